@@ -1262,9 +1262,11 @@ void AES_decrypt(const unsigned char *in, unsigned char *out,
 
 #endif /* AES_ASM */
 
-void AES_cbc_encrypt(const unsigned char *in, unsigned char *out,
-		     const unsigned long length, const AES_KEY *key,
-		     unsigned char *ivec, const int enc)
+static void aes_cbc_encrypt_generic(const unsigned char *in,
+				    unsigned char *out,
+				    const unsigned long length,
+				    const AES_KEY *key,
+				    unsigned char *ivec, const int enc)
 {
 
 	unsigned long n;
@@ -1312,3 +1314,197 @@ void AES_cbc_encrypt(const unsigned char *in, unsigned char *out,
 		}
 	}
 }
+
+/*
+ * Accelerated CBC implementations, selected at startup.  They use the round
+ * keys computed by AES_set_{en,de}crypt_key(): the decryption schedule is
+ * already in the "equivalent inverse cipher" form that AESDEC and AESD
+ * expect, only the words need to be put back in byte order.  Trailing
+ * partial blocks are left to the generic code.
+ */
+
+#ifdef CONFIG_AESNI_OPT
+#pragma GCC push_options
+#pragma GCC target("aes,ssse3")
+#include <cpuid.h>
+#include <wmmintrin.h>
+#include <tmmintrin.h>
+
+static void aes_cbc_encrypt_aesni(const unsigned char *in, unsigned char *out,
+                                  const unsigned long length,
+                                  const AES_KEY *key,
+                                  unsigned char *ivec, const int enc)
+{
+    const __m128i bswap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11,
+                                       4, 5, 6, 7, 0, 1, 2, 3);
+    __m128i rk[AES_MAXNR + 1];
+    __m128i iv, b0, b1, b2, b3, c0, c1, c2, c3;
+    unsigned long len = length;
+    int nr = key->rounds;
+    int i;
+
+    for (i = 0; i <= nr; i++) {
+        rk[i] = _mm_shuffle_epi8(
+            _mm_loadu_si128((const __m128i *)&key->rd_key[4 * i]), bswap);
+    }
+
+    iv = _mm_loadu_si128((const __m128i *)ivec);
+    if (enc) {
+        for (; len >= AES_BLOCK_SIZE; len -= AES_BLOCK_SIZE) {
+            b0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in), iv);
+            b0 = _mm_xor_si128(b0, rk[0]);
+            for (i = 1; i < nr; i++) {
+                b0 = _mm_aesenc_si128(b0, rk[i]);
+            }
+            iv = _mm_aesenclast_si128(b0, rk[nr]);
+            _mm_storeu_si128((__m128i *)out, iv);
+            in += AES_BLOCK_SIZE;
+            out += AES_BLOCK_SIZE;
+        }
+    } else {
+        /* CBC decryption has no chain dependency: keep four blocks in
+         * flight to hide the AESDEC latency.  */
+        for (; len >= 4 * AES_BLOCK_SIZE; len -= 4 * AES_BLOCK_SIZE) {
+            c0 = _mm_loadu_si128((const __m128i *)in);
+            c1 = _mm_loadu_si128((const __m128i *)in + 1);
+            c2 = _mm_loadu_si128((const __m128i *)in + 2);
+            c3 = _mm_loadu_si128((const __m128i *)in + 3);
+            b0 = _mm_xor_si128(c0, rk[0]);
+            b1 = _mm_xor_si128(c1, rk[0]);
+            b2 = _mm_xor_si128(c2, rk[0]);
+            b3 = _mm_xor_si128(c3, rk[0]);
+            for (i = 1; i < nr; i++) {
+                b0 = _mm_aesdec_si128(b0, rk[i]);
+                b1 = _mm_aesdec_si128(b1, rk[i]);
+                b2 = _mm_aesdec_si128(b2, rk[i]);
+                b3 = _mm_aesdec_si128(b3, rk[i]);
+            }
+            b0 = _mm_xor_si128(_mm_aesdeclast_si128(b0, rk[nr]), iv);
+            b1 = _mm_xor_si128(_mm_aesdeclast_si128(b1, rk[nr]), c0);
+            b2 = _mm_xor_si128(_mm_aesdeclast_si128(b2, rk[nr]), c1);
+            b3 = _mm_xor_si128(_mm_aesdeclast_si128(b3, rk[nr]), c2);
+            _mm_storeu_si128((__m128i *)out, b0);
+            _mm_storeu_si128((__m128i *)out + 1, b1);
+            _mm_storeu_si128((__m128i *)out + 2, b2);
+            _mm_storeu_si128((__m128i *)out + 3, b3);
+            iv = c3;
+            in += 4 * AES_BLOCK_SIZE;
+            out += 4 * AES_BLOCK_SIZE;
+        }
+        for (; len >= AES_BLOCK_SIZE; len -= AES_BLOCK_SIZE) {
+            c0 = _mm_loadu_si128((const __m128i *)in);
+            b0 = _mm_xor_si128(c0, rk[0]);
+            for (i = 1; i < nr; i++) {
+                b0 = _mm_aesdec_si128(b0, rk[i]);
+            }
+            b0 = _mm_xor_si128(_mm_aesdeclast_si128(b0, rk[nr]), iv);
+            _mm_storeu_si128((__m128i *)out, b0);
+            iv = c0;
+            in += AES_BLOCK_SIZE;
+            out += AES_BLOCK_SIZE;
+        }
+    }
+    _mm_storeu_si128((__m128i *)ivec, iv);
+
+    if (len) {
+        aes_cbc_encrypt_generic(in, out, len, key, ivec, enc);
+    }
+}
+#pragma GCC pop_options
+
+static bool aesni_usable(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (__get_cpuid_max(0, NULL) < 1) {
+        return false;
+    }
+    __cpuid(1, eax, ebx, ecx, edx);
+    return (ecx & bit_AES) && (ecx & bit_SSSE3);
+}
+#endif
+
+#ifdef CONFIG_ARM_AES_OPT
+#pragma GCC push_options
+#pragma GCC target("+crypto")
+#include <arm_neon.h>
+#include <sys/auxv.h>
+
+#ifndef HWCAP_AES
+#define HWCAP_AES (1 << 3)
+#endif
+
+static void aes_cbc_encrypt_armv8(const unsigned char *in, unsigned char *out,
+                                  const unsigned long length,
+                                  const AES_KEY *key,
+                                  unsigned char *ivec, const int enc)
+{
+    uint8x16_t rk[AES_MAXNR + 1];
+    uint8x16_t iv, b, c;
+    unsigned long len = length;
+    int nr = key->rounds;
+    int i;
+
+    for (i = 0; i <= nr; i++) {
+        rk[i] = vrev32q_u8(vld1q_u8((const uint8_t *)&key->rd_key[4 * i]));
+    }
+
+    iv = vld1q_u8(ivec);
+    for (; len >= AES_BLOCK_SIZE; len -= AES_BLOCK_SIZE) {
+        c = vld1q_u8(in);
+        if (enc) {
+            b = veorq_u8(c, iv);
+            for (i = 0; i < nr - 1; i++) {
+                b = vaesmcq_u8(vaeseq_u8(b, rk[i]));
+            }
+            iv = veorq_u8(vaeseq_u8(b, rk[nr - 1]), rk[nr]);
+            vst1q_u8(out, iv);
+        } else {
+            b = c;
+            for (i = 0; i < nr - 1; i++) {
+                b = vaesimcq_u8(vaesdq_u8(b, rk[i]));
+            }
+            b = veorq_u8(vaesdq_u8(b, rk[nr - 1]), rk[nr]);
+            vst1q_u8(out, veorq_u8(b, iv));
+            iv = c;
+        }
+        in += AES_BLOCK_SIZE;
+        out += AES_BLOCK_SIZE;
+    }
+    vst1q_u8(ivec, iv);
+
+    if (len) {
+        aes_cbc_encrypt_generic(in, out, len, key, ivec, enc);
+    }
+}
+#pragma GCC pop_options
+#endif
+
+static void (*aes_cbc_encrypt_accel)(const unsigned char *in,
+                                     unsigned char *out,
+                                     const unsigned long length,
+                                     const AES_KEY *key,
+                                     unsigned char *ivec, const int enc) =
+    aes_cbc_encrypt_generic;
+
+static void __attribute__((constructor)) aes_cbc_encrypt_init(void)
+{
+#ifdef CONFIG_AESNI_OPT
+    if (aesni_usable()) {
+        aes_cbc_encrypt_accel = aes_cbc_encrypt_aesni;
+    }
+#endif
+#ifdef CONFIG_ARM_AES_OPT
+    if (getauxval(AT_HWCAP) & HWCAP_AES) {
+        aes_cbc_encrypt_accel = aes_cbc_encrypt_armv8;
+    }
+#endif
+}
+
+void AES_cbc_encrypt(const unsigned char *in, unsigned char *out,
+                     const unsigned long length, const AES_KEY *key,
+                     unsigned char *ivec, const int enc)
+{
+    assert(in && out && key && ivec);
+    aes_cbc_encrypt_accel(in, out, length, key, ivec, enc);
+}
@@ -131,11 +131,12 @@ bool aio_pending(AioContext *ctx)
 
 bool aio_poll(AioContext *ctx, bool blocking)
 {
-    static struct timeval tv0;
+    struct timeval tv, *tvp;
     AioHandler *node;
     fd_set rdfds, wrfds;
     int max_fd = -1;
     int ret;
+    int64_t timeout;
     bool busy, progress;
 
     progress = false;
@@ -150,6 +151,12 @@ bool aio_poll(AioContext *ctx, bool blocking)
         progress = true;
     }
 
+    /* Expired timers count as progress too.  */
+    if (timerlistgroup_run_timers(ctx->tlg)) {
+        blocking = false;
+        progress = true;
+    }
+
     /*
      * Then dispatch any pending callbacks from the GSource.
      *
@@ -226,8 +233,17 @@ bool aio_poll(AioContext *ctx, bool blocking)
         return progress;
     }
 
-    /* wait until next event */
-    ret = select(max_fd, &rdfds, &wrfds, NULL, blocking ? NULL : &tv0);
+    /* wait until next event, or until the first timer expires */
+    timeout = blocking ? timerlistgroup_deadline_ns(ctx->tlg) : 0;
+    tvp = NULL;
+    if (timeout >= 0) {
+        /* round up, so that the timer has expired on wakeup */
+        timeout = (timeout + SCALE_US - 1) / SCALE_US;
+        tv.tv_sec = timeout / 1000000;
+        tv.tv_usec = timeout % 1000000;
+        tvp = &tv;
+    }
+    ret = select(max_fd, &rdfds, &wrfds, NULL, tvp);
 
     /* if we have any readable fds, dispatch event */
     if (ret > 0) {
@@ -264,5 +280,9 @@ bool aio_poll(AioContext *ctx, bool blocking)
         }
     }
 
+    if (timerlistgroup_run_timers(ctx->tlg)) {
+        progress = true;
+    }
+
     return progress;
 }
@@ -111,6 +111,12 @@ bool aio_poll(AioContext *ctx, bool blocking)
         progress = true;
     }
 
+    /* Expired timers count as progress too.  */
+    if (timerlistgroup_run_timers(ctx->tlg)) {
+        blocking = false;
+        progress = true;
+    }
+
     /*
      * Then dispatch any pending callbacks from the GSource.
      *
@@ -174,8 +180,10 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     /* wait until next event */
     while (count > 0) {
-        int timeout = blocking ? INFINITE : 0;
-        int ret = WaitForMultipleObjects(count, events, FALSE, timeout);
+        int timeout = blocking ?
+            qemu_timeout_ns_to_ms(timerlistgroup_deadline_ns(ctx->tlg)) : 0;
+        int ret = WaitForMultipleObjects(count, events, FALSE,
+                                         timeout < 0 ? INFINITE : timeout);
 
         /* if we have any signaled events, dispatch event */
         if ((DWORD) (ret - WAIT_OBJECT_0) >= count) {
@@ -214,5 +222,9 @@ bool aio_poll(AioContext *ctx, bool blocking)
         events[ret - WAIT_OBJECT_0] = events[--count];
     }
 
+    if (timerlistgroup_run_timers(ctx->tlg)) {
+        progress = true;
+    }
+
     return progress;
 }
@@ -28,9 +28,11 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #endif
+#include <zlib.h>
 #include "config.h"
 #include "monitor.h"
 #include "sysemu.h"
+#include "cpus.h"
 #include "bitops.h"
 #include "bitmap.h"
 #include "arch_init.h"
@@ -46,6 +48,7 @@
 #include "exec-memory.h"
 #include "hw/pcspk.h"
 #include "qemu/page_cache.h"
+#include "qemu-thread.h"
 #include "qmp-commands.h"
 #include "trace.h"
 
@@ -112,6 +115,15 @@ const uint32_t arch_type = QEMU_ARCH;
 #define RAM_SAVE_FLAG_EOS      0x10
 #define RAM_SAVE_FLAG_CONTINUE 0x20
 #define RAM_SAVE_FLAG_XBZRLE   0x40
+#define RAM_SAVE_FLAG_POSTCOPY_ADVISE 0x80
+#define RAM_SAVE_FLAG_POSTCOPY 0x100
+#define RAM_SAVE_FLAG_COMPRESS_PAGE 0x200
+/* a run of zero pages, followed by the number of pages; there are no
+   free flag bits left with 1K target pages, so reuse an impossible pair */
+#define RAM_SAVE_FLAG_ZERO_RANGE (RAM_SAVE_FLAG_COMPRESS | RAM_SAVE_FLAG_PAGE)
+
+/* longest run of zero pages sent as one record */
+#define ZERO_RANGE_MAX_PAGES 1024
 
 #ifdef __ALTIVEC__
 #include <altivec.h>
@@ -166,9 +178,15 @@ int qemu_read_default_config_files(bool userconfig)
 static int is_dup_page(uint8_t *page)
 {
     VECTYPE *p = (VECTYPE *)page;
-    VECTYPE val = SPLAT(page);
+    VECTYPE val;
     int i;
 
+    /* by far the most common case */
+    if (*page == 0) {
+        return buffer_is_zero(page, TARGET_PAGE_SIZE);
+    }
+
+    val = SPLAT(page);
     for (i = 0; i < TARGET_PAGE_SIZE / sizeof(VECTYPE); i++) {
         if (!ALL_EQ(val, p[i])) {
             return 0;
@@ -214,7 +232,11 @@ typedef struct AccountingInfo {
     uint64_t xbzrle_bytes;
     uint64_t xbzrle_pages;
     uint64_t xbzrle_cache_miss;
+    uint64_t xbzrle_cache_hits;
     uint64_t xbzrle_overflows;
+    uint64_t compress_pages;
+    uint64_t compress_bytes;
+    uint64_t compress_busy;
 } AccountingInfo;
 
 static AccountingInfo acct_info;
@@ -244,6 +266,30 @@ uint64_t norm_mig_pages_transferred(void)
     return acct_info.norm_pages;
 }
 
+uint64_t compress_mig_pages_transferred(void)
+{
+    return acct_info.compress_pages;
+}
+
+uint64_t compress_mig_bytes_transferred(void)
+{
+    return acct_info.compress_bytes;
+}
+
+uint64_t compress_mig_busy(void)
+{
+    return acct_info.compress_busy;
+}
+
+double compress_mig_rate(void)
+{
+    if (!acct_info.compress_bytes) {
+        return 0;
+    }
+    return (double)(acct_info.compress_pages * TARGET_PAGE_SIZE) /
+           acct_info.compress_bytes;
+}
+
 uint64_t xbzrle_mig_bytes_transferred(void)
 {
     return acct_info.xbzrle_bytes;
@@ -259,6 +305,11 @@ uint64_t xbzrle_mig_pages_cache_miss(void)
     return acct_info.xbzrle_cache_miss;
 }
 
+uint64_t xbzrle_mig_pages_cache_hit(void)
+{
+    return acct_info.xbzrle_cache_hits;
+}
+
 uint64_t xbzrle_mig_pages_overflow(void)
 {
     return acct_info.xbzrle_overflows;
@@ -293,6 +344,7 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t *current_data,
         acct_info.xbzrle_cache_miss++;
         return -1;
     }
+    acct_info.xbzrle_cache_hits++;
 
     prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
 
@@ -333,9 +385,22 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t *current_data,
 
 static RAMBlock *last_block;
 static ram_addr_t last_offset;
+static RAMBlock *last_sent_block;
 static unsigned long *migration_bitmap;
 static uint64_t migration_dirty_pages;
 
+/* Set once the destination runs the guest; see ram_save_postcopy() */
+static bool ram_postcopy;
+
+typedef struct RAMPageRequest {
+    RAMBlock *block;
+    ram_addr_t offset;
+    QSIMPLEQ_ENTRY(RAMPageRequest) next;
+} RAMPageRequest;
+
+static QSIMPLEQ_HEAD(, RAMPageRequest) ram_page_requests =
+    QSIMPLEQ_HEAD_INITIALIZER(ram_page_requests);
+
 static inline bool migration_bitmap_test_and_reset_dirty(MemoryRegion *mr,
                                                          ram_addr_t offset)
 {
@@ -364,10 +429,29 @@ static inline bool migration_bitmap_set_dirty(MemoryRegion *mr,
     return ret;
 }
 
+/* auto-converge: start throttling at this level, then step it up */
+#define THROTTLE_PCT_INITIAL    20
+#define THROTTLE_PCT_INCREMENT  10
+
+static int dirty_rate_high_cnt;
+static uint64_t bytes_xfer_prev;
+
+static void mig_throttle_guest_down(void)
+{
+    int pct;
+
+    if (!cpu_throttle_active()) {
+        pct = THROTTLE_PCT_INITIAL;
+    } else {
+        pct = cpu_throttle_get_percentage() + THROTTLE_PCT_INCREMENT;
+    }
+    trace_mig_throttle_guest_down(pct);
+    cpu_throttle_set(pct);
+}
+
 static void migration_bitmap_sync(void)
 {
     RAMBlock *block;
-    ram_addr_t addr;
     uint64_t num_dirty_pages_init = migration_dirty_pages;
     MigrationState *s = migrate_get_current();
     static int64_t start_time;
@@ -382,22 +466,34 @@ static void migration_bitmap_sync(void)
     memory_global_sync_dirty_bitmap(get_system_memory());
 
     QLIST_FOREACH(block, &ram_list.blocks, next) {
-        for (addr = 0; addr < block->length; addr += TARGET_PAGE_SIZE) {
-            if (memory_region_get_dirty(block->mr, addr, TARGET_PAGE_SIZE,
-                                        DIRTY_MEMORY_MIGRATION)) {
-                migration_bitmap_set_dirty(block->mr, addr);
-            }
-        }
-        memory_region_reset_dirty(block->mr, 0, block->length,
-                                  DIRTY_MEMORY_MIGRATION);
+        migration_dirty_pages +=
+            memory_region_move_dirty(block->mr, 0, block->length,
+                                     DIRTY_MEMORY_MIGRATION, migration_bitmap);
     }
     trace_migration_bitmap_sync_end(migration_dirty_pages
                                     - num_dirty_pages_init);
+    s->dirty_sync_count++;
+    migration_update_estimates(s, (migration_dirty_pages - num_dirty_pages_init)
+                                  * TARGET_PAGE_SIZE);
     num_dirty_pages_period += migration_dirty_pages - num_dirty_pages_init;
     end_time = qemu_get_clock_ms(rt_clock);
 
     /* more than 1 second = 1000 millisecons */
     if (end_time > start_time + 1000) {
+        if (migrate_auto_converge()) {
+            uint64_t bytes_xfer_now = ram_bytes_transferred();
+
+            /* The guest dirtied more than half of what we managed to send
+             * in this period; if that keeps happening, slow it down.
+             */
+            if (num_dirty_pages_period * TARGET_PAGE_SIZE >
+                (bytes_xfer_now - bytes_xfer_prev) / 2 &&
+                dirty_rate_high_cnt++ >= 2) {
+                dirty_rate_high_cnt = 0;
+                mig_throttle_guest_down();
+            }
+            bytes_xfer_prev = bytes_xfer_now;
+        }
         s->dirty_pages_rate = num_dirty_pages_period * 1000
             / (end_time - start_time);
         start_time = end_time;
@@ -406,6 +502,314 @@ static void migration_bitmap_sync(void)
 }
 
 
+/*
+ * ram_save_page: Writes the page at offset in block to the stream f
+ *
+ * Returns:  0: if the page hasn't changed (XBZRLE)
+ *           n: the amount of bytes written in other case
+ */
+
+/*
+ * Extend a zero page at offset to the following pages of the block that
+ * are dirty and zero too, and send them as one record.
+ */
+static int ram_save_zero_range(QEMUFile *f, RAMBlock *block,
+                               ram_addr_t offset, int cont)
+{
+    uint8_t *host = memory_region_get_ram_ptr(block->mr);
+    ram_addr_t next = offset + TARGET_PAGE_SIZE;
+    uint32_t pages = 1;
+    int nr;
+
+    while (pages < ZERO_RANGE_MAX_PAGES && next < block->length) {
+        nr = (block->mr->ram_addr + next) >> TARGET_PAGE_BITS;
+        if (!test_bit(nr, migration_bitmap) ||
+            !buffer_is_zero(host + next, TARGET_PAGE_SIZE)) {
+            break;
+        }
+        migration_bitmap_test_and_reset_dirty(block->mr, next);
+        next += TARGET_PAGE_SIZE;
+        pages++;
+    }
+
+    /* ram_save_block() skips the rest of the run, it is clean now */
+    acct_info.dup_pages += pages;
+    save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_ZERO_RANGE);
+    qemu_put_be32(f, pages);
+    return 4;
+}
+
+static int ram_save_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                         bool last_stage)
+{
+    int bytes_sent = -1;
+    int cont = (block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+    ram_addr_t current_addr;
+    bool send_async = true;
+    uint8_t *p;
+
+    p = memory_region_get_ram_ptr(block->mr) + offset;
+
+    if (is_dup_page(p)) {
+        if (*p == 0 && migrate_use_zero_ranges() && !ram_postcopy) {
+            bytes_sent = ram_save_zero_range(f, block, offset, cont);
+        } else {
+            acct_info.dup_pages++;
+            save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_COMPRESS);
+            qemu_put_byte(f, *p);
+            bytes_sent = 1;
+        }
+    } else if (migrate_use_xbzrle() && !ram_postcopy) {
+        /* the destination discarded its copy in postcopy, no delta base */
+        current_addr = block->offset + offset;
+        bytes_sent = save_xbzrle_page(f, p, current_addr, block,
+                                      offset, cont, last_stage);
+        if (!last_stage) {
+            /* the cache entry can be evicted before it is sent */
+            p = get_cached_data(XBZRLE.cache, current_addr);
+            send_async = false;
+        }
+    }
+
+    /* A transport with its own RAM path (RDMA) can only take guest
+     * memory, not a copy from the XBZRLE cache.  It writes nothing to the
+     * stream, so last_sent_block stays as it is.
+     */
+    if (bytes_sent == -1 && send_async) {
+        int ret = ram_control_save_page(f, block->offset, offset,
+                                        TARGET_PAGE_SIZE);
+        if (ret != -ENOTSUP) {
+            if (ret > 0) {
+                acct_info.norm_pages++;
+            }
+            /* errors are recorded in f and stop the save loop */
+            return MAX(ret, 0);
+        }
+    }
+
+    /* either we didn't send yet (we may have had XBZRLE overflow) */
+    if (bytes_sent == -1) {
+        save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
+        /* Guest RAM is sent without copying it.  A page that changes
+         * before it goes out is dirty again and will be resent.
+         */
+        if (send_async) {
+            qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
+        } else {
+            qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+        }
+        bytes_sent = TARGET_PAGE_SIZE;
+        acct_info.norm_pages++;
+    }
+
+    if (bytes_sent > 0) {
+        last_sent_block = block;
+    }
+    return bytes_sent;
+}
+
+/*
+ * Multi-threaded page compression.  Each worker compresses one page at a
+ * time into its own buffer; the migration thread writes the result out
+ * once the worker is done, so block headers (RAM_SAVE_FLAG_CONTINUE)
+ * are generated in stream order.  A page can change while it is being
+ * compressed: it is dirty again then and will be resent.
+ */
+typedef struct CompressParam {
+    QemuThread thread;
+    QemuMutex mutex;
+    QemuCond cond;
+    bool start;
+    bool quit;
+    uint8_t *src;
+    RAMBlock *block;
+    ram_addr_t offset;
+    uint8_t *buf;
+    unsigned long len;
+    int ret;
+} CompressParam;
+
+static CompressParam *comp_param;
+static int comp_thread_count;
+static QemuMutex comp_done_lock;
+static QemuCond comp_done_cond;
+/* protected by comp_done_lock; a worker is idle when it's not busy */
+static bool *comp_busy;
+
+static void *do_data_compress(void *opaque)
+{
+    CompressParam *param = opaque;
+    int level = migrate_compress_level();
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (!param->start) {
+            qemu_cond_wait(&param->cond, &param->mutex);
+            continue;
+        }
+        param->start = false;
+        qemu_mutex_unlock(&param->mutex);
+
+        param->len = compressBound(TARGET_PAGE_SIZE);
+        param->ret = compress2(param->buf, &param->len, param->src,
+                               TARGET_PAGE_SIZE, level);
+
+        qemu_mutex_lock(&comp_done_lock);
+        comp_busy[param - comp_param] = false;
+        qemu_cond_signal(&comp_done_cond);
+        qemu_mutex_unlock(&comp_done_lock);
+
+        qemu_mutex_lock(&param->mutex);
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    return NULL;
+}
+
+static void migrate_compress_threads_create(void)
+{
+    int i;
+
+    comp_thread_count = migrate_compress_threads();
+    comp_param = g_new0(CompressParam, comp_thread_count);
+    comp_busy = g_new0(bool, comp_thread_count);
+    qemu_mutex_init(&comp_done_lock);
+    qemu_cond_init(&comp_done_cond);
+    for (i = 0; i < comp_thread_count; i++) {
+        CompressParam *param = &comp_param[i];
+
+        param->buf = g_malloc(compressBound(TARGET_PAGE_SIZE));
+        qemu_mutex_init(&param->mutex);
+        qemu_cond_init(&param->cond);
+        qemu_thread_create(&param->thread, do_data_compress, param,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void migrate_compress_threads_join(void)
+{
+    int i;
+
+    if (!comp_param) {
+        return;
+    }
+    for (i = 0; i < comp_thread_count; i++) {
+        CompressParam *param = &comp_param[i];
+
+        qemu_mutex_lock(&param->mutex);
+        param->quit = true;
+        qemu_cond_signal(&param->cond);
+        qemu_mutex_unlock(&param->mutex);
+        qemu_thread_join(&param->thread);
+        qemu_mutex_destroy(&param->mutex);
+        qemu_cond_destroy(&param->cond);
+        g_free(param->buf);
+    }
+    qemu_mutex_destroy(&comp_done_lock);
+    qemu_cond_destroy(&comp_done_cond);
+    g_free(comp_param);
+    g_free(comp_busy);
+    comp_param = NULL;
+    comp_busy = NULL;
+}
+
+/* Called with comp_done_lock held and the worker idle */
+static int flush_compressed_page(QEMUFile *f, CompressParam *param)
+{
+    int cont;
+
+    if (!param->block) {
+        return 0;
+    }
+    if (param->ret != Z_OK) {
+        /* try again on the next pass */
+        DPRINTF("Page compression failed: %d\n", param->ret);
+        migration_bitmap_set_dirty(param->block->mr, param->offset);
+        param->block = NULL;
+        return 0;
+    }
+
+    cont = (param->block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+    save_block_hdr(f, param->block, param->offset, cont,
+                   RAM_SAVE_FLAG_COMPRESS_PAGE);
+    qemu_put_be32(f, param->len);
+    qemu_put_buffer(f, param->buf, param->len);
+    last_sent_block = param->block;
+    param->block = NULL;
+
+    acct_info.compress_pages++;
+    acct_info.compress_bytes += param->len + 4;
+    return param->len + 4;
+}
+
+/* Wait for all compression workers and write out their pages */
+static int flush_compressed_data(QEMUFile *f)
+{
+    int bytes_sent = 0;
+    int i;
+
+    if (!comp_param) {
+        return 0;
+    }
+    qemu_mutex_lock(&comp_done_lock);
+    for (i = 0; i < comp_thread_count; i++) {
+        while (comp_busy[i]) {
+            qemu_cond_wait(&comp_done_cond, &comp_done_lock);
+        }
+        bytes_sent += flush_compressed_page(f, &comp_param[i]);
+    }
+    qemu_mutex_unlock(&comp_done_lock);
+    return bytes_sent;
+}
+
+static int ram_save_compressed_page(QEMUFile *f, RAMBlock *block,
+                                    ram_addr_t offset)
+{
+    uint8_t *p = memory_region_get_ram_ptr(block->mr) + offset;
+    int bytes_sent = 0;
+    int i;
+
+    if (is_dup_page(p)) {
+        return ram_save_page(f, block, offset, false);
+    }
+
+    qemu_mutex_lock(&comp_done_lock);
+    for (;;) {
+        for (i = 0; i < comp_thread_count; i++) {
+            if (!comp_busy[i]) {
+                break;
+            }
+        }
+        if (i < comp_thread_count) {
+            break;
+        }
+        acct_info.compress_busy++;
+        qemu_cond_wait(&comp_done_cond, &comp_done_lock);
+    }
+    bytes_sent = flush_compressed_page(f, &comp_param[i]);
+    comp_busy[i] = true;
+    qemu_mutex_unlock(&comp_done_lock);
+
+    qemu_mutex_lock(&comp_param[i].mutex);
+    comp_param[i].src = p;
+    comp_param[i].block = block;
+    comp_param[i].offset = offset;
+    comp_param[i].start = true;
+    qemu_cond_signal(&comp_param[i].cond);
+    qemu_mutex_unlock(&comp_param[i].mutex);
+
+    return bytes_sent;
+}
+
+static bool ram_use_compression(void)
+{
+    /* XBZRLE keeps its own cache of sent pages, it wins when both are on;
+     * so does a transport that moves RAM itself.
+     */
+    return comp_param && !ram_postcopy && !migrate_use_xbzrle() &&
+           !migrate_transport_saves_ram();
+}
+
 /*
  * ram_save_block: Writes a page of memory to the stream f
  *
@@ -420,7 +824,6 @@ static int ram_save_block(QEMUFile *f, bool last_stage)
     ram_addr_t offset = last_offset;
     int bytes_sent = -1;
     MemoryRegion *mr;
-    ram_addr_t current_addr;
 
     if (!block)
         block = QLIST_FIRST(&ram_list.blocks);
@@ -428,32 +831,12 @@ static int ram_save_block(QEMUFile *f, bool last_stage)
     do {
         mr = block->mr;
         if (migration_bitmap_test_and_reset_dirty(mr, offset)) {
-            uint8_t *p;
-            int cont = (block == last_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
-
-            p = memory_region_get_ram_ptr(mr) + offset;
-
-            if (is_dup_page(p)) {
-                acct_info.dup_pages++;
-                save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_COMPRESS);
-                qemu_put_byte(f, *p);
-                bytes_sent = 1;
-            } else if (migrate_use_xbzrle()) {
-                current_addr = block->offset + offset;
-                bytes_sent = save_xbzrle_page(f, p, current_addr, block,
-                                              offset, cont, last_stage);
-                if (!last_stage) {
-                    p = get_cached_data(XBZRLE.cache, current_addr);
-                }
-            }
-
-            /* either we didn't send yet (we may have had XBZRLE overflow) */
-            if (bytes_sent == -1) {
-                save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
-                qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
-                bytes_sent = TARGET_PAGE_SIZE;
-                acct_info.norm_pages++;
+            if (ram_use_compression()) {
+                /* the page is accounted for once it was handed out */
+                bytes_sent = ram_save_compressed_page(f, block, offset);
+                break;
             }
+            bytes_sent = ram_save_page(f, block, offset, last_stage);
 
             /* if page is unmodified, continue to the next */
             if (bytes_sent != 0) {
@@ -493,6 +876,23 @@ uint64_t ram_bytes_transferred(void)
     return bytes_transferred;
 }
 
+/* The guest reported [offset, offset + length) of @mr as free, so its
+ * contents need not reach the destination until the guest writes it again.
+ */
+void ram_discard_free_range(MemoryRegion *mr, uint64_t offset,
+                            uint64_t length)
+{
+    uint64_t end = offset + length;
+
+    if (!migration_bitmap) {
+        return;
+    }
+    memory_region_reset_dirty(mr, offset, length, DIRTY_MEMORY_MIGRATION);
+    for (; offset < end; offset += TARGET_PAGE_SIZE) {
+        migration_bitmap_test_and_reset_dirty(mr, offset);
+    }
+}
+
 uint64_t ram_bytes_total(void)
 {
     RAMBlock *block;
@@ -533,9 +933,22 @@ static void sort_ram_list(void)
     g_free(blocks);
 }
 
+static void ram_postcopy_flush_requests(void)
+{
+    RAMPageRequest *req;
+
+    while ((req = QSIMPLEQ_FIRST(&ram_page_requests)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&ram_page_requests, next);
+        g_free(req);
+    }
+}
+
 static void migration_end(void)
 {
     memory_global_dirty_log_stop();
+    migrate_compress_threads_join();
+    ram_postcopy = false;
+    ram_postcopy_flush_requests();
 
     if (migrate_use_xbzrle()) {
         cache_fini(XBZRLE.cache);
@@ -557,10 +970,12 @@ static void reset_ram_globals(void)
 {
     last_block = NULL;
     last_offset = 0;
+    last_sent_block = NULL;
+    ram_postcopy = false;
     sort_ram_list();
 }
 
-#define MAX_WAIT 50 /* ms, half buffered_file limit */
+#define MAX_WAIT 50 /* ms, half the migration thread's rate limit window */
 
 static int ram_save_setup(QEMUFile *f, void *opaque)
 {
@@ -572,6 +987,8 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     migration_dirty_pages = ram_pages;
 
     bytes_transferred = 0;
+    bytes_xfer_prev = 0;
+    dirty_rate_high_cnt = 0;
     reset_ram_globals();
 
     if (migrate_use_xbzrle()) {
@@ -587,6 +1004,13 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         acct_clear();
     }
 
+    if (migrate_use_compression()) {
+        if (!migrate_use_xbzrle()) {
+            acct_clear();
+        }
+        migrate_compress_threads_create();
+    }
+
     memory_global_dirty_log_start();
     migration_bitmap_sync();
 
@@ -598,11 +1022,130 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         qemu_put_be64(f, block->length);
     }
 
+    /* lets the destination fail early if it cannot do postcopy */
+    if (migrate_use_postcopy()) {
+        qemu_put_be64(f, RAM_SAVE_FLAG_POSTCOPY_ADVISE);
+    }
+
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
 
     return 0;
 }
 
+/* Called from the return channel handler when the destination faults */
+void ram_postcopy_request_page(const char *idstr, uint64_t offset)
+{
+    RAMPageRequest *req;
+    RAMBlock *block;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (!strcmp(block->idstr, idstr)) {
+            break;
+        }
+    }
+    if (!block || offset >= block->length) {
+        DPRINTF("postcopy: bad page request %s %" PRIx64 "\n", idstr, offset);
+        return;
+    }
+
+    trace_ram_postcopy_request_page(idstr, offset);
+    req = g_malloc(sizeof(*req));
+    req->block = block;
+    req->offset = offset & TARGET_PAGE_MASK;
+    QSIMPLEQ_INSERT_TAIL(&ram_page_requests, req, next);
+}
+
+static void ram_postcopy_send_requested(QEMUFile *f)
+{
+    RAMPageRequest *req;
+
+    while ((req = QSIMPLEQ_FIRST(&ram_page_requests)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&ram_page_requests, next);
+        /* not dirty any more: the page is already on its way */
+        if (migration_bitmap_test_and_reset_dirty(req->block->mr,
+                                                  req->offset)) {
+            bytes_transferred += ram_save_page(f, req->block, req->offset,
+                                               false);
+        }
+        g_free(req);
+    }
+}
+
+static int ram_save_iterate_postcopy(QEMUFile *f)
+{
+    int ret;
+
+    /* pages the guest is waiting for go out first, bypassing the limit */
+    ram_postcopy_send_requested(f);
+
+    while ((ret = qemu_file_rate_limit(f)) == 0) {
+        int bytes_sent;
+
+        bytes_sent = ram_save_block(f, false);
+        if (bytes_sent < 0) {
+            break;
+        }
+        bytes_transferred += bytes_sent;
+    }
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+    qemu_fflush(f);
+
+    return ram_save_remaining() == 0;
+}
+
+/*
+ * Switch-over to postcopy, with the guest stopped: tell the destination
+ * which pages are still dirty, so that it can drop its stale copies and
+ * fault them in on access instead.
+ */
+static int ram_save_postcopy(QEMUFile *f, void *opaque)
+{
+    RAMBlock *block;
+
+    migration_bitmap_sync();
+    ram_postcopy = true;
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_POSTCOPY);
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        unsigned long first = block->offset >> TARGET_PAGE_BITS;
+        unsigned long last = first + (block->length >> TARGET_PAGE_BITS);
+        unsigned long start, end;
+        uint32_t nruns = 0;
+
+        for (start = find_next_bit(migration_bitmap, last, first);
+             start < last;
+             start = find_next_bit(migration_bitmap, last, end)) {
+            end = find_next_zero_bit(migration_bitmap, last, start);
+            nruns++;
+        }
+        if (!nruns) {
+            continue;
+        }
+
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        qemu_put_be32(f, nruns);
+        for (start = find_next_bit(migration_bitmap, last, first);
+             start < last;
+             start = find_next_bit(migration_bitmap, last, end)) {
+            end = find_next_zero_bit(migration_bitmap, last, start);
+            qemu_put_be64(f, (ram_addr_t)(start - first) << TARGET_PAGE_BITS);
+            qemu_put_be64(f, (ram_addr_t)(end - start) << TARGET_PAGE_BITS);
+        }
+    }
+    qemu_put_byte(f, 0);
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+
+    return qemu_file_get_error(f);
+}
+
 static int ram_save_iterate(QEMUFile *f, void *opaque)
 {
     uint64_t bytes_transferred_last;
@@ -612,6 +1155,12 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     uint64_t expected_downtime;
     MigrationState *s = migrate_get_current();
 
+    if (ram_postcopy) {
+        return ram_save_iterate_postcopy(f);
+    }
+
+    ram_control_before_iterate(f, RAM_CONTROL_ROUND);
+
     bytes_transferred_last = bytes_transferred;
     bwidth = qemu_get_clock_ns(rt_clock);
 
@@ -646,9 +1195,19 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         return ret;
     }
 
+    bytes_transferred += flush_compressed_data(f);
+
     bwidth = qemu_get_clock_ns(rt_clock) - bwidth;
     bwidth = (bytes_transferred - bytes_transferred_last) / bwidth;
 
+    /* The migration thread measures what actually went out on the wire,
+     * which is a better estimate than how fast we filled the buffer.
+     * s->bandwidth is in bytes/ms, bwidth in bytes/ns.
+     */
+    if (s->bandwidth > 0) {
+        bwidth = s->bandwidth / 1000000;
+    }
+
     /* if we haven't transferred anything this round, force
      * expected_downtime to a very high value, but without
      * crashing */
@@ -656,6 +1215,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         bwidth = 0.000001;
     }
 
+    ram_control_after_iterate(f, RAM_CONTROL_ROUND);
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
 
     expected_downtime = ram_save_remaining() * TARGET_PAGE_SIZE / bwidth;
@@ -665,7 +1225,6 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     if (expected_downtime <= migrate_max_downtime()) {
         migration_bitmap_sync();
         expected_downtime = ram_save_remaining() * TARGET_PAGE_SIZE / bwidth;
-        s->expected_downtime = expected_downtime / 1000000; /* ns -> ms */
 
         return expected_downtime <= migrate_max_downtime();
     }
@@ -674,6 +1233,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
 
 static int ram_save_complete(QEMUFile *f, void *opaque)
 {
+    ram_control_before_iterate(f, RAM_CONTROL_FINISH);
     migration_bitmap_sync();
 
     /* try transferring iterative blocks of memory */
@@ -689,8 +1249,13 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
         }
         bytes_transferred += bytes_sent;
     }
+    bytes_transferred += flush_compressed_data(f);
+    migrate_compress_threads_join();
     memory_global_dirty_log_stop();
+    ram_postcopy = false;
+    ram_postcopy_flush_requests();
 
+    ram_control_after_iterate(f, RAM_CONTROL_FINISH);
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
 
     g_free(migration_bitmap);
@@ -770,6 +1335,290 @@ static inline void *host_from_stream_offset(QEMUFile *f,
     return NULL;
 }
 
+/*
+ * Parallel decompression: the stream is read by the caller, workers only
+ * inflate into guest RAM.  All workers are drained at the end of each
+ * section so that a page resent in a later pass can't be overwritten by
+ * an older copy.
+ */
+typedef struct DecompressParam {
+    QemuThread thread;
+    QemuMutex mutex;
+    QemuCond cond;
+    bool start;
+    bool quit;
+    uint8_t *des;
+    uint8_t *compbuf;
+    int len;
+} DecompressParam;
+
+static DecompressParam *decomp_param;
+static int decomp_thread_count;
+static QemuMutex decomp_done_lock;
+static QemuCond decomp_done_cond;
+/* protected by decomp_done_lock */
+static bool *decomp_busy;
+static bool decomp_failed;
+
+static void *do_data_decompress(void *opaque)
+{
+    DecompressParam *param = opaque;
+    unsigned long pagesize;
+    int ret;
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (!param->start) {
+            qemu_cond_wait(&param->cond, &param->mutex);
+            continue;
+        }
+        param->start = false;
+        qemu_mutex_unlock(&param->mutex);
+
+        pagesize = TARGET_PAGE_SIZE;
+        ret = uncompress(param->des, &pagesize, param->compbuf, param->len);
+
+        qemu_mutex_lock(&decomp_done_lock);
+        if (ret != Z_OK || pagesize != TARGET_PAGE_SIZE) {
+            decomp_failed = true;
+        }
+        decomp_busy[param - decomp_param] = false;
+        qemu_cond_signal(&decomp_done_cond);
+        qemu_mutex_unlock(&decomp_done_lock);
+
+        qemu_mutex_lock(&param->mutex);
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    return NULL;
+}
+
+static void migrate_decompress_threads_create(void)
+{
+    int i;
+
+    decomp_thread_count = migrate_decompress_threads();
+    decomp_param = g_new0(DecompressParam, decomp_thread_count);
+    decomp_busy = g_new0(bool, decomp_thread_count);
+    decomp_failed = false;
+    qemu_mutex_init(&decomp_done_lock);
+    qemu_cond_init(&decomp_done_cond);
+    for (i = 0; i < decomp_thread_count; i++) {
+        DecompressParam *param = &decomp_param[i];
+
+        param->compbuf = g_malloc(compressBound(TARGET_PAGE_SIZE));
+        qemu_mutex_init(&param->mutex);
+        qemu_cond_init(&param->cond);
+        qemu_thread_create(&param->thread, do_data_decompress, param,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+void migrate_decompress_threads_join(void)
+{
+    int i;
+
+    if (!decomp_param) {
+        return;
+    }
+    for (i = 0; i < decomp_thread_count; i++) {
+        DecompressParam *param = &decomp_param[i];
+
+        qemu_mutex_lock(&param->mutex);
+        param->quit = true;
+        qemu_cond_signal(&param->cond);
+        qemu_mutex_unlock(&param->mutex);
+        qemu_thread_join(&param->thread);
+        qemu_mutex_destroy(&param->mutex);
+        qemu_cond_destroy(&param->cond);
+        g_free(param->compbuf);
+    }
+    qemu_mutex_destroy(&decomp_done_lock);
+    qemu_cond_destroy(&decomp_done_cond);
+    g_free(decomp_param);
+    g_free(decomp_busy);
+    decomp_param = NULL;
+    decomp_busy = NULL;
+}
+
+static int load_compressed_page(QEMUFile *f, void *host)
+{
+    int len = qemu_get_be32(f);
+    int i;
+
+    if (len < 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+        fprintf(stderr, "Invalid compressed page length %d\n", len);
+        return -EINVAL;
+    }
+    if (!decomp_param) {
+        migrate_decompress_threads_create();
+    }
+
+    qemu_mutex_lock(&decomp_done_lock);
+    for (;;) {
+        for (i = 0; i < decomp_thread_count; i++) {
+            if (!decomp_busy[i]) {
+                break;
+            }
+        }
+        if (i < decomp_thread_count) {
+            break;
+        }
+        qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+    }
+    decomp_busy[i] = true;
+    qemu_mutex_unlock(&decomp_done_lock);
+
+    qemu_get_buffer(f, decomp_param[i].compbuf, len);
+    qemu_mutex_lock(&decomp_param[i].mutex);
+    decomp_param[i].des = host;
+    decomp_param[i].len = len;
+    decomp_param[i].start = true;
+    qemu_cond_signal(&decomp_param[i].cond);
+    qemu_mutex_unlock(&decomp_param[i].mutex);
+    return 0;
+}
+
+static int wait_for_decompress_done(void)
+{
+    int ret = 0;
+    int i;
+
+    if (!decomp_param) {
+        return 0;
+    }
+    qemu_mutex_lock(&decomp_done_lock);
+    for (i = 0; i < decomp_thread_count; i++) {
+        while (decomp_busy[i]) {
+            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+        }
+    }
+    if (decomp_failed) {
+        fprintf(stderr, "Failed to decompress page\n");
+        ret = -EINVAL;
+    }
+    qemu_mutex_unlock(&decomp_done_lock);
+    return ret;
+}
+
+/*
+ * Once postcopy runs the pages are loaded from the listen thread:
+ * ram_list must not be touched, use the block table that was handed to
+ * migration-postcopy.c instead.
+ */
+static void *host_from_stream_offset_postcopy(QEMUFile *f,
+                                              ram_addr_t offset,
+                                              int flags)
+{
+    static char id[256];
+    uint8_t len;
+
+    if (!(flags & RAM_SAVE_FLAG_CONTINUE)) {
+        len = qemu_get_byte(f);
+        qemu_get_buffer(f, (uint8_t *)id, len);
+        id[len] = 0;
+    }
+
+    return postcopy_host_from_idstr(id, offset);
+}
+
+/* Drop the stale copies of the pages that are still dirty on the source */
+static int ram_load_postcopy_discard(QEMUFile *f)
+{
+    RAMBlock *block;
+    char id[256];
+    uint8_t len;
+
+    while ((len = qemu_get_byte(f)) != 0) {
+        uint32_t nruns;
+
+        qemu_get_buffer(f, (uint8_t *)id, len);
+        id[len] = 0;
+        QLIST_FOREACH(block, &ram_list.blocks, next) {
+            if (!strncmp(id, block->idstr, sizeof(id))) {
+                break;
+            }
+        }
+        if (!block) {
+            fprintf(stderr, "Can't find block %s!\n", id);
+            return -EINVAL;
+        }
+
+        nruns = qemu_get_be32(f);
+        while (nruns--) {
+            uint64_t start = qemu_get_be64(f);
+            uint64_t length = qemu_get_be64(f);
+
+            if (start + length > block->length) {
+                return -EINVAL;
+            }
+            trace_ram_postcopy_discard(id, start, length);
+            qemu_madvise(block->host + start, length, QEMU_MADV_DONTNEED);
+        }
+    }
+
+    if (postcopy_incoming_init(qemu_get_fd(f)) < 0) {
+        return -EINVAL;
+    }
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (postcopy_incoming_register(block->idstr, block->host,
+                                       block->length) < 0) {
+            postcopy_incoming_cleanup();
+            return -EINVAL;
+        }
+    }
+    return postcopy_incoming_start();
+}
+
+static int ram_load_postcopy_page(QEMUFile *f, ram_addr_t addr, int flags)
+{
+    static uint8_t *page;
+    void *host;
+
+    host = host_from_stream_offset_postcopy(f, addr, flags);
+    if (!host) {
+        return -EINVAL;
+    }
+    if (!page) {
+        page = qemu_memalign(TARGET_PAGE_SIZE, TARGET_PAGE_SIZE);
+    }
+
+    if ((flags & RAM_SAVE_FLAG_ZERO_RANGE) == RAM_SAVE_FLAG_ZERO_RANGE) {
+        /* never sent after the switch-over */
+        return -EINVAL;
+    } else if (flags & RAM_SAVE_FLAG_COMPRESS) {
+        uint8_t ch = qemu_get_byte(f);
+
+        if (ch == 0) {
+            return postcopy_place_zero_page(host, TARGET_PAGE_SIZE);
+        }
+        memset(page, ch, TARGET_PAGE_SIZE);
+    } else if (flags & RAM_SAVE_FLAG_PAGE) {
+        qemu_get_buffer(f, page, TARGET_PAGE_SIZE);
+    } else {
+        /* XBZRLE is never used after the switch-over */
+        return -EINVAL;
+    }
+    return postcopy_place_page(host, page, TARGET_PAGE_SIZE);
+}
+
+/* Fill a page with ch.  A page that was never touched reads as zero
+ * without being allocated, so leave zero pages alone instead of faulting
+ * them in.
+ */
+static void ram_handle_compressed(void *host, uint8_t ch)
+{
+    if (ch != 0 || !buffer_is_zero(host, TARGET_PAGE_SIZE)) {
+        memset(host, ch, TARGET_PAGE_SIZE);
+#ifndef _WIN32
+        if (ch == 0 &&
+            (!kvm_enabled() || kvm_has_sync_mmu())) {
+            qemu_madvise(host, TARGET_PAGE_SIZE, QEMU_MADV_DONTNEED);
+        }
+#endif
+    }
+}
+
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     ram_addr_t addr;
@@ -827,23 +1676,56 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
             }
         }
 
-        if (flags & RAM_SAVE_FLAG_COMPRESS) {
-            void *host;
-            uint8_t ch;
+        if (flags & RAM_SAVE_FLAG_POSTCOPY_ADVISE) {
+            if (!postcopy_incoming_supported() ||
+                getpagesize() != TARGET_PAGE_SIZE) {
+                fprintf(stderr, "Postcopy migration is not supported "
+                        "on this host\n");
+                ret = -EINVAL;
+                goto done;
+            }
+        }
+
+        if (flags & RAM_SAVE_FLAG_POSTCOPY) {
+            ret = ram_load_postcopy_discard(f);
+            if (ret < 0) {
+                goto done;
+            }
+        } else if (postcopy_incoming_active() &&
+                   (flags & (RAM_SAVE_FLAG_COMPRESS | RAM_SAVE_FLAG_PAGE |
+                             RAM_SAVE_FLAG_XBZRLE))) {
+            ret = ram_load_postcopy_page(f, addr, flags);
+            if (ret < 0) {
+                goto done;
+            }
+        } else if ((flags & RAM_SAVE_FLAG_ZERO_RANGE) ==
+                   RAM_SAVE_FLAG_ZERO_RANGE) {
+            uint8_t *host;
+            uint32_t pages;
 
             host = host_from_stream_offset(f, addr, flags);
             if (!host) {
                 return -EINVAL;
             }
 
-            ch = qemu_get_byte(f);
-            memset(host, ch, TARGET_PAGE_SIZE);
-#ifndef _WIN32
-            if (ch == 0 &&
-                (!kvm_enabled() || kvm_has_sync_mmu())) {
-                qemu_madvise(host, TARGET_PAGE_SIZE, QEMU_MADV_DONTNEED);
+            pages = qemu_get_be32(f);
+            if (pages > ZERO_RANGE_MAX_PAGES) {
+                ret = -EINVAL;
+                goto done;
             }
-#endif
+            while (pages--) {
+                ram_handle_compressed(host, 0);
+                host += TARGET_PAGE_SIZE;
+            }
+        } else if (flags & RAM_SAVE_FLAG_COMPRESS) {
+            void *host;
+
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                return -EINVAL;
+            }
+
+            ram_handle_compressed(host, qemu_get_byte(f));
         } else if (flags & RAM_SAVE_FLAG_PAGE) {
             void *host;
 
@@ -866,6 +1748,17 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 ret = -EINVAL;
                 goto done;
             }
+        } else if (flags & RAM_SAVE_FLAG_COMPRESS_PAGE) {
+            void *host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                ret = -EINVAL;
+                goto done;
+            }
+
+            ret = load_compressed_page(f, host);
+            if (ret < 0) {
+                goto done;
+            }
         }
         error = qemu_file_get_error(f);
         if (error) {
@@ -875,6 +1768,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     } while (!(flags & RAM_SAVE_FLAG_EOS));
 
 done:
+    if (wait_for_decompress_done() < 0 && ret == 0) {
+        ret = -EINVAL;
+    }
     DPRINTF("Completed load of VM with exit code %d seq iteration "
             "%" PRIu64 "\n", ret, seq_iter);
     return ret;
@@ -884,6 +1780,7 @@ SaveVMHandlers savevm_ram_handlers = {
     .save_live_setup = ram_save_setup,
     .save_live_iterate = ram_save_iterate,
     .save_live_complete = ram_save_complete,
+    .save_live_postcopy = ram_save_postcopy,
     .load_state = ram_load,
     .cancel = ram_migration_cancel,
 };
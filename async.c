@@ -25,6 +25,7 @@
 #include "qemu-common.h"
 #include "qemu-aio.h"
 #include "main-loop.h"
+#include "thread-pool.h"
 
 /***********************************************************/
 /* bottom halves (can be seen as timers which expire ASAP) */
@@ -33,8 +34,9 @@ struct QEMUBH {
     AioContext *ctx;
     QEMUBHFunc *cb;
     void *opaque;
-    QEMUBH *next;
-    bool scheduled;
+    QEMUBH *next;       /* in ctx->scheduled_bh, pending_bh or deleted_bh */
+    int queued;         /* on ctx->scheduled_bh; only changed atomically */
+    int scheduled;
     bool idle;
     bool deleted;
 };
@@ -46,23 +48,66 @@ QEMUBH *aio_bh_new(AioContext *ctx, QEMUBHFunc *cb, void *opaque)
     bh->ctx = ctx;
     bh->cb = cb;
     bh->opaque = opaque;
-    bh->next = ctx->first_bh;
-    ctx->first_bh = bh;
     return bh;
 }
 
+/* Push bh on the list that aio_bh_poll() looks at, unless it is already
+ * there.  The list is only ever emptied as a whole by aio_bh_poll(), so
+ * a compare-and-swap on the head is enough and this is safe to call from
+ * any thread.  */
+static void aio_bh_enqueue(QEMUBH *bh)
+{
+    AioContext *ctx = bh->ctx;
+    QEMUBH *head;
+
+    if (!__sync_bool_compare_and_swap(&bh->queued, 0, 1)) {
+        return;
+    }
+    do {
+        head = ctx->scheduled_bh;
+        bh->next = head;
+    } while (!__sync_bool_compare_and_swap(&ctx->scheduled_bh, head, bh));
+}
+
 int aio_bh_poll(AioContext *ctx)
 {
-    QEMUBH *bh, **bhp, *next;
+    QEMUBH *bh, *list, *next, **tail;
     int ret;
 
     ctx->walking_bh++;
 
-    ret = 0;
-    for (bh = ctx->first_bh; bh; bh = next) {
+    /* Grab everything scheduled so far and put it back in the order the
+     * bottom halves were scheduled.  Anything scheduled from now on,
+     * including by the callbacks below, waits for the next call.  */
+    bh = __sync_lock_test_and_set(&ctx->scheduled_bh, NULL);
+    list = NULL;
+    while (bh) {
         next = bh->next;
-        if (!bh->deleted && bh->scheduled) {
-            bh->scheduled = 0;
+        bh->next = list;
+        list = bh;
+        bh = next;
+    }
+
+    /* If a callback of an outer call got us here, its remaining bottom
+     * halves are still queued and can't be scheduled again; they were
+     * scheduled before ours, so run them first.  */
+    for (tail = &ctx->pending_bh; *tail; tail = &(*tail)->next) {
+        /* nothing */
+    }
+    *tail = list;
+
+    ret = 0;
+    while ((bh = ctx->pending_bh) != NULL) {
+        ctx->pending_bh = bh->next;
+        if (bh->deleted) {
+            /* stays queued so that nobody links it anywhere else */
+            bh->next = ctx->deleted_bh;
+            ctx->deleted_bh = bh;
+            continue;
+        }
+        __sync_lock_release(&bh->queued);
+        /* a cancelled bottom half is simply skipped */
+        if (__sync_fetch_and_and(&bh->scheduled, 0)) {
             if (!bh->idle)
                 ret = 1;
             bh->idle = 0;
@@ -72,17 +117,12 @@ int aio_bh_poll(AioContext *ctx)
 
     ctx->walking_bh--;
 
-    /* remove deleted bhs */
+    /* free deleted bhs */
     if (!ctx->walking_bh) {
-        bhp = &ctx->first_bh;
-        while (*bhp) {
-            bh = *bhp;
-            if (bh->deleted) {
-                *bhp = bh->next;
-                g_free(bh);
-            } else {
-                bhp = &bh->next;
-            }
+        while (ctx->deleted_bh) {
+            bh = ctx->deleted_bh;
+            ctx->deleted_bh = bh->next;
+            g_free(bh);
         }
     }
 
@@ -93,21 +133,24 @@ void qemu_bh_schedule_idle(QEMUBH *bh)
 {
     if (bh->scheduled)
         return;
-    bh->scheduled = 1;
     bh->idle = 1;
+    bh->scheduled = 1;
+    aio_bh_enqueue(bh);
 }
 
 void qemu_bh_schedule(QEMUBH *bh)
 {
     if (bh->scheduled)
         return;
-    bh->scheduled = 1;
     bh->idle = 0;
+    bh->scheduled = 1;
+    aio_bh_enqueue(bh);
     aio_notify(bh->ctx);
 }
 
 void qemu_bh_cancel(QEMUBH *bh)
 {
+    /* the list entry, if any, is dropped by the next aio_bh_poll() */
     bh->scheduled = 0;
 }
 
@@ -115,6 +158,8 @@ void qemu_bh_delete(QEMUBH *bh)
 {
     bh->scheduled = 0;
     bh->deleted = 1;
+    /* let aio_bh_poll() free it once no callback can be running */
+    aio_bh_enqueue(bh);
 }
 
 static gboolean
@@ -122,8 +167,16 @@ aio_ctx_prepare(GSource *source, gint    *timeout)
 {
     AioContext *ctx = (AioContext *) source;
     QEMUBH *bh;
+    int deadline;
 
-    for (bh = ctx->first_bh; bh; bh = bh->next) {
+    for (bh = ctx->pending_bh; bh; bh = bh->next) {
+        if (!bh->deleted && bh->scheduled) {
+            /* left over from an aio_bh_poll() that is still running */
+            *timeout = 0;
+            return true;
+        }
+    }
+    for (bh = ctx->scheduled_bh; bh; bh = bh->next) {
         if (!bh->deleted && bh->scheduled) {
             if (bh->idle) {
                 /* idle bottom halves will be polled at least
@@ -138,6 +191,15 @@ aio_ctx_prepare(GSource *source, gint    *timeout)
         }
     }
 
+    deadline = qemu_timeout_ns_to_ms(timerlistgroup_deadline_ns(ctx->tlg));
+    if (deadline == 0) {
+        *timeout = 0;
+        return true;
+    }
+    if (deadline > 0 && (*timeout < 0 || deadline < *timeout)) {
+        *timeout = deadline;
+    }
+
     return false;
 }
 
@@ -147,12 +209,17 @@ aio_ctx_check(GSource *source)
     AioContext *ctx = (AioContext *) source;
     QEMUBH *bh;
 
-    for (bh = ctx->first_bh; bh; bh = bh->next) {
+    for (bh = ctx->pending_bh; bh; bh = bh->next) {
         if (!bh->deleted && bh->scheduled) {
             return true;
-	}
+        }
+    }
+    for (bh = ctx->scheduled_bh; bh; bh = bh->next) {
+        if (!bh->deleted && bh->scheduled) {
+            return true;
+        }
     }
-    return aio_pending(ctx);
+    return aio_pending(ctx) || timerlistgroup_deadline_ns(ctx->tlg) == 0;
 }
 
 static gboolean
@@ -172,8 +239,10 @@ aio_ctx_finalize(GSource     *source)
 {
     AioContext *ctx = (AioContext *) source;
 
+    thread_pool_free(ctx->thread_pool);
     aio_set_event_notifier(ctx, &ctx->notifier, NULL, NULL);
     event_notifier_cleanup(&ctx->notifier);
+    timerlistgroup_deinit(ctx->tlg);
 }
 
 static GSourceFuncs aio_source_funcs = {
@@ -189,19 +258,40 @@ GSource *aio_get_g_source(AioContext *ctx)
     return &ctx->source;
 }
 
+ThreadPool *aio_get_thread_pool(AioContext *ctx)
+{
+    if (!ctx->thread_pool) {
+        ctx->thread_pool = thread_pool_new(ctx);
+    }
+    return ctx->thread_pool;
+}
+
 void aio_notify(AioContext *ctx)
 {
     event_notifier_set(&ctx->notifier);
 }
 
+static void aio_timerlist_notify(void *opaque)
+{
+    aio_notify(opaque);
+}
+
+QEMUTimer *aio_timer_new(AioContext *ctx, enum QEMUClockType type, int scale,
+                         QEMUTimerCB *cb, void *opaque)
+{
+    return qemu_new_timer_tl(ctx->tlg[type], scale, cb, opaque);
+}
+
 AioContext *aio_context_new(void)
 {
     AioContext *ctx;
     ctx = (AioContext *) g_source_new(&aio_source_funcs, sizeof(AioContext));
+    ctx->thread_pool = NULL;
     event_notifier_init(&ctx->notifier, false);
     aio_set_event_notifier(ctx, &ctx->notifier, 
                            (EventNotifierHandler *)
                            event_notifier_test_and_clear, NULL);
+    timerlistgroup_init(ctx->tlg, aio_timerlist_notify, ctx);
 
     return ctx;
 }
@@ -1106,11 +1106,46 @@ static void audio_pcm_print_info (const char *cap, struct audio_pcm_info *info)
 /*
  * Timer
  */
-static int audio_is_timer_needed (void)
+
+/* An enabled output voice that got no data for this long, and has nothing
+ * left to play, no longer needs the timer.  AUD_write and
+ * AUD_set_active_out restart it.
+ */
+#define AUDIO_IDLE_TIMEOUT_MS 1000
+
+static int audio_is_idle (AudioState *s)
+{
+    HWVoiceOut *hwo = NULL;
+    int nb_live;
+
+    if (qemu_get_clock_ns (vm_clock) - s->last_data <
+        AUDIO_IDLE_TIMEOUT_MS * SCALE_MS) {
+        return 0;
+    }
+
+    /* Capture produces data on its own */
+    if (audio_pcm_hw_find_any_enabled_in (NULL)) {
+        return 0;
+    }
+
+    while ((hwo = audio_pcm_hw_find_any_enabled_out (hwo))) {
+        if (hwo->pending_disable ||
+            (audio_pcm_hw_get_live_out (hwo, &nb_live) && nb_live)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int audio_is_timer_needed (AudioState *s)
 {
     HWVoiceIn *hwi = NULL;
     HWVoiceOut *hwo = NULL;
 
+    if (audio_is_idle (s)) {
+        return 0;
+    }
+
     while ((hwo = audio_pcm_hw_find_any_enabled_out (hwo))) {
         if (!hwo->poll_mode) return 1;
     }
@@ -1122,14 +1157,23 @@ static int audio_is_timer_needed (void)
 
 static void audio_reset_timer (AudioState *s)
 {
-    if (audio_is_timer_needed ()) {
-        qemu_mod_timer (s->ts, qemu_get_clock_ns (vm_clock) + 1);
+    if (audio_is_timer_needed (s)) {
+        qemu_mod_timer (s->ts, qemu_get_clock_ns (vm_clock) + conf.period.ticks);
     }
     else {
         qemu_del_timer (s->ts);
     }
 }
 
+/* A frontend has new data or (re)started a voice */
+static void audio_wakeup (AudioState *s)
+{
+    s->last_data = qemu_get_clock_ns (vm_clock);
+    if (s->vm_running && !qemu_timer_pending (s->ts)) {
+        audio_reset_timer (s);
+    }
+}
+
 static void audio_timer (void *opaque)
 {
     audio_run ("timer");
@@ -1154,6 +1198,9 @@ int AUD_write (SWVoiceOut *sw, void *buf, int size)
     }
 
     bytes = sw->hw->pcm_ops->write (sw, buf, size);
+    if (bytes) {
+        audio_wakeup (&glob_audio_state);
+    }
     return bytes;
 }
 
@@ -1189,6 +1236,10 @@ void AUD_set_active_out (SWVoiceOut *sw, int on)
     }
 
     hw = sw->hw;
+    if (on) {
+        /* Also a hint from frontends that the guest resumed playback */
+        audio_wakeup (&glob_audio_state);
+    }
     if (sw->active != on) {
         AudioState *s = &glob_audio_state;
         SWVoiceOut *temp_sw;
@@ -200,6 +200,7 @@ struct AudioState {
     int nb_hw_voices_out;
     int nb_hw_voices_in;
     int vm_running;
+    int64_t last_data;          /* vm_clock time of the last frontend data */
 };
 
 extern struct audio_driver no_audio_driver;
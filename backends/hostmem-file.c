@@ -0,0 +1,102 @@
+/*
+ * QEMU Host Memory Backend for files (hugetlbfs, tmpfs)
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/hostmem.h"
+#include "qerror.h"
+
+#define MEMORY_BACKEND_FILE(obj) \
+    OBJECT_CHECK(HostMemoryBackendFile, (obj), TYPE_MEMORY_BACKEND_FILE)
+
+typedef struct HostMemoryBackendFile
+{
+    HostMemoryBackend parent;
+
+    char *mem_path;
+} HostMemoryBackendFile;
+
+/**
+ * Guest memory mapped from an unlinked file created in the "mem-path"
+ * directory, typically a hugetlbfs mount.  With "share" the mapping is
+ * shared and the file descriptor can be passed to other processes.
+ */
+
+static void file_backend_alloc(HostMemoryBackend *backend, const char *name,
+                               Error **errp)
+{
+    HostMemoryBackendFile *fb = MEMORY_BACKEND_FILE(backend);
+
+    if (!fb->mem_path) {
+        error_set(errp, QERR_MISSING_PARAMETER, "mem-path");
+        return;
+    }
+
+    if (memory_region_init_ram_from_file(&backend->mr, name, backend->size,
+                                         fb->mem_path, backend->share) < 0) {
+        memory_region_destroy(&backend->mr);
+        error_setg(errp, "cannot allocate memory for '%s' in %s",
+                   name, fb->mem_path);
+    }
+}
+
+static char *file_backend_get_mem_path(Object *obj, Error **errp)
+{
+    HostMemoryBackendFile *fb = MEMORY_BACKEND_FILE(obj);
+
+    return g_strdup(fb->mem_path);
+}
+
+static void file_backend_set_mem_path(Object *obj, const char *value,
+                                      Error **errp)
+{
+    HostMemoryBackendFile *fb = MEMORY_BACKEND_FILE(obj);
+
+    if (MEMORY_BACKEND(obj)->allocated) {
+        error_set(errp, QERR_PERMISSION_DENIED);
+        return;
+    }
+
+    g_free(fb->mem_path);
+    fb->mem_path = g_strdup(value);
+}
+
+static void file_backend_init(Object *obj)
+{
+    object_property_add_str(obj, "mem-path",
+                            file_backend_get_mem_path,
+                            file_backend_set_mem_path,
+                            NULL);
+}
+
+static void file_backend_finalize(Object *obj)
+{
+    HostMemoryBackendFile *fb = MEMORY_BACKEND_FILE(obj);
+
+    g_free(fb->mem_path);
+}
+
+static void file_backend_class_init(ObjectClass *klass, void *data)
+{
+    HostMemoryBackendClass *bc = MEMORY_BACKEND_CLASS(klass);
+
+    bc->alloc = file_backend_alloc;
+}
+
+static TypeInfo file_backend_info = {
+    .name = TYPE_MEMORY_BACKEND_FILE,
+    .parent = TYPE_MEMORY_BACKEND,
+    .instance_size = sizeof(HostMemoryBackendFile),
+    .instance_init = file_backend_init,
+    .instance_finalize = file_backend_finalize,
+    .class_init = file_backend_class_init,
+};
+
+static void register_types(void)
+{
+    type_register_static(&file_backend_info);
+}
+
+type_init(register_types);
@@ -0,0 +1,50 @@
+/*
+ * QEMU Host Memory Backend for anonymous memory
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/hostmem.h"
+
+/**
+ * Guest memory allocated like the default RAM.  With "share" set the memory
+ * is a shared mapping of an anonymous memory file, so that its file
+ * descriptor can be passed to other processes.
+ */
+
+static void ram_backend_alloc(HostMemoryBackend *backend, const char *name,
+                              Error **errp)
+{
+    if (!backend->share) {
+        memory_region_init_ram(&backend->mr, name, backend->size);
+        return;
+    }
+
+    if (memory_region_init_ram_from_file(&backend->mr, name, backend->size,
+                                         NULL, true) < 0) {
+        memory_region_destroy(&backend->mr);
+        error_setg(errp, "cannot allocate shared memory for '%s'", name);
+    }
+}
+
+static void ram_backend_class_init(ObjectClass *klass, void *data)
+{
+    HostMemoryBackendClass *bc = MEMORY_BACKEND_CLASS(klass);
+
+    bc->alloc = ram_backend_alloc;
+}
+
+static TypeInfo ram_backend_info = {
+    .name = TYPE_MEMORY_BACKEND_RAM,
+    .parent = TYPE_MEMORY_BACKEND,
+    .instance_size = sizeof(HostMemoryBackend),
+    .class_init = ram_backend_class_init,
+};
+
+static void register_types(void)
+{
+    type_register_static(&ram_backend_info);
+}
+
+type_init(register_types);
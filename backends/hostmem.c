@@ -0,0 +1,380 @@
+/*
+ * QEMU Host Memory Backend
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/hostmem.h"
+#include "qapi/qapi-visit-core.h"
+#include "qerror.h"
+#include "sysemu.h"
+#include "qemu-config.h"
+
+#ifdef CONFIG_LINUX
+#include <sys/syscall.h>
+
+/* From <numaif.h>; the policies are issued with the raw system call so that
+ * no libnuma is needed.
+ */
+#define QEMU_MPOL_DEFAULT       0
+#define QEMU_MPOL_PREFERRED     1
+#define QEMU_MPOL_BIND          2
+#define QEMU_MPOL_INTERLEAVE    3
+#define QEMU_MPOL_MF_STRICT     (1 << 0)
+#define QEMU_MPOL_MF_MOVE       (1 << 1)
+#endif
+
+static const char *host_mem_policy_names[HOST_MEM_POLICY_MAX] = {
+    [HOST_MEM_POLICY_DEFAULT] = "default",
+    [HOST_MEM_POLICY_PREFERRED] = "preferred",
+    [HOST_MEM_POLICY_BIND] = "bind",
+    [HOST_MEM_POLICY_INTERLEAVE] = "interleave",
+};
+
+static void host_memory_backend_get_size(Object *obj, Visitor *v,
+                                         void *opaque, const char *name,
+                                         Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+    uint64_t value = backend->size;
+
+    visit_type_size(v, &value, name, errp);
+}
+
+static void host_memory_backend_set_size(Object *obj, Visitor *v,
+                                         void *opaque, const char *name,
+                                         Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+    Error *local_err = NULL;
+    uint64_t value;
+
+    if (backend->allocated) {
+        error_set(errp, QERR_PERMISSION_DENIED);
+        return;
+    }
+
+    visit_type_size(v, &value, name, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+    if (!value) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, name, "a non-zero size");
+        return;
+    }
+    backend->size = value;
+}
+
+static bool host_memory_backend_get_share(Object *obj, Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+
+    return backend->share;
+}
+
+static void host_memory_backend_set_share(Object *obj, bool value,
+                                          Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+
+    if (backend->allocated) {
+        error_set(errp, QERR_PERMISSION_DENIED);
+        return;
+    }
+    backend->share = value;
+}
+
+static bool host_memory_backend_get_prealloc(Object *obj, Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+
+    return backend->prealloc;
+}
+
+static void host_memory_backend_set_prealloc(Object *obj, bool value,
+                                             Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+
+    if (backend->allocated) {
+        error_set(errp, QERR_PERMISSION_DENIED);
+        return;
+    }
+    backend->prealloc = value;
+}
+
+static bool host_memory_backend_get_merge(Object *obj, Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+
+    return backend->merge;
+}
+
+static void host_memory_backend_set_merge(Object *obj, bool value,
+                                          Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+
+    if (backend->allocated) {
+        error_set(errp, QERR_PERMISSION_DENIED);
+        return;
+    }
+    backend->merge = value;
+}
+
+static bool host_memory_backend_get_hugepage(Object *obj, Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+
+    return backend->hugepage;
+}
+
+static void host_memory_backend_set_hugepage(Object *obj, bool value,
+                                             Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+
+    if (backend->allocated) {
+        error_set(errp, QERR_PERMISSION_DENIED);
+        return;
+    }
+    backend->hugepage = value;
+}
+
+static char *host_memory_backend_get_policy(Object *obj, Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+
+    return g_strdup(host_mem_policy_names[backend->policy]);
+}
+
+static void host_memory_backend_set_policy(Object *obj, const char *value,
+                                           Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+    int i;
+
+    if (backend->allocated) {
+        error_set(errp, QERR_PERMISSION_DENIED);
+        return;
+    }
+
+    for (i = 0; i < HOST_MEM_POLICY_MAX; i++) {
+        if (!strcmp(value, host_mem_policy_names[i])) {
+            backend->policy = i;
+            return;
+        }
+    }
+    error_set(errp, QERR_INVALID_PARAMETER_VALUE, "policy",
+              "default, preferred, bind or interleave");
+}
+
+/* host-nodes is a host node number or a range of them, as in "0-1" */
+static char *host_memory_backend_get_host_nodes(Object *obj, Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+    unsigned long first, last;
+
+    first = find_first_bit(backend->host_nodes, MAX_HOST_NODES);
+    if (first >= MAX_HOST_NODES) {
+        return g_strdup("");
+    }
+    last = find_last_bit(backend->host_nodes, MAX_HOST_NODES);
+    if (first == last) {
+        return g_strdup_printf("%lu", first);
+    }
+    return g_strdup_printf("%lu-%lu", first, last);
+}
+
+static void host_memory_backend_set_host_nodes(Object *obj, const char *value,
+                                               Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+    unsigned long first, last;
+    char *endptr;
+
+    if (backend->allocated) {
+        error_set(errp, QERR_PERMISSION_DENIED);
+        return;
+    }
+
+    first = last = strtoul(value, &endptr, 10);
+    if (endptr != value && *endptr == '-') {
+        last = strtoul(endptr + 1, &endptr, 10);
+    }
+    if (endptr == value || *endptr || last < first ||
+        last >= MAX_HOST_NODES) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "host-nodes",
+                  "a host node number or range");
+        return;
+    }
+
+    bitmap_zero(backend->host_nodes, MAX_HOST_NODES);
+    bitmap_set(backend->host_nodes, first, last - first + 1);
+}
+
+static void host_memory_backend_set_mempolicy(HostMemoryBackend *backend,
+                                              void *ptr, uint64_t size,
+                                              Error **errp)
+{
+    bool have_nodes = !bitmap_empty(backend->host_nodes, MAX_HOST_NODES);
+
+    if (backend->policy == HOST_MEM_POLICY_DEFAULT) {
+        if (have_nodes) {
+            error_setg(errp, "host-nodes requires a memory policy");
+        }
+        return;
+    }
+    if (!have_nodes && backend->policy != HOST_MEM_POLICY_PREFERRED) {
+        error_set(errp, QERR_MISSING_PARAMETER, "host-nodes");
+        return;
+    }
+
+#if defined(CONFIG_LINUX) && defined(__NR_mbind)
+    {
+        static const int modes[HOST_MEM_POLICY_MAX] = {
+            [HOST_MEM_POLICY_DEFAULT] = QEMU_MPOL_DEFAULT,
+            [HOST_MEM_POLICY_PREFERRED] = QEMU_MPOL_PREFERRED,
+            [HOST_MEM_POLICY_BIND] = QEMU_MPOL_BIND,
+            [HOST_MEM_POLICY_INTERLEAVE] = QEMU_MPOL_INTERLEAVE,
+        };
+        unsigned int flags = QEMU_MPOL_MF_MOVE;
+
+        if (backend->policy == HOST_MEM_POLICY_BIND) {
+            flags |= QEMU_MPOL_MF_STRICT;
+        }
+
+        /* The kernel expects maxnode to be one more than the last bit */
+        if (syscall(__NR_mbind, ptr, size, modes[backend->policy],
+                    have_nodes ? backend->host_nodes : NULL,
+                    have_nodes ? MAX_HOST_NODES + 1 : 0, flags) < 0) {
+            error_setg(errp, "cannot set %s memory policy: %s",
+                       host_mem_policy_names[backend->policy],
+                       strerror(errno));
+        }
+    }
+#else
+    error_setg(errp, "host memory policies are not supported on this host");
+#endif
+}
+
+MemoryRegion *host_memory_backend_get_memory(HostMemoryBackend *backend,
+                                             Error **errp)
+{
+    HostMemoryBackendClass *k = MEMORY_BACKEND_GET_CLASS(backend);
+    Error *local_err = NULL;
+    gchar *path;
+    const char *name;
+    void *ptr;
+
+    if (backend->allocated) {
+        return &backend->mr;
+    }
+
+    if (!backend->size) {
+        error_set(errp, QERR_MISSING_PARAMETER, "size");
+        return NULL;
+    }
+
+    path = object_get_canonical_path(OBJECT(backend));
+    name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    k->alloc(backend, name, &local_err);
+    if (local_err) {
+        goto out;
+    }
+    backend->allocated = true;
+
+    qemu_ram_set_advice(memory_region_get_ram_addr(&backend->mr),
+                        backend->merge, backend->hugepage);
+    ptr = memory_region_get_ram_ptr(&backend->mr);
+    host_memory_backend_set_mempolicy(backend, ptr, backend->size, &local_err);
+    if (local_err) {
+        goto out;
+    }
+
+    /* Fault in every page now rather than when the guest first touches it.
+     * The policy is already in place, so each node's backend is populated
+     * on its host nodes whichever CPUs the threads run on.
+     */
+    if (backend->prealloc &&
+        os_mem_prealloc(ptr, backend->size, getpagesize(),
+                        mem_prealloc_threads) < 0) {
+        error_setg(&local_err, "insufficient free host memory pages "
+                   "available to preallocate '%s'", name);
+    }
+
+out:
+    g_free(path);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return NULL;
+    }
+    return &backend->mr;
+}
+
+static void host_memory_backend_init(Object *obj)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+    QemuOpts *opts = qemu_opts_find(qemu_find_opts("machine"), 0);
+
+    /* default to the machine-wide settings of the other RAM blocks */
+    backend->merge = !opts || qemu_opt_get_bool(opts, "mem-merge", true);
+    backend->hugepage = !opts || qemu_opt_get_bool(opts, "thp", true);
+
+    object_property_add(obj, "size", "int",
+                        host_memory_backend_get_size,
+                        host_memory_backend_set_size,
+                        NULL, NULL, NULL);
+    object_property_add_bool(obj, "share",
+                             host_memory_backend_get_share,
+                             host_memory_backend_set_share,
+                             NULL);
+    object_property_add_bool(obj, "prealloc",
+                             host_memory_backend_get_prealloc,
+                             host_memory_backend_set_prealloc,
+                             NULL);
+    object_property_add_bool(obj, "merge",
+                             host_memory_backend_get_merge,
+                             host_memory_backend_set_merge,
+                             NULL);
+    object_property_add_bool(obj, "hugepage",
+                             host_memory_backend_get_hugepage,
+                             host_memory_backend_set_hugepage,
+                             NULL);
+    object_property_add_str(obj, "policy",
+                            host_memory_backend_get_policy,
+                            host_memory_backend_set_policy,
+                            NULL);
+    object_property_add_str(obj, "host-nodes",
+                            host_memory_backend_get_host_nodes,
+                            host_memory_backend_set_host_nodes,
+                            NULL);
+}
+
+static void host_memory_backend_finalize(Object *obj)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+
+    if (backend->allocated) {
+        memory_region_destroy(&backend->mr);
+    }
+}
+
+static TypeInfo host_memory_backend_info = {
+    .name = TYPE_MEMORY_BACKEND,
+    .parent = TYPE_OBJECT,
+    .instance_size = sizeof(HostMemoryBackend),
+    .instance_init = host_memory_backend_init,
+    .instance_finalize = host_memory_backend_finalize,
+    .class_size = sizeof(HostMemoryBackendClass),
+    .abstract = true,
+};
+
+static void register_types(void)
+{
+    type_register_static(&host_memory_backend_info);
+}
+
+type_init(register_types);
@@ -28,9 +28,13 @@
 #define BLK_MIG_FLAG_DEVICE_BLOCK       0x01
 #define BLK_MIG_FLAG_EOS                0x02
 #define BLK_MIG_FLAG_PROGRESS           0x04
+#define BLK_MIG_FLAG_ZERO_BLOCK         0x08
 
 #define MAX_IS_ALLOCATED_SEARCH 65536
 
+/* Sectors read by a single bulk phase request; sent as BLOCK_SIZE chunks */
+#define BULK_READ_SECTORS (8 * BDRV_SECTORS_PER_DIRTY_CHUNK)
+
 //#define DEBUG_BLK_MIGRATION
 
 #ifdef DEBUG_BLK_MIGRATION
@@ -80,24 +84,66 @@ typedef struct BlkMigState {
     long double total_time;
     long double prev_time_offset;
     int reads;
+    bool zero_blocks;
 } BlkMigState;
 
 static BlkMigState block_mig_state;
 
-static void blk_send(QEMUFile *f, BlkMigBlock * blk)
+/* Number of BLOCK_SIZE chunks, and of submitted/read_done units, in blk */
+static int blk_nr_chunks(BlkMigBlock *blk)
+{
+    return DIV_ROUND_UP(blk->nr_sectors, BDRV_SECTORS_PER_DIRTY_CHUNK);
+}
+
+static void blk_send_header(QEMUFile *f, BlkMigDevState *bmds,
+                            int64_t sector, int flags)
 {
     int len;
 
     /* sector number and flags */
-    qemu_put_be64(f, (blk->sector << BDRV_SECTOR_BITS)
-                     | BLK_MIG_FLAG_DEVICE_BLOCK);
+    qemu_put_be64(f, (sector << BDRV_SECTOR_BITS) | flags);
 
     /* device name */
-    len = strlen(blk->bmds->bs->device_name);
+    len = strlen(bmds->bs->device_name);
     qemu_put_byte(f, len);
-    qemu_put_buffer(f, (uint8_t *)blk->bmds->bs->device_name, len);
+    qemu_put_buffer(f, (uint8_t *)bmds->bs->device_name, len);
+}
+
+static void blk_send(QEMUFile *f, BlkMigBlock * blk)
+{
+    int64_t offset;
+    int nr_sectors;
+    uint8_t *buf;
+
+    for (offset = 0; offset < blk->nr_sectors;
+         offset += BDRV_SECTORS_PER_DIRTY_CHUNK) {
+        buf = blk->buf + (offset << BDRV_SECTOR_BITS);
+        nr_sectors = MIN(BDRV_SECTORS_PER_DIRTY_CHUNK,
+                         blk->nr_sectors - offset);
+
+        if (block_mig_state.zero_blocks &&
+            buffer_is_zero(buf, nr_sectors << BDRV_SECTOR_BITS)) {
+            blk_send_header(f, blk->bmds, blk->sector + offset,
+                            BLK_MIG_FLAG_DEVICE_BLOCK |
+                            BLK_MIG_FLAG_ZERO_BLOCK);
+        } else {
+            blk_send_header(f, blk->bmds, blk->sector + offset,
+                            BLK_MIG_FLAG_DEVICE_BLOCK);
+            qemu_put_buffer(f, buf, BLOCK_SIZE);
+        }
+    }
+}
+
+/* Send zero markers for all chunks in [sector, sector + nr_sectors) */
+static void blk_send_zeroes(QEMUFile *f, BlkMigDevState *bmds,
+                            int64_t sector, int nr_sectors)
+{
+    int64_t end = sector + nr_sectors;
 
-    qemu_put_buffer(f, blk->buf, BLOCK_SIZE);
+    for (; sector < end; sector += BDRV_SECTORS_PER_DIRTY_CHUNK) {
+        blk_send_header(f, bmds, sector,
+                        BLK_MIG_FLAG_DEVICE_BLOCK | BLK_MIG_FLAG_ZERO_BLOCK);
+    }
 }
 
 int blk_mig_active(void)
@@ -132,9 +178,12 @@ uint64_t blk_mig_bytes_total(void)
     return sum << BDRV_SECTOR_BITS;
 }
 
+/* Read bandwidth in bytes per ns, or 0 if nothing has been read yet */
 static inline long double compute_read_bwidth(void)
 {
-    assert(block_mig_state.total_time != 0);
+    if (block_mig_state.total_time == 0) {
+        return 0;
+    }
     return (block_mig_state.reads / block_mig_state.total_time) * BLOCK_SIZE;
 }
 
@@ -191,15 +240,15 @@ static void blk_mig_read_cb(void *opaque, int ret)
 
     blk->ret = ret;
 
-    block_mig_state.reads++;
+    block_mig_state.reads += blk_nr_chunks(blk);
     block_mig_state.total_time += (curr_time - block_mig_state.prev_time_offset);
     block_mig_state.prev_time_offset = curr_time;
 
     QSIMPLEQ_INSERT_TAIL(&block_mig_state.blk_list, blk, entry);
     bmds_set_aio_inflight(blk->bmds, blk->sector, blk->nr_sectors, 0);
 
-    block_mig_state.submitted--;
-    block_mig_state.read_done++;
+    block_mig_state.submitted -= blk_nr_chunks(blk);
+    block_mig_state.read_done += blk_nr_chunks(blk);
     assert(block_mig_state.submitted >= 0);
 }
 
@@ -228,15 +277,41 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
 
     cur_sector &= ~((int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK - 1);
 
-    /* we are going to transfer a full block even if it is not allocated */
-    nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
+    /*
+     * Without a backing file, unallocated chunks read as zeroes: send a
+     * marker for them instead of reading them.  Allocated data is read in
+     * requests of up to BULK_READ_SECTORS, stopping at the next unallocated
+     * chunk.
+     */
+    nr_sectors = BULK_READ_SECTORS;
+    if ((block_mig_state.zero_blocks && !bs->backing_hd) ||
+        bmds->shared_base) {
+        int n;
+
+        if (!bdrv_is_allocated(bs, cur_sector, MAX_IS_ALLOCATED_SEARCH, &n)) {
+            if (cur_sector + n < total_sectors) {
+                n &= ~(BDRV_SECTORS_PER_DIRTY_CHUNK - 1);
+            }
+            if (n > 0 && !bmds->shared_base) {
+                blk_send_zeroes(f, bmds, cur_sector, n);
+                bdrv_reset_dirty(bs, cur_sector, n);
+                bmds->cur_sector = cur_sector + n;
+                return (bmds->cur_sector >= total_sectors);
+            }
+            /* the chunk is partially allocated, read all of it */
+            n = BDRV_SECTORS_PER_DIRTY_CHUNK;
+        }
+        n = QEMU_ALIGN_UP(n, BDRV_SECTORS_PER_DIRTY_CHUNK);
+        nr_sectors = MIN(nr_sectors, n);
+    }
 
-    if (total_sectors - cur_sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
+    if (total_sectors - cur_sector < nr_sectors) {
         nr_sectors = total_sectors - cur_sector;
     }
 
     blk = g_malloc(sizeof(BlkMigBlock));
-    blk->buf = g_malloc(BLOCK_SIZE);
+    blk->buf = g_malloc(QEMU_ALIGN_UP(nr_sectors, BDRV_SECTORS_PER_DIRTY_CHUNK)
+                        << BDRV_SECTOR_BITS);
     blk->bmds = bmds;
     blk->sector = cur_sector;
     blk->nr_sectors = nr_sectors;
@@ -251,7 +326,7 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
 
     blk->aiocb = bdrv_aio_readv(bs, cur_sector, &blk->qiov,
                                 nr_sectors, blk_mig_read_cb, blk);
-    block_mig_state.submitted++;
+    block_mig_state.submitted += blk_nr_chunks(blk);
 
     bdrv_reset_dirty(bs, cur_sector, nr_sectors);
     bmds->cur_sector = cur_sector + nr_sectors;
@@ -264,7 +339,7 @@ static void set_dirty_tracking(int enable)
     BlkMigDevState *bmds;
 
     QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
-        bdrv_set_dirty_tracking(bmds->bs, enable);
+        bdrv_set_dirty_tracking(bmds->bs, enable ? BLOCK_SIZE : 0);
     }
 }
 
@@ -312,6 +387,7 @@ static void init_blk_migration(QEMUFile *f)
     block_mig_state.bulk_completed = 0;
     block_mig_state.total_time = 0;
     block_mig_state.reads = 0;
+    block_mig_state.zero_blocks = migrate_zero_blocks();
 
     bdrv_iterate(init_blk_migration_it, NULL);
 }
@@ -323,18 +399,17 @@ static int blk_mig_save_bulked_block(QEMUFile *f)
     int progress;
     int ret = 0;
 
+    /* Issue one read for every device, so that they progress in parallel */
     QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
         if (bmds->bulk_completed == 0) {
             if (mig_save_device_bulk(f, bmds) == 1) {
                 /* completed bulk section for this device */
                 bmds->bulk_completed = 1;
+            } else {
+                ret = 1;
             }
-            completed_sector_sum += bmds->completed_sectors;
-            ret = 1;
-            break;
-        } else {
-            completed_sector_sum += bmds->completed_sectors;
         }
+        completed_sector_sum += bmds->completed_sectors;
     }
 
     if (block_mig_state.total_sector_sum != 0) {
@@ -371,55 +446,57 @@ static int mig_save_device_dirty(QEMUFile *f, BlkMigDevState *bmds,
     int nr_sectors;
     int ret = -EIO;
 
-    for (sector = bmds->cur_dirty; sector < bmds->total_sectors;) {
-        if (bmds_aio_inflight(bmds, sector)) {
-            bdrv_drain_all();
-        }
-        if (bdrv_get_dirty(bmds->bs, sector)) {
+    /* Jump straight to the next dirty chunk instead of testing every
+     * chunk between the cursor and the end of the device.
+     */
+    sector = bdrv_get_next_dirty(bmds->bs, bmds->cur_dirty);
+    if (sector < 0) {
+        bmds->cur_dirty = total_sectors;
+        return 1;
+    }
+    bmds->cur_dirty = sector;
 
-            if (total_sectors - sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
-                nr_sectors = total_sectors - sector;
-            } else {
-                nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
-            }
-            blk = g_malloc(sizeof(BlkMigBlock));
-            blk->buf = g_malloc(BLOCK_SIZE);
-            blk->bmds = bmds;
-            blk->sector = sector;
-            blk->nr_sectors = nr_sectors;
-
-            if (is_async) {
-                blk->iov.iov_base = blk->buf;
-                blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
-                qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
-
-                if (block_mig_state.submitted == 0) {
-                    block_mig_state.prev_time_offset = qemu_get_clock_ns(rt_clock);
-                }
+    if (bmds_aio_inflight(bmds, sector)) {
+        bdrv_drain_all();
+    }
 
-                blk->aiocb = bdrv_aio_readv(bmds->bs, sector, &blk->qiov,
-                                            nr_sectors, blk_mig_read_cb, blk);
-                block_mig_state.submitted++;
-                bmds_set_aio_inflight(bmds, sector, nr_sectors, 1);
-            } else {
-                ret = bdrv_read(bmds->bs, sector, blk->buf, nr_sectors);
-                if (ret < 0) {
-                    goto error;
-                }
-                blk_send(f, blk);
+    if (total_sectors - sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
+        nr_sectors = total_sectors - sector;
+    } else {
+        nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
+    }
+    blk = g_malloc(sizeof(BlkMigBlock));
+    blk->buf = g_malloc(BLOCK_SIZE);
+    blk->bmds = bmds;
+    blk->sector = sector;
+    blk->nr_sectors = nr_sectors;
 
-                g_free(blk->buf);
-                g_free(blk);
-            }
+    if (is_async) {
+        blk->iov.iov_base = blk->buf;
+        blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
 
-            bdrv_reset_dirty(bmds->bs, sector, nr_sectors);
-            break;
+        if (block_mig_state.submitted == 0) {
+            block_mig_state.prev_time_offset = qemu_get_clock_ns(rt_clock);
         }
-        sector += BDRV_SECTORS_PER_DIRTY_CHUNK;
-        bmds->cur_dirty = sector;
+
+        blk->aiocb = bdrv_aio_readv(bmds->bs, sector, &blk->qiov,
+                                    nr_sectors, blk_mig_read_cb, blk);
+        block_mig_state.submitted += blk_nr_chunks(blk);
+        bmds_set_aio_inflight(bmds, sector, nr_sectors, 1);
+    } else {
+        ret = bdrv_read(bmds->bs, sector, blk->buf, nr_sectors);
+        if (ret < 0) {
+            goto error;
+        }
+        blk_send(f, blk);
+
+        g_free(blk->buf);
+        g_free(blk);
     }
 
-    return (bmds->cur_dirty >= bmds->total_sectors);
+    bdrv_reset_dirty(bmds->bs, sector, nr_sectors);
+    return 0;
 
 error:
     DPRINTF("Error reading sector %" PRId64 "\n", sector);
@@ -470,8 +547,8 @@ static int flush_blks(QEMUFile *f)
         g_free(blk->buf);
         g_free(blk);
 
-        block_mig_state.read_done--;
-        block_mig_state.transferred++;
+        block_mig_state.read_done -= blk_nr_chunks(blk);
+        block_mig_state.transferred += blk_nr_chunks(blk);
         assert(block_mig_state.read_done >= 0);
     }
 
@@ -490,7 +567,7 @@ static int64_t get_remaining_dirty(void)
         dirty += bdrv_get_dirty_count(bmds->bs);
     }
 
-    return dirty * BLOCK_SIZE;
+    return dirty << BDRV_SECTOR_BITS;
 }
 
 static int is_stage2_completed(void)
@@ -506,6 +583,10 @@ static int is_stage2_completed(void)
         }
 
         bwidth = compute_read_bwidth();
+        if (bwidth == 0) {
+            /* no estimate yet, read some of the dirty data first */
+            return 0;
+        }
 
         if ((remaining_dirty / bwidth) <=
             migrate_max_downtime()) {
@@ -591,7 +672,7 @@ static int block_save_iterate(QEMUFile *f, void *opaque)
     /* control the rate of transfer */
     while ((block_mig_state.submitted +
             block_mig_state.read_done) * BLOCK_SIZE <
-           qemu_file_get_rate_limit(f)) {
+           qemu_file_get_rate_limit(f) && !qemu_file_rate_limit(f)) {
         if (block_mig_state.bulk_completed == 0) {
             /* first finish the bulk phase */
             if (blk_mig_save_bulked_block(f) == 0) {
@@ -706,12 +787,15 @@ static int block_load(QEMUFile *f, void *opaque, int version_id)
                 nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
             }
 
-            buf = g_malloc(BLOCK_SIZE);
-
-            qemu_get_buffer(f, buf, BLOCK_SIZE);
-            ret = bdrv_write(bs, addr, buf, nr_sectors);
+            if (flags & BLK_MIG_FLAG_ZERO_BLOCK) {
+                ret = bdrv_write_zeroes(bs, addr, nr_sectors);
+            } else {
+                buf = g_malloc(BLOCK_SIZE);
+                qemu_get_buffer(f, buf, BLOCK_SIZE);
+                ret = bdrv_write(bs, addr, buf, nr_sectors);
+                g_free(buf);
+            }
 
-            g_free(buf);
             if (ret < 0) {
                 return ret;
             }
@@ -34,6 +34,7 @@
 #include "qemu-coroutine.h"
 #include "qmp-commands.h"
 #include "qemu-timer.h"
+#include "block/shared-cache.h"
 
 #ifdef CONFIG_BSD
 #include <sys/types.h>
@@ -54,9 +55,20 @@
 typedef enum {
     BDRV_REQ_COPY_ON_READ = 0x1,
     BDRV_REQ_ZERO_WRITE   = 0x2,
+    /* Neither copy-on-read nor wait for overlapping requests; used by
+     * before-write notifiers, which run inside a tracked write request */
+    BDRV_REQ_NO_COPY_ON_READ = 0x4,
+    /* Wait for overlapping requests, and make overlapping requests that
+     * start later wait for this one */
+    BDRV_REQ_SERIALISING  = 0x8,
 } BdrvRequestFlags;
 
 static void bdrv_dev_change_media_cb(BlockDriverState *bs, bool load);
+static void bdrv_set_dirty_bitmaps(BlockDriverState *bs, int64_t cur_sector,
+                                   int nr_sectors);
+static void bdrv_set_dirty_bitmaps_all(BlockDriverState *bs);
+static void bdrv_truncate_dirty_bitmaps(BlockDriverState *bs,
+                                        int64_t old_sectors);
 static BlockDriverAIOCB *bdrv_aio_readv_em(BlockDriverState *bs,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque);
@@ -83,15 +95,13 @@ static BlockDriverAIOCB *bdrv_co_aio_rw_vector(BlockDriverState *bs,
                                                void *opaque,
                                                bool is_write);
 static void coroutine_fn bdrv_co_do_rw(void *opaque);
+static void bdrv_merge_submit(BlockDriverState *bs);
 static int coroutine_fn bdrv_co_do_write_zeroes(BlockDriverState *bs,
     int64_t sector_num, int nb_sectors);
-
-static bool bdrv_exceed_bps_limits(BlockDriverState *bs, int nb_sectors,
-        bool is_write, double elapsed_time, uint64_t *wait);
-static bool bdrv_exceed_iops_limits(BlockDriverState *bs, bool is_write,
-        double elapsed_time, uint64_t *wait);
-static bool bdrv_exceed_io_limits(BlockDriverState *bs, int nb_sectors,
-        bool is_write, int64_t *wait);
+static BlockLatencyHistogramInfo *
+bdrv_query_latency_histogram(const BlockLatencyHistogram *hist);
+static BlockDeviceTimedStatsList *
+bdrv_query_timed_stats(const BlockDriverState *bs);
 
 static QTAILQ_HEAD(, BlockDriverState) bdrv_states =
     QTAILQ_HEAD_INITIALIZER(bdrv_states);
@@ -105,6 +115,13 @@ static BlockDriverState *bs_snapshots;
 /* If non-zero, use only whitelisted block drivers */
 static int use_bdrv_whitelist;
 
+/* Latency accounting defaults for devices */
+static const uint64_t bdrv_default_latency_boundaries[] = {
+    10 * SCALE_US, 100 * SCALE_US, SCALE_MS, 10 * SCALE_MS, 100 * SCALE_MS,
+    1000 * SCALE_MS, 10000ULL * SCALE_MS,
+};
+static const uint64_t bdrv_default_stats_intervals[] = { 1, 60, 3600 };
+
 #ifdef _WIN32
 static int is_windows_drive_prefix(const char *filename)
 {
@@ -126,39 +143,250 @@ int is_windows_drive(const char *filename)
 #endif
 
 /* throttling disk I/O limits */
-void bdrv_io_limits_disable(BlockDriverState *bs)
+typedef struct BlockIOBucket {
+    double level;           /* units waiting to leak out at the average rate */
+    double burst_level;     /* units waiting to leak out at the burst rate */
+} BlockIOBucket;
+
+struct BlockThrottleGroup {
+    char name[32];          /* empty for the private group of one device */
+    unsigned int refcnt;
+    BlockIOLimit limits;
+    BlockIOBucket bps[3];
+    BlockIOBucket iops[3];
+    int64_t previous_leak;
+    QEMUTimer *timer;
+    QLIST_HEAD(, BlockDriverState) members;
+    BlockDriverState *token; /* member that dispatched the last request */
+    QLIST_ENTRY(BlockThrottleGroup) list;
+};
+
+static QLIST_HEAD(, BlockThrottleGroup) throttle_groups =
+    QLIST_HEAD_INITIALIZER(throttle_groups);
+
+static void throttle_bucket_leak(BlockIOBucket *bkt, int64_t avg, int64_t max,
+                                 double delta)
 {
-    bs->io_limits_enabled = false;
+    bkt->level = MAX(bkt->level - avg * delta, 0);
+    bkt->burst_level = MAX(bkt->burst_level - max * delta, 0);
+}
 
-    while (qemu_co_queue_next(&bs->throttled_reqs));
+static void throttle_bucket_fill(BlockIOBucket *bkt, int64_t avg,
+                                 double units)
+{
+    if (avg) {
+        bkt->level += units;
+        bkt->burst_level += units;
+    }
+}
+
+/* Return the time in nanoseconds until @bkt has room for another request */
+static int64_t throttle_bucket_wait(BlockIOBucket *bkt, int64_t avg,
+                                    int64_t max, int64_t burst_length)
+{
+    double size, extra, wait = 0;
+
+    if (!avg) {
+        return 0;
+    }
+
+    size = max ? (double)max * burst_length : avg / 10.0;
+    extra = bkt->level - size;
+    if (extra > 0) {
+        wait = extra / avg;
+    }
+
+    if (max) {
+        extra = bkt->burst_level - max / 10.0;
+        if (extra > 0) {
+            wait = MAX(wait, extra / max);
+        }
+    }
+
+    return wait * NANOSECONDS_PER_SECOND;
+}
+
+static void throttle_leak(BlockThrottleGroup *tg, int64_t now)
+{
+    BlockIOLimit *l = &tg->limits;
+    double delta;
+    int i;
+
+    delta = (now - tg->previous_leak) / NANOSECONDS_PER_SECOND;
+    if (delta <= 0) {
+        return;
+    }
+    tg->previous_leak = now;
+
+    for (i = 0; i < 3; i++) {
+        throttle_bucket_leak(&tg->bps[i], l->bps[i], l->bps_max[i], delta);
+        throttle_bucket_leak(&tg->iops[i], l->iops[i], l->iops_max[i], delta);
+    }
+}
+
+static int64_t throttle_compute_wait(BlockThrottleGroup *tg, bool is_write,
+                                     int64_t now)
+{
+    BlockIOLimit *l = &tg->limits;
+    int dirs[2] = { is_write, BLOCK_IO_LIMIT_TOTAL };
+    int64_t wait = 0;
+    int i, d;
+
+    throttle_leak(tg, now);
+
+    for (i = 0; i < 2; i++) {
+        d = dirs[i];
+        wait = MAX(wait, throttle_bucket_wait(&tg->bps[d], l->bps[d],
+                                              l->bps_max[d], l->burst_length));
+        wait = MAX(wait, throttle_bucket_wait(&tg->iops[d], l->iops[d],
+                                              l->iops_max[d], l->burst_length));
+    }
+
+    return wait;
+}
+
+static void throttle_account(BlockThrottleGroup *tg, bool is_write,
+                             uint64_t bytes)
+{
+    BlockIOLimit *l = &tg->limits;
+    int dirs[2] = { is_write, BLOCK_IO_LIMIT_TOTAL };
+    double units = 1;
+    int i, d;
+
+    /* a large request costs as much as the iops_size requests it replaces */
+    if (l->iops_size && bytes > l->iops_size) {
+        units = (double)bytes / l->iops_size;
+    }
+
+    for (i = 0; i < 2; i++) {
+        d = dirs[i];
+        throttle_bucket_fill(&tg->bps[d], l->bps[d], bytes);
+        throttle_bucket_fill(&tg->iops[d], l->iops[d], units);
+    }
+}
+
+static BlockDriverState *throttle_group_next_member(BlockThrottleGroup *tg,
+                                                    BlockDriverState *bs)
+{
+    BlockDriverState *next = QLIST_NEXT(bs, throttle_list);
+
+    return next ? next : QLIST_FIRST(&tg->members);
+}
+
+/* Wake the first queued request of the member after the one that was served
+ * last, so that the devices in a group take turns.  Nothing is done while
+ * the timer is armed: it will call back here once there is budget again.
+ */
+static void throttle_group_schedule_next(BlockThrottleGroup *tg)
+{
+    BlockDriverState *start, *bs;
+
+    if (qemu_timer_pending(tg->timer) || QLIST_EMPTY(&tg->members)) {
+        return;
+    }
+
+    start = tg->token ? throttle_group_next_member(tg, tg->token)
+                      : QLIST_FIRST(&tg->members);
+    bs = start;
+    do {
+        if (qemu_co_queue_next(&bs->throttled_reqs)) {
+            return;
+        }
+        bs = throttle_group_next_member(tg, bs);
+    } while (bs != start);
+}
+
+static void throttle_group_timer(void *opaque)
+{
+    throttle_group_schedule_next(opaque);
+}
+
+static BlockThrottleGroup *throttle_group_get(const char *name)
+{
+    BlockThrottleGroup *tg;
+
+    if (name[0]) {
+        QLIST_FOREACH(tg, &throttle_groups, list) {
+            if (!strcmp(tg->name, name)) {
+                tg->refcnt++;
+                return tg;
+            }
+        }
+    }
+
+    tg = g_malloc0(sizeof(*tg));
+    pstrcpy(tg->name, sizeof(tg->name), name);
+    tg->refcnt = 1;
+    tg->previous_leak = qemu_get_clock_ns(vm_clock);
+    tg->timer = qemu_new_timer_ns(vm_clock, throttle_group_timer, tg);
+    QLIST_INIT(&tg->members);
+    QLIST_INSERT_HEAD(&throttle_groups, tg, list);
+    return tg;
+}
+
+static void throttle_group_put(BlockThrottleGroup *tg)
+{
+    if (--tg->refcnt) {
+        return;
+    }
+
+    QLIST_REMOVE(tg, list);
+    qemu_del_timer(tg->timer);
+    qemu_free_timer(tg->timer);
+    g_free(tg);
+}
+
+/* The limits last set on any member apply to the whole group */
+static void throttle_group_config(BlockThrottleGroup *tg,
+                                  BlockIOLimit *io_limits)
+{
+    BlockDriverState *bs;
+    int i;
 
-    if (bs->block_timer) {
-        qemu_del_timer(bs->block_timer);
-        qemu_free_timer(bs->block_timer);
-        bs->block_timer = NULL;
+    tg->limits = *io_limits;
+    for (i = 0; i < 3; i++) {
+        if (!io_limits->bps[i]) {
+            memset(&tg->bps[i], 0, sizeof(tg->bps[i]));
+        }
+        if (!io_limits->iops[i]) {
+            memset(&tg->iops[i], 0, sizeof(tg->iops[i]));
+        }
     }
 
-    bs->slice_start = 0;
-    bs->slice_end   = 0;
-    bs->slice_time  = 0;
-    memset(&bs->io_base, 0, sizeof(bs->io_base));
+    QLIST_FOREACH(bs, &tg->members, throttle_list) {
+        bs->io_limits = *io_limits;
+    }
 }
 
-static void bdrv_block_timer(void *opaque)
+void bdrv_io_limits_disable(BlockDriverState *bs)
 {
-    BlockDriverState *bs = opaque;
+    BlockThrottleGroup *tg = bs->throttle_group;
+
+    bs->io_limits_enabled = false;
+
+    if (tg) {
+        bs->throttle_group = NULL;
+        QLIST_REMOVE(bs, throttle_list);
+        if (tg->token == bs) {
+            tg->token = NULL;
+        }
+        throttle_group_put(tg);
+    }
 
-    qemu_co_queue_next(&bs->throttled_reqs);
+    while (qemu_co_queue_next(&bs->throttled_reqs));
 }
 
 void bdrv_io_limits_enable(BlockDriverState *bs)
 {
+    BlockThrottleGroup *tg;
+
+    assert(!bs->throttle_group);
+
     qemu_co_queue_init(&bs->throttled_reqs);
-    bs->block_timer = qemu_new_timer_ns(vm_clock, bdrv_block_timer, bs);
-    bs->slice_time  = 5 * BLOCK_IO_SLICE_TIME;
-    bs->slice_start = qemu_get_clock_ns(vm_clock);
-    bs->slice_end   = bs->slice_start + bs->slice_time;
-    memset(&bs->io_base, 0, sizeof(bs->io_base));
+    tg = throttle_group_get(bs->io_limits.group);
+    QLIST_INSERT_HEAD(&tg->members, bs, throttle_list);
+    bs->throttle_group = tg;
+    throttle_group_config(tg, &bs->io_limits);
     bs->io_limits_enabled = true;
 }
 
@@ -173,29 +401,42 @@ bool bdrv_io_limits_enabled(BlockDriverState *bs)
          || io_limits->iops[BLOCK_IO_LIMIT_TOTAL];
 }
 
-static void bdrv_io_limits_intercept(BlockDriverState *bs,
-                                     bool is_write, int nb_sectors)
+static void coroutine_fn bdrv_io_limits_intercept(BlockDriverState *bs,
+                                                  bool is_write,
+                                                  int nb_sectors)
 {
-    int64_t wait_time = -1;
+    BlockThrottleGroup *tg = bs->throttle_group;
+    int64_t now, wait;
 
-    if (!qemu_co_queue_empty(&bs->throttled_reqs)) {
+    /* Requests are served in FIFO order on each device.  While the group
+     * timer is armed some member is already waiting for budget, so queue
+     * up behind it and let the round-robin pick us.
+     */
+    if (!qemu_co_queue_empty(&bs->throttled_reqs) ||
+        (tg && qemu_timer_pending(tg->timer))) {
         qemu_co_queue_wait(&bs->throttled_reqs);
     }
 
-    /* In fact, we hope to keep each request's timing, in FIFO mode. The next
-     * throttled requests will not be dequeued until the current request is
-     * allowed to be serviced. So if the current request still exceeds the
-     * limits, it will be inserted to the head. All requests followed it will
-     * be still in throttled_reqs queue.
-     */
+    for (;;) {
+        tg = bs->throttle_group;
+        if (!tg) {
+            /* throttling was switched off while we were queued */
+            return;
+        }
+
+        now = qemu_get_clock_ns(vm_clock);
+        wait = throttle_compute_wait(tg, is_write, now);
+        if (!wait) {
+            break;
+        }
 
-    while (bdrv_exceed_io_limits(bs, nb_sectors, is_write, &wait_time)) {
-        qemu_mod_timer(bs->block_timer,
-                       wait_time + qemu_get_clock_ns(vm_clock));
+        qemu_mod_timer(tg->timer, now + wait);
         qemu_co_queue_wait_insert_head(&bs->throttled_reqs);
     }
 
-    qemu_co_queue_next(&bs->throttled_reqs);
+    throttle_account(tg, is_write, (uint64_t)nb_sectors * BDRV_SECTOR_SIZE);
+    tg->token = bs;
+    throttle_group_schedule_next(tg);
 }
 
 /* check if the path starts with "<protocol>:" */
@@ -314,6 +555,16 @@ BlockDriverState *bdrv_new(const char *device_name)
     }
     bdrv_iostatus_disable(bs);
     notifier_list_init(&bs->close_notifiers);
+    notifier_with_return_list_init(&bs->before_write_notifiers);
+    QTAILQ_INIT(&bs->merge_queue);
+    bs->aio_context = qemu_get_aio_context();
+
+    /* latency accounting is always on for devices */
+    if (device_name[0] != '\0') {
+        bdrv_reset_latency_histograms(bs);
+        bdrv_set_stats_intervals(bs, bdrv_default_stats_intervals,
+                                 ARRAY_SIZE(bdrv_default_stats_intervals));
+    }
 
     return bs;
 }
@@ -323,6 +574,12 @@ void bdrv_add_close_notifier(BlockDriverState *bs, Notifier *notify)
     notifier_list_add(&bs->close_notifiers, notify);
 }
 
+void bdrv_add_before_write_notifier(BlockDriverState *bs,
+                                    NotifierWithReturn *notifier)
+{
+    notifier_with_return_list_add(&bs->before_write_notifiers, notifier);
+}
+
 BlockDriver *bdrv_find_format(const char *format_name)
 {
     BlockDriver *drv1;
@@ -880,6 +1137,10 @@ int bdrv_open(BlockDriverState *bs, const char *filename, int flags,
         bdrv_dev_change_media_cb(bs, true);
     }
 
+    if (bdrv_shared_cache_enabled()) {
+        bs->shared_cache_id = bdrv_shared_cache_image_id(bs);
+    }
+
     /* throttling disk I/O limits */
     if (bs->io_limits_enabled) {
         bdrv_io_limits_enable(bs);
@@ -894,6 +1155,58 @@ unlink_and_fail:
     return ret;
 }
 
+typedef struct OpenCo {
+    BlockDriverState *bs;
+    char *filename;
+    int flags;
+    BlockDriver *drv;
+    BlockDriverCompletionFunc *cb;
+    void *opaque;
+} OpenCo;
+
+static void coroutine_fn bdrv_open_co_entry(void *opaque)
+{
+    OpenCo *oco = opaque;
+    int ret;
+
+    ret = bdrv_open(oco->bs, oco->filename, oco->flags, oco->drv);
+    oco->cb(oco->opaque, ret);
+
+    g_free(oco->filename);
+    g_free(oco);
+}
+
+/*
+ * Opens a disk image like bdrv_open(), but in a coroutine that yields
+ * whenever the image or its backing files wait for I/O.  Several images
+ * opened this way make progress at the same time, which hides the latency
+ * of header and table reads on network storage.  Protocols that connect
+ * synchronously still block while they do so.
+ *
+ * cb is called with the result of bdrv_open() when the image is open; this
+ * can happen before bdrv_open_async() returns.  The caller runs the event
+ * loop until then, e.g. with qemu_aio_wait().
+ */
+void bdrv_open_async(BlockDriverState *bs, const char *filename, int flags,
+                     BlockDriver *drv, BlockDriverCompletionFunc *cb,
+                     void *opaque)
+{
+    Coroutine *co;
+    OpenCo *oco = g_new(OpenCo, 1);
+
+    *oco = (OpenCo) {
+        .bs         = bs,
+        .filename   = g_strdup(filename),
+        .flags      = flags,
+        .drv        = drv,
+        .cb         = cb,
+        .opaque     = opaque,
+    };
+
+    co = qemu_coroutine_create(bdrv_open_co_entry);
+    qemu_coroutine_enter(co, oco);
+}
+
 typedef struct BlockReopenQueueEntry {
      bool prepared;
      BDRVReopenState state;
@@ -1106,6 +1419,11 @@ void bdrv_reopen_commit(BDRVReopenState *reopen_state)
     reopen_state->bs->enable_write_cache = !!(reopen_state->flags &
                                               BDRV_O_CACHE_WB);
     reopen_state->bs->read_only = !(reopen_state->flags & BDRV_O_RDWR);
+
+    /* Once writable, the image may no longer match what is cached */
+    if (!reopen_state->bs->read_only) {
+        reopen_state->bs->shared_cache_id = 0;
+    }
 }
 
 /*
@@ -1126,15 +1444,54 @@ void bdrv_reopen_abort(BDRVReopenState *reopen_state)
 }
 
 
+/* Waits for the requests on bs and the images below it to complete */
+static void coroutine_fn bdrv_co_wait_requests(BlockDriverState *bs)
+{
+    BdrvTrackedRequest *req;
+
+    if (!bs) {
+        return;
+    }
+    while ((req = QLIST_FIRST(&bs->tracked_requests)) != NULL) {
+        qemu_co_queue_wait(&req->wait_queue);
+    }
+    bdrv_co_wait_requests(bs->file);
+    bdrv_co_wait_requests(bs->backing_hd);
+}
+
+/*
+ * bdrv_open() runs in a coroutine under bdrv_open_async() and closes
+ * images on its probe and error paths.  A blocking bdrv_drain_all() there
+ * would run the other images being opened nested on this coroutine's
+ * stack until they are done, and they may be waiting for this one.  Only
+ * bs needs to be idle in that case, so yield until it is.
+ */
+static void bdrv_close_drain(BlockDriverState *bs)
+{
+    if (qemu_in_coroutine()) {
+        bdrv_co_wait_requests(bs);
+    } else {
+        bdrv_drain_all();
+    }
+}
+
 void bdrv_close(BlockDriverState *bs)
 {
+    /* the final flush must cover writes still waiting to be merged */
+    if (!QTAILQ_EMPTY(&bs->merge_queue)) {
+        bdrv_drain_all();
+    }
     bdrv_flush(bs);
     if (bs->job) {
         block_job_cancel_sync(bs->job);
     }
-    bdrv_drain_all();
+    bdrv_close_drain(bs);
     notifier_list_notify(&bs->close_notifiers, bs);
 
+    if (bs->prefetch_recorder) {
+        prefetch_record_stop(bs, NULL);
+    }
+
     if (bs->drv) {
         if (bs == bs_snapshots) {
             bs_snapshots = NULL;
@@ -1144,6 +1501,9 @@ void bdrv_close(BlockDriverState *bs)
             bs->backing_hd = NULL;
         }
         bs->drv->bdrv_close(bs);
+        while (!QLIST_EMPTY(&bs->dirty_bitmaps)) {
+            bdrv_release_dirty_bitmap(bs, QLIST_FIRST(&bs->dirty_bitmaps));
+        }
         g_free(bs->opaque);
 #ifdef _WIN32
         if (bs->is_temporary) {
@@ -1160,6 +1520,8 @@ void bdrv_close(BlockDriverState *bs)
         bs->valid_key = 0;
         bs->sg = 0;
         bs->growable = 0;
+        bs->discard_granularity = 0;
+        bs->shared_cache_id = 0;
 
         if (bs->file != NULL) {
             bdrv_delete(bs->file);
@@ -1184,6 +1546,42 @@ void bdrv_close_all(void)
     }
 }
 
+static bool bdrv_requests_pending(BlockDriverState *bs)
+{
+    if (!QLIST_EMPTY(&bs->tracked_requests) ||
+        !qemu_co_queue_empty(&bs->throttled_reqs) ||
+        !QTAILQ_EMPTY(&bs->merge_queue)) {
+        return true;
+    }
+    if (bs->file && bdrv_requests_pending(bs->file)) {
+        return true;
+    }
+    if (bs->backing_hd && bdrv_requests_pending(bs->backing_hd)) {
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Wait for pending requests to complete on bs and the images below it
+ *
+ * Completions may submit I/O to other devices, which is left running; use
+ * this when only bs needs to be quiescent, e.g. before snapshotting it, and
+ * bdrv_drain_all() when the whole VM must be.
+ */
+void bdrv_drain(BlockDriverState *bs)
+{
+    while (bdrv_requests_pending(bs)) {
+        if (!qemu_co_queue_empty(&bs->throttled_reqs)) {
+            qemu_co_queue_restart_all(&bs->throttled_reqs);
+        }
+        if (!QTAILQ_EMPTY(&bs->merge_queue)) {
+            bdrv_merge_submit(bs);
+        }
+        aio_poll(bdrv_get_aio_context(bs), true);
+    }
+}
+
 /*
  * Wait for pending requests to complete across all BlockDriverStates
  *
@@ -1193,8 +1591,8 @@ void bdrv_close_all(void)
  * Note that completion of an asynchronous I/O operation can trigger any
  * number of other I/O operations on other devices---for example a coroutine
  * can be arbitrarily complex and a constant flow of I/O can come until the
- * coroutine is complete.  Because of this, it is not possible to have a
- * function to drain a single device's I/O queue.
+ * coroutine is complete.  Because of this, draining a single device with
+ * bdrv_drain() does not make the other devices quiescent.
  */
 void bdrv_drain_all(void)
 {
@@ -1212,6 +1610,10 @@ void bdrv_drain_all(void)
                 qemu_co_queue_restart_all(&bs->throttled_reqs);
                 busy = true;
             }
+            if (!QTAILQ_EMPTY(&bs->merge_queue)) {
+                bdrv_merge_submit(bs);
+                busy = true;
+            }
         }
     } while (busy);
 
@@ -1219,6 +1621,7 @@ void bdrv_drain_all(void)
     QTAILQ_FOREACH(bs, &bdrv_states, list) {
         assert(QLIST_EMPTY(&bs->tracked_requests));
         assert(qemu_co_queue_empty(&bs->throttled_reqs));
+        assert(QTAILQ_EMPTY(&bs->merge_queue));
     }
 }
 
@@ -1254,16 +1657,28 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
 
     bs_dest->enable_write_cache = bs_src->enable_write_cache;
 
-    /* i/o timing parameters */
-    bs_dest->slice_time         = bs_src->slice_time;
-    bs_dest->slice_start        = bs_src->slice_start;
-    bs_dest->slice_end          = bs_src->slice_end;
+    /* i/o throttling */
     bs_dest->io_limits          = bs_src->io_limits;
-    bs_dest->io_base            = bs_src->io_base;
+    bs_dest->throttle_group     = bs_src->throttle_group;
+    bs_dest->throttle_list      = bs_src->throttle_list;
     bs_dest->throttled_reqs     = bs_src->throttled_reqs;
-    bs_dest->block_timer        = bs_src->block_timer;
     bs_dest->io_limits_enabled  = bs_src->io_limits_enabled;
 
+    /* latency accounting */
+    memcpy(bs_dest->latency_histogram, bs_src->latency_histogram,
+           sizeof(bs_dest->latency_histogram));
+    memcpy(bs_dest->timed_stats, bs_src->timed_stats,
+           sizeof(bs_dest->timed_stats));
+    bs_dest->nb_stats_intervals = bs_src->nb_stats_intervals;
+
+    /* request merging */
+    bs_dest->io_merge_enabled   = bs_src->io_merge_enabled;
+    bs_dest->merge_window_ns    = bs_src->merge_window_ns;
+    bs_dest->merge_timer        = bs_src->merge_timer;
+    bs_dest->merge_queue        = bs_src->merge_queue;
+    bs_dest->merge_queue_len    = bs_src->merge_queue_len;
+    bs_dest->io_plug_depth      = bs_src->io_plug_depth;
+
     /* r/w error */
     bs_dest->on_read_error      = bs_src->on_read_error;
     bs_dest->on_write_error     = bs_src->on_write_error;
@@ -1273,8 +1688,11 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
     bs_dest->iostatus           = bs_src->iostatus;
 
     /* dirty bitmap */
-    bs_dest->dirty_count        = bs_src->dirty_count;
     bs_dest->dirty_bitmap       = bs_src->dirty_bitmap;
+    bs_dest->dirty_bitmaps      = bs_src->dirty_bitmaps;
+
+    /* before write notifiers */
+    bs_dest->before_write_notifiers = bs_src->before_write_notifiers;
 
     /* job */
     bs_dest->in_use             = bs_src->in_use;
@@ -1286,6 +1704,25 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
     bs_dest->list = bs_src->list;
 }
 
+static void bdrv_fix_moved_lists(BlockDriverState *bs)
+{
+    BdrvDirtyBitmap *bitmap = QLIST_FIRST(&bs->dirty_bitmaps);
+    NotifierWithReturn *notifier =
+        QLIST_FIRST(&bs->before_write_notifiers.notifiers);
+
+    if (bitmap) {
+        bitmap->list.le_prev = &QLIST_FIRST(&bs->dirty_bitmaps);
+    }
+    if (notifier) {
+        notifier->node.le_prev =
+            &QLIST_FIRST(&bs->before_write_notifiers.notifiers);
+    }
+
+    /* bdrv_swap() callers drain first, so the merge queue is empty */
+    assert(QTAILQ_EMPTY(&bs->merge_queue));
+    QTAILQ_INIT(&bs->merge_queue);
+}
+
 /*
  * Swap bs contents for two image chains while they are live,
  * while keeping required fields on the BlockDriverState that is
@@ -1309,7 +1746,7 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
     assert(bs_new->dev == NULL);
     assert(bs_new->in_use == 0);
     assert(bs_new->io_limits_enabled == false);
-    assert(bs_new->block_timer == NULL);
+    assert(bs_new->throttle_group == NULL);
 
     tmp = *bs_new;
     *bs_new = *bs_old;
@@ -1320,6 +1757,10 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
     bdrv_move_feature_fields(bs_old, bs_new);
     bdrv_move_feature_fields(bs_new, &tmp);
 
+    /* The first element of a moved list still points back to the old head */
+    bdrv_fix_moved_lists(bs_new);
+    bdrv_fix_moved_lists(bs_old);
+
     /* bs_new shouldn't be in bdrv_states even after the swap!  */
     assert(bs_new->device_name[0] == '\0');
 
@@ -1328,7 +1769,7 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
     assert(bs_new->job == NULL);
     assert(bs_new->in_use == 0);
     assert(bs_new->io_limits_enabled == false);
-    assert(bs_new->block_timer == NULL);
+    assert(bs_new->throttle_group == NULL);
 
     bdrv_rebind(bs_new);
     bdrv_rebind(bs_old);
@@ -1361,6 +1802,8 @@ void bdrv_append(BlockDriverState *bs_new, BlockDriverState *bs_top)
 
 void bdrv_delete(BlockDriverState *bs)
 {
+    int i;
+
     assert(!bs->dev);
     assert(!bs->job);
     assert(!bs->in_use);
@@ -1369,6 +1812,10 @@ void bdrv_delete(BlockDriverState *bs)
     bdrv_make_anon(bs);
 
     bdrv_close(bs);
+    bdrv_set_io_merge(bs, false, 0);
+    for (i = 0; i < BDRV_MAX_IOTYPE; i++) {
+        bdrv_set_latency_histogram(bs, i, NULL, 0);
+    }
 
     assert(bs != bs_snapshots);
     g_free(bs);
@@ -1616,16 +2063,6 @@ int bdrv_commit_all(void)
     return 0;
 }
 
-struct BdrvTrackedRequest {
-    BlockDriverState *bs;
-    int64_t sector_num;
-    int nb_sectors;
-    bool is_write;
-    QLIST_ENTRY(BdrvTrackedRequest) list;
-    Coroutine *co; /* owner, used for deadlock detection */
-    CoQueue wait_queue; /* coroutines blocked on this request */
-};
-
 /**
  * Remove an active request from the tracked requests list
  *
@@ -1661,10 +2098,10 @@ static void tracked_request_begin(BdrvTrackedRequest *req,
 /**
  * Round a region to cluster boundaries
  */
-static void round_to_clusters(BlockDriverState *bs,
-                              int64_t sector_num, int nb_sectors,
-                              int64_t *cluster_sector_num,
-                              int *cluster_nb_sectors)
+void bdrv_round_to_clusters(BlockDriverState *bs,
+                            int64_t sector_num, int nb_sectors,
+                            int64_t *cluster_sector_num,
+                            int *cluster_nb_sectors)
 {
     BlockDriverInfo bdi;
 
@@ -1706,7 +2143,7 @@ static void coroutine_fn wait_for_overlapping_requests(BlockDriverState *bs,
      * CoR read and write operations are atomic and guest writes cannot
      * interleave between them.
      */
-    round_to_clusters(bs, sector_num, nb_sectors,
+    bdrv_round_to_clusters(bs, sector_num, nb_sectors,
                       &cluster_sector_num, &cluster_nb_sectors);
 
     do {
@@ -1939,6 +2376,7 @@ typedef struct RwCo {
     QEMUIOVector *qiov;
     bool is_write;
     int ret;
+    BdrvRequestFlags flags;
 } RwCo;
 
 static void coroutine_fn bdrv_rw_co_entry(void *opaque)
@@ -1950,7 +2388,8 @@ static void coroutine_fn bdrv_rw_co_entry(void *opaque)
                                      rwco->nb_sectors, rwco->qiov, 0);
     } else {
         rwco->ret = bdrv_co_do_writev(rwco->bs, rwco->sector_num,
-                                      rwco->nb_sectors, rwco->qiov, 0);
+                                      rwco->nb_sectors, rwco->qiov,
+                                      rwco->flags);
     }
 }
 
@@ -1958,7 +2397,7 @@ static void coroutine_fn bdrv_rw_co_entry(void *opaque)
  * Process a synchronous request using coroutines
  */
 static int bdrv_rw_co(BlockDriverState *bs, int64_t sector_num, uint8_t *buf,
-                      int nb_sectors, bool is_write)
+                      int nb_sectors, bool is_write, BdrvRequestFlags flags)
 {
     QEMUIOVector qiov;
     struct iovec iov = {
@@ -1970,9 +2409,10 @@ static int bdrv_rw_co(BlockDriverState *bs, int64_t sector_num, uint8_t *buf,
         .bs = bs,
         .sector_num = sector_num,
         .nb_sectors = nb_sectors,
-        .qiov = &qiov,
+        .qiov = buf ? &qiov : NULL,
         .is_write = is_write,
         .ret = NOT_DONE,
+        .flags = flags,
     };
 
     qemu_iovec_init_external(&qiov, &iov, 1);
@@ -1995,7 +2435,7 @@ static int bdrv_rw_co(BlockDriverState *bs, int64_t sector_num, uint8_t *buf,
         co = qemu_coroutine_create(bdrv_rw_co_entry);
         qemu_coroutine_enter(co, &rwco);
         while (rwco.ret == NOT_DONE) {
-            qemu_aio_wait();
+            aio_poll(bdrv_get_aio_context(bs), true);
         }
     }
     return rwco.ret;
@@ -2005,7 +2445,7 @@ static int bdrv_rw_co(BlockDriverState *bs, int64_t sector_num, uint8_t *buf,
 int bdrv_read(BlockDriverState *bs, int64_t sector_num,
               uint8_t *buf, int nb_sectors)
 {
-    return bdrv_rw_co(bs, sector_num, buf, nb_sectors, false);
+    return bdrv_rw_co(bs, sector_num, buf, nb_sectors, false, 0);
 }
 
 /* Just like bdrv_read(), but with I/O throttling temporarily disabled */
@@ -2022,36 +2462,6 @@ int bdrv_read_unthrottled(BlockDriverState *bs, int64_t sector_num,
     return ret;
 }
 
-#define BITS_PER_LONG  (sizeof(unsigned long) * 8)
-
-static void set_dirty_bitmap(BlockDriverState *bs, int64_t sector_num,
-                             int nb_sectors, int dirty)
-{
-    int64_t start, end;
-    unsigned long val, idx, bit;
-
-    start = sector_num / BDRV_SECTORS_PER_DIRTY_CHUNK;
-    end = (sector_num + nb_sectors - 1) / BDRV_SECTORS_PER_DIRTY_CHUNK;
-
-    for (; start <= end; start++) {
-        idx = start / BITS_PER_LONG;
-        bit = start % BITS_PER_LONG;
-        val = bs->dirty_bitmap[idx];
-        if (dirty) {
-            if (!(val & (1UL << bit))) {
-                bs->dirty_count++;
-                val |= 1UL << bit;
-            }
-        } else {
-            if (val & (1UL << bit)) {
-                bs->dirty_count--;
-                val &= ~(1UL << bit);
-            }
-        }
-        bs->dirty_bitmap[idx] = val;
-    }
-}
-
 /* Return < 0 if error. Important errors are:
   -EIO         generic I/O error (may happen for all errors)
   -ENOMEDIUM   No media inserted.
@@ -2061,7 +2471,15 @@ static void set_dirty_bitmap(BlockDriverState *bs, int64_t sector_num,
 int bdrv_write(BlockDriverState *bs, int64_t sector_num,
                const uint8_t *buf, int nb_sectors)
 {
-    return bdrv_rw_co(bs, sector_num, (uint8_t *)buf, nb_sectors, true);
+    return bdrv_rw_co(bs, sector_num, (uint8_t *)buf, nb_sectors, true, 0);
+}
+
+/* Synchronous version of bdrv_co_write_zeroes() */
+int bdrv_write_zeroes(BlockDriverState *bs, int64_t sector_num,
+                      int nb_sectors)
+{
+    return bdrv_rw_co(bs, sector_num, NULL, nb_sectors, true,
+                      BDRV_REQ_ZERO_WRITE);
 }
 
 int bdrv_pread(BlockDriverState *bs, int64_t offset,
@@ -2203,7 +2621,7 @@ static int coroutine_fn bdrv_co_do_copy_on_readv(BlockDriverState *bs,
     /* Cover entire cluster so no additional backing file I/O is required when
      * allocating cluster in the image file.
      */
-    round_to_clusters(bs, sector_num, nb_sectors,
+    bdrv_round_to_clusters(bs, sector_num, nb_sectors,
                       &cluster_sector_num, &cluster_nb_sectors);
 
     trace_bdrv_co_do_copy_on_readv(bs, sector_num, nb_sectors,
@@ -2266,19 +2684,25 @@ static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
         return -EIO;
     }
 
+    /* Explicit copy-on-read comes from streaming, not from the guest */
+    if (bs->prefetch_recorder && !(flags & BDRV_REQ_COPY_ON_READ)) {
+        prefetch_record_read(bs, sector_num, nb_sectors);
+    }
+
     /* throttling disk read I/O */
     if (bs->io_limits_enabled) {
         bdrv_io_limits_intercept(bs, false, nb_sectors);
     }
 
-    if (bs->copy_on_read) {
+    if (bs->copy_on_read && !(flags & BDRV_REQ_NO_COPY_ON_READ)) {
         flags |= BDRV_REQ_COPY_ON_READ;
     }
     if (flags & BDRV_REQ_COPY_ON_READ) {
         bs->copy_on_read_in_flight++;
     }
 
-    if (bs->copy_on_read_in_flight) {
+    if ((bs->copy_on_read_in_flight || bs->serialising_in_flight) &&
+        !(flags & BDRV_REQ_NO_COPY_ON_READ)) {
         wait_for_overlapping_requests(bs, sector_num, nb_sectors);
     }
 
@@ -2298,7 +2722,11 @@ static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
         }
     }
 
-    ret = drv->bdrv_co_readv(bs, sector_num, nb_sectors, qiov);
+    if (bs->shared_cache_id && bs->read_only) {
+        ret = bdrv_shared_cache_co_readv(bs, sector_num, nb_sectors, qiov);
+    } else {
+        ret = drv->bdrv_co_readv(bs, sector_num, nb_sectors, qiov);
+    }
 
 out:
     tracked_request_end(&req);
@@ -2327,6 +2755,18 @@ int coroutine_fn bdrv_co_copy_on_readv(BlockDriverState *bs,
                             BDRV_REQ_COPY_ON_READ);
 }
 
+/* Read without copy-on-read and without waiting for overlapping requests.
+ * This is for callers that run inside a write request themselves.
+ */
+int coroutine_fn bdrv_co_no_copy_on_readv(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+{
+    trace_bdrv_co_no_copy_on_readv(bs, sector_num, nb_sectors);
+
+    return bdrv_co_do_readv(bs, sector_num, nb_sectors, qiov,
+                            BDRV_REQ_NO_COPY_ON_READ);
+}
+
 static int coroutine_fn bdrv_co_do_write_zeroes(BlockDriverState *bs,
     int64_t sector_num, int nb_sectors)
 {
@@ -2384,13 +2824,20 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
         bdrv_io_limits_intercept(bs, true, nb_sectors);
     }
 
-    if (bs->copy_on_read_in_flight) {
+    if (flags & BDRV_REQ_SERIALISING) {
+        bs->serialising_in_flight++;
+    }
+    if (bs->copy_on_read_in_flight || bs->serialising_in_flight) {
         wait_for_overlapping_requests(bs, sector_num, nb_sectors);
     }
 
     tracked_request_begin(&req, bs, sector_num, nb_sectors, true);
 
-    if (flags & BDRV_REQ_ZERO_WRITE) {
+    ret = notifier_with_return_list_notify(&bs->before_write_notifiers, &req);
+
+    if (ret < 0) {
+        /* Do nothing, write notifier decided to fail this request */
+    } else if (flags & BDRV_REQ_ZERO_WRITE) {
         ret = bdrv_co_do_write_zeroes(bs, sector_num, nb_sectors);
     } else {
         ret = drv->bdrv_co_writev(bs, sector_num, nb_sectors, qiov);
@@ -2403,6 +2850,7 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
     if (bs->dirty_bitmap) {
         bdrv_set_dirty(bs, sector_num, nb_sectors);
     }
+    bdrv_set_dirty_bitmaps(bs, sector_num, nb_sectors);
 
     if (bs->wr_highest_sector < sector_num + nb_sectors - 1) {
         bs->wr_highest_sector = sector_num + nb_sectors - 1;
@@ -2410,6 +2858,10 @@ static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
 
     tracked_request_end(&req);
 
+    if (flags & BDRV_REQ_SERIALISING) {
+        bs->serialising_in_flight--;
+    }
+
     return ret;
 }
 
@@ -2430,12 +2882,35 @@ int coroutine_fn bdrv_co_write_zeroes(BlockDriverState *bs,
                              BDRV_REQ_ZERO_WRITE);
 }
 
+/* Write that cannot interleave with overlapping requests.  Readers of an
+ * image whose old contents are preserved by copy-before-write use this to
+ * see either the old or the copied data, never a mix.
+ */
+int coroutine_fn bdrv_co_serialising_writev(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+{
+    trace_bdrv_co_serialising_writev(bs, sector_num, nb_sectors);
+
+    return bdrv_co_do_writev(bs, sector_num, nb_sectors, qiov,
+                             BDRV_REQ_SERIALISING);
+}
+
+int coroutine_fn bdrv_co_serialising_write_zeroes(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors)
+{
+    trace_bdrv_co_serialising_writev(bs, sector_num, nb_sectors);
+
+    return bdrv_co_do_writev(bs, sector_num, nb_sectors, NULL,
+                             BDRV_REQ_ZERO_WRITE | BDRV_REQ_SERIALISING);
+}
+
 /**
  * Truncate file to 'offset' bytes (needed only for file protocols)
  */
 int bdrv_truncate(BlockDriverState *bs, int64_t offset)
 {
     BlockDriver *drv = bs->drv;
+    int64_t old_sectors;
     int ret;
     if (!drv)
         return -ENOMEDIUM;
@@ -2445,9 +2920,11 @@ int bdrv_truncate(BlockDriverState *bs, int64_t offset)
         return -EACCES;
     if (bdrv_in_use(bs))
         return -EBUSY;
+    old_sectors = bs->total_sectors;
     ret = drv->bdrv_truncate(bs, offset);
     if (ret == 0) {
         ret = refresh_total_sectors(bs, offset >> BDRV_SECTOR_BITS);
+        bdrv_truncate_dirty_bitmaps(bs, old_sectors);
         bdrv_dev_resize_cb(bs);
     }
     return ret;
@@ -2505,8 +2982,28 @@ void bdrv_get_geometry(BlockDriverState *bs, uint64_t *nb_sectors_ptr)
 void bdrv_set_io_limits(BlockDriverState *bs,
                         BlockIOLimit *io_limits)
 {
+    BlockThrottleGroup *tg = bs->throttle_group;
+
     bs->io_limits = *io_limits;
-    bs->io_limits_enabled = bdrv_io_limits_enabled(bs);
+
+    if (tg && (!bdrv_io_limits_enabled(bs) ||
+               strcmp(tg->name, io_limits->group))) {
+        bdrv_io_limits_disable(bs);
+        tg = NULL;
+    }
+
+    if (!bdrv_io_limits_enabled(bs)) {
+        bs->io_limits_enabled = false;
+    } else if (tg) {
+        throttle_group_config(tg, io_limits);
+        /* let queued requests look at the new limits */
+        qemu_mod_timer(tg->timer, qemu_get_clock_ns(vm_clock));
+    } else if (bs->drv) {
+        bdrv_io_limits_enable(bs);
+    } else {
+        /* bdrv_open() joins the group once there is a medium */
+        bs->io_limits_enabled = true;
+    }
 }
 
 void bdrv_set_on_error(BlockDriverState *bs, BlockdevOnError on_read_error,
@@ -2516,14 +3013,37 @@ void bdrv_set_on_error(BlockDriverState *bs, BlockdevOnError on_read_error,
     bs->on_write_error = on_write_error;
 }
 
-BlockdevOnError bdrv_get_on_error(BlockDriverState *bs, bool is_read)
+/*
+ * Set the size of the metadata caches of the image format, 0 meaning the
+ * default.  The sizes are used when the image is opened, and applied right
+ * away if it is open already.  The caller must make sure that no requests
+ * are in flight.
+ */
+int bdrv_set_cache_size(BlockDriverState *bs, uint64_t l2_cache_size,
+                        uint64_t refcount_cache_size)
 {
-    return is_read ? bs->on_read_error : bs->on_write_error;
-}
+    BlockDriver *drv = bs->drv;
 
-BlockErrorAction bdrv_get_error_action(BlockDriverState *bs, bool is_read, int error)
-{
-    BlockdevOnError on_err = is_read ? bs->on_read_error : bs->on_write_error;
+    if (drv && !drv->bdrv_update_cache_size) {
+        return -ENOTSUP;
+    }
+
+    bs->l2_cache_size = l2_cache_size;
+    bs->refcount_cache_size = refcount_cache_size;
+    if (drv) {
+        return drv->bdrv_update_cache_size(bs);
+    }
+    return 0;
+}
+
+BlockdevOnError bdrv_get_on_error(BlockDriverState *bs, bool is_read)
+{
+    return is_read ? bs->on_read_error : bs->on_write_error;
+}
+
+BlockErrorAction bdrv_get_error_action(BlockDriverState *bs, bool is_read, int error)
+{
+    BlockdevOnError on_err = is_read ? bs->on_read_error : bs->on_write_error;
 
     switch (on_err) {
     case BLOCKDEV_ON_ERROR_ENOSPC:
@@ -2564,6 +3084,12 @@ int bdrv_is_sg(BlockDriverState *bs)
     return bs->sg;
 }
 
+/* Returns the granularity in bytes in which discards free space, or 0 */
+uint32_t bdrv_get_discard_granularity(BlockDriverState *bs)
+{
+    return bs->discard_granularity;
+}
+
 int bdrv_enable_write_cache(BlockDriverState *bs)
 {
     return bs->enable_write_cache;
@@ -2677,13 +3203,22 @@ int bdrv_get_flags(BlockDriverState *bs)
     return bs->open_flags;
 }
 
-void bdrv_flush_all(void)
+int bdrv_flush_all(void)
 {
     BlockDriverState *bs;
+    BlockDriverState **bs_list = NULL;
+    int n = 0, ret;
 
     QTAILQ_FOREACH(bs, &bdrv_states, list) {
-        bdrv_flush(bs);
+        if ((n & (n - 1)) == 0) {
+            bs_list = g_renew(BlockDriverState *, bs_list, MAX(n * 2, 16));
+        }
+        bs_list[n++] = bs;
     }
+
+    ret = bdrv_flush_multiple(bs_list, n);
+    g_free(bs_list);
+    return ret;
 }
 
 int bdrv_has_zero_init(BlockDriverState *bs)
@@ -2772,10 +3307,15 @@ int bdrv_is_allocated(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
         .done = false,
     };
 
-    co = qemu_coroutine_create(bdrv_is_allocated_co_entry);
-    qemu_coroutine_enter(co, &data);
-    while (!data.done) {
-        qemu_aio_wait();
+    if (qemu_in_coroutine()) {
+        /* Fast-path if already in coroutine context */
+        bdrv_is_allocated_co_entry(&data);
+    } else {
+        co = qemu_coroutine_create(bdrv_is_allocated_co_entry);
+        qemu_coroutine_enter(co, &data);
+        while (!data.done) {
+            aio_poll(bdrv_get_aio_context(bs), true);
+        }
     }
     return data.ret;
 }
@@ -2829,6 +3369,254 @@ int coroutine_fn bdrv_co_is_allocated_above(BlockDriverState *top,
     return 0;
 }
 
+/*
+ * Return the BDRV_EXTENT_* type of the given sectors, or -errno.  'pnum' is
+ * set as for bdrv_co_is_allocated().  Drivers that cannot tell zeroes from
+ * data report everything they have allocated as BDRV_EXTENT_DATA.
+ */
+int coroutine_fn bdrv_co_get_extent(BlockDriverState *bs, int64_t sector_num,
+                                    int nb_sectors, int *pnum)
+{
+    int64_t n;
+    int ret;
+
+    if (sector_num >= bs->total_sectors) {
+        *pnum = 0;
+        return BDRV_EXTENT_UNALLOCATED;
+    }
+
+    n = bs->total_sectors - sector_num;
+    if (n < nb_sectors) {
+        nb_sectors = n;
+    }
+
+    if (bs->drv->bdrv_co_get_extent) {
+        return bs->drv->bdrv_co_get_extent(bs, sector_num, nb_sectors, pnum);
+    }
+
+    ret = bdrv_co_is_allocated(bs, sector_num, nb_sectors, pnum);
+    if (ret < 0) {
+        return ret;
+    }
+    return ret ? BDRV_EXTENT_DATA : BDRV_EXTENT_UNALLOCATED;
+}
+
+/*
+ * Return the BDRV_EXTENT_* type of the given sectors as seen through the
+ * image chain from TOP down to, but not including, BASE.  Sectors past the
+ * end of a shorter backing file read as zeroes.  BDRV_EXTENT_UNALLOCATED
+ * means that no image between BASE and TOP has the sectors; with a NULL BASE
+ * they read as zeroes, too.
+ *
+ * Unlike bdrv_co_is_allocated_above(), 'pnum' never extends past the first
+ * change of state in any of the images above the one that decided it.
+ */
+int coroutine_fn bdrv_co_get_extent_above(BlockDriverState *top,
+                                          BlockDriverState *base,
+                                          int64_t sector_num,
+                                          int nb_sectors, int *pnum)
+{
+    BlockDriverState *intermediate;
+    int ret, n = nb_sectors;
+
+    for (intermediate = top; intermediate && intermediate != base;
+         intermediate = intermediate->backing_hd) {
+        int pnum_inter;
+
+        if (intermediate != top && sector_num >= intermediate->total_sectors) {
+            *pnum = n;
+            return BDRV_EXTENT_ZERO;
+        }
+
+        ret = bdrv_co_get_extent(intermediate, sector_num, n, &pnum_inter);
+        if (ret < 0) {
+            return ret;
+        } else if (ret != BDRV_EXTENT_UNALLOCATED) {
+            *pnum = pnum_inter;
+            return ret;
+        }
+
+        if (n > pnum_inter) {
+            n = pnum_inter;
+        }
+    }
+
+    *pnum = n;
+    return BDRV_EXTENT_UNALLOCATED;
+}
+
+/*
+ * Describes the sectors [sector_num, sector_num + nb_sectors) of the image
+ * chain starting at BS in up to 'max_extents' extents, each covering a run
+ * of sectors with the same BDRV_EXTENT_* type that comes from the same image.
+ * Sectors that no image of the chain has are BDRV_EXTENT_UNALLOCATED, with
+ * the depth one past the last backing file.
+ *
+ * Returns the number of extents filled in, which cover less than the request
+ * only if 'max_extents' was reached, or -errno.
+ */
+int coroutine_fn bdrv_co_get_extents(BlockDriverState *bs, int64_t sector_num,
+                                     int64_t nb_sectors, BdrvExtent *extents,
+                                     int max_extents)
+{
+    BlockDriverState *intermediate;
+    int64_t end;
+    int i = 0;
+
+    end = MIN(sector_num + nb_sectors, bs->total_sectors);
+    while (sector_num < end) {
+        int depth, type = BDRV_EXTENT_UNALLOCATED;
+        int n = MIN(end - sector_num, INT_MAX >> BDRV_SECTOR_BITS);
+
+        for (intermediate = bs, depth = 0; intermediate;
+             intermediate = intermediate->backing_hd, depth++) {
+            int pnum;
+
+            if (intermediate != bs &&
+                sector_num >= intermediate->total_sectors) {
+                type = BDRV_EXTENT_ZERO;
+                break;
+            }
+
+            type = bdrv_co_get_extent(intermediate, sector_num, n, &pnum);
+            if (type < 0) {
+                return type;
+            }
+            n = MIN(n, pnum);
+            if (type != BDRV_EXTENT_UNALLOCATED) {
+                break;
+            }
+        }
+        if (n == 0) {
+            return -EIO;
+        }
+
+        if (i > 0 && extents[i - 1].type == type &&
+            extents[i - 1].depth == depth) {
+            extents[i - 1].nb_sectors += n;
+        } else if (i < max_extents) {
+            extents[i].sector_num = sector_num;
+            extents[i].nb_sectors = n;
+            extents[i].type = type;
+            extents[i].depth = depth;
+            i++;
+        } else {
+            break;
+        }
+        sector_num += n;
+    }
+
+    return i;
+}
+
+typedef struct BdrvCoGetExtentsData {
+    BlockDriverState *bs;
+    int64_t sector_num;
+    int64_t nb_sectors;
+    BdrvExtent *extents;
+    int max_extents;
+    int ret;
+    bool done;
+} BdrvCoGetExtentsData;
+
+static void coroutine_fn bdrv_get_extents_co_entry(void *opaque)
+{
+    BdrvCoGetExtentsData *data = opaque;
+
+    data->ret = bdrv_co_get_extents(data->bs, data->sector_num,
+                                    data->nb_sectors, data->extents,
+                                    data->max_extents);
+    data->done = true;
+}
+
+/*
+ * Synchronous wrapper around bdrv_co_get_extents().
+ */
+int bdrv_get_extents(BlockDriverState *bs, int64_t sector_num,
+                     int64_t nb_sectors, BdrvExtent *extents, int max_extents)
+{
+    Coroutine *co;
+    BdrvCoGetExtentsData data = {
+        .bs = bs,
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+        .extents = extents,
+        .max_extents = max_extents,
+        .done = false,
+    };
+
+    if (qemu_in_coroutine()) {
+        /* Fast-path if already in coroutine context */
+        bdrv_get_extents_co_entry(&data);
+    } else {
+        co = qemu_coroutine_create(bdrv_get_extents_co_entry);
+        qemu_coroutine_enter(co, &data);
+        while (!data.done) {
+            aio_poll(bdrv_get_aio_context(bs), true);
+        }
+    }
+    return data.ret;
+}
+
+/*
+ * Returns the number of bytes in the blocks of 'granularity' bytes of the
+ * image chain starting at BS that contain data, or -errno.  Blocks that only
+ * read as zeroes are not counted.
+ */
+int64_t bdrv_get_data_size(BlockDriverState *bs, int64_t granularity)
+{
+    BdrvExtent extents[256];
+    int64_t sector_num, start, end, last_block = -1, size = 0;
+    int64_t total_sectors;
+    int i, n;
+
+    total_sectors = bdrv_getlength(bs);
+    if (total_sectors < 0) {
+        return total_sectors;
+    }
+    total_sectors = DIV_ROUND_UP(total_sectors, BDRV_SECTOR_SIZE);
+
+    for (sector_num = 0; sector_num < total_sectors; ) {
+        n = bdrv_get_extents(bs, sector_num, total_sectors - sector_num,
+                             extents, ARRAY_SIZE(extents));
+        if (n <= 0) {
+            return n < 0 ? n : -EIO;
+        }
+        for (i = 0; i < n; i++) {
+            if (extents[i].type != BDRV_EXTENT_DATA) {
+                continue;
+            }
+            start = (extents[i].sector_num << BDRV_SECTOR_BITS) / granularity;
+            end = ((extents[i].sector_num + extents[i].nb_sectors)
+                   << BDRV_SECTOR_BITS) - 1;
+            end /= granularity;
+            if (start == last_block) {
+                start++;
+            }
+            if (start <= end) {
+                size += (end - start + 1) * granularity;
+            }
+            last_block = end;
+        }
+        sector_num = extents[n - 1].sector_num + extents[n - 1].nb_sectors;
+    }
+
+    return size;
+}
+
+/*
+ * Computes the sizes of an image of format DRV created with the given
+ * options when the data of IN_BS (if not NULL) is converted into it.
+ */
+int bdrv_measure(BlockDriver *drv, QEMUOptionParameter *options,
+                 BlockDriverState *in_bs, BlockMeasureInfo *info)
+{
+    if (!drv->bdrv_measure) {
+        return -ENOTSUP;
+    }
+    return drv->bdrv_measure(options, in_bs, info);
+}
+
 BlockInfo *bdrv_query_info(BlockDriverState *bs)
 {
     BlockInfo *info = g_malloc0(sizeof(*info));
@@ -2850,8 +3638,31 @@ BlockInfo *bdrv_query_info(BlockDriverState *bs)
     if (bs->dirty_bitmap) {
         info->has_dirty = true;
         info->dirty = g_malloc0(sizeof(*info->dirty));
-        info->dirty->count = bdrv_get_dirty_count(bs) *
-            BDRV_SECTORS_PER_DIRTY_CHUNK * BDRV_SECTOR_SIZE;
+        info->dirty->count = bdrv_get_dirty_count(bs) * BDRV_SECTOR_SIZE;
+    }
+
+    if (!QLIST_EMPTY(&bs->dirty_bitmaps)) {
+        BlockDirtyBitmapInfoList **p_next = &info->dirty_bitmaps;
+        BdrvDirtyBitmap *bitmap;
+
+        info->has_dirty_bitmaps = true;
+        QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+            BlockDirtyBitmapInfoList *entry;
+            BlockDirtyBitmapInfo *bm;
+            int granularity = hbitmap_granularity(bitmap->bitmap);
+
+            entry = g_new0(BlockDirtyBitmapInfoList, 1);
+            bm = g_new0(BlockDirtyBitmapInfo, 1);
+
+            bm->name = g_strdup(bitmap->name);
+            bm->granularity = (int64_t)BDRV_SECTOR_SIZE << granularity;
+            bm->count = hbitmap_count(bitmap->bitmap) * BDRV_SECTOR_SIZE;
+            bm->persistent = bitmap->persistent;
+            bm->frozen = bitmap->frozen;
+            entry->value = bm;
+            *p_next = entry;
+            p_next = &entry->next;
+        }
     }
 
     if (bs->drv) {
@@ -2883,6 +3694,33 @@ BlockInfo *bdrv_query_info(BlockDriverState *bs)
                            bs->io_limits.iops[BLOCK_IO_LIMIT_READ];
             info->inserted->iops_wr =
                            bs->io_limits.iops[BLOCK_IO_LIMIT_WRITE];
+
+            info->inserted->has_bps_max = true;
+            info->inserted->bps_max =
+                           bs->io_limits.bps_max[BLOCK_IO_LIMIT_TOTAL];
+            info->inserted->has_bps_rd_max = true;
+            info->inserted->bps_rd_max =
+                           bs->io_limits.bps_max[BLOCK_IO_LIMIT_READ];
+            info->inserted->has_bps_wr_max = true;
+            info->inserted->bps_wr_max =
+                           bs->io_limits.bps_max[BLOCK_IO_LIMIT_WRITE];
+            info->inserted->has_iops_max = true;
+            info->inserted->iops_max =
+                           bs->io_limits.iops_max[BLOCK_IO_LIMIT_TOTAL];
+            info->inserted->has_iops_rd_max = true;
+            info->inserted->iops_rd_max =
+                           bs->io_limits.iops_max[BLOCK_IO_LIMIT_READ];
+            info->inserted->has_iops_wr_max = true;
+            info->inserted->iops_wr_max =
+                           bs->io_limits.iops_max[BLOCK_IO_LIMIT_WRITE];
+            info->inserted->has_burst_length = true;
+            info->inserted->burst_length = bs->io_limits.burst_length;
+            info->inserted->has_iops_size = true;
+            info->inserted->iops_size = bs->io_limits.iops_size;
+            if (bs->io_limits.group[0]) {
+                info->inserted->has_group = true;
+                info->inserted->group = g_strdup(bs->io_limits.group);
+            }
         }
     }
     return info;
@@ -2925,6 +3763,28 @@ BlockStats *bdrv_query_stats(const BlockDriverState *bs)
     s->stats->wr_total_time_ns = bs->total_time_ns[BDRV_ACCT_WRITE];
     s->stats->rd_total_time_ns = bs->total_time_ns[BDRV_ACCT_READ];
     s->stats->flush_total_time_ns = bs->total_time_ns[BDRV_ACCT_FLUSH];
+    s->stats->rd_merged = bs->nr_merged[BDRV_ACCT_READ];
+    s->stats->wr_merged = bs->nr_merged[BDRV_ACCT_WRITE];
+
+    if (bs->nb_stats_intervals) {
+        s->stats->has_timed_stats = true;
+        s->stats->timed_stats = bdrv_query_timed_stats(bs);
+    }
+    if (bs->latency_histogram[BDRV_ACCT_READ].nb_bins) {
+        s->stats->has_rd_latency_histogram = true;
+        s->stats->rd_latency_histogram =
+            bdrv_query_latency_histogram(&bs->latency_histogram[BDRV_ACCT_READ]);
+    }
+    if (bs->latency_histogram[BDRV_ACCT_WRITE].nb_bins) {
+        s->stats->has_wr_latency_histogram = true;
+        s->stats->wr_latency_histogram =
+            bdrv_query_latency_histogram(&bs->latency_histogram[BDRV_ACCT_WRITE]);
+    }
+    if (bs->latency_histogram[BDRV_ACCT_FLUSH].nb_bins) {
+        s->stats->has_flush_latency_histogram = true;
+        s->stats->flush_latency_histogram =
+            bdrv_query_latency_histogram(&bs->latency_histogram[BDRV_ACCT_FLUSH]);
+    }
 
     if (bs->file) {
         s->has_parent = true;
@@ -3095,8 +3955,13 @@ int bdrv_snapshot_goto(BlockDriverState *bs,
 
     if (!drv)
         return -ENOMEDIUM;
-    if (drv->bdrv_snapshot_goto)
-        return drv->bdrv_snapshot_goto(bs, snapshot_id);
+    if (drv->bdrv_snapshot_goto) {
+        ret = drv->bdrv_snapshot_goto(bs, snapshot_id);
+        if (ret == 0) {
+            bdrv_set_dirty_bitmaps_all(bs);
+        }
+        return ret;
+    }
 
     if (bs->file) {
         drv->bdrv_close(bs);
@@ -3107,6 +3972,9 @@ int bdrv_snapshot_goto(BlockDriverState *bs,
             bs->drv = NULL;
             return open_ret;
         }
+        if (ret == 0) {
+            bdrv_set_dirty_bitmaps_all(bs);
+        }
         return ret;
     }
 
@@ -3322,6 +4190,206 @@ char *bdrv_snapshot_dump(char *buf, int buf_size, QEMUSnapshotInfo *sn)
     return buf;
 }
 
+/**************************************************************/
+/* request merging */
+
+/*
+ * Devices that submit one request per guest descriptor (IDE, AHCI, Xen
+ * blkback, ...) can enable merging for their BlockDriverState.  Requests
+ * from bdrv_aio_readv/writev are then held back until the outermost
+ * bdrv_io_unplug(), until the merge window expires or until the queue is
+ * full.  The queue is sorted and exactly contiguous requests going in the
+ * same direction are submitted as one.  Requests that are in the queue at
+ * the same time are in flight as far as the guest is concerned, so changing
+ * their order is allowed.
+ */
+
+#define BDRV_MERGE_QUEUE_MAX    64
+#define BDRV_MERGE_MAX_SECTORS  2048
+
+typedef struct BlockMergeAIOCB BlockMergeAIOCB;
+
+struct BlockMergeAIOCB {
+    BlockDriverAIOCB common;
+    int64_t sector_num;
+    int nb_sectors;
+    QEMUIOVector *qiov;
+    bool is_write;
+    QTAILQ_ENTRY(BlockMergeAIOCB) list;
+
+    /* completes together with this request; only the first request of a
+     * merged group owns merged_qiov */
+    BlockMergeAIOCB *next_merged;
+    QEMUIOVector merged_qiov;
+};
+
+static void bdrv_merge_cancel(BlockDriverAIOCB *blockacb)
+{
+    /* the request may still be queued, send it on and wait for it */
+    bdrv_merge_submit(blockacb->bs);
+    qemu_aio_flush();
+}
+
+static const AIOCBInfo bdrv_merge_aiocb_info = {
+    .aiocb_size         = sizeof(BlockMergeAIOCB),
+    .cancel             = bdrv_merge_cancel,
+};
+
+static void bdrv_merge_cb(void *opaque, int ret)
+{
+    BlockMergeAIOCB *acb = opaque;
+    BlockMergeAIOCB *next;
+
+    if (acb->next_merged) {
+        qemu_iovec_destroy(&acb->merged_qiov);
+    }
+    for (; acb; acb = next) {
+        next = acb->next_merged;
+        acb->common.cb(acb->common.opaque, ret);
+        qemu_aio_release(acb);
+    }
+}
+
+static int bdrv_merge_compare(const void *a, const void *b)
+{
+    const BlockMergeAIOCB *req1 = *(BlockMergeAIOCB * const *)a;
+    const BlockMergeAIOCB *req2 = *(BlockMergeAIOCB * const *)b;
+
+    if (req1->is_write != req2->is_write) {
+        return req1->is_write - req2->is_write;
+    }
+    if (req1->sector_num < req2->sector_num) {
+        return -1;
+    } else if (req1->sector_num > req2->sector_num) {
+        return 1;
+    }
+    return 0;
+}
+
+static void bdrv_merge_issue(BlockDriverState *bs, BlockMergeAIOCB *head,
+                             int nb_sectors, int niov, int nb_reqs)
+{
+    BlockMergeAIOCB *acb;
+    QEMUIOVector *qiov = head->qiov;
+
+    if (nb_reqs > 1) {
+        qemu_iovec_init(&head->merged_qiov, niov);
+        for (acb = head; acb; acb = acb->next_merged) {
+            qemu_iovec_concat(&head->merged_qiov, acb->qiov, 0,
+                              acb->qiov->size);
+        }
+        qiov = &head->merged_qiov;
+        bs->nr_merged[head->is_write ? BDRV_ACCT_WRITE : BDRV_ACCT_READ] +=
+            nb_reqs - 1;
+    }
+
+    bdrv_co_aio_rw_vector(bs, head->sector_num, qiov, nb_sectors,
+                          bdrv_merge_cb, head, head->is_write);
+}
+
+static void bdrv_merge_submit(BlockDriverState *bs)
+{
+    BlockMergeAIOCB *reqs[BDRV_MERGE_QUEUE_MAX];
+    BlockMergeAIOCB *acb, *last;
+    int nb_reqs = 0;
+    int nb_sectors, niov;
+    int i, j;
+
+    if (bs->merge_timer) {
+        qemu_del_timer(bs->merge_timer);
+    }
+
+    /* empty the queue first, completions may queue new requests */
+    while ((acb = QTAILQ_FIRST(&bs->merge_queue)) != NULL) {
+        QTAILQ_REMOVE(&bs->merge_queue, acb, list);
+        reqs[nb_reqs++] = acb;
+    }
+    bs->merge_queue_len = 0;
+
+    qsort(reqs, nb_reqs, sizeof(reqs[0]), bdrv_merge_compare);
+
+    for (i = 0; i < nb_reqs; i = j) {
+        last = reqs[i];
+        nb_sectors = last->nb_sectors;
+        niov = last->qiov->niov;
+
+        for (j = i + 1; j < nb_reqs; j++) {
+            acb = reqs[j];
+            if (acb->is_write != last->is_write ||
+                acb->sector_num != last->sector_num + last->nb_sectors ||
+                niov + acb->qiov->niov > IOV_MAX ||
+                nb_sectors + acb->nb_sectors > BDRV_MERGE_MAX_SECTORS) {
+                break;
+            }
+            last->next_merged = acb;
+            last = acb;
+            nb_sectors += acb->nb_sectors;
+            niov += acb->qiov->niov;
+        }
+
+        bdrv_merge_issue(bs, reqs[i], nb_sectors, niov, j - i);
+    }
+}
+
+static void bdrv_merge_timer_cb(void *opaque)
+{
+    bdrv_merge_submit(opaque);
+}
+
+static BlockDriverAIOCB *bdrv_merge_queue_rw(BlockDriverState *bs,
+                                             int64_t sector_num,
+                                             QEMUIOVector *qiov,
+                                             int nb_sectors,
+                                             BlockDriverCompletionFunc *cb,
+                                             void *opaque,
+                                             bool is_write)
+{
+    BlockMergeAIOCB *acb;
+
+    acb = qemu_aio_get(&bdrv_merge_aiocb_info, bs, cb, opaque);
+    acb->sector_num = sector_num;
+    acb->nb_sectors = nb_sectors;
+    acb->qiov = qiov;
+    acb->is_write = is_write;
+    acb->next_merged = NULL;
+    QTAILQ_INSERT_TAIL(&bs->merge_queue, acb, list);
+
+    if (++bs->merge_queue_len == BDRV_MERGE_QUEUE_MAX) {
+        bdrv_merge_submit(bs);
+    } else if (bs->io_plug_depth == 0) {
+        /* outside a plugged section only the merge window can batch */
+        if (bs->merge_window_ns == 0) {
+            bdrv_merge_submit(bs);
+        } else if (!qemu_timer_pending(bs->merge_timer)) {
+            qemu_mod_timer(bs->merge_timer,
+                           qemu_get_clock_ns(rt_clock) + bs->merge_window_ns);
+        }
+    }
+
+    return &acb->common;
+}
+
+/*
+ * Enable or disable request merging for @bs.  With a @window_ns of zero
+ * requests are only merged inside bdrv_io_plug()/bdrv_io_unplug() sections,
+ * otherwise they may wait up to @window_ns for neighbours.
+ */
+void bdrv_set_io_merge(BlockDriverState *bs, bool enabled, int64_t window_ns)
+{
+    if (!enabled) {
+        bdrv_merge_submit(bs);
+        if (bs->merge_timer) {
+            qemu_free_timer(bs->merge_timer);
+            bs->merge_timer = NULL;
+        }
+    } else if (!bs->merge_timer) {
+        bs->merge_timer = qemu_new_timer_ns(rt_clock, bdrv_merge_timer_cb, bs);
+    }
+
+    bs->io_merge_enabled = enabled;
+    bs->merge_window_ns = window_ns;
+}
+
 /**************************************************************/
 /* async I/Os */
 
@@ -3331,6 +4399,10 @@ BlockDriverAIOCB *bdrv_aio_readv(BlockDriverState *bs, int64_t sector_num,
 {
     trace_bdrv_aio_readv(bs, sector_num, nb_sectors, opaque);
 
+    if (bs->io_merge_enabled) {
+        return bdrv_merge_queue_rw(bs, sector_num, qiov, nb_sectors,
+                                   cb, opaque, false);
+    }
     return bdrv_co_aio_rw_vector(bs, sector_num, qiov, nb_sectors,
                                  cb, opaque, false);
 }
@@ -3341,6 +4413,10 @@ BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
 {
     trace_bdrv_aio_writev(bs, sector_num, nb_sectors, opaque);
 
+    if (bs->io_merge_enabled) {
+        return bdrv_merge_queue_rw(bs, sector_num, qiov, nb_sectors,
+                                   cb, opaque, true);
+    }
     return bdrv_co_aio_rw_vector(bs, sector_num, qiov, nb_sectors,
                                  cb, opaque, true);
 }
@@ -3525,183 +4601,18 @@ void bdrv_aio_cancel(BlockDriverAIOCB *acb)
     acb->aiocb_info->cancel(acb);
 }
 
-/* block I/O throttling */
-static bool bdrv_exceed_bps_limits(BlockDriverState *bs, int nb_sectors,
-                 bool is_write, double elapsed_time, uint64_t *wait)
-{
-    uint64_t bps_limit = 0;
-    double   bytes_limit, bytes_base, bytes_res;
-    double   slice_time, wait_time;
+/**************************************************************/
+/* async block device emulation */
 
-    if (bs->io_limits.bps[BLOCK_IO_LIMIT_TOTAL]) {
-        bps_limit = bs->io_limits.bps[BLOCK_IO_LIMIT_TOTAL];
-    } else if (bs->io_limits.bps[is_write]) {
-        bps_limit = bs->io_limits.bps[is_write];
-    } else {
-        if (wait) {
-            *wait = 0;
-        }
-
-        return false;
-    }
-
-    slice_time = bs->slice_end - bs->slice_start;
-    slice_time /= (NANOSECONDS_PER_SECOND);
-    bytes_limit = bps_limit * slice_time;
-    bytes_base  = bs->nr_bytes[is_write] - bs->io_base.bytes[is_write];
-    if (bs->io_limits.bps[BLOCK_IO_LIMIT_TOTAL]) {
-        bytes_base += bs->nr_bytes[!is_write] - bs->io_base.bytes[!is_write];
-    }
-
-    /* bytes_base: the bytes of data which have been read/written; and
-     *             it is obtained from the history statistic info.
-     * bytes_res: the remaining bytes of data which need to be read/written.
-     * (bytes_base + bytes_res) / bps_limit: used to calcuate
-     *             the total time for completing reading/writting all data.
-     */
-    bytes_res   = (unsigned) nb_sectors * BDRV_SECTOR_SIZE;
-
-    if (bytes_base + bytes_res <= bytes_limit) {
-        if (wait) {
-            *wait = 0;
-        }
-
-        return false;
-    }
-
-    /* Calc approx time to dispatch */
-    wait_time = (bytes_base + bytes_res) / bps_limit - elapsed_time;
-
-    /* When the I/O rate at runtime exceeds the limits,
-     * bs->slice_end need to be extended in order that the current statistic
-     * info can be kept until the timer fire, so it is increased and tuned
-     * based on the result of experiment.
-     */
-    bs->slice_time = wait_time * BLOCK_IO_SLICE_TIME * 10;
-    bs->slice_end += bs->slice_time - 3 * BLOCK_IO_SLICE_TIME;
-    if (wait) {
-        *wait = wait_time * BLOCK_IO_SLICE_TIME * 10;
-    }
-
-    return true;
-}
-
-static bool bdrv_exceed_iops_limits(BlockDriverState *bs, bool is_write,
-                             double elapsed_time, uint64_t *wait)
-{
-    uint64_t iops_limit = 0;
-    double   ios_limit, ios_base;
-    double   slice_time, wait_time;
-
-    if (bs->io_limits.iops[BLOCK_IO_LIMIT_TOTAL]) {
-        iops_limit = bs->io_limits.iops[BLOCK_IO_LIMIT_TOTAL];
-    } else if (bs->io_limits.iops[is_write]) {
-        iops_limit = bs->io_limits.iops[is_write];
-    } else {
-        if (wait) {
-            *wait = 0;
-        }
-
-        return false;
-    }
-
-    slice_time = bs->slice_end - bs->slice_start;
-    slice_time /= (NANOSECONDS_PER_SECOND);
-    ios_limit  = iops_limit * slice_time;
-    ios_base   = bs->nr_ops[is_write] - bs->io_base.ios[is_write];
-    if (bs->io_limits.iops[BLOCK_IO_LIMIT_TOTAL]) {
-        ios_base += bs->nr_ops[!is_write] - bs->io_base.ios[!is_write];
-    }
-
-    if (ios_base + 1 <= ios_limit) {
-        if (wait) {
-            *wait = 0;
-        }
-
-        return false;
-    }
-
-    /* Calc approx time to dispatch */
-    wait_time = (ios_base + 1) / iops_limit;
-    if (wait_time > elapsed_time) {
-        wait_time = wait_time - elapsed_time;
-    } else {
-        wait_time = 0;
-    }
-
-    bs->slice_time = wait_time * BLOCK_IO_SLICE_TIME * 10;
-    bs->slice_end += bs->slice_time - 3 * BLOCK_IO_SLICE_TIME;
-    if (wait) {
-        *wait = wait_time * BLOCK_IO_SLICE_TIME * 10;
-    }
-
-    return true;
-}
-
-static bool bdrv_exceed_io_limits(BlockDriverState *bs, int nb_sectors,
-                           bool is_write, int64_t *wait)
-{
-    int64_t  now, max_wait;
-    uint64_t bps_wait = 0, iops_wait = 0;
-    double   elapsed_time;
-    int      bps_ret, iops_ret;
-
-    now = qemu_get_clock_ns(vm_clock);
-    if ((bs->slice_start < now)
-        && (bs->slice_end > now)) {
-        bs->slice_end = now + bs->slice_time;
-    } else {
-        bs->slice_time  =  5 * BLOCK_IO_SLICE_TIME;
-        bs->slice_start = now;
-        bs->slice_end   = now + bs->slice_time;
-
-        bs->io_base.bytes[is_write]  = bs->nr_bytes[is_write];
-        bs->io_base.bytes[!is_write] = bs->nr_bytes[!is_write];
-
-        bs->io_base.ios[is_write]    = bs->nr_ops[is_write];
-        bs->io_base.ios[!is_write]   = bs->nr_ops[!is_write];
-    }
-
-    elapsed_time  = now - bs->slice_start;
-    elapsed_time  /= (NANOSECONDS_PER_SECOND);
-
-    bps_ret  = bdrv_exceed_bps_limits(bs, nb_sectors,
-                                      is_write, elapsed_time, &bps_wait);
-    iops_ret = bdrv_exceed_iops_limits(bs, is_write,
-                                      elapsed_time, &iops_wait);
-    if (bps_ret || iops_ret) {
-        max_wait = bps_wait > iops_wait ? bps_wait : iops_wait;
-        if (wait) {
-            *wait = max_wait;
-        }
-
-        now = qemu_get_clock_ns(vm_clock);
-        if (bs->slice_end < now + max_wait) {
-            bs->slice_end = now + max_wait;
-        }
-
-        return true;
-    }
-
-    if (wait) {
-        *wait = 0;
-    }
-
-    return false;
-}
-
-/**************************************************************/
-/* async block device emulation */
-
-typedef struct BlockDriverAIOCBSync {
-    BlockDriverAIOCB common;
-    QEMUBH *bh;
-    int ret;
-    /* vector translation state */
-    QEMUIOVector *qiov;
-    uint8_t *bounce;
-    int is_write;
-} BlockDriverAIOCBSync;
+typedef struct BlockDriverAIOCBSync {
+    BlockDriverAIOCB common;
+    QEMUBH *bh;
+    int ret;
+    /* vector translation state */
+    QEMUIOVector *qiov;
+    uint8_t *bounce;
+    int is_write;
+} BlockDriverAIOCBSync;
 
 static void bdrv_aio_cancel_em(BlockDriverAIOCB *blockacb)
 {
@@ -3745,7 +4656,7 @@ static BlockDriverAIOCB *bdrv_aio_rw_vector(BlockDriverState *bs,
     acb->is_write = is_write;
     acb->qiov = qiov;
     acb->bounce = qemu_blockalign(bs, qiov->size);
-    acb->bh = qemu_bh_new(bdrv_aio_bh_cb, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_aio_bh_cb, acb);
 
     if (is_write) {
         qemu_iovec_to_buf(acb->qiov, 0, acb->bounce, qiov->size);
@@ -3814,7 +4725,7 @@ static void coroutine_fn bdrv_co_do_rw(void *opaque)
             acb->req.nb_sectors, acb->req.qiov, 0);
     }
 
-    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_co_em_bh, acb);
     qemu_bh_schedule(acb->bh);
 }
 
@@ -3847,7 +4758,7 @@ static void coroutine_fn bdrv_aio_flush_co_entry(void *opaque)
     BlockDriverState *bs = acb->common.bs;
 
     acb->req.error = bdrv_co_flush(bs);
-    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_co_em_bh, acb);
     qemu_bh_schedule(acb->bh);
 }
 
@@ -3872,7 +4783,7 @@ static void coroutine_fn bdrv_aio_discard_co_entry(void *opaque)
     BlockDriverState *bs = acb->common.bs;
 
     acb->req.error = bdrv_co_discard(bs, acb->req.sector, acb->req.nb_sectors);
-    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_co_em_bh, acb);
     qemu_bh_schedule(acb->bh);
 }
 
@@ -4088,13 +4999,54 @@ int bdrv_flush(BlockDriverState *bs)
         co = qemu_coroutine_create(bdrv_flush_co_entry);
         qemu_coroutine_enter(co, &rwco);
         while (rwco.ret == NOT_DONE) {
-            qemu_aio_wait();
+            aio_poll(bdrv_get_aio_context(bs), true);
         }
     }
 
     return rwco.ret;
 }
 
+/*
+ * Flush all of bs_list at the same time, so that the round trips to their
+ * storage overlap, and return the first error.
+ */
+int bdrv_flush_multiple(BlockDriverState **bs_list, int n)
+{
+    Coroutine *co;
+    RwCo *rwco;
+    int i, ret = 0;
+
+    if (qemu_in_coroutine()) {
+        for (i = 0; i < n; i++) {
+            int err = bdrv_co_flush(bs_list[i]);
+            if (err < 0 && ret == 0) {
+                ret = err;
+            }
+        }
+        return ret;
+    }
+
+    rwco = g_new0(RwCo, n);
+    for (i = 0; i < n; i++) {
+        rwco[i].bs = bs_list[i];
+        rwco[i].ret = NOT_DONE;
+        co = qemu_coroutine_create(bdrv_flush_co_entry);
+        qemu_coroutine_enter(co, &rwco[i]);
+    }
+
+    for (i = 0; i < n; i++) {
+        while (rwco[i].ret == NOT_DONE) {
+            aio_poll(bdrv_get_aio_context(rwco[i].bs), true);
+        }
+        if (rwco[i].ret < 0 && ret == 0) {
+            ret = rwco[i].ret;
+        }
+    }
+
+    g_free(rwco);
+    return ret;
+}
+
 static void coroutine_fn bdrv_discard_co_entry(void *opaque)
 {
     RwCo *rwco = opaque;
@@ -4149,7 +5101,7 @@ int bdrv_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors)
         co = qemu_coroutine_create(bdrv_discard_co_entry);
         qemu_coroutine_enter(co, &rwco);
         while (rwco.ret == NOT_DONE) {
-            qemu_aio_wait();
+            aio_poll(bdrv_get_aio_context(bs), true);
         }
     }
 
@@ -4250,22 +5202,22 @@ void *qemu_blockalign(BlockDriverState *bs, size_t size)
     return qemu_memalign((bs && bs->buffer_alignment) ? bs->buffer_alignment : 512, size);
 }
 
-void bdrv_set_dirty_tracking(BlockDriverState *bs, int enable)
+void bdrv_set_dirty_tracking(BlockDriverState *bs, int granularity)
 {
     int64_t bitmap_size;
 
-    bs->dirty_count = 0;
-    if (enable) {
-        if (!bs->dirty_bitmap) {
-            bitmap_size = (bdrv_getlength(bs) >> BDRV_SECTOR_BITS) +
-                    BDRV_SECTORS_PER_DIRTY_CHUNK * BITS_PER_LONG - 1;
-            bitmap_size /= BDRV_SECTORS_PER_DIRTY_CHUNK * BITS_PER_LONG;
+    assert((granularity & (granularity - 1)) == 0);
 
-            bs->dirty_bitmap = g_new0(unsigned long, bitmap_size);
+    if (granularity) {
+        if (!bs->dirty_bitmap) {
+            granularity >>= BDRV_SECTOR_BITS;
+            bitmap_size = bdrv_getlength(bs) >> BDRV_SECTOR_BITS;
+            bs->dirty_bitmap = hbitmap_alloc(bitmap_size,
+                                             ffs(granularity) - 1);
         }
     } else {
         if (bs->dirty_bitmap) {
-            g_free(bs->dirty_bitmap);
+            hbitmap_free(bs->dirty_bitmap);
             bs->dirty_bitmap = NULL;
         }
     }
@@ -4273,67 +5225,154 @@ void bdrv_set_dirty_tracking(BlockDriverState *bs, int enable)
 
 int bdrv_get_dirty(BlockDriverState *bs, int64_t sector)
 {
-    int64_t chunk = sector / (int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK;
-
     if (bs->dirty_bitmap &&
         (sector << BDRV_SECTOR_BITS) < bdrv_getlength(bs)) {
-        return !!(bs->dirty_bitmap[chunk / BITS_PER_LONG] &
-            (1UL << (chunk % BITS_PER_LONG)));
+        return hbitmap_get(bs->dirty_bitmap, sector);
     } else {
         return 0;
     }
 }
 
+/* Return the first dirty sector at or after @sector, rounded down to the
+ * start of its chunk, or -1 if there is none.
+ */
 int64_t bdrv_get_next_dirty(BlockDriverState *bs, int64_t sector)
 {
-    int64_t chunk;
-    int bit, elem;
-
-    /* Avoid an infinite loop.  */
-    assert(bs->dirty_count > 0);
-
-    sector = (sector | (BDRV_SECTORS_PER_DIRTY_CHUNK - 1)) + 1;
-    chunk = sector / (int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK;
+    HBitmapIter hbi;
 
-    QEMU_BUILD_BUG_ON(sizeof(bs->dirty_bitmap[0]) * 8 != BITS_PER_LONG);
-    elem = chunk / BITS_PER_LONG;
-    bit = chunk % BITS_PER_LONG;
-    for (;;) {
-        if (sector >= bs->total_sectors) {
-            sector = 0;
-            bit = elem = 0;
-        }
-        if (bit == 0 && bs->dirty_bitmap[elem] == 0) {
-            sector += BDRV_SECTORS_PER_DIRTY_CHUNK * BITS_PER_LONG;
-            elem++;
-        } else {
-            if (bs->dirty_bitmap[elem] & (1UL << bit)) {
-                return sector;
-            }
-            sector += BDRV_SECTORS_PER_DIRTY_CHUNK;
-            if (++bit == BITS_PER_LONG) {
-                bit = 0;
-                elem++;
-            }
-        }
+    if (!bs->dirty_bitmap ||
+        (sector << BDRV_SECTOR_BITS) >= bdrv_getlength(bs)) {
+        return -1;
     }
+    hbitmap_iter_init(&hbi, bs->dirty_bitmap, sector);
+    return hbitmap_iter_next(&hbi);
+}
+
+void bdrv_dirty_iter_init(BlockDriverState *bs, HBitmapIter *hbi)
+{
+    hbitmap_iter_init(hbi, bs->dirty_bitmap, 0);
 }
 
 void bdrv_set_dirty(BlockDriverState *bs, int64_t cur_sector,
                     int nr_sectors)
 {
-    set_dirty_bitmap(bs, cur_sector, nr_sectors, 1);
+    hbitmap_set(bs->dirty_bitmap, cur_sector, nr_sectors);
 }
 
 void bdrv_reset_dirty(BlockDriverState *bs, int64_t cur_sector,
                       int nr_sectors)
 {
-    set_dirty_bitmap(bs, cur_sector, nr_sectors, 0);
+    hbitmap_reset(bs->dirty_bitmap, cur_sector, nr_sectors);
 }
 
+/* Return the number of dirty sectors */
 int64_t bdrv_get_dirty_count(BlockDriverState *bs)
 {
-    return bs->dirty_count;
+    if (bs->dirty_bitmap) {
+        return hbitmap_count(bs->dirty_bitmap);
+    } else {
+        return 0;
+    }
+}
+
+BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs,
+                                          const char *name, int granularity)
+{
+    BdrvDirtyBitmap *bitmap;
+    int64_t bitmap_size;
+
+    assert(granularity >= BDRV_SECTOR_SIZE);
+    assert((granularity & (granularity - 1)) == 0);
+    assert(!bdrv_find_dirty_bitmap(bs, name));
+
+    granularity >>= BDRV_SECTOR_BITS;
+    bitmap_size = bdrv_getlength(bs) >> BDRV_SECTOR_BITS;
+
+    bitmap = g_new0(BdrvDirtyBitmap, 1);
+    bitmap->name = g_strdup(name);
+    bitmap->bitmap = hbitmap_alloc(bitmap_size, ffs(granularity) - 1);
+    QLIST_INSERT_HEAD(&bs->dirty_bitmaps, bitmap, list);
+    return bitmap;
+}
+
+BdrvDirtyBitmap *bdrv_find_dirty_bitmap(BlockDriverState *bs,
+                                        const char *name)
+{
+    BdrvDirtyBitmap *bitmap;
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        if (!strcmp(bitmap->name, name)) {
+            return bitmap;
+        }
+    }
+    return NULL;
+}
+
+void bdrv_release_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
+{
+    assert(!bitmap->frozen);
+
+    QLIST_REMOVE(bitmap, list);
+    hbitmap_free(bitmap->bitmap);
+    g_free(bitmap->name);
+    g_free(bitmap);
+}
+
+bool bdrv_can_persist_dirty_bitmaps(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!drv || bs->read_only || !drv->bdrv_can_persist_dirty_bitmaps) {
+        return false;
+    }
+    return drv->bdrv_can_persist_dirty_bitmaps(bs);
+}
+
+static void bdrv_set_dirty_bitmaps(BlockDriverState *bs, int64_t cur_sector,
+                                   int nr_sectors)
+{
+    BdrvDirtyBitmap *bitmap;
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        hbitmap_set(bitmap->bitmap, cur_sector, nr_sectors);
+    }
+}
+
+/* Mark everything dirty, e.g. after reverting to an internal snapshot */
+static void bdrv_set_dirty_bitmaps_all(BlockDriverState *bs)
+{
+    bdrv_set_dirty_bitmaps(bs, 0, bs->total_sectors);
+}
+
+/* Resize the named bitmaps after the image size has changed.  Bits for the
+ * part that is kept are copied, any new area counts as dirty.
+ */
+static void bdrv_truncate_dirty_bitmaps(BlockDriverState *bs,
+                                        int64_t old_sectors)
+{
+    BdrvDirtyBitmap *bitmap;
+    HBitmapIter hbi;
+    HBitmap *new;
+    int64_t sector;
+    int granularity;
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        granularity = hbitmap_granularity(bitmap->bitmap);
+        new = hbitmap_alloc(bs->total_sectors, granularity);
+
+        hbitmap_iter_init(&hbi, bitmap->bitmap, 0);
+        while ((sector = hbitmap_iter_next(&hbi)) >= 0 &&
+               sector < bs->total_sectors) {
+            hbitmap_set(new, sector, MIN(1LL << granularity,
+                                         bs->total_sectors - sector));
+        }
+        if (bs->total_sectors > old_sectors) {
+            hbitmap_set(new, old_sectors, bs->total_sectors - old_sectors);
+        }
+
+        hbitmap_free(bitmap->bitmap);
+        bitmap->bitmap = new;
+    }
 }
 
 void bdrv_set_in_use(BlockDriverState *bs, int in_use)
@@ -4398,14 +5437,218 @@ bdrv_acct_start(BlockDriverState *bs, BlockAcctCookie *cookie, int64_t bytes,
     cookie->type = type;
 }
 
+static void bdrv_acct_window_reset(BlockAcctWindow *w)
+{
+    int i;
+
+    for (i = 0; i < BDRV_MAX_IOTYPE; i++) {
+        w->count[i] = 0;
+        w->sum_ns[i] = 0;
+        w->min_ns[i] = UINT64_MAX;
+        w->max_ns[i] = 0;
+    }
+}
+
+/* Restart the windows that have expired; return the older window */
+static BlockAcctWindow *bdrv_acct_timed_stats_update(BlockAcctTimedStats *ts,
+                                                     int64_t now)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        BlockAcctWindow *w = &ts->windows[i];
+
+        if (w->expires_ns <= now) {
+            /* keep the windows staggered even after a long idle time */
+            w->expires_ns = now + ts->interval_ns -
+                            (now - w->expires_ns) % ts->interval_ns;
+            bdrv_acct_window_reset(w);
+        }
+    }
+
+    return &ts->windows[ts->windows[0].expires_ns < ts->windows[1].expires_ns
+                        ? 0 : 1];
+}
+
+static void bdrv_acct_histogram_add(BlockLatencyHistogram *hist,
+                                    uint64_t latency_ns)
+{
+    int lo = 0, hi = hist->nb_bins - 1;
+
+    /* find the first bin whose end is above the latency */
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if (latency_ns < hist->boundaries[mid]) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    hist->bins[lo]++;
+}
+
 void
 bdrv_acct_done(BlockDriverState *bs, BlockAcctCookie *cookie)
 {
-    assert(cookie->type < BDRV_MAX_IOTYPE);
+    enum BlockAcctType type = cookie->type;
+    int64_t now = get_clock();
+    uint64_t latency_ns = now - cookie->start_time_ns;
+    int i, j;
+
+    assert(type < BDRV_MAX_IOTYPE);
+
+    bs->nr_bytes[type] += cookie->bytes;
+    bs->nr_ops[type]++;
+    bs->total_time_ns[type] += latency_ns;
+
+    if (bs->latency_histogram[type].nb_bins) {
+        bdrv_acct_histogram_add(&bs->latency_histogram[type], latency_ns);
+    }
+
+    for (i = 0; i < bs->nb_stats_intervals; i++) {
+        BlockAcctTimedStats *ts = &bs->timed_stats[i];
+
+        bdrv_acct_timed_stats_update(ts, now);
+        for (j = 0; j < 2; j++) {
+            BlockAcctWindow *w = &ts->windows[j];
+
+            w->count[type]++;
+            w->sum_ns[type] += latency_ns;
+            w->min_ns[type] = MIN(w->min_ns[type], latency_ns);
+            w->max_ns[type] = MAX(w->max_ns[type], latency_ns);
+        }
+    }
+}
+
+int bdrv_set_latency_histogram(BlockDriverState *bs, enum BlockAcctType type,
+                               const uint64_t *boundaries, int nb_boundaries)
+{
+    BlockLatencyHistogram *hist = &bs->latency_histogram[type];
+    int i;
+
+    for (i = 0; i < nb_boundaries; i++) {
+        if (!boundaries[i] || (i && boundaries[i] <= boundaries[i - 1])) {
+            return -EINVAL;
+        }
+    }
+
+    g_free(hist->boundaries);
+    g_free(hist->bins);
+    hist->boundaries = NULL;
+    hist->bins = NULL;
+    hist->nb_bins = 0;
+
+    if (nb_boundaries) {
+        hist->boundaries = g_memdup(boundaries,
+                                    nb_boundaries * sizeof(uint64_t));
+        hist->bins = g_new0(uint64_t, nb_boundaries + 1);
+        hist->nb_bins = nb_boundaries + 1;
+    }
+    return 0;
+}
+
+void bdrv_reset_latency_histograms(BlockDriverState *bs)
+{
+    int i;
+
+    for (i = 0; i < BDRV_MAX_IOTYPE; i++) {
+        bdrv_set_latency_histogram(bs, i, bdrv_default_latency_boundaries,
+                                   ARRAY_SIZE(bdrv_default_latency_boundaries));
+    }
+}
+
+int bdrv_set_stats_intervals(BlockDriverState *bs, const uint64_t *intervals,
+                             int nb_intervals)
+{
+    int64_t now = get_clock();
+    int i;
+
+    if (nb_intervals > BLOCK_MAX_STATS_INTERVALS) {
+        return -E2BIG;
+    }
+    for (i = 0; i < nb_intervals; i++) {
+        if (!intervals[i] || intervals[i] > INT64_MAX / get_ticks_per_sec()) {
+            return -EINVAL;
+        }
+    }
+
+    for (i = 0; i < nb_intervals; i++) {
+        BlockAcctTimedStats *ts = &bs->timed_stats[i];
+
+        ts->interval_ns = intervals[i] * get_ticks_per_sec();
+        ts->windows[0].expires_ns = now + ts->interval_ns;
+        ts->windows[1].expires_ns = now + ts->interval_ns / 2;
+        bdrv_acct_window_reset(&ts->windows[0]);
+        bdrv_acct_window_reset(&ts->windows[1]);
+    }
+    bs->nb_stats_intervals = nb_intervals;
+    return 0;
+}
+
+static BlockLatencyHistogramInfo *
+bdrv_query_latency_histogram(const BlockLatencyHistogram *hist)
+{
+    BlockLatencyHistogramInfo *info = g_malloc0(sizeof(*info));
+    BlockLatencyHistogramBinList **tail = &info->bins;
+    int i;
+
+    for (i = 0; i < hist->nb_bins; i++) {
+        BlockLatencyHistogramBinList *entry = g_malloc0(sizeof(*entry));
+
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->start = i ? hist->boundaries[i - 1] : 0;
+        entry->value->count = hist->bins[i];
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return info;
+}
+
+static BlockDeviceTimedStatsList *
+bdrv_query_timed_stats(const BlockDriverState *bs)
+{
+    BlockDeviceTimedStatsList *head = NULL, **tail = &head;
+    int64_t now = get_clock();
+    int i;
 
-    bs->nr_bytes[cookie->type] += cookie->bytes;
-    bs->nr_ops[cookie->type]++;
-    bs->total_time_ns[cookie->type] += get_clock() - cookie->start_time_ns;
+    for (i = 0; i < bs->nb_stats_intervals; i++) {
+        BlockAcctTimedStats ts = bs->timed_stats[i];
+        BlockAcctWindow *w = bdrv_acct_timed_stats_update(&ts, now);
+        BlockDeviceTimedStatsList *entry = g_malloc0(sizeof(*entry));
+        BlockDeviceTimedStats *s = g_malloc0(sizeof(*s));
+        int64_t elapsed = now - (w->expires_ns - ts.interval_ns);
+        uint64_t min_ns[BDRV_MAX_IOTYPE], avg_ns[BDRV_MAX_IOTYPE];
+        int j;
+
+        for (j = 0; j < BDRV_MAX_IOTYPE; j++) {
+            min_ns[j] = w->count[j] ? w->min_ns[j] : 0;
+            avg_ns[j] = w->count[j] ? w->sum_ns[j] / w->count[j] : 0;
+        }
+
+        s->interval_length = ts.interval_ns / get_ticks_per_sec();
+        s->min_rd_latency_ns = min_ns[BDRV_ACCT_READ];
+        s->max_rd_latency_ns = w->max_ns[BDRV_ACCT_READ];
+        s->avg_rd_latency_ns = avg_ns[BDRV_ACCT_READ];
+        s->min_wr_latency_ns = min_ns[BDRV_ACCT_WRITE];
+        s->max_wr_latency_ns = w->max_ns[BDRV_ACCT_WRITE];
+        s->avg_wr_latency_ns = avg_ns[BDRV_ACCT_WRITE];
+        s->min_flush_latency_ns = min_ns[BDRV_ACCT_FLUSH];
+        s->max_flush_latency_ns = w->max_ns[BDRV_ACCT_FLUSH];
+        s->avg_flush_latency_ns = avg_ns[BDRV_ACCT_FLUSH];
+        /* Little's law: the time spent by all requests over the time */
+        if (elapsed > 0) {
+            s->avg_rd_queue_depth =
+                (double)w->sum_ns[BDRV_ACCT_READ] / elapsed;
+            s->avg_wr_queue_depth =
+                (double)w->sum_ns[BDRV_ACCT_WRITE] / elapsed;
+        }
+
+        entry->value = s;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return head;
 }
 
 int bdrv_img_create(const char *filename, const char *fmt,
@@ -4555,3 +5798,94 @@ out:
 
     return ret;
 }
+
+AioContext *bdrv_get_aio_context(BlockDriverState *bs)
+{
+    return bs->aio_context;
+}
+
+static void bdrv_detach_aio_context(BlockDriverState *bs)
+{
+    if (!bs->drv) {
+        return;
+    }
+
+    if (bs->drv->bdrv_detach_aio_context) {
+        bs->drv->bdrv_detach_aio_context(bs);
+    }
+    if (bs->file) {
+        bdrv_detach_aio_context(bs->file);
+    }
+    if (bs->backing_hd) {
+        bdrv_detach_aio_context(bs->backing_hd);
+    }
+
+    bs->aio_context = NULL;
+}
+
+static void bdrv_attach_aio_context(BlockDriverState *bs,
+                                    AioContext *new_context)
+{
+    bs->aio_context = new_context;
+
+    if (!bs->drv) {
+        return;
+    }
+
+    if (bs->backing_hd) {
+        bdrv_attach_aio_context(bs->backing_hd, new_context);
+    }
+    if (bs->file) {
+        bdrv_attach_aio_context(bs->file, new_context);
+    }
+    if (bs->drv->bdrv_attach_aio_context) {
+        bs->drv->bdrv_attach_aio_context(bs, new_context);
+    }
+}
+
+/* Move a BlockDriverState and its children to @new_context.  After this
+ * returns, completion callbacks and bottom halves for @bs run in whichever
+ * thread calls aio_poll() on @new_context.  I/O throttling, request merging
+ * and block jobs still depend on the global timer list and must not be used
+ * with an AioContext other than the main loop's.
+ */
+void bdrv_set_aio_context(BlockDriverState *bs, AioContext *new_context)
+{
+    bdrv_drain_all(); /* ensure there are no in-flight requests */
+
+    bdrv_detach_aio_context(bs);
+    bdrv_attach_aio_context(bs, new_context);
+}
+
+/*
+ * Requests submitted between bdrv_io_plug() and bdrv_io_unplug() may be
+ * queued by the driver and submitted together on unplug. Calls can be
+ * nested; only the outermost unplug submits the queued requests.
+ */
+void bdrv_io_plug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    bs->io_plug_depth++;
+    if (drv && drv->bdrv_io_plug) {
+        drv->bdrv_io_plug(bs);
+    } else if (bs->file) {
+        bdrv_io_plug(bs->file);
+    }
+}
+
+void bdrv_io_unplug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    assert(bs->io_plug_depth > 0);
+    if (--bs->io_plug_depth == 0 && !QTAILQ_EMPTY(&bs->merge_queue)) {
+        /* the driver is still plugged and sees the merged requests at once */
+        bdrv_merge_submit(bs);
+    }
+    if (drv && drv->bdrv_io_unplug) {
+        drv->bdrv_io_unplug(bs);
+    } else if (bs->file) {
+        bdrv_io_unplug(bs->file);
+    }
+}
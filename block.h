@@ -83,6 +83,9 @@ typedef struct BlockDevOps {
 #define BDRV_O_INCOMING    0x0800  /* consistency hint for incoming migration */
 #define BDRV_O_CHECK       0x1000  /* open solely for consistency check */
 #define BDRV_O_ALLOW_RDWR  0x2000  /* allow reopen to change from r/o to r/w */
+#define BDRV_O_IO_URING    0x4000  /* use io_uring instead of the thread pool */
+#define BDRV_O_SQPOLL      0x8000  /* poll the io_uring from a kernel thread */
+#define BDRV_O_FIXED_BUFS  0x10000 /* register guest RAM with the io_uring */
 
 #define BDRV_O_CACHE_MASK  (BDRV_O_NOCACHE | BDRV_O_CACHE_WB | BDRV_O_NO_FLUSH)
 
@@ -118,6 +121,9 @@ void bdrv_io_limits_enable(BlockDriverState *bs);
 void bdrv_io_limits_disable(BlockDriverState *bs);
 bool bdrv_io_limits_enabled(BlockDriverState *bs);
 
+/* request merging for device emulation */
+void bdrv_set_io_merge(BlockDriverState *bs, bool enabled, int64_t window_ns);
+
 void bdrv_init(void);
 void bdrv_init_with_whitelist(void);
 BlockDriver *bdrv_find_protocol(const char *filename);
@@ -136,6 +142,9 @@ int bdrv_file_open(BlockDriverState **pbs, const char *filename, int flags);
 int bdrv_open_backing_file(BlockDriverState *bs);
 int bdrv_open(BlockDriverState *bs, const char *filename, int flags,
               BlockDriver *drv);
+void bdrv_open_async(BlockDriverState *bs, const char *filename, int flags,
+                     BlockDriver *drv, BlockDriverCompletionFunc *cb,
+                     void *opaque);
 BlockReopenQueue *bdrv_reopen_queue(BlockReopenQueue *bs_queue,
                                     BlockDriverState *bs, int flags);
 int bdrv_reopen_multiple(BlockReopenQueue *bs_queue, Error **errp);
@@ -162,6 +171,8 @@ int bdrv_read_unthrottled(BlockDriverState *bs, int64_t sector_num,
                           uint8_t *buf, int nb_sectors);
 int bdrv_write(BlockDriverState *bs, int64_t sector_num,
                const uint8_t *buf, int nb_sectors);
+int bdrv_write_zeroes(BlockDriverState *bs, int64_t sector_num,
+                      int nb_sectors);
 int bdrv_pread(BlockDriverState *bs, int64_t offset,
                void *buf, int count);
 int bdrv_pwrite(BlockDriverState *bs, int64_t offset,
@@ -172,8 +183,14 @@ int coroutine_fn bdrv_co_readv(BlockDriverState *bs, int64_t sector_num,
     int nb_sectors, QEMUIOVector *qiov);
 int coroutine_fn bdrv_co_copy_on_readv(BlockDriverState *bs,
     int64_t sector_num, int nb_sectors, QEMUIOVector *qiov);
+int coroutine_fn bdrv_co_no_copy_on_readv(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov);
 int coroutine_fn bdrv_co_writev(BlockDriverState *bs, int64_t sector_num,
     int nb_sectors, QEMUIOVector *qiov);
+int coroutine_fn bdrv_co_serialising_writev(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov);
+int coroutine_fn bdrv_co_serialising_write_zeroes(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors);
 /*
  * Efficiently zero a region of the disk image.  Note that this is a regular
  * I/O request like read or write and should have a reasonable size.  This
@@ -188,6 +205,42 @@ int coroutine_fn bdrv_co_is_allocated_above(BlockDriverState *top,
                                             BlockDriverState *base,
                                             int64_t sector_num,
                                             int nb_sectors, int *pnum);
+
+/* extent types returned by bdrv_co_get_extent() */
+#define BDRV_EXTENT_UNALLOCATED 0   /* contents come from the backing file */
+#define BDRV_EXTENT_DATA        1
+#define BDRV_EXTENT_ZERO        2   /* reads as zeroes */
+
+int coroutine_fn bdrv_co_get_extent(BlockDriverState *bs, int64_t sector_num,
+                                    int nb_sectors, int *pnum);
+int coroutine_fn bdrv_co_get_extent_above(BlockDriverState *top,
+                                          BlockDriverState *base,
+                                          int64_t sector_num,
+                                          int nb_sectors, int *pnum);
+
+/* A run of sectors that share their BDRV_EXTENT_* type */
+typedef struct BdrvExtent {
+    int64_t sector_num;
+    int64_t nb_sectors;
+    int type;
+    int depth;          /* image in the backing chain, 0 is the top */
+} BdrvExtent;
+
+int coroutine_fn bdrv_co_get_extents(BlockDriverState *bs, int64_t sector_num,
+                                     int64_t nb_sectors, BdrvExtent *extents,
+                                     int max_extents);
+int bdrv_get_extents(BlockDriverState *bs, int64_t sector_num,
+                     int64_t nb_sectors, BdrvExtent *extents, int max_extents);
+
+/* Sizes of an image that bdrv_measure() computes, in bytes */
+typedef struct BlockMeasureInfo {
+    uint64_t required;          /* to hold the allocated data */
+    uint64_t fully_allocated;   /* if all of the image is allocated */
+} BlockMeasureInfo;
+
+int bdrv_measure(BlockDriver *drv, QEMUOptionParameter *options,
+                 BlockDriverState *in_bs, BlockMeasureInfo *info);
+int64_t bdrv_get_data_size(BlockDriverState *bs, int64_t granularity);
 BlockDriverState *bdrv_find_backing_image(BlockDriverState *bs,
     const char *backing_file);
 int bdrv_get_backing_file_depth(BlockDriverState *bs);
@@ -269,10 +322,18 @@ void bdrv_clear_incoming_migration_all(void);
 /* Ensure contents are flushed to disk.  */
 int bdrv_flush(BlockDriverState *bs);
 int coroutine_fn bdrv_co_flush(BlockDriverState *bs);
-void bdrv_flush_all(void);
+int bdrv_flush_multiple(BlockDriverState **bs_list, int n);
+int bdrv_flush_all(void);
 void bdrv_close_all(void);
+void bdrv_drain(BlockDriverState *bs);
 void bdrv_drain_all(void);
 
+AioContext *bdrv_get_aio_context(BlockDriverState *bs);
+void bdrv_set_aio_context(BlockDriverState *bs, AioContext *new_context);
+
+void bdrv_io_plug(BlockDriverState *bs);
+void bdrv_io_unplug(BlockDriverState *bs);
+
 int bdrv_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors);
 int bdrv_co_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors);
 int bdrv_has_zero_init(BlockDriverState *bs);
@@ -281,12 +342,15 @@ int bdrv_is_allocated(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
 
 void bdrv_set_on_error(BlockDriverState *bs, BlockdevOnError on_read_error,
                        BlockdevOnError on_write_error);
+int bdrv_set_cache_size(BlockDriverState *bs, uint64_t l2_cache_size,
+                        uint64_t refcount_cache_size);
 BlockdevOnError bdrv_get_on_error(BlockDriverState *bs, bool is_read);
 BlockErrorAction bdrv_get_error_action(BlockDriverState *bs, bool is_read, int error);
 void bdrv_error_action(BlockDriverState *bs, BlockErrorAction action,
                        bool is_read, int error);
 int bdrv_is_read_only(BlockDriverState *bs);
 int bdrv_is_sg(BlockDriverState *bs);
+uint32_t bdrv_get_discard_granularity(BlockDriverState *bs);
 int bdrv_enable_write_cache(BlockDriverState *bs);
 void bdrv_set_enable_write_cache(BlockDriverState *bs, bool wce);
 int bdrv_is_inserted(BlockDriverState *bs);
@@ -306,6 +370,8 @@ void bdrv_iterate_format(void (*it)(void *opaque, const char *name),
                          void *opaque);
 const char *bdrv_get_device_name(BlockDriverState *bs);
 int bdrv_get_flags(BlockDriverState *bs);
+/* nb_sectors is a multiple of the cluster size; drivers may compress the
+ * clusters in parallel */
 int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
                           const uint8_t *buf, int nb_sectors);
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi);
@@ -349,16 +415,31 @@ int bdrv_img_create(const char *filename, const char *fmt,
 
 void bdrv_set_buffer_alignment(BlockDriverState *bs, int align);
 void *qemu_blockalign(BlockDriverState *bs, size_t size);
+void bdrv_round_to_clusters(BlockDriverState *bs,
+                            int64_t sector_num, int nb_sectors,
+                            int64_t *cluster_sector_num,
+                            int *cluster_nb_sectors);
 
-#define BDRV_SECTORS_PER_DIRTY_CHUNK 2048
+#define BDRV_LOG_SECTORS_PER_DIRTY_CHUNK 11
+#define BDRV_SECTORS_PER_DIRTY_CHUNK (1 << BDRV_LOG_SECTORS_PER_DIRTY_CHUNK)
 
-void bdrv_set_dirty_tracking(BlockDriverState *bs, int enable);
+struct HBitmapIter;
+void bdrv_set_dirty_tracking(BlockDriverState *bs, int granularity);
 int bdrv_get_dirty(BlockDriverState *bs, int64_t sector);
 void bdrv_set_dirty(BlockDriverState *bs, int64_t cur_sector, int nr_sectors);
 void bdrv_reset_dirty(BlockDriverState *bs, int64_t cur_sector, int nr_sectors);
 int64_t bdrv_get_next_dirty(BlockDriverState *bs, int64_t sector);
+void bdrv_dirty_iter_init(BlockDriverState *bs, struct HBitmapIter *hbi);
 int64_t bdrv_get_dirty_count(BlockDriverState *bs);
 
+typedef struct BdrvDirtyBitmap BdrvDirtyBitmap;
+BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs,
+                                          const char *name, int granularity);
+BdrvDirtyBitmap *bdrv_find_dirty_bitmap(BlockDriverState *bs,
+                                        const char *name);
+void bdrv_release_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap);
+bool bdrv_can_persist_dirty_bitmaps(BlockDriverState *bs);
+
 void bdrv_enable_copy_on_read(BlockDriverState *bs);
 void bdrv_disable_copy_on_read(BlockDriverState *bs);
 
@@ -382,6 +463,17 @@ void bdrv_acct_start(BlockDriverState *bs, BlockAcctCookie *cookie,
         int64_t bytes, enum BlockAcctType type);
 void bdrv_acct_done(BlockDriverState *bs, BlockAcctCookie *cookie);
 
+/* Latency histogram of one request type; @nb_boundaries == 0 disables it.
+ * bdrv_reset_latency_histograms() restores the default boundaries.
+ */
+int bdrv_set_latency_histogram(BlockDriverState *bs, enum BlockAcctType type,
+                               const uint64_t *boundaries, int nb_boundaries);
+void bdrv_reset_latency_histograms(BlockDriverState *bs);
+
+/* Intervals in seconds over which min/max/average latencies are kept */
+int bdrv_set_stats_intervals(BlockDriverState *bs, const uint64_t *intervals,
+                             int nb_intervals);
+
 typedef enum {
     BLKDBG_L1_UPDATE,
 
@@ -431,4 +523,13 @@ typedef enum {
 #define BLKDBG_EVENT(bs, evt) bdrv_debug_event(bs, evt)
 void bdrv_debug_event(BlockDriverState *bs, BlkDebugEvent event);
 
+#ifdef CONFIG_LINUX_AIO
+int raw_get_aio_fd(BlockDriverState *bs);
+#else
+static inline int raw_get_aio_fd(BlockDriverState *bs)
+{
+    return -ENOTSUP;
+}
+#endif
+
 #endif
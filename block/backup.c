@@ -0,0 +1,518 @@
+/*
+ * QEMU backup
+ *
+ * A point-in-time copy of a block device.  Old data is saved to the target
+ * before guest writes overwrite it, while a background loop copies the
+ * rest of the device.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "block.h"
+#include "block_int.h"
+#include "blockjob.h"
+#include "qemu/ratelimit.h"
+
+#define BACKUP_CLUSTER_BITS 16
+#define BACKUP_CLUSTER_SIZE (1 << BACKUP_CLUSTER_BITS)
+#define BACKUP_SECTORS_PER_CLUSTER (BACKUP_CLUSTER_SIZE / BDRV_SECTOR_SIZE)
+
+#define SLICE_TIME 100000000ULL /* ns */
+
+typedef struct CowRequest {
+    int64_t start;
+    int64_t end;
+    QLIST_ENTRY(CowRequest) list;
+    CoQueue wait_queue; /* coroutines blocked on this request */
+} CowRequest;
+
+typedef struct BackupBlockJob {
+    BlockJob common;
+    BlockDriverState *target;
+    MirrorSyncMode sync_mode;
+    RateLimit limit;
+    BlockdevOnError on_source_error;
+    BlockdevOnError on_target_error;
+    CoRwlock flush_rwlock;
+    uint64_t sectors_read;
+
+    /* Clusters that need not be copied (anymore), one bit per cluster */
+    HBitmap *done_bitmap;
+
+    /* Incremental mode: the user's bitmap and the clusters it selected
+     * when the job started, one bit per cluster */
+    BdrvDirtyBitmap *sync_bitmap;
+    HBitmap *copy_bitmap;
+
+    /* Error while saving old data for a guest write; fails the job */
+    int cow_ret;
+
+    QLIST_HEAD(, CowRequest) inflight_reqs;
+} BackupBlockJob;
+
+/* See if in-flight requests overlap and wait for them to complete */
+static void coroutine_fn wait_for_overlapping_requests(BackupBlockJob *job,
+                                                       int64_t start,
+                                                       int64_t end)
+{
+    CowRequest *req;
+    bool retry;
+
+    do {
+        retry = false;
+        QLIST_FOREACH(req, &job->inflight_reqs, list) {
+            if (end > req->start && start < req->end) {
+                qemu_co_queue_wait(&req->wait_queue);
+                retry = true;
+                break;
+            }
+        }
+    } while (retry);
+}
+
+/* Keep track of an in-flight request */
+static void cow_request_begin(CowRequest *req, BackupBlockJob *job,
+                              int64_t start, int64_t end)
+{
+    req->start = start;
+    req->end = end;
+    qemu_co_queue_init(&req->wait_queue);
+    QLIST_INSERT_HEAD(&job->inflight_reqs, req, list);
+}
+
+/* Forget about a completed request */
+static void cow_request_end(CowRequest *req)
+{
+    QLIST_REMOVE(req, list);
+    qemu_co_queue_restart_all(&req->wait_queue);
+}
+
+static int coroutine_fn backup_do_cow(BackupBlockJob *job,
+                                      int64_t sector_num, int nb_sectors,
+                                      bool is_write_notifier,
+                                      bool *error_is_read)
+{
+    BlockDriverState *bs = job->common.bs;
+    CowRequest cow_request;
+    struct iovec iov;
+    QEMUIOVector bounce_qiov;
+    void *bounce_buffer = NULL;
+    int ret = 0;
+    int64_t start, end;
+    int n;
+
+    qemu_co_rwlock_rdlock(&job->flush_rwlock);
+
+    start = sector_num / BACKUP_SECTORS_PER_CLUSTER;
+    end = DIV_ROUND_UP(sector_num + nb_sectors, BACKUP_SECTORS_PER_CLUSTER);
+
+    trace_backup_do_cow_enter(job, start, sector_num, nb_sectors);
+
+    wait_for_overlapping_requests(job, start, end);
+    cow_request_begin(&cow_request, job, start, end);
+
+    for (; start < end; start++) {
+        if (hbitmap_get(job->done_bitmap, start)) {
+            trace_backup_do_cow_skip(job, start);
+            continue; /* already copied */
+        }
+
+        trace_backup_do_cow_process(job, start);
+
+        n = MIN(BACKUP_SECTORS_PER_CLUSTER,
+                job->common.bs->total_sectors -
+                start * BACKUP_SECTORS_PER_CLUSTER);
+
+        if (!bounce_buffer) {
+            bounce_buffer = qemu_blockalign(bs, BACKUP_CLUSTER_SIZE);
+        }
+        iov.iov_base = bounce_buffer;
+        iov.iov_len = n * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&bounce_qiov, &iov, 1);
+
+        /* The notifier runs inside the guest's write request, which must not
+         * wait for itself or trigger copy-on-read writes to the source */
+        if (is_write_notifier) {
+            ret = bdrv_co_no_copy_on_readv(bs,
+                                           start * BACKUP_SECTORS_PER_CLUSTER,
+                                           n, &bounce_qiov);
+        } else {
+            ret = bdrv_co_readv(bs, start * BACKUP_SECTORS_PER_CLUSTER, n,
+                                &bounce_qiov);
+        }
+        if (ret < 0) {
+            trace_backup_do_cow_read_fail(job, start, ret);
+            if (error_is_read) {
+                *error_is_read = true;
+            }
+            goto out;
+        }
+
+        /* The target may be read concurrently through a point-in-time
+         * export, whose reads of uncopied clusters go to the source */
+        if (buffer_is_zero(iov.iov_base, iov.iov_len)) {
+            ret = bdrv_co_serialising_write_zeroes(job->target,
+                                       start * BACKUP_SECTORS_PER_CLUSTER, n);
+        } else {
+            ret = bdrv_co_serialising_writev(job->target,
+                                 start * BACKUP_SECTORS_PER_CLUSTER, n,
+                                 &bounce_qiov);
+        }
+        if (ret < 0) {
+            trace_backup_do_cow_write_fail(job, start, ret);
+            if (error_is_read) {
+                *error_is_read = false;
+            }
+            goto out;
+        }
+
+        hbitmap_set(job->done_bitmap, start, 1);
+
+        /* Publish progress, guest I/O counts as progress too.  Note that the
+         * offset field is an opaque progress value, it is not a disk offset.
+         */
+        job->sectors_read += n;
+        job->common.offset += n * BDRV_SECTOR_SIZE;
+    }
+
+out:
+    if (bounce_buffer) {
+        qemu_vfree(bounce_buffer);
+    }
+
+    cow_request_end(&cow_request);
+
+    trace_backup_do_cow_return(job, sector_num, nb_sectors, ret);
+
+    qemu_co_rwlock_unlock(&job->flush_rwlock);
+
+    return ret;
+}
+
+typedef struct BackupBeforeWrite {
+    NotifierWithReturn notifier;
+    BackupBlockJob *job;
+} BackupBeforeWrite;
+
+static int coroutine_fn backup_before_write_notify(
+        NotifierWithReturn *notifier,
+        void *opaque)
+{
+    BackupBeforeWrite *before_write =
+        container_of(notifier, BackupBeforeWrite, notifier);
+    BackupBlockJob *job = before_write->job;
+    BdrvTrackedRequest *req = opaque;
+    int ret;
+
+    if (job->cow_ret < 0) {
+        return 0;
+    }
+
+    ret = backup_do_cow(job, req->sector_num, req->nb_sectors, true, NULL);
+    if (ret < 0) {
+        /* The guest write still goes through, so the target is no longer a
+         * point-in-time copy.  Let the job fail instead of the guest.
+         */
+        job->cow_ret = ret;
+    }
+    return 0;
+}
+
+static void backup_set_speed(BlockJob *job, int64_t speed, Error **errp)
+{
+    BackupBlockJob *s = container_of(job, BackupBlockJob, common);
+
+    if (speed < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER, "speed");
+        return;
+    }
+    ratelimit_set_speed(&s->limit, speed / BDRV_SECTOR_SIZE, SLICE_TIME);
+}
+
+static void backup_iostatus_reset(BlockJob *job)
+{
+    BackupBlockJob *s = container_of(job, BackupBlockJob, common);
+
+    bdrv_iostatus_reset(s->target);
+}
+
+static BlockJobType backup_job_type = {
+    .instance_size  = sizeof(BackupBlockJob),
+    .job_type       = "backup",
+    .set_speed      = backup_set_speed,
+    .iostatus_reset = backup_iostatus_reset,
+};
+
+static BlockErrorAction backup_error_action(BackupBlockJob *job,
+                                            bool read, int error)
+{
+    if (read) {
+        return block_job_error_action(&job->common, job->common.bs,
+                                      job->on_source_error, true, error);
+    } else {
+        return block_job_error_action(&job->common, job->target,
+                                      job->on_target_error, false, error);
+    }
+}
+
+/* Returns 1 if any sector of the cluster is allocated in the top image */
+static int coroutine_fn backup_cluster_allocated(BlockDriverState *bs,
+                                                 int64_t cluster)
+{
+    int64_t sector_num = cluster * BACKUP_SECTORS_PER_CLUSTER;
+    int nb_sectors = MIN(BACKUP_SECTORS_PER_CLUSTER,
+                         bs->total_sectors - sector_num);
+    int i, n, ret;
+
+    /* bdrv_co_is_allocated() only reports the state of the first run of
+     * sectors, so look at the whole cluster. */
+    for (i = 0; i < nb_sectors; i += n) {
+        ret = bdrv_co_is_allocated(bs, sector_num + i, nb_sectors - i, &n);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Turn the user's bitmap into the set of clusters to copy, and start a new
+ * generation in the user's bitmap.  Clusters that are not selected count as
+ * done so that guest writes to them do not copy anything either.
+ */
+static void backup_start_incremental(BackupBlockJob *job, int64_t end)
+{
+    HBitmap *bitmap = job->sync_bitmap->bitmap;
+    int granularity = hbitmap_granularity(bitmap);
+    HBitmapIter hbi;
+    int64_t sector, cluster, last;
+
+    job->copy_bitmap = hbitmap_alloc(end, 0);
+
+    hbitmap_iter_init(&hbi, bitmap, 0);
+    while ((sector = hbitmap_iter_next(&hbi)) >= 0) {
+        cluster = sector / BACKUP_SECTORS_PER_CLUSTER;
+        last = DIV_ROUND_UP(sector + (1LL << granularity),
+                            BACKUP_SECTORS_PER_CLUSTER);
+        hbitmap_set(job->copy_bitmap, cluster, MIN(last, end) - cluster);
+    }
+    hbitmap_reset_all(bitmap);
+
+    hbitmap_set(job->done_bitmap, 0, end);
+    hbitmap_iter_init(&hbi, job->copy_bitmap, 0);
+    while ((cluster = hbitmap_iter_next(&hbi)) >= 0) {
+        hbitmap_reset(job->done_bitmap, cluster, 1);
+    }
+
+    job->common.len = hbitmap_count(job->copy_bitmap) * BACKUP_CLUSTER_SIZE;
+}
+
+/* The clusters of a failed incremental backup must be copied next time */
+static void backup_abort_incremental(BackupBlockJob *job)
+{
+    BlockDriverState *bs = job->common.bs;
+    HBitmapIter hbi;
+    int64_t cluster, sector_num;
+
+    hbitmap_iter_init(&hbi, job->copy_bitmap, 0);
+    while ((cluster = hbitmap_iter_next(&hbi)) >= 0) {
+        sector_num = cluster * BACKUP_SECTORS_PER_CLUSTER;
+        hbitmap_set(job->sync_bitmap->bitmap, sector_num,
+                    MIN(BACKUP_SECTORS_PER_CLUSTER,
+                        bs->total_sectors - sector_num));
+    }
+}
+
+static void coroutine_fn backup_run(void *opaque)
+{
+    BackupBlockJob *job = opaque;
+    BackupBeforeWrite before_write = {
+        .notifier.notify = backup_before_write_notify,
+        .job = job,
+    };
+    BlockDriverState *bs = job->common.bs;
+    BlockDriverState *target = job->target;
+    BlockdevOnError on_target_error = job->on_target_error;
+    HBitmapIter hbi;
+    int64_t start, end;
+    int ret = 0;
+
+    QLIST_INIT(&job->inflight_reqs);
+    qemu_co_rwlock_init(&job->flush_rwlock);
+
+    end = DIV_ROUND_UP(bs->total_sectors, BACKUP_SECTORS_PER_CLUSTER);
+
+    job->done_bitmap = hbitmap_alloc(end, 0);
+    if (job->sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) {
+        backup_start_incremental(job, end);
+        hbitmap_iter_init(&hbi, job->copy_bitmap, 0);
+    }
+
+    bdrv_set_enable_write_cache(target, true);
+    bdrv_set_on_error(target, on_target_error, on_target_error);
+    bdrv_iostatus_enable(target);
+
+    bdrv_add_before_write_notifier(bs, &before_write.notifier);
+
+    start = 0;
+    while (job->cow_ret == 0) {
+        bool error_is_read;
+
+        /* Note that even when no rate limit is applied we need to yield
+         * with no pending I/O here so that qemu_aio_flush() returns.
+         */
+        if (job->sync_mode == MIRROR_SYNC_MODE_NONE) {
+            /* Only the before write notifier copies data; wake up now and
+             * then to check for its errors */
+            block_job_sleep_ns(&job->common, rt_clock, SLICE_TIME);
+        } else if (job->common.speed) {
+            uint64_t delay_ns = ratelimit_calculate_delay(&job->limit,
+                                                          job->sectors_read);
+            job->sectors_read = 0;
+            block_job_sleep_ns(&job->common, rt_clock, delay_ns);
+        } else {
+            block_job_sleep_ns(&job->common, rt_clock, 0);
+        }
+
+        if (block_job_is_cancelled(&job->common)) {
+            break;
+        }
+        if (job->sync_mode == MIRROR_SYNC_MODE_NONE) {
+            continue;
+        }
+
+        /* Pick the next cluster */
+        if (job->sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) {
+            start = hbitmap_iter_next(&hbi);
+            if (start < 0) {
+                break;
+            }
+        } else if (start >= end) {
+            break;
+        }
+
+        if (job->sync_mode == MIRROR_SYNC_MODE_TOP) {
+            ret = backup_cluster_allocated(bs, start);
+            if (ret < 0) {
+                error_is_read = true;
+                goto error;
+            }
+            if (ret == 0) {
+                /* Not allocated in the topmost image, nothing to copy */
+                start++;
+                continue;
+            }
+        }
+
+        ret = backup_do_cow(job, start * BACKUP_SECTORS_PER_CLUSTER,
+                            BACKUP_SECTORS_PER_CLUSTER, false, &error_is_read);
+        if (ret == 0) {
+            start++;
+            continue;
+        }
+
+error:
+        /* Depending on error action, fail now, skip or retry the cluster */
+        switch (backup_error_action(job, error_is_read, -ret)) {
+        case BDRV_ACTION_REPORT:
+            goto out;
+        case BDRV_ACTION_IGNORE:
+            ret = 0;
+            start++;
+            break;
+        default:
+            ret = 0;
+            if (job->sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) {
+                /* Retry with the iterator positioned on this cluster */
+                hbitmap_iter_init(&hbi, job->copy_bitmap, start);
+            }
+            break;
+        }
+    }
+
+out:
+    notifier_with_return_remove(&before_write.notifier);
+
+    /* wait until pending backup_do_cow() calls have completed */
+    qemu_co_rwlock_wrlock(&job->flush_rwlock);
+    qemu_co_rwlock_unlock(&job->flush_rwlock);
+
+    if (ret == 0) {
+        ret = job->cow_ret;
+    }
+
+    if (job->sync_bitmap) {
+        if (ret < 0 || block_job_is_cancelled(&job->common)) {
+            backup_abort_incremental(job);
+        }
+        job->sync_bitmap->frozen = false;
+        hbitmap_free(job->copy_bitmap);
+    }
+    hbitmap_free(job->done_bitmap);
+
+    bdrv_iostatus_disable(target);
+    bdrv_delete(target);
+
+    block_job_completed(&job->common, ret);
+}
+
+void backup_start(BlockDriverState *bs, BlockDriverState *target,
+                  int64_t speed, MirrorSyncMode sync_mode,
+                  BdrvDirtyBitmap *sync_bitmap,
+                  BlockdevOnError on_source_error,
+                  BlockdevOnError on_target_error,
+                  BlockDriverCompletionFunc *cb, void *opaque,
+                  Error **errp)
+{
+    BackupBlockJob *job;
+    int64_t len;
+
+    assert(bs);
+    assert(target);
+    assert(cb);
+    assert((sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) == !!sync_bitmap);
+
+    if ((on_source_error == BLOCKDEV_ON_ERROR_STOP ||
+         on_source_error == BLOCKDEV_ON_ERROR_ENOSPC) &&
+        !bdrv_iostatus_is_enabled(bs)) {
+        error_set(errp, QERR_INVALID_PARAMETER, "on-source-error");
+        return;
+    }
+
+    if (sync_bitmap && sync_bitmap->frozen) {
+        error_setg(errp, "Bitmap '%s' is in use by another job",
+                   sync_bitmap->name);
+        return;
+    }
+
+    len = bdrv_getlength(bs);
+    if (len < 0) {
+        error_set(errp, QERR_IO_ERROR);
+        return;
+    }
+
+    job = block_job_create(&backup_job_type, bs, speed, cb, opaque, errp);
+    if (!job) {
+        return;
+    }
+
+    job->on_source_error = on_source_error;
+    job->on_target_error = on_target_error;
+    job->target = target;
+    job->sync_mode = sync_mode;
+    job->sync_bitmap = sync_bitmap;
+    if (sync_bitmap) {
+        sync_bitmap->frozen = true;
+    }
+    job->common.len = len;
+    job->common.co = qemu_coroutine_create(backup_run);
+    trace_backup_start(bs, target, job, job->common.co, opaque);
+    qemu_coroutine_enter(job->common.co, job);
+}
@@ -0,0 +1,269 @@
+/*
+ * Cache of decompressed chunks for read-only compressed image formats
+ *
+ * Formats like dmg and cloop store the image in chunks that can only be
+ * decompressed as a whole.  The cache keeps the most recently used chunks
+ * decompressed, decompresses in the thread pool, and loads the chunks that
+ * follow the one being read in the background.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "block/chunk-cache.h"
+#include "thread-pool.h"
+#include "qemu-aio.h"
+
+#define CHUNK_NONE UINT32_MAX
+
+typedef struct ChunkCacheEntry {
+    uint32_t chunk;         /* CHUNK_NONE if free */
+    uint8_t *data;          /* decompressed chunk, allocated on first use */
+    uint64_t lru_counter;
+    bool loading;           /* being read or decompressed */
+    CoQueue waiters;        /* readers waiting for the load to finish */
+} ChunkCacheEntry;
+
+struct ChunkCache {
+    BlockDriverState *bs;
+    const ChunkCacheOps *ops;
+    uint32_t n_chunks;
+    size_t max_chunk_size;
+    ChunkCacheEntry entries[CHUNK_CACHE_MAX];
+    int size;
+    uint64_t lru_counter;
+    int readahead_in_flight;
+};
+
+typedef struct ChunkCacheJob {
+    ChunkCache *c;
+    ChunkCacheEntry *entry;
+    const uint8_t *in;
+    uint64_t length;
+} ChunkCacheJob;
+
+ChunkCache *chunk_cache_new(BlockDriverState *bs, const ChunkCacheOps *ops,
+                            uint32_t n_chunks, size_t max_chunk_size)
+{
+    ChunkCache *c = g_malloc0(sizeof(*c));
+    int i;
+
+    c->bs = bs;
+    c->ops = ops;
+    c->n_chunks = n_chunks;
+    c->max_chunk_size = MAX(max_chunk_size, 1);
+    c->size = MAX(2, MIN(CHUNK_CACHE_MAX,
+                         CHUNK_CACHE_BYTES / c->max_chunk_size));
+    for (i = 0; i < c->size; i++) {
+        c->entries[i].chunk = CHUNK_NONE;
+        qemu_co_queue_init(&c->entries[i].waiters);
+    }
+
+    return c;
+}
+
+void chunk_cache_free(ChunkCache *c)
+{
+    int i;
+
+    if (!c) {
+        return;
+    }
+
+    while (c->readahead_in_flight) {
+        qemu_aio_wait();
+    }
+    for (i = 0; i < c->size; i++) {
+        assert(!c->entries[i].loading);
+        qemu_vfree(c->entries[i].data);
+    }
+    g_free(c);
+}
+
+static ChunkCacheEntry *chunk_cache_find(ChunkCache *c, uint32_t chunk)
+{
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        if (c->entries[i].chunk == chunk) {
+            return &c->entries[i];
+        }
+    }
+    return NULL;
+}
+
+/* Claim the least recently used entry that is not being loaded for chunk,
+ * or return NULL if all of them are busy.  */
+static ChunkCacheEntry *chunk_cache_claim(ChunkCache *c, uint32_t chunk)
+{
+    ChunkCacheEntry *e = NULL;
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        ChunkCacheEntry *cur = &c->entries[i];
+
+        if (!cur->loading && (!e || cur->lru_counter < e->lru_counter)) {
+            e = cur;
+        }
+    }
+    if (e) {
+        if (!e->data) {
+            e->data = qemu_blockalign(c->bs, c->max_chunk_size);
+        }
+        e->chunk = chunk;
+        e->loading = true;
+    }
+    return e;
+}
+
+static void chunk_cache_loaded(ChunkCache *c, ChunkCacheEntry *e, int ret)
+{
+    e->loading = false;
+    if (ret < 0) {
+        e->chunk = CHUNK_NONE;
+        e->lru_counter = 0;
+    } else {
+        e->lru_counter = ++c->lru_counter;
+    }
+    qemu_co_queue_restart_all(&e->waiters);
+}
+
+static int chunk_cache_worker(void *opaque)
+{
+    ChunkCacheJob *job = opaque;
+    ChunkCache *c = job->c;
+
+    return c->ops->decompress(c->bs, job->entry->chunk, job->in, job->length,
+                              job->entry->data);
+}
+
+/* Read the chunk of entry e from the image and decompress it */
+static int coroutine_fn chunk_cache_load(ChunkCache *c, ChunkCacheEntry *e)
+{
+    BlockDriverState *bs = c->bs;
+    ChunkCacheJob job;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    uint64_t offset, length;
+    int64_t sector_num;
+    int nb_sectors;
+    uint8_t *buf = NULL;
+    int ret;
+
+    ret = c->ops->get_extent(bs, e->chunk, &offset, &length);
+    if (ret < 0) {
+        return ret;
+    }
+
+    job.c = c;
+    job.entry = e;
+    job.in = NULL;
+    job.length = length;
+
+    if (length) {
+        sector_num = offset >> BDRV_SECTOR_BITS;
+        nb_sectors = DIV_ROUND_UP(offset + length, BDRV_SECTOR_SIZE) -
+                     sector_num;
+        iov.iov_len = nb_sectors * BDRV_SECTOR_SIZE;
+        iov.iov_base = buf = qemu_blockalign(bs, iov.iov_len);
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        ret = bdrv_co_readv(bs->file, sector_num, nb_sectors, &qiov);
+        if (ret < 0) {
+            goto out;
+        }
+        job.in = buf + (offset & (BDRV_SECTOR_SIZE - 1));
+    }
+
+    ret = thread_pool_submit_co(aio_get_thread_pool(bdrv_get_aio_context(bs)),
+                                chunk_cache_worker, &job);
+
+out:
+    qemu_vfree(buf);
+    return ret;
+}
+
+typedef struct ChunkCacheReadahead {
+    ChunkCache *c;
+    ChunkCacheEntry *entry;
+} ChunkCacheReadahead;
+
+static void coroutine_fn chunk_cache_readahead_co(void *opaque)
+{
+    ChunkCacheReadahead *ra = opaque;
+    ChunkCache *c = ra->c;
+    int ret;
+
+    ret = chunk_cache_load(c, ra->entry);
+    chunk_cache_loaded(c, ra->entry, ret);
+    c->readahead_in_flight--;
+    g_free(ra);
+}
+
+static void chunk_cache_start_readahead(ChunkCache *c, ChunkCacheEntry *e)
+{
+    ChunkCacheReadahead *ra = g_malloc(sizeof(*ra));
+    Coroutine *co;
+
+    ra->c = c;
+    ra->entry = e;
+    c->readahead_in_flight++;
+    co = qemu_coroutine_create(chunk_cache_readahead_co);
+    qemu_coroutine_enter(co, ra);
+}
+
+int coroutine_fn chunk_cache_get(ChunkCache *c, uint32_t chunk,
+                                 uint8_t **data)
+{
+    ChunkCacheEntry *e;
+    uint32_t next;
+    int ret;
+
+    if (chunk >= c->n_chunks) {
+        return -EIO;
+    }
+
+again:
+    e = chunk_cache_find(c, chunk);
+    if (e) {
+        if (e->loading) {
+            qemu_co_queue_wait(&e->waiters);
+            goto again;
+        }
+        e->lru_counter = ++c->lru_counter;
+        *data = e->data;
+        return 0;
+    }
+
+    e = chunk_cache_claim(c, chunk);
+    if (!e) {
+        /* Every entry is being loaded; wait for one to become free */
+        qemu_co_queue_wait(&c->entries[0].waiters);
+        goto again;
+    }
+
+    /* Overlap reading and decompressing the next chunks with this one */
+    for (next = chunk + 1;
+         next <= chunk + CHUNK_CACHE_READAHEAD && next < c->n_chunks;
+         next++) {
+        ChunkCacheEntry *ra;
+
+        if (chunk_cache_find(c, next)) {
+            continue;
+        }
+        ra = chunk_cache_claim(c, next);
+        if (!ra) {
+            break;
+        }
+        chunk_cache_start_readahead(c, ra);
+    }
+
+    ret = chunk_cache_load(c, e);
+    chunk_cache_loaded(c, e, ret);
+    if (ret < 0) {
+        return ret;
+    }
+
+    *data = e->data;
+    return 0;
+}
@@ -0,0 +1,52 @@
+/*
+ * Cache of decompressed chunks for read-only compressed image formats
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef BLOCK_CHUNK_CACHE_H
+#define BLOCK_CHUNK_CACHE_H
+
+#include "qemu-common.h"
+#include "qemu-coroutine.h"
+#include "block_int.h"
+
+/* Decompressed chunks kept in memory: as many as fit in CHUNK_CACHE_BYTES,
+ * but at least 2 and at most CHUNK_CACHE_MAX */
+#define CHUNK_CACHE_BYTES       (4 * 1024 * 1024)
+#define CHUNK_CACHE_MAX         32
+/* Chunks following the one being read that are loaded in the background */
+#define CHUNK_CACHE_READAHEAD   2
+
+typedef struct ChunkCache ChunkCache;
+
+typedef struct ChunkCacheOps {
+    /*
+     * Returns where the data of chunk is stored in bs->file, with a length
+     * of 0 for chunks that are not stored at all, or -errno.
+     */
+    int (*get_extent)(BlockDriverState *bs, uint32_t chunk,
+                      uint64_t *offset, uint64_t *length);
+
+    /*
+     * Turns the 'length' bytes read from the extent of chunk into the data
+     * of the chunk.  Called from the thread pool, so it must not touch any
+     * state that changes after bdrv_open.
+     */
+    int (*decompress)(BlockDriverState *bs, uint32_t chunk,
+                      const uint8_t *in, uint64_t length, uint8_t *out);
+} ChunkCacheOps;
+
+ChunkCache *chunk_cache_new(BlockDriverState *bs, const ChunkCacheOps *ops,
+                            uint32_t n_chunks, size_t max_chunk_size);
+void chunk_cache_free(ChunkCache *c);
+
+/*
+ * Returns the decompressed data of chunk in *data.  It stays valid until
+ * the calling coroutine yields.
+ */
+int coroutine_fn chunk_cache_get(ChunkCache *c, uint32_t chunk,
+                                 uint8_t **data);
+
+#endif
@@ -24,18 +24,15 @@
 #include "qemu-common.h"
 #include "block_int.h"
 #include "module.h"
+#include "block/chunk-cache.h"
 #include <zlib.h>
 
 typedef struct BDRVCloopState {
-    CoMutex lock;
     uint32_t block_size;
     uint32_t n_blocks;
     uint64_t *offsets;
     uint32_t sectors_per_block;
-    uint32_t current_block;
-    uint8_t *compressed_block;
-    uint8_t *uncompressed_block;
-    z_stream zstream;
+    ChunkCache *cache;
 } BDRVCloopState;
 
 static int cloop_probe(const uint8_t *buf, int buf_size, const char *filename)
@@ -53,10 +50,49 @@ static int cloop_probe(const uint8_t *buf, int buf_size, const char *filename)
     return 0;
 }
 
+static int cloop_get_extent(BlockDriverState *bs, uint32_t chunk,
+                            uint64_t *offset, uint64_t *length)
+{
+    BDRVCloopState *s = bs->opaque;
+
+    *offset = s->offsets[chunk];
+    *length = s->offsets[chunk + 1] - s->offsets[chunk];
+    return 0;
+}
+
+static int cloop_decompress(BlockDriverState *bs, uint32_t chunk,
+                            const uint8_t *in, uint64_t length, uint8_t *out)
+{
+    BDRVCloopState *s = bs->opaque;
+    z_stream zstream;
+    int ret;
+
+    memset(&zstream, 0, sizeof(zstream));
+    if (inflateInit(&zstream) != Z_OK) {
+        return -EIO;
+    }
+
+    zstream.next_in = (uint8_t *)in;
+    zstream.avail_in = length;
+    zstream.next_out = out;
+    zstream.avail_out = s->block_size;
+    ret = inflate(&zstream, Z_FINISH);
+    inflateEnd(&zstream);
+    if (ret != Z_STREAM_END || zstream.total_out != s->block_size) {
+        return -EIO;
+    }
+    return 0;
+}
+
+static const ChunkCacheOps cloop_chunk_ops = {
+    .get_extent = cloop_get_extent,
+    .decompress = cloop_decompress,
+};
+
 static int cloop_open(BlockDriverState *bs, int flags)
 {
     BDRVCloopState *s = bs->opaque;
-    uint32_t offsets_size, max_compressed_block_size = 1, i;
+    uint32_t offsets_size, i;
 
     bs->read_only = 1;
 
@@ -71,111 +107,65 @@ static int cloop_open(BlockDriverState *bs, int flags)
     }
     s->n_blocks = be32_to_cpu(s->n_blocks);
 
-    /* read offsets */
-    offsets_size = s->n_blocks * sizeof(uint64_t);
+    /* read offsets; the end of block i is the start of block i + 1 */
+    offsets_size = (s->n_blocks + 1) * sizeof(uint64_t);
     s->offsets = g_malloc(offsets_size);
     if (bdrv_pread(bs->file, 128 + 4 + 4, s->offsets, offsets_size) <
             offsets_size) {
         goto cloop_close;
     }
-    for(i=0;i<s->n_blocks;i++) {
+    for (i = 0; i <= s->n_blocks; i++) {
         s->offsets[i] = be64_to_cpu(s->offsets[i]);
-        if (i > 0) {
-            uint32_t size = s->offsets[i] - s->offsets[i - 1];
-            if (size > max_compressed_block_size) {
-                max_compressed_block_size = size;
-            }
+        if (i > 0 && s->offsets[i] < s->offsets[i - 1]) {
+            goto cloop_close;
         }
     }
 
-    /* initialize zlib engine */
-    s->compressed_block = g_malloc(max_compressed_block_size + 1);
-    s->uncompressed_block = g_malloc(s->block_size);
-    if (inflateInit(&s->zstream) != Z_OK) {
-        goto cloop_close;
-    }
-    s->current_block = s->n_blocks;
+    s->cache = chunk_cache_new(bs, &cloop_chunk_ops, s->n_blocks,
+                               s->block_size);
 
     s->sectors_per_block = s->block_size/512;
     bs->total_sectors = s->n_blocks * s->sectors_per_block;
-    qemu_co_mutex_init(&s->lock);
     return 0;
 
 cloop_close:
     return -1;
 }
 
-static inline int cloop_read_block(BlockDriverState *bs, int block_num)
+static coroutine_fn int cloop_co_readv(BlockDriverState *bs,
+                                       int64_t sector_num, int nb_sectors,
+                                       QEMUIOVector *qiov)
 {
     BDRVCloopState *s = bs->opaque;
+    size_t qiov_offset = 0;
+    uint8_t *data;
+    int n, ret;
 
-    if (s->current_block != block_num) {
-        int ret;
-        uint32_t bytes = s->offsets[block_num + 1] - s->offsets[block_num];
+    while (nb_sectors > 0) {
+        uint32_t sector_offset_in_block = sector_num % s->sectors_per_block;
+        uint32_t block_num = sector_num / s->sectors_per_block;
 
-        ret = bdrv_pread(bs->file, s->offsets[block_num], s->compressed_block,
-                         bytes);
-        if (ret != bytes) {
-            return -1;
+        ret = chunk_cache_get(s->cache, block_num, &data);
+        if (ret < 0) {
+            return ret;
         }
 
-        s->zstream.next_in = s->compressed_block;
-        s->zstream.avail_in = bytes;
-        s->zstream.next_out = s->uncompressed_block;
-        s->zstream.avail_out = s->block_size;
-        ret = inflateReset(&s->zstream);
-        if (ret != Z_OK) {
-            return -1;
-        }
-        ret = inflate(&s->zstream, Z_FINISH);
-        if (ret != Z_STREAM_END || s->zstream.total_out != s->block_size) {
-            return -1;
-        }
-
-        s->current_block = block_num;
-    }
-    return 0;
-}
+        n = MIN(nb_sectors, s->sectors_per_block - sector_offset_in_block);
+        qemu_iovec_from_buf(qiov, qiov_offset,
+                            data + sector_offset_in_block * 512, n * 512);
 
-static int cloop_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
-{
-    BDRVCloopState *s = bs->opaque;
-    int i;
-
-    for (i = 0; i < nb_sectors; i++) {
-        uint32_t sector_offset_in_block =
-            ((sector_num + i) % s->sectors_per_block),
-            block_num = (sector_num + i) / s->sectors_per_block;
-        if (cloop_read_block(bs, block_num) != 0) {
-            return -1;
-        }
-        memcpy(buf + i * 512,
-            s->uncompressed_block + sector_offset_in_block * 512, 512);
+        qiov_offset += n * 512;
+        sector_num += n;
+        nb_sectors -= n;
     }
     return 0;
 }
 
-static coroutine_fn int cloop_co_read(BlockDriverState *bs, int64_t sector_num,
-                                      uint8_t *buf, int nb_sectors)
-{
-    int ret;
-    BDRVCloopState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = cloop_read(bs, sector_num, buf, nb_sectors);
-    qemu_co_mutex_unlock(&s->lock);
-    return ret;
-}
-
 static void cloop_close(BlockDriverState *bs)
 {
     BDRVCloopState *s = bs->opaque;
-    if (s->n_blocks > 0) {
-        g_free(s->offsets);
-    }
-    g_free(s->compressed_block);
-    g_free(s->uncompressed_block);
-    inflateEnd(&s->zstream);
+    chunk_cache_free(s->cache);
+    g_free(s->offsets);
 }
 
 static BlockDriver bdrv_cloop = {
@@ -183,7 +173,7 @@ static BlockDriver bdrv_cloop = {
     .instance_size  = sizeof(BDRVCloopState),
     .bdrv_probe     = cloop_probe,
     .bdrv_open      = cloop_open,
-    .bdrv_read      = cloop_co_read,
+    .bdrv_co_readv  = cloop_co_readv,
     .bdrv_close     = cloop_close,
 };
 
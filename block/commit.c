@@ -24,6 +24,9 @@ enum {
      * contiguous regions of the image is efficient.
      */
     COMMIT_BUFFER_SIZE = 512 * 1024, /* in bytes */
+
+    /* Number of buffers that are copied in parallel */
+    COMMIT_MAX_IN_FLIGHT = 16,
 };
 
 #define SLICE_TIME 100000000ULL /* ns */
@@ -37,21 +40,47 @@ typedef struct CommitBlockJob {
     BlockdevOnError on_error;
     int base_flags;
     int orig_overlay_flags;
+
+    /* Copy requests still running and the job waiting for them */
+    int in_flight;
+    bool waiting;
+
+    /* First error and the lowest failed sector */
+    int ret;
+    int64_t err_sector;
 } CommitBlockJob;
 
+typedef struct CommitOp {
+    CommitBlockJob *s;
+    int64_t sector_num;
+    int nb_sectors;
+} CommitOp;
+
 static int coroutine_fn commit_populate(BlockDriverState *bs,
                                         BlockDriverState *base,
                                         int64_t sector_num, int nb_sectors,
                                         void *buf)
 {
+    struct iovec iov = {
+        .iov_base = buf,
+        .iov_len  = nb_sectors * BDRV_SECTOR_SIZE,
+    };
+    QEMUIOVector qiov;
     int ret = 0;
 
-    ret = bdrv_read(bs, sector_num, buf, nb_sectors);
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    ret = bdrv_co_readv(bs, sector_num, nb_sectors, &qiov);
     if (ret) {
         return ret;
     }
 
-    ret = bdrv_write(base, sector_num, buf, nb_sectors);
+    /* Keep the base sparse where the overlay only holds zeroes */
+    if (buffer_is_zero(buf, iov.iov_len)) {
+        ret = bdrv_co_write_zeroes(base, sector_num, nb_sectors);
+    } else {
+        ret = bdrv_co_writev(base, sector_num, nb_sectors, &qiov);
+    }
     if (ret) {
         return ret;
     }
@@ -59,6 +88,62 @@ static int coroutine_fn commit_populate(BlockDriverState *bs,
     return 0;
 }
 
+static void coroutine_fn commit_populate_entry(void *opaque)
+{
+    CommitOp *op = opaque;
+    CommitBlockJob *s = op->s;
+    void *buf;
+    int ret;
+
+    buf = qemu_blockalign(s->top, op->nb_sectors * BDRV_SECTOR_SIZE);
+    ret = commit_populate(s->top, s->base, op->sector_num, op->nb_sectors, buf);
+    qemu_vfree(buf);
+
+    if (ret < 0) {
+        if (s->ret == 0 || op->sector_num < s->err_sector) {
+            s->err_sector = op->sector_num;
+        }
+        if (s->ret == 0) {
+            s->ret = ret;
+        }
+    } else {
+        /* Publish progress */
+        s->common.offset += op->nb_sectors * BDRV_SECTOR_SIZE;
+    }
+    g_free(op);
+
+    s->in_flight--;
+    if (s->waiting) {
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
+/* Wait until fewer than max_in_flight copy requests are running */
+static void coroutine_fn commit_wait(CommitBlockJob *s, int max_in_flight)
+{
+    while (s->in_flight > max_in_flight - 1) {
+        s->waiting = true;
+        qemu_coroutine_yield();
+        s->waiting = false;
+    }
+}
+
+static void coroutine_fn commit_start_populate(CommitBlockJob *s,
+                                               int64_t sector_num,
+                                               int nb_sectors)
+{
+    CommitOp *op = g_new(CommitOp, 1);
+    Coroutine *co;
+
+    op->s = s;
+    op->sector_num = sector_num;
+    op->nb_sectors = nb_sectors;
+
+    s->in_flight++;
+    co = qemu_coroutine_create(commit_populate_entry);
+    qemu_coroutine_enter(co, op);
+}
+
 static void coroutine_fn commit_run(void *opaque)
 {
     CommitBlockJob *s = opaque;
@@ -67,10 +152,10 @@ static void coroutine_fn commit_run(void *opaque)
     BlockDriverState *base = s->base;
     BlockDriverState *overlay_bs = NULL;
     int64_t sector_num, end;
+    int64_t extent_end = 0;
+    bool copy = false;
     int ret = 0;
     int n = 0;
-    void *buf;
-    int bytes_written = 0;
     int64_t base_len;
 
     ret = s->common.len = bdrv_getlength(top);
@@ -95,11 +180,16 @@ static void coroutine_fn commit_run(void *opaque)
     overlay_bs = bdrv_find_overlay(active, top);
 
     end = s->common.len >> BDRV_SECTOR_BITS;
-    buf = qemu_blockalign(top, COMMIT_BUFFER_SIZE);
 
-    for (sector_num = 0; sector_num < end; sector_num += n) {
+    for (sector_num = 0; ; sector_num += n) {
         uint64_t delay_ns = 0;
-        bool copy;
+
+        if (sector_num >= end) {
+            commit_wait(s, 1);
+            if (s->ret == 0) {
+                break;
+            }
+        }
 
 wait:
         /* Note that even when no rate limit is applied we need to yield
@@ -109,47 +199,74 @@ wait:
         if (block_job_is_cancelled(&s->common)) {
             break;
         }
-        /* Copy if allocated above the base */
-        ret = bdrv_co_is_allocated_above(top, base, sector_num,
-                                         COMMIT_BUFFER_SIZE / BDRV_SECTOR_SIZE,
-                                         &n);
-        copy = (ret == 1);
-        trace_commit_one_iteration(s, sector_num, n, ret);
-        if (copy) {
-            if (s->common.speed) {
-                delay_ns = ratelimit_calculate_delay(&s->limit, n);
-                if (delay_ns > 0) {
-                    goto wait;
-                }
-            }
-            ret = commit_populate(top, base, sector_num, n, buf);
-            bytes_written += n * BDRV_SECTOR_SIZE;
-        }
-        if (ret < 0) {
+
+        if (s->ret < 0) {
+            /* Settle all requests before acting on the first error */
+            commit_wait(s, 1);
+            ret = s->ret;
             if (s->on_error == BLOCKDEV_ON_ERROR_STOP ||
                 s->on_error == BLOCKDEV_ON_ERROR_REPORT||
                 (s->on_error == BLOCKDEV_ON_ERROR_ENOSPC && ret == -ENOSPC)) {
-                goto exit_free_buf;
-            } else {
+                goto exit_restore_reopen;
+            }
+            /* Retry from the first failure, everything below it is done */
+            sector_num = s->err_sector;
+            s->common.offset = sector_num * BDRV_SECTOR_SIZE;
+            s->ret = 0;
+            extent_end = 0;
+            n = 0;
+            continue;
+        }
+
+        /* Copy if allocated above the base.  Whole extents are looked up so
+         * that large areas not allocated above the base are skipped with a
+         * single query.
+         */
+        if (sector_num >= extent_end) {
+            ret = bdrv_co_is_allocated_above(top, base, sector_num,
+                                             MIN(end - sector_num, INT_MAX),
+                                             &n);
+            copy = (ret == 1);
+            trace_commit_one_iteration(s, sector_num, n, ret);
+            if (ret < 0) {
+                s->ret = ret;
+                s->err_sector = sector_num;
                 n = 0;
                 continue;
             }
+            extent_end = sector_num + n;
         }
-        /* Publish progress */
-        s->common.offset += n * BDRV_SECTOR_SIZE;
+
+        n = extent_end - sector_num;
+        if (!copy) {
+            /* Publish progress */
+            s->common.offset += n * BDRV_SECTOR_SIZE;
+            continue;
+        }
+
+        n = MIN(n, COMMIT_BUFFER_SIZE / BDRV_SECTOR_SIZE);
+        if (s->common.speed) {
+            delay_ns = ratelimit_calculate_delay(&s->limit, n);
+            if (delay_ns > 0) {
+                goto wait;
+            }
+        }
+        commit_wait(s, COMMIT_MAX_IN_FLIGHT);
+        commit_start_populate(s, sector_num, n);
     }
 
-    ret = 0;
+    commit_wait(s, 1);
+    ret = s->ret;
 
-    if (!block_job_is_cancelled(&s->common) && sector_num == end) {
+    if (!block_job_is_cancelled(&s->common) && sector_num >= end && ret == 0) {
         /* success */
         ret = bdrv_drop_intermediate(active, top, base);
     }
 
-exit_free_buf:
-    qemu_vfree(buf);
-
 exit_restore_reopen:
+    /* Requests may still be running if we bailed out on an error */
+    commit_wait(s, 1);
+
     /* restore base open flags here if appropriate (e.g., change the base back
      * to r/o). These reopens do not need to be atomic, since we won't abort
      * even on failure here */
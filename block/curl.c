@@ -22,6 +22,7 @@
  * THE SOFTWARE.
  */
 #include "qemu-common.h"
+#include "qemu-queue.h"
 #include "block_int.h"
 #include <curl/curl.h>
 
@@ -34,10 +35,11 @@
 #define DPRINTF(fmt, ...) do { } while (0)
 #endif
 
-#define CURL_NUM_STATES 8
+#define CURL_NUM_STATES 16
 #define CURL_NUM_ACB    8
 #define SECTOR_SIZE     512
 #define READ_AHEAD_SIZE (256 * 1024)
+#define READ_AHEAD_MAX  (4 * 1024 * 1024)
 
 #define FIND_RET_NONE   0
 #define FIND_RET_OK     1
@@ -55,6 +57,8 @@ typedef struct CURLAIOCB {
 
     size_t start;
     size_t end;
+
+    QTAILQ_ENTRY(CURLAIOCB) next;
 } CURLAIOCB;
 
 typedef struct CURLState
@@ -66,6 +70,7 @@ typedef struct CURLState
     size_t buf_start;
     size_t buf_off;
     size_t buf_len;
+    uint64_t gen;
     char range[128];
     char errmsg[CURL_ERROR_SIZE];
     char in_use;
@@ -77,11 +82,24 @@ typedef struct BDRVCURLState {
     CURLState states[CURL_NUM_STATES];
     char *url;
     size_t readahead_size;
+
+    /* The readahead window doubles, up to READ_AHEAD_MAX, while misses
+     * continue where the previous range request ended, and falls back to
+     * readahead_size on a random access.
+     */
+    size_t readahead_cur;
+    size_t fetch_start;
+    size_t fetch_end;
+    uint64_t gen;
+
+    /* Requests waiting for a free CURLState */
+    QTAILQ_HEAD(, CURLAIOCB) pending;
 } BDRVCURLState;
 
 static void curl_clean_state(CURLState *s);
 static void curl_multi_do(void *arg);
 static int curl_aio_flush(void *opaque);
+static bool curl_start_pending(BDRVCURLState *s);
 
 static int curl_sock_cb(CURL *curl, curl_socket_t fd, int action,
                         void *s, void *sp)
@@ -215,6 +233,7 @@ static void curl_multi_do(void *arg)
     if (!s->multi)
         return;
 
+again:
     do {
         r = curl_multi_socket_all(s->multi, &running);
     } while(r == CURLM_CALL_MULTI_PERFORM);
@@ -260,37 +279,41 @@ static void curl_multi_do(void *arg)
                 break;
         }
     } while(msgs_in_queue);
+
+    /* Finished transfers freed their states, give them to waiting reads */
+    if (curl_start_pending(s)) {
+        goto again;
+    }
 }
 
-static CURLState *curl_init_state(BDRVCURLState *s)
+/* Pick the idle state whose data was fetched longest ago, keeping the
+ * more recent buffers around for curl_find_buf().
+ */
+static CURLState *curl_find_state(BDRVCURLState *s)
 {
     CURLState *state = NULL;
-    int i, j;
-
-    do {
-        for (i=0; i<CURL_NUM_STATES; i++) {
-            for (j=0; j<CURL_NUM_ACB; j++)
-                if (s->states[i].acb[j])
-                    continue;
-            if (s->states[i].in_use)
-                continue;
+    int i;
 
+    for (i=0; i<CURL_NUM_STATES; i++) {
+        if (s->states[i].in_use)
+            continue;
+        if (!state || s->states[i].gen < state->gen)
             state = &s->states[i];
-            state->in_use = 1;
-            break;
-        }
-        if (!state) {
-            g_usleep(100);
-            curl_multi_do(s);
-        }
-    } while(!state);
+    }
+    return state;
+}
 
+static CURLState *curl_init_state(BDRVCURLState *s, CURLState *state)
+{
+    state->in_use = 1;
     if (state->curl)
         goto has_curl;
 
     state->curl = curl_easy_init();
-    if (!state->curl)
+    if (!state->curl) {
+        state->in_use = 0;
         return NULL;
+    }
     curl_easy_setopt(state->curl, CURLOPT_URL, s->url);
     curl_easy_setopt(state->curl, CURLOPT_TIMEOUT, 5);
     curl_easy_setopt(state->curl, CURLOPT_WRITEFUNCTION, (void *)curl_read_cb);
@@ -376,7 +399,9 @@ static int curl_open(BlockDriverState *bs, const char *filename, int flags)
 
     DPRINTF("CURL: Opening %s\n", file);
     s->url = file;
-    state = curl_init_state(s);
+    s->readahead_cur = s->readahead_size;
+    QTAILQ_INIT(&s->pending);
+    state = curl_init_state(s, &s->states[0]);
     if (!state)
         goto out_noclean;
 
@@ -405,6 +430,11 @@ static int curl_open(BlockDriverState *bs, const char *filename, int flags)
     s->multi = curl_multi_init();
     curl_multi_setopt( s->multi, CURLMOPT_SOCKETDATA, s); 
     curl_multi_setopt( s->multi, CURLMOPT_SOCKETFUNCTION, curl_sock_cb ); 
+#if LIBCURL_VERSION_NUM >= 0x071003
+    /* keep one connection alive per state so range requests run in
+     * parallel without reconnecting */
+    curl_multi_setopt(s->multi, CURLMOPT_MAXCONNECTS, (long)CURL_NUM_STATES);
+#endif
     curl_multi_do(s);
 
     return 0;
@@ -423,6 +453,9 @@ static int curl_aio_flush(void *opaque)
     BDRVCURLState *s = opaque;
     int i, j;
 
+    if (!QTAILQ_EMPTY(&s->pending)) {
+        return 1;
+    }
     for (i=0; i < CURL_NUM_STATES; i++) {
         for(j=0; j < CURL_NUM_ACB; j++) {
             if (s->states[i].acb[j]) {
@@ -444,59 +477,133 @@ static const AIOCBInfo curl_aiocb_info = {
 };
 
 
-static void curl_readv_bh_cb(void *p)
+static void curl_fetch(BDRVCURLState *s, CURLState *state, size_t start,
+                       size_t len)
 {
-    CURLState *state;
+    size_t end;
 
-    CURLAIOCB *acb = p;
-    BDRVCURLState *s = acb->common.bs->opaque;
+    state->buf_off = 0;
+    if (state->orig_buf)
+        g_free(state->orig_buf);
+    state->buf_start = start;
+    state->buf_len = len;
+    state->gen = ++s->gen;
+    end = MIN(start + state->buf_len, s->len) - 1;
+    state->orig_buf = g_malloc(state->buf_len);
 
-    qemu_bh_delete(acb->bh);
-    acb->bh = NULL;
+    s->fetch_start = start;
+    s->fetch_end = start + len;
+
+    snprintf(state->range, 127, "%zd-%zd", start, end);
+    DPRINTF("CURL (AIO): Fetching %zd at %zd (%s)\n", len, start,
+            state->range);
+    curl_easy_setopt(state->curl, CURLOPT_RANGE, state->range);
+
+    curl_multi_add_handle(s->multi, state->curl);
+}
+
+static bool curl_range_fetched(BDRVCURLState *s, size_t start)
+{
+    int i;
+
+    for (i=0; i<CURL_NUM_STATES; i++) {
+        CURLState *state = &s->states[i];
 
+        if (state->orig_buf && start >= state->buf_start &&
+            start < state->buf_start + state->buf_len)
+            return true;
+    }
+    return false;
+}
+
+/* Serve acb from a buffer or start a range request for it.  Returns
+ * -EBUSY if all states are busy and acb has to wait.
+ */
+static int curl_start_read(BDRVCURLState *s, CURLAIOCB *acb)
+{
+    CURLState *state;
     size_t start = acb->sector_num * SECTOR_SIZE;
-    size_t end;
+    size_t len = acb->nb_sectors * SECTOR_SIZE;
+    size_t next;
+    bool sequential;
 
     // In case we have the requested data already (e.g. read-ahead),
     // we can just call the callback and be done.
-    switch (curl_find_buf(s, start, acb->nb_sectors * SECTOR_SIZE, acb)) {
+    switch (curl_find_buf(s, start, len, acb)) {
         case FIND_RET_OK:
             qemu_aio_release(acb);
             // fall through
         case FIND_RET_WAIT:
-            return;
+            return 0;
         default:
             break;
     }
 
     // No cache found, so let's start a new request
-    state = curl_init_state(s);
-    if (!state) {
+    state = curl_find_state(s);
+    if (!state)
+        return -EBUSY;
+    if (!curl_init_state(s, state)) {
         acb->common.cb(acb->common.opaque, -EIO);
         qemu_aio_release(acb);
-        return;
+        return 0;
     }
 
-    acb->start = 0;
-    acb->end = (acb->nb_sectors * SECTOR_SIZE);
+    sequential = s->fetch_end && start >= s->fetch_start &&
+                 start <= s->fetch_end;
+    if (sequential) {
+        s->readahead_cur = MIN(s->readahead_cur * 2,
+                               MAX(s->readahead_size, READ_AHEAD_MAX));
+    } else {
+        s->readahead_cur = s->readahead_size;
+    }
 
-    state->buf_off = 0;
-    if (state->orig_buf)
-        g_free(state->orig_buf);
-    state->buf_start = start;
-    state->buf_len = acb->end + s->readahead_size;
-    end = MIN(start + state->buf_len, s->len) - 1;
-    state->orig_buf = g_malloc(state->buf_len);
+    acb->start = 0;
+    acb->end = len;
     state->acb[0] = acb;
+    curl_fetch(s, state, start, len + s->readahead_cur);
+
+    // Streaming: fetch the window after this one in parallel
+    next = start + len + s->readahead_cur;
+    if (sequential && s->readahead_cur && next < s->len &&
+        !curl_range_fetched(s, next)) {
+        state = curl_find_state(s);
+        if (state && curl_init_state(s, state)) {
+            curl_fetch(s, state, next, s->readahead_cur);
+        }
+    }
+    return 0;
+}
 
-    snprintf(state->range, 127, "%zd-%zd", start, end);
-    DPRINTF("CURL (AIO): Reading %d at %zd (%s)\n",
-            (acb->nb_sectors * SECTOR_SIZE), start, state->range);
-    curl_easy_setopt(state->curl, CURLOPT_RANGE, state->range);
+static bool curl_start_pending(BDRVCURLState *s)
+{
+    CURLAIOCB *acb;
+    bool started = false;
 
-    curl_multi_add_handle(s->multi, state->curl);
-    curl_multi_do(s);
+    while ((acb = QTAILQ_FIRST(&s->pending)) != NULL) {
+        QTAILQ_REMOVE(&s->pending, acb, next);
+        if (curl_start_read(s, acb) == -EBUSY) {
+            QTAILQ_INSERT_HEAD(&s->pending, acb, next);
+            break;
+        }
+        started = true;
+    }
+    return started;
+}
 
+static void curl_readv_bh_cb(void *p)
+{
+    CURLAIOCB *acb = p;
+    BDRVCURLState *s = acb->common.bs->opaque;
+
+    qemu_bh_delete(acb->bh);
+    acb->bh = NULL;
+
+    if (!QTAILQ_EMPTY(&s->pending) || curl_start_read(s, acb) == -EBUSY) {
+        QTAILQ_INSERT_TAIL(&s->pending, acb, next);
+        return;
+    }
+    curl_multi_do(s);
 }
 
 static BlockDriverAIOCB *curl_aio_readv(BlockDriverState *bs,
@@ -528,6 +635,13 @@ static void curl_close(BlockDriverState *bs)
     int i;
 
     DPRINTF("CURL: Close\n");
+    while (!QTAILQ_EMPTY(&s->pending)) {
+        CURLAIOCB *acb = QTAILQ_FIRST(&s->pending);
+
+        QTAILQ_REMOVE(&s->pending, acb, next);
+        acb->common.cb(acb->common.opaque, -EIO);
+        qemu_aio_release(acb);
+    }
     for (i=0; i<CURL_NUM_STATES; i++) {
         if (s->states[i].in_use)
             curl_clean_state(&s->states[i]);
@@ -25,10 +25,10 @@
 #include "block_int.h"
 #include "bswap.h"
 #include "module.h"
+#include "block/chunk-cache.h"
 #include <zlib.h>
 
 typedef struct BDRVDMGState {
-    CoMutex lock;
     /* each chunk contains a certain number of sectors,
      * offsets[i] is the offset in the .dmg file,
      * lengths[i] is the length of the compressed chunk,
@@ -43,10 +43,7 @@ typedef struct BDRVDMGState {
     uint64_t* lengths;
     uint64_t* sectors;
     uint64_t* sectorcounts;
-    uint32_t current_chunk;
-    uint8_t *compressed_chunk;
-    uint8_t *uncompressed_chunk;
-    z_stream zstream;
+    ChunkCache *cache;
 } BDRVDMGState;
 
 static int dmg_probe(const uint8_t *buf, int buf_size, const char *filename)
@@ -73,12 +70,62 @@ static off_t read_uint32(BlockDriverState *bs, int64_t offset)
 	return be32_to_cpu(buffer);
 }
 
+static int dmg_get_extent(BlockDriverState *bs, uint32_t chunk,
+                          uint64_t *offset, uint64_t *length)
+{
+    BDRVDMGState *s = bs->opaque;
+
+    *offset = s->offsets[chunk];
+    /* zero chunks are not stored */
+    *length = s->types[chunk] == 2 ? 0 : s->lengths[chunk];
+    return 0;
+}
+
+static int dmg_decompress(BlockDriverState *bs, uint32_t chunk,
+                          const uint8_t *in, uint64_t length, uint8_t *out)
+{
+    BDRVDMGState *s = bs->opaque;
+    uint64_t size = 512 * s->sectorcounts[chunk];
+    z_stream zstream;
+    int ret;
+
+    switch (s->types[chunk]) {
+    case 0x80000005: /* zlib compressed */
+        memset(&zstream, 0, sizeof(zstream));
+        if (inflateInit(&zstream) != Z_OK) {
+            return -EIO;
+        }
+        zstream.next_in = (uint8_t *)in;
+        zstream.avail_in = length;
+        zstream.next_out = out;
+        zstream.avail_out = size;
+        ret = inflate(&zstream, Z_FINISH);
+        inflateEnd(&zstream);
+        if (ret != Z_STREAM_END || zstream.total_out != size) {
+            return -EIO;
+        }
+        break;
+    case 1: /* copy */
+        memcpy(out, in, MIN(length, size));
+        break;
+    case 2: /* zero */
+        memset(out, 0, size);
+        break;
+    }
+    return 0;
+}
+
+static const ChunkCacheOps dmg_chunk_ops = {
+    .get_extent = dmg_get_extent,
+    .decompress = dmg_decompress,
+};
+
 static int dmg_open(BlockDriverState *bs, int flags)
 {
     BDRVDMGState *s = bs->opaque;
     off_t info_begin,info_end,last_in_offset,last_out_offset;
     uint32_t count;
-    uint32_t max_compressed_size=1,max_sectors_per_chunk=1,i;
+    uint32_t max_sectors_per_chunk=1,i;
     int64_t offset;
 
     bs->read_only = 1;
@@ -161,8 +208,6 @@ static int dmg_open(BlockDriverState *bs, int flags)
 		s->lengths[i] = read_off(bs, offset);
 		offset += 8;
 
-		if(s->lengths[i]>max_compressed_size)
-		    max_compressed_size = s->lengths[i];
 		if(s->sectorcounts[i]>max_sectors_per_chunk)
 		    max_sectors_per_chunk = s->sectorcounts[i];
 	    }
@@ -170,31 +215,14 @@ static int dmg_open(BlockDriverState *bs, int flags)
 	}
     }
 
-    /* initialize zlib engine */
-    s->compressed_chunk = g_malloc(max_compressed_size+1);
-    s->uncompressed_chunk = g_malloc(512*max_sectors_per_chunk);
-    if(inflateInit(&s->zstream) != Z_OK)
-	goto fail;
-
-    s->current_chunk = s->n_chunks;
-
-    qemu_co_mutex_init(&s->lock);
+    s->cache = chunk_cache_new(bs, &dmg_chunk_ops, s->n_chunks,
+                               512 * max_sectors_per_chunk);
     return 0;
 fail:
     return -1;
 }
 
-static inline int is_sector_in_chunk(BDRVDMGState* s,
-		uint32_t chunk_num,int sector_num)
-{
-    if(chunk_num>=s->n_chunks || s->sectors[chunk_num]>sector_num ||
-	    s->sectors[chunk_num]+s->sectorcounts[chunk_num]<=sector_num)
-	return 0;
-    else
-	return -1;
-}
-
-static inline uint32_t search_chunk(BDRVDMGState* s,int sector_num)
+static inline uint32_t search_chunk(BDRVDMGState* s,uint64_t sector_num)
 {
     /* binary search */
     uint32_t chunk1=0,chunk2=s->n_chunks,chunk3;
@@ -210,89 +238,35 @@ static inline uint32_t search_chunk(BDRVDMGState* s,int sector_num)
     return s->n_chunks; /* error */
 }
 
-static inline int dmg_read_chunk(BlockDriverState *bs, int sector_num)
-{
-    BDRVDMGState *s = bs->opaque;
-
-    if(!is_sector_in_chunk(s,s->current_chunk,sector_num)) {
-	int ret;
-	uint32_t chunk = search_chunk(s,sector_num);
-
-	if(chunk>=s->n_chunks)
-	    return -1;
-
-	s->current_chunk = s->n_chunks;
-	switch(s->types[chunk]) {
-	case 0x80000005: { /* zlib compressed */
-	    int i;
-
-	    /* we need to buffer, because only the chunk as whole can be
-	     * inflated. */
-	    i=0;
-	    do {
-                ret = bdrv_pread(bs->file, s->offsets[chunk] + i,
-                                 s->compressed_chunk+i, s->lengths[chunk]-i);
-		if(ret<0 && errno==EINTR)
-		    ret=0;
-		i+=ret;
-	    } while(ret>=0 && ret+i<s->lengths[chunk]);
-
-	    if (ret != s->lengths[chunk])
-		return -1;
-
-	    s->zstream.next_in = s->compressed_chunk;
-	    s->zstream.avail_in = s->lengths[chunk];
-	    s->zstream.next_out = s->uncompressed_chunk;
-	    s->zstream.avail_out = 512*s->sectorcounts[chunk];
-	    ret = inflateReset(&s->zstream);
-	    if(ret != Z_OK)
-		return -1;
-	    ret = inflate(&s->zstream, Z_FINISH);
-	    if(ret != Z_STREAM_END || s->zstream.total_out != 512*s->sectorcounts[chunk])
-		return -1;
-	    break; }
-	case 1: /* copy */
-	    ret = bdrv_pread(bs->file, s->offsets[chunk],
-                             s->uncompressed_chunk, s->lengths[chunk]);
-	    if (ret != s->lengths[chunk])
-		return -1;
-	    break;
-	case 2: /* zero */
-	    memset(s->uncompressed_chunk, 0, 512*s->sectorcounts[chunk]);
-	    break;
-	}
-	s->current_chunk = chunk;
-    }
-    return 0;
-}
-
-static int dmg_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+static coroutine_fn int dmg_co_readv(BlockDriverState *bs, int64_t sector_num,
+                                     int nb_sectors, QEMUIOVector *qiov)
 {
     BDRVDMGState *s = bs->opaque;
-    int i;
-
-    for(i=0;i<nb_sectors;i++) {
-	uint32_t sector_offset_in_chunk;
-	if(dmg_read_chunk(bs, sector_num+i) != 0)
-	    return -1;
-	sector_offset_in_chunk = sector_num+i-s->sectors[s->current_chunk];
-	memcpy(buf+i*512,s->uncompressed_chunk+sector_offset_in_chunk*512,512);
+    size_t qiov_offset = 0;
+    uint8_t *data;
+    uint32_t chunk;
+    uint64_t sector_offset_in_chunk;
+    int n, ret;
+
+    while (nb_sectors > 0) {
+        chunk = search_chunk(s, sector_num);
+        ret = chunk_cache_get(s->cache, chunk, &data);
+        if (ret < 0) {
+            return ret;
+        }
+
+        sector_offset_in_chunk = sector_num - s->sectors[chunk];
+        n = MIN(nb_sectors, s->sectorcounts[chunk] - sector_offset_in_chunk);
+        qemu_iovec_from_buf(qiov, qiov_offset,
+                            data + sector_offset_in_chunk * 512, n * 512);
+
+        qiov_offset += n * 512;
+        sector_num += n;
+        nb_sectors -= n;
     }
     return 0;
 }
 
-static coroutine_fn int dmg_co_read(BlockDriverState *bs, int64_t sector_num,
-                                    uint8_t *buf, int nb_sectors)
-{
-    int ret;
-    BDRVDMGState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = dmg_read(bs, sector_num, buf, nb_sectors);
-    qemu_co_mutex_unlock(&s->lock);
-    return ret;
-}
-
 static void dmg_close(BlockDriverState *bs)
 {
     BDRVDMGState *s = bs->opaque;
@@ -303,9 +277,7 @@ static void dmg_close(BlockDriverState *bs)
 	free(s->sectors);
 	free(s->sectorcounts);
     }
-    free(s->compressed_chunk);
-    free(s->uncompressed_chunk);
-    inflateEnd(&s->zstream);
+    chunk_cache_free(s->cache);
 }
 
 static BlockDriver bdrv_dmg = {
@@ -313,7 +285,7 @@ static BlockDriver bdrv_dmg = {
     .instance_size	= sizeof(BDRVDMGState),
     .bdrv_probe		= dmg_probe,
     .bdrv_open		= dmg_open,
-    .bdrv_read          = dmg_co_read,
+    .bdrv_co_readv      = dmg_co_readv,
     .bdrv_close		= dmg_close,
 };
 
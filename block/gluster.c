@@ -3,7 +3,7 @@
  *
  * Copyright (C) 2012 Bharata B Rao <bharata@linux.vnet.ibm.com>
  *
- * Pipe handling mechanism in AIO implementation is derived from
+ * Completion handling in the AIO implementation is derived from
  * block/rbd.c. Hence,
  *
  * Copyright (C) 2010-2011 Christian Brunner <chb@muc.de>,
@@ -26,20 +26,18 @@ typedef struct GlusterAIOCB {
     int ret;
     bool *finished;
     QEMUBH *bh;
+    struct GlusterAIOCB *next;
 } GlusterAIOCB;
 
 typedef struct BDRVGlusterState {
+    EventNotifier e;
     struct glfs *glfs;
-    int fds[2];
     struct glfs_fd *fd;
     int qemu_aio_count;
-    int event_reader_pos;
-    GlusterAIOCB *event_acb;
+    /* Requests finished by libgfapi, pushed from its callback threads */
+    GlusterAIOCB *completed;
 } BDRVGlusterState;
 
-#define GLUSTER_FD_READ  0
-#define GLUSTER_FD_WRITE 1
-
 typedef struct GlusterConf {
     char *server;
     int port;
@@ -255,29 +253,32 @@ static void qemu_gluster_complete_aio(GlusterAIOCB *acb, BDRVGlusterState *s)
     }
 }
 
-static void qemu_gluster_aio_event_reader(void *opaque)
+static void qemu_gluster_aio_event_reader(EventNotifier *e)
 {
-    BDRVGlusterState *s = opaque;
-    ssize_t ret;
+    BDRVGlusterState *s = container_of(e, BDRVGlusterState, e);
+    GlusterAIOCB *acb, *next, *list = NULL;
 
-    do {
-        char *p = (char *)&s->event_acb;
-
-        ret = read(s->fds[GLUSTER_FD_READ], p + s->event_reader_pos,
-                   sizeof(s->event_acb) - s->event_reader_pos);
-        if (ret > 0) {
-            s->event_reader_pos += ret;
-            if (s->event_reader_pos == sizeof(s->event_acb)) {
-                s->event_reader_pos = 0;
-                qemu_gluster_complete_aio(s->event_acb, s);
-            }
-        }
-    } while (ret < 0 && errno == EINTR);
+    event_notifier_test_and_clear(e);
+    acb = __sync_lock_test_and_set(&s->completed, NULL);
+
+    /* The list was built in LIFO order, restore completion order */
+    while (acb) {
+        next = acb->next;
+        acb->next = list;
+        list = acb;
+        acb = next;
+    }
+
+    while (list) {
+        acb = list;
+        list = acb->next;
+        qemu_gluster_complete_aio(acb, s);
+    }
 }
 
-static int qemu_gluster_aio_flush_cb(void *opaque)
+static int qemu_gluster_aio_flush_cb(EventNotifier *e)
 {
-    BDRVGlusterState *s = opaque;
+    BDRVGlusterState *s = container_of(e, BDRVGlusterState, e);
 
     return (s->qemu_aio_count > 0);
 }
@@ -312,14 +313,13 @@ static int qemu_gluster_open(BlockDriverState *bs, const char *filename,
         goto out;
     }
 
-    ret = qemu_pipe(s->fds);
+    s->completed = NULL;
+    ret = event_notifier_init(&s->e, false);
     if (ret < 0) {
-        ret = -errno;
         goto out;
     }
-    fcntl(s->fds[GLUSTER_FD_READ], F_SETFL, O_NONBLOCK);
-    qemu_aio_set_fd_handler(s->fds[GLUSTER_FD_READ],
-        qemu_gluster_aio_event_reader, NULL, qemu_gluster_aio_flush_cb, s);
+    qemu_aio_set_event_notifier(&s->e, qemu_gluster_aio_event_reader,
+                                qemu_gluster_aio_flush_cb);
 
 out:
     qemu_gluster_gconf_free(gconf);
@@ -393,35 +393,26 @@ static const AIOCBInfo gluster_aiocb_info = {
     .cancel = qemu_gluster_aio_cancel,
 };
 
+/*
+ * Called from a libgfapi thread.  Push the request on the completion
+ * list; only the first request of a batch needs to wake up the qemu
+ * thread, which completes the whole list in
+ * qemu_gluster_aio_event_reader().
+ */
 static void gluster_finish_aiocb(struct glfs_fd *fd, ssize_t ret, void *arg)
 {
     GlusterAIOCB *acb = (GlusterAIOCB *)arg;
-    BlockDriverState *bs = acb->common.bs;
-    BDRVGlusterState *s = bs->opaque;
-    int retval;
+    BDRVGlusterState *s = acb->common.bs->opaque;
+    GlusterAIOCB *head;
 
     acb->ret = ret;
-    retval = qemu_write_full(s->fds[GLUSTER_FD_WRITE], &acb, sizeof(acb));
-    if (retval != sizeof(acb)) {
-        /*
-         * Gluster AIO callback thread failed to notify the waiting
-         * QEMU thread about IO completion.
-         *
-         * Complete this IO request and make the disk inaccessible for
-         * subsequent reads and writes.
-         */
-        error_report("Gluster failed to notify QEMU about IO completion");
-
-        qemu_mutex_lock_iothread(); /* We are in gluster thread context */
-        acb->common.cb(acb->common.opaque, -EIO);
-        qemu_aio_release(acb);
-        s->qemu_aio_count--;
-        close(s->fds[GLUSTER_FD_READ]);
-        close(s->fds[GLUSTER_FD_WRITE]);
-        qemu_aio_set_fd_handler(s->fds[GLUSTER_FD_READ], NULL, NULL, NULL,
-            NULL);
-        bs->drv = NULL; /* Make the disk inaccessible */
-        qemu_mutex_unlock_iothread();
+    do {
+        head = s->completed;
+        acb->next = head;
+    } while (!__sync_bool_compare_and_swap(&s->completed, head, acb));
+
+    if (head == NULL) {
+        event_notifier_set(&s->e);
     }
 }
 
@@ -533,9 +524,8 @@ static void qemu_gluster_close(BlockDriverState *bs)
 {
     BDRVGlusterState *s = bs->opaque;
 
-    close(s->fds[GLUSTER_FD_READ]);
-    close(s->fds[GLUSTER_FD_WRITE]);
-    qemu_aio_set_fd_handler(s->fds[GLUSTER_FD_READ], NULL, NULL, NULL, NULL);
+    qemu_aio_set_event_notifier(&s->e, NULL, NULL);
+    event_notifier_cleanup(&s->e);
 
     if (s->fd) {
         glfs_close(s->fd);
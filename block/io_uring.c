@@ -0,0 +1,504 @@
+/*
+ * Linux io_uring support.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu-common.h"
+#include "qemu-aio.h"
+#include "qemu-coroutine.h"
+#include "block/raw-aio.h"
+#include "event_notifier.h"
+#include "cpu-common.h"
+
+#include <liburing.h>
+#if defined(CONFIG_FALLOCATE_PUNCH_HOLE) || defined(CONFIG_FALLOCATE_ZERO_RANGE)
+#include <linux/falloc.h>
+#endif
+
+/*
+ * Submission queue size (per-device).  The completion queue is twice as big,
+ * and newer kernels keep completions that don't fit instead of dropping them.
+ */
+#define MAX_ENTRIES 128
+
+/* Milliseconds the SQ polling thread spins before it goes to sleep */
+#define SQPOLL_IDLE_MS 1000
+
+/*
+ * Only RAM blocks of at least this size are registered as fixed buffers.
+ * That is guest RAM proper; the small blocks of ROMs and option ROMs can go
+ * away on hot-unplug, and the ring would keep their old pages pinned.
+ */
+#define FIXED_BUF_MIN_BLOCK (16 * 1024 * 1024)
+
+/* The kernel doesn't accept fixed buffers larger than this */
+#define FIXED_BUF_MAX_SIZE (1024 * 1024 * 1024)
+
+struct qemu_luringcb {
+    BlockDriverAIOCB common;
+    struct qemu_luring_state *ctx;
+    ssize_t ret;
+    size_t nbytes;
+    QEMUIOVector *qiov;
+    bool is_read;
+};
+
+typedef struct LuringFixedBuf {
+    uint8_t *host;
+    size_t len;
+} LuringFixedBuf;
+
+struct qemu_luring_state {
+    struct io_uring ring;
+    EventNotifier e;
+    int count;
+
+    /* requests in the submission queue that the kernel hasn't seen yet */
+    int in_queue;
+    int plugged;
+
+    /* guest RAM registered with the ring, sorted by address */
+    bool use_fixed_bufs;
+    bool fixed_bufs_done;
+    LuringFixedBuf *fixed_bufs;
+    int nr_fixed_bufs;
+};
+
+/*
+ * Completes an AIO request (calls the callback and frees the ACB).
+ */
+static void qemu_luring_process_completion(struct qemu_luring_state *s,
+    struct qemu_luringcb *luringcb)
+{
+    int ret;
+
+    s->count--;
+
+    ret = luringcb->ret;
+    if (ret != -ECANCELED) {
+        if (ret == luringcb->nbytes) {
+            ret = 0;
+        } else if (ret >= 0) {
+            /* Short reads mean EOF, pad with zeros. */
+            if (luringcb->is_read) {
+                qemu_iovec_memset(luringcb->qiov, ret, 0,
+                    luringcb->qiov->size - ret);
+                ret = 0;
+            } else {
+                ret = -EINVAL;
+            }
+        }
+
+        luringcb->common.cb(luringcb->common.opaque, ret);
+    }
+
+    qemu_aio_release(luringcb);
+}
+
+/* Runs the callbacks of all requests in the completion queue */
+static void qemu_luring_process_cq(struct qemu_luring_state *s)
+{
+    struct io_uring_cqe *cqe;
+
+    while (io_uring_peek_cqe(&s->ring, &cqe) == 0) {
+        struct qemu_luringcb *luringcb = io_uring_cqe_get_data(cqe);
+
+        io_uring_cqe_seen(&s->ring, cqe);
+        if (!luringcb) {
+            /* no-op that took the place of a rejected request */
+            continue;
+        }
+        luringcb->ret = cqe->res;
+        qemu_luring_process_completion(s, luringcb);
+    }
+}
+
+static void qemu_luring_completion_cb(EventNotifier *e)
+{
+    struct qemu_luring_state *s = container_of(e, struct qemu_luring_state, e);
+
+    while (event_notifier_test_and_clear(&s->e)) {
+        qemu_luring_process_cq(s);
+    }
+}
+
+/*
+ * Hands the queued requests to the kernel.  With SQ polling this only wakes
+ * up the polling thread if it went to sleep.
+ */
+static int ioq_submit(struct qemu_luring_state *s)
+{
+    int ret;
+
+    do {
+        ret = io_uring_submit(&s->ring);
+    } while (ret == -EINTR);
+
+    if (ret > 0) {
+        s->in_queue -= MIN(ret, s->in_queue);
+    }
+    return ret;
+}
+
+static void luring_cancel(BlockDriverAIOCB *blockacb)
+{
+    struct qemu_luringcb *luringcb = (struct qemu_luringcb *)blockacb;
+    struct qemu_luring_state *s = luringcb->ctx;
+    struct io_uring_cqe *cqe;
+
+    if (luringcb->ret != -EINPROGRESS) {
+        return;
+    }
+
+    /*
+     * Requests in the submission queue can't be taken back, and neither
+     * regular files nor block devices can cancel requests that they are
+     * working on.  Push everything to the kernel and wait for the request
+     * to complete.
+     */
+    if (s->in_queue > 0) {
+        ioq_submit(s);
+    }
+
+    while (luringcb->ret == -EINPROGRESS) {
+        if (io_uring_wait_cqe(&s->ring, &cqe) < 0) {
+            continue;
+        }
+        qemu_luring_process_cq(s);
+    }
+}
+
+static const AIOCBInfo luring_aiocb_info = {
+    .aiocb_size         = sizeof(struct qemu_luringcb),
+    .cancel             = luring_cancel,
+};
+
+static int qemu_luring_flush_cb(EventNotifier *e)
+{
+    struct qemu_luring_state *s = container_of(e, struct qemu_luring_state, e);
+
+    /* Somebody waits for requests to complete, don't hold them back */
+    if (s->in_queue > 0) {
+        ioq_submit(s);
+    }
+
+    return (s->count > 0) ? 1 : 0;
+}
+
+void luring_io_plug(void *aio_ctx)
+{
+    struct qemu_luring_state *s = aio_ctx;
+
+    s->plugged++;
+}
+
+void luring_io_unplug(void *aio_ctx)
+{
+    struct qemu_luring_state *s = aio_ctx;
+
+    assert(s->plugged > 0);
+    if (--s->plugged > 0) {
+        return;
+    }
+
+    if (s->in_queue > 0) {
+        ioq_submit(s);
+    }
+}
+
+static void luring_add_fixed_buf(void *host_addr, ram_addr_t offset,
+                                 ram_addr_t length, void *opaque)
+{
+    GArray *bufs = opaque;
+    uint8_t *host = host_addr;
+
+    if (length < FIXED_BUF_MIN_BLOCK) {
+        return;
+    }
+
+    while (length > 0) {
+        LuringFixedBuf buf = {
+            .host = host,
+            .len  = MIN(length, FIXED_BUF_MAX_SIZE),
+        };
+
+        g_array_append_val(bufs, buf);
+        host += buf.len;
+        length -= buf.len;
+    }
+}
+
+static gint luring_fixed_buf_cmp(gconstpointer a, gconstpointer b)
+{
+    const LuringFixedBuf *x = a, *y = b;
+
+    return x->host < y->host ? -1 : x->host > y->host;
+}
+
+/*
+ * Registers guest RAM with the ring, so that requests on it can skip
+ * mapping the pages for every request.  Guest RAM only exists after the
+ * drives have been opened, so this is tried on the first requests until
+ * there is some RAM.  If the kernel refuses (e.g. because of RLIMIT_MEMLOCK),
+ * requests keep using plain buffers.
+ */
+static void luring_register_fixed_bufs(struct qemu_luring_state *s)
+{
+    GArray *bufs = g_array_new(false, false, sizeof(LuringFixedBuf));
+    struct iovec *iov;
+    int i, n;
+
+    qemu_ram_foreach_block(luring_add_fixed_buf, bufs);
+    n = bufs->len;
+    if (n == 0) {
+        g_array_free(bufs, true);
+        return;
+    }
+    s->fixed_bufs_done = true;
+
+    g_array_sort(bufs, luring_fixed_buf_cmp);
+    iov = g_new(struct iovec, n);
+    for (i = 0; i < n; i++) {
+        LuringFixedBuf *buf = &g_array_index(bufs, LuringFixedBuf, i);
+        iov[i].iov_base = buf->host;
+        iov[i].iov_len = buf->len;
+    }
+
+    if (io_uring_register_buffers(&s->ring, iov, n) == 0) {
+        s->nr_fixed_bufs = n;
+        s->fixed_bufs = (LuringFixedBuf *)g_array_free(bufs, false);
+    } else {
+        g_array_free(bufs, true);
+    }
+    g_free(iov);
+}
+
+/* Returns the index of the fixed buffer that contains iov, or -1 */
+static int luring_find_fixed_buf(struct qemu_luring_state *s,
+                                 struct iovec *iov)
+{
+    uint8_t *base = iov->iov_base;
+    int lo = 0, hi = s->nr_fixed_bufs;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        LuringFixedBuf *buf = &s->fixed_bufs[mid];
+
+        if (base < buf->host) {
+            hi = mid;
+        } else if (base >= buf->host + buf->len) {
+            lo = mid + 1;
+        } else {
+            return iov->iov_len <= buf->host + buf->len - base ? mid : -1;
+        }
+    }
+    return -1;
+}
+
+static void luring_prep_rw(struct qemu_luring_state *s,
+                           struct io_uring_sqe *sqe, int fd, off_t offset,
+                           QEMUIOVector *qiov, bool is_read)
+{
+    int index = -1;
+
+    if (s->use_fixed_bufs && !s->fixed_bufs_done) {
+        luring_register_fixed_bufs(s);
+    }
+    if (qiov->niov == 1 && s->nr_fixed_bufs > 0) {
+        index = luring_find_fixed_buf(s, &qiov->iov[0]);
+    }
+
+    if (index >= 0) {
+        if (is_read) {
+            io_uring_prep_read_fixed(sqe, fd, qiov->iov[0].iov_base,
+                                     qiov->iov[0].iov_len, offset, index);
+        } else {
+            io_uring_prep_write_fixed(sqe, fd, qiov->iov[0].iov_base,
+                                      qiov->iov[0].iov_len, offset, index);
+        }
+    } else if (is_read) {
+        io_uring_prep_readv(sqe, fd, qiov->iov, qiov->niov, offset);
+    } else {
+        io_uring_prep_writev(sqe, fd, qiov->iov, qiov->niov, offset);
+    }
+}
+
+/*
+ * Returns a free submission queue entry, making room by submitting the
+ * queued requests if necessary.
+ */
+static struct io_uring_sqe *luring_get_sqe(struct qemu_luring_state *s)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&s->ring);
+
+    if (!sqe) {
+        ioq_submit(s);
+        sqe = io_uring_get_sqe(&s->ring);
+    }
+    return sqe;
+}
+
+BlockDriverAIOCB *luring_submit(BlockDriverState *bs, void *aio_ctx, int fd,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque, int type)
+{
+    struct qemu_luring_state *s = aio_ctx;
+    struct qemu_luringcb *luringcb;
+    struct io_uring_sqe *sqe;
+    off_t offset = sector_num * 512;
+    off_t len = (off_t)nb_sectors * 512;
+
+    sqe = luring_get_sqe(s);
+    if (!sqe) {
+        return NULL;
+    }
+
+    switch (type & QEMU_AIO_TYPE_MASK) {
+    case QEMU_AIO_READ:
+    case QEMU_AIO_WRITE:
+        luring_prep_rw(s, sqe, fd, offset, qiov, type == QEMU_AIO_READ);
+        break;
+    case QEMU_AIO_FLUSH:
+        io_uring_prep_fsync(sqe, fd, IORING_FSYNC_DATASYNC);
+        len = 0;
+        break;
+#ifdef CONFIG_FALLOCATE_PUNCH_HOLE
+    case QEMU_AIO_DISCARD:
+        io_uring_prep_fallocate(sqe, fd,
+                                FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                                offset, len);
+        len = 0;
+        break;
+#endif
+#ifdef CONFIG_FALLOCATE_ZERO_RANGE
+    case QEMU_AIO_WRITE_ZEROES:
+        io_uring_prep_fallocate(sqe, fd, FALLOC_FL_ZERO_RANGE, offset, len);
+        len = 0;
+        break;
+#endif
+    default:
+        fprintf(stderr, "%s: invalid AIO request type 0x%x.\n",
+                        __func__, type);
+        /* The entry is already taken, turn it into a no-op */
+        io_uring_prep_nop(sqe);
+        io_uring_sqe_set_data(sqe, NULL);
+        return NULL;
+    }
+
+    luringcb = qemu_aio_get(&luring_aiocb_info, bs, cb, opaque);
+    luringcb->nbytes = len;
+    luringcb->ctx = s;
+    luringcb->ret = -EINPROGRESS;
+    luringcb->is_read = (type == QEMU_AIO_READ);
+    luringcb->qiov = qiov;
+    io_uring_sqe_set_data(sqe, luringcb);
+
+    s->count++;
+    s->in_queue++;
+    if (!s->plugged) {
+        ioq_submit(s);
+    }
+    return &luringcb->common;
+}
+
+typedef struct LuringCo {
+    Coroutine *co;
+    int ret;
+} LuringCo;
+
+static void luring_co_cb(void *opaque, int ret)
+{
+    LuringCo *lc = opaque;
+
+    lc->ret = ret;
+    qemu_coroutine_enter(lc->co, NULL);
+}
+
+int coroutine_fn luring_co_submit(BlockDriverState *bs, void *aio_ctx, int fd,
+        int64_t sector_num, int nb_sectors, int type)
+{
+    LuringCo lc = { .co = qemu_coroutine_self(), .ret = -EINPROGRESS };
+
+    assert(qemu_in_coroutine());
+    if (!luring_submit(bs, aio_ctx, fd, sector_num, NULL, nb_sectors,
+                       luring_co_cb, &lc, type)) {
+        return -EIO;
+    }
+    qemu_coroutine_yield();
+    return lc.ret;
+}
+
+void luring_detach_aio_context(void *s_, AioContext *old_context)
+{
+    struct qemu_luring_state *s = s_;
+
+    aio_set_event_notifier(old_context, &s->e, NULL, NULL);
+}
+
+void luring_attach_aio_context(void *s_, AioContext *new_context)
+{
+    struct qemu_luring_state *s = s_;
+
+    aio_set_event_notifier(new_context, &s->e, qemu_luring_completion_cb,
+                           qemu_luring_flush_cb);
+}
+
+/*
+ * Sets up a ring.  With sqpoll, a kernel thread picks up submitted requests
+ * so that submitting needs no system call; kernels that can't do this for
+ * unprivileged users or unregistered files get a normal ring.  fixed_bufs
+ * registers guest RAM with the ring, which pins it in host memory.
+ */
+void *luring_init(bool sqpoll, bool fixed_bufs)
+{
+    struct qemu_luring_state *s;
+    struct io_uring_params p;
+    int ret = -1;
+
+    s = g_malloc0(sizeof(*s));
+    if (event_notifier_init(&s->e, false) < 0) {
+        goto out_free_state;
+    }
+
+    if (sqpoll) {
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_SQPOLL;
+        p.sq_thread_idle = SQPOLL_IDLE_MS;
+        ret = io_uring_queue_init_params(MAX_ENTRIES, &s->ring, &p);
+    }
+    if (ret < 0) {
+        ret = io_uring_queue_init(MAX_ENTRIES, &s->ring, 0);
+    }
+    if (ret < 0) {
+        errno = -ret;
+        goto out_close_efd;
+    }
+
+    if (io_uring_register_eventfd(&s->ring, event_notifier_get_fd(&s->e))) {
+        goto out_exit_ring;
+    }
+
+    s->use_fixed_bufs = fixed_bufs;
+
+    return s;
+
+out_exit_ring:
+    io_uring_queue_exit(&s->ring);
+out_close_efd:
+    event_notifier_cleanup(&s->e);
+out_free_state:
+    g_free(s);
+    return NULL;
+}
+
+void luring_cleanup(void *s_)
+{
+    struct qemu_luring_state *s = s_;
+
+    assert(s->count == 0);
+    io_uring_queue_exit(&s->ring);
+    event_notifier_cleanup(&s->e);
+    g_free(s->fixed_bufs);
+    g_free(s);
+}
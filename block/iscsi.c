@@ -28,6 +28,7 @@
 #include <arpa/inet.h>
 #include "qemu-common.h"
 #include "qemu-error.h"
+#include "qemu-queue.h"
 #include "block_int.h"
 #include "trace.h"
 #include "hw/scsi-defs.h"
@@ -40,30 +41,54 @@
 #include <hw/scsi-defs.h>
 #endif
 
-typedef struct IscsiLun {
+#define ISCSI_MAX_SESSIONS 8
+
+typedef struct IscsiLun IscsiLun;
+typedef struct IscsiAIOCB IscsiAIOCB;
+
+/* One login to the target, with its own connection and command window.
+ * READ and WRITE commands go to the session with the fewest of them
+ * outstanding; everything else can use any session.
+ */
+typedef struct IscsiSession {
     struct iscsi_context *iscsi;
+    IscsiLun *iscsilun;
+    int events;
+    int in_flight;          /* READ/WRITE tasks sent and not completed */
+} IscsiSession;
+
+struct IscsiLun {
+    IscsiSession sessions[ISCSI_MAX_SESSIONS];
+    int nb_sessions;
+    int queue_depth;        /* READ/WRITE tasks per session, 0 = no limit */
+    QTAILQ_HEAD(, IscsiAIOCB) pending;
     int lun;
     enum scsi_inquiry_peripheral_device_type type;
     int block_size;
     uint64_t num_blocks;
-    int events;
-} IscsiLun;
+};
 
-typedef struct IscsiAIOCB {
+struct IscsiAIOCB {
     BlockDriverAIOCB common;
     QEMUIOVector *qiov;
     QEMUBH *bh;
     IscsiLun *iscsilun;
+    IscsiSession *session;  /* NULL while waiting in iscsilun->pending */
     struct scsi_task *task;
+    iscsi_command_cb task_cb;
     uint8_t *buf;
     int status;
     int canceled;
+    int in_flight;
     size_t read_size;
     size_t read_offset;
+    QTAILQ_ENTRY(IscsiAIOCB) pending_entry;
 #ifdef __linux__
     sg_io_hdr_t *ioh;
 #endif
-} IscsiAIOCB;
+};
+
+static void iscsi_rw_done(IscsiAIOCB *acb);
 
 static void
 iscsi_bh_cb(void *p)
@@ -72,6 +97,9 @@ iscsi_bh_cb(void *p)
 
     qemu_bh_delete(acb->bh);
 
+    /* an aborted task may never see its own callback */
+    iscsi_rw_done(acb);
+
     if (acb->canceled == 0) {
         acb->common.cb(acb->common.opaque, acb->status);
     }
@@ -117,8 +145,18 @@ iscsi_aio_cancel(BlockDriverAIOCB *blockacb)
 
     acb->canceled = 1;
 
+    /* not sent yet, so the target knows nothing about it */
+    if (acb->session == NULL) {
+        QTAILQ_REMOVE(&iscsilun->pending, acb, pending_entry);
+        g_free(acb->buf);
+        acb->buf = NULL;
+        acb->status = -ECANCELED;
+        iscsi_schedule_bh(acb);
+        return;
+    }
+
     /* send a task mgmt call to the target to cancel the task on the target */
-    iscsi_task_mgmt_abort_task_async(iscsilun->iscsi, acb->task,
+    iscsi_task_mgmt_abort_task_async(acb->session->iscsi, acb->task,
                                      iscsi_abort_task_cb, acb);
 
     while (acb->status == -EINPROGRESS) {
@@ -137,50 +175,159 @@ static void iscsi_process_write(void *arg);
 
 static int iscsi_process_flush(void *arg)
 {
-    IscsiLun *iscsilun = arg;
+    IscsiSession *session = arg;
 
-    return iscsi_queue_length(iscsilun->iscsi) > 0;
+    return iscsi_queue_length(session->iscsi) > 0;
 }
 
 static void
-iscsi_set_events(IscsiLun *iscsilun)
+iscsi_set_events(IscsiSession *session)
 {
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    struct iscsi_context *iscsi = session->iscsi;
     int ev;
 
     /* We always register a read handler.  */
     ev = POLLIN;
     ev |= iscsi_which_events(iscsi);
-    if (ev != iscsilun->events) {
+    if (ev != session->events) {
         qemu_aio_set_fd_handler(iscsi_get_fd(iscsi),
                       iscsi_process_read,
                       (ev & POLLOUT) ? iscsi_process_write : NULL,
                       iscsi_process_flush,
-                      iscsilun);
+                      session);
 
     }
 
-    iscsilun->events = ev;
+    session->events = ev;
 }
 
 static void
 iscsi_process_read(void *arg)
 {
-    IscsiLun *iscsilun = arg;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    IscsiSession *session = arg;
+    struct iscsi_context *iscsi = session->iscsi;
 
     iscsi_service(iscsi, POLLIN);
-    iscsi_set_events(iscsilun);
+    iscsi_set_events(session);
 }
 
 static void
 iscsi_process_write(void *arg)
 {
-    IscsiLun *iscsilun = arg;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    IscsiSession *session = arg;
+    struct iscsi_context *iscsi = session->iscsi;
 
     iscsi_service(iscsi, POLLOUT);
-    iscsi_set_events(iscsilun);
+    iscsi_set_events(session);
+}
+
+static IscsiSession *iscsi_pick_session(IscsiLun *iscsilun)
+{
+    IscsiSession *best = &iscsilun->sessions[0];
+    int i;
+
+    for (i = 1; i < iscsilun->nb_sessions; i++) {
+        if (iscsilun->sessions[i].in_flight < best->in_flight) {
+            best = &iscsilun->sessions[i];
+        }
+    }
+    return best;
+}
+
+static bool iscsi_session_full(IscsiLun *iscsilun, IscsiSession *session)
+{
+    return iscsilun->queue_depth &&
+           session->in_flight >= iscsilun->queue_depth;
+}
+
+static int iscsi_submit_rw(IscsiAIOCB *acb, IscsiSession *session)
+{
+    IscsiLun *iscsilun = acb->iscsilun;
+    struct iscsi_data data;
+#if !defined(LIBISCSI_FEATURE_IOVECTOR)
+    int i;
+#endif
+
+    /* only writes without iovector support still use a bounce buffer */
+    data.data = acb->buf;
+    data.size = acb->task->expxferlen;
+
+    if (iscsi_scsi_command_async(session->iscsi, iscsilun->lun, acb->task,
+                                 acb->task_cb,
+                                 acb->buf ? &data : NULL,
+                                 acb) != 0) {
+        return -EIO;
+    }
+
+    if (acb->task->xfer_dir == SCSI_XFER_READ) {
+#if defined(LIBISCSI_FEATURE_IOVECTOR)
+        scsi_task_set_iov_in(acb->task, (struct scsi_iovec *)acb->qiov->iov,
+                             acb->qiov->niov);
+#else
+        for (i = 0; i < acb->qiov->niov; i++) {
+            scsi_task_add_data_in_buffer(acb->task,
+                    acb->qiov->iov[i].iov_len,
+                    acb->qiov->iov[i].iov_base);
+        }
+#endif
+    }
+
+    acb->session = session;
+    acb->in_flight = 1;
+    session->in_flight++;
+    iscsi_set_events(session);
+    return 0;
+}
+
+/* Send a READ or WRITE task, or queue it until a session has room for it
+ * under the queue-depth limit.
+ */
+static int iscsi_start_rw(IscsiAIOCB *acb, iscsi_command_cb cb)
+{
+    IscsiLun *iscsilun = acb->iscsilun;
+    IscsiSession *session = iscsi_pick_session(iscsilun);
+
+    acb->task_cb = cb;
+    acb->session = NULL;
+    acb->in_flight = 0;
+    if (!QTAILQ_EMPTY(&iscsilun->pending) ||
+        iscsi_session_full(iscsilun, session)) {
+        QTAILQ_INSERT_TAIL(&iscsilun->pending, acb, pending_entry);
+        return 0;
+    }
+    return iscsi_submit_rw(acb, session);
+}
+
+static void iscsi_submit_pending(IscsiLun *iscsilun)
+{
+    IscsiAIOCB *acb;
+    IscsiSession *session;
+
+    while ((acb = QTAILQ_FIRST(&iscsilun->pending)) != NULL) {
+        session = iscsi_pick_session(iscsilun);
+        if (iscsi_session_full(iscsilun, session)) {
+            break;
+        }
+        QTAILQ_REMOVE(&iscsilun->pending, acb, pending_entry);
+        if (iscsi_submit_rw(acb, session) != 0) {
+            error_report("iSCSI: Failed to send queued command. %s",
+                         iscsi_get_error(session->iscsi));
+            g_free(acb->buf);
+            acb->buf = NULL;
+            acb->status = -EIO;
+            iscsi_schedule_bh(acb);
+        }
+    }
+}
+
+static void iscsi_rw_done(IscsiAIOCB *acb)
+{
+    if (!acb->in_flight) {
+        return;
+    }
+    acb->in_flight = 0;
+    acb->session->in_flight--;
+    iscsi_submit_pending(acb->iscsilun);
 }
 
 
@@ -193,6 +340,8 @@ iscsi_aio_write16_cb(struct iscsi_context *iscsi, int status,
     trace_iscsi_aio_write16_cb(iscsi, status, acb, acb->canceled);
 
     g_free(acb->buf);
+    acb->buf = NULL;
+    iscsi_rw_done(acb);
 
     if (acb->canceled != 0) {
         return;
@@ -220,15 +369,13 @@ iscsi_aio_writev(BlockDriverState *bs, int64_t sector_num,
                  void *opaque)
 {
     IscsiLun *iscsilun = bs->opaque;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
     IscsiAIOCB *acb;
     size_t size;
     uint32_t num_sectors;
     uint64_t lba;
-    struct iscsi_data data;
 
     acb = qemu_aio_get(&iscsi_aiocb_info, bs, cb, opaque);
-    trace_iscsi_aio_writev(iscsi, sector_num, nb_sectors, opaque, acb);
+    trace_iscsi_aio_writev(iscsilun, sector_num, nb_sectors, opaque, acb);
 
     acb->iscsilun = iscsilun;
     acb->qiov     = qiov;
@@ -236,17 +383,14 @@ iscsi_aio_writev(BlockDriverState *bs, int64_t sector_num,
     acb->canceled   = 0;
     acb->bh         = NULL;
     acb->status     = -EINPROGRESS;
+    acb->buf        = NULL;
 
-    /* XXX we should pass the iovec to write16 to avoid the extra copy */
-    /* this will allow us to get rid of 'buf' completely */
     size = nb_sectors * BDRV_SECTOR_SIZE;
-    acb->buf = g_malloc(size);
-    qemu_iovec_to_buf(acb->qiov, 0, acb->buf, size);
 
     acb->task = malloc(sizeof(struct scsi_task));
     if (acb->task == NULL) {
         error_report("iSCSI: Failed to allocate task for scsi WRITE16 "
-                     "command. %s", iscsi_get_error(iscsi));
+                     "command.");
         qemu_aio_release(acb);
         return NULL;
     }
@@ -262,21 +406,22 @@ iscsi_aio_writev(BlockDriverState *bs, int64_t sector_num,
     *(uint32_t *)&acb->task->cdb[10] = htonl(num_sectors);
     acb->task->expxferlen = size;
 
-    data.data = acb->buf;
-    data.size = size;
+#if defined(LIBISCSI_FEATURE_IOVECTOR)
+    /* libiscsi sends the data-out PDUs straight from the guest buffers */
+    scsi_task_set_iov_out(acb->task, (struct scsi_iovec *)acb->qiov->iov,
+                          acb->qiov->niov);
+#else
+    acb->buf = g_malloc(size);
+    qemu_iovec_to_buf(acb->qiov, 0, acb->buf, size);
+#endif
 
-    if (iscsi_scsi_command_async(iscsi, iscsilun->lun, acb->task,
-                                 iscsi_aio_write16_cb,
-                                 &data,
-                                 acb) != 0) {
+    if (iscsi_start_rw(acb, iscsi_aio_write16_cb) != 0) {
         scsi_free_scsi_task(acb->task);
         g_free(acb->buf);
         qemu_aio_release(acb);
         return NULL;
     }
 
-    iscsi_set_events(iscsilun);
-
     return &acb->common;
 }
 
@@ -288,6 +433,8 @@ iscsi_aio_read16_cb(struct iscsi_context *iscsi, int status,
 
     trace_iscsi_aio_read16_cb(iscsi, status, acb, acb->canceled);
 
+    iscsi_rw_done(acb);
+
     if (acb->canceled != 0) {
         return;
     }
@@ -309,17 +456,15 @@ iscsi_aio_readv(BlockDriverState *bs, int64_t sector_num,
                 void *opaque)
 {
     IscsiLun *iscsilun = bs->opaque;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
     IscsiAIOCB *acb;
     size_t qemu_read_size;
-    int i;
     uint64_t lba;
     uint32_t num_sectors;
 
     qemu_read_size = BDRV_SECTOR_SIZE * (size_t)nb_sectors;
 
     acb = qemu_aio_get(&iscsi_aiocb_info, bs, cb, opaque);
-    trace_iscsi_aio_readv(iscsi, sector_num, nb_sectors, opaque, acb);
+    trace_iscsi_aio_readv(iscsilun, sector_num, nb_sectors, opaque, acb);
 
     acb->iscsilun = iscsilun;
     acb->qiov     = qiov;
@@ -348,7 +493,7 @@ iscsi_aio_readv(BlockDriverState *bs, int64_t sector_num,
     acb->task = malloc(sizeof(struct scsi_task));
     if (acb->task == NULL) {
         error_report("iSCSI: Failed to allocate task for scsi READ16 "
-                     "command. %s", iscsi_get_error(iscsi));
+                     "command.");
         qemu_aio_release(acb);
         return NULL;
     }
@@ -374,23 +519,12 @@ iscsi_aio_readv(BlockDriverState *bs, int64_t sector_num,
         break;
     }
 
-    if (iscsi_scsi_command_async(iscsi, iscsilun->lun, acb->task,
-                                 iscsi_aio_read16_cb,
-                                 NULL,
-                                 acb) != 0) {
+    if (iscsi_start_rw(acb, iscsi_aio_read16_cb) != 0) {
         scsi_free_scsi_task(acb->task);
         qemu_aio_release(acb);
         return NULL;
     }
 
-    for (i = 0; i < acb->qiov->niov; i++) {
-        scsi_task_add_data_in_buffer(acb->task,
-                acb->qiov->iov[i].iov_len,
-                acb->qiov->iov[i].iov_base);
-    }
-
-    iscsi_set_events(iscsilun);
-
     return &acb->common;
 }
 
@@ -420,12 +554,18 @@ iscsi_aio_flush(BlockDriverState *bs,
                 BlockDriverCompletionFunc *cb, void *opaque)
 {
     IscsiLun *iscsilun = bs->opaque;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    IscsiSession *session = iscsi_pick_session(iscsilun);
+    struct iscsi_context *iscsi = session->iscsi;
     IscsiAIOCB *acb;
 
     acb = qemu_aio_get(&iscsi_aiocb_info, bs, cb, opaque);
 
+    /* SYNCHRONIZE CACHE acts on the logical unit, so one session covers
+     * the writes completed on all of them.
+     */
     acb->iscsilun = iscsilun;
+    acb->session    = session;
+    acb->in_flight  = 0;
     acb->canceled   = 0;
     acb->bh         = NULL;
     acb->status     = -EINPROGRESS;
@@ -441,7 +581,7 @@ iscsi_aio_flush(BlockDriverState *bs,
         return NULL;
     }
 
-    iscsi_set_events(iscsilun);
+    iscsi_set_events(session);
 
     return &acb->common;
 }
@@ -472,13 +612,16 @@ iscsi_aio_discard(BlockDriverState *bs,
                   BlockDriverCompletionFunc *cb, void *opaque)
 {
     IscsiLun *iscsilun = bs->opaque;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    IscsiSession *session = iscsi_pick_session(iscsilun);
+    struct iscsi_context *iscsi = session->iscsi;
     IscsiAIOCB *acb;
     struct unmap_list list[1];
 
     acb = qemu_aio_get(&iscsi_aiocb_info, bs, cb, opaque);
 
     acb->iscsilun = iscsilun;
+    acb->session    = session;
+    acb->in_flight  = 0;
     acb->canceled   = 0;
     acb->bh         = NULL;
     acb->status     = -EINPROGRESS;
@@ -497,7 +640,7 @@ iscsi_aio_discard(BlockDriverState *bs,
         return NULL;
     }
 
-    iscsi_set_events(iscsilun);
+    iscsi_set_events(session);
 
     return &acb->common;
 }
@@ -545,7 +688,8 @@ static BlockDriverAIOCB *iscsi_aio_ioctl(BlockDriverState *bs,
         BlockDriverCompletionFunc *cb, void *opaque)
 {
     IscsiLun *iscsilun = bs->opaque;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    IscsiSession *session = iscsi_pick_session(iscsilun);
+    struct iscsi_context *iscsi = session->iscsi;
     struct iscsi_data data;
     IscsiAIOCB *acb;
 
@@ -554,6 +698,8 @@ static BlockDriverAIOCB *iscsi_aio_ioctl(BlockDriverState *bs,
     acb = qemu_aio_get(&iscsi_aiocb_info, bs, cb, opaque);
 
     acb->iscsilun = iscsilun;
+    acb->session     = session;
+    acb->in_flight   = 0;
     acb->canceled    = 0;
     acb->bh          = NULL;
     acb->status      = -EINPROGRESS;
@@ -606,7 +752,7 @@ static BlockDriverAIOCB *iscsi_aio_ioctl(BlockDriverState *bs,
                                      acb->ioh->dxferp);
     }
 
-    iscsi_set_events(iscsilun);
+    iscsi_set_events(session);
 
     return &acb->common;
 }
@@ -734,6 +880,40 @@ static void parse_header_digest(struct iscsi_context *iscsi, const char *target)
     }
 }
 
+static int parse_session_opts(IscsiLun *iscsilun, const char *target)
+{
+    QemuOptsList *list;
+    QemuOpts *opts = NULL;
+
+    list = qemu_find_opts("iscsi");
+    if (list) {
+        opts = qemu_opts_find(list, target);
+        if (!opts) {
+            opts = QTAILQ_FIRST(&list->head);
+        }
+    }
+
+    iscsilun->nb_sessions = 1;
+    iscsilun->queue_depth = 0;
+    if (!opts) {
+        return 0;
+    }
+
+    iscsilun->nb_sessions = qemu_opt_get_number(opts, "sessions", 1);
+    if (iscsilun->nb_sessions < 1 ||
+        iscsilun->nb_sessions > ISCSI_MAX_SESSIONS) {
+        error_report("iSCSI: sessions must be between 1 and %d",
+                     ISCSI_MAX_SESSIONS);
+        return -EINVAL;
+    }
+    iscsilun->queue_depth = qemu_opt_get_number(opts, "queue-depth", 0);
+    if (iscsilun->queue_depth < 0) {
+        error_report("iSCSI: Invalid queue-depth");
+        return -EINVAL;
+    }
+    return 0;
+}
+
 static char *parse_initiator_name(const char *target)
 {
     QemuOptsList *list;
@@ -761,51 +941,25 @@ static char *parse_initiator_name(const char *target)
     }
 }
 
-/*
- * We support iscsi url's on the form
- * iscsi://[<username>%<password>@]<host>[:<port>]/<targetname>/<lun>
- */
-static int iscsi_open(BlockDriverState *bs, const char *filename, int flags)
+/* Log a new session in to the LUN named by iscsi_url */
+static int iscsi_session_login(IscsiSession *session,
+                               struct iscsi_url *iscsi_url,
+                               const char *initiator_name)
 {
-    IscsiLun *iscsilun = bs->opaque;
-    struct iscsi_context *iscsi = NULL;
-    struct iscsi_url *iscsi_url = NULL;
-    struct scsi_task *task = NULL;
-    struct scsi_inquiry_standard *inq = NULL;
-    struct scsi_readcapacity10 *rc10 = NULL;
-    struct scsi_readcapacity16 *rc16 = NULL;
-    char *initiator_name = NULL;
+    struct iscsi_context *iscsi;
     int ret;
 
-    if ((BDRV_SECTOR_SIZE % 512) != 0) {
-        error_report("iSCSI: Invalid BDRV_SECTOR_SIZE. "
-                     "BDRV_SECTOR_SIZE(%lld) is not a multiple "
-                     "of 512", BDRV_SECTOR_SIZE);
-        return -EINVAL;
-    }
-
-    iscsi_url = iscsi_parse_full_url(iscsi, filename);
-    if (iscsi_url == NULL) {
-        error_report("Failed to parse URL : %s", filename);
-        ret = -EINVAL;
-        goto out;
-    }
-
-    memset(iscsilun, 0, sizeof(IscsiLun));
-
-    initiator_name = parse_initiator_name(iscsi_url->target);
-
     iscsi = iscsi_create_context(initiator_name);
     if (iscsi == NULL) {
         error_report("iSCSI: Failed to create iSCSI context.");
         ret = -ENOMEM;
-        goto out;
+        goto fail;
     }
 
     if (iscsi_set_targetname(iscsi, iscsi_url->target)) {
         error_report("iSCSI: Failed to set target name.");
         ret = -EINVAL;
-        goto out;
+        goto fail;
     }
 
     if (iscsi_url->user != NULL) {
@@ -814,7 +968,7 @@ static int iscsi_open(BlockDriverState *bs, const char *filename, int flags)
         if (ret != 0) {
             error_report("Failed to set initiator username and password");
             ret = -EINVAL;
-            goto out;
+            goto fail;
         }
     }
 
@@ -822,13 +976,13 @@ static int iscsi_open(BlockDriverState *bs, const char *filename, int flags)
     if (parse_chap(iscsi, iscsi_url->target) != 0) {
         error_report("iSCSI: Failed to set CHAP user/password");
         ret = -EINVAL;
-        goto out;
+        goto fail;
     }
 
     if (iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL) != 0) {
         error_report("iSCSI: Failed to set session type to normal.");
         ret = -EINVAL;
-        goto out;
+        goto fail;
     }
 
     iscsi_set_header_digest(iscsi, ISCSI_HEADER_DIGEST_NONE_CRC32C);
@@ -840,10 +994,69 @@ static int iscsi_open(BlockDriverState *bs, const char *filename, int flags)
         error_report("iSCSI: Failed to connect to LUN : %s",
             iscsi_get_error(iscsi));
         ret = -EINVAL;
+        goto fail;
+    }
+
+    session->iscsi = iscsi;
+    return 0;
+
+fail:
+    if (iscsi != NULL) {
+        iscsi_destroy_context(iscsi);
+    }
+    return ret;
+}
+
+/*
+ * We support iscsi url's on the form
+ * iscsi://[<username>%<password>@]<host>[:<port>]/<targetname>/<lun>
+ */
+static int iscsi_open(BlockDriverState *bs, const char *filename, int flags)
+{
+    IscsiLun *iscsilun = bs->opaque;
+    struct iscsi_context *iscsi = NULL;
+    struct iscsi_url *iscsi_url = NULL;
+    struct scsi_task *task = NULL;
+    struct scsi_inquiry_standard *inq = NULL;
+    struct scsi_readcapacity10 *rc10 = NULL;
+    struct scsi_readcapacity16 *rc16 = NULL;
+    char *initiator_name = NULL;
+    int i, ret;
+
+    if ((BDRV_SECTOR_SIZE % 512) != 0) {
+        error_report("iSCSI: Invalid BDRV_SECTOR_SIZE. "
+                     "BDRV_SECTOR_SIZE(%lld) is not a multiple "
+                     "of 512", BDRV_SECTOR_SIZE);
+        return -EINVAL;
+    }
+
+    iscsi_url = iscsi_parse_full_url(iscsi, filename);
+    if (iscsi_url == NULL) {
+        error_report("Failed to parse URL : %s", filename);
+        ret = -EINVAL;
         goto out;
     }
 
-    iscsilun->iscsi = iscsi;
+    memset(iscsilun, 0, sizeof(IscsiLun));
+    QTAILQ_INIT(&iscsilun->pending);
+
+    ret = parse_session_opts(iscsilun, iscsi_url->target);
+    if (ret < 0) {
+        goto out;
+    }
+
+    initiator_name = parse_initiator_name(iscsi_url->target);
+
+    for (i = 0; i < iscsilun->nb_sessions; i++) {
+        ret = iscsi_session_login(&iscsilun->sessions[i], iscsi_url,
+                                  initiator_name);
+        if (ret < 0) {
+            goto out;
+        }
+        iscsilun->sessions[i].iscsilun = iscsilun;
+    }
+
+    iscsi = iscsilun->sessions[0].iscsi;
     iscsilun->lun   = iscsi_url->lun;
 
     task = iscsi_inquiry_sync(iscsi, iscsilun->lun, 0, 0, 36);
@@ -933,8 +1146,10 @@ out:
     }
 
     if (ret) {
-        if (iscsi != NULL) {
-            iscsi_destroy_context(iscsi);
+        for (i = 0; i < ISCSI_MAX_SESSIONS; i++) {
+            if (iscsilun->sessions[i].iscsi != NULL) {
+                iscsi_destroy_context(iscsilun->sessions[i].iscsi);
+            }
         }
         memset(iscsilun, 0, sizeof(IscsiLun));
     }
@@ -944,10 +1159,14 @@ out:
 static void iscsi_close(BlockDriverState *bs)
 {
     IscsiLun *iscsilun = bs->opaque;
-    struct iscsi_context *iscsi = iscsilun->iscsi;
+    struct iscsi_context *iscsi;
+    int i;
 
-    qemu_aio_set_fd_handler(iscsi_get_fd(iscsi), NULL, NULL, NULL, NULL);
-    iscsi_destroy_context(iscsi);
+    for (i = 0; i < iscsilun->nb_sessions; i++) {
+        iscsi = iscsilun->sessions[i].iscsi;
+        qemu_aio_set_fd_handler(iscsi_get_fd(iscsi), NULL, NULL, NULL, NULL);
+        iscsi_destroy_context(iscsi);
+    }
     memset(iscsilun, 0, sizeof(IscsiLun));
 }
 
@@ -25,6 +25,9 @@
  */
 #define MAX_EVENTS 128
 
+/* Maximum number of requests queued while plugged */
+#define MAX_QUEUED_IO  128
+
 struct qemu_laiocb {
     BlockDriverAIOCB common;
     struct qemu_laio_state *ctx;
@@ -36,10 +39,19 @@ struct qemu_laiocb {
     QLIST_ENTRY(qemu_laiocb) node;
 };
 
+typedef struct {
+    struct iocb *iocbs[MAX_QUEUED_IO];
+    int plugged;
+    int idx;
+} LaioQueue;
+
 struct qemu_laio_state {
     io_context_t ctx;
     EventNotifier e;
     int count;
+
+    /* io queue for submit at batch */
+    LaioQueue io_q;
 };
 
 static inline ssize_t io_event_ret(struct io_event *ev)
@@ -86,37 +98,51 @@ static void qemu_laio_completion_cb(EventNotifier *e)
         struct timespec ts = { 0 };
         int nevents, i;
 
+        /*
+         * The eventfd counter is reset above, so keep harvesting until the
+         * ring is empty; otherwise completions beyond the first batch would
+         * wait for the next notification.
+         */
         do {
-            nevents = io_getevents(s->ctx, MAX_EVENTS, MAX_EVENTS, events, &ts);
-        } while (nevents == -EINTR);
+            do {
+                nevents = io_getevents(s->ctx, 0, MAX_EVENTS, events, &ts);
+            } while (nevents == -EINTR);
 
-        for (i = 0; i < nevents; i++) {
-            struct iocb *iocb = events[i].obj;
-            struct qemu_laiocb *laiocb =
-                    container_of(iocb, struct qemu_laiocb, iocb);
+            for (i = 0; i < nevents; i++) {
+                struct iocb *iocb = events[i].obj;
+                struct qemu_laiocb *laiocb =
+                        container_of(iocb, struct qemu_laiocb, iocb);
 
-            laiocb->ret = io_event_ret(&events[i]);
-            qemu_laio_process_completion(s, laiocb);
-        }
+                laiocb->ret = io_event_ret(&events[i]);
+                qemu_laio_process_completion(s, laiocb);
+            }
+        } while (nevents == MAX_EVENTS);
     }
 }
 
-static int qemu_laio_flush_cb(EventNotifier *e)
-{
-    struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
-
-    return (s->count > 0) ? 1 : 0;
-}
 
 static void laio_cancel(BlockDriverAIOCB *blockacb)
 {
     struct qemu_laiocb *laiocb = (struct qemu_laiocb *)blockacb;
+    struct qemu_laio_state *s = laiocb->ctx;
     struct io_event event;
-    int ret;
+    int ret, i;
 
     if (laiocb->ret != -EINPROGRESS)
         return;
 
+    /* Requests that are still queued haven't reached the kernel yet */
+    for (i = 0; i < s->io_q.idx; i++) {
+        if (s->io_q.iocbs[i] == &laiocb->iocb) {
+            memmove(&s->io_q.iocbs[i], &s->io_q.iocbs[i + 1],
+                    (s->io_q.idx - i - 1) * sizeof(s->io_q.iocbs[0]));
+            s->io_q.idx--;
+            laiocb->ret = -ECANCELED;
+            qemu_laio_process_completion(s, laiocb);
+            return;
+        }
+    }
+
     /*
      * Note that as of Linux 2.6.31 neither the block device code nor any
      * filesystem implements cancellation of AIO request.
@@ -145,6 +171,95 @@ static const AIOCBInfo laio_aiocb_info = {
     .cancel             = laio_cancel,
 };
 
+static void ioq_init(LaioQueue *io_q)
+{
+    io_q->idx = 0;
+    io_q->plugged = 0;
+}
+
+/*
+ * Submits the queued requests with a single io_submit call. Requests that
+ * the kernel doesn't accept stay at the head of the queue.
+ */
+static int ioq_submit(struct qemu_laio_state *s)
+{
+    int ret, i = 0;
+    int len = s->io_q.idx;
+
+    do {
+        ret = io_submit(s->ctx, len, s->io_q.iocbs);
+    } while (i++ < 3 && ret == -EAGAIN);
+
+    if (ret > 0) {
+        memmove(s->io_q.iocbs, s->io_q.iocbs + ret,
+                (len - ret) * sizeof(s->io_q.iocbs[0]));
+        s->io_q.idx = len - ret;
+    }
+    return ret;
+}
+
+/* Completes all requests that are still queued with an error */
+static void ioq_fail(struct qemu_laio_state *s, int ret)
+{
+    struct iocb *iocbs[MAX_QUEUED_IO];
+    int i, len = s->io_q.idx;
+
+    /* Callbacks may queue new requests */
+    memcpy(iocbs, s->io_q.iocbs, len * sizeof(iocbs[0]));
+    s->io_q.idx = 0;
+
+    for (i = 0; i < len; i++) {
+        struct qemu_laiocb *laiocb =
+            container_of(iocbs[i], struct qemu_laiocb, iocb);
+
+        laiocb->ret = ret;
+        qemu_laio_process_completion(s, laiocb);
+    }
+}
+
+/* Submits all queued requests, failing those that can't be submitted */
+static void ioq_flush(struct qemu_laio_state *s)
+{
+    int ret = ioq_submit(s);
+
+    if (s->io_q.idx > 0) {
+        ioq_fail(s, ret < 0 ? ret : -EIO);
+    }
+}
+
+static int qemu_laio_flush_cb(EventNotifier *e)
+{
+    struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
+
+    /* Somebody waits for requests to complete, don't hold them back */
+    if (s->io_q.idx > 0) {
+        ioq_flush(s);
+    }
+
+    return (s->count > 0) ? 1 : 0;
+}
+
+void laio_io_plug(void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    s->io_q.plugged++;
+}
+
+void laio_io_unplug(void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    assert(s->io_q.plugged > 0);
+    if (--s->io_q.plugged > 0) {
+        return;
+    }
+
+    if (s->io_q.idx > 0) {
+        ioq_flush(s);
+    }
+}
+
 BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque, int type)
@@ -179,8 +294,20 @@ BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
     io_set_eventfd(&laiocb->iocb, event_notifier_get_fd(&s->e));
     s->count++;
 
-    if (io_submit(s->ctx, 1, &iocbs) < 0)
-        goto out_dec_count;
+    if (!s->io_q.plugged) {
+        if (io_submit(s->ctx, 1, &iocbs) < 0) {
+            goto out_dec_count;
+        }
+    } else {
+        /* Make room if the queue is full; fail the request if that fails */
+        if (s->io_q.idx == MAX_QUEUED_IO) {
+            ioq_submit(s);
+            if (s->io_q.idx == MAX_QUEUED_IO) {
+                goto out_dec_count;
+            }
+        }
+        s->io_q.iocbs[s->io_q.idx++] = iocbs;
+    }
     return &laiocb->common;
 
 out_dec_count:
@@ -190,6 +317,21 @@ out_free_aiocb:
     return NULL;
 }
 
+void laio_detach_aio_context(void *s_, AioContext *old_context)
+{
+    struct qemu_laio_state *s = s_;
+
+    aio_set_event_notifier(old_context, &s->e, NULL, NULL);
+}
+
+void laio_attach_aio_context(void *s_, AioContext *new_context)
+{
+    struct qemu_laio_state *s = s_;
+
+    aio_set_event_notifier(new_context, &s->e, qemu_laio_completion_cb,
+                           qemu_laio_flush_cb);
+}
+
 void *laio_init(void)
 {
     struct qemu_laio_state *s;
@@ -203,8 +345,7 @@ void *laio_init(void)
         goto out_close_efd;
     }
 
-    qemu_aio_set_event_notifier(&s->e, qemu_laio_completion_cb,
-                                qemu_laio_flush_cb);
+    ioq_init(&s->io_q);
 
     return s;
 
@@ -48,14 +48,12 @@
 #endif
 
 #define MAX_NBD_REQUESTS	16
-#define HANDLE_TO_INDEX(bs, handle) ((handle) ^ ((uint64_t)(intptr_t)bs))
-#define INDEX_TO_HANDLE(bs, index)  ((index)  ^ ((uint64_t)(intptr_t)bs))
+#define MAX_NBD_CONNECTIONS	8
+#define HANDLE_TO_INDEX(c, handle) ((handle) ^ ((uint64_t)(intptr_t)c))
+#define INDEX_TO_HANDLE(c, index)  ((index)  ^ ((uint64_t)(intptr_t)c))
 
-typedef struct BDRVNBDState {
+typedef struct NBDConnection {
     int sock;
-    uint32_t nbdflags;
-    off_t size;
-    size_t blocksize;
 
     CoMutex send_mutex;
     CoMutex free_sema;
@@ -64,6 +62,19 @@ typedef struct BDRVNBDState {
 
     Coroutine *recv_coroutine[MAX_NBD_REQUESTS];
     struct nbd_reply reply;
+} NBDConnection;
+
+typedef struct BDRVNBDState {
+    /* Requests are spread over several sockets if the server says that
+     * flushes on one of them cover writes completed on the others.
+     */
+    NBDConnection conn[MAX_NBD_CONNECTIONS];
+    int nb_conns;
+
+    uint32_t nbdflags;
+    off_t size;
+    size_t blocksize;
+    NBDExtensions ext;
 
     int is_unix;
     char *host_spec;
@@ -74,8 +85,11 @@ static int nbd_parse_uri(BDRVNBDState *s, const char *filename)
 {
     URI *uri;
     const char *p;
+    const char *sockpath = NULL;
     QueryParams *qp = NULL;
+    char *end;
     int ret = 0;
+    int i;
 
     uri = uri_parse(filename);
     if (!uri) {
@@ -101,20 +115,31 @@ static int nbd_parse_uri(BDRVNBDState *s, const char *filename)
     }
 
     qp = query_params_parse(uri->query);
-    if (qp->n > 1 || (s->is_unix && !qp->n) || (!s->is_unix && qp->n)) {
-        ret = -EINVAL;
-        goto out;
+    for (i = 0; i < qp->n; i++) {
+        if (s->is_unix && !sockpath && !strcmp(qp->p[i].name, "socket")) {
+            sockpath = qp->p[i].value;
+        } else if (!strcmp(qp->p[i].name, "connections")) {
+            s->nb_conns = strtol(qp->p[i].value, &end, 10);
+            if (*end || s->nb_conns < 1 ||
+                s->nb_conns > MAX_NBD_CONNECTIONS) {
+                ret = -EINVAL;
+                goto out;
+            }
+        } else {
+            ret = -EINVAL;
+            goto out;
+        }
     }
 
     if (s->is_unix) {
-        /* nbd+unix:///export?socket=path */
-        if (uri->server || uri->port || strcmp(qp->p[0].name, "socket")) {
+        /* nbd+unix:///export?socket=path[&connections=n] */
+        if (uri->server || uri->port || !sockpath) {
             ret = -EINVAL;
             goto out;
         }
-        s->host_spec = g_strdup(qp->p[0].value);
+        s->host_spec = g_strdup(sockpath);
     } else {
-        /* nbd[+tcp]://host:port/export */
+        /* nbd[+tcp]://host:port/export[?connections=n] */
         if (!uri->server) {
             ret = -EINVAL;
             goto out;
@@ -182,53 +207,62 @@ out:
     return err;
 }
 
-static void nbd_coroutine_start(BDRVNBDState *s, struct nbd_request *request)
+static NBDConnection *nbd_coroutine_start(BDRVNBDState *s,
+                                          struct nbd_request *request)
 {
+    NBDConnection *c = &s->conn[0];
     int i;
 
+    for (i = 1; i < s->nb_conns; i++) {
+        if (s->conn[i].in_flight < c->in_flight) {
+            c = &s->conn[i];
+        }
+    }
+
     /* Poor man semaphore.  The free_sema is locked when no other request
      * can be accepted, and unlocked after receiving one reply.  */
-    if (s->in_flight >= MAX_NBD_REQUESTS - 1) {
-        qemu_co_mutex_lock(&s->free_sema);
-        assert(s->in_flight < MAX_NBD_REQUESTS);
+    if (c->in_flight >= MAX_NBD_REQUESTS - 1) {
+        qemu_co_mutex_lock(&c->free_sema);
+        assert(c->in_flight < MAX_NBD_REQUESTS);
     }
-    s->in_flight++;
+    c->in_flight++;
 
     for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        if (s->recv_coroutine[i] == NULL) {
-            s->recv_coroutine[i] = qemu_coroutine_self();
+        if (c->recv_coroutine[i] == NULL) {
+            c->recv_coroutine[i] = qemu_coroutine_self();
             break;
         }
     }
 
     assert(i < MAX_NBD_REQUESTS);
-    request->handle = INDEX_TO_HANDLE(s, i);
+    request->handle = INDEX_TO_HANDLE(c, i);
+    return c;
 }
 
 static int nbd_have_request(void *opaque)
 {
-    BDRVNBDState *s = opaque;
+    NBDConnection *c = opaque;
 
-    return s->in_flight > 0;
+    return c->in_flight > 0;
 }
 
 static void nbd_reply_ready(void *opaque)
 {
-    BDRVNBDState *s = opaque;
+    NBDConnection *c = opaque;
     uint64_t i;
     int ret;
 
-    if (s->reply.handle == 0) {
+    if (c->reply.handle == 0) {
         /* No reply already in flight.  Fetch a header.  It is possible
          * that another thread has done the same thing in parallel, so
          * the socket is not readable anymore.
          */
-        ret = nbd_receive_reply(s->sock, &s->reply);
+        ret = nbd_receive_reply(c->sock, &c->reply);
         if (ret == -EAGAIN) {
             return;
         }
         if (ret < 0) {
-            s->reply.handle = 0;
+            c->reply.handle = 0;
             goto fail;
         }
     }
@@ -236,96 +270,234 @@ static void nbd_reply_ready(void *opaque)
     /* There's no need for a mutex on the receive side, because the
      * handler acts as a synchronization point and ensures that only
      * one coroutine is called until the reply finishes.  */
-    i = HANDLE_TO_INDEX(s, s->reply.handle);
+    i = HANDLE_TO_INDEX(c, c->reply.handle);
     if (i >= MAX_NBD_REQUESTS) {
         goto fail;
     }
 
-    if (s->recv_coroutine[i]) {
-        qemu_coroutine_enter(s->recv_coroutine[i], NULL);
+    if (c->recv_coroutine[i]) {
+        qemu_coroutine_enter(c->recv_coroutine[i], NULL);
         return;
     }
 
 fail:
     for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        if (s->recv_coroutine[i]) {
-            qemu_coroutine_enter(s->recv_coroutine[i], NULL);
+        if (c->recv_coroutine[i]) {
+            qemu_coroutine_enter(c->recv_coroutine[i], NULL);
         }
     }
 }
 
 static void nbd_restart_write(void *opaque)
 {
-    BDRVNBDState *s = opaque;
-    qemu_coroutine_enter(s->send_coroutine, NULL);
+    NBDConnection *c = opaque;
+    qemu_coroutine_enter(c->send_coroutine, NULL);
 }
 
-static int nbd_co_send_request(BDRVNBDState *s, struct nbd_request *request,
+static int nbd_co_send_request(NBDConnection *c, struct nbd_request *request,
                                QEMUIOVector *qiov, int offset)
 {
     int rc, ret;
 
-    qemu_co_mutex_lock(&s->send_mutex);
-    s->send_coroutine = qemu_coroutine_self();
-    qemu_aio_set_fd_handler(s->sock, nbd_reply_ready, nbd_restart_write,
-                            nbd_have_request, s);
-    rc = nbd_send_request(s->sock, request);
+    qemu_co_mutex_lock(&c->send_mutex);
+    c->send_coroutine = qemu_coroutine_self();
+    qemu_aio_set_fd_handler(c->sock, nbd_reply_ready, nbd_restart_write,
+                            nbd_have_request, c);
+    rc = nbd_send_request(c->sock, request);
     if (rc >= 0 && qiov) {
-        ret = qemu_co_sendv(s->sock, qiov->iov, qiov->niov,
+        ret = qemu_co_sendv(c->sock, qiov->iov, qiov->niov,
                             offset, request->len);
         if (ret != request->len) {
-            return -EIO;
+            rc = -EIO;
         }
     }
-    qemu_aio_set_fd_handler(s->sock, nbd_reply_ready, NULL,
-                            nbd_have_request, s);
-    s->send_coroutine = NULL;
-    qemu_co_mutex_unlock(&s->send_mutex);
+    qemu_aio_set_fd_handler(c->sock, nbd_reply_ready, NULL,
+                            nbd_have_request, c);
+    c->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&c->send_mutex);
     return rc;
 }
 
-static void nbd_co_receive_reply(BDRVNBDState *s, struct nbd_request *request,
+static int nbd_co_recv_full(int sock, void *buf, size_t len)
+{
+    return qemu_co_recv(sock, buf, len) == len ? 0 : -EIO;
+}
+
+static int nbd_co_drain(int sock, uint32_t len)
+{
+    char buf[256];
+    uint32_t n;
+
+    while (len > 0) {
+        n = MIN(len, sizeof(buf));
+        if (nbd_co_recv_full(sock, buf, n) < 0) {
+            return -EIO;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+/* Consume the payload of a structured reply chunk.  Returns a negative
+ * value if the stream cannot be parsed anymore, a positive errno if the
+ * server reported an error for the request, zero otherwise.
+ */
+static int nbd_co_receive_chunk(BDRVNBDState *s, NBDConnection *c,
+                                struct nbd_request *request,
+                                struct nbd_reply *reply,
+                                QEMUIOVector *qiov, int offset,
+                                struct nbd_extent *extent)
+{
+    uint8_t buf[12];
+    uint64_t from;
+    uint32_t len;
+    bool hole;
+    int ret;
+
+    switch (reply->type) {
+    case NBD_REPLY_TYPE_NONE:
+        return reply->length == 0 ? 0 : -EINVAL;
+
+    case NBD_REPLY_TYPE_OFFSET_DATA:
+    case NBD_REPLY_TYPE_OFFSET_HOLE:
+        hole = reply->type == NBD_REPLY_TYPE_OFFSET_HOLE;
+        if (!qiov || reply->length < 8 || (hole && reply->length != 12)) {
+            return -EINVAL;
+        }
+        if (nbd_co_recv_full(c->sock, buf, hole ? 12 : 8) < 0) {
+            return -EIO;
+        }
+        from = be64_to_cpup((uint64_t *)buf);
+        len = hole ? be32_to_cpup((uint32_t *)(buf + 8)) : reply->length - 8;
+        if (from < request->from || len > request->len ||
+            from - request->from > request->len - len) {
+            return -EINVAL;
+        }
+
+        offset += from - request->from;
+        if (hole) {
+            qemu_iovec_memset(qiov, offset, 0, len);
+            return 0;
+        }
+        ret = qemu_co_recvv(c->sock, qiov->iov, qiov->niov, offset, len);
+        return ret == len ? 0 : -EIO;
+
+    case NBD_REPLY_TYPE_BLOCK_STATUS:
+        if (!extent || reply->length < 12 || (reply->length - 4) % 8) {
+            return -EINVAL;
+        }
+        if (nbd_co_recv_full(c->sock, buf, 12) < 0 ||
+            be32_to_cpup((uint32_t *)buf) != s->ext.alloc_context_id) {
+            return -EINVAL;
+        }
+        /* Only the first extent is needed to answer is_allocated */
+        extent->length = be32_to_cpup((uint32_t *)(buf + 4));
+        extent->flags = be32_to_cpup((uint32_t *)(buf + 8));
+        return nbd_co_drain(c->sock, reply->length - 12);
+
+    default:
+        if (!NBD_REPLY_TYPE_IS_ERR(reply->type)) {
+            return nbd_co_drain(c->sock, reply->length) < 0 ? -EIO : EIO;
+        }
+        /* Error chunks start with the error and the message length */
+        if (reply->length < 6 || nbd_co_recv_full(c->sock, buf, 4) < 0 ||
+            nbd_co_drain(c->sock, reply->length - 4) < 0) {
+            return -EINVAL;
+        }
+        ret = be32_to_cpup((uint32_t *)buf);
+        return ret ? ret : EIO;
+    }
+}
+
+static void nbd_co_receive_reply(BDRVNBDState *s, NBDConnection *c,
+                                 struct nbd_request *request,
                                  struct nbd_reply *reply,
-                                 QEMUIOVector *qiov, int offset)
+                                 QEMUIOVector *qiov, int offset,
+                                 struct nbd_extent *extent)
 {
+    int error = 0;
     int ret;
 
-    /* Wait until we're woken up by the read handler.  TODO: perhaps
-     * peek at the next reply and avoid yielding if it's ours?  */
-    qemu_coroutine_yield();
-    *reply = s->reply;
-    if (reply->handle != request->handle) {
-        reply->error = EIO;
-    } else {
-        if (qiov && reply->error == 0) {
-            ret = qemu_co_recvv(s->sock, qiov->iov, qiov->niov,
-                                offset, request->len);
-            if (ret != request->len) {
-                reply->error = EIO;
+    for (;;) {
+        /* Wait until we're woken up by the read handler.  TODO: perhaps
+         * peek at the next reply and avoid yielding if it's ours?  */
+        qemu_coroutine_yield();
+        *reply = c->reply;
+        if (reply->handle != request->handle) {
+            reply->error = EIO;
+            return;
+        }
+
+        if (reply->magic != NBD_STRUCTURED_REPLY_MAGIC) {
+            if (qiov && reply->error == 0) {
+                ret = qemu_co_recvv(c->sock, qiov->iov, qiov->niov,
+                                    offset, request->len);
+                if (ret != request->len) {
+                    reply->error = EIO;
+                }
             }
+
+            /* Tell the read handler to read another header.  */
+            c->reply.handle = 0;
+            return;
+        }
+
+        /* A structured reply can be split in several chunks, possibly
+         * interleaved with replies to other requests.
+         */
+        ret = nbd_co_receive_chunk(s, c, request, reply, qiov, offset,
+                                   extent);
+        if (ret < 0) {
+            reply->error = EIO;
+            return;
+        }
+        if (ret > 0 && error == 0) {
+            error = ret;
         }
 
-        /* Tell the read handler to read another header.  */
-        s->reply.handle = 0;
+        c->reply.handle = 0;
+        if (reply->flags & NBD_REPLY_FLAG_DONE) {
+            reply->error = error;
+            return;
+        }
     }
 }
 
-static void nbd_coroutine_end(BDRVNBDState *s, struct nbd_request *request)
+static void nbd_coroutine_end(NBDConnection *c, struct nbd_request *request)
 {
-    int i = HANDLE_TO_INDEX(s, request->handle);
-    s->recv_coroutine[i] = NULL;
-    if (s->in_flight-- == MAX_NBD_REQUESTS) {
-        qemu_co_mutex_unlock(&s->free_sema);
+    int i = HANDLE_TO_INDEX(c, request->handle);
+    c->recv_coroutine[i] = NULL;
+    if (c->in_flight-- == MAX_NBD_REQUESTS) {
+        qemu_co_mutex_unlock(&c->free_sema);
     }
 }
 
-static int nbd_establish_connection(BlockDriverState *bs)
+static int nbd_co_request(BlockDriverState *bs, struct nbd_request *request,
+                          QEMUIOVector *write_qiov, QEMUIOVector *read_qiov,
+                          int offset, struct nbd_extent *extent)
 {
     BDRVNBDState *s = bs->opaque;
+    NBDConnection *c;
+    struct nbd_reply reply;
+    ssize_t ret;
+
+    c = nbd_coroutine_start(s, request);
+    ret = nbd_co_send_request(c, request, write_qiov, offset);
+    if (ret < 0) {
+        reply.error = -ret;
+    } else {
+        nbd_co_receive_reply(s, c, request, &reply, read_qiov, offset,
+                             extent);
+    }
+    nbd_coroutine_end(c, request);
+    return -reply.error;
+}
+
+static int nbd_connect(BDRVNBDState *s, NBDConnection *c, uint32_t *flags,
+                       off_t *size, size_t *blocksize, NBDExtensions *ext)
+{
     int sock;
     int ret;
-    off_t size;
-    size_t blocksize;
 
     if (s->is_unix) {
         sock = unix_socket_outgoing(s->host_spec);
@@ -340,8 +512,8 @@ static int nbd_establish_connection(BlockDriverState *bs)
     }
 
     /* NBD handshake */
-    ret = nbd_receive_negotiate(sock, s->export_name, &s->nbdflags, &size,
-                                &blocksize);
+    ret = nbd_receive_negotiate(sock, s->export_name, flags, size,
+                                blocksize, ext);
     if (ret < 0) {
         logout("Failed to negotiate with the NBD server\n");
         closesocket(sock);
@@ -352,37 +524,87 @@ static int nbd_establish_connection(BlockDriverState *bs)
      * kick the reply mechanism.  */
     socket_set_nonblock(sock);
     qemu_aio_set_fd_handler(sock, nbd_reply_ready, NULL,
-                            nbd_have_request, s);
-
-    s->sock = sock;
-    s->size = size;
-    s->blocksize = blocksize;
-
-    logout("Established connection with NBD server\n");
+                            nbd_have_request, c);
+    c->sock = sock;
     return 0;
 }
 
-static void nbd_teardown_connection(BlockDriverState *bs)
+static void nbd_close_connection(NBDConnection *c)
 {
-    BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
 
     request.type = NBD_CMD_DISC;
     request.from = 0;
     request.len = 0;
-    nbd_send_request(s->sock, &request);
+    nbd_send_request(c->sock, &request);
 
-    qemu_aio_set_fd_handler(s->sock, NULL, NULL, NULL, NULL);
-    closesocket(s->sock);
+    qemu_aio_set_fd_handler(c->sock, NULL, NULL, NULL, NULL);
+    closesocket(c->sock);
+}
+
+static void nbd_teardown_connection(BlockDriverState *bs)
+{
+    BDRVNBDState *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < s->nb_conns; i++) {
+        nbd_close_connection(&s->conn[i]);
+    }
+}
+
+static int nbd_establish_connection(BlockDriverState *bs)
+{
+    BDRVNBDState *s = bs->opaque;
+    NBDExtensions ext;
+    uint32_t flags;
+    off_t size;
+    size_t blocksize;
+    int ret;
+    int i;
+
+    ret = nbd_connect(s, &s->conn[0], &s->nbdflags, &s->size,
+                      &s->blocksize, &s->ext);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (s->nb_conns > 1 && !(s->nbdflags & NBD_FLAG_CAN_MULTI_CONN)) {
+        logout("Server does not support multiple connections\n");
+        s->nb_conns = 1;
+    }
+
+    /* The other connections must see the same export */
+    for (i = 1; i < s->nb_conns; i++) {
+        ret = nbd_connect(s, &s->conn[i], &flags, &size, &blocksize, &ext);
+        if (ret == 0 && (flags != s->nbdflags || size != s->size ||
+                         ext.structured_reply != s->ext.structured_reply ||
+                         ext.block_status != s->ext.block_status ||
+                         ext.alloc_context_id != s->ext.alloc_context_id)) {
+            nbd_close_connection(&s->conn[i]);
+            ret = -EINVAL;
+        }
+        if (ret < 0) {
+            s->nb_conns = i;
+            nbd_teardown_connection(bs);
+            return ret;
+        }
+    }
+
+    logout("Established %d connection(s) with NBD server\n", s->nb_conns);
+    return 0;
 }
 
 static int nbd_open(BlockDriverState *bs, const char* filename, int flags)
 {
     BDRVNBDState *s = bs->opaque;
     int result;
+    int i;
 
-    qemu_co_mutex_init(&s->send_mutex);
-    qemu_co_mutex_init(&s->free_sema);
+    for (i = 0; i < MAX_NBD_CONNECTIONS; i++) {
+        qemu_co_mutex_init(&s->conn[i].send_mutex);
+        qemu_co_mutex_init(&s->conn[i].free_sema);
+    }
+    s->nb_conns = 1;
 
     /* Pop the config into our state object. Exit if invalid. */
     result = nbd_config(s, filename);
@@ -402,25 +624,13 @@ static int nbd_co_readv_1(BlockDriverState *bs, int64_t sector_num,
                           int nb_sectors, QEMUIOVector *qiov,
                           int offset)
 {
-    BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
-    struct nbd_reply reply;
-    ssize_t ret;
 
     request.type = NBD_CMD_READ;
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, NULL, 0);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(s, &request, &reply, qiov, offset);
-    }
-    nbd_coroutine_end(s, &request);
-    return -reply.error;
-
+    return nbd_co_request(bs, &request, NULL, qiov, offset, NULL);
 }
 
 static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
@@ -429,8 +639,6 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
 {
     BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
-    struct nbd_reply reply;
-    ssize_t ret;
 
     request.type = NBD_CMD_WRITE;
     if (!bdrv_enable_write_cache(bs) && (s->nbdflags & NBD_FLAG_SEND_FUA)) {
@@ -440,15 +648,7 @@ static int nbd_co_writev_1(BlockDriverState *bs, int64_t sector_num,
     request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, qiov, offset);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(s, &request, &reply, NULL, 0);
-    }
-    nbd_coroutine_end(s, &request);
-    return -reply.error;
+    return nbd_co_request(bs, &request, qiov, NULL, offset, NULL);
 }
 
 /* qemu-nbd has a limit of slightly less than 1M per request.  Try to
@@ -493,8 +693,6 @@ static int nbd_co_flush(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
-    struct nbd_reply reply;
-    ssize_t ret;
 
     if (!(s->nbdflags & NBD_FLAG_SEND_FLUSH)) {
         return 0;
@@ -508,15 +706,7 @@ static int nbd_co_flush(BlockDriverState *bs)
     request.from = 0;
     request.len = 0;
 
-    nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, NULL, 0);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(s, &request, &reply, NULL, 0);
-    }
-    nbd_coroutine_end(s, &request);
-    return -reply.error;
+    return nbd_co_request(bs, &request, NULL, NULL, 0, NULL);
 }
 
 static int nbd_co_discard(BlockDriverState *bs, int64_t sector_num,
@@ -524,25 +714,50 @@ static int nbd_co_discard(BlockDriverState *bs, int64_t sector_num,
 {
     BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
-    struct nbd_reply reply;
-    ssize_t ret;
 
     if (!(s->nbdflags & NBD_FLAG_SEND_TRIM)) {
         return 0;
     }
     request.type = NBD_CMD_TRIM;
-    request.from = sector_num * 512;;
+    request.from = sector_num * 512;
     request.len = nb_sectors * 512;
 
-    nbd_coroutine_start(s, &request);
-    ret = nbd_co_send_request(s, &request, NULL, 0);
+    return nbd_co_request(bs, &request, NULL, NULL, 0, NULL);
+}
+
+static int coroutine_fn nbd_co_is_allocated(BlockDriverState *bs,
+                                            int64_t sector_num,
+                                            int nb_sectors, int *pnum)
+{
+    BDRVNBDState *s = bs->opaque;
+    struct nbd_request request;
+    struct nbd_extent extent = { 0, 0 };
+    int ret;
+
+    if (!s->ext.block_status) {
+        *pnum = nb_sectors;
+        return 1;
+    }
+
+    request.type = NBD_CMD_BLOCK_STATUS | NBD_CMD_FLAG_REQ_ONE;
+    request.from = sector_num * 512;
+    request.len = MIN(nb_sectors, UINT32_MAX / 512) * 512;
+
+    ret = nbd_co_request(bs, &request, NULL, NULL, 0, &extent);
     if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(s, &request, &reply, NULL, 0);
+        return ret;
     }
-    nbd_coroutine_end(s, &request);
-    return -reply.error;
+    if (extent.length == 0 || extent.length > request.len) {
+        return -EIO;
+    }
+
+    /* An extent shorter than a sector leaves its state ambiguous */
+    if (extent.length < 512) {
+        *pnum = 1;
+        return 1;
+    }
+    *pnum = extent.length / 512;
+    return !(extent.flags & NBD_STATE_HOLE);
 }
 
 static void nbd_close(BlockDriverState *bs)
@@ -571,6 +786,7 @@ static BlockDriver bdrv_nbd = {
     .bdrv_close          = nbd_close,
     .bdrv_co_flush_to_os = nbd_co_flush,
     .bdrv_co_discard     = nbd_co_discard,
+    .bdrv_co_is_allocated = nbd_co_is_allocated,
     .bdrv_getlength      = nbd_getlength,
 };
 
@@ -584,6 +800,7 @@ static BlockDriver bdrv_nbd_tcp = {
     .bdrv_close          = nbd_close,
     .bdrv_co_flush_to_os = nbd_co_flush,
     .bdrv_co_discard     = nbd_co_discard,
+    .bdrv_co_is_allocated = nbd_co_is_allocated,
     .bdrv_getlength      = nbd_getlength,
 };
 
@@ -597,6 +814,7 @@ static BlockDriver bdrv_nbd_unix = {
     .bdrv_close          = nbd_close,
     .bdrv_co_flush_to_os = nbd_co_flush,
     .bdrv_co_discard     = nbd_co_discard,
+    .bdrv_co_is_allocated = nbd_co_is_allocated,
     .bdrv_getlength      = nbd_getlength,
 };
 
@@ -0,0 +1,238 @@
+/*
+ * Recording of guest read patterns for prefetching
+ *
+ * While a guest boots from an image, the order in which it first touches
+ * each area of the disk is recorded into a small hint file.  Streaming a
+ * clone of the same image with that hint file copies these areas first,
+ * ahead of the guest, before streaming the rest of the backing file.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "block_int.h"
+#include "qemu-timer.h"
+#include "qemu/hbitmap.h"
+#include "qerror.h"
+
+#define PREFETCH_HINT_MAGIC     0x51504648 /* "QPFH" */
+#define PREFETCH_HINT_VERSION   1
+
+/* Reads are recorded in chunks of this many sectors (64k) */
+#define PREFETCH_CHUNK_BITS     7
+#define PREFETCH_CHUNK_SECTORS  (1 << PREFETCH_CHUNK_BITS)
+/* A boot touches far fewer separate areas; stop recording after this many */
+#define PREFETCH_MAX_EXTENTS    65536
+
+/* All fields are big-endian */
+typedef struct QEMU_PACKED PrefetchHintHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t total_sectors;
+    uint32_t nb_extents;
+    uint32_t reserved;
+} PrefetchHintHeader;
+
+typedef struct QEMU_PACKED PrefetchHintEntry {
+    uint64_t sector_num;
+    uint32_t nb_sectors;
+    uint32_t reserved;
+} PrefetchHintEntry;
+
+struct PrefetchRecorder {
+    char *filename;
+    int64_t total_sectors;
+    HBitmap *seen;              /* chunks read so far */
+    PrefetchExtent *extents;    /* in the order they were first read */
+    int nb_extents;
+    QEMUTimer *timer;           /* ends the recording after its duration */
+};
+
+static void prefetch_record_timer_cb(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+
+    prefetch_record_stop(bs, NULL);
+}
+
+void prefetch_record_start(BlockDriverState *bs, const char *filename,
+                           int64_t duration_ms, Error **errp)
+{
+    PrefetchRecorder *r;
+
+    if (bs->prefetch_recorder) {
+        error_set(errp, QERR_DEVICE_IN_USE, bdrv_get_device_name(bs));
+        return;
+    }
+    if (!bdrv_is_inserted(bs)) {
+        error_set(errp, QERR_DEVICE_HAS_NO_MEDIUM, bdrv_get_device_name(bs));
+        return;
+    }
+
+    r = g_malloc0(sizeof(*r));
+    r->filename = g_strdup(filename);
+    r->total_sectors = bdrv_getlength(bs) >> BDRV_SECTOR_BITS;
+    r->seen = hbitmap_alloc(r->total_sectors, PREFETCH_CHUNK_BITS);
+    if (duration_ms > 0) {
+        r->timer = qemu_new_timer_ms(rt_clock, prefetch_record_timer_cb, bs);
+        qemu_mod_timer(r->timer, qemu_get_clock_ms(rt_clock) + duration_ms);
+    }
+
+    bs->prefetch_recorder = r;
+}
+
+void prefetch_record_read(BlockDriverState *bs, int64_t sector_num,
+                          int nb_sectors)
+{
+    PrefetchRecorder *r = bs->prefetch_recorder;
+    int64_t chunk = sector_num >> PREFETCH_CHUNK_BITS;
+    int64_t end = MIN(sector_num + nb_sectors, r->total_sectors);
+
+    for (; chunk << PREFETCH_CHUNK_BITS < end; chunk++) {
+        int64_t start = chunk << PREFETCH_CHUNK_BITS;
+        PrefetchExtent *last;
+
+        if (hbitmap_get(r->seen, start)) {
+            continue;
+        }
+        hbitmap_set(r->seen, start, PREFETCH_CHUNK_SECTORS);
+
+        /* Sequential first reads grow the previous extent */
+        last = r->nb_extents ? &r->extents[r->nb_extents - 1] : NULL;
+        if (last && last->sector_num + last->nb_sectors == start &&
+            last->nb_sectors <= INT_MAX - PREFETCH_CHUNK_SECTORS) {
+            last->nb_sectors += PREFETCH_CHUNK_SECTORS;
+            continue;
+        }
+
+        if (r->nb_extents == PREFETCH_MAX_EXTENTS) {
+            return;
+        }
+        if ((r->nb_extents & (r->nb_extents - 1)) == 0) {
+            r->extents = g_renew(PrefetchExtent, r->extents,
+                                 MAX(r->nb_extents * 2, 64));
+        }
+        r->extents[r->nb_extents++] = (PrefetchExtent) {
+            .sector_num = start,
+            .nb_sectors = PREFETCH_CHUNK_SECTORS,
+        };
+    }
+}
+
+static int prefetch_hints_write(PrefetchRecorder *r)
+{
+    PrefetchHintHeader header = {
+        .magic          = cpu_to_be32(PREFETCH_HINT_MAGIC),
+        .version        = cpu_to_be32(PREFETCH_HINT_VERSION),
+        .total_sectors  = cpu_to_be64(r->total_sectors),
+        .nb_extents     = cpu_to_be32(r->nb_extents),
+    };
+    PrefetchHintEntry *entries;
+    size_t size = r->nb_extents * sizeof(*entries);
+    int fd, i, ret = 0;
+
+    entries = g_malloc0(MAX(size, 1));
+    for (i = 0; i < r->nb_extents; i++) {
+        entries[i].sector_num = cpu_to_be64(r->extents[i].sector_num);
+        entries[i].nb_sectors = cpu_to_be32(r->extents[i].nb_sectors);
+    }
+
+    fd = qemu_open(r->filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY,
+                   0644);
+    if (fd < 0) {
+        ret = -errno;
+        goto out;
+    }
+    if (qemu_write_full(fd, &header, sizeof(header)) != sizeof(header) ||
+        qemu_write_full(fd, entries, size) != size) {
+        ret = -errno;
+    }
+    close(fd);
+
+out:
+    g_free(entries);
+    return ret;
+}
+
+void prefetch_record_stop(BlockDriverState *bs, Error **errp)
+{
+    PrefetchRecorder *r = bs->prefetch_recorder;
+
+    if (!r) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "device",
+                  "a device recording reads");
+        return;
+    }
+    bs->prefetch_recorder = NULL;
+
+    if (prefetch_hints_write(r) < 0) {
+        error_set(errp, QERR_OPEN_FILE_FAILED, r->filename);
+    }
+
+    if (r->timer) {
+        qemu_del_timer(r->timer);
+        qemu_free_timer(r->timer);
+    }
+    hbitmap_free(r->seen);
+    g_free(r->extents);
+    g_free(r->filename);
+    g_free(r);
+}
+
+int prefetch_hints_load(BlockDriverState *bs, const char *filename,
+                        PrefetchExtent **extents, Error **errp)
+{
+    PrefetchHintHeader header;
+    PrefetchHintEntry entry;
+    int64_t total_sectors = bdrv_getlength(bs) >> BDRV_SECTOR_BITS;
+    int fd, i, n = 0;
+    uint32_t nb_extents;
+
+    *extents = NULL;
+
+    fd = qemu_open(filename, O_RDONLY | O_BINARY);
+    if (fd < 0) {
+        error_set(errp, QERR_OPEN_FILE_FAILED, filename);
+        return -1;
+    }
+
+    if (read(fd, &header, sizeof(header)) != sizeof(header) ||
+        be32_to_cpu(header.magic) != PREFETCH_HINT_MAGIC ||
+        be32_to_cpu(header.version) != PREFETCH_HINT_VERSION ||
+        be32_to_cpu(header.nb_extents) > PREFETCH_MAX_EXTENTS) {
+        goto invalid;
+    }
+    nb_extents = be32_to_cpu(header.nb_extents);
+
+    /* A clone may have been resized; only keep what is still in the image */
+    *extents = g_new(PrefetchExtent, MAX(nb_extents, 1));
+    for (i = 0; i < nb_extents; i++) {
+        uint64_t sector_num;
+        uint32_t nb_sectors;
+
+        if (read(fd, &entry, sizeof(entry)) != sizeof(entry)) {
+            goto invalid;
+        }
+        sector_num = be64_to_cpu(entry.sector_num);
+        nb_sectors = be32_to_cpu(entry.nb_sectors);
+        if (sector_num >= total_sectors || nb_sectors == 0 ||
+            nb_sectors > INT_MAX) {
+            continue;
+        }
+        (*extents)[n++] = (PrefetchExtent) {
+            .sector_num = sector_num,
+            .nb_sectors = MIN(nb_sectors, total_sectors - sector_num),
+        };
+    }
+
+    close(fd);
+    return n;
+
+invalid:
+    close(fd);
+    g_free(*extents);
+    *extents = NULL;
+    error_set(errp, QERR_INVALID_PARAMETER_VALUE, "hint-file",
+              "a prefetch hint file");
+    return -1;
+}
@@ -778,8 +778,9 @@ static int qcow_make_empty(BlockDriverState *bs)
 
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
-static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                                 const uint8_t *buf, int nb_sectors)
+static int qcow_write_compressed_cluster(BlockDriverState *bs,
+                                         int64_t sector_num,
+                                         const uint8_t *buf)
 {
     BDRVQcowState *s = bs->opaque;
     z_stream strm;
@@ -787,9 +788,6 @@ static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
     uint8_t *out_buf;
     uint64_t cluster_offset;
 
-    if (nb_sectors != s->cluster_sectors)
-        return -EINVAL;
-
     out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
 
     /* best compression, small window, no zlib header */
@@ -844,6 +842,26 @@ fail:
     return ret;
 }
 
+static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
+                                 const uint8_t *buf, int nb_sectors)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    if (nb_sectors == 0 || nb_sectors % s->cluster_sectors) {
+        return -EINVAL;
+    }
+    for (; nb_sectors > 0; nb_sectors -= s->cluster_sectors) {
+        ret = qcow_write_compressed_cluster(bs, sector_num, buf);
+        if (ret < 0) {
+            return ret;
+        }
+        sector_num += s->cluster_sectors;
+        buf += s->cluster_size;
+    }
+    return 0;
+}
+
 static int qcow_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 {
     BDRVQcowState *s = bs->opaque;
@@ -0,0 +1,405 @@
+/*
+ * Persistent dirty bitmaps for the QCOW version 2 format
+ *
+ * Named dirty bitmaps are kept in memory while the image is open.  On close
+ * their contents are written to contiguous clusters and listed in the dirty
+ * bitmaps header extension; on open they are loaded again and marked in use,
+ * so that the bitmaps of an image that was not closed properly are dropped.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "block_int.h"
+#include "block/qcow2.h"
+#include "qemu-error.h"
+
+typedef struct QEMU_PACKED Qcow2BitmapHeader {
+    uint64_t data_offset;
+    uint64_t data_size;
+    uint32_t flags;
+    uint8_t granularity_bits;
+    uint8_t reserved;
+    uint16_t name_size;
+    /* name follows, padded to 8 bytes */
+} Qcow2BitmapHeader;
+
+static size_t bitmap_entry_size(size_t name_size)
+{
+    return align_offset(sizeof(Qcow2BitmapHeader) + name_size, 8);
+}
+
+/* Size of the bitmap data for the current image size */
+static uint64_t bitmap_data_size(BlockDriverState *bs, int granularity_bits)
+{
+    uint64_t granules = DIV_ROUND_UP(bs->total_sectors * BDRV_SECTOR_SIZE,
+                                     1ULL << granularity_bits);
+
+    return DIV_ROUND_UP(granules, 8);
+}
+
+void qcow2_free_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        g_free(s->bitmaps[i].name);
+    }
+    g_free(s->bitmaps);
+    s->bitmaps = NULL;
+    s->nb_bitmaps = 0;
+}
+
+bool qcow2_can_persist_dirty_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    return s->qcow_version >= 3;
+}
+
+/*
+ * Parse the dirty bitmaps header extension into s->bitmaps.
+ *
+ * Returns 0 on success, -errno in error cases.
+ */
+int qcow2_read_bitmap_ext(BlockDriverState *bs, const uint8_t *data,
+                          size_t len)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2BitmapHeader h;
+    Qcow2Bitmap *bm;
+    size_t offset = 0;
+    size_t entry_size;
+    uint64_t data_offset;
+    uint16_t name_size;
+
+    qcow2_free_bitmaps(bs);
+
+    while (offset < len) {
+        if (len - offset < sizeof(h)) {
+            goto invalid;
+        }
+        memcpy(&h, data + offset, sizeof(h));
+        name_size = be16_to_cpu(h.name_size);
+        data_offset = be64_to_cpu(h.data_offset);
+
+        entry_size = bitmap_entry_size(name_size);
+        if (name_size == 0 || entry_size > len - offset) {
+            goto invalid;
+        }
+        if (h.granularity_bits < QCOW2_MIN_BITMAP_GRANULARITY_BITS ||
+            h.granularity_bits > QCOW2_MAX_BITMAP_GRANULARITY_BITS ||
+            (data_offset & (s->cluster_size - 1))) {
+            goto invalid;
+        }
+
+        s->bitmaps = g_realloc(s->bitmaps,
+                               (s->nb_bitmaps + 1) * sizeof(*s->bitmaps));
+        bm = &s->bitmaps[s->nb_bitmaps++];
+        bm->name = g_strndup((const char *)data + offset + sizeof(h),
+                             name_size);
+        bm->data_offset = data_offset;
+        bm->data_size = be64_to_cpu(h.data_size);
+        bm->flags = be32_to_cpu(h.flags);
+        bm->granularity_bits = h.granularity_bits;
+
+        offset += entry_size;
+    }
+
+    return 0;
+
+invalid:
+    error_report("Invalid dirty bitmaps header extension");
+    qcow2_free_bitmaps(bs);
+    return -EINVAL;
+}
+
+size_t qcow2_bitmap_ext_size(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    size_t size = 0;
+    int i;
+
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        size += bitmap_entry_size(strlen(s->bitmaps[i].name));
+    }
+    return size;
+}
+
+/* Fill buf, which is qcow2_bitmap_ext_size() bytes large */
+void qcow2_build_bitmap_ext(BlockDriverState *bs, uint8_t *buf)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2BitmapHeader h;
+    Qcow2Bitmap *bm;
+    size_t name_size;
+    int i;
+
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        bm = &s->bitmaps[i];
+        name_size = strlen(bm->name);
+
+        memset(&h, 0, sizeof(h));
+        h.data_offset = cpu_to_be64(bm->data_offset);
+        h.data_size = cpu_to_be64(bm->data_size);
+        h.flags = cpu_to_be32(bm->flags);
+        h.granularity_bits = bm->granularity_bits;
+        h.name_size = cpu_to_be16(name_size);
+
+        memset(buf, 0, bitmap_entry_size(name_size));
+        memcpy(buf, &h, sizeof(h));
+        memcpy(buf + sizeof(h), bm->name, name_size);
+        buf += bitmap_entry_size(name_size);
+    }
+}
+
+static int load_bitmap(BlockDriverState *bs, Qcow2Bitmap *bm)
+{
+    BdrvDirtyBitmap *bitmap;
+    int sector_bits = bm->granularity_bits - BDRV_SECTOR_BITS;
+    uint8_t *data;
+    uint64_t i, sector;
+    int ret;
+
+    data = g_malloc(bm->data_size);
+    ret = bdrv_pread(bs->file, bm->data_offset, data, bm->data_size);
+    if (ret < 0) {
+        g_free(data);
+        return ret;
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, bm->name, 1 << bm->granularity_bits);
+    bitmap->persistent = true;
+
+    for (i = 0; i < bm->data_size * 8; i++) {
+        if (!(data[i / 8] & (1 << (i % 8)))) {
+            continue;
+        }
+        sector = i << sector_bits;
+        if (sector >= bs->total_sectors) {
+            break;
+        }
+        hbitmap_set(bitmap->bitmap, sector,
+                    MIN(1ULL << sector_bits, bs->total_sectors - sector));
+    }
+
+    g_free(data);
+    return 0;
+}
+
+/*
+ * Create the named dirty bitmaps listed in the header extension.  Bitmaps
+ * that were in use when the image was last closed are stale and dropped.
+ * Unless @read_only, the remaining ones are marked as in use until
+ * qcow2_store_dirty_bitmaps() writes the up to date data.  This is also
+ * used when a read-only image becomes writable.
+ *
+ * Returns 0 on success, -errno in error cases.
+ */
+int qcow2_load_dirty_bitmaps(BlockDriverState *bs, bool read_only)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2Bitmap *bm;
+    Qcow2Bitmap *stale = NULL;
+    int nb_stale = 0;
+    bool changed = false;
+    int i, ret = 0;
+
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        bm = &s->bitmaps[i];
+
+        if (bm->flags & QCOW2_BITMAP_IN_USE) {
+            error_report("Dirty bitmap '%s' was not saved properly, "
+                         "dropping it", bm->name);
+        } else if (bm->data_size !=
+                   bitmap_data_size(bs, bm->granularity_bits)) {
+            error_report("Dirty bitmap '%s' does not match the image size, "
+                         "dropping it", bm->name);
+        } else {
+            /* A bitmap that is still in memory, e.g. across
+             * qcow2_invalidate_cache(), is more recent than the image */
+            if (!bdrv_find_dirty_bitmap(bs, bm->name)) {
+                ret = load_bitmap(bs, bm);
+                if (ret < 0) {
+                    goto out;
+                }
+            }
+            if (!read_only) {
+                bm->flags |= QCOW2_BITMAP_IN_USE;
+                changed = true;
+            }
+            continue;
+        }
+
+        if (read_only) {
+            continue;
+        }
+
+        /* Remove the entry from the directory.  The clusters of bitmaps that
+         * were in use are still allocated and can be freed once the header
+         * no longer points to them; anything else is left for qemu-img check.
+         */
+        if (bm->flags & QCOW2_BITMAP_IN_USE) {
+            stale = g_realloc(stale, (nb_stale + 1) * sizeof(*stale));
+            stale[nb_stale++] = *bm;
+        } else {
+            g_free(bm->name);
+        }
+        memmove(bm, bm + 1, (s->nb_bitmaps - i - 1) * sizeof(*bm));
+        s->nb_bitmaps--;
+        i--;
+        changed = true;
+    }
+
+    if (changed) {
+        ret = qcow2_update_header(bs);
+        if (ret < 0) {
+            goto out;
+        }
+        ret = bdrv_flush(bs->file);
+        if (ret < 0) {
+            goto out;
+        }
+        for (i = 0; i < nb_stale; i++) {
+            qcow2_free_clusters(bs, stale[i].data_offset, stale[i].data_size);
+        }
+    }
+
+out:
+    for (i = 0; i < nb_stale; i++) {
+        g_free(stale[i].name);
+    }
+    g_free(stale);
+    return ret;
+}
+
+/* Allocate clusters for a bitmap and write its data */
+static int store_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                        Qcow2Bitmap *bm)
+{
+    int sector_bits = hbitmap_granularity(bitmap->bitmap);
+    HBitmapIter hbi;
+    uint8_t *data;
+    int64_t sector, offset;
+    uint64_t granule;
+    int ret;
+
+    bm->name = g_strdup(bitmap->name);
+    bm->granularity_bits = sector_bits + BDRV_SECTOR_BITS;
+    bm->data_size = bitmap_data_size(bs, bm->granularity_bits);
+    bm->data_offset = 0;
+    bm->flags = 0;
+
+    if (bm->data_size == 0) {
+        return 0;
+    }
+
+    data = g_malloc0(bm->data_size);
+    hbitmap_iter_init(&hbi, bitmap->bitmap, 0);
+    while ((sector = hbitmap_iter_next(&hbi)) >= 0) {
+        granule = sector >> sector_bits;
+        data[granule / 8] |= 1 << (granule % 8);
+    }
+
+    offset = qcow2_alloc_clusters(bs, bm->data_size);
+    if (offset < 0) {
+        ret = offset;
+        goto out;
+    }
+    bm->data_offset = offset;
+
+    ret = bdrv_pwrite(bs->file, offset, data, bm->data_size);
+
+out:
+    g_free(data);
+    return ret;
+}
+
+/*
+ * Write all persistent bitmaps to the image and update the header extension
+ * to point to them.  The new data is stable on disk before the header
+ * switches over, and old clusters are only freed afterwards.
+ *
+ * Returns 0 on success, -errno in error cases.
+ */
+int qcow2_store_dirty_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+    Qcow2Bitmap *old_bitmaps = s->bitmaps;
+    int old_nb_bitmaps = s->nb_bitmaps;
+    uint64_t old_autoclear = s->autoclear_features;
+    Qcow2Bitmap *bitmaps;
+    int nb_bitmaps = 0;
+    int i, ret;
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        if (bitmap->persistent) {
+            nb_bitmaps++;
+        }
+    }
+    if (nb_bitmaps == 0 && old_nb_bitmaps == 0) {
+        return 0;
+    }
+
+    bitmaps = g_new0(Qcow2Bitmap, nb_bitmaps);
+    i = 0;
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        if (!bitmap->persistent) {
+            continue;
+        }
+        ret = store_bitmap(bs, bitmap, &bitmaps[i++]);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    /* The data and its refcounts must be stable before the header */
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        goto fail;
+    }
+    ret = bdrv_flush(bs->file);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    s->bitmaps = bitmaps;
+    s->nb_bitmaps = nb_bitmaps;
+    if (nb_bitmaps) {
+        s->autoclear_features |= QCOW2_AUTOCLEAR_BITMAPS;
+    } else {
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_BITMAPS;
+    }
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->bitmaps = old_bitmaps;
+        s->nb_bitmaps = old_nb_bitmaps;
+        s->autoclear_features = old_autoclear;
+        goto fail;
+    }
+
+    for (i = 0; i < old_nb_bitmaps; i++) {
+        qcow2_free_clusters(bs, old_bitmaps[i].data_offset,
+                            old_bitmaps[i].data_size);
+        g_free(old_bitmaps[i].name);
+    }
+    g_free(old_bitmaps);
+    return 0;
+
+fail:
+    for (i = 0; i < nb_bitmaps; i++) {
+        if (bitmaps[i].data_offset) {
+            qcow2_free_clusters(bs, bitmaps[i].data_offset,
+                                bitmaps[i].data_size);
+        }
+        g_free(bitmaps[i].name);
+    }
+    g_free(bitmaps);
+    error_report("Could not save dirty bitmaps: %s", strerror(-ret));
+    return ret;
+}
@@ -28,32 +28,104 @@
 #include "trace.h"
 
 typedef struct Qcow2CachedTable {
-    void*   table;
     int64_t offset;
     bool    dirty;
-    int     cache_hits;
     int     ref;
+    int     hash_next;  /* next entry in the same bucket, or -1 */
+    QTAILQ_ENTRY(Qcow2CachedTable) lru; /* only while unreferenced */
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
     Qcow2CachedTable*       entries;
+    uint8_t*                tables;
+    int                     table_size;
+    int*                    buckets;
+    int                     nb_buckets;
+    QTAILQ_HEAD(, Qcow2CachedTable) lru;
     struct Qcow2Cache*      depends;
     int                     size;
     bool                    depends_on_flush;
 };
 
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
+static inline void *qcow2_cache_table(Qcow2Cache *c, int i)
+{
+    return c->tables + (size_t)i * c->table_size;
+}
+
+static int qcow2_cache_table_index(Qcow2Cache *c, void *table)
+{
+    ptrdiff_t diff = (uint8_t *)table - c->tables;
+
+    if (diff < 0 || diff >= (ptrdiff_t)c->size * c->table_size) {
+        return -1;
+    }
+    assert(diff % c->table_size == 0);
+    return diff / c->table_size;
+}
+
+static inline int qcow2_cache_bucket(Qcow2Cache *c, uint64_t offset)
+{
+    return ((offset / c->table_size) * 0x9e3779b97f4a7c15ULL >> 32) &
+           (c->nb_buckets - 1);
+}
+
+static int qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i;
+
+    for (i = c->buckets[qcow2_cache_bucket(c, offset)]; i >= 0;
+         i = c->entries[i].hash_next) {
+        if (c->entries[i].offset == offset) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void qcow2_cache_hash_insert(Qcow2Cache *c, int i)
+{
+    int b = qcow2_cache_bucket(c, c->entries[i].offset);
+
+    c->entries[i].hash_next = c->buckets[b];
+    c->buckets[b] = i;
+}
+
+static void qcow2_cache_hash_remove(Qcow2Cache *c, int i)
+{
+    int *p = &c->buckets[qcow2_cache_bucket(c, c->entries[i].offset)];
+
+    while (*p != i) {
+        assert(*p >= 0);
+        p = &c->entries[*p].hash_next;
+    }
+    *p = c->entries[i].hash_next;
+}
+
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+    int table_size)
 {
-    BDRVQcowState *s = bs->opaque;
     Qcow2Cache *c;
     int i;
 
     c = g_malloc0(sizeof(*c));
     c->size = num_tables;
+    c->table_size = table_size;
     c->entries = g_malloc0(sizeof(*c->entries) * num_tables);
+    c->tables = qemu_blockalign(bs, (size_t)num_tables * table_size);
 
+    c->nb_buckets = 1;
+    while (c->nb_buckets < num_tables) {
+        c->nb_buckets <<= 1;
+    }
+    c->buckets = g_malloc(sizeof(*c->buckets) * c->nb_buckets);
+    for (i = 0; i < c->nb_buckets; i++) {
+        c->buckets[i] = -1;
+    }
+
+    QTAILQ_INIT(&c->lru);
     for (i = 0; i < c->size; i++) {
-        c->entries[i].table = qemu_blockalign(bs, s->cluster_size);
+        c->entries[i].hash_next = -1;
+        QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru);
     }
 
     return c;
@@ -65,9 +137,10 @@ int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        qemu_vfree(c->entries[i].table);
     }
 
+    qemu_vfree(c->tables);
+    g_free(c->buckets);
     g_free(c->entries);
     g_free(c);
 
@@ -120,8 +193,8 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
         BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
     }
 
-    ret = bdrv_pwrite(bs->file, c->entries[i].offset, c->entries[i].table,
-        s->cluster_size);
+    ret = bdrv_pwrite(bs->file, c->entries[i].offset,
+        qcow2_cache_table(c, i), c->table_size);
     if (ret < 0) {
         return ret;
     }
@@ -185,40 +258,11 @@ void qcow2_cache_depends_on_flush(Qcow2Cache *c)
     c->depends_on_flush = true;
 }
 
-static int qcow2_cache_find_entry_to_replace(Qcow2Cache *c)
-{
-    int i;
-    int min_count = INT_MAX;
-    int min_index = -1;
-
-
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].ref) {
-            continue;
-        }
-
-        if (c->entries[i].cache_hits < min_count) {
-            min_index = i;
-            min_count = c->entries[i].cache_hits;
-        }
-
-        /* Give newer hits priority */
-        /* TODO Check how to optimize the replacement strategy */
-        c->entries[i].cache_hits /= 2;
-    }
-
-    if (min_index == -1) {
-        /* This can't happen in current synchronous code, but leave the check
-         * here as a reminder for whoever starts using AIO with the cache */
-        abort();
-    }
-    return min_index;
-}
-
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     uint64_t offset, void **table, bool read_from_disk)
 {
     BDRVQcowState *s = bs->opaque;
+    Qcow2CachedTable *e;
     int i;
     int ret;
 
@@ -226,19 +270,21 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
                           offset, read_from_disk);
 
     /* Check if the table is already cached */
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            goto found;
-        }
+    i = qcow2_cache_lookup(c, offset);
+    if (i >= 0) {
+        goto found;
     }
 
-    /* If not, write a table back and replace it */
-    i = qcow2_cache_find_entry_to_replace(c);
+    /* If not, write back the least recently used table and replace it */
+    e = QTAILQ_FIRST(&c->lru);
+    if (e == NULL) {
+        /* This can't happen in current synchronous code, but leave the check
+         * here as a reminder for whoever starts using AIO with the cache */
+        abort();
+    }
+    i = e - c->entries;
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
-    if (i < 0) {
-        return i;
-    }
 
     ret = qcow2_cache_entry_flush(bs, c, i);
     if (ret < 0) {
@@ -247,28 +293,31 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    if (c->entries[i].offset) {
+        qcow2_cache_hash_remove(c, i);
+        c->entries[i].offset = 0;
+    }
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
         }
 
-        ret = bdrv_pread(bs->file, offset, c->entries[i].table, s->cluster_size);
+        ret = bdrv_pread(bs->file, offset, qcow2_cache_table(c, i),
+                         c->table_size);
         if (ret < 0) {
             return ret;
         }
     }
 
-    /* Give the table some hits for the start so that it won't be replaced
-     * immediately. The number 32 is completely arbitrary. */
-    c->entries[i].cache_hits = 32;
     c->entries[i].offset = offset;
+    qcow2_cache_hash_insert(c, i);
 
     /* And return the right table */
 found:
-    c->entries[i].cache_hits++;
-    c->entries[i].ref++;
-    *table = c->entries[i].table;
+    if (c->entries[i].ref++ == 0) {
+        QTAILQ_REMOVE(&c->lru, &c->entries[i], lru);
+    }
+    *table = qcow2_cache_table(c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
@@ -290,34 +339,27 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 {
-    int i;
+    int i = qcow2_cache_table_index(c, *table);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == *table) {
-            goto found;
-        }
+    if (i < 0) {
+        return -ENOENT;
     }
-    return -ENOENT;
 
-found:
-    c->entries[i].ref--;
+    assert(c->entries[i].ref > 0);
+    if (--c->entries[i].ref == 0) {
+        QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru);
+    }
     *table = NULL;
 
-    assert(c->entries[i].ref >= 0);
     return 0;
 }
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 {
-    int i;
+    int i = qcow2_cache_table_index(c, table);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == table) {
-            goto found;
-        }
+    if (i < 0) {
+        abort();
     }
-    abort();
-
-found:
     c->entries[i].dirty = true;
 }
@@ -27,6 +27,7 @@
 #include "qemu-common.h"
 #include "block_int.h"
 #include "block/qcow2.h"
+#include "thread-pool.h"
 #include "trace.h"
 
 int qcow2_grow_l1_table(BlockDriverState *bs, int min_size, bool exact_size)
@@ -113,13 +114,27 @@ int qcow2_grow_l1_table(BlockDriverState *bs, int min_size, bool exact_size)
  * the image file failed.
  */
 
-static int l2_load(BlockDriverState *bs, uint64_t l2_offset,
-    uint64_t **l2_table)
+/*
+ * Returns the offset in the image file of the L2 slice that contains the
+ * entry for the given guest offset.
+ */
+static uint64_t l2_slice_offset(BDRVQcowState *s, uint64_t l2_offset,
+    uint64_t offset)
+{
+    int l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
+
+    return l2_offset +
+        (l2_index & ~(s->l2_slice_size - 1)) * l2_entry_size(s);
+}
+
+static int l2_load(BlockDriverState *bs, uint64_t offset,
+    uint64_t l2_offset, uint64_t **l2_table)
 {
     BDRVQcowState *s = bs->opaque;
     int ret;
 
-    ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset, (void**) l2_table);
+    ret = qcow2_cache_get(bs, s->l2_table_cache,
+        l2_slice_offset(s, l2_offset, offset), (void**) l2_table);
 
     return ret;
 }
@@ -151,6 +166,74 @@ static int write_l1_entry(BlockDriverState *bs, int l1_index)
     return 0;
 }
 
+/*
+ * l2_allocate_empty
+ *
+ * Write a zeroed L2 table at l2_offset and point the L1 entry to it. The
+ * table is written without holding s->lock, so that requests using other
+ * L2 tables can go on meanwhile; requests for the same L1 entry wait in
+ * get_cluster_table until the L1 entry has been updated.
+ *
+ * The slice containing the entry for offset is returned in *table.
+ */
+static int coroutine_fn l2_allocate_empty(BlockDriverState *bs, int l1_index,
+    int64_t l2_offset, uint64_t offset, uint64_t **table)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t old_l2_offset = s->l1_table[l1_index];
+    QCowL2Alloc alloc = {
+        .l1_index = l1_index,
+    };
+    void *buf;
+    int ret;
+
+    qemu_co_queue_init(&alloc.dependent_requests);
+    QLIST_INSERT_HEAD(&s->l2_allocs, &alloc, next_in_flight);
+
+    buf = qemu_blockalign(bs, s->cluster_size);
+    memset(buf, 0, s->cluster_size);
+
+    BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_WRITE);
+    trace_qcow2_l2_allocate_write_l2(bs, l1_index);
+    qemu_co_mutex_unlock(&s->lock);
+    ret = bdrv_pwrite(bs->file, l2_offset, buf, s->cluster_size);
+    qemu_co_mutex_lock(&s->lock);
+    qemu_vfree(buf);
+    if (ret < 0) {
+        goto out;
+    }
+
+    /* The caller has flushed the refcount already; the new table must be
+     * stable as well before the L1 entry points to it. */
+    ret = bdrv_flush(bs->file);
+    if (ret < 0) {
+        goto out;
+    }
+
+    trace_qcow2_l2_allocate_write_l1(bs, l1_index);
+    s->l1_table[l1_index] = l2_offset | QCOW_OFLAG_COPIED;
+    ret = write_l1_entry(bs, l1_index);
+    if (ret < 0) {
+        s->l1_table[l1_index] = old_l2_offset;
+        goto out;
+    }
+
+    /* The table on disk is zeroed, so the cache entry is clean */
+    ret = qcow2_cache_get_empty(bs, s->l2_table_cache,
+                                l2_slice_offset(s, l2_offset, offset),
+                                (void**) table);
+    if (ret < 0) {
+        goto out;
+    }
+    memset(*table, 0, s->l2_slice_size * l2_entry_size(s));
+
+out:
+    trace_qcow2_l2_allocate_done(bs, l1_index, ret);
+    QLIST_REMOVE(&alloc, next_in_flight);
+    qemu_co_queue_restart_all(&alloc.dependent_requests);
+    return ret;
+}
+
 /*
  * l2_allocate
  *
@@ -159,15 +242,19 @@ static int write_l1_entry(BlockDriverState *bs, int l1_index)
  * table) copy the contents of the old L2 table into the newly allocated one.
  * Otherwise the new table is initialized with zeros.
  *
+ * The slice of the new table that contains the entry for offset is returned
+ * in *table.
  */
 
-static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
+static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t offset,
+    uint64_t **table)
 {
     BDRVQcowState *s = bs->opaque;
     uint64_t old_l2_offset;
-    uint64_t *l2_table;
+    uint64_t *l2_table = NULL;
     int64_t l2_offset;
-    int ret;
+    int slice_bytes = s->l2_slice_size * l2_entry_size(s);
+    int i, ret;
 
     old_l2_offset = s->l1_table[l1_index];
 
@@ -175,44 +262,58 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 
     /* allocate a new l2 entry */
 
-    l2_offset = qcow2_alloc_clusters(bs, s->l2_size * sizeof(uint64_t));
+    l2_offset = qcow2_alloc_clusters(bs, s->cluster_size);
     if (l2_offset < 0) {
         return l2_offset;
     }
 
-    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
-    if (ret < 0) {
-        goto fail;
+    if (qcow2_need_accurate_refcounts(s)) {
+        ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+        if (ret < 0) {
+            goto fail;
+        }
     }
 
-    /* allocate a new entry in the l2 cache */
-
-    trace_qcow2_l2_allocate_get_empty(bs, l1_index);
-    ret = qcow2_cache_get_empty(bs, s->l2_table_cache, l2_offset, (void**) table);
-    if (ret < 0) {
-        return ret;
+    /* Coroutine callers hold s->lock, which is dropped for the table write */
+    if ((old_l2_offset & L1E_OFFSET_MASK) == 0 && qemu_in_coroutine()) {
+        return l2_allocate_empty(bs, l1_index, l2_offset, offset, table);
     }
 
-    l2_table = *table;
-
-    if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
-        /* if there was no old l2 table, clear the new table */
-        memset(l2_table, 0, s->l2_size * sizeof(uint64_t));
-    } else {
-        uint64_t* old_table;
+    /* fill the new table in the l2 cache, one slice at a time */
 
-        /* if there was an old l2 table, read it from the disk */
-        BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_COW_READ);
-        ret = qcow2_cache_get(bs, s->l2_table_cache,
-            old_l2_offset & L1E_OFFSET_MASK,
-            (void**) &old_table);
+    trace_qcow2_l2_allocate_get_empty(bs, l1_index);
+    for (i = 0; i < s->l2_size; i += s->l2_slice_size) {
+        ret = qcow2_cache_get_empty(bs, s->l2_table_cache,
+            l2_offset + i * l2_entry_size(s), (void**) &l2_table);
         if (ret < 0) {
             goto fail;
         }
 
-        memcpy(l2_table, old_table, s->cluster_size);
+        if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
+            /* if there was no old l2 table, clear the new table */
+            memset(l2_table, 0, slice_bytes);
+        } else {
+            uint64_t* old_table;
+
+            /* if there was an old l2 table, read it from the disk */
+            BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_COW_READ);
+            ret = qcow2_cache_get(bs, s->l2_table_cache,
+                (old_l2_offset & L1E_OFFSET_MASK) + i * l2_entry_size(s),
+                (void**) &old_table);
+            if (ret < 0) {
+                goto fail;
+            }
+
+            memcpy(l2_table, old_table, slice_bytes);
+
+            ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &old_table);
+            if (ret < 0) {
+                goto fail;
+            }
+        }
 
-        ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &old_table);
+        qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
+        ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
         if (ret < 0) {
             goto fail;
         }
@@ -222,7 +323,6 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
     BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_WRITE);
 
     trace_qcow2_l2_allocate_write_l2(bs, l1_index);
-    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret < 0) {
         goto fail;
@@ -236,13 +336,19 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
         goto fail;
     }
 
-    *table = l2_table;
+    ret = l2_load(bs, offset, l2_offset, table);
+    if (ret < 0) {
+        return ret;
+    }
+
     trace_qcow2_l2_allocate_done(bs, l1_index, 0);
     return 0;
 
 fail:
     trace_qcow2_l2_allocate_done(bs, l1_index, ret);
-    qcow2_cache_put(bs, s->l2_table_cache, (void**) table);
+    if (l2_table) {
+        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+    }
     s->l1_table[l1_index] = old_l2_offset;
     return ret;
 }
@@ -254,32 +360,34 @@ fail:
  * as contiguous. (This allows it, for example, to stop at the first compressed
  * cluster which may require a different handling)
  */
-static int count_contiguous_clusters(uint64_t nb_clusters, int cluster_size,
-        uint64_t *l2_table, uint64_t start, uint64_t stop_flags)
+static int count_contiguous_clusters(BDRVQcowState *s, uint64_t nb_clusters,
+        uint64_t *l2_table, int l2_index, uint64_t stop_flags)
 {
     int i;
     uint64_t mask = stop_flags | L2E_OFFSET_MASK;
-    uint64_t offset = be64_to_cpu(l2_table[0]) & mask;
+    uint64_t offset = get_l2_entry(s, l2_table, l2_index) & mask;
 
     if (!offset)
         return 0;
 
-    for (i = start; i < start + nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_table[i]) & mask;
-        if (offset + (uint64_t) i * cluster_size != l2_entry) {
+    for (i = 0; i < nb_clusters; i++) {
+        uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index + i) & mask;
+        if (offset + (uint64_t) i * s->cluster_size != l2_entry) {
             break;
         }
     }
 
-	return (i - start);
+	return i;
 }
 
-static int count_contiguous_free_clusters(uint64_t nb_clusters, uint64_t *l2_table)
+static int count_contiguous_free_clusters(BDRVQcowState *s,
+    uint64_t nb_clusters, uint64_t *l2_table, int l2_index)
 {
     int i;
 
     for (i = 0; i < nb_clusters; i++) {
-        int type = qcow2_get_cluster_type(be64_to_cpu(l2_table[i]));
+        int type = qcow2_get_cluster_type(get_l2_entry(s, l2_table,
+                                                       l2_index + i));
 
         if (type != QCOW2_CLUSTER_UNALLOCATED) {
             break;
@@ -289,6 +397,90 @@ static int count_contiguous_free_clusters(uint64_t nb_clusters, uint64_t *l2_tab
     return i;
 }
 
+/*
+ * Returns the bitmap of the subclusters of the nth cluster of a request that
+ * contain sectors in [start, end). Both start and end are given in sectors
+ * from the start of the first cluster of the request.
+ */
+static uint64_t subcluster_mask(BDRVQcowState *s, int n, int start, int end)
+{
+    int sc_shift = s->subcluster_bits - BDRV_SECTOR_BITS;
+    int first, last;
+
+    start = MAX(start - n * s->cluster_sectors, 0);
+    end = MIN(end - n * s->cluster_sectors, s->cluster_sectors);
+    if (end <= start) {
+        return 0;
+    }
+
+    first = start >> sc_shift;
+    last = (end + s->subcluster_sectors - 1) >> sc_shift;
+
+    return ((1ULL << last) - 1) & ~((1ULL << first) - 1);
+}
+
+/*
+ * With extended L2 entries, normal and unallocated clusters consist of
+ * subclusters that are allocated, read as zeros or are unallocated.
+ *
+ * Returns the type of the subcluster that contains sector index_in_cluster
+ * of the cluster at l2_index, and stores in *nb_sectors the number of sectors
+ * from the start of that cluster up to the first subcluster of a different
+ * type. Allocated subclusters only count as the same type if they are
+ * contiguous in the image file. At most nb_clusters clusters are looked at.
+ */
+static int get_subcluster_range(BDRVQcowState *s, uint64_t *l2_table,
+    int l2_index, int nb_clusters, int index_in_cluster, uint64_t *nb_sectors)
+{
+    uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index);
+    uint64_t l2_bitmap = get_l2_bitmap(s, l2_table, l2_index);
+    uint64_t host_offset = l2_entry & L2E_OFFSET_MASK;
+    int sc = index_in_cluster >> (s->subcluster_bits - BDRV_SECTOR_BITS);
+    int type, i;
+
+    type = qcow2_get_subcluster_type(l2_bitmap, sc);
+    if (type == QCOW2_CLUSTER_NORMAL && host_offset == 0) {
+        return -EIO;
+    }
+
+    for (sc++; sc < QCOW_EXTL2_SUBCLUSTERS; sc++) {
+        if (qcow2_get_subcluster_type(l2_bitmap, sc) != type) {
+            *nb_sectors = sc * s->subcluster_sectors;
+            return type;
+        }
+    }
+
+    /* Continue with clusters that have the same type as a whole */
+    for (i = 1; i < nb_clusters; i++) {
+        l2_entry = get_l2_entry(s, l2_table, l2_index + i);
+        l2_bitmap = get_l2_bitmap(s, l2_table, l2_index + i);
+
+        if (l2_entry & QCOW_OFLAG_COMPRESSED) {
+            break;
+        }
+
+        if (type == QCOW2_CLUSTER_NORMAL) {
+            if ((l2_entry & L2E_OFFSET_MASK) !=
+                host_offset + (uint64_t) i * s->cluster_size ||
+                (l2_bitmap & QCOW_L2_BITMAP_ALL_ALLOC) !=
+                QCOW_L2_BITMAP_ALL_ALLOC) {
+                break;
+            }
+        } else if (type == QCOW2_CLUSTER_ZERO) {
+            if ((l2_bitmap & QCOW_L2_BITMAP_ALL_ZERO) !=
+                QCOW_L2_BITMAP_ALL_ZERO ||
+                (l2_bitmap & QCOW_L2_BITMAP_ALL_ALLOC)) {
+                break;
+            }
+        } else if (l2_bitmap) {
+            break;
+        }
+    }
+
+    *nb_sectors = (uint64_t) i * s->cluster_sectors;
+    return type;
+}
+
 /* The crypt function is compatible with the linux cryptoloop
    algorithm for < 4 GB images. NOTE: out_buf == in_buf is
    supported */
@@ -314,6 +506,94 @@ void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
     }
 }
 
+/* Requests at least this large are split across the thread pool */
+#define QCOW2_CRYPT_PARALLEL_SECTORS 256
+#define QCOW2_CRYPT_MAX_JOBS         4
+
+typedef struct Qcow2CryptRequest Qcow2CryptRequest;
+
+typedef struct Qcow2CryptJob {
+    Qcow2CryptRequest *req;
+    int64_t sector_num;
+    uint8_t *buf;
+    int nb_sectors;
+} Qcow2CryptJob;
+
+struct Qcow2CryptRequest {
+    BDRVQcowState *s;
+    Coroutine *co;
+    int enc;
+    const AES_KEY *key;
+    int pending;
+    Qcow2CryptJob jobs[QCOW2_CRYPT_MAX_JOBS];
+};
+
+static int qcow2_crypt_worker(void *opaque)
+{
+    Qcow2CryptJob *job = opaque;
+    Qcow2CryptRequest *req = job->req;
+
+    qcow2_encrypt_sectors(req->s, job->sector_num, job->buf, job->buf,
+                          job->nb_sectors, req->enc, req->key);
+    return 0;
+}
+
+static void qcow2_crypt_done(void *opaque, int ret)
+{
+    Qcow2CryptJob *job = opaque;
+    Qcow2CryptRequest *req = job->req;
+
+    if (--req->pending == 0) {
+        qemu_coroutine_enter(req->co, NULL);
+    }
+}
+
+/* Encrypt or decrypt buf in place.  The caller need not hold s->lock, the
+ * keys do not change while requests are in flight.  Large buffers are
+ * split by sector ranges, each of which has its own IVs, and all but the
+ * first range are handed to the thread pool.  */
+void coroutine_fn qcow2_co_encrypt_sectors(BlockDriverState *bs,
+                                           int64_t sector_num, uint8_t *buf,
+                                           int nb_sectors, int enc,
+                                           const AES_KEY *key)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CryptRequest req = {
+        .s      = s,
+        .co     = qemu_coroutine_self(),
+        .enc    = enc,
+        .key    = key,
+    };
+    ThreadPool *pool;
+    int chunk, i;
+
+    if (nb_sectors < QCOW2_CRYPT_PARALLEL_SECTORS) {
+        qcow2_encrypt_sectors(s, sector_num, buf, buf, nb_sectors, enc, key);
+        return;
+    }
+
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    chunk = DIV_ROUND_UP(nb_sectors, QCOW2_CRYPT_MAX_JOBS);
+    for (i = 1; i < QCOW2_CRYPT_MAX_JOBS && i * chunk < nb_sectors; i++) {
+        Qcow2CryptJob *job = &req.jobs[i];
+
+        job->req = &req;
+        job->sector_num = sector_num + i * chunk;
+        job->buf = buf + i * chunk * 512;
+        job->nb_sectors = MIN(chunk, nb_sectors - i * chunk);
+        req.pending++;
+        thread_pool_submit_aio(pool, qcow2_crypt_worker, job,
+                               qcow2_crypt_done, job);
+    }
+
+    qcow2_encrypt_sectors(s, sector_num, buf, buf, chunk, enc, key);
+
+    /* Completions run from the main loop, so none can have happened yet */
+    if (req.pending) {
+        qemu_coroutine_yield();
+    }
+}
+
 static int coroutine_fn copy_sectors(BlockDriverState *bs,
                                      uint64_t start_sect,
                                      uint64_t cluster_offset,
@@ -355,9 +635,8 @@ static int coroutine_fn copy_sectors(BlockDriverState *bs,
     }
 
     if (s->crypt_method) {
-        qcow2_encrypt_sectors(s, start_sect + n_start,
-                        iov.iov_base, iov.iov_base, n, 1,
-                        &s->aes_encrypt_key);
+        qcow2_co_encrypt_sectors(bs, start_sect + n_start,
+                                 iov.iov_base, n, 1, &s->aes_encrypt_key);
     }
 
     BLKDBG_EVENT(bs->file, BLKDBG_COW_WRITE);
@@ -393,7 +672,7 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     BDRVQcowState *s = bs->opaque;
     unsigned int l1_index, l2_index;
     uint64_t l2_offset, *l2_table;
-    int l1_bits, c;
+    int l1_bits, slice_bits, c;
     unsigned int index_in_cluster, nb_clusters;
     uint64_t nb_available, nb_needed;
     int ret;
@@ -402,12 +681,14 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     nb_needed = *num + index_in_cluster;
 
     l1_bits = s->l2_bits + s->cluster_bits;
+    slice_bits = s->l2_slice_bits + s->cluster_bits;
 
     /* compute how many bytes there are between the offset and
-     * the end of the l1 entry
+     * the end of the l2 slice
      */
 
-    nb_available = (1ULL << l1_bits) - (offset & ((1ULL << l1_bits) - 1));
+    nb_available = (1ULL << slice_bits) -
+                   (offset & ((1ULL << slice_bits) - 1));
 
     /* compute the number of available sectors */
 
@@ -433,20 +714,35 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
         goto out;
     }
 
-    /* load the l2 table in memory */
+    /* load the l2 slice in memory */
 
-    ret = l2_load(bs, l2_offset, &l2_table);
+    ret = l2_load(bs, offset, l2_offset, &l2_table);
     if (ret < 0) {
         return ret;
     }
 
     /* find the cluster offset for the given disk offset */
 
-    l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
-    *cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    l2_index = offset_to_l2_slice_index(s, offset);
+    *cluster_offset = get_l2_entry(s, l2_table, l2_index);
     nb_clusters = size_to_clusters(s, nb_needed << 9);
 
     ret = qcow2_get_cluster_type(*cluster_offset);
+    if (s->extended_l2 && ret != QCOW2_CLUSTER_COMPRESSED) {
+        ret = get_subcluster_range(s, l2_table, l2_index, nb_clusters,
+                                   index_in_cluster, &nb_available);
+        if (ret == QCOW2_CLUSTER_NORMAL) {
+            *cluster_offset &= L2E_OFFSET_MASK;
+        } else {
+            *cluster_offset = 0;
+        }
+        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+        if (ret < 0) {
+            return ret;
+        }
+        goto out;
+    }
+
     switch (ret) {
     case QCOW2_CLUSTER_COMPRESSED:
         /* Compressed clusters can only be processed one by one */
@@ -454,20 +750,19 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
         *cluster_offset &= L2E_COMPRESSED_OFFSET_SIZE_MASK;
         break;
     case QCOW2_CLUSTER_ZERO:
-        c = count_contiguous_clusters(nb_clusters, s->cluster_size,
-                &l2_table[l2_index], 0,
+        c = count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
                 QCOW_OFLAG_COMPRESSED | QCOW_OFLAG_ZERO);
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_UNALLOCATED:
         /* how many empty clusters ? */
-        c = count_contiguous_free_clusters(nb_clusters, &l2_table[l2_index]);
+        c = count_contiguous_free_clusters(s, nb_clusters, l2_table,
+                                           l2_index);
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_NORMAL:
         /* how many allocated clusters ? */
-        c = count_contiguous_clusters(nb_clusters, s->cluster_size,
-                &l2_table[l2_index], 0,
+        c = count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
                 QCOW_OFLAG_COMPRESSED | QCOW_OFLAG_ZERO);
         *cluster_offset &= L2E_OFFSET_MASK;
         break;
@@ -494,8 +789,8 @@ out:
  * for a given disk offset, load (and allocate if needed)
  * the l2 table.
  *
- * the l2 table offset in the qcow2 file and the cluster index
- * in the l2 table are given to the caller.
+ * the slice of the l2 table that covers the offset and the cluster index
+ * in that slice are given to the caller.
  *
  * Returns 0 on success, -errno in failure case
  */
@@ -507,10 +802,12 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
     unsigned int l1_index, l2_index;
     uint64_t l2_offset;
     uint64_t *l2_table = NULL;
+    QCowL2Alloc *alloc;
     int ret;
 
     /* seek the the l2 offset in the l1 table */
 
+again:
     l1_index = offset >> (s->l2_bits + s->cluster_bits);
     if (l1_index >= s->l1_size) {
         ret = qcow2_grow_l1_table(bs, l1_index + 1, false);
@@ -519,32 +816,42 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
         }
     }
 
+    /* Wait if another request is allocating this L2 table right now */
+    QLIST_FOREACH(alloc, &s->l2_allocs, next_in_flight) {
+        if (alloc->l1_index == l1_index) {
+            qemu_co_mutex_unlock(&s->lock);
+            qemu_co_queue_wait(&alloc->dependent_requests);
+            qemu_co_mutex_lock(&s->lock);
+            goto again;
+        }
+    }
+
     l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
 
     /* seek the l2 table of the given l2 offset */
 
     if (s->l1_table[l1_index] & QCOW_OFLAG_COPIED) {
-        /* load the l2 table in memory */
-        ret = l2_load(bs, l2_offset, &l2_table);
+        /* load the l2 slice in memory */
+        ret = l2_load(bs, offset, l2_offset, &l2_table);
         if (ret < 0) {
             return ret;
         }
     } else {
         /* First allocate a new L2 table (and do COW if needed) */
-        ret = l2_allocate(bs, l1_index, &l2_table);
+        ret = l2_allocate(bs, l1_index, offset, &l2_table);
         if (ret < 0) {
             return ret;
         }
 
         /* Then decrease the refcount of the old table */
         if (l2_offset) {
-            qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t));
+            qcow2_free_clusters(bs, l2_offset, s->cluster_size);
         }
     }
 
     /* find the cluster offset for the given disk offset */
 
-    l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
+    l2_index = offset_to_l2_slice_index(s, offset);
 
     *new_l2_table = l2_table;
     *new_l2_index = l2_index;
@@ -582,7 +889,7 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     /* Compression can't overwrite anything. Fail if the cluster was already
      * allocated. */
-    cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_table, l2_index);
     if (cluster_offset & L2E_OFFSET_MASK) {
         qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
         return 0;
@@ -606,7 +913,10 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE_COMPRESSED);
     qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
-    l2_table[l2_index] = cpu_to_be64(cluster_offset);
+    set_l2_entry(s, l2_table, l2_index, cluster_offset);
+    if (s->extended_l2) {
+        set_l2_bitmap(s, l2_table, l2_index, 0);
+    }
     ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
     if (ret < 0) {
         return 0;
@@ -632,20 +942,21 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 
     /* copy content of unmodified sectors */
     start_sect = (m->offset & ~(s->cluster_size - 1)) >> 9;
-    if (m->n_start) {
+    if (m->cow_start < m->n_start) {
         cow = true;
         qemu_co_mutex_unlock(&s->lock);
-        ret = copy_sectors(bs, start_sect, cluster_offset, 0, m->n_start);
+        ret = copy_sectors(bs, start_sect, cluster_offset, m->cow_start,
+                           m->n_start);
         qemu_co_mutex_lock(&s->lock);
         if (ret < 0)
             goto err;
     }
 
-    if (m->nb_available & (s->cluster_sectors - 1)) {
+    if (m->nb_available < m->cow_end) {
         cow = true;
         qemu_co_mutex_unlock(&s->lock);
         ret = copy_sectors(bs, start_sect, cluster_offset, m->nb_available,
-                           align_offset(m->nb_available, s->cluster_sectors));
+                           m->cow_end);
         qemu_co_mutex_lock(&s->lock);
         if (ret < 0)
             goto err;
@@ -679,11 +990,26 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 	 * cluster the second one has to do RMW (which is done above by
 	 * copy_sectors()), update l2 table with its cluster pointer and free
 	 * old cluster. This is what this loop does */
-        if(l2_table[l2_index + i] != 0)
-            old_cluster[j++] = l2_table[l2_index + i];
+        uint64_t old_entry = get_l2_entry(s, l2_table, l2_index + i);
 
-        l2_table[l2_index + i] = cpu_to_be64((cluster_offset +
+        if (old_entry != 0 && !m->keep_old_cluster)
+            old_cluster[j++] = old_entry;
+
+        set_l2_entry(s, l2_table, l2_index + i, (cluster_offset +
                     (i << s->cluster_bits)) | QCOW_OFLAG_COPIED);
+
+        if (s->extended_l2) {
+            uint64_t bitmap = QCOW_L2_BITMAP_ALL_ALLOC;
+
+            /* Subclusters that weren't written keep their old state */
+            if (m->subcluster_cow) {
+                uint64_t mask = subcluster_mask(s, i, m->cow_start,
+                                                m->cow_end);
+                bitmap = get_l2_bitmap(s, l2_table, l2_index + i);
+                bitmap = (bitmap | mask) & ~(mask << 32);
+            }
+            set_l2_bitmap(s, l2_table, l2_index + i, bitmap);
+        }
      }
 
 
@@ -698,7 +1024,7 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
      */
     if (j != 0) {
         for (i = 0; i < j; i++) {
-            qcow2_free_any_clusters(bs, be64_to_cpu(old_cluster[i]), 1);
+            qcow2_free_any_clusters(bs, old_cluster[i], 1);
         }
     }
 
@@ -716,12 +1042,24 @@ err:
 static int count_cow_clusters(BDRVQcowState *s, int nb_clusters,
     uint64_t *l2_table, int l2_index)
 {
+    int first_type = qcow2_get_cluster_type(get_l2_entry(s, l2_table,
+                                                         l2_index));
     int i;
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_table[l2_index + i]);
+        uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index + i);
         int cluster_type = qcow2_get_cluster_type(l2_entry);
 
+        /*
+         * With extended L2 entries, unallocated clusters only copy the
+         * touched subclusters, while all others are copied as a whole.
+         */
+        if (s->extended_l2 &&
+            (cluster_type == QCOW2_CLUSTER_UNALLOCATED) !=
+            (first_type == QCOW2_CLUSTER_UNALLOCATED)) {
+            goto out;
+        }
+
         switch(cluster_type) {
         case QCOW2_CLUSTER_NORMAL:
             if (l2_entry & QCOW_OFLAG_COPIED) {
@@ -743,38 +1081,22 @@ out:
 }
 
 /*
- * Allocates new clusters for the given guest_offset.
- *
- * At most *nb_clusters are allocated, and on return *nb_clusters is updated to
- * contain the number of clusters that have been allocated and are contiguous
- * in the image file.
- *
- * If *host_offset is non-zero, it specifies the offset in the image file at
- * which the new clusters must start. *nb_clusters can be 0 on return in this
- * case if the cluster at host_offset is already in use. If *host_offset is
- * zero, the clusters can be allocated anywhere in the image file.
+ * Check if there already is an AIO write request in flight which allocates
+ * the same cluster. In this case we need to wait until the previous
+ * request has completed and updated the L2 table accordingly.
  *
- * *host_offset is updated to contain the offset into the image file at which
- * the first allocated cluster starts.
+ * If the request only overlaps at its end, *nb_clusters is shortened so
+ * that it stops at the start of the running allocation.
  *
- * Return 0 on success and -errno in error cases. -EAGAIN means that the
- * function has been waiting for another request and the allocation must be
- * restarted, but the whole request should not be failed.
+ * Returns 0 if there was no dependency, and -EAGAIN if the function has been
+ * waiting for another request and the caller must recheck the clusters.
  */
-static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
-    uint64_t *host_offset, unsigned int *nb_clusters)
+static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
+    unsigned int *nb_clusters)
 {
     BDRVQcowState *s = bs->opaque;
     QCowL2Meta *old_alloc;
 
-    trace_qcow2_do_alloc_clusters_offset(qemu_coroutine_self(), guest_offset,
-                                         *host_offset, *nb_clusters);
-
-    /*
-     * Check if there already is an AIO write request in flight which allocates
-     * the same cluster. In this case we need to wait until the previous
-     * request has completed and updated the L2 table accordingly.
-     */
     QLIST_FOREACH(old_alloc, &s->cluster_allocs, next_in_flight) {
 
         uint64_t start = guest_offset >> s->cluster_bits;
@@ -782,7 +1104,7 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
         uint64_t old_start = old_alloc->offset >> s->cluster_bits;
         uint64_t old_end = old_start + old_alloc->nb_clusters;
 
-        if (end < old_start || start > old_end) {
+        if (end <= old_start || start >= old_end) {
             /* No intersection */
         } else {
             if (start < old_start) {
@@ -803,6 +1125,42 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
         }
     }
 
+    return 0;
+}
+
+/*
+ * Allocates new clusters for the given guest_offset.
+ *
+ * At most *nb_clusters are allocated, and on return *nb_clusters is updated to
+ * contain the number of clusters that have been allocated and are contiguous
+ * in the image file.
+ *
+ * If *host_offset is non-zero, it specifies the offset in the image file at
+ * which the new clusters must start. *nb_clusters can be 0 on return in this
+ * case if the cluster at host_offset is already in use. If *host_offset is
+ * zero, the clusters can be allocated anywhere in the image file.
+ *
+ * *host_offset is updated to contain the offset into the image file at which
+ * the first allocated cluster starts.
+ *
+ * Return 0 on success and -errno in error cases. -EAGAIN means that the
+ * function has been waiting for another request and the allocation must be
+ * restarted, but the whole request should not be failed.
+ */
+static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
+    uint64_t *host_offset, unsigned int *nb_clusters)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    trace_qcow2_do_alloc_clusters_offset(qemu_coroutine_self(), guest_offset,
+                                         *host_offset, *nb_clusters);
+
+    ret = handle_dependencies(bs, guest_offset, nb_clusters);
+    if (ret < 0) {
+        return ret;
+    }
+
     if (!*nb_clusters) {
         abort();
     }
@@ -854,6 +1212,8 @@ int qcow2_alloc_cluster_offset(BlockDriverState *bs, uint64_t offset,
     uint64_t *l2_table;
     unsigned int nb_clusters, keep_clusters;
     uint64_t cluster_offset;
+    uint64_t old_bitmap = 0;
+    bool subcluster_cow = false, keep_old_cluster = false;
 
     trace_qcow2_alloc_clusters_offset(qemu_coroutine_self(), offset,
                                       n_start, n_end);
@@ -866,13 +1226,13 @@ again:
     }
 
     /*
-     * Calculate the number of clusters to look for. We stop at L2 table
+     * Calculate the number of clusters to look for. We stop at L2 slice
      * boundaries to keep things simple.
      */
     nb_clusters = MIN(size_to_clusters(s, n_end << BDRV_SECTOR_BITS),
-                      s->l2_size - l2_index);
+                      s->l2_slice_size - l2_index);
 
-    cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_table, l2_index);
 
     /*
      * Check how many clusters are already allocated and don't need COW, and how
@@ -881,12 +1241,22 @@ again:
     if (qcow2_get_cluster_type(cluster_offset) == QCOW2_CLUSTER_NORMAL
         && (cluster_offset & QCOW_OFLAG_COPIED))
     {
+        int i;
+
         /* We keep all QCOW_OFLAG_COPIED clusters */
         keep_clusters =
-            count_contiguous_clusters(nb_clusters, s->cluster_size,
-                                      &l2_table[l2_index], 0,
+            count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
                                       QCOW_OFLAG_COPIED | QCOW_OFLAG_ZERO);
         assert(keep_clusters <= nb_clusters);
+
+        /* ...as long as all subclusters that are written to are allocated */
+        for (i = 0; s->extended_l2 && i < keep_clusters; i++) {
+            uint64_t mask = subcluster_mask(s, i, n_start, n_end);
+            if ((get_l2_bitmap(s, l2_table, l2_index + i) & mask) != mask) {
+                keep_clusters = i;
+            }
+        }
+
         nb_clusters -= keep_clusters;
     } else {
         keep_clusters = 0;
@@ -895,12 +1265,27 @@ again:
 
     if (nb_clusters > 0) {
         /* For the moment, overwrite compressed clusters one by one */
-        uint64_t entry = be64_to_cpu(l2_table[l2_index + keep_clusters]);
+        uint64_t entry = get_l2_entry(s, l2_table, l2_index + keep_clusters);
+        int type = qcow2_get_cluster_type(entry);
+
         if (entry & QCOW_OFLAG_COMPRESSED) {
             nb_clusters = 1;
+        } else if (s->extended_l2 && type == QCOW2_CLUSTER_NORMAL &&
+                   (entry & QCOW_OFLAG_COPIED))
+        {
+            /*
+             * Some of the subclusters that are written to are unallocated.
+             * The cluster is only ours, so write them in place; if there are
+             * kept clusters before, handle it in the next round.
+             */
+            nb_clusters = keep_clusters == 0;
+            keep_old_cluster = subcluster_cow = true;
+            old_bitmap = get_l2_bitmap(s, l2_table, l2_index);
         } else {
             nb_clusters = count_cow_clusters(s, nb_clusters, l2_table,
                                              l2_index + keep_clusters);
+            subcluster_cow = s->extended_l2 &&
+                             type == QCOW2_CLUSTER_UNALLOCATED;
         }
     }
 
@@ -940,8 +1325,13 @@ again:
         }
 
         /* Allocate, if necessary at a given offset in the image file */
-        ret = do_alloc_cluster_offset(bs, alloc_offset, &alloc_cluster_offset,
-                                      &nb_clusters);
+        if (keep_old_cluster) {
+            alloc_cluster_offset = cluster_offset;
+            ret = handle_dependencies(bs, alloc_offset, &nb_clusters);
+        } else {
+            ret = do_alloc_cluster_offset(bs, alloc_offset,
+                                          &alloc_cluster_offset, &nb_clusters);
+        }
         if (ret == -EAGAIN) {
             goto again;
         } else if (ret < 0) {
@@ -961,15 +1351,45 @@ again:
             int requested_sectors = n_end - keep_clusters * s->cluster_sectors;
             int avail_sectors = nb_clusters
                                 << (s->cluster_bits - BDRV_SECTOR_BITS);
+            int alloc_n_start = keep_clusters == 0 ? n_start : 0;
+            int nb_available = MIN(requested_sectors, avail_sectors);
+            int cow_start = 0;
+            int cow_end = align_offset(nb_available, s->cluster_sectors);
+
+            /*
+             * With subcluster COW, only the partially written subclusters at
+             * the start and the end need to be copied. Allocated subclusters
+             * of the old cluster already contain the right data, and must
+             * not be copied because other writes may go there in parallel.
+             */
+            if (subcluster_cow) {
+                int sc_shift = s->subcluster_bits - BDRV_SECTOR_BITS;
+
+                cow_start = alloc_n_start & ~(s->subcluster_sectors - 1);
+                cow_end = align_offset(nb_available, s->subcluster_sectors);
+
+                if (old_bitmap &
+                    QCOW_L2_BITMAP_ALLOC(alloc_n_start >> sc_shift)) {
+                    cow_start = alloc_n_start;
+                }
+                if (old_bitmap &
+                    QCOW_L2_BITMAP_ALLOC((nb_available - 1) >> sc_shift)) {
+                    cow_end = nb_available;
+                }
+            }
 
             *m = (QCowL2Meta) {
                 .cluster_offset = keep_clusters == 0 ?
                                   alloc_cluster_offset : cluster_offset,
                 .alloc_offset   = alloc_cluster_offset,
                 .offset         = alloc_offset,
-                .n_start        = keep_clusters == 0 ? n_start : 0,
+                .n_start        = alloc_n_start,
                 .nb_clusters    = nb_clusters,
-                .nb_available   = MIN(requested_sectors, avail_sectors),
+                .nb_available   = nb_available,
+                .cow_start      = cow_start,
+                .cow_end        = cow_end,
+                .subcluster_cow = subcluster_cow,
+                .keep_old_cluster = keep_old_cluster,
             };
             qemu_co_queue_init(&m->dependent_requests);
             QLIST_INSERT_HEAD(&s->cluster_allocs, m, next_in_flight);
@@ -1021,34 +1441,304 @@ static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
     return 0;
 }
 
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
+void qcow2_compressed_cache_init(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i;
+
+    s->compressed_cache_size = QCOW2_COMPRESSED_CACHE_BYTES / s->cluster_size;
+    s->compressed_cache_size = MAX(2, MIN(QCOW2_COMPRESSED_CACHE_MAX,
+                                          s->compressed_cache_size));
+    for (i = 0; i < s->compressed_cache_size; i++) {
+        s->compressed_cache[i].coffset = -1;
+        qemu_co_queue_init(&s->compressed_cache[i].waiters);
+    }
+}
+
+void qcow2_compressed_cache_destroy(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < s->compressed_cache_size; i++) {
+        assert(!s->compressed_cache[i].loading);
+        g_free(s->compressed_cache[i].data);
+        s->compressed_cache[i].data = NULL;
+    }
+}
+
+/* Host clusters holding compressed data that are freed can be handed out
+ * again by qcow2_alloc_compressed_cluster_offset(), and then a cached
+ * host offset would describe the wrong data.  */
+void qcow2_compressed_cache_invalidate(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < s->compressed_cache_size; i++) {
+        Qcow2CompressedCluster *c = &s->compressed_cache[i];
+
+        if (c->loading) {
+            c->stale = true;
+        } else {
+            c->coffset = -1;
+            c->lru_counter = 0;
+        }
+    }
+}
+
+static Qcow2CompressedCluster *compressed_cache_find(BDRVQcowState *s,
+                                                     uint64_t coffset)
+{
+    int i;
+
+    for (i = 0; i < s->compressed_cache_size; i++) {
+        if (s->compressed_cache[i].coffset == coffset) {
+            return &s->compressed_cache[i];
+        }
+    }
+    return NULL;
+}
+
+/* Claim the least recently used entry that is not being loaded for
+ * coffset, or return NULL if all of them are busy.  */
+static Qcow2CompressedCluster *compressed_cache_claim(BDRVQcowState *s,
+                                                      uint64_t coffset)
+{
+    Qcow2CompressedCluster *c = NULL;
+    int i;
+
+    for (i = 0; i < s->compressed_cache_size; i++) {
+        Qcow2CompressedCluster *e = &s->compressed_cache[i];
+
+        if (!e->loading && (!c || e->lru_counter < c->lru_counter)) {
+            c = e;
+        }
+    }
+    if (c) {
+        if (!c->data) {
+            c->data = g_malloc(s->cluster_size);
+        }
+        c->coffset = coffset;
+        c->loading = true;
+        c->stale = false;
+    }
+    return c;
+}
+
+static void compressed_cache_loaded(BDRVQcowState *s,
+                                    Qcow2CompressedCluster *c, int ret)
+{
+    c->loading = false;
+    if (ret < 0 || c->stale) {
+        c->coffset = -1;
+        c->lru_counter = 0;
+    } else {
+        c->lru_counter = ++s->compressed_lru_counter;
+    }
+    qemu_co_queue_restart_all(&c->waiters);
+}
+
+/* Compressed data read in one request, shared by the clusters in it */
+typedef struct Qcow2CompressedBuf {
+    uint8_t *data;
+    int64_t sector_num;
+    int refcnt;
+} Qcow2CompressedBuf;
+
+typedef struct Qcow2DecompressJob {
+    BDRVQcowState *s;
+    Qcow2CompressedCluster *cluster;
+    Qcow2CompressedBuf *buf;
+    uint64_t l2_entry;
+} Qcow2DecompressJob;
+
+static void compressed_buf_unref(Qcow2CompressedBuf *buf)
+{
+    if (--buf->refcnt == 0) {
+        qemu_vfree(buf->data);
+        g_free(buf);
+    }
+}
+
+static int decompress_worker(void *opaque)
+{
+    Qcow2DecompressJob *job = opaque;
+    BDRVQcowState *s = job->s;
+    uint64_t coffset = job->l2_entry & s->cluster_offset_mask;
+    int nb_csectors = ((job->l2_entry >> s->csize_shift) & s->csize_mask) + 1;
+    int csize = nb_csectors * 512 - (coffset & 511);
+    int64_t start = coffset - job->buf->sector_num * 512;
+
+    if (decompress_buffer(job->cluster->data, s->cluster_size,
+                          job->buf->data + start, csize) < 0) {
+        return -EIO;
+    }
+    return 0;
+}
+
+static void decompress_readahead_done(void *opaque, int ret)
+{
+    Qcow2DecompressJob *job = opaque;
+
+    compressed_cache_loaded(job->s, job->cluster, ret);
+    compressed_buf_unref(job->buf);
+    g_free(job);
+}
+
+/*
+ * Return the decompressed data of the compressed cluster described by the
+ * L2 entry cluster_offset, at guest offset offset, in *data.  The data stays
+ * valid until s->lock is dropped.
+ *
+ * qemu-img convert -c writes compressed clusters back to back, so the
+ * compressed clusters that follow in the guest are usually the next bytes
+ * on the host.  Up to QCOW2_COMPRESSED_READAHEAD of them are read along
+ * with this one and decompressed in the background.
+ */
+int coroutine_fn qcow2_decompress_cluster(BlockDriverState *bs,
+                                          uint64_t offset,
+                                          uint64_t cluster_offset,
+                                          uint8_t **data)
 {
     BDRVQcowState *s = bs->opaque;
-    int ret, csize, nb_csectors, sector_offset;
+    uint64_t l2_entries[1 + QCOW2_COMPRESSED_READAHEAD];
+    Qcow2CompressedCluster *clusters[1 + QCOW2_COMPRESSED_READAHEAD];
+    Qcow2CompressedCluster *c;
+    Qcow2DecompressJob job;
+    Qcow2CompressedBuf *buf;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    ThreadPool *pool;
     uint64_t coffset;
+    int64_t end_sector;
+    int i, n, ret;
 
     coffset = cluster_offset & s->cluster_offset_mask;
-    if (s->cluster_cache_offset != coffset) {
-        nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
-        sector_offset = coffset & 511;
-        csize = nb_csectors * 512 - sector_offset;
-        BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
-        ret = bdrv_read(bs->file, coffset >> 9, s->cluster_data, nb_csectors);
-        if (ret < 0) {
-            return ret;
+    offset &= ~((uint64_t)s->cluster_size - 1);
+
+again:
+    c = compressed_cache_find(s, coffset);
+    if (c) {
+        if (c->loading) {
+            qemu_co_mutex_unlock(&s->lock);
+            qemu_co_queue_wait(&c->waiters);
+            qemu_co_mutex_lock(&s->lock);
+            goto again;
         }
-        if (decompress_buffer(s->cluster_cache, s->cluster_size,
-                              s->cluster_data + sector_offset, csize) < 0) {
-            return -EIO;
+        c->lru_counter = ++s->compressed_lru_counter;
+        *data = c->data;
+        return 0;
+    }
+
+    /* Find the compressed clusters stored right behind this one */
+    l2_entries[0] = cluster_offset;
+    end_sector = (coffset >> 9) +
+        ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
+    for (n = 1; n <= QCOW2_COMPRESSED_READAHEAD; n++) {
+        uint64_t next_offset = offset + n * s->cluster_size;
+        uint64_t next_entry, next_coffset;
+        int nb_sectors = s->cluster_sectors;
+
+        if (next_offset >= bs->total_sectors * BDRV_SECTOR_SIZE) {
+            break;
+        }
+        ret = qcow2_get_cluster_offset(bs, next_offset, &nb_sectors,
+                                       &next_entry);
+        if (ret != QCOW2_CLUSTER_COMPRESSED) {
+            break;
         }
-        s->cluster_cache_offset = coffset;
+        next_coffset = next_entry & s->cluster_offset_mask;
+        if ((next_coffset >> 9) < (coffset >> 9) ||
+            (next_coffset >> 9) > end_sector) {
+            break;
+        }
+        l2_entries[n] = next_entry;
+        end_sector = MAX(end_sector, (next_coffset >> 9) +
+            ((next_entry >> s->csize_shift) & s->csize_mask) + 1);
+    }
+
+    /* Looking at the L2 tables may have yielded */
+    if (compressed_cache_find(s, coffset)) {
+        goto again;
+    }
+    clusters[0] = compressed_cache_claim(s, coffset);
+    if (!clusters[0]) {
+        /* Every entry is being loaded; wait for one to become free */
+        qemu_co_mutex_unlock(&s->lock);
+        qemu_co_queue_wait(&s->compressed_cache[0].waiters);
+        qemu_co_mutex_lock(&s->lock);
+        goto again;
     }
+    end_sector = (coffset >> 9) +
+        ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
+    for (i = 1; i < n; i++) {
+        uint64_t next_coffset = l2_entries[i] & s->cluster_offset_mask;
+
+        if (compressed_cache_find(s, next_coffset)) {
+            break;
+        }
+        clusters[i] = compressed_cache_claim(s, next_coffset);
+        if (!clusters[i]) {
+            break;
+        }
+        end_sector = MAX(end_sector, (next_coffset >> 9) +
+            ((l2_entries[i] >> s->csize_shift) & s->csize_mask) + 1);
+    }
+    n = i;
+
+    buf = g_malloc0(sizeof(*buf));
+    buf->sector_num = coffset >> 9;
+    buf->refcnt = 1;
+    iov.iov_len = (end_sector - buf->sector_num) * BDRV_SECTOR_SIZE;
+    iov.iov_base = buf->data = qemu_blockalign(bs, iov.iov_len);
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    qemu_co_mutex_unlock(&s->lock);
+    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    ret = bdrv_co_readv(bs->file, buf->sector_num,
+                        end_sector - buf->sector_num, &qiov);
+    if (ret < 0) {
+        qemu_co_mutex_lock(&s->lock);
+        for (i = 0; i < n; i++) {
+            compressed_cache_loaded(s, clusters[i], ret);
+        }
+        compressed_buf_unref(buf);
+        return ret;
+    }
+
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    for (i = 1; i < n; i++) {
+        Qcow2DecompressJob *ra = g_malloc(sizeof(*ra));
+
+        ra->s = s;
+        ra->cluster = clusters[i];
+        ra->buf = buf;
+        ra->l2_entry = l2_entries[i];
+        buf->refcnt++;
+        thread_pool_submit_aio(pool, decompress_worker, ra,
+                               decompress_readahead_done, ra);
+    }
+
+    job.s = s;
+    job.cluster = clusters[0];
+    job.buf = buf;
+    job.l2_entry = cluster_offset;
+    ret = thread_pool_submit_co(pool, decompress_worker, &job);
+
+    qemu_co_mutex_lock(&s->lock);
+    compressed_cache_loaded(s, clusters[0], ret);
+    compressed_buf_unref(buf);
+    if (ret < 0) {
+        return ret;
+    }
+    *data = clusters[0]->data;
     return 0;
 }
 
 /*
  * This discards as many clusters of nb_clusters as possible at once (i.e.
- * all clusters in the same L2 table) and returns the number of discarded
+ * all clusters in the same L2 slice) and returns the number of discarded
  * clusters.
  */
 static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
@@ -1065,20 +1755,23 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
         return ret;
     }
 
-    /* Limit nb_clusters to one L2 table */
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    /* Limit nb_clusters to one L2 slice */
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
 
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_offset;
 
-        old_offset = be64_to_cpu(l2_table[l2_index + i]);
+        old_offset = get_l2_entry(s, l2_table, l2_index + i);
         if ((old_offset & L2E_OFFSET_MASK) == 0) {
             continue;
         }
 
         /* First remove L2 entries */
         qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
-        l2_table[l2_index + i] = cpu_to_be64(0);
+        set_l2_entry(s, l2_table, l2_index + i, 0);
+        if (s->extended_l2) {
+            set_l2_bitmap(s, l2_table, l2_index + i, 0);
+        }
 
         /* Then decrease the refcount */
         qcow2_free_any_clusters(bs, old_offset, 1);
@@ -1112,7 +1805,7 @@ int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
 
     nb_clusters = size_to_clusters(s, end_offset - offset);
 
-    /* Each L2 table is handled by its own loop iteration */
+    /* Each L2 slice is handled by its own loop iteration */
     while (nb_clusters > 0) {
         ret = discard_single_l2(bs, offset, nb_clusters);
         if (ret < 0) {
@@ -1128,7 +1821,7 @@ int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
 
 /*
  * This zeroes as many clusters of nb_clusters as possible at once (i.e.
- * all clusters in the same L2 table) and returns the number of zeroed
+ * all clusters in the same L2 slice) and returns the number of zeroed
  * clusters.
  */
 static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
@@ -1145,21 +1838,29 @@ static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
         return ret;
     }
 
-    /* Limit nb_clusters to one L2 table */
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    /* Limit nb_clusters to one L2 slice */
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
 
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_offset;
 
-        old_offset = be64_to_cpu(l2_table[l2_index + i]);
+        old_offset = get_l2_entry(s, l2_table, l2_index + i);
 
         /* Update L2 entries */
         qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
-        if (old_offset & QCOW_OFLAG_COMPRESSED) {
-            l2_table[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
+        if (s->extended_l2) {
+            /* The cluster stays allocated, but all subclusters read zeros */
+            if (old_offset & QCOW_OFLAG_COMPRESSED) {
+                set_l2_entry(s, l2_table, l2_index + i, 0);
+                qcow2_free_any_clusters(bs, old_offset, 1);
+            }
+            set_l2_bitmap(s, l2_table, l2_index + i, QCOW_L2_BITMAP_ALL_ZERO);
+        } else if (old_offset & QCOW_OFLAG_COMPRESSED) {
+            set_l2_entry(s, l2_table, l2_index + i, QCOW_OFLAG_ZERO);
             qcow2_free_any_clusters(bs, old_offset, 1);
         } else {
-            l2_table[l2_index + i] |= cpu_to_be64(QCOW_OFLAG_ZERO);
+            set_l2_entry(s, l2_table, l2_index + i,
+                         old_offset | QCOW_OFLAG_ZERO);
         }
     }
 
@@ -1182,7 +1883,7 @@ int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors)
         return -ENOTSUP;
     }
 
-    /* Each L2 table is handled by its own loop iteration */
+    /* Each L2 slice is handled by its own loop iteration */
     nb_clusters = size_to_clusters(s, nb_sectors << BDRV_SECTOR_BITS);
 
     while (nb_clusters > 0) {
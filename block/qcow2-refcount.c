@@ -25,6 +25,7 @@
 #include "qemu-common.h"
 #include "block_int.h"
 #include "block/qcow2.h"
+#include "bitmap.h"
 
 static int64_t alloc_clusters_noref(BlockDriverState *bs, int64_t size);
 static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
@@ -432,6 +433,8 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
         return 0;
     }
 
+    /* Even with lazy refcounts: a freed cluster may be reused right away,
+     * so the L2 update that dropped it must reach the disk first. */
     if (addend < 0) {
         qcow2_cache_set_dependency(bs, s->refcount_block_cache,
             s->l2_table_cache);
@@ -720,18 +723,258 @@ void qcow2_free_any_clusters(BlockDriverState *bs,
 
 
 /* update the refcounts of snapshots and the copied flag */
+typedef struct RefcountUpdate {
+    int64_t cluster_index;
+    int l2_index;
+    int refcount;
+} RefcountUpdate;
+
+static int refcount_update_cmp(const void *a, const void *b)
+{
+    const RefcountUpdate *ua = a, *ub = b;
+
+    if (ua->cluster_index != ub->cluster_index) {
+        return ua->cluster_index < ub->cluster_index ? -1 : 1;
+    }
+    return 0;
+}
+
+/*
+ * Add addend to the refcount of every cluster in updates[], which is sorted
+ * by cluster index, and store the new refcounts in it.  Each refcount block
+ * is looked up once for all the clusters it covers.  With addend == 0 the
+ * refcounts are only read.
+ */
+static int update_refcount_sorted(BlockDriverState *bs,
+                                  RefcountUpdate *updates, int n, int addend)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint16_t *refcount_block = NULL;
+    int64_t old_table_index = -1;
+    int i, done = 0;
+    int ret = 0;
+
+    /* Even with lazy refcounts: a freed cluster may be reused right away,
+     * so the L2 update that dropped it must reach the disk first. */
+    if (addend < 0) {
+        qcow2_cache_set_dependency(bs, s->refcount_block_cache,
+            s->l2_table_cache);
+    }
+
+    for (i = 0; i < n; i++) {
+        int64_t cluster_index = updates[i].cluster_index;
+        int64_t table_index =
+            cluster_index >> (s->cluster_bits - REFCOUNT_SHIFT);
+        int block_index, refcount;
+
+        if (table_index != old_table_index) {
+            if (refcount_block) {
+                ret = qcow2_cache_put(bs, s->refcount_block_cache,
+                    (void**) &refcount_block);
+                if (ret < 0) {
+                    goto fail;
+                }
+            }
+            old_table_index = table_index;
+
+            if (addend != 0) {
+                ret = alloc_refcount_block(bs, cluster_index, &refcount_block);
+            } else if (table_index < s->refcount_table_size &&
+                       s->refcount_table[table_index]) {
+                ret = load_refcount_block(bs, s->refcount_table[table_index],
+                    (void**) &refcount_block);
+            }
+            if (ret < 0) {
+                goto fail;
+            }
+        }
+
+        if (!refcount_block) {
+            /* no refcount block, nothing is allocated there */
+            updates[i].refcount = 0;
+            continue;
+        }
+
+        block_index = cluster_index &
+            ((1 << (s->cluster_bits - REFCOUNT_SHIFT)) - 1);
+        refcount = be16_to_cpu(refcount_block[block_index]);
+        if (addend != 0) {
+            refcount += addend;
+            if (refcount < 0 || refcount > 0xffff) {
+                ret = -EINVAL;
+                goto fail;
+            }
+            if (refcount == 0 && cluster_index < s->free_cluster_index) {
+                s->free_cluster_index = cluster_index;
+            }
+            qcow2_cache_entry_mark_dirty(s->refcount_block_cache,
+                                         refcount_block);
+            refcount_block[block_index] = cpu_to_be16(refcount);
+            done = i + 1;
+        }
+        updates[i].refcount = refcount;
+    }
+
+fail:
+    if (refcount_block) {
+        int wret;
+        wret = qcow2_cache_put(bs, s->refcount_block_cache,
+            (void**) &refcount_block);
+        if (wret < 0 && ret == 0) {
+            ret = wret;
+        }
+    }
+
+    /* Try to undo what was done, as update_refcount() does */
+    if (ret < 0) {
+        for (i = 0; i < done; i++) {
+            int dummy;
+            dummy = update_refcount(bs,
+                updates[i].cluster_index << s->cluster_bits, 1, -addend);
+            (void)dummy;
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * Adjust the refcounts of the L2 table in l1_table[l1_index] and of all
+ * clusters it references by addend, and update the COPIED flags in both
+ * tables.  *l1_modified is set when l1_table changed.
+ */
+static int update_l1_entry_refcount(BlockDriverState *bs, uint64_t *l1_table,
+                                    int l1_index, int addend,
+                                    RefcountUpdate *updates, bool *l1_modified)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t *l2_table = NULL;
+    uint64_t l2_offset, old_l2_offset, offset, old_offset;
+    int i, j, n, slice, refcount;
+    int ret;
+
+    old_l2_offset = l1_table[l1_index];
+    l2_offset = old_l2_offset & L1E_OFFSET_MASK;
+    if (!l2_offset) {
+        return 0;
+    }
+
+    for (slice = 0; slice < s->l2_size; slice += s->l2_slice_size) {
+        ret = qcow2_cache_get(bs, s->l2_table_cache,
+            l2_offset + slice * l2_entry_size(s), (void**) &l2_table);
+        if (ret < 0) {
+            return ret;
+        }
+
+        n = 0;
+        for (j = 0; j < s->l2_slice_size; j++) {
+            old_offset = get_l2_entry(s, l2_table, j);
+            if (old_offset & QCOW_OFLAG_COMPRESSED) {
+                int nb_csectors = ((old_offset >> s->csize_shift) &
+                                   s->csize_mask) + 1;
+                if (addend != 0) {
+                    ret = update_refcount(bs,
+                        (old_offset & s->cluster_offset_mask) & ~511,
+                        nb_csectors * 512, addend);
+                    if (ret < 0) {
+                        goto fail;
+                    }
+                }
+                /* compressed clusters are never modified */
+                offset = old_offset & ~QCOW_OFLAG_COPIED;
+                if (offset != old_offset) {
+                    set_l2_entry(s, l2_table, j, offset);
+                    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
+                }
+            } else if (old_offset & L2E_OFFSET_MASK) {
+                updates[n].cluster_index =
+                    (old_offset & L2E_OFFSET_MASK) >> s->cluster_bits;
+                updates[n].l2_index = j;
+                n++;
+            }
+        }
+
+        qsort(updates, n, sizeof(*updates), refcount_update_cmp);
+        ret = update_refcount_sorted(bs, updates, n, addend);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        for (i = 0; i < n; i++) {
+            j = updates[i].l2_index;
+            old_offset = get_l2_entry(s, l2_table, j);
+            offset = old_offset & ~QCOW_OFLAG_COPIED;
+            if (updates[i].refcount == 1) {
+                offset |= QCOW_OFLAG_COPIED;
+            }
+            if (offset != old_offset) {
+                if (addend > 0) {
+                    qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                        s->refcount_block_cache);
+                }
+                set_l2_entry(s, l2_table, j, offset);
+                qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
+            }
+        }
+
+        ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (addend != 0) {
+        ret = update_refcount(bs, l2_offset, 1, addend);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    refcount = get_refcount(bs, l2_offset >> s->cluster_bits);
+    if (refcount < 0) {
+        return refcount;
+    } else if (refcount == 1) {
+        l2_offset |= QCOW_OFLAG_COPIED;
+    }
+    if (l2_offset != old_l2_offset) {
+        l1_table[l1_index] = l2_offset;
+        *l1_modified = true;
+    }
+    return 0;
+
+fail:
+    qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+    return ret;
+}
+
+static int write_l1_table(BlockDriverState *bs, int64_t l1_table_offset,
+                          uint64_t *l1_table, int l1_size)
+{
+    uint64_t *buf;
+    int i, ret;
+
+    buf = g_malloc(l1_size * sizeof(uint64_t));
+    for (i = 0; i < l1_size; i++) {
+        buf[i] = cpu_to_be64(l1_table[i]);
+    }
+    ret = bdrv_pwrite_sync(bs->file, l1_table_offset, buf,
+                           l1_size * sizeof(uint64_t));
+    g_free(buf);
+    return ret;
+}
+
 int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     int64_t l1_table_offset, int l1_size, int addend)
 {
     BDRVQcowState *s = bs->opaque;
-    uint64_t *l1_table, *l2_table, l2_offset, offset, l1_size2, l1_allocated;
-    int64_t old_offset, old_l2_offset;
-    int i, j, l1_modified = 0, nb_csectors, refcount;
+    uint64_t *l1_table, l1_size2, l1_allocated;
+    RefcountUpdate *updates;
+    bool l1_modified = false;
+    int i;
     int ret;
 
-    l2_table = NULL;
     l1_table = NULL;
     l1_size2 = l1_size * sizeof(uint64_t);
+    updates = g_new(RefcountUpdate, s->l2_slice_size);
 
     /* WARNING: qcow2_snapshot_goto relies on this function not using the
      * l1_table_offset when it is the current s->l1_table_offset! Be careful
@@ -759,120 +1002,202 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     }
 
     for(i = 0; i < l1_size; i++) {
-        l2_offset = l1_table[i];
-        if (l2_offset) {
-            old_l2_offset = l2_offset;
-            l2_offset &= L1E_OFFSET_MASK;
-
-            ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
-                (void**) &l2_table);
-            if (ret < 0) {
-                goto fail;
-            }
-
-            for(j = 0; j < s->l2_size; j++) {
-                offset = be64_to_cpu(l2_table[j]);
-                if (offset != 0) {
-                    old_offset = offset;
-                    offset &= ~QCOW_OFLAG_COPIED;
-                    if (offset & QCOW_OFLAG_COMPRESSED) {
-                        nb_csectors = ((offset >> s->csize_shift) &
-                                       s->csize_mask) + 1;
-                        if (addend != 0) {
-                            int ret;
-                            ret = update_refcount(bs,
-                                (offset & s->cluster_offset_mask) & ~511,
-                                nb_csectors * 512, addend);
-                            if (ret < 0) {
-                                goto fail;
-                            }
-
-                            /* TODO Flushing once for the whole function should
-                             * be enough */
-                            bdrv_flush(bs->file);
-                        }
-                        /* compressed clusters are never modified */
-                        refcount = 2;
-                    } else {
-                        uint64_t cluster_index = (offset & L2E_OFFSET_MASK) >> s->cluster_bits;
-                        if (addend != 0) {
-                            refcount = update_cluster_refcount(bs, cluster_index, addend);
-                        } else {
-                            refcount = get_refcount(bs, cluster_index);
-                        }
-
-                        if (refcount < 0) {
-                            ret = -EIO;
-                            goto fail;
-                        }
-                    }
-
-                    if (refcount == 1) {
-                        offset |= QCOW_OFLAG_COPIED;
-                    }
-                    if (offset != old_offset) {
-                        if (addend > 0) {
-                            qcow2_cache_set_dependency(bs, s->l2_table_cache,
-                                s->refcount_block_cache);
-                        }
-                        l2_table[j] = cpu_to_be64(offset);
-                        qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
-                    }
-                }
-            }
-
-            ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
-            if (ret < 0) {
-                goto fail;
-            }
-
-
-            if (addend != 0) {
-                refcount = update_cluster_refcount(bs, l2_offset >> s->cluster_bits, addend);
-            } else {
-                refcount = get_refcount(bs, l2_offset >> s->cluster_bits);
-            }
-            if (refcount < 0) {
-                ret = -EIO;
-                goto fail;
-            } else if (refcount == 1) {
-                l2_offset |= QCOW_OFLAG_COPIED;
-            }
-            if (l2_offset != old_l2_offset) {
-                l1_table[i] = l2_offset;
-                l1_modified = 1;
-            }
+        ret = update_l1_entry_refcount(bs, l1_table, i, addend, updates,
+                                       &l1_modified);
+        if (ret < 0) {
+            goto fail;
         }
     }
 
     ret = 0;
 fail:
-    if (l2_table) {
-        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
-    }
-
     /* Update L1 only if it isn't deleted anyway (addend = -1) */
     if (addend >= 0 && l1_modified) {
-        for(i = 0; i < l1_size; i++)
-            cpu_to_be64s(&l1_table[i]);
-        if (bdrv_pwrite_sync(bs->file, l1_table_offset, l1_table,
-                        l1_size2) < 0)
-            goto fail;
-        for(i = 0; i < l1_size; i++)
-            be64_to_cpus(&l1_table[i]);
+        int wret = write_l1_table(bs, l1_table_offset, l1_table, l1_size);
+        if (wret < 0 && ret == 0) {
+            ret = wret;
+        }
     }
     if (l1_allocated)
         g_free(l1_table);
+    g_free(updates);
     return ret;
 }
 
+typedef struct SnapshotRelease {
+    BlockDriverState *bs;
+    int64_t l1_table_offset;
+    int l1_size;
+} SnapshotRelease;
+
+static void coroutine_fn release_snapshot_co(void *opaque)
+{
+    SnapshotRelease *sr = opaque;
+    BlockDriverState *bs = sr->bs;
+    BDRVQcowState *s = bs->opaque;
+    uint64_t *l1_table;
+    RefcountUpdate *updates;
+    bool l1_modified = false;
+    int i, ret;
+
+    updates = g_new(RefcountUpdate, s->l2_slice_size);
+    l1_table = g_malloc0(align_offset(sr->l1_size * sizeof(uint64_t), 512));
+    ret = bdrv_pread(bs->file, sr->l1_table_offset, l1_table,
+                     sr->l1_size * sizeof(uint64_t));
+    if (ret < 0) {
+        goto out;
+    }
+    for (i = 0; i < sr->l1_size; i++) {
+        be64_to_cpus(&l1_table[i]);
+    }
+
+    /* One L2 table at a time, so that guest requests can get in between */
+    for (i = 0; i < sr->l1_size; i++) {
+        qemu_co_mutex_lock(&s->lock);
+        ret = update_l1_entry_refcount(bs, l1_table, i, -1, updates,
+                                       &l1_modified);
+        qemu_co_mutex_unlock(&s->lock);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    qcow2_free_clusters(bs, sr->l1_table_offset,
+                        sr->l1_size * sizeof(uint64_t));
+    qemu_co_mutex_unlock(&s->lock);
+
+    /* Clusters that are now only used by the active image get COPIED */
+    l1_modified = false;
+    for (i = 0; i < s->l1_size; i++) {
+        qemu_co_mutex_lock(&s->lock);
+        ret = update_l1_entry_refcount(bs, s->l1_table, i, 0, updates,
+                                       &l1_modified);
+        qemu_co_mutex_unlock(&s->lock);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+    if (l1_modified) {
+        qemu_co_mutex_lock(&s->lock);
+        write_l1_table(bs, s->l1_table_offset, s->l1_table, s->l1_size);
+        qemu_co_mutex_unlock(&s->lock);
+    }
+
+out:
+    g_free(l1_table);
+    g_free(updates);
+    g_free(sr);
+    s->snapshot_releases--;
+}
+
+/*
+ * Drop the references a deleted snapshot with the given L1 table holds, in
+ * the background.  The snapshot must already be gone from the snapshot
+ * table: if QEMU stops before this is done, the remaining clusters are only
+ * leaked.
+ */
+void qcow2_release_snapshot_refcounts(BlockDriverState *bs,
+    int64_t l1_table_offset, int l1_size)
+{
+    BDRVQcowState *s = bs->opaque;
+    SnapshotRelease *sr = g_malloc(sizeof(*sr));
+    Coroutine *co;
+
+    sr->bs = bs;
+    sr->l1_table_offset = l1_table_offset;
+    sr->l1_size = l1_size;
+    s->snapshot_releases++;
+
+    co = qemu_coroutine_create(release_snapshot_co);
+    qemu_coroutine_enter(co, sr);
+}
+
+/* Wait for snapshot deletions still being processed in the background */
+void qcow2_wait_snapshot_releases(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
 
+    while (s->snapshot_releases) {
+        qemu_aio_wait();
+    }
+}
 
 
 /*********************************************************/
 /* refcount checking functions */
 
+/*
+ * The reference counts built while checking an image.  Images without
+ * snapshots almost never reference a cluster more than once, so for them a
+ * bitmap with one bit per cluster is kept and the few clusters referenced
+ * more often (compressed clusters sharing a host cluster, corruptions) go
+ * to a hash table.  Other images use a full 16 bit table.
+ */
+typedef struct CheckRefcounts {
+    int nb_clusters;
+    uint16_t *table;
+    unsigned long *once;
+    GHashTable *more;
+} CheckRefcounts;
+
+static void check_refcounts_init(CheckRefcounts *rt, int nb_clusters,
+                                 bool compact)
+{
+    rt->nb_clusters = nb_clusters;
+    if (compact) {
+        rt->table = NULL;
+        rt->once = bitmap_new(nb_clusters);
+        rt->more = g_hash_table_new(g_direct_hash, g_direct_equal);
+    } else {
+        rt->table = g_malloc0(nb_clusters * sizeof(uint16_t));
+        rt->once = NULL;
+        rt->more = NULL;
+    }
+}
+
+static void check_refcounts_free(CheckRefcounts *rt)
+{
+    g_free(rt->table);
+    g_free(rt->once);
+    if (rt->more) {
+        g_hash_table_destroy(rt->more);
+    }
+}
 
+static uint16_t check_refcounts_get(CheckRefcounts *rt, int k)
+{
+    gpointer value;
+
+    if (rt->table) {
+        return rt->table[k];
+    }
+    if (!test_bit(k, rt->once)) {
+        return 0;
+    }
+    if (!g_hash_table_lookup_extended(rt->more, GINT_TO_POINTER(k),
+                                      NULL, &value)) {
+        return 1;
+    }
+    return GPOINTER_TO_UINT(value);
+}
+
+/* Returns the new reference count, 0 on overflow */
+static uint16_t check_refcounts_inc(CheckRefcounts *rt, int k)
+{
+    uint16_t refcount;
+
+    if (rt->table) {
+        return ++rt->table[k];
+    }
+    if (!test_and_set_bit(k, rt->once)) {
+        return 1;
+    }
+    refcount = check_refcounts_get(rt, k) + 1;
+    g_hash_table_insert(rt->more, GINT_TO_POINTER(k),
+                        GUINT_TO_POINTER(refcount));
+    return refcount;
+}
 
 /*
  * Increases the refcount for a range of clusters in a given refcount table.
@@ -883,8 +1208,7 @@ fail:
  */
 static void inc_refcounts(BlockDriverState *bs,
                           BdrvCheckResult *res,
-                          uint16_t *refcount_table,
-                          int refcount_table_size,
+                          CheckRefcounts *refcount_table,
                           int64_t offset, int64_t size)
 {
     BDRVQcowState *s = bs->opaque;
@@ -903,13 +1227,13 @@ static void inc_refcounts(BlockDriverState *bs,
             fprintf(stderr, "ERROR: invalid cluster offset=0x%" PRIx64 "\n",
                 cluster_offset);
             res->corruptions++;
-        } else if (k >= refcount_table_size) {
+        } else if (k >= refcount_table->nb_clusters) {
             fprintf(stderr, "Warning: cluster offset=0x%" PRIx64 " is after "
                 "the end of the image file, can't properly check refcounts.\n",
                 cluster_offset);
             res->check_errors++;
         } else {
-            if (++refcount_table[k] == 0) {
+            if (check_refcounts_inc(refcount_table, k) == 0) {
                 fprintf(stderr, "ERROR: overflow cluster offset=0x%" PRIx64
                     "\n", cluster_offset);
                 res->corruptions++;
@@ -920,30 +1244,22 @@ static void inc_refcounts(BlockDriverState *bs,
 
 /*
  * Increases the refcount in the given refcount table for the all clusters
- * referenced in the L2 table. While doing so, performs some checks on L2
- * entries.
+ * referenced in the L2 table, which has already been read into memory. While
+ * doing so, performs some checks on L2 entries.
  *
  * Returns the number of errors found by the checks or -errno if an internal
  * error occurred.
  */
 static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
-    uint16_t *refcount_table, int refcount_table_size, int64_t l2_offset,
-    int check_copied)
+    CheckRefcounts *refcount_table, uint64_t *l2_table, int check_copied)
 {
     BDRVQcowState *s = bs->opaque;
-    uint64_t *l2_table, l2_entry;
-    int i, l2_size, nb_csectors, refcount;
-
-    /* Read L2 table from disk */
-    l2_size = s->l2_size * sizeof(uint64_t);
-    l2_table = g_malloc(l2_size);
-
-    if (bdrv_pread(bs->file, l2_offset, l2_table, l2_size) != l2_size)
-        goto fail;
+    uint64_t l2_entry;
+    int i, nb_csectors, refcount;
 
     /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
-        l2_entry = be64_to_cpu(l2_table[i]);
+        l2_entry = get_l2_entry(s, l2_table, i);
 
         switch (qcow2_get_cluster_type(l2_entry)) {
         case QCOW2_CLUSTER_COMPRESSED:
@@ -960,7 +1276,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             nb_csectors = ((l2_entry >> s->csize_shift) &
                            s->csize_mask) + 1;
             l2_entry &= s->cluster_offset_mask;
-            inc_refcounts(bs, res, refcount_table, refcount_table_size,
+            inc_refcounts(bs, res, refcount_table,
                 l2_entry & ~511, nb_csectors * 512);
             break;
 
@@ -990,7 +1306,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             }
 
             /* Mark cluster as used */
-            inc_refcounts(bs, res, refcount_table,refcount_table_size,
+            inc_refcounts(bs, res, refcount_table,
                 offset, s->cluster_size);
 
             /* Correct offsets are cluster aligned */
@@ -1003,6 +1319,11 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         case QCOW2_CLUSTER_UNALLOCATED:
+            if (get_l2_bitmap(s, l2_table, i) & QCOW_L2_BITMAP_ALL_ALLOC) {
+                fprintf(stderr, "ERROR: L2 entry %d: allocated subclusters "
+                    "without a host cluster\n", i);
+                res->corruptions++;
+            }
             break;
 
         default:
@@ -1010,15 +1331,75 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
         }
     }
 
-    g_free(l2_table);
     return 0;
 
 fail:
     fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
-    g_free(l2_table);
     return -EIO;
 }
 
+/* Number of L2 tables that are read in parallel while checking */
+#define CHECK_L2_PREFETCH 16
+
+typedef struct CheckL2Prefetch {
+    int pending;
+    int ret;
+} CheckL2Prefetch;
+
+static void check_l2_prefetch_cb(void *opaque, int ret)
+{
+    CheckL2Prefetch *p = opaque;
+
+    if (ret < 0) {
+        p->ret = ret;
+    }
+    p->pending--;
+}
+
+/*
+ * Reads the L2 tables at the given offsets into consecutive clusters of buf.
+ * Outside coroutine context, the reads are all submitted at once so that the
+ * walk over a large image is not bound by the latency of single reads.
+ */
+static int check_read_l2_tables(BlockDriverState *bs, uint64_t *offsets,
+                                int n, uint8_t *buf)
+{
+    BDRVQcowState *s = bs->opaque;
+    CheckL2Prefetch p = { .pending = 0, .ret = 0 };
+    struct iovec iov[CHECK_L2_PREFETCH];
+    QEMUIOVector qiov[CHECK_L2_PREFETCH];
+    int i;
+
+    assert(n <= CHECK_L2_PREFETCH);
+    for (i = 0; i < n; i++) {
+        uint8_t *table = buf + ((size_t)i << s->cluster_bits);
+
+        if (qemu_in_coroutine() || (offsets[i] & (BDRV_SECTOR_SIZE - 1))) {
+            if (bdrv_pread(bs->file, offsets[i], table, s->cluster_size)
+                != s->cluster_size) {
+                p.ret = -EIO;
+            }
+            continue;
+        }
+
+        iov[i].iov_base = table;
+        iov[i].iov_len = s->cluster_size;
+        qemu_iovec_init_external(&qiov[i], &iov[i], 1);
+        p.pending++;
+        if (!bdrv_aio_readv(bs->file, offsets[i] >> BDRV_SECTOR_BITS,
+                            &qiov[i], s->cluster_sectors,
+                            check_l2_prefetch_cb, &p)) {
+            p.pending--;
+            p.ret = -EIO;
+        }
+    }
+
+    while (p.pending > 0) {
+        qemu_aio_wait();
+    }
+    return p.ret;
+}
+
 /*
  * Increases the refcount for the L1 table, its L2 tables and all referenced
  * clusters in the given refcount table. While doing so, performs some checks
@@ -1029,19 +1410,21 @@ fail:
  */
 static int check_refcounts_l1(BlockDriverState *bs,
                               BdrvCheckResult *res,
-                              uint16_t *refcount_table,
-                              int refcount_table_size,
+                              CheckRefcounts *refcount_table,
                               int64_t l1_table_offset, int l1_size,
                               int check_copied)
 {
     BDRVQcowState *s = bs->opaque;
     uint64_t *l1_table, l2_offset, l1_size2;
-    int i, refcount, ret;
+    uint64_t batch[CHECK_L2_PREFETCH];
+    uint8_t *l2_tables;
+    int i, j, n, next, refcount, ret;
 
     l1_size2 = l1_size * sizeof(uint64_t);
+    l2_tables = NULL;
 
     /* Mark L1 table as used */
-    inc_refcounts(bs, res, refcount_table, refcount_table_size,
+    inc_refcounts(bs, res, refcount_table,
         l1_table_offset, l1_size2);
 
     /* Read L1 table entries from disk */
@@ -1054,12 +1437,34 @@ static int check_refcounts_l1(BlockDriverState *bs,
             goto fail;
         for(i = 0;i < l1_size; i++)
             be64_to_cpus(&l1_table[i]);
+        l2_tables = qemu_blockalign(bs->file,
+                                    CHECK_L2_PREFETCH * s->cluster_size);
     }
 
-    /* Do the actual checks */
-    for(i = 0; i < l1_size; i++) {
-        l2_offset = l1_table[i];
-        if (l2_offset) {
+    /* Do the actual checks, a batch of L2 tables at a time */
+    for(i = 0; i < l1_size; i = next) {
+        n = 0;
+        for (next = i; next < l1_size && n < CHECK_L2_PREFETCH; next++) {
+            if (l1_table[next]) {
+                batch[n++] = l1_table[next] & L1E_OFFSET_MASK;
+            }
+        }
+        if (n == 0) {
+            continue;
+        }
+
+        ret = check_read_l2_tables(bs, batch, n, l2_tables);
+        if (ret < 0) {
+            fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
+            goto fail;
+        }
+
+        for (j = 0; i < next; i++) {
+            l2_offset = l1_table[i];
+            if (!l2_offset) {
+                continue;
+            }
+
             /* QCOW_OFLAG_COPIED must be set iff refcount == 1 */
             if (check_copied) {
                 refcount = get_refcount(bs, (l2_offset & ~QCOW_OFLAG_COPIED)
@@ -1078,7 +1483,7 @@ static int check_refcounts_l1(BlockDriverState *bs,
 
             /* Mark L2 table as used */
             l2_offset &= L1E_OFFSET_MASK;
-            inc_refcounts(bs, res, refcount_table, refcount_table_size,
+            inc_refcounts(bs, res, refcount_table,
                 l2_offset, s->cluster_size);
 
             /* L2 tables are cluster aligned */
@@ -1090,22 +1495,118 @@ static int check_refcounts_l1(BlockDriverState *bs,
 
             /* Process and check L2 entries */
             ret = check_refcounts_l2(bs, res, refcount_table,
-                refcount_table_size, l2_offset, check_copied);
+                (uint64_t *)(l2_tables + ((size_t)j++ << s->cluster_bits)),
+                check_copied);
             if (ret < 0) {
                 goto fail;
             }
         }
     }
+    qemu_vfree(l2_tables);
     g_free(l1_table);
     return 0;
 
 fail:
     fprintf(stderr, "ERROR: I/O error in check_refcounts_l1\n");
     res->check_errors++;
+    qemu_vfree(l2_tables);
     g_free(l1_table);
     return -EIO;
 }
 
+/*
+ * Compares the refcounts of the clusters in [start, end), which are all
+ * covered by the same refcount block, with the reference counts that were
+ * found.  Allowed repairs are done in place in the cached refcount block, so
+ * that each refcount block is written at most once.
+ */
+static void check_compare_refcount_block(BlockDriverState *bs,
+                                         BdrvCheckResult *res,
+                                         BdrvCheckMode fix,
+                                         CheckRefcounts *refcount_table,
+                                         int64_t start, int64_t end)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint16_t *refcount_block = NULL;
+    int64_t refcount_block_offset, i;
+    int refcount_table_index, block_mask, ret;
+    int refcount1, refcount2;
+
+    refcount_table_index = start >> (s->cluster_bits - REFCOUNT_SHIFT);
+    block_mask = (1 << (s->cluster_bits - REFCOUNT_SHIFT)) - 1;
+    refcount_block_offset = 0;
+    if (refcount_table_index < s->refcount_table_size) {
+        refcount_block_offset = s->refcount_table[refcount_table_index];
+    }
+
+    if (refcount_block_offset) {
+        ret = load_refcount_block(bs, refcount_block_offset,
+                                  (void **) &refcount_block);
+        if (ret < 0) {
+            fprintf(stderr, "Can't get refcount for clusters %" PRId64
+                    "-%" PRId64 ": %s\n", start, end - 1, strerror(-ret));
+            res->check_errors += end - start;
+            return;
+        }
+    }
+
+    for (i = start; i < end; i++) {
+        refcount1 = refcount_block ?
+            be16_to_cpu(refcount_block[i & block_mask]) : 0;
+        refcount2 = check_refcounts_get(refcount_table, i);
+        if (refcount1 != refcount2) {
+
+            /* Check if we're allowed to fix the mismatch */
+            int *num_fixed = NULL;
+            if (refcount1 > refcount2 && (fix & BDRV_FIX_LEAKS)) {
+                num_fixed = &res->leaks_fixed;
+            } else if (refcount1 < refcount2 && (fix & BDRV_FIX_ERRORS)) {
+                num_fixed = &res->corruptions_fixed;
+            }
+
+            fprintf(stderr, "%s cluster %" PRId64 " refcount=%d reference=%d\n",
+                   num_fixed != NULL     ? "Repairing" :
+                   refcount1 < refcount2 ? "ERROR" :
+                                           "Leaked",
+                   i, refcount1, refcount2);
+
+            if (num_fixed && refcount_block) {
+                qcow2_cache_entry_mark_dirty(s->refcount_block_cache,
+                                             refcount_block);
+                refcount_block[i & block_mask] = cpu_to_be16(refcount2);
+                if (refcount2 == 0 && i < s->free_cluster_index) {
+                    s->free_cluster_index = i;
+                }
+                (*num_fixed)++;
+                continue;
+            } else if (num_fixed) {
+                /* Needs a new refcount block */
+                ret = update_refcount(bs, i << s->cluster_bits, 1,
+                                      refcount2 - refcount1);
+                if (ret >= 0) {
+                    (*num_fixed)++;
+                    continue;
+                }
+            }
+
+            /* And if we couldn't, print an error */
+            if (refcount1 < refcount2) {
+                res->corruptions++;
+            } else {
+                res->leaks++;
+            }
+        }
+    }
+
+    if (refcount_block) {
+        ret = qcow2_cache_put(bs, s->refcount_block_cache,
+                              (void **) &refcount_block);
+        if (ret < 0) {
+            res->check_errors++;
+        }
+    }
+}
+
 /*
  * Checks an image for refcount consistency.
  *
@@ -1116,22 +1617,22 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                           BdrvCheckMode fix)
 {
     BDRVQcowState *s = bs->opaque;
-    int64_t size, i;
-    int nb_clusters, refcount1, refcount2;
+    int64_t size, i, end;
+    int nb_clusters, refcount;
     QCowSnapshot *sn;
-    uint16_t *refcount_table;
+    CheckRefcounts refcount_table;
     int ret;
 
     size = bdrv_getlength(bs->file);
     nb_clusters = size_to_clusters(s, size);
-    refcount_table = g_malloc0(nb_clusters * sizeof(uint16_t));
+    check_refcounts_init(&refcount_table, nb_clusters, s->nb_snapshots == 0);
 
     /* header */
-    inc_refcounts(bs, res, refcount_table, nb_clusters,
+    inc_refcounts(bs, res, &refcount_table,
         0, s->cluster_size);
 
     /* current L1 table */
-    ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
+    ret = check_refcounts_l1(bs, res, &refcount_table,
                        s->l1_table_offset, s->l1_size, 1);
     if (ret < 0) {
         goto fail;
@@ -1140,17 +1641,23 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     /* snapshots */
     for(i = 0; i < s->nb_snapshots; i++) {
         sn = s->snapshots + i;
-        ret = check_refcounts_l1(bs, res, refcount_table, nb_clusters,
+        ret = check_refcounts_l1(bs, res, &refcount_table,
             sn->l1_table_offset, sn->l1_size, 0);
         if (ret < 0) {
             goto fail;
         }
     }
-    inc_refcounts(bs, res, refcount_table, nb_clusters,
+    inc_refcounts(bs, res, &refcount_table,
         s->snapshots_offset, s->snapshots_size);
 
+    /* dirty bitmaps */
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        inc_refcounts(bs, res, &refcount_table,
+            s->bitmaps[i].data_offset, s->bitmaps[i].data_size);
+    }
+
     /* refcount data */
-    inc_refcounts(bs, res, refcount_table, nb_clusters,
+    inc_refcounts(bs, res, &refcount_table,
         s->refcount_table_offset,
         s->refcount_table_size * sizeof(uint64_t));
 
@@ -1175,67 +1682,39 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         if (offset != 0) {
-            inc_refcounts(bs, res, refcount_table, nb_clusters,
+            inc_refcounts(bs, res, &refcount_table,
                 offset, s->cluster_size);
-            if (refcount_table[cluster] != 1) {
+            refcount = check_refcounts_get(&refcount_table, cluster);
+            if (refcount != 1) {
                 fprintf(stderr, "ERROR refcount block %" PRId64
                     " refcount=%d\n",
-                    i, refcount_table[cluster]);
+                    i, refcount);
                 res->corruptions++;
             }
         }
     }
 
-    /* compare ref counts */
-    for(i = 0; i < nb_clusters; i++) {
-        refcount1 = get_refcount(bs, i);
-        if (refcount1 < 0) {
-            fprintf(stderr, "Can't get refcount for cluster %" PRId64 ": %s\n",
-                i, strerror(-refcount1));
-            res->check_errors++;
-            continue;
-        }
-
-        refcount2 = refcount_table[i];
-        if (refcount1 != refcount2) {
-
-            /* Check if we're allowed to fix the mismatch */
-            int *num_fixed = NULL;
-            if (refcount1 > refcount2 && (fix & BDRV_FIX_LEAKS)) {
-                num_fixed = &res->leaks_fixed;
-            } else if (refcount1 < refcount2 && (fix & BDRV_FIX_ERRORS)) {
-                num_fixed = &res->corruptions_fixed;
-            }
-
-            fprintf(stderr, "%s cluster %" PRId64 " refcount=%d reference=%d\n",
-                   num_fixed != NULL     ? "Repairing" :
-                   refcount1 < refcount2 ? "ERROR" :
-                                           "Leaked",
-                   i, refcount1, refcount2);
-
-            if (num_fixed) {
-                ret = update_refcount(bs, i << s->cluster_bits, 1,
-                                      refcount2 - refcount1);
-                if (ret >= 0) {
-                    (*num_fixed)++;
-                    continue;
-                }
-            }
+    /* compare ref counts, one refcount block at a time */
+    for(i = 0; i < nb_clusters; i = end) {
+        end = MIN(nb_clusters,
+                  (i | ((1 << (s->cluster_bits - REFCOUNT_SHIFT)) - 1)) + 1);
+        check_compare_refcount_block(bs, res, fix, &refcount_table, i, end);
+    }
 
-            /* And if we couldn't, print an error */
-            if (refcount1 < refcount2) {
-                res->corruptions++;
-            } else {
-                res->leaks++;
-            }
+    /* Write back the repaired refcount blocks */
+    if (fix) {
+        ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+        if (ret < 0) {
+            fprintf(stderr, "ERROR: Could not write refcount blocks: %s\n",
+                    strerror(-ret));
+            res->check_errors++;
         }
     }
 
     ret = 0;
 
 fail:
-    g_free(refcount_table);
+    check_refcounts_free(&refcount_table);
 
     return ret;
 }
-
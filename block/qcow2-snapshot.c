@@ -151,14 +151,82 @@ fail:
     return ret;
 }
 
+static int snapshot_entry_size(QCowSnapshot *sn)
+{
+    return sizeof(QCowSnapshotHeader) + sizeof(QCowSnapshotExtraData) +
+           strlen(sn->id_str) + strlen(sn->name);
+}
+
+/* Write a single snapshot table entry at *offset and advance *offset */
+static int qcow2_write_snapshot_entry(BlockDriverState *bs, QCowSnapshot *sn,
+                                      int64_t *offset)
+{
+    QCowSnapshotHeader h;
+    QCowSnapshotExtraData extra;
+    int name_size, id_str_size;
+    int64_t pos;
+    int ret;
+
+    memset(&h, 0, sizeof(h));
+    h.l1_table_offset = cpu_to_be64(sn->l1_table_offset);
+    h.l1_size = cpu_to_be32(sn->l1_size);
+    /* If it doesn't fit in 32 bit, older implementations should treat it
+     * as a disk-only snapshot rather than truncate the VM state */
+    if (sn->vm_state_size <= 0xffffffff) {
+        h.vm_state_size = cpu_to_be32(sn->vm_state_size);
+    }
+    h.date_sec = cpu_to_be32(sn->date_sec);
+    h.date_nsec = cpu_to_be32(sn->date_nsec);
+    h.vm_clock_nsec = cpu_to_be64(sn->vm_clock_nsec);
+    h.extra_data_size = cpu_to_be32(sizeof(extra));
+
+    memset(&extra, 0, sizeof(extra));
+    extra.vm_state_size_large = cpu_to_be64(sn->vm_state_size);
+    extra.disk_size = cpu_to_be64(sn->disk_size);
+
+    id_str_size = strlen(sn->id_str);
+    name_size = strlen(sn->name);
+    h.id_str_size = cpu_to_be16(id_str_size);
+    h.name_size = cpu_to_be16(name_size);
+    pos = align_offset(*offset, 8);
+
+    ret = bdrv_pwrite(bs->file, pos, &h, sizeof(h));
+    if (ret < 0) {
+        return ret;
+    }
+    pos += sizeof(h);
+
+    ret = bdrv_pwrite(bs->file, pos, &extra, sizeof(extra));
+    if (ret < 0) {
+        return ret;
+    }
+    pos += sizeof(extra);
+
+    ret = bdrv_pwrite(bs->file, pos, sn->id_str, id_str_size);
+    if (ret < 0) {
+        return ret;
+    }
+    pos += id_str_size;
+
+    ret = bdrv_pwrite(bs->file, pos, sn->name, name_size);
+    if (ret < 0) {
+        return ret;
+    }
+    pos += name_size;
+
+    *offset = pos;
+    return 0;
+}
+
+/* qcow2_write_snapshots() updates both fields with a single write */
+QEMU_BUILD_BUG_ON(offsetof(QCowHeader, snapshots_offset) !=
+    offsetof(QCowHeader, nb_snapshots) + sizeof(uint32_t));
+
 /* add at the end of the file a new list of snapshots */
 static int qcow2_write_snapshots(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
-    QCowSnapshot *sn;
-    QCowSnapshotHeader h;
-    QCowSnapshotExtraData extra;
-    int i, name_size, id_str_size, snapshots_size;
+    int i, snapshots_size;
     struct {
         uint32_t nb_snapshots;
         uint64_t snapshots_offset;
@@ -169,12 +237,8 @@ static int qcow2_write_snapshots(BlockDriverState *bs)
     /* compute the size of the snapshots */
     offset = 0;
     for(i = 0; i < s->nb_snapshots; i++) {
-        sn = s->snapshots + i;
         offset = align_offset(offset, 8);
-        offset += sizeof(h);
-        offset += sizeof(extra);
-        offset += strlen(sn->id_str);
-        offset += strlen(sn->name);
+        offset += snapshot_entry_size(&s->snapshots[i]);
     }
     snapshots_size = offset;
 
@@ -188,53 +252,10 @@ static int qcow2_write_snapshots(BlockDriverState *bs)
 
     /* Write all snapshots to the new list */
     for(i = 0; i < s->nb_snapshots; i++) {
-        sn = s->snapshots + i;
-        memset(&h, 0, sizeof(h));
-        h.l1_table_offset = cpu_to_be64(sn->l1_table_offset);
-        h.l1_size = cpu_to_be32(sn->l1_size);
-        /* If it doesn't fit in 32 bit, older implementations should treat it
-         * as a disk-only snapshot rather than truncate the VM state */
-        if (sn->vm_state_size <= 0xffffffff) {
-            h.vm_state_size = cpu_to_be32(sn->vm_state_size);
-        }
-        h.date_sec = cpu_to_be32(sn->date_sec);
-        h.date_nsec = cpu_to_be32(sn->date_nsec);
-        h.vm_clock_nsec = cpu_to_be64(sn->vm_clock_nsec);
-        h.extra_data_size = cpu_to_be32(sizeof(extra));
-
-        memset(&extra, 0, sizeof(extra));
-        extra.vm_state_size_large = cpu_to_be64(sn->vm_state_size);
-        extra.disk_size = cpu_to_be64(sn->disk_size);
-
-        id_str_size = strlen(sn->id_str);
-        name_size = strlen(sn->name);
-        h.id_str_size = cpu_to_be16(id_str_size);
-        h.name_size = cpu_to_be16(name_size);
-        offset = align_offset(offset, 8);
-
-        ret = bdrv_pwrite(bs->file, offset, &h, sizeof(h));
-        if (ret < 0) {
-            goto fail;
-        }
-        offset += sizeof(h);
-
-        ret = bdrv_pwrite(bs->file, offset, &extra, sizeof(extra));
+        ret = qcow2_write_snapshot_entry(bs, &s->snapshots[i], &offset);
         if (ret < 0) {
             goto fail;
         }
-        offset += sizeof(extra);
-
-        ret = bdrv_pwrite(bs->file, offset, sn->id_str, id_str_size);
-        if (ret < 0) {
-            goto fail;
-        }
-        offset += id_str_size;
-
-        ret = bdrv_pwrite(bs->file, offset, sn->name, name_size);
-        if (ret < 0) {
-            goto fail;
-        }
-        offset += name_size;
     }
 
     /*
@@ -246,9 +267,6 @@ static int qcow2_write_snapshots(BlockDriverState *bs)
         goto fail;
     }
 
-    QEMU_BUILD_BUG_ON(offsetof(QCowHeader, snapshots_offset) !=
-        offsetof(QCowHeader, nb_snapshots) + sizeof(header_data.nb_snapshots));
-
     header_data.nb_snapshots        = cpu_to_be32(s->nb_snapshots);
     header_data.snapshots_offset    = cpu_to_be64(snapshots_offset);
 
@@ -268,6 +286,54 @@ fail:
     return ret;
 }
 
+/*
+ * Add the last entry of s->snapshots to the snapshot table on disk.
+ *
+ * If it fits into the clusters the current table already occupies, only the
+ * new entry and the snapshot count in the header are written: until the
+ * header update, the bytes after the old end of the table are ignored.
+ * Otherwise the whole table is rewritten to a new location.
+ */
+static int qcow2_append_snapshot(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    QCowSnapshot *sn = &s->snapshots[s->nb_snapshots - 1];
+    uint32_t nb_snapshots;
+    int64_t offset, end;
+    int ret;
+
+    if (s->nb_snapshots == 1 || s->snapshots_offset == 0) {
+        return qcow2_write_snapshots(bs);
+    }
+
+    offset = s->snapshots_offset + align_offset(s->snapshots_size, 8);
+    end = offset + snapshot_entry_size(sn);
+    if (size_to_clusters(s, end - s->snapshots_offset) !=
+        size_to_clusters(s, s->snapshots_size)) {
+        return qcow2_write_snapshots(bs);
+    }
+
+    ret = qcow2_write_snapshot_entry(bs, sn, &offset);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bdrv_flush(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    nb_snapshots = cpu_to_be32(s->nb_snapshots);
+    ret = bdrv_pwrite_sync(bs->file, offsetof(QCowHeader, nb_snapshots),
+                           &nb_snapshots, sizeof(nb_snapshots));
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->snapshots_size = end - s->snapshots_offset;
+    return 0;
+}
+
 static void find_new_snapshot_id(BlockDriverState *bs,
                                  char *id_str, int id_str_size)
 {
@@ -324,6 +390,8 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
 
     memset(sn, 0, sizeof(*sn));
 
+    qcow2_wait_snapshot_releases(bs);
+
     /* Generate an ID if it wasn't passed */
     if (sn_info->id_str[0] == '\0') {
         find_new_snapshot_id(bs, sn_info->id_str, sizeof(sn_info->id_str));
@@ -393,10 +461,11 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
     s->snapshots = new_snapshot_list;
     s->snapshots[s->nb_snapshots++] = *sn;
 
-    ret = qcow2_write_snapshots(bs);
+    ret = qcow2_append_snapshot(bs);
     if (ret < 0) {
         g_free(s->snapshots);
         s->snapshots = old_snapshot_list;
+        s->nb_snapshots--;
         goto fail;
     }
 
@@ -428,6 +497,8 @@ int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
     int ret;
     uint64_t *sn_l1_table = NULL;
 
+    qcow2_wait_snapshot_releases(bs);
+
     /* Search the snapshot */
     snapshot_index = find_snapshot_by_id_or_name(bs, snapshot_id);
     if (snapshot_index < 0) {
@@ -538,6 +609,8 @@ int qcow2_snapshot_delete(BlockDriverState *bs, const char *snapshot_id)
     QCowSnapshot sn;
     int snapshot_index, ret;
 
+    qcow2_wait_snapshot_releases(bs);
+
     /* Search the snapshot */
     snapshot_index = find_snapshot_by_id_or_name(bs, snapshot_id);
     if (snapshot_index < 0) {
@@ -563,25 +636,16 @@ int qcow2_snapshot_delete(BlockDriverState *bs, const char *snapshot_id)
     g_free(sn.name);
 
     /*
-     * Now decrease the refcounts of clusters referenced by the snapshot and
-     * free the L1 table.
+     * Decreasing the refcounts of clusters referenced by the snapshot, freeing
+     * its L1 table and updating the copied flag on the current cluster
+     * offsets is done in the background.
      */
-    ret = qcow2_update_snapshot_refcount(bs, sn.l1_table_offset,
-                                         sn.l1_size, -1);
-    if (ret < 0) {
-        return ret;
-    }
-    qcow2_free_clusters(bs, sn.l1_table_offset, sn.l1_size * sizeof(uint64_t));
-
-    /* must update the copied flag on the current cluster offsets */
-    ret = qcow2_update_snapshot_refcount(bs, s->l1_table_offset, s->l1_size, 0);
-    if (ret < 0) {
-        return ret;
-    }
+    qcow2_release_snapshot_refcounts(bs, sn.l1_table_offset, sn.l1_size);
 
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
+        qcow2_wait_snapshot_releases(bs);
         qcow2_check_refcounts(bs, &result, 0);
     }
 #endif
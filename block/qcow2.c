@@ -29,6 +29,7 @@
 #include "block/qcow2.h"
 #include "qemu-error.h"
 #include "qerror.h"
+#include "qemu-thread.h"
 #include "trace.h"
 
 /*
@@ -56,6 +57,7 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_END 0
 #define  QCOW2_EXT_MAGIC_BACKING_FORMAT 0xE2792ACA
 #define  QCOW2_EXT_MAGIC_FEATURE_TABLE 0x6803f857
+#define  QCOW2_EXT_MAGIC_DIRTY_BITMAPS 0x23852875
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
@@ -148,6 +150,24 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             break;
 
+        case QCOW2_EXT_MAGIC_DIRTY_BITMAPS:
+            /* Without the autoclear bit, the image was written by someone
+             * who did not update the bitmaps; drop them */
+            if (p_feature_table == NULL &&
+                (s->autoclear_features & QCOW2_AUTOCLEAR_BITMAPS)) {
+                uint8_t *data = g_malloc(ext.len);
+
+                ret = bdrv_pread(bs->file, offset, data, ext.len);
+                if (ret >= 0) {
+                    ret = qcow2_read_bitmap_ext(bs, data, ext.len);
+                }
+                g_free(data);
+                if (ret < 0) {
+                    s->autoclear_features &= ~QCOW2_AUTOCLEAR_BITMAPS;
+                }
+            }
+            break;
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             {
@@ -271,10 +291,79 @@ static int qcow2_mark_clean(BlockDriverState *bs)
     return 0;
 }
 
+/*
+ * With lazy refcounts, allocating writes only mark the image dirty instead
+ * of ordering their metadata updates with flushes, so that sequential
+ * allocations keep streaming and a whole burst costs one header update.
+ * When allocating writes have been idle for QCOW2_NEED_CHECK_TIMEOUT seconds
+ * the metadata caches are written back and the image is marked clean again;
+ * only a crash during a burst of allocations requires a repair.
+ */
+#define QCOW2_NEED_CHECK_TIMEOUT 5 /* in seconds */
+
+static void coroutine_fn qcow2_need_check_co(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    /* Holding the lock plugs new allocating writes until we are done */
+    qemu_co_mutex_lock(&s->lock);
+    if (s->nb_allocating_writes == 0 &&
+        (s->incompatible_features & QCOW2_INCOMPAT_DIRTY)) {
+        ret = qcow2_cache_flush(bs, s->l2_table_cache);
+        if (ret == 0) {
+            ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+        }
+        if (ret == 0) {
+            s->incompatible_features &= ~QCOW2_INCOMPAT_DIRTY;
+            ret = qcow2_update_header(bs);
+            if (ret < 0) {
+                s->incompatible_features |= QCOW2_INCOMPAT_DIRTY;
+            }
+        }
+    }
+    qemu_co_mutex_unlock(&s->lock);
+}
+
+static void qcow2_need_check_timer_cb(void *opaque)
+{
+    BDRVQcowState *s = opaque;
+    Coroutine *co;
+
+    co = qemu_coroutine_create(qcow2_need_check_co);
+    qemu_coroutine_enter(co, s->bs);
+}
+
+static void qcow2_allocating_write_done(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    assert(s->nb_allocating_writes > 0);
+    if (--s->nb_allocating_writes == 0 && s->need_check_timer &&
+        (s->incompatible_features & QCOW2_INCOMPAT_DIRTY)) {
+        /* Use vm_clock so we don't alter the image file while suspended for
+         * migration.
+         */
+        qemu_mod_timer(s->need_check_timer, qemu_get_clock_ns(vm_clock) +
+                       get_ticks_per_sec() * QCOW2_NEED_CHECK_TIMEOUT);
+    }
+}
+
+static void qcow2_rebind(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    s->bs = bs;
+}
+
 static int qcow2_check(BlockDriverState *bs, BdrvCheckResult *result,
                        BdrvCheckMode fix)
 {
-    int ret = qcow2_check_refcounts(bs, result, fix);
+    int ret;
+
+    qcow2_wait_snapshot_releases(bs);
+
+    ret = qcow2_check_refcounts(bs, result, fix);
     if (ret < 0) {
         return ret;
     }
@@ -285,6 +374,33 @@ static int qcow2_check(BlockDriverState *bs, BdrvCheckResult *result,
     return ret;
 }
 
+/* Create the L2 table and refcount block caches with the configured sizes */
+static void qcow2_create_caches(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int slice_bytes = s->l2_slice_size * l2_entry_size(s);
+    uint64_t l2_cache_size, refcount_cache_size;
+    int l2_entries, refcount_entries;
+
+    l2_cache_size = bs->l2_cache_size;
+    if (!l2_cache_size) {
+        l2_cache_size = (uint64_t)L2_CACHE_SIZE * s->cluster_size;
+    }
+    refcount_cache_size = bs->refcount_cache_size;
+    if (!refcount_cache_size) {
+        refcount_cache_size = (uint64_t)REFCOUNT_CACHE_SIZE * s->cluster_size;
+    }
+
+    l2_entries = MIN(l2_cache_size / slice_bytes, INT_MAX);
+    l2_entries = MAX(l2_entries, MIN_L2_CACHE_SIZE);
+    refcount_entries = MIN(refcount_cache_size / s->cluster_size, INT_MAX);
+    refcount_entries = MAX(refcount_entries, REFCOUNT_CACHE_SIZE);
+
+    s->l2_table_cache = qcow2_cache_create(bs, l2_entries, slice_bytes);
+    s->refcount_block_cache = qcow2_cache_create(bs, refcount_entries,
+                                                 s->cluster_size);
+}
+
 static int qcow2_open(BlockDriverState *bs, int flags)
 {
     BDRVQcowState *s = bs->opaque;
@@ -386,15 +502,27 @@ static int qcow2_open(BlockDriverState *bs, int flags)
         ret = -EINVAL;
         goto fail;
     }
+    s->extended_l2 = !!(s->incompatible_features & QCOW2_INCOMPAT_EXTL2);
+    if (s->extended_l2 && header.cluster_bits < MIN_EXTL2_CLUSTER_BITS) {
+        ret = -EINVAL;
+        goto fail;
+    }
     s->crypt_method_header = header.crypt_method;
     if (s->crypt_method_header) {
         bs->encrypted = 1;
     }
     s->cluster_bits = header.cluster_bits;
     s->cluster_size = 1 << s->cluster_bits;
+    bs->discard_granularity = s->cluster_size;
     s->cluster_sectors = 1 << (s->cluster_bits - 9);
-    s->l2_bits = s->cluster_bits - 3; /* L2 is always one cluster */
+    /* L2 is always one cluster, extended entries take 16 bytes */
+    s->l2_bits = s->cluster_bits - 3 - s->extended_l2;
     s->l2_size = 1 << s->l2_bits;
+    s->l2_slice_bits = MIN(s->cluster_bits, ffs(L2_SLICE_SIZE) - 1) - 3 -
+                       s->extended_l2;
+    s->l2_slice_size = 1 << s->l2_slice_bits;
+    s->subcluster_bits = s->cluster_bits - (ffs(QCOW_EXTL2_SUBCLUSTERS) - 1);
+    s->subcluster_sectors = 1 << (s->subcluster_bits - BDRV_SECTOR_BITS);
     bs->total_sectors = header.size / 512;
     s->csize_shift = (62 - (s->cluster_bits - 8));
     s->csize_mask = (1 << (s->cluster_bits - 8)) - 1;
@@ -430,14 +558,9 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     }
 
     /* alloc L2 table/refcount block cache */
-    s->l2_table_cache = qcow2_cache_create(bs, L2_CACHE_SIZE);
-    s->refcount_block_cache = qcow2_cache_create(bs, REFCOUNT_CACHE_SIZE);
-
-    s->cluster_cache = g_malloc(s->cluster_size);
-    /* one more sector for decompressed data alignment */
-    s->cluster_data = qemu_blockalign(bs, QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size
-                                  + 512);
-    s->cluster_cache_offset = -1;
+    qcow2_create_caches(bs);
+
+    qcow2_compressed_cache_init(bs);
     s->flags = flags;
 
     ret = qcow2_refcount_init(bs);
@@ -446,6 +569,7 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     }
 
     QLIST_INIT(&s->cluster_allocs);
+    QLIST_INIT(&s->l2_allocs);
 
     /* read qcow2 extensions */
     if (qcow2_read_extensions(bs, header.header_length, ext_end, NULL)) {
@@ -473,8 +597,8 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     }
 
     /* Clear unknown autoclear feature bits */
-    if (!bs->read_only && s->autoclear_features != 0) {
-        s->autoclear_features = 0;
+    if (!bs->read_only && (s->autoclear_features & ~QCOW2_AUTOCLEAR_MASK)) {
+        s->autoclear_features &= QCOW2_AUTOCLEAR_MASK;
         ret = qcow2_update_header(bs);
         if (ret < 0) {
             goto fail;
@@ -484,6 +608,12 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     /* Initialise locks */
     qemu_co_mutex_init(&s->lock);
 
+    s->bs = bs;
+    if (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS) {
+        s->need_check_timer = qemu_new_timer_ns(vm_clock,
+                                                qcow2_need_check_timer_cb, s);
+    }
+
     /* Repair image if dirty */
     if (!(flags & BDRV_O_CHECK) && !bs->read_only &&
         (s->incompatible_features & QCOW2_INCOMPAT_DIRTY)) {
@@ -495,6 +625,14 @@ static int qcow2_open(BlockDriverState *bs, int flags)
         }
     }
 
+    /* Load dirty bitmaps, freeing stale ones needs accurate refcounts */
+    if (s->nb_bitmaps) {
+        ret = qcow2_load_dirty_bitmaps(bs, bs->read_only);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
@@ -504,6 +642,11 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     return ret;
 
  fail:
+    if (s->need_check_timer) {
+        qemu_free_timer(s->need_check_timer);
+        s->need_check_timer = NULL;
+    }
+    qcow2_free_bitmaps(bs);
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
     qcow2_free_snapshots(bs);
@@ -512,8 +655,7 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     if (s->l2_table_cache) {
         qcow2_cache_destroy(bs, s->l2_table_cache);
     }
-    g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
+    qcow2_compressed_cache_destroy(bs);
     return ret;
 }
 
@@ -564,9 +706,37 @@ static int qcow2_set_key(BlockDriverState *bs, const char *key)
 static int qcow2_reopen_prepare(BDRVReopenState *state,
                                 BlockReopenQueue *queue, Error **errp)
 {
+    BlockDriverState *bs = state->bs;
+
+    /* Save the dirty bitmaps while the image is still writable */
+    if (!bs->read_only && !(state->flags & BDRV_O_RDWR)) {
+        qcow2_store_dirty_bitmaps(bs);
+    }
     return 0;
 }
 
+static void qcow2_reopen_commit(BDRVReopenState *state)
+{
+    BlockDriverState *bs = state->bs;
+    BDRVQcowState *s = bs->opaque;
+
+    /* bs->file is already writable, mark the loaded bitmaps in use */
+    if (bs->read_only && (state->flags & BDRV_O_RDWR) && s->nb_bitmaps) {
+        qcow2_load_dirty_bitmaps(bs, false);
+    }
+}
+
+static void qcow2_reopen_abort(BDRVReopenState *state)
+{
+    BlockDriverState *bs = state->bs;
+    BDRVQcowState *s = bs->opaque;
+
+    /* Staying writable, so the bitmaps saved in prepare are in use again */
+    if (!bs->read_only && !(state->flags & BDRV_O_RDWR) && s->nb_bitmaps) {
+        qcow2_load_dirty_bitmaps(bs, false);
+    }
+}
+
 static int coroutine_fn qcow2_co_is_allocated(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors, int *pnum)
 {
@@ -587,6 +757,32 @@ static int coroutine_fn qcow2_co_is_allocated(BlockDriverState *bs,
     return (cluster_offset != 0);
 }
 
+static int coroutine_fn qcow2_co_get_extent(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, int *pnum)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t cluster_offset;
+    int ret;
+
+    /* one lookup covers everything up to the end of the L2 slice */
+    *pnum = nb_sectors;
+    qemu_co_mutex_lock(&s->lock);
+    ret = qcow2_get_cluster_offset(bs, sector_num << 9, pnum, &cluster_offset);
+    qemu_co_mutex_unlock(&s->lock);
+
+    switch (ret) {
+    case QCOW2_CLUSTER_UNALLOCATED:
+        return BDRV_EXTENT_UNALLOCATED;
+    case QCOW2_CLUSTER_ZERO:
+        return BDRV_EXTENT_ZERO;
+    case QCOW2_CLUSTER_NORMAL:
+    case QCOW2_CLUSTER_COMPRESSED:
+        return BDRV_EXTENT_DATA;
+    default:
+        return ret;
+    }
+}
+
 /* handle reading after the end of the backing file */
 int qcow2_backing_read1(BlockDriverState *bs, QEMUIOVector *qiov,
                   int64_t sector_num, int nb_sectors)
@@ -672,17 +868,20 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
             qemu_iovec_memset(&hd_qiov, 0, 0, 512 * cur_nr_sectors);
             break;
 
-        case QCOW2_CLUSTER_COMPRESSED:
-            /* add AIO support for compressed blocks ? */
-            ret = qcow2_decompress_cluster(bs, cluster_offset);
+        case QCOW2_CLUSTER_COMPRESSED: {
+            uint8_t *data;
+
+            ret = qcow2_decompress_cluster(bs, sector_num << 9,
+                                           cluster_offset, &data);
             if (ret < 0) {
                 goto fail;
             }
 
             qemu_iovec_from_buf(&hd_qiov, 0,
-                s->cluster_cache + index_in_cluster * 512,
+                data + index_in_cluster * 512,
                 512 * cur_nr_sectors);
             break;
+        }
 
         case QCOW2_CLUSTER_NORMAL:
             if ((cluster_offset & 511) != 0) {
@@ -712,13 +911,15 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
             ret = bdrv_co_readv(bs->file,
                                 (cluster_offset >> 9) + index_in_cluster,
                                 cur_nr_sectors, &hd_qiov);
+            if (ret >= 0 && s->crypt_method) {
+                qcow2_co_encrypt_sectors(bs, sector_num, cluster_data,
+                    cur_nr_sectors, 0, &s->aes_decrypt_key);
+            }
             qemu_co_mutex_lock(&s->lock);
             if (ret < 0) {
                 goto fail;
             }
             if (s->crypt_method) {
-                qcow2_encrypt_sectors(s, sector_num,  cluster_data,
-                    cluster_data, cur_nr_sectors, 0, &s->aes_decrypt_key);
                 qemu_iovec_from_buf(qiov, bytes_done,
                     cluster_data, 512 * cur_nr_sectors);
             }
@@ -777,6 +978,7 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
     QCowL2Meta l2meta = {
         .nb_clusters = 0,
     };
+    bool allocating = false;
 
     trace_qcow2_writev_start_req(qemu_coroutine_self(), sector_num,
                                  remaining_sectors);
@@ -785,8 +987,6 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
-    s->cluster_cache_offset = -1; /* disable compressed cache */
-
     qemu_co_mutex_lock(&s->lock);
 
     while (remaining_sectors != 0) {
@@ -805,9 +1005,12 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
             goto fail;
         }
 
-        if (l2meta.nb_clusters > 0 &&
-            (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS)) {
-            qcow2_mark_dirty(bs);
+        if (l2meta.nb_clusters > 0) {
+            s->nb_allocating_writes++;
+            allocating = true;
+            if (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS) {
+                qcow2_mark_dirty(bs);
+            }
         }
 
         cluster_offset = l2meta.cluster_offset;
@@ -817,6 +1020,9 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
         qemu_iovec_concat(&hd_qiov, qiov, bytes_done,
             cur_nr_sectors * 512);
 
+        /* The clusters are reserved in l2meta; the data goes out without
+         * the lock, and so can the encryption.  */
+        qemu_co_mutex_unlock(&s->lock);
         if (s->crypt_method) {
             if (!cluster_data) {
                 cluster_data = qemu_blockalign(bs, QCOW_MAX_CRYPT_CLUSTERS *
@@ -827,8 +1033,8 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
                    QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
             qemu_iovec_to_buf(&hd_qiov, 0, cluster_data, hd_qiov.size);
 
-            qcow2_encrypt_sectors(s, sector_num, cluster_data,
-                cluster_data, cur_nr_sectors, 1, &s->aes_encrypt_key);
+            qcow2_co_encrypt_sectors(bs, sector_num, cluster_data,
+                cur_nr_sectors, 1, &s->aes_encrypt_key);
 
             qemu_iovec_reset(&hd_qiov);
             qemu_iovec_add(&hd_qiov, cluster_data,
@@ -836,7 +1042,6 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
         }
 
         BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
-        qemu_co_mutex_unlock(&s->lock);
         trace_qcow2_writev_data(qemu_coroutine_self(),
                                 (cluster_offset >> 9) + index_in_cluster);
         ret = bdrv_co_writev(bs->file,
@@ -853,6 +1058,10 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
         }
 
         run_dependent_requests(s, &l2meta);
+        if (allocating) {
+            qcow2_allocating_write_done(bs);
+            allocating = false;
+        }
 
         remaining_sectors -= cur_nr_sectors;
         sector_num += cur_nr_sectors;
@@ -863,6 +1072,9 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
 
 fail:
     run_dependent_requests(s, &l2meta);
+    if (allocating) {
+        qcow2_allocating_write_done(bs);
+    }
 
     qemu_co_mutex_unlock(&s->lock);
 
@@ -876,8 +1088,22 @@ fail:
 static void qcow2_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+
+    qcow2_wait_snapshot_releases(bs);
+
+    if (!bs->read_only) {
+        qcow2_store_dirty_bitmaps(bs);
+    }
+    qcow2_free_bitmaps(bs);
+
     g_free(s->l1_table);
 
+    if (s->need_check_timer) {
+        qemu_del_timer(s->need_check_timer);
+        qemu_free_timer(s->need_check_timer);
+        s->need_check_timer = NULL;
+    }
+
     qcow2_cache_flush(bs, s->l2_table_cache);
     qcow2_cache_flush(bs, s->refcount_block_cache);
 
@@ -889,12 +1115,33 @@ static void qcow2_close(BlockDriverState *bs)
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
 
-    g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
+    qcow2_compressed_cache_destroy(bs);
     qcow2_refcount_close(bs);
     qcow2_free_snapshots(bs);
 }
 
+static int qcow2_update_cache_size(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    /* Write back all dirty tables before the caches are replaced */
+    ret = qcow2_cache_flush(bs, s->l2_table_cache);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        return ret;
+    }
+
+    qcow2_cache_destroy(bs, s->l2_table_cache);
+    qcow2_cache_destroy(bs, s->refcount_block_cache);
+    qcow2_create_caches(bs);
+
+    return 0;
+}
+
 static void qcow2_invalidate_cache(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
@@ -1052,11 +1299,21 @@ int qcow2_update_header(BlockDriverState *bs)
             .bit  = QCOW2_INCOMPAT_DIRTY_BITNR,
             .name = "dirty bit",
         },
+        {
+            .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+            .bit  = QCOW2_INCOMPAT_EXTL2_BITNR,
+            .name = "extended L2 entries",
+        },
         {
             .type = QCOW2_FEAT_TYPE_COMPATIBLE,
             .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
             .name = "lazy refcounts",
         },
+        {
+            .type = QCOW2_FEAT_TYPE_AUTOCLEAR,
+            .bit  = QCOW2_AUTOCLEAR_BITMAPS_BITNR,
+            .name = "dirty bitmaps",
+        },
     };
 
     ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
@@ -1067,6 +1324,22 @@ int qcow2_update_header(BlockDriverState *bs)
     buf += ret;
     buflen -= ret;
 
+    /* Dirty bitmaps header extension */
+    if (s->nb_bitmaps) {
+        size_t bitmap_ext_size = qcow2_bitmap_ext_size(bs);
+        uint8_t *bitmap_ext = g_malloc(bitmap_ext_size);
+
+        qcow2_build_bitmap_ext(bs, bitmap_ext);
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_DIRTY_BITMAPS,
+                             bitmap_ext, bitmap_ext_size, buflen);
+        g_free(bitmap_ext);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Keep unknown header extensions */
     QLIST_FOREACH(uext, &s->unknown_header_ext, next) {
         ret = header_ext_add(buf, uext->magic, uext->data, uext->len, buflen);
@@ -1245,6 +1518,10 @@ static int qcow2_create2(const char *filename, int64_t total_size,
             cpu_to_be64(QCOW2_COMPAT_LAZY_REFCOUNTS);
     }
 
+    if (flags & BLOCK_FLAG_EXTL2) {
+        header.incompatible_features |= cpu_to_be64(QCOW2_INCOMPAT_EXTL2);
+    }
+
     ret = bdrv_pwrite(bs, 0, &header, sizeof(header));
     if (ret < 0) {
         goto out;
@@ -1360,6 +1637,8 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options)
             }
         } else if (!strcmp(options->name, BLOCK_OPT_LAZY_REFCOUNTS)) {
             flags |= options->value.n ? BLOCK_FLAG_LAZY_REFCOUNTS : 0;
+        } else if (!strcmp(options->name, BLOCK_OPT_EXTL2)) {
+            flags |= options->value.n ? BLOCK_FLAG_EXTL2 : 0;
         }
         options++;
     }
@@ -1376,10 +1655,121 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options)
         return -EINVAL;
     }
 
+    if (flags & BLOCK_FLAG_EXTL2) {
+        if (version < 3) {
+            fprintf(stderr, "Extended L2 entries only supported with "
+                    "compatibility level 1.1 and above (use compat=1.1 or "
+                    "greater)\n");
+            return -EINVAL;
+        }
+        if (cluster_size < (1 << MIN_EXTL2_CLUSTER_BITS)) {
+            fprintf(stderr, "Extended L2 entries need a cluster size of at "
+                    "least %dk\n", 1 << (MIN_EXTL2_CLUSTER_BITS - 10));
+            return -EINVAL;
+        }
+    }
+
     return qcow2_create2(filename, sectors, backing_file, backing_fmt, flags,
                          cluster_size, prealloc, options, version);
 }
 
+/*
+ * Returns the number of clusters that the refcount table and the refcount
+ * blocks take in an image with 'clusters' other clusters.
+ */
+static int64_t qcow2_refcount_clusters(int64_t clusters, int cluster_bits)
+{
+    int64_t blocks = 0, table = 0, last;
+
+    do {
+        last = blocks + table;
+        blocks = DIV_ROUND_UP(clusters + last,
+                              1 << (cluster_bits - REFCOUNT_SHIFT));
+        table = DIV_ROUND_UP(blocks * sizeof(uint64_t), 1 << cluster_bits);
+    } while (blocks + table != last);
+
+    return last;
+}
+
+static int qcow2_measure(QEMUOptionParameter *options, BlockDriverState *in_bs,
+                         BlockMeasureInfo *info)
+{
+    uint64_t size = 0;
+    size_t cluster_size = DEFAULT_CLUSTER_SIZE;
+    int cluster_bits, l2_entries;
+    int prealloc = 0;
+    bool extended_l2 = false;
+    int64_t nb_clusters, nb_l2, fixed, used, full;
+
+    /* Read out options */
+    while (options && options->name) {
+        if (!strcmp(options->name, BLOCK_OPT_SIZE)) {
+            size = options->value.n;
+        } else if (!strcmp(options->name, BLOCK_OPT_CLUSTER_SIZE)) {
+            if (options->value.n) {
+                cluster_size = options->value.n;
+            }
+        } else if (!strcmp(options->name, BLOCK_OPT_PREALLOC)) {
+            if (!options->value.s || !strcmp(options->value.s, "off")) {
+                prealloc = 0;
+            } else if (!strcmp(options->value.s, "metadata")) {
+                prealloc = 1;
+            } else {
+                fprintf(stderr, "Invalid preallocation mode: '%s'\n",
+                    options->value.s);
+                return -EINVAL;
+            }
+        } else if (!strcmp(options->name, BLOCK_OPT_EXTL2)) {
+            extended_l2 = options->value.n;
+        }
+        options++;
+    }
+
+    cluster_bits = ffs(cluster_size) - 1;
+    if (cluster_bits < MIN_CLUSTER_BITS || cluster_bits > MAX_CLUSTER_BITS ||
+        (1 << cluster_bits) != cluster_size)
+    {
+        error_report(
+            "Cluster size must be a power of two between %d and %dk",
+            1 << MIN_CLUSTER_BITS, 1 << (MAX_CLUSTER_BITS - 10));
+        return -EINVAL;
+    }
+
+    /* Header and L1 table are always there, refcounts come on top */
+    l2_entries = cluster_size / (extended_l2 ? 2 * sizeof(uint64_t)
+                                             : sizeof(uint64_t));
+    nb_clusters = DIV_ROUND_UP(size, cluster_size);
+    nb_l2 = DIV_ROUND_UP(nb_clusters, l2_entries);
+    fixed = 1 + DIV_ROUND_UP(nb_l2 * sizeof(uint64_t), cluster_size);
+
+    full = fixed + nb_l2 + nb_clusters;
+    info->fully_allocated =
+        (full + qcow2_refcount_clusters(full, cluster_bits)) << cluster_bits;
+
+    if (prealloc) {
+        info->required = info->fully_allocated;
+        return 0;
+    }
+
+    used = fixed;
+    if (in_bs) {
+        int64_t data, l2;
+
+        data = bdrv_get_data_size(in_bs, cluster_size);
+        if (data < 0) {
+            return data;
+        }
+        l2 = bdrv_get_data_size(in_bs, (int64_t)cluster_size * l2_entries);
+        if (l2 < 0) {
+            return l2;
+        }
+        used += (data >> cluster_bits) + l2 / cluster_size / l2_entries;
+    }
+    info->required =
+        (used + qcow2_refcount_clusters(used, cluster_bits)) << cluster_bits;
+    return 0;
+}
+
 static int qcow2_make_empty(BlockDriverState *bs)
 {
 #if 0
@@ -1438,6 +1828,8 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
     BDRVQcowState *s = bs->opaque;
     int ret, new_l1_size;
 
+    qcow2_wait_snapshot_releases(bs);
+
     if (offset & 511) {
         error_report("The new size must be a multiple of 512");
         return -EINVAL;
@@ -1473,14 +1865,73 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
     return 0;
 }
 
+/* Threads qcow2_write_compressed() spreads its clusters over */
+#define QCOW2_COMPRESS_THREADS 4
+
+typedef struct Qcow2CompressJob {
+    const uint8_t *buf;
+    uint8_t *out_buf;
+    int *out_len;
+    int cluster_size;
+    int first, last;
+} Qcow2CompressJob;
+
+/* Returns the compressed size, 0 if the data does not shrink, or -errno */
+static int qcow2_compress(uint8_t *dest, const uint8_t *src, int size)
+{
+    z_stream strm;
+    int ret, out_len;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+                       Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != 0) {
+        return -EINVAL;
+    }
+
+    strm.avail_in = size;
+    strm.next_in = (uint8_t *)src;
+    strm.avail_out = size;
+    strm.next_out = dest;
+
+    ret = deflate(&strm, Z_FINISH);
+    out_len = strm.next_out - dest;
+    deflateEnd(&strm);
+
+    if (ret != Z_STREAM_END && ret != Z_OK) {
+        return -EINVAL;
+    }
+    if (ret != Z_STREAM_END || out_len >= size) {
+        return 0;
+    }
+    return out_len;
+}
+
+static void *qcow2_compress_thread(void *opaque)
+{
+    Qcow2CompressJob *job = opaque;
+    int i;
+
+    for (i = job->first; i < job->last; i++) {
+        job->out_len[i] = qcow2_compress(job->out_buf + i * job->cluster_size,
+                                         job->buf + i * job->cluster_size,
+                                         job->cluster_size);
+    }
+    return NULL;
+}
+
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
 static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
                                   const uint8_t *buf, int nb_sectors)
 {
     BDRVQcowState *s = bs->opaque;
-    z_stream strm;
-    int ret, out_len;
+    Qcow2CompressJob jobs[QCOW2_COMPRESS_THREADS];
+    QemuThread threads[QCOW2_COMPRESS_THREADS];
+    int ret, i, nb_clusters, nb_threads;
+    int *out_len;
     uint8_t *out_buf;
     uint64_t cluster_offset;
 
@@ -1493,59 +1944,70 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
         return 0;
     }
 
-    if (nb_sectors != s->cluster_sectors)
+    if (nb_sectors % s->cluster_sectors) {
         return -EINVAL;
-
-    out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
-
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
     }
 
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
+    qcow2_compressed_cache_invalidate(bs);
 
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
-        goto fail;
+    /* Compress all clusters first, spread over a few threads, then write
+     * them out in order so they stay packed on disk.  */
+    nb_clusters = nb_sectors / s->cluster_sectors;
+    nb_threads = MIN(nb_clusters, QCOW2_COMPRESS_THREADS);
+    out_buf = g_malloc((size_t)nb_clusters * s->cluster_size);
+    out_len = g_new(int, nb_clusters);
+    for (i = 0; i < nb_threads; i++) {
+        jobs[i] = (Qcow2CompressJob) {
+            .buf            = buf,
+            .out_buf        = out_buf,
+            .out_len        = out_len,
+            .cluster_size   = s->cluster_size,
+            .first          = nb_clusters * i / nb_threads,
+            .last           = nb_clusters * (i + 1) / nb_threads,
+        };
+    }
+    for (i = 1; i < nb_threads; i++) {
+        qemu_thread_create(&threads[i], qcow2_compress_thread, &jobs[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    qcow2_compress_thread(&jobs[0]);
+    for (i = 1; i < nb_threads; i++) {
+        qemu_thread_join(&threads[i]);
     }
-    out_len = strm.next_out - out_buf;
 
-    deflateEnd(&strm);
+    for (i = 0; i < nb_clusters; i++) {
+        int64_t cluster_sector = sector_num + i * s->cluster_sectors;
 
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
-        /* could not compress: write normal cluster */
-        ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
-        if (ret < 0) {
-            goto fail;
-        }
-    } else {
-        cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
-            sector_num << 9, out_len);
-        if (!cluster_offset) {
-            ret = -EIO;
-            goto fail;
-        }
-        cluster_offset &= s->cluster_offset_mask;
-        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
-        ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
+        ret = out_len[i];
         if (ret < 0) {
             goto fail;
+        } else if (ret == 0) {
+            /* could not compress: write normal cluster */
+            ret = bdrv_write(bs, cluster_sector, buf + i * s->cluster_size,
+                             s->cluster_sectors);
+            if (ret < 0) {
+                goto fail;
+            }
+        } else {
+            cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
+                cluster_sector << 9, out_len[i]);
+            if (!cluster_offset) {
+                ret = -EIO;
+                goto fail;
+            }
+            cluster_offset &= s->cluster_offset_mask;
+            BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
+            ret = bdrv_pwrite(bs->file, cluster_offset,
+                              out_buf + i * s->cluster_size, out_len[i]);
+            if (ret < 0) {
+                goto fail;
+            }
         }
     }
 
     ret = 0;
 fail:
+    g_free(out_len);
     g_free(out_buf);
     return ret;
 }
@@ -1680,6 +2142,11 @@ static QEMUOptionParameter qcow2_create_options[] = {
         .type = OPT_FLAG,
         .help = "Postpone refcount updates",
     },
+    {
+        .name = BLOCK_OPT_EXTL2,
+        .type = OPT_FLAG,
+        .help = "Track allocation of subclusters in the L2 tables",
+    },
     { NULL }
 };
 
@@ -1689,9 +2156,14 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_probe         = qcow2_probe,
     .bdrv_open          = qcow2_open,
     .bdrv_close         = qcow2_close,
+    .bdrv_rebind          = qcow2_rebind,
     .bdrv_reopen_prepare  = qcow2_reopen_prepare,
+    .bdrv_reopen_commit   = qcow2_reopen_commit,
+    .bdrv_reopen_abort    = qcow2_reopen_abort,
     .bdrv_create        = qcow2_create,
+    .bdrv_measure       = qcow2_measure,
     .bdrv_co_is_allocated = qcow2_co_is_allocated,
+    .bdrv_co_get_extent = qcow2_co_get_extent,
     .bdrv_set_key       = qcow2_set_key,
     .bdrv_make_empty    = qcow2_make_empty,
 
@@ -1702,6 +2174,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_co_write_zeroes   = qcow2_co_write_zeroes,
     .bdrv_co_discard        = qcow2_co_discard,
     .bdrv_truncate          = qcow2_truncate,
+    .bdrv_update_cache_size = qcow2_update_cache_size,
     .bdrv_write_compressed  = qcow2_write_compressed,
 
     .bdrv_snapshot_create   = qcow2_snapshot_create,
@@ -1720,6 +2193,7 @@ static BlockDriver bdrv_qcow2 = {
 
     .create_options = qcow2_create_options,
     .bdrv_check = qcow2_check,
+    .bdrv_can_persist_dirty_bitmaps = qcow2_can_persist_dirty_bitmaps,
 };
 
 static void bdrv_qcow2_init(void)
@@ -39,6 +39,14 @@
 
 #define QCOW_MAX_CRYPT_CLUSTERS 32
 
+/* Decompressed clusters kept in memory: as many as fit in
+ * QCOW2_COMPRESSED_CACHE_BYTES, but at least 2 and at most 16 */
+#define QCOW2_COMPRESSED_CACHE_BYTES (1024 * 1024)
+#define QCOW2_COMPRESSED_CACHE_MAX   16
+/* Compressed clusters stored right after the one being read that are read
+ * and decompressed along with it */
+#define QCOW2_COMPRESSED_READAHEAD   4
+
 /* indicate that the refcount of the referenced cluster is exactly one. */
 #define QCOW_OFLAG_COPIED     (1LL << 63)
 /* indicate that the cluster is compressed (they never have the copied flag) */
@@ -46,12 +54,31 @@
 /* The cluster reads as all zeros */
 #define QCOW_OFLAG_ZERO (1LL << 0)
 
+/* Number of subclusters in a cluster with extended L2 entries */
+#define QCOW_EXTL2_SUBCLUSTERS 32
+
+/* Bits in the subcluster bitmap of an extended L2 entry */
+#define QCOW_L2_BITMAP_ALL_ALLOC  0x00000000ffffffffULL
+#define QCOW_L2_BITMAP_ALL_ZERO   0xffffffff00000000ULL
+#define QCOW_L2_BITMAP_ALLOC(sc)  (1ULL << (sc))
+#define QCOW_L2_BITMAP_ZERO(sc)   (1ULL << ((sc) + 32))
+
+/* Extended L2 entries need subclusters of at least one sector */
+#define MIN_EXTL2_CLUSTER_BITS 14
+
 #define REFCOUNT_SHIFT 1 /* refcount size is 2 bytes */
 
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
 
+/* Default size of the L2 cache, in clusters.  The cache holds slices of
+ * at most L2_SLICE_SIZE bytes, so that only the hot parts of the tables take
+ * up memory. */
 #define L2_CACHE_SIZE 16
+#define L2_SLICE_SIZE 4096
+
+/* Copying an L2 table needs two slices at a time */
+#define MIN_L2_CACHE_SIZE 2
 
 /* Must be at least 4 to cover all cases of refcount table growth */
 #define REFCOUNT_CACHE_SIZE 4
@@ -113,9 +140,12 @@ enum {
 /* Incompatible feature bits */
 enum {
     QCOW2_INCOMPAT_DIRTY_BITNR   = 0,
+    QCOW2_INCOMPAT_EXTL2_BITNR   = 4,
     QCOW2_INCOMPAT_DIRTY         = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
+    QCOW2_INCOMPAT_EXTL2         = 1 << QCOW2_INCOMPAT_EXTL2_BITNR,
 
-    QCOW2_INCOMPAT_MASK          = QCOW2_INCOMPAT_DIRTY,
+    QCOW2_INCOMPAT_MASK          = QCOW2_INCOMPAT_DIRTY
+                                 | QCOW2_INCOMPAT_EXTL2,
 };
 
 /* Compatible feature bits */
@@ -126,18 +156,57 @@ enum {
     QCOW2_COMPAT_FEAT_MASK            = QCOW2_COMPAT_LAZY_REFCOUNTS,
 };
 
+/* Autoclear feature bits */
+enum {
+    QCOW2_AUTOCLEAR_BITMAPS_BITNR   = 0,
+    QCOW2_AUTOCLEAR_BITMAPS         = 1 << QCOW2_AUTOCLEAR_BITMAPS_BITNR,
+
+    QCOW2_AUTOCLEAR_MASK            = QCOW2_AUTOCLEAR_BITMAPS,
+};
+
+/* Flags of a dirty bitmap directory entry */
+enum {
+    QCOW2_BITMAP_IN_USE             = 1 << 0,
+};
+
+#define QCOW2_MIN_BITMAP_GRANULARITY_BITS 9
+#define QCOW2_MAX_BITMAP_GRANULARITY_BITS 26
+
+/* An entry of the dirty bitmaps header extension */
+typedef struct Qcow2Bitmap {
+    char *name;
+    uint64_t data_offset;
+    uint64_t data_size;
+    uint32_t flags;
+    int granularity_bits;
+} Qcow2Bitmap;
+
 typedef struct Qcow2Feature {
     uint8_t type;
     uint8_t bit;
     char    name[46];
 } QEMU_PACKED Qcow2Feature;
 
+typedef struct Qcow2CompressedCluster {
+    uint64_t coffset;       /* host offset of the compressed data, -1 if free */
+    uint8_t *data;          /* decompressed cluster, allocated on first use */
+    uint64_t lru_counter;
+    bool loading;           /* being read or decompressed */
+    bool stale;             /* invalidated while loading */
+    CoQueue waiters;        /* readers waiting for the load to finish */
+} Qcow2CompressedCluster;
+
 typedef struct BDRVQcowState {
     int cluster_bits;
     int cluster_size;
     int cluster_sectors;
     int l2_bits;
     int l2_size;
+    int l2_slice_bits;
+    int l2_slice_size;
+    bool extended_l2;
+    int subcluster_bits;
+    int subcluster_sectors;
     int l1_size;
     int l1_vm_state_index;
     int csize_shift;
@@ -149,10 +218,11 @@ typedef struct BDRVQcowState {
     Qcow2Cache* l2_table_cache;
     Qcow2Cache* refcount_block_cache;
 
-    uint8_t *cluster_cache;
-    uint8_t *cluster_data;
-    uint64_t cluster_cache_offset;
+    Qcow2CompressedCluster compressed_cache[QCOW2_COMPRESSED_CACHE_MAX];
+    int compressed_cache_size;
+    uint64_t compressed_lru_counter;
     QLIST_HEAD(QCowClusterAlloc, QCowL2Meta) cluster_allocs;
+    QLIST_HEAD(QCowL2AllocList, QCowL2Alloc) l2_allocs;
 
     uint64_t *refcount_table;
     uint64_t refcount_table_offset;
@@ -162,6 +232,12 @@ typedef struct BDRVQcowState {
 
     CoMutex lock;
 
+    /* Lazy refcounts: allocating writes in flight, and the timer that marks
+     * the image clean once they have been idle for a while */
+    BlockDriverState *bs;
+    int nb_allocating_writes;
+    QEMUTimer *need_check_timer;
+
     uint32_t crypt_method; /* current crypt method, 0 if no key yet */
     uint32_t crypt_method_header;
     AES_KEY aes_encrypt_key;
@@ -170,6 +246,7 @@ typedef struct BDRVQcowState {
     int snapshots_size;
     int nb_snapshots;
     QCowSnapshot *snapshots;
+    int snapshot_releases; /* deleted snapshots still being freed */
 
     int flags;
     int qcow_version;
@@ -178,6 +255,9 @@ typedef struct BDRVQcowState {
     uint64_t compatible_features;
     uint64_t autoclear_features;
 
+    int nb_bitmaps;
+    Qcow2Bitmap *bitmaps;
+
     size_t unknown_header_fields_size;
     void* unknown_header_fields;
     QLIST_HEAD(, Qcow2UnknownHeaderExtension) unknown_header_ext;
@@ -205,11 +285,30 @@ typedef struct QCowL2Meta
     int n_start;
     int nb_available;
     int nb_clusters;
+
+    /* Sectors [cow_start, n_start) and [nb_available, cow_end) are copied */
+    int cow_start;
+    int cow_end;
+
+    /* Only the touched subclusters are copied and marked allocated */
+    bool subcluster_cow;
+    /* The write goes to the existing cluster, which must not be freed */
+    bool keep_old_cluster;
+
     CoQueue dependent_requests;
 
     QLIST_ENTRY(QCowL2Meta) next_in_flight;
 } QCowL2Meta;
 
+/* An empty L2 table being written while s->lock is dropped */
+typedef struct QCowL2Alloc
+{
+    int l1_index;
+    CoQueue dependent_requests;
+
+    QLIST_ENTRY(QCowL2Alloc) next_in_flight;
+} QCowL2Alloc;
+
 enum {
     QCOW2_CLUSTER_UNALLOCATED,
     QCOW2_CLUSTER_NORMAL,
@@ -228,6 +327,43 @@ static inline int size_to_clusters(BDRVQcowState *s, int64_t size)
     return (size + (s->cluster_size - 1)) >> s->cluster_bits;
 }
 
+/* Index of the L2 entry for offset in its cached slice */
+static inline int offset_to_l2_slice_index(BDRVQcowState *s, int64_t offset)
+{
+    return (offset >> s->cluster_bits) & (s->l2_slice_size - 1);
+}
+
+/* Size of an L2 entry in bytes (the entry plus its subcluster bitmap) */
+static inline int l2_entry_size(BDRVQcowState *s)
+{
+    return s->extended_l2 ? 2 * sizeof(uint64_t) : sizeof(uint64_t);
+}
+
+static inline uint64_t get_l2_entry(BDRVQcowState *s, uint64_t *l2_table,
+                                    int idx)
+{
+    return be64_to_cpu(l2_table[s->extended_l2 ? 2 * idx : idx]);
+}
+
+static inline void set_l2_entry(BDRVQcowState *s, uint64_t *l2_table,
+                                int idx, uint64_t entry)
+{
+    l2_table[s->extended_l2 ? 2 * idx : idx] = cpu_to_be64(entry);
+}
+
+static inline uint64_t get_l2_bitmap(BDRVQcowState *s, uint64_t *l2_table,
+                                     int idx)
+{
+    return s->extended_l2 ? be64_to_cpu(l2_table[2 * idx + 1]) : 0;
+}
+
+static inline void set_l2_bitmap(BDRVQcowState *s, uint64_t *l2_table,
+                                 int idx, uint64_t bitmap)
+{
+    assert(s->extended_l2);
+    l2_table[2 * idx + 1] = cpu_to_be64(bitmap);
+}
+
 static inline int size_to_l1(BDRVQcowState *s, int64_t size)
 {
     int shift = s->cluster_bits + s->l2_bits;
@@ -253,6 +389,22 @@ static inline int qcow2_get_cluster_type(uint64_t l2_entry)
     }
 }
 
+/*
+ * Type of subcluster sc in a cluster with extended L2 entries. Allocated
+ * subclusters are returned as QCOW2_CLUSTER_NORMAL even if the entry has no
+ * host offset; callers must check this.
+ */
+static inline int qcow2_get_subcluster_type(uint64_t l2_bitmap, int sc)
+{
+    if (l2_bitmap & QCOW_L2_BITMAP_ALLOC(sc)) {
+        return QCOW2_CLUSTER_NORMAL;
+    } else if (l2_bitmap & QCOW_L2_BITMAP_ZERO(sc)) {
+        return QCOW2_CLUSTER_ZERO;
+    } else {
+        return QCOW2_CLUSTER_UNALLOCATED;
+    }
+}
+
 /* Check whether refcounts are eager or lazy */
 static inline bool qcow2_need_accurate_refcounts(BDRVQcowState *s)
 {
@@ -279,6 +431,9 @@ void qcow2_free_clusters(BlockDriverState *bs,
 void qcow2_free_any_clusters(BlockDriverState *bs,
     uint64_t cluster_offset, int nb_clusters);
 
+void qcow2_release_snapshot_refcounts(BlockDriverState *bs,
+    int64_t l1_table_offset, int l1_size);
+void qcow2_wait_snapshot_releases(BlockDriverState *bs);
 int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     int64_t l1_table_offset, int l1_size, int addend);
 
@@ -288,11 +443,21 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
 /* qcow2-cluster.c functions */
 int qcow2_grow_l1_table(BlockDriverState *bs, int min_size, bool exact_size);
 void qcow2_l2_cache_reset(BlockDriverState *bs);
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset);
+int coroutine_fn qcow2_decompress_cluster(BlockDriverState *bs,
+                                          uint64_t offset,
+                                          uint64_t cluster_offset,
+                                          uint8_t **data);
+void qcow2_compressed_cache_init(BlockDriverState *bs);
+void qcow2_compressed_cache_invalidate(BlockDriverState *bs);
+void qcow2_compressed_cache_destroy(BlockDriverState *bs);
 void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
                      uint8_t *out_buf, const uint8_t *in_buf,
                      int nb_sectors, int enc,
                      const AES_KEY *key);
+void coroutine_fn qcow2_co_encrypt_sectors(BlockDriverState *bs,
+                                           int64_t sector_num, uint8_t *buf,
+                                           int nb_sectors, int enc,
+                                           const AES_KEY *key);
 
 int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     int *num, uint64_t *cluster_offset);
@@ -317,8 +482,19 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs, const char *snapshot_name);
 void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
 
+/* qcow2-bitmap.c functions */
+int qcow2_read_bitmap_ext(BlockDriverState *bs, const uint8_t *data,
+                          size_t len);
+size_t qcow2_bitmap_ext_size(BlockDriverState *bs);
+void qcow2_build_bitmap_ext(BlockDriverState *bs, uint8_t *buf);
+int qcow2_load_dirty_bitmaps(BlockDriverState *bs, bool read_only);
+int qcow2_store_dirty_bitmaps(BlockDriverState *bs);
+void qcow2_free_bitmaps(BlockDriverState *bs);
+bool qcow2_can_persist_dirty_bitmaps(BlockDriverState *bs);
+
 /* qcow2-cache.c functions */
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+    int table_size);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table);
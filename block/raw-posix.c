@@ -53,6 +53,7 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <sys/param.h>
+#include <sys/sysmacros.h>
 #include <linux/cdrom.h>
 #include <linux/fd.h>
 #include <linux/fs.h>
@@ -60,6 +61,9 @@
 #ifdef CONFIG_FIEMAP
 #include <linux/fiemap.h>
 #endif
+#if defined(CONFIG_FALLOCATE_PUNCH_HOLE) || defined(CONFIG_FALLOCATE_ZERO_RANGE)
+#include <linux/falloc.h>
+#endif
 #if defined (__FreeBSD__) || defined(__FreeBSD_kernel__)
 #include <sys/disk.h>
 #include <sys/cdio.h>
@@ -136,9 +140,19 @@ typedef struct BDRVRawState {
     int use_aio;
     void *aio_ctx;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    int use_io_uring;
+    void *io_uring_ctx;
+#endif
 #ifdef CONFIG_XFS
     bool is_xfs : 1;
 #endif
+    bool is_blkdev : 1;
+    /* memory and length alignment that O_DIRECT requests need */
+    size_t buf_align;
+    /* cleared once the kernel says that it cannot discard or zero ranges */
+    bool has_discard;
+    bool has_write_zeroes;
 } BDRVRawState;
 
 typedef struct BDRVRawReopenState {
@@ -147,6 +161,9 @@ typedef struct BDRVRawReopenState {
 #ifdef CONFIG_LINUX_AIO
     int use_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    int use_io_uring;
+#endif
 } BDRVRawReopenState;
 
 static int fd_open(BlockDriverState *bs);
@@ -228,7 +245,8 @@ static void raw_parse_flags(int bdrv_flags, int *open_flags)
 }
 
 #ifdef CONFIG_LINUX_AIO
-static int raw_set_aio(void **aio_ctx, int *use_aio, int bdrv_flags)
+static int raw_set_aio(BlockDriverState *bs, void **aio_ctx, int *use_aio,
+                       int bdrv_flags)
 {
     int ret = -1;
     assert(aio_ctx != NULL);
@@ -246,6 +264,7 @@ static int raw_set_aio(void **aio_ctx, int *use_aio, int bdrv_flags)
             if (!*aio_ctx) {
                 goto error;
             }
+            laio_attach_aio_context(*aio_ctx, bdrv_get_aio_context(bs));
         }
         *use_aio = 1;
     } else {
@@ -259,10 +278,117 @@ error:
 }
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+static int raw_set_io_uring(BlockDriverState *bs, void **io_uring_ctx,
+                            int *use_io_uring, int bdrv_flags)
+{
+    assert(io_uring_ctx != NULL);
+    assert(use_io_uring != NULL);
+
+    /* io_uring does buffered I/O as well, so any cache mode will do */
+    if (bdrv_flags & BDRV_O_IO_URING) {
+        /* if non-NULL, luring_init() has already been run */
+        if (*io_uring_ctx == NULL) {
+            *io_uring_ctx = luring_init(bdrv_flags & BDRV_O_SQPOLL,
+                                        bdrv_flags & BDRV_O_FIXED_BUFS);
+            if (!*io_uring_ctx) {
+                return -1;
+            }
+            luring_attach_aio_context(*io_uring_ctx, bdrv_get_aio_context(bs));
+        }
+        *use_io_uring = 1;
+    } else {
+        *use_io_uring = 0;
+    }
+
+    return 0;
+}
+#endif
+
+/*
+ * Finds the alignment that O_DIRECT requests need for their buffers: block
+ * devices report their logical block size, for files reads from buffers of
+ * growing alignment are tried.
+ */
+static void raw_probe_alignment(BDRVRawState *s)
+{
+    size_t align;
+    char *buf;
+
+    s->buf_align = 512;
+    if (!(s->open_flags & O_DIRECT)) {
+        return;
+    }
+
+#ifdef BLKSSZGET
+    if (s->is_blkdev) {
+        unsigned int sector_size;
+
+        if (ioctl(s->fd, BLKSSZGET, &sector_size) >= 0 &&
+            sector_size >= 512) {
+            s->buf_align = sector_size;
+            return;
+        }
+    }
+#endif
+
+    buf = qemu_memalign(MAX_BLOCKSIZE, 2 * MAX_BLOCKSIZE);
+    for (align = 512; align <= MAX_BLOCKSIZE; align <<= 1) {
+        if (pread(s->fd, buf + align, MAX_BLOCKSIZE, 0) >= 0) {
+            s->buf_align = align;
+            break;
+        } else if (errno != EINVAL) {
+            /* can't tell, keep the default */
+            break;
+        }
+    }
+    qemu_vfree(buf);
+}
+
+/*
+ * Returns the unit in which discarding frees space on the host, or 0 if the
+ * host cannot discard.  st is the result of fstat() on the open file.
+ */
+static uint32_t raw_discard_granularity(BDRVRawState *s, struct stat *st)
+{
+#ifdef __linux__
+    if (s->is_blkdev) {
+        char *path, *buf;
+        uint32_t granularity = 0;
+
+        /* partitions share the queue of their disk */
+        path = g_strdup_printf("/sys/dev/block/%u:%u/queue/discard_granularity",
+                               major(st->st_rdev), minor(st->st_rdev));
+        if (!g_file_get_contents(path, &buf, NULL, NULL)) {
+            g_free(path);
+            path = g_strdup_printf("/sys/dev/block/%u:%u/../queue/"
+                                   "discard_granularity",
+                                   major(st->st_rdev), minor(st->st_rdev));
+            if (!g_file_get_contents(path, &buf, NULL, NULL)) {
+                buf = NULL;
+            }
+        }
+        if (buf) {
+            granularity = strtoul(buf, NULL, 10);
+            g_free(buf);
+        }
+        g_free(path);
+        return granularity;
+    }
+#endif
+#if defined(CONFIG_FALLOCATE_PUNCH_HOLE) || defined(CONFIG_XFS)
+    if (S_ISREG(st->st_mode)) {
+        return st->st_blksize;
+    }
+#endif
+    return 0;
+}
+
 static int raw_open_common(BlockDriverState *bs, const char *filename,
                            int bdrv_flags, int open_flags)
 {
     BDRVRawState *s = bs->opaque;
+    struct stat st;
     int fd, ret;
 
     ret = raw_normalize_devicepath(&filename);
@@ -284,7 +410,13 @@ static int raw_open_common(BlockDriverState *bs, const char *filename,
     s->fd = fd;
 
 #ifdef CONFIG_LINUX_AIO
-    if (raw_set_aio(&s->aio_ctx, &s->use_aio, bdrv_flags)) {
+    if (raw_set_aio(bs, &s->aio_ctx, &s->use_aio, bdrv_flags)) {
+        qemu_close(fd);
+        return -errno;
+    }
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (raw_set_io_uring(bs, &s->io_uring_ctx, &s->use_io_uring, bdrv_flags)) {
         qemu_close(fd);
         return -errno;
     }
@@ -296,6 +428,15 @@ static int raw_open_common(BlockDriverState *bs, const char *filename,
     }
 #endif
 
+    if (!fstat(s->fd, &st) && S_ISBLK(st.st_mode)) {
+        s->is_blkdev = true;
+    }
+    raw_probe_alignment(s);
+    bs->buffer_alignment = s->buf_align;
+    s->has_discard = true;
+    s->has_write_zeroes = true;
+    bs->discard_granularity = raw_discard_granularity(s, &st);
+
     return 0;
 }
 
@@ -328,7 +469,15 @@ static int raw_reopen_prepare(BDRVReopenState *state,
     /* we can use s->aio_ctx instead of a copy, because the use_aio flag is
      * valid in the 'false' condition even if aio_ctx is set, and raw_set_aio()
      * won't override aio_ctx if aio_ctx is non-NULL */
-    if (raw_set_aio(&s->aio_ctx, &raw_s->use_aio, state->flags)) {
+    if (raw_set_aio(state->bs, &s->aio_ctx, &raw_s->use_aio,
+                    state->flags)) {
+        return -1;
+    }
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    raw_s->use_io_uring = s->use_io_uring;
+    if (raw_set_io_uring(state->bs, &s->io_uring_ctx, &raw_s->use_io_uring,
+                         state->flags)) {
         return -1;
     }
 #endif
@@ -390,6 +539,13 @@ static void raw_reopen_commit(BDRVReopenState *state)
 #ifdef CONFIG_LINUX_AIO
     s->use_aio = raw_s->use_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    s->use_io_uring = raw_s->use_io_uring;
+#endif
+
+    /* The cache mode may have changed */
+    raw_probe_alignment(s);
+    state->bs->buffer_alignment = s->buf_align;
 
     g_free(state->opaque);
     state->opaque = NULL;
@@ -432,14 +588,17 @@ static void raw_reopen_abort(BDRVReopenState *state)
 */
 
 /*
- * Check if all memory in this vector is sector aligned.
+ * Check if all memory in this vector is aligned for O_DIRECT, both its
+ * address and its length.
  */
 static int qiov_is_aligned(BlockDriverState *bs, QEMUIOVector *qiov)
 {
+    BDRVRawState *s = bs->opaque;
     int i;
 
     for (i = 0; i < qiov->niov; i++) {
-        if ((uintptr_t) qiov->iov[i].iov_base % bs->buffer_alignment) {
+        if ((uintptr_t) qiov->iov[i].iov_base % s->buf_align ||
+            qiov->iov[i].iov_len % s->buf_align) {
             return 0;
         }
     }
@@ -512,27 +671,146 @@ qemu_pwritev(int fd, const struct iovec *iov, int nr_iov, off_t offset)
 
 #endif
 
-static ssize_t handle_aiocb_rw_vector(RawPosixAIOData *aiocb)
+/*
+ * Read/writes the data to/from the given vector, resubmitting the rest after
+ * short transfers.
+ *
+ * Returns the number of bytes handled or -errno in case of an error. Short
+ * reads are only returned if the end of the file is reached.
+ */
+static ssize_t handle_aiocb_rw_vector(RawPosixAIOData *aiocb,
+                                      struct iovec *iov, int niov)
 {
+    struct iovec *copy = NULL;
+    ssize_t offset = 0;
     ssize_t len;
 
-    do {
-        if (aiocb->aio_type & QEMU_AIO_WRITE)
-            len = qemu_pwritev(aiocb->aio_fildes,
-                               aiocb->aio_iov,
-                               aiocb->aio_niov,
-                               aiocb->aio_offset);
-         else
-            len = qemu_preadv(aiocb->aio_fildes,
-                              aiocb->aio_iov,
-                              aiocb->aio_niov,
-                              aiocb->aio_offset);
-    } while (len == -1 && errno == EINTR);
-
-    if (len == -1) {
-        return -errno;
+    while (niov > 0) {
+        if (aiocb->aio_type & QEMU_AIO_WRITE) {
+            len = qemu_pwritev(aiocb->aio_fildes, iov, MIN(niov, IOV_MAX),
+                               aiocb->aio_offset + offset);
+        } else {
+            len = qemu_preadv(aiocb->aio_fildes, iov, MIN(niov, IOV_MAX),
+                              aiocb->aio_offset + offset);
+        }
+        if (len == -1 && errno == EINTR) {
+            continue;
+        } else if (len == -1) {
+            offset = -errno;
+            break;
+        } else if (len < 0) {
+            offset = len;
+            break;
+        } else if (len == 0) {
+            break;
+        }
+        offset += len;
+
+        /* Skip what is done, the vector of the caller stays unchanged */
+        while (niov > 0 && len >= iov->iov_len) {
+            len -= iov->iov_len;
+            iov++;
+            niov--;
+        }
+        if (len > 0) {
+            if (!copy) {
+                copy = g_memdup(iov, niov * sizeof(*iov));
+                iov = copy;
+            }
+            iov->iov_base = (char *)iov->iov_base + len;
+            iov->iov_len -= len;
+        }
+    }
+
+    g_free(copy);
+    return offset;
+}
+
+/*
+ * Like handle_aiocb_rw_vector(), for O_DIRECT requests whose buffers are not
+ * all aligned.  Each element keeps its aligned middle part, and only the bytes
+ * around it go through bounce segments, aligned chunks which each collect the
+ * misaligned tail of an element, the elements after it that cannot be used
+ * directly and the head of the next usable one.
+ */
+static ssize_t handle_aiocb_rw_realigned(RawPosixAIOData *aiocb)
+{
+    BDRVRawState *s = aiocb->bs->opaque;
+    size_t align = s->buf_align;
+    struct iovec *iov;
+    size_t *bounce_start, *bounce_len;
+    int *bounce_idx;
+    size_t pos = 0, pending_start = 0, pending_len = 0, bounce_total = 0;
+    char *bounce_buf, *p;
+    ssize_t nbytes;
+    int i, n = 0, nb = 0;
+
+    iov = g_new(struct iovec, 2 * aiocb->aio_niov + 1);
+    bounce_start = g_new(size_t, aiocb->aio_niov + 1);
+    bounce_len = g_new(size_t, aiocb->aio_niov + 1);
+    bounce_idx = g_new(int, aiocb->aio_niov + 1);
+
+    for (i = 0; i < aiocb->aio_niov; i++) {
+        char *base = aiocb->aio_iov[i].iov_base;
+        size_t len = aiocb->aio_iov[i].iov_len;
+        size_t head = pending_len % align ? align - pending_len % align : 0;
+
+        if (head < len && (uintptr_t)(base + head) % align == 0 &&
+            len - head >= align) {
+            size_t mid = (len - head) & ~(align - 1);
+
+            if (pending_len + head > 0) {
+                bounce_start[nb] = pending_start;
+                bounce_len[nb] = pending_len + head;
+                bounce_idx[nb++] = n++;
+                bounce_total += pending_len + head;
+            }
+            iov[n].iov_base = base + head;
+            iov[n++].iov_len = mid;
+            pending_start = pos + head + mid;
+            pending_len = len - head - mid;
+        } else {
+            if (pending_len == 0) {
+                pending_start = pos;
+            }
+            pending_len += len;
+        }
+        pos += len;
+    }
+    if (pending_len > 0) {
+        bounce_start[nb] = pending_start;
+        bounce_len[nb] = pending_len;
+        bounce_idx[nb++] = n++;
+        bounce_total += pending_len;
+    }
+
+    /* All bounce segments but the last have aligned lengths */
+    bounce_buf = nb ? qemu_memalign(align, bounce_total) : NULL;
+    for (i = 0, p = bounce_buf; i < nb; p += bounce_len[i], i++) {
+        iov[bounce_idx[i]].iov_base = p;
+        iov[bounce_idx[i]].iov_len = bounce_len[i];
+        if (aiocb->aio_type & QEMU_AIO_WRITE) {
+            iov_to_buf(aiocb->aio_iov, aiocb->aio_niov, bounce_start[i],
+                       p, bounce_len[i]);
+        }
     }
-    return len;
+
+    nbytes = handle_aiocb_rw_vector(aiocb, iov, n);
+    if (!(aiocb->aio_type & QEMU_AIO_WRITE)) {
+        for (i = 0, p = bounce_buf; i < nb; p += bounce_len[i], i++) {
+            if (nbytes > 0 && bounce_start[i] < nbytes) {
+                iov_from_buf(aiocb->aio_iov, aiocb->aio_niov, bounce_start[i],
+                             p, MIN(bounce_len[i], nbytes - bounce_start[i]));
+            }
+        }
+    }
+
+    qemu_vfree(bounce_buf);
+    g_free(bounce_idx);
+    g_free(bounce_len);
+    g_free(bounce_start);
+    g_free(iov);
+    return nbytes;
 }
 
 /*
@@ -592,19 +870,20 @@ static ssize_t handle_aiocb_rw(RawPosixAIOData *aiocb)
          * buffer if it's not supported.
          */
         if (preadv_present) {
-            nbytes = handle_aiocb_rw_vector(aiocb);
-            if (nbytes == aiocb->aio_nbytes ||
-                (nbytes < 0 && nbytes != -ENOSYS)) {
+            nbytes = handle_aiocb_rw_vector(aiocb, aiocb->aio_iov,
+                                            aiocb->aio_niov);
+            if (nbytes != -ENOSYS) {
                 return nbytes;
             }
             preadv_present = false;
         }
-
-        /*
-         * XXX(hch): short read/write.  no easy way to handle the reminder
-         * using these interfaces.  For now retry using plain
-         * pread/pwrite?
-         */
+    } else if (preadv_present) {
+        /* Copy only the misaligned parts */
+        nbytes = handle_aiocb_rw_realigned(aiocb);
+        if (nbytes != -ENOSYS) {
+            return nbytes;
+        }
+        preadv_present = false;
     }
 
     /*
@@ -643,6 +922,131 @@ static ssize_t handle_aiocb_rw(RawPosixAIOData *aiocb)
     return nbytes;
 }
 
+#ifdef CONFIG_XFS
+static int xfs_discard(BDRVRawState *s, int64_t offset, uint64_t bytes)
+{
+    struct xfs_flock64 fl;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_whence = SEEK_SET;
+    fl.l_start = offset;
+    fl.l_len = bytes;
+
+    if (xfsctl(NULL, s->fd, XFS_IOC_UNRESVSP64, &fl) < 0) {
+        DEBUG_BLOCK_PRINT("cannot punch hole (%s)\n", strerror(errno));
+        return -errno;
+    }
+
+    return 0;
+}
+#endif
+
+/*
+ * Errors that mean that the kernel or the file system cannot do an operation
+ * at all, so that there is no point in trying it again.
+ */
+static bool raw_op_unsupported(int ret)
+{
+    return ret == -ENOTSUP || ret == -EOPNOTSUPP || ret == -ENOSYS ||
+           ret == -ENOTTY;
+}
+
+/*
+ * Turns the error of a discard or write zeroes request into -ENOTSUP where
+ * the caller should fall back, and clears *supported if there is no point
+ * in trying again.
+ */
+static int raw_nodata_ret(int ret, bool *supported)
+{
+    if (raw_op_unsupported(ret)) {
+        *supported = false;
+        ret = -ENOTSUP;
+    } else if (ret == -EINVAL) {
+        /* e.g. a range that is not aligned to the device's blocks */
+        ret = -ENOTSUP;
+    }
+    return ret;
+}
+
+static ssize_t handle_aiocb_discard(RawPosixAIOData *aiocb)
+{
+    BDRVRawState *s = aiocb->bs->opaque;
+    int ret = -ENOTSUP;
+
+    if (!s->has_discard) {
+        return -ENOTSUP;
+    }
+
+    if (aiocb->aio_type & QEMU_AIO_BLKDEV) {
+#ifdef BLKDISCARD
+        do {
+            uint64_t range[2] = { aiocb->aio_offset, aiocb->aio_nbytes };
+            if (ioctl(aiocb->aio_fildes, BLKDISCARD, range) == 0) {
+                return 0;
+            }
+        } while (errno == EINTR);
+
+        ret = -errno;
+#endif
+    } else {
+#ifdef CONFIG_XFS
+        if (s->is_xfs) {
+            return xfs_discard(s, aiocb->aio_offset, aiocb->aio_nbytes);
+        }
+#endif
+
+#ifdef CONFIG_FALLOCATE_PUNCH_HOLE
+        do {
+            if (fallocate(aiocb->aio_fildes,
+                          FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                          aiocb->aio_offset, aiocb->aio_nbytes) == 0) {
+                return 0;
+            }
+        } while (errno == EINTR);
+
+        ret = -errno;
+#endif
+    }
+
+    return raw_nodata_ret(ret, &s->has_discard);
+}
+
+static ssize_t handle_aiocb_write_zeroes(RawPosixAIOData *aiocb)
+{
+    BDRVRawState *s = aiocb->bs->opaque;
+    int ret = -ENOTSUP;
+
+    if (!s->has_write_zeroes) {
+        return -ENOTSUP;
+    }
+
+    if (aiocb->aio_type & QEMU_AIO_BLKDEV) {
+#ifdef BLKZEROOUT
+        do {
+            uint64_t range[2] = { aiocb->aio_offset, aiocb->aio_nbytes };
+            if (ioctl(aiocb->aio_fildes, BLKZEROOUT, range) == 0) {
+                return 0;
+            }
+        } while (errno == EINTR);
+
+        ret = -errno;
+#endif
+    } else {
+#ifdef CONFIG_FALLOCATE_ZERO_RANGE
+        do {
+            if (fallocate(aiocb->aio_fildes, FALLOC_FL_ZERO_RANGE,
+                          aiocb->aio_offset, aiocb->aio_nbytes) == 0) {
+                return 0;
+            }
+        } while (errno == EINTR);
+
+        ret = -errno;
+#endif
+    }
+
+    return raw_nodata_ret(ret, &s->has_write_zeroes);
+}
+
 static int aio_worker(void *arg)
 {
     RawPosixAIOData *aiocb = arg;
@@ -677,6 +1081,12 @@ static int aio_worker(void *arg)
     case QEMU_AIO_IOCTL:
         ret = handle_aiocb_ioctl(aiocb);
         break;
+    case QEMU_AIO_DISCARD:
+        ret = handle_aiocb_discard(aiocb);
+        break;
+    case QEMU_AIO_WRITE_ZEROES:
+        ret = handle_aiocb_write_zeroes(aiocb);
+        break;
     default:
         fprintf(stderr, "invalid aio request (0x%x)\n", aiocb->aio_type);
         ret = -EINVAL;
@@ -692,6 +1102,7 @@ static BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
         BlockDriverCompletionFunc *cb, void *opaque, int type)
 {
     RawPosixAIOData *acb = g_slice_new(RawPosixAIOData);
+    ThreadPool *pool;
 
     acb->bs = bs;
     acb->aio_type = type;
@@ -705,7 +1116,41 @@ static BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
     acb->aio_offset = sector_num * 512;
 
     trace_paio_submit(acb, opaque, sector_num, nb_sectors, type);
-    return thread_pool_submit_aio(aio_worker, acb, cb, opaque);
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    return thread_pool_submit_aio(pool, aio_worker, acb, cb, opaque);
+}
+
+/*
+ * Runs a request without data buffers (discard, write zeroes) in the thread
+ * pool and waits for it in coroutine context.
+ */
+static int coroutine_fn paio_submit_co(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, int type)
+{
+    BDRVRawState *s = bs->opaque;
+    RawPosixAIOData *acb;
+    ThreadPool *pool;
+    int ret;
+
+    ret = fd_open(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (s->is_blkdev) {
+        type |= QEMU_AIO_BLKDEV;
+    }
+
+    acb = g_slice_new(RawPosixAIOData);
+    acb->bs = bs;
+    acb->aio_type = type;
+    acb->aio_fildes = s->fd;
+    acb->aio_nbytes = (int64_t)nb_sectors * 512;
+    acb->aio_offset = sector_num * 512;
+
+    trace_paio_submit(acb, bs, sector_num, nb_sectors, type);
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    return thread_pool_submit_co(pool, aio_worker, acb);
 }
 
 static BlockDriverAIOCB *paio_ioctl(BlockDriverState *bs, int fd,
@@ -713,6 +1158,7 @@ static BlockDriverAIOCB *paio_ioctl(BlockDriverState *bs, int fd,
         BlockDriverCompletionFunc *cb, void *opaque)
 {
     RawPosixAIOData *acb = g_slice_new(RawPosixAIOData);
+    ThreadPool *pool;
 
     acb->bs = bs;
     acb->aio_type = QEMU_AIO_IOCTL;
@@ -721,7 +1167,8 @@ static BlockDriverAIOCB *paio_ioctl(BlockDriverState *bs, int fd,
     acb->aio_ioctl_buf = buf;
     acb->aio_ioctl_cmd = req;
 
-    return thread_pool_submit_aio(aio_worker, acb, cb, opaque);
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    return thread_pool_submit_aio(pool, aio_worker, acb, cb, opaque);
 }
 
 static BlockDriverAIOCB *raw_aio_submit(BlockDriverState *bs,
@@ -749,6 +1196,13 @@ static BlockDriverAIOCB *raw_aio_submit(BlockDriverState *bs,
         }
     }
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_io_uring && !(type & QEMU_AIO_MISALIGNED)) {
+        return luring_submit(bs, s->io_uring_ctx, s->fd, sector_num, qiov,
+                             nb_sectors, cb, opaque, type);
+    }
+#endif
+
     return paio_submit(bs, s->fd, sector_num, qiov, nb_sectors,
                        cb, opaque, type);
 }
@@ -777,18 +1231,140 @@ static BlockDriverAIOCB *raw_aio_flush(BlockDriverState *bs,
     if (fd_open(bs) < 0)
         return NULL;
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_io_uring) {
+        return luring_submit(bs, s->io_uring_ctx, s->fd, 0, NULL, 0,
+                             cb, opaque, QEMU_AIO_FLUSH);
+    }
+#endif
+
     return paio_submit(bs, s->fd, 0, NULL, 0, cb, opaque, QEMU_AIO_FLUSH);
 }
 
 static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
+
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->io_uring_ctx) {
+        luring_detach_aio_context(s->io_uring_ctx, bdrv_get_aio_context(bs));
+        luring_cleanup(s->io_uring_ctx);
+        s->io_uring_ctx = NULL;
+    }
+#endif
     if (s->fd >= 0) {
         qemu_close(s->fd);
         s->fd = -1;
     }
 }
 
+static void raw_detach_aio_context(BlockDriverState *bs)
+{
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
+    BDRVRawState *s = bs->opaque;
+#endif
+
+#ifdef CONFIG_LINUX_AIO
+    if (s->aio_ctx) {
+        laio_detach_aio_context(s->aio_ctx, bdrv_get_aio_context(bs));
+    }
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->io_uring_ctx) {
+        luring_detach_aio_context(s->io_uring_ctx, bdrv_get_aio_context(bs));
+    }
+#endif
+}
+
+static void raw_attach_aio_context(BlockDriverState *bs,
+                                   AioContext *new_context)
+{
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
+    BDRVRawState *s = bs->opaque;
+#endif
+
+#ifdef CONFIG_LINUX_AIO
+    if (s->aio_ctx) {
+        laio_attach_aio_context(s->aio_ctx, new_context);
+    }
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->io_uring_ctx) {
+        luring_attach_aio_context(s->io_uring_ctx, new_context);
+    }
+#endif
+}
+
+static void raw_aio_plug(BlockDriverState *bs)
+{
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
+    BDRVRawState *s = bs->opaque;
+#endif
+
+#ifdef CONFIG_LINUX_AIO
+    if (s->use_aio) {
+        laio_io_plug(s->aio_ctx);
+    }
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_io_uring) {
+        luring_io_plug(s->io_uring_ctx);
+    }
+#endif
+}
+
+static void raw_aio_unplug(BlockDriverState *bs)
+{
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
+    BDRVRawState *s = bs->opaque;
+#endif
+
+#ifdef CONFIG_LINUX_AIO
+    if (s->use_aio) {
+        laio_io_unplug(s->aio_ctx);
+    }
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_io_uring) {
+        luring_io_unplug(s->io_uring_ctx);
+    }
+#endif
+}
+
+#ifdef CONFIG_LINUX_AIO
+/**
+ * Return the file descriptor for Linux AIO
+ *
+ * This function is a layering violation and should be removed when it becomes
+ * possible to call the block layer outside the global mutex.  It allows the
+ * caller to hijack the file descriptor so I/O can be performed outside the
+ * block layer.
+ */
+int raw_get_aio_fd(BlockDriverState *bs)
+{
+    BDRVRawState *s;
+
+    if (!bs->drv) {
+        return -ENOMEDIUM;
+    }
+
+    if (bs->drv == bdrv_find_format("raw")) {
+        bs = bs->file;
+    }
+
+    /* raw-posix has several protocols so just check for raw_aio_readv */
+    if (bs->drv->bdrv_aio_readv != raw_aio_readv) {
+        return -ENOTSUP;
+    }
+
+    s = bs->opaque;
+    if (!s->use_aio) {
+        return -ENOTSUP;
+    }
+    return s->fd;
+}
+#endif
+
 static int raw_truncate(BlockDriverState *bs, int64_t offset)
 {
     BDRVRawState *s = bs->opaque;
@@ -1093,37 +1669,68 @@ static int coroutine_fn raw_co_is_allocated(BlockDriverState *bs,
     }
 }
 
+#if defined(CONFIG_LINUX_IO_URING) && \
+    (defined(CONFIG_FALLOCATE_PUNCH_HOLE) || defined(CONFIG_FALLOCATE_ZERO_RANGE))
+/*
+ * On regular files, discard and write zeroes are plain fallocate() calls
+ * that io_uring can do.  Block devices need ioctls and XFS has its own
+ * calls, so these stay in the thread pool.
+ */
+static bool raw_nodata_use_io_uring(BDRVRawState *s)
+{
 #ifdef CONFIG_XFS
-static int xfs_discard(BDRVRawState *s, int64_t sector_num, int nb_sectors)
+    if (s->is_xfs) {
+        return false;
+    }
+#endif
+    return s->use_io_uring && !s->is_blkdev;
+}
+#endif
+
+static coroutine_fn int raw_co_discard(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors)
 {
-    struct xfs_flock64 fl;
+    int ret;
 
-    memset(&fl, 0, sizeof(fl));
-    fl.l_whence = SEEK_SET;
-    fl.l_start = sector_num << 9;
-    fl.l_len = (int64_t)nb_sectors << 9;
+#if defined(CONFIG_LINUX_IO_URING) && defined(CONFIG_FALLOCATE_PUNCH_HOLE)
+    BDRVRawState *s = bs->opaque;
 
-    if (xfsctl(NULL, s->fd, XFS_IOC_UNRESVSP64, &fl) < 0) {
-        DEBUG_BLOCK_PRINT("cannot punch hole (%s)\n", strerror(errno));
-        return -errno;
+    if (raw_nodata_use_io_uring(s)) {
+        if (!s->has_discard) {
+            return 0;
+        }
+        ret = luring_co_submit(bs, s->io_uring_ctx, s->fd, sector_num,
+                               nb_sectors, QEMU_AIO_DISCARD);
+        ret = raw_nodata_ret(ret, &s->has_discard);
+    } else
+#endif
+    {
+        ret = paio_submit_co(bs, sector_num, nb_sectors, QEMU_AIO_DISCARD);
     }
 
-    return 0;
+    /* Discard is only a hint, not being able to do it is no error */
+    return ret == -ENOTSUP ? 0 : ret;
 }
-#endif
 
-static coroutine_fn int raw_co_discard(BlockDriverState *bs,
+static coroutine_fn int raw_co_write_zeroes(BlockDriverState *bs,
     int64_t sector_num, int nb_sectors)
 {
-#ifdef CONFIG_XFS
+#if defined(CONFIG_LINUX_IO_URING) && defined(CONFIG_FALLOCATE_ZERO_RANGE)
     BDRVRawState *s = bs->opaque;
 
-    if (s->is_xfs) {
-        return xfs_discard(s, sector_num, nb_sectors);
+    if (raw_nodata_use_io_uring(s)) {
+        int ret;
+
+        if (!s->has_write_zeroes) {
+            return -ENOTSUP;
+        }
+        ret = luring_co_submit(bs, s->io_uring_ctx, s->fd, sector_num,
+                               nb_sectors, QEMU_AIO_WRITE_ZEROES);
+        return raw_nodata_ret(ret, &s->has_write_zeroes);
     }
 #endif
 
-    return 0;
+    return paio_submit_co(bs, sector_num, nb_sectors, QEMU_AIO_WRITE_ZEROES);
 }
 
 static QEMUOptionParameter raw_create_options[] = {
@@ -1145,8 +1752,13 @@ static BlockDriver bdrv_file = {
     .bdrv_reopen_commit = raw_reopen_commit,
     .bdrv_reopen_abort = raw_reopen_abort,
     .bdrv_close = raw_close,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+    .bdrv_io_plug = raw_aio_plug,
+    .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_create = raw_create,
     .bdrv_co_discard = raw_co_discard,
+    .bdrv_co_write_zeroes = raw_co_write_zeroes,
     .bdrv_co_is_allocated = raw_co_is_allocated,
 
     .bdrv_aio_readv = raw_aio_readv,
@@ -1413,12 +2025,18 @@ static BlockDriver bdrv_host_device = {
     .bdrv_probe_device  = hdev_probe_device,
     .bdrv_file_open     = hdev_open,
     .bdrv_close         = raw_close,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+    .bdrv_io_plug = raw_aio_plug,
+    .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_reopen_prepare = raw_reopen_prepare,
     .bdrv_reopen_commit  = raw_reopen_commit,
     .bdrv_reopen_abort   = raw_reopen_abort,
     .bdrv_create        = hdev_create,
     .create_options     = raw_create_options,
     .bdrv_has_zero_init = hdev_has_zero_init,
+    .bdrv_co_discard    = raw_co_discard,
+    .bdrv_co_write_zeroes = raw_co_write_zeroes,
 
     .bdrv_aio_readv	= raw_aio_readv,
     .bdrv_aio_writev	= raw_aio_writev,
@@ -1537,6 +2155,10 @@ static BlockDriver bdrv_host_floppy = {
     .bdrv_probe_device	= floppy_probe_device,
     .bdrv_file_open     = floppy_open,
     .bdrv_close         = raw_close,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+    .bdrv_io_plug = raw_aio_plug,
+    .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_reopen_prepare = raw_reopen_prepare,
     .bdrv_reopen_commit  = raw_reopen_commit,
     .bdrv_reopen_abort   = raw_reopen_abort,
@@ -1639,6 +2261,10 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_probe_device	= cdrom_probe_device,
     .bdrv_file_open     = cdrom_open,
     .bdrv_close         = raw_close,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+    .bdrv_io_plug = raw_aio_plug,
+    .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_reopen_prepare = raw_reopen_prepare,
     .bdrv_reopen_commit  = raw_reopen_commit,
     .bdrv_reopen_abort   = raw_reopen_abort,
@@ -1761,6 +2387,10 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_probe_device	= cdrom_probe_device,
     .bdrv_file_open     = cdrom_open,
     .bdrv_close         = raw_close,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+    .bdrv_io_plug = raw_aio_plug,
+    .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_reopen_prepare = raw_reopen_prepare,
     .bdrv_reopen_commit  = raw_reopen_commit,
     .bdrv_reopen_abort   = raw_reopen_abort,
@@ -6,6 +6,7 @@
 static int raw_open(BlockDriverState *bs, int flags)
 {
     bs->sg = bs->file->sg;
+    bs->discard_granularity = bs->file->discard_granularity;
     return 0;
 }
 
@@ -31,6 +32,13 @@ static int coroutine_fn raw_co_writev(BlockDriverState *bs, int64_t sector_num,
     return bdrv_co_writev(bs->file, sector_num, nb_sectors, qiov);
 }
 
+static int coroutine_fn raw_co_write_zeroes(BlockDriverState *bs,
+                                            int64_t sector_num,
+                                            int nb_sectors)
+{
+    return bdrv_co_write_zeroes(bs->file, sector_num, nb_sectors);
+}
+
 static void raw_close(BlockDriverState *bs)
 {
 }
@@ -100,6 +108,31 @@ static int raw_create(const char *filename, QEMUOptionParameter *options)
     return bdrv_create_file(filename, options);
 }
 
+static int raw_measure(QEMUOptionParameter *options, BlockDriverState *in_bs,
+                       BlockMeasureInfo *info)
+{
+    int64_t size = 0;
+
+    while (options && options->name) {
+        if (!strcmp(options->name, BLOCK_OPT_SIZE)) {
+            size = options->value.n;
+        }
+        options++;
+    }
+
+    /* Sectors that read as zeroes stay holes in the file */
+    info->required = 0;
+    if (in_bs) {
+        int64_t data = bdrv_get_data_size(in_bs, BDRV_SECTOR_SIZE);
+        if (data < 0) {
+            return data;
+        }
+        info->required = data;
+    }
+    info->fully_allocated = size;
+    return 0;
+}
+
 static QEMUOptionParameter raw_create_options[] = {
     {
         .name = BLOCK_OPT_SIZE,
@@ -129,6 +162,7 @@ static BlockDriver bdrv_raw = {
     .bdrv_co_writev         = raw_co_writev,
     .bdrv_co_is_allocated   = raw_co_is_allocated,
     .bdrv_co_discard        = raw_co_discard,
+    .bdrv_co_write_zeroes   = raw_co_write_zeroes,
 
     .bdrv_probe         = raw_probe,
     .bdrv_getlength     = raw_getlength,
@@ -143,6 +177,7 @@ static BlockDriver bdrv_raw = {
     .bdrv_aio_ioctl     = raw_aio_ioctl,
 
     .bdrv_create        = raw_create,
+    .bdrv_measure       = raw_measure,
     .create_options     = raw_create_options,
     .bdrv_has_zero_init = raw_has_zero_init,
 };
@@ -51,6 +51,11 @@
 #undef LIBRBD_SUPPORTS_DISCARD
 #endif
 
+/* librbd defines LIBRBD_SUPPORTS_IOVEC itself (since 1.12.0) when
+ * rbd_aio_readv and rbd_aio_writev are available.  Without them, requests
+ * go through a bounce buffer.
+ */
+
 #define OBJ_MAX_SIZE (1UL << OBJ_DEFAULT_OBJ_ORDER)
 
 #define RBD_MAX_CONF_NAME_SIZE 128
@@ -68,7 +73,6 @@ typedef enum {
 
 typedef struct RBDAIOCB {
     BlockDriverAIOCB common;
-    QEMUBH *bh;
     int64_t ret;
     QEMUIOVector *qiov;
     char *bounce;
@@ -85,27 +89,22 @@ typedef struct RADOSCB {
     struct BDRVRBDState *s;
     int done;
     int64_t size;
-    char *buf;
     int64_t ret;
+    struct RADOSCB *next;
 } RADOSCB;
 
-#define RBD_FD_READ 0
-#define RBD_FD_WRITE 1
-
 typedef struct BDRVRBDState {
-    int fds[2];
+    EventNotifier e;
     rados_t cluster;
     rados_ioctx_t io_ctx;
     rbd_image_t image;
     char name[RBD_MAX_IMAGE_NAME_SIZE];
     int qemu_aio_count;
     char *snap;
-    int event_reader_pos;
-    RADOSCB *event_rcb;
+    /* Requests finished by librbd, pushed from its callback threads */
+    RADOSCB *completed;
 } BDRVRBDState;
 
-static void rbd_aio_bh_cb(void *opaque);
-
 static int qemu_rbd_next_tok(char *dst, int dst_len,
                              char *src, char delim,
                              const char *name,
@@ -366,10 +365,20 @@ static int qemu_rbd_create(const char *filename, QEMUOptionParameter *options)
     return ret;
 }
 
+static void qemu_rbd_memset(RADOSCB *rcb, int64_t offs)
+{
+    RBDAIOCB *acb = rcb->acb;
+
+    if (acb->bounce) {
+        memset(acb->bounce + offs, 0, rcb->size - offs);
+    } else {
+        qemu_iovec_memset(acb->qiov, offs, 0, rcb->size - offs);
+    }
+}
+
 /*
  * This aio completion is being called from qemu_rbd_aio_event_reader()
- * and runs in qemu context. It schedules a bh, but just in case the aio
- * was not cancelled before.
+ * and runs in qemu context.
  */
 static void qemu_rbd_complete_aio(RADOSCB *rcb)
 {
@@ -394,11 +403,11 @@ static void qemu_rbd_complete_aio(RADOSCB *rcb)
         }
     } else {
         if (r < 0) {
-            memset(rcb->buf, 0, rcb->size);
+            qemu_rbd_memset(rcb, 0);
             acb->ret = r;
             acb->error = 1;
         } else if (r < rcb->size) {
-            memset(rcb->buf + r, 0, rcb->size - r);
+            qemu_rbd_memset(rcb, r);
             if (!acb->error) {
                 acb->ret = rcb->size;
             }
@@ -406,43 +415,48 @@ static void qemu_rbd_complete_aio(RADOSCB *rcb)
             acb->ret = r;
         }
     }
-    /* Note that acb->bh can be NULL in case where the aio was cancelled */
-    acb->bh = qemu_bh_new(rbd_aio_bh_cb, acb);
-    qemu_bh_schedule(acb->bh);
+
+    if (acb->cmd == RBD_AIO_READ && acb->bounce) {
+        qemu_iovec_from_buf(acb->qiov, 0, acb->bounce, acb->qiov->size);
+    }
+    qemu_vfree(acb->bounce);
+    acb->common.cb(acb->common.opaque, (acb->ret > 0 ? 0 : acb->ret));
+    qemu_aio_release(acb);
 done:
     g_free(rcb);
 }
 
 /*
- * aio fd read handler. It runs in the qemu context and calls the
- * completion handling of completed rados aio operations.
+ * aio event handler. It runs in the qemu context and completes all the
+ * rados aio operations that finished since it last ran.
  */
-static void qemu_rbd_aio_event_reader(void *opaque)
+static void qemu_rbd_aio_event_reader(EventNotifier *e)
 {
-    BDRVRBDState *s = opaque;
+    BDRVRBDState *s = container_of(e, BDRVRBDState, e);
+    RADOSCB *rcb, *next, *list = NULL;
 
-    ssize_t ret;
+    event_notifier_test_and_clear(e);
+    rcb = __sync_lock_test_and_set(&s->completed, NULL);
 
-    do {
-        char *p = (char *)&s->event_rcb;
-
-        /* now read the rcb pointer that was sent from a non qemu thread */
-        ret = read(s->fds[RBD_FD_READ], p + s->event_reader_pos,
-                   sizeof(s->event_rcb) - s->event_reader_pos);
-        if (ret > 0) {
-            s->event_reader_pos += ret;
-            if (s->event_reader_pos == sizeof(s->event_rcb)) {
-                s->event_reader_pos = 0;
-                qemu_rbd_complete_aio(s->event_rcb);
-                s->qemu_aio_count--;
-            }
-        }
-    } while (ret < 0 && errno == EINTR);
+    /* The list was built in LIFO order, restore completion order */
+    while (rcb) {
+        next = rcb->next;
+        rcb->next = list;
+        list = rcb;
+        rcb = next;
+    }
+
+    while (list) {
+        rcb = list;
+        list = rcb->next;
+        s->qemu_aio_count--;
+        qemu_rbd_complete_aio(rcb);
+    }
 }
 
-static int qemu_rbd_aio_flush_cb(void *opaque)
+static int qemu_rbd_aio_flush_cb(EventNotifier *e)
 {
-    BDRVRBDState *s = opaque;
+    BDRVRBDState *s = container_of(e, BDRVRBDState, e);
 
     return (s->qemu_aio_count > 0);
 }
@@ -522,17 +536,14 @@ static int qemu_rbd_open(BlockDriverState *bs, const char *filename, int flags)
 
     bs->read_only = (s->snap != NULL);
 
-    s->event_reader_pos = 0;
-    r = qemu_pipe(s->fds);
+    s->completed = NULL;
+    r = event_notifier_init(&s->e, false);
     if (r < 0) {
         error_report("error opening eventfd");
         goto failed;
     }
-    fcntl(s->fds[0], F_SETFL, O_NONBLOCK);
-    fcntl(s->fds[1], F_SETFL, O_NONBLOCK);
-    qemu_aio_set_fd_handler(s->fds[RBD_FD_READ], qemu_rbd_aio_event_reader,
-                            NULL, qemu_rbd_aio_flush_cb, s);
-
+    qemu_aio_set_event_notifier(&s->e, qemu_rbd_aio_event_reader,
+                                qemu_rbd_aio_flush_cb);
 
     return 0;
 
@@ -550,9 +561,8 @@ static void qemu_rbd_close(BlockDriverState *bs)
 {
     BDRVRBDState *s = bs->opaque;
 
-    close(s->fds[0]);
-    close(s->fds[1]);
-    qemu_aio_set_fd_handler(s->fds[RBD_FD_READ], NULL, NULL, NULL, NULL);
+    qemu_aio_set_event_notifier(&s->e, NULL, NULL);
+    event_notifier_cleanup(&s->e);
 
     rbd_close(s->image);
     rados_ioctx_destroy(s->io_ctx);
@@ -575,72 +585,32 @@ static const AIOCBInfo rbd_aiocb_info = {
     .cancel = qemu_rbd_aio_cancel,
 };
 
-static int qemu_rbd_send_pipe(BDRVRBDState *s, RADOSCB *rcb)
-{
-    int ret = 0;
-    while (1) {
-        fd_set wfd;
-        int fd = s->fds[RBD_FD_WRITE];
-
-        /* send the op pointer to the qemu thread that is responsible
-           for the aio/op completion. Must do it in a qemu thread context */
-        ret = write(fd, (void *)&rcb, sizeof(rcb));
-        if (ret >= 0) {
-            break;
-        }
-        if (errno == EINTR) {
-            continue;
-        }
-        if (errno != EAGAIN) {
-            break;
-        }
-
-        FD_ZERO(&wfd);
-        FD_SET(fd, &wfd);
-        do {
-            ret = select(fd + 1, NULL, &wfd, NULL, NULL);
-        } while (ret < 0 && errno == EINTR);
-    }
-
-    return ret;
-}
-
 /*
  * This is the callback function for rbd_aio_read and _write
  *
  * Note: this function is being called from a non qemu thread so
  * we need to be careful about what we do here. Generally we only
- * write to the block notification pipe, and do the rest of the
+ * push the request on the completion list, and do the rest of the
  * io completion handling from qemu_rbd_aio_event_reader() which
- * runs in a qemu context.
+ * runs in a qemu context.  Only the first request of a batch needs
+ * to wake up the qemu thread.
  */
 static void rbd_finish_aiocb(rbd_completion_t c, RADOSCB *rcb)
 {
-    int ret;
+    BDRVRBDState *s = rcb->s;
+    RADOSCB *head;
+
     rcb->ret = rbd_aio_get_return_value(c);
     rbd_aio_release(c);
-    ret = qemu_rbd_send_pipe(rcb->s, rcb);
-    if (ret < 0) {
-        error_report("failed writing to acb->s->fds");
-        g_free(rcb);
-    }
-}
 
-/* Callback when all queued rbd_aio requests are complete */
-
-static void rbd_aio_bh_cb(void *opaque)
-{
-    RBDAIOCB *acb = opaque;
+    do {
+        head = s->completed;
+        rcb->next = head;
+    } while (!__sync_bool_compare_and_swap(&s->completed, head, rcb));
 
-    if (acb->cmd == RBD_AIO_READ) {
-        qemu_iovec_from_buf(acb->qiov, 0, acb->bounce, acb->qiov->size);
+    if (head == NULL) {
+        event_notifier_set(&s->e);
     }
-    qemu_vfree(acb->bounce);
-    acb->common.cb(acb->common.opaque, (acb->ret > 0 ? 0 : acb->ret));
-    qemu_bh_delete(acb->bh);
-    acb->bh = NULL;
-
-    qemu_aio_release(acb);
 }
 
 static int rbd_aio_discard_wrapper(rbd_image_t image,
@@ -667,7 +637,6 @@ static BlockDriverAIOCB *rbd_start_aio(BlockDriverState *bs,
     RADOSCB *rcb;
     rbd_completion_t c;
     int64_t off, size;
-    char *buf;
     int r;
 
     BDRVRBDState *s = bs->opaque;
@@ -675,22 +644,20 @@ static BlockDriverAIOCB *rbd_start_aio(BlockDriverState *bs,
     acb = qemu_aio_get(&rbd_aiocb_info, bs, cb, opaque);
     acb->cmd = cmd;
     acb->qiov = qiov;
-    if (cmd == RBD_AIO_DISCARD) {
-        acb->bounce = NULL;
-    } else {
-        acb->bounce = qemu_blockalign(bs, qiov->size);
-    }
+    acb->bounce = NULL;
     acb->ret = 0;
     acb->error = 0;
     acb->s = s;
     acb->cancelled = 0;
-    acb->bh = NULL;
 
-    if (cmd == RBD_AIO_WRITE) {
-        qemu_iovec_to_buf(acb->qiov, 0, acb->bounce, qiov->size);
+#ifndef LIBRBD_SUPPORTS_IOVEC
+    if (cmd != RBD_AIO_DISCARD) {
+        acb->bounce = qemu_blockalign(bs, qiov->size);
+        if (cmd == RBD_AIO_WRITE) {
+            qemu_iovec_to_buf(acb->qiov, 0, acb->bounce, qiov->size);
+        }
     }
-
-    buf = acb->bounce;
+#endif
 
     off = sector_num * BDRV_SECTOR_SIZE;
     size = nb_sectors * BDRV_SECTOR_SIZE;
@@ -700,7 +667,6 @@ static BlockDriverAIOCB *rbd_start_aio(BlockDriverState *bs,
     rcb = g_malloc(sizeof(RADOSCB));
     rcb->done = 0;
     rcb->acb = acb;
-    rcb->buf = buf;
     rcb->s = acb->s;
     rcb->size = size;
     r = rbd_aio_create_completion(rcb, (rbd_callback_t) rbd_finish_aiocb, &c);
@@ -710,10 +676,18 @@ static BlockDriverAIOCB *rbd_start_aio(BlockDriverState *bs,
 
     switch (cmd) {
     case RBD_AIO_WRITE:
-        r = rbd_aio_write(s->image, off, size, buf, c);
+#ifdef LIBRBD_SUPPORTS_IOVEC
+        r = rbd_aio_writev(s->image, qiov->iov, qiov->niov, off, c);
+#else
+        r = rbd_aio_write(s->image, off, size, acb->bounce, c);
+#endif
         break;
     case RBD_AIO_READ:
-        r = rbd_aio_read(s->image, off, size, buf, c);
+#ifdef LIBRBD_SUPPORTS_IOVEC
+        r = rbd_aio_readv(s->image, qiov->iov, qiov->niov, off, c);
+#else
+        r = rbd_aio_read(s->image, off, size, acb->bounce, c);
+#endif
         break;
     case RBD_AIO_DISCARD:
         r = rbd_aio_discard_wrapper(s->image, off, size, c);
@@ -731,6 +705,7 @@ static BlockDriverAIOCB *rbd_start_aio(BlockDriverState *bs,
 failed:
     g_free(rcb);
     s->qemu_aio_count--;
+    qemu_vfree(acb->bounce);
     qemu_aio_release(acb);
     return NULL;
 }
@@ -0,0 +1,363 @@
+/*
+ * Host-wide cache of read-only image data shared between QEMU processes
+ *
+ * Many guests often boot from the same base image.  Each QEMU process
+ * reading it with cache=none goes to the storage on its own; with this
+ * cache, clusters of read-only images are kept in a file mapped by all
+ * processes (typically in /dev/shm), so that only the first one to read a
+ * cluster has to fetch it.
+ *
+ * The file holds a set-associative table of slots, each protected by a
+ * sequence counter.  Readers copy a cluster out and retry-check the counter
+ * like a seqlock; writers take a slot by moving its counter from even to odd
+ * with an atomic compare-and-swap and simply skip the insertion if another
+ * process holds it.  The cache is best effort: a process that dies while
+ * filling a slot leaves it unusable until the file is recreated.
+ *
+ * Images are identified by the device, inode, size and modification time of
+ * their file, combined with those of their backing files, so a modified
+ * image never matches data cached for an older version of it.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "block/shared-cache.h"
+#include "qemu/seqlock.h"
+#include "qemu-barrier.h"
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/file.h>
+#endif
+
+#define SHARED_CACHE_MAGIC      0x51534843 /* "QSHC" */
+#define SHARED_CACHE_VERSION    1
+#define SHARED_CACHE_WAYS       4
+/* Largest number of clusters read into one bounce buffer */
+#define SHARED_CACHE_MAX_RUN    16
+
+typedef struct SharedCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t cluster_size;
+    uint32_t nb_sets;
+    uint64_t clock;         /* stamps slots on insertion, for eviction */
+    uint8_t reserved[40];
+} SharedCacheHeader;
+
+typedef struct SharedCacheSlot {
+    QemuSeqLock lock;
+    uint32_t reserved;
+    uint64_t image_id;      /* 0 if empty */
+    uint64_t cluster;
+    uint64_t stamp;
+} SharedCacheSlot;
+
+static SharedCacheHeader *shared_cache;
+static SharedCacheSlot *shared_cache_slots;
+static uint8_t *shared_cache_data;
+
+static uint64_t shared_cache_size(uint32_t nb_sets)
+{
+    uint64_t nb_slots = (uint64_t)nb_sets * SHARED_CACHE_WAYS;
+
+    return sizeof(SharedCacheHeader) +
+           nb_slots * (sizeof(SharedCacheSlot) + SHARED_CACHE_CLUSTER_SIZE);
+}
+
+#ifndef _WIN32
+int bdrv_shared_cache_init(const char *path, uint64_t size)
+{
+    SharedCacheHeader *h;
+    struct stat st;
+    uint64_t nb_sets = 0;
+    void *p;
+    int fd, ret;
+
+    if (shared_cache) {
+        return -EBUSY;
+    }
+
+    fd = qemu_open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    /* Serialize creation against other processes starting at the same time */
+    if (flock(fd, LOCK_EX) < 0 || fstat(fd, &st) < 0) {
+        ret = -errno;
+        goto out;
+    }
+
+    if (st.st_size == 0) {
+        nb_sets = (size - sizeof(SharedCacheHeader)) /
+                  (SHARED_CACHE_WAYS *
+                   (sizeof(SharedCacheSlot) + SHARED_CACHE_CLUSTER_SIZE));
+        if (size < sizeof(SharedCacheHeader) || nb_sets == 0 ||
+            nb_sets > UINT32_MAX) {
+            ret = -EINVAL;
+            goto out;
+        }
+        size = shared_cache_size(nb_sets);
+        if (ftruncate(fd, size) < 0) {
+            ret = -errno;
+            goto out;
+        }
+    } else {
+        size = st.st_size;
+        if (size < sizeof(SharedCacheHeader)) {
+            ret = -EINVAL;
+            goto out;
+        }
+    }
+
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        ret = -errno;
+        goto out;
+    }
+    h = p;
+
+    if (st.st_size == 0) {
+        /* The file is zero-filled, so every slot starts out empty */
+        h->cluster_size = SHARED_CACHE_CLUSTER_SIZE;
+        h->nb_sets = nb_sets;
+        h->version = SHARED_CACHE_VERSION;
+        smp_wmb();
+        h->magic = SHARED_CACHE_MAGIC;
+    } else if (h->magic != SHARED_CACHE_MAGIC ||
+               h->version != SHARED_CACHE_VERSION ||
+               h->cluster_size != SHARED_CACHE_CLUSTER_SIZE ||
+               h->nb_sets == 0 || shared_cache_size(h->nb_sets) > size) {
+        munmap(p, size);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    shared_cache = h;
+    shared_cache_slots = (SharedCacheSlot *)(h + 1);
+    shared_cache_data = (uint8_t *)(shared_cache_slots +
+                                    (uint64_t)h->nb_sets * SHARED_CACHE_WAYS);
+    ret = 0;
+
+out:
+    /* The mapping stays valid after the file is closed */
+    close(fd);
+    return ret;
+}
+#else
+int bdrv_shared_cache_init(const char *path, uint64_t size)
+{
+    return -ENOTSUP;
+}
+#endif
+
+bool bdrv_shared_cache_enabled(void)
+{
+    return shared_cache != NULL;
+}
+
+static uint64_t shared_cache_hash(uint64_t hash, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    size_t i;
+
+    /* FNV-1a */
+    for (i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+uint64_t bdrv_shared_cache_image_id(BlockDriverState *bs)
+{
+    struct stat st;
+    uint64_t fields[4];
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    if (!shared_cache || !bs->drv || !bs->read_only || bs->encrypted ||
+        !bs->file || !bs->file->drv || !bs->file->drv->protocol_name ||
+        strcmp(bs->file->drv->protocol_name, "file")) {
+        return 0;
+    }
+    if (bs->backing_hd && !bs->backing_hd->shared_cache_id) {
+        return 0;
+    }
+    if (stat(bs->file->filename, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return 0;
+    }
+
+    fields[0] = st.st_dev;
+    fields[1] = st.st_ino;
+    fields[2] = st.st_size;
+    fields[3] = st.st_mtime;
+    hash = shared_cache_hash(hash, fields, sizeof(fields));
+    hash = shared_cache_hash(hash, bs->drv->format_name,
+                             strlen(bs->drv->format_name));
+    if (bs->backing_hd) {
+        hash = shared_cache_hash(hash, &bs->backing_hd->shared_cache_id,
+                                 sizeof(bs->backing_hd->shared_cache_id));
+    }
+
+    return hash ? hash : 1;
+}
+
+static SharedCacheSlot *shared_cache_set(uint64_t image_id, uint64_t cluster)
+{
+    uint64_t set = shared_cache_hash(image_id, &cluster, sizeof(cluster));
+
+    return &shared_cache_slots[(set % shared_cache->nb_sets) *
+                               SHARED_CACHE_WAYS];
+}
+
+static uint8_t *shared_cache_slot_data(SharedCacheSlot *slot)
+{
+    return shared_cache_data +
+           (uint64_t)(slot - shared_cache_slots) * SHARED_CACHE_CLUSTER_SIZE;
+}
+
+static bool shared_cache_lookup(uint64_t image_id, uint64_t cluster,
+                                uint8_t *buf)
+{
+    SharedCacheSlot *set = shared_cache_set(image_id, cluster);
+    int i;
+
+    for (i = 0; i < SHARED_CACHE_WAYS; i++) {
+        SharedCacheSlot *slot = &set[i];
+        unsigned seq = seqlock_read_begin(&slot->lock);
+
+        if (slot->image_id != image_id || slot->cluster != cluster) {
+            continue;
+        }
+        memcpy(buf, shared_cache_slot_data(slot), SHARED_CACHE_CLUSTER_SIZE);
+        if (!seqlock_read_retry(&slot->lock, seq)) {
+            /* Racy, but a lost update only makes eviction less accurate */
+            slot->stamp = shared_cache->clock;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void shared_cache_insert(uint64_t image_id, uint64_t cluster,
+                                const uint8_t *buf)
+{
+    SharedCacheSlot *set = shared_cache_set(image_id, cluster);
+    SharedCacheSlot *victim = NULL;
+    unsigned seq;
+    int i;
+
+    for (i = 0; i < SHARED_CACHE_WAYS; i++) {
+        SharedCacheSlot *slot = &set[i];
+
+        if (slot->image_id == image_id && slot->cluster == cluster) {
+            return;
+        }
+        if (!victim || slot->stamp < victim->stamp) {
+            victim = slot;
+        }
+    }
+
+    /* seqlock_write_begin, but writers in other processes may race with us */
+    seq = victim->lock.sequence;
+    if ((seq & 1) ||
+        !__sync_bool_compare_and_swap(&victim->lock.sequence, seq, seq + 1)) {
+        return;
+    }
+
+    victim->image_id = image_id;
+    victim->cluster = cluster;
+    memcpy(shared_cache_slot_data(victim), buf, SHARED_CACHE_CLUSTER_SIZE);
+    victim->stamp = __sync_add_and_fetch(&shared_cache->clock, 1);
+
+    seqlock_write_end(&victim->lock);
+}
+
+int coroutine_fn bdrv_shared_cache_co_readv(BlockDriverState *bs,
+                                            int64_t sector_num, int nb_sectors,
+                                            QEMUIOVector *qiov)
+{
+    const int cluster_sectors = SHARED_CACHE_CLUSTER_SIZE >> BDRV_SECTOR_BITS;
+    uint64_t image_id = bs->shared_cache_id;
+    int64_t end = sector_num + nb_sectors;
+    int64_t start, stop;
+    bool hit[SHARED_CACHE_MAX_RUN];
+    QEMUIOVector bounce_qiov;
+    struct iovec iov;
+    uint8_t *bounce;
+    int i, n, run, ret = 0;
+
+    bounce = qemu_blockalign(bs, SHARED_CACHE_MAX_RUN *
+                                 SHARED_CACHE_CLUSTER_SIZE);
+
+    /*
+     * Work on cluster-aligned pieces of the request, so that whatever is read
+     * from the image can be added to the cache.  Only the partial cluster at
+     * the end of the image is never cached.
+     */
+    start = sector_num - sector_num % cluster_sectors;
+    while (start < end) {
+        stop = MIN(start + SHARED_CACHE_MAX_RUN * cluster_sectors,
+                   QEMU_ALIGN_UP(end, cluster_sectors));
+        stop = MIN(stop, bs->total_sectors);
+        n = DIV_ROUND_UP(stop - start, cluster_sectors);
+
+        for (i = 0; i < n; i++) {
+            int64_t cluster = start / cluster_sectors + i;
+
+            hit[i] = (cluster + 1) * cluster_sectors <= bs->total_sectors &&
+                     shared_cache_lookup(image_id, cluster,
+                                         bounce + i * SHARED_CACHE_CLUSTER_SIZE);
+        }
+
+        /* Read runs of missing clusters in one request each */
+        for (i = 0; i < n; i = run) {
+            int64_t run_start, run_sectors;
+
+            if (hit[i]) {
+                run = i + 1;
+                continue;
+            }
+            for (run = i; run < n && !hit[run]; run++) {
+                /* nothing */
+            }
+
+            run_start = start + (int64_t)i * cluster_sectors;
+            run_sectors = MIN(start + (int64_t)run * cluster_sectors, stop) -
+                          run_start;
+            iov.iov_base = bounce + i * SHARED_CACHE_CLUSTER_SIZE;
+            iov.iov_len = run_sectors * BDRV_SECTOR_SIZE;
+            qemu_iovec_init_external(&bounce_qiov, &iov, 1);
+
+            ret = bs->drv->bdrv_co_readv(bs, run_start, run_sectors,
+                                         &bounce_qiov);
+            if (ret < 0) {
+                goto out;
+            }
+
+            for (; i < run; i++) {
+                int64_t cluster = start / cluster_sectors + i;
+
+                if ((cluster + 1) * cluster_sectors <= bs->total_sectors) {
+                    shared_cache_insert(image_id, cluster,
+                                        bounce + i * SHARED_CACHE_CLUSTER_SIZE);
+                }
+            }
+        }
+
+        /* Copy the part of the request that falls into this piece */
+        qemu_iovec_from_buf(qiov,
+                            (MAX(start, sector_num) - sector_num) *
+                            BDRV_SECTOR_SIZE,
+                            bounce + (MAX(start, sector_num) - start) *
+                                     BDRV_SECTOR_SIZE,
+                            (MIN(stop, end) - MAX(start, sector_num)) *
+                            BDRV_SECTOR_SIZE);
+        start = stop;
+    }
+
+out:
+    qemu_vfree(bounce);
+    return ret;
+}
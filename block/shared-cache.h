@@ -0,0 +1,42 @@
+/*
+ * Host-wide cache of read-only image data shared between QEMU processes
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef BLOCK_SHARED_CACHE_H
+#define BLOCK_SHARED_CACHE_H
+
+#include "qemu-common.h"
+#include "qemu-coroutine.h"
+#include "block_int.h"
+
+/* Unit of caching, in bytes of guest-visible image data */
+#define SHARED_CACHE_CLUSTER_SIZE   (64 * 1024)
+/* Size of the cache file when it is created and no size is given */
+#define SHARED_CACHE_DEFAULT_SIZE   (1024 * 1024 * 1024)
+
+/*
+ * Maps the cache file at path, creating it with the given size if it does
+ * not exist yet.  An existing cache keeps its size.  Returns -errno.
+ */
+int bdrv_shared_cache_init(const char *path, uint64_t size);
+bool bdrv_shared_cache_enabled(void);
+
+/*
+ * Returns the key under which the data of the read-only image bs is cached,
+ * or 0 if bs cannot use the cache.  Must be called after the backing file
+ * of bs has been opened.
+ */
+uint64_t bdrv_shared_cache_image_id(BlockDriverState *bs);
+
+/*
+ * Reads from bs->drv like bdrv_co_readv, serving whole clusters from the
+ * cache where possible and adding the clusters read from the image.
+ */
+int coroutine_fn bdrv_shared_cache_co_readv(BlockDriverState *bs,
+                                            int64_t sector_num, int nb_sectors,
+                                            QEMUIOVector *qiov);
+
+#endif
@@ -89,6 +89,9 @@
 #define SD_INODE_SIZE (sizeof(SheepdogInode))
 #define CURRENT_VDI_ID 0
 
+/* Data objects are spread over this many connections to the gateway */
+#define SD_NR_CONNECTIONS 4
+
 typedef struct SheepdogReq {
     uint8_t proto_ver;
     uint8_t opcode;
@@ -247,9 +250,11 @@ static inline bool is_snapshot(struct SheepdogInode *inode)
 #endif
 
 typedef struct SheepdogAIOCB SheepdogAIOCB;
+typedef struct SheepdogConn SheepdogConn;
 
 typedef struct AIOReq {
     SheepdogAIOCB *aiocb;
+    SheepdogConn *conn;
     unsigned int iov_offset;
 
     uint64_t oid;
@@ -260,6 +265,10 @@ typedef struct AIOReq {
     uint32_t id;
 
     QLIST_ENTRY(AIOReq) aio_siblings;
+
+    /* Adjacent writes sent as part of this request share its response */
+    QSIMPLEQ_HEAD(, AIOReq) merged;
+    QSIMPLEQ_ENTRY(AIOReq) send_entry;
 } AIOReq;
 
 enum AIOCBState {
@@ -285,6 +294,21 @@ struct SheepdogAIOCB {
     int nr_pending;
 };
 
+struct SheepdogConn {
+    struct BDRVSheepdogState *s;
+    int fd;
+
+    CoMutex lock;
+    Coroutine *co_send;
+    Coroutine *co_recv;
+
+    /* Plain writes issued while another coroutine is sending; it sends
+     * them before dropping the lock, merging those that are adjacent.
+     */
+    bool sending;
+    QSIMPLEQ_HEAD(, AIOReq) send_queue;
+};
+
 typedef struct BDRVSheepdogState {
     SheepdogInode inode;
 
@@ -297,13 +321,10 @@ typedef struct BDRVSheepdogState {
 
     char *addr;
     char *port;
-    int fd;
+    SheepdogConn conns[SD_NR_CONNECTIONS];
+    int nr_conns;
     int flush_fd;
 
-    CoMutex lock;
-    Coroutine *co_send;
-    Coroutine *co_recv;
-
     uint32_t aioreq_seq_num;
     QLIST_HEAD(inflight_aio_head, AIOReq) inflight_aio_head;
     QLIST_HEAD(pending_aio_head, AIOReq) pending_aio_head;
@@ -359,7 +380,10 @@ static const char * sd_strerror(int err)
  * 1. In sd_co_rw_vector, we send the I/O requests to the server and
  *    link the requests to the inflight_list in the
  *    BDRVSheepdogState.  The function exits without waiting for
- *    receiving the response.
+ *    receiving the response.  Requests for a data object always use
+ *    the same connection, picked by the object index, so the order of
+ *    requests to one object is kept while different objects proceed in
+ *    parallel.  The vdi object uses the first connection.
  *
  * 2. We receive the response in aio_read_response, the fd handler to
  *    the sheepdog connection.  If metadata update is needed, we send
@@ -377,6 +401,12 @@ static inline AIOReq *alloc_aio_req(BDRVSheepdogState *s, SheepdogAIOCB *acb,
 
     aio_req = g_malloc(sizeof(*aio_req));
     aio_req->aiocb = acb;
+    if (is_data_obj(oid)) {
+        aio_req->conn = &s->conns[data_oid_to_idx(oid) % s->nr_conns];
+    } else {
+        aio_req->conn = &s->conns[0];
+    }
+    QSIMPLEQ_INIT(&aio_req->merged);
     aio_req->iov_offset = iov_offset;
     aio_req->oid = oid;
     aio_req->base_oid = base_oid;
@@ -661,16 +691,17 @@ static void coroutine_fn send_pending_req(BDRVSheepdogState *s, uint64_t oid)
  * Receive responses of the I/O requests.
  *
  * This function is registered as a fd handler, and called from the
- * main loop when s->fd is ready for reading responses.
+ * main loop when conn->fd is ready for reading responses.
  */
 static void coroutine_fn aio_read_response(void *opaque)
 {
     SheepdogObjRsp rsp;
-    BDRVSheepdogState *s = opaque;
-    int fd = s->fd;
+    SheepdogConn *conn = opaque;
+    BDRVSheepdogState *s = conn->s;
+    int fd = conn->fd;
     int ret;
-    AIOReq *aio_req = NULL;
-    SheepdogAIOCB *acb;
+    AIOReq *aio_req = NULL, *merged;
+    SheepdogAIOCB *acb, *merged_acb;
     unsigned long idx;
 
     if (QLIST_EMPTY(&s->inflight_aio_head)) {
@@ -701,7 +732,7 @@ static void coroutine_fn aio_read_response(void *opaque)
     case AIOCB_WRITE_UDATA:
         /* this coroutine context is no longer suitable for co_recv
          * because we may send data to update vdi objects */
-        s->co_recv = NULL;
+        conn->co_recv = NULL;
         if (!is_data_obj(aio_req->oid)) {
             break;
         }
@@ -741,6 +772,18 @@ static void coroutine_fn aio_read_response(void *opaque)
         error_report("%s", sd_strerror(rsp.result));
     }
 
+    while ((merged = QSIMPLEQ_FIRST(&aio_req->merged)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&aio_req->merged, send_entry);
+        merged_acb = merged->aiocb;
+        if (rsp.result != SD_RES_SUCCESS) {
+            merged_acb->ret = -EIO;
+        }
+        free_aio_req(s, merged);
+        if (!merged_acb->nr_pending) {
+            merged_acb->aio_done_func(merged_acb);
+        }
+    }
+
     free_aio_req(s, aio_req);
     if (!acb->nr_pending) {
         /*
@@ -750,30 +793,31 @@ static void coroutine_fn aio_read_response(void *opaque)
         acb->aio_done_func(acb);
     }
 out:
-    s->co_recv = NULL;
+    conn->co_recv = NULL;
 }
 
 static void co_read_response(void *opaque)
 {
-    BDRVSheepdogState *s = opaque;
+    SheepdogConn *conn = opaque;
 
-    if (!s->co_recv) {
-        s->co_recv = qemu_coroutine_create(aio_read_response);
+    if (!conn->co_recv) {
+        conn->co_recv = qemu_coroutine_create(aio_read_response);
     }
 
-    qemu_coroutine_enter(s->co_recv, opaque);
+    qemu_coroutine_enter(conn->co_recv, opaque);
 }
 
 static void co_write_request(void *opaque)
 {
-    BDRVSheepdogState *s = opaque;
+    SheepdogConn *conn = opaque;
 
-    qemu_coroutine_enter(s->co_send, NULL);
+    qemu_coroutine_enter(conn->co_send, NULL);
 }
 
 static int aio_flush_request(void *opaque)
 {
-    BDRVSheepdogState *s = opaque;
+    SheepdogConn *conn = opaque;
+    BDRVSheepdogState *s = conn->s;
 
     return !QLIST_EMPTY(&s->inflight_aio_head) ||
         !QLIST_EMPTY(&s->pending_aio_head);
@@ -794,8 +838,9 @@ static int set_nodelay(int fd)
  * We cannot use this discriptor for other operations because
  * the block driver may be on waiting response from the server.
  */
-static int get_sheep_fd(BDRVSheepdogState *s)
+static int get_sheep_fd(SheepdogConn *conn)
 {
+    BDRVSheepdogState *s = conn->s;
     int ret, fd;
 
     fd = connect_to_sdog(s->addr, s->port);
@@ -813,7 +858,8 @@ static int get_sheep_fd(BDRVSheepdogState *s)
         return -errno;
     }
 
-    qemu_aio_set_fd_handler(fd, co_read_response, NULL, aio_flush_request, s);
+    qemu_aio_set_fd_handler(fd, co_read_response, NULL, aio_flush_request,
+                            conn);
     return fd;
 }
 
@@ -942,10 +988,13 @@ out:
     return ret;
 }
 
-static int coroutine_fn add_aio_request(BDRVSheepdogState *s, AIOReq *aio_req,
-                           struct iovec *iov, int niov, bool create,
-                           enum AIOCBState aiocb_type)
+static int coroutine_fn send_aio_request(BDRVSheepdogState *s,
+                                         AIOReq *aio_req,
+                                         struct iovec *iov, int niov,
+                                         bool create,
+                                         enum AIOCBState aiocb_type)
 {
+    SheepdogConn *conn = aio_req->conn;
     int nr_copies = s->inode.nr_copies;
     SheepdogObjReq hdr;
     unsigned int wlen;
@@ -955,11 +1004,16 @@ static int coroutine_fn add_aio_request(BDRVSheepdogState *s, AIOReq *aio_req,
     uint64_t offset = aio_req->offset;
     uint8_t flags = aio_req->flags;
     uint64_t old_oid = aio_req->base_oid;
+    AIOReq *merged;
 
     if (!nr_copies) {
         error_report("bug");
     }
 
+    QSIMPLEQ_FOREACH(merged, &aio_req->merged, send_entry) {
+        datalen += merged->data_len;
+    }
+
     memset(&hdr, 0, sizeof(hdr));
 
     if (aiocb_type == AIOCB_READ_UDATA) {
@@ -989,37 +1043,125 @@ static int coroutine_fn add_aio_request(BDRVSheepdogState *s, AIOReq *aio_req,
 
     hdr.id = aio_req->id;
 
-    qemu_co_mutex_lock(&s->lock);
-    s->co_send = qemu_coroutine_self();
-    qemu_aio_set_fd_handler(s->fd, co_read_response, co_write_request,
-                            aio_flush_request, s);
-    socket_set_cork(s->fd, 1);
+    conn->co_send = qemu_coroutine_self();
+    qemu_aio_set_fd_handler(conn->fd, co_read_response, co_write_request,
+                            aio_flush_request, conn);
+    socket_set_cork(conn->fd, 1);
 
     /* send a header */
-    ret = qemu_co_send(s->fd, &hdr, sizeof(hdr));
+    ret = qemu_co_send(conn->fd, &hdr, sizeof(hdr));
     if (ret < 0) {
-        qemu_co_mutex_unlock(&s->lock);
         error_report("failed to send a req, %s", strerror(errno));
         return -errno;
     }
 
     if (wlen) {
-        ret = qemu_co_sendv(s->fd, iov, niov, aio_req->iov_offset, wlen);
+        /* the data goes out straight from the guest buffers */
+        ret = qemu_co_sendv(conn->fd, iov, niov, aio_req->iov_offset,
+                            aio_req->data_len);
+        QSIMPLEQ_FOREACH(merged, &aio_req->merged, send_entry) {
+            if (ret < 0) {
+                break;
+            }
+            ret = qemu_co_sendv(conn->fd, merged->aiocb->qiov->iov,
+                                merged->aiocb->qiov->niov,
+                                merged->iov_offset, merged->data_len);
+        }
         if (ret < 0) {
-            qemu_co_mutex_unlock(&s->lock);
             error_report("failed to send a data, %s", strerror(errno));
             return -errno;
         }
     }
 
-    socket_set_cork(s->fd, 0);
-    qemu_aio_set_fd_handler(s->fd, co_read_response, NULL,
-                            aio_flush_request, s);
-    qemu_co_mutex_unlock(&s->lock);
+    socket_set_cork(conn->fd, 0);
+    qemu_aio_set_fd_handler(conn->fd, co_read_response, NULL,
+                            aio_flush_request, conn);
 
     return 0;
 }
 
+/*
+ * Move the queued writes that continue aio_req within the same object
+ * to its merged list, so they go out as a single request.
+ */
+static void merge_queued_writes(SheepdogConn *conn, AIOReq *aio_req)
+{
+    AIOReq *areq;
+    uint64_t end = aio_req->offset + aio_req->data_len;
+    bool found;
+
+    do {
+        found = false;
+        QSIMPLEQ_FOREACH(areq, &conn->send_queue, send_entry) {
+            if (areq->oid == aio_req->oid && areq->offset == end) {
+                QSIMPLEQ_REMOVE(&conn->send_queue, areq, AIOReq, send_entry);
+                QSIMPLEQ_INSERT_TAIL(&aio_req->merged, areq, send_entry);
+                end += areq->data_len;
+                found = true;
+                break;
+            }
+        }
+    } while (found);
+}
+
+static void coroutine_fn send_queued_writes(BDRVSheepdogState *s,
+                                            SheepdogConn *conn)
+{
+    AIOReq *aio_req, *merged;
+    SheepdogAIOCB *acb;
+    int ret;
+
+    while ((aio_req = QSIMPLEQ_FIRST(&conn->send_queue)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&conn->send_queue, send_entry);
+        merge_queued_writes(conn, aio_req);
+
+        acb = aio_req->aiocb;
+        ret = send_aio_request(s, aio_req, acb->qiov->iov, acb->qiov->niov,
+                               false, AIOCB_WRITE_UDATA);
+        if (ret < 0) {
+            error_report("add_aio_request is failed");
+            while ((merged = QSIMPLEQ_FIRST(&aio_req->merged)) != NULL) {
+                QSIMPLEQ_REMOVE_HEAD(&aio_req->merged, send_entry);
+                acb = merged->aiocb;
+                acb->ret = -EIO;
+                free_aio_req(s, merged);
+                if (!acb->nr_pending) {
+                    sd_finish_aiocb(acb);
+                }
+            }
+            acb = aio_req->aiocb;
+            acb->ret = -EIO;
+            free_aio_req(s, aio_req);
+            if (!acb->nr_pending) {
+                sd_finish_aiocb(acb);
+            }
+        }
+    }
+}
+
+static int coroutine_fn add_aio_request(BDRVSheepdogState *s, AIOReq *aio_req,
+                           struct iovec *iov, int niov, bool create,
+                           enum AIOCBState aiocb_type)
+{
+    SheepdogConn *conn = aio_req->conn;
+    int ret;
+
+    if (conn->sending && aiocb_type == AIOCB_WRITE_UDATA && !create &&
+        is_data_obj(aio_req->oid) && iov == aio_req->aiocb->qiov->iov) {
+        QSIMPLEQ_INSERT_TAIL(&conn->send_queue, aio_req, send_entry);
+        return 0;
+    }
+
+    qemu_co_mutex_lock(&conn->lock);
+    conn->sending = true;
+    ret = send_aio_request(s, aio_req, iov, niov, create, aiocb_type);
+    send_queued_writes(s, conn);
+    conn->sending = false;
+    qemu_co_mutex_unlock(&conn->lock);
+
+    return ret;
+}
+
 static int read_write_object(int fd, char *buf, uint64_t oid, int copies,
                              unsigned int datalen, uint64_t offset,
                              bool write, bool create, bool cache)
@@ -1087,7 +1229,7 @@ static int write_object(int fd, char *buf, uint64_t oid, int copies,
 
 static int sd_open(BlockDriverState *bs, const char *filename, int flags)
 {
-    int ret, fd;
+    int ret, fd, i;
     uint32_t vid = 0;
     BDRVSheepdogState *s = bs->opaque;
     char vdi[SD_MAX_VDI_LEN], tag[SD_MAX_VDI_TAG_LEN];
@@ -1098,7 +1240,13 @@ static int sd_open(BlockDriverState *bs, const char *filename, int flags)
 
     QLIST_INIT(&s->inflight_aio_head);
     QLIST_INIT(&s->pending_aio_head);
-    s->fd = -1;
+    s->nr_conns = SD_NR_CONNECTIONS;
+    for (i = 0; i < s->nr_conns; i++) {
+        s->conns[i].s = s;
+        s->conns[i].fd = -1;
+        qemu_co_mutex_init(&s->conns[i].lock);
+        QSIMPLEQ_INIT(&s->conns[i].send_queue);
+    }
 
     memset(vdi, 0, sizeof(vdi));
     memset(tag, 0, sizeof(tag));
@@ -1106,10 +1254,12 @@ static int sd_open(BlockDriverState *bs, const char *filename, int flags)
         ret = -EINVAL;
         goto out;
     }
-    s->fd = get_sheep_fd(s);
-    if (s->fd < 0) {
-        ret = s->fd;
-        goto out;
+    for (i = 0; i < s->nr_conns; i++) {
+        s->conns[i].fd = get_sheep_fd(&s->conns[i]);
+        if (s->conns[i].fd < 0) {
+            ret = s->conns[i].fd;
+            goto out;
+        }
     }
 
     ret = find_vdi_name(s, vdi, snapid, tag, &vid, 0);
@@ -1153,13 +1303,14 @@ static int sd_open(BlockDriverState *bs, const char *filename, int flags)
 
     bs->total_sectors = s->inode.vdi_size / SECTOR_SIZE;
     pstrcpy(s->name, sizeof(s->name), vdi);
-    qemu_co_mutex_init(&s->lock);
     g_free(buf);
     return 0;
 out:
-    qemu_aio_set_fd_handler(s->fd, NULL, NULL, NULL, NULL);
-    if (s->fd >= 0) {
-        closesocket(s->fd);
+    for (i = 0; i < s->nr_conns; i++) {
+        if (s->conns[i].fd >= 0) {
+            qemu_aio_set_fd_handler(s->conns[i].fd, NULL, NULL, NULL, NULL);
+            closesocket(s->conns[i].fd);
+        }
     }
     g_free(buf);
     return ret;
@@ -1359,7 +1510,7 @@ static void sd_close(BlockDriverState *bs)
     SheepdogVdiReq hdr;
     SheepdogVdiRsp *rsp = (SheepdogVdiRsp *)&hdr;
     unsigned int wlen, rlen = 0;
-    int fd, ret;
+    int fd, ret, i;
 
     dprintf("%s\n", s->name);
 
@@ -1384,8 +1535,10 @@ static void sd_close(BlockDriverState *bs)
         error_report("%s, %s", sd_strerror(rsp->result), s->name);
     }
 
-    qemu_aio_set_fd_handler(s->fd, NULL, NULL, NULL, NULL);
-    closesocket(s->fd);
+    for (i = 0; i < s->nr_conns; i++) {
+        qemu_aio_set_fd_handler(s->conns[i].fd, NULL, NULL, NULL, NULL);
+        closesocket(s->conns[i].fd);
+    }
     if (s->cache_enabled) {
         closesocket(s->flush_fd);
     }
@@ -23,6 +23,15 @@ enum {
      * contiguous regions of the image is efficient.
      */
     STREAM_BUFFER_SIZE = 512 * 1024, /* in bytes */
+
+    /*
+     * Number of buffers that are populated in parallel.  Copy-on-read
+     * allocates clusters in the image file in the order the requests
+     * complete, so more than one would scatter the streamed data, and
+     * pausing or throttling the job would only take effect after the
+     * requests already issued.
+     */
+    STREAM_MAX_IN_FLIGHT = 1,
 };
 
 #define SLICE_TIME 100000000ULL /* ns */
@@ -33,8 +42,28 @@ typedef struct StreamBlockJob {
     BlockDriverState *base;
     BlockdevOnError on_error;
     char backing_file_id[1024];
+
+    /* Areas the guest is expected to read first, copied before the rest */
+    PrefetchExtent *hints;
+    int nb_hints;
+
+    /* Populate requests still running and the job waiting for them */
+    int in_flight;
+    bool waiting;
+
+    /* First error and the failed range, reported once in_flight drops */
+    int ret;
+    int64_t err_sector;
+    int64_t err_sectors;
 } StreamBlockJob;
 
+typedef struct StreamOp {
+    StreamBlockJob *s;
+    int64_t sector_num;
+    int nb_sectors;
+    bool prefetch;  /* neither counted in progress nor reported on error */
+} StreamOp;
+
 static int coroutine_fn stream_populate(BlockDriverState *bs,
                                         int64_t sector_num, int nb_sectors,
                                         void *buf)
@@ -51,6 +80,73 @@ static int coroutine_fn stream_populate(BlockDriverState *bs,
     return bdrv_co_copy_on_readv(bs, sector_num, nb_sectors, &qiov);
 }
 
+static void stream_set_error(StreamBlockJob *s, int64_t sector_num,
+                             int nb_sectors, int ret)
+{
+    if (s->ret == 0 || sector_num < s->err_sector) {
+        s->err_sector = sector_num;
+    }
+    if (s->ret == 0) {
+        s->ret = ret;
+    }
+    s->err_sectors += nb_sectors;
+}
+
+static void coroutine_fn stream_populate_entry(void *opaque)
+{
+    StreamOp *op = opaque;
+    StreamBlockJob *s = op->s;
+    BlockDriverState *bs = s->common.bs;
+    void *buf;
+    int ret;
+
+    buf = qemu_blockalign(bs, op->nb_sectors * BDRV_SECTOR_SIZE);
+    ret = stream_populate(bs, op->sector_num, op->nb_sectors, buf);
+    qemu_vfree(buf);
+
+    if (op->prefetch) {
+        /* The linear pass copies whatever failed here, or reports it */
+    } else if (ret < 0) {
+        stream_set_error(s, op->sector_num, op->nb_sectors, ret);
+    } else {
+        /* Publish progress */
+        s->common.offset += op->nb_sectors * BDRV_SECTOR_SIZE;
+    }
+    g_free(op);
+
+    s->in_flight--;
+    if (s->waiting) {
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
+/* Wait until fewer than max_in_flight populate requests are running */
+static void coroutine_fn stream_wait(StreamBlockJob *s, int max_in_flight)
+{
+    while (s->in_flight > max_in_flight - 1) {
+        s->waiting = true;
+        qemu_coroutine_yield();
+        s->waiting = false;
+    }
+}
+
+static void coroutine_fn stream_start_populate(StreamBlockJob *s,
+                                               int64_t sector_num,
+                                               int nb_sectors, bool prefetch)
+{
+    StreamOp *op = g_new(StreamOp, 1);
+    Coroutine *co;
+
+    op->s = s;
+    op->sector_num = sector_num;
+    op->nb_sectors = nb_sectors;
+    op->prefetch = prefetch;
+
+    s->in_flight++;
+    co = qemu_coroutine_create(stream_populate_entry);
+    qemu_coroutine_enter(co, op);
+}
+
 static void close_unused_images(BlockDriverState *top, BlockDriverState *base,
                                 const char *base_id)
 {
@@ -73,16 +169,49 @@ static void close_unused_images(BlockDriverState *top, BlockDriverState *base,
     top->backing_hd = base;
 }
 
+/* Copy the hinted areas in the order the guest is expected to read them */
+static void coroutine_fn stream_prefetch(StreamBlockJob *s)
+{
+    BlockDriverState *bs = s->common.bs;
+    int i;
+
+    for (i = 0; i < s->nb_hints; i++) {
+        int64_t sector_num = s->hints[i].sector_num;
+        int64_t end = sector_num + s->hints[i].nb_sectors;
+        int n, ret;
+
+        while (sector_num < end) {
+            block_job_sleep_ns(&s->common, rt_clock, 0);
+            if (block_job_is_cancelled(&s->common)) {
+                return;
+            }
+
+            n = MIN(end - sector_num, STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE);
+            ret = bdrv_co_is_allocated(bs, sector_num, n, &n);
+            if (ret < 0) {
+                /* Left to the linear pass, which handles the error */
+                break;
+            } else if (ret == 0) {
+                stream_wait(s, STREAM_MAX_IN_FLIGHT);
+                stream_start_populate(s, sector_num, n, true);
+            }
+            sector_num += MAX(n, 1);
+        }
+    }
+    stream_wait(s, 1);
+}
+
 static void coroutine_fn stream_run(void *opaque)
 {
     StreamBlockJob *s = opaque;
     BlockDriverState *bs = s->common.bs;
     BlockDriverState *base = s->base;
     int64_t sector_num, end;
+    int64_t extent_end = 0;
+    bool copy = false;
     int error = 0;
     int ret = 0;
     int n = 0;
-    void *buf;
 
     s->common.len = bdrv_getlength(bs);
     if (s->common.len < 0) {
@@ -91,7 +220,6 @@ static void coroutine_fn stream_run(void *opaque)
     }
 
     end = s->common.len >> BDRV_SECTOR_BITS;
-    buf = qemu_blockalign(bs, STREAM_BUFFER_SIZE);
 
     /* Turn on copy-on-read for the whole block device so that guest read
      * requests help us make progress.  Only do this when copying the entire
@@ -102,9 +230,23 @@ static void coroutine_fn stream_run(void *opaque)
         bdrv_enable_copy_on_read(bs);
     }
 
-    for (sector_num = 0; sector_num < end; sector_num += n) {
+    stream_prefetch(s);
+    g_free(s->hints);
+    s->hints = NULL;
+
+    for (sector_num = 0; ; sector_num += n) {
         uint64_t delay_ns = 0;
-        bool copy;
+
+        /* Make room for the next request before sleeping, so that the job
+         * is idle while it is paused or throttled.
+         */
+        stream_wait(s, STREAM_MAX_IN_FLIGHT);
+        if (sector_num >= end) {
+            stream_wait(s, 1);
+            if (s->ret == 0) {
+                break;
+            }
+        }
 
 wait:
         /* Note that even when no rate limit is applied we need to yield
@@ -115,53 +257,86 @@ wait:
             break;
         }
 
-        ret = bdrv_co_is_allocated(bs, sector_num,
-                                   STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE, &n);
-        if (ret == 1) {
-            /* Allocated in the top, no need to copy.  */
-            copy = false;
-        } else {
-            /* Copy if allocated in the intermediate images.  Limit to the
-             * known-unallocated area [sector_num, sector_num+n).  */
-            ret = bdrv_co_is_allocated_above(bs->backing_hd, base,
-                                             sector_num, n, &n);
-
-            /* Finish early if end of backing file has been reached */
-            if (ret == 0 && n == 0) {
-                n = end - sector_num;
-            }
+        if (s->ret < 0) {
+            BlockErrorAction action;
 
-            copy = (ret == 1);
-        }
-        trace_stream_one_iteration(s, sector_num, n, ret);
-        if (ret >= 0 && copy) {
-            if (s->common.speed) {
-                delay_ns = ratelimit_calculate_delay(&s->limit, n);
-                if (delay_ns > 0) {
-                    goto wait;
+            /* Settle all requests before acting on the first error */
+            stream_wait(s, 1);
+            action = block_job_error_action(&s->common, s->common.bs,
+                                            s->on_error, true, -s->ret);
+            n = 0;
+            if (action == BDRV_ACTION_STOP) {
+                /* Everything below the first failure has completed */
+                sector_num = s->err_sector;
+                s->common.offset = sector_num * BDRV_SECTOR_SIZE;
+                extent_end = 0;
+            } else {
+                if (error == 0) {
+                    error = s->ret;
+                }
+                if (action == BDRV_ACTION_REPORT) {
+                    break;
                 }
+                s->common.offset += s->err_sectors * BDRV_SECTOR_SIZE;
             }
-            ret = stream_populate(bs, sector_num, n, buf);
+            s->ret = 0;
+            s->err_sectors = 0;
+            continue;
         }
-        if (ret < 0) {
-            BlockErrorAction action =
-                block_job_error_action(&s->common, s->common.bs, s->on_error,
-                                       true, -ret);
-            if (action == BDRV_ACTION_STOP) {
-                n = 0;
-                continue;
+
+        /* Look up whole extents so that large unallocated or already
+         * streamed areas are skipped with a single query.
+         */
+        if (sector_num >= extent_end) {
+            int64_t max = MIN(end - sector_num, INT_MAX);
+
+            ret = bdrv_co_is_allocated(bs, sector_num, max, &n);
+            if (ret == 1) {
+                /* Allocated in the top, no need to copy.  */
+                copy = false;
+            } else if (ret >= 0) {
+                /* Copy if allocated in the intermediate images.  Limit to the
+                 * known-unallocated area [sector_num, sector_num+n).  */
+                ret = bdrv_co_is_allocated_above(bs->backing_hd, base,
+                                                 sector_num, n, &n);
+
+                /* Finish early if end of backing file has been reached */
+                if (ret == 0 && n == 0) {
+                    n = end - sector_num;
+                }
+
+                copy = (ret == 1);
             }
-            if (error == 0) {
-                error = ret;
+            trace_stream_one_iteration(s, sector_num, n, ret);
+            if (ret < 0) {
+                n = MIN(end - sector_num,
+                        STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE);
+                stream_set_error(s, sector_num, n, ret);
+                continue;
             }
-            if (action == BDRV_ACTION_REPORT) {
-                break;
+            extent_end = sector_num + n;
+        }
+
+        n = extent_end - sector_num;
+        if (!copy) {
+            s->common.offset += n * BDRV_SECTOR_SIZE;
+            continue;
+        }
+
+        n = MIN(n, STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE);
+        if (s->common.speed) {
+            delay_ns = ratelimit_calculate_delay(&s->limit, n);
+            if (delay_ns > 0) {
+                goto wait;
             }
         }
-        ret = 0;
+        stream_wait(s, STREAM_MAX_IN_FLIGHT);
+        stream_start_populate(s, sector_num, n, false);
+    }
 
-        /* Publish progress */
-        s->common.offset += n * BDRV_SECTOR_SIZE;
+    stream_wait(s, 1);
+    if (s->ret < 0 && error == 0) {
+        error = s->ret;
     }
 
     if (!base) {
@@ -171,7 +346,7 @@ wait:
     /* Do not remove the backing file if an error was there but ignored.  */
     ret = error;
 
-    if (!block_job_is_cancelled(&s->common) && sector_num == end && ret == 0) {
+    if (!block_job_is_cancelled(&s->common) && sector_num >= end && ret == 0) {
         const char *base_id = NULL, *base_fmt = NULL;
         if (base) {
             base_id = s->backing_file_id;
@@ -183,7 +358,6 @@ wait:
         close_unused_images(bs, base, base_id);
     }
 
-    qemu_vfree(buf);
     block_job_completed(&s->common, ret);
 }
 
@@ -205,12 +379,14 @@ static BlockJobType stream_job_type = {
 };
 
 void stream_start(BlockDriverState *bs, BlockDriverState *base,
-                  const char *base_id, int64_t speed,
-                  BlockdevOnError on_error,
+                  const char *base_id, const char *hint_file,
+                  int64_t speed, BlockdevOnError on_error,
                   BlockDriverCompletionFunc *cb,
                   void *opaque, Error **errp)
 {
     StreamBlockJob *s;
+    PrefetchExtent *hints = NULL;
+    int nb_hints = 0;
 
     if ((on_error == BLOCKDEV_ON_ERROR_STOP ||
          on_error == BLOCKDEV_ON_ERROR_ENOSPC) &&
@@ -219,11 +395,22 @@ void stream_start(BlockDriverState *bs, BlockDriverState *base,
         return;
     }
 
+    if (hint_file) {
+        nb_hints = prefetch_hints_load(bs, hint_file, &hints, errp);
+        if (nb_hints < 0) {
+            return;
+        }
+    }
+
     s = block_job_create(&stream_job_type, bs, speed, cb, opaque, errp);
     if (!s) {
+        g_free(hints);
         return;
     }
 
+    s->hints = hints;
+    s->nb_hints = nb_hints;
+
     s->base = base;
     if (base_id) {
         pstrcpy(s->backing_file_id, sizeof(s->backing_file_id), base_id);
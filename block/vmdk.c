@@ -66,7 +66,8 @@ typedef struct {
     uint16_t compressAlgorithm;
 } QEMU_PACKED VMDK4Header;
 
-#define L2_CACHE_SIZE 16
+/* Grain tables cached per extent, least recently used ones are evicted */
+#define L2_CACHE_SIZE 256
 
 typedef struct VmdkExtent {
     BlockDriverState *file;
@@ -84,9 +85,11 @@ typedef struct VmdkExtent {
     uint32_t l1_entry_sectors;
 
     unsigned int l2_size;
+    unsigned int l2_cache_size;
     uint32_t *l2_cache;
     uint32_t l2_cache_offsets[L2_CACHE_SIZE];
-    uint32_t l2_cache_counts[L2_CACHE_SIZE];
+    uint32_t l2_cache_used[L2_CACHE_SIZE];
+    uint32_t l2_cache_clock;
 
     unsigned int cluster_sectors;
 } VmdkExtent;
@@ -435,8 +438,10 @@ static int vmdk_init_tables(BlockDriverState *bs, VmdkExtent *extent)
         }
     }
 
+    /* More tables than the extent has will never be needed */
+    extent->l2_cache_size = MIN(L2_CACHE_SIZE, extent->l1_size);
     extent->l2_cache =
-        g_malloc(extent->l2_size * L2_CACHE_SIZE * sizeof(uint32_t));
+        g_malloc(extent->l2_size * extent->l2_cache_size * sizeof(uint32_t));
     return 0;
  fail_l1b:
     g_free(extent->l1_backup_table);
@@ -837,8 +842,8 @@ static int get_cluster_offset(BlockDriverState *bs,
                                     uint64_t *cluster_offset)
 {
     unsigned int l1_index, l2_offset, l2_index;
-    int min_index, i, j;
-    uint32_t min_count, *l2_table, tmp = 0;
+    int min_index, i;
+    uint32_t min_used, *l2_table, tmp = 0;
 
     if (m_data) {
         m_data->valid = 0;
@@ -857,28 +862,30 @@ static int get_cluster_offset(BlockDriverState *bs,
     if (!l2_offset) {
         return -1;
     }
-    for (i = 0; i < L2_CACHE_SIZE; i++) {
+    if (++extent->l2_cache_clock == 0) {
+        /* the clock wrapped, start over with all entries equally old */
+        memset(extent->l2_cache_used, 0, sizeof(extent->l2_cache_used));
+        extent->l2_cache_clock = 1;
+    }
+    for (i = 0; i < extent->l2_cache_size; i++) {
         if (l2_offset == extent->l2_cache_offsets[i]) {
-            /* increment the hit count */
-            if (++extent->l2_cache_counts[i] == 0xffffffff) {
-                for (j = 0; j < L2_CACHE_SIZE; j++) {
-                    extent->l2_cache_counts[j] >>= 1;
-                }
-            }
+            extent->l2_cache_used[i] = extent->l2_cache_clock;
             l2_table = extent->l2_cache + (i * extent->l2_size);
             goto found;
         }
     }
-    /* not found: load a new entry in the least used one */
+    /* not found: load a new entry in the least recently used one */
     min_index = 0;
-    min_count = 0xffffffff;
-    for (i = 0; i < L2_CACHE_SIZE; i++) {
-        if (extent->l2_cache_counts[i] < min_count) {
-            min_count = extent->l2_cache_counts[i];
+    min_used = 0xffffffff;
+    for (i = 0; i < extent->l2_cache_size; i++) {
+        if (extent->l2_cache_used[i] < min_used) {
+            min_used = extent->l2_cache_used[i];
             min_index = i;
         }
     }
     l2_table = extent->l2_cache + (min_index * extent->l2_size);
+    /* the entry is invalid while it is being read */
+    extent->l2_cache_offsets[min_index] = 0;
     if (bdrv_pread(
                 extent->file,
                 (int64_t)l2_offset * 512,
@@ -889,7 +896,7 @@ static int get_cluster_offset(BlockDriverState *bs,
     }
 
     extent->l2_cache_offsets[min_index] = l2_offset;
-    extent->l2_cache_counts[min_index] = 1;
+    extent->l2_cache_used[min_index] = extent->l2_cache_clock;
  found:
     l2_index = ((offset >> 9) / extent->cluster_sectors) % extent->l2_size;
     *cluster_offset = le32_to_cpu(l2_table[l2_index]);
@@ -1086,32 +1093,71 @@ static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
     return ret;
 }
 
-static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+/*
+ * Look up the grain containing sector_num together with the following grains
+ * that can be read in the same request: grains that are contiguous in the
+ * extent file, or that are all unallocated.  Returns the number of sectors
+ * of the run, at most nb_sectors, and the file offset of the first grain in
+ * *cluster_offset if the run is allocated.  Called with s->lock held.
+ */
+static int64_t vmdk_find_run(BlockDriverState *bs, VmdkExtent *extent,
+                             int64_t sector_num, int64_t nb_sectors,
+                             uint64_t *cluster_offset, bool *allocated)
+{
+    uint64_t extent_begin_sector = extent->end_sector - extent->sectors;
+    uint64_t index_in_cluster, next_offset;
+    int64_t n;
+
+    *allocated = !get_cluster_offset(bs, extent, NULL, sector_num << 9, 0,
+                                     cluster_offset);
+    index_in_cluster = (sector_num - extent_begin_sector) %
+                       extent->cluster_sectors;
+    n = extent->cluster_sectors - index_in_cluster;
+
+    /* compressed grains are inflated one at a time */
+    while (!extent->flat && !extent->compressed && n < nb_sectors &&
+           sector_num + n < extent->end_sector) {
+        bool next_allocated = !get_cluster_offset(bs, extent, NULL,
+                                                  (sector_num + n) << 9, 0,
+                                                  &next_offset);
+        if (next_allocated != *allocated ||
+            (*allocated && next_offset !=
+             *cluster_offset + ((index_in_cluster + n) << 9))) {
+            break;
+        }
+        n += extent->cluster_sectors;
+    }
+
+    return MIN(n, nb_sectors);
+}
+
+static coroutine_fn int vmdk_co_read(BlockDriverState *bs, int64_t sector_num,
+                                     uint8_t *buf, int nb_sectors)
 {
     BDRVVmdkState *s = bs->opaque;
     int ret;
-    uint64_t n, index_in_cluster;
-    uint64_t extent_begin_sector, extent_relative_sector_num;
+    int64_t n;
+    uint64_t index_in_cluster;
     VmdkExtent *extent = NULL;
     uint64_t cluster_offset;
+    bool allocated;
 
     while (nb_sectors > 0) {
         extent = find_extent(s, sector_num, extent);
         if (!extent) {
             return -EIO;
         }
-        ret = get_cluster_offset(
-                            bs, extent, NULL,
-                            sector_num << 9, 0, &cluster_offset);
-        extent_begin_sector = extent->end_sector - extent->sectors;
-        extent_relative_sector_num = sector_num - extent_begin_sector;
-        index_in_cluster = extent_relative_sector_num % extent->cluster_sectors;
-        n = extent->cluster_sectors - index_in_cluster;
-        if (n > nb_sectors) {
-            n = nb_sectors;
-        }
-        if (ret) {
+
+        /* Only the lookup is done under the lock, so that reads run in
+         * parallel.  Writers keep the lock until their grain is written, so
+         * a grain found allocated here already has its data.
+         */
+        qemu_co_mutex_lock(&s->lock);
+        n = vmdk_find_run(bs, extent, sector_num, nb_sectors,
+                          &cluster_offset, &allocated);
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (!allocated) {
             /* if not allocated, try to read from parent image, if exist */
             if (bs->backing_hd) {
                 if (!vmdk_is_cid_valid(bs)) {
@@ -1125,6 +1171,9 @@ static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
                 memset(buf, 0, 512 * n);
             }
         } else {
+            index_in_cluster = (sector_num - (extent->end_sector -
+                                              extent->sectors)) %
+                               extent->cluster_sectors;
             ret = vmdk_read_extent(extent,
                             cluster_offset, index_in_cluster * 512,
                             buf, n);
@@ -1139,17 +1188,6 @@ static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
     return 0;
 }
 
-static coroutine_fn int vmdk_co_read(BlockDriverState *bs, int64_t sector_num,
-                                     uint8_t *buf, int nb_sectors)
-{
-    int ret;
-    BDRVVmdkState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = vmdk_read(bs, sector_num, buf, nb_sectors);
-    qemu_co_mutex_unlock(&s->lock);
-    return ret;
-}
-
 static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
                      const uint8_t *buf, int nb_sectors)
 {
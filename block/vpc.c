@@ -416,8 +416,8 @@ fail:
     return -1;
 }
 
-static int vpc_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+static coroutine_fn int vpc_co_read(BlockDriverState *bs, int64_t sector_num,
+                                    uint8_t *buf, int nb_sectors)
 {
     BDRVVPCState *s = bs->opaque;
     int ret;
@@ -429,7 +429,13 @@ static int vpc_read(BlockDriverState *bs, int64_t sector_num,
         return bdrv_read(bs->file, sector_num, buf, nb_sectors);
     }
     while (nb_sectors > 0) {
+        /* The BAT is in memory, the lock only makes sure that a block being
+         * allocated by a writer is complete.  Data is read without it so
+         * that reads run in parallel.
+         */
+        qemu_co_mutex_lock(&s->lock);
         offset = get_sector_offset(bs, sector_num, 0);
+        qemu_co_mutex_unlock(&s->lock);
 
         sectors_per_block = s->block_size >> BDRV_SECTOR_BITS;
         sectors = sectors_per_block - (sector_num % sectors_per_block);
@@ -454,17 +460,6 @@ static int vpc_read(BlockDriverState *bs, int64_t sector_num,
     return 0;
 }
 
-static coroutine_fn int vpc_co_read(BlockDriverState *bs, int64_t sector_num,
-                                    uint8_t *buf, int nb_sectors)
-{
-    int ret;
-    BDRVVPCState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = vpc_read(bs, sector_num, buf, nb_sectors);
-    qemu_co_mutex_unlock(&s->lock);
-    return ret;
-}
-
 static int vpc_write(BlockDriverState *bs, int64_t sector_num,
     const uint8_t *buf, int nb_sectors)
 {
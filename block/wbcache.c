@@ -0,0 +1,1343 @@
+/*
+ * Persistent write-back cache for block devices
+ *
+ * Guest writes are appended to a log kept in a local cache file (usually
+ * on an SSD) and completed as soon as the log write finishes; a guest
+ * flush only has to flush the cache file.  Destage coroutines copy dirty
+ * blocks to the image in the background, oldest first.  Blocks that are
+ * read twice while not cached are also added to the log, so that later
+ * reads of hot data are served locally.
+ *
+ * Usage: wbcache:<cache file>:<image>
+ *
+ * The cache file must already exist; its size bounds the log.  It is
+ * formatted on first use and tied to the image filename.  The log is
+ * replayed when the image is opened again after a crash, so dirty data
+ * that was not destaged yet is never lost.
+ *
+ * Cache file layout (all sizes in 512-byte sectors, little endian):
+ *
+ *   header (WBC_HEADER_SECTORS)
+ *   circular log of records, each made of one header sector followed by
+ *   nb_blocks cache blocks of WBC_BLOCK_SECTORS sectors
+ *
+ * Records carry a sequence number and a CRC of header and data.  Replay
+ * starts at the tail recorded in the header and follows consecutive
+ * sequence numbers, wrapping to the start of the log when the next record
+ * is not found in place and would not have fit there.  The tail is only moved forward after the records
+ * it skips have been destaged and the image has been flushed; their space
+ * is reused only after the new header has reached the disk.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <zlib.h>
+#include "qemu-common.h"
+#include "qemu-error.h"
+#include "block_int.h"
+#include "module.h"
+
+#define WBC_MAGIC               0x43425751 /* "QWBC" */
+#define WBC_RECORD_MAGIC        0x52425751 /* "QWBR" */
+#define WBC_VERSION             1
+
+#define WBC_HEADER_SECTORS      8
+#define WBC_BLOCK_SECTORS       8
+#define WBC_BLOCK_SIZE          (WBC_BLOCK_SECTORS * BDRV_SECTOR_SIZE)
+
+/* Largest record, 512 KB of data */
+#define WBC_REC_MAX_BLOCKS      128
+#define WBC_REC_SECTORS(n)      (1 + (n) * WBC_BLOCK_SECTORS)
+
+/* The log must hold a handful of maximum-sized records */
+#define WBC_MIN_LOG_SECTORS     (16 * WBC_REC_SECTORS(WBC_REC_MAX_BLOCKS))
+
+/* Parallel destage requests, and dirty runs picked up per destage round */
+#define WBC_DESTAGE_WORKERS     4
+#define WBC_DESTAGE_BATCH       64
+
+/* Record flags */
+#define WBC_REC_DIRTY           1
+
+enum {
+    WBC_GHOST_SEEN = 1,         /* missed once */
+    WBC_GHOST_ADMITTING = 2,    /* missed twice, being added to the log */
+};
+
+typedef struct QEMU_PACKED WBCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t cache_id;          /* random, also stored in every record */
+    uint64_t cache_sectors;     /* size of the cache file */
+    uint64_t image_sectors;
+    uint64_t tail;              /* first sector to replay */
+    uint64_t tail_seq;          /* sequence number of the record there */
+    uint32_t crc;               /* of the header, with crc set to zero */
+    char image[256];
+} WBCacheHeader;
+
+typedef struct QEMU_PACKED WBCacheRecordHeader {
+    uint32_t magic;
+    uint32_t flags;
+    uint64_t cache_id;
+    uint64_t seq;
+    uint64_t block;             /* first image block */
+    uint32_t nb_blocks;
+    uint32_t crc;               /* of the header (crc zero) and the data */
+} WBCacheRecordHeader;
+
+typedef struct WBCacheRecord {
+    uint64_t offset;            /* sector of the record header */
+    uint64_t seq;
+    uint64_t block;
+    int nb_blocks;
+    bool dirty_rec;             /* guest write, as opposed to a read fill */
+    bool written;               /* log write completed */
+    int live;                   /* index entries pointing into the record */
+    int dirty;                  /* ... of which not destaged yet */
+    int readers;                /* reads in flight from the record */
+    uint64_t clean_gen;         /* destage round that cleaned it last */
+    QTAILQ_ENTRY(WBCacheRecord) next;
+    QLIST_ENTRY(WBCacheRecord) inflight;
+} WBCacheRecord;
+
+typedef struct WBCacheEntry {
+    uint64_t block;             /* hash key */
+    WBCacheRecord *rec;
+    bool dirty;
+} WBCacheEntry;
+
+typedef struct WBCacheRun {
+    WBCacheRecord *rec;
+    int idx;
+    int nb_blocks;
+} WBCacheRun;
+
+typedef struct BDRVWBCacheState {
+    BlockDriverState *cache;
+    BlockDriverState *target;
+    bool read_only;
+    uint64_t image_sectors;
+    uint64_t cache_id;
+    char image[256];
+
+    /* Log geometry and state, in sectors */
+    uint64_t log_start;
+    uint64_t log_end;
+    uint64_t head;
+    uint64_t tail;              /* as stored in the header */
+    uint64_t used;              /* from tail to head, including wrap waste */
+    uint64_t next_seq;
+    QTAILQ_HEAD(, WBCacheRecord) records;
+    QLIST_HEAD(, WBCacheRecord) inflight;
+
+    GHashTable *index;          /* block -> WBCacheEntry */
+    GHashTable *ghosts;         /* block -> WBC_GHOST_* for read misses */
+    uint64_t max_ghosts;
+    uint64_t nb_dirty;
+    uint64_t max_dirty;
+
+    CoMutex rmw_lock;           /* serializes partial block writes */
+    CoQueue space_queue;        /* writers waiting for log space */
+    CoQueue flush_queue;        /* flushes waiting for log writes */
+    CoQueue destage_queue;      /* waiting for the destage coroutine */
+    bool failed;                /* a log write failed */
+
+    /* Destage state */
+    Coroutine *destage_co;
+    bool destage_kick;
+    bool destage_waiting;
+    bool space_wanted;
+    int destage_ret;
+    uint64_t destage_gen;
+    uint64_t flushed_gen;
+    WBCacheRun batch[WBC_DESTAGE_BATCH];
+    int batch_len;
+    int batch_next;
+    int batch_workers;
+    int batch_ret;
+
+    int fills;                  /* read fills in flight */
+    bool closed;
+} BDRVWBCacheState;
+
+static guint wbc_block_hash(gconstpointer v)
+{
+    uint64_t block = *(const uint64_t *)v;
+
+    return (guint)(block ^ (block >> 32));
+}
+
+static gboolean wbc_block_equal(gconstpointer a, gconstpointer b)
+{
+    return *(const uint64_t *)a == *(const uint64_t *)b;
+}
+
+static WBCacheEntry *wbc_lookup(BDRVWBCacheState *s, uint64_t block)
+{
+    return g_hash_table_lookup(s->index, &block);
+}
+
+static void wbc_ghost_remove(BDRVWBCacheState *s, uint64_t block,
+                             int nb_blocks)
+{
+    uint64_t b;
+
+    for (b = block; b < block + nb_blocks; b++) {
+        g_hash_table_remove(s->ghosts, &b);
+    }
+}
+
+static uint64_t wbc_log_sectors(BDRVWBCacheState *s)
+{
+    return s->log_end - s->log_start;
+}
+
+static uint64_t wbc_ring_dist(BDRVWBCacheState *s, uint64_t from, uint64_t to)
+{
+    return (to + wbc_log_sectors(s) - from) % wbc_log_sectors(s);
+}
+
+static uint32_t wbc_crc_iov(uint32_t crc, QEMUIOVector *qiov)
+{
+    int i;
+
+    for (i = 0; i < qiov->niov; i++) {
+        crc = crc32(crc, qiov->iov[i].iov_base, qiov->iov[i].iov_len);
+    }
+    return crc;
+}
+
+/* Point the index at every block of a record whose log write completed.
+ * A guest write replaces older writes and any read fill; a read fill only
+ * populates blocks that are not cached at all.
+ */
+static void wbc_index_record(BDRVWBCacheState *s, WBCacheRecord *rec)
+{
+    WBCacheEntry *e;
+    uint64_t block;
+    int i;
+
+    for (i = 0; i < rec->nb_blocks; i++) {
+        block = rec->block + i;
+        e = wbc_lookup(s, block);
+        if (e) {
+            if (!rec->dirty_rec) {
+                continue;
+            }
+            if (e->rec->dirty_rec && e->rec->seq > rec->seq) {
+                continue;
+            }
+            e->rec->live--;
+            if (e->dirty) {
+                e->rec->dirty--;
+                s->nb_dirty--;
+            }
+        } else {
+            e = g_new(WBCacheEntry, 1);
+            e->block = block;
+            g_hash_table_insert(s->index, &e->block, e);
+        }
+        e->rec = rec;
+        e->dirty = rec->dirty_rec;
+        rec->live++;
+        if (e->dirty) {
+            rec->dirty++;
+            s->nb_dirty++;
+        }
+    }
+}
+
+static bool wbc_is_current(BDRVWBCacheState *s, WBCacheRecord *rec, int idx)
+{
+    WBCacheEntry *e = wbc_lookup(s, rec->block + idx);
+
+    return e && e->rec == rec;
+}
+
+static void wbc_evict_record(BDRVWBCacheState *s, WBCacheRecord *rec)
+{
+    uint64_t block;
+    int i;
+
+    for (i = 0; i < rec->nb_blocks && rec->live; i++) {
+        if (wbc_is_current(s, rec, i)) {
+            block = rec->block + i;
+            g_hash_table_remove(s->index, &block);
+            rec->live--;
+        }
+    }
+}
+
+static void wbc_header_to_disk(BDRVWBCacheState *s, WBCacheHeader *h,
+                               uint64_t tail, uint64_t tail_seq)
+{
+    memset(h, 0, sizeof(*h));
+    h->magic = cpu_to_le32(WBC_MAGIC);
+    h->version = cpu_to_le32(WBC_VERSION);
+    h->cache_id = cpu_to_le64(s->cache_id);
+    h->cache_sectors = cpu_to_le64(s->log_end);
+    h->image_sectors = cpu_to_le64(s->image_sectors);
+    h->tail = cpu_to_le64(tail);
+    h->tail_seq = cpu_to_le64(tail_seq);
+    pstrcpy(h->image, sizeof(h->image), s->image);
+    h->crc = cpu_to_le32(crc32(0, (const Bytef *)h, sizeof(*h)));
+}
+
+/* Drop records from the tail of the log that are no longer needed and
+ * persist the new tail.  Clean blocks are evicted from the index too when
+ * @evict is true.  The records are only freed once the new header is on
+ * disk.  Only called from the destage coroutine.
+ */
+static int coroutine_fn wbc_reclaim(BDRVWBCacheState *s, bool evict)
+{
+    WBCacheRecord *rec;
+    WBCacheHeader *h;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    uint64_t tail, tail_seq, freed;
+    int nb_freed = 0;
+    int ret;
+
+    QTAILQ_FOREACH(rec, &s->records, next) {
+        if (!rec->written || rec->readers || rec->dirty ||
+            rec->clean_gen > s->flushed_gen) {
+            break;
+        }
+        if (rec->live) {
+            if (!evict) {
+                break;
+            }
+            wbc_evict_record(s, rec);
+        }
+        nb_freed++;
+    }
+    if (!nb_freed) {
+        return 0;
+    }
+
+    if (rec) {
+        tail = rec->offset;
+        tail_seq = rec->seq;
+        freed = wbc_ring_dist(s, s->tail, tail);
+    } else {
+        tail = s->head;
+        tail_seq = s->next_seq;
+        freed = s->used;
+    }
+
+    h = qemu_blockalign(s->cache, BDRV_SECTOR_SIZE);
+    memset(h, 0, BDRV_SECTOR_SIZE);
+    wbc_header_to_disk(s, h, tail, tail_seq);
+    iov.iov_base = h;
+    iov.iov_len = BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    ret = bdrv_co_writev(s->cache, 0, 1, &qiov);
+    qemu_vfree(h);
+    if (ret == 0) {
+        ret = bdrv_co_flush(s->cache);
+    }
+    if (ret < 0) {
+        error_report("wbcache: failed to update cache header: %s",
+                     strerror(-ret));
+        return ret;
+    }
+
+    /* Records appended meanwhile went behind the ones counted above, and
+     * those have no index entries left that could gain readers.  */
+    while (nb_freed--) {
+        rec = QTAILQ_FIRST(&s->records);
+        QTAILQ_REMOVE(&s->records, rec, next);
+        g_free(rec);
+    }
+    s->tail = tail;
+    s->used -= freed;
+    qemu_co_queue_restart_all(&s->space_queue);
+    return 0;
+}
+
+static void coroutine_fn wbc_destage_worker(void *opaque)
+{
+    BDRVWBCacheState *s = opaque;
+    WBCacheRun *run;
+    WBCacheEntry *e;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    uint64_t sector, nb_sectors;
+    void *buf;
+    int i, ret;
+
+    buf = qemu_blockalign(s->cache, WBC_REC_MAX_BLOCKS * WBC_BLOCK_SIZE);
+    while (s->batch_next < s->batch_len && s->batch_ret == 0) {
+        run = &s->batch[s->batch_next++];
+
+        iov.iov_base = buf;
+        iov.iov_len = run->nb_blocks * WBC_BLOCK_SIZE;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        ret = bdrv_co_readv(s->cache,
+                            run->rec->offset + 1 + run->idx * WBC_BLOCK_SECTORS,
+                            run->nb_blocks * WBC_BLOCK_SECTORS, &qiov);
+        if (ret < 0) {
+            s->batch_ret = ret;
+            break;
+        }
+
+        /* The last block of the image may be partial */
+        sector = (run->rec->block + run->idx) * WBC_BLOCK_SECTORS;
+        nb_sectors = MIN(run->nb_blocks * WBC_BLOCK_SECTORS,
+                         s->image_sectors - sector);
+        iov.iov_len = nb_sectors * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        ret = bdrv_co_writev(s->target, sector, nb_sectors, &qiov);
+        if (ret < 0) {
+            s->batch_ret = ret;
+            break;
+        }
+
+        for (i = run->idx; i < run->idx + run->nb_blocks; i++) {
+            e = wbc_lookup(s, run->rec->block + i);
+            if (e && e->rec == run->rec && e->dirty) {
+                e->dirty = false;
+                run->rec->dirty--;
+                s->nb_dirty--;
+                run->rec->clean_gen = s->destage_gen;
+            }
+        }
+    }
+    qemu_vfree(buf);
+
+    if (--s->batch_workers == 0 && s->destage_waiting) {
+        s->destage_waiting = false;
+        qemu_coroutine_enter(s->destage_co, NULL);
+    }
+}
+
+/* Pick the oldest dirty runs, copy them to the image in parallel and
+ * flush the image.  Returns the number of runs, or -errno.
+ */
+static int coroutine_fn wbc_destage_batch(BDRVWBCacheState *s)
+{
+    WBCacheRecord *rec;
+    WBCacheEntry *e;
+    Coroutine *co;
+    int i, start, workers, ret;
+
+    s->batch_len = 0;
+    QTAILQ_FOREACH(rec, &s->records, next) {
+        if (!rec->written || !rec->dirty) {
+            continue;
+        }
+        start = -1;
+        for (i = 0; i <= rec->nb_blocks; i++) {
+            e = i < rec->nb_blocks ? wbc_lookup(s, rec->block + i) : NULL;
+            if (e && e->rec == rec && e->dirty) {
+                if (start < 0) {
+                    start = i;
+                }
+                continue;
+            }
+            if (start >= 0) {
+                s->batch[s->batch_len].rec = rec;
+                s->batch[s->batch_len].idx = start;
+                s->batch[s->batch_len].nb_blocks = i - start;
+                start = -1;
+                if (++s->batch_len == WBC_DESTAGE_BATCH) {
+                    goto full;
+                }
+            }
+        }
+    }
+full:
+    if (s->batch_len == 0) {
+        return 0;
+    }
+
+    s->destage_gen++;
+    s->batch_next = 0;
+    s->batch_ret = 0;
+    workers = MIN(WBC_DESTAGE_WORKERS, s->batch_len);
+    s->batch_workers = workers;
+    for (i = 0; i < workers; i++) {
+        co = qemu_coroutine_create(wbc_destage_worker);
+        qemu_coroutine_enter(co, s);
+    }
+    while (s->batch_workers > 0) {
+        s->destage_waiting = true;
+        qemu_coroutine_yield();
+    }
+    if (s->batch_ret < 0) {
+        return s->batch_ret;
+    }
+
+    ret = bdrv_co_flush(s->target);
+    if (ret < 0) {
+        return ret;
+    }
+    s->flushed_gen = s->destage_gen;
+    qemu_co_queue_restart_all(&s->space_queue);
+    return s->batch_len;
+}
+
+static void coroutine_fn wbc_destage_co(void *opaque)
+{
+    BDRVWBCacheState *s = opaque;
+    bool evict;
+    int ret;
+
+    do {
+        s->destage_kick = false;
+        while (s->nb_dirty > 0) {
+            ret = wbc_destage_batch(s);
+            if (ret < 0) {
+                error_report("wbcache: destage failed: %s", strerror(-ret));
+                s->destage_ret = ret;
+                break;
+            } else if (ret == 0) {
+                break;
+            }
+            if (wbc_reclaim(s, false) < 0) {
+                break;
+            }
+        }
+        evict = s->space_wanted;
+        s->space_wanted = false;
+        wbc_reclaim(s, evict);
+        qemu_co_queue_restart_all(&s->space_queue);
+    } while (s->destage_kick && s->destage_ret == 0);
+
+    s->destage_co = NULL;
+    qemu_co_queue_restart_all(&s->destage_queue);
+}
+
+static void wbc_kick_destage(BDRVWBCacheState *s)
+{
+    if (s->read_only) {
+        return;
+    }
+    if (s->destage_co) {
+        s->destage_kick = true;
+        return;
+    }
+    s->destage_ret = 0;
+    s->destage_co = qemu_coroutine_create(wbc_destage_co);
+    qemu_coroutine_enter(s->destage_co, s);
+}
+
+static bool wbc_log_fits(BDRVWBCacheState *s, uint64_t n)
+{
+    uint64_t waste = 0;
+
+    if (s->head + n > s->log_end) {
+        waste = s->log_end - s->head;
+    }
+    return s->used + waste + n <= wbc_log_sectors(s);
+}
+
+static uint64_t wbc_log_alloc(BDRVWBCacheState *s, uint64_t n)
+{
+    uint64_t offset;
+
+    if (s->head + n > s->log_end) {
+        s->used += s->log_end - s->head;
+        s->head = s->log_start;
+    }
+    offset = s->head;
+    s->head += n;
+    s->used += n;
+    return offset;
+}
+
+static int coroutine_fn wbc_wait_space(BDRVWBCacheState *s, uint64_t n)
+{
+    while (!wbc_log_fits(s, n) || s->nb_dirty >= s->max_dirty) {
+        if (s->failed) {
+            return -EIO;
+        }
+        if (s->destage_ret < 0 && !s->destage_co) {
+            return s->destage_ret;
+        }
+        s->space_wanted = true;
+        wbc_kick_destage(s);
+        qemu_co_queue_wait(&s->space_queue);
+    }
+    return 0;
+}
+
+static bool wbc_inflight_overlaps(BDRVWBCacheState *s, uint64_t block,
+                                  int nb_blocks)
+{
+    WBCacheRecord *rec;
+
+    QLIST_FOREACH(rec, &s->inflight, inflight) {
+        if (rec->block < block + nb_blocks &&
+            block < rec->block + rec->nb_blocks) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Append one record to the log.  @data holds exactly @nb_blocks blocks. */
+static int coroutine_fn wbc_log_write(BDRVWBCacheState *s, uint64_t block,
+                                      int nb_blocks, QEMUIOVector *data,
+                                      bool dirty)
+{
+    WBCacheRecord *rec;
+    WBCacheRecordHeader *hdr;
+    QEMUIOVector qiov;
+    uint64_t n = WBC_REC_SECTORS(nb_blocks);
+    uint32_t crc;
+    int ret;
+
+    assert(nb_blocks > 0 && nb_blocks <= WBC_REC_MAX_BLOCKS);
+    assert(data->size == nb_blocks * WBC_BLOCK_SIZE);
+
+    if (dirty) {
+        ret = wbc_wait_space(s, n);
+        if (ret < 0) {
+            return ret;
+        }
+    } else if (!wbc_log_fits(s, n)) {
+        /* Make room for later fills, but never wait for it */
+        s->space_wanted = true;
+        wbc_kick_destage(s);
+        return 0;
+    }
+
+    hdr = qemu_blockalign(s->cache, BDRV_SECTOR_SIZE);
+    memset(hdr, 0, BDRV_SECTOR_SIZE);
+
+    rec = g_new0(WBCacheRecord, 1);
+    rec->offset = wbc_log_alloc(s, n);
+    rec->seq = s->next_seq++;
+    rec->block = block;
+    rec->nb_blocks = nb_blocks;
+    rec->dirty_rec = dirty;
+    QTAILQ_INSERT_TAIL(&s->records, rec, next);
+    QLIST_INSERT_HEAD(&s->inflight, rec, inflight);
+
+    hdr->magic = cpu_to_le32(WBC_RECORD_MAGIC);
+    hdr->flags = cpu_to_le32(dirty ? WBC_REC_DIRTY : 0);
+    hdr->cache_id = cpu_to_le64(s->cache_id);
+    hdr->seq = cpu_to_le64(rec->seq);
+    hdr->block = cpu_to_le64(block);
+    hdr->nb_blocks = cpu_to_le32(nb_blocks);
+    crc = crc32(0, (const Bytef *)hdr, BDRV_SECTOR_SIZE);
+    hdr->crc = cpu_to_le32(wbc_crc_iov(crc, data));
+
+    qemu_iovec_init(&qiov, data->niov + 1);
+    qemu_iovec_add(&qiov, hdr, BDRV_SECTOR_SIZE);
+    qemu_iovec_concat(&qiov, data, 0, data->size);
+    ret = bdrv_co_writev(s->cache, rec->offset, n, &qiov);
+    qemu_iovec_destroy(&qiov);
+    qemu_vfree(hdr);
+
+    QLIST_REMOVE(rec, inflight);
+    rec->written = true;
+    if (ret < 0) {
+        /* Replay stops at this record, so later ones must not be
+         * acknowledged either; fail the cache until it is reopened.
+         */
+        if (!s->failed) {
+            error_report("wbcache: cache write failed: %s", strerror(-ret));
+        }
+        s->failed = true;
+        qemu_co_queue_restart_all(&s->space_queue);
+    } else {
+        wbc_index_record(s, rec);
+        if (dirty) {
+            wbc_ghost_remove(s, block, nb_blocks);
+        }
+    }
+    qemu_co_queue_restart_all(&s->flush_queue);
+    if (dirty || s->space_wanted) {
+        wbc_kick_destage(s);
+    }
+    return ret;
+}
+
+typedef struct WBCacheFill {
+    BDRVWBCacheState *s;
+    uint64_t block;
+    int nb_blocks;
+    void *buf;
+} WBCacheFill;
+
+static void coroutine_fn wbc_fill_co(void *opaque)
+{
+    WBCacheFill *fill = opaque;
+    BDRVWBCacheState *s = fill->s;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    gpointer state;
+    uint64_t b;
+    bool ok = !s->failed && !s->read_only &&
+              !wbc_inflight_overlaps(s, fill->block, fill->nb_blocks);
+
+    /* Any write to these blocks since the read was issued removed the
+     * ghost entries, and the data we read may be stale then.
+     */
+    for (b = fill->block; ok && b < fill->block + fill->nb_blocks; b++) {
+        state = g_hash_table_lookup(s->ghosts, &b);
+        if (GPOINTER_TO_INT(state) != WBC_GHOST_ADMITTING || wbc_lookup(s, b)) {
+            ok = false;
+        }
+    }
+    wbc_ghost_remove(s, fill->block, fill->nb_blocks);
+
+    if (ok) {
+        iov.iov_base = fill->buf;
+        iov.iov_len = fill->nb_blocks * WBC_BLOCK_SIZE;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        wbc_log_write(s, fill->block, fill->nb_blocks, &qiov, false);
+    }
+
+    qemu_vfree(fill->buf);
+    g_free(fill);
+    if (--s->fills == 0) {
+        qemu_co_queue_restart_all(&s->destage_queue);
+    }
+}
+
+/* Track misses on whole blocks; return true if @block is hot, i.e. it
+ * missed before and should be added to the log after this read.
+ */
+static bool wbc_ghost_hit(BDRVWBCacheState *s, uint64_t block)
+{
+    gpointer state = g_hash_table_lookup(s->ghosts, &block);
+    uint64_t *key;
+
+    if (GPOINTER_TO_INT(state) == WBC_GHOST_SEEN) {
+        g_hash_table_replace(s->ghosts, g_memdup(&block, sizeof(block)),
+                             GINT_TO_POINTER(WBC_GHOST_ADMITTING));
+        return true;
+    } else if (state) {
+        return false;
+    }
+
+    if (g_hash_table_size(s->ghosts) >= s->max_ghosts) {
+        g_hash_table_remove_all(s->ghosts);
+    }
+    key = g_memdup(&block, sizeof(block));
+    g_hash_table_insert(s->ghosts, key, GINT_TO_POINTER(WBC_GHOST_SEEN));
+    return false;
+}
+
+static void wbc_start_fills(BDRVWBCacheState *s, uint64_t sector_num,
+                            int nb_sectors, QEMUIOVector *qiov,
+                            size_t qiov_offset, const bool *hot)
+{
+    uint64_t first = DIV_ROUND_UP(sector_num, WBC_BLOCK_SECTORS);
+    uint64_t end = (sector_num + nb_sectors) / WBC_BLOCK_SECTORS;
+    uint64_t b, run;
+    WBCacheFill *fill;
+    Coroutine *co;
+
+    for (b = first; b < end; b += run) {
+        run = 0;
+        while (b + run < end && run < WBC_REC_MAX_BLOCKS &&
+               hot[b + run - first]) {
+            run++;
+        }
+        if (run == 0) {
+            run = 1;
+            continue;
+        }
+
+        fill = g_new(WBCacheFill, 1);
+        fill->s = s;
+        fill->block = b;
+        fill->nb_blocks = run;
+        fill->buf = qemu_blockalign(s->cache, run * WBC_BLOCK_SIZE);
+        qemu_iovec_to_buf(qiov, qiov_offset + (b * WBC_BLOCK_SECTORS -
+                                               sector_num) * BDRV_SECTOR_SIZE,
+                          fill->buf, run * WBC_BLOCK_SIZE);
+        s->fills++;
+        co = qemu_coroutine_create(wbc_fill_co);
+        qemu_coroutine_enter(co, fill);
+    }
+}
+
+/* Read a run of uncached sectors from the image, and consider the blocks
+ * it covers completely for caching.
+ */
+static int coroutine_fn wbc_read_miss(BDRVWBCacheState *s, uint64_t sector_num,
+                                      int nb_sectors, QEMUIOVector *qiov,
+                                      size_t qiov_offset, bool fill)
+{
+    uint64_t first = DIV_ROUND_UP(sector_num, WBC_BLOCK_SECTORS);
+    uint64_t end = (sector_num + nb_sectors) / WBC_BLOCK_SECTORS;
+    QEMUIOVector sub;
+    bool *hot = NULL;
+    bool any_hot = false;
+    uint64_t b;
+    int ret;
+
+    if (fill && end > first && !s->read_only) {
+        hot = g_new0(bool, end - first);
+        for (b = first; b < end; b++) {
+            hot[b - first] = wbc_ghost_hit(s, b);
+            any_hot |= hot[b - first];
+        }
+    }
+
+    qemu_iovec_init(&sub, qiov->niov);
+    qemu_iovec_concat(&sub, qiov, qiov_offset, nb_sectors * BDRV_SECTOR_SIZE);
+    ret = bdrv_co_readv(s->target, sector_num, nb_sectors, &sub);
+    qemu_iovec_destroy(&sub);
+
+    if (ret == 0 && any_hot) {
+        wbc_start_fills(s, sector_num, nb_sectors, qiov, qiov_offset, hot);
+    } else if (any_hot) {
+        for (b = first; b < end; b++) {
+            if (hot[b - first]) {
+                g_hash_table_remove(s->ghosts, &b);
+            }
+        }
+    }
+    g_free(hot);
+    return ret;
+}
+
+static int coroutine_fn wbc_read(BDRVWBCacheState *s, uint64_t sector_num,
+                                 int nb_sectors, QEMUIOVector *qiov, bool fill)
+{
+    WBCacheEntry *e, *next;
+    WBCacheRecord *rec;
+    QEMUIOVector sub;
+    size_t qiov_offset = 0;
+    uint64_t block, idx, n;
+    int ret = 0;
+
+    while (nb_sectors > 0) {
+        if (sector_num >= s->image_sectors) {
+            /* Partial block at the end of the image */
+            qemu_iovec_memset(qiov, qiov_offset, 0,
+                              nb_sectors * BDRV_SECTOR_SIZE);
+            break;
+        }
+
+        block = sector_num / WBC_BLOCK_SECTORS;
+        e = wbc_lookup(s, block);
+        n = MIN(WBC_BLOCK_SECTORS - sector_num % WBC_BLOCK_SECTORS,
+                nb_sectors);
+        if (e) {
+            /* Extend over blocks that follow in the same record */
+            rec = e->rec;
+            idx = block - rec->block;
+            while (n < nb_sectors && ++block < rec->block + rec->nb_blocks &&
+                   (next = wbc_lookup(s, block)) && next->rec == rec) {
+                n = MIN(n + WBC_BLOCK_SECTORS, nb_sectors);
+            }
+
+            qemu_iovec_init(&sub, qiov->niov);
+            qemu_iovec_concat(&sub, qiov, qiov_offset, n * BDRV_SECTOR_SIZE);
+            rec->readers++;
+            ret = bdrv_co_readv(s->cache,
+                                rec->offset + 1 + idx * WBC_BLOCK_SECTORS +
+                                sector_num % WBC_BLOCK_SECTORS, n, &sub);
+            if (--rec->readers == 0 && s->space_wanted) {
+                wbc_kick_destage(s);
+            }
+            qemu_iovec_destroy(&sub);
+        } else {
+            while (n < nb_sectors && !wbc_lookup(s, ++block)) {
+                n = MIN(n + WBC_BLOCK_SECTORS, nb_sectors);
+            }
+            n = MIN(n, s->image_sectors - sector_num);
+            ret = wbc_read_miss(s, sector_num, n, qiov, qiov_offset, fill);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        qiov_offset += n * BDRV_SECTOR_SIZE;
+    }
+    return 0;
+}
+
+static coroutine_fn int wbcache_co_readv(BlockDriverState *bs,
+                                         int64_t sector_num, int nb_sectors,
+                                         QEMUIOVector *qiov)
+{
+    BDRVWBCacheState *s = bs->opaque;
+
+    return wbc_read(s, sector_num, nb_sectors, qiov, true);
+}
+
+/* Log writes of whole blocks, split in maximum-sized records */
+static int coroutine_fn wbc_write_blocks(BDRVWBCacheState *s, uint64_t block,
+                                         uint64_t nb_blocks,
+                                         QEMUIOVector *qiov)
+{
+    QEMUIOVector sub;
+    uint64_t done, n;
+    int ret = 0;
+
+    wbc_ghost_remove(s, block, nb_blocks);
+
+    qemu_iovec_init(&sub, qiov->niov);
+    for (done = 0; done < nb_blocks; done += n) {
+        n = MIN(nb_blocks - done, WBC_REC_MAX_BLOCKS);
+        qemu_iovec_reset(&sub);
+        qemu_iovec_concat(&sub, qiov, done * WBC_BLOCK_SIZE,
+                          n * WBC_BLOCK_SIZE);
+        ret = wbc_log_write(s, block + done, n, &sub, true);
+        if (ret < 0) {
+            break;
+        }
+    }
+    qemu_iovec_destroy(&sub);
+    return ret;
+}
+
+static coroutine_fn int wbcache_co_writev(BlockDriverState *bs,
+                                          int64_t sector_num, int nb_sectors,
+                                          QEMUIOVector *qiov)
+{
+    BDRVWBCacheState *s = bs->opaque;
+    uint64_t start, end, first, last;
+    QEMUIOVector local;
+    struct iovec iov;
+    void *buf;
+    int ret;
+
+    if (s->failed) {
+        return -EIO;
+    }
+
+    start = sector_num;
+    end = sector_num + nb_sectors;
+    if (start % WBC_BLOCK_SECTORS == 0 && end % WBC_BLOCK_SECTORS == 0) {
+        return wbc_write_blocks(s, start / WBC_BLOCK_SECTORS,
+                                nb_sectors / WBC_BLOCK_SECTORS, qiov);
+    }
+
+    /* Partial blocks: merge with the current contents */
+    first = start / WBC_BLOCK_SECTORS;
+    last = DIV_ROUND_UP(end, WBC_BLOCK_SECTORS);
+    buf = qemu_blockalign(s->cache, (last - first) * WBC_BLOCK_SIZE);
+    iov.iov_base = buf;
+    qemu_co_mutex_lock(&s->rmw_lock);
+
+    iov.iov_len = WBC_BLOCK_SIZE;
+    qemu_iovec_init_external(&local, &iov, 1);
+    ret = wbc_read(s, first * WBC_BLOCK_SECTORS, WBC_BLOCK_SECTORS, &local,
+                   false);
+    if (ret == 0 && last - 1 > first) {
+        iov.iov_base = buf + (last - 1 - first) * WBC_BLOCK_SIZE;
+        ret = wbc_read(s, (last - 1) * WBC_BLOCK_SECTORS, WBC_BLOCK_SECTORS,
+                       &local, false);
+    }
+    if (ret < 0) {
+        goto out;
+    }
+
+    qemu_iovec_to_buf(qiov, 0,
+                      buf + (start - first * WBC_BLOCK_SECTORS) *
+                      BDRV_SECTOR_SIZE,
+                      nb_sectors * BDRV_SECTOR_SIZE);
+    iov.iov_base = buf;
+    iov.iov_len = (last - first) * WBC_BLOCK_SIZE;
+    qemu_iovec_init_external(&local, &iov, 1);
+    ret = wbc_write_blocks(s, first, last - first, &local);
+
+out:
+    qemu_co_mutex_unlock(&s->rmw_lock);
+    qemu_vfree(buf);
+    return ret;
+}
+
+static bool wbc_inflight_before(BDRVWBCacheState *s, uint64_t seq)
+{
+    WBCacheRecord *rec;
+
+    QLIST_FOREACH(rec, &s->inflight, inflight) {
+        if (rec->seq < seq) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static coroutine_fn int wbcache_co_flush(BlockDriverState *bs)
+{
+    BDRVWBCacheState *s = bs->opaque;
+    uint64_t seq = s->next_seq;
+
+    /* A record that completed after one still in flight cannot be
+     * replayed without it, so wait for every earlier log write.
+     */
+    while (wbc_inflight_before(s, seq)) {
+        qemu_co_queue_wait(&s->flush_queue);
+    }
+    if (s->failed) {
+        return -EIO;
+    }
+    return bdrv_co_flush(s->cache);
+}
+
+static int wbc_format(BDRVWBCacheState *s)
+{
+    WBCacheHeader *h;
+    int ret;
+
+    s->cache_id = ((uint64_t)g_random_int() << 32) | g_random_int();
+    h = qemu_blockalign(s->cache, BDRV_SECTOR_SIZE);
+    memset(h, 0, BDRV_SECTOR_SIZE);
+    wbc_header_to_disk(s, h, s->log_start, 1);
+    ret = bdrv_pwrite_sync(s->cache, 0, h, BDRV_SECTOR_SIZE);
+    qemu_vfree(h);
+
+    s->tail = s->head = s->log_start;
+    s->next_seq = 1;
+    return ret < 0 ? ret : 0;
+}
+
+static bool wbc_record_valid(BDRVWBCacheState *s, WBCacheRecordHeader *hdr,
+                             uint64_t pos, uint64_t seq)
+{
+    uint64_t block = le64_to_cpu(hdr->block);
+    uint32_t nb_blocks = le32_to_cpu(hdr->nb_blocks);
+
+    return le32_to_cpu(hdr->magic) == WBC_RECORD_MAGIC &&
+           le64_to_cpu(hdr->cache_id) == s->cache_id &&
+           le64_to_cpu(hdr->seq) == seq &&
+           nb_blocks > 0 && nb_blocks <= WBC_REC_MAX_BLOCKS &&
+           pos + WBC_REC_SECTORS(nb_blocks) <= s->log_end &&
+           block * WBC_BLOCK_SECTORS < s->image_sectors;
+}
+
+/* Rebuild the index from the records between the tail and the first
+ * missing, torn or stale record.
+ */
+static int wbc_replay(BDRVWBCacheState *s, uint64_t seq)
+{
+    WBCacheRecordHeader *hdr;
+    WBCacheRecord *rec;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    uint64_t pos = s->tail;
+    uint64_t wrap_from = 0;
+    uint32_t crc, nb_blocks;
+    uint8_t *buf;
+    int ret = 0;
+
+    buf = qemu_blockalign(s->cache, BDRV_SECTOR_SIZE +
+                          WBC_REC_MAX_BLOCKS * WBC_BLOCK_SIZE);
+    hdr = (WBCacheRecordHeader *)buf;
+    for (;;) {
+        if (pos >= s->log_end) {
+            pos = s->log_start;
+        }
+        ret = bdrv_pread(s->cache, pos * BDRV_SECTOR_SIZE, buf,
+                         BDRV_SECTOR_SIZE);
+        if (ret < 0) {
+            goto out;
+        }
+        if (!wbc_record_valid(s, hdr, pos, seq)) {
+            if (!wrap_from && pos != s->log_start) {
+                /* The record may not have fit before the end of the log */
+                wrap_from = pos;
+                pos = s->log_start;
+                continue;
+            }
+            break;
+        }
+
+        nb_blocks = le32_to_cpu(hdr->nb_blocks);
+        if (wrap_from) {
+            if (wrap_from + WBC_REC_SECTORS(nb_blocks) <= s->log_end) {
+                /* It would have been written in place, so it is stale */
+                break;
+            }
+            wrap_from = 0;
+        }
+        ret = bdrv_pread(s->cache, (pos + 1) * BDRV_SECTOR_SIZE,
+                         buf + BDRV_SECTOR_SIZE, nb_blocks * WBC_BLOCK_SIZE);
+        if (ret < 0) {
+            goto out;
+        }
+        crc = le32_to_cpu(hdr->crc);
+        hdr->crc = 0;
+        iov.iov_base = buf + BDRV_SECTOR_SIZE;
+        iov.iov_len = nb_blocks * WBC_BLOCK_SIZE;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        if (wbc_crc_iov(crc32(0, buf, BDRV_SECTOR_SIZE), &qiov) != crc) {
+            break;
+        }
+
+        rec = g_new0(WBCacheRecord, 1);
+        rec->offset = pos;
+        rec->seq = seq;
+        rec->block = le64_to_cpu(hdr->block);
+        rec->nb_blocks = MIN(nb_blocks, DIV_ROUND_UP(s->image_sectors,
+                             WBC_BLOCK_SECTORS) - rec->block);
+        rec->dirty_rec = le32_to_cpu(hdr->flags) & WBC_REC_DIRTY;
+        rec->written = true;
+        QTAILQ_INSERT_TAIL(&s->records, rec, next);
+        wbc_index_record(s, rec);
+
+        pos += WBC_REC_SECTORS(nb_blocks);
+        seq++;
+    }
+    if (wrap_from) {
+        /* The log ends where the next record was not found in place */
+        pos = wrap_from;
+    }
+    ret = 0;
+
+    if (QTAILQ_EMPTY(&s->records)) {
+        s->head = s->tail;
+        s->used = 0;
+    } else {
+        s->head = pos;
+        s->used = wbc_ring_dist(s, s->tail, s->head);
+        if (s->used == 0) {
+            s->used = wbc_log_sectors(s);
+        }
+    }
+    s->next_seq = seq;
+
+out:
+    qemu_vfree(buf);
+    return ret;
+}
+
+static int wbc_load(BDRVWBCacheState *s)
+{
+    WBCacheHeader *h;
+    uint32_t crc;
+    int ret;
+
+    h = qemu_blockalign(s->cache, BDRV_SECTOR_SIZE);
+    ret = bdrv_pread(s->cache, 0, h, BDRV_SECTOR_SIZE);
+    if (ret < 0) {
+        goto out;
+    }
+
+    if (le32_to_cpu(h->magic) != WBC_MAGIC) {
+        if (s->read_only) {
+            /* Nothing cached yet, e.g. while the format is being probed;
+             * the first writable open formats the cache file.  */
+            s->tail = s->head = s->log_start;
+            s->next_seq = 1;
+            ret = 0;
+        } else {
+            ret = wbc_format(s);
+        }
+        goto out;
+    }
+
+    crc = le32_to_cpu(h->crc);
+    h->crc = 0;
+    if (crc32(0, (const Bytef *)h, sizeof(*h)) != crc ||
+        le32_to_cpu(h->version) != WBC_VERSION) {
+        error_report("wbcache: cache header is corrupt or unsupported");
+        ret = -EINVAL;
+        goto out;
+    }
+    h->image[sizeof(h->image) - 1] = '\0';
+    if (strcmp(h->image, s->image) ||
+        le64_to_cpu(h->image_sectors) != s->image_sectors) {
+        error_report("wbcache: cache file belongs to image %s", h->image);
+        ret = -EINVAL;
+        goto out;
+    }
+    if (le64_to_cpu(h->cache_sectors) != s->log_end ||
+        le64_to_cpu(h->tail) < s->log_start ||
+        le64_to_cpu(h->tail) >= s->log_end) {
+        error_report("wbcache: cache file was resized");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    s->cache_id = le64_to_cpu(h->cache_id);
+    s->tail = le64_to_cpu(h->tail);
+    ret = wbc_replay(s, le64_to_cpu(h->tail_seq));
+
+out:
+    qemu_vfree(h);
+    return ret;
+}
+
+static int wbcache_open(BlockDriverState *bs, const char *filename, int flags)
+{
+    BDRVWBCacheState *s = bs->opaque;
+    char *cache, *c;
+    int64_t len;
+    int ret;
+
+    /* Parse the wbcache: prefix */
+    if (strncmp(filename, "wbcache:", strlen("wbcache:"))) {
+        return -EINVAL;
+    }
+    filename += strlen("wbcache:");
+
+    /* Parse the cache filename */
+    c = strchr(filename, ':');
+    if (c == NULL) {
+        return -EINVAL;
+    }
+
+    cache = g_strdup(filename);
+    cache[c - filename] = '\0';
+    ret = bdrv_file_open(&s->cache, cache, flags);
+    g_free(cache);
+    if (ret < 0) {
+        return ret;
+    }
+    filename = c + 1;
+
+    /* Open the image */
+    s->target = bdrv_new("");
+    ret = bdrv_open(s->target, filename, flags, NULL);
+    if (ret < 0) {
+        bdrv_delete(s->target);
+        goto fail_cache;
+    }
+
+    s->read_only = !(flags & BDRV_O_RDWR);
+    pstrcpy(s->image, sizeof(s->image), filename);
+    len = bdrv_getlength(s->target);
+    if (len < 0) {
+        ret = len;
+        goto fail;
+    }
+    s->image_sectors = len >> BDRV_SECTOR_BITS;
+
+    len = bdrv_getlength(s->cache);
+    if (len < 0) {
+        ret = len;
+        goto fail;
+    }
+    s->log_start = WBC_HEADER_SECTORS;
+    s->log_end = len >> BDRV_SECTOR_BITS;
+    if (s->log_end < s->log_start + WBC_MIN_LOG_SECTORS) {
+        error_report("wbcache: cache file must be at least %d KB",
+                     (WBC_HEADER_SECTORS + WBC_MIN_LOG_SECTORS) / 2);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    /* Keep at least a quarter of the log for new writes and read fills */
+    s->max_dirty = wbc_log_sectors(s) / WBC_REC_SECTORS(1) * 3 / 4;
+    s->max_ghosts = wbc_log_sectors(s) / WBC_BLOCK_SECTORS;
+
+    QTAILQ_INIT(&s->records);
+    QLIST_INIT(&s->inflight);
+    s->index = g_hash_table_new_full(wbc_block_hash, wbc_block_equal,
+                                     NULL, g_free);
+    s->ghosts = g_hash_table_new_full(wbc_block_hash, wbc_block_equal,
+                                      g_free, NULL);
+    qemu_co_mutex_init(&s->rmw_lock);
+    qemu_co_queue_init(&s->space_queue);
+    qemu_co_queue_init(&s->flush_queue);
+    qemu_co_queue_init(&s->destage_queue);
+
+    ret = wbc_load(s);
+    if (ret < 0) {
+        goto fail_tables;
+    }
+
+    if (s->nb_dirty) {
+        wbc_kick_destage(s);
+    }
+    return 0;
+
+fail_tables:
+    while (!QTAILQ_EMPTY(&s->records)) {
+        WBCacheRecord *rec = QTAILQ_FIRST(&s->records);
+        QTAILQ_REMOVE(&s->records, rec, next);
+        g_free(rec);
+    }
+    g_hash_table_destroy(s->index);
+    g_hash_table_destroy(s->ghosts);
+fail:
+    bdrv_delete(s->target);
+fail_cache:
+    bdrv_delete(s->cache);
+    s->target = NULL;
+    s->cache = NULL;
+    return ret;
+}
+
+/* Destage everything before closing, so that the image is consistent
+ * even without its cache.  Clean blocks stay in the log for the next open.
+ */
+static void coroutine_fn wbc_close_co(void *opaque)
+{
+    BDRVWBCacheState *s = opaque;
+
+    while (s->fills || s->destage_co) {
+        qemu_co_queue_wait(&s->destage_queue);
+    }
+    while (s->nb_dirty && !s->failed) {
+        wbc_kick_destage(s);
+        while (s->destage_co) {
+            qemu_co_queue_wait(&s->destage_queue);
+        }
+        if (s->destage_ret < 0) {
+            error_report("wbcache: dirty data left in the cache file");
+            break;
+        }
+    }
+    s->closed = true;
+}
+
+static void wbcache_close(BlockDriverState *bs)
+{
+    BDRVWBCacheState *s = bs->opaque;
+    WBCacheRecord *rec;
+    Coroutine *co;
+
+    if (!s->read_only) {
+        co = qemu_coroutine_create(wbc_close_co);
+        qemu_coroutine_enter(co, s);
+        while (!s->closed) {
+            qemu_aio_wait();
+        }
+    }
+
+    while ((rec = QTAILQ_FIRST(&s->records)) != NULL) {
+        QTAILQ_REMOVE(&s->records, rec, next);
+        g_free(rec);
+    }
+    g_hash_table_destroy(s->index);
+    g_hash_table_destroy(s->ghosts);
+    bdrv_delete(s->target);
+    bdrv_delete(s->cache);
+}
+
+static int64_t wbcache_getlength(BlockDriverState *bs)
+{
+    BDRVWBCacheState *s = bs->opaque;
+
+    return s->image_sectors << BDRV_SECTOR_BITS;
+}
+
+static BlockDriver bdrv_wbcache = {
+    .format_name            = "wbcache",
+    .protocol_name          = "wbcache",
+
+    .instance_size          = sizeof(BDRVWBCacheState),
+
+    .bdrv_getlength         = wbcache_getlength,
+
+    .bdrv_file_open         = wbcache_open,
+    .bdrv_close             = wbcache_close,
+
+    .bdrv_co_readv          = wbcache_co_readv,
+    .bdrv_co_writev         = wbcache_co_writev,
+    .bdrv_co_flush_to_disk  = wbcache_co_flush,
+};
+
+static void bdrv_wbcache_init(void)
+{
+    bdrv_register(&bdrv_wbcache);
+}
+
+block_init(bdrv_wbcache_init);
@@ -32,16 +32,17 @@
 #include "qapi-types.h"
 #include "qerror.h"
 #include "monitor.h"
+#include "qemu/hbitmap.h"
 
 #define BLOCK_FLAG_ENCRYPT          1
 #define BLOCK_FLAG_COMPAT6          4
 #define BLOCK_FLAG_LAZY_REFCOUNTS   8
+#define BLOCK_FLAG_EXTL2            16
 
 #define BLOCK_IO_LIMIT_READ     0
 #define BLOCK_IO_LIMIT_WRITE    1
 #define BLOCK_IO_LIMIT_TOTAL    2
 
-#define BLOCK_IO_SLICE_TIME     100000000
 #define NANOSECONDS_PER_SECOND  1000000000.0
 
 #define BLOCK_OPT_SIZE              "size"
@@ -55,18 +56,30 @@
 #define BLOCK_OPT_SUBFMT            "subformat"
 #define BLOCK_OPT_COMPAT_LEVEL      "compat"
 #define BLOCK_OPT_LAZY_REFCOUNTS    "lazy_refcounts"
+#define BLOCK_OPT_EXTL2             "extended_l2"
 
 typedef struct BdrvTrackedRequest BdrvTrackedRequest;
-
+typedef struct PrefetchRecorder PrefetchRecorder;
+
+/* Each non-zero rate in bps[] or iops[] is enforced by a leaky bucket that
+ * drains at that rate.  Requests are let through while the bucket is below
+ * its size, which is bps_max/iops_max * burst_length units when a burst rate
+ * is given and a tenth of a second's worth of the average rate otherwise.
+ * The burst rate itself is enforced over windows of a tenth of a second.
+ * Requests larger than iops_size bytes count as several operations.
+ * Devices naming the same group share one set of buckets.
+ */
 typedef struct BlockIOLimit {
     int64_t bps[3];
     int64_t iops[3];
+    int64_t bps_max[3];
+    int64_t iops_max[3];
+    int64_t burst_length;
+    int64_t iops_size;
+    char group[32];
 } BlockIOLimit;
 
-typedef struct BlockIOBaseValue {
-    uint64_t bytes[2];
-    uint64_t ios[2];
-} BlockIOBaseValue;
+typedef struct BlockThrottleGroup BlockThrottleGroup;
 
 struct BlockDriver {
     const char *format_name;
@@ -88,7 +101,29 @@ struct BlockDriver {
                       const uint8_t *buf, int nb_sectors);
     void (*bdrv_close)(BlockDriverState *bs);
     void (*bdrv_rebind)(BlockDriverState *bs);
+
+    /* Remove fd handlers and other event loop callbacks so the old
+     * AioContext is no longer in use.  Called with no in-flight requests.
+     */
+    void (*bdrv_detach_aio_context)(BlockDriverState *bs);
+
+    /* Add fd handlers and other event loop callbacks to @new_context so
+     * I/O requests can be processed again.  Called with no in-flight
+     * requests.
+     */
+    void (*bdrv_attach_aio_context)(BlockDriverState *bs,
+                                    AioContext *new_context);
+
+    /* Queue requests until the matching unplug and submit them at once */
+    void (*bdrv_io_plug)(BlockDriverState *bs);
+    void (*bdrv_io_unplug)(BlockDriverState *bs);
     int (*bdrv_create)(const char *filename, QEMUOptionParameter *options);
+    /*
+     * Computes the size of an image created with the given options when
+     * in_bs (or nothing, if it is NULL) is converted into it.  May be NULL.
+     */
+    int (*bdrv_measure)(QEMUOptionParameter *options, BlockDriverState *in_bs,
+                        BlockMeasureInfo *info);
     int (*bdrv_set_key)(BlockDriverState *bs, const char *key);
     int (*bdrv_make_empty)(BlockDriverState *bs);
     /* aio */
@@ -120,6 +155,12 @@ struct BlockDriver {
         int64_t sector_num, int nb_sectors);
     int coroutine_fn (*bdrv_co_is_allocated)(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors, int *pnum);
+    /*
+     * Like bdrv_co_is_allocated(), but returns a BDRV_EXTENT_* type so that
+     * sectors which read as zeroes can be told apart from data.  May be NULL.
+     */
+    int coroutine_fn (*bdrv_co_get_extent)(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, int *pnum);
 
     /*
      * Invalidate any cached meta-data.
@@ -143,6 +184,9 @@ struct BlockDriver {
     int (*bdrv_truncate)(BlockDriverState *bs, int64_t offset);
     int64_t (*bdrv_getlength)(BlockDriverState *bs);
     int64_t (*bdrv_get_allocated_file_size)(BlockDriverState *bs);
+    /* Apply bs->l2_cache_size and bs->refcount_cache_size to an open image.
+     * Called with no requests in flight. */
+    int (*bdrv_update_cache_size)(BlockDriverState *bs);
     int (*bdrv_write_compressed)(BlockDriverState *bs, int64_t sector_num,
                                  const uint8_t *buf, int nb_sectors);
 
@@ -188,6 +232,12 @@ struct BlockDriver {
     int (*bdrv_check)(BlockDriverState* bs, BdrvCheckResult *result,
         BdrvCheckMode fix);
 
+    /*
+     * Returns true if persistent dirty bitmaps can be stored in the image.
+     * Such bitmaps are saved by bdrv_close() and recreated on open.
+     */
+    bool (*bdrv_can_persist_dirty_bitmaps)(BlockDriverState *bs);
+
     void (*bdrv_debug_event)(BlockDriverState *bs, BlkDebugEvent event);
 
     /*
@@ -199,6 +249,32 @@ struct BlockDriver {
     QLIST_ENTRY(BlockDriver) list;
 };
 
+#define BLOCK_MAX_STATS_INTERVALS 8
+
+typedef struct BlockLatencyHistogram {
+    int nb_bins;                /* 0 while disabled */
+    uint64_t *boundaries;       /* nb_bins - 1 bin boundaries in ns */
+    uint64_t *bins;
+} BlockLatencyHistogram;
+
+/* Latencies of the requests that completed in a window of time.  Each
+ * interval has two windows that are staggered by half its length, and the
+ * older one is reported, so that the figures cover between half and all of
+ * the interval.
+ */
+typedef struct BlockAcctWindow {
+    int64_t expires_ns;
+    uint64_t count[BDRV_MAX_IOTYPE];
+    uint64_t sum_ns[BDRV_MAX_IOTYPE];
+    uint64_t min_ns[BDRV_MAX_IOTYPE];
+    uint64_t max_ns[BDRV_MAX_IOTYPE];
+} BlockAcctWindow;
+
+typedef struct BlockAcctTimedStats {
+    int64_t interval_ns;
+    BlockAcctWindow windows[2];
+} BlockAcctTimedStats;
+
 /*
  * Note: the function bdrv_append() copies and swaps contents of
  * BlockDriverStates, so if you add new fields to this struct, please
@@ -213,6 +289,8 @@ struct BlockDriverState {
     int encrypted; /* if true, the media is encrypted */
     int valid_key; /* if true, a valid encryption key has been set */
     int sg;        /* if true, the device is a /dev/sg* */
+    /* in bytes, the unit in which discards free space (0 if they don't) */
+    uint32_t discard_granularity;
     int copy_on_read; /* if true, copy read backing sectors into image
                          note this is a reference count */
 
@@ -235,24 +313,40 @@ struct BlockDriverState {
 
     NotifierList close_notifiers;
 
+    /* Callback before write request is processed */
+    NotifierWithReturnList before_write_notifiers;
+
     /* number of in-flight copy-on-read requests */
     unsigned int copy_on_read_in_flight;
 
-    /* the time for latest disk I/O */
-    int64_t slice_time;
-    int64_t slice_start;
-    int64_t slice_end;
+    /* number of in-flight requests that overlapping requests wait for */
+    unsigned int serialising_in_flight;
+
+    /* I/O throttling */
     BlockIOLimit io_limits;
-    BlockIOBaseValue  io_base;
+    BlockThrottleGroup *throttle_group;
+    QLIST_ENTRY(BlockDriverState) throttle_list;
     CoQueue      throttled_reqs;
-    QEMUTimer    *block_timer;
     bool         io_limits_enabled;
 
+    /* Request merging: bdrv_aio_readv/writev queue requests until the
+     * outermost bdrv_io_unplug() or until merge_window_ns have passed */
+    bool         io_merge_enabled;
+    int64_t      merge_window_ns;
+    QEMUTimer    *merge_timer;
+    QTAILQ_HEAD(, BlockMergeAIOCB) merge_queue;
+    int          merge_queue_len;
+    int          io_plug_depth;
+
     /* I/O stats (display with "info blockstats"). */
     uint64_t nr_bytes[BDRV_MAX_IOTYPE];
     uint64_t nr_ops[BDRV_MAX_IOTYPE];
+    uint64_t nr_merged[BDRV_MAX_IOTYPE];
     uint64_t total_time_ns[BDRV_MAX_IOTYPE];
     uint64_t wr_highest_sector;
+    BlockLatencyHistogram latency_histogram[BDRV_MAX_IOTYPE];
+    BlockAcctTimedStats timed_stats[BLOCK_MAX_STATS_INTERVALS];
+    int nb_stats_intervals;
 
     /* Whether the disk can expand beyond total_sectors */
     int growable;
@@ -260,6 +354,11 @@ struct BlockDriverState {
     /* the memory alignment required for the buffers handled by this driver */
     int buffer_alignment;
 
+    /* metadata cache sizes in bytes for formats that have them, 0 for the
+     * driver default */
+    uint64_t l2_cache_size;
+    uint64_t refcount_cache_size;
+
     /* do we need to tell the quest if we have a volatile write cache? */
     int enable_write_cache;
 
@@ -269,8 +368,8 @@ struct BlockDriverState {
     bool iostatus_enabled;
     BlockDeviceIoStatus iostatus;
     char device_name[32];
-    unsigned long *dirty_bitmap;
-    int64_t dirty_count;
+    HBitmap *dirty_bitmap;
+    QLIST_HEAD(, BdrvDirtyBitmap) dirty_bitmaps; /* named bitmaps */
     int in_use; /* users other than guest access, eg. block migration */
     QTAILQ_ENTRY(BlockDriverState) list;
 
@@ -279,6 +378,37 @@ struct BlockDriverState {
     /* long-running background operation */
     BlockJob *job;
 
+    /* event loop used for fd handlers and bottom halves */
+    AioContext *aio_context;
+
+    /* key of the image data in the shared host-wide cache, 0 if unused */
+    uint64_t shared_cache_id;
+
+    /* guest read pattern being recorded into a prefetch hint file */
+    PrefetchRecorder *prefetch_recorder;
+};
+
+struct BdrvTrackedRequest {
+    BlockDriverState *bs;
+    int64_t sector_num;
+    int nb_sectors;
+    bool is_write;
+    QLIST_ENTRY(BdrvTrackedRequest) list;
+    Coroutine *co; /* owner, used for deadlock detection */
+    CoQueue wait_queue; /* coroutines blocked on this request */
+};
+
+/*
+ * A named dirty bitmap.  Unlike bs->dirty_bitmap, which belongs to whatever
+ * block job is running, these are managed by the user and survive jobs; the
+ * persistent ones are stored in the image by drivers that support it.
+ */
+struct BdrvDirtyBitmap {
+    char *name;
+    HBitmap *bitmap;
+    bool persistent;    /* saved in the image on close */
+    bool frozen;        /* in use by a block job, cannot be removed */
+    QLIST_ENTRY(BdrvDirtyBitmap) list;
 };
 
 int get_tmp_filename(char *filename, int size);
@@ -286,6 +416,16 @@ int get_tmp_filename(char *filename, int size);
 void bdrv_set_io_limits(BlockDriverState *bs,
                         BlockIOLimit *io_limits);
 
+/**
+ * bdrv_add_before_write_notifier:
+ *
+ * Register a callback that is invoked before write requests are processed but
+ * after any throttling or waiting for overlapping requests.  The notifier is
+ * passed the BdrvTrackedRequest of the write.
+ */
+void bdrv_add_before_write_notifier(BlockDriverState *bs,
+                                    NotifierWithReturn *notifier);
+
 #ifdef _WIN32
 int is_windows_drive(const char *filename);
 #endif
@@ -293,6 +433,37 @@ void bdrv_emit_qmp_error_event(const BlockDriverState *bdrv,
                                enum MonitorEvent ev,
                                BlockErrorAction action, bool is_read);
 
+typedef struct PrefetchExtent {
+    int64_t sector_num;
+    int nb_sectors;
+} PrefetchExtent;
+
+/**
+ * prefetch_record_start:
+ * @bs: Block device whose guest reads are recorded.
+ * @filename: Hint file written when the recording ends.
+ * @duration_ms: Length of the recording, or 0 to record until
+ * prefetch_record_stop() is called or @bs is closed.
+ * @errp: Error object.
+ *
+ * Record the order in which the guest first reads each area of @bs, for
+ * use as the @hint_file of stream_start() on clones of the same image.
+ */
+void prefetch_record_start(BlockDriverState *bs, const char *filename,
+                           int64_t duration_ms, Error **errp);
+void prefetch_record_read(BlockDriverState *bs, int64_t sector_num,
+                          int nb_sectors);
+void prefetch_record_stop(BlockDriverState *bs, Error **errp);
+
+/**
+ * prefetch_hints_load:
+ *
+ * Read the extents of the hint file @filename that lie within @bs into a
+ * newly allocated array.  Returns the number of extents, or -1 on error.
+ */
+int prefetch_hints_load(BlockDriverState *bs, const char *filename,
+                        PrefetchExtent **extents, Error **errp);
+
 /**
  * stream_start:
  * @bs: Block device to operate on.
@@ -300,6 +471,7 @@ void bdrv_emit_qmp_error_event(const BlockDriverState *bdrv,
  * flatten the whole backing file chain onto @bs.
  * @base_id: The file name that will be written to @bs as the new
  * backing file if the job completes.  Ignored if @base is %NULL.
+ * @hint_file: Hint file from prefetch_record_start(), or %NULL.
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
  * @on_error: The action to take upon error.
  * @cb: Completion function for the job.
@@ -311,9 +483,14 @@ void bdrv_emit_qmp_error_event(const BlockDriverState *bdrv,
  * exclusive) will be written to @bs.  At the end of a successful
  * streaming job, the backing file of @bs will be changed to
  * @base_id in the written image and to @base in the live BlockDriverState.
+ *
+ * With a @hint_file, the areas it lists are copied first, in the recorded
+ * order and regardless of @speed, so that a booting guest finds them in
+ * @bs; the rest is streamed afterwards at @speed.
  */
 void stream_start(BlockDriverState *bs, BlockDriverState *base,
-                  const char *base_id, int64_t speed, BlockdevOnError on_error,
+                  const char *base_id, const char *hint_file,
+                  int64_t speed, BlockdevOnError on_error,
                   BlockDriverCompletionFunc *cb,
                   void *opaque, Error **errp);
 
@@ -338,6 +515,9 @@ void commit_start(BlockDriverState *bs, BlockDriverState *base,
  * @bs: Block device to operate on.
  * @target: Block device to write to.
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
+ * @granularity: The chosen granularity for the dirty bitmap, or 0 to
+ * pick one based on the target's cluster size.
+ * @buf_size: The amount of data that can be in flight at one time.
  * @mode: Whether to collapse all images in the chain to the target.
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
@@ -351,10 +531,39 @@ void commit_start(BlockDriverState *bs, BlockDriverState *base,
  * @bs will be switched to read from @target.
  */
 void mirror_start(BlockDriverState *bs, BlockDriverState *target,
-                  int64_t speed, MirrorSyncMode mode,
+                  int64_t speed, int64_t granularity, int64_t buf_size,
+                  MirrorSyncMode mode,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockDriverCompletionFunc *cb,
                   void *opaque, Error **errp);
 
+/*
+ * backup_start:
+ * @bs: Block device to operate on.
+ * @target: Block device to write to.
+ * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
+ * @sync_mode: What parts of the disk image should be copied to the
+ * destination.
+ * @sync_bitmap: The dirty bitmap that selects the clusters to copy with
+ * MIRROR_SYNC_MODE_INCREMENTAL, NULL otherwise.
+ * @on_source_error: The action to take upon error reading from the source.
+ * @on_target_error: The action to take upon error writing to the target.
+ * @cb: Completion function for the job.
+ * @opaque: Opaque pointer value passed to @cb.
+ * @errp: Error object.
+ *
+ * Start a backup operation on @bs.  Clusters in @bs are written to @target
+ * until the job is cancelled or the whole image has been copied.  Guest
+ * writes to clusters not yet copied first save the old data to @target, so
+ * that @target holds the contents of @bs at the time the job was started.
+ */
+void backup_start(BlockDriverState *bs, BlockDriverState *target,
+                  int64_t speed, MirrorSyncMode sync_mode,
+                  BdrvDirtyBitmap *sync_bitmap,
+                  BlockdevOnError on_source_error,
+                  BlockdevOnError on_target_error,
+                  BlockDriverCompletionFunc *cb, void *opaque,
+                  Error **errp);
+
 #endif /* BLOCK_INT_H */
@@ -10,6 +10,8 @@
  */
 
 #include "blockdev.h"
+#include "block_int.h"
+#include "blockjob.h"
 #include "hw/block-common.h"
 #include "monitor.h"
 #include "qerror.h"
@@ -51,6 +53,7 @@ void qmp_nbd_server_start(SocketAddress *addr, Error **errp)
 typedef struct NBDCloseNotifier {
     Notifier n;
     NBDExport *exp;
+    BlockDriverState *source;   /* only for point-in-time exports */
     QTAILQ_ENTRY(NBDCloseNotifier) next;
 } NBDCloseNotifier;
 
@@ -66,6 +69,15 @@ static void nbd_close_notifier(Notifier *n, void *data)
 
     nbd_export_close(cn->exp);
     nbd_export_put(cn->exp);
+
+    /* The overlay only borrowed the live image as its backing file */
+    if (cn->source) {
+        BlockDriverState *overlay = data;
+
+        bdrv_drain_all();
+        assert(overlay->backing_hd == cn->source);
+        overlay->backing_hd = NULL;
+    }
     g_free(cn);
 }
 
@@ -75,10 +87,75 @@ static void nbd_server_put_ref(NBDExport *exp)
     drive_put_ref(drive_get_by_blockdev(bs));
 }
 
+/* Create a temporary overlay that shows @bs as it is now.  Reads of
+ * clusters that the guest has not overwritten are passed to @bs; a
+ * copy-before-write backup job saves the old contents of the others into
+ * the overlay.  The job owns the overlay and deletes it when it ends.
+ */
+static BlockDriverState *nbd_snapshot_new(BlockDriverState *bs, Error **errp)
+{
+    BlockDriverState *overlay;
+    BlockDriver *drv = bdrv_find_format("qcow2");
+    char tmp_filename[PATH_MAX + 1];
+    Error *local_err = NULL;
+    int64_t size;
+    int ret;
+
+    if (bdrv_in_use(bs)) {
+        error_set(errp, QERR_DEVICE_IN_USE, bdrv_get_device_name(bs));
+        return NULL;
+    }
+
+    size = bdrv_getlength(bs);
+    if (size < 0) {
+        error_set(errp, QERR_IO_ERROR);
+        return NULL;
+    }
+
+    /* The default cluster size matches the copy-before-write granularity,
+     * so the job never makes the overlay read its backing file.
+     */
+    ret = get_tmp_filename(tmp_filename, sizeof(tmp_filename));
+    if (ret == 0) {
+        ret = bdrv_img_create(tmp_filename, "qcow2", NULL, NULL, NULL,
+                              size, BDRV_O_RDWR);
+    }
+    if (ret) {
+        error_set(errp, QERR_OPEN_FILE_FAILED, tmp_filename);
+        return NULL;
+    }
+
+    overlay = bdrv_new("");
+    overlay->is_temporary = 1;
+    ret = bdrv_open(overlay, tmp_filename,
+                    BDRV_O_RDWR | BDRV_O_CACHE_WB | BDRV_O_NO_BACKING, drv);
+    if (ret < 0) {
+        bdrv_delete(overlay);
+        error_set(errp, QERR_OPEN_FILE_FAILED, tmp_filename);
+        return NULL;
+    }
+    overlay->backing_hd = bs;
+
+    backup_start(bs, overlay, 0, MIRROR_SYNC_MODE_NONE, NULL,
+                 BLOCKDEV_ON_ERROR_REPORT, BLOCKDEV_ON_ERROR_REPORT,
+                 block_job_cb, bs, &local_err);
+    if (local_err != NULL) {
+        overlay->backing_hd = NULL;
+        bdrv_delete(overlay);
+        error_propagate(errp, local_err);
+        return NULL;
+    }
+
+    /* Released by block_job_cb */
+    drive_get_ref(drive_get_by_blockdev(bs));
+    return overlay;
+}
+
 void qmp_nbd_server_add(const char *device, bool has_writable, bool writable,
-                        Error **errp)
+                        bool has_snapshot, bool snapshot, Error **errp)
 {
     BlockDriverState *bs;
+    BlockDriverState *source = NULL;
     NBDExport *exp;
     NBDCloseNotifier *n;
 
@@ -105,15 +182,33 @@ void qmp_nbd_server_add(const char *device, bool has_writable, bool writable,
         writable = false;
     }
 
-    exp = nbd_export_new(bs, 0, -1, writable ? 0 : NBD_FLAG_READ_ONLY,
-                         nbd_server_put_ref);
+    if (has_snapshot && snapshot) {
+        if (writable) {
+            error_setg(errp, "A point-in-time export cannot be writable");
+            return;
+        }
+        source = bs;
+        bs = nbd_snapshot_new(source, errp);
+        if (!bs) {
+            return;
+        }
+
+        /* The overlay is not a drive; the backup job keeps the source in
+         * use and deletes the overlay, which closes the export.
+         */
+        exp = nbd_export_new(bs, 0, -1, NBD_FLAG_READ_ONLY, NULL);
+    } else {
+        exp = nbd_export_new(bs, 0, -1, writable ? 0 : NBD_FLAG_READ_ONLY,
+                             nbd_server_put_ref);
+        drive_get_ref(drive_get_by_blockdev(bs));
+    }
 
     nbd_export_set_name(exp, device);
-    drive_get_ref(drive_get_by_blockdev(bs));
 
     n = g_malloc0(sizeof(NBDCloseNotifier));
     n->n.notify = nbd_close_notifier;
     n->exp = exp;
+    n->source = source;
     bdrv_add_close_notifier(bs, &n->n);
     QTAILQ_INSERT_TAIL(&close_notifiers, n, next);
 }
@@ -122,7 +217,14 @@ void qmp_nbd_server_stop(Error **errp)
 {
     while (!QTAILQ_EMPTY(&close_notifiers)) {
         NBDCloseNotifier *cn = QTAILQ_FIRST(&close_notifiers);
+        BlockDriverState *source = cn->source;
+
         nbd_close_notifier(&cn->n, nbd_export_get_blockdev(cn->exp));
+
+        /* Stopping the copy-before-write job deletes the overlay */
+        if (source && source->job) {
+            block_job_cancel_sync(source->job);
+        }
     }
 
     if (server_fd != -1) {
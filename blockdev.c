@@ -23,6 +23,19 @@
 
 static QTAILQ_HEAD(drivelist, DriveInfo) drives = QTAILQ_HEAD_INITIALIZER(drives);
 
+/* Images that drive_init() opens concurrently between the batch calls */
+typedef struct DriveOpen {
+    DriveInfo *dinfo;
+    char *file;
+    int ret;
+    QSIMPLEQ_ENTRY(DriveOpen) next;
+} DriveOpen;
+
+static bool drive_open_batched;
+static int drive_opens_pending;
+static QSIMPLEQ_HEAD(, DriveOpen) drive_opens =
+    QSIMPLEQ_HEAD_INITIALIZER(drive_opens);
+
 static const char *const if_name[IF_COUNT] = {
     [IF_NONE] = "none",
     [IF_IDE] = "ide",
@@ -238,6 +251,66 @@ static void drive_put_ref_bh_schedule(DriveInfo *dinfo)
     qemu_bh_schedule(s->bh);
 }
 
+/* Undoes drive_init() for a drive whose image could not be opened */
+static void drive_init_abort(DriveInfo *dinfo)
+{
+    bdrv_delete(dinfo->bdrv);
+    g_free(dinfo->id);
+    QTAILQ_REMOVE(&drives, dinfo, next);
+    g_free(dinfo);
+}
+
+static void drive_open_cb(void *opaque, int ret)
+{
+    DriveOpen *dopen = opaque;
+
+    dopen->ret = ret;
+    drive_opens_pending--;
+}
+
+/*
+ * Makes drive_init() start opening images in the background instead of
+ * waiting for each of them, so that the images and backing files of all
+ * drives on the command line are opened at the same time.
+ */
+void drive_open_batch_begin(void)
+{
+    assert(!drive_open_batched);
+    drive_open_batched = true;
+}
+
+/*
+ * Waits for the images that drive_init() started to open since
+ * drive_open_batch_begin() and removes the drives whose image failed.
+ * Returns -1 if any failed.
+ */
+int drive_open_batch_end(void)
+{
+    DriveOpen *dopen;
+    int ret = 0;
+
+    assert(drive_open_batched);
+    while (drive_opens_pending > 0) {
+        qemu_aio_wait();
+    }
+    drive_open_batched = false;
+
+    while ((dopen = QSIMPLEQ_FIRST(&drive_opens)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&drive_opens, next);
+        if (dopen->ret < 0) {
+            error_report("could not open disk image %s: %s",
+                         dopen->file, strerror(-dopen->ret));
+            drive_init_abort(dopen->dinfo);
+            ret = -1;
+        } else if (bdrv_key_required(dopen->dinfo->bdrv)) {
+            autostart = 0;
+        }
+        g_free(dopen->file);
+        g_free(dopen);
+    }
+    return ret;
+}
+
 static int parse_block_error_action(const char *buf, bool is_read)
 {
     if (!strcmp(buf, "ignore")) {
@@ -255,10 +328,11 @@ static int parse_block_error_action(const char *buf, bool is_read)
     }
 }
 
-static bool do_check_io_limits(BlockIOLimit *io_limits)
+static bool do_check_io_limits(BlockIOLimit *io_limits, Error **errp)
 {
     bool bps_flag;
     bool iops_flag;
+    int i;
 
     assert(io_limits);
 
@@ -269,12 +343,73 @@ static bool do_check_io_limits(BlockIOLimit *io_limits)
                  && ((io_limits->iops[BLOCK_IO_LIMIT_READ] != 0)
                  || (io_limits->iops[BLOCK_IO_LIMIT_WRITE] != 0));
     if (bps_flag || iops_flag) {
+        error_setg(errp, "bps(iops) and bps_rd/bps_wr(iops_rd/iops_wr) "
+                   "cannot be used at the same time");
+        return false;
+    }
+
+    for (i = 0; i < 3; i++) {
+        if (io_limits->bps[i] < 0 || io_limits->iops[i] < 0 ||
+            io_limits->bps_max[i] < 0 || io_limits->iops_max[i] < 0) {
+            error_setg(errp, "bps and iops values must be 0 or greater");
+            return false;
+        }
+        if ((io_limits->bps_max[i] &&
+             io_limits->bps_max[i] < io_limits->bps[i]) ||
+            (io_limits->iops_max[i] &&
+             io_limits->iops_max[i] < io_limits->iops[i])) {
+            error_setg(errp, "burst rates cannot be lower than the "
+                       "average rates");
+            return false;
+        }
+        if ((io_limits->bps_max[i] && !io_limits->bps[i]) ||
+            (io_limits->iops_max[i] && !io_limits->iops[i])) {
+            error_setg(errp, "burst rates need the matching average rate");
+            return false;
+        }
+    }
+
+    if (io_limits->burst_length < 1) {
+        error_setg(errp, "burst_length must be at least 1 second");
+        return false;
+    }
+
+    if (io_limits->iops_size < 0) {
+        error_setg(errp, "iops_size must be 0 or greater");
         return false;
     }
 
     return true;
 }
 
+/* Parse a colon-separated list of numbers like "1:60:3600" */
+static int parse_uint_list(const char *str, uint64_t *values, int max_values)
+{
+    int n = 0;
+    char *end;
+
+    if (!*str) {
+        return 0;
+    }
+    for (;;) {
+        if (n == max_values || !qemu_isdigit(*str)) {
+            return -EINVAL;
+        }
+        errno = 0;
+        values[n++] = strtoull(str, &end, 10);
+        if (errno) {
+            return -EINVAL;
+        }
+        if (!*end) {
+            return n;
+        }
+        if (*end != ':') {
+            return -EINVAL;
+        }
+        str = end + 1;
+    }
+}
+
 DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
 {
     const char *buf;
@@ -294,6 +429,9 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     const char *devaddr;
     DriveInfo *dinfo;
     BlockIOLimit io_limits;
+    uint64_t stats_intervals[BLOCK_MAX_STATS_INTERVALS];
+    int nb_stats_intervals = -1;
+    Error *error = NULL;
     int snapshot = 0;
     bool copy_on_read;
     int ret;
@@ -386,12 +524,24 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
         }
     }
 
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     if ((buf = qemu_opt_get(opts, "aio")) != NULL) {
-        if (!strcmp(buf, "native")) {
-            bdrv_flags |= BDRV_O_NATIVE_AIO;
-        } else if (!strcmp(buf, "threads")) {
+        if (!strcmp(buf, "threads")) {
             /* this is the default */
+#ifdef CONFIG_LINUX_AIO
+        } else if (!strcmp(buf, "native")) {
+            bdrv_flags |= BDRV_O_NATIVE_AIO;
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+        } else if (!strcmp(buf, "io_uring")) {
+            bdrv_flags |= BDRV_O_IO_URING;
+            if (qemu_opt_get_bool(opts, "aio-sqpoll", false)) {
+                bdrv_flags |= BDRV_O_SQPOLL;
+            }
+            if (qemu_opt_get_bool(opts, "aio-fixed-bufs", false)) {
+                bdrv_flags |= BDRV_O_FIXED_BUFS;
+            }
+#endif
         } else {
            error_report("invalid aio option");
            return NULL;
@@ -414,6 +564,7 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     }
 
     /* disk I/O throttling */
+    memset(&io_limits, 0, sizeof(io_limits));
     io_limits.bps[BLOCK_IO_LIMIT_TOTAL]  =
                            qemu_opt_get_number(opts, "bps", 0);
     io_limits.bps[BLOCK_IO_LIMIT_READ]   =
@@ -426,13 +577,42 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
                            qemu_opt_get_number(opts, "iops_rd", 0);
     io_limits.iops[BLOCK_IO_LIMIT_WRITE] =
                            qemu_opt_get_number(opts, "iops_wr", 0);
-
-    if (!do_check_io_limits(&io_limits)) {
-        error_report("bps(iops) and bps_rd/bps_wr(iops_rd/iops_wr) "
-                     "cannot be used at the same time");
+    io_limits.bps_max[BLOCK_IO_LIMIT_TOTAL]  =
+                           qemu_opt_get_number(opts, "bps_max", 0);
+    io_limits.bps_max[BLOCK_IO_LIMIT_READ]   =
+                           qemu_opt_get_number(opts, "bps_rd_max", 0);
+    io_limits.bps_max[BLOCK_IO_LIMIT_WRITE]  =
+                           qemu_opt_get_number(opts, "bps_wr_max", 0);
+    io_limits.iops_max[BLOCK_IO_LIMIT_TOTAL] =
+                           qemu_opt_get_number(opts, "iops_max", 0);
+    io_limits.iops_max[BLOCK_IO_LIMIT_READ]  =
+                           qemu_opt_get_number(opts, "iops_rd_max", 0);
+    io_limits.iops_max[BLOCK_IO_LIMIT_WRITE] =
+                           qemu_opt_get_number(opts, "iops_wr_max", 0);
+    io_limits.burst_length = qemu_opt_get_number(opts, "burst_length", 1);
+    io_limits.iops_size = qemu_opt_get_size(opts, "iops_size", 0);
+    buf = qemu_opt_get(opts, "group");
+    if (buf) {
+        pstrcpy(io_limits.group, sizeof(io_limits.group), buf);
+    }
+
+    if (!do_check_io_limits(&io_limits, &error)) {
+        error_report("%s", error_get_pretty(error));
+        error_free(error);
         return NULL;
     }
 
+    buf = qemu_opt_get(opts, "stats-intervals");
+    if (buf) {
+        nb_stats_intervals = parse_uint_list(buf, stats_intervals,
+                                             BLOCK_MAX_STATS_INTERVALS);
+        if (nb_stats_intervals < 0) {
+            error_report("stats-intervals must be up to %d colon-separated "
+                         "numbers of seconds", BLOCK_MAX_STATS_INTERVALS);
+            return NULL;
+        }
+    }
+
     if (qemu_opt_get(opts, "boot") != NULL) {
         fprintf(stderr, "qemu-kvm: boot=on|off is deprecated and will be "
                 "ignored. Future versions will reject this parameter. Please "
@@ -554,6 +734,27 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     /* disk I/O throttling */
     bdrv_set_io_limits(dinfo->bdrv, &io_limits);
 
+    /* latency statistics, see query-blockstats */
+    if (nb_stats_intervals >= 0 &&
+        bdrv_set_stats_intervals(dinfo->bdrv, stats_intervals,
+                                 nb_stats_intervals) < 0) {
+        error_report("invalid stats-intervals '%s'",
+                     qemu_opt_get(opts, "stats-intervals"));
+        goto err;
+    }
+
+    /* request merging */
+    if (qemu_opt_get_bool(opts, "merge", false)) {
+        bdrv_set_io_merge(dinfo->bdrv, true,
+                          qemu_opt_get_number(opts, "merge-window", 0) *
+                          SCALE_US);
+    }
+
+    /* metadata caches, applied when the image is opened */
+    bdrv_set_cache_size(dinfo->bdrv,
+                        qemu_opt_get_size(opts, "l2-cache-size", 0),
+                        qemu_opt_get_size(opts, "refcount-cache-size", 0));
+
     switch(type) {
     case IF_IDE:
     case IF_SCSI:
@@ -615,6 +816,18 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
         error_report("warning: disabling copy_on_read on readonly drive");
     }
 
+    if (drive_open_batched) {
+        DriveOpen *dopen = g_new0(DriveOpen, 1);
+
+        dopen->dinfo = dinfo;
+        dopen->file = g_strdup(file);
+        QSIMPLEQ_INSERT_TAIL(&drive_opens, dopen, next);
+        drive_opens_pending++;
+        bdrv_open_async(dinfo->bdrv, file, bdrv_flags, drv,
+                        drive_open_cb, dopen);
+        return dinfo;
+    }
+
     ret = bdrv_open(dinfo->bdrv, file, bdrv_flags, drv);
     if (ret < 0) {
         error_report("could not open disk image %s: %s",
@@ -627,10 +840,7 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     return dinfo;
 
 err:
-    bdrv_delete(dinfo->bdrv);
-    g_free(dinfo->id);
-    QTAILQ_REMOVE(&drives, dinfo, next);
-    g_free(dinfo);
+    drive_init_abort(dinfo);
     return NULL;
 }
 
@@ -697,6 +907,47 @@ typedef struct BlkTransactionStates {
     QSIMPLEQ_ENTRY(BlkTransactionStates) entry;
 } BlkTransactionStates;
 
+/*
+ * Drain the devices taking part in a transaction and flush the writable ones,
+ * all at the same time.  Devices that cannot be found are skipped here and
+ * reported by qmp_transaction().
+ */
+static int transaction_quiesce(BlockdevActionList *dev_list)
+{
+    BlockdevActionList *dev_entry;
+    BlockDriverState **bs_list = NULL;
+    int n = 0, ret;
+
+    for (dev_entry = dev_list; dev_entry; dev_entry = dev_entry->next) {
+        BlockdevAction *dev_info = dev_entry->value;
+        BlockDriverState *bs;
+        const char *device;
+
+        switch (dev_info->kind) {
+        case BLOCKDEV_ACTION_KIND_BLOCKDEV_SNAPSHOT_SYNC:
+            device = dev_info->blockdev_snapshot_sync->device;
+            break;
+        default:
+            abort();
+        }
+
+        bs = bdrv_find(device);
+        if (!bs || !bdrv_is_inserted(bs)) {
+            continue;
+        }
+
+        bdrv_drain(bs);
+        if (!bdrv_is_read_only(bs)) {
+            bs_list = g_renew(BlockDriverState *, bs_list, n + 1);
+            bs_list[n++] = bs;
+        }
+    }
+
+    ret = bdrv_flush_multiple(bs_list, n);
+    g_free(bs_list);
+    return ret;
+}
+
 /*
  * 'Atomic' group snapshots.  The snapshots are taken as a set, and if any fail
  *  then we do not pivot any of the devices in the group, and abandon the
@@ -711,8 +962,11 @@ void qmp_transaction(BlockdevActionList *dev_list, Error **errp)
     QSIMPLEQ_HEAD(snap_bdrv_states, BlkTransactionStates) snap_bdrv_states;
     QSIMPLEQ_INIT(&snap_bdrv_states);
 
-    /* drain all i/o before any snapshots */
-    bdrv_drain_all();
+    /* drain and flush the devices before any snapshots */
+    if (transaction_quiesce(dev_list) < 0) {
+        error_set(errp, QERR_IO_ERROR);
+        return;
+    }
 
     /* We don't do anything in this loop that commits us to the snapshot */
     while (NULL != dev_entry) {
@@ -769,13 +1023,6 @@ void qmp_transaction(BlockdevActionList *dev_list, Error **errp)
             goto delete_and_fail;
         }
 
-        if (!bdrv_is_read_only(states->old_bs)) {
-            if (bdrv_flush(states->old_bs)) {
-                error_set(errp, QERR_IO_ERROR);
-                goto delete_and_fail;
-            }
-        }
-
         flags = states->old_bs->open_flags;
 
         proto_drv = bdrv_find_protocol(new_image_file);
@@ -952,10 +1199,102 @@ void qmp_change_blockdev(const char *device, const char *filename,
     qmp_bdrv_open_encrypted(bs, filename, bdrv_flags, drv, NULL, errp);
 }
 
+#define MAX_LATENCY_BOUNDARIES 64
+
+void qmp_block_latency_histogram_set(const char *device,
+                                     bool has_boundaries,
+                                     const char *boundaries,
+                                     bool has_boundaries_read,
+                                     const char *boundaries_read,
+                                     bool has_boundaries_write,
+                                     const char *boundaries_write,
+                                     bool has_boundaries_flush,
+                                     const char *boundaries_flush,
+                                     Error **errp)
+{
+    const char *type_boundaries[BDRV_MAX_IOTYPE] = {
+        [BDRV_ACCT_READ] = has_boundaries_read ? boundaries_read : NULL,
+        [BDRV_ACCT_WRITE] = has_boundaries_write ? boundaries_write : NULL,
+        [BDRV_ACCT_FLUSH] = has_boundaries_flush ? boundaries_flush : NULL,
+    };
+    static const char *type_names[BDRV_MAX_IOTYPE] = {
+        [BDRV_ACCT_READ] = "boundaries-read",
+        [BDRV_ACCT_WRITE] = "boundaries-write",
+        [BDRV_ACCT_FLUSH] = "boundaries-flush",
+    };
+    uint64_t values[BDRV_MAX_IOTYPE][MAX_LATENCY_BOUNDARIES];
+    int nb_values[BDRV_MAX_IOTYPE];
+    BlockDriverState *bs;
+    int i, j;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    if (!has_boundaries && !has_boundaries_read && !has_boundaries_write &&
+        !has_boundaries_flush) {
+        bdrv_reset_latency_histograms(bs);
+        return;
+    }
+
+    /* check everything before changing anything */
+    for (i = 0; i < BDRV_MAX_IOTYPE; i++) {
+        const char *str = type_boundaries[i];
+        const char *name = type_names[i];
+
+        if (!str) {
+            if (!has_boundaries) {
+                nb_values[i] = -1; /* unchanged */
+                continue;
+            }
+            str = boundaries;
+            name = "boundaries";
+        }
+        nb_values[i] = parse_uint_list(str, values[i],
+                                       MAX_LATENCY_BOUNDARIES);
+        if (nb_values[i] < 0) {
+            error_set(errp, QERR_INVALID_PARAMETER_VALUE, name,
+                      "colon-separated nanoseconds");
+            return;
+        }
+        /* the same checks as bdrv_set_latency_histogram() */
+        if (nb_values[i] && !values[i][0]) {
+            error_set(errp, QERR_INVALID_PARAMETER_VALUE, name,
+                      "boundaries above zero");
+            return;
+        }
+        for (j = 1; j < nb_values[i]; j++) {
+            if (values[i][j] <= values[i][j - 1]) {
+                error_set(errp, QERR_INVALID_PARAMETER_VALUE, name,
+                          "increasing boundaries");
+                return;
+            }
+        }
+    }
+
+    for (i = 0; i < BDRV_MAX_IOTYPE; i++) {
+        if (nb_values[i] >= 0) {
+            bdrv_set_latency_histogram(bs, i, values[i], nb_values[i]);
+        }
+    }
+}
+
 /* throttling disk I/O limits */
 void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
                                int64_t bps_wr, int64_t iops, int64_t iops_rd,
-                               int64_t iops_wr, Error **errp)
+                               int64_t iops_wr,
+                               bool has_bps_max, int64_t bps_max,
+                               bool has_bps_rd_max, int64_t bps_rd_max,
+                               bool has_bps_wr_max, int64_t bps_wr_max,
+                               bool has_iops_max, int64_t iops_max,
+                               bool has_iops_rd_max, int64_t iops_rd_max,
+                               bool has_iops_wr_max, int64_t iops_wr_max,
+                               bool has_burst_length, int64_t burst_length,
+                               bool has_iops_size, int64_t iops_size,
+                               bool has_group, const char *group,
+                               Error **errp)
 {
     BlockIOLimit io_limits;
     BlockDriverState *bs;
@@ -966,29 +1305,78 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
         return;
     }
 
+    memset(&io_limits, 0, sizeof(io_limits));
     io_limits.bps[BLOCK_IO_LIMIT_TOTAL] = bps;
     io_limits.bps[BLOCK_IO_LIMIT_READ]  = bps_rd;
     io_limits.bps[BLOCK_IO_LIMIT_WRITE] = bps_wr;
     io_limits.iops[BLOCK_IO_LIMIT_TOTAL]= iops;
     io_limits.iops[BLOCK_IO_LIMIT_READ] = iops_rd;
     io_limits.iops[BLOCK_IO_LIMIT_WRITE]= iops_wr;
+    io_limits.bps_max[BLOCK_IO_LIMIT_TOTAL]  = has_bps_max ? bps_max : 0;
+    io_limits.bps_max[BLOCK_IO_LIMIT_READ]   = has_bps_rd_max ? bps_rd_max : 0;
+    io_limits.bps_max[BLOCK_IO_LIMIT_WRITE]  = has_bps_wr_max ? bps_wr_max : 0;
+    io_limits.iops_max[BLOCK_IO_LIMIT_TOTAL] = has_iops_max ? iops_max : 0;
+    io_limits.iops_max[BLOCK_IO_LIMIT_READ]  =
+                           has_iops_rd_max ? iops_rd_max : 0;
+    io_limits.iops_max[BLOCK_IO_LIMIT_WRITE] =
+                           has_iops_wr_max ? iops_wr_max : 0;
+    io_limits.burst_length = has_burst_length ? burst_length : 1;
+    io_limits.iops_size = has_iops_size ? iops_size : 0;
+    if (has_group) {
+        if (strlen(group) >= sizeof(io_limits.group)) {
+            error_set(errp, QERR_INVALID_PARAMETER_VALUE, "group",
+                      "a shorter name");
+            return;
+        }
+        pstrcpy(io_limits.group, sizeof(io_limits.group), group);
+    }
 
-    if (!do_check_io_limits(&io_limits)) {
-        error_set(errp, QERR_INVALID_PARAMETER_COMBINATION);
+    if (!do_check_io_limits(&io_limits, errp)) {
         return;
     }
 
-    bs->io_limits = io_limits;
-    bs->slice_time = BLOCK_IO_SLICE_TIME;
+    bdrv_set_io_limits(bs, &io_limits);
+}
 
-    if (!bs->io_limits_enabled && bdrv_io_limits_enabled(bs)) {
-        bdrv_io_limits_enable(bs);
-    } else if (bs->io_limits_enabled && !bdrv_io_limits_enabled(bs)) {
-        bdrv_io_limits_disable(bs);
-    } else {
-        if (bs->block_timer) {
-            qemu_mod_timer(bs->block_timer, qemu_get_clock_ns(vm_clock));
-        }
+void qmp_block_set_cache_size(const char *device,
+                              bool has_l2_cache_size, int64_t l2_cache_size,
+                              bool has_refcount_cache_size,
+                              int64_t refcount_cache_size, Error **errp)
+{
+    BlockDriverState *bs;
+    int ret;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    if (!has_l2_cache_size) {
+        l2_cache_size = bs->l2_cache_size;
+    }
+    if (!has_refcount_cache_size) {
+        refcount_cache_size = bs->refcount_cache_size;
+    }
+    if (l2_cache_size < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "l2-cache-size",
+                  "a positive size");
+        return;
+    }
+    if (refcount_cache_size < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "refcount-cache-size",
+                  "a positive size");
+        return;
+    }
+
+    /* The caches are replaced, so no request may be using them */
+    bdrv_drain_all();
+
+    ret = bdrv_set_cache_size(bs, l2_cache_size, refcount_cache_size);
+    if (ret == -ENOTSUP) {
+        error_set(errp, QERR_NOT_SUPPORTED);
+    } else if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not resize the metadata caches");
     }
 }
 
@@ -1062,7 +1450,7 @@ void qmp_block_resize(const char *device, int64_t size, Error **errp)
     }
 }
 
-static void block_job_cb(void *opaque, int ret)
+void block_job_cb(void *opaque, int ret)
 {
     BlockDriverState *bs = opaque;
     QObject *obj;
@@ -1087,7 +1475,8 @@ static void block_job_cb(void *opaque, int ret)
 }
 
 void qmp_block_stream(const char *device, bool has_base,
-                      const char *base, bool has_speed, int64_t speed,
+                      const char *base, bool has_hint_file,
+                      const char *hint_file, bool has_speed, int64_t speed,
                       bool has_on_error, BlockdevOnError on_error,
                       Error **errp)
 {
@@ -1113,8 +1502,9 @@ void qmp_block_stream(const char *device, bool has_base,
         }
     }
 
-    stream_start(bs, base_bs, base, has_speed ? speed : 0,
-                 on_error, block_job_cb, bs, &local_err);
+    stream_start(bs, base_bs, base, has_hint_file ? hint_file : NULL,
+                 has_speed ? speed : 0, on_error, block_job_cb, bs,
+                 &local_err);
     if (error_is_set(&local_err)) {
         error_propagate(errp, local_err);
         return;
@@ -1128,6 +1518,39 @@ void qmp_block_stream(const char *device, bool has_base,
     trace_qmp_block_stream(bs, bs->job);
 }
 
+void qmp_block_record_reads(const char *device, const char *hint_file,
+                            bool has_duration, int64_t duration,
+                            Error **errp)
+{
+    BlockDriverState *bs;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+    if (has_duration && duration < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER, "duration");
+        return;
+    }
+
+    prefetch_record_start(bs, hint_file,
+                          has_duration ? duration * 1000 : 0, errp);
+}
+
+void qmp_block_record_reads_stop(const char *device, Error **errp)
+{
+    BlockDriverState *bs;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    prefetch_record_stop(bs, errp);
+}
+
 void qmp_block_commit(const char *device,
                       bool has_base, const char *base, const char *top,
                       bool has_speed, int64_t speed,
@@ -1187,6 +1610,8 @@ void qmp_block_commit(const char *device,
     drive_get_ref(drive_get_by_blockdev(bs));
 }
 
+#define DEFAULT_MIRROR_BUF_SIZE   (10 << 20)
+
 void qmp_drive_mirror(const char *device, const char *target,
                       bool has_format, const char *format,
                       enum MirrorSyncMode sync,
@@ -1194,9 +1619,10 @@ void qmp_drive_mirror(const char *device, const char *target,
                       bool has_speed, int64_t speed,
                       bool has_on_source_error, BlockdevOnError on_source_error,
                       bool has_on_target_error, BlockdevOnError on_target_error,
+                      bool has_granularity, uint32_t granularity,
+                      bool has_buf_size, int64_t buf_size,
                       Error **errp)
 {
-    BlockDriverInfo bdi;
     BlockDriverState *bs;
     BlockDriverState *source, *target_bs;
     BlockDriver *proto_drv;
@@ -1218,6 +1644,29 @@ void qmp_drive_mirror(const char *device, const char *target,
     if (!has_mode) {
         mode = NEW_IMAGE_MODE_ABSOLUTE_PATHS;
     }
+    if (!has_granularity) {
+        granularity = 0;
+    }
+    if (!has_buf_size) {
+        buf_size = DEFAULT_MIRROR_BUF_SIZE;
+    }
+
+    if (granularity != 0 && (granularity < 512 || granularity > 1048576 * 64)) {
+        error_set(errp, QERR_INVALID_PARAMETER, "granularity");
+        return;
+    }
+    if (granularity & (granularity - 1)) {
+        error_set(errp, QERR_INVALID_PARAMETER, "granularity");
+        return;
+    }
+    if (buf_size <= 0) {
+        error_set(errp, QERR_INVALID_PARAMETER, "buf-size");
+        return;
+    }
+    if (sync == MIRROR_SYNC_MODE_INCREMENTAL) {
+        error_set(errp, QERR_INVALID_PARAMETER, "sync");
+        return;
+    }
 
     bs = bdrv_find(device);
     if (!bs) {
@@ -1296,18 +1745,136 @@ void qmp_drive_mirror(const char *device, const char *target,
         return;
     }
 
-    /* We need a backing file if we will copy parts of a cluster.  */
-    if (bdrv_get_info(target_bs, &bdi) >= 0 && bdi.cluster_size != 0 &&
-        bdi.cluster_size >= BDRV_SECTORS_PER_DIRTY_CHUNK * 512) {
-        ret = bdrv_open_backing_file(target_bs);
-        if (ret < 0) {
-            bdrv_delete(target_bs);
+    mirror_start(bs, target_bs, speed, granularity, buf_size, sync,
+                 on_source_error, on_target_error,
+                 block_job_cb, bs, &local_err);
+    if (local_err != NULL) {
+        bdrv_delete(target_bs);
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    /* Grab a reference so hotplug does not delete the BlockDriverState from
+     * underneath us.
+     */
+    drive_get_ref(drive_get_by_blockdev(bs));
+}
+
+void qmp_drive_backup(const char *device, const char *target,
+                      bool has_format, const char *format,
+                      enum MirrorSyncMode sync,
+                      bool has_mode, enum NewImageMode mode,
+                      bool has_speed, int64_t speed,
+                      bool has_bitmap, const char *bitmap,
+                      bool has_on_source_error, BlockdevOnError on_source_error,
+                      bool has_on_target_error, BlockdevOnError on_target_error,
+                      Error **errp)
+{
+    BlockDriverState *bs;
+    BlockDriverState *target_bs;
+    BlockDriverState *source = NULL;
+    BdrvDirtyBitmap *sync_bitmap = NULL;
+    BlockDriver *drv = NULL;
+    Error *local_err = NULL;
+    int flags;
+    int64_t size;
+    int ret;
+
+    if (!has_speed) {
+        speed = 0;
+    }
+    if (!has_on_source_error) {
+        on_source_error = BLOCKDEV_ON_ERROR_REPORT;
+    }
+    if (!has_on_target_error) {
+        on_target_error = BLOCKDEV_ON_ERROR_REPORT;
+    }
+    if (!has_mode) {
+        mode = NEW_IMAGE_MODE_ABSOLUTE_PATHS;
+    }
+    if (has_bitmap != (sync == MIRROR_SYNC_MODE_INCREMENTAL)) {
+        error_set(errp, QERR_INVALID_PARAMETER, "bitmap");
+        return;
+    }
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    if (!bdrv_is_inserted(bs)) {
+        error_set(errp, QERR_DEVICE_HAS_NO_MEDIUM, device);
+        return;
+    }
+
+    if (has_bitmap) {
+        sync_bitmap = bdrv_find_dirty_bitmap(bs, bitmap);
+        if (!sync_bitmap) {
+            error_setg(errp, "Dirty bitmap '%s' not found", bitmap);
+            return;
+        }
+    }
+
+    if (!has_format) {
+        format = mode == NEW_IMAGE_MODE_EXISTING ? NULL : bs->drv->format_name;
+    }
+    if (format) {
+        drv = bdrv_find_format(format);
+        if (!drv) {
+            error_set(errp, QERR_INVALID_BLOCK_FORMAT, format);
+            return;
+        }
+    }
+
+    if (bdrv_in_use(bs)) {
+        error_set(errp, QERR_DEVICE_IN_USE, device);
+        return;
+    }
+
+    flags = bs->open_flags | BDRV_O_RDWR;
+
+    /* Only the topmost image is copied for sync=top, so keep the same
+     * backing file for the target */
+    if (sync == MIRROR_SYNC_MODE_TOP) {
+        source = bs->backing_hd;
+        if (!source) {
+            sync = MIRROR_SYNC_MODE_FULL;
+        }
+    }
+
+    size = bdrv_getlength(bs);
+    if (size < 0) {
+        error_set(errp, QERR_IO_ERROR);
+        return;
+    }
+
+    if (mode != NEW_IMAGE_MODE_EXISTING) {
+        assert(format && drv);
+        if (source) {
+            ret = bdrv_img_create(target, format, source->filename,
+                                  source->drv->format_name, NULL,
+                                  size, flags);
+        } else {
+            ret = bdrv_img_create(target, format, NULL, NULL, NULL,
+                                  size, flags);
+        }
+        if (ret) {
             error_set(errp, QERR_OPEN_FILE_FAILED, target);
             return;
         }
     }
 
-    mirror_start(bs, target_bs, speed, sync, on_source_error, on_target_error,
+    target_bs = bdrv_new("");
+    ret = bdrv_open(target_bs, target, flags, drv);
+    if (ret < 0) {
+        bdrv_delete(target_bs);
+        error_set(errp, QERR_OPEN_FILE_FAILED, target);
+        return;
+    }
+
+    backup_start(bs, target_bs, speed, sync, sync_bitmap,
+                 on_source_error, on_target_error,
                  block_job_cb, bs, &local_err);
     if (local_err != NULL) {
         bdrv_delete(target_bs);
@@ -1321,6 +1888,83 @@ void qmp_drive_mirror(const char *device, const char *target,
     drive_get_ref(drive_get_by_blockdev(bs));
 }
 
+void qmp_block_dirty_bitmap_add(const char *device, const char *name,
+                                bool has_granularity, uint32_t granularity,
+                                bool has_persistent, bool persistent,
+                                Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    if (!bdrv_is_inserted(bs)) {
+        error_set(errp, QERR_DEVICE_HAS_NO_MEDIUM, device);
+        return;
+    }
+
+    if (!*name) {
+        error_set(errp, QERR_INVALID_PARAMETER, "name");
+        return;
+    }
+    if (bdrv_find_dirty_bitmap(bs, name)) {
+        error_setg(errp, "Dirty bitmap '%s' already exists", name);
+        return;
+    }
+
+    if (!has_granularity) {
+        BlockDriverInfo bdi;
+
+        granularity = 65536;
+        if (bdrv_get_info(bs, &bdi) >= 0 && bdi.cluster_size > granularity) {
+            granularity = bdi.cluster_size;
+        }
+    }
+    if (granularity < 512 || granularity > 1048576 * 64 ||
+        (granularity & (granularity - 1))) {
+        error_set(errp, QERR_INVALID_PARAMETER, "granularity");
+        return;
+    }
+
+    if (has_persistent && persistent && !bdrv_can_persist_dirty_bitmaps(bs)) {
+        error_set(errp, QERR_BLOCK_FORMAT_FEATURE_NOT_SUPPORTED,
+                  bs->drv->format_name, device, "persistent dirty bitmaps");
+        return;
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, name, granularity);
+    bitmap->persistent = has_persistent && persistent;
+}
+
+void qmp_block_dirty_bitmap_remove(const char *device, const char *name,
+                                   Error **errp)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    bitmap = bdrv_find_dirty_bitmap(bs, name);
+    if (!bitmap) {
+        error_setg(errp, "Dirty bitmap '%s' not found", name);
+        return;
+    }
+    if (bitmap->frozen) {
+        error_setg(errp, "Dirty bitmap '%s' is in use by a block job", name);
+        return;
+    }
+
+    bdrv_release_dirty_bitmap(bs, bitmap);
+}
+
 static BlockJob *find_block_job(const char *device)
 {
     BlockDriverState *bs;
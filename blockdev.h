@@ -52,6 +52,8 @@ QemuOpts *drive_def(const char *optstr);
 QemuOpts *drive_add(BlockInterfaceType type, int index, const char *file,
                     const char *optstr);
 DriveInfo *drive_init(QemuOpts *arg, int default_to_scsi);
+void drive_open_batch_begin(void);
+int drive_open_batch_end(void);
 
 /* device-hotplug */
 
@@ -61,4 +63,10 @@ void qmp_change_blockdev(const char *device, const char *filename,
                          bool has_format, const char *format, Error **errp);
 void do_commit(Monitor *mon, const QDict *qdict);
 int do_drive_del(Monitor *mon, const QDict *qdict, QObject **ret_data);
+
+/* Completion callback of block jobs started on behalf of the monitor;
+ * @opaque is the source BlockDriverState, whose DriveInfo reference
+ * the job holds.
+ */
+void block_job_cb(void *opaque, int ret);
 #endif
@@ -34,19 +34,27 @@
 #include <valgrind/valgrind.h>
 #endif
 
+/* On these hosts switching is done by saving the callee-saved registers on
+ * the stack and exchanging stack pointers, which is much cheaper than
+ * setjmp()/longjmp().  The ucontext functions are not needed at all then.
+ */
+#if defined(__ELF__) && (defined(__x86_64__) || \
+                         (defined(__arm__) && !defined(__thumb__)))
+#define COROUTINE_ASM_SWITCH
+#endif
+
 enum {
-    /* Maximum free pool size prevents holding too many freed coroutines */
-    POOL_MAX_SIZE = 64,
+    COROUTINE_STACK_SIZE = 1 << 20,
 };
 
-/** Free list to speed up creation */
-static QSLIST_HEAD(, Coroutine) pool = QSLIST_HEAD_INITIALIZER(pool);
-static unsigned int pool_size;
-
 typedef struct {
     Coroutine base;
     void *stack;
+#ifdef COROUTINE_ASM_SWITCH
+    void *sp;
+#else
     jmp_buf env;
+#endif
 
 #ifdef CONFIG_VALGRIND_H
     unsigned int valgrind_stack_id;
@@ -96,17 +104,6 @@ static void qemu_coroutine_thread_cleanup(void *opaque)
     g_free(s);
 }
 
-static void __attribute__((destructor)) coroutine_cleanup(void)
-{
-    Coroutine *co;
-    Coroutine *tmp;
-
-    QSLIST_FOREACH_SAFE(co, &pool, pool_next, tmp) {
-        g_free(DO_UPCAST(CoroutineUContext, base, co)->stack);
-        g_free(co);
-    }
-}
-
 static void __attribute__((constructor)) coroutine_init(void)
 {
     int ret;
@@ -118,6 +115,127 @@ static void __attribute__((constructor)) coroutine_init(void)
     }
 }
 
+#ifdef COROUTINE_ASM_SWITCH
+/* coroutine_asm_switch() stores the stack pointer of the current context
+ * in *@save_sp, continues on the stack @sp and returns @action there.
+ * A new coroutine starts in coroutine_asm_start(), which takes the
+ * CoroutineUContext from a callee-saved register of its initial frame.
+ */
+CoroutineAction coroutine_asm_switch(void **save_sp, void *sp,
+                                     CoroutineAction action);
+void coroutine_asm_start(void);
+
+#if defined(__x86_64__)
+asm(".text\n"
+    ".p2align 4\n"
+    ".type coroutine_asm_switch, @function\n"
+    "coroutine_asm_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    movl %edx, %eax\n"
+    "    ret\n"
+    ".size coroutine_asm_switch, .-coroutine_asm_switch\n"
+    ".p2align 4\n"
+    ".type coroutine_asm_start, @function\n"
+    "coroutine_asm_start:\n"
+    "    movq %rbx, %rdi\n"
+    "    call coroutine_asm_entry\n"
+    "    ud2\n"
+    ".size coroutine_asm_start, .-coroutine_asm_start\n");
+
+/* r15, r14, r13, r12, rbx, rbp, return address */
+#define COROUTINE_FRAME_WORDS   7
+#define COROUTINE_FRAME_ARG     4
+#define COROUTINE_FRAME_RET     6
+#elif defined(__arm__)
+#if defined(__VFP_FP__) && !defined(__SOFTFP__)
+#define COROUTINE_VFP_SAVE      "    vpush {d8-d15}\n"
+#define COROUTINE_VFP_RESTORE   "    vpop {d8-d15}\n"
+#define COROUTINE_VFP_WORDS     16
+#else
+#define COROUTINE_VFP_SAVE      ""
+#define COROUTINE_VFP_RESTORE   ""
+#define COROUTINE_VFP_WORDS     0
+#endif
+asm(".text\n"
+    ".syntax unified\n"
+    ".arm\n"
+    ".p2align 2\n"
+    ".type coroutine_asm_switch, %function\n"
+    "coroutine_asm_switch:\n"
+    "    push {r4-r11, lr}\n"
+    COROUTINE_VFP_SAVE
+    "    str sp, [r0]\n"
+    "    mov sp, r1\n"
+    COROUTINE_VFP_RESTORE
+    "    mov r0, r2\n"
+    "    pop {r4-r11, pc}\n"
+    ".size coroutine_asm_switch, .-coroutine_asm_switch\n"
+    ".p2align 2\n"
+    ".type coroutine_asm_start, %function\n"
+    "coroutine_asm_start:\n"
+    "    mov r0, r4\n"
+    "    bl coroutine_asm_entry\n"
+    "    bkpt #0\n"
+    ".size coroutine_asm_start, .-coroutine_asm_start\n");
+
+/* d8-d15, r4-r11, return address */
+#define COROUTINE_FRAME_WORDS   (COROUTINE_VFP_WORDS + 9)
+#define COROUTINE_FRAME_ARG     COROUTINE_VFP_WORDS
+#define COROUTINE_FRAME_RET     (COROUTINE_VFP_WORDS + 8)
+#endif
+
+void __attribute__((used)) coroutine_asm_entry(CoroutineUContext *self);
+
+void __attribute__((used)) coroutine_asm_entry(CoroutineUContext *self)
+{
+    Coroutine *co = &self->base;
+
+    while (true) {
+        co->entry(co->entry_arg);
+        qemu_coroutine_switch(co, co->caller, COROUTINE_TERMINATE);
+    }
+}
+
+static Coroutine *coroutine_new(void)
+{
+    CoroutineUContext *co;
+    uintptr_t *frame;
+    uintptr_t top;
+
+    co = g_malloc0(sizeof(*co));
+    co->stack = qemu_alloc_stack(COROUTINE_STACK_SIZE);
+
+    /* Build the frame that the first coroutine_asm_switch() pops.  The
+     * stack pointer is 16-byte aligned once the return address is gone.
+     */
+    top = ((uintptr_t)co->stack + COROUTINE_STACK_SIZE) & ~(uintptr_t)15;
+    frame = (uintptr_t *)top - COROUTINE_FRAME_WORDS;
+    memset(frame, 0, COROUTINE_FRAME_WORDS * sizeof(*frame));
+    frame[COROUTINE_FRAME_ARG] = (uintptr_t)co;
+    frame[COROUTINE_FRAME_RET] = (uintptr_t)coroutine_asm_start;
+    co->sp = frame;
+
+#ifdef CONFIG_VALGRIND_H
+    co->valgrind_stack_id =
+        VALGRIND_STACK_REGISTER(co->stack, co->stack + COROUTINE_STACK_SIZE);
+#endif
+
+    return &co->base;
+}
+#else
 static void coroutine_trampoline(int i0, int i1)
 {
     union cc_arg arg;
@@ -142,7 +260,6 @@ static void coroutine_trampoline(int i0, int i1)
 
 static Coroutine *coroutine_new(void)
 {
-    const size_t stack_size = 1 << 20;
     CoroutineUContext *co;
     ucontext_t old_uc, uc;
     jmp_buf old_env;
@@ -160,17 +277,17 @@ static Coroutine *coroutine_new(void)
     }
 
     co = g_malloc0(sizeof(*co));
-    co->stack = g_malloc(stack_size);
+    co->stack = qemu_alloc_stack(COROUTINE_STACK_SIZE);
     co->base.entry_arg = &old_env; /* stash away our jmp_buf */
 
     uc.uc_link = &old_uc;
     uc.uc_stack.ss_sp = co->stack;
-    uc.uc_stack.ss_size = stack_size;
+    uc.uc_stack.ss_size = COROUTINE_STACK_SIZE;
     uc.uc_stack.ss_flags = 0;
 
 #ifdef CONFIG_VALGRIND_H
     co->valgrind_stack_id =
-        VALGRIND_STACK_REGISTER(co->stack, co->stack + stack_size);
+        VALGRIND_STACK_REGISTER(co->stack, co->stack + COROUTINE_STACK_SIZE);
 #endif
 
     arg.p = co;
@@ -184,19 +301,11 @@ static Coroutine *coroutine_new(void)
     }
     return &co->base;
 }
+#endif
 
 Coroutine *qemu_coroutine_new(void)
 {
-    Coroutine *co;
-
-    co = QSLIST_FIRST(&pool);
-    if (co) {
-        QSLIST_REMOVE_HEAD(&pool, pool_next);
-        pool_size--;
-    } else {
-        co = coroutine_new();
-    }
-    return co;
+    return coroutine_new();
 }
 
 #ifdef CONFIG_VALGRIND_H
@@ -217,18 +326,11 @@ void qemu_coroutine_delete(Coroutine *co_)
 {
     CoroutineUContext *co = DO_UPCAST(CoroutineUContext, base, co_);
 
-    if (pool_size < POOL_MAX_SIZE) {
-        QSLIST_INSERT_HEAD(&pool, &co->base, pool_next);
-        co->base.caller = NULL;
-        pool_size++;
-        return;
-    }
-
 #ifdef CONFIG_VALGRIND_H
     valgrind_stack_deregister(co);
 #endif
 
-    g_free(co->stack);
+    qemu_free_stack(co->stack, COROUTINE_STACK_SIZE);
     g_free(co);
 }
 
@@ -238,15 +340,21 @@ CoroutineAction qemu_coroutine_switch(Coroutine *from_, Coroutine *to_,
     CoroutineUContext *from = DO_UPCAST(CoroutineUContext, base, from_);
     CoroutineUContext *to = DO_UPCAST(CoroutineUContext, base, to_);
     CoroutineThreadState *s = coroutine_get_thread_state();
+#ifndef COROUTINE_ASM_SWITCH
     int ret;
+#endif
 
     s->current = to_;
 
+#ifdef COROUTINE_ASM_SWITCH
+    return coroutine_asm_switch(&from->sp, to->sp, action);
+#else
     ret = setjmp(from->env);
     if (ret == 0) {
         longjmp(to->env, action);
     }
     return ret;
+#endif
 }
 
 Coroutine *qemu_coroutine_self(void)
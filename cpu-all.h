@@ -479,6 +479,12 @@ extern ram_addr_t ram_size;
 
 /* RAM is pre-allocated and passed into qemu_ram_alloc_from_ptr */
 #define RAM_PREALLOC_MASK   (1 << 0)
+/* RAM is a shared mapping of block->fd */
+#define RAM_SHARED_MASK     (1 << 1)
+/* RAM is advised to KSM */
+#define RAM_MERGEABLE_MASK  (1 << 2)
+/* RAM is advised to be backed by transparent hugepages */
+#define RAM_HUGEPAGE_MASK   (1 << 3)
 
 typedef struct RAMBlock {
     struct MemoryRegion *mr;
@@ -494,7 +500,8 @@ typedef struct RAMBlock {
 } RAMBlock;
 
 typedef struct RAMList {
-    uint8_t *phys_dirty;
+    /* one bitmap per dirty memory client, indexed by ram_addr_t page */
+    unsigned long *dirty_memory[DIRTY_MEMORY_NUM];
     QLIST_HEAD(, RAMBlock) blocks;
 } RAMList;
 extern RAMList ram_list;
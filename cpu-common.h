@@ -33,6 +33,13 @@ typedef uintptr_t ram_addr_t;
 
 /* memory API */
 
+/* Dirty memory clients; each has its own bitmap in ram_list.  */
+#define DIRTY_MEMORY_VGA       0
+#define DIRTY_MEMORY_CODE      1
+#define DIRTY_MEMORY_MIGRATION 2
+#define DIRTY_MEMORY_DUMP      3
+#define DIRTY_MEMORY_NUM       4
+
 typedef void CPUWriteMemoryFunc(void *opaque, hwaddr addr, uint32_t value);
 typedef uint32_t CPUReadMemoryFunc(void *opaque, hwaddr addr);
 
@@ -42,8 +49,17 @@ void *qemu_get_ram_ptr(ram_addr_t addr);
 void qemu_put_ram_ptr(void *addr);
 /* This should not be used by devices.  */
 int qemu_ram_addr_from_host(void *ptr, ram_addr_t *ram_addr);
+int qemu_get_ram_fd(void *ptr, ram_addr_t *offset);
+int qemu_ram_get_fd(ram_addr_t addr);
 ram_addr_t qemu_ram_addr_from_host_nofail(void *ptr);
 void qemu_ram_set_idstr(ram_addr_t addr, const char *name, DeviceState *dev);
+/* Only private anonymous memory can be merged; @merge is ignored otherwise */
+void qemu_ram_set_advice(ram_addr_t addr, bool merge, bool hugepage);
+
+typedef void (RAMBlockIterFunc)(void *host_addr,
+    ram_addr_t offset, ram_addr_t length, void *opaque);
+
+void qemu_ram_foreach_block(RAMBlockIterFunc func, void *opaque);
 
 void cpu_physical_memory_rw(hwaddr addr, uint8_t *buf,
                             int len, int is_write);
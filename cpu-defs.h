@@ -79,6 +79,10 @@ typedef uint64_t target_ulong __attribute__((aligned(TARGET_LONG_ALIGNMENT)));
 #if !defined(CONFIG_USER_ONLY)
 #define CPU_TLB_BITS 8
 #define CPU_TLB_SIZE (1 << CPU_TLB_BITS)
+/* fully associative victim TLB, holding entries evicted from tlb_table */
+#define CPU_VTLB_SIZE 8
+/* number of separately tracked regions mapped by large pages */
+#define CPU_TLB_LARGE_PAGES 4
 
 #if HOST_LONG_BITS == 32 && TARGET_LONG_BITS == 32
 #define CPU_TLB_ENTRY_BITS 4
@@ -86,6 +90,13 @@ typedef uint64_t target_ulong __attribute__((aligned(TARGET_LONG_ALIGNMENT)));
 #define CPU_TLB_ENTRY_BITS 5
 #endif
 
+/* A naturally aligned region mapped by one or more large pages; addr is
+   -1 for unused slots.  */
+typedef struct CPUTLBLargePage {
+    target_ulong addr;
+    target_ulong mask;
+} CPUTLBLargePage;
+
 typedef struct CPUTLBEntry {
     /* bit TARGET_LONG_BITS to TARGET_PAGE_BITS : virtual address
        bit TARGET_PAGE_BITS-1..4  : Nonzero for accesses that should not
@@ -112,8 +123,13 @@ extern int CPUTLBEntry_wrong_size[sizeof(CPUTLBEntry) == (1 << CPU_TLB_ENTRY_BIT
     /* The meaning of the MMU modes is defined in the target code. */   \
     CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
     hwaddr iotlb[NB_MMU_MODES][CPU_TLB_SIZE];               \
-    target_ulong tlb_flush_addr;                                        \
-    target_ulong tlb_flush_mask;
+    CPUTLBLargePage tlb_large_pages[CPU_TLB_LARGE_PAGES];               \
+    CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
+    hwaddr iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];                        \
+    unsigned int vtlb_index;                                            \
+    unsigned int vtlb_hit_count;                                        \
+    /* dispatch snapshot the iotlb entries refer to */                  \
+    struct AddressSpaceDispatch *memory_dispatch;
 
 #else
 
@@ -135,6 +151,7 @@ typedef struct icount_decr_u16 {
 #endif
 
 struct kvm_run;
+struct kvm_dirty_gfn;
 struct KVMState;
 struct qemu_work_item;
 
@@ -208,6 +225,8 @@ typedef struct CPUWatchpoint {
     struct KVMState *kvm_state;                                         \
     struct kvm_run *kvm_run;                                            \
     int kvm_fd;                                                         \
-    int kvm_vcpu_dirty;
+    int kvm_vcpu_dirty;                                                 \
+    struct kvm_dirty_gfn *kvm_dirty_gfns;                               \
+    uint32_t kvm_fetch_index;
 
 #endif
@@ -21,12 +21,31 @@
 #include "disas.h"
 #include "tcg.h"
 #include "qemu-barrier.h"
+#include "qemu-rcu.h"
 #include "qtest.h"
+#if !defined(CONFIG_USER_ONLY)
+#include "main-loop.h"
+#endif
 
 int tb_invalidated_flag;
 
 //#define CONFIG_DEBUG_EXEC
 
+#if defined(CONFIG_USER_ONLY)
+static inline bool qemu_mutex_lock_iothread_vcpu(void)
+{
+    return false;
+}
+
+static inline void qemu_mutex_unlock_iothread_vcpu(bool locked)
+{
+}
+
+static inline void qemu_mutex_reset_iothread_vcpu(void)
+{
+}
+#endif
+
 bool qemu_cpu_has_work(CPUState *cpu)
 {
     return cpu_has_work(cpu);
@@ -64,8 +83,10 @@ static void cpu_exec_nocache(CPUArchState *env, int max_cycles,
     if (max_cycles > CF_COUNT_MASK)
         max_cycles = CF_COUNT_MASK;
 
+    tb_cache_lock();
     tb = tb_gen_code(env, orig_tb->pc, orig_tb->cs_base, orig_tb->flags,
                      max_cycles);
+    tb_cache_unlock();
     env->current_tb = tb;
     /* execute the generated code */
     next_tb = tcg_qemu_tb_exec(env, tb->tc_ptr);
@@ -76,31 +97,27 @@ static void cpu_exec_nocache(CPUArchState *env, int max_cycles,
            the TB starts executing.  */
         cpu_pc_from_tb(env, tb);
     }
+    tb_cache_lock();
     tb_phys_invalidate(tb, -1);
     tb_free(tb);
+    tb_cache_unlock();
 }
 
-static TranslationBlock *tb_find_slow(CPUArchState *env,
-                                      target_ulong pc,
-                                      target_ulong cs_base,
-                                      uint64_t flags)
+/* Walk the physical hash chain.  No lock is needed: chains are
+   published with smp_wmb() and TBs are never freed while a vCPU runs.  */
+static TranslationBlock *tb_find_physical(CPUArchState *env,
+                                          target_ulong pc,
+                                          target_ulong cs_base,
+                                          uint64_t flags,
+                                          tb_page_addr_t phys_pc)
 {
-    TranslationBlock *tb, **ptb1;
-    unsigned int h;
-    tb_page_addr_t phys_pc, phys_page1;
+    TranslationBlock *tb;
+    tb_page_addr_t phys_page1;
     target_ulong virt_page2;
 
-    tb_invalidated_flag = 0;
-
-    /* find translated block using physical mappings */
-    phys_pc = get_page_addr_code(env, pc);
     phys_page1 = phys_pc & TARGET_PAGE_MASK;
-    h = tb_phys_hash_func(phys_pc);
-    ptb1 = &tb_phys_hash[h];
-    for(;;) {
-        tb = *ptb1;
-        if (!tb)
-            goto not_found;
+    tb = tb_phys_hash_first(tb_phys_hash_func(phys_pc, pc, flags));
+    for (; tb != NULL; tb = tb->phys_hash_next) {
         if (tb->pc == pc &&
             tb->page_addr[0] == phys_page1 &&
             tb->cs_base == cs_base &&
@@ -112,24 +129,39 @@ static TranslationBlock *tb_find_slow(CPUArchState *env,
                 virt_page2 = (pc & TARGET_PAGE_MASK) +
                     TARGET_PAGE_SIZE;
                 phys_page2 = get_page_addr_code(env, virt_page2);
-                if (tb->page_addr[1] == phys_page2)
-                    goto found;
+                if (tb->page_addr[1] == phys_page2) {
+                    return tb;
+                }
             } else {
-                goto found;
+                return tb;
             }
         }
-        ptb1 = &tb->phys_hash_next;
     }
- not_found:
-   /* if no translated code available, then translate it now */
-    tb = tb_gen_code(env, pc, cs_base, flags, 0);
-
- found:
-    /* Move the last found TB to the head of the list */
-    if (likely(*ptb1)) {
-        *ptb1 = tb->phys_hash_next;
-        tb->phys_hash_next = tb_phys_hash[h];
-        tb_phys_hash[h] = tb;
+    return NULL;
+}
+
+static TranslationBlock *tb_find_slow(CPUArchState *env,
+                                      target_ulong pc,
+                                      target_ulong cs_base,
+                                      uint64_t flags)
+{
+    TranslationBlock *tb;
+    tb_page_addr_t phys_pc;
+
+    tb_invalidated_flag = 0;
+
+    /* find translated block using physical mappings */
+    phys_pc = get_page_addr_code(env, pc);
+    tb = tb_find_physical(env, pc, cs_base, flags, phys_pc);
+    if (!tb) {
+        tb_cache_lock();
+        /* another vCPU may have translated it in the meantime */
+        tb = tb_find_physical(env, pc, cs_base, flags, phys_pc);
+        if (!tb) {
+            /* if no translated code available, then translate it now */
+            tb = tb_gen_code(env, pc, cs_base, flags, 0);
+        }
+        tb_cache_unlock();
     }
     /* we add the TB in the virtual pc hash table */
     env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
@@ -154,6 +186,35 @@ static inline TranslationBlock *tb_find_fast(CPUArchState *env)
     return tb;
 }
 
+#if defined(TARGET_I386) || defined(TARGET_ARM)
+#include "helper.h"
+
+/* Called by generated code at the end of a TB that ends with an indirect
+   branch.  If the next TB is in the jump cache, return its host code so
+   that execution continues without going through cpu_exec().  Otherwise,
+   or if the loop has to be left for an interrupt, return the epilogue,
+   which behaves as exit_tb(0).  The TB is never translated here.  */
+void *HELPER(lookup_tb_ptr)(CPUArchState *env)
+{
+    TranslationBlock *tb;
+    target_ulong cs_base, pc;
+    int flags;
+
+    if (unlikely(env->interrupt_request || env->exit_request)) {
+        return code_gen_epilogue;
+    }
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    tb = env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+    if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
+                 tb->flags != flags || tb->invalid)) {
+        return code_gen_epilogue;
+    }
+    /* cpu_exit() unchains from current_tb, keep it up to date */
+    env->current_tb = tb;
+    return tb->tc_ptr;
+}
+#endif
+
 static CPUDebugExcpHandler *debug_excp_handler;
 
 void cpu_set_debug_excp_handler(CPUDebugExcpHandler *handler)
@@ -183,6 +244,7 @@ int cpu_exec(CPUArchState *env)
 {
     CPUState *cpu = ENV_GET_CPU(env);
     int ret, interrupt_request;
+    int flush_count = 0, last_flush_count = 0;
     TranslationBlock *tb;
     uint8_t *tc_ptr;
     tcg_target_ulong next_tb;
@@ -196,6 +258,10 @@ int cpu_exec(CPUArchState *env)
     }
 
     cpu_single_env = env;
+#if !defined(CONFIG_USER_ONLY)
+    /* keeps env->memory_dispatch alive while guest code runs */
+    rcu_read_lock();
+#endif
 
     if (unlikely(exit_request)) {
         env->exit_request = 1;
@@ -254,8 +320,11 @@ int cpu_exec(CPUArchState *env)
                     ret = env->exception_index;
                     break;
 #else
+                    bool locked = qemu_mutex_lock_iothread_vcpu();
+
                     do_interrupt(env);
                     env->exception_index = -1;
+                    qemu_mutex_unlock_iothread_vcpu(locked);
 #endif
                 }
             }
@@ -264,6 +333,11 @@ int cpu_exec(CPUArchState *env)
             for(;;) {
                 interrupt_request = env->interrupt_request;
                 if (unlikely(interrupt_request)) {
+                    /* devices update interrupt_request under the global
+                       mutex; multi-threaded TCG vCPUs run without it */
+                    bool locked = qemu_mutex_lock_iothread_vcpu();
+
+                    interrupt_request = env->interrupt_request;
                     if (unlikely(env->singlestep_enabled & SSTEP_NOIRQ)) {
                         /* Mask out external interrupts for this step. */
                         interrupt_request &= ~CPU_INTERRUPT_SSTEP_MASK;
@@ -538,6 +612,7 @@ int cpu_exec(CPUArchState *env)
                            the program flow was changed */
                         next_tb = 0;
                     }
+                    qemu_mutex_unlock_iothread_vcpu(locked);
                 }
                 if (unlikely(env->exit_request)) {
                     env->exit_request = 0;
@@ -563,7 +638,9 @@ int cpu_exec(CPUArchState *env)
 #endif
                 }
 #endif /* DEBUG_DISAS || CONFIG_DEBUG_EXEC */
-                spin_lock(&tb_lock);
+                last_flush_count = flush_count;
+                flush_count = tb_flush_count;
+                smp_rmb();
                 tb = tb_find_fast(env);
                 /* Note: we do it here to avoid a gcc bug on Mac OS X when
                    doing it in tb_find_slow */
@@ -583,9 +660,21 @@ int cpu_exec(CPUArchState *env)
                    spans two pages, we cannot safely do a direct
                    jump. */
                 if (next_tb != 0 && tb->page_addr[1] == -1) {
-                    tb_add_jump((TranslationBlock *)(next_tb & ~3), next_tb & 3, tb);
+                    TranslationBlock *last_tb;
+
+                    /* the lookup was lockless, so either TB may have
+                       been invalidated since, or the code buffer may
+                       have been flushed by another thread; never chain
+                       to those */
+                    tb_cache_lock();
+                    last_tb = (TranslationBlock *)(next_tb & ~3);
+                    if (last_flush_count == tb_flush_count &&
+                        flush_count == tb_flush_count &&
+                        !tb->invalid && !last_tb->invalid) {
+                        tb_add_jump(last_tb, next_tb & 3, tb);
+                    }
+                    tb_cache_unlock();
                 }
-                spin_unlock(&tb_lock);
 
                 /* cpu_interrupt might be called while translating the
                    TB, but before it is linked into a potentially
@@ -597,12 +686,18 @@ int cpu_exec(CPUArchState *env)
                     tc_ptr = tb->tc_ptr;
                     /* execute the generated code */
                     next_tb = tcg_qemu_tb_exec(env, tc_ptr);
+#if !defined(CONFIG_USER_ONLY)
+                    tb_profile_exit(next_tb);
+#endif
                     if ((next_tb & 3) == 2) {
                         /* Instruction counter expired.  */
                         int insns_left;
                         tb = (TranslationBlock *)(next_tb & ~3);
                         /* Restore PC.  */
                         cpu_pc_from_tb(env, tb);
+                        /* Undo the decrement stored by the TB prologue,
+                           the TB did not run.  */
+                        env->icount_decr.u16.low += tb->icount;
                         insns_left = env->icount_decr.u32;
                         if (env->icount_extra && insns_left >= 0) {
                             /* Refill decrementer and continue execution.  */
@@ -633,6 +728,14 @@ int cpu_exec(CPUArchState *env)
             /* Reload env after longjmp - the compiler may have smashed all
              * local variables as longjmp is marked 'noreturn'. */
             env = cpu_single_env;
+            /* a guest exception may leave a locked section early */
+            tb_cache_lock_reset();
+            qemu_mutex_reset_iothread_vcpu();
+#if defined(CONFIG_USER_ONLY)
+            mmap_lock_reset();
+#else
+            rcu_read_lock_reset();
+#endif
         }
     } /* for(;;) */
 
@@ -665,6 +768,9 @@ int cpu_exec(CPUArchState *env)
 #error unsupported target CPU
 #endif
 
+#if !defined(CONFIG_USER_ONLY)
+    rcu_read_unlock();
+#endif
     /* fail safe : never use cpu_single_env outside cpu_exec() */
     cpu_single_env = NULL;
     return ret;
@@ -37,6 +37,9 @@
 #include "qtest.h"
 #include "main-loop.h"
 #include "bitmap.h"
+#include "migration.h"
+#include "qerror.h"
+#include "qemu/seqlock.h"
 
 #ifndef _WIN32
 #include "compatfd.h"
@@ -45,6 +48,8 @@
 #ifdef CONFIG_LINUX
 
 #include <sys/prctl.h>
+#include <sched.h>
+#include <dirent.h>
 
 #ifndef PR_MCE_KILL
 #define PR_MCE_KILL 33
@@ -105,6 +110,8 @@ static QEMUTimer *icount_vm_timer;
 static QEMUTimer *icount_warp_timer;
 static int64_t vm_clock_warp_start;
 static int64_t qemu_icount;
+/* With sleep=off, idle vCPUs jump to the next vm_clock event at once.  */
+static bool icount_sleep = true;
 
 typedef struct TimersState {
     int64_t cpu_ticks_prev;
@@ -116,6 +123,10 @@ typedef struct TimersState {
 
 TimersState timers_state;
 
+/* Lets vCPU threads read vm_clock without the global mutex, which
+   serializes the writers in cpu_enable_ticks and cpu_disable_ticks.  */
+static QemuSeqLock vm_clock_seqlock;
+
 /* Return the virtual CPU time, based on the instruction counter.  */
 int64_t cpu_get_icount(void)
 {
@@ -153,8 +164,7 @@ int64_t cpu_get_ticks(void)
     }
 }
 
-/* return the host CPU monotonic timer and handle stop/restart */
-int64_t cpu_get_clock(void)
+static int64_t cpu_get_clock_locked(void)
 {
     int64_t ti;
     if (!timers_state.cpu_ticks_enabled) {
@@ -165,13 +175,30 @@ int64_t cpu_get_clock(void)
     }
 }
 
+/* return the host CPU monotonic timer and handle stop/restart; safe to
+   call without the global mutex */
+int64_t cpu_get_clock(void)
+{
+    int64_t ti;
+    unsigned start;
+
+    do {
+        start = seqlock_read_begin(&vm_clock_seqlock);
+        ti = cpu_get_clock_locked();
+    } while (seqlock_read_retry(&vm_clock_seqlock, start));
+
+    return ti;
+}
+
 /* enable cpu_get_ticks() */
 void cpu_enable_ticks(void)
 {
     if (!timers_state.cpu_ticks_enabled) {
+        seqlock_write_begin(&vm_clock_seqlock);
         timers_state.cpu_ticks_offset -= cpu_get_real_ticks();
         timers_state.cpu_clock_offset -= get_clock();
         timers_state.cpu_ticks_enabled = 1;
+        seqlock_write_end(&vm_clock_seqlock);
     }
 }
 
@@ -180,9 +207,11 @@ void cpu_enable_ticks(void)
 void cpu_disable_ticks(void)
 {
     if (timers_state.cpu_ticks_enabled) {
+        seqlock_write_begin(&vm_clock_seqlock);
         timers_state.cpu_ticks_offset = cpu_get_ticks();
-        timers_state.cpu_clock_offset = cpu_get_clock();
+        timers_state.cpu_clock_offset = cpu_get_clock_locked();
         timers_state.cpu_ticks_enabled = 0;
+        seqlock_write_end(&vm_clock_seqlock);
     }
 }
 
@@ -314,8 +343,18 @@ void qemu_clock_warp(QEMUClock *clock)
 	return;
     }
 
-    vm_clock_warp_start = qemu_get_clock_ns(rt_clock);
     deadline = qemu_clock_deadline(vm_clock);
+    if (!icount_sleep) {
+        /* Nothing happens in the guest until the next vm_clock event,
+           so advance to it now instead of waiting in real time.  */
+        if (deadline > 0) {
+            qemu_icount_bias += deadline;
+        }
+        qemu_notify_event();
+        return;
+    }
+
+    vm_clock_warp_start = qemu_get_clock_ns(rt_clock);
     if (deadline > 0) {
         /*
          * Ensure the vm_clock proceeds even when the virtual CPU goes to
@@ -354,18 +393,36 @@ static const VMStateDescription vmstate_timers = {
 
 void configure_icount(const char *option)
 {
+    const char *opts;
+
+    seqlock_init(&vm_clock_seqlock);
     vmstate_register(NULL, 0, &vmstate_timers, &timers_state);
     if (!option) {
         return;
     }
 
+    opts = strchr(option, ',');
+    if (opts) {
+        if (strcmp(opts, ",sleep=off") == 0) {
+            icount_sleep = false;
+        } else if (strcmp(opts, ",sleep=on") != 0) {
+            fprintf(stderr, "qemu: invalid -icount option '%s'\n", option);
+            exit(1);
+        }
+    }
+
     icount_warp_timer = qemu_new_timer_ns(rt_clock, icount_warp_rt, NULL);
-    if (strcmp(option, "auto") != 0) {
+    if (strncmp(option, "auto", 4) != 0) {
         icount_time_shift = strtol(option, NULL, 0);
         use_icount = 1;
         return;
     }
 
+    if (!icount_sleep) {
+        fprintf(stderr, "qemu: -icount auto does not support sleep=off\n");
+        exit(1);
+    }
+
     use_icount = 2;
 
     /* 125MIPS seems a reasonable initial guess at the guest speed.
@@ -622,6 +679,46 @@ static QemuThread io_thread;
 static QemuThread *tcg_cpu_thread;
 static QemuCond *tcg_halt_cond;
 
+/*
+ * Multi-threaded TCG (-machine tcg-thread=multi).  Every vCPU gets its
+ * own thread, which executes guest code without the global mutex and
+ * takes it again only around device emulation and interrupt delivery
+ * (qemu_mutex_lock_iothread_vcpu).  The translation cache is protected
+ * by tb_cache_lock.  Work that must not race with any running vCPU,
+ * such as flushing the translation cache or other vCPUs' TLBs, is queued
+ * with async_safe_run_on_cpus and runs once every vCPU thread has left
+ * cpu_exec.
+ */
+bool tcg_multithread;
+#ifdef TARGET_SUPPORTS_MTTCG
+static Error *tcg_migration_blocker;
+#endif
+
+enum {
+    VCPU_LOCK_NONE,             /* not executing guest code unlocked */
+    VCPU_LOCK_RELEASED,         /* in cpu_exec, global mutex released */
+    VCPU_LOCK_TAKEN,            /* in cpu_exec, global mutex taken for I/O */
+};
+static DEFINE_TLS(int, vcpu_lock_state);
+#define vcpu_lock_state tls_var(vcpu_lock_state)
+
+typedef struct SafeWork {
+    void (*func)(void *data);
+    void *data;
+    QSIMPLEQ_ENTRY(SafeWork) next;
+} SafeWork;
+
+/* vCPUs inside cpu_exec; protected by the global mutex */
+static int tcg_running_vcpus;
+/* safe_work may be queued from guest code, hence its own lock */
+static QemuMutex safe_work_lock;
+static QSIMPLEQ_HEAD(, SafeWork) safe_work =
+    QSIMPLEQ_HEAD_INITIALIZER(safe_work);
+
+/* data plane threads and the settings they get from set-thread-sched */
+static QemuMutex iothread_sched_lock;
+static GArray *iothread_tids;
+
 /* cpu creation */
 static QemuCond qemu_cpu_cond;
 /* system init */
@@ -636,6 +733,9 @@ void qemu_init_cpu_loop(void)
     qemu_cond_init(&qemu_work_cond);
     qemu_cond_init(&qemu_io_proceeded_cond);
     qemu_mutex_init(&qemu_global_mutex);
+    qemu_mutex_init(&safe_work_lock);
+    qemu_mutex_init(&iothread_sched_lock);
+    iothread_tids = g_array_new(false, false, sizeof(int));
 
     qemu_thread_get_self(&io_thread);
 }
@@ -686,6 +786,269 @@ static void flush_queued_work(CPUState *cpu)
     qemu_cond_broadcast(&qemu_work_cond);
 }
 
+bool qemu_mutex_lock_iothread_vcpu(void)
+{
+    if (vcpu_lock_state != VCPU_LOCK_RELEASED) {
+        return false;
+    }
+    qemu_mutex_lock(&qemu_global_mutex);
+    vcpu_lock_state = VCPU_LOCK_TAKEN;
+    return true;
+}
+
+void qemu_mutex_unlock_iothread_vcpu(bool locked)
+{
+    if (locked) {
+        vcpu_lock_state = VCPU_LOCK_RELEASED;
+        qemu_mutex_unlock(&qemu_global_mutex);
+    }
+}
+
+void qemu_mutex_release_iothread_vcpu(void)
+{
+    assert(vcpu_lock_state == VCPU_LOCK_NONE);
+    vcpu_lock_state = VCPU_LOCK_RELEASED;
+    qemu_mutex_unlock(&qemu_global_mutex);
+}
+
+void qemu_mutex_acquire_iothread_vcpu(void)
+{
+    assert(vcpu_lock_state == VCPU_LOCK_RELEASED);
+    qemu_mutex_lock(&qemu_global_mutex);
+    vcpu_lock_state = VCPU_LOCK_NONE;
+}
+
+void qemu_mutex_reset_iothread_vcpu(void)
+{
+    qemu_mutex_unlock_iothread_vcpu(vcpu_lock_state == VCPU_LOCK_TAKEN);
+}
+
+static bool safe_work_pending(void)
+{
+    bool pending;
+
+    qemu_mutex_lock(&safe_work_lock);
+    pending = !QSIMPLEQ_EMPTY(&safe_work);
+    qemu_mutex_unlock(&safe_work_lock);
+    return pending;
+}
+
+/* Called with the global mutex held and no vCPU inside cpu_exec.  */
+static void run_safe_work(void)
+{
+    CPUArchState *env;
+    SafeWork *work;
+
+    qemu_mutex_lock(&safe_work_lock);
+    while ((work = QSIMPLEQ_FIRST(&safe_work)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&safe_work, next);
+        qemu_mutex_unlock(&safe_work_lock);
+        work->func(work->data);
+        g_free(work);
+        qemu_mutex_lock(&safe_work_lock);
+    }
+    qemu_mutex_unlock(&safe_work_lock);
+
+    /* let the vCPUs that were held back enter cpu_exec again */
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        qemu_cond_broadcast(ENV_GET_CPU(env)->halt_cond);
+    }
+}
+
+/* Run @func once no vCPU is executing guest code: right away if that is
+   already the case, else from the last vCPU thread leaving cpu_exec.  Call
+   with the global mutex held, or from guest code on a vCPU thread.  */
+void async_safe_run_on_cpus(void (*func)(void *data), void *data)
+{
+    CPUArchState *env;
+    SafeWork *work;
+
+    if (vcpu_lock_state == VCPU_LOCK_NONE && tcg_running_vcpus == 0) {
+        func(data);
+        return;
+    }
+
+    work = g_malloc(sizeof(*work));
+    work->func = func;
+    work->data = data;
+    qemu_mutex_lock(&safe_work_lock);
+    QSIMPLEQ_INSERT_TAIL(&safe_work, work, next);
+    qemu_mutex_unlock(&safe_work_lock);
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        cpu_exit(env);
+    }
+}
+
+/*
+ * vCPU throttling, used by migration auto-converge.  Every timeslice a
+ * rt_clock timer asks each vCPU to sleep for the throttled share of the
+ * period, which it does from its thread with the global mutex dropped.
+ */
+#define CPU_THROTTLE_PCT_MIN 1
+#define CPU_THROTTLE_PCT_MAX 99
+#define CPU_THROTTLE_TIMESLICE_NS 10000000
+
+static QEMUTimer *throttle_timer;
+static int throttle_percentage;
+
+static void cpu_throttle_thread(CPUState *cpu)
+{
+    double pct = throttle_percentage / 100.0;
+    int64_t sleeptime_ns;
+
+    if (!throttle_percentage) {
+        return;
+    }
+
+    sleeptime_ns = (int64_t)(pct / (1 - pct) * CPU_THROTTLE_TIMESLICE_NS);
+    qemu_mutex_unlock(&qemu_global_mutex);
+    g_usleep(sleeptime_ns / 1000);
+    qemu_mutex_lock(&qemu_global_mutex);
+}
+
+static void cpu_throttle_timer_tick(void *opaque)
+{
+    CPUArchState *env;
+    double pct;
+
+    if (!throttle_percentage) {
+        return;
+    }
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        CPUState *cpu = ENV_GET_CPU(env);
+
+        if (!cpu->throttle_pending) {
+            cpu->throttle_pending = true;
+            qemu_cpu_kick(cpu);
+        }
+    }
+
+    pct = throttle_percentage / 100.0;
+    qemu_mod_timer(throttle_timer, qemu_get_clock_ns(rt_clock) +
+                   CPU_THROTTLE_TIMESLICE_NS / (1 - pct));
+}
+
+void cpu_throttle_set(int new_throttle_pct)
+{
+    new_throttle_pct = MIN(new_throttle_pct, CPU_THROTTLE_PCT_MAX);
+    new_throttle_pct = MAX(new_throttle_pct, CPU_THROTTLE_PCT_MIN);
+
+    if (!throttle_timer) {
+        throttle_timer = qemu_new_timer_ns(rt_clock, cpu_throttle_timer_tick,
+                                           NULL);
+    }
+    if (!throttle_percentage) {
+        qemu_mod_timer(throttle_timer, qemu_get_clock_ns(rt_clock) +
+                       CPU_THROTTLE_TIMESLICE_NS);
+    }
+    throttle_percentage = new_throttle_pct;
+}
+
+void cpu_throttle_stop(void)
+{
+    throttle_percentage = 0;
+    if (throttle_timer) {
+        qemu_del_timer(throttle_timer);
+    }
+}
+
+bool cpu_throttle_active(void)
+{
+    return throttle_percentage != 0;
+}
+
+int cpu_throttle_get_percentage(void)
+{
+    return throttle_percentage;
+}
+
+/*
+ * Halt polling (-machine halt-poll-ns=N).  Before a vCPU thread that found
+ * nothing to do sleeps on its halt condition, it drops the global mutex and
+ * spins for a per-vCPU window, so that a wakeup arriving soon after the halt
+ * does not pay for a futex wait and a reschedule.  The window starts at zero,
+ * grows while idle periods end within halt_poll_max_ns and shrinks when
+ * they outlast it, so vCPUs with long idle periods stop burning host CPU.
+ */
+#define HALT_POLL_GROW_START_NS 10000
+
+static int64_t halt_poll_max_ns;
+
+int qemu_halt_poll_configure(int64_t max_ns)
+{
+    if (max_ns < 0) {
+        fprintf(stderr, "qemu: halt-poll-ns must not be negative\n");
+        return -1;
+    }
+    halt_poll_max_ns = max_ns;
+    return 0;
+}
+
+static bool halt_poll_idle(CPUArchState *env)
+{
+    return env ? cpu_thread_is_idle(env) : all_cpu_threads_idle();
+}
+
+/* Poll for @env, or any vCPU of the round-robin TCG thread if @env is NULL,
+   to get work.  Called with the global mutex held.  Returns when the idle
+   period started, or 0 if halt polling does not apply.  */
+static int64_t qemu_halt_poll(CPUState *cpu, CPUArchState *env)
+{
+    int64_t start, now;
+    bool idle;
+
+    if (!halt_poll_max_ns || !runstate_is_running() || !halt_poll_idle(env)) {
+        return 0;
+    }
+
+    start = get_clock();
+    if (!cpu->halt_poll_ns) {
+        return start;
+    }
+
+    cpu->halt_polls++;
+    qemu_mutex_unlock(&qemu_global_mutex);
+    do {
+        /* unlocked reads; the caller checks again with the mutex held */
+        idle = halt_poll_idle(env);
+        now = get_clock();
+    } while (idle && now - start < cpu->halt_poll_ns);
+    qemu_mutex_lock(&qemu_global_mutex);
+
+    if (!idle) {
+        cpu->halt_poll_hits++;
+    }
+    return start;
+}
+
+/* Resize the poll window once the idle period that started at @start has
+   ended.  */
+static void qemu_halt_poll_adjust(CPUState *cpu, int64_t start)
+{
+    int64_t idle_ns;
+
+    if (!start) {
+        return;
+    }
+
+    idle_ns = get_clock() - start;
+    if (idle_ns <= cpu->halt_poll_ns) {
+        return;
+    }
+    if (idle_ns <= halt_poll_max_ns) {
+        /* a longer window would have caught this wakeup */
+        cpu->halt_poll_ns = MIN(MAX(cpu->halt_poll_ns * 2,
+                                    HALT_POLL_GROW_START_NS),
+                                halt_poll_max_ns);
+    } else {
+        cpu->halt_poll_ns /= 2;
+        if (cpu->halt_poll_ns < HALT_POLL_GROW_START_NS) {
+            cpu->halt_poll_ns = 0;
+        }
+    }
+}
+
 static void qemu_wait_io_event_common(CPUState *cpu)
 {
     if (cpu->stop) {
@@ -694,12 +1057,20 @@ static void qemu_wait_io_event_common(CPUState *cpu)
         qemu_cond_signal(&qemu_pause_cond);
     }
     flush_queued_work(cpu);
+    if (cpu->throttle_pending) {
+        cpu->throttle_pending = false;
+        cpu_throttle_thread(cpu);
+    }
     cpu->thread_kicked = false;
 }
 
 static void qemu_tcg_wait_io_event(void)
 {
     CPUArchState *env;
+    int64_t halt_start;
+
+    /* the window and statistics of the shared thread live in the first vCPU */
+    halt_start = qemu_halt_poll(ENV_GET_CPU(first_cpu), NULL);
 
     while (all_cpu_threads_idle()) {
        /* Start accounting real time to the virtual clock if the CPUs
@@ -708,6 +1079,8 @@ static void qemu_tcg_wait_io_event(void)
         qemu_cond_wait(tcg_halt_cond, &qemu_global_mutex);
     }
 
+    qemu_halt_poll_adjust(ENV_GET_CPU(first_cpu), halt_start);
+
     while (iothread_requesting_mutex) {
         qemu_cond_wait(&qemu_io_proceeded_cond, &qemu_global_mutex);
     }
@@ -717,18 +1090,63 @@ static void qemu_tcg_wait_io_event(void)
     }
 }
 
+static void qemu_tcg_vcpu_wait_io_event(CPUArchState *env)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+    int64_t halt_start = qemu_halt_poll(cpu, env);
+
+    while (cpu_thread_is_idle(env) || safe_work_pending()) {
+        qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
+    }
+
+    qemu_halt_poll_adjust(cpu, halt_start);
+    qemu_wait_io_event_common(cpu);
+}
+
 static void qemu_kvm_wait_io_event(CPUArchState *env)
 {
     CPUState *cpu = ENV_GET_CPU(env);
+    int64_t halt_start = qemu_halt_poll(cpu, env);
 
     while (cpu_thread_is_idle(env)) {
         qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
     }
 
+    qemu_halt_poll_adjust(cpu, halt_start);
     qemu_kvm_eat_signals(env);
     qemu_wait_io_event_common(cpu);
 }
 
+/* Pin the calling vCPU thread to the host CPUs given for its NUMA node */
+static void qemu_vcpu_set_host_affinity(CPUArchState *env)
+{
+#ifdef CONFIG_LINUX
+    cpu_set_t set;
+    unsigned long i;
+    int node;
+
+    for (node = 0; node < nb_numa_nodes; node++) {
+        if (test_bit(env->cpu_index, node_cpumask[node])) {
+            break;
+        }
+    }
+    if (node == nb_numa_nodes || !node_host_cpumask[node]) {
+        return;
+    }
+
+    CPU_ZERO(&set);
+    for (i = find_first_bit(node_host_cpumask[node], MAX_HOST_CPUS);
+         i < MAX_HOST_CPUS;
+         i = find_next_bit(node_host_cpumask[node], MAX_HOST_CPUS, i + 1)) {
+        CPU_SET(i, &set);
+    }
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        fprintf(stderr, "Failed to pin vCPU %d to the CPUs of its host node: "
+                "%s\n", env->cpu_index, strerror(errno));
+    }
+#endif
+}
+
 static void *qemu_kvm_cpu_thread_fn(void *arg)
 {
     CPUArchState *env = arg;
@@ -739,6 +1157,7 @@ static void *qemu_kvm_cpu_thread_fn(void *arg)
     qemu_thread_get_self(cpu->thread);
     cpu->thread_id = qemu_get_thread_id();
     cpu_single_env = env;
+    qemu_vcpu_set_host_affinity(env);
 
     r = kvm_init_vcpu(env);
     if (r < 0) {
@@ -754,6 +1173,7 @@ static void *qemu_kvm_cpu_thread_fn(void *arg)
 
     while (1) {
         if (cpu_can_run(cpu)) {
+            qemu_startup_first_insn();
             r = kvm_cpu_exec(env);
             if (r == EXCP_DEBUG) {
                 cpu_handle_guest_debug(env);
@@ -848,6 +1268,53 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
     return NULL;
 }
 
+static int tcg_cpu_exec(CPUArchState *env);
+
+/* Run guest code on a multi-threaded TCG vCPU without the global mutex.  */
+static int tcg_cpu_exec_unlocked(CPUArchState *env)
+{
+    int r;
+
+    tcg_running_vcpus++;
+    qemu_mutex_release_iothread_vcpu();
+
+    r = tcg_cpu_exec(env);
+
+    qemu_mutex_acquire_iothread_vcpu();
+    if (--tcg_running_vcpus == 0 && safe_work_pending()) {
+        run_safe_work();
+    }
+    return r;
+}
+
+static void *qemu_tcg_vcpu_thread_fn(void *arg)
+{
+    CPUArchState *env = arg;
+    CPUState *cpu = ENV_GET_CPU(env);
+    int r;
+
+    qemu_tcg_init_cpu_signals();
+    qemu_thread_get_self(cpu->thread);
+
+    /* signal CPU creation */
+    qemu_mutex_lock(&qemu_global_mutex);
+    cpu->thread_id = qemu_get_thread_id();
+    cpu->created = true;
+    qemu_cond_signal(&qemu_cpu_cond);
+
+    while (1) {
+        if (cpu_can_run(cpu)) {
+            r = tcg_cpu_exec_unlocked(env);
+            if (r == EXCP_DEBUG) {
+                cpu_handle_guest_debug(env);
+            }
+        }
+        qemu_tcg_vcpu_wait_io_event(env);
+    }
+
+    return NULL;
+}
+
 static void qemu_cpu_kick_thread(CPUState *cpu)
 {
 #ifndef _WIN32
@@ -870,7 +1337,16 @@ static void qemu_cpu_kick_thread(CPUState *cpu)
 void qemu_cpu_kick(CPUState *cpu)
 {
     qemu_cond_broadcast(cpu->halt_cond);
-    if (!tcg_enabled() && !cpu->thread_kicked) {
+    if (tcg_enabled() && tcg_multithread) {
+        CPUArchState *env;
+
+        /* the vCPU may be running guest code right now */
+        for (env = first_cpu; env != NULL; env = env->next_cpu) {
+            if (ENV_GET_CPU(env) == cpu) {
+                cpu_exit(env);
+            }
+        }
+    } else if (!tcg_enabled() && !cpu->thread_kicked) {
         qemu_cpu_kick_thread(cpu);
         cpu->thread_kicked = true;
     }
@@ -903,7 +1379,7 @@ static bool qemu_in_vcpu_thread(void)
 
 void qemu_mutex_lock_iothread(void)
 {
-    if (!tcg_enabled()) {
+    if (!tcg_enabled() || tcg_multithread) {
         qemu_mutex_lock(&qemu_global_mutex);
     } else {
         iothread_requesting_mutex = true;
@@ -950,7 +1426,7 @@ void pause_all_vcpus(void)
 
     if (qemu_in_vcpu_thread()) {
         cpu_stop_current();
-        if (!kvm_enabled()) {
+        if (!kvm_enabled() && !tcg_multithread) {
             while (penv) {
                 CPUState *pcpu = ENV_GET_CPU(penv);
                 pcpu->stop = 0;
@@ -971,22 +1447,74 @@ void pause_all_vcpus(void)
     }
 }
 
+void cpu_resume(CPUState *cpu)
+{
+    cpu->stop = false;
+    cpu->stopped = false;
+    qemu_cpu_kick(cpu);
+}
+
 void resume_all_vcpus(void)
 {
     CPUArchState *penv = first_cpu;
 
     qemu_clock_enable(vm_clock, true);
     while (penv) {
-        CPUState *pcpu = ENV_GET_CPU(penv);
-        pcpu->stop = false;
-        pcpu->stopped = false;
-        qemu_cpu_kick(pcpu);
+        cpu_resume(ENV_GET_CPU(penv));
         penv = penv->next_cpu;
     }
 }
 
-static void qemu_tcg_init_vcpu(CPUState *cpu)
+int qemu_tcg_configure_thread(const char *mode)
+{
+    if (!strcmp(mode, "single")) {
+        tcg_multithread = false;
+        return 0;
+    }
+    if (strcmp(mode, "multi")) {
+        fprintf(stderr, "qemu: invalid tcg-thread mode '%s'\n", mode);
+        return -1;
+    }
+    if (!tcg_enabled()) {
+        fprintf(stderr, "qemu: tcg-thread=multi requires the tcg accelerator\n");
+        return -1;
+    }
+    if (use_icount) {
+        fprintf(stderr, "qemu: tcg-thread=multi is not allowed with -icount\n");
+        return -1;
+    }
+#ifndef TARGET_SUPPORTS_MTTCG
+    fprintf(stderr, "qemu: tcg-thread=multi is not supported for this target\n");
+    return -1;
+#else
+    /* vCPUs write guest RAM while the dirty log is being reset */
+    error_set(&tcg_migration_blocker, QERR_MIGRATION_NOT_SUPPORTED,
+              "tcg-thread=multi");
+    migrate_add_blocker(tcg_migration_blocker);
+    tcg_multithread = true;
+    return 0;
+#endif
+}
+
+static void qemu_tcg_init_vcpu(CPUArchState *env)
 {
+    CPUState *cpu = ENV_GET_CPU(env);
+
+    if (tcg_multithread) {
+        cpu->thread = g_malloc0(sizeof(QemuThread));
+        cpu->halt_cond = g_malloc0(sizeof(QemuCond));
+        qemu_cond_init(cpu->halt_cond);
+        qemu_thread_create(cpu->thread, qemu_tcg_vcpu_thread_fn, env,
+                           QEMU_THREAD_JOINABLE);
+#ifdef _WIN32
+        cpu->hThread = qemu_thread_get_handle(cpu->thread);
+#endif
+        while (!cpu->created) {
+            qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        }
+        return;
+    }
+
     /* share a single thread for all cpus with TCG */
     if (!tcg_cpu_thread) {
         cpu->thread = g_malloc0(sizeof(QemuThread));
@@ -1047,7 +1575,7 @@ void qemu_init_vcpu(void *_env)
     if (kvm_enabled()) {
         qemu_kvm_start_vcpu(env);
     } else if (tcg_enabled()) {
-        qemu_tcg_init_vcpu(cpu);
+        qemu_tcg_init_vcpu(env);
     } else {
         qemu_dummy_start_vcpu(env);
     }
@@ -1096,6 +1624,7 @@ static int tcg_cpu_exec(CPUArchState *env)
     int64_t ti;
 #endif
 
+    qemu_startup_first_insn();
 #ifdef CONFIG_PROFILER
     ti = profile_getclock();
 #endif
@@ -1217,6 +1746,14 @@ CpuInfoList *qmp_query_cpus(Error **errp)
         info->value->current = (env == first_cpu);
         info->value->halted = env->halted;
         info->value->thread_id = cpu->thread_id;
+        if (halt_poll_max_ns) {
+            info->value->has_halt_poll_ns = true;
+            info->value->halt_poll_ns = cpu->halt_poll_ns;
+            info->value->has_halt_polls = true;
+            info->value->halt_polls = cpu->halt_polls;
+            info->value->has_halt_poll_hits = true;
+            info->value->halt_poll_hits = cpu->halt_poll_hits;
+        }
 #if defined(TARGET_I386)
         info->value->has_pc = true;
         info->value->pc = env->eip + env->segs[R_CS].base;
@@ -1245,6 +1782,339 @@ CpuInfoList *qmp_query_cpus(Error **errp)
     return head;
 }
 
+/*
+ * Host scheduling of QEMU's threads (set-thread-sched).  vCPU threads are
+ * found through their CPUState, data plane threads register themselves
+ * with qemu_sched_iothread_enter(), and every other thread of the process
+ * is an emulator thread.
+ */
+#ifdef CONFIG_LINUX
+typedef struct HostThreadSched {
+    bool has_host_cpus;
+    DECLARE_BITMAP(host_cpus, MAX_HOST_CPUS);
+    bool has_policy;
+    HostSchedPolicy policy;
+    int priority;
+} HostThreadSched;
+
+static const int host_sched_policy[HOST_SCHED_POLICY_MAX] = {
+    [HOST_SCHED_POLICY_OTHER] = SCHED_OTHER,
+    [HOST_SCHED_POLICY_FIFO] = SCHED_FIFO,
+    [HOST_SCHED_POLICY_RR] = SCHED_RR,
+};
+
+/* protected by iothread_sched_lock */
+static HostThreadSched iothread_sched;
+
+static void host_thread_sched_apply(int tid, const HostThreadSched *ts,
+                                    Error **errp)
+{
+    struct sched_param param;
+    cpu_set_t set;
+    unsigned long i;
+
+    if (ts->has_host_cpus) {
+        CPU_ZERO(&set);
+        for (i = find_first_bit(ts->host_cpus, MAX_HOST_CPUS);
+             i < MAX_HOST_CPUS;
+             i = find_next_bit(ts->host_cpus, MAX_HOST_CPUS, i + 1)) {
+            CPU_SET(i, &set);
+        }
+        if (sched_setaffinity(tid, sizeof(set), &set) < 0) {
+            error_setg_errno(errp, errno, "Cannot set the host CPUs of "
+                             "thread %d", tid);
+            return;
+        }
+    }
+    if (ts->has_policy) {
+        param.sched_priority = ts->priority;
+        if (sched_setscheduler(tid, host_sched_policy[ts->policy],
+                               &param) < 0) {
+            error_setg_errno(errp, errno, "Cannot set the scheduling policy "
+                             "of thread %d", tid);
+        }
+    }
+}
+
+/* Called by a data plane thread when it starts.  */
+void qemu_sched_iothread_enter(void)
+{
+    int tid = qemu_get_thread_id();
+    Error *err = NULL;
+
+    qemu_mutex_lock(&iothread_sched_lock);
+    g_array_append_val(iothread_tids, tid);
+    host_thread_sched_apply(tid, &iothread_sched, &err);
+    qemu_mutex_unlock(&iothread_sched_lock);
+
+    if (err) {
+        fprintf(stderr, "%s\n", error_get_pretty(err));
+        error_free(err);
+    }
+}
+
+/* Called by a data plane thread before it exits.  */
+void qemu_sched_iothread_exit(void)
+{
+    int tid = qemu_get_thread_id();
+    guint i;
+
+    qemu_mutex_lock(&iothread_sched_lock);
+    for (i = 0; i < iothread_tids->len; i++) {
+        if (g_array_index(iothread_tids, int, i) == tid) {
+            g_array_remove_index_fast(iothread_tids, i);
+            break;
+        }
+    }
+    qemu_mutex_unlock(&iothread_sched_lock);
+}
+
+/* Called with iothread_sched_lock held.  */
+static HostThreadClass host_thread_class(int tid, int64_t *cpu_index)
+{
+    CPUArchState *env;
+    guint i;
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        if (ENV_GET_CPU(env)->thread_id == tid) {
+            *cpu_index = env->cpu_index;
+            return HOST_THREAD_CLASS_VCPU;
+        }
+    }
+    for (i = 0; i < iothread_tids->len; i++) {
+        if (g_array_index(iothread_tids, int, i) == tid) {
+            return HOST_THREAD_CLASS_IOTHREAD;
+        }
+    }
+    return HOST_THREAD_CLASS_EMULATOR;
+}
+
+/* Call @func for every thread of the process; stop on an error.  */
+static void host_thread_foreach(void (*func)(int tid, void *opaque,
+                                             Error **errp),
+                                void *opaque, Error **errp)
+{
+    Error *local_err = NULL;
+    struct dirent *de;
+    DIR *dir;
+    char *endptr;
+    int tid;
+
+    dir = opendir("/proc/self/task");
+    if (!dir) {
+        error_setg_errno(errp, errno, "Cannot list the threads of QEMU");
+        return;
+    }
+    while ((de = readdir(dir)) != NULL) {
+        tid = strtol(de->d_name, &endptr, 10);
+        if (*endptr || endptr == de->d_name) {
+            continue;
+        }
+        func(tid, opaque, &local_err);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            break;
+        }
+    }
+    closedir(dir);
+}
+
+static void set_emulator_sched(int tid, void *opaque, Error **errp)
+{
+    int64_t cpu_index;
+
+    if (host_thread_class(tid, &cpu_index) == HOST_THREAD_CLASS_EMULATOR) {
+        host_thread_sched_apply(tid, opaque, errp);
+    }
+}
+
+void qmp_set_thread_sched(HostThreadClass threads, bool has_cpu_index,
+                          int64_t cpu_index, bool has_host_cpus,
+                          const char *host_cpus, bool has_policy,
+                          HostSchedPolicy policy, bool has_priority,
+                          int64_t priority, Error **errp)
+{
+    HostThreadSched ts;
+    CPUArchState *env;
+    Error *local_err = NULL;
+    guint i;
+
+    memset(&ts, 0, sizeof(ts));
+    if (has_cpu_index && threads != HOST_THREAD_CLASS_VCPU) {
+        error_set(errp, QERR_INVALID_PARAMETER, "cpu-index");
+        return;
+    }
+    if (has_host_cpus) {
+        ts.has_host_cpus = true;
+        if (qemu_parse_cpulist(host_cpus, ts.host_cpus, MAX_HOST_CPUS) < 0 ||
+            bitmap_empty(ts.host_cpus, MAX_HOST_CPUS)) {
+            error_set(errp, QERR_INVALID_PARAMETER_VALUE, "host-cpus",
+                      "a list of host CPUs");
+            return;
+        }
+    }
+    if (has_priority && !has_policy) {
+        error_set(errp, QERR_MISSING_PARAMETER, "policy");
+        return;
+    }
+    if (has_policy) {
+        if (!has_priority) {
+            priority = policy == HOST_SCHED_POLICY_OTHER ? 0 : 1;
+        }
+        if (priority < sched_get_priority_min(host_sched_policy[policy]) ||
+            priority > sched_get_priority_max(host_sched_policy[policy])) {
+            error_set(errp, QERR_INVALID_PARAMETER_VALUE, "priority",
+                      policy == HOST_SCHED_POLICY_OTHER ? "0" : "1 to 99");
+            return;
+        }
+        ts.has_policy = true;
+        ts.policy = policy;
+        ts.priority = priority;
+    }
+
+    switch (threads) {
+    case HOST_THREAD_CLASS_VCPU:
+        for (env = first_cpu; env != NULL; env = env->next_cpu) {
+            if (has_cpu_index && env->cpu_index != cpu_index) {
+                continue;
+            }
+            host_thread_sched_apply(ENV_GET_CPU(env)->thread_id, &ts,
+                                    &local_err);
+            if (local_err) {
+                error_propagate(errp, local_err);
+                return;
+            }
+            if (has_cpu_index) {
+                return;
+            }
+        }
+        if (has_cpu_index) {
+            error_set(errp, QERR_INVALID_PARAMETER_VALUE, "cpu-index",
+                      "a CPU number");
+        }
+        break;
+    case HOST_THREAD_CLASS_IOTHREAD:
+        qemu_mutex_lock(&iothread_sched_lock);
+        for (i = 0; i < iothread_tids->len && !local_err; i++) {
+            host_thread_sched_apply(g_array_index(iothread_tids, int, i), &ts,
+                                    &local_err);
+        }
+        if (!local_err) {
+            /* remember the settings for data plane threads started later */
+            if (ts.has_host_cpus) {
+                iothread_sched.has_host_cpus = true;
+                bitmap_copy(iothread_sched.host_cpus, ts.host_cpus,
+                            MAX_HOST_CPUS);
+            }
+            if (ts.has_policy) {
+                iothread_sched.has_policy = true;
+                iothread_sched.policy = ts.policy;
+                iothread_sched.priority = ts.priority;
+            }
+        }
+        qemu_mutex_unlock(&iothread_sched_lock);
+        error_propagate(errp, local_err);
+        break;
+    default:
+        qemu_mutex_lock(&iothread_sched_lock);
+        host_thread_foreach(set_emulator_sched, &ts, errp);
+        qemu_mutex_unlock(&iothread_sched_lock);
+        break;
+    }
+}
+
+static void query_thread_sched(int tid, void *opaque, Error **errp)
+{
+    ThreadSchedInfoList ***tail = opaque;
+    ThreadSchedInfoList *entry;
+    ThreadSchedInfo *info;
+    struct sched_param param;
+    GString *cpus;
+    cpu_set_t set;
+    int policy, i, last;
+
+    if (sched_getaffinity(tid, sizeof(set), &set) < 0 ||
+        (policy = sched_getscheduler(tid)) < 0 ||
+        sched_getparam(tid, &param) < 0) {
+        /* the thread has exited in the meantime */
+        return;
+    }
+
+    cpus = g_string_new("");
+    for (i = 0; i < CPU_SETSIZE; i++) {
+        if (!CPU_ISSET(i, &set)) {
+            continue;
+        }
+        for (last = i; last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &set);
+             last++) {
+        }
+        g_string_append_printf(cpus, cpus->len ? ",%d" : "%d", i);
+        if (last > i) {
+            g_string_append_printf(cpus, "-%d", last);
+        }
+        i = last;
+    }
+
+    info = g_malloc0(sizeof(*info));
+    info->threads = host_thread_class(tid, &info->cpu_index);
+    info->has_cpu_index = info->threads == HOST_THREAD_CLASS_VCPU;
+    info->thread_id = tid;
+    info->host_cpus = g_string_free(cpus, false);
+    info->policy = policy == SCHED_FIFO ? HOST_SCHED_POLICY_FIFO :
+                   policy == SCHED_RR ? HOST_SCHED_POLICY_RR :
+                   HOST_SCHED_POLICY_OTHER;
+    info->priority = param.sched_priority;
+
+    entry = g_malloc0(sizeof(*entry));
+    entry->value = info;
+    **tail = entry;
+    *tail = &entry->next;
+}
+
+ThreadSchedInfoList *qmp_query_thread_sched(Error **errp)
+{
+    ThreadSchedInfoList *head = NULL, **tail = &head;
+
+    qemu_mutex_lock(&iothread_sched_lock);
+    host_thread_foreach(query_thread_sched, &tail, errp);
+    qemu_mutex_unlock(&iothread_sched_lock);
+    return head;
+}
+#else
+void qemu_sched_iothread_enter(void)
+{
+}
+
+void qemu_sched_iothread_exit(void)
+{
+}
+
+void qmp_set_thread_sched(HostThreadClass threads, bool has_cpu_index,
+                          int64_t cpu_index, bool has_host_cpus,
+                          const char *host_cpus, bool has_policy,
+                          HostSchedPolicy policy, bool has_priority,
+                          int64_t priority, Error **errp)
+{
+    error_setg(errp, "Thread scheduling is not supported on this host");
+}
+
+ThreadSchedInfoList *qmp_query_thread_sched(Error **errp)
+{
+    error_setg(errp, "Thread scheduling is not supported on this host");
+    return NULL;
+}
+#endif
+
+void qmp_set_mlock(bool enable, Error **errp)
+{
+    int ret = os_mlock(enable);
+
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Cannot %slock the memory of QEMU",
+                         enable ? "" : "un");
+    }
+}
+
 void qmp_memsave(int64_t addr, int64_t size, const char *filename,
                  bool has_cpu, int64_t cpu_index, Error **errp)
 {
@@ -13,6 +13,17 @@ void cpu_synchronize_all_post_init(void);
 
 void qtest_clock_warp(int64_t dest);
 
+int qemu_tcg_configure_thread(const char *mode);
+int qemu_halt_poll_configure(int64_t max_ns);
+void qemu_sched_iothread_enter(void);
+void qemu_sched_iothread_exit(void);
+void async_safe_run_on_cpus(void (*func)(void *data), void *data);
+
+void cpu_throttle_set(int new_throttle_pct);
+void cpu_throttle_stop(void);
+bool cpu_throttle_active(void);
+int cpu_throttle_get_percentage(void);
+
 /* vl.c */
 extern int smp_cores;
 extern int smp_threads;
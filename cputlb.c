@@ -26,12 +26,14 @@
 #include "cputlb.h"
 
 #include "memory-internal.h"
+#include "qemu-rcu.h"
 
 //#define DEBUG_TLB
 //#define DEBUG_TLB_CHECK
 
 /* statistics */
 int tlb_flush_count;
+int tlb_flush_large_page_count;
 
 static const CPUTLBEntry s_cputlb_empty_entry = {
     .addr_read  = -1,
@@ -70,11 +72,23 @@ void tlb_flush(CPUArchState *env, int flush_global)
             env->tlb_table[mmu_idx][i] = s_cputlb_empty_entry;
         }
     }
+    for (i = 0; i < CPU_VTLB_SIZE; i++) {
+        int mmu_idx;
+
+        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            env->tlb_v_table[mmu_idx][i] = s_cputlb_empty_entry;
+        }
+    }
 
     memset(env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
 
-    env->tlb_flush_addr = -1;
-    env->tlb_flush_mask = 0;
+    /* iotlb entries computed from now on index the current snapshot */
+    env->memory_dispatch = atomic_rcu_read(&address_space_memory.dispatch);
+
+    for (i = 0; i < CPU_TLB_LARGE_PAGES; i++) {
+        env->tlb_large_pages[i].addr = -1;
+        env->tlb_large_pages[i].mask = 0;
+    }
     tlb_flush_count++;
 }
 
@@ -90,6 +104,79 @@ static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
     }
 }
 
+static inline bool tlb_entry_in_range(const CPUTLBEntry *te,
+                                      target_ulong addr, target_ulong mask)
+{
+    return (te->addr_read & mask) == addr ||
+           (te->addr_write & mask) == addr ||
+           (te->addr_code & mask) == addr;
+}
+
+/* Flush the TLB entries of a region mapped by large pages, and stop
+   tracking it.  */
+static void tlb_flush_large_page(CPUArchState *env, CPUTLBLargePage *lp)
+{
+    target_ulong addr = lp->addr, mask = lp->mask;
+    target_ulong pages = (~mask >> TARGET_PAGE_BITS) + 1;
+    int i, mmu_idx;
+
+#if defined(DEBUG_TLB)
+    printf("tlb_flush_page: large page flush (" TARGET_FMT_lx "/"
+           TARGET_FMT_lx ")\n", addr, mask);
+#endif
+    lp->addr = -1;
+    lp->mask = 0;
+
+    /* An entry can only hold a page of the region at its own index, so
+       small regions are flushed page by page.  */
+    if (pages && pages < CPU_TLB_SIZE) {
+        target_ulong page = addr;
+
+        do {
+            i = (page >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+            for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+                tlb_flush_entry(&env->tlb_table[mmu_idx][i], page);
+            }
+            page += TARGET_PAGE_SIZE;
+        } while (--pages);
+    } else {
+        for (i = 0; i < CPU_TLB_SIZE; i++) {
+            for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+                CPUTLBEntry *te = &env->tlb_table[mmu_idx][i];
+
+                if (tlb_entry_in_range(te, addr, mask)) {
+                    *te = s_cputlb_empty_entry;
+                }
+            }
+        }
+    }
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        for (i = 0; i < CPU_VTLB_SIZE; i++) {
+            CPUTLBEntry *te = &env->tlb_v_table[mmu_idx][i];
+
+            if (tlb_entry_in_range(te, addr, mask)) {
+                *te = s_cputlb_empty_entry;
+            }
+        }
+    }
+
+    /* Each page clears its own and the previous page's jump cache
+       entries; beyond that many pages, clear all of them.  */
+    pages = (~mask >> TARGET_PAGE_BITS) + 1;
+    if (pages && pages < TB_JMP_CACHE_SIZE / TB_JMP_PAGE_SIZE) {
+        target_ulong page = addr;
+
+        do {
+            tb_flush_jmp_cache(env, page);
+            page += TARGET_PAGE_SIZE;
+        } while (--pages);
+    } else {
+        memset(env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof(void *));
+    }
+    tlb_flush_large_page_count++;
+}
+
 void tlb_flush_page(CPUArchState *env, target_ulong addr)
 {
     int i;
@@ -98,26 +185,35 @@ void tlb_flush_page(CPUArchState *env, target_ulong addr)
 #if defined(DEBUG_TLB)
     printf("tlb_flush_page: " TARGET_FMT_lx "\n", addr);
 #endif
-    /* Check if we need to flush due to large pages.  */
-    if ((addr & env->tlb_flush_mask) == env->tlb_flush_addr) {
-#if defined(DEBUG_TLB)
-        printf("tlb_flush_page: forced full flush ("
-               TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
-               env->tlb_flush_addr, env->tlb_flush_mask);
-#endif
-        tlb_flush(env, 1);
-        return;
-    }
     /* must reset current TB so that interrupts cannot modify the
        links while we are modifying them */
     env->current_tb = NULL;
 
+    /* Check if we need to flush due to large pages.  */
+    for (i = 0; i < CPU_TLB_LARGE_PAGES; i++) {
+        CPUTLBLargePage *lp = &env->tlb_large_pages[i];
+
+        if (lp->addr != (target_ulong)-1 && (addr & lp->mask) == lp->addr) {
+            tlb_flush_large_page(env, lp);
+            return;
+        }
+    }
+
     addr &= TARGET_PAGE_MASK;
     i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
     }
 
+    /* check whether there are entries that need to be flushed in the vtlb */
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        int k;
+
+        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+            tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
+        }
+    }
+
     tb_flush_jmp_cache(env, addr);
 }
 
@@ -127,7 +223,7 @@ void tlb_protect_code(ram_addr_t ram_addr)
 {
     cpu_physical_memory_reset_dirty(ram_addr,
                                     ram_addr + TARGET_PAGE_SIZE,
-                                    CODE_DIRTY_FLAG);
+                                    DIRTY_MEMORY_CODE);
 }
 
 /* update the TLB so that writes in physical page 'phys_addr' are no longer
@@ -135,7 +231,7 @@ void tlb_protect_code(ram_addr_t ram_addr)
 void tlb_unprotect_code_phys(CPUArchState *env, ram_addr_t ram_addr,
                              target_ulong vaddr)
 {
-    cpu_physical_memory_set_dirty_flags(ram_addr, CODE_DIRTY_FLAG);
+    cpu_physical_memory_set_dirty_flag(ram_addr, DIRTY_MEMORY_CODE);
 }
 
 static bool tlb_is_dirty_ram(CPUTLBEntry *tlbe)
@@ -185,6 +281,10 @@ void cpu_tlb_reset_dirty_all(ram_addr_t start1, ram_addr_t length)
                 tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
                                       start1, length);
             }
+            for (i = 0; i < CPU_VTLB_SIZE; i++) {
+                tlb_reset_dirty_range(&env->tlb_v_table[mmu_idx][i],
+                                      start1, length);
+            }
         }
     }
 }
@@ -208,29 +308,77 @@ void tlb_set_dirty(CPUArchState *env, target_ulong vaddr)
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
     }
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        int k;
+
+        for (k = 0; k < CPU_VTLB_SIZE; k++) {
+            tlb_set_dirty1(&env->tlb_v_table[mmu_idx][k], vaddr);
+        }
+    }
+}
+
+static inline bool tlb_entry_is_empty(const CPUTLBEntry *te)
+{
+    return te->addr_read == -1 && te->addr_write == -1 &&
+           te->addr_code == -1;
+}
+
+static inline bool tlb_entry_is_page(const CPUTLBEntry *te, target_ulong page)
+{
+    return page == (te->addr_read & (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
+           page == (te->addr_write & (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
+           page == (te->addr_code & (TARGET_PAGE_MASK | TLB_INVALID_MASK));
 }
 
-/* Our TLB does not support large pages, so remember the area covered by
-   large pages and trigger a full TLB flush if these are invalidated.  */
+/* Our TLB does not support large pages, so remember the areas covered by
+   large pages and flush all of an area's entries if one of its pages is
+   invalidated.  */
 static void tlb_add_large_page(CPUArchState *env, target_ulong vaddr,
                                target_ulong size)
 {
     target_ulong mask = ~(size - 1);
+    CPUTLBLargePage *lp, *best = NULL;
+    target_ulong best_mask = 0;
+    int i;
 
-    if (env->tlb_flush_addr == (target_ulong)-1) {
-        env->tlb_flush_addr = vaddr & mask;
-        env->tlb_flush_mask = mask;
+    for (i = 0; i < CPU_TLB_LARGE_PAGES; i++) {
+        lp = &env->tlb_large_pages[i];
+        if (lp->addr == (target_ulong)-1) {
+            if (!best) {
+                best = lp;
+            }
+            continue;
+        }
+        if ((vaddr & lp->mask) == lp->addr && (lp->mask & ~mask) == 0) {
+            /* already covered */
+            return;
+        }
+    }
+    if (best) {
+        best->addr = vaddr & mask;
+        best->mask = mask;
         return;
     }
-    /* Extend the existing region to include the new page.
-       This is a compromise between unnecessary flushes and the cost
-       of maintaining a full variable size TLB.  */
-    mask &= env->tlb_flush_mask;
-    while (((env->tlb_flush_addr ^ vaddr) & mask) != 0) {
-        mask <<= 1;
+
+    /* All slots are in use: extend the area that grows the least to
+       include the new page.  This is a compromise between unnecessary
+       flushes and the cost of maintaining a full variable size TLB.  */
+    for (i = 0; i < CPU_TLB_LARGE_PAGES; i++) {
+        target_ulong m;
+
+        lp = &env->tlb_large_pages[i];
+        m = mask & lp->mask;
+        while (((lp->addr ^ vaddr) & m) != 0) {
+            m <<= 1;
+        }
+        if (!best || m > best_mask) {
+            best = lp;
+            best_mask = m;
+        }
     }
-    env->tlb_flush_addr &= mask;
-    env->tlb_flush_mask = mask;
+    best->addr &= best_mask;
+    best->mask = best_mask;
 }
 
 /* Add a new TLB entry. At most one entry for a given virtual address
@@ -241,7 +389,7 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
                   int mmu_idx, target_ulong size)
 {
     MemoryRegionSection *section;
-    unsigned int index;
+    unsigned int index, i;
     target_ulong address;
     target_ulong code_address;
     uintptr_t addend;
@@ -252,7 +400,7 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
     if (size != TARGET_PAGE_SIZE) {
         tlb_add_large_page(env, vaddr, size);
     }
-    section = phys_page_find(address_space_memory.dispatch, paddr >> TARGET_PAGE_BITS);
+    section = phys_page_find(env->memory_dispatch, paddr >> TARGET_PAGE_BITS);
 #if defined(DEBUG_TLB)
     printf("tlb_set_page: vaddr=" TARGET_FMT_lx " paddr=0x" TARGET_FMT_plx
            " prot=%x idx=%d pd=0x%08lx\n",
@@ -278,8 +426,24 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
                                             &address);
 
     index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te = &env->tlb_table[mmu_idx][index];
+
+    /* a stale copy of this page in the victim tlb would shadow the new
+       entry once it is evicted again */
+    for (i = 0; i < CPU_VTLB_SIZE; i++) {
+        tlb_flush_entry(&env->tlb_v_table[mmu_idx][i], vaddr & TARGET_PAGE_MASK);
+    }
+
+    /* do not discard the translation in te, evict it into a victim tlb */
+    if (!tlb_entry_is_empty(te) &&
+        !tlb_entry_is_page(te, vaddr & TARGET_PAGE_MASK)) {
+        unsigned vidx = env->vtlb_index++ % CPU_VTLB_SIZE;
+
+        env->tlb_v_table[mmu_idx][vidx] = *te;
+        env->iotlb_v[mmu_idx][vidx] = env->iotlb[mmu_idx][index];
+    }
+
+    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te->addend = addend - vaddr;
     if (prot & PAGE_READ) {
         te->addr_read = address;
@@ -310,6 +474,46 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
     }
 }
 
+/* Called on a tlb_table miss before resorting to tlb_fill().  If the victim
+   tlb has a translation for addr, swap it with the conflicting entry of
+   the direct-mapped table and return true.  access_type is as for
+   tlb_fill().  */
+bool tlb_victim_lookup(CPUArchState *env, target_ulong addr, int access_type,
+                       int mmu_idx)
+{
+    unsigned int index, vidx;
+    target_ulong page = addr & TARGET_PAGE_MASK;
+
+    index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    for (vidx = 0; vidx < CPU_VTLB_SIZE; vidx++) {
+        CPUTLBEntry *vte = &env->tlb_v_table[mmu_idx][vidx];
+        target_ulong cmp;
+
+        if (access_type == 0) {
+            cmp = vte->addr_read;
+        } else if (access_type == 1) {
+            cmp = vte->addr_write;
+        } else {
+            cmp = vte->addr_code;
+        }
+        if ((cmp & (TARGET_PAGE_MASK | TLB_INVALID_MASK)) == page) {
+            CPUTLBEntry *te = &env->tlb_table[mmu_idx][index];
+            CPUTLBEntry tmptlb;
+            hwaddr tmpiotlb;
+
+            tmptlb = *te;
+            *te = *vte;
+            *vte = tmptlb;
+            tmpiotlb = env->iotlb[mmu_idx][index];
+            env->iotlb[mmu_idx][index] = env->iotlb_v[mmu_idx][vidx];
+            env->iotlb_v[mmu_idx][vidx] = tmpiotlb;
+            env->vtlb_hit_count++;
+            return true;
+        }
+    }
+    return false;
+}
+
 /* NOTE: this function can trigger an exception */
 /* NOTE2: the returned address is not exactly the physical address: it
  * is actually a ram_addr_t (in system mode; the user mode emulation
@@ -328,7 +532,7 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
         cpu_ldub_code(env1, addr);
     }
     pd = env1->iotlb[mmu_idx][page_index] & ~TARGET_PAGE_MASK;
-    mr = iotlb_to_region(pd);
+    mr = iotlb_to_region(env1, pd);
     if (memory_region_is_unassigned(mr)) {
 #if defined(TARGET_ALPHA) || defined(TARGET_MIPS) || defined(TARGET_SPARC)
         cpu_unassigned_access(env1, addr, 0, 1, 0, 4);
@@ -27,6 +27,7 @@
 
 #include "qemu_socket.h"
 #include "iov.h"
+#include "bitops.h"
 
 void strpadcpy(char *buf, int buf_size, const char *str, char pad)
 {
@@ -145,10 +146,11 @@ int qemu_fdatasync(int fd)
 /*
  * Checks if a buffer is all zeroes
  *
- * Attention! The len must be a multiple of 4 * sizeof(long) due to
- * restriction of optimizations in this function.
+ * The long-sized loop below is the fallback; hosts with vector units
+ * scan 64 or 128 bytes per iteration, and the AVX2 variant is picked at
+ * startup if the CPU and the OS support it.
  */
-bool buffer_is_zero(const void *buf, size_t len)
+static bool buffer_is_zero_generic(const void *buf, size_t len)
 {
     /*
      * Use long as the biggest available internal data type that fits into the
@@ -160,7 +162,6 @@ bool buffer_is_zero(const void *buf, size_t len)
     long d0, d1, d2, d3;
     const long * const data = buf;
 
-    assert(len % (4 * sizeof(long)) == 0);
     len /= sizeof(long);
 
     for (i = 0; i < len; i += 4) {
@@ -177,6 +178,117 @@ bool buffer_is_zero(const void *buf, size_t len)
     return true;
 }
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+static bool buffer_is_zero_vector(const void *buf, size_t len)
+{
+    const __m128i *p = buf;
+    const __m128i zero = _mm_setzero_si128();
+    __m128i t;
+    size_t i;
+
+    for (i = 0; i + 64 <= len; i += 64, p += 4) {
+        t = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(p),
+                                      _mm_loadu_si128(p + 1)),
+                         _mm_or_si128(_mm_loadu_si128(p + 2),
+                                      _mm_loadu_si128(p + 3)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(t, zero)) != 0xFFFF) {
+            return false;
+        }
+    }
+    return buffer_is_zero_generic((const char *)buf + i, len - i);
+}
+#elif defined(__ARM_NEON__) || defined(__aarch64__)
+#include <arm_neon.h>
+
+static bool buffer_is_zero_vector(const void *buf, size_t len)
+{
+    const uint64_t *p = buf;
+    uint64x2_t t;
+    size_t i;
+
+    for (i = 0; i + 64 <= len; i += 64, p += 8) {
+        t = vorrq_u64(vorrq_u64(vld1q_u64(p), vld1q_u64(p + 2)),
+                      vorrq_u64(vld1q_u64(p + 4), vld1q_u64(p + 6)));
+        if (vgetq_lane_u64(t, 0) | vgetq_lane_u64(t, 1)) {
+            return false;
+        }
+    }
+    return buffer_is_zero_generic((const char *)buf + i, len - i);
+}
+#else
+#define buffer_is_zero_vector buffer_is_zero_generic
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <cpuid.h>
+#include <immintrin.h>
+
+static bool buffer_is_zero_avx2(const void *buf, size_t len)
+{
+    const __m256i *p = buf;
+    __m256i t;
+    size_t i;
+
+    for (i = 0; i + 128 <= len; i += 128, p += 4) {
+        t = _mm256_or_si256(_mm256_or_si256(_mm256_loadu_si256(p),
+                                            _mm256_loadu_si256(p + 1)),
+                            _mm256_or_si256(_mm256_loadu_si256(p + 2),
+                                            _mm256_loadu_si256(p + 3)));
+        if (!_mm256_testz_si256(t, t)) {
+            return false;
+        }
+    }
+    return buffer_is_zero_vector((const char *)buf + i, len - i);
+}
+#pragma GCC pop_options
+
+static bool avx2_usable(void)
+{
+    unsigned int eax, ebx, ecx, edx, xcr0_lo, xcr0_hi;
+
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return false;
+    }
+    __cpuid(1, eax, ebx, ecx, edx);
+    /* the OS must save the YMM registers on context switches */
+    if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX)) {
+        return false;
+    }
+    asm("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+    if ((xcr0_lo & 6) != 6) {
+        return false;
+    }
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return ebx & bit_AVX2;
+}
+#endif
+
+static bool (*buffer_is_zero_accel)(const void *buf, size_t len) =
+    buffer_is_zero_vector;
+
+static void __attribute__((constructor)) buffer_is_zero_init(void)
+{
+#ifdef CONFIG_AVX2_OPT
+    if (avx2_usable()) {
+        buffer_is_zero_accel = buffer_is_zero_avx2;
+    }
+#endif
+}
+
+/*
+ * Attention! The len must be a multiple of 4 * sizeof(long) due to
+ * restriction of optimizations in this function.
+ */
+bool buffer_is_zero(const void *buf, size_t len)
+{
+    assert(len % (4 * sizeof(long)) == 0);
+    return buffer_is_zero_accel(buf, len);
+}
+
 #ifndef _WIN32
 /* Sets a specific flag */
 int fcntl_setfl(int fd, int flag)
@@ -280,6 +392,45 @@ int qemu_parse_fd(const char *param)
     return fd;
 }
 
+/*
+ * Parse a CPU list such as "0-3,8,10-11" (as found in sysfs; a trailing
+ * newline ends the list) and set the listed CPUs in the bitmap @cpus.
+ * CPUs at or above @nbits are ignored.  Returns 0 on success, -1 on a
+ * malformed list.
+ */
+int qemu_parse_cpulist(const char *str, unsigned long *cpus,
+                       unsigned long nbits)
+{
+    const char *p = str;
+    char *endptr;
+    unsigned long first, last;
+
+    while (*p && *p != '\n') {
+        first = last = strtoul(p, &endptr, 10);
+        if (endptr == p) {
+            return -1;
+        }
+        if (*endptr == '-') {
+            p = endptr + 1;
+            last = strtoul(p, &endptr, 10);
+            if (endptr == p) {
+                return -1;
+            }
+        }
+        if (*endptr && *endptr != ',' && *endptr != '\n') {
+            return -1;
+        }
+        if (last >= nbits) {
+            last = nbits - 1;
+        }
+        for (; first <= last; first++) {
+            set_bit(first, cpus);
+        }
+        p = *endptr == ',' ? endptr + 1 : endptr;
+    }
+    return 0;
+}
+
 /* round down to the nearest power of 2*/
 int64_t pow2floor(int64_t value)
 {
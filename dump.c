@@ -12,6 +12,13 @@
  */
 
 #include "qemu-common.h"
+#include <zlib.h>
+#ifdef CONFIG_LZO
+#include <lzo/lzo1x.h>
+#endif
+#ifdef CONFIG_SNAPPY
+#include <snappy-c.h>
+#endif
 #include "elf.h"
 #include "cpu.h"
 #include "cpu-all.h"
@@ -24,6 +31,20 @@
 #include "error.h"
 #include "qmp-commands.h"
 #include "gdbstub.h"
+#include "qemu-thread.h"
+#include "main-loop.h"
+#include "bitmap.h"
+#include "exec-memory.h"
+#include "migration.h"
+
+/* kdump-compressed format: pages are compressed in batches on worker threads */
+#define DUMP_COMPRESS_THREADS   4
+#define DUMP_BATCH_PAGES        256
+#define DUMP_CACHE_SIZE         (64 * TARGET_PAGE_SIZE)
+
+/* live dump: stop the guest after this many passes, or when little is left */
+#define DUMP_LIVE_MAX_PASSES    10
+#define DUMP_LIVE_MAX_DIRTY     (32 * 1024 * 1024)
 
 static uint16_t cpu_convert_to_target16(uint16_t val, int endian)
 {
@@ -58,6 +79,22 @@ static uint64_t cpu_convert_to_target64(uint64_t val, int endian)
     return val;
 }
 
+typedef struct DumpPage {
+    uint8_t *src;           /* guest page */
+    uint8_t *buf;           /* compressed data */
+    size_t len;             /* size of the data to write, 0 for a zero page */
+    bool compressed;        /* buf holds the data, not src */
+} DumpPage;
+
+typedef struct DumpCompressWorker {
+    QemuThread thread;
+    struct DumpState *s;
+    int index;
+#ifdef CONFIG_LZO
+    lzo_bytep wrkmem;
+#endif
+} DumpCompressWorker;
+
 typedef struct DumpState {
     ArchDumpInfo dump_info;
     MemoryMappingList list;
@@ -75,8 +112,46 @@ typedef struct DumpState {
     int64_t begin;
     int64_t length;
     Error **errp;
+
+    /* kdump-compressed format */
+    uint32_t flag_compress;     /* DUMP_DH_COMPRESSED_*, 0 for elf */
+    bool flat;                  /* write makedumpfile's flattened format */
+    int nr_cpus;
+    uint64_t max_mapnr;         /* highest page frame number + 1 */
+    uint64_t num_dumpable;      /* number of pages in the dump */
+    size_t len_dump_bitmap;     /* size of each of the two bitmaps */
+    off_t offset_dump_bitmap;
+    off_t offset_page;          /* page descriptors, followed by the data */
+    uint8_t *note_buf;
+    size_t note_buf_offset;
+
+    /* compression workers, see dump_compress_batch() */
+    DumpCompressWorker *workers;
+    DumpPage *pages;
+    int nr_pages;
+    size_t compress_bound;
+    QemuMutex compress_lock;
+    QemuCond compress_cond;
+    QemuCond compress_done_cond;
+    unsigned int compress_seq;
+    int compress_done;
+    bool compress_quit;
+
+    off_t offset_note;
+
+    /* live dump */
+    QemuThread thread;
+    unsigned long *dirty_bitmap;
+    bool dirty_log;
 } DumpState;
 
+/* Progress of the last live dump, for query-dump */
+static DumpStatus live_dump_status = DUMP_STATUS_NONE;
+static int64_t live_dump_completed;
+static int64_t live_dump_total;
+
+static void dump_compress_threads_join(DumpState *s);
+
 static int dump_cleanup(DumpState *s)
 {
     int ret = 0;
@@ -84,9 +159,20 @@ static int dump_cleanup(DumpState *s)
     memory_mapping_list_free(&s->list);
     if (s->fd != -1) {
         close(s->fd);
+        s->fd = -1;
+    }
+    dump_compress_threads_join(s);
+    g_free(s->note_buf);
+    s->note_buf = NULL;
+    if (s->dirty_log) {
+        memory_global_dirty_log_stop();
+        s->dirty_log = false;
     }
+    g_free(s->dirty_bitmap);
+    s->dirty_bitmap = NULL;
     if (s->resume) {
         vm_start();
+        s->resume = false;
     }
 
     return ret;
@@ -268,7 +354,7 @@ static int write_elf64_note(DumpState *s)
     return 0;
 }
 
-static int write_elf64_notes(DumpState *s)
+static int write_elf64_notes(write_core_dump_function f, DumpState *s)
 {
     CPUArchState *env;
     int ret;
@@ -276,7 +362,7 @@ static int write_elf64_notes(DumpState *s)
 
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
         id = cpu_index(env);
-        ret = cpu_write_elf64_note(fd_write_vmcore, env, id, s);
+        ret = cpu_write_elf64_note(f, env, id, s);
         if (ret < 0) {
             dump_error(s, "dump: failed to write elf notes.\n");
             return -1;
@@ -284,7 +370,7 @@ static int write_elf64_notes(DumpState *s)
     }
 
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
-        ret = cpu_write_elf64_qemunote(fd_write_vmcore, env, s);
+        ret = cpu_write_elf64_qemunote(f, env, s);
         if (ret < 0) {
             dump_error(s, "dump: failed to write CPU status.\n");
             return -1;
@@ -318,7 +404,7 @@ static int write_elf32_note(DumpState *s)
     return 0;
 }
 
-static int write_elf32_notes(DumpState *s)
+static int write_elf32_notes(write_core_dump_function f, DumpState *s)
 {
     CPUArchState *env;
     int ret;
@@ -326,7 +412,7 @@ static int write_elf32_notes(DumpState *s)
 
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
         id = cpu_index(env);
-        ret = cpu_write_elf32_note(fd_write_vmcore, env, id, s);
+        ret = cpu_write_elf32_note(f, env, id, s);
         if (ret < 0) {
             dump_error(s, "dump: failed to write elf notes.\n");
             return -1;
@@ -334,7 +420,7 @@ static int write_elf32_notes(DumpState *s)
     }
 
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
-        ret = cpu_write_elf32_qemunote(fd_write_vmcore, env, s);
+        ret = cpu_write_elf32_qemunote(f, env, s);
         if (ret < 0) {
             dump_error(s, "dump: failed to write CPU status.\n");
             return -1;
@@ -387,24 +473,16 @@ static int write_data(DumpState *s, void *buf, int length)
     return 0;
 }
 
-/* write the memroy to vmcore. 1 page per I/O. */
+/* write the memroy to vmcore. DUMP_BATCH_PAGES pages per I/O. */
 static int write_memory(DumpState *s, RAMBlock *block, ram_addr_t start,
                         int64_t size)
 {
-    int64_t i;
+    int64_t i, len;
     int ret;
 
-    for (i = 0; i < size / TARGET_PAGE_SIZE; i++) {
-        ret = write_data(s, block->host + start + i * TARGET_PAGE_SIZE,
-                         TARGET_PAGE_SIZE);
-        if (ret < 0) {
-            return ret;
-        }
-    }
-
-    if ((size % TARGET_PAGE_SIZE) != 0) {
-        ret = write_data(s, block->host + start + i * TARGET_PAGE_SIZE,
-                         size % TARGET_PAGE_SIZE);
+    for (i = 0; i < size; i += len) {
+        len = MIN(size - i, DUMP_BATCH_PAGES * TARGET_PAGE_SIZE);
+        ret = write_data(s, block->host + start + i, len);
         if (ret < 0) {
             return ret;
         }
@@ -553,7 +631,7 @@ static int dump_begin(DumpState *s)
         }
 
         /* write notes to vmcore */
-        if (write_elf64_notes(s) < 0) {
+        if (write_elf64_notes(fd_write_vmcore, s) < 0) {
             return -1;
         }
 
@@ -576,7 +654,7 @@ static int dump_begin(DumpState *s)
         }
 
         /* write notes to vmcore */
-        if (write_elf32_notes(s) < 0) {
+        if (write_elf32_notes(fd_write_vmcore, s) < 0) {
             return -1;
         }
     }
@@ -665,6 +743,797 @@ static int create_vmcore(DumpState *s)
     return 0;
 }
 
+static int buf_write_note(void *buf, size_t size, void *opaque)
+{
+    DumpState *s = opaque;
+
+    if (s->note_buf_offset + size > s->note_size) {
+        return -1;
+    }
+
+    memcpy(s->note_buf + s->note_buf_offset, buf, size);
+    s->note_buf_offset += size;
+
+    return 0;
+}
+
+/* write to vmcore at offset, as a record of the flattened format if needed */
+static int write_buffer(DumpState *s, off_t offset, const void *buf,
+                        size_t size)
+{
+    MakedumpfileDataHeader mdh;
+
+    if (s->flat) {
+        mdh.offset = cpu_to_be64(offset);
+        mdh.buf_size = cpu_to_be64(size);
+        if (qemu_write_full(s->fd, &mdh, sizeof(mdh)) != sizeof(mdh)) {
+            return -1;
+        }
+    } else if (lseek(s->fd, offset, SEEK_SET) != offset) {
+        return -1;
+    }
+
+    if (qemu_write_full(s->fd, buf, size) != size) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int write_start_flat_header(DumpState *s)
+{
+    MakedumpfileHeader *mh;
+    int ret = 0;
+
+    /* the header is padded to MAX_SIZE_MDF_HEADER bytes */
+    mh = g_malloc0(MAX_SIZE_MDF_HEADER);
+    memcpy(mh->signature, MAKEDUMPFILE_SIGNATURE,
+           strlen(MAKEDUMPFILE_SIGNATURE));
+    mh->type = cpu_to_be64(TYPE_FLAT_HEADER);
+    mh->version = cpu_to_be64(VERSION_FLAT_HEADER);
+
+    if (qemu_write_full(s->fd, mh, MAX_SIZE_MDF_HEADER) !=
+        MAX_SIZE_MDF_HEADER) {
+        ret = -1;
+    }
+
+    g_free(mh);
+    return ret;
+}
+
+static int write_end_flat_header(DumpState *s)
+{
+    MakedumpfileDataHeader mdh;
+
+    mdh.offset = END_FLAG_FLAT_HEADER;
+    mdh.buf_size = END_FLAG_FLAT_HEADER;
+
+    if (qemu_write_full(s->fd, &mdh, sizeof(mdh)) != sizeof(mdh)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* write the sub header's notes, at s->offset_note */
+static int write_dump_notes(DumpState *s)
+{
+    int ret;
+
+    s->note_buf = g_malloc0(s->note_size);
+    s->note_buf_offset = 0;
+
+    if (s->dump_info.d_class == ELFCLASS64) {
+        ret = write_elf64_notes(buf_write_note, s);
+    } else {
+        ret = write_elf32_notes(buf_write_note, s);
+    }
+    if (ret < 0) {
+        return -1;
+    }
+
+    if (write_buffer(s, s->offset_note, s->note_buf, s->note_size) < 0) {
+        dump_error(s, "dump: failed to write notes.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void get_utsname_machine(DumpState *s, NewUtsname *utsname)
+{
+    const char *machine = "";
+
+    if (s->dump_info.d_machine == EM_X86_64) {
+        machine = "x86_64";
+    } else if (s->dump_info.d_machine == EM_386) {
+        machine = "i686";
+    }
+    pstrcpy(utsname->machine, sizeof(utsname->machine), machine);
+}
+
+static int write_dump_header32(DumpState *s)
+{
+    DiskDumpHeader32 dh;
+    KdumpSubHeader32 kh;
+    int endian = s->dump_info.d_endian;
+    uint32_t block_size = TARGET_PAGE_SIZE;
+
+    memset(&dh, 0, sizeof(dh));
+    memcpy(dh.signature, KDUMP_SIGNATURE, SIG_LEN);
+    dh.header_version = cpu_convert_to_target32(6, endian);
+    get_utsname_machine(s, &dh.utsname);
+    dh.status = cpu_convert_to_target32(s->flag_compress, endian);
+    dh.block_size = cpu_convert_to_target32(block_size, endian);
+    dh.sub_hdr_size = cpu_convert_to_target32(s->offset_dump_bitmap /
+                                              block_size -
+                                              DISKDUMP_HEADER_BLOCKS, endian);
+    dh.bitmap_blocks = cpu_convert_to_target32(s->len_dump_bitmap * 2 /
+                                               block_size, endian);
+    /* max_mapnr is truncated, newer readers use max_mapnr_64 */
+    dh.max_mapnr = cpu_convert_to_target32(MIN(s->max_mapnr, UINT_MAX),
+                                           endian);
+    dh.nr_cpus = cpu_convert_to_target32(s->nr_cpus, endian);
+
+    if (write_buffer(s, 0, &dh, sizeof(dh)) < 0) {
+        dump_error(s, "dump: failed to write disk dump header.\n");
+        return -1;
+    }
+
+    memset(&kh, 0, sizeof(kh));
+    kh.phys_base = cpu_convert_to_target32(PHYS_BASE, endian);
+    kh.dump_level = cpu_convert_to_target32(DUMP_LEVEL, endian);
+    kh.offset_note = cpu_convert_to_target64(s->offset_note, endian);
+    kh.note_size = cpu_convert_to_target32(s->note_size, endian);
+    kh.max_mapnr_64 = cpu_convert_to_target64(s->max_mapnr, endian);
+
+    if (write_buffer(s, DISKDUMP_HEADER_BLOCKS * block_size, &kh,
+                     sizeof(kh)) < 0) {
+        dump_error(s, "dump: failed to write kdump sub header.\n");
+        return -1;
+    }
+
+    return write_dump_notes(s);
+}
+
+static int write_dump_header64(DumpState *s)
+{
+    DiskDumpHeader64 dh;
+    KdumpSubHeader64 kh;
+    int endian = s->dump_info.d_endian;
+    uint32_t block_size = TARGET_PAGE_SIZE;
+
+    memset(&dh, 0, sizeof(dh));
+    memcpy(dh.signature, KDUMP_SIGNATURE, SIG_LEN);
+    dh.header_version = cpu_convert_to_target32(6, endian);
+    get_utsname_machine(s, &dh.utsname);
+    dh.status = cpu_convert_to_target32(s->flag_compress, endian);
+    dh.block_size = cpu_convert_to_target32(block_size, endian);
+    dh.sub_hdr_size = cpu_convert_to_target32(s->offset_dump_bitmap /
+                                              block_size -
+                                              DISKDUMP_HEADER_BLOCKS, endian);
+    dh.bitmap_blocks = cpu_convert_to_target32(s->len_dump_bitmap * 2 /
+                                               block_size, endian);
+    /* max_mapnr is truncated, newer readers use max_mapnr_64 */
+    dh.max_mapnr = cpu_convert_to_target32(MIN(s->max_mapnr, UINT_MAX),
+                                           endian);
+    dh.nr_cpus = cpu_convert_to_target32(s->nr_cpus, endian);
+
+    if (write_buffer(s, 0, &dh, sizeof(dh)) < 0) {
+        dump_error(s, "dump: failed to write disk dump header.\n");
+        return -1;
+    }
+
+    memset(&kh, 0, sizeof(kh));
+    kh.phys_base = cpu_convert_to_target64(PHYS_BASE, endian);
+    kh.dump_level = cpu_convert_to_target32(DUMP_LEVEL, endian);
+    kh.offset_note = cpu_convert_to_target64(s->offset_note, endian);
+    kh.note_size = cpu_convert_to_target64(s->note_size, endian);
+    kh.max_mapnr_64 = cpu_convert_to_target64(s->max_mapnr, endian);
+
+    if (write_buffer(s, DISKDUMP_HEADER_BLOCKS * block_size, &kh,
+                     sizeof(kh)) < 0) {
+        dump_error(s, "dump: failed to write kdump sub header.\n");
+        return -1;
+    }
+
+    return write_dump_notes(s);
+}
+
+/*
+ * Write both bitmaps of the page frames.  The first one has the page frames
+ * that exist, the second one those whose page is in the dump; as pages that
+ * only contain zeroes share a single copy, they are the same.
+ */
+static int write_dump_bitmap(DumpState *s)
+{
+    RAMBlock *block;
+    uint8_t *bitmap;
+    uint64_t pfn, end;
+    int ret = 0;
+
+    /* bit N of byte M is page frame M * 8 + N, whatever the host */
+    bitmap = g_malloc0(s->len_dump_bitmap);
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        end = (block->offset + block->length) >> TARGET_PAGE_BITS;
+        for (pfn = block->offset >> TARGET_PAGE_BITS; pfn < end; pfn++) {
+            bitmap[pfn >> 3] |= 1 << (pfn & 7);
+        }
+    }
+
+    if (write_buffer(s, s->offset_dump_bitmap, bitmap,
+                     s->len_dump_bitmap) < 0 ||
+        write_buffer(s, s->offset_dump_bitmap + s->len_dump_bitmap, bitmap,
+                     s->len_dump_bitmap) < 0) {
+        dump_error(s, "dump: failed to write dump bitmap.\n");
+        ret = -1;
+    }
+
+    g_free(bitmap);
+    return ret;
+}
+
+/* batches writes of consecutive data to vmcore */
+typedef struct DataCache {
+    DumpState *state;
+    uint8_t *buf;
+    size_t data_size;
+    off_t offset;           /* of buf in vmcore */
+} DataCache;
+
+static void prepare_data_cache(DataCache *dc, DumpState *s, off_t offset)
+{
+    dc->state = s;
+    dc->buf = g_malloc(DUMP_CACHE_SIZE);
+    dc->data_size = 0;
+    dc->offset = offset;
+}
+
+static int flush_cache(DataCache *dc)
+{
+    if (dc->data_size &&
+        write_buffer(dc->state, dc->offset, dc->buf, dc->data_size) < 0) {
+        return -1;
+    }
+
+    dc->offset += dc->data_size;
+    dc->data_size = 0;
+    return 0;
+}
+
+static int write_cache(DataCache *dc, const void *buf, size_t size)
+{
+    if (dc->data_size + size > DUMP_CACHE_SIZE && flush_cache(dc) < 0) {
+        return -1;
+    }
+
+    memcpy(dc->buf + dc->data_size, buf, size);
+    dc->data_size += size;
+    return 0;
+}
+
+static void free_data_cache(DataCache *dc)
+{
+    g_free(dc->buf);
+}
+
+static void dump_compress_page(DumpState *s, DumpCompressWorker *w,
+                               DumpPage *p)
+{
+    size_t len = s->compress_bound;
+    bool ok = false;
+
+    p->compressed = false;
+    if (buffer_is_zero(p->src, TARGET_PAGE_SIZE)) {
+        p->len = 0;
+        return;
+    }
+
+    switch (s->flag_compress) {
+    case DUMP_DH_COMPRESSED_ZLIB: {
+        uLongf zlib_len = len;
+
+        ok = compress2(p->buf, &zlib_len, p->src, TARGET_PAGE_SIZE,
+                       Z_BEST_SPEED) == Z_OK;
+        len = zlib_len;
+        break;
+    }
+#ifdef CONFIG_LZO
+    case DUMP_DH_COMPRESSED_LZO: {
+        lzo_uint lzo_len = len;
+
+        ok = lzo1x_1_compress(p->src, TARGET_PAGE_SIZE, p->buf, &lzo_len,
+                              w->wrkmem) == LZO_E_OK;
+        len = lzo_len;
+        break;
+    }
+#endif
+#ifdef CONFIG_SNAPPY
+    case DUMP_DH_COMPRESSED_SNAPPY:
+        ok = snappy_compress((char *)p->src, TARGET_PAGE_SIZE,
+                             (char *)p->buf, &len) == SNAPPY_OK;
+        break;
+#endif
+    }
+
+    /* pages that do not shrink are stored as they are */
+    if (ok && len < TARGET_PAGE_SIZE) {
+        p->compressed = true;
+        p->len = len;
+    } else {
+        p->len = TARGET_PAGE_SIZE;
+    }
+}
+
+static void *dump_compress_thread(void *opaque)
+{
+    DumpCompressWorker *w = opaque;
+    DumpState *s = w->s;
+    unsigned int seq = 0;
+    int i;
+
+    qemu_mutex_lock(&s->compress_lock);
+    for (;;) {
+        while (s->compress_seq == seq && !s->compress_quit) {
+            qemu_cond_wait(&s->compress_cond, &s->compress_lock);
+        }
+        if (s->compress_quit) {
+            break;
+        }
+        seq = s->compress_seq;
+        qemu_mutex_unlock(&s->compress_lock);
+
+        for (i = w->index; i < s->nr_pages; i += DUMP_COMPRESS_THREADS) {
+            dump_compress_page(s, w, &s->pages[i]);
+        }
+
+        qemu_mutex_lock(&s->compress_lock);
+        s->compress_done++;
+        qemu_cond_signal(&s->compress_done_cond);
+    }
+    qemu_mutex_unlock(&s->compress_lock);
+
+    return NULL;
+}
+
+static void dump_compress_threads_start(DumpState *s)
+{
+    DumpCompressWorker *w;
+    int i;
+
+    s->pages = g_new0(DumpPage, DUMP_BATCH_PAGES);
+    for (i = 0; i < DUMP_BATCH_PAGES; i++) {
+        s->pages[i].buf = g_malloc(s->compress_bound);
+    }
+
+    qemu_mutex_init(&s->compress_lock);
+    qemu_cond_init(&s->compress_cond);
+    qemu_cond_init(&s->compress_done_cond);
+    s->compress_seq = 0;
+    s->compress_quit = false;
+
+    s->workers = g_new0(DumpCompressWorker, DUMP_COMPRESS_THREADS);
+    for (i = 0; i < DUMP_COMPRESS_THREADS; i++) {
+        w = &s->workers[i];
+        w->s = s;
+        w->index = i;
+#ifdef CONFIG_LZO
+        if (s->flag_compress == DUMP_DH_COMPRESSED_LZO) {
+            w->wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
+        }
+#endif
+        qemu_thread_create(&w->thread, dump_compress_thread, w,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void dump_compress_threads_join(DumpState *s)
+{
+    int i;
+
+    if (!s->workers) {
+        return;
+    }
+
+    qemu_mutex_lock(&s->compress_lock);
+    s->compress_quit = true;
+    qemu_cond_broadcast(&s->compress_cond);
+    qemu_mutex_unlock(&s->compress_lock);
+
+    for (i = 0; i < DUMP_COMPRESS_THREADS; i++) {
+        qemu_thread_join(&s->workers[i].thread);
+#ifdef CONFIG_LZO
+        g_free(s->workers[i].wrkmem);
+#endif
+    }
+    g_free(s->workers);
+    s->workers = NULL;
+
+    for (i = 0; i < DUMP_BATCH_PAGES; i++) {
+        g_free(s->pages[i].buf);
+    }
+    g_free(s->pages);
+    s->pages = NULL;
+
+    qemu_cond_destroy(&s->compress_done_cond);
+    qemu_cond_destroy(&s->compress_cond);
+    qemu_mutex_destroy(&s->compress_lock);
+}
+
+/* compress s->pages[0..nr_pages - 1] on the worker threads */
+static void dump_compress_batch(DumpState *s, int nr_pages)
+{
+    qemu_mutex_lock(&s->compress_lock);
+    s->nr_pages = nr_pages;
+    s->compress_done = 0;
+    s->compress_seq++;
+    qemu_cond_broadcast(&s->compress_cond);
+    while (s->compress_done < DUMP_COMPRESS_THREADS) {
+        qemu_cond_wait(&s->compress_done_cond, &s->compress_lock);
+    }
+    qemu_mutex_unlock(&s->compress_lock);
+}
+
+static int ram_block_cmp(const void *a, const void *b)
+{
+    RAMBlock *block_a = *(RAMBlock **)a;
+    RAMBlock *block_b = *(RAMBlock **)b;
+
+    if (block_a->offset < block_b->offset) {
+        return -1;
+    }
+    return block_a->offset > block_b->offset;
+}
+
+/*
+ * write the page descriptors, in page frame order, and the page data.  The
+ * pages that only contain zeroes all point to a single copy.
+ */
+static int write_dump_pages(DumpState *s)
+{
+    DataCache page_desc, page_data;
+    PageDescriptor pd, pd_zero;
+    RAMBlock **blocks, *block;
+    DumpPage *p;
+    uint8_t *zero_page;
+    off_t offset_data;
+    ram_addr_t addr;
+    int endian = s->dump_info.d_endian;
+    int nr_blocks = 0;
+    int i, j, n;
+    int ret = -1;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        nr_blocks++;
+    }
+    blocks = g_new(RAMBlock *, nr_blocks);
+    i = 0;
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        blocks[i++] = block;
+    }
+    qsort(blocks, nr_blocks, sizeof(blocks[0]), ram_block_cmp);
+
+    offset_data = s->offset_page + sizeof(PageDescriptor) * s->num_dumpable;
+    prepare_data_cache(&page_desc, s, s->offset_page);
+    prepare_data_cache(&page_data, s, offset_data);
+
+    zero_page = g_malloc0(TARGET_PAGE_SIZE);
+    pd_zero.offset = cpu_convert_to_target64(offset_data, endian);
+    pd_zero.size = cpu_convert_to_target32(TARGET_PAGE_SIZE, endian);
+    pd_zero.flags = 0;
+    pd_zero.page_flags = 0;
+    if (write_cache(&page_data, zero_page, TARGET_PAGE_SIZE) < 0) {
+        goto out;
+    }
+    offset_data += TARGET_PAGE_SIZE;
+
+    pd.page_flags = 0;
+    for (i = 0; i < nr_blocks; i++) {
+        block = blocks[i];
+        for (addr = 0; addr < block->length; addr += n * TARGET_PAGE_SIZE) {
+            n = MIN((block->length - addr) >> TARGET_PAGE_BITS,
+                    DUMP_BATCH_PAGES);
+            for (j = 0; j < n; j++) {
+                s->pages[j].src = block->host + addr + j * TARGET_PAGE_SIZE;
+            }
+            dump_compress_batch(s, n);
+
+            for (j = 0; j < n; j++) {
+                p = &s->pages[j];
+                if (p->len == 0) {
+                    if (write_cache(&page_desc, &pd_zero, sizeof(pd)) < 0) {
+                        goto out;
+                    }
+                    continue;
+                }
+
+                pd.offset = cpu_convert_to_target64(offset_data, endian);
+                pd.size = cpu_convert_to_target32(p->len, endian);
+                pd.flags = cpu_convert_to_target32(p->compressed ?
+                                                   s->flag_compress : 0,
+                                                   endian);
+                if (write_cache(&page_desc, &pd, sizeof(pd)) < 0 ||
+                    write_cache(&page_data, p->compressed ? p->buf : p->src,
+                                p->len) < 0) {
+                    goto out;
+                }
+                offset_data += p->len;
+            }
+        }
+    }
+
+    if (flush_cache(&page_desc) < 0 || flush_cache(&page_data) < 0) {
+        goto out;
+    }
+    ret = 0;
+
+out:
+    if (ret < 0) {
+        dump_error(s, "dump: failed to write pages.\n");
+    }
+    free_data_cache(&page_desc);
+    free_data_cache(&page_data);
+    g_free(zero_page);
+    g_free(blocks);
+    return ret;
+}
+
+static int create_kdump_vmcore(DumpState *s)
+{
+    int ret;
+
+    /*
+     * the kdump-compressed format is:
+     *                                               File offset
+     *  +------------------------------------------+ 0x0
+     *  |    main header (struct disk_dump_header) |
+     *  |------------------------------------------+ block 1
+     *  |    sub header (struct kdump_sub_header)  |
+     *  |    elf note                              |
+     *  |------------------------------------------+ offset_dump_bitmap
+     *  |            1st-dump_bitmap               |
+     *  |------------------------------------------+
+     *  |            2nd-dump_bitmap               |
+     *  |------------------------------------------+ offset_page
+     *  |            page desc for pfn 0           |
+     *  |            ...                           |
+     *  |            page desc for pfn N           |
+     *  |------------------------------------------+
+     *  |            zero page                     |
+     *  |            page data                     |
+     *  |            ...                           |
+     *  +------------------------------------------+
+     *
+     * when vmcore cannot be seeked, every piece is written as a record of
+     * makedumpfile's flattened format instead.
+     */
+    if (s->flat && write_start_flat_header(s) < 0) {
+        dump_error(s, "dump: failed to write start flat header.\n");
+        return -1;
+    }
+
+    if (s->dump_info.d_class == ELFCLASS64) {
+        ret = write_dump_header64(s);
+    } else {
+        ret = write_dump_header32(s);
+    }
+    if (ret < 0) {
+        return -1;
+    }
+
+    if (write_dump_bitmap(s) < 0) {
+        return -1;
+    }
+
+    dump_compress_threads_start(s);
+    if (write_dump_pages(s) < 0) {
+        return -1;
+    }
+
+    if (s->flat && write_end_flat_header(s) < 0) {
+        dump_error(s, "dump: failed to write end flat header.\n");
+        return -1;
+    }
+
+    dump_completed(s);
+    return 0;
+}
+
+/* the part of block that is dumped starts at *start, return its size */
+static int64_t dump_block_range(DumpState *s, RAMBlock *block,
+                                ram_addr_t *start)
+{
+    int64_t size = block->length;
+
+    *start = 0;
+    if (!s->has_filter) {
+        return size;
+    }
+
+    if (block->offset >= s->begin + s->length ||
+        block->offset + block->length <= s->begin) {
+        /* This block is out of the range */
+        return 0;
+    }
+
+    if (s->begin > block->offset) {
+        *start = s->begin - block->offset;
+        size -= *start;
+    }
+    if (s->begin + s->length < block->offset + block->length) {
+        size -= block->offset + block->length - (s->begin + s->length);
+    }
+
+    return size;
+}
+
+/* collect the pages dirtied since the last call, return how many */
+static uint64_t dump_live_sync(DumpState *s)
+{
+    RAMBlock *block;
+    ram_addr_t start;
+    int64_t size;
+    uint64_t dirty = 0;
+
+    memory_global_sync_dirty_bitmap(get_system_memory());
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        size = dump_block_range(s, block, &start);
+        if (size) {
+            dirty += memory_region_move_dirty(block->mr, start, size,
+                                              DIRTY_MEMORY_DUMP,
+                                              s->dirty_bitmap);
+        }
+    }
+
+    return dirty;
+}
+
+/* write the pages of s->dirty_bitmap to their place in the elf vmcore */
+static int dump_live_write_dirty(DumpState *s)
+{
+    RAMBlock *block;
+    ram_addr_t start, first, last, addr, end;
+    unsigned long page, end_page, last_page;
+    off_t offset = s->memory_offset;
+    int64_t size;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        size = dump_block_range(s, block, &start);
+        if (!size) {
+            continue;
+        }
+
+        first = block->offset + start;
+        last = first + size;
+        last_page = TARGET_PAGE_ALIGN(last) >> TARGET_PAGE_BITS;
+        page = find_next_bit(s->dirty_bitmap, last_page,
+                             first >> TARGET_PAGE_BITS);
+        while (page < last_page) {
+            end_page = find_next_zero_bit(s->dirty_bitmap,
+                                          MIN(last_page,
+                                              page + DUMP_BATCH_PAGES),
+                                          page);
+            bitmap_clear(s->dirty_bitmap, page, end_page - page);
+
+            /* the first and last pages may be partly out of the range */
+            addr = MAX((ram_addr_t)page << TARGET_PAGE_BITS, first);
+            end = MIN((ram_addr_t)end_page << TARGET_PAGE_BITS, last);
+            if (write_buffer(s, offset + (addr - first),
+                             block->host + (addr - block->offset),
+                             end - addr) < 0) {
+                return -1;
+            }
+            live_dump_completed += end - addr;
+
+            page = find_next_bit(s->dirty_bitmap, last_page, end_page);
+        }
+        offset += size;
+    }
+
+    return 0;
+}
+
+static void *dump_live_thread(void *opaque)
+{
+    DumpState *s = opaque;
+    CPUArchState *env;
+    uint64_t dirty;
+    int pass;
+
+    /* copy memory while the guest runs, until it dirties little enough */
+    for (pass = 0; pass < DUMP_LIVE_MAX_PASSES; pass++) {
+        if (dump_live_write_dirty(s) < 0) {
+            qemu_mutex_lock_iothread();
+            goto fail;
+        }
+
+        qemu_mutex_lock_iothread();
+        dirty = dump_live_sync(s);
+        qemu_mutex_unlock_iothread();
+        if (dirty * TARGET_PAGE_SIZE <= DUMP_LIVE_MAX_DIRTY) {
+            break;
+        }
+    }
+
+    qemu_mutex_lock_iothread();
+    if (runstate_is_running()) {
+        vm_stop(RUN_STATE_SAVE_VM);
+        s->resume = true;
+    }
+    dump_live_sync(s);
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        cpu_synchronize_state(env);
+    }
+
+    /* the headers and notes go before the memory */
+    if (lseek(s->fd, 0, SEEK_SET) != 0 || dump_begin(s) < 0 ||
+        dump_live_write_dirty(s) < 0) {
+        goto fail;
+    }
+
+    dump_completed(s);
+    live_dump_status = DUMP_STATUS_COMPLETED;
+    qemu_mutex_unlock_iothread();
+    g_free(s);
+    return NULL;
+
+fail:
+    dump_cleanup(s);
+    live_dump_status = DUMP_STATUS_FAILED;
+    qemu_mutex_unlock_iothread();
+    g_free(s);
+    return NULL;
+}
+
+/* start a live dump; the thread owns s from now on */
+static void dump_live_start(DumpState *s)
+{
+    RAMBlock *block;
+    ram_addr_t start;
+    int64_t size;
+    unsigned long first, last;
+
+    s->dirty_bitmap = bitmap_new(last_ram_offset() >> TARGET_PAGE_BITS);
+    live_dump_total = 0;
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        size = dump_block_range(s, block, &start);
+        if (size) {
+            first = (block->offset + start) >> TARGET_PAGE_BITS;
+            last = (block->offset + start + size - 1) >> TARGET_PAGE_BITS;
+            bitmap_set(s->dirty_bitmap, first, last - first + 1);
+            live_dump_total += size;
+        }
+    }
+
+    memory_global_dirty_log_start();
+    s->dirty_log = true;
+    dump_live_sync(s);
+
+    live_dump_completed = 0;
+    live_dump_status = DUMP_STATUS_ACTIVE;
+
+    /* errors of the thread are reported by query-dump */
+    s->errp = NULL;
+    qemu_thread_create(&s->thread, dump_live_thread, s, QEMU_THREAD_DETACHED);
+}
+
+bool dump_in_progress(void)
+{
+    return live_dump_status == DUMP_STATUS_ACTIVE;
+}
+
+DumpQueryResult *qmp_query_dump(Error **errp)
+{
+    DumpQueryResult *result = g_malloc0(sizeof(*result));
+
+    result->status = live_dump_status;
+    result->completed = live_dump_completed;
+    result->total = live_dump_total;
+
+    return result;
+}
+
 static ram_addr_t get_start_block(DumpState *s)
 {
     RAMBlock *block;
@@ -694,13 +1563,17 @@ static ram_addr_t get_start_block(DumpState *s)
 }
 
 static int dump_init(DumpState *s, int fd, bool paging, bool has_filter,
-                     int64_t begin, int64_t length, Error **errp)
+                     int64_t begin, int64_t length,
+                     DumpGuestMemoryFormat format, bool live, Error **errp)
 {
     CPUArchState *env;
+    RAMBlock *block;
+    size_t sub_hdr_size;
     int nr_cpus;
     int ret;
 
-    if (runstate_is_running()) {
+    /* a live dump only stops the guest at its end */
+    if (!live && runstate_is_running()) {
         vm_stop(RUN_STATE_SAVE_VM);
         s->resume = true;
     } else {
@@ -757,6 +1630,56 @@ static int dump_init(DumpState *s, int fd, bool paging, bool has_filter,
         memory_mapping_filter(&s->list, s->begin, s->length);
     }
 
+    if (format != DUMP_GUEST_MEMORY_FORMAT_ELF) {
+        switch (format) {
+        case DUMP_GUEST_MEMORY_FORMAT_KDUMP_LZO:
+#ifdef CONFIG_LZO
+            if (lzo_init() != LZO_E_OK) {
+                error_setg(errp, "failed to initialize the lzo library");
+                goto cleanup;
+            }
+#endif
+            s->flag_compress = DUMP_DH_COMPRESSED_LZO;
+            s->compress_bound = TARGET_PAGE_SIZE + TARGET_PAGE_SIZE / 16 +
+                                64 + 3;
+            break;
+        case DUMP_GUEST_MEMORY_FORMAT_KDUMP_SNAPPY:
+            s->flag_compress = DUMP_DH_COMPRESSED_SNAPPY;
+#ifdef CONFIG_SNAPPY
+            s->compress_bound = snappy_max_compressed_length(TARGET_PAGE_SIZE);
+#endif
+            break;
+        default:
+            s->flag_compress = DUMP_DH_COMPRESSED_ZLIB;
+            s->compress_bound = compressBound(TARGET_PAGE_SIZE);
+            break;
+        }
+
+        /* a pipe or socket gets the flattened format */
+        s->flat = lseek(fd, 0, SEEK_CUR) == (off_t)-1;
+        s->nr_cpus = nr_cpus;
+        s->max_mapnr = last_ram_offset() >> TARGET_PAGE_BITS;
+        s->num_dumpable = 0;
+        QLIST_FOREACH(block, &ram_list.blocks, next) {
+            s->num_dumpable += block->length >> TARGET_PAGE_BITS;
+        }
+
+        /* everything after the disk dump header starts at a block boundary */
+        s->len_dump_bitmap = QEMU_ALIGN_UP(DIV_ROUND_UP(s->max_mapnr, 8),
+                                           TARGET_PAGE_SIZE);
+        if (s->dump_info.d_class == ELFCLASS64) {
+            sub_hdr_size = sizeof(KdumpSubHeader64);
+        } else {
+            sub_hdr_size = sizeof(KdumpSubHeader32);
+        }
+        s->offset_note = DISKDUMP_HEADER_BLOCKS * TARGET_PAGE_SIZE +
+                         sub_hdr_size;
+        s->offset_dump_bitmap = QEMU_ALIGN_UP(s->offset_note + s->note_size,
+                                              TARGET_PAGE_SIZE);
+        s->offset_page = s->offset_dump_bitmap + 2 * s->len_dump_bitmap;
+        return 0;
+    }
+
     /*
      * calculate phdr_num
      *
@@ -811,7 +1734,8 @@ cleanup:
 
 void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
                            int64_t begin, bool has_length, int64_t length,
-                           Error **errp)
+                           bool has_format, DumpGuestMemoryFormat format,
+                           bool has_live, bool live, Error **errp)
 {
     const char *p;
     int fd = -1;
@@ -826,6 +1750,48 @@ void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
         error_set(errp, QERR_MISSING_PARAMETER, "begin");
         return;
     }
+    if (!has_format) {
+        format = DUMP_GUEST_MEMORY_FORMAT_ELF;
+    }
+    if (!has_live) {
+        live = false;
+    }
+
+    if (format != DUMP_GUEST_MEMORY_FORMAT_ELF && (paging || has_begin)) {
+        error_setg(errp, "kdump-compressed format doesn't support paging or "
+                   "filter");
+        return;
+    }
+#ifndef CONFIG_LZO
+    if (format == DUMP_GUEST_MEMORY_FORMAT_KDUMP_LZO) {
+        error_setg(errp, "kdump-lzo is not available in this build");
+        return;
+    }
+#endif
+#ifndef CONFIG_SNAPPY
+    if (format == DUMP_GUEST_MEMORY_FORMAT_KDUMP_SNAPPY) {
+        error_setg(errp, "kdump-snappy is not available in this build");
+        return;
+    }
+#endif
+
+    if (dump_in_progress()) {
+        error_setg(errp, "A live guest memory dump is in progress");
+        return;
+    }
+    if (live) {
+        if (format != DUMP_GUEST_MEMORY_FORMAT_ELF || paging) {
+            error_setg(errp, "live dump only supports the elf format "
+                       "without paging");
+            return;
+        }
+        /* dirty logging cannot be shared with migration */
+        if (migration_is_active(migrate_get_current()) ||
+            savevm_live_active()) {
+            error_setg(errp, "live dump is not possible during migration");
+            return;
+        }
+    }
 
 #if !defined(WIN32)
     if (strstart(file, "fd:", &p)) {
@@ -849,15 +1815,33 @@ void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
         return;
     }
 
-    s = g_malloc(sizeof(DumpState));
+    /* the memory the guest changes is written again in place */
+    if (live && lseek(fd, 0, SEEK_CUR) == (off_t)-1) {
+        error_setg(errp, "live dump needs a seekable file");
+        close(fd);
+        return;
+    }
+
+    s = g_malloc0(sizeof(DumpState));
 
-    ret = dump_init(s, fd, paging, has_begin, begin, length, errp);
+    ret = dump_init(s, fd, paging, has_begin, begin, length, format, live,
+                    errp);
     if (ret < 0) {
         g_free(s);
         return;
     }
 
-    if (create_vmcore(s) < 0 && !error_is_set(s->errp)) {
+    if (live) {
+        dump_live_start(s);
+        return;
+    }
+
+    if (format != DUMP_GUEST_MEMORY_FORMAT_ELF) {
+        ret = create_kdump_vmcore(s);
+    } else {
+        ret = create_vmcore(s);
+    }
+    if (ret < 0 && !error_is_set(s->errp)) {
         error_set(errp, QERR_IO_ERROR);
     }
 
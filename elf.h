@@ -110,6 +110,8 @@ typedef int64_t  Elf64_Sxword;
 
 #define EM_UNICORE32    110     /* UniCore32 */
 
+#define EM_AARCH64      183     /* ARM AArch64 */
+
 /*
  * This is an interim value that we will use until the committee comes
  * up with a final number.
@@ -616,6 +618,12 @@ typedef struct {
 /* Keep this the last entry.  */
 #define R_ARM_NUM		256
 
+/* ARM AArch64 relocations, only those used by the TCG backend.  */
+#define R_AARCH64_NONE          0       /* No relocation.  */
+#define R_AARCH64_CONDBR19      280     /* PC-rel. cond. br. imm. from 20:2.  */
+#define R_AARCH64_JUMP26        282     /* PC-rel. B imm. from bits 27:2.  */
+#define R_AARCH64_CALL26        283     /* Likewise for CALL.  */
+
 /* s390 relocations defined by the ABIs */
 #define R_390_NONE		0	/* No reloc.  */
 #define R_390_8			1	/* Direct 8 bit.  */
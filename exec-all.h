@@ -21,6 +21,7 @@
 #define _EXEC_ALL_H_
 
 #include "qemu-common.h"
+#include "qemu-barrier.h"
 
 /* allow to see translation results - the slowdown should be negligible, so we leave it */
 #define DEBUG_DISAS
@@ -106,6 +107,25 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
                   hwaddr paddr, int prot,
                   int mmu_idx, target_ulong size);
 void tb_invalidate_phys_addr(hwaddr addr);
+bool tlb_victim_lookup(CPUArchState *env, target_ulong addr, int access_type,
+                       int mmu_idx);
+/* tb-persist.c */
+bool tb_persist_load(CPUArchState *env, TranslationBlock *tb,
+                     int *code_size);
+void tb_persist_save(CPUArchState *env, TranslationBlock *tb, int code_size);
+void tb_persist_dump_info(FILE *f, fprintf_function cpu_fprintf);
+/* tb-profile.c */
+extern bool tb_profile_enabled;
+void tb_profile_gen_code(CPUArchState *env, TranslationBlock *tb,
+                         int *code_size);
+void tb_profile_tlb_miss_slow(uintptr_t retaddr);
+
+static inline void tb_profile_tlb_miss(uintptr_t retaddr)
+{
+    if (unlikely(tb_profile_enabled)) {
+        tb_profile_tlb_miss_slow(retaddr);
+    }
+}
 #else
 static inline void tlb_flush_page(CPUArchState *env, target_ulong addr)
 {
@@ -118,8 +138,10 @@ static inline void tlb_flush(CPUArchState *env, int flush_global)
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
 
-#define CODE_GEN_PHYS_HASH_BITS     15
-#define CODE_GEN_PHYS_HASH_SIZE     (1 << CODE_GEN_PHYS_HASH_BITS)
+/* initial size of the physical TB hash table; it doubles whenever the
+   average chain length goes above TB_PHYS_HASH_MAX_LOAD */
+#define TB_PHYS_HASH_MIN_BITS       12
+#define TB_PHYS_HASH_MAX_LOAD       2
 
 /* estimated block size for TB allocation */
 /* XXX: use a per code average code fragment size and modulate it
@@ -132,6 +154,7 @@ static inline void tlb_flush(CPUArchState *env, int flush_global)
 
 #if defined(__arm__) || defined(_ARCH_PPC) \
     || defined(__x86_64__) || defined(__i386__) \
+    || defined(__aarch64__) \
     || defined(__sparc__) \
     || defined(CONFIG_TCG_INTERPRETER)
 #define USE_DIRECT_JUMP
@@ -146,6 +169,7 @@ struct TranslationBlock {
     uint16_t cflags;    /* compile flags */
 #define CF_COUNT_MASK  0x7fff
 #define CF_LAST_IO     0x8000 /* Last insn may be an IO access.  */
+    bool invalid;       /* removed from the physical hash table */
 
     uint8_t *tc_ptr;    /* pointer to the translated code */
     /* next matching tb for physical address. */
@@ -170,8 +194,45 @@ struct TranslationBlock {
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
     uint32_t icount;
+    struct TBProfile *prof; /* statistics if profiling, see tb-profile.c */
 };
 
+/* Per-TB statistics, shared by all translations of the same guest code */
+typedef struct TBProfile {
+    target_ulong pc;
+    target_ulong cs_base;
+    uint64_t flags;
+    unsigned int guest_size;
+    unsigned int host_size;
+    unsigned int helper_calls;
+    uint64_t translations;
+    int64_t translate_time;
+    uint64_t exec_count;        /* incremented by the generated code */
+    uint64_t tlb_misses;
+    uint64_t unchained_exits;
+    uint64_t icount_exits;
+} TBProfile;
+
+/* Counter that gen_icount_start() makes the TB being translated increment,
+   NULL if it is not profiled.  */
+extern uint64_t *tb_profile_counter;
+
+#if !defined(CONFIG_USER_ONLY)
+/* Account a return from the generated code to the main loop.  */
+static inline void tb_profile_exit(uintptr_t next_tb)
+{
+    TranslationBlock *tb = (TranslationBlock *)(next_tb & ~3);
+
+    if (tb && tb->prof) {
+        if ((next_tb & 3) == 2) {
+            tb->prof->icount_exits++;
+        } else {
+            tb->prof->unchained_exits++;
+        }
+    }
+}
+#endif
+
 static inline unsigned int tb_jmp_cache_hash_page(target_ulong pc)
 {
     target_ulong tmp;
@@ -187,17 +248,45 @@ static inline unsigned int tb_jmp_cache_hash_func(target_ulong pc)
 	    | (tmp & TB_JMP_ADDR_MASK));
 }
 
-static inline unsigned int tb_phys_hash_func(tb_page_addr_t pc)
+/* Chains are only modified with tb_lock (and, for multi-threaded TCG,
+   the tb_cache lock) held; new entries are published with smp_wmb() so
+   that lookups can walk the table without any lock.  The table itself
+   is only replaced while no vCPU is executing.  */
+typedef struct TBPhysHash {
+    unsigned int mask;
+    unsigned int nb_entries;
+    TranslationBlock *buckets[];
+} TBPhysHash;
+
+extern TBPhysHash *tb_phys_hash;
+
+static inline uint32_t tb_phys_hash_func(tb_page_addr_t phys_pc,
+                                         target_ulong pc, uint64_t flags)
+{
+    uint64_t h;
+
+    /* 64-bit finalizer from MurmurHash3; the low bits of the result
+       depend on all bits of the key */
+    h = (uint64_t)phys_pc ^ ((uint64_t)pc * 0x9e3779b97f4a7c15ULL) ^
+        (flags * 0xc2b2ae3d27d4eb4fULL);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline TranslationBlock *tb_phys_hash_first(uint32_t h)
 {
-    return (pc >> 2) & (CODE_GEN_PHYS_HASH_SIZE - 1);
+    TBPhysHash *table = tb_phys_hash;
+
+    smp_rmb();
+    return table->buckets[h & table->mask];
 }
 
 void tb_free(TranslationBlock *tb);
 void tb_flush(CPUArchState *env);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
 
-extern TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
-
 #if defined(USE_DIRECT_JUMP)
 
 #if defined(CONFIG_TCG_INTERPRETER)
@@ -217,6 +306,9 @@ static inline void tb_set_jmp_target1(uintptr_t jmp_addr, uintptr_t addr)
     *(uint32_t *)jmp_addr = addr - (jmp_addr + 4);
     /* no need to flush icache explicitly */
 }
+#elif defined(__aarch64__)
+void aarch64_tb_set_jmp_target(uintptr_t jmp_addr, uintptr_t addr);
+#define tb_set_jmp_target1 aarch64_tb_set_jmp_target
 #elif defined(__arm__)
 static inline void tb_set_jmp_target1(uintptr_t jmp_addr, uintptr_t addr)
 {
@@ -285,6 +377,30 @@ TranslationBlock *tb_find_pc(uintptr_t pc_ptr);
 
 extern spinlock_t tb_lock;
 
+#if !defined(CONFIG_USER_ONLY)
+/* Set by -machine tcg-thread=multi: one host thread per vCPU.  */
+extern bool tcg_multithread;
+#endif
+
+/* Serialise the TB cache and the code generator between vCPU threads;
+   in system mode only in multi-threaded mode, otherwise the calls are
+   no-ops.  In user mode every guest thread is a vCPU thread.  The lock
+   is recursive, and cpu_exec drops it with tb_cache_lock_reset when a
+   guest exception longjmps out of a locked section.  When both are
+   needed, the global mutex (or in user mode the mmap lock) is taken
+   first.  */
+void tb_cache_lock(void);
+void tb_cache_unlock(void);
+void tb_cache_lock_reset(void);
+
+/* Bumped by every flush of the code buffer; a TB pointer obtained
+   before a flush must not be chained to.  */
+extern int tb_flush_count;
+
+#if defined(CONFIG_USER_ONLY)
+void mmap_lock_reset(void);
+#endif
+
 extern int tb_invalidated_flag;
 
 /* The return address may point to the start of the next instruction.
@@ -339,6 +455,31 @@ extern uintptr_t tci_tb_ptr;
 # elif defined (_ARCH_PPC) && !defined (_ARCH_PPC64)
 #  define GETRA() ((uintptr_t)__builtin_return_address(0))
 #  define GETPC_LDST() ((uintptr_t) ((*(int32_t *)(GETRA() - 4)) - 1))
+# elif defined(__arm__) || defined(__mips__) || defined(__s390x__) || \
+       defined(__sparc__)
+/* The slow path branches over a word holding the distance from the word
+   itself to the next code of the fast path:
+
+   call MMU helper
+   (delay slot)             (MIPS, SPARC)
+   b POST_PROC              <- GETRA() (ARM, MIPS, s390x)
+   (delay slot)             (MIPS: nop)
+   .long NEXT_CODE - .      <- GETRA() + LDST_RADDR_OFS
+   POST_PROCESS ...
+
+   On SPARC the return address is the call instruction itself, and the
+   word sits in the annulled delay slot of "ba,a POST_PROC".
+ */
+#  if defined(__mips__)
+#   define LDST_RADDR_OFS 8
+#  elif defined(__sparc__)
+#   define LDST_RADDR_OFS 12
+#  else
+#   define LDST_RADDR_OFS 4
+#  endif
+#  define GETRA() ((uintptr_t)__builtin_return_address(0))
+#  define GETPC_LDST() ((uintptr_t)(GETRA() + LDST_RADDR_OFS + \
+                        *(int32_t *)(GETRA() + LDST_RADDR_OFS) - 1))
 # else
 #  error "CONFIG_QEMU_LDST_OPTIMIZATION needs GETPC_LDST() implementation!"
 # endif
@@ -350,7 +491,7 @@ bool is_tcg_gen_code(uintptr_t pc_ptr);
 
 #if !defined(CONFIG_USER_ONLY)
 
-struct MemoryRegion *iotlb_to_region(hwaddr index);
+struct MemoryRegion *iotlb_to_region(CPUArchState *env, hwaddr index);
 uint64_t io_mem_read(struct MemoryRegion *mr, hwaddr addr,
                      unsigned size);
 void io_mem_write(struct MemoryRegion *mr, hwaddr addr,
@@ -56,11 +56,18 @@
 #else /* !CONFIG_USER_ONLY */
 #include "xen-mapcache.h"
 #include "trace.h"
+#include "sysemu.h"
+#if !defined(CONFIG_USER_ONLY)
+#include "cpus.h"
+#include "qmp-commands.h"
+#endif
 #endif
 
 #include "cputlb.h"
 
 #include "memory-internal.h"
+#include "host-utils.h"
+#include "qemu-rcu.h"
 
 //#define DEBUG_TB_INVALIDATE
 //#define DEBUG_FLUSH
@@ -81,12 +88,73 @@
 
 static TranslationBlock *tbs;
 static int code_gen_max_blocks;
-TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
-static int nb_tbs;
+TBPhysHash *tb_phys_hash;
+static bool tb_phys_hash_grow_pending;
+
+/* The translation buffer and tbs[] are split into regions that are filled
+   in turn.  When the last one is full, the oldest region is emptied by
+   invalidating its TBs instead of flushing the whole cache.  */
+#define TB_REGIONS_MAX 8
+
+typedef struct TBRegion {
+    TranslationBlock *tbs;
+    int nb_tbs;
+    uint8_t *code_start;
+    uint8_t *code_end;      /* valid once the region has been left */
+} TBRegion;
+
+static TBRegion tb_regions[TB_REGIONS_MAX];
+static int tb_nb_regions;
+static int tb_region_cur;
+static int tb_region_max_blocks;
+static size_t tb_region_size;
+static size_t tb_region_max_size;
+static int tb_evict_count;
+
 /* any access to the tbs or the page table must use this lock */
 spinlock_t tb_lock = SPIN_LOCK_UNLOCKED;
 
+static DEFINE_TLS(int, tb_cache_lock_depth);
+#define tb_cache_lock_depth tls_var(tb_cache_lock_depth)
+
+#if defined(CONFIG_USER_ONLY)
+/* Every guest thread is a vCPU thread, so the lock is always needed;
+   tb_lock is the one fork_start() already takes.  */
+#define tb_cache_lock_needed()      true
+#define tb_cache_mutex_lock()       spin_lock(&tb_lock)
+#define tb_cache_mutex_unlock()     spin_unlock(&tb_lock)
+#else
+static QemuMutex tb_cache_mutex;
+#define tb_cache_lock_needed()      tcg_multithread
+#define tb_cache_mutex_lock()       qemu_mutex_lock(&tb_cache_mutex)
+#define tb_cache_mutex_unlock()     qemu_mutex_unlock(&tb_cache_mutex)
+#endif
+
+void tb_cache_lock(void)
+{
+    if (tb_cache_lock_needed() && tb_cache_lock_depth++ == 0) {
+        tb_cache_mutex_lock();
+    }
+}
+
+void tb_cache_unlock(void)
+{
+    if (tb_cache_lock_needed() && --tb_cache_lock_depth == 0) {
+        tb_cache_mutex_unlock();
+    }
+}
+
+void tb_cache_lock_reset(void)
+{
+    if (tb_cache_lock_depth) {
+        tb_cache_lock_depth = 0;
+        tb_cache_mutex_unlock();
+    }
+}
+
 uint8_t *code_gen_prologue;
+uint8_t *code_gen_epilogue;
+uint64_t *tb_profile_counter;
 static uint8_t *code_gen_buffer;
 static size_t code_gen_buffer_size;
 /* threshold to flush the translated code buffer */
@@ -175,19 +243,40 @@ static void *l1_map[V_L1_SIZE];
 
 #if !defined(CONFIG_USER_ONLY)
 
-static MemoryRegionSection *phys_sections;
-static unsigned phys_sections_nb, phys_sections_nb_alloc;
-static uint16_t phys_section_unassigned;
-static uint16_t phys_section_notdirty;
-static uint16_t phys_section_rom;
-static uint16_t phys_section_watch;
-
-/* Simple allocator for PhysPageEntry nodes */
-static PhysPageEntry (*phys_map_nodes)[L2_SIZE];
-static unsigned phys_map_nodes_nb, phys_map_nodes_nb_alloc;
+/* Sections registered at the same index in every dispatch snapshot */
+#define PHYS_SECTION_UNASSIGNED 0
+#define PHYS_SECTION_NOTDIRTY 1
+#define PHYS_SECTION_ROM 2
+#define PHYS_SECTION_WATCH 3
 
 #define PHYS_MAP_NODE_NIL (((uint16_t)~0) >> 1)
 
+typedef PhysPageEntry Node[L2_SIZE];
+
+/* A snapshot of the physical memory map of an address space.  It is built
+ * between the begin and commit callbacks of a memory transaction, never
+ * modified after it has been published in AddressSpace::dispatch, and
+ * reclaimed with call_rcu() once it has been replaced.
+ *
+ * Usually a transaction copies the previous snapshot and only patches the
+ * ranges that were removed or added; nodes and sections that this leaves
+ * unreachable are dropped by rebuilding from scratch once in a while.
+ */
+struct AddressSpaceDispatch {
+    struct rcu_head rcu;
+    /* This is a multi-level map on the physical address space.
+     * The bottom level has pointers to MemoryRegionSections.
+     */
+    PhysPageEntry phys_map;
+    /* Simple allocator for PhysPageEntry nodes */
+    Node *nodes;
+    unsigned nodes_nb, nodes_nb_alloc;
+    MemoryRegionSection *sections;
+    unsigned sections_nb, sections_nb_alloc;
+    /* nodes_nb and sections_nb right after the last rebuild */
+    unsigned rebuild_nodes_nb, rebuild_sections_nb;
+};
+
 static void io_mem_init(void);
 static void memory_map_init(void);
 static void *qemu_safe_ram_ptr(ram_addr_t addr);
@@ -198,8 +287,73 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                          tb_page_addr_t phys_page2);
 
 /* statistics */
-static int tb_flush_count;
+int tb_flush_count;
 static int tb_phys_invalidate_count;
+static int tb_phys_hash_grow_count;
+
+static TBPhysHash *tb_phys_hash_alloc(unsigned int nb_buckets)
+{
+    TBPhysHash *table;
+
+    table = g_malloc0(sizeof(*table) + nb_buckets * sizeof(TranslationBlock *));
+    table->mask = nb_buckets - 1;
+    return table;
+}
+
+static inline tb_page_addr_t tb_phys_pc(TranslationBlock *tb)
+{
+    return tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
+}
+
+static void tb_phys_hash_insert(TBPhysHash *table, TranslationBlock *tb,
+                                tb_page_addr_t phys_pc)
+{
+    TranslationBlock **ptb;
+
+    ptb = &table->buckets[tb_phys_hash_func(phys_pc, tb->pc, tb->flags) &
+                          table->mask];
+    tb->phys_hash_next = *ptb;
+    /* lookups may be walking the chain concurrently */
+    smp_wmb();
+    *ptb = tb;
+    table->nb_entries++;
+}
+
+/* Rehash every TB into a table twice as large.  In system mode this runs
+   while no vCPU is executing, so the old table can be freed right away.
+   In user mode other threads may still be walking it; it is kept, and
+   all retired tables together are smaller than the current one.  */
+static void tb_phys_hash_grow(void *opaque)
+{
+    TBPhysHash *old_table, *new_table;
+    TranslationBlock *tb, *next;
+    unsigned int i;
+
+    tb_cache_lock();
+    tb_phys_hash_grow_pending = false;
+    old_table = tb_phys_hash;
+    if (old_table->nb_entries <=
+        (old_table->mask + 1) * TB_PHYS_HASH_MAX_LOAD) {
+        /* a tb_flush came first */
+        tb_cache_unlock();
+        return;
+    }
+
+    new_table = tb_phys_hash_alloc((old_table->mask + 1) * 2);
+    for (i = 0; i <= old_table->mask; i++) {
+        for (tb = old_table->buckets[i]; tb != NULL; tb = next) {
+            next = tb->phys_hash_next;
+            tb_phys_hash_insert(new_table, tb, tb_phys_pc(tb));
+        }
+    }
+    smp_wmb();
+    tb_phys_hash = new_table;
+#if !defined(CONFIG_USER_ONLY)
+    g_free(old_table);
+#endif
+    tb_phys_hash_grow_count++;
+    tb_cache_unlock();
+}
 
 #ifdef _WIN32
 static inline void map_exec(void *addr, long size)
@@ -326,11 +480,18 @@ static PageDesc *page_find_alloc(tb_page_addr_t index, int alloc)
         P = mmap(NULL, SIZE, PROT_READ | PROT_WRITE,    \
                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);   \
     } while (0)
+# define FREE(P, SIZE)  munmap(P, SIZE)
 #else
 # define ALLOC(P, SIZE) \
     do { P = g_malloc0(SIZE); } while (0)
+# define FREE(P, SIZE)  g_free(P)
 #endif
 
+    /* Lookups take no lock, and levels are allocated both under the mmap
+       lock and under the TB lock.  A new level is published with a
+       compare-and-swap, which is also a full barrier; the loser frees
+       its copy.  Levels are never freed once published.  */
+
     /* Level 1.  Always allocated.  */
     lp = l1_map + ((index >> V_L1_SHIFT) & (V_L1_SIZE - 1));
 
@@ -343,7 +504,10 @@ static PageDesc *page_find_alloc(tb_page_addr_t index, int alloc)
                 return NULL;
             }
             ALLOC(p, sizeof(void *) * L2_SIZE);
-            *lp = p;
+            if (!__sync_bool_compare_and_swap(lp, NULL, p)) {
+                FREE(p, sizeof(void *) * L2_SIZE);
+                p = *lp;
+            }
         }
 
         lp = p + ((index >> (i * L2_BITS)) & (L2_SIZE - 1));
@@ -355,10 +519,14 @@ static PageDesc *page_find_alloc(tb_page_addr_t index, int alloc)
             return NULL;
         }
         ALLOC(pd, sizeof(PageDesc) * L2_SIZE);
-        *lp = pd;
+        if (!__sync_bool_compare_and_swap(lp, NULL, pd)) {
+            FREE(pd, sizeof(PageDesc) * L2_SIZE);
+            pd = *lp;
+        }
     }
 
 #undef ALLOC
+#undef FREE
 
     return pd + (index & (L2_SIZE - 1));
 }
@@ -370,40 +538,32 @@ static inline PageDesc *page_find(tb_page_addr_t index)
 
 #if !defined(CONFIG_USER_ONLY)
 
-static void phys_map_node_reserve(unsigned nodes)
+static void phys_map_node_reserve(AddressSpaceDispatch *d, unsigned nodes)
 {
-    if (phys_map_nodes_nb + nodes > phys_map_nodes_nb_alloc) {
-        typedef PhysPageEntry Node[L2_SIZE];
-        phys_map_nodes_nb_alloc = MAX(phys_map_nodes_nb_alloc * 2, 16);
-        phys_map_nodes_nb_alloc = MAX(phys_map_nodes_nb_alloc,
-                                      phys_map_nodes_nb + nodes);
-        phys_map_nodes = g_renew(Node, phys_map_nodes,
-                                 phys_map_nodes_nb_alloc);
+    if (d->nodes_nb + nodes > d->nodes_nb_alloc) {
+        d->nodes_nb_alloc = MAX(d->nodes_nb_alloc * 2, 16);
+        d->nodes_nb_alloc = MAX(d->nodes_nb_alloc, d->nodes_nb + nodes);
+        d->nodes = g_renew(Node, d->nodes, d->nodes_nb_alloc);
     }
 }
 
-static uint16_t phys_map_node_alloc(void)
+static uint16_t phys_map_node_alloc(AddressSpaceDispatch *d)
 {
     unsigned i;
     uint16_t ret;
 
-    ret = phys_map_nodes_nb++;
+    ret = d->nodes_nb++;
     assert(ret != PHYS_MAP_NODE_NIL);
-    assert(ret != phys_map_nodes_nb_alloc);
+    assert(ret != d->nodes_nb_alloc);
     for (i = 0; i < L2_SIZE; ++i) {
-        phys_map_nodes[ret][i].is_leaf = 0;
-        phys_map_nodes[ret][i].ptr = PHYS_MAP_NODE_NIL;
+        d->nodes[ret][i].is_leaf = 0;
+        d->nodes[ret][i].ptr = PHYS_MAP_NODE_NIL;
     }
     return ret;
 }
 
-static void phys_map_nodes_reset(void)
-{
-    phys_map_nodes_nb = 0;
-}
-
-
-static void phys_page_set_level(PhysPageEntry *lp, hwaddr *index,
+static void phys_page_set_level(AddressSpaceDispatch *d,
+                                PhysPageEntry *lp, hwaddr *index,
                                 hwaddr *nb, uint16_t leaf,
                                 int level)
 {
@@ -411,17 +571,30 @@ static void phys_page_set_level(PhysPageEntry *lp, hwaddr *index,
     int i;
     hwaddr step = (hwaddr)1 << (level * L2_BITS);
 
-    if (!lp->is_leaf && lp->ptr == PHYS_MAP_NODE_NIL) {
-        lp->ptr = phys_map_node_alloc();
-        p = phys_map_nodes[lp->ptr];
+    if (lp->is_leaf) {
+        /* Only part of a range that is mapped as a whole changes, which
+           happens when patching a copied snapshot: split the leaf into a
+           node whose entries all point to the same section.  */
+        uint16_t section = lp->ptr;
+
+        lp->is_leaf = 0;
+        lp->ptr = phys_map_node_alloc(d);
+        p = d->nodes[lp->ptr];
+        for (i = 0; i < L2_SIZE; i++) {
+            p[i].is_leaf = 1;
+            p[i].ptr = section;
+        }
+    } else if (lp->ptr == PHYS_MAP_NODE_NIL) {
+        lp->ptr = phys_map_node_alloc(d);
+        p = d->nodes[lp->ptr];
         if (level == 0) {
             for (i = 0; i < L2_SIZE; i++) {
                 p[i].is_leaf = 1;
-                p[i].ptr = phys_section_unassigned;
+                p[i].ptr = PHYS_SECTION_UNASSIGNED;
             }
         }
     } else {
-        p = phys_map_nodes[lp->ptr];
+        p = d->nodes[lp->ptr];
     }
     lp = &p[(*index >> (level * L2_BITS)) & (L2_SIZE - 1)];
 
@@ -432,7 +605,7 @@ static void phys_page_set_level(PhysPageEntry *lp, hwaddr *index,
             *index += step;
             *nb -= step;
         } else {
-            phys_page_set_level(lp, index, nb, leaf, level - 1);
+            phys_page_set_level(d, lp, index, nb, leaf, level - 1);
         }
         ++lp;
     }
@@ -443,29 +616,31 @@ static void phys_page_set(AddressSpaceDispatch *d,
                           uint16_t leaf)
 {
     /* Wildly overreserve - it doesn't matter much. */
-    phys_map_node_reserve(3 * P_L2_LEVELS);
+    phys_map_node_reserve(d, 3 * P_L2_LEVELS);
 
-    phys_page_set_level(&d->phys_map, &index, &nb, leaf, P_L2_LEVELS - 1);
+    phys_page_set_level(d, &d->phys_map, &index, &nb, leaf, P_L2_LEVELS - 1);
 }
 
+/* The returned section belongs to @d; it stays valid for as long as the
+   caller is inside the RCU critical section @d was fetched in.  */
 MemoryRegionSection *phys_page_find(AddressSpaceDispatch *d, hwaddr index)
 {
     PhysPageEntry lp = d->phys_map;
     PhysPageEntry *p;
     int i;
-    uint16_t s_index = phys_section_unassigned;
+    uint16_t s_index = PHYS_SECTION_UNASSIGNED;
 
     for (i = P_L2_LEVELS - 1; i >= 0 && !lp.is_leaf; i--) {
         if (lp.ptr == PHYS_MAP_NODE_NIL) {
             goto not_found;
         }
-        p = phys_map_nodes[lp.ptr];
+        p = d->nodes[lp.ptr];
         lp = p[(index >> (i * L2_BITS)) & (L2_SIZE - 1)];
     }
 
     s_index = lp.ptr;
 not_found:
-    return &phys_sections[s_index];
+    return &d->sections[s_index];
 }
 
 bool memory_region_is_unassigned(MemoryRegion *mr)
@@ -506,6 +681,9 @@ bool memory_region_is_unassigned(MemoryRegion *mr)
 # define MAX_CODE_GEN_BUFFER_SIZE  (2ul * 1024 * 1024 * 1024)
 #elif defined(__sparc__)
 # define MAX_CODE_GEN_BUFFER_SIZE  (2ul * 1024 * 1024 * 1024)
+#elif defined(__aarch64__)
+  /* B and BL reach +- 128MB.  */
+# define MAX_CODE_GEN_BUFFER_SIZE  (128ul * 1024 * 1024)
 #elif defined(__arm__)
 # define MAX_CODE_GEN_BUFFER_SIZE  (16u * 1024 * 1024)
 #elif defined(__s390x__)
@@ -598,6 +776,30 @@ static inline void *alloc_code_gen_buffer(void)
 }
 #endif /* USE_STATIC_CODE_GEN_BUFFER, USE_MMAP */
 
+static void tb_regions_init(void)
+{
+    size_t headroom = TCG_MAX_OP_SIZE * OPC_BUF_SIZE;
+    int i;
+
+    /* Each region loses the headroom at its end, so only split buffers
+       that are large compared to it.  A single region behaves as a
+       plain flush when full.  */
+    tb_nb_regions = MIN(TB_REGIONS_MAX, code_gen_buffer_size / (8 * headroom));
+    if (tb_nb_regions < 2) {
+        tb_nb_regions = 1;
+    }
+    tb_region_size = code_gen_buffer_size / tb_nb_regions;
+    tb_region_max_size = tb_region_size - headroom;
+    tb_region_max_blocks = code_gen_max_blocks / tb_nb_regions;
+    for (i = 0; i < tb_nb_regions; i++) {
+        tb_regions[i].tbs = tbs + i * tb_region_max_blocks;
+        tb_regions[i].nb_tbs = 0;
+        tb_regions[i].code_start = code_gen_buffer + i * tb_region_size;
+        tb_regions[i].code_end = tb_regions[i].code_start;
+    }
+    tb_region_cur = 0;
+}
+
 static inline void code_gen_alloc(size_t tb_size)
 {
     code_gen_buffer_size = size_code_gen_buffer(tb_size);
@@ -619,6 +821,8 @@ static inline void code_gen_alloc(size_t tb_size)
         (TCG_MAX_OP_SIZE * OPC_BUF_SIZE);
     code_gen_max_blocks = code_gen_buffer_size / CODE_GEN_AVG_BLOCK_SIZE;
     tbs = g_malloc(code_gen_max_blocks * sizeof(TranslationBlock));
+    tb_phys_hash = tb_phys_hash_alloc(1 << TB_PHYS_HASH_MIN_BITS);
+    tb_regions_init();
 }
 
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
@@ -631,6 +835,9 @@ void tcg_exec_init(unsigned long tb_size)
     code_gen_ptr = code_gen_buffer;
     tcg_register_jit(code_gen_buffer, code_gen_buffer_size);
     page_init();
+#if !defined(CONFIG_USER_ONLY)
+    qemu_mutex_init(&tb_cache_mutex);
+#endif
 #if !defined(CONFIG_USER_ONLY) || !defined(CONFIG_USE_GUEST_BASE)
     /* There's no guest base to take into account, so go ahead and
        initialize the prologue now.  */
@@ -728,18 +935,21 @@ void cpu_exec_init(CPUArchState *env)
 #endif
 }
 
-/* Allocate a new translation block. Flush the translation buffer if
-   too many translation blocks or too much generated code. */
+/* Allocate a new translation block. Return NULL if the current region
+   holds too many translation blocks or too much generated code. */
 static TranslationBlock *tb_alloc(target_ulong pc)
 {
+    TBRegion *r = &tb_regions[tb_region_cur];
     TranslationBlock *tb;
 
-    if (nb_tbs >= code_gen_max_blocks ||
-        (code_gen_ptr - code_gen_buffer) >= code_gen_buffer_max_size)
+    if (r->nb_tbs >= tb_region_max_blocks ||
+        (code_gen_ptr - r->code_start) >= tb_region_max_size)
         return NULL;
-    tb = &tbs[nb_tbs++];
+    tb = &r->tbs[r->nb_tbs++];
     tb->pc = pc;
     tb->cflags = 0;
+    tb->invalid = false;
+    tb->prof = NULL;
     return tb;
 }
 
@@ -748,9 +958,11 @@ void tb_free(TranslationBlock *tb)
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (nb_tbs > 0 && tb == &tbs[nb_tbs - 1]) {
+    TBRegion *r = &tb_regions[tb_region_cur];
+
+    if (r->nb_tbs > 0 && tb == &r->tbs[r->nb_tbs - 1]) {
         code_gen_ptr = tb->tc_ptr;
-        nb_tbs--;
+        r->nb_tbs--;
     }
 }
 
@@ -795,26 +1007,33 @@ static void page_flush_tb(void)
 }
 
 /* flush all the translation blocks */
-/* XXX: tb_flush is currently not thread safe */
-void tb_flush(CPUArchState *env1)
+/* XXX: tb_flush is currently not thread safe in user mode */
+static void tb_flush_safe(CPUArchState *env1)
 {
     CPUArchState *env;
+    int i;
 #if defined(DEBUG_FLUSH)
-    printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
+    printf("qemu: flush code_size=%ld region=%d/%d\n",
            (unsigned long)(code_gen_ptr - code_gen_buffer),
-           nb_tbs, nb_tbs > 0 ?
-           ((unsigned long)(code_gen_ptr - code_gen_buffer)) / nb_tbs : 0);
+           tb_region_cur, tb_nb_regions);
 #endif
     if ((unsigned long)(code_gen_ptr - code_gen_buffer) > code_gen_buffer_size)
         cpu_abort(env1, "Internal error: code buffer overflow\n");
 
-    nb_tbs = 0;
+    for (i = 0; i < tb_nb_regions; i++) {
+        tb_regions[i].nb_tbs = 0;
+        tb_regions[i].code_end = tb_regions[i].code_start;
+    }
+    tb_region_cur = 0;
 
     for(env = first_cpu; env != NULL; env = env->next_cpu) {
         memset (env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
     }
 
-    memset (tb_phys_hash, 0, CODE_GEN_PHYS_HASH_SIZE * sizeof (void *));
+    /* keep the table size, the new working set is likely to be similar */
+    memset(tb_phys_hash->buckets, 0,
+           (tb_phys_hash->mask + 1) * sizeof(TranslationBlock *));
+    tb_phys_hash->nb_entries = 0;
     page_flush_tb();
 
     code_gen_ptr = code_gen_buffer;
@@ -823,6 +1042,85 @@ void tb_flush(CPUArchState *env1)
     tb_flush_count++;
 }
 
+#if !defined(CONFIG_USER_ONLY)
+static void do_tb_flush(void *data)
+{
+    /* several vCPUs may have asked for the same flush */
+    if (tb_flush_count == (uintptr_t)data) {
+        tb_flush_safe(NULL);
+    }
+}
+#endif
+
+void tb_flush(CPUArchState *env1)
+{
+#if !defined(CONFIG_USER_ONLY)
+    if (tcg_multithread) {
+        /* other vCPUs may be executing code from the buffer */
+        async_safe_run_on_cpus(do_tb_flush, (void *)(uintptr_t)tb_flush_count);
+        return;
+    }
+#endif
+    tb_flush_safe(env1);
+}
+
+/* Move code generation to the next region, which holds the oldest code,
+   and invalidate the TBs still living there.  */
+static void tb_evict_safe(void)
+{
+    TBRegion *r;
+    TranslationBlock *tb;
+    int i;
+
+    tb_cache_lock();
+    tb_regions[tb_region_cur].code_end = code_gen_ptr;
+    tb_region_cur = (tb_region_cur + 1) % tb_nb_regions;
+    r = &tb_regions[tb_region_cur];
+#if defined(DEBUG_FLUSH)
+    printf("qemu: evict region=%d nb_tbs=%d code_size=%ld\n",
+           tb_region_cur, r->nb_tbs,
+           (unsigned long)(r->code_end - r->code_start));
+#endif
+    for (i = 0; i < r->nb_tbs; i++) {
+        tb = &r->tbs[i];
+        if (!tb->invalid) {
+            tb_phys_invalidate(tb, -1);
+        }
+    }
+    r->nb_tbs = 0;
+    r->code_end = r->code_start;
+    code_gen_ptr = r->code_start;
+    tb_evict_count++;
+    tb_cache_unlock();
+}
+
+#if !defined(CONFIG_USER_ONLY)
+static void do_tb_evict(void *data)
+{
+    /* several vCPUs may have found the same region full */
+    if (tb_evict_count == (uintptr_t)data) {
+        tb_evict_safe();
+    }
+}
+#endif
+
+/* Make room in the translation buffer, recycling the oldest region when
+   the buffer is split and flushing everything otherwise.  */
+static void tb_evict(CPUArchState *env1)
+{
+    if (tb_nb_regions == 1) {
+        tb_flush(env1);
+        return;
+    }
+#if !defined(CONFIG_USER_ONLY)
+    if (tcg_multithread) {
+        async_safe_run_on_cpus(do_tb_evict, (void *)(uintptr_t)tb_evict_count);
+        return;
+    }
+#endif
+    tb_evict_safe();
+}
+
 #ifdef DEBUG_TB_CHECK
 
 static void tb_invalidate_check(target_ulong address)
@@ -830,8 +1128,9 @@ static void tb_invalidate_check(target_ulong address)
     TranslationBlock *tb;
     int i;
     address &= TARGET_PAGE_MASK;
-    for(i = 0;i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for(tb = tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
+    for (i = 0; i <= tb_phys_hash->mask; i++) {
+        for (tb = tb_phys_hash->buckets[i]; tb != NULL;
+             tb = tb->phys_hash_next) {
             if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
                   address >= tb->pc + tb->size)) {
                 printf("ERROR invalidate: address=" TARGET_FMT_lx
@@ -848,8 +1147,9 @@ static void tb_page_check(void)
     TranslationBlock *tb;
     int i, flags1, flags2;
 
-    for(i = 0;i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for(tb = tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
+    for (i = 0; i <= tb_phys_hash->mask; i++) {
+        for (tb = tb_phys_hash->buckets[i]; tb != NULL;
+             tb = tb->phys_hash_next) {
             flags1 = page_get_flags(tb->pc);
             flags2 = page_get_flags(tb->pc + tb->size - 1);
             if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
@@ -934,14 +1234,15 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     CPUArchState *env;
     PageDesc *p;
     unsigned int h, n1;
-    tb_page_addr_t phys_pc;
     TranslationBlock *tb1, *tb2;
 
-    /* remove the TB from the hash list */
-    phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
-    h = tb_phys_hash_func(phys_pc);
-    tb_remove(&tb_phys_hash[h], tb,
+    /* remove the TB from the hash list.  tb->phys_hash_next is left
+       alone so that a concurrent lookup standing on tb can proceed. */
+    h = tb_phys_hash_func(tb_phys_pc(tb), tb->pc, tb->flags);
+    tb_remove(&tb_phys_hash->buckets[h & tb_phys_hash->mask], tb,
               offsetof(TranslationBlock, phys_hash_next));
+    tb_phys_hash->nb_entries--;
+    tb->invalid = true;
 
     /* remove the TB from the page list */
     if (tb->page_addr[0] != page_addr) {
@@ -1053,8 +1354,15 @@ TranslationBlock *tb_gen_code(CPUArchState *env,
     phys_pc = get_page_addr_code(env, pc);
     tb = tb_alloc(pc);
     if (!tb) {
-        /* flush must be done */
-        tb_flush(env);
+        /* eviction or flush must be done */
+        tb_evict(env);
+#if !defined(CONFIG_USER_ONLY)
+        if (tcg_multithread) {
+            /* it runs once all vCPUs have left cpu_exec */
+            env->exception_index = EXCP_INTERRUPT;
+            cpu_loop_exit(env);
+        }
+#endif
         /* cannot fail at this point */
         tb = tb_alloc(pc);
         /* Don't forget to invalidate previous TB info.  */
@@ -1065,7 +1373,16 @@ TranslationBlock *tb_gen_code(CPUArchState *env,
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
+#if !defined(CONFIG_USER_ONLY)
+    if (tb_profile_enabled) {
+        tb_profile_gen_code(env, tb, &code_gen_size);
+    } else if (!tb_persist_load(env, tb, &code_gen_size)) {
+        cpu_gen_code(env, tb, &code_gen_size);
+        tb_persist_save(env, tb, code_gen_size);
+    }
+#else
     cpu_gen_code(env, tb, &code_gen_size);
+#endif
     code_gen_ptr = (void *)(((uintptr_t)code_gen_ptr + code_gen_size +
                              CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
 
@@ -1120,9 +1437,12 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
     int current_flags = 0;
 #endif /* TARGET_HAS_PRECISE_SMC */
 
+    tb_cache_lock();
     p = page_find(start >> TARGET_PAGE_BITS);
-    if (!p)
+    if (!p) {
+        tb_cache_unlock();
         return;
+    }
     if (!p->code_bitmap &&
         ++p->code_write_count >= SMC_BITMAP_USE_THRESHOLD &&
         is_cpu_write_access) {
@@ -1206,6 +1526,7 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
         cpu_resume_from_signal(env, NULL);
     }
 #endif
+    tb_cache_unlock();
 }
 
 /* len must be <= 8 and start must be a multiple of len */
@@ -1222,9 +1543,12 @@ static inline void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
                   (intptr_t)cpu_single_env->segs[R_CS].base);
     }
 #endif
+    tb_cache_lock();
     p = page_find(start >> TARGET_PAGE_BITS);
-    if (!p)
+    if (!p) {
+        tb_cache_unlock();
         return;
+    }
     if (p->code_bitmap) {
         offset = start & ~TARGET_PAGE_MASK;
         b = p->code_bitmap[offset >> 3] >> (offset & 7);
@@ -1234,6 +1558,7 @@ static inline void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
     do_invalidate:
         tb_invalidate_phys_page_range(start, start + len, 1);
     }
+    tb_cache_unlock();
 }
 
 #if !defined(CONFIG_SOFTMMU)
@@ -1360,17 +1685,26 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                          tb_page_addr_t phys_page2)
 {
-    unsigned int h;
-    TranslationBlock **ptb;
-
-    /* Grab the mmap lock to stop another thread invalidating this TB
-       before we are done.  */
-    mmap_lock();
+    /* The TB cache lock stops another thread invalidating this TB before
+       we are done; it is taken after the mmap lock, so do not take that
+       one here.  */
+    tb_cache_lock();
     /* add in the physical hash table */
-    h = tb_phys_hash_func(phys_pc);
-    ptb = &tb_phys_hash[h];
-    tb->phys_hash_next = *ptb;
-    *ptb = tb;
+    tb_phys_hash_insert(tb_phys_hash, tb, phys_pc);
+    if (tb_phys_hash->nb_entries >
+        (tb_phys_hash->mask + 1) * TB_PHYS_HASH_MAX_LOAD &&
+        tb_phys_hash->mask + 1 < code_gen_max_blocks &&
+        !tb_phys_hash_grow_pending) {
+#if !defined(CONFIG_USER_ONLY)
+        if (tcg_multithread) {
+            tb_phys_hash_grow_pending = true;
+            async_safe_run_on_cpus(tb_phys_hash_grow, NULL);
+        } else
+#endif
+        {
+            tb_phys_hash_grow(NULL);
+        }
+    }
 
     /* add in the page list */
     tb_alloc_page(tb, 0, phys_pc & TARGET_PAGE_MASK);
@@ -1392,7 +1726,7 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
 #ifdef DEBUG_TB_CHECK
     tb_page_check();
 #endif
-    mmap_unlock();
+    tb_cache_unlock();
 }
 
 #if defined(CONFIG_QEMU_LDST_OPTIMIZATION) && defined(CONFIG_SOFTMMU)
@@ -1408,24 +1742,29 @@ bool is_tcg_gen_code(uintptr_t tc_ptr)
 
 /* find the TB 'tb' such that tb[0].tc_ptr <= tc_ptr <
    tb[1].tc_ptr. Return NULL if not found */
-TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
+static TranslationBlock *tb_find_pc_locked(uintptr_t tc_ptr)
 {
     int m_min, m_max, m;
     uintptr_t v;
     TranslationBlock *tb;
+    TBRegion *r;
+    uint8_t *code_end;
 
-    if (nb_tbs <= 0)
-        return NULL;
     if (tc_ptr < (uintptr_t)code_gen_buffer ||
-        tc_ptr >= (uintptr_t)code_gen_ptr) {
+        tc_ptr >= (uintptr_t)code_gen_buffer + tb_nb_regions * tb_region_size) {
+        return NULL;
+    }
+    r = &tb_regions[(tc_ptr - (uintptr_t)code_gen_buffer) / tb_region_size];
+    code_end = r == &tb_regions[tb_region_cur] ? code_gen_ptr : r->code_end;
+    if (r->nb_tbs <= 0 || tc_ptr >= (uintptr_t)code_end) {
         return NULL;
     }
     /* binary search (cf Knuth) */
     m_min = 0;
-    m_max = nb_tbs - 1;
+    m_max = r->nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tbs[m];
+        tb = &r->tbs[m];
         v = (uintptr_t)tb->tc_ptr;
         if (v == tc_ptr)
             return tb;
@@ -1435,7 +1774,17 @@ TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
             m_min = m + 1;
         }
     }
-    return &tbs[m_max];
+    return &r->tbs[m_max];
+}
+
+TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
+{
+    TranslationBlock *tb;
+
+    tb_cache_lock();
+    tb = tb_find_pc_locked(tc_ptr);
+    tb_cache_unlock();
+    return tb;
 }
 
 static void tb_reset_jump_recursive(TranslationBlock *tb);
@@ -1497,14 +1846,16 @@ void tb_invalidate_phys_addr(hwaddr addr)
     ram_addr_t ram_addr;
     MemoryRegionSection *section;
 
-    section = phys_page_find(address_space_memory.dispatch, addr >> TARGET_PAGE_BITS);
-    if (!(memory_region_is_ram(section->mr)
-          || (section->mr->rom_device && section->mr->readable))) {
-        return;
+    rcu_read_lock();
+    section = phys_page_find(atomic_rcu_read(&address_space_memory.dispatch),
+                             addr >> TARGET_PAGE_BITS);
+    if (memory_region_is_ram(section->mr)
+        || (section->mr->rom_device && section->mr->readable)) {
+        ram_addr = (memory_region_get_ram_addr(section->mr) & TARGET_PAGE_MASK)
+            + memory_region_section_addr(section, addr);
+        tb_invalidate_phys_page_range(ram_addr, ram_addr + 1, 0);
     }
-    ram_addr = (memory_region_get_ram_addr(section->mr) & TARGET_PAGE_MASK)
-        + memory_region_section_addr(section, addr);
-    tb_invalidate_phys_page_range(ram_addr, ram_addr + 1, 0);
+    rcu_read_unlock();
 }
 
 static void breakpoint_invalidate(CPUArchState *env, target_ulong pc)
@@ -1698,6 +2049,7 @@ static void cpu_unlink_tb(CPUArchState *env)
     static spinlock_t interrupt_lock = SPIN_LOCK_UNLOCKED;
 
     spin_lock(&interrupt_lock);
+    tb_cache_lock();
     tb = env->current_tb;
     /* if the cpu is currently executing code, we must unlink it and
        all the potentially executing TB */
@@ -1705,6 +2057,7 @@ static void cpu_unlink_tb(CPUArchState *env)
         env->current_tb = NULL;
         tb_reset_jump_recursive(tb);
     }
+    tb_cache_unlock();
     spin_unlock(&interrupt_lock);
 }
 
@@ -1862,7 +2215,7 @@ static void tlb_reset_dirty_range_all(ram_addr_t start, ram_addr_t end,
 
 /* Note: start and end must be within the same ram block.  */
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
-                                     int dirty_flags)
+                                     unsigned client)
 {
     uintptr_t length;
 
@@ -1872,13 +2225,105 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
     length = end - start;
     if (length == 0)
         return;
-    cpu_physical_memory_mask_dirty_range(start, length, dirty_flags);
+    cpu_physical_memory_clear_dirty_range(start, length, client);
 
     if (tcg_enabled()) {
         tlb_reset_dirty_range_all(start, end, length);
     }
 }
 
+/* Mark dirty for all clients the pages described by a little-endian
+   bitmap with one bit per host page, such as a KVM dirty log.  */
+void cpu_physical_memory_set_dirty_lebitmap(ram_addr_t start,
+                                            const unsigned long *bitmap,
+                                            uint64_t pages)
+{
+    unsigned long hpratio = getpagesize() / TARGET_PAGE_SIZE;
+    unsigned long page = start >> TARGET_PAGE_BITS;
+    uint64_t i, len = BITS_TO_LONGS(pages);
+    unsigned long c;
+    unsigned client;
+    int j;
+
+    for (i = 0; i < len; i++) {
+        if (!bitmap[i]) {
+            continue;
+        }
+        c = leul_to_cpu(bitmap[i]);
+        if (i == len - 1 && pages % BITS_PER_LONG) {
+            c &= BITMAP_LAST_WORD_MASK(pages);
+        }
+        if (hpratio == 1 && !(page % BITS_PER_LONG)) {
+            /* the source word covers exactly one destination word */
+            for (client = 0; client < DIRTY_MEMORY_NUM; client++) {
+                ram_list.dirty_memory[client][page / BITS_PER_LONG + i] |= c;
+            }
+            continue;
+        }
+        while (c) {
+            j = ffsl(c) - 1;
+            c &= ~(1UL << j);
+            for (client = 0; client < DIRTY_MEMORY_NUM; client++) {
+                bitmap_set(ram_list.dirty_memory[client],
+                           page + (i * BITS_PER_LONG + j) * hpratio, hpratio);
+            }
+        }
+    }
+    xen_modified_memory(start, pages * hpratio * TARGET_PAGE_SIZE);
+}
+
+/* Move the dirty bits of @client for the pages in [start, start + length)
+   to @dest, a bitmap indexed by ram_addr_t page number, and return the
+   number of pages that were newly set in it.
+   Note: start and length must be within the same ram block.  */
+uint64_t cpu_physical_memory_move_dirty(ram_addr_t start, ram_addr_t length,
+                                        unsigned client, unsigned long *dest)
+{
+    unsigned long *src = ram_list.dirty_memory[client];
+    unsigned long page, end_page, k, w;
+    ram_addr_t end;
+    uint64_t num_dirty = 0;
+    bool found = false;
+
+    end = TARGET_PAGE_ALIGN(start + length);
+    start &= TARGET_PAGE_MASK;
+    page = start >> TARGET_PAGE_BITS;
+    end_page = end >> TARGET_PAGE_BITS;
+
+    /* leading bits up to a word boundary, and everything for short ranges */
+    while (page < end_page && (page % BITS_PER_LONG ||
+                               end_page - page < BITS_PER_LONG)) {
+        if (test_and_clear_bit(page, src)) {
+            found = true;
+            if (!test_and_set_bit(page, dest)) {
+                num_dirty++;
+            }
+        }
+        page++;
+    }
+
+    /* whole words, then the trailing bits of the last one */
+    for (k = page / BITS_PER_LONG; page < end_page; k++) {
+        w = src[k];
+        if (end_page - page < BITS_PER_LONG) {
+            w &= BITMAP_LAST_WORD_MASK(end_page - page);
+        }
+        page += BITS_PER_LONG;
+        if (!w) {
+            continue;
+        }
+        found = true;
+        src[k] &= ~w;
+        num_dirty += ctpopl(w & ~dest[k]);
+        dest[k] |= w;
+    }
+
+    if (found && tcg_enabled()) {
+        tlb_reset_dirty_range_all(start, end, end - start);
+    }
+    return num_dirty;
+}
+
 static int cpu_physical_memory_set_dirty_tracking(int enable)
 {
     int ret = 0;
@@ -1901,9 +2346,9 @@ hwaddr memory_region_section_get_iotlb(CPUArchState *env,
         iotlb = (memory_region_get_ram_addr(section->mr) & TARGET_PAGE_MASK)
             + memory_region_section_addr(section, paddr);
         if (!section->readonly) {
-            iotlb |= phys_section_notdirty;
+            iotlb |= PHYS_SECTION_NOTDIRTY;
         } else {
-            iotlb |= phys_section_rom;
+            iotlb |= PHYS_SECTION_ROM;
         }
     } else {
         /* IO handlers are currently passed a physical address.
@@ -1912,7 +2357,7 @@ hwaddr memory_region_section_get_iotlb(CPUArchState *env,
            and avoid full address decoding in every device.
            We can't use the high bits of pd for this because
            IO_MEM_ROMD uses these as a ram address.  */
-        iotlb = section - phys_sections;
+        iotlb = section - env->memory_dispatch->sections;
         iotlb += memory_region_section_addr(section, paddr);
     }
 
@@ -1922,7 +2367,7 @@ hwaddr memory_region_section_get_iotlb(CPUArchState *env,
         if (vaddr == (wp->vaddr & TARGET_PAGE_MASK)) {
             /* Avoid trapping reads of pages with a write breakpoint. */
             if ((prot & PAGE_WRITE) || (wp->flags & BP_MEM_READ)) {
-                iotlb = phys_section_watch + paddr;
+                iotlb = PHYS_SECTION_WATCH + paddr;
                 *address |= TLB_MMIO;
                 break;
             }
@@ -2056,7 +2501,8 @@ int page_get_flags(target_ulong address)
 
 /* Modify the flags of a page and invalidate the code if necessary.
    The flag PAGE_WRITE_ORG is positioned automatically depending
-   on PAGE_WRITE.  The mmap_lock should already be held.  */
+   on PAGE_WRITE.  The mmap_lock should already be held; the page
+   descriptors themselves are protected by the TB cache lock.  */
 void page_set_flags(target_ulong start, target_ulong end, int flags)
 {
     target_ulong addr, len;
@@ -2076,6 +2522,7 @@ void page_set_flags(target_ulong start, target_ulong end, int flags)
         flags |= PAGE_WRITE_ORG;
     }
 
+    tb_cache_lock();
     for (addr = start, len = end - start;
          len != 0;
          len -= TARGET_PAGE_SIZE, addr += TARGET_PAGE_SIZE) {
@@ -2090,6 +2537,7 @@ void page_set_flags(target_ulong start, target_ulong end, int flags)
         }
         p->flags = flags;
     }
+    tb_cache_unlock();
 }
 
 int page_check_range(target_ulong start, target_ulong len, int flags)
@@ -2154,9 +2602,11 @@ int page_unprotect(target_ulong address, uintptr_t pc, void *puc)
        know this only ever happens in a synchronous SEGV handler, so in
        practice it seems to be ok.  */
     mmap_lock();
+    tb_cache_lock();
 
     p = page_find(address >> TARGET_PAGE_BITS);
     if (!p) {
+        tb_cache_unlock();
         mmap_unlock();
         return 0;
     }
@@ -2183,9 +2633,11 @@ int page_unprotect(target_ulong address, uintptr_t pc, void *puc)
         mprotect((void *)g2h(host_start), qemu_host_page_size,
                  prot & PAGE_BITS);
 
+        tb_cache_unlock();
         mmap_unlock();
         return 1;
     }
+    tb_cache_unlock();
     mmap_unlock();
     return 0;
 }
@@ -2197,65 +2649,50 @@ int page_unprotect(target_ulong address, uintptr_t pc, void *puc)
 typedef struct subpage_t {
     MemoryRegion iomem;
     hwaddr base;
+    /* the snapshot whose sections sub_section[] indexes */
+    AddressSpaceDispatch *d;
     uint16_t sub_section[TARGET_PAGE_SIZE];
 } subpage_t;
 
 static int subpage_register (subpage_t *mmio, uint32_t start, uint32_t end,
                              uint16_t section);
-static subpage_t *subpage_init(hwaddr base);
-static void destroy_page_desc(uint16_t section_index)
-{
-    MemoryRegionSection *section = &phys_sections[section_index];
-    MemoryRegion *mr = section->mr;
-
-    if (mr->subpage) {
-        subpage_t *subpage = container_of(mr, subpage_t, iomem);
-        memory_region_destroy(&subpage->iomem);
-        g_free(subpage);
-    }
-}
+static subpage_t *subpage_init(AddressSpaceDispatch *d, hwaddr base);
+static AddressSpaceDispatch *mem_next_dispatch(AddressSpace *as);
 
-static void destroy_l2_mapping(PhysPageEntry *lp, unsigned level)
+static void address_space_dispatch_free(AddressSpaceDispatch *d)
 {
     unsigned i;
-    PhysPageEntry *p;
 
-    if (lp->ptr == PHYS_MAP_NODE_NIL) {
-        return;
-    }
+    /* subpages are private to the snapshot that created them */
+    for (i = 0; i < d->sections_nb; i++) {
+        MemoryRegion *mr = d->sections[i].mr;
 
-    p = phys_map_nodes[lp->ptr];
-    for (i = 0; i < L2_SIZE; ++i) {
-        if (!p[i].is_leaf) {
-            destroy_l2_mapping(&p[i], level - 1);
-        } else {
-            destroy_page_desc(p[i].ptr);
+        if (mr->subpage) {
+            subpage_t *subpage = container_of(mr, subpage_t, iomem);
+            memory_region_destroy(&subpage->iomem);
+            g_free(subpage);
         }
     }
-    lp->is_leaf = 0;
-    lp->ptr = PHYS_MAP_NODE_NIL;
+    g_free(d->nodes);
+    g_free(d->sections);
+    g_free(d);
 }
 
-static void destroy_all_mappings(AddressSpaceDispatch *d)
+static void address_space_dispatch_reclaim(struct rcu_head *rcu)
 {
-    destroy_l2_mapping(&d->phys_map, P_L2_LEVELS - 1);
-    phys_map_nodes_reset();
+    address_space_dispatch_free(container_of(rcu, AddressSpaceDispatch, rcu));
 }
 
-static uint16_t phys_section_add(MemoryRegionSection *section)
+static uint16_t phys_section_add(AddressSpaceDispatch *d,
+                                 MemoryRegionSection *section)
 {
-    if (phys_sections_nb == phys_sections_nb_alloc) {
-        phys_sections_nb_alloc = MAX(phys_sections_nb_alloc * 2, 16);
-        phys_sections = g_renew(MemoryRegionSection, phys_sections,
-                                phys_sections_nb_alloc);
+    if (d->sections_nb == d->sections_nb_alloc) {
+        d->sections_nb_alloc = MAX(d->sections_nb_alloc * 2, 16);
+        d->sections = g_renew(MemoryRegionSection, d->sections,
+                              d->sections_nb_alloc);
     }
-    phys_sections[phys_sections_nb] = *section;
-    return phys_sections_nb++;
-}
-
-static void phys_sections_clear(void)
-{
-    phys_sections_nb = 0;
+    d->sections[d->sections_nb] = *section;
+    return d->sections_nb++;
 }
 
 static void register_subpage(AddressSpaceDispatch *d, MemoryRegionSection *section)
@@ -2273,16 +2710,16 @@ static void register_subpage(AddressSpaceDispatch *d, MemoryRegionSection *secti
     assert(existing->mr->subpage || existing->mr == &io_mem_unassigned);
 
     if (!(existing->mr->subpage)) {
-        subpage = subpage_init(base);
+        subpage = subpage_init(d, base);
         subsection.mr = &subpage->iomem;
         phys_page_set(d, base >> TARGET_PAGE_BITS, 1,
-                      phys_section_add(&subsection));
+                      phys_section_add(d, &subsection));
     } else {
         subpage = container_of(existing->mr, subpage_t, iomem);
     }
     start = section->offset_within_address_space & ~TARGET_PAGE_MASK;
     end = start + section->size - 1;
-    subpage_register(subpage, start, end, phys_section_add(section));
+    subpage_register(subpage, start, end, phys_section_add(d, section));
 }
 
 
@@ -2291,7 +2728,7 @@ static void register_multipage(AddressSpaceDispatch *d, MemoryRegionSection *sec
     hwaddr start_addr = section->offset_within_address_space;
     ram_addr_t size = section->size;
     hwaddr addr;
-    uint16_t section_index = phys_section_add(section);
+    uint16_t section_index = phys_section_add(d, section);
 
     assert(size);
 
@@ -2302,7 +2739,8 @@ static void register_multipage(AddressSpaceDispatch *d, MemoryRegionSection *sec
 
 static void mem_add(MemoryListener *listener, MemoryRegionSection *section)
 {
-    AddressSpaceDispatch *d = container_of(listener, AddressSpaceDispatch, listener);
+    AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
+    AddressSpaceDispatch *d = mem_next_dispatch(as);
     MemoryRegionSection now = *section, remain = *section;
 
     if ((now.offset_within_address_space & ~TARGET_PAGE_MASK)
@@ -2334,15 +2772,89 @@ static void mem_add(MemoryListener *listener, MemoryRegionSection *section)
     }
 }
 
+/* Undo mem_add(): partial pages are cleared in their subpage, whole pages
+   in the map itself.  */
+static void mem_del(MemoryListener *listener, MemoryRegionSection *section)
+{
+    AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
+    AddressSpaceDispatch *d = mem_next_dispatch(as);
+    hwaddr addr = section->offset_within_address_space;
+    hwaddr size = section->size;
+    hwaddr start, len;
+    MemoryRegionSection *existing;
+
+    if (as->dispatch_rebuild) {
+        return;
+    }
+    while (size) {
+        start = addr & ~TARGET_PAGE_MASK;
+        len = MIN(TARGET_PAGE_SIZE - start, size);
+        if (len < TARGET_PAGE_SIZE) {
+            existing = phys_page_find(d, addr >> TARGET_PAGE_BITS);
+            assert(existing->mr->subpage);
+            subpage_register(container_of(existing->mr, subpage_t, iomem),
+                             start, start + len - 1, PHYS_SECTION_UNASSIGNED);
+        } else {
+            len = size & TARGET_PAGE_MASK;
+            phys_page_set(d, addr >> TARGET_PAGE_BITS,
+                          len >> TARGET_PAGE_BITS, PHYS_SECTION_UNASSIGNED);
+        }
+        addr += len;
+        size -= len;
+    }
+}
+
+static void mem_nop(MemoryListener *listener, MemoryRegionSection *section)
+{
+    AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
+
+    /* an unchanged range only matters when starting from scratch */
+    if (as->dispatch_rebuild) {
+        mem_add(listener, section);
+    }
+}
+
 void qemu_flush_coalesced_mmio_buffer(void)
 {
     if (kvm_enabled())
         kvm_flush_coalesced_mmio_buffer();
 }
 
+#ifdef __linux__
+#define RAM_ALIGN_DEFAULT (2 * 1024 * 1024)
+#else
+#define RAM_ALIGN_DEFAULT getpagesize()
+#endif
+
+/* Guest RAM blocks start at this alignment so that transparent hugepages
+ * can back all of a block, rather than only the huge page sized ranges that
+ * happen to be aligned in the host.
+ */
+static size_t ram_block_alignment(void)
+{
+    QemuOpts *opts;
+
+    opts = qemu_opts_find(qemu_find_opts("machine"), 0);
+    if (!opts) {
+        return RAM_ALIGN_DEFAULT;
+    }
+    return qemu_opt_get_size(opts, "ram-align", RAM_ALIGN_DEFAULT);
+}
+
+static void *ram_block_vmalloc(ram_addr_t size)
+{
+    size_t align = ram_block_alignment();
+
+    if (size < align) {
+        return qemu_vmalloc(size);
+    }
+    return qemu_memalign(align, size);
+}
+
 #if defined(__linux__) && !defined(TARGET_S390X)
 
 #include <sys/vfs.h>
+#include <sys/syscall.h>
 
 #define HUGETLBFS_MAGIC       0x958458f6
 
@@ -2366,16 +2878,44 @@ static long gethugepagesize(const char *path)
     return fs.f_bsize;
 }
 
+/* mmap() only guarantees page alignment, so reserve @align more address
+ * space than needed and map the memory at the aligned address within it.
+ */
+static void *ram_mmap_aligned(ram_addr_t size, size_t align, int flags, int fd)
+{
+    uint8_t *guard, *ptr;
+    size_t total = size + align;
+
+    if (size < align) {
+        return mmap(0, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+    }
+
+    guard = mmap(0, total, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (guard == MAP_FAILED) {
+        return MAP_FAILED;
+    }
+    ptr = (uint8_t *)QEMU_ALIGN_UP((uintptr_t)guard, align);
+    if (mmap(ptr, size, PROT_READ | PROT_WRITE, flags | MAP_FIXED,
+             fd, 0) == MAP_FAILED) {
+        munmap(guard, total);
+        return MAP_FAILED;
+    }
+    if (ptr > guard) {
+        munmap(guard, ptr - guard);
+    }
+    munmap(ptr + size, guard + total - (ptr + size));
+    return ptr;
+}
+
 static void *file_ram_alloc(RAMBlock *block,
                             ram_addr_t memory,
-                            const char *path)
+                            const char *path,
+                            bool share)
 {
     char *filename;
     void *area;
     int fd;
-#ifdef MAP_POPULATE
     int flags;
-#endif
     unsigned long hpagesize;
 
     hpagesize = gethugepagesize(path);
@@ -2421,30 +2961,112 @@ static void *file_ram_alloc(RAMBlock *block,
      * MAP_PRIVATE is requested.  For mem_prealloc we mmap as MAP_SHARED
      * to sidestep this quirk.
      */
-    flags = mem_prealloc ? MAP_POPULATE | MAP_SHARED : MAP_PRIVATE;
-    area = mmap(0, memory, PROT_READ | PROT_WRITE, flags, fd, 0);
-#else
-    area = mmap(0, memory, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (mem_prealloc) {
+        share = true;
+    }
+#endif
+    flags = share ? MAP_SHARED : MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    /* A single thread populating a huge guest takes minutes; with more
+     * than one prealloc thread the pages are touched in parallel below.
+     */
+    if (mem_prealloc && mem_prealloc_threads == 1) {
+        flags |= MAP_POPULATE;
+    }
 #endif
+    area = ram_mmap_aligned(memory, MAX(ram_block_alignment(), hpagesize),
+                            flags, fd);
     if (area == MAP_FAILED) {
         perror("file_ram_alloc: can't mmap RAM pages");
         close(fd);
         return (NULL);
     }
+    if (mem_prealloc && mem_prealloc_threads > 1 &&
+        os_mem_prealloc(area, memory, hpagesize, mem_prealloc_threads) < 0) {
+        fprintf(stderr, "file_ram_alloc: insufficient free host memory "
+                "pages available to preallocate guest RAM\n");
+        munmap(area, memory);
+        close(fd);
+        return NULL;
+    }
     block->fd = fd;
+    if (share) {
+        block->flags |= RAM_SHARED_MASK;
+    }
     return area;
 }
-#endif
 
-static ram_addr_t find_ram_offset(ram_addr_t size)
+static int qemu_memfd_create(const char *name)
 {
-    RAMBlock *block, *next_block;
-    ram_addr_t offset = RAM_ADDR_MAX, mingap = RAM_ADDR_MAX;
+    char *filename;
+    int fd;
 
-    if (QLIST_EMPTY(&ram_list.blocks))
-        return 0;
+#ifdef __NR_memfd_create
+    fd = syscall(__NR_memfd_create, name, 1 /* MFD_CLOEXEC */);
+    if (fd >= 0) {
+        return fd;
+    }
+#endif
 
-    QLIST_FOREACH(block, &ram_list.blocks, next) {
+    /* Older hosts: fall back to an unlinked file on the tmpfs mount */
+    if (asprintf(&filename, "/dev/shm/%s.XXXXXX", name) == -1) {
+        return -1;
+    }
+    fd = mkstemp(filename);
+    if (fd >= 0) {
+        unlink(filename);
+    }
+    free(filename);
+    return fd;
+}
+
+/* Anonymous guest memory that can still be handed to another process:
+ * a MAP_SHARED mapping of a memfd (or tmpfs file) kept in block->fd.
+ */
+static void *shared_ram_alloc(RAMBlock *block, ram_addr_t memory)
+{
+    void *area;
+    int fd;
+
+    if (kvm_enabled() && !kvm_has_sync_mmu()) {
+        fprintf(stderr, "host lacks kvm mmu notifiers, "
+                "shared guest memory unsupported\n");
+        return NULL;
+    }
+
+    fd = qemu_memfd_create("qemu_ram");
+    if (fd < 0) {
+        perror("unable to create backing store for shared memory");
+        return NULL;
+    }
+
+    if (ftruncate(fd, memory)) {
+        perror("ftruncate");
+        close(fd);
+        return NULL;
+    }
+
+    area = ram_mmap_aligned(memory, ram_block_alignment(), MAP_SHARED, fd);
+    if (area == MAP_FAILED) {
+        perror("shared_ram_alloc: can't mmap RAM pages");
+        close(fd);
+        return NULL;
+    }
+    block->fd = fd;
+    block->flags |= RAM_SHARED_MASK;
+    return area;
+}
+#endif
+
+static ram_addr_t find_ram_offset(ram_addr_t size)
+{
+    RAMBlock *block, *next_block;
+    ram_addr_t offset = RAM_ADDR_MAX, mingap = RAM_ADDR_MAX;
+
+    if (QLIST_EMPTY(&ram_list.blocks))
+        return 0;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
         ram_addr_t end, next = RAM_ADDR_MAX;
 
         end = block->offset + block->length;
@@ -2530,39 +3152,248 @@ void qemu_ram_set_idstr(ram_addr_t addr, const char *name, DeviceState *dev)
     }
 }
 
-static int memory_try_enable_merging(void *addr, size_t len)
+#if defined(__linux__) && !defined(TARGET_S390X)
+static bool memory_share_enabled(void)
+{
+    QemuOpts *opts;
+
+    opts = qemu_opts_find(qemu_find_opts("machine"), 0);
+    return opts && qemu_opt_get_bool(opts, "mem-share", false);
+}
+#endif
+
+static bool memory_merge_default(void)
 {
     QemuOpts *opts;
 
     opts = qemu_opts_find(qemu_find_opts("machine"), 0);
-    if (opts && !qemu_opt_get_bool(opts, "mem-merge", true)) {
-        /* disabled by the user */
-        return 0;
+    return !opts || qemu_opt_get_bool(opts, "mem-merge", true);
+}
+
+static bool memory_hugepage_default(void)
+{
+    QemuOpts *opts;
+
+    opts = qemu_opts_find(qemu_find_opts("machine"), 0);
+    return !opts || qemu_opt_get_bool(opts, "thp", true);
+}
+
+/* KSM only scans private anonymous memory */
+static bool ram_block_mergeable(RAMBlock *block)
+{
+    if (block->flags & (RAM_PREALLOC_MASK | RAM_SHARED_MASK)) {
+        return false;
     }
+#if defined(__linux__) && !defined(TARGET_S390X)
+    if (block->fd >= 0) {
+        return false;
+    }
+#endif
+    return true;
+}
 
-    return qemu_madvise(addr, len, QEMU_MADV_MERGEABLE);
+/* KSM splits the huge pages it merges, so a block should usually be either
+ * mergeable or backed by transparent hugepages; both are chosen per block.
+ */
+static void ram_block_advise(RAMBlock *block, void *addr, ram_addr_t len)
+{
+    qemu_madvise(addr, len, block->flags & RAM_MERGEABLE_MASK ?
+                 QEMU_MADV_MERGEABLE : QEMU_MADV_UNMERGEABLE);
+    qemu_madvise(addr, len, block->flags & RAM_HUGEPAGE_MASK ?
+                 QEMU_MADV_HUGEPAGE : QEMU_MADV_NOHUGEPAGE);
 }
 
-ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
-                                   MemoryRegion *mr)
+/* Sorted arrays over ram_list.blocks for lookups by ram_addr_t or by host
+ * pointer.  An index is never modified once published; adding or removing
+ * a block publishes a new one, so lookups only need an RCU critical section
+ * and never touch the list itself.
+ */
+typedef struct RAMBlockIndex {
+    struct rcu_head rcu;
+    RAMBlock **by_offset;
+    unsigned nb;
+    RAMBlock **by_host;         /* only blocks that have a host mapping */
+    unsigned nb_host;
+    RAMBlock *retired;          /* freed together with the index */
+} RAMBlockIndex;
+
+static RAMBlockIndex *ram_block_index;
+
+static int ram_block_cmp_offset(const void *a_, const void *b_)
+{
+    const RAMBlock *a = *(RAMBlock * const *)a_;
+    const RAMBlock *b = *(RAMBlock * const *)b_;
+
+    return a->offset < b->offset ? -1 : a->offset > b->offset;
+}
+
+static int ram_block_cmp_host(const void *a_, const void *b_)
+{
+    const RAMBlock *a = *(RAMBlock * const *)a_;
+    const RAMBlock *b = *(RAMBlock * const *)b_;
+
+    return a->host < b->host ? -1 : a->host > b->host;
+}
+
+static void ram_block_index_reclaim(struct rcu_head *rcu)
+{
+    RAMBlockIndex *index = container_of(rcu, RAMBlockIndex, rcu);
+
+    g_free(index->retired);
+    g_free(index->by_offset);
+    g_free(index->by_host);
+    g_free(index);
+}
+
+/* Publish an index for the current contents of ram_list.blocks.  @retired,
+   if not NULL, has just been removed from the list; it is freed once no
+   lookup can be using the previous index anymore.  */
+static void ram_block_index_update(RAMBlock *retired)
+{
+    RAMBlockIndex *old = ram_block_index;
+    RAMBlockIndex *index = g_new0(RAMBlockIndex, 1);
+    RAMBlock *block;
+    unsigned n = 0;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        n++;
+    }
+    index->by_offset = g_new(RAMBlock *, n);
+    index->by_host = g_new(RAMBlock *, n);
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        index->by_offset[index->nb++] = block;
+        if (block->host) {
+            index->by_host[index->nb_host++] = block;
+        }
+    }
+    qsort(index->by_offset, index->nb, sizeof(RAMBlock *),
+          ram_block_cmp_offset);
+    qsort(index->by_host, index->nb_host, sizeof(RAMBlock *),
+          ram_block_cmp_host);
+
+    atomic_rcu_set(&ram_block_index, index);
+    if (old) {
+        old->retired = retired;
+        call_rcu(&old->rcu, ram_block_index_reclaim);
+    } else {
+        g_free(retired);
+    }
+}
+
+/* Must be called inside an RCU critical section.  */
+static RAMBlock *ram_block_find(ram_addr_t addr)
+{
+    RAMBlockIndex *index = atomic_rcu_read(&ram_block_index);
+    unsigned lo = 0, hi = index ? index->nb : 0;
+
+    while (lo < hi) {
+        unsigned mid = (lo + hi) / 2;
+        RAMBlock *block = index->by_offset[mid];
+
+        if (addr < block->offset) {
+            hi = mid;
+        } else if (addr - block->offset < block->length) {
+            return block;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return NULL;
+}
+
+/* Must be called inside an RCU critical section.  */
+static RAMBlock *ram_block_find_host(uint8_t *host)
+{
+    RAMBlockIndex *index = atomic_rcu_read(&ram_block_index);
+    unsigned lo = 0, hi = index ? index->nb_host : 0;
+
+    while (lo < hi) {
+        unsigned mid = (lo + hi) / 2;
+        RAMBlock *block = index->by_host[mid];
+
+        if (host < block->host) {
+            hi = mid;
+        } else if (host - block->host < block->length) {
+            return block;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return NULL;
+}
+
+static ram_addr_t ram_block_add(RAMBlock *new_block)
+{
+    ram_addr_t size = new_block->length;
+    unsigned long old_pages, new_pages;
+    unsigned client;
+
+    old_pages = last_ram_offset() >> TARGET_PAGE_BITS;
+    QLIST_INSERT_HEAD(&ram_list.blocks, new_block, next);
+    ram_block_index_update(NULL);
+    new_pages = last_ram_offset() >> TARGET_PAGE_BITS;
+
+    if (new_pages > old_pages) {
+        for (client = 0; client < DIRTY_MEMORY_NUM; client++) {
+            ram_list.dirty_memory[client] =
+                g_realloc(ram_list.dirty_memory[client],
+                          BITS_TO_LONGS(new_pages) * sizeof(unsigned long));
+            /* the new words are undefined; the block below sets its bits */
+            memset(ram_list.dirty_memory[client] + BITS_TO_LONGS(old_pages),
+                   0, (BITS_TO_LONGS(new_pages) - BITS_TO_LONGS(old_pages)) *
+                   sizeof(unsigned long));
+        }
+    }
+    cpu_physical_memory_set_dirty_range(new_block->offset, size);
+
+    qemu_ram_setup_dump(new_block->host, size);
+    if (memory_merge_default() && ram_block_mergeable(new_block)) {
+        new_block->flags |= RAM_MERGEABLE_MASK;
+    }
+    if (memory_hugepage_default()) {
+        new_block->flags |= RAM_HUGEPAGE_MASK;
+    }
+    if (new_block->host) {
+        ram_block_advise(new_block, new_block->host, size);
+    }
+
+    if (kvm_enabled())
+        kvm_setup_guest_memory(new_block->host, size);
+
+    return new_block->offset;
+}
+
+static RAMBlock *ram_block_new(ram_addr_t size, MemoryRegion *mr)
 {
     RAMBlock *new_block;
 
-    size = TARGET_PAGE_ALIGN(size);
     new_block = g_malloc0(sizeof(*new_block));
-
     new_block->mr = mr;
     new_block->offset = find_ram_offset(size);
+    new_block->length = size;
+#if defined(__linux__) && !defined(TARGET_S390X)
+    new_block->fd = -1;
+#endif
+    return new_block;
+}
+
+ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
+                                   MemoryRegion *mr)
+{
+    RAMBlock *new_block;
+
+    size = TARGET_PAGE_ALIGN(size);
+    new_block = ram_block_new(size, mr);
     if (host) {
         new_block->host = host;
         new_block->flags |= RAM_PREALLOC_MASK;
     } else {
         if (mem_path) {
 #if defined (__linux__) && !defined(TARGET_S390X)
-            new_block->host = file_ram_alloc(new_block, size, mem_path);
+            new_block->host = file_ram_alloc(new_block, size, mem_path,
+                                             memory_share_enabled());
             if (!new_block->host) {
-                new_block->host = qemu_vmalloc(size);
-                memory_try_enable_merging(new_block->host, size);
+                new_block->host = ram_block_vmalloc(size);
             }
 #else
             fprintf(stderr, "-mem-path option unsupported\n");
@@ -2571,32 +3402,54 @@ ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
         } else {
             if (xen_enabled()) {
                 xen_ram_alloc(new_block->offset, size, mr);
+#if defined(__linux__) && !defined(TARGET_S390X)
+            } else if (memory_share_enabled() &&
+                       (new_block->host = shared_ram_alloc(new_block, size))) {
+                ;
+#endif
+#ifdef TARGET_S390X
             } else if (kvm_enabled()) {
                 /* some s390/kvm configurations have special constraints */
                 new_block->host = kvm_vmalloc(size);
+#endif
             } else {
-                new_block->host = qemu_vmalloc(size);
+                new_block->host = ram_block_vmalloc(size);
             }
-            memory_try_enable_merging(new_block->host, size);
         }
     }
-    new_block->length = size;
 
-    QLIST_INSERT_HEAD(&ram_list.blocks, new_block, next);
+    return ram_block_add(new_block);
+}
 
-    ram_list.phys_dirty = g_realloc(ram_list.phys_dirty,
-                                       last_ram_offset() >> TARGET_PAGE_BITS);
-    memset(ram_list.phys_dirty + (new_block->offset >> TARGET_PAGE_BITS),
-           0, size >> TARGET_PAGE_BITS);
-    cpu_physical_memory_set_dirty_range(new_block->offset, size, 0xff);
+ram_addr_t qemu_ram_alloc_from_file(ram_addr_t size, MemoryRegion *mr,
+                                    const char *path, bool share)
+{
+#if defined(__linux__) && !defined(TARGET_S390X)
+    RAMBlock *new_block;
 
-    qemu_ram_setup_dump(new_block->host, size);
-    qemu_madvise(new_block->host, size, QEMU_MADV_HUGEPAGE);
+    if (xen_enabled()) {
+        fprintf(stderr, "file-backed guest memory unsupported with Xen\n");
+        return RAM_ADDR_MAX;
+    }
 
-    if (kvm_enabled())
-        kvm_setup_guest_memory(new_block->host, size);
+    size = TARGET_PAGE_ALIGN(size);
+    new_block = ram_block_new(size, mr);
+    if (path) {
+        new_block->host = file_ram_alloc(new_block, size, path, share);
+    } else {
+        assert(share);
+        new_block->host = shared_ram_alloc(new_block, size);
+    }
+    if (!new_block->host) {
+        g_free(new_block);
+        return RAM_ADDR_MAX;
+    }
 
-    return new_block->offset;
+    return ram_block_add(new_block);
+#else
+    fprintf(stderr, "file-backed guest memory unsupported on this host\n");
+    return RAM_ADDR_MAX;
+#endif
 }
 
 ram_addr_t qemu_ram_alloc(ram_addr_t size, MemoryRegion *mr)
@@ -2604,6 +3457,106 @@ ram_addr_t qemu_ram_alloc(ram_addr_t size, MemoryRegion *mr)
     return qemu_ram_alloc_from_ptr(size, NULL, mr);
 }
 
+void qemu_ram_set_advice(ram_addr_t addr, bool merge, bool hugepage)
+{
+    RAMBlock *block;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (block->offset == addr) {
+            block->flags &= ~(RAM_MERGEABLE_MASK | RAM_HUGEPAGE_MASK);
+            if (merge && ram_block_mergeable(block)) {
+                block->flags |= RAM_MERGEABLE_MASK;
+            }
+            if (hugepage) {
+                block->flags |= RAM_HUGEPAGE_MASK;
+            }
+            if (block->host) {
+                ram_block_advise(block, block->host, block->length);
+            }
+            return;
+        }
+    }
+}
+
+#ifdef __linux__
+/* Sum up the transparent huge pages of the mappings that overlap the block.
+ * Blocks get mappings of their own, so only the alignment slack around a
+ * block can be counted in excess, and it is never touched.
+ */
+static uint64_t ram_block_thp_size(RAMBlock *block)
+{
+    uintptr_t start = (uintptr_t)block->host;
+    uintptr_t end = start + block->length;
+    unsigned long map_start = 0, map_end = 0;
+    uint64_t total = 0, kb;
+    char line[256];
+    FILE *f;
+
+    f = fopen("/proc/self/smaps", "r");
+    if (!f) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long s, e;
+
+        if (sscanf(line, "%lx-%lx ", &s, &e) == 2) {
+            map_start = s;
+            map_end = e;
+            continue;
+        }
+        if (map_start >= end || map_end <= start) {
+            continue;
+        }
+        if (sscanf(line, "AnonHugePages: %" SCNu64 " kB", &kb) == 1 ||
+            sscanf(line, "ShmemPmdMapped: %" SCNu64 " kB", &kb) == 1) {
+            total += kb * 1024;
+        }
+    }
+    fclose(f);
+
+    return MIN(total, block->length);
+}
+#else
+static uint64_t ram_block_thp_size(RAMBlock *block)
+{
+    return 0;
+}
+#endif
+
+RamBlockInfoList *qmp_query_ram_blocks(Error **errp)
+{
+    RamBlockInfoList *head = NULL, **tail = &head;
+    RAMBlock *block;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        RamBlockInfoList *entry = g_malloc0(sizeof(*entry));
+        RamBlockInfo *info = g_malloc0(sizeof(*info));
+        uintptr_t host = (uintptr_t)block->host;
+
+        info->name = g_strdup(block->idstr);
+        info->size = block->length;
+        /* the largest power of two dividing the address, at most 1 GiB */
+        info->align = host ? MIN(host & -host, 1 << 30) : 0;
+        info->merge = !!(block->flags & RAM_MERGEABLE_MASK);
+        info->hugepage = !!(block->flags & RAM_HUGEPAGE_MASK);
+        info->thp_size = host ? ram_block_thp_size(block) : 0;
+        entry->value = info;
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    return head;
+}
+
+void qemu_ram_foreach_block(RAMBlockIterFunc func, void *opaque)
+{
+    RAMBlock *block;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        func(block->host, block->offset, block->length, opaque);
+    }
+}
+
 void qemu_ram_free_from_ptr(ram_addr_t addr)
 {
     RAMBlock *block;
@@ -2611,7 +3564,7 @@ void qemu_ram_free_from_ptr(ram_addr_t addr)
     QLIST_FOREACH(block, &ram_list.blocks, next) {
         if (addr == block->offset) {
             QLIST_REMOVE(block, next);
-            g_free(block);
+            ram_block_index_update(block);
             return;
         }
     }
@@ -2626,14 +3579,14 @@ void qemu_ram_free(ram_addr_t addr)
             QLIST_REMOVE(block, next);
             if (block->flags & RAM_PREALLOC_MASK) {
                 ;
+#if defined(__linux__) && !defined(TARGET_S390X)
+            } else if (block->fd >= 0) {
+                munmap(block->host, block->length);
+                close(block->fd);
+#endif
             } else if (mem_path) {
 #if defined (__linux__) && !defined(TARGET_S390X)
-                if (block->fd) {
-                    munmap(block->host, block->length);
-                    close(block->fd);
-                } else {
-                    qemu_vfree(block->host);
-                }
+                qemu_vfree(block->host);
 #else
                 abort();
 #endif
@@ -2648,7 +3601,7 @@ void qemu_ram_free(ram_addr_t addr)
                 }
 #endif
             }
-            g_free(block);
+            ram_block_index_update(block);
             return;
         }
     }
@@ -2672,22 +3625,24 @@ void qemu_ram_remap(ram_addr_t addr, ram_addr_t length)
             } else {
                 flags = MAP_FIXED;
                 munmap(vaddr, length);
-                if (mem_path) {
 #if defined(__linux__) && !defined(TARGET_S390X)
-                    if (block->fd) {
+                if (block->fd >= 0) {
+                    flags |= block->flags & RAM_SHARED_MASK ? MAP_SHARED :
+                        MAP_PRIVATE;
 #ifdef MAP_POPULATE
-                        flags |= mem_prealloc ? MAP_POPULATE | MAP_SHARED :
-                            MAP_PRIVATE;
-#else
-                        flags |= MAP_PRIVATE;
-#endif
-                        area = mmap(vaddr, length, PROT_READ | PROT_WRITE,
-                                    flags, block->fd, offset);
-                    } else {
-                        flags |= MAP_PRIVATE | MAP_ANONYMOUS;
-                        area = mmap(vaddr, length, PROT_READ | PROT_WRITE,
-                                    flags, -1, 0);
+                    if (mem_prealloc) {
+                        flags |= MAP_POPULATE;
                     }
+#endif
+                    area = mmap(vaddr, length, PROT_READ | PROT_WRITE,
+                                flags, block->fd, offset);
+                } else
+#endif
+                if (mem_path) {
+#if defined(__linux__) && !defined(TARGET_S390X)
+                    flags |= MAP_PRIVATE | MAP_ANONYMOUS;
+                    area = mmap(vaddr, length, PROT_READ | PROT_WRITE,
+                                flags, -1, 0);
 #else
                     abort();
 #endif
@@ -2708,7 +3663,7 @@ void qemu_ram_remap(ram_addr_t addr, ram_addr_t length)
                             length, addr);
                     exit(1);
                 }
-                memory_try_enable_merging(vaddr, length);
+                ram_block_advise(block, vaddr, length);
                 qemu_ram_setup_dump(vaddr, length);
             }
             return;
@@ -2728,65 +3683,39 @@ void qemu_ram_remap(ram_addr_t addr, ram_addr_t length)
 void *qemu_get_ram_ptr(ram_addr_t addr)
 {
     RAMBlock *block;
+    void *ptr;
 
-    QLIST_FOREACH(block, &ram_list.blocks, next) {
-        if (addr - block->offset < block->length) {
-            /* Move this entry to to start of the list.  */
-            if (block != QLIST_FIRST(&ram_list.blocks)) {
-                QLIST_REMOVE(block, next);
-                QLIST_INSERT_HEAD(&ram_list.blocks, block, next);
-            }
-            if (xen_enabled()) {
-                /* We need to check if the requested address is in the RAM
-                 * because we don't want to map the entire memory in QEMU.
-                 * In that case just map until the end of the page.
-                 */
-                if (block->offset == 0) {
-                    return xen_map_cache(addr, 0, 0);
-                } else if (block->host == NULL) {
-                    block->host =
-                        xen_map_cache(block->offset, block->length, 1);
-                }
-            }
-            return block->host + (addr - block->offset);
+    rcu_read_lock();
+    block = ram_block_find(addr);
+    if (!block) {
+        fprintf(stderr, "Bad ram offset %" PRIx64 "\n", (uint64_t)addr);
+        abort();
+    }
+    if (xen_enabled()) {
+        /* We need to check if the requested address is in the RAM
+         * because we don't want to map the entire memory in QEMU.
+         * In that case just map until the end of the page.
+         */
+        if (block->offset == 0) {
+            ptr = xen_map_cache(addr, 0, 0);
+            rcu_read_unlock();
+            return ptr;
+        } else if (block->host == NULL) {
+            block->host =
+                xen_map_cache(block->offset, block->length, 1);
         }
     }
-
-    fprintf(stderr, "Bad ram offset %" PRIx64 "\n", (uint64_t)addr);
-    abort();
-
-    return NULL;
+    ptr = block->host + (addr - block->offset);
+    rcu_read_unlock();
+    return ptr;
 }
 
 /* Return a host pointer to ram allocated with qemu_ram_alloc.
- * Same as qemu_get_ram_ptr but avoid reordering ramblocks.
+ * Lookups no longer reorder ramblocks, so this is qemu_get_ram_ptr.
  */
 static void *qemu_safe_ram_ptr(ram_addr_t addr)
 {
-    RAMBlock *block;
-
-    QLIST_FOREACH(block, &ram_list.blocks, next) {
-        if (addr - block->offset < block->length) {
-            if (xen_enabled()) {
-                /* We need to check if the requested address is in the RAM
-                 * because we don't want to map the entire memory in QEMU.
-                 * In that case just map until the end of the page.
-                 */
-                if (block->offset == 0) {
-                    return xen_map_cache(addr, 0, 0);
-                } else if (block->host == NULL) {
-                    block->host =
-                        xen_map_cache(block->offset, block->length, 1);
-                }
-            }
-            return block->host + (addr - block->offset);
-        }
-    }
-
-    fprintf(stderr, "Bad ram offset %" PRIx64 "\n", (uint64_t)addr);
-    abort();
-
-    return NULL;
+    return qemu_get_ram_ptr(addr);
 }
 
 /* Return a host pointer to guest's ram. Similar to qemu_get_ram_ptr
@@ -2800,17 +3729,19 @@ static void *qemu_ram_ptr_length(ram_addr_t addr, ram_addr_t *size)
         return xen_map_cache(addr, *size, 1);
     } else {
         RAMBlock *block;
+        void *ptr;
 
-        QLIST_FOREACH(block, &ram_list.blocks, next) {
-            if (addr - block->offset < block->length) {
-                if (addr - block->offset + *size > block->length)
-                    *size = block->length - addr + block->offset;
-                return block->host + (addr - block->offset);
-            }
+        rcu_read_lock();
+        block = ram_block_find(addr);
+        if (!block) {
+            fprintf(stderr, "Bad ram offset %" PRIx64 "\n", (uint64_t)addr);
+            abort();
         }
-
-        fprintf(stderr, "Bad ram offset %" PRIx64 "\n", (uint64_t)addr);
-        abort();
+        if (addr - block->offset + *size > block->length)
+            *size = block->length - addr + block->offset;
+        ptr = block->host + (addr - block->offset);
+        rcu_read_unlock();
+        return ptr;
     }
 }
 
@@ -2829,17 +3760,61 @@ int qemu_ram_addr_from_host(void *ptr, ram_addr_t *ram_addr)
         return 0;
     }
 
+    rcu_read_lock();
+    block = ram_block_find_host(host);
+    if (block) {
+        *ram_addr = block->offset + (host - block->host);
+    }
+    rcu_read_unlock();
+
+    return block ? 0 : -1;
+}
+
+/* Return the file descriptor of a shared RAM mapping containing the host
+ * address ptr and store the offset of ptr into the file in *offset.  This
+ * lets other processes map guest memory.  Returns -1 if ptr is not backed by
+ * a shared file mapping.
+ */
+int qemu_get_ram_fd(void *ptr, ram_addr_t *offset)
+{
+#if defined(__linux__) && !defined(TARGET_S390X)
+    RAMBlock *block;
+    uint8_t *host = ptr;
+
     QLIST_FOREACH(block, &ram_list.blocks, next) {
-        /* This case append when the block is not mapped. */
         if (block->host == NULL) {
             continue;
         }
-        if (host - block->host < block->length) {
-            *ram_addr = block->offset + (host - block->host);
-            return 0;
+        if (host >= block->host && host - block->host < block->length) {
+            if (block->fd < 0 || !(block->flags & RAM_SHARED_MASK)) {
+                return -1;
+            }
+            *offset = host - block->host;
+            return block->fd;
         }
     }
+#endif
+    return -1;
+}
+
+/* Return the file descriptor of the shared RAM block registered at addr.
+ * The block is mapped from offset 0 of the file.  Returns -1 if the block is
+ * not backed by a shared file mapping.
+ */
+int qemu_ram_get_fd(ram_addr_t addr)
+{
+#if defined(__linux__) && !defined(TARGET_S390X)
+    RAMBlock *block;
 
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (addr - block->offset < block->length) {
+            if (block->fd < 0 || !(block->flags & RAM_SHARED_MASK)) {
+                return -1;
+            }
+            return block->fd;
+        }
+    }
+#endif
     return -1;
 }
 
@@ -2912,12 +3887,9 @@ static const MemoryRegionOps rom_mem_ops = {
 static void notdirty_mem_write(void *opaque, hwaddr ram_addr,
                                uint64_t val, unsigned size)
 {
-    int dirty_flags;
-    dirty_flags = cpu_physical_memory_get_dirty_flags(ram_addr);
-    if (!(dirty_flags & CODE_DIRTY_FLAG)) {
+    if (!cpu_physical_memory_get_dirty_flag(ram_addr, DIRTY_MEMORY_CODE)) {
 #if !defined(CONFIG_USER_ONLY)
         tb_invalidate_phys_page_fast(ram_addr, size);
-        dirty_flags = cpu_physical_memory_get_dirty_flags(ram_addr);
 #endif
     }
     switch (size) {
@@ -2933,11 +3905,10 @@ static void notdirty_mem_write(void *opaque, hwaddr ram_addr,
     default:
         abort();
     }
-    dirty_flags |= (0xff & ~CODE_DIRTY_FLAG);
-    cpu_physical_memory_set_dirty_flags(ram_addr, dirty_flags);
+    cpu_physical_memory_set_dirty_nocode(ram_addr);
     /* we remove the notdirty callback only if the code has been
        flushed */
-    if (dirty_flags == 0xff)
+    if (cpu_physical_memory_is_dirty(ram_addr))
         tlb_set_dirty(cpu_single_env, cpu_single_env->mem_io_vaddr);
 }
 
@@ -2971,6 +3942,8 @@ static void check_watchpoint(int offset, int len_mask, int flags)
             wp->flags |= BP_WATCHPOINT_HIT;
             if (!env->watchpoint_hit) {
                 env->watchpoint_hit = wp;
+                /* dropped by cpu_exec after the longjmp below */
+                tb_cache_lock();
                 tb = tb_find_pc(env->mem_io_pc);
                 if (!tb) {
                     cpu_abort(env, "check_watchpoint: could not find TB for "
@@ -3043,7 +4016,7 @@ static uint64_t subpage_read(void *opaque, hwaddr addr,
            mmio, len, addr, idx);
 #endif
 
-    section = &phys_sections[mmio->sub_section[idx]];
+    section = &mmio->d->sections[mmio->sub_section[idx]];
     addr += mmio->base;
     addr -= section->offset_within_address_space;
     addr += section->offset_within_region;
@@ -3062,7 +4035,7 @@ static void subpage_write(void *opaque, hwaddr addr,
            __func__, mmio, len, addr, idx, value);
 #endif
 
-    section = &phys_sections[mmio->sub_section[idx]];
+    section = &mmio->d->sections[mmio->sub_section[idx]];
     addr += mmio->base;
     addr -= section->offset_within_address_space;
     addr += section->offset_within_region;
@@ -3120,10 +4093,10 @@ static int subpage_register (subpage_t *mmio, uint32_t start, uint32_t end,
     printf("%s: %p start %08x end %08x idx %08x eidx %08x mem %ld\n", __func__,
            mmio, start, end, idx, eidx, memory);
 #endif
-    if (memory_region_is_ram(phys_sections[section].mr)) {
-        MemoryRegionSection new_section = phys_sections[section];
+    if (memory_region_is_ram(mmio->d->sections[section].mr)) {
+        MemoryRegionSection new_section = mmio->d->sections[section];
         new_section.mr = &io_mem_subpage_ram;
-        section = phys_section_add(&new_section);
+        section = phys_section_add(mmio->d, &new_section);
     }
     for (; idx <= eidx; idx++) {
         mmio->sub_section[idx] = section;
@@ -3132,13 +4105,14 @@ static int subpage_register (subpage_t *mmio, uint32_t start, uint32_t end,
     return 0;
 }
 
-static subpage_t *subpage_init(hwaddr base)
+static subpage_t *subpage_init(AddressSpaceDispatch *d, hwaddr base)
 {
     subpage_t *mmio;
 
     mmio = g_malloc0(sizeof(subpage_t));
 
     mmio->base = base;
+    mmio->d = d;
     memory_region_init_io(&mmio->iomem, &subpage_ops, mmio,
                           "subpage", TARGET_PAGE_SIZE);
     mmio->iomem.subpage = true;
@@ -3146,12 +4120,12 @@ static subpage_t *subpage_init(hwaddr base)
     printf("%s: %p base " TARGET_FMT_plx " len %08x %d\n", __func__,
            mmio, base, TARGET_PAGE_SIZE, subpage_memory);
 #endif
-    subpage_register(mmio, 0, TARGET_PAGE_SIZE-1, phys_section_unassigned);
+    subpage_register(mmio, 0, TARGET_PAGE_SIZE-1, PHYS_SECTION_UNASSIGNED);
 
     return mmio;
 }
 
-static uint16_t dummy_section(MemoryRegion *mr)
+static uint16_t dummy_section(AddressSpaceDispatch *d, MemoryRegion *mr)
 {
     MemoryRegionSection section = {
         .mr = mr,
@@ -3160,12 +4134,14 @@ static uint16_t dummy_section(MemoryRegion *mr)
         .size = UINT64_MAX,
     };
 
-    return phys_section_add(&section);
+    return phys_section_add(d, &section);
 }
 
-MemoryRegion *iotlb_to_region(hwaddr index)
+/* env->memory_dispatch is the snapshot the iotlb entries were computed
+   from; it is switched together with the TLB flush in tcg_commit().  */
+MemoryRegion *iotlb_to_region(CPUArchState *env, hwaddr index)
 {
-    return phys_sections[index & ~TARGET_PAGE_MASK].mr;
+    return env->memory_dispatch->sections[index & ~TARGET_PAGE_MASK].mr;
 }
 
 static void io_mem_init(void)
@@ -3182,24 +4158,108 @@ static void io_mem_init(void)
                           "watch", UINT64_MAX);
 }
 
+/* A snapshot that holds nothing but the fixed sections */
+static AddressSpaceDispatch *address_space_dispatch_new(void)
+{
+    AddressSpaceDispatch *d = g_new0(AddressSpaceDispatch, 1);
+    uint16_t n;
+
+    d->phys_map = (PhysPageEntry) { .ptr = PHYS_MAP_NODE_NIL, .is_leaf = 0 };
+    n = dummy_section(d, &io_mem_unassigned);
+    assert(n == PHYS_SECTION_UNASSIGNED);
+    n = dummy_section(d, &io_mem_notdirty);
+    assert(n == PHYS_SECTION_NOTDIRTY);
+    n = dummy_section(d, &io_mem_rom);
+    assert(n == PHYS_SECTION_ROM);
+    n = dummy_section(d, &io_mem_watch);
+    assert(n == PHYS_SECTION_WATCH);
+    return d;
+}
+
+/* A private copy of @old to be patched.  Subpages belong to the snapshot
+   that uses them, so they are copied as well.  */
+static AddressSpaceDispatch *address_space_dispatch_copy(AddressSpaceDispatch *old)
+{
+    AddressSpaceDispatch *d = g_new0(AddressSpaceDispatch, 1);
+    unsigned i;
+
+    d->phys_map = old->phys_map;
+    d->nodes = g_memdup(old->nodes, old->nodes_nb * sizeof(Node));
+    d->nodes_nb = d->nodes_nb_alloc = old->nodes_nb;
+    d->sections = g_memdup(old->sections,
+                           old->sections_nb * sizeof(MemoryRegionSection));
+    d->sections_nb = d->sections_nb_alloc = old->sections_nb;
+    d->rebuild_nodes_nb = old->rebuild_nodes_nb;
+    d->rebuild_sections_nb = old->rebuild_sections_nb;
+
+    for (i = 0; i < d->sections_nb; i++) {
+        MemoryRegion *mr = d->sections[i].mr;
+
+        if (mr->subpage) {
+            subpage_t *old_subpage = container_of(mr, subpage_t, iomem);
+            subpage_t *subpage = subpage_init(d, old_subpage->base);
+
+            memcpy(subpage->sub_section, old_subpage->sub_section,
+                   sizeof(subpage->sub_section));
+            d->sections[i].mr = &subpage->iomem;
+        }
+    }
+    return d;
+}
+
+/* The snapshot being built by the current transaction.  It is only
+   created when the first range of the address space is added or removed,
+   so that address spaces that did not change keep their snapshot.  */
+static AddressSpaceDispatch *mem_next_dispatch(AddressSpace *as)
+{
+    if (!as->next_dispatch) {
+        if (as->dispatch_rebuild) {
+            as->next_dispatch = address_space_dispatch_new();
+        } else {
+            as->next_dispatch = address_space_dispatch_copy(as->dispatch);
+        }
+    }
+    return as->next_dispatch;
+}
+
 static void mem_begin(MemoryListener *listener)
 {
-    AddressSpaceDispatch *d = container_of(listener, AddressSpaceDispatch, listener);
+    AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
+    AddressSpaceDispatch *cur = as->dispatch;
 
-    destroy_all_mappings(d);
-    d->phys_map.ptr = PHYS_MAP_NODE_NIL;
+    /* Start over once unreachable nodes or sections make up about half of
+       the snapshot, or when the 15-bit indices start running out.  */
+    as->dispatch_rebuild = !cur
+        || cur->nodes_nb > 2 * cur->rebuild_nodes_nb + 64
+        || cur->sections_nb > 2 * cur->rebuild_sections_nb + 64
+        || cur->nodes_nb > PHYS_MAP_NODE_NIL / 2
+        || cur->sections_nb > PHYS_MAP_NODE_NIL / 2;
+    as->next_dispatch = NULL;
 }
 
-static void core_begin(MemoryListener *listener)
+static void mem_commit(MemoryListener *listener)
 {
-    phys_sections_clear();
-    phys_section_unassigned = dummy_section(&io_mem_unassigned);
-    phys_section_notdirty = dummy_section(&io_mem_notdirty);
-    phys_section_rom = dummy_section(&io_mem_rom);
-    phys_section_watch = dummy_section(&io_mem_watch);
+    AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
+    AddressSpaceDispatch *cur = as->dispatch;
+    AddressSpaceDispatch *next;
+
+    if (cur && !as->next_dispatch) {
+        return;
+    }
+    next = mem_next_dispatch(as);
+    if (as->dispatch_rebuild) {
+        next->rebuild_nodes_nb = next->nodes_nb;
+        next->rebuild_sections_nb = next->sections_nb;
+    }
+
+    atomic_rcu_set(&as->dispatch, next);
+    as->next_dispatch = NULL;
+    if (cur) {
+        call_rcu(&cur->rcu, address_space_dispatch_reclaim);
+    }
 }
 
-static void tcg_commit(MemoryListener *listener)
+static void tcg_flush_all_tlbs(void *unused)
 {
     CPUArchState *env;
 
@@ -3207,10 +4267,21 @@ static void tcg_commit(MemoryListener *listener)
        reset the modified entries */
     /* XXX: slow ! */
     for(env = first_cpu; env != NULL; env = env->next_cpu) {
+        /* also switches env->memory_dispatch to the new snapshot */
         tlb_flush(env, 1);
     }
 }
 
+static void tcg_commit(MemoryListener *listener)
+{
+    if (tcg_multithread) {
+        /* do not touch the TLB of a vCPU that is running guest code */
+        async_safe_run_on_cpus(tcg_flush_all_tlbs, NULL);
+    } else {
+        tcg_flush_all_tlbs(NULL);
+    }
+}
+
 static void core_log_global_start(MemoryListener *listener)
 {
     cpu_physical_memory_set_dirty_tracking(1);
@@ -3240,7 +4311,6 @@ static void io_region_del(MemoryListener *listener,
 }
 
 static MemoryListener core_memory_listener = {
-    .begin = core_begin,
     .log_global_start = core_log_global_start,
     .log_global_stop = core_log_global_stop,
     .priority = 1,
@@ -3252,33 +4322,37 @@ static MemoryListener io_memory_listener = {
     .priority = 0,
 };
 
+/* Must commit after the dispatch listener of address_space_memory, so
+   that the TLB flush picks up the snapshot that was just published.  */
 static MemoryListener tcg_memory_listener = {
     .commit = tcg_commit,
+    .priority = 1,
 };
 
 void address_space_init_dispatch(AddressSpace *as)
 {
-    AddressSpaceDispatch *d = g_new(AddressSpaceDispatch, 1);
-
-    d->phys_map  = (PhysPageEntry) { .ptr = PHYS_MAP_NODE_NIL, .is_leaf = 0 };
-    d->listener = (MemoryListener) {
+    as->dispatch = NULL;
+    as->dispatch_listener = (MemoryListener) {
         .begin = mem_begin,
+        .commit = mem_commit,
         .region_add = mem_add,
-        .region_nop = mem_add,
+        .region_del = mem_del,
+        .region_nop = mem_nop,
         .priority = 0,
     };
-    as->dispatch = d;
-    memory_listener_register(&d->listener, as);
+    /* registration replays the current topology outside a transaction */
+    mem_begin(&as->dispatch_listener);
+    memory_listener_register(&as->dispatch_listener, as);
+    mem_commit(&as->dispatch_listener);
 }
 
 void address_space_destroy_dispatch(AddressSpace *as)
 {
     AddressSpaceDispatch *d = as->dispatch;
 
-    memory_listener_unregister(&d->listener);
-    destroy_l2_mapping(&d->phys_map, P_L2_LEVELS - 1);
-    g_free(d);
+    memory_listener_unregister(&as->dispatch_listener);
     as->dispatch = NULL;
+    call_rcu(&d->rcu, address_space_dispatch_reclaim);
 }
 
 static void memory_map_init(void)
@@ -3363,7 +4437,7 @@ static void invalidate_and_set_dirty(hwaddr addr,
         /* invalidate code */
         tb_invalidate_phys_page_range(addr, addr + length, 0);
         /* set dirty bit */
-        cpu_physical_memory_set_dirty_flags(addr, (0xff & ~CODE_DIRTY_FLAG));
+        cpu_physical_memory_set_dirty_nocode(addr);
     }
     xen_modified_memory(addr, length);
 }
@@ -3371,13 +4445,15 @@ static void invalidate_and_set_dirty(hwaddr addr,
 void address_space_rw(AddressSpace *as, hwaddr addr, uint8_t *buf,
                       int len, bool is_write)
 {
-    AddressSpaceDispatch *d = as->dispatch;
+    AddressSpaceDispatch *d;
     int l;
     uint8_t *ptr;
     uint32_t val;
     hwaddr page;
     MemoryRegionSection *section;
 
+    rcu_read_lock();
+    d = atomic_rcu_read(&as->dispatch);
     while (len > 0) {
         page = addr & TARGET_PAGE_MASK;
         l = (page + TARGET_PAGE_SIZE) - addr;
@@ -3452,6 +4528,35 @@ void address_space_rw(AddressSpace *as, hwaddr addr, uint8_t *buf,
         buf += l;
         addr += l;
     }
+    rcu_read_unlock();
+}
+
+bool address_space_rw_lockless(AddressSpace *as, hwaddr addr, uint8_t *buf,
+                               int len, bool is_write)
+{
+    MemoryRegionSection *section;
+    bool lockless;
+
+    if ((addr & ~TARGET_PAGE_MASK) + len > TARGET_PAGE_SIZE) {
+        return false;
+    }
+
+    rcu_read_lock();
+    section = phys_page_find(atomic_rcu_read(&as->dispatch),
+                             addr >> TARGET_PAGE_BITS);
+    if (section->mr->subpage) {
+        subpage_t *mmio = container_of(section->mr, subpage_t, iomem);
+        section = &mmio->d->sections[mmio->sub_section[SUBPAGE_IDX(addr)]];
+    }
+    lockless = section->mr->lockless &&
+        addr + len <= section->offset_within_address_space + section->size;
+    if (lockless) {
+        /* Should the map change under our feet, address_space_rw takes the
+           global mutex for whatever region it finds instead.  */
+        address_space_rw(as, addr, buf, len, is_write);
+    }
+    rcu_read_unlock();
+    return lockless;
 }
 
 void address_space_write(AddressSpace *as, hwaddr addr,
@@ -3483,12 +4588,14 @@ void cpu_physical_memory_rw(hwaddr addr, uint8_t *buf,
 void cpu_physical_memory_write_rom(hwaddr addr,
                                    const uint8_t *buf, int len)
 {
-    AddressSpaceDispatch *d = address_space_memory.dispatch;
+    AddressSpaceDispatch *d;
     int l;
     uint8_t *ptr;
     hwaddr page;
     MemoryRegionSection *section;
 
+    rcu_read_lock();
+    d = atomic_rcu_read(&address_space_memory.dispatch);
     while (len > 0) {
         page = addr & TARGET_PAGE_MASK;
         l = (page + TARGET_PAGE_SIZE) - addr;
@@ -3513,6 +4620,7 @@ void cpu_physical_memory_write_rom(hwaddr addr,
         buf += l;
         addr += l;
     }
+    rcu_read_unlock();
 }
 
 typedef struct {
@@ -3573,7 +4681,7 @@ void *address_space_map(AddressSpace *as,
                         hwaddr *plen,
                         bool is_write)
 {
-    AddressSpaceDispatch *d = as->dispatch;
+    AddressSpaceDispatch *d;
     hwaddr len = *plen;
     hwaddr todo = 0;
     int l;
@@ -3583,6 +4691,8 @@ void *address_space_map(AddressSpace *as,
     ram_addr_t rlen;
     void *ret;
 
+    rcu_read_lock();
+    d = atomic_rcu_read(&as->dispatch);
     while (len > 0) {
         page = addr & TARGET_PAGE_MASK;
         l = (page + TARGET_PAGE_SIZE) - addr;
@@ -3600,6 +4710,7 @@ void *address_space_map(AddressSpace *as,
             if (!is_write) {
                 address_space_read(as, addr, bounce.buffer, l);
             }
+            rcu_read_unlock();
 
             *plen = l;
             return bounce.buffer;
@@ -3613,6 +4724,7 @@ void *address_space_map(AddressSpace *as,
         addr += l;
         todo += l;
     }
+    rcu_read_unlock();
     rlen = todo;
     ret = qemu_ram_ptr_length(raddr, &rlen);
     *plen = rlen;
@@ -3671,9 +4783,12 @@ static inline uint32_t ldl_phys_internal(hwaddr addr,
 {
     uint8_t *ptr;
     uint32_t val;
+    AddressSpaceDispatch *d;
     MemoryRegionSection *section;
 
-    section = phys_page_find(address_space_memory.dispatch, addr >> TARGET_PAGE_BITS);
+    rcu_read_lock();
+    d = atomic_rcu_read(&address_space_memory.dispatch);
+    section = phys_page_find(d, addr >> TARGET_PAGE_BITS);
 
     if (!(memory_region_is_ram(section->mr) ||
           memory_region_is_romd(section->mr))) {
@@ -3706,6 +4821,7 @@ static inline uint32_t ldl_phys_internal(hwaddr addr,
             break;
         }
     }
+    rcu_read_unlock();
     return val;
 }
 
@@ -3730,9 +4846,12 @@ static inline uint64_t ldq_phys_internal(hwaddr addr,
 {
     uint8_t *ptr;
     uint64_t val;
+    AddressSpaceDispatch *d;
     MemoryRegionSection *section;
 
-    section = phys_page_find(address_space_memory.dispatch, addr >> TARGET_PAGE_BITS);
+    rcu_read_lock();
+    d = atomic_rcu_read(&address_space_memory.dispatch);
+    section = phys_page_find(d, addr >> TARGET_PAGE_BITS);
 
     if (!(memory_region_is_ram(section->mr) ||
           memory_region_is_romd(section->mr))) {
@@ -3765,6 +4884,7 @@ static inline uint64_t ldq_phys_internal(hwaddr addr,
             break;
         }
     }
+    rcu_read_unlock();
     return val;
 }
 
@@ -3797,9 +4917,12 @@ static inline uint32_t lduw_phys_internal(hwaddr addr,
 {
     uint8_t *ptr;
     uint64_t val;
+    AddressSpaceDispatch *d;
     MemoryRegionSection *section;
 
-    section = phys_page_find(address_space_memory.dispatch, addr >> TARGET_PAGE_BITS);
+    rcu_read_lock();
+    d = atomic_rcu_read(&address_space_memory.dispatch);
+    section = phys_page_find(d, addr >> TARGET_PAGE_BITS);
 
     if (!(memory_region_is_ram(section->mr) ||
           memory_region_is_romd(section->mr))) {
@@ -3832,6 +4955,7 @@ static inline uint32_t lduw_phys_internal(hwaddr addr,
             break;
         }
     }
+    rcu_read_unlock();
     return val;
 }
 
@@ -3856,14 +4980,17 @@ uint32_t lduw_be_phys(hwaddr addr)
 void stl_phys_notdirty(hwaddr addr, uint32_t val)
 {
     uint8_t *ptr;
+    AddressSpaceDispatch *d;
     MemoryRegionSection *section;
 
-    section = phys_page_find(address_space_memory.dispatch, addr >> TARGET_PAGE_BITS);
+    rcu_read_lock();
+    d = atomic_rcu_read(&address_space_memory.dispatch);
+    section = phys_page_find(d, addr >> TARGET_PAGE_BITS);
 
     if (!memory_region_is_ram(section->mr) || section->readonly) {
         addr = memory_region_section_addr(section, addr);
         if (memory_region_is_ram(section->mr)) {
-            section = &phys_sections[phys_section_rom];
+            section = &d->sections[PHYS_SECTION_ROM];
         }
         io_mem_write(section->mr, addr, val, 4);
     } else {
@@ -3878,24 +5005,27 @@ void stl_phys_notdirty(hwaddr addr, uint32_t val)
                 /* invalidate code */
                 tb_invalidate_phys_page_range(addr1, addr1 + 4, 0);
                 /* set dirty bit */
-                cpu_physical_memory_set_dirty_flags(
-                    addr1, (0xff & ~CODE_DIRTY_FLAG));
+                cpu_physical_memory_set_dirty_nocode(addr1);
             }
         }
     }
+    rcu_read_unlock();
 }
 
 void stq_phys_notdirty(hwaddr addr, uint64_t val)
 {
     uint8_t *ptr;
+    AddressSpaceDispatch *d;
     MemoryRegionSection *section;
 
-    section = phys_page_find(address_space_memory.dispatch, addr >> TARGET_PAGE_BITS);
+    rcu_read_lock();
+    d = atomic_rcu_read(&address_space_memory.dispatch);
+    section = phys_page_find(d, addr >> TARGET_PAGE_BITS);
 
     if (!memory_region_is_ram(section->mr) || section->readonly) {
         addr = memory_region_section_addr(section, addr);
         if (memory_region_is_ram(section->mr)) {
-            section = &phys_sections[phys_section_rom];
+            section = &d->sections[PHYS_SECTION_ROM];
         }
 #ifdef TARGET_WORDS_BIGENDIAN
         io_mem_write(section->mr, addr, val >> 32, 4);
@@ -3910,6 +5040,7 @@ void stq_phys_notdirty(hwaddr addr, uint64_t val)
                                + memory_region_section_addr(section, addr));
         stq_p(ptr, val);
     }
+    rcu_read_unlock();
 }
 
 /* warning: addr must be aligned */
@@ -3917,14 +5048,17 @@ static inline void stl_phys_internal(hwaddr addr, uint32_t val,
                                      enum device_endian endian)
 {
     uint8_t *ptr;
+    AddressSpaceDispatch *d;
     MemoryRegionSection *section;
 
-    section = phys_page_find(address_space_memory.dispatch, addr >> TARGET_PAGE_BITS);
+    rcu_read_lock();
+    d = atomic_rcu_read(&address_space_memory.dispatch);
+    section = phys_page_find(d, addr >> TARGET_PAGE_BITS);
 
     if (!memory_region_is_ram(section->mr) || section->readonly) {
         addr = memory_region_section_addr(section, addr);
         if (memory_region_is_ram(section->mr)) {
-            section = &phys_sections[phys_section_rom];
+            section = &d->sections[PHYS_SECTION_ROM];
         }
 #if defined(TARGET_WORDS_BIGENDIAN)
         if (endian == DEVICE_LITTLE_ENDIAN) {
@@ -3955,6 +5089,7 @@ static inline void stl_phys_internal(hwaddr addr, uint32_t val,
         }
         invalidate_and_set_dirty(addr1, 4);
     }
+    rcu_read_unlock();
 }
 
 void stl_phys(hwaddr addr, uint32_t val)
@@ -3984,14 +5119,17 @@ static inline void stw_phys_internal(hwaddr addr, uint32_t val,
                                      enum device_endian endian)
 {
     uint8_t *ptr;
+    AddressSpaceDispatch *d;
     MemoryRegionSection *section;
 
-    section = phys_page_find(address_space_memory.dispatch, addr >> TARGET_PAGE_BITS);
+    rcu_read_lock();
+    d = atomic_rcu_read(&address_space_memory.dispatch);
+    section = phys_page_find(d, addr >> TARGET_PAGE_BITS);
 
     if (!memory_region_is_ram(section->mr) || section->readonly) {
         addr = memory_region_section_addr(section, addr);
         if (memory_region_is_ram(section->mr)) {
-            section = &phys_sections[phys_section_rom];
+            section = &d->sections[PHYS_SECTION_ROM];
         }
 #if defined(TARGET_WORDS_BIGENDIAN)
         if (endian == DEVICE_LITTLE_ENDIAN) {
@@ -4022,6 +5160,7 @@ static inline void stw_phys_internal(hwaddr addr, uint32_t val,
         }
         invalidate_and_set_dirty(addr1, 2);
     }
+    rcu_read_unlock();
 }
 
 void stw_phys(hwaddr addr, uint32_t val)
@@ -4151,8 +5290,11 @@ void cpu_io_recompile(CPUArchState *env, uintptr_t retaddr)
 
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
-    int i, target_code_size, max_target_code_size;
+    int i, j, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    int nb_tbs;
+    size_t code_size;
+    TBRegion *r;
     TranslationBlock *tb;
 
     target_code_size = 0;
@@ -4160,32 +5302,42 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for(i = 0; i < nb_tbs; i++) {
-        tb = &tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size)
-            max_target_code_size = tb->size;
-        if (tb->page_addr[1] != -1)
-            cross_page++;
-        if (tb->tb_next_offset[0] != 0xffff) {
-            direct_jmp_count++;
-            if (tb->tb_next_offset[1] != 0xffff) {
-                direct_jmp2_count++;
+    nb_tbs = 0;
+    code_size = 0;
+    for (j = 0; j < tb_nb_regions; j++) {
+        r = &tb_regions[j];
+        code_size += (j == tb_region_cur ? code_gen_ptr : r->code_end) -
+                     r->code_start;
+        nb_tbs += r->nb_tbs;
+        for (i = 0; i < r->nb_tbs; i++) {
+            tb = &r->tbs[i];
+            target_code_size += tb->size;
+            if (tb->size > max_target_code_size)
+                max_target_code_size = tb->size;
+            if (tb->page_addr[1] != -1)
+                cross_page++;
+            if (tb->tb_next_offset[0] != 0xffff) {
+                direct_jmp_count++;
+                if (tb->tb_next_offset[1] != 0xffff) {
+                    direct_jmp2_count++;
+                }
             }
         }
     }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
-    cpu_fprintf(f, "gen code size       %td/%zd\n",
-                code_gen_ptr - code_gen_buffer, code_gen_buffer_max_size);
+    cpu_fprintf(f, "gen code size       %zd/%zd\n",
+                code_size, code_gen_buffer_max_size);
+    cpu_fprintf(f, "buffer regions      %d (current %d)\n",
+                tb_nb_regions, tb_region_cur);
     cpu_fprintf(f, "TB count            %d/%d\n", 
                 nb_tbs, code_gen_max_blocks);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
                 nb_tbs ? target_code_size / nb_tbs : 0,
                 max_target_code_size);
-    cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-                nb_tbs ? (code_gen_ptr - code_gen_buffer) / nb_tbs : 0,
-                target_code_size ? (double) (code_gen_ptr - code_gen_buffer) / target_code_size : 0);
+    cpu_fprintf(f, "TB avg host size    %zd bytes (expansion ratio: %0.1f)\n",
+                nb_tbs ? code_size / nb_tbs : 0,
+                target_code_size ? (double) code_size / target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n",
             cross_page,
             nb_tbs ? (cross_page * 100) / nb_tbs : 0);
@@ -4196,8 +5348,25 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                 nb_tbs ? (direct_jmp2_count * 100) / nb_tbs : 0);
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %d\n", tb_flush_count);
+    cpu_fprintf(f, "TB region evictions %d\n", tb_evict_count);
     cpu_fprintf(f, "TB invalidate count %d\n", tb_phys_invalidate_count);
+    cpu_fprintf(f, "TB hash buckets     %u (%d resizes)\n",
+                tb_phys_hash->mask + 1, tb_phys_hash_grow_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    cpu_fprintf(f, "TLB large page flush count %d\n",
+                tlb_flush_large_page_count);
+#if !defined(CONFIG_USER_ONLY)
+    {
+        CPUArchState *env;
+        unsigned int vtlb_hits = 0;
+
+        for (env = first_cpu; env != NULL; env = env->next_cpu) {
+            vtlb_hits += env->vtlb_hit_count;
+        }
+        cpu_fprintf(f, "victim TLB hits     %u\n", vtlb_hits);
+    }
+    tb_persist_dump_info(f, cpu_fprintf);
+#endif
     tcg_dump_info(f, cpu_fprintf);
 }
 
@@ -4221,11 +5390,15 @@ bool virtio_is_big_endian(void)
 bool cpu_physical_memory_is_io(hwaddr phys_addr)
 {
     MemoryRegionSection *section;
+    bool ret;
 
-    section = phys_page_find(address_space_memory.dispatch,
+    rcu_read_lock();
+    section = phys_page_find(atomic_rcu_read(&address_space_memory.dispatch),
                              phys_addr >> TARGET_PAGE_BITS);
+    ret = !(memory_region_is_ram(section->mr) ||
+            memory_region_is_romd(section->mr));
+    rcu_read_unlock();
 
-    return !(memory_region_is_ram(section->mr) ||
-             memory_region_is_romd(section->mr));
+    return ret;
 }
 #endif
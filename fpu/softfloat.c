@@ -418,6 +418,121 @@ INLINE flag extractFloat64Sign( float64 a )
 
 }
 
+/*----------------------------------------------------------------------------
+| Host FPU fast path.  When rounding to nearest-even, when the inexact flag
+| is already raised (the host cannot cheaply tell whether a result is exact),
+| and when both operands are zero or normal, an addition, subtraction,
+| multiplication or division can be done by the host FPU.  The result is
+| used only if it is finite and larger in magnitude than the smallest normal
+| number: otherwise the operation may have overflowed or underflowed, or
+| produced a zero whose sign depends on the operands, and it is redone in
+| software.  Only hosts that evaluate float and double in their own precision
+| qualify.
+*----------------------------------------------------------------------------*/
+#if defined(__FLT_EVAL_METHOD__) && __FLT_EVAL_METHOD__ == 0
+#define SOFTFLOAT_HOST_FPU 1
+#endif
+
+#ifdef SOFTFLOAT_HOST_FPU
+#include <float.h>
+#include <math.h>
+
+typedef union {
+    uint32_t i;
+    float f;
+} float32_host;
+
+typedef union {
+    uint64_t i;
+    double f;
+} float64_host;
+
+INLINE flag float32_is_zero_or_normal_sf(float32 a)
+{
+    int_fast16_t exp = extractFloat32Exp(a);
+
+    return exp ? exp != 0xFF : extractFloat32Frac(a) == 0;
+}
+
+INLINE flag float64_is_zero_or_normal_sf(float64 a)
+{
+    int_fast16_t exp = extractFloat64Exp(a);
+
+    return exp ? exp != 0x7FF : extractFloat64Frac(a) == 0;
+}
+
+INLINE flag float_host_fpu_usable(float_status *status)
+{
+    return STATUS(float_rounding_mode) == float_round_nearest_even &&
+           (STATUS(float_exception_flags) & float_flag_inexact);
+}
+
+INLINE flag float32_host_args(float32 a, float32 b STATUS_PARAM)
+{
+    return float_host_fpu_usable(status) &&
+           float32_is_zero_or_normal_sf(a) && float32_is_zero_or_normal_sf(b);
+}
+
+INLINE flag float64_host_args(float64 a, float64 b STATUS_PARAM)
+{
+    return float_host_fpu_usable(status) &&
+           float64_is_zero_or_normal_sf(a) && float64_is_zero_or_normal_sf(b);
+}
+
+INLINE float float32_to_host(float32 a)
+{
+    float32_host u;
+
+    u.i = float32_val(a);
+    return u.f;
+}
+
+INLINE double float64_to_host(float64 a)
+{
+    float64_host u;
+
+    u.i = float64_val(a);
+    return u.f;
+}
+
+/* Store the host result in `*z' and return true if it can be used.  */
+INLINE flag float32_from_host(float r, float32 *z)
+{
+    float32_host u;
+
+    if (!(fabsf(r) > FLT_MIN) || isinf(r)) {
+        return 0;
+    }
+    u.f = r;
+    *z = make_float32(u.i);
+    return 1;
+}
+
+INLINE flag float64_from_host(double r, float64 *z)
+{
+    float64_host u;
+
+    if (!(fabs(r) > DBL_MIN) || isinf(r)) {
+        return 0;
+    }
+    u.f = r;
+    *z = make_float64(u.i);
+    return 1;
+}
+
+#define FLOAT_HOST_OP(bits, a, b, op)                                   \
+    do {                                                                \
+        float##bits z_;                                                 \
+        if (float##bits##_host_args(a, b STATUS_VAR) &&                 \
+            float##bits##_from_host(float##bits##_to_host(a) op         \
+                                    float##bits##_to_host(b), &z_)) {   \
+            return z_;                                                  \
+        }                                                               \
+    } while (0)
+#else
+#define FLOAT_HOST_OP(bits, a, b, op) do { } while (0)
+#endif
+
 /*----------------------------------------------------------------------------
 | If `a' is denormal and we are in flush-to-zero mode then set the
 | input-denormal exception and return zero. Otherwise just return the value.
@@ -1855,6 +1970,8 @@ float32 float32_add( float32 a, float32 b STATUS_PARAM )
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
+    FLOAT_HOST_OP(32, a, b, +);
+
     aSign = extractFloat32Sign( a );
     bSign = extractFloat32Sign( b );
     if ( aSign == bSign ) {
@@ -1878,6 +1995,8 @@ float32 float32_sub( float32 a, float32 b STATUS_PARAM )
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
+    FLOAT_HOST_OP(32, a, b, -);
+
     aSign = extractFloat32Sign( a );
     bSign = extractFloat32Sign( b );
     if ( aSign == bSign ) {
@@ -1906,6 +2025,8 @@ float32 float32_mul( float32 a, float32 b STATUS_PARAM )
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
+    FLOAT_HOST_OP(32, a, b, *);
+
     aSig = extractFloat32Frac( a );
     aExp = extractFloat32Exp( a );
     aSign = extractFloat32Sign( a );
@@ -1966,6 +2087,11 @@ float32 float32_div( float32 a, float32 b STATUS_PARAM )
     a = float32_squash_input_denormal(a STATUS_VAR);
     b = float32_squash_input_denormal(b STATUS_VAR);
 
+    /* a zero divisor raises divbyzero or invalid, leave it to software */
+    if (!float32_is_zero(b)) {
+        FLOAT_HOST_OP(32, a, b, /);
+    }
+
     aSig = extractFloat32Frac( a );
     aExp = extractFloat32Exp( a );
     aSign = extractFloat32Sign( a );
@@ -3418,6 +3544,8 @@ float64 float64_add( float64 a, float64 b STATUS_PARAM )
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
+    FLOAT_HOST_OP(64, a, b, +);
+
     aSign = extractFloat64Sign( a );
     bSign = extractFloat64Sign( b );
     if ( aSign == bSign ) {
@@ -3441,6 +3569,8 @@ float64 float64_sub( float64 a, float64 b STATUS_PARAM )
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
+    FLOAT_HOST_OP(64, a, b, -);
+
     aSign = extractFloat64Sign( a );
     bSign = extractFloat64Sign( b );
     if ( aSign == bSign ) {
@@ -3467,6 +3597,8 @@ float64 float64_mul( float64 a, float64 b STATUS_PARAM )
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
+    FLOAT_HOST_OP(64, a, b, *);
+
     aSig = extractFloat64Frac( a );
     aExp = extractFloat64Exp( a );
     aSign = extractFloat64Sign( a );
@@ -3529,6 +3661,11 @@ float64 float64_div( float64 a, float64 b STATUS_PARAM )
     a = float64_squash_input_denormal(a STATUS_VAR);
     b = float64_squash_input_denormal(b STATUS_VAR);
 
+    /* a zero divisor raises divbyzero or invalid, leave it to software */
+    if (!float64_is_zero(b)) {
+        FLOAT_HOST_OP(64, a, b, /);
+    }
+
     aSig = extractFloat64Frac( a );
     aExp = extractFloat64Exp( a );
     aSign = extractFloat64Sign( a );
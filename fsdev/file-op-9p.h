@@ -75,6 +75,8 @@ typedef struct FsDriverEntry {
     char *fsdev_id;
     char *path;
     int export_flags;
+    int workers;
+    int64_t stat_cache_ttl;
     FileOperations *ops;
 } FsDriverEntry;
 
@@ -85,6 +87,8 @@ typedef struct FsContext
     int export_flags;
     struct xattr_operations **xops;
     struct extended_ops exops;
+    int64_t stat_cache_ttl;
+    struct V9fsStatCache *stat_cache;
     /* fs driver specific data */
     void *private;
 } FsContext;
@@ -68,6 +68,7 @@ int qemu_fsdev_add(QemuOpts *opts)
             fsle->fse.export_flags |= V9FS_IMMEDIATE_WRITEOUT;
         }
     }
+    fsle->fse.workers = qemu_opt_get_number(opts, "workers", 0);
     if (ro) {
         fsle->fse.export_flags |= V9FS_RDONLY;
     } else {
@@ -9,18 +9,32 @@ static inline void gen_icount_start(void)
 {
     TCGv_i32 count;
 
+    if (tb_profile_counter) {
+        TCGv_ptr ptr = tcg_const_ptr(tb_profile_counter);
+        TCGv_i64 execs = tcg_temp_new_i64();
+
+        tcg_mark_host_ptr(&tcg_ctx);
+        tcg_gen_ld_i64(execs, ptr, 0);
+        tcg_gen_addi_i64(execs, execs, 1);
+        tcg_gen_st_i64(execs, ptr, 0);
+        tcg_temp_free_i64(execs);
+        tcg_temp_free_ptr(ptr);
+    }
+
     if (!use_icount)
         return;
 
     icount_label = gen_new_label();
-    count = tcg_temp_local_new_i32();
+    count = tcg_temp_new_i32();
     tcg_gen_ld_i32(count, cpu_env, offsetof(CPUArchState, icount_decr.u32));
     /* This is a horrid hack to allow fixing up the value later.  */
     icount_arg = tcg_ctx.gen_opparam_ptr + 1;
     tcg_gen_subi_i32(count, count, 0xdeadbeef);
 
-    tcg_gen_brcondi_i32(TCG_COND_LT, count, 0, icount_label);
+    /* Store before testing so that the count need not survive the
+       branch; cpu_exec adds tb->icount back when the TB exits here.  */
     tcg_gen_st16_i32(count, cpu_env, offsetof(CPUArchState, icount_decr.u16.low));
+    tcg_gen_brcondi_i32(TCG_COND_LT, count, 0, icount_label);
     tcg_temp_free_i32(count);
 }
 
@@ -320,6 +320,36 @@ Create a snapshot of the whole virtual machine. If @var{tag} is
 provided, it is used as human readable identifier. If there is already
 a snapshot with the same tag or ID, it is replaced. More info at
 @ref{vm_snapshots}.
+ETEXI
+
+    {
+        .name       = "savevm_start",
+        .args_type  = "name:s?",
+        .params     = "[tag|id]",
+        .help       = "start a live VM snapshot, saving RAM while the guest runs",
+        .mhandler.cmd = hmp_savevm_start,
+    },
+
+STEXI
+@item savevm_start [@var{tag}|@var{id}]
+@findex savevm_start
+Like @code{savevm}, but RAM is saved while the guest keeps running and the
+guest is only stopped for the last dirty pages and the device state.  The
+command returns immediately; use @code{info savevm} to follow the progress.
+ETEXI
+
+    {
+        .name       = "savevm_cancel",
+        .args_type  = "",
+        .params     = "",
+        .help       = "cancel the live VM snapshot",
+        .mhandler.cmd = hmp_savevm_cancel,
+    },
+
+STEXI
+@item savevm_cancel
+@findex savevm_cancel
+Cancel the live snapshot started with @code{savevm_start}.
 ETEXI
 
     {
@@ -364,6 +394,29 @@ STEXI
 @findex singlestep
 Run the emulation in single step mode.
 If called with option off, the emulation returns to normal mode.
+ETEXI
+
+    {
+        .name       = "tb_profile",
+        .args_type  = "option:s,sort:s?,count:i?",
+        .params     = "on|off|show [sort] [count]",
+        .help       = "enable or disable per-TB profiling, or show the\n\t\t\t"
+                      "'count' (default 20) first translation blocks\n\t\t\t"
+                      "ordered by 'sort': exec-count (default), pc,\n\t\t\t"
+                      "translate-time, host-size, tlb-misses or exits",
+        .mhandler.cmd = hmp_tb_profile,
+    },
+
+STEXI
+@item tb_profile on|off|show [@var{sort}] [@var{count}]
+@findex tb_profile
+Enable or disable per-TB profiling of the TCG accelerator.  Enabling it
+clears the statistics and retranslates all code with execution counters.
+With @code{show}, list the @var{count} (default 20) first translation
+blocks ordered by @var{sort}, one of @code{exec-count} (default),
+@code{pc}, @code{translate-time}, @code{host-size}, @code{tlb-misses}
+and @code{exits}.  Guest symbols are shown if they were loaded, e.g.
+from an ELF kernel.
 ETEXI
 
     {
@@ -892,6 +945,22 @@ STEXI
 @item migrate_set_cache_size @var{value}
 @findex migrate_set_cache_size
 Set cache size to @var{value} (in bytes) for xbzrle migrations.
+ETEXI
+
+    {
+        .name       = "migrate_set_parameter",
+        .args_type  = "parameter:s,value:i",
+        .params     = "parameter value",
+        .help       = "Set the parameter for migration compression: "
+                      "compress-level, compress-threads or "
+                      "decompress-threads",
+        .mhandler.cmd = hmp_migrate_set_parameter,
+    },
+
+STEXI
+@item migrate_set_parameter @var{parameter} @var{value}
+@findex migrate_set_parameter
+Set the migration compression parameter @var{parameter} to @var{value}.
 ETEXI
 
     {
@@ -958,9 +1027,13 @@ ETEXI
 #if defined(CONFIG_HAVE_CORE_DUMP)
     {
         .name       = "dump-guest-memory",
-        .args_type  = "paging:-p,filename:F,begin:i?,length:i?",
-        .params     = "[-p] filename [begin] [length]",
+        .args_type  = "paging:-p,live:-L,zlib:-z,lzo:-l,snappy:-s,"
+                      "filename:F,begin:i?,length:i?",
+        .params     = "[-p] [-L] [-z|-l|-s] filename [begin] [length]",
         .help       = "dump guest memory to file"
+                      "\n\t\t\t -L: copy memory while the guest runs"
+                      "\n\t\t\t -z|-l|-s: kdump-compressed format, with"
+                      "\n\t\t\t zlib, lzo or snappy compression"
                       "\n\t\t\t begin(optional): the starting physical address"
                       "\n\t\t\t length(optional): the memory size, in bytes",
         .mhandler.cmd = hmp_dump_guest_memory,
@@ -968,12 +1041,15 @@ ETEXI
 
 
 STEXI
-@item dump-guest-memory [-p] @var{protocol} @var{begin} @var{length}
+@item dump-guest-memory [-p] [-L] [-z|-l|-s] @var{protocol} @var{begin} @var{length}
 @findex dump-guest-memory
 Dump guest memory to @var{protocol}. The file can be processed with crash or
 gdb.
   filename: dump file name
     paging: do paging to get guest's memory mapping
+      live: copy memory while the guest runs, see "info dump" for progress
+  zlib/lzo/snappy: write a kdump-compressed file with pages compressed
+            by zlib, lzo or snappy; it can be processed with crash only
      begin: the starting physical address. It's optional, and should be
             specified with length together.
     length: the memory size, in bytes. It's optional, and should be specified
@@ -1022,6 +1098,26 @@ STEXI
 @findex drive_mirror
 Start mirroring a block device's writes to a new destination,
 using the specified target.
+ETEXI
+
+    {
+        .name       = "drive_backup",
+        .args_type  = "reuse:-n,full:-f,device:B,target:s,format:s?",
+        .params     = "[-n] [-f] device target [format]",
+        .help       = "initiates a point-in-time\n\t\t\t"
+                      "copy for a device. The device's contents are\n\t\t\t"
+                      "copied to the new image file, excluding data that\n\t\t\t"
+                      "is written after the command is started.\n\t\t\t"
+                      "The -n flag requests QEMU to reuse the image found\n\t\t\t"
+                      "in new-image-file, instead of recreating it from scratch.\n\t\t\t"
+                      "The -f flag requests QEMU to copy the whole disk,\n\t\t\t"
+                      "so that the result does not need a backing file.\n\t\t\t",
+        .mhandler.cmd = hmp_drive_backup,
+    },
+STEXI
+@item drive_backup
+@findex drive_backup
+Start a point-in-time copy of a block device to a new destination.
 ETEXI
 
     {
@@ -1328,8 +1424,8 @@ ETEXI
 
     {
         .name       = "nbd_server_add",
-        .args_type  = "writable:-w,device:B",
-        .params     = "nbd_server_add [-w] device",
+        .args_type  = "writable:-w,snapshot:-s,device:B",
+        .params     = "nbd_server_add [-w] [-s] device",
         .help       = "export a block device via NBD",
         .mhandler.cmd = hmp_nbd_server_add,
     },
@@ -1338,7 +1434,9 @@ STEXI
 @findex nbd_server_add
 Export a block device through QEMU's NBD server, which must be started
 beforehand with @command{nbd_server_start}.  The @option{-w} option makes the
-exported device writable too.
+exported device writable too.  The @option{-s} option exports a read-only
+view of the device as it is at the time of the command, for example to take
+a consistent backup while the guest keeps running.
 ETEXI
 
     {
@@ -1512,6 +1610,11 @@ show block device statistics
 show the cpu registers
 @item info cpus
 show infos for each CPU
+@item info memory
+show the host memory alignment, KSM and transparent hugepage advice, and the
+transparent hugepage coverage of each guest RAM block
+@item info startup
+show how long each startup phase took and when the guest started running
 @item info history
 show the command line history
 @item info irq
@@ -1540,6 +1643,8 @@ show profiling information
 show information about active capturing
 @item info snapshots
 show list of VM snapshots
+@item info savevm
+show the progress of the live snapshot
 @item info status
 show the current VM status (running|paused)
 @item info pcmcia
@@ -1560,8 +1665,12 @@ show user network stack connection states
 show migration status
 @item info migrate_capabilities
 show current migration capabilities
+@item info dump
+show the progress of a live guest memory dump
 @item info migrate_cache_size
 show current migration XBZRLE cache size
+@item info migrate_parameters
+show current migration compression parameters
 @item info balloon
 show balloon information
 @item info qtree
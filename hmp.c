@@ -191,6 +191,27 @@ void hmp_info_migrate(Monitor *mon)
                        info->disk->total >> 10);
     }
 
+    if (info->has_cpu_throttle_percentage) {
+        monitor_printf(mon, "cpu throttle percentage: %" PRIu64 "\n",
+                       info->cpu_throttle_percentage);
+    }
+
+    if (info->has_estimates) {
+        monitor_printf(mon, "pass: %" PRIu64 "\n", info->estimates->pass);
+        monitor_printf(mon, "bandwidth: %" PRIu64 " kbytes/s\n",
+                       info->estimates->bandwidth >> 10);
+        monitor_printf(mon, "dirty rate: %" PRIu64 " kbytes/s\n",
+                       info->estimates->dirty_rate >> 10);
+        monitor_printf(mon, "last pass dirty: %" PRIu64 " kbytes\n",
+                       info->estimates->dirty_bytes >> 10);
+        if (info->estimates->has_remaining_time) {
+            monitor_printf(mon, "remaining time: %" PRIu64 " milliseconds\n",
+                           info->estimates->remaining_time);
+        } else {
+            monitor_printf(mon, "remaining time: not converging\n");
+        }
+    }
+
     if (info->has_xbzrle_cache) {
         monitor_printf(mon, "cache size: %" PRIu64 " bytes\n",
                        info->xbzrle_cache->cache_size);
@@ -200,10 +221,24 @@ void hmp_info_migrate(Monitor *mon)
                        info->xbzrle_cache->pages);
         monitor_printf(mon, "xbzrle cache miss: %" PRIu64 "\n",
                        info->xbzrle_cache->cache_miss);
+        monitor_printf(mon, "xbzrle cache hits: %" PRIu64 " (%0.2f%%)\n",
+                       info->xbzrle_cache->cache_hits,
+                       info->xbzrle_cache->cache_hit_rate * 100);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
     }
 
+    if (info->has_compression) {
+        monitor_printf(mon, "compression pages: %" PRIu64 " pages\n",
+                       info->compression->pages);
+        monitor_printf(mon, "compression busy: %" PRIu64 "\n",
+                       info->compression->busy);
+        monitor_printf(mon, "compressed size: %" PRIu64 " kbytes\n",
+                       info->compression->compressed_size >> 10);
+        monitor_printf(mon, "compression rate: %0.2f\n",
+                       info->compression->compression_rate);
+    }
+
     qapi_free_MigrationInfo(info);
     qapi_free_MigrationCapabilityStatusList(caps);
 }
@@ -233,6 +268,20 @@ void hmp_info_migrate_cache_size(Monitor *mon)
                    qmp_query_migrate_cache_size(NULL) >> 10);
 }
 
+void hmp_info_migrate_parameters(Monitor *mon)
+{
+    MigrationParameters *params;
+
+    params = qmp_query_migrate_parameters(NULL);
+    monitor_printf(mon, "compress-level: %" PRId64 "\n",
+                   params->compress_level);
+    monitor_printf(mon, "compress-threads: %" PRId64 "\n",
+                   params->compress_threads);
+    monitor_printf(mon, "decompress-threads: %" PRId64 "\n",
+                   params->decompress_threads);
+    qapi_free_MigrationParameters(params);
+}
+
 void hmp_info_cpus(Monitor *mon)
 {
     CpuInfoList *cpu_list, *cpu;
@@ -265,12 +314,65 @@ void hmp_info_cpus(Monitor *mon)
             monitor_printf(mon, " (halted)");
         }
 
-        monitor_printf(mon, " thread_id=%" PRId64 "\n", cpu->value->thread_id);
+        monitor_printf(mon, " thread_id=%" PRId64, cpu->value->thread_id);
+
+        if (cpu->value->has_halt_poll_ns) {
+            monitor_printf(mon, " halt_poll=%" PRId64 "ns polls=%" PRId64
+                           " hits=%" PRId64, cpu->value->halt_poll_ns,
+                           cpu->value->halt_polls, cpu->value->halt_poll_hits);
+        }
+        monitor_printf(mon, "\n");
     }
 
     qapi_free_CpuInfoList(cpu_list);
 }
 
+void hmp_info_memory(Monitor *mon)
+{
+    RamBlockInfoList *block_list, *block;
+    uint64_t total = 0, thp = 0;
+
+    block_list = qmp_query_ram_blocks(NULL);
+
+    for (block = block_list; block; block = block->next) {
+        RamBlockInfo *info = block->value;
+
+        monitor_printf(mon, "%s: size=%" PRId64 " align=%" PRId64
+                       " merge=%s thp=%s thp_size=%" PRId64 " (%d%%)\n",
+                       info->name, info->size, info->align,
+                       info->merge ? "on" : "off",
+                       info->hugepage ? "on" : "off", info->thp_size,
+                       info->size ? (int)(info->thp_size * 100 / info->size)
+                                  : 0);
+        total += info->size;
+        thp += info->thp_size;
+    }
+    if (total) {
+        monitor_printf(mon, "transparent hugepages cover %" PRIu64 " of %"
+                       PRIu64 " bytes (%d%%)\n", thp, total,
+                       (int)(thp * 100 / total));
+    }
+
+    qapi_free_RamBlockInfoList(block_list);
+}
+
+void hmp_info_startup(Monitor *mon)
+{
+    StartupInfo *info = qmp_query_startup(NULL);
+    StartupPhaseList *phase;
+
+    for (phase = info->phases; phase; phase = phase->next) {
+        monitor_printf(mon, "%-24s %8.3f ms\n", phase->value->name,
+                       phase->value->duration_ns / 1000000.0);
+    }
+    if (info->has_first_insn_ns) {
+        monitor_printf(mon, "first guest instruction after %.3f ms\n",
+                       info->first_insn_ns / 1000000.0);
+    }
+
+    qapi_free_StartupInfo(info);
+}
+
 void hmp_info_block(Monitor *mon)
 {
     BlockInfoList *block_list, *info;
@@ -315,6 +417,11 @@ void hmp_info_block(Monitor *mon)
                             info->value->inserted->iops,
                             info->value->inserted->iops_rd,
                             info->value->inserted->iops_wr);
+
+            if (info->value->inserted->has_group) {
+                monitor_printf(mon, " group=%s",
+                               info->value->inserted->group);
+            }
         } else {
             monitor_printf(mon, " [not inserted]");
         }
@@ -345,6 +452,8 @@ void hmp_info_blockstats(Monitor *mon)
                        " wr_total_time_ns=%" PRId64
                        " rd_total_time_ns=%" PRId64
                        " flush_total_time_ns=%" PRId64
+                       " rd_merged=%" PRId64
+                       " wr_merged=%" PRId64
                        "\n",
                        stats->value->stats->rd_bytes,
                        stats->value->stats->wr_bytes,
@@ -353,7 +462,9 @@ void hmp_info_blockstats(Monitor *mon)
                        stats->value->stats->flush_operations,
                        stats->value->stats->wr_total_time_ns,
                        stats->value->stats->rd_total_time_ns,
-                       stats->value->stats->flush_total_time_ns);
+                       stats->value->stats->flush_total_time_ns,
+                       stats->value->stats->rd_merged,
+                       stats->value->stats->wr_merged);
     }
 
     qapi_free_BlockStatsList(stats_list);
@@ -796,6 +907,36 @@ void hmp_drive_mirror(Monitor *mon, const QDict *qdict)
     qmp_drive_mirror(device, filename, !!format, format,
                      full ? MIRROR_SYNC_MODE_FULL : MIRROR_SYNC_MODE_TOP,
                      true, mode, false, 0,
+                     false, 0, false, 0,
+                     false, 0, false, 0, &errp);
+    hmp_handle_error(mon, &errp);
+}
+
+void hmp_drive_backup(Monitor *mon, const QDict *qdict)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    const char *filename = qdict_get_str(qdict, "target");
+    const char *format = qdict_get_try_str(qdict, "format");
+    int reuse = qdict_get_try_bool(qdict, "reuse", 0);
+    int full = qdict_get_try_bool(qdict, "full", 0);
+    enum NewImageMode mode;
+    Error *errp = NULL;
+
+    if (!filename) {
+        error_set(&errp, QERR_MISSING_PARAMETER, "target");
+        hmp_handle_error(mon, &errp);
+        return;
+    }
+
+    if (reuse) {
+        mode = NEW_IMAGE_MODE_EXISTING;
+    } else {
+        mode = NEW_IMAGE_MODE_ABSOLUTE_PATHS;
+    }
+
+    qmp_drive_backup(device, filename, !!format, format,
+                     full ? MIRROR_SYNC_MODE_FULL : MIRROR_SYNC_MODE_TOP,
+                     true, mode, false, 0, false, NULL,
                      false, 0, false, 0, &errp);
     hmp_handle_error(mon, &errp);
 }
@@ -828,6 +969,49 @@ void hmp_migrate_cancel(Monitor *mon, const QDict *qdict)
     qmp_migrate_cancel(NULL);
 }
 
+void hmp_savevm_start(Monitor *mon, const QDict *qdict)
+{
+    const char *name = qdict_get_try_str(qdict, "name");
+    Error *errp = NULL;
+
+    qmp_savevm_start(!!name, name, &errp);
+    hmp_handle_error(mon, &errp);
+}
+
+void hmp_savevm_cancel(Monitor *mon, const QDict *qdict)
+{
+    qmp_savevm_cancel(NULL);
+}
+
+void hmp_info_savevm(Monitor *mon)
+{
+    SaveVMInfo *info;
+
+    info = qmp_query_savevm(NULL);
+    if (info->has_status) {
+        monitor_printf(mon, "Snapshot status: %s\n", info->status);
+    }
+    if (info->has_name) {
+        monitor_printf(mon, "name: %s\n", info->name);
+    }
+    if (info->has_total_time) {
+        monitor_printf(mon, "total time: %" PRIu64 " milliseconds\n",
+                       info->total_time);
+    }
+    if (info->has_bytes) {
+        monitor_printf(mon, "vm state: %" PRIu64 " kbytes\n",
+                       info->bytes >> 10);
+    }
+    if (info->has_remaining) {
+        monitor_printf(mon, "remaining ram: %" PRIu64 " kbytes\n",
+                       info->remaining >> 10);
+    }
+    if (info->has_error) {
+        monitor_printf(mon, "error: %s\n", info->error);
+    }
+    qapi_free_SaveVMInfo(info);
+}
+
 void hmp_migrate_set_downtime(Monitor *mon, const QDict *qdict)
 {
     double value = qdict_get_double(qdict, "value");
@@ -847,6 +1031,28 @@ void hmp_migrate_set_cache_size(Monitor *mon, const QDict *qdict)
     }
 }
 
+void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
+{
+    const char *param = qdict_get_str(qdict, "parameter");
+    int64_t value = qdict_get_int(qdict, "value");
+    Error *err = NULL;
+
+    if (!strcmp(param, "compress-level")) {
+        qmp_migrate_set_parameters(true, value, false, 0, false, 0, &err);
+    } else if (!strcmp(param, "compress-threads")) {
+        qmp_migrate_set_parameters(false, 0, true, value, false, 0, &err);
+    } else if (!strcmp(param, "decompress-threads")) {
+        qmp_migrate_set_parameters(false, 0, false, 0, true, value, &err);
+    } else {
+        error_set(&err, QERR_INVALID_PARAMETER, param);
+    }
+
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+    }
+}
+
 void hmp_migrate_set_speed(Monitor *mon, const QDict *qdict)
 {
     int64_t value = qdict_get_int(qdict, "value");
@@ -959,7 +1165,10 @@ void hmp_block_set_io_throttle(Monitor *mon, const QDict *qdict)
                               qdict_get_int(qdict, "bps_wr"),
                               qdict_get_int(qdict, "iops"),
                               qdict_get_int(qdict, "iops_rd"),
-                              qdict_get_int(qdict, "iops_wr"), &err);
+                              qdict_get_int(qdict, "iops_wr"),
+                              false, 0, false, 0, false, 0,
+                              false, 0, false, 0, false, 0,
+                              false, 0, false, 0, false, NULL, &err);
     hmp_handle_error(mon, &err);
 }
 
@@ -970,7 +1179,7 @@ void hmp_block_stream(Monitor *mon, const QDict *qdict)
     const char *base = qdict_get_try_str(qdict, "base");
     int64_t speed = qdict_get_try_int(qdict, "speed", 0);
 
-    qmp_block_stream(device, base != NULL, base,
+    qmp_block_stream(device, base != NULL, base, false, NULL,
                      qdict_haskey(qdict, "speed"), speed,
                      BLOCKDEV_ON_ERROR_REPORT, true, &error);
 
@@ -1115,13 +1324,30 @@ void hmp_dump_guest_memory(Monitor *mon, const QDict *qdict)
 {
     Error *errp = NULL;
     int paging = qdict_get_try_bool(qdict, "paging", 0);
+    bool live = qdict_get_try_bool(qdict, "live", 0);
+    bool zlib = qdict_get_try_bool(qdict, "zlib", 0);
+    bool lzo = qdict_get_try_bool(qdict, "lzo", 0);
+    bool snappy = qdict_get_try_bool(qdict, "snappy", 0);
     const char *file = qdict_get_str(qdict, "filename");
     bool has_begin = qdict_haskey(qdict, "begin");
     bool has_length = qdict_haskey(qdict, "length");
     int64_t begin = 0;
     int64_t length = 0;
+    DumpGuestMemoryFormat dump_format = DUMP_GUEST_MEMORY_FORMAT_ELF;
     char *prot;
 
+    if (zlib + lzo + snappy > 1) {
+        monitor_printf(mon, "only one of '-z|-l|-s' can be set\n");
+        return;
+    }
+    if (zlib) {
+        dump_format = DUMP_GUEST_MEMORY_FORMAT_KDUMP_ZLIB;
+    } else if (lzo) {
+        dump_format = DUMP_GUEST_MEMORY_FORMAT_KDUMP_LZO;
+    } else if (snappy) {
+        dump_format = DUMP_GUEST_MEMORY_FORMAT_KDUMP_SNAPPY;
+    }
+
     if (has_begin) {
         begin = qdict_get_int(qdict, "begin");
     }
@@ -1132,11 +1358,30 @@ void hmp_dump_guest_memory(Monitor *mon, const QDict *qdict)
     prot = g_strconcat("file:", file, NULL);
 
     qmp_dump_guest_memory(paging, prot, has_begin, begin, has_length, length,
-                          &errp);
+                          true, dump_format, true, live, &errp);
     hmp_handle_error(mon, &errp);
     g_free(prot);
 }
 
+void hmp_info_dump(Monitor *mon)
+{
+    DumpQueryResult *result;
+    Error *err = NULL;
+
+    result = qmp_query_dump(&err);
+    if (error_is_set(&err)) {
+        hmp_handle_error(mon, &err);
+        return;
+    }
+    monitor_printf(mon, "Status: %s\n", DumpStatus_lookup[result->status]);
+    if (result->status != DUMP_STATUS_NONE) {
+        monitor_printf(mon, "Completed: %" PRId64 " kbytes of %" PRId64
+                       " kbytes\n", result->completed >> 10,
+                       result->total >> 10);
+    }
+    qapi_free_DumpQueryResult(result);
+}
+
 void hmp_netdev_add(Monitor *mon, const QDict *qdict)
 {
     Error *err = NULL;
@@ -1301,7 +1546,8 @@ void hmp_nbd_server_start(Monitor *mon, const QDict *qdict)
             continue;
         }
 
-        qmp_nbd_server_add(info->value->device, true, writable, &local_err);
+        qmp_nbd_server_add(info->value->device, true, writable, false, false,
+                           &local_err);
 
         if (local_err != NULL) {
             qmp_nbd_server_stop(NULL);
@@ -1319,9 +1565,10 @@ void hmp_nbd_server_add(Monitor *mon, const QDict *qdict)
 {
     const char *device = qdict_get_str(qdict, "device");
     int writable = qdict_get_try_bool(qdict, "writable", 0);
+    int snapshot = qdict_get_try_bool(qdict, "snapshot", 0);
     Error *local_err = NULL;
 
-    qmp_nbd_server_add(device, true, writable, &local_err);
+    qmp_nbd_server_add(device, true, writable, true, snapshot, &local_err);
 
     if (local_err != NULL) {
         hmp_handle_error(mon, &local_err);
@@ -1335,3 +1582,59 @@ void hmp_nbd_server_stop(Monitor *mon, const QDict *qdict)
     qmp_nbd_server_stop(&errp);
     hmp_handle_error(mon, &errp);
 }
+
+void hmp_tb_profile(Monitor *mon, const QDict *qdict)
+{
+    const char *option = qdict_get_str(qdict, "option");
+    const char *sort = qdict_get_try_str(qdict, "sort");
+    int count = qdict_get_try_int(qdict, "count", 20);
+    TbProfileInfoList *list, *tb;
+    Error *errp = NULL;
+    int key = TB_PROFILE_SORT_KEY_EXEC_COUNT;
+
+    if (strcmp(option, "on") == 0 || strcmp(option, "off") == 0) {
+        qmp_tb_profile(strcmp(option, "on") == 0, &errp);
+        hmp_handle_error(mon, &errp);
+        return;
+    }
+    if (strcmp(option, "show") != 0) {
+        monitor_printf(mon, "unexpected option %s\n", option);
+        return;
+    }
+
+    if (sort) {
+        for (key = 0; key < TB_PROFILE_SORT_KEY_MAX; key++) {
+            if (strcmp(sort, TbProfileSortKey_lookup[key]) == 0) {
+                break;
+            }
+        }
+        if (key == TB_PROFILE_SORT_KEY_MAX) {
+            error_set(&errp, QERR_INVALID_PARAMETER, sort);
+            hmp_handle_error(mon, &errp);
+            return;
+        }
+    }
+
+    list = qmp_query_tb_profile(true, key, true, count, &errp);
+    if (errp) {
+        hmp_handle_error(mon, &errp);
+        return;
+    }
+
+    monitor_printf(mon, "%-18s %12s %5s %5s %6s %10s %10s %10s  %s\n",
+                   "pc", "execs", "gsize", "hsize", "helper", "tlb-miss",
+                   "exits", "xlate-ns", "symbol");
+    for (tb = list; tb; tb = tb->next) {
+        TbProfileInfo *info = tb->value;
+
+        monitor_printf(mon, "0x%016" PRIx64 " %12" PRId64 " %5" PRId64
+                       " %5" PRId64 " %6" PRId64 " %10" PRId64
+                       " %10" PRId64 " %10" PRId64 "  %s\n",
+                       info->pc, info->exec_count, info->guest_size,
+                       info->host_size, info->helper_calls, info->tlb_misses,
+                       info->unchained_exits + info->icount_exits,
+                       info->translate_time,
+                       info->has_symbol ? info->symbol : "");
+    }
+    qapi_free_TbProfileInfoList(list);
+}
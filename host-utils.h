@@ -23,6 +23,9 @@
  * THE SOFTWARE.
  */
 
+#ifndef HOST_UTILS_H
+#define HOST_UTILS_H
+
 #include "compiler.h"   /* QEMU_GNUC_PREREQ */
 
 #if defined(__x86_64__)
@@ -234,3 +237,17 @@ static inline int ctpop64(uint64_t val)
     return val;
 #endif
 }
+
+/* Host type specific sizes of these routines.  */
+
+static inline int ctzl(unsigned long val)
+{
+    return sizeof(val) == 4 ? ctz32(val) : ctz64(val);
+}
+
+static inline int ctpopl(unsigned long val)
+{
+    return sizeof(val) == 4 ? ctpop32(val) : ctpop64(val);
+}
+
+#endif
@@ -16,6 +16,7 @@
 #include "qemu-thread.h"
 #include "qemu-coroutine.h"
 #include "virtio-9p-coth.h"
+#include "virtio-9p-statcache.h"
 
 int v9fs_co_st_gen(V9fsPDU *pdu, V9fsPath *path, mode_t st_mode,
                    V9fsStatDotl *v9stat)
@@ -252,6 +253,12 @@ int v9fs_co_pwritev(V9fsPDU *pdu, V9fsFidState *fidp,
                 err = -errno;
             }
         });
+    if (err > 0 && s->ctx.stat_cache) {
+        /* size and mtime changed */
+        v9fs_path_read_lock(s);
+        v9fs_stat_cache_invalidate(s->ctx.stat_cache, fidp->path.data, false);
+        v9fs_path_unlock(s);
+    }
     return err;
 }
 
@@ -17,6 +17,7 @@
 #include "qemu-thread.h"
 #include "qemu-coroutine.h"
 #include "virtio-9p-coth.h"
+#include "qemu-barrier.h"
 
 /* v9fs glib thread pool */
 static V9fsThPool v9fs_pool;
@@ -37,6 +38,12 @@ static void v9fs_qemu_process_req_done(void *arg)
         len = read(v9fs_pool.rfd, &byte, sizeof(byte));
     } while (len == -1 &&  errno == EINTR);
 
+    /* Clear the flag before draining, so that a worker completing after
+     * this point writes a new notification byte.
+     */
+    __sync_lock_release(&v9fs_pool.notify_pending);
+    smp_mb();
+
     while ((co = g_async_queue_try_pop(v9fs_pool.completed)) != NULL) {
         qemu_coroutine_enter(co, NULL);
     }
@@ -51,18 +58,40 @@ static void v9fs_thread_routine(gpointer data, gpointer user_data)
     qemu_coroutine_enter(co, NULL);
 
     g_async_queue_push(v9fs_pool.completed, co);
+
+    /* Only the first completion since the QEMU thread last drained the
+     * queue needs to wake it up.
+     */
+    if (__sync_lock_test_and_set(&v9fs_pool.notify_pending, 1)) {
+        return;
+    }
     do {
         len = write(v9fs_pool.wfd, &byte, sizeof(byte));
     } while (len == -1 && errno == EINTR);
 }
 
-int v9fs_init_worker_threads(void)
+/*
+ * All 9p devices share one pool.  max_workers > 0 sizes it: the threads
+ * are created up front and kept, and the largest size requested by any
+ * device wins.  max_workers == 0 keeps the default pool that starts a
+ * thread for every outstanding request.
+ */
+int v9fs_init_worker_threads(int max_workers)
 {
     int ret = 0;
     int notifier_fds[2];
     V9fsThPool *p = &v9fs_pool;
     sigset_t set, oldset;
 
+    if (p->pool) {
+        if (max_workers > 0 && p->max_workers > 0 &&
+            max_workers > p->max_workers) {
+            g_thread_pool_set_max_threads(p->pool, max_workers, NULL);
+            p->max_workers = max_workers;
+        }
+        return 0;
+    }
+
     sigfillset(&set);
     /* Leave signal handling to the iothread.  */
     pthread_sigmask(SIG_SETMASK, &set, &oldset);
@@ -71,7 +100,14 @@ int v9fs_init_worker_threads(void)
         ret = -1;
         goto err_out;
     }
-    p->pool = g_thread_pool_new(v9fs_thread_routine, p, -1, FALSE, NULL);
+    if (max_workers > 0) {
+        p->pool = g_thread_pool_new(v9fs_thread_routine, p, max_workers,
+                                    TRUE, NULL);
+        p->max_workers = max_workers;
+    } else {
+        p->pool = g_thread_pool_new(v9fs_thread_routine, p, -1, FALSE, NULL);
+        p->max_workers = -1;
+    }
     if (!p->pool) {
         ret = -1;
         goto err_out;
@@ -14,6 +14,7 @@
 #include "hw/virtio.h"
 #include "virtio-9p.h"
 #include "virtio-9p-xattr.h"
+#include "virtio-9p-statcache.h"
 #include <arpa/inet.h>
 #include <pwd.h>
 #include <grp.h>
@@ -93,17 +94,28 @@ static int local_lstat(FsContext *fs_ctx, V9fsPath *fs_path, struct stat *stbuf)
     int err;
     char buffer[PATH_MAX];
     char *path = fs_path->data;
+    struct stat host;
 
+    if (v9fs_stat_cache_lookup(fs_ctx->stat_cache, path, stbuf)) {
+        return 0;
+    }
     err =  lstat(rpath(fs_ctx, path, buffer), stbuf);
     if (err) {
         return err;
     }
+    host = *stbuf;
     if (fs_ctx->export_flags & V9FS_SM_MAPPED) {
         /* Actual credentials are part of extended attrs */
         uid_t tmp_uid;
         gid_t tmp_gid;
         mode_t tmp_mode;
         dev_t tmp_dev;
+
+        /* setxattr bumps ctime, so an unchanged inode has the same attrs */
+        if (v9fs_stat_cache_lookup_attrs(fs_ctx->stat_cache, path,
+                                         &host, stbuf)) {
+            return 0;
+        }
         if (getxattr(rpath(fs_ctx, path, buffer), "user.virtfs.uid", &tmp_uid,
                     sizeof(uid_t)) > 0) {
             stbuf->st_uid = tmp_uid;
@@ -123,6 +135,7 @@ static int local_lstat(FsContext *fs_ctx, V9fsPath *fs_path, struct stat *stbuf)
     } else if (fs_ctx->export_flags & V9FS_SM_MAPPED_FILE) {
         local_mapped_file_attr(fs_ctx, path, stbuf);
     }
+    v9fs_stat_cache_insert(fs_ctx->stat_cache, path, &host, stbuf);
     return err;
 }
 
@@ -317,6 +330,9 @@ static int local_open(FsContext *ctx, V9fsPath *fs_path,
     char *path = fs_path->data;
 
     fs->fd = open(rpath(ctx, path, buffer), flags);
+    if (fs->fd >= 0 && (flags & O_TRUNC)) {
+        v9fs_stat_cache_invalidate(ctx->stat_cache, path, false);
+    }
     return fs->fd;
 }
 
@@ -416,16 +432,18 @@ static int local_chmod(FsContext *fs_ctx, V9fsPath *fs_path, FsCred *credp)
 {
     char buffer[PATH_MAX];
     char *path = fs_path->data;
+    int err = -1;
 
     if (fs_ctx->export_flags & V9FS_SM_MAPPED) {
-        return local_set_xattr(rpath(fs_ctx, path, buffer), credp);
+        err = local_set_xattr(rpath(fs_ctx, path, buffer), credp);
     } else if (fs_ctx->export_flags & V9FS_SM_MAPPED_FILE) {
-        return local_set_mapped_file_attr(fs_ctx, path, credp);
+        err = local_set_mapped_file_attr(fs_ctx, path, credp);
     } else if ((fs_ctx->export_flags & V9FS_SM_PASSTHROUGH) ||
                (fs_ctx->export_flags & V9FS_SM_NONE)) {
-        return chmod(rpath(fs_ctx, path, buffer), credp->fc_mode);
+        err = chmod(rpath(fs_ctx, path, buffer), credp->fc_mode);
     }
-    return -1;
+    v9fs_stat_cache_invalidate(fs_ctx->stat_cache, path, false);
+    return err;
 }
 
 static int local_mknod(FsContext *fs_ctx, V9fsPath *dir_path,
@@ -484,6 +502,7 @@ err_end:
     remove(rpath(fs_ctx, path, buffer));
     errno = serrno;
 out:
+    v9fs_stat_cache_invalidate(fs_ctx->stat_cache, fullname.data, false);
     v9fs_string_free(&fullname);
     return err;
 }
@@ -542,6 +561,7 @@ err_end:
     remove(rpath(fs_ctx, path, buffer));
     errno = serrno;
 out:
+    v9fs_stat_cache_invalidate(fs_ctx->stat_cache, fullname.data, false);
     v9fs_string_free(&fullname);
     return err;
 }
@@ -654,6 +674,7 @@ err_end:
     remove(rpath(fs_ctx, path, buffer));
     errno = serrno;
 out:
+    v9fs_stat_cache_invalidate(fs_ctx->stat_cache, fullname.data, false);
     v9fs_string_free(&fullname);
     return err;
 }
@@ -757,6 +778,7 @@ err_end:
     remove(rpath(fs_ctx, newpath, buffer));
     errno = serrno;
 out:
+    v9fs_stat_cache_invalidate(fs_ctx->stat_cache, fullname.data, false);
     v9fs_string_free(&fullname);
     return err;
 }
@@ -788,6 +810,8 @@ static int local_link(FsContext *ctx, V9fsPath *oldpath,
         }
     }
 err_out:
+    v9fs_stat_cache_invalidate(ctx->stat_cache, oldpath->data, false);
+    v9fs_stat_cache_invalidate(ctx->stat_cache, newpath.data, false);
     v9fs_string_free(&newpath);
     return ret;
 }
@@ -797,7 +821,11 @@ static int local_truncate(FsContext *ctx, V9fsPath *fs_path, off_t size)
     char buffer[PATH_MAX];
     char *path = fs_path->data;
 
-    return truncate(rpath(ctx, path, buffer), size);
+    int err;
+
+    err = truncate(rpath(ctx, path, buffer), size);
+    v9fs_stat_cache_invalidate(ctx->stat_cache, path, false);
+    return err;
 }
 
 static int local_rename(FsContext *ctx, const char *oldpath,
@@ -815,10 +843,14 @@ static int local_rename(FsContext *ctx, const char *oldpath,
         err = rename(local_mapped_attr_path(ctx, oldpath, buffer),
                      local_mapped_attr_path(ctx, newpath, buffer1));
         if (err < 0 && errno != ENOENT) {
-            return err;
+            goto out;
         }
     }
-    return rename(rpath(ctx, oldpath, buffer), rpath(ctx, newpath, buffer1));
+    err = rename(rpath(ctx, oldpath, buffer), rpath(ctx, newpath, buffer1));
+out:
+    v9fs_stat_cache_invalidate(ctx->stat_cache, oldpath, true);
+    v9fs_stat_cache_invalidate(ctx->stat_cache, newpath, true);
+    return err;
 }
 
 static int local_chown(FsContext *fs_ctx, V9fsPath *fs_path, FsCred *credp)
@@ -826,17 +858,20 @@ static int local_chown(FsContext *fs_ctx, V9fsPath *fs_path, FsCred *credp)
     char buffer[PATH_MAX];
     char *path = fs_path->data;
 
+    int err = -1;
+
     if ((credp->fc_uid == -1 && credp->fc_gid == -1) ||
         (fs_ctx->export_flags & V9FS_SM_PASSTHROUGH) ||
         (fs_ctx->export_flags & V9FS_SM_NONE)) {
-        return lchown(rpath(fs_ctx, path, buffer),
-                      credp->fc_uid, credp->fc_gid);
+        err = lchown(rpath(fs_ctx, path, buffer),
+                     credp->fc_uid, credp->fc_gid);
     } else if (fs_ctx->export_flags & V9FS_SM_MAPPED) {
-        return local_set_xattr(rpath(fs_ctx, path, buffer), credp);
+        err = local_set_xattr(rpath(fs_ctx, path, buffer), credp);
     } else if (fs_ctx->export_flags & V9FS_SM_MAPPED_FILE) {
-        return local_set_mapped_file_attr(fs_ctx, path, credp);
+        err = local_set_mapped_file_attr(fs_ctx, path, credp);
     }
-    return -1;
+    v9fs_stat_cache_invalidate(fs_ctx->stat_cache, path, false);
+    return err;
 }
 
 static int local_utimensat(FsContext *s, V9fsPath *fs_path,
@@ -845,7 +880,11 @@ static int local_utimensat(FsContext *s, V9fsPath *fs_path,
     char buffer[PATH_MAX];
     char *path = fs_path->data;
 
-    return qemu_utimens(rpath(s, path, buffer), buf);
+    int err;
+
+    err = qemu_utimens(rpath(s, path, buffer), buf);
+    v9fs_stat_cache_invalidate(s->stat_cache, path, false);
+    return err;
 }
 
 static int local_remove(FsContext *ctx, const char *path)
@@ -887,8 +926,9 @@ static int local_remove(FsContext *ctx, const char *path)
             goto err_out;
         }
     }
-    return remove(rpath(ctx, path, buffer));
+    err = remove(rpath(ctx, path, buffer));
 err_out:
+    v9fs_stat_cache_invalidate(ctx->stat_cache, path, true);
     return err;
 }
 
@@ -939,7 +979,11 @@ static int local_lsetxattr(FsContext *ctx, V9fsPath *fs_path, const char *name,
 {
     char *path = fs_path->data;
 
-    return v9fs_set_xattr(ctx, path, name, value, size, flags);
+    int err;
+
+    err = v9fs_set_xattr(ctx, path, name, value, size, flags);
+    v9fs_stat_cache_invalidate(ctx->stat_cache, path, false);
+    return err;
 }
 
 static int local_lremovexattr(FsContext *ctx, V9fsPath *fs_path,
@@ -947,7 +991,11 @@ static int local_lremovexattr(FsContext *ctx, V9fsPath *fs_path,
 {
     char *path = fs_path->data;
 
-    return v9fs_remove_xattr(ctx, path, name);
+    int err;
+
+    err = v9fs_remove_xattr(ctx, path, name);
+    v9fs_stat_cache_invalidate(ctx->stat_cache, path, false);
+    return err;
 }
 
 static int local_name_to_path(FsContext *ctx, V9fsPath *dir_path,
@@ -1025,9 +1073,10 @@ static int local_unlinkat(FsContext *ctx, V9fsPath *dir,
     }
     /* Remove the name finally */
     ret = remove(rpath(ctx, fullname.data, buffer));
-    v9fs_string_free(&fullname);
 
 err_out:
+    v9fs_stat_cache_invalidate(ctx->stat_cache, fullname.data, true);
+    v9fs_string_free(&fullname);
     return ret;
 }
 
@@ -1076,6 +1125,13 @@ static int local_init(FsContext *ctx)
         ctx->xops = passthrough_xattr_ops;
     }
     ctx->export_flags |= V9FS_PATHNAME_FSCONTEXT;
+    /*
+     * Without a ttl only the xattr lookups of the mapped model are saved
+     */
+    if (ctx->stat_cache_ttl > 0 || (ctx->export_flags & V9FS_SM_MAPPED)) {
+        ctx->stat_cache = v9fs_stat_cache_new(V9FS_STAT_CACHE_MAX,
+                                              ctx->stat_cache_ttl);
+    }
 #ifdef FS_IOC_GETVERSION
     /*
      * use ioc_getversion only if the iocl is definied
@@ -1128,6 +1184,7 @@ static int local_parse_opts(QemuOpts *opts, struct FsDriverEntry *fse)
         return -1;
     }
     fse->path = g_strdup(path);
+    fse->stat_cache_ttl = qemu_opt_get_number(opts, "stat_cache_ttl", 0);
 
     return 0;
 }
@@ -0,0 +1,202 @@
+/*
+ * Virtio 9p stat/attribute cache
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu-queue.h"
+#include "qemu-thread.h"
+#include "qemu-timer.h"
+#include "virtio-9p-statcache.h"
+
+typedef struct V9fsStatCacheEntry {
+    char *path;
+    struct stat host;
+    struct stat stbuf;
+    int64_t stamp;
+    QTAILQ_ENTRY(V9fsStatCacheEntry) lru;
+} V9fsStatCacheEntry;
+
+struct V9fsStatCache {
+    /* lookups run on the 9p worker threads */
+    QemuMutex lock;
+    GHashTable *entries;
+    QTAILQ_HEAD(V9fsStatCacheLru, V9fsStatCacheEntry) lru;
+    int num_entries;
+    int max_entries;
+    int64_t ttl_ns;
+};
+
+static void entry_free(V9fsStatCache *c, V9fsStatCacheEntry *e)
+{
+    QTAILQ_REMOVE(&c->lru, e, lru);
+    c->num_entries--;
+    g_free(e->path);
+    g_free(e);
+}
+
+static void entry_remove(V9fsStatCache *c, const char *path)
+{
+    V9fsStatCacheEntry *e = g_hash_table_lookup(c->entries, path);
+
+    if (e) {
+        g_hash_table_remove(c->entries, path);
+        entry_free(c, e);
+    }
+}
+
+static bool same_inode(const struct stat *a, const struct stat *b)
+{
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+           a->st_ctim.tv_sec == b->st_ctim.tv_sec &&
+           a->st_ctim.tv_nsec == b->st_ctim.tv_nsec;
+}
+
+V9fsStatCache *v9fs_stat_cache_new(int max_entries, int64_t ttl_ms)
+{
+    V9fsStatCache *c = g_malloc0(sizeof(*c));
+
+    qemu_mutex_init(&c->lock);
+    c->entries = g_hash_table_new(g_str_hash, g_str_equal);
+    QTAILQ_INIT(&c->lru);
+    c->max_entries = max_entries;
+    c->ttl_ns = ttl_ms * 1000000LL;
+    return c;
+}
+
+void v9fs_stat_cache_free(V9fsStatCache *c)
+{
+    V9fsStatCacheEntry *e, *next;
+
+    if (!c) {
+        return;
+    }
+    QTAILQ_FOREACH_SAFE(e, &c->lru, lru, next) {
+        entry_free(c, e);
+    }
+    g_hash_table_destroy(c->entries);
+    qemu_mutex_destroy(&c->lock);
+    g_free(c);
+}
+
+bool v9fs_stat_cache_lookup(V9fsStatCache *c, const char *path,
+                            struct stat *stbuf)
+{
+    V9fsStatCacheEntry *e;
+    bool hit = false;
+
+    if (!c || !c->ttl_ns) {
+        return false;
+    }
+
+    qemu_mutex_lock(&c->lock);
+    e = g_hash_table_lookup(c->entries, path);
+    if (e && get_clock() - e->stamp < c->ttl_ns) {
+        *stbuf = e->stbuf;
+        QTAILQ_REMOVE(&c->lru, e, lru);
+        QTAILQ_INSERT_HEAD(&c->lru, e, lru);
+        hit = true;
+    }
+    qemu_mutex_unlock(&c->lock);
+    return hit;
+}
+
+bool v9fs_stat_cache_lookup_attrs(V9fsStatCache *c, const char *path,
+                                  const struct stat *host, struct stat *stbuf)
+{
+    V9fsStatCacheEntry *e;
+    bool hit = false;
+
+    if (!c) {
+        return false;
+    }
+
+    qemu_mutex_lock(&c->lock);
+    e = g_hash_table_lookup(c->entries, path);
+    if (e && same_inode(&e->host, host)) {
+        *stbuf = *host;
+        stbuf->st_uid = e->stbuf.st_uid;
+        stbuf->st_gid = e->stbuf.st_gid;
+        stbuf->st_mode = e->stbuf.st_mode;
+        stbuf->st_rdev = e->stbuf.st_rdev;
+        e->host = *host;
+        e->stbuf = *stbuf;
+        e->stamp = get_clock();
+        QTAILQ_REMOVE(&c->lru, e, lru);
+        QTAILQ_INSERT_HEAD(&c->lru, e, lru);
+        hit = true;
+    }
+    qemu_mutex_unlock(&c->lock);
+    return hit;
+}
+
+void v9fs_stat_cache_insert(V9fsStatCache *c, const char *path,
+                            const struct stat *host, const struct stat *stbuf)
+{
+    V9fsStatCacheEntry *e;
+
+    if (!c) {
+        return;
+    }
+
+    qemu_mutex_lock(&c->lock);
+    e = g_hash_table_lookup(c->entries, path);
+    if (e) {
+        QTAILQ_REMOVE(&c->lru, e, lru);
+    } else {
+        if (c->num_entries >= c->max_entries) {
+            V9fsStatCacheEntry *old = QTAILQ_LAST(&c->lru, V9fsStatCacheLru);
+
+            g_hash_table_remove(c->entries, old->path);
+            entry_free(c, old);
+        }
+        e = g_malloc0(sizeof(*e));
+        e->path = g_strdup(path);
+        g_hash_table_insert(c->entries, e->path, e);
+        c->num_entries++;
+    }
+    e->host = *host;
+    e->stbuf = *stbuf;
+    e->stamp = get_clock();
+    QTAILQ_INSERT_HEAD(&c->lru, e, lru);
+    qemu_mutex_unlock(&c->lock);
+}
+
+void v9fs_stat_cache_invalidate(V9fsStatCache *c, const char *path,
+                                bool tree)
+{
+    V9fsStatCacheEntry *e, *next;
+    const char *slash;
+    size_t len;
+
+    if (!c) {
+        return;
+    }
+
+    qemu_mutex_lock(&c->lock);
+    entry_remove(c, path);
+
+    /* The parent's mtime, ctime and link count change with its entries */
+    slash = strrchr(path, '/');
+    if (slash) {
+        char *parent = slash == path ? g_strdup("/") :
+                       g_strndup(path, slash - path);
+        entry_remove(c, parent);
+        g_free(parent);
+    }
+
+    if (tree) {
+        len = strlen(path);
+        QTAILQ_FOREACH_SAFE(e, &c->lru, lru, next) {
+            if (!strncmp(e->path, path, len) && e->path[len] == '/') {
+                g_hash_table_remove(c->entries, e->path);
+                entry_free(c, e);
+            }
+        }
+    }
+    qemu_mutex_unlock(&c->lock);
+}
@@ -0,0 +1,46 @@
+/*
+ * Virtio 9p stat/attribute cache
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef _QEMU_VIRTIO_9P_STATCACHE_H
+#define _QEMU_VIRTIO_9P_STATCACHE_H
+
+#include <sys/stat.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define V9FS_STAT_CACHE_MAX 4096
+
+typedef struct V9fsStatCache V9fsStatCache;
+
+/*
+ * The cache maps a backend path to the result of its lstat, including the
+ * credentials mapped from xattrs or metadata files.  The attribute part is
+ * revalidated against the inode and ctime of a fresh host lstat, which any
+ * chmod, chown, setxattr or write updates.  With a non-zero ttl_ms the
+ * whole result is reused without a host lstat for that long.
+ *
+ * All functions accept a NULL cache and then do nothing.
+ */
+V9fsStatCache *v9fs_stat_cache_new(int max_entries, int64_t ttl_ms);
+void v9fs_stat_cache_free(V9fsStatCache *c);
+
+bool v9fs_stat_cache_lookup(V9fsStatCache *c, const char *path,
+                            struct stat *stbuf);
+bool v9fs_stat_cache_lookup_attrs(V9fsStatCache *c, const char *path,
+                                  const struct stat *host, struct stat *stbuf);
+void v9fs_stat_cache_insert(V9fsStatCache *c, const char *path,
+                            const struct stat *host, const struct stat *stbuf);
+
+/*
+ * Drop path and its parent directory; with tree also everything below
+ * path (for rename and remove of directories).
+ */
+void v9fs_stat_cache_invalidate(V9fsStatCache *c, const char *path,
+                                bool tree);
+
+#endif
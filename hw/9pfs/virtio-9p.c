@@ -261,6 +261,7 @@ static V9fsFidState *alloc_fid(V9fsState *s, int32_t fid)
     f->fid = fid;
     f->fid_type = P9_FID_NONE;
     f->ref = 1;
+    qemu_co_mutex_init(&f->io_lock);
     /*
      * Mark the fid as referenced so that the LRU
      * reclaim won't close the file descriptor
@@ -1503,10 +1504,12 @@ static void v9fs_fsync(void *opaque)
         err = -ENOENT;
         goto out_nofid;
     }
+    qemu_co_mutex_lock(&fidp->io_lock);
     err = v9fs_co_fsync(pdu, fidp, datasync);
     if (!err) {
         err = offset;
     }
+    qemu_co_mutex_unlock(&fidp->io_lock);
     put_fid(pdu, fidp);
 out_nofid:
     complete_pdu(s, pdu, err);
@@ -1693,6 +1696,7 @@ static void v9fs_read(void *opaque)
         err = -EINVAL;
         goto out_nofid;
     }
+    qemu_co_mutex_lock(&fidp->io_lock);
     if (fidp->fid_type == P9_FID_DIR) {
 
         if (off == 0) {
@@ -1732,16 +1736,19 @@ static void v9fs_read(void *opaque)
             if (len < 0) {
                 /* IO error return the error */
                 err = len;
-                goto out;
+                break;
             }
         } while (count < max_count && len > 0);
+        qemu_iovec_destroy(&qiov);
+        qemu_iovec_destroy(&qiov_full);
+        if (err < 0) {
+            goto out;
+        }
         err = pdu_marshal(pdu, offset, "d", count);
         if (err < 0) {
             goto out;
         }
         err += offset + count;
-        qemu_iovec_destroy(&qiov);
-        qemu_iovec_destroy(&qiov_full);
     } else if (fidp->fid_type == P9_FID_XATTR) {
         err = v9fs_xattr_read(s, pdu, fidp, off, max_count);
     } else {
@@ -1749,6 +1756,7 @@ static void v9fs_read(void *opaque)
     }
     trace_v9fs_read_return(pdu->tag, pdu->id, count, err);
 out:
+    qemu_co_mutex_unlock(&fidp->io_lock);
     put_fid(pdu, fidp);
 out_nofid:
     complete_pdu(s, pdu, err);
@@ -1852,6 +1860,7 @@ static void v9fs_readdir(void *opaque)
         retval = -EINVAL;
         goto out_nofid;
     }
+    qemu_co_mutex_lock(&fidp->io_lock);
     if (!fidp->fs.dir) {
         retval = -EINVAL;
         goto out;
@@ -1873,6 +1882,7 @@ static void v9fs_readdir(void *opaque)
     retval += count + offset;
     trace_v9fs_readdir_return(pdu->tag, pdu->id, count, retval);
 out:
+    qemu_co_mutex_unlock(&fidp->io_lock);
     put_fid(pdu, fidp);
 out_nofid:
     complete_pdu(s, pdu, retval);
@@ -1953,6 +1963,7 @@ static void v9fs_write(void *opaque)
         err = -EINVAL;
         goto out_nofid;
     }
+    qemu_co_mutex_lock(&fidp->io_lock);
     if (fidp->fid_type == P9_FID_FILE) {
         if (fidp->fs.fd == -1) {
             err = -EINVAL;
@@ -2001,6 +2012,7 @@ static void v9fs_write(void *opaque)
 out_qiov:
     qemu_iovec_destroy(&qiov);
 out:
+    qemu_co_mutex_unlock(&fidp->io_lock);
     put_fid(pdu, fidp);
 out_nofid:
     qemu_iovec_destroy(&qiov_full);
@@ -200,6 +200,12 @@ struct V9fsFidState
     uid_t uid;
     int ref;
     int clunked;
+    /*
+     * Requests run in parallel on the worker pool; I/O on the same fid
+     * is serialized in arrival order so that the file offset and
+     * directory stream of a fid see the guest's order.
+     */
+    CoMutex io_lock;
     V9fsFidState *next;
     V9fsFidState *rclm_lst;
 };
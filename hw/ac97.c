@@ -855,6 +855,8 @@ static void nabm_writeb (void *opaque, uint32_t addr, uint32_t val)
             r->civ = r->piv;
             r->piv = (r->piv + 1) % 32;
             fetch_bd (s, r);
+            /* Restart the audio timer if it stopped while we were halted */
+            voice_set_active (s, GET_BM (index), 1);
         }
         r->lvi = val % 32;
         dolog ("LVI[%d] <- %#x\n", GET_BM (index), val);
@@ -28,6 +28,7 @@
 #include "range.h"
 #include "ioport.h"
 #include "fw_cfg.h"
+#include "mem_hotplug.h"
 
 //#define DEBUG
 
@@ -45,8 +46,27 @@
 #define PCI_DOWN_BASE 0xae04
 #define PCI_EJ_BASE 0xae08
 #define PCI_RMV_BASE 0xae0c
+#define PROC_BASE 0xaf00
+#define PROC_LEN 32
+#define MEM_BASE 0xaf80
+#define MEM_LEN 24
 
 #define PIIX4_PCI_HOTPLUG_STATUS 2
+#define PIIX4_CPU_HOTPLUG_STATUS 4
+#define PIIX4_MEM_HOTPLUG_STATUS 8
+
+/* Memory hotplug registers, all 32 bits wide; the first five describe the
+ * slot selected by writing its index to MEM_STATUS.
+ */
+#define MEM_ADDR_LO     0x00
+#define MEM_ADDR_HI     0x04
+#define MEM_SIZE_LO     0x08
+#define MEM_SIZE_HI     0x0c
+#define MEM_STATUS      0x10    /* read: status bits, write: select slot */
+#define MEM_EVENT       0x14    /* read: number of slots, write: ack bits */
+
+#define MEM_STATUS_POPULATED    1
+#define MEM_STATUS_INSERT       2
 
 struct pci_status {
     uint32_t up; /* deprecated, maintained for migration compatibility */
@@ -55,7 +75,8 @@ struct pci_status {
 
 typedef struct PIIX4PMState {
     PCIDevice dev;
-    IORange ioport;
+    MemoryRegion io;
+    MemoryRegion io_tmr;
     ACPIREGS ar;
 
     APMState apm;
@@ -74,6 +95,15 @@ typedef struct PIIX4PMState {
     uint32_t pci0_hotplug_enable;
     uint32_t pci0_slot_device_present;
 
+    /* for cpu hotplug, one bit per present APIC id */
+    Notifier cpu_added_notifier;
+    uint8_t cpus_sts[PROC_LEN];
+
+    /* for memory hotplug */
+    Notifier mem_added_notifier;
+    uint32_t mem_insert;
+    uint32_t mem_selector;
+
     uint8_t disable_s3;
     uint8_t disable_s4;
     uint8_t s4_val;
@@ -95,7 +125,8 @@ static void pm_update_sci(PIIX4PMState *s)
                    ACPI_BITMASK_GLOBAL_LOCK_ENABLE |
                    ACPI_BITMASK_TIMER_ENABLE)) != 0) ||
         (((s->ar.gpe.sts[0] & s->ar.gpe.en[0])
-          & PIIX4_PCI_HOTPLUG_STATUS) != 0);
+          & (PIIX4_PCI_HOTPLUG_STATUS | PIIX4_CPU_HOTPLUG_STATUS |
+             PIIX4_MEM_HOTPLUG_STATUS)) != 0);
 
     qemu_set_irq(s->irq, sci_level);
     /* schedule a timer interruption if needed */
@@ -109,10 +140,10 @@ static void pm_tmr_timer(ACPIREGS *ar)
     pm_update_sci(s);
 }
 
-static void pm_ioport_write(IORange *ioport, uint64_t addr, unsigned width,
-                            uint64_t val)
+static void pm_ioport_write(void *opaque, hwaddr addr, uint64_t val,
+                            unsigned width)
 {
-    PIIX4PMState *s = container_of(ioport, PIIX4PMState, ioport);
+    PIIX4PMState *s = opaque;
 
     if (width != 2) {
         PIIX4_DPRINTF("PM write port=0x%04x width=%d val=0x%08x\n",
@@ -138,10 +169,9 @@ static void pm_ioport_write(IORange *ioport, uint64_t addr, unsigned width,
                   (unsigned int)val);
 }
 
-static void pm_ioport_read(IORange *ioport, uint64_t addr, unsigned width,
-                            uint64_t *data)
+static uint64_t pm_ioport_read(void *opaque, hwaddr addr, unsigned width)
 {
-    PIIX4PMState *s = container_of(ioport, PIIX4PMState, ioport);
+    PIIX4PMState *s = opaque;
     uint32_t val;
 
     switch(addr) {
@@ -154,20 +184,38 @@ static void pm_ioport_read(IORange *ioport, uint64_t addr, unsigned width,
     case 0x04:
         val = s->ar.pm1.cnt.cnt;
         break;
-    case 0x08:
-        val = acpi_pm_tmr_get(&s->ar);
-        break;
     default:
         val = 0;
         break;
     }
     PIIX4_DPRINTF("PM readw port=0x%04x val=0x%04x\n", (unsigned int)addr, val);
-    *data = val;
+    return val;
 }
 
-static const IORangeOps pm_iorange_ops = {
+static const MemoryRegionOps pm_io_ops = {
     .read = pm_ioport_read,
     .write = pm_ioport_write,
+    .endianness = DEVICE_LITTLE_ENDIAN,
+};
+
+/* The timer only reads vm_clock, so it is dispatched without the global
+   mutex; guests that use it as their clocksource read it very often.  */
+static uint64_t pm_tmr_read(void *opaque, hwaddr addr, unsigned width)
+{
+    PIIX4PMState *s = opaque;
+
+    return acpi_pm_tmr_get(&s->ar) >> (addr * 8);
+}
+
+static void pm_tmr_write(void *opaque, hwaddr addr, uint64_t val,
+                         unsigned width)
+{
+}
+
+static const MemoryRegionOps pm_tmr_ops = {
+    .read = pm_tmr_read,
+    .write = pm_tmr_write,
+    .endianness = DEVICE_LITTLE_ENDIAN,
 };
 
 static void apm_ctrl_changed(uint32_t val, void *arg)
@@ -193,15 +241,14 @@ static void pm_io_space_update(PIIX4PMState *s)
 {
     uint32_t pm_io_base;
 
-    if (s->dev.config[0x80] & 1) {
-        pm_io_base = le32_to_cpu(*(uint32_t *)(s->dev.config + 0x40));
-        pm_io_base &= 0xffc0;
+    pm_io_base = le32_to_cpu(*(uint32_t *)(s->dev.config + 0x40));
+    pm_io_base &= 0xffc0;
 
-        /* XXX: need to improve memory and ioport allocation */
-        PIIX4_DPRINTF("PM: mapping to 0x%x\n", pm_io_base);
-        iorange_init(&s->ioport, &pm_iorange_ops, pm_io_base, 64);
-        ioport_register(&s->ioport);
-    }
+    memory_region_transaction_begin();
+    memory_region_set_enabled(&s->io, s->dev.config[0x80] & 1);
+    memory_region_set_address(&s->io, pm_io_base);
+    memory_region_transaction_commit();
+    PIIX4_DPRINTF("PM: mapping to 0x%x\n", pm_io_base);
 }
 
 static void pm_write_config(PCIDevice *d,
@@ -302,6 +349,23 @@ static int acpi_load_old(QEMUFile *f, void *opaque, int version_id)
     return ret;
 }
 
+static bool vmstate_memhp_needed(void *opaque)
+{
+    return mem_hotplug_nr_slots() > 0;
+}
+
+static const VMStateDescription vmstate_memhp = {
+    .name = "piix4_pm/memhp",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields      = (VMStateField []) {
+        VMSTATE_UINT32(mem_insert, PIIX4PMState),
+        VMSTATE_UINT32(mem_selector, PIIX4PMState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 /* qemu-kvm 1.2 uses version 3 but advertised as 2
  * To support incoming qemu-kvm 1.2 migration, change version_id
  * and minimum_version_id to 2 below (which breaks migration from
@@ -327,6 +391,14 @@ static const VMStateDescription vmstate_acpi = {
         VMSTATE_STRUCT(pci0_status, PIIX4PMState, 2, vmstate_pci_status,
                        struct pci_status),
         VMSTATE_END_OF_LIST()
+    },
+    .subsections = (VMStateSubsection[]) {
+        {
+            .vmsd = &vmstate_memhp,
+            .needed = vmstate_memhp_needed,
+        }, {
+            /* empty */
+        }
     }
 };
 
@@ -459,6 +531,13 @@ static int piix4_pm_initfn(PCIDevice *dev)
     acpi_pm_tmr_init(&s->ar, pm_tmr_timer);
     acpi_gpe_init(&s->ar, GPE_LEN);
 
+    memory_region_init_io(&s->io, &pm_io_ops, s, "piix4-pm", 64);
+    memory_region_set_enabled(&s->io, false);
+    memory_region_add_subregion(pci_address_space_io(dev), 0, &s->io);
+    memory_region_init_io(&s->io_tmr, &pm_tmr_ops, s, "piix4-pm-tmr", 4);
+    memory_region_set_lockless(&s->io_tmr, true);
+    memory_region_add_subregion_overlap(&s->io, 0x08, &s->io_tmr, 1);
+
     s->powerdown_notifier.notify = piix4_pm_powerdown_req;
     qemu_register_powerdown_notifier(&s->powerdown_notifier);
 
@@ -602,11 +681,105 @@ static uint32_t pcirmv_read(void *opaque, uint32_t addr)
     return s->pci0_hotplug_enable;
 }
 
+static uint32_t cpu_status_read(void *opaque, uint32_t addr)
+{
+    PIIX4PMState *s = opaque;
+    uint32_t val = s->cpus_sts[addr - PROC_BASE];
+
+    PIIX4_DPRINTF("cpu_status_read %x == %x\n", addr, val);
+    return val;
+}
+
+static void cpu_status_write(void *opaque, uint32_t addr, uint32_t val)
+{
+    /* the bitmap is only changed by QEMU */
+}
+
+static void piix4_cpu_added(Notifier *n, void *opaque)
+{
+    PIIX4PMState *s = container_of(n, PIIX4PMState, cpu_added_notifier);
+    int64_t id = *(int64_t *)opaque;
+
+    if (id < 0 || id >= PROC_LEN * 8) {
+        return;
+    }
+    s->cpus_sts[id / 8] |= 1 << (id % 8);
+    s->ar.gpe.sts[0] |= PIIX4_CPU_HOTPLUG_STATUS;
+    pm_update_sci(s);
+}
+
+static uint32_t mem_read(void *opaque, uint32_t addr)
+{
+    PIIX4PMState *s = opaque;
+    const MemHotplugSlot *slot = mem_hotplug_get_slot(s->mem_selector);
+    uint32_t val = 0;
+
+    switch (addr - MEM_BASE) {
+    case MEM_ADDR_LO:
+        val = slot ? slot->addr : 0;
+        break;
+    case MEM_ADDR_HI:
+        val = slot ? slot->addr >> 32 : 0;
+        break;
+    case MEM_SIZE_LO:
+        val = slot ? slot->size : 0;
+        break;
+    case MEM_SIZE_HI:
+        val = slot ? slot->size >> 32 : 0;
+        break;
+    case MEM_STATUS:
+        if (slot && slot->memdev) {
+            val |= MEM_STATUS_POPULATED;
+        }
+        if (s->mem_insert & (1U << s->mem_selector)) {
+            val |= MEM_STATUS_INSERT;
+        }
+        break;
+    case MEM_EVENT:
+        val = mem_hotplug_nr_slots();
+        break;
+    }
+
+    PIIX4_DPRINTF("mem_read %x == %x\n", addr, val);
+    return val;
+}
+
+static void mem_write(void *opaque, uint32_t addr, uint32_t val)
+{
+    PIIX4PMState *s = opaque;
+
+    switch (addr - MEM_BASE) {
+    case MEM_STATUS:
+        if (val < mem_hotplug_nr_slots()) {
+            s->mem_selector = val;
+        }
+        break;
+    case MEM_EVENT:
+        if (val & MEM_STATUS_INSERT) {
+            s->mem_insert &= ~(1U << s->mem_selector);
+        }
+        break;
+    }
+
+    PIIX4_DPRINTF("mem_write %x <== %x\n", addr, val);
+}
+
+static void piix4_mem_added(Notifier *n, void *opaque)
+{
+    PIIX4PMState *s = container_of(n, PIIX4PMState, mem_added_notifier);
+    int slot = *(int *)opaque;
+
+    s->mem_insert |= 1U << slot;
+    s->ar.gpe.sts[0] |= PIIX4_MEM_HOTPLUG_STATUS;
+    pm_update_sci(s);
+}
+
 static int piix4_device_hotplug(DeviceState *qdev, PCIDevice *dev,
                                 PCIHotplugState state);
 
 static void piix4_acpi_system_hot_add_init(PCIBus *bus, PIIX4PMState *s)
 {
+    int i;
 
     register_ioport_write(GPE_BASE, GPE_LEN, 1, gpe_writeb, s);
     register_ioport_read(GPE_BASE, GPE_LEN, 1,  gpe_readb, s);
@@ -620,6 +793,22 @@ static void piix4_acpi_system_hot_add_init(PCIBus *bus, PIIX4PMState *s)
 
     register_ioport_read(PCI_RMV_BASE, 4, 4,  pcirmv_read, s);
 
+    /* APIC ids are cpu_index values, so the boot CPUs are 0..smp_cpus-1 */
+    for (i = 0; i < smp_cpus && i < PROC_LEN * 8; i++) {
+        s->cpus_sts[i / 8] |= 1 << (i % 8);
+    }
+    register_ioport_read(PROC_BASE, PROC_LEN, 1, cpu_status_read, s);
+    register_ioport_write(PROC_BASE, PROC_LEN, 1, cpu_status_write, s);
+    s->cpu_added_notifier.notify = piix4_cpu_added;
+    qemu_register_cpu_added_notifier(&s->cpu_added_notifier);
+
+    if (mem_hotplug_nr_slots()) {
+        register_ioport_read(MEM_BASE, MEM_LEN, 4, mem_read, s);
+        register_ioport_write(MEM_BASE, MEM_LEN, 4, mem_write, s);
+        s->mem_added_notifier.notify = piix4_mem_added;
+        mem_hotplug_add_notifier(&s->mem_added_notifier);
+    }
+
     pci_bus_hotplug(bus, piix4_device_hotplug, &s->dev.qdev);
 }
 
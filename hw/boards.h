@@ -4,6 +4,7 @@
 #define HW_BOARDS_H
 
 #include "qdev.h"
+#include "memory.h"
 
 typedef struct QEMUMachineInitArgs {
     ram_addr_t ram_size;
@@ -18,12 +19,15 @@ typedef void QEMUMachineInitFunc(QEMUMachineInitArgs *args);
 
 typedef void QEMUMachineResetFunc(void);
 
+typedef void QEMUMachineHotAddCPUFunc(const int64_t id, Error **errp);
+
 typedef struct QEMUMachine {
     const char *name;
     const char *alias;
     const char *desc;
     QEMUMachineInitFunc *init;
     QEMUMachineResetFunc *reset;
+    QEMUMachineHotAddCPUFunc *hot_add_cpu;
     int use_scsi;
     int max_cpus;
     unsigned int no_serial:1,
@@ -44,4 +48,10 @@ QEMUMachine *find_default_machine(void);
 
 extern QEMUMachine *current_machine;
 
+/* Initialize mr as the guest RAM of a machine, backed by the -numa memdev
+ * backends when given and by anonymous memory otherwise.
+ */
+void memory_region_allocate_system_memory(MemoryRegion *mr, const char *name,
+                                          uint64_t size);
+
 #endif
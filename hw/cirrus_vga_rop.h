@@ -37,11 +37,24 @@ static inline void glue(rop_32_,ROP_NAME)(uint32_t *dst, uint32_t src)
     *dst = ROP_FN(*dst, src);
 }
 
+static inline void glue(rop_64_,ROP_NAME)(uint64_t *dst, uint64_t src)
+{
+    *dst = ROP_FN(*dst, src);
+}
+
 #define ROP_OP(d, s) glue(rop_8_,ROP_NAME)(d, s)
 #define ROP_OP_16(d, s) glue(rop_16_,ROP_NAME)(d, s)
 #define ROP_OP_32(d, s) glue(rop_32_,ROP_NAME)(d, s)
+#define ROP_OP_64(d, s) glue(rop_64_,ROP_NAME)(d, s)
 #undef ROP_FN
 
+/* The raster operations are bitwise, so the plain blits combine 8 bytes
+ * at once.  That gives the same result as going byte by byte unless the
+ * destination trails the source by less than 8 bytes, in which case
+ * bytes written early would be read again as source.
+ */
+#define ROP_WIDE_OK(trail) ((trail) <= 0 || (trail) >= 8)
+
 static void
 glue(cirrus_bitblt_rop_fwd_, ROP_NAME)(CirrusVGAState *s,
                              uint8_t *dst,const uint8_t *src,
@@ -49,6 +62,7 @@ glue(cirrus_bitblt_rop_fwd_, ROP_NAME)(CirrusVGAState *s,
                              int bltwidth,int bltheight)
 {
     int x,y;
+    bool wide;
     dstpitch -= bltwidth;
     srcpitch -= bltwidth;
 
@@ -57,8 +71,22 @@ glue(cirrus_bitblt_rop_fwd_, ROP_NAME)(CirrusVGAState *s,
         return;
     }
 
+    wide = ROP_WIDE_OK(dst - src);
     for (y = 0; y < bltheight; y++) {
-        for (x = 0; x < bltwidth; x++) {
+        x = 0;
+        if (wide) {
+            for (; x + 8 <= bltwidth; x += 8) {
+                uint64_t d, v;
+
+                memcpy(&d, dst, 8);
+                memcpy(&v, src, 8);
+                ROP_OP_64(&d, v);
+                memcpy(dst, &d, 8);
+                dst += 8;
+                src += 8;
+            }
+        }
+        for (; x < bltwidth; x++) {
             ROP_OP(dst, *src);
             dst++;
             src++;
@@ -75,10 +103,25 @@ glue(cirrus_bitblt_rop_bkwd_, ROP_NAME)(CirrusVGAState *s,
                                         int bltwidth,int bltheight)
 {
     int x,y;
+    bool wide;
     dstpitch += bltwidth;
     srcpitch += bltwidth;
+    wide = ROP_WIDE_OK(src - dst);
     for (y = 0; y < bltheight; y++) {
-        for (x = 0; x < bltwidth; x++) {
+        x = 0;
+        if (wide) {
+            for (; x + 8 <= bltwidth; x += 8) {
+                uint64_t d, v;
+
+                memcpy(&d, dst - 7, 8);
+                memcpy(&v, src - 7, 8);
+                ROP_OP_64(&d, v);
+                memcpy(dst - 7, &d, 8);
+                dst -= 8;
+                src -= 8;
+            }
+        }
+        for (; x < bltwidth; x++) {
             ROP_OP(dst, *src);
             dst--;
             src--;
@@ -206,3 +249,5 @@ glue(glue(cirrus_bitblt_rop_bkwd_transp_, ROP_NAME),_16)(CirrusVGAState *s,
 #undef ROP_OP
 #undef ROP_OP_16
 #undef ROP_OP_32
+#undef ROP_OP_64
+#undef ROP_WIDE_OK
@@ -0,0 +1,212 @@
+/*
+ * Event loop with file descriptor polling
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <sys/epoll.h>
+#include "qemu-timer.h"
+#include "trace.h"
+#include "hw/dataplane/event-poll.h"
+
+/* Add an event notifier and its callback for polling */
+void event_poll_add(EventPoll *poll, EventHandler *handler,
+                    EventNotifier *notifier, EventCallback *callback)
+{
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.ptr = handler,
+    };
+    handler->notifier = notifier;
+    handler->callback = callback;
+    handler->poll = NULL;
+    if (epoll_ctl(poll->epoll_fd, EPOLL_CTL_ADD,
+                  event_notifier_get_fd(notifier), &event) != 0) {
+        fprintf(stderr, "failed to add event handler to epoll: %m\n");
+        exit(1);
+    }
+}
+
+/* Register a function that checks for pending work without a system call
+ *
+ * The function is called repeatedly while busy polling and returns true when
+ * the handler's callback has work to do.
+ */
+void event_poll_set_poll_func(EventPoll *poll, EventHandler *handler,
+                              EventPollFunc *poll_func)
+{
+    assert(poll->num_poll_handlers < EVENT_POLL_MAX_HANDLERS);
+    handler->poll = poll_func;
+    poll->poll_handlers[poll->num_poll_handlers++] = handler;
+}
+
+/* Configure adaptive polling
+ *
+ * A grow factor of 0 selects the default of 2, a shrink factor of 0 resets
+ * the polling time to 0 whenever it has to shrink.
+ */
+void event_poll_set_poll_params(EventPoll *poll, int64_t max_ns,
+                                int64_t grow, int64_t shrink)
+{
+    poll->poll_max_ns = max_ns;
+    poll->poll_ns = 0;
+    poll->poll_grow = grow;
+    poll->poll_shrink = shrink;
+}
+
+/* Event callback for stopping event_poll() */
+static void handle_stop(EventHandler *handler)
+{
+    /* Do nothing */
+}
+
+void event_poll_init(EventPoll *poll)
+{
+    /* Create epoll file descriptor */
+    poll->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (poll->epoll_fd < 0) {
+        fprintf(stderr, "epoll_create1 failed: %m\n");
+        exit(1);
+    }
+
+    /* Set up stop notifier */
+    if (event_notifier_init(&poll->stop_notifier, 0) < 0) {
+        fprintf(stderr, "failed to init stop notifier\n");
+        exit(1);
+    }
+    event_poll_add(poll, &poll->stop_handler,
+                   &poll->stop_notifier, handle_stop);
+
+    poll->num_poll_handlers = 0;
+    poll->poll_ns = 0;
+    poll->poll_max_ns = 0;
+    poll->poll_grow = 0;
+    poll->poll_shrink = 0;
+    poll->poll_hits = 0;
+    poll->poll_misses = 0;
+}
+
+void event_poll_cleanup(EventPoll *poll)
+{
+    event_notifier_cleanup(&poll->stop_notifier);
+    close(poll->epoll_fd);
+    poll->epoll_fd = -1;
+}
+
+/* Busy poll for up to poll_ns nanoseconds
+ *
+ * Returns true if an event was found and its callback has been invoked.
+ */
+static bool run_poll_handlers(EventPoll *poll, int64_t start)
+{
+    int64_t end = start + poll->poll_ns;
+    unsigned int i;
+
+    do {
+        for (i = 0; i < poll->num_poll_handlers; i++) {
+            EventHandler *handler = poll->poll_handlers[i];
+
+            if (handler->poll(handler)) {
+                /* The eventfd may have fired too, avoid a spurious wakeup */
+                event_notifier_test_and_clear(handler->notifier);
+                handler->callback(handler);
+                poll->poll_hits++;
+                return true;
+            }
+        }
+    } while (get_clock() < end);
+
+    poll->poll_misses++;
+    return false;
+}
+
+/* Update the polling time after blocking for block_ns nanoseconds */
+static void adjust_poll_time(EventPoll *poll, int64_t block_ns)
+{
+    int64_t old = poll->poll_ns;
+
+    if (block_ns <= poll->poll_ns) {
+        /* This is the sweet spot, no adjustment needed */
+        return;
+    }
+
+    if (block_ns > poll->poll_max_ns) {
+        /* We would have to poll for too long, poll less */
+        if (poll->poll_shrink) {
+            poll->poll_ns /= poll->poll_shrink;
+        } else {
+            poll->poll_ns = 0;
+        }
+        if (poll->poll_ns != old) {
+            trace_event_poll_shrink(poll, old, poll->poll_ns);
+        }
+    } else if (poll->poll_ns < poll->poll_max_ns) {
+        /* There is room to grow, poll longer */
+        int64_t grow = poll->poll_grow ? poll->poll_grow : 2;
+
+        if (poll->poll_ns) {
+            poll->poll_ns *= grow;
+        } else {
+            poll->poll_ns = 4000; /* start polling at 4 microseconds */
+        }
+        if (poll->poll_ns > poll->poll_max_ns) {
+            poll->poll_ns = poll->poll_max_ns;
+        }
+        trace_event_poll_grow(poll, old, poll->poll_ns);
+    }
+}
+
+/* Block until the next event and invoke its callback
+ *
+ * If adaptive polling is enabled, the registered poll functions are checked
+ * in a loop for a while before going to sleep in epoll_wait(2).
+ */
+void event_poll(EventPoll *poll)
+{
+    EventHandler *handler;
+    struct epoll_event event;
+    int64_t start = 0;
+    int nevents;
+
+    if (poll->poll_max_ns) {
+        start = get_clock();
+        if (poll->poll_ns && poll->num_poll_handlers &&
+            run_poll_handlers(poll, start)) {
+            return;
+        }
+    }
+
+    /* Wait for the next event.  Only do one event per call to keep the
+     * function simple, this could be changed later. */
+    do {
+        nevents = epoll_wait(poll->epoll_fd, &event, 1, -1);
+    } while (nevents < 0 && errno == EINTR);
+    if (unlikely(nevents != 1)) {
+        fprintf(stderr, "epoll_wait failed: %m\n");
+        exit(1); /* should never happen */
+    }
+
+    if (poll->poll_max_ns) {
+        adjust_poll_time(poll, get_clock() - start);
+    }
+
+    /* Find out which event handler has become active */
+    handler = event.data.ptr;
+
+    /* Clear the eventfd */
+    event_notifier_test_and_clear(handler->notifier);
+
+    /* Handle the event */
+    handler->callback(handler);
+}
+
+/* Stop event_poll()
+ *
+ * This function can be used from another thread.
+ */
+void event_poll_notify(EventPoll *poll)
+{
+    event_notifier_set(&poll->stop_notifier);
+}
@@ -0,0 +1,58 @@
+/*
+ * Event loop with file descriptor polling
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef EVENT_POLL_H
+#define EVENT_POLL_H
+
+#include <sys/epoll.h>
+#include "event_notifier.h"
+
+typedef struct EventHandler EventHandler;
+typedef void EventCallback(EventHandler *handler);
+typedef bool EventPollFunc(EventHandler *handler);
+struct EventHandler {
+    EventNotifier *notifier;        /* eventfd */
+    EventCallback *callback;        /* callback function */
+    EventPollFunc *poll;            /* userspace check for pending work */
+};
+
+enum {
+    EVENT_POLL_MAX_HANDLERS = 4,    /* handlers with a poll function */
+};
+
+typedef struct {
+    int epoll_fd;                   /* epoll(2) file descriptor */
+    EventNotifier stop_notifier;    /* stop poll notifier */
+    EventHandler stop_handler;      /* stop poll handler */
+
+    /* Busy polling before blocking in epoll_wait(2).  The polling time
+     * adapts between 0 and poll_max_ns depending on how long it takes for
+     * events to arrive; poll_max_ns == 0 disables polling.
+     */
+    EventHandler *poll_handlers[EVENT_POLL_MAX_HANDLERS];
+    unsigned int num_poll_handlers;
+    int64_t poll_ns;                /* current polling time */
+    int64_t poll_max_ns;            /* maximum polling time */
+    int64_t poll_grow;              /* polling time growth factor */
+    int64_t poll_shrink;            /* polling time shrink factor */
+    uint64_t poll_hits;             /* events found by polling */
+    uint64_t poll_misses;           /* polling timed out, had to block */
+} EventPoll;
+
+void event_poll_add(EventPoll *poll, EventHandler *handler,
+                    EventNotifier *notifier, EventCallback *callback);
+void event_poll_set_poll_func(EventPoll *poll, EventHandler *handler,
+                              EventPollFunc *poll_func);
+void event_poll_set_poll_params(EventPoll *poll, int64_t max_ns,
+                                int64_t grow, int64_t shrink);
+void event_poll_init(EventPoll *poll);
+void event_poll_cleanup(EventPoll *poll);
+void event_poll(EventPoll *poll);
+void event_poll_notify(EventPoll *poll);
+
+#endif /* EVENT_POLL_H */
@@ -0,0 +1,175 @@
+/*
+ * Linux AIO request queue
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "hw/dataplane/ioq.h"
+
+void ioq_init(IOQueue *ioq, int fd, unsigned int max_reqs)
+{
+    int rc;
+    unsigned int i;
+
+    ioq->fd = fd;
+    ioq->max_reqs = max_reqs;
+
+    memset(&ioq->io_ctx, 0, sizeof ioq->io_ctx);
+    rc = io_setup(max_reqs, &ioq->io_ctx);
+    if (rc != 0) {
+        fprintf(stderr, "ioq io_setup failed %d\n", rc);
+        exit(1);
+    }
+
+    rc = event_notifier_init(&ioq->io_notifier, 0);
+    if (rc != 0) {
+        fprintf(stderr, "ioq io event notifier creation failed %d\n", rc);
+        exit(1);
+    }
+
+    ioq->iocbs = g_malloc0(sizeof ioq->iocbs[0] * max_reqs);
+    ioq->freelist = g_malloc0(sizeof ioq->freelist[0] * max_reqs);
+    for (i = 0; i < max_reqs; i++) {
+        ioq->freelist[i] = &ioq->iocbs[i];
+    }
+    ioq->freelist_idx = max_reqs;
+
+    ioq->queue = g_malloc0(sizeof ioq->queue[0] * max_reqs);
+    ioq->queue_idx = 0;
+}
+
+void ioq_cleanup(IOQueue *ioq)
+{
+    g_free(ioq->iocbs);
+    g_free(ioq->freelist);
+    g_free(ioq->queue);
+
+    event_notifier_cleanup(&ioq->io_notifier);
+    io_destroy(ioq->io_ctx);
+}
+
+EventNotifier *ioq_get_notifier(IOQueue *ioq)
+{
+    return &ioq->io_notifier;
+}
+
+struct iocb *ioq_get_iocb(IOQueue *ioq)
+{
+    struct iocb *iocb;
+
+    /* Underflow cannot happen since ioq is sized for max_reqs */
+    assert(ioq->freelist_idx != 0);
+
+    iocb = ioq->freelist[--ioq->freelist_idx];
+    ioq->queue[ioq->queue_idx++] = iocb;
+    return iocb;
+}
+
+void ioq_put_iocb(IOQueue *ioq, struct iocb *iocb)
+{
+    /* Overflow cannot happen since ioq is sized for max_reqs */
+    assert(ioq->freelist_idx != ioq->max_reqs);
+
+    ioq->freelist[ioq->freelist_idx++] = iocb;
+}
+
+/* Like ioq_rdwr() but on a file other than the queue's own, so that one
+ * queue can serve several disks.
+ */
+struct iocb *ioq_rdwr_fd(IOQueue *ioq, int fd, bool read, struct iovec *iov,
+                         unsigned int count, long long offset)
+{
+    struct iocb *iocb = ioq_get_iocb(ioq);
+
+    if (read) {
+        io_prep_preadv(iocb, fd, iov, count, offset);
+    } else {
+        io_prep_pwritev(iocb, fd, iov, count, offset);
+    }
+    io_set_eventfd(iocb, event_notifier_get_fd(&ioq->io_notifier));
+    return iocb;
+}
+
+struct iocb *ioq_rdwr(IOQueue *ioq, bool read, struct iovec *iov,
+                      unsigned int count, long long offset)
+{
+    return ioq_rdwr_fd(ioq, ioq->fd, read, iov, count, offset);
+}
+
+/* Submit all queued requests with a single io_submit() call
+ *
+ * Returns the number of requests submitted or a negative errno.  Requests
+ * that could not be submitted stay queued.
+ */
+int ioq_submit(IOQueue *ioq)
+{
+    int rc = io_submit(ioq->io_ctx, ioq->queue_idx, ioq->queue);
+
+    if (rc > 0 && rc < ioq->queue_idx) {
+        /* Keep requests that were not accepted by the kernel */
+        memmove(ioq->queue, &ioq->queue[rc],
+                (ioq->queue_idx - rc) * sizeof(ioq->queue[0]));
+        ioq->queue_idx -= rc;
+    } else if (rc >= 0) {
+        ioq->queue_idx = 0;
+    }
+    return rc;
+}
+
+/* Completion ring shared with the kernel, io_context_t points to it */
+struct aio_ring {
+    unsigned int id;
+    unsigned int nr;                /* number of io_events */
+    unsigned int head;
+    unsigned int tail;
+    unsigned int magic;
+    unsigned int compat_features;
+    unsigned int incompat_features;
+    unsigned int header_length;     /* size of aio_ring */
+};
+
+#define AIO_RING_MAGIC 0xa10a10a1
+
+/* Check for completed requests without a system call
+ *
+ * This is cheap enough to be called in a busy polling loop.  If the ring
+ * layout is not recognized, completions are only reported through the
+ * eventfd.
+ */
+bool ioq_completions_pending(IOQueue *ioq)
+{
+    volatile struct aio_ring *ring = (struct aio_ring *)ioq->io_ctx;
+
+    if (ring->magic != AIO_RING_MAGIC) {
+        return false;
+    }
+    return ring->head != ring->tail;
+}
+
+/* Harvest completed requests and invoke the completion function
+ *
+ * Returns the number of completed requests.
+ */
+int ioq_run_completion(IOQueue *ioq, IOQueueCompletion *completion,
+                       void *opaque)
+{
+    struct io_event events[ioq->max_reqs];
+    int nevents, i;
+
+    do {
+        nevents = io_getevents(ioq->io_ctx, 0, ioq->max_reqs, events, NULL);
+    } while (nevents == -EINTR);
+    if (nevents < 0) {
+        return nevents;
+    }
+
+    for (i = 0; i < nevents; i++) {
+        ssize_t ret = ((uint64_t)events[i].res2 << 32) | events[i].res;
+
+        completion(events[i].obj, ret, opaque);
+        ioq_put_iocb(ioq, events[i].obj);
+    }
+    return nevents;
+}
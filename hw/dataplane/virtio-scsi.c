@@ -0,0 +1,653 @@
+/*
+ * Dedicated threads for virtio-scsi I/O processing
+ *
+ * Every command virtqueue gets its own thread with an event loop that polls
+ * the queue's host notifier (ioeventfd) and a Linux AIO completion eventfd.
+ * A request is serviced start to finish by the thread of the queue it
+ * arrived on.
+ *
+ * READ and WRITE commands for scsi-hd LUNs backed by a raw image opened with
+ * aio=native are submitted with io_submit() directly, without taking the
+ * global mutex.  Everything else, and any fast path request that fails, is
+ * handed over to the main loop and goes through the SCSI layer as usual;
+ * the completion is pushed back onto the thread's vring under a lock.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "trace.h"
+#include "iov.h"
+#include "qemu-thread.h"
+#include "qemu-error.h"
+#include "cpus.h"
+#include "migration.h"
+#include "block.h"
+#include "hw/scsi-defs.h"
+#include "hw/dataplane/event-poll.h"
+#include "hw/dataplane/vring.h"
+#include "hw/dataplane/ioq.h"
+#include "hw/dataplane/virtio-scsi.h"
+
+enum {
+    SEG_MAX = 126,                  /* maximum number of I/O segments */
+    VRING_MAX = SEG_MAX + 2,        /* maximum number of vring descriptors */
+    REQ_MAX = VIRTIO_SCSI_VQ_SIZE,  /* maximum number of requests in flight
+                                       per queue */
+    CDB_MIN = 16,                   /* CDB bytes the fast path looks at */
+};
+
+/* A LUN whose READ and WRITE commands bypass the SCSI layer */
+typedef struct {
+    SCSIDevice *dev;
+    BlockDriverState *bs;
+    int fd;                         /* image file descriptor */
+    uint64_t nb_blocks;             /* capacity when the threads started */
+    bool read_only;
+} VirtIOSCSIDataPlaneLun;
+
+struct VirtIOSCSIDataPlaneQueue {
+    VirtIOSCSIDataPlane *s;
+    unsigned int n;                 /* virtqueue index */
+    QemuThread thread;
+
+    Vring vring;                    /* virtqueue vring */
+    EventNotifier *guest_notifier;  /* irq */
+    QemuMutex lock;                 /* serializes vring_push() and the guest
+                                       notification with the main loop */
+
+    EventPoll event_poll;           /* event poller */
+    EventHandler io_handler;        /* Linux AIO completion handler */
+    EventHandler notify_handler;    /* virtqueue notify handler */
+
+    IOQueue ioqueue;                /* Linux AIO queue */
+    unsigned int num_reqs;          /* number of fast requests in flight */
+};
+
+struct VirtIOSCSIDataPlane {
+    bool started;
+    bool stopping;
+
+    VirtIODevice *vdev;
+    VirtIOSCSIConf *conf;
+    SCSIBus *bus;
+
+    VirtIOSCSIDataPlaneQueue *queues;
+
+    /* Snapshot of the bus taken on start, read-only while threads run.
+     * Hotplug and hot-unplug stop the threads and the next kick rebuilds it.
+     */
+    VirtIOSCSIDataPlaneLun *luns;
+    unsigned int num_luns;
+
+    /* Requests waiting for the main loop */
+    QemuMutex slow_lock;
+    QSIMPLEQ_HEAD(, VirtIOSCSIDataPlaneReq) slow_reqs;
+    EventNotifier slow_notifier;
+
+    Error *migration_blocker;
+};
+
+/* Raise an interrupt to signal guest, if necessary.  Called with q->lock
+ * held.
+ */
+static void notify_guest(VirtIOSCSIDataPlaneQueue *q)
+{
+    if (!vring_should_notify(q->s->vdev, &q->vring)) {
+        return;
+    }
+
+    event_notifier_set(q->guest_notifier);
+}
+
+static void free_request(VirtIOSCSIDataPlaneReq *req)
+{
+    g_free(req->iov);
+    g_slice_free(VirtIOSCSIDataPlaneReq, req);
+}
+
+/* Context: QEMU global mutex held, or a queue thread */
+void virtio_scsi_data_plane_complete(VirtIOSCSIDataPlaneReq *req, int len)
+{
+    VirtIOSCSIDataPlaneQueue *q = req->queue;
+
+    trace_virtio_scsi_data_plane_complete_request(q, req->head, len);
+
+    qemu_mutex_lock(&q->lock);
+    vring_push(&q->vring, req->head, len);
+    notify_guest(q);
+    qemu_mutex_unlock(&q->lock);
+    free_request(req);
+}
+
+static void run_slow_requests(VirtIOSCSIDataPlane *s)
+{
+    QSIMPLEQ_HEAD(, VirtIOSCSIDataPlaneReq) reqs;
+    VirtIOSCSIDataPlaneReq *req;
+
+    QSIMPLEQ_INIT(&reqs);
+    qemu_mutex_lock(&s->slow_lock);
+    QSIMPLEQ_CONCAT(&reqs, &s->slow_reqs);
+    qemu_mutex_unlock(&s->slow_lock);
+
+    while ((req = QSIMPLEQ_FIRST(&reqs))) {
+        QSIMPLEQ_REMOVE_HEAD(&reqs, next);
+        virtio_scsi_handle_data_plane_req(s->vdev, req);
+    }
+}
+
+/* Context: QEMU global mutex held */
+static void handle_slow_notify(EventNotifier *e)
+{
+    VirtIOSCSIDataPlane *s = container_of(e, VirtIOSCSIDataPlane,
+                                          slow_notifier);
+
+    event_notifier_test_and_clear(e);
+    run_slow_requests(s);
+}
+
+static void hand_over_request(VirtIOSCSIDataPlaneQueue *q,
+                              VirtIOSCSIDataPlaneReq *req)
+{
+    VirtIOSCSIDataPlane *s = q->s;
+
+    qemu_mutex_lock(&s->slow_lock);
+    QSIMPLEQ_INSERT_TAIL(&s->slow_reqs, req, next);
+    qemu_mutex_unlock(&s->slow_lock);
+    event_notifier_set(&s->slow_notifier);
+}
+
+/* Data-out or data-in buffers of a request */
+static struct iovec *request_data(VirtIOSCSIDataPlaneReq *req,
+                                  unsigned int *niov)
+{
+    if (req->out_num > 1) {
+        *niov = req->out_num - 1;
+        return &req->iov[1];
+    }
+    *niov = req->in_num - 1;
+    return &req->iov[req->out_num + 1];
+}
+
+static VirtIOSCSIDataPlaneLun *find_lun(VirtIOSCSIDataPlane *s,
+                                        const uint8_t *lun)
+{
+    unsigned int i, id, nr;
+
+    /* Same addressing rules as virtio_scsi_device_find(), but only an exact
+     * match is good enough here.
+     */
+    if (lun[0] != 1) {
+        return NULL;
+    }
+    if (lun[2] != 0 && !(lun[2] >= 0x40 && lun[2] < 0x80)) {
+        return NULL;
+    }
+    id = lun[1];
+    nr = ((lun[2] << 8) | lun[3]) & 0x3FFF;
+    for (i = 0; i < s->num_luns; i++) {
+        SCSIDevice *d = s->luns[i].dev;
+
+        if (d->channel == 0 && d->id == id && d->lun == nr) {
+            return &s->luns[i];
+        }
+    }
+    return NULL;
+}
+
+static bool iov_is_aligned(struct iovec *iov, unsigned int iov_cnt,
+                           size_t align)
+{
+    unsigned int i;
+
+    for (i = 0; i < iov_cnt; i++) {
+        if ((uintptr_t)iov[i].iov_base % align ||
+            iov[i].iov_len % align) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Submit a READ or WRITE straight to the image file.  Returns false if the
+ * request needs the SCSI layer.
+ */
+static bool do_fast_rdwr(VirtIOSCSIDataPlaneQueue *q,
+                         VirtIOSCSIDataPlaneReq *req)
+{
+    VirtIOSCSICmdReq *cmd;
+    VirtIOSCSIDataPlaneLun *l;
+    struct iovec *data;
+    unsigned int niov;
+    struct iocb *iocb;
+    uint64_t lba;
+    uint32_t nb;
+    uint8_t *cdb;
+    bool read;
+
+    if (req->out_num < 1 || req->in_num < 1 ||
+        req->iov[0].iov_len < sizeof(VirtIOSCSICmdReq) + CDB_MIN ||
+        req->iov[req->out_num].iov_len < sizeof(VirtIOSCSICmdResp)) {
+        return false;
+    }
+
+    cmd = req->iov[0].iov_base;
+    cdb = cmd->cdb;
+    switch (cdb[0]) {
+    case READ_10:
+    case WRITE_10:
+        lba = (uint32_t)ldl_be_p(&cdb[2]);
+        nb = lduw_be_p(&cdb[7]);
+        break;
+    case READ_16:
+    case WRITE_16:
+        lba = ldq_be_p(&cdb[2]);
+        nb = (uint32_t)ldl_be_p(&cdb[10]);
+        break;
+    default:
+        return false;
+    }
+    read = cdb[0] == READ_10 || cdb[0] == READ_16;
+
+    /* Protection information and FUA are left to scsi-disk */
+    if ((cdb[1] & 0xe8) || nb == 0) {
+        return false;
+    }
+    if (read ? req->out_num != 1 : req->in_num != 1) {
+        return false;
+    }
+
+    l = find_lun(q->s, cmd->lun);
+    if (!l || l->dev->unit_attention.key != NO_SENSE) {
+        return false;
+    }
+    /* Writethrough needs a flush after every write */
+    if (!read && (l->read_only || !bdrv_enable_write_cache(l->bs))) {
+        return false;
+    }
+    if (lba >= l->nb_blocks || nb > l->nb_blocks - lba) {
+        return false;
+    }
+
+    data = request_data(req, &niov);
+    if (iov_size(data, niov) != (uint64_t)nb * l->dev->blocksize ||
+        !iov_is_aligned(data, niov, l->dev->blocksize)) {
+        return false;
+    }
+
+    iocb = ioq_rdwr_fd(&q->ioqueue, l->fd, read, data, niov,
+                       lba * l->dev->blocksize);
+    iocb->data = req;
+    return true;
+}
+
+static void complete_request(struct iocb *iocb, ssize_t ret, void *opaque)
+{
+    VirtIOSCSIDataPlaneQueue *q = opaque;
+    VirtIOSCSIDataPlaneReq *req = iocb->data;
+    struct iovec *resp_iov = &req->iov[req->out_num];
+    struct iovec *data;
+    unsigned int niov;
+    size_t size;
+
+    data = request_data(req, &niov);
+    size = iov_size(data, niov);
+    q->num_reqs--;
+
+    trace_virtio_scsi_data_plane_fast_complete(q, req->head, ret);
+
+    if (unlikely(ret != size)) {
+        /* Let scsi-disk redo it and apply the rerror/werror policy */
+        hand_over_request(q, req);
+        return;
+    }
+
+    /* VIRTIO_SCSI_S_OK, GOOD, no residual and no sense */
+    memset(resp_iov->iov_base, 0, sizeof(VirtIOSCSICmdResp));
+    vring_push(&q->vring, req->head, size + resp_iov->iov_len);
+    free_request(req);
+}
+
+static void process_request(VirtIOSCSIDataPlaneQueue *q, struct iovec iov[],
+                            unsigned int out_num, unsigned int in_num,
+                            unsigned int head)
+{
+    VirtIOSCSIDataPlaneReq *req = g_slice_new(VirtIOSCSIDataPlaneReq);
+
+    /* The copy keeps the iovecs alive for the slow path and for a retry */
+    req->queue = q;
+    req->head = head;
+    req->iov = g_memdup(iov, (out_num + in_num) * sizeof(struct iovec));
+    req->out_num = out_num;
+    req->in_num = in_num;
+
+    if (!do_fast_rdwr(q, req)) {
+        hand_over_request(q, req);
+    }
+}
+
+static void submit_requests(VirtIOSCSIDataPlaneQueue *q)
+{
+    unsigned int num_queued = ioq_num_queued(&q->ioqueue);
+    int rc;
+
+    if (num_queued == 0) {
+        return;
+    }
+
+    q->num_reqs += num_queued;
+    rc = ioq_submit(&q->ioqueue);
+    if (unlikely(rc < 0)) {
+        fprintf(stderr, "ioq_submit failed %d\n", rc);
+        exit(1);
+    }
+}
+
+static void handle_notify(EventHandler *handler)
+{
+    VirtIOSCSIDataPlaneQueue *q = container_of(handler,
+                                               VirtIOSCSIDataPlaneQueue,
+                                               notify_handler);
+    VirtIODevice *vdev = q->s->vdev;
+
+    /* Requests copy their iovecs, so the array can be reused as soon as
+     * it fills up.
+     */
+    struct iovec iovec[VRING_MAX];
+    struct iovec *end = &iovec[VRING_MAX];
+    struct iovec *iov;
+    int head;
+    unsigned int out_num = 0, in_num = 0;
+
+    for (;;) {
+        /* Disable guest->host notifies to avoid unnecessary vmexits */
+        vring_disable_notification(vdev, &q->vring);
+
+        iov = iovec;
+        for (;;) {
+            head = vring_pop(vdev, &q->vring, iov, end, &out_num, &in_num);
+            if (head < 0) {
+                break; /* no more requests */
+            }
+
+            trace_virtio_scsi_data_plane_process_request(q, out_num, in_num,
+                                                         head);
+
+            process_request(q, iov, out_num, in_num, head);
+            iov += out_num + in_num;
+        }
+
+        if (head == -ENOBUFS) {
+            if (iov == iovec) {
+                /* More descriptors than seg_max allows */
+                error_report("virtio-scsi request too large");
+                vring_set_broken(&q->vring);
+                break;
+            }
+            continue; /* iovec[] is depleted, start over */
+        }
+
+        /* Re-enable guest->host notifies and stop processing the vring.
+         * But if the guest has snuck in more descriptors, keep processing.
+         */
+        if (head != -EAGAIN || vring_enable_notification(vdev, &q->vring)) {
+            break;
+        }
+    }
+
+    submit_requests(q);
+}
+
+static void handle_io(EventHandler *handler)
+{
+    VirtIOSCSIDataPlaneQueue *q = container_of(handler,
+                                               VirtIOSCSIDataPlaneQueue,
+                                               io_handler);
+
+    qemu_mutex_lock(&q->lock);
+    if (ioq_run_completion(&q->ioqueue, complete_request, q) > 0) {
+        notify_guest(q);
+    }
+    qemu_mutex_unlock(&q->lock);
+}
+
+static void *data_plane_thread(void *opaque)
+{
+    VirtIOSCSIDataPlaneQueue *q = opaque;
+
+    qemu_sched_iothread_enter();
+    do {
+        event_poll(&q->event_poll);
+    } while (!q->s->stopping || q->num_reqs > 0);
+    qemu_sched_iothread_exit();
+    return NULL;
+}
+
+/* Context: QEMU global mutex held */
+static void add_lun(VirtIOSCSIDataPlane *s, SCSIDevice *d)
+{
+    const char *type = object_get_typename(OBJECT(d));
+    BlockDriverState *bs = d->conf.bs;
+    VirtIOSCSIDataPlaneLun *l;
+    uint64_t nb_sectors;
+    int fd;
+
+    /* scsi-block and scsi-generic pass commands through, scsi-cd has
+     * removable media.
+     */
+    if (d->type != TYPE_DISK || !bs ||
+        (strcmp(type, "scsi-hd") && strcmp(type, "scsi-disk"))) {
+        return;
+    }
+    if (bdrv_in_use(bs) || d->blocksize < BDRV_SECTOR_SIZE) {
+        return;
+    }
+    fd = raw_get_aio_fd(bs);
+    if (fd < 0) {
+        return;
+    }
+
+    bdrv_get_geometry(bs, &nb_sectors);
+    s->luns = g_renew(VirtIOSCSIDataPlaneLun, s->luns, s->num_luns + 1);
+    l = &s->luns[s->num_luns++];
+    l->dev = d;
+    l->bs = bs;
+    l->fd = fd;
+    l->nb_blocks = nb_sectors / (d->blocksize / BDRV_SECTOR_SIZE);
+    l->read_only = bdrv_is_read_only(bs);
+
+    /* Prevent block operations that conflict with the data plane threads */
+    bdrv_set_in_use(bs, 1);
+}
+
+/* Context: QEMU global mutex held */
+static void release_luns(VirtIOSCSIDataPlane *s)
+{
+    unsigned int i;
+
+    for (i = 0; i < s->num_luns; i++) {
+        bdrv_set_in_use(s->luns[i].bs, 0);
+    }
+    g_free(s->luns);
+    s->luns = NULL;
+    s->num_luns = 0;
+}
+
+/* Context: QEMU global mutex held */
+bool virtio_scsi_data_plane_create(VirtIODevice *vdev, VirtIOSCSIConf *conf,
+                                   SCSIBus *bus,
+                                   VirtIOSCSIDataPlane **dataplane)
+{
+    VirtIOSCSIDataPlane *s;
+    unsigned int i;
+
+    *dataplane = NULL;
+
+    if (!conf->data_plane) {
+        return true;
+    }
+
+    s = g_new0(VirtIOSCSIDataPlane, 1);
+    s->vdev = vdev;
+    s->conf = conf;
+    s->bus = bus;
+    s->queues = g_new0(VirtIOSCSIDataPlaneQueue, conf->num_queues);
+    for (i = 0; i < conf->num_queues; i++) {
+        s->queues[i].s = s;
+        s->queues[i].n = i + 2; /* after the control and event queues */
+        qemu_mutex_init(&s->queues[i].lock);
+    }
+
+    qemu_mutex_init(&s->slow_lock);
+    QSIMPLEQ_INIT(&s->slow_reqs);
+    if (event_notifier_init(&s->slow_notifier, 0) < 0) {
+        error_report("virtio-scsi x-data-plane: cannot create event notifier");
+        g_free(s->queues);
+        g_free(s);
+        return false;
+    }
+    event_notifier_set_handler(&s->slow_notifier, handle_slow_notify);
+
+    error_setg(&s->migration_blocker,
+               "x-data-plane does not support migration");
+    migrate_add_blocker(s->migration_blocker);
+
+    *dataplane = s;
+    return true;
+}
+
+/* Context: QEMU global mutex held */
+void virtio_scsi_data_plane_destroy(VirtIOSCSIDataPlane *s)
+{
+    unsigned int i;
+
+    if (!s) {
+        return;
+    }
+
+    virtio_scsi_data_plane_stop(s);
+    migrate_del_blocker(s->migration_blocker);
+    error_free(s->migration_blocker);
+    event_notifier_set_handler(&s->slow_notifier, NULL);
+    event_notifier_cleanup(&s->slow_notifier);
+    qemu_mutex_destroy(&s->slow_lock);
+    for (i = 0; i < s->conf->num_queues; i++) {
+        qemu_mutex_destroy(&s->queues[i].lock);
+    }
+    g_free(s->queues);
+    g_free(s);
+}
+
+/* Context: QEMU global mutex held */
+void virtio_scsi_data_plane_start(VirtIOSCSIDataPlane *s)
+{
+    VirtIODevice *vdev = s->vdev;
+    BusChild *kid;
+    unsigned int i;
+
+    if (s->started) {
+        return;
+    }
+
+    for (i = 0; i < s->conf->num_queues; i++) {
+        if (!vring_setup(&s->queues[i].vring, vdev, s->queues[i].n)) {
+            while (i-- > 0) {
+                vring_teardown(&s->queues[i].vring, vdev, s->queues[i].n);
+            }
+            return;
+        }
+    }
+
+    QTAILQ_FOREACH(kid, &s->bus->qbus.children, sibling) {
+        add_lun(s, DO_UPCAST(SCSIDevice, qdev, kid->child));
+    }
+
+    /* Set up guest notifiers (irq) */
+    if (vdev->binding->set_guest_notifiers(vdev->binding_opaque, true) != 0) {
+        fprintf(stderr, "virtio-scsi failed to set guest notifier, "
+                "ensure -enable-kvm is set\n");
+        exit(1);
+    }
+
+    for (i = 0; i < s->conf->num_queues; i++) {
+        VirtIOSCSIDataPlaneQueue *q = &s->queues[i];
+        VirtQueue *vq = virtio_get_queue(vdev, q->n);
+
+        q->guest_notifier = virtio_queue_get_guest_notifier(vq);
+        event_poll_init(&q->event_poll);
+
+        /* Set up virtqueue notify */
+        if (vdev->binding->set_host_notifier(vdev->binding_opaque,
+                                             q->n, true) != 0) {
+            fprintf(stderr, "virtio-scsi failed to set host notifier\n");
+            exit(1);
+        }
+        event_poll_add(&q->event_poll, &q->notify_handler,
+                       virtio_queue_get_host_notifier(vq), handle_notify);
+
+        /* Set up ioqueue, each request names its own image file */
+        ioq_init(&q->ioqueue, -1, REQ_MAX);
+        event_poll_add(&q->event_poll, &q->io_handler,
+                       ioq_get_notifier(&q->ioqueue), handle_io);
+    }
+
+    s->started = true;
+    trace_virtio_scsi_data_plane_start(s, s->conf->num_queues, s->num_luns);
+
+    for (i = 0; i < s->conf->num_queues; i++) {
+        VirtIOSCSIDataPlaneQueue *q = &s->queues[i];
+        VirtQueue *vq = virtio_get_queue(vdev, q->n);
+
+        /* Kick right away to begin processing requests already in vring */
+        event_notifier_set(virtio_queue_get_host_notifier(vq));
+
+        qemu_thread_create(&q->thread, data_plane_thread,
+                           q, QEMU_THREAD_JOINABLE);
+    }
+}
+
+/* Context: QEMU global mutex held */
+void virtio_scsi_data_plane_stop(VirtIOSCSIDataPlane *s)
+{
+    VirtIODevice *vdev = s->vdev;
+    unsigned int i;
+
+    if (!s->started || s->stopping) {
+        return;
+    }
+    s->stopping = true;
+    trace_virtio_scsi_data_plane_stop(s);
+
+    /* Stop threads; they finish in-flight fast requests before exiting */
+    for (i = 0; i < s->conf->num_queues; i++) {
+        event_poll_notify(&s->queues[i].event_poll);
+    }
+    for (i = 0; i < s->conf->num_queues; i++) {
+        qemu_thread_join(&s->queues[i].thread);
+    }
+
+    /* Whatever went to the SCSI layer must complete while the vrings and
+     * guest notifiers still exist.
+     */
+    run_slow_requests(s);
+    virtio_scsi_drain_data_plane_reqs(vdev);
+
+    for (i = 0; i < s->conf->num_queues; i++) {
+        VirtIOSCSIDataPlaneQueue *q = &s->queues[i];
+
+        ioq_cleanup(&q->ioqueue);
+        vdev->binding->set_host_notifier(vdev->binding_opaque, q->n, false);
+        event_poll_cleanup(&q->event_poll);
+    }
+
+    /* Clean up guest notifiers (irq) */
+    vdev->binding->set_guest_notifiers(vdev->binding_opaque, false);
+
+    for (i = 0; i < s->conf->num_queues; i++) {
+        vring_teardown(&s->queues[i].vring, vdev, s->queues[i].n);
+    }
+    release_luns(s);
+    s->started = false;
+    s->stopping = false;
+}
@@ -0,0 +1,46 @@
+/*
+ * Dedicated threads for virtio-scsi I/O processing
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef HW_DATAPLANE_VIRTIO_SCSI_H
+#define HW_DATAPLANE_VIRTIO_SCSI_H
+
+#include "qemu-queue.h"
+#include "hw/virtio.h"
+#include "hw/virtio-scsi.h"
+#include "hw/scsi.h"
+
+typedef struct VirtIOSCSIDataPlane VirtIOSCSIDataPlane;
+typedef struct VirtIOSCSIDataPlaneQueue VirtIOSCSIDataPlaneQueue;
+
+/* A request taken from a command queue by its thread.  iov[0] is the
+ * command header, iov[out_num] the response header and the remaining
+ * elements hold the data-out or data-in buffers.
+ */
+typedef struct VirtIOSCSIDataPlaneReq {
+    VirtIOSCSIDataPlaneQueue *queue;
+    unsigned int head;              /* vring descriptor index */
+    struct iovec *iov;
+    unsigned int out_num;
+    unsigned int in_num;
+    QSIMPLEQ_ENTRY(VirtIOSCSIDataPlaneReq) next;
+} VirtIOSCSIDataPlaneReq;
+
+bool virtio_scsi_data_plane_create(VirtIODevice *vdev, VirtIOSCSIConf *conf,
+                                   SCSIBus *bus,
+                                   VirtIOSCSIDataPlane **dataplane);
+void virtio_scsi_data_plane_destroy(VirtIOSCSIDataPlane *s);
+void virtio_scsi_data_plane_start(VirtIOSCSIDataPlane *s);
+void virtio_scsi_data_plane_stop(VirtIOSCSIDataPlane *s);
+void virtio_scsi_data_plane_complete(VirtIOSCSIDataPlaneReq *req, int len);
+
+/* Provided by hw/virtio-scsi.c, called with the QEMU global mutex held */
+void virtio_scsi_handle_data_plane_req(VirtIODevice *vdev,
+                                       VirtIOSCSIDataPlaneReq *req);
+void virtio_scsi_drain_data_plane_reqs(VirtIODevice *vdev);
+
+#endif /* HW_DATAPLANE_VIRTIO_SCSI_H */
@@ -82,6 +82,12 @@ enum {
                    /* default to E1000_DEV_ID_82540EM */	0xc20
 };
 
+/* Descriptors fetched from guest memory with a single DMA access */
+enum {
+    E1000_TX_DESC_BATCH = 16,
+    E1000_RX_DESC_BATCH = 8,
+};
+
 typedef struct E1000State_st {
     PCIDevice dev;
     NICState *nic;
@@ -129,6 +135,22 @@ typedef struct E1000State_st {
     } eecd_state;
 
     QEMUTimer *autoneg_timer;
+
+    /* Interrupt mitigation (ITR, RADV and TADV) */
+    QEMUTimer *mit_timer;           /* mitigation timer */
+    bool mit_timer_on;              /* mitigation delay window is active */
+    bool mit_irq_level;             /* current interrupt line level */
+    bool mit_ide;                   /* a tx descriptor had IDE set */
+
+    /* RX descriptors prefetched from the ring, starting at rx_cache_head */
+    struct e1000_rx_desc rx_cache[E1000_RX_DESC_BATCH];
+    uint32_t rx_cache_head;
+    uint32_t rx_cache_len;
+
+/* Compatibility flags for migration to/from qemu 1.3.0 and older */
+#define E1000_FLAG_MIT_BIT 0
+#define E1000_FLAG_MIT (1 << E1000_FLAG_MIT_BIT)
+    uint32_t compat_flags;
 } E1000State;
 
 #define	defreg(x)	x = (E1000_##x>>2)
@@ -143,7 +165,8 @@ enum {
     defreg(TORH),	defreg(TORL),	defreg(TOTH),	defreg(TOTL),
     defreg(TPR),	defreg(TPT),	defreg(TXDCTL),	defreg(WUFC),
     defreg(RA),		defreg(MTA),	defreg(CRCERRS),defreg(VFTA),
-    defreg(VET),
+    defreg(VET),	defreg(ITR),	defreg(RDTR),	defreg(RADV),
+    defreg(TADV),
 };
 
 static void
@@ -164,7 +187,7 @@ static void
 set_phy_ctrl(E1000State *s, int index, uint16_t val)
 {
     if ((val & MII_CR_AUTO_NEG_EN) && (val & MII_CR_RESTART_AUTO_NEG)) {
-        s->nic->nc.link_down = true;
+        qemu_get_queue(s->nic)->link_down = true;
         e1000_link_down(s);
         s->phy_reg[PHY_STATUS] &= ~MII_SR_AUTONEG_COMPLETE;
         DBGOUT(PHY, "Start link auto negotiation\n");
@@ -176,7 +199,7 @@ static void
 e1000_autoneg_timer(void *opaque)
 {
     E1000State *s = opaque;
-    s->nic->nc.link_down = false;
+    qemu_get_queue(s->nic)->link_down = false;
     e1000_link_up(s);
     s->phy_reg[PHY_STATUS] |= MII_SR_AUTONEG_COMPLETE;
     DBGOUT(PHY, "Auto negotiation is completed\n");
@@ -222,16 +245,73 @@ static const uint32_t mac_reg_init[] = {
                 E1000_MANC_RMCP_EN,
 };
 
+/* Pick the shortest non-zero delay */
+static inline void
+mit_update_delay(uint32_t *curr, uint32_t value)
+{
+    if (value && (*curr == 0 || value < *curr)) {
+        *curr = value;
+    }
+}
+
 static void
 set_interrupt_cause(E1000State *s, int index, uint32_t val)
 {
+    uint32_t pending_ints;
+    uint32_t mit_delay;
+
     if (val && (E1000_DEVID >= E1000_DEV_ID_82547EI_MOBILE)) {
         /* Only for 8257x */
         val |= E1000_ICR_INT_ASSERTED;
     }
     s->mac_reg[ICR] = val;
     s->mac_reg[ICS] = val;
-    qemu_set_irq(s->dev.irq[0], (s->mac_reg[IMS] & s->mac_reg[ICR]) != 0);
+
+    pending_ints = s->mac_reg[IMS] & s->mac_reg[ICR];
+    if (!s->mit_irq_level && pending_ints) {
+        /*
+         * This is a rising edge.  Inside the mitigation window the interrupt
+         * is postponed until the timer fires; otherwise raise it now and
+         * open a new window.  The delay is the shortest of ITR (256ns
+         * units), TADV if a tx descriptor asked for a delayed interrupt and
+         * RADV if RDTR is set (both 1024ns units).  The relative TIDV/RDTR
+         * timers are not emulated.
+         */
+        if (s->mit_timer_on) {
+            return;
+        }
+        if (s->compat_flags & E1000_FLAG_MIT) {
+            mit_delay = 0;
+            if (s->mit_ide &&
+                (pending_ints & (E1000_ICR_TXQE | E1000_ICR_TXDW))) {
+                mit_update_delay(&mit_delay, s->mac_reg[TADV] * 4);
+            }
+            if (s->mac_reg[RDTR] && (pending_ints & E1000_ICS_RXT0)) {
+                mit_update_delay(&mit_delay, s->mac_reg[RADV] * 4);
+            }
+            mit_update_delay(&mit_delay, s->mac_reg[ITR]);
+
+            if (mit_delay) {
+                s->mit_timer_on = true;
+                qemu_mod_timer(s->mit_timer, qemu_get_clock_ns(vm_clock) +
+                               mit_delay * 256);
+            }
+            s->mit_ide = false;
+        }
+    }
+
+    s->mit_irq_level = (pending_ints != 0);
+    qemu_set_irq(s->dev.irq[0], s->mit_irq_level);
+}
+
+static void
+e1000_mit_timer(void *opaque)
+{
+    E1000State *s = opaque;
+
+    s->mit_timer_on = false;
+    /* Raise the interrupt if causes became pending in the window */
+    set_interrupt_cause(s, 0, s->mac_reg[ICR]);
 }
 
 static void
@@ -272,6 +352,11 @@ static void e1000_reset(void *opaque)
     int i;
 
     qemu_del_timer(d->autoneg_timer);
+    qemu_del_timer(d->mit_timer);
+    d->mit_timer_on = false;
+    d->mit_irq_level = false;
+    d->mit_ide = false;
+    d->rx_cache_len = 0;
     memset(d->phy_reg, 0, sizeof d->phy_reg);
     memmove(d->phy_reg, phy_reg_init, sizeof phy_reg_init);
     memset(d->mac_reg, 0, sizeof d->mac_reg);
@@ -279,7 +364,7 @@ static void e1000_reset(void *opaque)
     d->rxbuf_min_shift = 1;
     memset(&d->tx, 0, sizeof d->tx);
 
-    if (d->nic->nc.link_down) {
+    if (qemu_get_queue(d->nic)->link_down) {
         e1000_link_down(d);
     }
 
@@ -303,11 +388,12 @@ static void
 set_rx_control(E1000State *s, int index, uint32_t val)
 {
     s->mac_reg[RCTL] = val;
+    s->rx_cache_len = 0;
     s->rxbuf_size = rxbufsize(val);
     s->rxbuf_min_shift = ((val / E1000_RCTL_RDMTS_QUAT) & 3) + 1;
     DBGOUT(RX, "RCTL: %d, mac_reg[RCTL] = 0x%x\n", s->mac_reg[RDT],
            s->mac_reg[RCTL]);
-    qemu_flush_queued_packets(&s->nic->nc);
+    qemu_flush_queued_packets(qemu_get_queue(s->nic));
 }
 
 static void
@@ -459,9 +545,10 @@ static void
 e1000_send_packet(E1000State *s, const uint8_t *buf, int size)
 {
     if (s->phy_reg[PHY_CTRL] & MII_CR_LOOPBACK) {
-        s->nic->nc.info->receive(&s->nic->nc, buf, size);
+        NetClientState *nc = qemu_get_queue(s->nic);
+        nc->info->receive(nc, buf, size);
     } else {
-        qemu_send_packet(&s->nic->nc, buf, size);
+        qemu_send_packet(qemu_get_queue(s->nic), buf, size);
     }
 }
 
@@ -616,8 +703,9 @@ process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
     tp->cptse = 0;
 }
 
+/* Update the status of a descriptor, the caller writes it back */
 static uint32_t
-txdesc_writeback(E1000State *s, dma_addr_t base, struct e1000_tx_desc *dp)
+txdesc_writeback(E1000State *s, struct e1000_tx_desc *dp)
 {
     uint32_t txd_upper, txd_lower = le32_to_cpu(dp->lower.data);
 
@@ -626,8 +714,6 @@ txdesc_writeback(E1000State *s, dma_addr_t base, struct e1000_tx_desc *dp)
     txd_upper = (le32_to_cpu(dp->upper.data) | E1000_TXD_STAT_DD) &
                 ~(E1000_TXD_STAT_EC | E1000_TXD_STAT_LC | E1000_TXD_STAT_TU);
     dp->upper.data = cpu_to_le32(txd_upper);
-    pci_dma_write(&s->dev, base + ((char *)&dp->upper - (char *)dp),
-                  &dp->upper, sizeof(dp->upper));
     return E1000_ICR_TXDW;
 }
 
@@ -639,41 +725,93 @@ static uint64_t tx_desc_base(E1000State *s)
     return (bah << 32) + bal;
 }
 
+/* Number of descriptors that can be accessed with one DMA starting at head,
+ * i.e. owned by the hardware and not wrapping around the end of the ring.
+ */
+static unsigned int
+desc_batch_len(uint32_t head, uint32_t tail, uint32_t len, size_t desc_size,
+               unsigned int max)
+{
+    uint32_t ring_size = len / desc_size;
+    uint32_t n;
+
+    if (head >= ring_size) {
+        return 1;   /* bogus head, the caller wraps it around */
+    }
+    if (tail > head && tail <= ring_size) {
+        n = tail - head;
+    } else {
+        n = ring_size - head;
+    }
+    return MIN(n, max);
+}
+
 static void
 start_xmit(E1000State *s)
 {
     dma_addr_t base;
-    struct e1000_tx_desc desc;
+    struct e1000_tx_desc descs[E1000_TX_DESC_BATCH];
     uint32_t tdh_start = s->mac_reg[TDH], cause = E1000_ICS_TXQE;
+    unsigned int i, n, wb_first, wb_last;
+    bool wrapped = false;
 
     if (!(s->mac_reg[TCTL] & E1000_TCTL_EN)) {
         DBGOUT(TX, "tx disabled\n");
         return;
     }
 
-    while (s->mac_reg[TDH] != s->mac_reg[TDT]) {
+    while (s->mac_reg[TDH] != s->mac_reg[TDT] && !wrapped) {
+        /* Fetch a batch of descriptors with a single access */
+        n = desc_batch_len(s->mac_reg[TDH], s->mac_reg[TDT],
+                           s->mac_reg[TDLEN], sizeof(descs[0]),
+                           E1000_TX_DESC_BATCH);
         base = tx_desc_base(s) +
                sizeof(struct e1000_tx_desc) * s->mac_reg[TDH];
-        pci_dma_read(&s->dev, base, &desc, sizeof(desc));
+        pci_dma_read(&s->dev, base, descs, n * sizeof(descs[0]));
 
-        DBGOUT(TX, "index %d: %p : %x %x\n", s->mac_reg[TDH],
-               (void *)(intptr_t)desc.buffer_addr, desc.lower.data,
-               desc.upper.data);
+        wb_first = n;
+        wb_last = 0;
+        for (i = 0; i < n; i++) {
+            struct e1000_tx_desc *dp = &descs[i];
+            uint32_t wb_cause;
 
-        process_tx_desc(s, &desc);
-        cause |= txdesc_writeback(s, base, &desc);
+            DBGOUT(TX, "index %d: %p : %x %x\n", s->mac_reg[TDH],
+                   (void *)(intptr_t)dp->buffer_addr, dp->lower.data,
+                   dp->upper.data);
 
-        if (++s->mac_reg[TDH] * sizeof(desc) >= s->mac_reg[TDLEN])
-            s->mac_reg[TDH] = 0;
-        /*
-         * the following could happen only if guest sw assigns
-         * bogus values to TDT/TDLEN.
-         * there's nothing too intelligent we could do about this.
+            if (le32_to_cpu(dp->lower.data) & E1000_TXD_CMD_IDE) {
+                s->mit_ide = true;
+            }
+            process_tx_desc(s, dp);
+            wb_cause = txdesc_writeback(s, dp);
+            if (wb_cause) {
+                wb_first = MIN(wb_first, i);
+                wb_last = i;
+                cause |= wb_cause;
+            }
+
+            if (++s->mac_reg[TDH] * sizeof(*dp) >= s->mac_reg[TDLEN])
+                s->mac_reg[TDH] = 0;
+            /*
+             * the following could happen only if guest sw assigns
+             * bogus values to TDT/TDLEN.
+             * there's nothing too intelligent we could do about this.
+             */
+            if (s->mac_reg[TDH] == tdh_start) {
+                DBGOUT(TXERR, "TDH wraparound @%x, TDT %x, TDLEN %x\n",
+                       tdh_start, s->mac_reg[TDT], s->mac_reg[TDLEN]);
+                wrapped = true;
+                break;
+            }
+        }
+
+        /* Write back the status of the whole batch at once.  Descriptors
+         * without RS in between are owned by the hardware and unchanged.
          */
-        if (s->mac_reg[TDH] == tdh_start) {
-            DBGOUT(TXERR, "TDH wraparound @%x, TDT %x, TDLEN %x\n",
-                   tdh_start, s->mac_reg[TDT], s->mac_reg[TDLEN]);
-            break;
+        if (wb_first <= wb_last) {
+            pci_dma_write(&s->dev, base + wb_first * sizeof(descs[0]),
+                          &descs[wb_first],
+                          (wb_last - wb_first + 1) * sizeof(descs[0]));
         }
     }
     set_ics(s, 0, cause);
@@ -735,7 +873,7 @@ receive_filter(E1000State *s, const uint8_t *buf, int size)
 static void
 e1000_set_link_status(NetClientState *nc)
 {
-    E1000State *s = DO_UPCAST(NICState, nc, nc)->opaque;
+    E1000State *s = qemu_get_nic_opaque(nc);
     uint32_t old_status = s->mac_reg[STATUS];
 
     if (nc->link_down) {
@@ -769,7 +907,7 @@ static bool e1000_has_rxbufs(E1000State *s, size_t total_size)
 static int
 e1000_can_receive(NetClientState *nc)
 {
-    E1000State *s = DO_UPCAST(NICState, nc, nc)->opaque;
+    E1000State *s = qemu_get_nic_opaque(nc);
 
     return (s->mac_reg[RCTL] & E1000_RCTL_EN) && e1000_has_rxbufs(s, 1);
 }
@@ -782,13 +920,35 @@ static uint64_t rx_desc_base(E1000State *s)
     return (bah << 32) + bal;
 }
 
+/* Read the descriptor at RDH, prefetching a batch of descriptors if it is
+ * not cached.  Descriptors between RDH and RDT belong to the hardware, so
+ * the guest does not modify them while they are cached.
+ */
+static void
+e1000_rx_desc_fetch(E1000State *s, struct e1000_rx_desc *desc)
+{
+    uint32_t rdh = s->mac_reg[RDH];
+
+    if (rdh < s->rx_cache_head ||
+        rdh >= s->rx_cache_head + s->rx_cache_len) {
+        s->rx_cache_len = desc_batch_len(rdh, s->mac_reg[RDT],
+                                         s->mac_reg[RDLEN], sizeof(*desc),
+                                         E1000_RX_DESC_BATCH);
+        s->rx_cache_head = rdh;
+        pci_dma_read(&s->dev, rx_desc_base(s) + sizeof(*desc) * rdh,
+                     s->rx_cache, s->rx_cache_len * sizeof(*desc));
+    }
+    *desc = s->rx_cache[rdh - s->rx_cache_head];
+}
+
 static ssize_t
 e1000_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 {
-    E1000State *s = DO_UPCAST(NICState, nc, nc)->opaque;
+    E1000State *s = qemu_get_nic_opaque(nc);
     struct e1000_rx_desc desc;
-    dma_addr_t base;
-    unsigned int n, rdt;
+    struct e1000_rx_desc wb[E1000_RX_DESC_BATCH];
+    dma_addr_t base, wb_base = 0;
+    unsigned int n, rdt, wb_len = 0;
     uint32_t rdh_start;
     uint16_t vlan_special = 0;
     uint8_t vlan_status = 0, vlan_offset = 0;
@@ -839,7 +999,7 @@ e1000_receive(NetClientState *nc, const uint8_t *buf, size_t size)
             desc_size = s->rxbuf_size;
         }
         base = rx_desc_base(s) + sizeof(desc) * s->mac_reg[RDH];
-        pci_dma_read(&s->dev, base, &desc, sizeof(desc));
+        e1000_rx_desc_fetch(s, &desc);
         desc.special = vlan_special;
         desc.status |= (vlan_status | E1000_RXD_STAT_DD);
         if (desc.buffer_addr) {
@@ -863,10 +1023,22 @@ e1000_receive(NetClientState *nc, const uint8_t *buf, size_t size)
         } else { // as per intel docs; skip descriptors with null buf addr
             DBGOUT(RX, "Null RX descriptor!!\n");
         }
-        pci_dma_write(&s->dev, base, &desc, sizeof(desc));
 
-        if (++s->mac_reg[RDH] * sizeof(desc) >= s->mac_reg[RDLEN])
+        /* Write back consecutive descriptors of a packet together */
+        if (wb_len == 0) {
+            wb_base = base;
+        }
+        wb[wb_len++] = desc;
+
+        if (++s->mac_reg[RDH] * sizeof(desc) >= s->mac_reg[RDLEN]) {
             s->mac_reg[RDH] = 0;
+            s->rx_cache_len = 0;
+        }
+        if (wb_len == E1000_RX_DESC_BATCH || s->mac_reg[RDH] == 0 ||
+            desc_offset >= total_size || s->mac_reg[RDH] == rdh_start) {
+            pci_dma_write(&s->dev, wb_base, wb, wb_len * sizeof(desc));
+            wb_len = 0;
+        }
         /* see comment in start_xmit; same here */
         if (s->mac_reg[RDH] == rdh_start) {
             DBGOUT(RXERR, "RDH wraparound @%x, RDT %x, RDLEN %x\n",
@@ -945,7 +1117,7 @@ set_rdt(E1000State *s, int index, uint32_t val)
 {
     s->mac_reg[index] = val & 0xffff;
     if (e1000_has_rxbufs(s, 1)) {
-        qemu_flush_queued_packets(&s->nic->nc);
+        qemu_flush_queued_packets(qemu_get_queue(s->nic));
     }
 }
 
@@ -955,10 +1127,27 @@ set_16bit(E1000State *s, int index, uint32_t val)
     s->mac_reg[index] = val & 0xffff;
 }
 
+static void
+set_rdh(E1000State *s, int index, uint32_t val)
+{
+    s->mac_reg[index] = val & 0xffff;
+    s->rx_cache_len = 0;
+}
+
+static void
+set_rdba(E1000State *s, int index, uint32_t val)
+{
+    s->mac_reg[index] = val;
+    s->rx_cache_len = 0;
+}
+
 static void
 set_dlen(E1000State *s, int index, uint32_t val)
 {
     s->mac_reg[index] = val & 0xfff80;
+    if (index == RDLEN) {
+        s->rx_cache_len = 0;
+    }
 }
 
 static void
@@ -998,7 +1187,8 @@ static uint32_t (*macreg_readops[])(E1000State *, int) = {
     getreg(TORL),	getreg(TOTL),	getreg(IMS),	getreg(TCTL),
     getreg(RDH),	getreg(RDT),	getreg(VET),	getreg(ICS),
     getreg(TDBAL),	getreg(TDBAH),	getreg(RDBAH),	getreg(RDBAL),
-    getreg(TDLEN),	getreg(RDLEN),
+    getreg(TDLEN),	getreg(RDLEN),	getreg(RDTR),	getreg(RADV),
+    getreg(TADV),	getreg(ITR),
 
     [TOTH] = mac_read_clr8,	[TORH] = mac_read_clr8,	[GPRC] = mac_read_clr4,
     [GPTC] = mac_read_clr4,	[TPR] = mac_read_clr4,	[TPT] = mac_read_clr4,
@@ -1013,13 +1203,16 @@ enum { NREADOPS = ARRAY_SIZE(macreg_readops) };
 #define putreg(x)	[x] = mac_writereg
 static void (*macreg_writeops[])(E1000State *, int, uint32_t) = {
     putreg(PBA),	putreg(EERD),	putreg(SWSM),	putreg(WUFC),
-    putreg(TDBAL),	putreg(TDBAH),	putreg(TXDCTL),	putreg(RDBAH),
-    putreg(RDBAL),	putreg(LEDCTL), putreg(VET),
+    putreg(TDBAL),	putreg(TDBAH),	putreg(TXDCTL),	putreg(LEDCTL),
+    putreg(VET),
+    [RDBAL] = set_rdba,	[RDBAH] = set_rdba,
     [TDLEN] = set_dlen,	[RDLEN] = set_dlen,	[TCTL] = set_tctl,
     [TDT] = set_tctl,	[MDIC] = set_mdic,	[ICS] = set_ics,
-    [TDH] = set_16bit,	[RDH] = set_16bit,	[RDT] = set_rdt,
+    [TDH] = set_16bit,	[RDH] = set_rdh,	[RDT] = set_rdt,
     [IMC] = set_imc,	[IMS] = set_ims,	[ICR] = set_icr,
     [EECD] = set_eecd,	[RCTL] = set_rx_control, [CTRL] = set_ctrl,
+    [RDTR] = set_16bit,	[RADV] = set_16bit,	[TADV] = set_16bit,
+    [ITR] = set_16bit,
     [RA ... RA+31] = &mac_writereg,
     [MTA ... MTA+127] = &mac_writereg,
     [VFTA ... VFTA+127] = &mac_writereg,
@@ -1102,11 +1295,50 @@ static int e1000_post_load(void *opaque, int version_id)
 
     /* nc.link_down can't be migrated, so infer link_down according
      * to link status bit in mac_reg[STATUS] */
-    s->nic->nc.link_down = (s->mac_reg[STATUS] & E1000_STATUS_LU) == 0;
+    qemu_get_queue(s->nic)->link_down =
+        (s->mac_reg[STATUS] & E1000_STATUS_LU) == 0;
+
+    /* The prefetched descriptors are not migrated */
+    s->rx_cache_len = 0;
+
+    /* Open a mitigation window so that the interrupt level is recomputed
+     * when the timer fires.
+     */
+    s->mit_ide = false;
+    if (s->compat_flags & E1000_FLAG_MIT) {
+        s->mit_timer_on = true;
+        qemu_mod_timer(s->mit_timer, qemu_get_clock_ns(vm_clock) + 1);
+    } else {
+        s->mit_timer_on = false;
+    }
 
     return 0;
 }
 
+static bool e1000_mit_state_needed(void *opaque)
+{
+    E1000State *s = opaque;
+
+    return (s->compat_flags & E1000_FLAG_MIT) &&
+           (s->mac_reg[RDTR] || s->mac_reg[RADV] || s->mac_reg[TADV] ||
+            s->mac_reg[ITR] || s->mit_irq_level);
+}
+
+static const VMStateDescription vmstate_e1000_mit_state = {
+    .name = "e1000/mit_state",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(mac_reg[RDTR], E1000State),
+        VMSTATE_UINT32(mac_reg[RADV], E1000State),
+        VMSTATE_UINT32(mac_reg[TADV], E1000State),
+        VMSTATE_UINT32(mac_reg[ITR], E1000State),
+        VMSTATE_BOOL(mit_irq_level, E1000State),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_e1000 = {
     .name = "e1000",
     .version_id = 2,
@@ -1183,6 +1415,14 @@ static const VMStateDescription vmstate_e1000 = {
         VMSTATE_UINT32_SUB_ARRAY(mac_reg, E1000State, MTA, 128),
         VMSTATE_UINT32_SUB_ARRAY(mac_reg, E1000State, VFTA, 128),
         VMSTATE_END_OF_LIST()
+    },
+    .subsections = (VMStateSubsection[]) {
+        {
+            .vmsd = &vmstate_e1000_mit_state,
+            .needed = e1000_mit_state_needed,
+        }, {
+            /* empty */
+        }
     }
 };
 
@@ -1220,7 +1460,7 @@ e1000_mmio_setup(E1000State *d)
 static void
 e1000_cleanup(NetClientState *nc)
 {
-    E1000State *s = DO_UPCAST(NICState, nc, nc)->opaque;
+    E1000State *s = qemu_get_nic_opaque(nc);
 
     s->nic = NULL;
 }
@@ -1232,9 +1472,11 @@ pci_e1000_uninit(PCIDevice *dev)
 
     qemu_del_timer(d->autoneg_timer);
     qemu_free_timer(d->autoneg_timer);
+    qemu_del_timer(d->mit_timer);
+    qemu_free_timer(d->mit_timer);
     memory_region_destroy(&d->mmio);
     memory_region_destroy(&d->io);
-    qemu_del_net_client(&d->nic->nc);
+    qemu_del_nic(d->nic);
 }
 
 static NetClientInfo net_e1000_info = {
@@ -1281,11 +1523,12 @@ static int pci_e1000_init(PCIDevice *pci_dev)
     d->nic = qemu_new_nic(&net_e1000_info, &d->conf,
                           object_get_typename(OBJECT(d)), d->dev.qdev.id, d);
 
-    qemu_format_nic_info_str(&d->nic->nc, macaddr);
+    qemu_format_nic_info_str(qemu_get_queue(d->nic), macaddr);
 
     add_boot_device_path(d->conf.bootindex, &pci_dev->qdev, "/ethernet-phy@0");
 
     d->autoneg_timer = qemu_new_timer_ms(vm_clock, e1000_autoneg_timer, d);
+    d->mit_timer = qemu_new_timer_ns(vm_clock, e1000_mit_timer, d);
 
     return 0;
 }
@@ -1298,6 +1541,8 @@ static void qdev_e1000_reset(DeviceState *dev)
 
 static Property e1000_properties[] = {
     DEFINE_NIC_PROPERTIES(E1000State, conf),
+    DEFINE_PROP_BIT("mitigation", E1000State,
+                    compat_flags, E1000_FLAG_MIT_BIT, true),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -40,6 +40,9 @@
 
 #define FW_CFG_SIZE 2
 #define FW_CFG_DATA_SIZE 1
+#define FW_CFG_DMA_SIZE 8
+
+#define FW_CFG_F_DMA 0
 
 typedef struct FWCfgEntry {
     uint32_t len;
@@ -50,8 +53,10 @@ typedef struct FWCfgEntry {
 
 struct FWCfgState {
     SysBusDevice busdev;
-    MemoryRegion ctl_iomem, data_iomem, comb_iomem;
-    uint32_t ctl_iobase, data_iobase;
+    MemoryRegion ctl_iomem, data_iomem, comb_iomem, dma_iomem;
+    uint32_t ctl_iobase, data_iobase, dma_iobase;
+    uint32_t features;
+    uint64_t dma_addr;
     FWCfgEntry entries[2][FW_CFG_MAX_ENTRY];
     FWCfgFiles *files;
     uint16_t cur_entry;
@@ -258,6 +263,100 @@ static uint8_t fw_cfg_read(FWCfgState *s)
     return ret;
 }
 
+static bool fw_cfg_dma_enabled(FWCfgState *s)
+{
+    return s->dma_iobase && (s->features & (1 << FW_CFG_F_DMA));
+}
+
+/* Copy zeroes to guest memory, like byte reads past the end of an item */
+static void fw_cfg_dma_zero(hwaddr addr, uint32_t len)
+{
+    static const uint8_t zeroes[4096];
+    uint32_t now;
+
+    while (len) {
+        now = MIN(len, sizeof(zeroes));
+        cpu_physical_memory_write(addr, zeroes, now);
+        addr += now;
+        len -= now;
+    }
+}
+
+static void fw_cfg_dma_transfer(FWCfgState *s)
+{
+    hwaddr desc = s->dma_addr;
+    FWCfgDmaAccess dma;
+    FWCfgEntry *e;
+    uint32_t control, len;
+    int arch;
+
+    s->dma_addr = 0;
+    cpu_physical_memory_read(desc, (uint8_t *)&dma, sizeof(dma));
+    dma.control = be32_to_cpu(dma.control);
+    dma.length = be32_to_cpu(dma.length);
+    dma.address = be64_to_cpu(dma.address);
+
+    FW_CFG_DPRINTF("dma control %#x length %u address %#" PRIx64 "\n",
+                   dma.control, dma.length, dma.address);
+
+    if (dma.control & FW_CFG_DMA_CTL_SELECT) {
+        fw_cfg_select(s, dma.control >> 16);
+    }
+
+    arch = !!(s->cur_entry & FW_CFG_ARCH_LOCAL);
+    e = &s->entries[arch][s->cur_entry & FW_CFG_ENTRY_MASK];
+    control = 0;
+
+    if (dma.control & (FW_CFG_DMA_CTL_READ | FW_CFG_DMA_CTL_SKIP)) {
+        if (s->cur_entry == FW_CFG_INVALID) {
+            control = FW_CFG_DMA_CTL_ERROR;
+            len = 0;
+        } else if (!e->data || s->cur_offset >= e->len) {
+            len = 0;
+        } else {
+            len = MIN(dma.length, e->len - s->cur_offset);
+        }
+        if (dma.control & FW_CFG_DMA_CTL_READ) {
+            if (len) {
+                cpu_physical_memory_write(dma.address,
+                                          e->data + s->cur_offset, len);
+            }
+            fw_cfg_dma_zero(dma.address + len, dma.length - len);
+        }
+        s->cur_offset += len;
+    }
+
+    control = cpu_to_be32(control);
+    cpu_physical_memory_write(desc, (uint8_t *)&control, sizeof(control));
+}
+
+static uint64_t fw_cfg_dma_mem_read(void *opaque, hwaddr addr,
+                                    unsigned size)
+{
+    uint64_t mask = size == 8 ? -1ULL : (1ULL << (size * 8)) - 1;
+
+    /* lets the firmware check that the interface is there */
+    return (FW_CFG_DMA_SIGNATURE >> ((8 - addr - size) * 8)) & mask;
+}
+
+/* The address is written high half first; writing the low half, or the
+   whole address at once, starts the transfer.  */
+static void fw_cfg_dma_mem_write(void *opaque, hwaddr addr,
+                                 uint64_t value, unsigned size)
+{
+    FWCfgState *s = opaque;
+
+    if (size == 8 && addr == 0) {
+        s->dma_addr = value;
+        fw_cfg_dma_transfer(s);
+    } else if (size == 4 && addr == 0) {
+        s->dma_addr = value << 32;
+    } else if (size == 4 && addr == 4) {
+        s->dma_addr |= value;
+        fw_cfg_dma_transfer(s);
+    }
+}
+
 static uint64_t fw_cfg_data_mem_read(void *opaque, hwaddr addr,
                                      unsigned size)
 {
@@ -330,11 +429,22 @@ static const MemoryRegionOps fw_cfg_comb_mem_ops = {
     .valid.accepts = fw_cfg_comb_valid,
 };
 
+static const MemoryRegionOps fw_cfg_dma_mem_ops = {
+    .read = fw_cfg_dma_mem_read,
+    .write = fw_cfg_dma_mem_write,
+    .endianness = DEVICE_BIG_ENDIAN,
+    .valid = {
+        .min_access_size = 4,
+        .max_access_size = 8,
+    },
+};
+
 static void fw_cfg_reset(DeviceState *d)
 {
     FWCfgState *s = DO_UPCAST(FWCfgState, busdev.qdev, d);
 
     fw_cfg_select(s, 0);
+    s->dma_addr = 0;
 }
 
 /* Save restore 32 bit int as uint16_t
@@ -495,6 +605,14 @@ static void fw_cfg_machine_ready(struct Notifier *n, void *data)
 
 FWCfgState *fw_cfg_init(uint32_t ctl_port, uint32_t data_port,
                         hwaddr ctl_addr, hwaddr data_addr)
+{
+    return fw_cfg_init_dma(ctl_port, data_port, 0, ctl_addr, data_addr);
+}
+
+/* Like fw_cfg_init, with a DMA register at I/O port @dma_port (0 for none) */
+FWCfgState *fw_cfg_init_dma(uint32_t ctl_port, uint32_t data_port,
+                            uint32_t dma_port,
+                            hwaddr ctl_addr, hwaddr data_addr)
 {
     DeviceState *dev;
     SysBusDevice *d;
@@ -503,6 +621,7 @@ FWCfgState *fw_cfg_init(uint32_t ctl_port, uint32_t data_port,
     dev = qdev_create(NULL, "fw_cfg");
     qdev_prop_set_uint32(dev, "ctl_iobase", ctl_port);
     qdev_prop_set_uint32(dev, "data_iobase", data_port);
+    qdev_prop_set_uint32(dev, "dma_iobase", dma_port);
     qdev_init_nofail(dev);
     d = sysbus_from_qdev(dev);
 
@@ -515,6 +634,8 @@ FWCfgState *fw_cfg_init(uint32_t ctl_port, uint32_t data_port,
         sysbus_mmio_map(d, 1, data_addr);
     }
     fw_cfg_add_bytes(s, FW_CFG_SIGNATURE, (uint8_t *)"QEMU", 4);
+    fw_cfg_add_i32(s, FW_CFG_ID, FW_CFG_VERSION |
+                   (fw_cfg_dma_enabled(s) ? FW_CFG_VERSION_DMA : 0));
     fw_cfg_add_bytes(s, FW_CFG_UUID, qemu_uuid, 16);
     fw_cfg_add_i16(s, FW_CFG_NOGRAPHIC, (uint16_t)(display_type == DT_NOGRAPHIC));
     fw_cfg_add_i16(s, FW_CFG_NB_CPUS, (uint16_t)smp_cpus);
@@ -553,12 +674,19 @@ static int fw_cfg_init1(SysBusDevice *dev)
             sysbus_add_io(dev, s->data_iobase, &s->data_iomem);
         }
     }
+    if (fw_cfg_dma_enabled(s)) {
+        memory_region_init_io(&s->dma_iomem, &fw_cfg_dma_mem_ops, s,
+                              "fwcfg.dma", FW_CFG_DMA_SIZE);
+        sysbus_add_io(dev, s->dma_iobase, &s->dma_iomem);
+    }
     return 0;
 }
 
 static Property fw_cfg_properties[] = {
     DEFINE_PROP_HEX32("ctl_iobase", FWCfgState, ctl_iobase, -1),
     DEFINE_PROP_HEX32("data_iobase", FWCfgState, data_iobase, -1),
+    DEFINE_PROP_HEX32("dma_iobase", FWCfgState, dma_iobase, 0),
+    DEFINE_PROP_BIT("dma_enabled", FWCfgState, features, FW_CFG_F_DMA, true),
     DEFINE_PROP_END_OF_LIST(),
 };
 
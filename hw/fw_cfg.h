@@ -38,6 +38,19 @@
 
 #define FW_CFG_INVALID          0xffff
 
+/* FW_CFG_ID bits */
+#define FW_CFG_VERSION          0x01
+#define FW_CFG_VERSION_DMA      0x02
+
+/* FWCfgDmaAccess control bits */
+#define FW_CFG_DMA_CTL_ERROR    0x01
+#define FW_CFG_DMA_CTL_READ     0x02
+#define FW_CFG_DMA_CTL_SKIP     0x04
+#define FW_CFG_DMA_CTL_SELECT   0x08
+
+/* Reading the DMA register returns this, big endian */
+#define FW_CFG_DMA_SIGNATURE    0x51454d5520434647ULL /* "QEMU CFG" */
+
 #ifndef NO_QEMU_PROTOS
 typedef struct FWCfgFile {
     uint32_t  size;        /* file size */
@@ -51,6 +64,17 @@ typedef struct FWCfgFiles {
     FWCfgFile f[];
 } FWCfgFiles;
 
+/* Descriptor whose guest physical address is written, big endian, to the
+ * DMA register; all fields are big endian too.  With SELECT, the item to
+ * select is in the top 16 bits of control.  On completion control is
+ * cleared, or left with just the ERROR bit set.
+ */
+typedef struct FWCfgDmaAccess {
+    uint32_t control;
+    uint32_t length;
+    uint64_t address;
+} QEMU_PACKED FWCfgDmaAccess;
+
 typedef void (*FWCfgCallback)(void *opaque, uint8_t *data);
 
 typedef struct FWCfgState FWCfgState;
@@ -64,6 +88,9 @@ int fw_cfg_add_file(FWCfgState *s, const char *filename, uint8_t *data,
                     uint32_t len);
 FWCfgState *fw_cfg_init(uint32_t ctl_port, uint32_t data_port,
                         hwaddr crl_addr, hwaddr data_addr);
+FWCfgState *fw_cfg_init_dma(uint32_t ctl_port, uint32_t data_port,
+                            uint32_t dma_port,
+                            hwaddr crl_addr, hwaddr data_addr);
 
 #endif /* NO_QEMU_PROTOS */
 
@@ -32,6 +32,7 @@
 #include "sysbus.h"
 #include "mc146818rtc.h"
 #include "i8254.h"
+#include "qemu/seqlock.h"
 
 //#define HPET_DEBUG
 #ifdef HPET_DEBUG
@@ -61,6 +62,8 @@ typedef struct HPETTimer {  /* timers */
 typedef struct HPETState {
     SysBusDevice busdev;
     MemoryRegion iomem;
+    MemoryRegion counter_mem;   /* main counter, read without the BQL */
+    QemuSeqLock counter_seqlock; /* config, hpet_offset and hpet_counter */
     uint64_t hpet_offset;
     qemu_irq irqs[HPET_NUM_IRQ_ROUTES];
     uint32_t flags;
@@ -149,6 +152,24 @@ static uint64_t hpet_get_ticks(HPETState *s)
     return ns_to_ticks(qemu_get_clock_ns(vm_clock) + s->hpet_offset);
 }
 
+/* Main counter value; safe to call without the global mutex.  */
+static uint64_t hpet_read_counter(HPETState *s)
+{
+    uint64_t cur_tick;
+    unsigned start;
+
+    do {
+        start = seqlock_read_begin(&s->counter_seqlock);
+        if (hpet_enabled(s)) {
+            cur_tick = hpet_get_ticks(s);
+        } else {
+            cur_tick = s->hpet_counter;
+        }
+    } while (seqlock_read_retry(&s->counter_seqlock, start));
+
+    return cur_tick;
+}
+
 /*
  * calculate diff between comparator value and current ticks
  */
@@ -210,7 +231,9 @@ static void hpet_pre_save(void *opaque)
     HPETState *s = opaque;
 
     /* save current counter value */
+    seqlock_write_begin(&s->counter_seqlock);
     s->hpet_counter = hpet_get_ticks(s);
+    seqlock_write_end(&s->counter_seqlock);
 }
 
 static int hpet_pre_load(void *opaque)
@@ -227,7 +250,9 @@ static int hpet_post_load(void *opaque, int version_id)
     HPETState *s = opaque;
 
     /* Recalculate the offset between the main counter and guest time */
+    seqlock_write_begin(&s->counter_seqlock);
     s->hpet_offset = ticks_to_ns(s->hpet_counter) - qemu_get_clock_ns(vm_clock);
+    seqlock_write_end(&s->counter_seqlock);
 
     /* Push number of timers into capability returned via HPET_ID */
     s->capability &= ~HPET_ID_NUM_TIM_MASK;
@@ -430,19 +455,11 @@ static uint64_t hpet_ram_read(void *opaque, hwaddr addr,
             DPRINTF("qemu: invalid HPET_CFG + 4 hpet_ram_readl\n");
             return 0;
         case HPET_COUNTER:
-            if (hpet_enabled(s)) {
-                cur_tick = hpet_get_ticks(s);
-            } else {
-                cur_tick = s->hpet_counter;
-            }
+            cur_tick = hpet_read_counter(s);
             DPRINTF("qemu: reading counter  = %" PRIx64 "\n", cur_tick);
             return cur_tick;
         case HPET_COUNTER + 4:
-            if (hpet_enabled(s)) {
-                cur_tick = hpet_get_ticks(s);
-            } else {
-                cur_tick = s->hpet_counter;
-            }
+            cur_tick = hpet_read_counter(s);
             DPRINTF("qemu: reading counter + 4  = %" PRIx64 "\n", cur_tick);
             return cur_tick >> 32;
         case HPET_STATUS:
@@ -557,11 +574,17 @@ static void hpet_ram_write(void *opaque, hwaddr addr,
             return;
         case HPET_CFG:
             val = hpet_fixup_reg(new_val, old_val, HPET_CFG_WRITE_MASK);
+            seqlock_write_begin(&s->counter_seqlock);
             s->config = (s->config & 0xffffffff00000000ULL) | val;
             if (activating_bit(old_val, new_val, HPET_CFG_ENABLE)) {
-                /* Enable main counter and interrupt generation. */
                 s->hpet_offset =
                     ticks_to_ns(s->hpet_counter) - qemu_get_clock_ns(vm_clock);
+            } else if (deactivating_bit(old_val, new_val, HPET_CFG_ENABLE)) {
+                s->hpet_counter = hpet_get_ticks(s);
+            }
+            seqlock_write_end(&s->counter_seqlock);
+            if (activating_bit(old_val, new_val, HPET_CFG_ENABLE)) {
+                /* Enable main counter and interrupt generation. */
                 for (i = 0; i < s->num_timers; i++) {
                     if ((&s->timer[i])->cmp != ~0ULL) {
                         hpet_set_timer(&s->timer[i]);
@@ -569,7 +592,6 @@ static void hpet_ram_write(void *opaque, hwaddr addr,
                 }
             } else if (deactivating_bit(old_val, new_val, HPET_CFG_ENABLE)) {
                 /* Halt main counter and disable interrupt generation. */
-                s->hpet_counter = hpet_get_ticks(s);
                 for (i = 0; i < s->num_timers; i++) {
                     hpet_del_timer(&s->timer[i]);
                 }
@@ -601,8 +623,10 @@ static void hpet_ram_write(void *opaque, hwaddr addr,
             if (hpet_enabled(s)) {
                 DPRINTF("qemu: Writing counter while HPET enabled!\n");
             }
+            seqlock_write_begin(&s->counter_seqlock);
             s->hpet_counter =
                 (s->hpet_counter & 0xffffffff00000000ULL) | value;
+            seqlock_write_end(&s->counter_seqlock);
             DPRINTF("qemu: HPET counter written. ctr = %#x -> %" PRIx64 "\n",
                     value, s->hpet_counter);
             break;
@@ -610,8 +634,10 @@ static void hpet_ram_write(void *opaque, hwaddr addr,
             if (hpet_enabled(s)) {
                 DPRINTF("qemu: Writing counter while HPET enabled!\n");
             }
+            seqlock_write_begin(&s->counter_seqlock);
             s->hpet_counter =
                 (s->hpet_counter & 0xffffffffULL) | (((uint64_t)value) << 32);
+            seqlock_write_end(&s->counter_seqlock);
             DPRINTF("qemu: HPET counter + 4 written. ctr = %#x -> %" PRIx64 "\n",
                     value, s->hpet_counter);
             break;
@@ -632,6 +658,32 @@ static const MemoryRegionOps hpet_ram_ops = {
     .endianness = DEVICE_NATIVE_ENDIAN,
 };
 
+/* The main counter is polled as a clocksource, so vCPUs read it without
+   the global mutex.  Writes are rare and go to hpet_ram_write.  */
+static uint64_t hpet_counter_read(void *opaque, hwaddr addr, unsigned size)
+{
+    return hpet_read_counter(opaque) >> (addr * 8);
+}
+
+static void hpet_counter_write(void *opaque, hwaddr addr, uint64_t value,
+                               unsigned size)
+{
+    bool locked = qemu_mutex_lock_iothread_vcpu();
+
+    hpet_ram_write(opaque, HPET_COUNTER + addr, value, size);
+    qemu_mutex_unlock_iothread_vcpu(locked);
+}
+
+static const MemoryRegionOps hpet_counter_ops = {
+    .read = hpet_counter_read,
+    .write = hpet_counter_write,
+    .valid = {
+        .min_access_size = 4,
+        .max_access_size = 4,
+    },
+    .endianness = DEVICE_NATIVE_ENDIAN,
+};
+
 static void hpet_reset(DeviceState *d)
 {
     HPETState *s = FROM_SYSBUS(HPETState, sysbus_from_qdev(d));
@@ -653,9 +705,11 @@ static void hpet_reset(DeviceState *d)
     }
 
     qemu_set_irq(s->pit_enabled, 1);
+    seqlock_write_begin(&s->counter_seqlock);
     s->hpet_counter = 0ULL;
     s->hpet_offset = 0ULL;
     s->config = 0ULL;
+    seqlock_write_end(&s->counter_seqlock);
     hpet_cfg.hpet[s->hpet_id].event_timer_block_id = (uint32_t)s->capability;
     hpet_cfg.hpet[s->hpet_id].address = sysbus_from_qdev(d)->mmio[0].addr;
 
@@ -722,7 +776,13 @@ static int hpet_init(SysBusDevice *dev)
     qdev_init_gpio_out(&dev->qdev, &s->pit_enabled, 1);
 
     /* HPET Area */
+    seqlock_init(&s->counter_seqlock);
     memory_region_init_io(&s->iomem, &hpet_ram_ops, s, "hpet", 0x400);
+    memory_region_init_io(&s->counter_mem, &hpet_counter_ops, s,
+                          "hpet-counter", 8);
+    memory_region_set_lockless(&s->counter_mem, true);
+    memory_region_add_subregion_overlap(&s->iomem, HPET_COUNTER,
+                                        &s->counter_mem, 1);
     sysbus_init_mmio(dev, &s->iomem);
     return 0;
 }
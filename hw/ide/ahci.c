@@ -431,15 +431,23 @@ static void ahci_reg_init(AHCIState *s)
 static void check_cmd(AHCIState *s, int port)
 {
     AHCIPortRegs *pr = &s->dev[port].port_regs;
+    BlockDriverState *bs = s->dev[port].port.ifs[0].bs;
     int slot;
 
     if ((pr->cmd & PORT_CMD_START) && pr->cmd_issue) {
+        /* NCQ commands issued together can be merged by the block layer */
+        if (bs) {
+            bdrv_io_plug(bs);
+        }
         for (slot = 0; (slot < 32) && pr->cmd_issue; slot++) {
             if ((pr->cmd_issue & (1 << slot)) &&
                 !handle_cmd(s, port, slot)) {
                 pr->cmd_issue &= ~(1 << slot);
             }
         }
+        if (bs) {
+            bdrv_io_unplug(bs);
+        }
     }
 }
 
@@ -493,6 +501,7 @@ static void ahci_reset_port(AHCIState *s, int port)
     pr->scr_stat = 0;
     pr->scr_err = 0;
     pr->scr_act = 0;
+    d->sdb_pending = 0;
     d->busy_slot = -1;
     d->init_d2h_sent = 0;
 
@@ -709,26 +718,47 @@ out:
     return r;
 }
 
+/* Report all NCQ tags completed since the last Set Device Bits FIS with a
+ * single FIS and interrupt.
+ */
+static void ahci_ncq_flush_sdb(AHCIDevice *ad)
+{
+    uint32_t done = ad->sdb_pending;
+
+    if (!done) {
+        return;
+    }
+    ad->sdb_pending = 0;
+
+    /* Clear the bits for these tags in SActive */
+    ad->port_regs.scr_act &= ~done;
+    ahci_write_fis_sdb(ad->hba, ad->port_no, done);
+}
+
+static void ahci_ncq_sdb_bh(void *opaque)
+{
+    ahci_ncq_flush_sdb(opaque);
+}
+
 static void ncq_cb(void *opaque, int ret)
 {
     NCQTransferState *ncq_tfs = (NCQTransferState *)opaque;
     IDEState *ide_state = &ncq_tfs->drive->port.ifs[0];
 
-    /* Clear bit for this tag in SActive */
-    ncq_tfs->drive->port_regs.scr_act &= ~(1 << ncq_tfs->tag);
+    ncq_tfs->drive->sdb_pending |= (1 << ncq_tfs->tag);
 
     if (ret < 0) {
-        /* error */
+        /* error, reported right away together with what is pending */
         ide_state->error = ABRT_ERR;
         ide_state->status = READY_STAT | ERR_STAT;
         ncq_tfs->drive->port_regs.scr_err |= (1 << ncq_tfs->tag);
+        ahci_ncq_flush_sdb(ncq_tfs->drive);
     } else {
+        /* completions from the same batch of AIO share one FIS */
         ide_state->status = READY_STAT | SEEK_STAT;
+        qemu_bh_schedule(ncq_tfs->drive->sdb_bh);
     }
 
-    ahci_write_fis_sdb(ncq_tfs->drive->hba, ncq_tfs->drive->port_no,
-                       (1 << ncq_tfs->tag));
-
     DPRINTF(ncq_tfs->drive->port_no, "NCQ transfer tag %d finished\n",
             ncq_tfs->tag);
 
@@ -1175,11 +1205,17 @@ void ahci_init(AHCIState *s, DeviceState *qdev, DMAContext *dma, int ports)
         ad->port_no = i;
         ad->port.dma = &ad->dma;
         ad->port.dma->ops = &ahci_dma_ops;
+        ad->sdb_bh = qemu_bh_new(ahci_ncq_sdb_bh, ad);
     }
 }
 
 void ahci_uninit(AHCIState *s)
 {
+    int i;
+
+    for (i = 0; i < s->ports; i++) {
+        qemu_bh_delete(s->dev[i].sdb_bh);
+    }
     memory_region_destroy(&s->mem);
     memory_region_destroy(&s->idp);
     g_free(s->dev);
@@ -279,6 +279,8 @@ struct AHCIDevice {
     AHCIPortRegs port_regs;
     struct AHCIState *hba;
     QEMUBH *check_bh;
+    QEMUBH *sdb_bh;
+    uint32_t sdb_pending;       /* NCQ tags completed but not yet reported */
     uint8_t *lst;
     uint8_t *res_fis;
     int dma_status;
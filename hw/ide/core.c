@@ -359,6 +359,7 @@ BlockDriverAIOCB *ide_issue_trim(BlockDriverState *bs,
 {
     TrimAIOCB *iocb;
     int i, j, ret;
+    uint64_t trim_start = 0, trim_sectors = 0;
 
     iocb = qemu_aio_get(&trim_aiocb_info, bs, cb, opaque);
     iocb->bh = qemu_bh_new(ide_trim_bh_cb, iocb);
@@ -377,10 +378,28 @@ BlockDriverAIOCB *ide_issue_trim(BlockDriverState *bs,
                 break;
             }
 
-            ret = bdrv_discard(bs, sector, count);
-            if (!iocb->ret) {
-                iocb->ret = ret;
+            /* Guests split large ranges into 64k sector entries */
+            if (trim_sectors && sector == trim_start + trim_sectors &&
+                trim_sectors + count <= INT_MAX >> BDRV_SECTOR_BITS) {
+                trim_sectors += count;
+                continue;
             }
+
+            if (trim_sectors) {
+                ret = bdrv_discard(bs, trim_start, trim_sectors);
+                if (!iocb->ret) {
+                    iocb->ret = ret;
+                }
+            }
+            trim_start = sector;
+            trim_sectors = count;
+        }
+    }
+
+    if (trim_sectors) {
+        ret = bdrv_discard(bs, trim_start, trim_sectors);
+        if (!iocb->ret) {
+            iocb->ret = ret;
         }
     }
 
@@ -19,6 +19,7 @@
 #include "hw.h"
 #include "pc.h"
 #include "pci.h"
+#include "msi.h"
 #include "msix.h"
 #include "kvm.h"
 #include "migration.h"
@@ -54,6 +55,14 @@ typedef struct EventfdEntry {
     int vector;
 } EventfdEntry;
 
+/* MSI-X vector delivered by KVM straight from our eventfd */
+typedef struct MSIVector {
+    MSIMessage msg;
+    int virq;
+    bool unmasked;
+    bool irqfd;
+} MSIVector;
+
 typedef struct IVShmemState {
     PCIDevice dev;
     uint32_t intrmask;
@@ -83,10 +92,12 @@ typedef struct IVShmemState {
     uint32_t vectors;
     uint32_t features;
     EventfdEntry *eventfd_table;
+    MSIVector *msi_vectors;     /* NULL unless MSI goes through irqfd */
 
     Error *migration_blocker;
 
     char * shmobj;
+    char * mem_path;
     char * sizearg;
     char * role;
     int role_val;   /* scalar to avoid multiple string comparisons */
@@ -305,6 +316,72 @@ static CharDriverState* create_eventfd_chr_device(void * opaque, EventNotifier *
 
 }
 
+/* Let KVM inject @vector whenever our eventfd for it is signalled, so the
+ * main loop no longer sees those doorbells.  Stays with fake_irqfd() if no
+ * route can be set up.
+ */
+static void ivshmem_irqfd_attach(IVShmemState *s, int vector)
+{
+    MSIVector *v = &s->msi_vectors[vector];
+    EventNotifier *n;
+    int ret;
+
+    if (v->irqfd || !v->unmasked || !s->eventfd_chr[vector]) {
+        return;
+    }
+    n = &s->peers[s->vm_id].eventfds[vector];
+
+    ret = kvm_irqchip_add_msi_route(kvm_state, v->msg);
+    if (ret < 0) {
+        return;
+    }
+    v->virq = ret;
+    if (kvm_irqchip_add_irqfd_notifier(kvm_state, n, v->virq) < 0) {
+        kvm_irqchip_release_virq(kvm_state, v->virq);
+        return;
+    }
+    qemu_chr_add_handlers(s->eventfd_chr[vector], NULL, NULL, NULL, NULL);
+    v->irqfd = true;
+}
+
+static void ivshmem_irqfd_detach(IVShmemState *s, int vector)
+{
+    MSIVector *v = &s->msi_vectors[vector];
+    int ret;
+
+    if (!v->irqfd) {
+        return;
+    }
+    ret = kvm_irqchip_remove_irqfd_notifier(kvm_state,
+                                            &s->peers[s->vm_id].eventfds[vector],
+                                            v->virq);
+    assert(ret == 0);
+    kvm_irqchip_release_virq(kvm_state, v->virq);
+    v->irqfd = false;
+
+    /* masked vectors go through msix_notify() to set their pending bit */
+    qemu_chr_add_handlers(s->eventfd_chr[vector], ivshmem_can_receive,
+                          fake_irqfd, ivshmem_event, &s->eventfd_table[vector]);
+}
+
+static int ivshmem_vector_use(PCIDevice *dev, unsigned vector, MSIMessage msg)
+{
+    IVShmemState *s = DO_UPCAST(IVShmemState, dev, dev);
+
+    s->msi_vectors[vector].msg = msg;
+    s->msi_vectors[vector].unmasked = true;
+    ivshmem_irqfd_attach(s, vector);
+    return 0;
+}
+
+static void ivshmem_vector_release(PCIDevice *dev, unsigned vector)
+{
+    IVShmemState *s = DO_UPCAST(IVShmemState, dev, dev);
+
+    s->msi_vectors[vector].unmasked = false;
+    ivshmem_irqfd_detach(s, vector);
+}
+
 static int check_shm_size(IVShmemState *s, int fd) {
     /* check that the guest isn't going to try and map more memory than the
      * the object has allocated return -1 to indicate error */
@@ -373,6 +450,12 @@ static void close_guest_eventfds(IVShmemState *s, int posn)
 
     guest_curr_max = s->peers[posn].nb_eventfds;
 
+    if (s->msi_vectors && posn == s->vm_id) {
+        for (i = 0; i < guest_curr_max; i++) {
+            ivshmem_irqfd_detach(s, i);
+        }
+    }
+
     memory_region_transaction_begin();
     for (i = 0; i < guest_curr_max; i++) {
         ivshmem_del_eventfd(s, posn, i);
@@ -504,6 +587,9 @@ static void ivshmem_read(void *opaque, const uint8_t * buf, int flags)
         s->eventfd_chr[guest_max_eventfd] = create_eventfd_chr_device(s,
                    &s->peers[s->vm_id].eventfds[guest_max_eventfd],
                    guest_max_eventfd);
+        if (s->msi_vectors) {
+            ivshmem_irqfd_attach(s, guest_max_eventfd);
+        }
     }
 
     if (ivshmem_has_feature(s, IVSHMEM_IOEVENTFD)) {
@@ -575,6 +661,39 @@ static void ivshmem_setup_msi(IVShmemState * s)
     s->eventfd_table = g_malloc0(s->vectors * sizeof(EventfdEntry));
 
     ivshmem_use_msix(s);
+
+    if (kvm_msi_via_irqfd_enabled()) {
+        s->msi_vectors = g_new0(MSIVector, s->vectors);
+        if (msix_set_vector_notifiers(&s->dev, ivshmem_vector_use,
+                                      ivshmem_vector_release) < 0) {
+            g_free(s->msi_vectors);
+            s->msi_vectors = NULL;
+        }
+    }
+}
+
+/* Back the region with a file, typically on hugetlbfs, instead of a POSIX
+ * shared memory object.
+ */
+static int ivshmem_open_mem_path(IVShmemState *s)
+{
+    struct stat st;
+    int fd;
+
+    fd = open(s->mem_path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        fprintf(stderr, "ivshmem: could not open %s: %s\n", s->mem_path,
+                strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &st) == 0 && st.st_size < s->ivshmem_size &&
+        ftruncate(fd, s->ivshmem_size) != 0) {
+        fprintf(stderr, "ivshmem: could not size %s to %" PRIu64 " bytes:"
+                " %s\n", s->mem_path, s->ivshmem_size, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
 }
 
 static void ivshmem_save(QEMUFile* f, void *opaque)
@@ -699,9 +818,9 @@ static int pci_ivshmem_init(PCIDevice *dev)
         /* if we get a UNIX socket as the parameter we will talk
          * to the ivshmem server to receive the memory region */
 
-        if (s->shmobj != NULL) {
+        if (s->shmobj != NULL || s->mem_path != NULL) {
             fprintf(stderr, "WARNING: do not specify both 'chardev' "
-                                                "and 'shm' with ivshmem\n");
+                                    "and 'shm' or 'mem-path' with ivshmem\n");
         }
 
         IVSHMEM_DPRINTF("using shared memory server (socket = %s)\n",
@@ -728,6 +847,16 @@ static int pci_ivshmem_init(PCIDevice *dev)
         /* just map the file immediately, we're not using a server */
         int fd;
 
+        if (s->mem_path != NULL) {
+            fd = ivshmem_open_mem_path(s);
+            if (fd < 0 || check_shm_size(s, fd) == -1) {
+                exit(-1);
+            }
+            create_shared_memory_BAR(s, fd);
+            s->dev.config_write = ivshmem_write_config;
+            return 0;
+        }
+
         if (s->shmobj == NULL) {
             fprintf(stderr, "Must specify 'chardev' or 'shm' to ivshmem\n");
         }
@@ -772,6 +901,11 @@ static void pci_ivshmem_uninit(PCIDevice *dev)
         error_free(s->migration_blocker);
     }
 
+    if (s->msi_vectors) {
+        msix_unset_vector_notifiers(&s->dev);
+        g_free(s->msi_vectors);
+    }
+
     memory_region_destroy(&s->ivshmem_mmio);
     memory_region_del_subregion(&s->bar, &s->ivshmem);
     vmstate_unregister_ram(&s->ivshmem, &s->dev.qdev);
@@ -787,6 +921,7 @@ static Property ivshmem_properties[] = {
     DEFINE_PROP_BIT("ioeventfd", IVShmemState, features, IVSHMEM_IOEVENTFD, false),
     DEFINE_PROP_BIT("msi", IVShmemState, features, IVSHMEM_MSI, true),
     DEFINE_PROP_STRING("shm", IVShmemState, shmobj),
+    DEFINE_PROP_STRING("mem-path", IVShmemState, mem_path),
     DEFINE_PROP_STRING("role", IVShmemState, role),
     DEFINE_PROP_UINT32("use64", IVShmemState, ivshmem_64bit, 1),
     DEFINE_PROP_END_OF_LIST(),
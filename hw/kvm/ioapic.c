@@ -22,6 +22,7 @@ void kvm_pc_setup_irq_routing(bool pci_enabled)
     int i;
 
     if (kvm_check_extension(s, KVM_CAP_IRQ_ROUTING)) {
+        kvm_irqchip_begin_route_changes(s);
         for (i = 0; i < 8; ++i) {
             if (i == 2) {
                 continue;
@@ -40,6 +41,7 @@ void kvm_pc_setup_irq_routing(bool pci_enabled)
                 }
             }
         }
+        kvm_irqchip_commit_route_changes(s);
     }
 }
 
@@ -74,6 +74,7 @@ typedef struct RTCState {
     int64_t next_periodic_time;
     /* update-ended timer */
     QEMUTimer *update_timer;
+    uint64_t next_update_time;
     uint64_t next_alarm_time;
     uint16_t irq_reinject_on_ack_count;
     uint32_t irq_coalesced;
@@ -178,8 +179,29 @@ static void periodic_timer_update(RTCState *s, int64_t current_time)
 static void rtc_periodic_timer(void *opaque)
 {
     RTCState *s = opaque;
+    int64_t fired = s->next_periodic_time;
+    int64_t now = qemu_get_clock_ns(rtc_clock);
 
-    periodic_timer_update(s, s->next_periodic_time);
+    /* Schedule from the current time rather than from the missed
+     * deadline, so that a late timer does not fire back to back once
+     * per period to catch up.  */
+    periodic_timer_update(s, MAX(fired, now));
+#ifdef TARGET_I386
+    if (s->lost_tick_policy == LOST_TICK_SLEW &&
+        (s->cmos_data[RTC_REG_B] & REG_B_PIE) && s->period) {
+        uint64_t cycles = muldiv64(s->next_periodic_time - fired,
+                                   RTC_CLOCK_RATE, get_ticks_per_sec());
+        uint32_t lost = (cycles + s->period / 2) / s->period;
+
+        /* The ticks skipped over are reinjected like undelivered ones */
+        if (lost > 1) {
+            s->irq_coalesced += lost - 1;
+            rtc_coalesced_timer_update(s);
+            DPRINTF_C("cmos: coalesced irqs increased to %d\n",
+                      s->irq_coalesced);
+        }
+    }
+#endif
     s->cmos_data[RTC_REG_C] |= REG_C_PF;
     if (s->cmos_data[RTC_REG_B] & REG_B_PIE) {
         s->cmos_data[RTC_REG_C] |= REG_C_IRQF;
@@ -213,6 +235,8 @@ static void check_update_timer(RTCState *s)
     uint64_t guest_nsec;
     int next_alarm_sec;
 
+    s->next_update_time = 0;
+
     /* From the data sheet: "Holding the dividers in reset prevents
      * interrupts from operating, while setting the SET bit allows"
      * them to occur.  However, it will prevent an alarm interrupt
@@ -249,6 +273,15 @@ static void check_update_timer(RTCState *s)
          * the alarm time.  */
         next_update_time = s->next_alarm_time;
     }
+    s->next_update_time = next_update_time;
+
+    /* With update and alarm interrupts masked nothing needs to happen at
+     * that time; the guest can only poll register C, which catches up
+     * with the flags on read.  */
+    if (!(s->cmos_data[RTC_REG_B] & (REG_B_UIE | REG_B_AIE))) {
+        qemu_del_timer(s->update_timer);
+        return;
+    }
     if (next_update_time != qemu_timer_expire_time_ns(s->update_timer)) {
         qemu_mod_timer(s->update_timer, next_update_time);
     }
@@ -384,6 +417,16 @@ static void rtc_update_timer(void *opaque)
     check_update_timer(s);
 }
 
+/* Set the UF and AF flags the update-ended timer would have set, had it
+ * been armed.  */
+static void rtc_update_catch_up(RTCState *s)
+{
+    if (s->next_update_time && !qemu_timer_pending(s->update_timer) &&
+        qemu_get_clock_ns(rtc_clock) >= s->next_update_time) {
+        rtc_update_timer(s);
+    }
+}
+
 static void cmos_ioport_write(void *opaque, hwaddr addr,
                               uint64_t data, unsigned size)
 {
@@ -464,6 +507,7 @@ static void cmos_ioport_write(void *opaque, hwaddr addr,
             }
             /* if an interrupt flag is already set when the interrupt
              * becomes enabled, raise an interrupt immediately.  */
+            rtc_update_catch_up(s);
             if (data & s->cmos_data[RTC_REG_C] & REG_C_MASK) {
                 s->cmos_data[RTC_REG_C] |= REG_C_IRQF;
                 qemu_irq_raise(s->irq);
@@ -637,6 +681,7 @@ static uint64_t cmos_ioport_read(void *opaque, hwaddr addr,
             ret = s->cmos_data[s->cmos_index];
             break;
         case RTC_REG_C:
+            rtc_update_catch_up(s);
             ret = s->cmos_data[s->cmos_index];
             qemu_irq_lower(s->irq);
             s->cmos_data[RTC_REG_C] = 0x00;
@@ -692,6 +737,13 @@ static void rtc_set_date_from_host(ISADevice *dev)
     rtc_set_cmos(s, &tm);
 }
 
+static void rtc_pre_save(void *opaque)
+{
+    RTCState *s = opaque;
+
+    rtc_update_catch_up(s);
+}
+
 static int rtc_post_load(void *opaque, int version_id)
 {
     RTCState *s = opaque;
@@ -700,6 +752,9 @@ static int rtc_post_load(void *opaque, int version_id)
         rtc_set_time(s);
         s->offset = 0;
         check_update_timer(s);
+    } else if (!qemu_timer_pending(s->update_timer)) {
+        /* next_update_time is not migrated */
+        check_update_timer(s);
     }
 
 #ifdef TARGET_I386
@@ -717,6 +772,7 @@ static const VMStateDescription vmstate_rtc = {
     .version_id = 3,
     .minimum_version_id = 1,
     .minimum_version_id_old = 1,
+    .pre_save = rtc_pre_save,
     .post_load = rtc_post_load,
     .fields      = (VMStateField []) {
         VMSTATE_BUFFER(cmos_data, RTCState),
@@ -854,6 +910,9 @@ static int rtc_initfn(ISADevice *dev)
 
     memory_region_init_io(&s->io, &cmos_ops, s, "rtc", 2);
     isa_register_ioport(dev, &s->io, base);
+    /* Index writes have no side effect until the data port is accessed,
+       and every access to the data port flushes the coalesced ring first.  */
+    memory_region_add_coalescing(&s->io, 0, 1);
 
     qdev_set_legacy_instance_id(&dev->qdev, base, 3);
     qemu_register_reset(rtc_reset, s);
@@ -0,0 +1,171 @@
+/*
+ * Memory hotplug into preconfigured slots
+ *
+ * The board reserves a window of guest physical addresses above RAM that is
+ * as large as the difference between maxmem and the boot memory.  Memory
+ * backends created with -object are then mapped into that window with
+ * the memory-add command; each populated slot is a separate RAM block and
+ * becomes a separate KVM memory slot through the memory listener.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "hw.h"
+#include "sysemu.h"
+#include "mem_hotplug.h"
+#include "qemu/hostmem.h"
+#include "qmp-commands.h"
+#include "qerror.h"
+
+static uint64_t hotplug_size;
+static int hotplug_nr_slots;
+static MemHotplugSlot *hotplug_slots;
+static MemoryRegion hotplug_mr;
+static hwaddr hotplug_base;
+static hwaddr hotplug_next;
+static NotifierList hotplug_notifiers =
+    NOTIFIER_LIST_INITIALIZER(hotplug_notifiers);
+
+int mem_hotplug_configure(uint64_t ram_size, uint64_t maxmem, int nr_slots)
+{
+    if (nr_slots < 0 || nr_slots > MEM_HOTPLUG_MAX_SLOTS) {
+        return -EINVAL;
+    }
+    if (!nr_slots) {
+        return 0;
+    }
+    if (maxmem <= ram_size) {
+        return -EINVAL;
+    }
+
+    hotplug_size = QEMU_ALIGN_UP(maxmem - ram_size, MEM_HOTPLUG_ALIGN);
+    hotplug_nr_slots = nr_slots;
+    hotplug_slots = g_new0(MemHotplugSlot, nr_slots);
+    return 0;
+}
+
+hwaddr mem_hotplug_init(MemoryRegion *system_memory, hwaddr ram_end)
+{
+    if (!hotplug_nr_slots) {
+        return ram_end;
+    }
+
+    hotplug_base = QEMU_ALIGN_UP(ram_end, 1ULL << 30);
+    hotplug_next = hotplug_base;
+    memory_region_init(&hotplug_mr, "hotplug-memory", hotplug_size);
+    memory_region_add_subregion(system_memory, hotplug_base, &hotplug_mr);
+
+    return hotplug_base + hotplug_size;
+}
+
+int mem_hotplug_nr_slots(void)
+{
+    return hotplug_nr_slots;
+}
+
+const MemHotplugSlot *mem_hotplug_get_slot(int slot)
+{
+    if (slot < 0 || slot >= hotplug_nr_slots) {
+        return NULL;
+    }
+    return &hotplug_slots[slot];
+}
+
+void mem_hotplug_add_notifier(Notifier *notifier)
+{
+    notifier_list_add(&hotplug_notifiers, notifier);
+}
+
+void qmp_memory_add(const char *memdev, Error **errp)
+{
+    HostMemoryBackend *backend;
+    MemHotplugSlot *slot = NULL;
+    MemoryRegion *mr;
+    Object *obj;
+    char *path;
+    hwaddr addr;
+    int i;
+
+    if (!hotplug_nr_slots || !memory_region_size(&hotplug_mr)) {
+        error_setg(errp, "Memory hotplug is not enabled for this machine");
+        return;
+    }
+
+    path = g_strdup_printf("/objects/%s", memdev);
+    obj = object_resolve_path(path, NULL);
+    g_free(path);
+    if (!obj || !object_dynamic_cast(obj, TYPE_MEMORY_BACKEND)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "memdev",
+                  "a memory backend");
+        return;
+    }
+    backend = MEMORY_BACKEND(obj);
+    if (backend->allocated) {
+        error_setg(errp, "Memory backend '%s' is already in use", memdev);
+        return;
+    }
+    if (!backend->size || backend->size % MEM_HOTPLUG_ALIGN) {
+        error_setg(errp, "The size of memory backend '%s' must be a "
+                   "non-zero multiple of %llu MiB", memdev,
+                   MEM_HOTPLUG_ALIGN >> 20);
+        return;
+    }
+
+    for (i = 0; i < hotplug_nr_slots; i++) {
+        if (!hotplug_slots[i].memdev) {
+            slot = &hotplug_slots[i];
+            break;
+        }
+    }
+    if (!slot) {
+        error_setg(errp, "All %d memory slots are in use", hotplug_nr_slots);
+        return;
+    }
+
+    /* Slots are never emptied, so the window is filled from the bottom */
+    addr = hotplug_next;
+    if (addr + backend->size >
+        hotplug_base + memory_region_size(&hotplug_mr)) {
+        error_setg(errp, "Not enough room below maxmem for '%s'", memdev);
+        return;
+    }
+
+    mr = host_memory_backend_get_memory(backend, errp);
+    if (!mr) {
+        return;
+    }
+    vmstate_register_ram_global(mr);
+    memory_region_add_subregion(&hotplug_mr, addr - hotplug_base, mr);
+
+    slot->addr = addr;
+    slot->size = backend->size;
+    slot->memdev = g_strdup(memdev);
+    hotplug_next = addr + backend->size;
+
+    notifier_list_notify(&hotplug_notifiers, &i);
+}
+
+MemorySlotInfoList *qmp_query_memory_slots(Error **errp)
+{
+    MemorySlotInfoList *head = NULL, **tail = &head;
+    int i;
+
+    for (i = 0; i < hotplug_nr_slots; i++) {
+        MemorySlotInfoList *entry = g_malloc0(sizeof(*entry));
+        MemorySlotInfo *info = g_malloc0(sizeof(*info));
+
+        info->slot = i;
+        info->addr = hotplug_slots[i].addr;
+        info->size = hotplug_slots[i].size;
+        if (hotplug_slots[i].memdev) {
+            info->has_memdev = true;
+            info->memdev = g_strdup(hotplug_slots[i].memdev);
+        }
+        entry->value = info;
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    return head;
+}
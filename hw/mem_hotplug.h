@@ -0,0 +1,42 @@
+/*
+ * Memory hotplug into preconfigured slots
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef HW_MEM_HOTPLUG_H
+#define HW_MEM_HOTPLUG_H
+
+#include "qemu-common.h"
+#include "memory.h"
+#include "notify.h"
+
+#define MEM_HOTPLUG_MAX_SLOTS 32
+
+/* The size of a Linux memory section on x86-64; hotplugged memory must be a
+ * multiple of it and is mapped at addresses aligned to it.
+ */
+#define MEM_HOTPLUG_ALIGN (128ULL << 20)
+
+typedef struct MemHotplugSlot {
+    hwaddr addr;
+    uint64_t size;
+    char *memdev;               /* NULL while the slot is empty */
+} MemHotplugSlot;
+
+/* Called by vl.c for "-machine maxmem=...,mem-slots=...".  */
+int mem_hotplug_configure(uint64_t ram_size, uint64_t maxmem, int nr_slots);
+
+/* Called by the board once RAM has been laid out.  Reserves the hotplug
+ * window at the first 1 GiB boundary above @ram_end and returns the end of
+ * the window, or @ram_end when memory hotplug is not configured.
+ */
+hwaddr mem_hotplug_init(MemoryRegion *system_memory, hwaddr ram_end);
+
+int mem_hotplug_nr_slots(void);
+const MemHotplugSlot *mem_hotplug_get_slot(int slot);
+
+/* The notifier data is a pointer to the int index of the new slot.  */
+void mem_hotplug_add_notifier(Notifier *notifier);
+
+#endif
@@ -38,6 +38,7 @@
 #include "mc146818rtc.h"
 #include "i8254.h"
 #include "pcspk.h"
+#include "boards.h"
 #include "msi.h"
 #include "sysbus.h"
 #include "sysemu.h"
@@ -581,15 +582,16 @@ static void *bochs_bios_init(void)
     register_ioport_write(0x501, 1, 2, bochs_bios_write, NULL);
     register_ioport_write(0x502, 1, 2, bochs_bios_write, NULL);
 
-    fw_cfg = fw_cfg_init(BIOS_CFG_IOPORT, BIOS_CFG_IOPORT + 1, 0, 0);
+    fw_cfg = fw_cfg_init_dma(BIOS_CFG_IOPORT, BIOS_CFG_IOPORT + 1,
+                             BIOS_CFG_IOPORT + 4, 0, 0);
 
-    fw_cfg_add_i32(fw_cfg, FW_CFG_ID, 1);
     fw_cfg_add_i64(fw_cfg, FW_CFG_RAM_SIZE, (uint64_t)ram_size);
     fw_cfg_add_bytes(fw_cfg, FW_CFG_ACPI_TABLES, (uint8_t *)acpi_tables,
                      acpi_tables_len);
     fw_cfg_add_i32(fw_cfg, FW_CFG_IRQ0_OVERRIDE, kvm_allows_irq0_override());
 
-    smbios_table = smbios_get_table(&smbios_len);
+    /* the firmware falls back to its own defaults */
+    smbios_table = fast_boot ? NULL : smbios_get_table(&smbios_len);
     if (smbios_table)
         fw_cfg_add_bytes(fw_cfg, FW_CFG_SMBIOS_ENTRIES,
                          smbios_table, smbios_len);
@@ -856,6 +858,44 @@ void pc_acpi_smi_interrupt(void *opaque, int irq, int level)
     }
 }
 
+static const char *pc_cpu_model;
+
+void pc_hot_add_cpu(const int64_t id, Error **errp)
+{
+    CPUArchState *env;
+    X86CPU *cpu;
+    int64_t nr_cpus = 0;
+
+    for (env = first_cpu; env; env = env->next_cpu) {
+        nr_cpus++;
+    }
+
+    if (id < 0 || id >= max_cpus) {
+        error_setg(errp, "Invalid CPU id %" PRIi64 ", it must be below the "
+                   "maximum of %d CPUs", id, max_cpus);
+        return;
+    }
+    /* The APIC id, like the KVM vCPU id, is the cpu_index of the CPU, which
+     * is assigned in creation order.
+     */
+    if (id != nr_cpus) {
+        error_setg(errp, "Invalid CPU id %" PRIi64 ", CPUs are added in "
+                   "order and the next one is %" PRIi64, id, nr_cpus);
+        return;
+    }
+
+    cpu = cpu_x86_init(pc_cpu_model);
+    if (!cpu) {
+        error_setg(errp, "Unable to create x86 CPU '%s'", pc_cpu_model);
+        return;
+    }
+    cpu_synchronize_post_init(&cpu->env);
+    if (runstate_is_running()) {
+        cpu_resume(CPU(cpu));
+    }
+    qemu_cpu_added(id);
+}
+
 void pc_cpus_init(const char *cpu_model)
 {
     int i;
@@ -868,6 +908,7 @@ void pc_cpus_init(const char *cpu_model)
         cpu_model = "qemu32";
 #endif
     }
+    pc_cpu_model = cpu_model;
 
     for (i = 0; i < smp_cpus; i++) {
         if (!cpu_x86_init(cpu_model)) {
@@ -898,9 +939,8 @@ void *pc_memory_init(MemoryRegion *system_memory,
      * with older qemus that used qemu_ram_alloc().
      */
     ram = g_malloc(sizeof(*ram));
-    memory_region_init_ram(ram, "pc.ram",
-                           below_4g_mem_size + above_4g_mem_size);
-    vmstate_register_ram_global(ram);
+    memory_region_allocate_system_memory(ram, "pc.ram",
+                                         below_4g_mem_size + above_4g_mem_size);
     *ram_memory = ram;
     ram_below_4g = g_malloc(sizeof(*ram_below_4g));
     memory_region_init_alias(ram_below_4g, "ram-below-4g", ram,
@@ -1018,7 +1058,9 @@ void pc_basic_device_init(ISABus *isa_bus, qemu_irq *gsi,
             /* connect PIT to output control line of the HPET */
             qdev_connect_gpio_out(hpet, 0, qdev_get_gpio_in(&pit->qdev, 0));
         }
-        pcspk_init(isa_bus, pit);
+        if (!fast_boot) {
+            pcspk_init(isa_bus, pit);
+        }
     }
 
     for(i = 0; i < MAX_SERIAL_PORTS; i++) {
@@ -1036,7 +1078,7 @@ void pc_basic_device_init(ISABus *isa_bus, qemu_irq *gsi,
     a20_line = qemu_allocate_irqs(handle_a20_line_change, first_cpu, 2);
     i8042 = isa_create_simple(isa_bus, "i8042");
     i8042_setup_a20_line(i8042, &a20_line[0]);
-    if (!no_vmport) {
+    if (!no_vmport && !fast_boot) {
         vmport_init(isa_bus);
         vmmouse = isa_try_create(isa_bus, "vmmouse");
     } else {
@@ -1055,7 +1097,11 @@ void pc_basic_device_init(ISABus *isa_bus, qemu_irq *gsi,
     for(i = 0; i < MAX_FD; i++) {
         fd[i] = drive_get(IF_FLOPPY, 0, i);
     }
-    *floppy = fdctrl_init_isa(isa_bus, fd);
+    if (fast_boot && !fd[0] && !fd[1]) {
+        *floppy = NULL;
+    } else {
+        *floppy = fdctrl_init_isa(isa_bus, fd);
+    }
 }
 
 void pc_nic_init(ISABus *isa_bus, PCIBus *pci_bus)
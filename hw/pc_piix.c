@@ -44,6 +44,8 @@
 #include "memory.h"
 #include "exec-memory.h"
 #include "cpu.h"
+#include "fw_cfg.h"
+#include "mem_hotplug.h"
 #ifdef CONFIG_XEN
 #  include <xen/hvm/hvm_info_table.h>
 #endif
@@ -85,6 +87,7 @@ static void pc_init1(MemoryRegion *system_memory,
     MemoryRegion *pci_memory;
     MemoryRegion *rom_memory;
     void *fw_cfg = NULL;
+    hwaddr ram_end;
 
     pc_cpus_init(cpu_model);
 
@@ -117,6 +120,23 @@ static void pc_init1(MemoryRegion *system_memory,
                        rom_memory, &ram_memory);
     }
 
+    /* The 64-bit PCI hole starts after the memory hotplug window, which
+     * firmware learns from etc/reserved-memory-end.
+     */
+    ram_end = 0x100000000ULL + above_4g_mem_size;
+    if (fw_cfg) {
+        hwaddr hotplug_end = mem_hotplug_init(system_memory, ram_end);
+
+        if (hotplug_end != ram_end) {
+            uint64_t *val = g_malloc(sizeof(*val));
+
+            *val = cpu_to_le64(hotplug_end);
+            fw_cfg_add_file(fw_cfg, "etc/reserved-memory-end",
+                            (uint8_t *)val, sizeof(*val));
+            ram_end = hotplug_end;
+        }
+    }
+
     gsi_state = g_malloc0(sizeof(*gsi_state));
     if (kvm_irqchip_in_kernel()) {
         kvm_pc_setup_irq_routing(pci_enabled);
@@ -131,7 +151,7 @@ static void pc_init1(MemoryRegion *system_memory,
                               system_memory, system_io, ram_size,
                               below_4g_mem_size,
                               0x100000000ULL - below_4g_mem_size,
-                              0x100000000ULL + above_4g_mem_size,
+                              ram_end,
                               (sizeof(hwaddr) == 4
                                ? 0
                                : ((uint64_t)1 << 62)),
@@ -286,6 +306,7 @@ static QEMUMachine pc_machine_v1_3 = {
     .alias = "pc",
     .desc = "Standard PC",
     .init = pc_init_pci_1_3,
+    .hot_add_cpu = pc_hot_add_cpu,
     .max_cpus = 255,
     .is_default = 1,
 };
@@ -315,6 +336,10 @@ static QEMUMachine pc_machine_v1_3 = {
             .driver   = "VGA",\
             .property = "mmio",\
             .value    = "off",\
+        },{\
+            .driver   = "fw_cfg",\
+            .property = "dma_enabled",\
+            .value    = "off",\
         }
 
 static QEMUMachine pc_machine_v1_2 = {
@@ -583,37 +583,81 @@ PropertyInfo qdev_prop_chr = {
 
 /* --- netdev device --- */
 
-static int parse_netdev(DeviceState *dev, const char *str, void **ptr)
-{
-    NetClientState *netdev = qemu_find_netdev(str);
-
-    if (netdev == NULL) {
-        return -ENOENT;
-    }
-    if (netdev->peer) {
-        return -EEXIST;
-    }
-    *ptr = netdev;
-    return 0;
-}
-
-static const char *print_netdev(void *ptr)
-{
-    NetClientState *netdev = ptr;
-
-    return netdev->name ? netdev->name : "";
-}
-
 static void get_netdev(Object *obj, Visitor *v, void *opaque,
                        const char *name, Error **errp)
 {
-    get_pointer(obj, v, opaque, print_netdev, name, errp);
+    DeviceState *dev = DEVICE(obj);
+    Property *prop = opaque;
+    NICPeers *peers_ptr = qdev_get_prop_ptr(dev, prop);
+    char *p = g_strdup(peers_ptr->ncs[0] ? peers_ptr->ncs[0]->name : "");
+
+    visit_type_str(v, &p, name, errp);
+    g_free(p);
 }
 
 static void set_netdev(Object *obj, Visitor *v, void *opaque,
                        const char *name, Error **errp)
 {
-    set_pointer(obj, v, opaque, parse_netdev, name, errp);
+    DeviceState *dev = DEVICE(obj);
+    Property *prop = opaque;
+    NICPeers *peers_ptr = qdev_get_prop_ptr(dev, prop);
+    NetClientState **ncs = peers_ptr->ncs;
+    NetClientState *peers[MAX_QUEUE_NUM];
+    Error *local_err = NULL;
+    int queues, i, err = 0;
+    char *str;
+
+    if (dev->state != DEV_STATE_CREATED) {
+        error_set(errp, QERR_PERMISSION_DENIED);
+        return;
+    }
+
+    visit_type_str(v, &str, name, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+    if (!*str) {
+        g_free(str);
+        ncs[0] = NULL;
+        peers_ptr->queues = 0;
+        return;
+    }
+
+    /* A multiqueue backend registers one net client per queue, all of
+     * them with the same name.
+     */
+    queues = qemu_find_net_clients_except(str, peers,
+                                          NET_CLIENT_OPTIONS_KIND_NIC,
+                                          MAX_QUEUE_NUM);
+    if (queues == 0) {
+        err = -ENOENT;
+        goto out;
+    }
+
+    if (queues > MAX_QUEUE_NUM) {
+        error_setg(errp, "queues of backend '%s'(%d) exceeds QEMU "
+                   "limitation(%d)", str, queues, MAX_QUEUE_NUM);
+        goto out;
+    }
+
+    for (i = 0; i < queues; i++) {
+        if (peers[i]->peer) {
+            err = -EEXIST;
+            goto out;
+        }
+    }
+
+    for (i = 0; i < queues; i++) {
+        ncs[i] = peers[i];
+        ncs[i]->queue_index = i;
+    }
+
+    peers_ptr->queues = queues;
+
+out:
+    error_set_from_qdev_prop_error(errp, err, dev, prop, str);
+    g_free(str);
 }
 
 PropertyInfo qdev_prop_netdev = {
@@ -626,11 +670,11 @@ PropertyInfo qdev_prop_netdev = {
 
 static int print_vlan(DeviceState *dev, Property *prop, char *dest, size_t len)
 {
-    NetClientState **ptr = qdev_get_prop_ptr(dev, prop);
+    NICPeers *peers_ptr = qdev_get_prop_ptr(dev, prop);
 
-    if (*ptr) {
+    if (peers_ptr->ncs[0]) {
         int id;
-        if (!net_hub_id_for_client(*ptr, &id)) {
+        if (!net_hub_id_for_client(peers_ptr->ncs[0], &id)) {
             return snprintf(dest, len, "%d", id);
         }
     }
@@ -643,12 +687,12 @@ static void get_vlan(Object *obj, Visitor *v, void *opaque,
 {
     DeviceState *dev = DEVICE(obj);
     Property *prop = opaque;
-    NetClientState **ptr = qdev_get_prop_ptr(dev, prop);
+    NICPeers *peers_ptr = qdev_get_prop_ptr(dev, prop);
     int32_t id = -1;
 
-    if (*ptr) {
+    if (peers_ptr->ncs[0]) {
         int hub_id;
-        if (!net_hub_id_for_client(*ptr, &hub_id)) {
+        if (!net_hub_id_for_client(peers_ptr->ncs[0], &hub_id)) {
             id = hub_id;
         }
     }
@@ -661,7 +705,7 @@ static void set_vlan(Object *obj, Visitor *v, void *opaque,
 {
     DeviceState *dev = DEVICE(obj);
     Property *prop = opaque;
-    NetClientState **ptr = qdev_get_prop_ptr(dev, prop);
+    NICPeers *peers_ptr = qdev_get_prop_ptr(dev, prop);
     Error *local_err = NULL;
     int32_t id;
     NetClientState *hubport;
@@ -677,7 +721,8 @@ static void set_vlan(Object *obj, Visitor *v, void *opaque,
         return;
     }
     if (id == -1) {
-        *ptr = NULL;
+        peers_ptr->ncs[0] = NULL;
+        peers_ptr->queues = 0;
         return;
     }
 
@@ -687,7 +732,8 @@ static void set_vlan(Object *obj, Visitor *v, void *opaque,
                   name, prop->info->name);
         return;
     }
-    *ptr = hubport;
+    peers_ptr->ncs[0] = hubport;
+    peers_ptr->queues = 1;
 }
 
 PropertyInfo qdev_prop_vlan = {
@@ -21,13 +21,24 @@
 
 #include "qxl.h"
 
+/*
+ * Flip rect of a bottom-up guest primary into guest_primary.flipped, which
+ * the DisplaySurface wraps.  Top-down primaries are shared with the
+ * DisplaySurface directly and need no copy at all.
+ */
 static void qxl_blit(PCIQXLDevice *qxl, QXLRect *rect)
 {
     uint8_t *src;
-    uint8_t *dst = ds_get_data(qxl->vga.ds);
+    uint8_t *dst = qxl->guest_primary.flipped;
     int len, i;
 
-    if (is_buffer_shared(qxl->vga.ds->surface)) {
+    if (!qxl->guest_primary.flip_active) {
+        return;
+    }
+    if (rect->left < 0 || rect->top < 0 ||
+        rect->left >= rect->right || rect->top >= rect->bottom ||
+        rect->right > qxl->guest_primary.flip_width ||
+        rect->bottom > qxl->guest_primary.flip_height) {
         return;
     }
     if (!qxl->guest_primary.data) {
@@ -37,14 +48,10 @@ static void qxl_blit(PCIQXLDevice *qxl, QXLRect *rect)
     trace_qxl_render_blit(qxl->guest_primary.qxl_stride,
             rect->left, rect->right, rect->top, rect->bottom);
     src = qxl->guest_primary.data;
-    if (qxl->guest_primary.qxl_stride < 0) {
-        /* qxl surface is upside down, walk src scanlines
-         * in reverse order to flip it */
-        src += (qxl->guest_primary.surface.height - rect->top - 1) *
-            qxl->guest_primary.abs_stride;
-    } else {
-        src += rect->top * qxl->guest_primary.abs_stride;
-    }
+    /* qxl surface is upside down, walk src scanlines
+     * in reverse order to flip it */
+    src += (qxl->guest_primary.flip_height - rect->top - 1) *
+        qxl->guest_primary.abs_stride;
     dst += rect->top  * qxl->guest_primary.abs_stride;
     src += rect->left * qxl->guest_primary.bytes_pp;
     dst += rect->left * qxl->guest_primary.bytes_pp;
@@ -111,25 +118,41 @@ static void qxl_render_update_area_unlocked(PCIQXLDevice *qxl)
                qxl->guest_primary.qxl_stride,
                qxl->guest_primary.bytes_pp,
                qxl->guest_primary.bits_pp);
+        qemu_free_displaysurface(vga->ds);
+        g_free(qxl->guest_primary.flipped);
+        qxl->guest_primary.flipped = NULL;
+        qxl->guest_primary.flip_active = false;
         if (qxl->guest_primary.qxl_stride > 0) {
-            qemu_free_displaysurface(vga->ds);
-            qemu_create_displaysurface_from(qxl->guest_primary.surface.width,
-                                            qxl->guest_primary.surface.height,
-                                            qxl->guest_primary.bits_pp,
-                                            qxl->guest_primary.abs_stride,
-                                            qxl->guest_primary.data);
+            vga->ds->surface = qemu_create_displaysurface_from(
+                    qxl->guest_primary.surface.width,
+                    qxl->guest_primary.surface.height,
+                    qxl->guest_primary.bits_pp,
+                    qxl->guest_primary.abs_stride,
+                    qxl->guest_primary.data);
         } else {
-            qemu_resize_displaysurface(vga->ds,
+            qxl->guest_primary.flipped =
+                g_malloc(qxl->guest_primary.abs_stride *
+                         qxl->guest_primary.surface.height);
+            qxl->guest_primary.flip_width = qxl->guest_primary.surface.width;
+            qxl->guest_primary.flip_height = qxl->guest_primary.surface.height;
+            qxl->guest_primary.flip_active = true;
+            vga->ds->surface = qemu_create_displaysurface_from(
                     qxl->guest_primary.surface.width,
-                    qxl->guest_primary.surface.height);
+                    qxl->guest_primary.surface.height,
+                    qxl->guest_primary.bits_pp,
+                    qxl->guest_primary.abs_stride,
+                    qxl->guest_primary.flipped);
+            qxl_blit(qxl, &qxl->dirty[0]);
         }
         dpy_gfx_resize(vga->ds);
     }
+    /* Apart from the full flip above, dirty rects were already copied by
+     * qxl_render_blit_unlocked in the spice server thread; all that is left
+     * to do here is telling the display listeners. */
     for (i = 0; i < qxl->num_dirty_rects; i++) {
         if (qemu_spice_rect_is_empty(qxl->dirty+i)) {
             break;
         }
-        qxl_blit(qxl, qxl->dirty+i);
         dpy_gfx_update(vga->ds,
                        qxl->dirty[i].left, qxl->dirty[i].top,
                        qxl->dirty[i].right - qxl->dirty[i].left,
@@ -175,6 +198,23 @@ void qxl_render_update_area_bh(void *opaque)
     qemu_mutex_unlock(&qxl->ssd.lock);
 }
 
+/*
+ * Called with ssd.lock held, from the spice server thread as soon as it has
+ * rendered rects, so that the copy into the DisplaySurface does not run
+ * under the global mutex.
+ */
+void qxl_render_blit_unlocked(PCIQXLDevice *qxl, QXLRect *rects, int n)
+{
+    int i;
+
+    if (qxl->guest_primary.resized) {
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        qxl_blit(qxl, rects + i);
+    }
+}
+
 void qxl_render_update_area_done(PCIQXLDevice *qxl, QXLCookie *cookie)
 {
     qemu_mutex_lock(&qxl->ssd.lock);
@@ -912,6 +912,7 @@ static void interface_update_area_complete(QXLInstance *sin,
         qemu_mutex_unlock(&qxl->ssd.lock);
         return;
     }
+    qxl_render_blit_unlocked(qxl, dirty, num_updated_rects);
     qxl_i = qxl->num_dirty_rects;
     for (i = 0; i < num_updated_rects; i++) {
         qxl->dirty[qxl_i++] = dirty[i];
@@ -1067,6 +1068,9 @@ static void qxl_enter_vga_mode(PCIQXLDevice *d)
         return;
     }
     trace_qxl_enter_vga_mode(d->id);
+    qemu_mutex_lock(&d->ssd.lock);
+    d->guest_primary.flip_active = false;
+    qemu_mutex_unlock(&d->ssd.lock);
     qemu_spice_create_host_primary(&d->ssd);
     d->mode = QXL_MODE_VGA;
     dpy_gfx_resize(d->ssd.ds);
@@ -1396,6 +1400,9 @@ static int qxl_destroy_primary(PCIQXLDevice *d, qxl_async_io async)
         return 0;
     }
     trace_qxl_destroy_primary(d->id);
+    qemu_mutex_lock(&d->ssd.lock);
+    d->guest_primary.flip_active = false;
+    qemu_mutex_unlock(&d->ssd.lock);
     d->mode = QXL_MODE_UNDEFINED;
     qemu_spice_destroy_primary_surface(&d->ssd, 0, async);
     qxl_spice_reset_cursor(d);
@@ -61,6 +61,12 @@ typedef struct PCIQXLDevice {
         uint32_t       bits_pp;
         uint32_t       bytes_pp;
         uint8_t        *data;
+        /* upright copy of a bottom-up primary, written by the spice
+         * server thread under ssd.lock while flip_active is set */
+        uint8_t        *flipped;
+        bool           flip_active;
+        uint32_t       flip_width;
+        uint32_t       flip_height;
     } guest_primary;
 
     struct surfaces {
@@ -158,3 +164,4 @@ void qxl_render_update(PCIQXLDevice *qxl);
 int qxl_render_cursor(PCIQXLDevice *qxl, QXLCommandExt *ext);
 void qxl_render_update_area_done(PCIQXLDevice *qxl, QXLCookie *cookie);
 void qxl_render_update_area_bh(void *opaque);
+void qxl_render_blit_unlocked(PCIQXLDevice *qxl, QXLRect *rects, int n);
@@ -47,9 +47,16 @@ static int scsi_device_init(SCSIDevice *s)
 static void scsi_device_destroy(SCSIDevice *s)
 {
     SCSIDeviceClass *sc = SCSI_DEVICE_GET_CLASS(s);
+    SCSIRequest *req;
+
     if (sc->destroy) {
         sc->destroy(s);
     }
+    while ((req = QSLIST_FIRST(&s->free_reqs))) {
+        QSLIST_REMOVE_HEAD(&s->free_reqs, free_next);
+        g_free(req);
+    }
+    s->nr_free_reqs = 0;
 }
 
 static SCSIRequest *scsi_device_alloc_req(SCSIDevice *s, uint32_t tag, uint32_t lun,
@@ -501,7 +508,14 @@ SCSIRequest *scsi_req_alloc(const SCSIReqOps *reqops, SCSIDevice *d,
 {
     SCSIRequest *req;
 
-    req = g_malloc0(reqops->size);
+    req = QSLIST_FIRST(&d->free_reqs);
+    if (req && reqops->size == d->free_req_size) {
+        QSLIST_REMOVE_HEAD(&d->free_reqs, free_next);
+        d->nr_free_reqs--;
+        memset(req, 0, reqops->size);
+    } else {
+        req = g_malloc0(reqops->size);
+    }
     req->refcount = 1;
     req->bus = scsi_bus_from_device(d);
     req->dev = d;
@@ -556,6 +570,9 @@ SCSIRequest *scsi_req_new(SCSIDevice *d, uint32_t tag, uint32_t lun,
                                  hba_private);
         } else {
             req = scsi_device_alloc_req(d, tag, lun, buf, hba_private);
+            if (!d->free_req_size) {
+                d->free_req_size = req->ops->size;
+            }
         }
     }
 
@@ -1489,6 +1506,22 @@ SCSIRequest *scsi_req_ref(SCSIRequest *req)
     return req;
 }
 
+/* Requests of the size the device itself allocates are recycled, the other
+ * sizes are rare (sense, REPORT LUNS, errors).
+ */
+static void scsi_req_recycle(SCSIRequest *req)
+{
+    SCSIDevice *d = req->dev;
+
+    if (req->ops->size == d->free_req_size &&
+        d->nr_free_reqs < SCSI_REQ_POOL_MAX) {
+        QSLIST_INSERT_HEAD(&d->free_reqs, req, free_next);
+        d->nr_free_reqs++;
+    } else {
+        g_free(req);
+    }
+}
+
 void scsi_req_unref(SCSIRequest *req)
 {
     assert(req->refcount > 0);
@@ -1500,7 +1533,7 @@ void scsi_req_unref(SCSIRequest *req)
         if (req->ops->free_req) {
             req->ops->free_req(req);
         }
-        g_free(req);
+        scsi_req_recycle(req);
     }
 }
 
@@ -1491,13 +1491,28 @@ static void scsi_unmap_complete(void *opaque, int ret)
             scsi_check_condition(r, SENSE_CODE(LBA_OUT_OF_RANGE));
             goto done;
         }
+        data->count--;
+        data->inbuf += 16;
+
+        /* Send adjacent descriptors as a single discard */
+        while (data->count > 0 &&
+               ldq_be_p(&data->inbuf[0]) == sector_num + nb_sectors) {
+            uint32_t n = ldl_be_p(&data->inbuf[8]);
+
+            if ((uint64_t)nb_sectors + n >
+                (INT_MAX >> BDRV_SECTOR_BITS) / (s->qdev.blocksize / 512) ||
+                !check_lba_range(s, sector_num + nb_sectors, n)) {
+                break;
+            }
+            nb_sectors += n;
+            data->count--;
+            data->inbuf += 16;
+        }
 
         r->req.aiocb = bdrv_aio_discard(s->qdev.conf.bs,
                                         sector_num * (s->qdev.blocksize / 512),
                                         nb_sectors * (s->qdev.blocksize / 512),
                                         scsi_unmap_complete, data);
-        data->count--;
-        data->inbuf += 16;
         return;
     }
 
@@ -2080,6 +2095,14 @@ static int scsi_initfn(SCSIDevice *dev)
     }
     bdrv_set_buffer_alignment(s->qdev.conf.bs, s->qdev.blocksize);
 
+    /* Unmapping in smaller units than the host can discard frees nothing */
+    if (s->qdev.conf.discard_granularity &&
+        bdrv_get_discard_granularity(s->qdev.conf.bs) >
+        s->qdev.conf.discard_granularity) {
+        s->qdev.conf.discard_granularity =
+            bdrv_get_discard_granularity(s->qdev.conf.bs);
+    }
+
     bdrv_iostatus_enable(s->qdev.conf.bs);
     add_boot_device_path(s->qdev.conf.bootindex, &dev->qdev, NULL);
     return 0;
@@ -30,6 +30,7 @@ typedef struct SCSISense {
 } SCSISense;
 
 #define SCSI_SENSE_BUF_SIZE 96
+#define SCSI_REQ_POOL_MAX   128
 
 struct SCSICommand {
     uint8_t buf[SCSI_CMD_BUF_SIZE];
@@ -59,6 +60,7 @@ struct SCSIRequest {
     bool retry;
     void *hba_private;
     QTAILQ_ENTRY(SCSIRequest) next;
+    QSLIST_ENTRY(SCSIRequest) free_next;
 };
 
 #define TYPE_SCSI_DEVICE "scsi-device"
@@ -95,6 +97,11 @@ struct SCSIDevice
     int blocksize;
     int type;
     uint64_t max_lba;
+
+    /* Recycled requests, all free_req_size bytes */
+    QSLIST_HEAD(, SCSIRequest) free_reqs;
+    size_t free_req_size;
+    unsigned int nr_free_reqs;
 };
 
 extern const VMStateDescription vmstate_scsi_device;
@@ -330,6 +330,8 @@ int spapr_rtas_device_tree_setup(void *fdt, hwaddr rtas_addr,
 #define SPAPR_TCE_PAGE_SHIFT   12
 #define SPAPR_TCE_PAGE_SIZE    (1ULL << SPAPR_TCE_PAGE_SHIFT)
 #define SPAPR_TCE_PAGE_MASK    (SPAPR_TCE_PAGE_SIZE - 1)
+/* Most TCEs one H_PUT_TCE_INDIRECT or H_STUFF_TCE call may update */
+#define SPAPR_TCE_BATCH_MAX    512
 
 typedef struct sPAPRTCE {
     uint64_t tce;
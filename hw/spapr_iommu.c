@@ -232,12 +232,107 @@ static target_ulong h_put_tce(PowerPCCPU *cpu, sPAPREnvironment *spapr,
     return H_PARAMETER;
 }
 
+/* Validate the LIOBN and the range of @npages TCEs at @ioba shared by the
+ * batched hypercalls; returns NULL if the caller should fail with
+ * H_PARAMETER.
+ */
+static sPAPRTCETable *spapr_tce_check_range(target_ulong liobn,
+                                            target_ulong ioba,
+                                            target_ulong npages)
+{
+    sPAPRTCETable *tcet;
+
+    if (liobn & 0xFFFFFFFF00000000ULL) {
+        hcall_dprintf("out-of-bounds LIOBN " TARGET_FMT_lx "\n", liobn);
+        return NULL;
+    }
+    tcet = spapr_tce_find_by_liobn(liobn);
+    if (!tcet) {
+        return NULL;
+    }
+    if (npages > SPAPR_TCE_BATCH_MAX || ioba >= tcet->window_size
+        || npages > (tcet->window_size - ioba) >> SPAPR_TCE_PAGE_SHIFT) {
+        hcall_dprintf("out-of-bounds IOBA 0x" TARGET_FMT_lx
+                      " npages " TARGET_FMT_lu "\n", ioba, npages);
+        return NULL;
+    }
+    return tcet;
+}
+
+static target_ulong h_put_tce_indirect(PowerPCCPU *cpu,
+                                       sPAPREnvironment *spapr,
+                                       target_ulong opcode, target_ulong *args)
+{
+    target_ulong liobn = args[0];
+    target_ulong ioba = args[1] & ~(SPAPR_TCE_PAGE_SIZE - 1);
+    target_ulong tce_list = args[2];
+    target_ulong npages = args[3];
+    sPAPRTCETable *tcet = spapr_tce_check_range(liobn, ioba, npages);
+    sPAPRTCE *tcep;
+    target_ulong i;
+
+    /* the list is a single page of TCEs */
+    if (!tcet || (tce_list & (SPAPR_TCE_PAGE_SIZE - 1))) {
+        return H_PARAMETER;
+    }
+
+    tcep = tcet->table + (ioba >> SPAPR_TCE_PAGE_SHIFT);
+    for (i = 0; i < npages; i++) {
+        tcep[i].tce = ldq_phys(tce_list + i * sizeof(uint64_t));
+    }
+
+    return H_SUCCESS;
+}
+
+static target_ulong h_stuff_tce(PowerPCCPU *cpu, sPAPREnvironment *spapr,
+                                target_ulong opcode, target_ulong *args)
+{
+    target_ulong liobn = args[0];
+    target_ulong ioba = args[1] & ~(SPAPR_TCE_PAGE_SIZE - 1);
+    target_ulong tce = args[2];
+    target_ulong npages = args[3];
+    sPAPRTCETable *tcet = spapr_tce_check_range(liobn, ioba, npages);
+    sPAPRTCE *tcep;
+    target_ulong i;
+
+    if (!tcet) {
+        return H_PARAMETER;
+    }
+
+    tcep = tcet->table + (ioba >> SPAPR_TCE_PAGE_SHIFT);
+    for (i = 0; i < npages; i++) {
+        tcep[i].tce = tce;
+    }
+
+    return H_SUCCESS;
+}
+
+static target_ulong h_get_tce(PowerPCCPU *cpu, sPAPREnvironment *spapr,
+                              target_ulong opcode, target_ulong *args)
+{
+    target_ulong liobn = args[0];
+    target_ulong ioba = args[1] & ~(SPAPR_TCE_PAGE_SIZE - 1);
+    sPAPRTCETable *tcet = spapr_tce_check_range(liobn, ioba, 1);
+
+    if (!tcet) {
+        return H_PARAMETER;
+    }
+
+    args[0] = tcet->table[ioba >> SPAPR_TCE_PAGE_SHIFT].tce;
+    return H_SUCCESS;
+}
+
 void spapr_iommu_init(void)
 {
     QLIST_INIT(&spapr_tce_tables);
 
     /* hcall-tce */
     spapr_register_hypercall(H_PUT_TCE, h_put_tce);
+    spapr_register_hypercall(H_GET_TCE, h_get_tce);
+
+    /* hcall-multi-tce */
+    spapr_register_hypercall(H_PUT_TCE_INDIRECT, h_put_tce_indirect);
+    spapr_register_hypercall(H_STUFF_TCE, h_stuff_tce);
 }
 
 int spapr_dma_dt(void *fdt, int node_off, const char *propname,
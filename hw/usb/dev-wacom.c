@@ -137,6 +137,7 @@ static void usb_mouse_event(void *opaque,
     s->dz += dz1;
     s->buttons_state = buttons_state;
     s->changed = 1;
+    usb_wakeup(usb_ep_get(&s->dev, USB_TOKEN_IN, 1));
 }
 
 static void usb_wacom_event(void *opaque,
@@ -150,6 +151,7 @@ static void usb_wacom_event(void *opaque,
     s->dz += dz;
     s->buttons_state = buttons_state;
     s->changed = 1;
+    usb_wakeup(usb_ep_get(&s->dev, USB_TOKEN_IN, 1));
 }
 
 static inline int int_clamp(int val, int vmin, int vmax)
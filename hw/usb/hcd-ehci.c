@@ -114,6 +114,7 @@
 #define BUFF_SIZE        5*4096   // Max bytes to transfer per transaction
 #define MAX_QH           100      // Max allowable queue heads in a chain
 #define MIN_FR_PER_TICK  3        // Min frames to process when catching up
+#define MAX_IDLE_STEPDOWN 16      // Max frames between idle periodic polls
 
 /*  Internal periodic / asynchronous schedule state machine states
  */
@@ -1381,6 +1382,7 @@ static int ehci_process_itd(EHCIState *ehci,
 
             dev = ehci_find_device(ehci, devaddr);
             ep = usb_ep_get(dev, pid, endp);
+            ehci->periodic_iso = true;
             if (ep && ep->type == USB_ENDPOINT_XFER_ISOC) {
                 usb_packet_setup(&ehci->ipacket, pid, ep, addr, false,
                                  (itd->transact[i] & ITD_XACT_IOC) != 0);
@@ -2183,6 +2185,37 @@ static void ehci_update_frindex(EHCIState *ehci, int frames)
     }
 }
 
+/*
+ * The periodic schedule is idle when nothing but NAKs comes back from it,
+ * and only from endpoints whose device is known to call usb_wakeup() once
+ * it has data.  The frame timer can then back off, as nothing is lost by
+ * walking the schedule less often.  Endpoints are learnt the first time
+ * they wake us up; until then, and for devices that never do, the schedule
+ * is walked every frame.
+ */
+static bool ehci_periodic_idle(EHCIState *ehci)
+{
+    EHCIQueue *q;
+    EHCIPacket *p;
+
+    if (ehci->periodic_iso) {
+        return false;
+    }
+
+    QTAILQ_FOREACH(q, &ehci->pqueues, next) {
+        p = QTAILQ_FIRST(&q->packets);
+        if (!p) {
+            continue;
+        }
+        if (!q->wakeup || p->packet.status != USB_RET_NAK ||
+            p->async == EHCI_ASYNC_INFLIGHT ||
+            p->async == EHCI_ASYNC_FINISHED) {
+            return false;
+        }
+    }
+    return true;
+}
+
 static void ehci_frame_timer(void *opaque)
 {
     EHCIState *ehci = opaque;
@@ -2198,7 +2231,7 @@ static void ehci_frame_timer(void *opaque)
 
     if (ehci_periodic_enabled(ehci) || ehci->pstate != EST_INACTIVE) {
         need_timer++;
-        ehci->async_stepdown = 0;
+        ehci->periodic_iso = false;
 
         if (frames > ehci->maxframes) {
             skipped_frames = frames - ehci->maxframes;
@@ -2226,6 +2259,13 @@ static void ehci_frame_timer(void *opaque)
             ehci_advance_periodic_state(ehci);
             ehci->last_run_ns += FRAME_TIMER_NS;
         }
+
+        if (!ehci_periodic_idle(ehci)) {
+            ehci->async_stepdown = 0;
+        } else if (ehci->async_stepdown < MIN(MAX_IDLE_STEPDOWN,
+                                              ehci->maxframes / 2)) {
+            ehci->async_stepdown++;
+        }
     } else {
         if (ehci->async_stepdown < ehci->maxframes / 2) {
             ehci->async_stepdown++;
@@ -2299,8 +2339,26 @@ static USBPortOps ehci_port_ops = {
     .complete = ehci_async_complete_packet,
 };
 
+static void ehci_wakeup_endpoint(USBBus *bus, USBEndpoint *ep)
+{
+    EHCIState *s = container_of(bus, EHCIState, bus);
+    EHCIQueue *q;
+    EHCIPacket *p;
+
+    QTAILQ_FOREACH(q, &s->pqueues, next) {
+        p = QTAILQ_FIRST(&q->packets);
+        if (p && p->packet.ep == ep) {
+            q->wakeup = true;
+        }
+    }
+
+    s->async_stepdown = 0;
+    qemu_bh_schedule(s->async_bh);
+}
+
 static USBBusOps ehci_bus_ops = {
     .register_companion = ehci_register_companion,
+    .wakeup_endpoint = ehci_wakeup_endpoint,
 };
 
 static int usb_ehci_post_load(void *opaque, int version_id)
@@ -247,6 +247,7 @@ struct EHCIQueue {
     uint32_t qhaddr;       /* address QH read from                 */
     uint32_t qtdaddr;      /* address QTD read from                */
     USBDevice *dev;
+    bool wakeup;           /* device wakes us when a NAK'd packet can run */
     QTAILQ_HEAD(pkts_head, EHCIPacket) packets;
 };
 
@@ -312,6 +313,7 @@ struct EHCIState {
     uint64_t last_run_ns;
     uint32_t async_stepdown;
     bool int_req_by_async;
+    bool periodic_iso;       /* iTDs were processed in this timer run */
 };
 
 extern const VMStateDescription vmstate_ehci;
@@ -43,6 +43,7 @@
 #include <linux/version.h>
 #include "hw/usb.h"
 #include "hw/usb/desc.h"
+#include "iov.h"
 
 /* We redefine it to avoid version problems */
 struct usb_ctrltransfer {
@@ -76,6 +77,23 @@ typedef int USBScanFunc(void *opaque, int bus_num, int addr, const char *port,
 /* devio.c limits single requests to 16k */
 #define MAX_USBFS_BUFFER_SIZE 16384
 
+/* ... unless it has USBDEVFS_CAP_NO_PACKET_SIZE_LIM */
+#define MAX_USBFS_LARGE_BUFFER_SIZE (256 * 1024)
+
+/* Not in older kernel headers */
+#ifndef USBDEVFS_GET_CAPABILITIES
+#define USBDEVFS_GET_CAPABILITIES       _IOR('U', 26, __u32)
+#endif
+#ifndef USBDEVFS_CAP_BULK_CONTINUATION
+#define USBDEVFS_CAP_BULK_CONTINUATION  0x02
+#endif
+#ifndef USBDEVFS_CAP_NO_PACKET_SIZE_LIM
+#define USBDEVFS_CAP_NO_PACKET_SIZE_LIM 0x04
+#endif
+#ifndef USBDEVFS_URB_BULK_CONTINUATION
+#define USBDEVFS_URB_BULK_CONTINUATION  0x04
+#endif
+
 typedef struct AsyncURB AsyncURB;
 
 struct endp_data {
@@ -110,8 +128,10 @@ typedef struct USBHostDevice {
     int       closing;
     uint32_t  iso_urb_count;
     uint32_t  options;
+    uint32_t  caps;             /* USBDEVFS_CAP_* of the host kernel */
     Notifier  exit;
     QEMUBH    *bh;
+    QEMUBH    *fail_bh;
 
     struct endp_data ep_in[USB_MAX_ENDPOINTS];
     struct endp_data ep_out[USB_MAX_ENDPOINTS];
@@ -281,6 +301,8 @@ struct AsyncURB
     /* For regular async urbs */
     USBPacket     *packet;
     int more; /* large transfer, more urbs follow */
+    uint8_t *bounce; /* linear copy of the packet data, on the last urb */
+    int failed; /* USB_RET_* of a submit that failed, see usb_host_fail_async */
 
     /* For buffered iso handling */
     int iso_frame_idx; /* -1 means in flight */
@@ -297,6 +319,7 @@ static AsyncURB *async_alloc(USBHostDevice *s)
 static void async_free(AsyncURB *aurb)
 {
     QLIST_REMOVE(aurb, next);
+    g_free(aurb->bounce);
     g_free(aurb);
 }
 
@@ -365,9 +388,18 @@ static void async_complete(void *opaque)
 
         if (p) {
             switch (aurb->urb.status) {
+            case -ECONNRESET:
+                if (!(aurb->urb.flags & USBDEVFS_URB_BULK_CONTINUATION)) {
+                    p->status = USB_RET_IOERROR;
+                    break;
+                }
+                /* The kernel dropped the rest of a transfer that was short */
+                aurb->urb.actual_length = 0;
+                /* fall through */
+            case -EREMOTEIO: /* short, with USBDEVFS_URB_SHORT_NOT_OK */
             case 0:
                 p->actual_length += aurb->urb.actual_length;
-                if (!aurb->more) {
+                if (!aurb->more && p->status == USB_RET_ASYNC) {
                     /* Clear previous ASYNC status */
                     p->status = USB_RET_SUCCESS;
                 }
@@ -392,9 +424,19 @@ static void async_complete(void *opaque)
                                             p->status, aurb->urb.actual_length);
                 usb_generic_async_ctrl_complete(&s->dev, p);
             } else if (!aurb->more) {
+                if (aurb->bounce && p->pid == USB_TOKEN_IN) {
+                    QEMUIOVector *iov = p->combined ? &p->combined->iov
+                                                    : &p->iov;
+                    iov_from_buf(iov->iov, iov->niov, 0, aurb->bounce,
+                                 p->actual_length);
+                }
                 trace_usb_host_req_complete(s->bus_num, s->addr, p,
                                             p->status, aurb->urb.actual_length);
-                usb_packet_complete(&s->dev, p);
+                if (p->pid == USB_TOKEN_IN && p->ep->pipeline) {
+                    usb_combined_input_packet_complete(&s->dev, p);
+                } else {
+                    usb_packet_complete(&s->dev, p);
+                }
             }
         }
 
@@ -854,13 +896,51 @@ static void usb_host_handle_iso_data(USBHostDevice *s, USBPacket *p, int in)
     }
 }
 
+/*
+ * usb_ep_combine_input_packets() expects every packet it submits to go
+ * async, so a submit error on a pipelined endpoint is reported from a
+ * bottom half instead.
+ */
+static void usb_host_fail_async(USBHostDevice *s, USBPacket *p)
+{
+    AsyncURB *aurb = async_alloc(s);
+
+    aurb->packet = p;
+    aurb->failed = (p->status == USB_RET_NAK) ? USB_RET_IOERROR : p->status;
+    p->status = USB_RET_ASYNC;
+    qemu_bh_schedule(s->fail_bh);
+}
+
+static void usb_host_fail_bh(void *opaque)
+{
+    USBHostDevice *s = opaque;
+    AsyncURB *aurb, *next;
+    USBPacket *p;
+
+    QLIST_FOREACH_SAFE(aurb, &s->aurbs, next, next) {
+        if (!aurb->failed) {
+            continue;
+        }
+        p = aurb->packet;
+        if (p) {
+            p->status = aurb->failed;
+        }
+        async_free(aurb);
+        if (p) {
+            usb_combined_input_packet_complete(&s->dev, p);
+        }
+    }
+}
+
 static void usb_host_handle_data(USBDevice *dev, USBPacket *p)
 {
     USBHostDevice *s = DO_UPCAST(USBHostDevice, dev, dev);
     struct usbdevfs_urb *urb;
-    AsyncURB *aurb;
-    int ret, rem, prem, v;
-    uint8_t *pbuf;
+    AsyncURB *aurb, *prev = NULL;
+    QEMUIOVector *iov;
+    int ret, rem, prem, v, type, max;
+    uint8_t *pbuf, *bounce = NULL;
+    bool first = true;
     uint8_t ep;
 
     trace_usb_host_req_data(s->bus_num, s->addr, p,
@@ -898,38 +978,89 @@ static void usb_host_handle_data(USBDevice *dev, USBPacket *p)
         return;
     }
 
+    /* Bulk input is queued and combined, see usb_host_flush_ep_queue() */
+    if (p->state == USB_PACKET_SETUP && p->pid == USB_TOKEN_IN &&
+        p->ep->pipeline) {
+        p->status = USB_RET_ADD_TO_QUEUE;
+        return;
+    }
+
+    iov = p->combined ? &p->combined->iov : &p->iov;
+    type = usb_host_usbfs_type(s, p);
+    max = MAX_USBFS_BUFFER_SIZE;
+    if (type == USBDEVFS_URB_TYPE_BULK &&
+        (s->caps & USBDEVFS_CAP_NO_PACKET_SIZE_LIM)) {
+        max = MAX_USBFS_LARGE_BUFFER_SIZE;
+    }
+
+    /*
+     * usbfs wants one linear buffer per urb, so a transfer scattered over
+     * guest pages would otherwise turn into one urb per page.  When the
+     * kernel takes large urbs, copy through a linear bounce buffer and let
+     * the host controller driver do the scatter-gather instead.
+     */
+    if (max > MAX_USBFS_BUFFER_SIZE && iov->niov > 1) {
+        bounce = g_malloc(iov->size);
+        if (p->pid == USB_TOKEN_OUT) {
+            iov_to_buf(iov->iov, iov->niov, 0, bounce, iov->size);
+        }
+    }
+
     v = 0;
     prem = 0;
     pbuf = NULL;
-    rem = p->iov.size;
+    rem = iov->size;
     do {
         if (prem == 0 && rem > 0) {
-            assert(v < p->iov.niov);
-            prem = p->iov.iov[v].iov_len;
-            pbuf = p->iov.iov[v].iov_base;
+            if (bounce) {
+                prem = rem;
+                pbuf = bounce;
+            } else {
+                assert(v < iov->niov);
+                prem = iov->iov[v].iov_len;
+                pbuf = iov->iov[v].iov_base;
+                v++;
+            }
             assert(prem <= rem);
-            v++;
         }
         aurb = async_alloc(s);
         aurb->packet = p;
 
         urb = &aurb->urb;
         urb->endpoint      = ep;
-        urb->type          = usb_host_usbfs_type(s, p);
+        urb->type          = type;
         urb->usercontext   = s;
         urb->buffer        = pbuf;
         urb->buffer_length = prem;
 
-        if (urb->buffer_length > MAX_USBFS_BUFFER_SIZE) {
-            urb->buffer_length = MAX_USBFS_BUFFER_SIZE;
+        if (urb->buffer_length > max) {
+            urb->buffer_length = max;
         }
         pbuf += urb->buffer_length;
         prem -= urb->buffer_length;
         rem  -= urb->buffer_length;
         if (rem) {
             aurb->more         = 1;
+        } else {
+            aurb->bounce       = bounce;
         }
 
+        /*
+         * A short urb ends a split input transfer; have the kernel drop
+         * the urbs that follow it instead of letting them eat into the
+         * next transfer.
+         */
+        if (type == USBDEVFS_URB_TYPE_BULK && p->pid == USB_TOKEN_IN &&
+            (s->caps & USBDEVFS_CAP_BULK_CONTINUATION)) {
+            if (aurb->more) {
+                urb->flags |= USBDEVFS_URB_SHORT_NOT_OK;
+            }
+            if (!first) {
+                urb->flags |= USBDEVFS_URB_BULK_CONTINUATION;
+            }
+        }
+        first = false;
+
         trace_usb_host_urb_submit(s->bus_num, s->addr, aurb,
                                   urb->buffer_length, aurb->more);
         ret = ioctl(s->fd, USBDEVFS_SUBMITURB, urb);
@@ -939,7 +1070,15 @@ static void usb_host_handle_data(USBDevice *dev, USBPacket *p)
 
         if (ret < 0) {
             perror("USBDEVFS_SUBMITURB");
+            aurb->bounce = NULL;
             async_free(aurb);
+            if (prev) {
+                /* Urbs already in flight still point to the buffer */
+                prev->bounce = bounce;
+                usb_host_async_cancel(dev, p);
+            } else {
+                g_free(bounce);
+            }
 
             switch(errno) {
             case ETIMEDOUT:
@@ -953,13 +1092,24 @@ static void usb_host_handle_data(USBDevice *dev, USBPacket *p)
                 trace_usb_host_req_complete(s->bus_num, s->addr, p,
                                             p->status, p->actual_length);
             }
+            if (p->pid == USB_TOKEN_IN && p->ep->pipeline) {
+                usb_host_fail_async(s, p);
+            }
             return;
         }
+        prev = aurb;
     } while (rem > 0);
 
     p->status = USB_RET_ASYNC;
 }
 
+static void usb_host_flush_ep_queue(USBDevice *dev, USBEndpoint *ep)
+{
+    if (ep->pid == USB_TOKEN_IN && ep->pipeline) {
+        usb_ep_combine_input_packets(ep);
+    }
+}
+
 static int ctrl_error(void)
 {
     if (errno == ETIMEDOUT) {
@@ -1240,8 +1390,7 @@ static void usb_linux_update_endp_table(USBHostDevice *s)
                 usb_ep_set_type(&s->dev, pid, ep, type);
                 usb_ep_set_ifnum(&s->dev, pid, ep, interface);
                 if ((s->options & (1 << USB_HOST_OPT_PIPELINE)) &&
-                    (type == USB_ENDPOINT_XFER_BULK) &&
-                    (pid == USB_TOKEN_OUT)) {
+                    (type == USB_ENDPOINT_XFER_BULK)) {
                     usb_ep_set_pipeline(&s->dev, pid, ep, true);
                 }
 
@@ -1317,6 +1466,10 @@ static int usb_host_open(USBHostDevice *dev, int bus_num,
     strcpy(dev->port, port);
     dev->fd = fd;
 
+    if (ioctl(fd, USBDEVFS_GET_CAPABILITIES, &dev->caps) < 0) {
+        dev->caps = 0;
+    }
+
     /* read the device description */
     dev->descr_len = read(fd, dev->descr, sizeof(dev->descr));
     if (dev->descr_len <= 0) {
@@ -1484,6 +1637,7 @@ static int usb_host_initfn(USBDevice *dev)
     s->exit.notify = usb_host_exit_notifier;
     qemu_add_exit_notifier(&s->exit);
     s->bh = qemu_bh_new(usb_host_post_load_bh, s);
+    s->fail_bh = qemu_bh_new(usb_host_fail_bh, s);
     usb_host_auto_check(NULL);
 
     if (s->match.bus_num != 0 && s->match.port != NULL) {
@@ -1526,6 +1680,7 @@ static void usb_host_class_initfn(ObjectClass *klass, void *data)
     uc->product_desc   = "USB Host Device";
     uc->cancel_packet  = usb_host_async_cancel;
     uc->handle_data    = usb_host_handle_data;
+    uc->flush_ep_queue = usb_host_flush_ep_queue;
     uc->handle_control = usb_host_handle_control;
     uc->handle_reset   = usb_host_handle_reset;
     uc->handle_destroy = usb_host_handle_destroy;
@@ -1646,6 +1646,7 @@ static void usbredir_interrupt_packet(void *priv, uint64_t id,
 
         /* bufp_alloc also adds the packet to the ep queue */
         bufp_alloc(dev, data, data_len, interrupt_packet->status, ep);
+        usb_wakeup(usb_ep_get(&dev->dev, USB_TOKEN_IN, ep & 0x0f));
     } else {
         /*
          * We report output interrupt packets as completed directly upon
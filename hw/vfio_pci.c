@@ -34,6 +34,7 @@
 #include "msi.h"
 #include "msix.h"
 #include "pci.h"
+#include "qapi/qapi-visit-core.h"
 #include "qemu-common.h"
 #include "qemu-error.h"
 #include "qemu-queue.h"
@@ -77,6 +78,7 @@ typedef struct VFIOMSIVector {
     struct VFIODevice *vdev; /* back pointer to device */
     int virq; /* KVM irqchip route for QEMU bypass */
     bool use;
+    bool masked; /* MSI-X masked, interrupts go to QEMU to set pending bit */
 } VFIOMSIVector;
 
 enum {
@@ -88,6 +90,15 @@ enum {
 
 struct VFIOGroup;
 
+/* A DMA map or unmap queued until the memory transaction commits */
+typedef struct VFIODMAOp {
+    hwaddr iova;
+    ram_addr_t size;
+    void *vaddr;
+    bool readonly;
+    bool map;
+} VFIODMAOp;
+
 typedef struct VFIOContainer {
     int fd; /* /dev/vfio/vfio, empowered by the attached groups */
     struct {
@@ -97,6 +108,9 @@ typedef struct VFIOContainer {
         };
         void (*release)(struct VFIOContainer *);
     } iommu_data;
+    VFIODMAOp *dma_ops;
+    int nr_dma_ops;
+    int max_dma_ops;
     QLIST_HEAD(, VFIOGroup) group_list;
     QLIST_ENTRY(VFIOContainer) next;
 } VFIOContainer;
@@ -110,6 +124,8 @@ typedef struct VFIOMSIXInfo {
     uint32_t pba_offset;
     MemoryRegion mmap_mem;
     void *mmap;
+    int8_t relo_bar; /* emulated BAR holding the table and PBA, or -1 */
+    uint32_t relo_pba_offset;
 } VFIOMSIXInfo;
 
 typedef struct VFIODevice {
@@ -125,11 +141,19 @@ typedef struct VFIODevice {
     VFIOMSIXInfo *msix;
     int nr_vectors; /* Number of MSI/MSIX vectors currently in use */
     int interrupt; /* Current interrupt type */
+    int32_t msix_relo; /* BAR to move the MSI-X table to, -1 to keep it */
     VFIOBAR bars[PCI_NUM_REGIONS - 1]; /* No ROM */
     PCIHostDeviceAddress host;
     QLIST_ENTRY(VFIODevice) next;
     struct VFIOGroup *group;
     bool reset_works;
+    /* Interrupts that took the slow path through QEMU */
+    struct {
+        uint64_t intx;          /* INTx injected by QEMU */
+        uint64_t intx_eoi;      /* INTx EOI detected by trapping BARs */
+        uint64_t msi;           /* MSI/MSI-X injected by QEMU */
+        uint64_t msi_no_route;  /* vectors set up without a KVM route */
+    } slow;
 } VFIODevice;
 
 typedef struct VFIOGroup {
@@ -240,6 +264,7 @@ static void vfio_intx_interrupt(void *opaque)
             vdev->host.bus, vdev->host.slot, vdev->host.function,
             'A' + vdev->intx.pin);
 
+    vdev->slow.intx++;
     vdev->intx.pending = true;
     qemu_set_irq(vdev->pdev.irq[vdev->intx.pin], 1);
     vfio_mmap_set_enabled(vdev, false);
@@ -258,6 +283,7 @@ static void vfio_eoi(VFIODevice *vdev)
     DPRINTF("%s(%04x:%02x:%02x.%x) EOI\n", __func__, vdev->host.domain,
             vdev->host.bus, vdev->host.slot, vdev->host.function);
 
+    vdev->slow.intx_eoi++;
     vdev->intx.pending = false;
     qemu_set_irq(vdev->pdev.irq[vdev->intx.pin], 0);
     vfio_unmask_intx(vdev);
@@ -325,6 +351,13 @@ static void vfio_enable_intx_kvm(VFIODevice *vdev)
 
     vdev->intx.kvm_accel = true;
 
+    /*
+     * KVM sees the EOI through the resample eventfd, so BAR accesses no
+     * longer need to be trapped to detect it.  Keep the mmaps enabled.
+     */
+    qemu_del_timer(vdev->intx.mmap_timer);
+    vfio_mmap_set_enabled(vdev, true);
+
     DPRINTF("%s(%04x:%02x:%02x.%x) KVM INTx accel enabled\n",
             __func__, vdev->host.domain, vdev->host.bus,
             vdev->host.slot, vdev->host.function);
@@ -520,6 +553,7 @@ static void vfio_msi_interrupt(void *opaque)
             vdev->host.domain, vdev->host.bus, vdev->host.slot,
             vdev->host.function, nr);
 
+    vdev->slow.msi++;
     if (vdev->interrupt == VFIO_INT_MSIX) {
         msix_notify(&vdev->pdev, nr);
     } else if (vdev->interrupt == VFIO_INT_MSI) {
@@ -573,8 +607,38 @@ static int vfio_msix_vector_use(PCIDevice *pdev,
             vdev->host.function, nr);
 
     vector = &vdev->msi_vectors[nr];
+
+    /*
+     * Unmasking a vector that was already set up: the eventfd is still
+     * the VFIO trigger, only move it from QEMU back to the KVM route.
+     */
+    if (vector->use) {
+        assert(vector->masked);
+        vector->masked = false;
+        if (vector->virq >= 0) {
+            if (kvm_irqchip_update_msi_route(kvm_state, vector->virq,
+                                             msg) == 0) {
+                qemu_set_fd_handler(event_notifier_get_fd(&vector->interrupt),
+                                    NULL, NULL, NULL);
+                if (kvm_irqchip_add_irqfd_notifier(kvm_state,
+                                                   &vector->interrupt,
+                                                   vector->virq) == 0) {
+                    return 0;
+                }
+            }
+            /* Stay in QEMU for good */
+            kvm_irqchip_release_virq(kvm_state, vector->virq);
+            vector->virq = -1;
+            vdev->slow.msi_no_route++;
+            qemu_set_fd_handler(event_notifier_get_fd(&vector->interrupt),
+                                vfio_msi_interrupt, NULL, vector);
+        }
+        return 0;
+    }
+
     vector->vdev = vdev;
     vector->use = true;
+    vector->masked = false;
 
     msix_vector_use(pdev, nr);
 
@@ -594,6 +658,7 @@ static int vfio_msix_vector_use(PCIDevice *pdev,
             kvm_irqchip_release_virq(kvm_state, vector->virq);
             vector->virq = -1;
         }
+        vdev->slow.msi_no_route++;
         qemu_set_fd_handler(event_notifier_get_fd(&vector->interrupt),
                             vfio_msi_interrupt, NULL, vector);
     }
@@ -638,54 +703,28 @@ static int vfio_msix_vector_use(PCIDevice *pdev,
     return 0;
 }
 
+/*
+ * Masking a vector keeps it allocated on the host and in VFIO; only the
+ * eventfd moves from the KVM irqfd to QEMU, which sets the pending bit
+ * when it fires.  The KVM route is kept for the next unmask.  Guests that
+ * mask and unmask vectors at high rates therefore never reprogram VFIO.
+ */
 static void vfio_msix_vector_release(PCIDevice *pdev, unsigned int nr)
 {
     VFIODevice *vdev = DO_UPCAST(VFIODevice, pdev, pdev);
     VFIOMSIVector *vector = &vdev->msi_vectors[nr];
-    int argsz;
-    struct vfio_irq_set *irq_set;
-    int32_t *pfd;
 
     DPRINTF("%s(%04x:%02x:%02x.%x) vector %d released\n", __func__,
             vdev->host.domain, vdev->host.bus, vdev->host.slot,
             vdev->host.function, nr);
 
-    /*
-     * XXX What's the right thing to do here?  This turns off the interrupt
-     * completely, but do we really just want to switch the interrupt to
-     * bouncing through userspace and let msix.c drop it?  Not sure.
-     */
-    msix_vector_unuse(pdev, nr);
-
-    argsz = sizeof(*irq_set) + sizeof(*pfd);
-
-    irq_set = g_malloc0(argsz);
-    irq_set->argsz = argsz;
-    irq_set->flags = VFIO_IRQ_SET_DATA_EVENTFD |
-                     VFIO_IRQ_SET_ACTION_TRIGGER;
-    irq_set->index = VFIO_PCI_MSIX_IRQ_INDEX;
-    irq_set->start = nr;
-    irq_set->count = 1;
-    pfd = (int32_t *)&irq_set->data;
-
-    *pfd = -1;
-
-    ioctl(vdev->fd, VFIO_DEVICE_SET_IRQS, irq_set);
-
-    g_free(irq_set);
-
-    if (vector->virq < 0) {
-        qemu_set_fd_handler(event_notifier_get_fd(&vector->interrupt),
-                            NULL, NULL, NULL);
-    } else {
+    vector->masked = true;
+    if (vector->virq >= 0) {
         kvm_irqchip_remove_irqfd_notifier(kvm_state, &vector->interrupt,
                                           vector->virq);
-        kvm_irqchip_release_virq(kvm_state, vector->virq);
-        vector->virq = -1;
+        qemu_set_fd_handler(event_notifier_get_fd(&vector->interrupt),
+                            vfio_msi_interrupt, NULL, vector);
     }
-
-    event_notifier_cleanup(&vector->interrupt);
-    vector->use = false;
 }
 
 static void vfio_enable_msix(VFIODevice *vdev)
@@ -794,12 +833,33 @@ static void vfio_disable_msi_common(VFIODevice *vdev)
 
 static void vfio_disable_msix(VFIODevice *vdev)
 {
+    int i;
+
+    /* This releases, i.e. masks, all vectors that were still unmasked */
     msix_unset_vector_notifiers(&vdev->pdev);
 
     if (vdev->nr_vectors) {
         vfio_disable_irqindex(vdev, VFIO_PCI_MSIX_IRQ_INDEX);
     }
 
+    for (i = 0; i < vdev->nr_vectors; i++) {
+        VFIOMSIVector *vector = &vdev->msi_vectors[i];
+
+        if (!vector->use) {
+            continue;
+        }
+
+        qemu_set_fd_handler(event_notifier_get_fd(&vector->interrupt),
+                            NULL, NULL, NULL);
+        if (vector->virq >= 0) {
+            kvm_irqchip_release_virq(kvm_state, vector->virq);
+            vector->virq = -1;
+        }
+        msix_vector_unuse(&vdev->pdev, i);
+        event_notifier_cleanup(&vector->interrupt);
+        vector->use = false;
+    }
+
     vfio_disable_msi_common(vdev);
 
     DPRINTF("%s(%04x:%02x:%02x.%x)\n", __func__, vdev->host.domain,
@@ -946,8 +1006,13 @@ static uint32_t vfio_pci_read_config(PCIDevice *pdev, uint32_t addr, int len)
      * We only need QEMU PCI config support for the ROM BAR, the MSI and MSIX
      * capabilities, and the multifunction bit below.  We let VFIO handle
      * virtualizing everything else.  Performance is not a concern here.
+     * A BAR holding a relocated MSI-X table does not exist on the host and
+     * is emulated too.
      */
     if (ranges_overlap(addr, len, PCI_ROM_ADDRESS, 4) ||
+        (vdev->msix && vdev->msix->relo_bar >= 0 &&
+         ranges_overlap(addr, len,
+                        PCI_BASE_ADDRESS_0 + 4 * vdev->msix->relo_bar, 4)) ||
         (pdev->cap_present & QEMU_PCI_CAP_MSIX &&
          ranges_overlap(addr, len, pdev->msix_cap, MSIX_CAP_LENGTH)) ||
         (pdev->cap_present & QEMU_PCI_CAP_MSI &&
@@ -1097,6 +1162,140 @@ static bool vfio_listener_skipped_section(MemoryRegionSection *section)
     return !memory_region_is_ram(section->mr);
 }
 
+/*
+ * Map and unmap requests are queued and issued when the memory transaction
+ * commits.  A section that is removed and added back unchanged, as happens
+ * for RAM when an unrelated BAR moves or a ROM is toggled, is left alone;
+ * the remaining requests are sorted and contiguous ones are merged, so that
+ * RAM split into several sections is mapped with one call and the IOMMU can
+ * use superpages across the section boundaries.
+ */
+#define VFIO_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+static void vfio_dma_queue(VFIOContainer *container, hwaddr iova,
+                           ram_addr_t size, void *vaddr, bool readonly,
+                           bool map)
+{
+    VFIODMAOp *op;
+
+    if (container->nr_dma_ops == container->max_dma_ops) {
+        container->max_dma_ops = MAX(container->max_dma_ops * 2, 16);
+        container->dma_ops = g_renew(VFIODMAOp, container->dma_ops,
+                                     container->max_dma_ops);
+    }
+    op = &container->dma_ops[container->nr_dma_ops++];
+    op->iova = iova;
+    op->size = size;
+    op->vaddr = vaddr;
+    op->readonly = readonly;
+    op->map = map;
+}
+
+static int vfio_dma_op_cmp(const void *a, const void *b)
+{
+    const VFIODMAOp *x = a, *y = b;
+
+    if (x->map != y->map) {
+        return x->map - y->map;     /* unmaps first */
+    }
+    return x->iova < y->iova ? -1 : x->iova > y->iova;
+}
+
+static bool vfio_dma_op_same(VFIODMAOp *a, VFIODMAOp *b)
+{
+    return a->iova == b->iova && a->size == b->size &&
+           a->vaddr == b->vaddr && a->readonly == b->readonly;
+}
+
+static bool vfio_dma_op_contiguous(VFIODMAOp *a, VFIODMAOp *b)
+{
+    return a->map == b->map && a->iova + a->size == b->iova &&
+           (!a->map || (a->vaddr + a->size == b->vaddr &&
+                        a->readonly == b->readonly));
+}
+
+static void vfio_dma_issue(VFIOContainer *container, VFIODMAOp *op)
+{
+    int ret;
+
+    if (op->map) {
+        DPRINTF("vfio: map %"HWADDR_PRIx" - %"HWADDR_PRIx" [%p]%s\n",
+                op->iova, op->iova + op->size - 1, op->vaddr,
+                op->size >= VFIO_HUGEPAGE_SIZE &&
+                ((op->iova ^ (uintptr_t)op->vaddr) &
+                 (VFIO_HUGEPAGE_SIZE - 1)) ? " (no superpages)" : "");
+        ret = vfio_dma_map(container, op->iova, op->size, op->vaddr,
+                           op->readonly);
+        if (ret) {
+            error_report("vfio_dma_map(%p, 0x%"HWADDR_PRIx", "
+                         "0x%"HWADDR_PRIx", %p) = %d (%m)\n",
+                         container, op->iova, (hwaddr)op->size, op->vaddr,
+                         ret);
+        }
+    } else {
+        DPRINTF("vfio: unmap %"HWADDR_PRIx" - %"HWADDR_PRIx"\n",
+                op->iova, op->iova + op->size - 1);
+        ret = vfio_dma_unmap(container, op->iova, op->size);
+        if (ret) {
+            error_report("vfio_dma_unmap(%p, 0x%"HWADDR_PRIx", "
+                         "0x%"HWADDR_PRIx") = %d (%m)\n",
+                         container, op->iova, (hwaddr)op->size, ret);
+        }
+    }
+}
+
+static void vfio_dma_commit(VFIOContainer *container)
+{
+    VFIODMAOp *ops = container->dma_ops;
+    int n = container->nr_dma_ops;
+    int i, j, first;
+    VFIODMAOp cur;
+
+    /* Drop unmap/map pairs that would restore the same mapping */
+    for (i = 0; i < n; i++) {
+        if (ops[i].map || !ops[i].size) {
+            continue;
+        }
+        for (j = 0; j < n; j++) {
+            if (ops[j].map && ops[j].size && vfio_dma_op_same(&ops[i],
+                                                              &ops[j])) {
+                ops[i].size = ops[j].size = 0;
+                break;
+            }
+        }
+    }
+
+    qsort(ops, n, sizeof(*ops), vfio_dma_op_cmp);
+
+    for (first = 1, i = 0; i < n; i++) {
+        if (!ops[i].size) {
+            continue;
+        }
+        if (first) {
+            cur = ops[i];
+            first = 0;
+        } else if (vfio_dma_op_contiguous(&cur, &ops[i])) {
+            cur.size += ops[i].size;
+        } else {
+            vfio_dma_issue(container, &cur);
+            cur = ops[i];
+        }
+    }
+    if (!first) {
+        vfio_dma_issue(container, &cur);
+    }
+
+    container->nr_dma_ops = 0;
+}
+
+static void vfio_listener_commit(MemoryListener *listener)
+{
+    VFIOContainer *container = container_of(listener, VFIOContainer,
+                                            iommu_data.listener);
+
+    vfio_dma_commit(container);
+}
+
 static void vfio_listener_region_add(MemoryListener *listener,
                                      MemoryRegionSection *section)
 {
@@ -1104,7 +1303,6 @@ static void vfio_listener_region_add(MemoryListener *listener,
                                             iommu_data.listener);
     hwaddr iova, end;
     void *vaddr;
-    int ret;
 
     if (vfio_listener_skipped_section(section)) {
         DPRINTF("vfio: SKIPPING region_add %"HWADDR_PRIx" - %"PRIx64"\n",
@@ -1134,12 +1332,8 @@ static void vfio_listener_region_add(MemoryListener *listener,
     DPRINTF("vfio: region_add %"HWADDR_PRIx" - %"HWADDR_PRIx" [%p]\n",
             iova, end - 1, vaddr);
 
-    ret = vfio_dma_map(container, iova, end - iova, vaddr, section->readonly);
-    if (ret) {
-        error_report("vfio_dma_map(%p, 0x%"HWADDR_PRIx", "
-                     "0x%"HWADDR_PRIx", %p) = %d (%m)\n",
-                     container, iova, end - iova, vaddr, ret);
-    }
+    vfio_dma_queue(container, iova, end - iova, vaddr, section->readonly,
+                   true);
 }
 
 static void vfio_listener_region_del(MemoryListener *listener,
@@ -1148,7 +1342,7 @@ static void vfio_listener_region_del(MemoryListener *listener,
     VFIOContainer *container = container_of(listener, VFIOContainer,
                                             iommu_data.listener);
     hwaddr iova, end;
-    int ret;
+    void *vaddr;
 
     if (vfio_listener_skipped_section(section)) {
         DPRINTF("vfio: SKIPPING region_del %"HWADDR_PRIx" - %"PRIx64"\n",
@@ -1174,15 +1368,16 @@ static void vfio_listener_region_del(MemoryListener *listener,
     DPRINTF("vfio: region_del %"HWADDR_PRIx" - %"HWADDR_PRIx"\n",
             iova, end - 1);
 
-    ret = vfio_dma_unmap(container, iova, end - iova);
-    if (ret) {
-        error_report("vfio_dma_unmap(%p, 0x%"HWADDR_PRIx", "
-                     "0x%"HWADDR_PRIx") = %d (%m)\n",
-                     container, iova, end - iova, ret);
-    }
+    /* The host address lets commit recognize a remap of the same RAM */
+    vaddr = memory_region_get_ram_ptr(section->mr) +
+            section->offset_within_region +
+            (iova - section->offset_within_address_space);
+    vfio_dma_queue(container, iova, end - iova, vaddr, section->readonly,
+                   false);
 }
 
 static MemoryListener vfio_memory_listener = {
+    .commit = vfio_listener_commit,
     .region_add = vfio_listener_region_add,
     .region_del = vfio_listener_region_del,
 };
@@ -1190,6 +1385,9 @@ static MemoryListener vfio_memory_listener = {
 static void vfio_listener_release(VFIOContainer *container)
 {
     memory_listener_unregister(&container->iommu_data.listener);
+    g_free(container->dma_ops);
+    container->dma_ops = NULL;
+    container->nr_dma_ops = container->max_dma_ops = 0;
 }
 
 /*
@@ -1242,6 +1440,70 @@ static int vfio_setup_msi(VFIODevice *vdev, int pos)
     return 0;
 }
 
+/*
+ * The MSI-X table often shares a page with registers the driver writes on
+ * every I/O, such as doorbells.  The table page cannot be mmap'd, so all of
+ * those writes trap to QEMU.  Moving the guest's view of the table and PBA
+ * to an otherwise unused BAR, emulated entirely in QEMU, leaves the
+ * physical BAR with nothing QEMU needs to intercept.  vfio_map_bar() then
+ * tries to mmap it whole, falling back to mapping around the table if the
+ * host refuses.
+ */
+static int vfio_msix_relocate(VFIODevice *vdev, int nr)
+{
+    VFIOBAR *bar;
+    uint32_t table_size, pba_size, size;
+    uint32_t pci_bar;
+
+    if (nr >= PCI_ROM_SLOT) {
+        error_report("vfio: Invalid MSI-X relocation BAR %d\n", nr);
+        return -EINVAL;
+    }
+
+    bar = &vdev->bars[nr];
+    if (bar->size) {
+        error_report("vfio: Cannot relocate MSI-X table to BAR %d, "
+                     "it is in use by the device\n", nr);
+        return -EBUSY;
+    }
+
+    /* An unimplemented BAR may also be the upper half of a 64bit BAR */
+    if (nr > 0 && vdev->bars[nr - 1].size) {
+        if (pread(vdev->fd, &pci_bar, sizeof(pci_bar), vdev->config_offset +
+                  PCI_BASE_ADDRESS_0 + 4 * (nr - 1)) != sizeof(pci_bar)) {
+            return -errno;
+        }
+        pci_bar = le32_to_cpu(pci_bar);
+        if (!(pci_bar & PCI_BASE_ADDRESS_SPACE_IO) &&
+            (pci_bar & PCI_BASE_ADDRESS_MEM_TYPE_MASK) ==
+            PCI_BASE_ADDRESS_MEM_TYPE_64) {
+            error_report("vfio: Cannot relocate MSI-X table to BAR %d, "
+                         "it is the upper half of BAR %d\n", nr, nr - 1);
+            return -EBUSY;
+        }
+    }
+
+    table_size = vdev->msix->entries * PCI_MSIX_ENTRY_SIZE;
+    pba_size = DIV_ROUND_UP(vdev->msix->entries, 64) * 8;
+    for (size = TARGET_PAGE_SIZE; size < table_size + pba_size; size <<= 1) {
+        /* BAR sizes are powers of two */
+    }
+
+    bar->size = size;
+    bar->flags = 0;
+    bar->fd = vdev->fd;
+    bar->nr = nr;
+
+    vdev->msix->relo_bar = nr;
+    vdev->msix->relo_pba_offset = table_size;
+
+    DPRINTF("%04x:%02x:%02x.%x MSI-X table relocated to BAR %d, size 0x%x\n",
+            vdev->host.domain, vdev->host.bus, vdev->host.slot,
+            vdev->host.function, nr, size);
+
+    return 0;
+}
+
 /*
  * We don't have any control over how pci_add_capability() inserts
  * capabilities into the chain.  In order to setup MSI-X we need a
@@ -1286,6 +1548,7 @@ static int vfio_early_setup_msix(VFIODevice *vdev)
     vdev->msix->pba_bar = pba & PCI_MSIX_FLAGS_BIRMASK;
     vdev->msix->pba_offset = pba & ~PCI_MSIX_FLAGS_BIRMASK;
     vdev->msix->entries = (ctrl & PCI_MSIX_FLAGS_QSIZE) + 1;
+    vdev->msix->relo_bar = -1;
 
     DPRINTF("%04x:%02x:%02x.%x "
             "PCI MSI-X CAP @0x%x, BAR %d, offset 0x%x, entries %d\n",
@@ -1293,18 +1556,30 @@ static int vfio_early_setup_msix(VFIODevice *vdev)
             vdev->host.function, pos, vdev->msix->table_bar,
             vdev->msix->table_offset, vdev->msix->entries);
 
+    if (vdev->msix_relo >= 0) {
+        return vfio_msix_relocate(vdev, vdev->msix_relo);
+    }
+
     return 0;
 }
 
 static int vfio_setup_msix(VFIODevice *vdev, int pos)
 {
+    VFIOMSIXInfo *msix = vdev->msix;
     int ret;
 
-    ret = msix_init(&vdev->pdev, vdev->msix->entries,
-                    &vdev->bars[vdev->msix->table_bar].mem,
-                    vdev->msix->table_bar, vdev->msix->table_offset,
-                    &vdev->bars[vdev->msix->pba_bar].mem,
-                    vdev->msix->pba_bar, vdev->msix->pba_offset, pos);
+    if (msix->relo_bar >= 0) {
+        ret = msix_init(&vdev->pdev, msix->entries,
+                        &vdev->bars[msix->relo_bar].mem, msix->relo_bar, 0,
+                        &vdev->bars[msix->relo_bar].mem, msix->relo_bar,
+                        msix->relo_pba_offset, pos);
+    } else {
+        ret = msix_init(&vdev->pdev, msix->entries,
+                        &vdev->bars[msix->table_bar].mem,
+                        msix->table_bar, msix->table_offset,
+                        &vdev->bars[msix->pba_bar].mem,
+                        msix->pba_bar, msix->pba_offset, pos);
+    }
     if (ret < 0) {
         if (ret == -ENOTSUP) {
             return 0;
@@ -1320,7 +1595,10 @@ static void vfio_teardown_msi(VFIODevice *vdev)
 {
     msi_uninit(&vdev->pdev);
 
-    if (vdev->msix) {
+    if (vdev->msix && vdev->msix->relo_bar >= 0) {
+        msix_uninit(&vdev->pdev, &vdev->bars[vdev->msix->relo_bar].mem,
+                    &vdev->bars[vdev->msix->relo_bar].mem);
+    } else if (vdev->msix) {
         msix_uninit(&vdev->pdev, &vdev->bars[vdev->msix->table_bar].mem,
                     &vdev->bars[vdev->msix->pba_bar].mem);
     }
@@ -1421,6 +1699,15 @@ static void vfio_map_bar(VFIODevice *vdev, int nr)
              vdev->host.domain, vdev->host.bus, vdev->host.slot,
              vdev->host.function, nr);
 
+    /* A relocated MSI-X table lives in a BAR that only exists in QEMU */
+    if (vdev->msix && vdev->msix->relo_bar == nr) {
+        memory_region_init(&bar->mem, name, size);
+        pci_register_bar(&vdev->pdev, nr, PCI_BASE_ADDRESS_SPACE_MEMORY,
+                         &bar->mem);
+        vfio_mmap_bar(bar, &bar->mem, &bar->mmap_mem, &bar->mmap, 0, 0, name);
+        return;
+    }
+
     /* Determine what type of BAR this is for registration */
     ret = pread(vdev->fd, &pci_bar, sizeof(pci_bar),
                 vdev->config_offset + PCI_BASE_ADDRESS_0 + (4 * nr));
@@ -1437,6 +1724,27 @@ static void vfio_map_bar(VFIODevice *vdev, int nr)
     memory_region_init_io(&bar->mem, &vfio_bar_ops, bar, name, size);
     pci_register_bar(&vdev->pdev, nr, type, &bar->mem);
 
+    strncat(name, " mmap", sizeof(name) - strlen(name) - 1);
+
+    /*
+     * The guest does not access a relocated table through this BAR, so
+     * nothing in it needs trapping.  Hosts that refuse to mmap the table
+     * page get the split mapping below.
+     */
+    if (vdev->msix && vdev->msix->table_bar == nr &&
+        vdev->msix->relo_bar >= 0) {
+        if (!vfio_mmap_bar(bar, &bar->mem,
+                           &bar->mmap_mem, &bar->mmap, size, 0, name)) {
+            /* Keep the unused msix-hi region around for cleanup */
+            vfio_mmap_bar(bar, &bar->mem, &vdev->msix->mmap_mem,
+                          &vdev->msix->mmap, 0, 0, name);
+            return;
+        }
+        DPRINTF("%s: host refused to map the MSI-X table page\n", name);
+        memory_region_del_subregion(&bar->mem, &bar->mmap_mem);
+        memory_region_destroy(&bar->mmap_mem);
+    }
+
     /*
      * We can't mmap areas overlapping the MSIX vector table, so we
      * potentially insert a direct-mapped subregion before and after it.
@@ -1445,7 +1753,6 @@ static void vfio_map_bar(VFIODevice *vdev, int nr)
         size = vdev->msix->table_offset & TARGET_PAGE_MASK;
     }
 
-    strncat(name, " mmap", sizeof(name) - strlen(name) - 1);
     if (vfio_mmap_bar(bar, &bar->mem,
                       &bar->mmap_mem, &bar->mmap, size, 0, name)) {
         error_report("%s unsupported. Performance may be slow\n", name);
@@ -1670,6 +1977,8 @@ static int vfio_connect_container(VFIOGroup *group)
         container->iommu_data.release = vfio_listener_release;
 
         memory_listener_register(&container->iommu_data.listener, &address_space_memory);
+        /* Registration replays the current map without a commit */
+        vfio_dma_commit(container);
     } else {
         error_report("vfio: No available IOMMU models\n");
         g_free(container);
@@ -1899,6 +2208,12 @@ static void vfio_put_device(VFIODevice *vdev)
     }
 }
 
+static void vfio_get_stat(Object *obj, Visitor *v, void *opaque,
+                          const char *name, Error **errp)
+{
+    visit_type_uint64(v, opaque, name, errp);
+}
+
 static int vfio_initfn(PCIDevice *pdev)
 {
     VFIODevice *pvdev, *vdev = DO_UPCAST(VFIODevice, pdev, pdev);
@@ -2009,6 +2324,16 @@ static int vfio_initfn(PCIDevice *pdev)
         }
     }
 
+    object_property_add(OBJECT(vdev), "x-slow-intx", "uint64",
+                        vfio_get_stat, NULL, NULL, &vdev->slow.intx, NULL);
+    object_property_add(OBJECT(vdev), "x-slow-intx-eoi", "uint64",
+                        vfio_get_stat, NULL, NULL, &vdev->slow.intx_eoi, NULL);
+    object_property_add(OBJECT(vdev), "x-slow-msi", "uint64",
+                        vfio_get_stat, NULL, NULL, &vdev->slow.msi, NULL);
+    object_property_add(OBJECT(vdev), "x-slow-msi-no-route", "uint64",
+                        vfio_get_stat, NULL, NULL, &vdev->slow.msi_no_route,
+                        NULL);
+
     return 0;
 
 out_teardown:
@@ -2072,6 +2397,7 @@ static Property vfio_pci_dev_properties[] = {
     DEFINE_PROP_PCI_HOST_DEVADDR("host", VFIODevice, host),
     DEFINE_PROP_UINT32("x-intx-mmap-timeout-ms", VFIODevice,
                        intx.mmap_timeout, 1100),
+    DEFINE_PROP_INT32("x-msix-relocation", VFIODevice, msix_relo, -1),
     /*
      * TODO - support passed fds... is this necessary?
      * DEFINE_PROP_STRING("vfiofd", VFIODevice, vfiofd_name),
@@ -1634,6 +1634,38 @@ void vga_dirty_log_stop(VGACommonState *s)
 /*
  * graphic modes
  */
+/* Whether any scanline vga_draw_graphic() would show can have changed since
+ * the last refresh.  One dirty log lookup covers the whole frame; CGA
+ * interleaving and the line compare split can show VRAM below the start
+ * address, so they check all of it.
+ */
+static bool vga_graphic_dirty(VGACommonState *s, ram_addr_t addr,
+                              int line_offset, int height, int bwidth)
+{
+    ram_addr_t start, end;
+    int i;
+
+    for (i = 0; i < (height + 31) >> 5; i++) {
+        if (s->invalidated_y_table[i]) {
+            return true;
+        }
+    }
+
+    if ((s->cr[VGA_CRTC_MODE] & 3) != 3 || s->line_compare < height) {
+        start = 0;
+        end = s->vram_size;
+    } else {
+        start = addr;
+        end = MIN(addr + (ram_addr_t)line_offset * height + bwidth,
+                  s->vram_size);
+    }
+    if (start >= end) {
+        return true;
+    }
+    return memory_region_get_dirty(&s->vram, start, end - start,
+                                   DIRTY_MEMORY_VGA);
+}
+
 static void vga_draw_graphic(VGACommonState *s, int full_update)
 {
     int y1, y, update, linesize, y_start, double_scan, mask, depth;
@@ -1782,6 +1814,10 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
 #endif
     addr1 = (s->start_addr * 4);
     bwidth = (width * bits + 7) / 8;
+    if (!full_update &&
+        !vga_graphic_dirty(s, addr1, line_offset, height, bwidth)) {
+        return;
+    }
     y_start = -1;
     page_min = -1;
     page_max = 0;
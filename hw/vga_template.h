@@ -405,6 +405,24 @@ static void glue(vga_draw_line24_, PIXEL_NAME)(VGACommonState *s1, uint8_t *d,
     uint32_t r, g, b;
 
     w = width;
+#if DEPTH == 32 && !defined(TARGET_WORDS_BIGENDIAN) && \
+    !defined(HOST_WORDS_BIGENDIAN) && !defined(BGR_FORMAT)
+    /* The pixel value is the 24 bit little endian load: convert four
+     * pixels from three words at a time */
+    for (; w >= 4; w -= 4) {
+        uint32_t w0 = ldl_le_p(s), w1 = ldl_le_p(s + 4), w2 = ldl_le_p(s + 8);
+
+        ((uint32_t *)d)[0] = w0 & 0xffffff;
+        ((uint32_t *)d)[1] = ((w0 >> 24) | (w1 << 8)) & 0xffffff;
+        ((uint32_t *)d)[2] = ((w1 >> 16) | (w2 << 16)) & 0xffffff;
+        ((uint32_t *)d)[3] = w2 >> 8;
+        s += 12;
+        d += 16;
+    }
+    if (w == 0) {
+        return;
+    }
+#endif
     do {
 #if defined(TARGET_WORDS_BIGENDIAN)
         r = s[0];
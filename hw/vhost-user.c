@@ -0,0 +1,389 @@
+/*
+ * vhost-user
+ *
+ * The vhost requests are sent as messages over a UNIX domain socket to a
+ * process that implements the virtio device in userspace.  File descriptors
+ * (guest memory, kick and call eventfds) are passed as SCM_RIGHTS ancillary
+ * data.  See docs/specs/vhost-user.txt for the protocol.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "hw/vhost.h"
+#include "hw/vhost-backend.h"
+#include "qemu-error.h"
+
+#include <sys/socket.h>
+#include <linux/vhost.h>
+
+#define VHOST_MEMORY_MAX_NREGIONS    8
+
+typedef enum VhostUserRequest {
+    VHOST_USER_NONE = 0,
+    VHOST_USER_GET_FEATURES = 1,
+    VHOST_USER_SET_FEATURES = 2,
+    VHOST_USER_SET_OWNER = 3,
+    VHOST_USER_RESET_OWNER = 4,
+    VHOST_USER_SET_MEM_TABLE = 5,
+    VHOST_USER_SET_LOG_BASE = 6,
+    VHOST_USER_SET_LOG_FD = 7,
+    VHOST_USER_SET_VRING_NUM = 8,
+    VHOST_USER_SET_VRING_ADDR = 9,
+    VHOST_USER_SET_VRING_BASE = 10,
+    VHOST_USER_GET_VRING_BASE = 11,
+    VHOST_USER_SET_VRING_KICK = 12,
+    VHOST_USER_SET_VRING_CALL = 13,
+    VHOST_USER_SET_VRING_ERR = 14,
+    VHOST_USER_MAX
+} VhostUserRequest;
+
+typedef struct VhostUserMemoryRegion {
+    uint64_t guest_phys_addr;
+    uint64_t memory_size;
+    uint64_t userspace_addr;
+    uint64_t mmap_offset;
+} VhostUserMemoryRegion;
+
+typedef struct VhostUserMemory {
+    uint32_t nregions;
+    uint32_t padding;
+    VhostUserMemoryRegion regions[VHOST_MEMORY_MAX_NREGIONS];
+} VhostUserMemory;
+
+typedef struct VhostUserMsg {
+    VhostUserRequest request;
+
+#define VHOST_USER_VERSION_MASK     (0x3)
+#define VHOST_USER_REPLY_MASK       (0x1 << 2)
+    uint32_t flags;
+    uint32_t size; /* the following payload size */
+    union {
+#define VHOST_USER_VRING_IDX_MASK   (0xff)
+#define VHOST_USER_VRING_NOFD_MASK  (0x1 << 8)
+        uint64_t u64;
+        struct vhost_vring_state state;
+        struct vhost_vring_addr addr;
+        VhostUserMemory memory;
+    };
+} QEMU_PACKED VhostUserMsg;
+
+#define VHOST_USER_HDR_SIZE offsetof(VhostUserMsg, u64)
+#define VHOST_USER_PAYLOAD_SIZE (sizeof(VhostUserMsg) - VHOST_USER_HDR_SIZE)
+
+/* The version of the protocol we support */
+#define VHOST_USER_VERSION    (0x1)
+
+static unsigned long int ioctl_to_vhost_user_request[VHOST_USER_MAX] = {
+    -1,                     /* VHOST_USER_NONE */
+    VHOST_GET_FEATURES,     /* VHOST_USER_GET_FEATURES */
+    VHOST_SET_FEATURES,     /* VHOST_USER_SET_FEATURES */
+    VHOST_SET_OWNER,        /* VHOST_USER_SET_OWNER */
+    VHOST_RESET_OWNER,      /* VHOST_USER_RESET_OWNER */
+    VHOST_SET_MEM_TABLE,    /* VHOST_USER_SET_MEM_TABLE */
+    VHOST_SET_LOG_BASE,     /* VHOST_USER_SET_LOG_BASE */
+    VHOST_SET_LOG_FD,       /* VHOST_USER_SET_LOG_FD */
+    VHOST_SET_VRING_NUM,    /* VHOST_USER_SET_VRING_NUM */
+    VHOST_SET_VRING_ADDR,   /* VHOST_USER_SET_VRING_ADDR */
+    VHOST_SET_VRING_BASE,   /* VHOST_USER_SET_VRING_BASE */
+    VHOST_GET_VRING_BASE,   /* VHOST_USER_GET_VRING_BASE */
+    VHOST_SET_VRING_KICK,   /* VHOST_USER_SET_VRING_KICK */
+    VHOST_SET_VRING_CALL,   /* VHOST_USER_SET_VRING_CALL */
+    VHOST_SET_VRING_ERR     /* VHOST_USER_SET_VRING_ERR */
+};
+
+static VhostUserRequest vhost_user_request_translate(unsigned long int request)
+{
+    VhostUserRequest idx;
+
+    for (idx = 0; idx < VHOST_USER_MAX; idx++) {
+        if (ioctl_to_vhost_user_request[idx] == request) {
+            break;
+        }
+    }
+
+    return (idx == VHOST_USER_MAX) ? VHOST_USER_NONE : idx;
+}
+
+static int vhost_user_read_full(int fd, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+    ssize_t r;
+
+    while (len > 0) {
+        r = read(fd, p, len);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return -1;
+        }
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+static int vhost_user_read(struct vhost_dev *dev, VhostUserMsg *msg)
+{
+    if (vhost_user_read_full(dev->control, msg, VHOST_USER_HDR_SIZE) < 0) {
+        error_report("Failed to read msg header from vhost-user backend");
+        return -1;
+    }
+
+    /* validate received flags */
+    if (msg->flags != (VHOST_USER_REPLY_MASK | VHOST_USER_VERSION)) {
+        error_report("Failed to read msg header, flags 0x%x instead of 0x%x",
+                     msg->flags, VHOST_USER_REPLY_MASK | VHOST_USER_VERSION);
+        return -1;
+    }
+
+    /* validate message size is sane */
+    if (msg->size > VHOST_USER_PAYLOAD_SIZE) {
+        error_report("Failed to read msg header, size %d exceeds max %zu",
+                     msg->size, VHOST_USER_PAYLOAD_SIZE);
+        return -1;
+    }
+
+    if (msg->size &&
+        vhost_user_read_full(dev->control, (uint8_t *)msg + VHOST_USER_HDR_SIZE,
+                             msg->size) < 0) {
+        error_report("Failed to read msg payload from vhost-user backend");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int vhost_user_write(struct vhost_dev *dev, VhostUserMsg *msg,
+                            int *fds, int fd_num)
+{
+    char control[CMSG_SPACE(VHOST_MEMORY_MAX_NREGIONS * sizeof(int))];
+    size_t fd_size = fd_num * sizeof(int);
+    struct msghdr msgh;
+    struct iovec iov;
+    ssize_t r;
+
+    memset(&msgh, 0, sizeof(msgh));
+    iov.iov_base = msg;
+    iov.iov_len = VHOST_USER_HDR_SIZE + msg->size;
+    msgh.msg_iov = &iov;
+    msgh.msg_iovlen = 1;
+
+    if (fd_num) {
+        struct cmsghdr *cmsg;
+
+        msgh.msg_control = control;
+        msgh.msg_controllen = CMSG_SPACE(fd_size);
+
+        cmsg = CMSG_FIRSTHDR(&msgh);
+        cmsg->cmsg_len = CMSG_LEN(fd_size);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        memcpy(CMSG_DATA(cmsg), fds, fd_size);
+    }
+
+    do {
+        r = sendmsg(dev->control, &msgh, 0);
+    } while (r < 0 && errno == EINTR);
+
+    if (r != iov.iov_len) {
+        error_report("Failed to send msg to vhost-user backend");
+        return -1;
+    }
+    return 0;
+}
+
+/* Describe the guest memory regions, together with the file descriptors
+ * that the backend has to mmap(2) to access them.
+ */
+static int vhost_user_fill_mem_table(struct vhost_dev *dev, VhostUserMsg *msg,
+                                     int *fds, int *fd_num)
+{
+    int i;
+
+    for (i = 0; i < dev->mem->nregions; ++i) {
+        struct vhost_memory_region *reg = dev->mem->regions + i;
+        VhostUserMemoryRegion ureg;
+        ram_addr_t offset;
+        int fd;
+
+        fd = qemu_get_ram_fd((void *)(uintptr_t)reg->userspace_addr, &offset);
+        if (fd < 0) {
+            error_report("vhost-user requires guest memory to be shared, "
+                         "use -machine mem-share=on or shared memory "
+                         "backends");
+            return -1;
+        }
+        if (*fd_num == VHOST_MEMORY_MAX_NREGIONS) {
+            error_report("vhost-user supports at most %d memory regions",
+                         VHOST_MEMORY_MAX_NREGIONS);
+            return -1;
+        }
+
+        ureg.guest_phys_addr = reg->guest_phys_addr;
+        ureg.memory_size = reg->memory_size;
+        ureg.userspace_addr = reg->userspace_addr;
+        ureg.mmap_offset = offset;
+        memcpy(&msg->memory.regions[*fd_num], &ureg, sizeof(ureg));
+        fds[(*fd_num)++] = fd;
+    }
+
+    msg->memory.nregions = *fd_num;
+    msg->memory.padding = 0;
+    msg->size = sizeof(msg->memory.nregions) + sizeof(msg->memory.padding) +
+                *fd_num * sizeof(VhostUserMemoryRegion);
+    return 0;
+}
+
+static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
+                           void *arg)
+{
+    VhostUserMsg msg;
+    VhostUserRequest msg_request;
+    struct vhost_vring_file *file = NULL;
+    bool need_reply = false;
+    int fds[VHOST_MEMORY_MAX_NREGIONS];
+    int fd_num = 0;
+
+    assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
+
+    msg_request = vhost_user_request_translate(request);
+    msg.request = msg_request;
+    msg.flags = VHOST_USER_VERSION;
+    msg.size = 0;
+
+    switch (request) {
+    case VHOST_GET_FEATURES:
+        need_reply = true;
+        break;
+
+    case VHOST_SET_FEATURES:
+    case VHOST_SET_LOG_BASE:
+        msg.u64 = *((uint64_t *) arg);
+        msg.size = sizeof(msg.u64);
+        break;
+
+    case VHOST_SET_OWNER:
+    case VHOST_RESET_OWNER:
+        break;
+
+    case VHOST_SET_MEM_TABLE:
+        if (vhost_user_fill_mem_table(dev, &msg, fds, &fd_num) < 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        break;
+
+    case VHOST_SET_LOG_FD:
+        fds[fd_num++] = *((int *) arg);
+        break;
+
+    case VHOST_SET_VRING_NUM:
+    case VHOST_SET_VRING_BASE:
+        memcpy(&msg.state, arg, sizeof(struct vhost_vring_state));
+        msg.size = sizeof(msg.state);
+        break;
+
+    case VHOST_GET_VRING_BASE:
+        memcpy(&msg.state, arg, sizeof(struct vhost_vring_state));
+        msg.size = sizeof(msg.state);
+        need_reply = true;
+        break;
+
+    case VHOST_SET_VRING_ADDR:
+        memcpy(&msg.addr, arg, sizeof(struct vhost_vring_addr));
+        msg.size = sizeof(msg.addr);
+        break;
+
+    case VHOST_SET_VRING_KICK:
+    case VHOST_SET_VRING_CALL:
+    case VHOST_SET_VRING_ERR:
+        file = arg;
+        msg.u64 = file->index & VHOST_USER_VRING_IDX_MASK;
+        msg.size = sizeof(msg.u64);
+        if (file->fd >= 0) {
+            fds[fd_num++] = file->fd;
+        } else {
+            msg.u64 |= VHOST_USER_VRING_NOFD_MASK;
+        }
+        break;
+
+    default:
+        error_report("vhost-user trying to send unhandled ioctl");
+        errno = ENOSYS;
+        return -1;
+    }
+
+    if (vhost_user_write(dev, &msg, fds, fd_num) < 0) {
+        errno = EIO;
+        return -1;
+    }
+
+    if (need_reply) {
+        if (vhost_user_read(dev, &msg) < 0) {
+            errno = EIO;
+            return -1;
+        }
+
+        if (msg_request != msg.request) {
+            error_report("Received unexpected msg type. "
+                         "Expected %d received %d", msg_request, msg.request);
+            errno = EPROTO;
+            return -1;
+        }
+
+        switch (msg_request) {
+        case VHOST_USER_GET_FEATURES:
+            if (msg.size != sizeof(msg.u64)) {
+                error_report("Received bad msg size.");
+                errno = EPROTO;
+                return -1;
+            }
+            *((uint64_t *) arg) = msg.u64;
+            break;
+        case VHOST_USER_GET_VRING_BASE:
+            if (msg.size != sizeof(msg.state)) {
+                error_report("Received bad msg size.");
+                errno = EPROTO;
+                return -1;
+            }
+            memcpy(arg, &msg.state, sizeof(struct vhost_vring_state));
+            break;
+        default:
+            error_report("Received unexpected msg type.");
+            errno = EPROTO;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int vhost_user_init(struct vhost_dev *dev, int fd)
+{
+    assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
+
+    if (fd < 0) {
+        error_report("vhost-user requires a connected socket");
+        return -1;
+    }
+
+    dev->control = fd;
+    return 0;
+}
+
+static int vhost_user_cleanup(struct vhost_dev *dev)
+{
+    assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
+
+    return close(dev->control);
+}
+
+const VhostOps user_ops = {
+    .backend_type = VHOST_BACKEND_TYPE_USER,
+    .vhost_call = vhost_user_call,
+    .vhost_backend_init = vhost_user_init,
+    .vhost_backend_cleanup = vhost_user_cleanup
+};
@@ -13,13 +13,37 @@
  * GNU GPL, version 2 or (at your option) any later version.
  */
 
-#include <sys/ioctl.h>
 #include "vhost.h"
 #include "hw/hw.h"
 #include "range.h"
+#include "host-utils.h"
 #include <linux/vhost.h>
 #include "exec-memory.h"
 
+/* Number of log words checked for dirty pages with a single test */
+#define VHOST_LOG_SKIP 64
+
+/* Mark the pages set in one log word dirty, one call per run of pages */
+static void vhost_dev_set_dirty(MemoryRegionSection *section, uint64_t addr,
+                                vhost_log_chunk_t log)
+{
+    uint64_t bits = log;
+
+    while (bits) {
+        int first = ctz64(bits);
+        int n = cto64(bits >> first);
+        hwaddr mr_offset = addr + first * VHOST_LOG_PAGE -
+                           section->offset_within_address_space +
+                           section->offset_within_region;
+
+        memory_region_set_dirty(section->mr, mr_offset, n * VHOST_LOG_PAGE);
+        if (first + n >= VHOST_LOG_BITS) {
+            break;
+        }
+        bits &= ~0ull << (first + n);
+    }
+}
+
 static void vhost_dev_sync_region(struct vhost_dev *dev,
                                   MemoryRegionSection *section,
                                   uint64_t mfirst, uint64_t mlast,
@@ -38,27 +62,38 @@ static void vhost_dev_sync_region(struct vhost_dev *dev,
     assert(start / VHOST_LOG_CHUNK < dev->log_size);
 
     for (;from < to; ++from) {
-        vhost_log_chunk_t log;
-        int bit;
-        /* We first check with non-atomic: much cheaper,
-         * and we expect non-dirty to be the common case. */
+        vhost_log_chunk_t log, mask = ~(vhost_log_chunk_t)0;
+
+        /* Clean stretches of the log are skipped a block of words at a
+         * time.  We first check with non-atomic reads: much cheaper, and
+         * we expect non-dirty to be the common case. */
+        if (to - from >= VHOST_LOG_SKIP &&
+            buffer_is_zero(from, VHOST_LOG_SKIP * sizeof(*from))) {
+            from += VHOST_LOG_SKIP - 1;
+            addr += VHOST_LOG_SKIP * VHOST_LOG_CHUNK;
+            continue;
+        }
         if (!*from) {
             addr += VHOST_LOG_CHUNK;
             continue;
         }
+
+        /* Only take the pages of this range out of the log, the first and
+         * last word may be shared with neighbouring sections. */
+        if (addr < start) {
+            mask &= ~(vhost_log_chunk_t)0 << (start - addr) / VHOST_LOG_PAGE;
+        }
+        if (end - addr < VHOST_LOG_CHUNK - 1) {
+            mask &= ~(vhost_log_chunk_t)0 >>
+                    (VHOST_LOG_BITS - 1 - (end - addr) / VHOST_LOG_PAGE);
+        }
+
         /* Data must be read atomically. We don't really
          * need the barrier semantics of __sync
          * builtins, but it's easier to use them than
          * roll our own. */
-        log = __sync_fetch_and_and(from, 0);
-        while ((bit = sizeof(log) > sizeof(int) ?
-                ffsll(log) : ffs(log))) {
-            ram_addr_t ram_addr;
-            bit -= 1;
-            ram_addr = section->offset_within_region + bit * VHOST_LOG_PAGE;
-            memory_region_set_dirty(section->mr, ram_addr, VHOST_LOG_PAGE);
-            log &= ~(0x1ull << bit);
-        }
+        log = __sync_fetch_and_and(from, ~mask) & mask;
+        vhost_dev_set_dirty(section, addr, log);
         addr += VHOST_LOG_CHUNK;
     }
 }
@@ -68,11 +103,17 @@ static int vhost_sync_dirty_bitmap(struct vhost_dev *dev,
                                    hwaddr start_addr,
                                    hwaddr end_addr)
 {
+    hwaddr section_first = section->offset_within_address_space;
     int i;
 
-    if (!dev->log_enabled || !dev->started) {
+    if (!dev->log_enabled || !dev->started || !section->size) {
         return 0;
     }
+
+    /* Pages outside the section belong to other memory regions */
+    start_addr = MAX(start_addr, section_first);
+    end_addr = MIN(end_addr, range_get_last(section_first, section->size));
+
     for (i = 0; i < dev->mem->nregions; ++i) {
         struct vhost_memory_region *reg = dev->mem->regions + i;
         vhost_dev_sync_region(dev, section, start_addr, end_addr,
@@ -94,7 +135,7 @@ static void vhost_log_sync(MemoryListener *listener,
     struct vhost_dev *dev = container_of(listener, struct vhost_dev,
                                          memory_listener);
     hwaddr start_addr = section->offset_within_address_space;
-    hwaddr end_addr = start_addr + section->size;
+    hwaddr end_addr = range_get_last(start_addr, section->size);
 
     vhost_sync_dirty_bitmap(dev, section, start_addr, end_addr);
 }
@@ -275,7 +316,7 @@ static inline void vhost_dev_log_resize(struct vhost_dev* dev, uint64_t size)
         log = NULL;
     }
     log_base = (uint64_t)(unsigned long)log;
-    r = ioctl(dev->control, VHOST_SET_LOG_BASE, &log_base);
+    r = dev->vhost_ops->vhost_call(dev, VHOST_SET_LOG_BASE, &log_base);
     assert(r >= 0);
     for (i = 0; i < dev->n_mem_sections; ++i) {
         /* Sync only the range covered by the old log */
@@ -412,7 +453,7 @@ static void vhost_set_memory(MemoryListener *listener,
     }
 
     if (!dev->log_enabled) {
-        r = ioctl(dev->control, VHOST_SET_MEM_TABLE, dev->mem);
+        r = dev->vhost_ops->vhost_call(dev, VHOST_SET_MEM_TABLE, dev->mem);
         assert(r >= 0);
         return;
     }
@@ -424,7 +465,7 @@ static void vhost_set_memory(MemoryListener *listener,
     if (dev->log_size < log_size) {
         vhost_dev_log_resize(dev, log_size + VHOST_LOG_BUFFER);
     }
-    r = ioctl(dev->control, VHOST_SET_MEM_TABLE, dev->mem);
+    r = dev->vhost_ops->vhost_call(dev, VHOST_SET_MEM_TABLE, dev->mem);
     assert(r >= 0);
     /* To log less, can only decrease log size after table update. */
     if (dev->log_size > log_size + VHOST_LOG_BUFFER) {
@@ -502,7 +543,7 @@ static int vhost_virtqueue_set_addr(struct vhost_dev *dev,
         .log_guest_addr = vq->used_phys,
         .flags = enable_log ? (1 << VHOST_VRING_F_LOG) : 0,
     };
-    int r = ioctl(dev->control, VHOST_SET_VRING_ADDR, &addr);
+    int r = dev->vhost_ops->vhost_call(dev, VHOST_SET_VRING_ADDR, &addr);
     if (r < 0) {
         return -errno;
     }
@@ -516,7 +557,7 @@ static int vhost_dev_set_features(struct vhost_dev *dev, bool enable_log)
     if (enable_log) {
         features |= 0x1 << VHOST_F_LOG_ALL;
     }
-    r = ioctl(dev->control, VHOST_SET_FEATURES, &features);
+    r = dev->vhost_ops->vhost_call(dev, VHOST_SET_FEATURES, &features);
     return r < 0 ? -errno : 0;
 }
 
@@ -619,22 +660,23 @@ static int vhost_virtqueue_init(struct vhost_dev *dev,
 {
     hwaddr s, l, a;
     int r;
+    int vhost_vq_index = idx - dev->vq_index;
     struct vhost_vring_file file = {
-        .index = idx,
+        .index = vhost_vq_index
     };
     struct vhost_vring_state state = {
-        .index = idx,
+        .index = vhost_vq_index
     };
     struct VirtQueue *vvq = virtio_get_queue(vdev, idx);
 
     vq->num = state.num = virtio_queue_get_num(vdev, idx);
-    r = ioctl(dev->control, VHOST_SET_VRING_NUM, &state);
+    r = dev->vhost_ops->vhost_call(dev, VHOST_SET_VRING_NUM, &state);
     if (r) {
         return -errno;
     }
 
     state.num = virtio_queue_get_last_avail_idx(vdev, idx);
-    r = ioctl(dev->control, VHOST_SET_VRING_BASE, &state);
+    r = dev->vhost_ops->vhost_call(dev, VHOST_SET_VRING_BASE, &state);
     if (r) {
         return -errno;
     }
@@ -669,20 +711,20 @@ static int vhost_virtqueue_init(struct vhost_dev *dev,
         goto fail_alloc_ring;
     }
 
-    r = vhost_virtqueue_set_addr(dev, vq, idx, dev->log_enabled);
+    r = vhost_virtqueue_set_addr(dev, vq, vhost_vq_index, dev->log_enabled);
     if (r < 0) {
         r = -errno;
         goto fail_alloc;
     }
     file.fd = event_notifier_get_fd(virtio_queue_get_host_notifier(vvq));
-    r = ioctl(dev->control, VHOST_SET_VRING_KICK, &file);
+    r = dev->vhost_ops->vhost_call(dev, VHOST_SET_VRING_KICK, &file);
     if (r) {
         r = -errno;
         goto fail_kick;
     }
 
     file.fd = event_notifier_get_fd(virtio_queue_get_guest_notifier(vvq));
-    r = ioctl(dev->control, VHOST_SET_VRING_CALL, &file);
+    r = dev->vhost_ops->vhost_call(dev, VHOST_SET_VRING_CALL, &file);
     if (r) {
         r = -errno;
         goto fail_call;
@@ -714,10 +756,10 @@ static void vhost_virtqueue_cleanup(struct vhost_dev *dev,
                                     unsigned idx)
 {
     struct vhost_vring_state state = {
-        .index = idx,
+        .index = idx - dev->vq_index,
     };
     int r;
-    r = ioctl(dev->control, VHOST_GET_VRING_BASE, &state);
+    r = dev->vhost_ops->vhost_call(dev, VHOST_GET_VRING_BASE, &state);
     if (r < 0) {
         fprintf(stderr, "vhost VQ %d ring restore failed: %d\n", idx, r);
         fflush(stderr);
@@ -747,24 +789,30 @@ static void vhost_eventfd_del(MemoryListener *listener,
 }
 
 int vhost_dev_init(struct vhost_dev *hdev, int devfd, const char *devpath,
-                   bool force)
+                   VhostBackendType backend_type, bool force)
 {
     uint64_t features;
     int r;
-    if (devfd >= 0) {
-        hdev->control = devfd;
-    } else {
-        hdev->control = open(devpath, O_RDWR);
-        if (hdev->control < 0) {
+
+    if (vhost_set_backend_type(hdev, backend_type) < 0) {
+        return -EINVAL;
+    }
+    if (devfd < 0 && backend_type == VHOST_BACKEND_TYPE_KERNEL) {
+        devfd = open(devpath, O_RDWR);
+        if (devfd < 0) {
             return -errno;
         }
     }
-    r = ioctl(hdev->control, VHOST_SET_OWNER, NULL);
+    if (hdev->vhost_ops->vhost_backend_init(hdev, devfd) < 0) {
+        return -EINVAL;
+    }
+
+    r = hdev->vhost_ops->vhost_call(hdev, VHOST_SET_OWNER, NULL);
     if (r < 0) {
         goto fail;
     }
 
-    r = ioctl(hdev->control, VHOST_GET_FEATURES, &features);
+    r = hdev->vhost_ops->vhost_call(hdev, VHOST_GET_FEATURES, &features);
     if (r < 0) {
         goto fail;
     }
@@ -797,7 +845,7 @@ int vhost_dev_init(struct vhost_dev *hdev, int devfd, const char *devpath,
     return 0;
 fail:
     r = -errno;
-    close(hdev->control);
+    hdev->vhost_ops->vhost_backend_cleanup(hdev);
     return r;
 }
 
@@ -806,7 +854,7 @@ void vhost_dev_cleanup(struct vhost_dev *hdev)
     memory_listener_unregister(&hdev->memory_listener);
     g_free(hdev->mem);
     g_free(hdev->mem_sections);
-    close(hdev->control);
+    hdev->vhost_ops->vhost_backend_cleanup(hdev);
 }
 
 bool vhost_dev_query(struct vhost_dev *hdev, VirtIODevice *vdev)
@@ -829,7 +877,8 @@ int vhost_dev_enable_notifiers(struct vhost_dev *hdev, VirtIODevice *vdev)
     }
 
     for (i = 0; i < hdev->nvqs; ++i) {
-        r = vdev->binding->set_host_notifier(vdev->binding_opaque, i, true);
+        r = vdev->binding->set_host_notifier(vdev->binding_opaque,
+                                             hdev->vq_index + i, true);
         if (r < 0) {
             fprintf(stderr, "vhost VQ %d notifier binding failed: %d\n", i, -r);
             goto fail_vq;
@@ -839,7 +888,8 @@ int vhost_dev_enable_notifiers(struct vhost_dev *hdev, VirtIODevice *vdev)
     return 0;
 fail_vq:
     while (--i >= 0) {
-        r = vdev->binding->set_host_notifier(vdev->binding_opaque, i, false);
+        r = vdev->binding->set_host_notifier(vdev->binding_opaque,
+                                             hdev->vq_index + i, false);
         if (r < 0) {
             fprintf(stderr, "vhost VQ %d notifier cleanup error: %d\n", i, -r);
             fflush(stderr);
@@ -860,7 +910,8 @@ void vhost_dev_disable_notifiers(struct vhost_dev *hdev, VirtIODevice *vdev)
     int i, r;
 
     for (i = 0; i < hdev->nvqs; ++i) {
-        r = vdev->binding->set_host_notifier(vdev->binding_opaque, i, false);
+        r = vdev->binding->set_host_notifier(vdev->binding_opaque,
+                                             hdev->vq_index + i, false);
         if (r < 0) {
             fprintf(stderr, "vhost VQ %d notifier cleanup failed: %d\n", i, -r);
             fflush(stderr);
@@ -869,27 +920,19 @@ void vhost_dev_disable_notifiers(struct vhost_dev *hdev, VirtIODevice *vdev)
     }
 }
 
-/* Host notifiers must be enabled at this point. */
+/* Host notifiers must be enabled at this point.  Guest notifiers are
+ * bound by the caller, who may share them among several vhost devices.
+ */
 int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev)
 {
+    uint64_t log_base;
     int i, r;
-    if (!vdev->binding->set_guest_notifiers) {
-        fprintf(stderr, "binding does not support guest notifiers\n");
-        r = -ENOSYS;
-        goto fail;
-    }
-
-    r = vdev->binding->set_guest_notifiers(vdev->binding_opaque, true);
-    if (r < 0) {
-        fprintf(stderr, "Error binding guest notifier: %d\n", -r);
-        goto fail_notifiers;
-    }
 
     r = vhost_dev_set_features(hdev, hdev->log_enabled);
     if (r < 0) {
         goto fail_features;
     }
-    r = ioctl(hdev->control, VHOST_SET_MEM_TABLE, hdev->mem);
+    r = hdev->vhost_ops->vhost_call(hdev, VHOST_SET_MEM_TABLE, hdev->mem);
     if (r < 0) {
         r = -errno;
         goto fail_mem;
@@ -898,7 +941,7 @@ int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev)
         r = vhost_virtqueue_init(hdev,
                                  vdev,
                                  hdev->vqs + i,
-                                 i);
+                                 hdev->vq_index + i);
         if (r < 0) {
             goto fail_vq;
         }
@@ -908,8 +951,9 @@ int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev)
         hdev->log_size = vhost_get_log_size(hdev);
         hdev->log = hdev->log_size ?
             g_malloc0(hdev->log_size * sizeof *hdev->log) : NULL;
-        r = ioctl(hdev->control, VHOST_SET_LOG_BASE,
-                  (uint64_t)(unsigned long)hdev->log);
+        log_base = (uint64_t)(unsigned long)hdev->log;
+        r = hdev->vhost_ops->vhost_call(hdev, VHOST_SET_LOG_BASE,
+                                        &log_base);
         if (r < 0) {
             r = -errno;
             goto fail_log;
@@ -925,37 +969,28 @@ fail_vq:
         vhost_virtqueue_cleanup(hdev,
                                 vdev,
                                 hdev->vqs + i,
-                                i);
+                                hdev->vq_index + i);
     }
 fail_mem:
 fail_features:
-    vdev->binding->set_guest_notifiers(vdev->binding_opaque, false);
-fail_notifiers:
-fail:
     return r;
 }
 
 /* Host notifiers must be enabled at this point. */
 void vhost_dev_stop(struct vhost_dev *hdev, VirtIODevice *vdev)
 {
-    int i, r;
+    int i;
 
     for (i = 0; i < hdev->nvqs; ++i) {
         vhost_virtqueue_cleanup(hdev,
                                 vdev,
                                 hdev->vqs + i,
-                                i);
+                                hdev->vq_index + i);
     }
     for (i = 0; i < hdev->n_mem_sections; ++i) {
         vhost_sync_dirty_bitmap(hdev, &hdev->mem_sections[i],
                                 0, (hwaddr)~0x0ull);
     }
-    r = vdev->binding->set_guest_notifiers(vdev->binding_opaque, false);
-    if (r < 0) {
-        fprintf(stderr, "vhost guest notifier cleanup failed: %d\n", r);
-        fflush(stderr);
-    }
-    assert (r >= 0);
 
     hdev->started = false;
     g_free(hdev->log);
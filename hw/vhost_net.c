@@ -15,6 +15,7 @@
 
 #include "net.h"
 #include "net/tap.h"
+#include "net/vhost-user.h"
 
 #include "virtio-net.h"
 #include "vhost_net.h"
@@ -92,7 +93,7 @@ static int vhost_net_get_fd(NetClientState *backend)
 }
 
 struct vhost_net *vhost_net_init(NetClientState *backend, int devfd,
-                                 bool force)
+                                 VhostBackendType backend_type, bool force)
 {
     int r;
     struct vhost_net *net = g_malloc(sizeof *net);
@@ -100,20 +101,29 @@ struct vhost_net *vhost_net_init(NetClientState *backend, int devfd,
         fprintf(stderr, "vhost-net requires backend to be setup\n");
         goto fail;
     }
-    r = vhost_net_get_fd(backend);
-    if (r < 0) {
-        goto fail;
-    }
     net->nc = backend;
-    net->dev.backend_features = tap_has_vnet_hdr(backend) ? 0 :
-        (1 << VHOST_NET_F_VIRTIO_NET_HDR);
-    net->backend = r;
 
-    r = vhost_dev_init(&net->dev, devfd, "/dev/vhost-net", force);
+    if (backend_type == VHOST_BACKEND_TYPE_KERNEL) {
+        r = vhost_net_get_fd(backend);
+        if (r < 0) {
+            goto fail;
+        }
+        net->dev.backend_features = tap_has_vnet_hdr(backend) ? 0 :
+            (1 << VHOST_NET_F_VIRTIO_NET_HDR);
+        net->backend = r;
+    } else {
+        /* The userspace backend handles the virtio-net header itself */
+        net->dev.backend_features = 0;
+        net->backend = -1;
+    }
+
+    r = vhost_dev_init(&net->dev, devfd, "/dev/vhost-net", backend_type,
+                       force);
     if (r < 0) {
         goto fail;
     }
-    if (!tap_has_vnet_hdr_len(backend,
+    if (backend_type == VHOST_BACKEND_TYPE_KERNEL &&
+        !tap_has_vnet_hdr_len(backend,
                               sizeof(struct virtio_net_hdr_mrg_rxbuf))) {
         net->dev.features &= ~(1 << VIRTIO_NET_F_MRG_RXBUF);
     }
@@ -137,14 +147,20 @@ bool vhost_net_query(VHostNetState *net, VirtIODevice *dev)
     return vhost_dev_query(&net->dev, dev);
 }
 
-int vhost_net_start(struct vhost_net *net,
-                    VirtIODevice *dev)
+static int vhost_net_start_one(struct vhost_net *net,
+                               VirtIODevice *dev,
+                               int vq_index)
 {
     struct vhost_vring_file file = { };
     int r;
 
+    if (net->dev.started) {
+        return 0;
+    }
+
     net->dev.nvqs = 2;
     net->dev.vqs = net->vqs;
+    net->dev.vq_index = vq_index;
 
     r = vhost_dev_enable_notifiers(&net->dev, dev);
     if (r < 0) {
@@ -156,11 +172,17 @@ int vhost_net_start(struct vhost_net *net,
         goto fail_start;
     }
 
+    if (net->dev.vhost_ops->backend_type != VHOST_BACKEND_TYPE_KERNEL) {
+        /* vhost-user backends have no tap device to attach */
+        return 0;
+    }
+
     net->nc->info->poll(net->nc, false);
     qemu_set_fd_handler(net->backend, NULL, NULL, NULL);
     file.fd = net->backend;
     for (file.index = 0; file.index < net->dev.nvqs; ++file.index) {
-        r = ioctl(net->dev.control, VHOST_NET_SET_BACKEND, &file);
+        r = net->dev.vhost_ops->vhost_call(&net->dev, VHOST_NET_SET_BACKEND,
+                                           &file);
         if (r < 0) {
             r = -errno;
             goto fail;
@@ -170,7 +192,8 @@ int vhost_net_start(struct vhost_net *net,
 fail:
     file.fd = -1;
     while (file.index-- > 0) {
-        int r = ioctl(net->dev.control, VHOST_NET_SET_BACKEND, &file);
+        int r = net->dev.vhost_ops->vhost_call(&net->dev,
+                                               VHOST_NET_SET_BACKEND, &file);
         assert(r >= 0);
     }
     net->nc->info->poll(net->nc, true);
@@ -181,20 +204,85 @@ fail_notifiers:
     return r;
 }
 
-void vhost_net_stop(struct vhost_net *net,
-                    VirtIODevice *dev)
+static void vhost_net_stop_one(struct vhost_net *net,
+                               VirtIODevice *dev)
 {
     struct vhost_vring_file file = { .fd = -1 };
 
-    for (file.index = 0; file.index < net->dev.nvqs; ++file.index) {
-        int r = ioctl(net->dev.control, VHOST_NET_SET_BACKEND, &file);
-        assert(r >= 0);
+    if (!net->dev.started) {
+        return;
+    }
+
+    if (net->dev.vhost_ops->backend_type == VHOST_BACKEND_TYPE_KERNEL) {
+        for (file.index = 0; file.index < net->dev.nvqs; ++file.index) {
+            int r = net->dev.vhost_ops->vhost_call(&net->dev,
+                                                   VHOST_NET_SET_BACKEND,
+                                                   &file);
+            assert(r >= 0);
+        }
+        net->nc->info->poll(net->nc, true);
     }
-    net->nc->info->poll(net->nc, true);
     vhost_dev_stop(&net->dev, dev);
     vhost_dev_disable_notifiers(&net->dev, dev);
 }
 
+/* Start one vhost-net device per queue pair.  Queue pair i of the NIC uses
+ * virtqueues 2 * i and 2 * i + 1.  The guest notifiers of all of them are
+ * bound at once, before the backends are given the call eventfds.
+ */
+int vhost_net_start(VirtIODevice *dev, NetClientState *ncs,
+                    int total_queues)
+{
+    int r, i = 0;
+
+    if (!dev->binding->set_guest_notifiers) {
+        error_report("binding does not support guest notifiers");
+        r = -ENOSYS;
+        goto err;
+    }
+
+    r = dev->binding->set_guest_notifiers(dev->binding_opaque, true);
+    if (r < 0) {
+        error_report("Error binding guest notifier: %d", -r);
+        goto err;
+    }
+
+    for (i = 0; i < total_queues; i++) {
+        r = vhost_net_start_one(get_vhost_net(ncs[i].peer), dev, i * 2);
+        if (r < 0) {
+            goto err_start;
+        }
+    }
+
+    return 0;
+
+err_start:
+    while (--i >= 0) {
+        vhost_net_stop_one(get_vhost_net(ncs[i].peer), dev);
+    }
+    r = dev->binding->set_guest_notifiers(dev->binding_opaque, false);
+    assert(r >= 0);
+err:
+    return r;
+}
+
+void vhost_net_stop(VirtIODevice *dev, NetClientState *ncs,
+                    int total_queues)
+{
+    int i, r;
+
+    for (i = 0; i < total_queues; i++) {
+        vhost_net_stop_one(get_vhost_net(ncs[i].peer), dev);
+    }
+
+    r = dev->binding->set_guest_notifiers(dev->binding_opaque, false);
+    if (r < 0) {
+        fprintf(stderr, "vhost guest notifier cleanup failed: %d\n", r);
+        fflush(stderr);
+    }
+    assert(r >= 0);
+}
+
 void vhost_net_cleanup(struct vhost_net *net)
 {
     vhost_dev_cleanup(&net->dev);
@@ -202,7 +290,7 @@ void vhost_net_cleanup(struct vhost_net *net)
 }
 #else
 struct vhost_net *vhost_net_init(NetClientState *backend, int devfd,
-                                 bool force)
+                                 VhostBackendType backend_type, bool force)
 {
     error_report("vhost-net support is not compiled in");
     return NULL;
@@ -213,13 +301,13 @@ bool vhost_net_query(VHostNetState *net, VirtIODevice *dev)
     return false;
 }
 
-int vhost_net_start(struct vhost_net *net,
-		    VirtIODevice *dev)
+int vhost_net_start(VirtIODevice *dev, NetClientState *ncs,
+                    int total_queues)
 {
     return -ENOSYS;
 }
-void vhost_net_stop(struct vhost_net *net,
-		    VirtIODevice *dev)
+void vhost_net_stop(VirtIODevice *dev, NetClientState *ncs,
+                    int total_queues)
 {
 }
 
@@ -235,3 +323,27 @@ void vhost_net_ack_features(struct vhost_net *net, unsigned features)
 {
 }
 #endif
+
+VHostNetState *get_vhost_net(NetClientState *nc)
+{
+    VHostNetState *vhost_net = NULL;
+
+    if (!nc) {
+        return NULL;
+    }
+
+    switch (nc->info->type) {
+    case NET_CLIENT_OPTIONS_KIND_TAP:
+        vhost_net = tap_get_vhost_net(nc);
+        break;
+#ifdef CONFIG_VHOST_NET
+    case NET_CLIENT_OPTIONS_KIND_VHOST_USER:
+        vhost_net = vhost_user_get_vhost_net(nc);
+        break;
+#endif
+    default:
+        break;
+    }
+
+    return vhost_net;
+}
@@ -22,6 +22,10 @@
 #include "virtio-balloon.h"
 #include "kvm.h"
 #include "exec-memory.h"
+#include "migration.h"
+#include "trace.h"
+#include "qemu-timer.h"
+#include "sysemu.h"
 
 #if defined(__linux__)
 #include <sys/mman.h>
@@ -30,12 +34,15 @@
 typedef struct VirtIOBalloon
 {
     VirtIODevice vdev;
-    VirtQueue *ivq, *dvq, *svq;
+    VirtQueue *ivq, *dvq, *svq, *rvq;
     uint32_t num_pages;
     uint32_t actual;
     uint64_t stats[VIRTIO_BALLOON_S_NR];
     VirtQueueElement stats_vq_elem;
     size_t stats_vq_offset;
+    bool stats_vq_elem_pending;
+    VirtIOBalloonConf conf;
+    QEMUTimer *auto_timer;
     DeviceState *qdev;
 } VirtIOBalloon;
 
@@ -53,6 +60,37 @@ static void balloon_page(void *addr, int deflate)
 #endif
 }
 
+/* Drop a free range reported by the guest: give the memory back to the
+ * host and keep migration from sending it.  Only whole host pages are
+ * discarded.
+ */
+static void balloon_discard_range(hwaddr pa, hwaddr len)
+{
+    MemoryRegionSection section;
+    hwaddr start = HOST_PAGE_ALIGN(pa);
+    hwaddr end = (pa + len) & qemu_host_page_mask;
+
+    if (start >= end) {
+        return;
+    }
+    section = memory_region_find(get_system_memory(), start, end - start);
+    if (!section.size || !memory_region_is_ram(section.mr) ||
+        memory_region_is_rom(section.mr)) {
+        return;
+    }
+
+    trace_virtio_balloon_discard_range(start, section.size);
+#if defined(__linux__)
+    if (!kvm_enabled() || kvm_has_sync_mmu()) {
+        qemu_madvise(memory_region_get_ram_ptr(section.mr) +
+                     section.offset_within_region,
+                     section.size, QEMU_MADV_DONTNEED);
+    }
+#endif
+    ram_discard_free_range(section.mr, section.offset_within_region,
+                           section.size);
+}
+
 /*
  * reset_stats - Mark all items in the stats array as unset
  *
@@ -101,6 +139,114 @@ static void virtio_balloon_handle_output(VirtIODevice *vdev, VirtQueue *vq)
     }
 }
 
+/* Each element carries a batch of free ranges, one per writable buffer,
+ * which the guest keeps off its free lists until the element is returned.
+ */
+static void virtio_balloon_handle_report(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtQueueElement elem;
+    bool notify = false;
+    unsigned int i;
+
+    while (virtqueue_pop(vq, &elem)) {
+        for (i = 0; i < elem.in_num; i++) {
+            balloon_discard_range(elem.in_addr[i], elem.in_sg[i].iov_len);
+        }
+        virtqueue_push(vq, &elem, 0);
+        notify = true;
+    }
+    if (notify) {
+        virtio_notify(vdev, vq);
+    }
+}
+
+static void virtio_balloon_to_target(void *opaque, ram_addr_t target);
+
+/* Host memory that could be handed to guests without swapping, in bytes,
+ * or -1 if unknown.
+ */
+static int64_t host_mem_available(void)
+{
+#if defined(__linux__)
+    char line[128];
+    int64_t avail = -1, memfree = -1, cached = 0;
+    unsigned long long kb;
+    FILE *f;
+
+    f = fopen("/proc/meminfo", "r");
+    if (!f) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "MemAvailable: %llu kB", &kb) == 1) {
+            avail = kb << 10;
+        } else if (sscanf(line, "MemFree: %llu kB", &kb) == 1) {
+            memfree = kb << 10;
+        } else if (sscanf(line, "Cached: %llu kB", &kb) == 1) {
+            cached = kb << 10;
+        }
+    }
+    fclose(f);
+    if (avail < 0 && memfree >= 0) {
+        avail = memfree + cached;
+    }
+    return avail;
+#else
+    return -1;
+#endif
+}
+
+/*
+ * Move the guest towards the size its own free memory and the host's
+ * memory pressure call for.  The guest is squeezed while the host is short
+ * of memory, handed memory back when it runs low itself or once the host
+ * has plenty again, and never moves by more than 1/16 of its RAM per poll.
+ */
+static void virtio_balloon_auto_adjust(VirtIOBalloon *s)
+{
+    uint64_t guest_free = s->stats[VIRTIO_BALLOON_S_MEMFREE];
+    uint64_t size = ram_size - ((uint64_t)s->actual << VIRTIO_BALLOON_PFN_SHIFT);
+    uint64_t reserve = (uint64_t)s->conf.auto_reserve << 20;
+    uint64_t host_low = (uint64_t)s->conf.auto_host_low << 20;
+    uint64_t step = ram_size / 16;
+    uint64_t target = size;
+    int64_t host_avail;
+
+    if (guest_free == (uint64_t)-1) {
+        return;
+    }
+
+    host_avail = host_mem_available();
+    if (host_avail >= 0 && host_avail < host_low) {
+        if (guest_free > reserve) {
+            target = size - MIN(step, (guest_free - reserve) / 2);
+        }
+    } else if (guest_free < reserve ||
+               host_avail < 0 || host_avail >= 2 * host_low) {
+        target = MIN(ram_size, size + step);
+    }
+
+    trace_virtio_balloon_auto(size, guest_free, host_avail, target);
+    target &= TARGET_PAGE_MASK;
+    if (target != (size & TARGET_PAGE_MASK)) {
+        virtio_balloon_to_target(s, target);
+    }
+}
+
+/* Ask the guest for fresh statistics by returning the buffer it left */
+static void virtio_balloon_auto_poll(void *opaque)
+{
+    VirtIOBalloon *s = opaque;
+
+    if (s->stats_vq_elem_pending) {
+        s->stats_vq_elem_pending = false;
+        virtqueue_push(s->svq, &s->stats_vq_elem, s->stats_vq_offset);
+        virtio_notify(&s->vdev, s->svq);
+    }
+    qemu_mod_timer(s->auto_timer, qemu_get_clock_ms(vm_clock) +
+                   s->conf.auto_interval * 1000LL);
+}
+
 static void virtio_balloon_receive_stats(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOBalloon *s = DO_UPCAST(VirtIOBalloon, vdev, vdev);
@@ -128,6 +274,12 @@ static void virtio_balloon_receive_stats(VirtIODevice *vdev, VirtQueue *vq)
             s->stats[tag] = val;
     }
     s->stats_vq_offset = offset;
+    s->stats_vq_elem_pending = true;
+
+    /* not while an incoming migration restores the held buffer */
+    if (s->conf.auto_interval && runstate_is_running()) {
+        virtio_balloon_auto_adjust(s);
+    }
 }
 
 static void virtio_balloon_get_config(VirtIODevice *vdev, uint8_t *config_data)
@@ -228,10 +380,25 @@ static int virtio_balloon_load(QEMUFile *f, void *opaque, int version_id)
 
     s->num_pages = qemu_get_be32(f);
     s->actual = qemu_get_be32(f);
+
+    /* The stats buffer the source was holding is not migrated; pop it
+     * again so that polling can go on.
+     */
+    if ((s->vdev.guest_features & (1 << VIRTIO_BALLOON_F_STATS_VQ)) &&
+        virtqueue_rewind(s->svq, 1)) {
+        virtio_balloon_receive_stats(&s->vdev, s->svq);
+    }
     return 0;
 }
 
-VirtIODevice *virtio_balloon_init(DeviceState *dev)
+static void virtio_balloon_reset(VirtIODevice *vdev)
+{
+    VirtIOBalloon *s = DO_UPCAST(VirtIOBalloon, vdev, vdev);
+
+    s->stats_vq_elem_pending = false;
+}
+
+VirtIODevice *virtio_balloon_init(DeviceState *dev, VirtIOBalloonConf *conf)
 {
     VirtIOBalloon *s;
     int ret;
@@ -243,6 +410,8 @@ VirtIODevice *virtio_balloon_init(DeviceState *dev)
     s->vdev.get_config = virtio_balloon_get_config;
     s->vdev.set_config = virtio_balloon_set_config;
     s->vdev.get_features = virtio_balloon_get_features;
+    s->vdev.reset = virtio_balloon_reset;
+    s->conf = *conf;
 
     ret = qemu_add_balloon_handler(virtio_balloon_to_target,
                                    virtio_balloon_stat, s);
@@ -254,9 +423,17 @@ VirtIODevice *virtio_balloon_init(DeviceState *dev)
     s->ivq = virtio_add_queue(&s->vdev, 128, virtio_balloon_handle_output);
     s->dvq = virtio_add_queue(&s->vdev, 128, virtio_balloon_handle_output);
     s->svq = virtio_add_queue(&s->vdev, 128, virtio_balloon_receive_stats);
+    s->rvq = virtio_add_queue(&s->vdev, 32, virtio_balloon_handle_report);
 
     reset_stats(s);
 
+    if (s->conf.auto_interval) {
+        s->auto_timer = qemu_new_timer_ms(vm_clock, virtio_balloon_auto_poll,
+                                          s);
+        qemu_mod_timer(s->auto_timer, qemu_get_clock_ms(vm_clock) +
+                       s->conf.auto_interval * 1000LL);
+    }
+
     s->qdev = dev;
     register_savevm(dev, "virtio-balloon", -1, 1,
                     virtio_balloon_save, virtio_balloon_load, s);
@@ -269,6 +446,10 @@ void virtio_balloon_exit(VirtIODevice *vdev)
     VirtIOBalloon *s = DO_UPCAST(VirtIOBalloon, vdev, vdev);
 
     qemu_remove_balloon_handler(s);
+    if (s->auto_timer) {
+        qemu_del_timer(s->auto_timer);
+        qemu_free_timer(s->auto_timer);
+    }
     unregister_savevm(s->qdev, "virtio-balloon", s);
     virtio_cleanup(vdev);
 }
@@ -26,6 +26,7 @@
 /* The feature bitmap for virtio balloon */
 #define VIRTIO_BALLOON_F_MUST_TELL_HOST 0 /* Tell before reclaiming pages */
 #define VIRTIO_BALLOON_F_STATS_VQ 1       /* Memory stats virtqueue */
+#define VIRTIO_BALLOON_F_FREE_PAGE_REPORTING 5 /* Free page ranges vq */
 
 /* Size of a PFN in the balloon interface. */
 #define VIRTIO_BALLOON_PFN_SHIFT 12
@@ -47,6 +48,13 @@ struct virtio_balloon_config
 #define VIRTIO_BALLOON_S_MEMTOT   5   /* Total amount of memory */
 #define VIRTIO_BALLOON_S_NR       6
 
+/* Automatic balloon sizing, driven by the stats virtqueue */
+struct VirtIOBalloonConf {
+    uint32_t auto_interval;         /* seconds between polls, 0 disables */
+    uint32_t auto_reserve;          /* MB the guest should keep free */
+    uint32_t auto_host_low;         /* MB host memory below which to inflate */
+};
+
 typedef struct VirtIOBalloonStat {
     uint16_t tag;
     uint64_t val;
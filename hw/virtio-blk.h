@@ -105,6 +105,10 @@ struct VirtIOBlkConf
     char *serial;
     uint32_t scsi;
     uint32_t config_wce;
+    uint32_t data_plane;
+    uint32_t poll_max_ns;
+    uint32_t poll_grow;
+    uint32_t poll_shrink;
 };
 
 #define DEFINE_VIRTIO_BLK_FEATURES(_state, _field) \
@@ -11,6 +11,7 @@
  */
 
 #include "qemu-char.h"
+#include "iov.h"
 #include "qemu-error.h"
 #include "trace.h"
 #include "virtio-serial.h"
@@ -49,9 +50,50 @@ static ssize_t flush_buf(VirtIOSerialPort *port, const uint8_t *buf, size_t len)
          */
         ret = 0;
     }
+    if (ret < len && qemu_chr_fe_write_blocked(vcon->chr)) {
+        /*
+         * The backend has queued what it could and will tell us when
+         * there is room again, so even consoles can wait for it
+         * instead of dropping data.
+         */
+        virtio_serial_throttle_port(port, true);
+    }
     return ret;
 }
 
+/* Same for a whole element, written with a single writev() where possible */
+static ssize_t flush_iov(VirtIOSerialPort *port, const struct iovec *iov,
+                         unsigned int iovcnt)
+{
+    VirtConsole *vcon = DO_UPCAST(VirtConsole, port, port);
+    size_t len = iov_size(iov, iovcnt);
+    ssize_t ret;
+
+    if (!vcon->chr) {
+        return len;
+    }
+
+    ret = qemu_chr_fe_writev(vcon->chr, iov, iovcnt);
+    trace_virtio_console_flush_buf(port->id, len, ret);
+
+    if (ret < 0) {
+        /* see flush_buf */
+        ret = 0;
+    }
+    if (ret < len && qemu_chr_fe_write_blocked(vcon->chr)) {
+        virtio_serial_throttle_port(port, true);
+    }
+    return ret;
+}
+
+/* The backend drained its output buffer */
+static void chr_write_ready(void *opaque)
+{
+    VirtConsole *vcon = opaque;
+
+    virtio_serial_throttle_port(&vcon->port, false);
+}
+
 /* Callback function that's called when the guest opens the port */
 static void guest_open(VirtIOSerialPort *port)
 {
@@ -119,6 +161,7 @@ static int virtconsole_initfn(VirtIOSerialPort *port)
     if (vcon->chr) {
         qemu_chr_add_handlers(vcon->chr, chr_can_read, chr_read, chr_event,
                               vcon);
+        qemu_chr_fe_set_write_ready(vcon->chr, chr_write_ready);
     }
 
     return 0;
@@ -137,6 +180,7 @@ static void virtconsole_class_init(ObjectClass *klass, void *data)
     k->is_console = true;
     k->init = virtconsole_initfn;
     k->have_data = flush_buf;
+    k->have_data_iov = flush_iov;
     k->guest_open = guest_open;
     k->guest_close = guest_close;
     dc->props = virtconsole_properties;
@@ -161,6 +205,7 @@ static void virtserialport_class_init(ObjectClass *klass, void *data)
 
     k->init = virtconsole_initfn;
     k->have_data = flush_buf;
+    k->have_data_iov = flush_iov;
     k->guest_open = guest_open;
     k->guest_close = guest_close;
     dc->props = virtserialport_properties;
@@ -175,11 +175,9 @@ static int virtio_pci_set_host_notifier_internal(VirtIOPCIProxy *proxy,
             return r;
         }
         virtio_queue_set_host_notifier_fd_handler(vq, true, set_handler);
-        memory_region_add_eventfd(&proxy->bar, VIRTIO_PCI_QUEUE_NOTIFY, 2,
-                                  true, n, notifier);
+        memory_region_add_eventfd(&proxy->notify, 0, 2, true, n, notifier);
     } else {
-        memory_region_del_eventfd(&proxy->bar, VIRTIO_PCI_QUEUE_NOTIFY, 2,
-                                  true, n, notifier);
+        memory_region_del_eventfd(&proxy->notify, 0, 2, true, n, notifier);
         virtio_queue_set_host_notifier_fd_handler(vq, false, false);
         event_notifier_cleanup(notifier);
     }
@@ -206,7 +204,9 @@ static void virtio_pci_start_ioeventfd(VirtIOPCIProxy *proxy)
             goto assign_error;
         }
     }
+    qemu_mutex_lock(&proxy->notify_lock);
     proxy->ioeventfd_started = true;
+    qemu_mutex_unlock(&proxy->notify_lock);
     return;
 
 assign_error:
@@ -231,6 +231,10 @@ static void virtio_pci_stop_ioeventfd(VirtIOPCIProxy *proxy)
         return;
     }
 
+    qemu_mutex_lock(&proxy->notify_lock);
+    proxy->ioeventfd_started = false;
+    qemu_mutex_unlock(&proxy->notify_lock);
+
     for (n = 0; n < VIRTIO_PCI_QUEUE_MAX; n++) {
         if (!virtio_queue_get_num(proxy->vdev, n)) {
             continue;
@@ -239,7 +243,6 @@ static void virtio_pci_stop_ioeventfd(VirtIOPCIProxy *proxy)
         r = virtio_pci_set_host_notifier_internal(proxy, n, false, false);
         assert(r >= 0);
     }
-    proxy->ioeventfd_started = false;
 }
 
 void virtio_pci_reset(DeviceState *d)
@@ -448,6 +451,53 @@ static const MemoryRegionOps virtio_pci_config_ops = {
     .endianness = DEVICE_LITTLE_ENDIAN,
 };
 
+static uint64_t virtio_pci_notify_read(void *opaque, hwaddr addr,
+                                       unsigned size)
+{
+    return 0xFFFFFFFF;
+}
+
+/* Queue notifications are dispatched without the global mutex.  Once
+ * ioeventfd is started they only reach us when KVM could not match the
+ * write in the kernel, and kicking the host notifier is enough; otherwise
+ * the queue is processed right away under the global mutex.
+ */
+static void virtio_pci_notify_write(void *opaque, hwaddr addr,
+                                    uint64_t val, unsigned size)
+{
+    VirtIOPCIProxy *proxy = opaque;
+    bool kicked = false;
+    bool locked;
+
+    if (addr != 0 || val >= VIRTIO_PCI_QUEUE_MAX) {
+        return;
+    }
+
+    qemu_mutex_lock(&proxy->notify_lock);
+    if (proxy->ioeventfd_started && virtio_queue_get_num(proxy->vdev, val)) {
+        VirtQueue *vq = virtio_get_queue(proxy->vdev, val);
+        event_notifier_set(virtio_queue_get_host_notifier(vq));
+        kicked = true;
+    }
+    qemu_mutex_unlock(&proxy->notify_lock);
+
+    if (!kicked) {
+        locked = qemu_mutex_lock_iothread_vcpu();
+        virtio_queue_notify(proxy->vdev, val);
+        qemu_mutex_unlock_iothread_vcpu(locked);
+    }
+}
+
+static const MemoryRegionOps virtio_pci_notify_ops = {
+    .read = virtio_pci_notify_read,
+    .write = virtio_pci_notify_write,
+    .impl = {
+        .min_access_size = 1,
+        .max_access_size = 4,
+    },
+    .endianness = DEVICE_LITTLE_ENDIAN,
+};
+
 static void virtio_write_config(PCIDevice *pci_dev, uint32_t address,
                                 uint32_t val, int len)
 {
@@ -470,32 +520,65 @@ static unsigned virtio_pci_get_features(void *opaque)
     return proxy->host_features;
 }
 
-static int kvm_virtio_pci_vq_vector_use(VirtIOPCIProxy *proxy,
-                                        unsigned int queue_no,
-                                        unsigned int vector,
-                                        MSIMessage msg)
+/* The MSI route of a vector is set up the first time the guest unmasks it
+ * and then kept until the guest notifiers are released, so that masking
+ * and unmasking only attach and detach the irqfds.  The route is rewritten
+ * only when the guest changes the message.
+ */
+static int kvm_virtio_pci_vector_route(VirtIOPCIProxy *proxy,
+                                       unsigned int vector, MSIMessage msg)
 {
-    VirtQueue *vq = virtio_get_queue(proxy->vdev, queue_no);
-    EventNotifier *n = virtio_queue_get_guest_notifier(vq);
     VirtIOIRQFD *irqfd = &proxy->vector_irqfd[vector];
     int ret;
 
-    if (irqfd->users == 0) {
+    if (irqfd->virq < 0) {
         ret = kvm_irqchip_add_msi_route(kvm_state, msg);
         if (ret < 0) {
             return ret;
         }
         irqfd->virq = ret;
+    } else if (irqfd->msg.address != msg.address ||
+               irqfd->msg.data != msg.data) {
+        ret = kvm_irqchip_update_msi_route(kvm_state, irqfd->virq, msg);
+        if (ret < 0) {
+            return ret;
+        }
     }
-    irqfd->users++;
+    irqfd->msg = msg;
+    return 0;
+}
 
-    ret = kvm_irqchip_add_irqfd_notifier(kvm_state, n, irqfd->virq);
-    if (ret < 0) {
-        if (--irqfd->users == 0) {
+static void kvm_virtio_pci_release_routes(VirtIOPCIProxy *proxy)
+{
+    int vector;
+
+    kvm_irqchip_begin_route_changes(kvm_state);
+    for (vector = 0; vector < msix_nr_vectors_allocated(&proxy->pci_dev);
+         vector++) {
+        VirtIOIRQFD *irqfd = &proxy->vector_irqfd[vector];
+
+        assert(irqfd->users == 0);
+        if (irqfd->virq >= 0) {
             kvm_irqchip_release_virq(kvm_state, irqfd->virq);
         }
+    }
+    kvm_irqchip_commit_route_changes(kvm_state);
+}
+
+static int kvm_virtio_pci_vq_vector_use(VirtIOPCIProxy *proxy,
+                                        unsigned int queue_no,
+                                        unsigned int vector)
+{
+    VirtQueue *vq = virtio_get_queue(proxy->vdev, queue_no);
+    EventNotifier *n = virtio_queue_get_guest_notifier(vq);
+    VirtIOIRQFD *irqfd = &proxy->vector_irqfd[vector];
+    int ret;
+
+    ret = kvm_irqchip_add_irqfd_notifier(kvm_state, n, irqfd->virq);
+    if (ret < 0) {
         return ret;
     }
+    irqfd->users++;
 
     virtio_queue_set_guest_notifier_fd_handler(vq, true, true);
     return 0;
@@ -512,10 +595,7 @@ static void kvm_virtio_pci_vq_vector_release(VirtIOPCIProxy *proxy,
 
     ret = kvm_irqchip_remove_irqfd_notifier(kvm_state, n, irqfd->virq);
     assert(ret == 0);
-
-    if (--irqfd->users == 0) {
-        kvm_irqchip_release_virq(kvm_state, irqfd->virq);
-    }
+    irqfd->users--;
 
     virtio_queue_set_guest_notifier_fd_handler(vq, true, false);
 }
@@ -527,6 +607,11 @@ static int kvm_virtio_pci_vector_use(PCIDevice *dev, unsigned vector,
     VirtIODevice *vdev = proxy->vdev;
     int ret, queue_no;
 
+    ret = kvm_virtio_pci_vector_route(proxy, vector, msg);
+    if (ret < 0) {
+        return ret;
+    }
+
     for (queue_no = 0; queue_no < VIRTIO_PCI_QUEUE_MAX; queue_no++) {
         if (!virtio_queue_get_num(vdev, queue_no)) {
             break;
@@ -534,7 +619,7 @@ static int kvm_virtio_pci_vector_use(PCIDevice *dev, unsigned vector,
         if (virtio_queue_vector(vdev, queue_no) != vector) {
             continue;
         }
-        ret = kvm_virtio_pci_vq_vector_use(proxy, queue_no, vector, msg);
+        ret = kvm_virtio_pci_vq_vector_use(proxy, queue_no, vector);
         if (ret < 0) {
             goto undo;
         }
@@ -603,6 +688,7 @@ static int virtio_pci_set_guest_notifiers(void *opaque, bool assign)
     /* Must unset vector notifier while guest notifier is still assigned */
     if (kvm_msi_via_irqfd_enabled() && !assign) {
         msix_unset_vector_notifiers(&proxy->pci_dev);
+        kvm_virtio_pci_release_routes(proxy);
         g_free(proxy->vector_irqfd);
         proxy->vector_irqfd = NULL;
     }
@@ -620,13 +706,24 @@ static int virtio_pci_set_guest_notifiers(void *opaque, bool assign)
 
     /* Must set vector notifier after guest notifier has been assigned */
     if (kvm_msi_via_irqfd_enabled() && assign) {
-        proxy->vector_irqfd =
-            g_malloc0(sizeof(*proxy->vector_irqfd) *
-                      msix_nr_vectors_allocated(&proxy->pci_dev));
+        int nvectors = msix_nr_vectors_allocated(&proxy->pci_dev);
+        int i;
+
+        proxy->vector_irqfd = g_malloc0(sizeof(*proxy->vector_irqfd) *
+                                        nvectors);
+        for (i = 0; i < nvectors; i++) {
+            proxy->vector_irqfd[i].virq = -1;
+        }
+        /* Routes for all unmasked vectors go to KVM in one update */
+        kvm_irqchip_begin_route_changes(kvm_state);
         r = msix_set_vector_notifiers(&proxy->pci_dev,
                                       kvm_virtio_pci_vector_use,
                                       kvm_virtio_pci_vector_release);
+        kvm_irqchip_commit_route_changes(kvm_state);
         if (r < 0) {
+            kvm_virtio_pci_release_routes(proxy);
+            g_free(proxy->vector_irqfd);
+            proxy->vector_irqfd = NULL;
             goto assign_error;
         }
     }
@@ -720,6 +817,12 @@ void virtio_init_pci(VirtIOPCIProxy *proxy, VirtIODevice *vdev)
 
     memory_region_init_io(&proxy->bar, &virtio_pci_config_ops, proxy,
                           "virtio-pci", size);
+    qemu_mutex_init(&proxy->notify_lock);
+    memory_region_init_io(&proxy->notify, &virtio_pci_notify_ops, proxy,
+                          "virtio-pci-notify", 2);
+    memory_region_set_lockless(&proxy->notify, true);
+    memory_region_add_subregion_overlap(&proxy->bar, VIRTIO_PCI_QUEUE_NOTIFY,
+                                        &proxy->notify, 1);
     pci_register_bar(&proxy->pci_dev, 0, PCI_BASE_ADDRESS_SPACE_IO,
                      &proxy->bar);
 
@@ -757,7 +860,10 @@ static void virtio_exit_pci(PCIDevice *pci_dev)
 {
     VirtIOPCIProxy *proxy = DO_UPCAST(VirtIOPCIProxy, pci_dev, pci_dev);
 
+    memory_region_del_subregion(&proxy->bar, &proxy->notify);
+    memory_region_destroy(&proxy->notify);
     memory_region_destroy(&proxy->bar);
+    qemu_mutex_destroy(&proxy->notify_lock);
     msix_uninit_exclusive_bar(pci_dev);
 }
 
@@ -807,6 +913,9 @@ static int virtio_net_init_pci(PCIDevice *pci_dev)
     VirtIODevice *vdev;
 
     vdev = virtio_net_init(&pci_dev->qdev, &proxy->nic, &proxy->net);
+    if (!vdev) {
+        return -1;
+    }
 
     vdev->nvectors = proxy->nvectors;
     virtio_init_pci(proxy, vdev);
@@ -835,7 +944,7 @@ static int virtio_balloon_init_pci(PCIDevice *pci_dev)
         proxy->class_code = PCI_CLASS_OTHERS;
     }
 
-    vdev = virtio_balloon_init(&pci_dev->qdev);
+    vdev = virtio_balloon_init(&pci_dev->qdev, &proxy->balloon);
     if (!vdev) {
         return -1;
     }
@@ -898,6 +1007,12 @@ static Property virtio_blk_properties[] = {
     DEFINE_PROP_BIT("config-wce", VirtIOPCIProxy, blk.config_wce, 0, true),
     DEFINE_PROP_BIT("ioeventfd", VirtIOPCIProxy, flags, VIRTIO_PCI_FLAG_USE_IOEVENTFD_BIT, true),
     DEFINE_PROP_UINT32("vectors", VirtIOPCIProxy, nvectors, 2),
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    DEFINE_PROP_BIT("x-data-plane", VirtIOPCIProxy, blk.data_plane, 0, false),
+    DEFINE_PROP_UINT32("x-poll-max-ns", VirtIOPCIProxy, blk.poll_max_ns, 0),
+    DEFINE_PROP_UINT32("x-poll-grow", VirtIOPCIProxy, blk.poll_grow, 0),
+    DEFINE_PROP_UINT32("x-poll-shrink", VirtIOPCIProxy, blk.poll_shrink, 0),
+#endif
     DEFINE_VIRTIO_BLK_FEATURES(VirtIOPCIProxy, host_features),
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -991,6 +1106,14 @@ static TypeInfo virtio_serial_info = {
 
 static Property virtio_balloon_properties[] = {
     DEFINE_VIRTIO_COMMON_FEATURES(VirtIOPCIProxy, host_features),
+    DEFINE_PROP_BIT("free-page-reporting", VirtIOPCIProxy, host_features,
+                    VIRTIO_BALLOON_F_FREE_PAGE_REPORTING, false),
+    DEFINE_PROP_UINT32("auto-balloon-interval", VirtIOPCIProxy,
+                       balloon.auto_interval, 0),
+    DEFINE_PROP_UINT32("auto-balloon-reserve", VirtIOPCIProxy,
+                       balloon.auto_reserve, 256),
+    DEFINE_PROP_UINT32("auto-balloon-host-low", VirtIOPCIProxy,
+                       balloon.auto_host_low, 1024),
     DEFINE_PROP_HEX32("class", VirtIOPCIProxy, class_code, 0),
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -1093,6 +1216,9 @@ static Property virtio_scsi_properties[] = {
     DEFINE_PROP_BIT("ioeventfd", VirtIOPCIProxy, flags, VIRTIO_PCI_FLAG_USE_IOEVENTFD_BIT, true),
     DEFINE_PROP_UINT32("vectors", VirtIOPCIProxy, nvectors, DEV_NVECTORS_UNSPECIFIED),
     DEFINE_VIRTIO_SCSI_PROPERTIES(VirtIOPCIProxy, host_features, scsi),
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    DEFINE_PROP_BIT("x-data-plane", VirtIOPCIProxy, scsi.data_plane, 0, false),
+#endif
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -20,6 +20,9 @@
 #include "virtio-rng.h"
 #include "virtio-serial.h"
 #include "virtio-scsi.h"
+#include "virtio-balloon.h"
+#include "qemu-thread.h"
+#include "msi.h"
 
 /* Performance improves when virtqueue kick processing is decoupled from the
  * vcpu thread using ioeventfd for some devices. */
@@ -27,14 +30,18 @@
 #define VIRTIO_PCI_FLAG_USE_IOEVENTFD   (1 << VIRTIO_PCI_FLAG_USE_IOEVENTFD_BIT)
 
 typedef struct {
-    int virq;
-    unsigned int users;
+    MSIMessage msg;
+    int virq;           /* -1 until the vector is first unmasked */
+    unsigned int users; /* queues with an irqfd on virq */
 } VirtIOIRQFD;
 
 typedef struct {
     PCIDevice pci_dev;
     VirtIODevice *vdev;
     MemoryRegion bar;
+    MemoryRegion notify;
+    /* Protects ioeventfd_started against lockless queue notifications */
+    QemuMutex notify_lock;
     uint32_t flags;
     uint32_t class_code;
     uint32_t nvectors;
@@ -48,6 +55,7 @@ typedef struct {
     virtio_net_conf net;
     VirtIOSCSIConf scsi;
     VirtIORNGConf rng;
+    VirtIOBalloonConf balloon;
     bool ioeventfd_disabled;
     bool ioeventfd_started;
     VirtIOIRQFD *vector_irqfd;
@@ -14,31 +14,19 @@
  */
 
 #include "virtio-scsi.h"
+#include "iov.h"
 #include <hw/scsi.h>
 #include <hw/scsi-defs.h>
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+#include "hw/dataplane/virtio-scsi.h"
+#endif
 
-#define VIRTIO_SCSI_VQ_SIZE     128
 #define VIRTIO_SCSI_CDB_SIZE    32
 #define VIRTIO_SCSI_SENSE_SIZE  96
 #define VIRTIO_SCSI_MAX_CHANNEL 0
 #define VIRTIO_SCSI_MAX_TARGET  255
 #define VIRTIO_SCSI_MAX_LUN     16383
 
-/* Response codes */
-#define VIRTIO_SCSI_S_OK                       0
-#define VIRTIO_SCSI_S_OVERRUN                  1
-#define VIRTIO_SCSI_S_ABORTED                  2
-#define VIRTIO_SCSI_S_BAD_TARGET               3
-#define VIRTIO_SCSI_S_RESET                    4
-#define VIRTIO_SCSI_S_BUSY                     5
-#define VIRTIO_SCSI_S_TRANSPORT_FAILURE        6
-#define VIRTIO_SCSI_S_TARGET_FAILURE           7
-#define VIRTIO_SCSI_S_NEXUS_FAILURE            8
-#define VIRTIO_SCSI_S_FAILURE                  9
-#define VIRTIO_SCSI_S_FUNCTION_SUCCEEDED       10
-#define VIRTIO_SCSI_S_FUNCTION_REJECTED        11
-#define VIRTIO_SCSI_S_INCORRECT_LUN            12
-
 /* Controlq type codes.  */
 #define VIRTIO_SCSI_T_TMF                      0
 #define VIRTIO_SCSI_T_AN_QUERY                 1
@@ -66,26 +54,6 @@
 #define VIRTIO_SCSI_EVT_RESET_RESCAN           1
 #define VIRTIO_SCSI_EVT_RESET_REMOVED          2
 
-/* SCSI command request, followed by data-out */
-typedef struct {
-    uint8_t lun[8];              /* Logical Unit Number */
-    uint64_t tag;                /* Command identifier */
-    uint8_t task_attr;           /* Task attribute */
-    uint8_t prio;
-    uint8_t crn;
-    uint8_t cdb[];
-} QEMU_PACKED VirtIOSCSICmdReq;
-
-/* Response, followed by sense data and data-in */
-typedef struct {
-    uint32_t sense_len;          /* Sense data length */
-    uint32_t resid;              /* Residual bytes in data buffer */
-    uint16_t status_qualifier;   /* Status qualifier */
-    uint8_t status;              /* Command completion status */
-    uint8_t response;            /* Response values */
-    uint8_t sense[];
-} QEMU_PACKED VirtIOSCSICmdResp;
-
 /* Task Management Request */
 typedef struct {
     uint32_t type;
@@ -141,6 +109,11 @@ typedef struct {
     bool events_dropped;
     VirtQueue *ctrl_vq;
     VirtQueue *event_vq;
+    struct VirtIOSCSIReq *free_reqs;
+    unsigned int nr_free_reqs;
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    VirtIOSCSIDataPlane *dataplane;
+#endif
     VirtQueue *cmd_vqs[0];
 } VirtIOSCSI;
 
@@ -150,6 +123,17 @@ typedef struct VirtIOSCSIReq {
     VirtQueueElement elem;
     QEMUSGList qsgl;
     SCSIRequest *sreq;
+    struct VirtIOSCSIReq *next;     /* in VirtIOSCSI.free_reqs */
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    /* Requests from a data plane thread carry host iovecs instead of guest
+     * addresses and transfer data with transfer_data(), qsgl only records
+     * the size.
+     */
+    VirtIOSCSIDataPlaneReq *dpreq;
+    struct iovec *data_iov;
+    unsigned int data_niov;
+    size_t data_offset;
+#endif
     union {
         char                  *buf;
         VirtIOSCSICmdReq      *cmd;
@@ -181,18 +165,58 @@ static inline SCSIDevice *virtio_scsi_device_find(VirtIOSCSI *s, uint8_t *lun)
     return scsi_device_find(&s->bus, 0, lun[1], virtio_scsi_get_lun(lun));
 }
 
+/* Completed requests are kept for reuse, up to the total queue size, so
+ * that the large VirtQueueElement inside is not allocated and faulted in
+ * again for every request.
+ */
+static VirtIOSCSIReq *virtio_scsi_alloc_req(VirtIOSCSI *s)
+{
+    VirtIOSCSIReq *req = s->free_reqs;
+
+    if (req) {
+        s->free_reqs = req->next;
+        s->nr_free_reqs--;
+    } else {
+        req = g_malloc(sizeof(*req));
+    }
+    return req;
+}
+
+static void virtio_scsi_free_req(VirtIOSCSI *s, VirtIOSCSIReq *req)
+{
+    if (s->nr_free_reqs < s->conf->num_queues * VIRTIO_SCSI_VQ_SIZE) {
+        req->next = s->free_reqs;
+        s->free_reqs = req;
+        s->nr_free_reqs++;
+    } else {
+        g_free(req);
+    }
+}
+
 static void virtio_scsi_complete_req(VirtIOSCSIReq *req)
 {
     VirtIOSCSI *s = req->dev;
     VirtQueue *vq = req->vq;
-    virtqueue_push(vq, &req->elem, req->qsgl.size + req->elem.in_sg[0].iov_len);
+    int len = req->qsgl.size + req->elem.in_sg[0].iov_len;
+
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (req->dpreq) {
+        virtio_scsi_data_plane_complete(req->dpreq, len);
+        vq = NULL;
+    } else
+#endif
+    {
+        virtqueue_push(vq, &req->elem, len);
+    }
     qemu_sglist_destroy(&req->qsgl);
     if (req->sreq) {
         req->sreq->hba_private = NULL;
         scsi_req_unref(req->sreq);
     }
-    g_free(req);
-    virtio_notify(&s->vdev, vq);
+    virtio_scsi_free_req(s, req);
+    if (vq) {
+        virtio_notify(&s->vdev, vq);
+    }
 }
 
 static void virtio_scsi_bad_req(void)
@@ -217,6 +241,9 @@ static void virtio_scsi_parse_req(VirtIOSCSI *s, VirtQueue *vq,
     req->vq = vq;
     req->dev = s;
     req->sreq = NULL;
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    req->dpreq = NULL;
+#endif
     if (req->elem.out_num) {
         req->req.buf = req->elem.out_sg[0].iov_base;
     }
@@ -236,9 +263,9 @@ static void virtio_scsi_parse_req(VirtIOSCSI *s, VirtQueue *vq,
 static VirtIOSCSIReq *virtio_scsi_pop_req(VirtIOSCSI *s, VirtQueue *vq)
 {
     VirtIOSCSIReq *req;
-    req = g_malloc(sizeof(*req));
+    req = virtio_scsi_alloc_req(s);
     if (!virtqueue_pop(vq, &req->elem)) {
-        g_free(req);
+        virtio_scsi_free_req(s, req);
         return NULL;
     }
 
@@ -263,7 +290,7 @@ static void *virtio_scsi_load_request(QEMUFile *f, SCSIRequest *sreq)
     VirtIOSCSIReq *req;
     uint32_t n;
 
-    req = g_malloc(sizeof(*req));
+    req = virtio_scsi_alloc_req(s);
     qemu_get_be32s(f, &n);
     assert(n < s->conf->num_queues);
     qemu_get_buffer(f, (unsigned char *)&req->elem, sizeof(req->elem));
@@ -443,6 +470,11 @@ static QEMUSGList *virtio_scsi_get_sg_list(SCSIRequest *r)
 {
     VirtIOSCSIReq *req = r->hba_private;
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (req->dpreq) {
+        return NULL;
+    }
+#endif
     return &req->qsgl;
 }
 
@@ -467,59 +499,157 @@ static void virtio_scsi_fail_cmd_req(VirtIOSCSIReq *req)
     virtio_scsi_complete_req(req);
 }
 
+static void virtio_scsi_handle_cmd_req(VirtIOSCSI *s, VirtIOSCSIReq *req)
+{
+    SCSIDevice *d;
+    int out_size, in_size;
+    int n;
+
+    if (req->elem.out_num < 1 || req->elem.in_num < 1) {
+        virtio_scsi_bad_req();
+    }
+
+    out_size = req->elem.out_sg[0].iov_len;
+    in_size = req->elem.in_sg[0].iov_len;
+    if (out_size < sizeof(VirtIOSCSICmdReq) + s->cdb_size ||
+        in_size < sizeof(VirtIOSCSICmdResp) + s->sense_size) {
+        virtio_scsi_bad_req();
+    }
+
+    if (req->elem.out_num > 1 && req->elem.in_num > 1) {
+        virtio_scsi_fail_cmd_req(req);
+        return;
+    }
+
+    d = virtio_scsi_device_find(s, req->req.cmd->lun);
+    if (!d) {
+        req->resp.cmd->response = VIRTIO_SCSI_S_BAD_TARGET;
+        virtio_scsi_complete_req(req);
+        return;
+    }
+    req->sreq = scsi_req_new(d, req->req.cmd->tag,
+                             virtio_scsi_get_lun(req->req.cmd->lun),
+                             req->req.cmd->cdb, req);
+
+    if (req->sreq->cmd.mode != SCSI_XFER_NONE) {
+        int req_mode =
+            (req->elem.in_num > 1 ? SCSI_XFER_FROM_DEV : SCSI_XFER_TO_DEV);
+
+        if (req->sreq->cmd.mode != req_mode ||
+            req->sreq->cmd.xfer > req->qsgl.size) {
+            req->resp.cmd->response = VIRTIO_SCSI_S_OVERRUN;
+            virtio_scsi_complete_req(req);
+            return;
+        }
+    }
+
+    n = scsi_req_enqueue(req->sreq);
+    if (n) {
+        scsi_req_continue(req->sreq);
+    }
+}
+
 static void virtio_scsi_handle_cmd(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOSCSI *s = (VirtIOSCSI *)vdev;
     VirtIOSCSIReq *req;
-    int n;
+
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    /* Some guests kick before setting VIRTIO_CONFIG_S_DRIVER_OK so start
+     * dataplane here instead of waiting for .set_status().
+     */
+    if (s->dataplane) {
+        virtio_scsi_data_plane_start(s->dataplane);
+        return;
+    }
+#endif
 
     while ((req = virtio_scsi_pop_req(s, vq))) {
-        SCSIDevice *d;
-        int out_size, in_size;
-        if (req->elem.out_num < 1 || req->elem.in_num < 1) {
-            virtio_scsi_bad_req();
-        }
+        virtio_scsi_handle_cmd_req(s, req);
+    }
+}
 
-        out_size = req->elem.out_sg[0].iov_len;
-        in_size = req->elem.in_sg[0].iov_len;
-        if (out_size < sizeof(VirtIOSCSICmdReq) + s->cdb_size ||
-            in_size < sizeof(VirtIOSCSICmdResp) + s->sense_size) {
-            virtio_scsi_bad_req();
-        }
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+void virtio_scsi_handle_data_plane_req(VirtIODevice *vdev,
+                                       VirtIOSCSIDataPlaneReq *dpreq)
+{
+    VirtIOSCSI *s = (VirtIOSCSI *)vdev;
+    VirtIOSCSIReq *req;
 
-        if (req->elem.out_num > 1 && req->elem.in_num > 1) {
-            virtio_scsi_fail_cmd_req(req);
-            continue;
-        }
+    if (dpreq->out_num < 1 || dpreq->in_num < 1) {
+        virtio_scsi_bad_req();
+    }
 
-        d = virtio_scsi_device_find(s, req->req.cmd->lun);
-        if (!d) {
-            req->resp.cmd->response = VIRTIO_SCSI_S_BAD_TARGET;
-            virtio_scsi_complete_req(req);
-            continue;
-        }
-        req->sreq = scsi_req_new(d, req->req.cmd->tag,
-                                 virtio_scsi_get_lun(req->req.cmd->lun),
-                                 req->req.cmd->cdb, req);
-
-        if (req->sreq->cmd.mode != SCSI_XFER_NONE) {
-            int req_mode =
-                (req->elem.in_num > 1 ? SCSI_XFER_FROM_DEV : SCSI_XFER_TO_DEV);
-
-            if (req->sreq->cmd.mode != req_mode ||
-                req->sreq->cmd.xfer > req->qsgl.size) {
-                req->resp.cmd->response = VIRTIO_SCSI_S_OVERRUN;
-                virtio_scsi_complete_req(req);
-                continue;
+    req = virtio_scsi_alloc_req(s);
+    req->vq = NULL;
+    req->dev = s;
+    req->sreq = NULL;
+    req->dpreq = dpreq;
+
+    /* Only the header elements are looked at outside of transfer_data() */
+    req->elem.index = dpreq->head;
+    req->elem.out_num = dpreq->out_num;
+    req->elem.in_num = dpreq->in_num;
+    req->elem.out_sg[0] = dpreq->iov[0];
+    req->elem.in_sg[0] = dpreq->iov[dpreq->out_num];
+    req->req.buf = req->elem.out_sg[0].iov_base;
+    req->resp.buf = req->elem.in_sg[0].iov_base;
+
+    if (dpreq->out_num > 1) {
+        req->data_iov = &dpreq->iov[1];
+        req->data_niov = dpreq->out_num - 1;
+    } else {
+        req->data_iov = &dpreq->iov[dpreq->out_num + 1];
+        req->data_niov = dpreq->in_num - 1;
+    }
+    req->data_offset = 0;
+    qemu_sglist_init(&req->qsgl, 0, &dma_context_memory);
+    req->qsgl.size = iov_size(req->data_iov, req->data_niov);
+
+    virtio_scsi_handle_cmd_req(s, req);
+}
+
+/* Complete or abort every request the data plane handed over */
+void virtio_scsi_drain_data_plane_reqs(VirtIODevice *vdev)
+{
+    VirtIOSCSI *s = (VirtIOSCSI *)vdev;
+    SCSIRequest *r, *next;
+    BusChild *kid;
+
+    bdrv_drain_all();
+
+    /* What is left waits for a werror=stop retry, but its vring is about to
+     * go away.
+     */
+    QTAILQ_FOREACH(kid, &s->bus.qbus.children, sibling) {
+        SCSIDevice *d = DO_UPCAST(SCSIDevice, qdev, kid->child);
+
+        QTAILQ_FOREACH_SAFE(r, &d->requests, next, next) {
+            VirtIOSCSIReq *req = r->hba_private;
+
+            if (req && req->dpreq) {
+                scsi_req_cancel(r);
             }
         }
+    }
+}
 
-        n = scsi_req_enqueue(req->sreq);
-        if (n) {
-            scsi_req_continue(req->sreq);
-        }
+static void virtio_scsi_transfer_data(SCSIRequest *r, uint32_t len)
+{
+    VirtIOSCSIReq *req = r->hba_private;
+    uint8_t *buf = scsi_req_get_buf(r);
+
+    if (r->cmd.mode == SCSI_XFER_FROM_DEV) {
+        iov_from_buf(req->data_iov, req->data_niov, req->data_offset,
+                     buf, len);
+    } else {
+        iov_to_buf(req->data_iov, req->data_niov, req->data_offset,
+                   buf, len);
     }
+    req->data_offset += len;
+    scsi_req_continue(r);
 }
+#endif
 
 static void virtio_scsi_get_config(VirtIODevice *vdev,
                                    uint8_t *config)
@@ -561,10 +691,27 @@ static uint32_t virtio_scsi_get_features(VirtIODevice *vdev,
     return requested_features;
 }
 
+static void virtio_scsi_set_status(VirtIODevice *vdev, uint8_t status)
+{
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    VirtIOSCSI *s = (VirtIOSCSI *)vdev;
+
+    if (s->dataplane && !(status & (VIRTIO_CONFIG_S_DRIVER |
+                                    VIRTIO_CONFIG_S_DRIVER_OK))) {
+        virtio_scsi_data_plane_stop(s->dataplane);
+    }
+#endif
+}
+
 static void virtio_scsi_reset(VirtIODevice *vdev)
 {
     VirtIOSCSI *s = (VirtIOSCSI *)vdev;
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (s->dataplane) {
+        virtio_scsi_data_plane_stop(s->dataplane);
+    }
+#endif
     s->sense_size = VIRTIO_SCSI_SENSE_SIZE;
     s->cdb_size = VIRTIO_SCSI_CDB_SIZE;
     s->events_dropped = false;
@@ -664,6 +811,13 @@ static void virtio_scsi_hotplug(SCSIBus *bus, SCSIDevice *dev)
 {
     VirtIOSCSI *s = container_of(bus, VirtIOSCSI, bus);
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    /* The threads restart with the new set of LUNs on the next kick */
+    if (s->dataplane) {
+        virtio_scsi_data_plane_stop(s->dataplane);
+    }
+#endif
+
     if ((s->vdev.guest_features >> VIRTIO_SCSI_F_HOTPLUG) & 1) {
         virtio_scsi_push_event(s, dev, VIRTIO_SCSI_T_TRANSPORT_RESET,
                                VIRTIO_SCSI_EVT_RESET_RESCAN);
@@ -674,6 +828,13 @@ static void virtio_scsi_hot_unplug(SCSIBus *bus, SCSIDevice *dev)
 {
     VirtIOSCSI *s = container_of(bus, VirtIOSCSI, bus);
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    /* The threads restart with the new set of LUNs on the next kick */
+    if (s->dataplane) {
+        virtio_scsi_data_plane_stop(s->dataplane);
+    }
+#endif
+
     if ((s->vdev.guest_features >> VIRTIO_SCSI_F_HOTPLUG) & 1) {
         virtio_scsi_push_event(s, dev, VIRTIO_SCSI_T_TRANSPORT_RESET,
                                VIRTIO_SCSI_EVT_RESET_REMOVED);
@@ -692,6 +853,9 @@ static struct SCSIBusInfo virtio_scsi_scsi_info = {
     .hotplug = virtio_scsi_hotplug,
     .hot_unplug = virtio_scsi_hot_unplug,
     .get_sg_list = virtio_scsi_get_sg_list,
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    .transfer_data = virtio_scsi_transfer_data,
+#endif
     .save_request = virtio_scsi_save_request,
     .load_request = virtio_scsi_load_request,
 };
@@ -714,6 +878,7 @@ VirtIODevice *virtio_scsi_init(DeviceState *dev, VirtIOSCSIConf *proxyconf)
     s->vdev.get_config = virtio_scsi_get_config;
     s->vdev.set_config = virtio_scsi_set_config;
     s->vdev.get_features = virtio_scsi_get_features;
+    s->vdev.set_status = virtio_scsi_set_status;
     s->vdev.reset = virtio_scsi_reset;
 
     s->ctrl_vq = virtio_add_queue(&s->vdev, VIRTIO_SCSI_VQ_SIZE,
@@ -730,6 +895,14 @@ VirtIODevice *virtio_scsi_init(DeviceState *dev, VirtIOSCSIConf *proxyconf)
         scsi_bus_legacy_handle_cmdline(&s->bus);
     }
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (!virtio_scsi_data_plane_create(&s->vdev, s->conf, &s->bus,
+                                       &s->dataplane)) {
+        virtio_cleanup(&s->vdev);
+        return NULL;
+    }
+#endif
+
     register_savevm(dev, "virtio-scsi", virtio_scsi_id++, 1,
                     virtio_scsi_save, virtio_scsi_load, s);
 
@@ -739,6 +912,16 @@ VirtIODevice *virtio_scsi_init(DeviceState *dev, VirtIOSCSIConf *proxyconf)
 void virtio_scsi_exit(VirtIODevice *vdev)
 {
     VirtIOSCSI *s = (VirtIOSCSI *)vdev;
+    VirtIOSCSIReq *req;
+
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    virtio_scsi_data_plane_destroy(s->dataplane);
+    s->dataplane = NULL;
+#endif
     unregister_savevm(s->qdev, "virtio-scsi", s);
+    while ((req = s->free_reqs)) {
+        s->free_reqs = req->next;
+        g_free(req);
+    }
     virtio_cleanup(vdev);
 }
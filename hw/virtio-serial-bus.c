@@ -139,6 +139,57 @@ static void discard_vq_data(VirtQueue *vq, VirtIODevice *vdev)
     virtio_notify(vdev, vq);
 }
 
+/*
+ * Hand everything from iov_idx/iov_offset to the end of the element to
+ * the port in one call, so that the backend can writev() it without
+ * splitting it per descriptor.  On a short write the position is
+ * advanced past what was consumed, as in the per-buffer loop below.
+ */
+static void flush_element_iov(VirtIOSerialPort *port,
+                              VirtIOSerialPortClass *vsc)
+{
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
+    unsigned int i, cnt;
+    size_t offset, size;
+    ssize_t ret;
+
+    offset = port->iov_offset;
+    for (i = 0; i < port->iov_idx; i++) {
+        offset += port->elem.out_sg[i].iov_len;
+    }
+    size = iov_size(port->elem.out_sg, port->elem.out_num);
+    if (offset >= size) {
+        return;
+    }
+    cnt = iov_copy(iov, ARRAY_SIZE(iov), port->elem.out_sg,
+                   port->elem.out_num, offset, size - offset);
+
+    ret = vsc->have_data_iov(port, iov, cnt);
+    if (ret < 0 && ret != -EAGAIN) {
+        /* We don't handle any other type of errors here */
+        abort();
+    }
+    if (ret >= 0 && ret == size - offset) {
+        return;
+    }
+
+    /* see the comment in do_flush_queued_data */
+    if (!vsc->is_console) {
+        virtio_serial_throttle_port(port, true);
+    }
+    if (!port->throttled) {
+        return;
+    }
+    if (ret > 0) {
+        port->iov_offset += ret;
+        while (port->iov_idx < port->elem.out_num &&
+               port->iov_offset >= port->elem.out_sg[port->iov_idx].iov_len) {
+            port->iov_offset -= port->elem.out_sg[port->iov_idx].iov_len;
+            port->iov_idx++;
+        }
+    }
+}
+
 static void do_flush_queued_data(VirtIOSerialPort *port, VirtQueue *vq,
                                  VirtIODevice *vdev)
 {
@@ -161,6 +212,16 @@ static void do_flush_queued_data(VirtIOSerialPort *port, VirtQueue *vq,
             port->iov_offset = 0;
         }
 
+        if (vsc->have_data_iov) {
+            flush_element_iov(port, vsc);
+            if (port->throttled) {
+                break;
+            }
+            virtqueue_push(vq, &port->elem, 0);
+            port->elem.out_num = 0;
+            continue;
+        }
+
         for (i = port->iov_idx; i < port->elem.out_num; i++) {
             size_t buf_size;
             ssize_t ret;
@@ -176,14 +237,12 @@ static void do_flush_queued_data(VirtIOSerialPort *port, VirtQueue *vq,
             }
             if (ret == -EAGAIN || (ret >= 0 && ret < buf_size)) {
 		/*
-                 * this is a temporary check until chardevs can signal to
-                 * frontends that they are writable again. This prevents
-                 * the console from going into throttled mode (forever)
-                 * if virtio-console is connected to a pty without a
-                 * listener. Otherwise the guest spins forever.
-                 * We can revert this if
-                 * 1: chardevs can notify frondends
-                 * 2: the guest driver does not spin in these cases
+                 * Consoles are only throttled by their have_data
+                 * callback, when the backend promises to signal that it
+                 * is writable again.  This prevents the console from
+                 * going into throttled mode (forever) if virtio-console
+                 * is connected to a pty without a listener. Otherwise
+                 * the guest spins forever.
                  */
                 if (!vsc->is_console) {
                     virtio_serial_throttle_port(port, true);
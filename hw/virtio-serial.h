@@ -107,6 +107,13 @@ typedef struct VirtIOSerialPortClass {
      */
     ssize_t (*have_data)(VirtIOSerialPort *port, const uint8_t *buf,
                          size_t len);
+
+    /*
+     * Optional variant of have_data that takes the rest of the
+     * element at once; same return convention.
+     */
+    ssize_t (*have_data_iov)(VirtIOSerialPort *port,
+                             const struct iovec *iov, unsigned int iovcnt);
 } VirtIOSerialPortClass;
 
 /*
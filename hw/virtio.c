@@ -17,6 +17,9 @@
 #include "qemu-error.h"
 #include "virtio.h"
 #include "qemu-barrier.h"
+#include "exec-memory.h"
+#include "xen.h"
+#include "qmp-commands.h"
 
 /* The alignment to use between consumer and producer parts of vring.
  * x86 pagesize again. */
@@ -79,6 +82,52 @@ struct VirtQueue
     VirtIODevice *vdev;
     EventNotifier guest_notifier;
     EventNotifier host_notifier;
+
+    /* Host mappings of the rings, valid while map_gen matches
+     * virtio_map_gen.  They are NULL unless all three rings are in guest
+     * RAM, in which case every access goes through the physical memory map.
+     */
+    VRingDesc *desc_host;
+    VRingAvail *avail_host;
+    VRingUsed *used_host;
+    MemoryRegion *used_mr;          /* for dirty logging of used ring writes */
+    hwaddr used_offset;             /* of used_host within used_mr */
+    unsigned int map_gen;
+
+    /* Performance counters, never reset */
+    struct {
+        uint64_t notifications;     /* guest kicks */
+        uint64_t interrupts;
+        uint64_t suppressed;        /* interrupts vring_notify() avoided */
+        uint64_t popped;
+        uint64_t ring_full;
+        uint64_t batches;
+        uint64_t batched;
+        uint64_t batch_max;
+        uint64_t batch_limited;
+        uint64_t batch_empty;
+    } stats;
+};
+
+static QLIST_HEAD(, VirtIODevice) virtio_devices =
+    QLIST_HEAD_INITIALIZER(virtio_devices);
+
+/* Bumped on every memory topology change, which may move or remove the RAM
+ * behind a ring.  Zero is never a valid generation.
+ */
+static unsigned int virtio_map_gen = 1;
+static bool virtio_memory_listener_registered;
+
+static void virtio_memory_commit(MemoryListener *listener)
+{
+    if (++virtio_map_gen == 0) {
+        virtio_map_gen = 1;
+    }
+}
+
+static MemoryListener virtio_memory_listener = {
+    .commit = virtio_memory_commit,
+    .priority = 10,
 };
 
 /* virt queue functions */
@@ -91,39 +140,161 @@ static void virtqueue_init(VirtQueue *vq)
     vq->vring.used = vring_align(vq->vring.avail +
                                  offsetof(VRingAvail, ring[vq->vring.num]),
                                  VIRTIO_PCI_VRING_ALIGN);
+    vq->map_gen = 0;
 }
 
-static inline uint64_t vring_desc_addr(hwaddr desc_pa, int i)
+static void *vring_map_ring(hwaddr pa, hwaddr size,
+                            MemoryRegion **mr, hwaddr *offset)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, addr);
-    return ldq_phys(pa);
+    MemoryRegionSection section;
+
+    section = memory_region_find(get_system_memory(), pa, size);
+    if (!section.mr || !memory_region_is_ram(section.mr) ||
+        memory_region_is_rom(section.mr) || section.readonly ||
+        section.offset_within_address_space != pa || section.size != size) {
+        return NULL;
+    }
+    *mr = section.mr;
+    *offset = section.offset_within_region;
+    return (uint8_t *)memory_region_get_ram_ptr(section.mr) +
+           section.offset_within_region;
 }
 
-static inline uint32_t vring_desc_len(hwaddr desc_pa, int i)
+static void virtqueue_map_rings(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, len);
-    return ldl_phys(pa);
+    unsigned int num = vq->vring.num;
+    VRingDesc *desc;
+    VRingAvail *avail;
+    VRingUsed *used;
+    MemoryRegion *mr;
+    hwaddr offset;
+
+    if (!virtio_memory_listener_registered) {
+        memory_listener_register(&virtio_memory_listener,
+                                 &address_space_memory);
+        virtio_memory_listener_registered = true;
+    }
+
+    vq->map_gen = virtio_map_gen;
+    vq->desc_host = NULL;
+    vq->avail_host = NULL;
+    vq->used_host = NULL;
+
+    /* Xen needs xen_modified_memory() on every write */
+    if (xen_enabled() || !vq->vring.desc) {
+        return;
+    }
+
+    desc = vring_map_ring(vq->vring.desc, num * sizeof(VRingDesc),
+                          &mr, &offset);
+    /* the rings end with used_event and avail_event respectively */
+    avail = vring_map_ring(vq->vring.avail,
+                           offsetof(VRingAvail, ring[num + 1]), &mr, &offset);
+    used = vring_map_ring(vq->vring.used,
+                          offsetof(VRingUsed, ring[num]) + sizeof(uint16_t),
+                          &mr, &offset);
+    if (desc && avail && used) {
+        vq->desc_host = desc;
+        vq->avail_host = avail;
+        vq->used_host = used;
+        vq->used_mr = mr;
+        vq->used_offset = offset;
+    }
 }
 
-static inline uint16_t vring_desc_flags(hwaddr desc_pa, int i)
+static inline bool vring_is_mapped(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, flags);
-    return lduw_phys(pa);
+    if (unlikely(vq->map_gen != virtio_map_gen)) {
+        virtqueue_map_rings(vq);
+    }
+    return vq->used_host != NULL;
 }
 
-static inline uint16_t vring_desc_next(hwaddr desc_pa, int i)
+/* Descriptors are read whole, from @desc_host if the table is mapped and
+ * otherwise with a single copy out of guest memory.
+ */
+static inline void vring_desc_read(hwaddr desc_pa, const VRingDesc *desc_host,
+                                   int i, VRingDesc *desc)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, next);
-    return lduw_phys(pa);
+    VRingDesc raw;
+
+    if (!desc_host) {
+        cpu_physical_memory_read(desc_pa + sizeof(VRingDesc) * i,
+                                 (uint8_t *)&raw, sizeof(raw));
+        desc_host = &raw;
+        i = 0;
+    }
+    desc->addr = ldq_p(&desc_host[i].addr);
+    desc->len = ldl_p(&desc_host[i].len);
+    desc->flags = lduw_p(&desc_host[i].flags);
+    desc->next = lduw_p(&desc_host[i].next);
+}
+
+static inline const VRingDesc *vring_desc_table(VirtQueue *vq)
+{
+    return vring_is_mapped(vq) ? vq->desc_host : NULL;
+}
+
+/* Largest indirect table that is bounced into a private copy when it
+ * cannot be mapped; bigger ones are read one descriptor at a time.
+ */
+#define VRING_INDIRECT_COPY_MAX (VIRTQUEUE_MAX_SIZE * sizeof(VRingDesc))
+
+typedef struct VRingIndirect {
+    const VRingDesc *desc;
+    hwaddr size;
+    bool copied;
+} VRingIndirect;
+
+/* Indirect tables are mapped, or copied in one go, for the duration of
+ * one walk.  Returns the table to pass to vring_desc_read().
+ */
+static const VRingDesc *vring_map_indirect(VRingIndirect *ind,
+                                           hwaddr pa, hwaddr size)
+{
+    hwaddr len = size;
+    void *p;
+
+    ind->desc = NULL;
+    ind->size = size;
+    ind->copied = false;
+    if (!size) {
+        return NULL;
+    }
+    p = cpu_physical_memory_map(pa, &len, 0);
+    if (p && len != size) {
+        cpu_physical_memory_unmap(p, len, 0, 0);
+        p = NULL;
+    }
+    if (!p && size <= VRING_INDIRECT_COPY_MAX) {
+        p = g_malloc(size);
+        cpu_physical_memory_read(pa, p, size);
+        ind->copied = true;
+    }
+    ind->desc = p;
+    return p;
+}
+
+static void vring_unmap_indirect(VRingIndirect *ind)
+{
+    if (!ind->desc) {
+        return;
+    }
+    if (ind->copied) {
+        g_free((void *)ind->desc);
+    } else {
+        cpu_physical_memory_unmap((void *)ind->desc, ind->size, 0, ind->size);
+    }
+    ind->desc = NULL;
 }
 
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
     hwaddr pa;
+
+    if (vring_is_mapped(vq)) {
+        return lduw_p(&vq->avail_host->flags);
+    }
     pa = vq->vring.avail + offsetof(VRingAvail, flags);
     return lduw_phys(pa);
 }
@@ -131,6 +302,11 @@ static inline uint16_t vring_avail_flags(VirtQueue *vq)
 static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
     hwaddr pa;
+
+    if (vring_is_mapped(vq)) {
+        /* the guest updates it behind our back */
+        return tswap16(*(volatile uint16_t *)&vq->avail_host->idx);
+    }
     pa = vq->vring.avail + offsetof(VRingAvail, idx);
     return lduw_phys(pa);
 }
@@ -138,6 +314,10 @@ static inline uint16_t vring_avail_idx(VirtQueue *vq)
 static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
 {
     hwaddr pa;
+
+    if (vring_is_mapped(vq)) {
+        return tswap16(*(volatile uint16_t *)&vq->avail_host->ring[i]);
+    }
     pa = vq->vring.avail + offsetof(VRingAvail, ring[i]);
     return lduw_phys(pa);
 }
@@ -147,9 +327,22 @@ static inline uint16_t vring_used_event(VirtQueue *vq)
     return vring_avail_ring(vq, vq->vring.num);
 }
 
+static inline void vring_used_set_dirty(VirtQueue *vq, hwaddr offset,
+                                        hwaddr size)
+{
+    memory_region_set_dirty(vq->used_mr, vq->used_offset + offset, size);
+}
+
 static inline void vring_used_ring_id(VirtQueue *vq, int i, uint32_t val)
 {
     hwaddr pa;
+
+    if (vring_is_mapped(vq)) {
+        stl_p(&vq->used_host->ring[i].id, val);
+        vring_used_set_dirty(vq, offsetof(VRingUsed, ring[i].id),
+                             sizeof(val));
+        return;
+    }
     pa = vq->vring.used + offsetof(VRingUsed, ring[i].id);
     stl_phys(pa, val);
 }
@@ -157,6 +350,13 @@ static inline void vring_used_ring_id(VirtQueue *vq, int i, uint32_t val)
 static inline void vring_used_ring_len(VirtQueue *vq, int i, uint32_t val)
 {
     hwaddr pa;
+
+    if (vring_is_mapped(vq)) {
+        stl_p(&vq->used_host->ring[i].len, val);
+        vring_used_set_dirty(vq, offsetof(VRingUsed, ring[i].len),
+                             sizeof(val));
+        return;
+    }
     pa = vq->vring.used + offsetof(VRingUsed, ring[i].len);
     stl_phys(pa, val);
 }
@@ -164,6 +364,10 @@ static inline void vring_used_ring_len(VirtQueue *vq, int i, uint32_t val)
 static uint16_t vring_used_idx(VirtQueue *vq)
 {
     hwaddr pa;
+
+    if (vring_is_mapped(vq)) {
+        return lduw_p(&vq->used_host->idx);
+    }
     pa = vq->vring.used + offsetof(VRingUsed, idx);
     return lduw_phys(pa);
 }
@@ -171,22 +375,48 @@ static uint16_t vring_used_idx(VirtQueue *vq)
 static inline void vring_used_idx_set(VirtQueue *vq, uint16_t val)
 {
     hwaddr pa;
+
+    if (vring_is_mapped(vq)) {
+        stw_p(&vq->used_host->idx, val);
+        vring_used_set_dirty(vq, offsetof(VRingUsed, idx), sizeof(val));
+        return;
+    }
     pa = vq->vring.used + offsetof(VRingUsed, idx);
     stw_phys(pa, val);
 }
 
-static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
+static inline void vring_used_flags_set(VirtQueue *vq, uint16_t val)
 {
     hwaddr pa;
+
+    if (vring_is_mapped(vq)) {
+        stw_p(&vq->used_host->flags, val);
+        vring_used_set_dirty(vq, offsetof(VRingUsed, flags), sizeof(val));
+        return;
+    }
     pa = vq->vring.used + offsetof(VRingUsed, flags);
-    stw_phys(pa, lduw_phys(pa) | mask);
+    stw_phys(pa, val);
 }
 
-static inline void vring_used_flags_unset_bit(VirtQueue *vq, int mask)
+static inline uint16_t vring_used_flags(VirtQueue *vq)
 {
     hwaddr pa;
+
+    if (vring_is_mapped(vq)) {
+        return lduw_p(&vq->used_host->flags);
+    }
     pa = vq->vring.used + offsetof(VRingUsed, flags);
-    stw_phys(pa, lduw_phys(pa) & ~mask);
+    return lduw_phys(pa);
+}
+
+static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
+{
+    vring_used_flags_set(vq, vring_used_flags(vq) | mask);
+}
+
+static inline void vring_used_flags_unset_bit(VirtQueue *vq, int mask)
+{
+    vring_used_flags_set(vq, vring_used_flags(vq) & ~mask);
 }
 
 static inline void vring_avail_event(VirtQueue *vq, uint16_t val)
@@ -195,6 +425,12 @@ static inline void vring_avail_event(VirtQueue *vq, uint16_t val)
     if (!vq->notification) {
         return;
     }
+    if (vring_is_mapped(vq)) {
+        stw_p(&vq->used_host->ring[vq->vring.num], val);
+        vring_used_set_dirty(vq, offsetof(VRingUsed, ring[vq->vring.num]),
+                             sizeof(val));
+        return;
+    }
     pa = vq->vring.used + offsetof(VRingUsed, ring[vq->vring.num]);
     stw_phys(pa, val);
 }
@@ -225,14 +461,11 @@ int virtio_queue_empty(VirtQueue *vq)
     return vring_avail_idx(vq) == vq->last_avail_idx;
 }
 
-void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
-                    unsigned int len, unsigned int idx)
+static void virtqueue_unmap_sg(const VirtQueueElement *elem, unsigned int len)
 {
     unsigned int offset;
     int i;
 
-    trace_virtqueue_fill(vq, elem, len, idx);
-
     offset = 0;
     for (i = 0; i < elem->in_num; i++) {
         size_t size = MIN(len - offset, elem->in_sg[i].iov_len);
@@ -248,6 +481,25 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
         cpu_physical_memory_unmap(elem->out_sg[i].iov_base,
                                   elem->out_sg[i].iov_len,
                                   0, elem->out_sg[i].iov_len);
+}
+
+/* Give back @elem, the last element popped, unused.  @len bytes were
+ * written to it.
+ */
+void virtqueue_discard(VirtQueue *vq, const VirtQueueElement *elem,
+                       unsigned int len)
+{
+    virtqueue_unmap_sg(elem, len);
+    vq->last_avail_idx--;
+    vq->inuse--;
+}
+
+void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                    unsigned int len, unsigned int idx)
+{
+    trace_virtqueue_fill(vq, elem, len, idx);
+
+    virtqueue_unmap_sg(elem, len);
 
     idx = (idx + vring_used_idx(vq)) % vq->vring.num;
 
@@ -313,19 +565,18 @@ static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
     return head;
 }
 
-static unsigned virtqueue_next_desc(hwaddr desc_pa,
-                                    unsigned int i, unsigned int max)
+static unsigned virtqueue_next_desc(const VRingDesc *desc, unsigned int max)
 {
     unsigned int next;
 
     /* If this descriptor says it doesn't chain, we're done. */
-    if (!(vring_desc_flags(desc_pa, i) & VRING_DESC_F_NEXT))
+    if (!(desc->flags & VRING_DESC_F_NEXT))
         return max;
 
-    /* Check they're not leading us off end of descriptors. */
-    next = vring_desc_next(desc_pa, i);
-    /* Make sure compiler knows to grab that: we don't want it changing! */
-    smp_wmb();
+    /* Check they're not leading us off end of descriptors.  The descriptor
+     * is a private copy, so it cannot change under us.
+     */
+    next = desc->next;
 
     if (next >= max) {
         error_report("Desc next is %u", next);
@@ -347,16 +598,21 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
     total_bufs = in_total = out_total = 0;
     while (virtqueue_num_heads(vq, idx)) {
         unsigned int max, num_bufs, indirect = 0;
+        const VRingDesc *desc_host;
+        VRingIndirect ind = { .desc = NULL };
         hwaddr desc_pa;
+        VRingDesc desc;
         int i;
 
         max = vq->vring.num;
         num_bufs = total_bufs;
         i = virtqueue_get_head(vq, idx++);
         desc_pa = vq->vring.desc;
+        desc_host = vring_desc_table(vq);
+        vring_desc_read(desc_pa, desc_host, i, &desc);
 
-        if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_INDIRECT) {
-            if (vring_desc_len(desc_pa, i) % sizeof(VRingDesc)) {
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            if (desc.len % sizeof(VRingDesc)) {
                 error_report("Invalid size for indirect buffer table");
                 exit(1);
             }
@@ -369,27 +625,37 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
 
             /* loop over the indirect descriptor table */
             indirect = 1;
-            max = vring_desc_len(desc_pa, i) / sizeof(VRingDesc);
+            max = desc.len / sizeof(VRingDesc);
             num_bufs = i = 0;
-            desc_pa = vring_desc_addr(desc_pa, i);
+            desc_pa = desc.addr;
+            desc_host = vring_map_indirect(&ind, desc_pa, desc.len);
+            vring_desc_read(desc_pa, desc_host, i, &desc);
         }
 
-        do {
+        for (;;) {
             /* If we've got too many, that implies a descriptor loop. */
             if (++num_bufs > max) {
                 error_report("Looped descriptor");
                 exit(1);
             }
 
-            if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_WRITE) {
-                in_total += vring_desc_len(desc_pa, i);
+            if (desc.flags & VRING_DESC_F_WRITE) {
+                in_total += desc.len;
             } else {
-                out_total += vring_desc_len(desc_pa, i);
+                out_total += desc.len;
             }
             if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
+                vring_unmap_indirect(&ind);
                 goto done;
             }
-        } while ((i = virtqueue_next_desc(desc_pa, i, max)) != max);
+
+            i = virtqueue_next_desc(&desc, max);
+            if (i == max) {
+                break;
+            }
+            vring_desc_read(desc_pa, desc_host, i, &desc);
+        }
+        vring_unmap_indirect(&ind);
 
         if (!indirect)
             total_bufs = num_bufs;
@@ -430,10 +696,28 @@ void virtqueue_map_sg(struct iovec *sg, hwaddr *addr,
     }
 }
 
+/* Make the last @num popped but not yet pushed elements available again,
+ * e.g. after migration, where elements held by the device are not part of
+ * the saved state.  Fails if fewer than @num elements are outstanding.
+ */
+bool virtqueue_rewind(VirtQueue *vq, unsigned int num)
+{
+    uint16_t outstanding = vq->last_avail_idx - vring_used_idx(vq);
+
+    if (num > outstanding) {
+        return false;
+    }
+    vq->last_avail_idx -= num;
+    return true;
+}
+
 int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
 {
     unsigned int i, head, max;
     hwaddr desc_pa = vq->vring.desc;
+    const VRingDesc *desc_host;
+    VRingIndirect ind = { .desc = NULL };
+    VRingDesc desc;
 
     if (!virtqueue_num_heads(vq, vq->last_avail_idx))
         return 0;
@@ -448,46 +732,57 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
         vring_avail_event(vq, vring_avail_idx(vq));
     }
 
-    if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_INDIRECT) {
-        if (vring_desc_len(desc_pa, i) % sizeof(VRingDesc)) {
+    desc_host = vring_desc_table(vq);
+    vring_desc_read(desc_pa, desc_host, i, &desc);
+    if (desc.flags & VRING_DESC_F_INDIRECT) {
+        if (desc.len % sizeof(VRingDesc)) {
             error_report("Invalid size for indirect buffer table");
             exit(1);
         }
 
         /* loop over the indirect descriptor table */
-        max = vring_desc_len(desc_pa, i) / sizeof(VRingDesc);
-        desc_pa = vring_desc_addr(desc_pa, i);
+        max = desc.len / sizeof(VRingDesc);
+        desc_pa = desc.addr;
+        desc_host = vring_map_indirect(&ind, desc_pa, desc.len);
         i = 0;
+        vring_desc_read(desc_pa, desc_host, i, &desc);
     }
 
     /* Collect all the descriptors */
-    do {
+    for (;;) {
         struct iovec *sg;
 
-        if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_WRITE) {
+        if (desc.flags & VRING_DESC_F_WRITE) {
             if (elem->in_num >= ARRAY_SIZE(elem->in_sg)) {
                 error_report("Too many write descriptors in indirect table");
                 exit(1);
             }
-            elem->in_addr[elem->in_num] = vring_desc_addr(desc_pa, i);
+            elem->in_addr[elem->in_num] = desc.addr;
             sg = &elem->in_sg[elem->in_num++];
         } else {
             if (elem->out_num >= ARRAY_SIZE(elem->out_sg)) {
                 error_report("Too many read descriptors in indirect table");
                 exit(1);
             }
-            elem->out_addr[elem->out_num] = vring_desc_addr(desc_pa, i);
+            elem->out_addr[elem->out_num] = desc.addr;
             sg = &elem->out_sg[elem->out_num++];
         }
 
-        sg->iov_len = vring_desc_len(desc_pa, i);
+        sg->iov_len = desc.len;
 
         /* If we've got too many, that implies a descriptor loop. */
         if ((elem->in_num + elem->out_num) > max) {
             error_report("Looped descriptor");
             exit(1);
         }
-    } while ((i = virtqueue_next_desc(desc_pa, i, max)) != max);
+
+        i = virtqueue_next_desc(&desc, max);
+        if (i == max) {
+            break;
+        }
+        vring_desc_read(desc_pa, desc_host, i, &desc);
+    }
+    vring_unmap_indirect(&ind);
 
     /* Now map what we have collected */
     virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
@@ -496,6 +791,7 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
     elem->index = head;
 
     vq->inuse++;
+    vq->stats.popped++;
 
     trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
     return elem->in_num + elem->out_num;
@@ -551,6 +847,7 @@ void virtio_reset(void *opaque)
         vdev->vq[i].signalled_used = 0;
         vdev->vq[i].signalled_used_valid = false;
         vdev->vq[i].notification = true;
+        vdev->vq[i].map_gen = 0;
     }
 }
 
@@ -660,6 +957,7 @@ void virtio_queue_notify_vq(VirtQueue *vq)
     if (vq->vring.desc) {
         VirtIODevice *vdev = vq->vdev;
         trace_virtio_queue_notify(vdev, vq - vdev->vq, vq);
+        vq->stats.notifications++;
         vq->handle_output(vdev, vq);
     }
 }
@@ -700,13 +998,94 @@ VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
     return &vdev->vq[i];
 }
 
+void virtio_del_queue(VirtIODevice *vdev, int n)
+{
+    if (n < 0 || n >= VIRTIO_PCI_QUEUE_MAX) {
+        abort();
+    }
+
+    vdev->vq[n].vring.num = 0;
+}
+
 void virtio_irq(VirtQueue *vq)
 {
     trace_virtio_irq(vq);
+    vq->stats.interrupts++;
     vq->vdev->isr |= 0x01;
     virtio_notify_vector(vq->vdev, vq->vector);
 }
 
+void virtio_queue_count_ring_full(VirtQueue *vq)
+{
+    vq->stats.ring_full++;
+}
+
+void virtio_queue_count_batch(VirtQueue *vq, unsigned int n, bool limited)
+{
+    vq->stats.batches++;
+    vq->stats.batched += n;
+    vq->stats.batch_max = MAX(vq->stats.batch_max, n);
+    vq->stats.batch_limited += limited;
+    vq->stats.batch_empty += !n;
+}
+
+VirtioCountersList *qmp_query_virtio_counters(Error **errp)
+{
+    VirtioCountersList *head = NULL, **tail = &head;
+    VirtIODevice *vdev;
+    int i;
+
+    QLIST_FOREACH(vdev, &virtio_devices, list) {
+        VirtioCountersList *entry = g_malloc0(sizeof(*entry));
+        VirtioCounters *info = g_malloc0(sizeof(*info));
+        VirtQueueCountersList **qtail = &info->queues;
+
+        info->name = g_strdup(vdev->name);
+        if (vdev->binding_opaque) {
+            DeviceState *dev = DEVICE(vdev->binding_opaque);
+
+            if (dev->id) {
+                info->has_id = true;
+                info->id = g_strdup(dev->id);
+            }
+            info->has_path = true;
+            info->path = object_get_canonical_path(OBJECT(dev));
+        }
+
+        for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+            VirtQueue *vq = &vdev->vq[i];
+            VirtQueueCountersList *qentry;
+            VirtQueueCounters *q;
+
+            if (vq->vring.num == 0) {
+                continue;
+            }
+            qentry = g_malloc0(sizeof(*qentry));
+            q = g_malloc0(sizeof(*q));
+            q->index = i;
+            q->notifications = vq->stats.notifications;
+            q->interrupts = vq->stats.interrupts;
+            q->suppressed_interrupts = vq->stats.suppressed;
+            q->popped = vq->stats.popped;
+            q->ring_full = vq->stats.ring_full;
+            q->batches = vq->stats.batches;
+            q->batched = vq->stats.batched;
+            q->batch_max = vq->stats.batch_max;
+            q->batch_limited = vq->stats.batch_limited;
+            q->batch_empty = vq->stats.batch_empty;
+            qentry->value = q;
+            *qtail = qentry;
+            qtail = &qentry->next;
+        }
+
+        entry->value = info;
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    return head;
+}
+
 /* Assuming a given event_idx value from the other size, if
  * we have just incremented index from old to new_idx,
  * should we trigger an event? */
@@ -746,10 +1125,12 @@ static bool vring_notify(VirtIODevice *vdev, VirtQueue *vq)
 void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
     if (!vring_notify(vdev, vq)) {
+        vq->stats.suppressed++;
         return;
     }
 
     trace_virtio_notify(vdev, vq);
+    vq->stats.interrupts++;
     vdev->isr |= 0x01;
     virtio_notify_vector(vdev, vq->vector);
 }
@@ -877,6 +1258,7 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f)
 
 void virtio_cleanup(VirtIODevice *vdev)
 {
+    QLIST_REMOVE(vdev, list);
     qemu_del_vm_change_state_handler(vdev->vmstate);
     g_free(vdev->config);
     g_free(vdev->vq);
@@ -930,6 +1312,7 @@ VirtIODevice *virtio_common_init(const char *name, uint16_t device_id,
         vdev->config = NULL;
 
     vdev->vmstate = qemu_add_vm_change_state_handler(virtio_vmstate_change, vdev);
+    QLIST_INSERT_HEAD(&virtio_devices, vdev, list);
 
     return vdev;
 }
@@ -5,6 +5,13 @@
 #include <xen/io/blkif.h>
 #include <xen/io/protocols.h>
 
+/* Not all Xen versions provide this */
+#ifndef __CONST_RING_SIZE
+#define __CONST_RING_SIZE(_s, _sz)                              \
+    (__RD32(((_sz) - offsetof(struct _s##_sring, ring)) /       \
+            sizeof(((struct _s##_sring *)0)->ring[0])))
+#endif
+
 /* Not a real protocol.  Used to generate ring structs which contain
  * the elements common to all protocols only.  This way we get a
  * compiler-checkable way to use common struct elements, so we can
@@ -45,13 +45,23 @@
 
 static int batch_maps   = 0;
 
-static int max_requests = 32;
-
 /* ------------------------------------------------------------- */
 
 #define BLOCK_SIZE  512
 #define IOCB_COUNT  (BLKIF_MAX_SEGMENTS_PER_REQUEST + 2)
 
+/* Largest shared ring we accept, as log2 of the number of pages */
+#define XEN_BLKIF_MAX_RING_ORDER 4
+#define XEN_BLKIF_MAX_RING_PAGES (1 << XEN_BLKIF_MAX_RING_ORDER)
+
+/* A grant the frontend reuses across requests; it stays mapped until the
+ * frontend disconnects.
+ */
+typedef struct PersistentGrant {
+    void *page;
+    struct XenBlkDev *blkdev;
+} PersistentGrant;
+
 struct ioreq {
     blkif_request_t     req;
     int16_t             status;
@@ -69,6 +79,7 @@ struct ioreq {
     int                 prot;
     void                *page[BLKIF_MAX_SEGMENTS_PER_REQUEST];
     void                *pages;
+    int                 num_unmap;      /* transient mappings to undo */
 
     /* aio status */
     int                 aio_inflight;
@@ -88,7 +99,8 @@ struct XenBlkDev {
     char                *devtype;
     const char          *fileproto;
     const char          *filename;
-    int                 ring_ref;
+    int                 ring_ref[XEN_BLKIF_MAX_RING_PAGES];
+    unsigned int        nr_ring_ref;
     void                *sring;
     int64_t             file_blk;
     int64_t             file_size;
@@ -96,6 +108,13 @@ struct XenBlkDev {
     blkif_back_rings_t  rings;
     int                 more_work;
     int                 cnt_map;
+    int                 max_requests;
+
+    /* persistent grants */
+    bool                feature_persistent;
+    GTree               *persistent_gnts;
+    unsigned int        persistent_gnt_count;
+    unsigned int        max_grants;
 
     /* request lists */
     QLIST_HEAD(inflight_head, ioreq) inflight;
@@ -118,7 +137,7 @@ static struct ioreq *ioreq_start(struct XenBlkDev *blkdev)
     struct ioreq *ioreq = NULL;
 
     if (QLIST_EMPTY(&blkdev->freelist)) {
-        if (blkdev->requests_total >= max_requests) {
+        if (blkdev->requests_total >= blkdev->max_requests) {
             goto out;
         }
         /* allocate new struct */
@@ -237,26 +256,49 @@ err:
     return -1;
 }
 
+static int int_cmp(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+    guint ua = GPOINTER_TO_UINT(a);
+    guint ub = GPOINTER_TO_UINT(b);
+    return (ua > ub) - (ua < ub);
+}
+
+static void destroy_grant(gpointer pgnt)
+{
+    PersistentGrant *grant = pgnt;
+    XenGnttab gnt = grant->blkdev->xendev.gnttabdev;
+
+    if (xc_gnttab_munmap(gnt, grant->page, 1) != 0) {
+        xen_be_printf(&grant->blkdev->xendev, 0,
+                      "xc_gnttab_munmap failed: %s\n",
+                      strerror(errno));
+    }
+    grant->blkdev->cnt_map--;
+    xen_be_printf(&grant->blkdev->xendev, 3,
+                  "unmapped grant %p\n", grant->page);
+    g_free(grant);
+}
+
 static void ioreq_unmap(struct ioreq *ioreq)
 {
     XenGnttab gnt = ioreq->blkdev->xendev.gnttabdev;
     int i;
 
-    if (ioreq->v.niov == 0 || ioreq->mapped == 0) {
+    if (ioreq->num_unmap == 0 || ioreq->mapped == 0) {
         return;
     }
     if (batch_maps) {
         if (!ioreq->pages) {
             return;
         }
-        if (xc_gnttab_munmap(gnt, ioreq->pages, ioreq->v.niov) != 0) {
+        if (xc_gnttab_munmap(gnt, ioreq->pages, ioreq->num_unmap) != 0) {
             xen_be_printf(&ioreq->blkdev->xendev, 0, "xc_gnttab_munmap failed: %s\n",
                           strerror(errno));
         }
-        ioreq->blkdev->cnt_map -= ioreq->v.niov;
+        ioreq->blkdev->cnt_map -= ioreq->num_unmap;
         ioreq->pages = NULL;
     } else {
-        for (i = 0; i < ioreq->v.niov; i++) {
+        for (i = 0; i < ioreq->num_unmap; i++) {
             if (!ioreq->page[i]) {
                 continue;
             }
@@ -273,42 +315,115 @@ static void ioreq_unmap(struct ioreq *ioreq)
 
 static int ioreq_map(struct ioreq *ioreq)
 {
-    XenGnttab gnt = ioreq->blkdev->xendev.gnttabdev;
-    int i;
-
+    struct XenBlkDev *blkdev = ioreq->blkdev;
+    XenGnttab gnt = blkdev->xendev.gnttabdev;
+    uint32_t domids[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    uint32_t refs[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    void *page[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+    int i, j, new_maps = 0;
+    PersistentGrant *grant;
+
+    /* domids and refs receive the grants that still need mapping; page
+     * ends up with the address of every segment in request order, whether
+     * it came from a persistent grant or a fresh mapping.
+     */
     if (ioreq->v.niov == 0 || ioreq->mapped == 1) {
         return 0;
     }
-    if (batch_maps) {
+    if (blkdev->feature_persistent) {
+        for (i = 0; i < ioreq->v.niov; i++) {
+            grant = g_tree_lookup(blkdev->persistent_gnts,
+                                  GUINT_TO_POINTER(ioreq->refs[i]));
+            if (grant != NULL) {
+                page[i] = grant->page;
+                xen_be_printf(&blkdev->xendev, 3,
+                              "using persistent-grant %" PRIu32 "\n",
+                              ioreq->refs[i]);
+            } else {
+                domids[new_maps] = ioreq->domids[i];
+                refs[new_maps] = ioreq->refs[i];
+                page[i] = NULL;
+                new_maps++;
+            }
+        }
+        /* the grant may be reused later in the other direction */
+        ioreq->prot = PROT_WRITE | PROT_READ;
+    } else {
+        memcpy(refs, ioreq->refs, sizeof(refs));
+        memcpy(domids, ioreq->domids, sizeof(domids));
+        memset(page, 0, sizeof(page));
+        new_maps = ioreq->v.niov;
+    }
+
+    if (batch_maps && new_maps) {
         ioreq->pages = xc_gnttab_map_grant_refs
-            (gnt, ioreq->v.niov, ioreq->domids, ioreq->refs, ioreq->prot);
+            (gnt, new_maps, domids, refs, ioreq->prot);
         if (ioreq->pages == NULL) {
-            xen_be_printf(&ioreq->blkdev->xendev, 0,
+            xen_be_printf(&blkdev->xendev, 0,
                           "can't map %d grant refs (%s, %d maps)\n",
-                          ioreq->v.niov, strerror(errno), ioreq->blkdev->cnt_map);
+                          new_maps, strerror(errno), blkdev->cnt_map);
             return -1;
         }
-        for (i = 0; i < ioreq->v.niov; i++) {
-            ioreq->v.iov[i].iov_base = ioreq->pages + i * XC_PAGE_SIZE +
-                (uintptr_t)ioreq->v.iov[i].iov_base;
+        for (i = 0, j = 0; i < ioreq->v.niov; i++) {
+            if (page[i] == NULL) {
+                page[i] = ioreq->pages + (j++) * XC_PAGE_SIZE;
+            }
         }
-        ioreq->blkdev->cnt_map += ioreq->v.niov;
-    } else  {
-        for (i = 0; i < ioreq->v.niov; i++) {
+        blkdev->cnt_map += new_maps;
+    } else if (new_maps)  {
+        for (i = 0; i < new_maps; i++) {
             ioreq->page[i] = xc_gnttab_map_grant_ref
-                (gnt, ioreq->domids[i], ioreq->refs[i], ioreq->prot);
+                (gnt, domids[i], refs[i], ioreq->prot);
             if (ioreq->page[i] == NULL) {
-                xen_be_printf(&ioreq->blkdev->xendev, 0,
+                xen_be_printf(&blkdev->xendev, 0,
                               "can't map grant ref %d (%s, %d maps)\n",
-                              ioreq->refs[i], strerror(errno), ioreq->blkdev->cnt_map);
+                              refs[i], strerror(errno), blkdev->cnt_map);
+                ioreq->mapped = 1;
+                ioreq->num_unmap = i;
                 ioreq_unmap(ioreq);
                 return -1;
             }
-            ioreq->v.iov[i].iov_base = ioreq->page[i] + (uintptr_t)ioreq->v.iov[i].iov_base;
-            ioreq->blkdev->cnt_map++;
+            blkdev->cnt_map++;
+        }
+        for (i = 0, j = 0; i < ioreq->v.niov; i++) {
+            if (page[i] == NULL) {
+                page[i] = ioreq->page[j++];
+            }
         }
     }
+
+    /* Keep as many of the new mappings as the budget allows.  Taking them
+     * from the end means ioreq_unmap() only has to undo the first
+     * num_unmap ones.  A grant used twice in the same request is kept
+     * once; the other mapping stays transient.
+     */
+    while (blkdev->feature_persistent && new_maps &&
+           blkdev->persistent_gnt_count < blkdev->max_grants) {
+        if (g_tree_lookup(blkdev->persistent_gnts,
+                          GUINT_TO_POINTER(refs[new_maps - 1]))) {
+            break;
+        }
+        new_maps--;
+        grant = g_malloc0(sizeof(*grant));
+        if (batch_maps) {
+            grant->page = ioreq->pages + new_maps * XC_PAGE_SIZE;
+        } else {
+            grant->page = ioreq->page[new_maps];
+        }
+        grant->blkdev = blkdev;
+        xen_be_printf(&blkdev->xendev, 3, "adding grant %" PRIu32 " page: %p\n",
+                      refs[new_maps], grant->page);
+        g_tree_insert(blkdev->persistent_gnts,
+                      GUINT_TO_POINTER(refs[new_maps]), grant);
+        blkdev->persistent_gnt_count++;
+    }
+
+    for (i = 0; i < ioreq->v.niov; i++) {
+        ioreq->v.iov[i].iov_base = page[i] +
+                                   (uintptr_t)ioreq->v.iov[i].iov_base;
+    }
     ioreq->mapped = 1;
+    ioreq->num_unmap = new_maps;
     return 0;
 }
 
@@ -494,6 +609,7 @@ static void blk_handle_requests(struct XenBlkDev *blkdev)
     xen_rmb(); /* Ensure we see queued requests up to 'rp'. */
 
     blk_send_response_all(blkdev);
+    bdrv_io_plug(blkdev->bs);
     while (rc != rp) {
         /* pull request from ring */
         if (RING_REQUEST_CONS_OVERFLOW(&blkdev->rings.common, rc)) {
@@ -518,8 +634,9 @@ static void blk_handle_requests(struct XenBlkDev *blkdev)
 
         ioreq_runio_qemu_aio(ioreq);
     }
+    bdrv_io_unplug(blkdev->bs);
 
-    if (blkdev->more_work && blkdev->requests_inflight < max_requests) {
+    if (blkdev->more_work && blkdev->requests_inflight < blkdev->max_requests) {
         qemu_bh_schedule(blkdev->bh);
     }
 }
@@ -552,11 +669,6 @@ static void blk_alloc(struct XenDevice *xendev)
     if (xen_mode != XEN_EMULATE) {
         batch_maps = 1;
     }
-    if (xc_gnttab_set_max_grants(xendev->gnttabdev,
-            MAX_GRANTS(max_requests, BLKIF_MAX_SEGMENTS_PER_REQUEST)) < 0) {
-        xen_be_printf(xendev, 0, "xc_gnttab_set_max_grants failed: %s\n",
-                      strerror(errno));
-    }
 }
 
 static int blk_init(struct XenDevice *xendev)
@@ -656,6 +768,9 @@ static int blk_init(struct XenDevice *xendev)
 
     /* fill info */
     xenstore_write_be_int(&blkdev->xendev, "feature-barrier", 1);
+    xenstore_write_be_int(&blkdev->xendev, "feature-persistent", 1);
+    xenstore_write_be_int(&blkdev->xendev, "max-ring-page-order",
+                          XEN_BLKIF_MAX_RING_ORDER);
     xenstore_write_be_int(&blkdev->xendev, "info",            info);
     xenstore_write_be_int(&blkdev->xendev, "sector-size",     blkdev->file_blk);
     xenstore_write_be_int(&blkdev->xendev, "sectors",
@@ -679,14 +794,43 @@ out_error:
 static int blk_connect(struct XenDevice *xendev)
 {
     struct XenBlkDev *blkdev = container_of(xendev, struct XenBlkDev, xendev);
-
-    if (xenstore_read_fe_int(&blkdev->xendev, "ring-ref", &blkdev->ring_ref) == -1) {
+    uint32_t domids[XEN_BLKIF_MAX_RING_PAGES];
+    uint32_t refs[XEN_BLKIF_MAX_RING_PAGES];
+    unsigned int ring_size, i;
+    int order, pers;
+
+    /* multi-page rings announce their size and use ring-ref0...N */
+    if (xenstore_read_fe_int(&blkdev->xendev, "ring-page-order", &order) == -1) {
+        blkdev->nr_ring_ref = 1;
+        if (xenstore_read_fe_int(&blkdev->xendev, "ring-ref",
+                                 &blkdev->ring_ref[0]) == -1) {
+            return -1;
+        }
+    } else if (order >= 0 && order <= XEN_BLKIF_MAX_RING_ORDER) {
+        blkdev->nr_ring_ref = 1 << order;
+        for (i = 0; i < blkdev->nr_ring_ref; i++) {
+            char *key = g_strdup_printf("ring-ref%u", i);
+            int ret = xenstore_read_fe_int(&blkdev->xendev, key,
+                                           &blkdev->ring_ref[i]);
+            g_free(key);
+            if (ret == -1) {
+                return -1;
+            }
+        }
+    } else {
+        xen_be_printf(&blkdev->xendev, 0, "invalid ring-page-order: %d\n",
+                      order);
         return -1;
     }
     if (xenstore_read_fe_int(&blkdev->xendev, "event-channel",
                              &blkdev->xendev.remote_port) == -1) {
         return -1;
     }
+    if (xenstore_read_fe_int(&blkdev->xendev, "feature-persistent", &pers)) {
+        blkdev->feature_persistent = false;
+    } else {
+        blkdev->feature_persistent = !!pers;
+    }
 
     blkdev->protocol = BLKIF_PROTOCOL_NATIVE;
     if (blkdev->xendev.protocol) {
@@ -698,44 +842,79 @@ static int blk_connect(struct XenDevice *xendev)
         }
     }
 
-    blkdev->sring = xc_gnttab_map_grant_ref(blkdev->xendev.gnttabdev,
-                                            blkdev->xendev.dom,
-                                            blkdev->ring_ref,
-                                            PROT_READ | PROT_WRITE);
+    ring_size = XC_PAGE_SIZE * blkdev->nr_ring_ref;
+    switch (blkdev->protocol) {
+    case BLKIF_PROTOCOL_X86_32:
+        blkdev->max_requests = __CONST_RING_SIZE(blkif_x86_32, ring_size);
+        break;
+    case BLKIF_PROTOCOL_X86_64:
+        blkdev->max_requests = __CONST_RING_SIZE(blkif_x86_64, ring_size);
+        break;
+    default:
+        blkdev->max_requests = __CONST_RING_SIZE(blkif, ring_size);
+        break;
+    }
+
+    /* the ring pages plus the data pages of every request in flight */
+    if (xc_gnttab_set_max_grants(blkdev->xendev.gnttabdev,
+            MAX_GRANTS(blkdev->max_requests, BLKIF_MAX_SEGMENTS_PER_REQUEST) +
+            blkdev->nr_ring_ref) < 0) {
+        xen_be_printf(&blkdev->xendev, 0, "xc_gnttab_set_max_grants failed: %s\n",
+                      strerror(errno));
+    }
+
+    for (i = 0; i < blkdev->nr_ring_ref; i++) {
+        domids[i] = blkdev->xendev.dom;
+        refs[i] = blkdev->ring_ref[i];
+    }
+    blkdev->sring = xc_gnttab_map_grant_refs(blkdev->xendev.gnttabdev,
+                                             blkdev->nr_ring_ref, domids, refs,
+                                             PROT_READ | PROT_WRITE);
     if (!blkdev->sring) {
         return -1;
     }
-    blkdev->cnt_map++;
+    blkdev->cnt_map += blkdev->nr_ring_ref;
 
     switch (blkdev->protocol) {
     case BLKIF_PROTOCOL_NATIVE:
     {
         blkif_sring_t *sring_native = blkdev->sring;
-        BACK_RING_INIT(&blkdev->rings.native, sring_native, XC_PAGE_SIZE);
+        BACK_RING_INIT(&blkdev->rings.native, sring_native, ring_size);
         break;
     }
     case BLKIF_PROTOCOL_X86_32:
     {
         blkif_x86_32_sring_t *sring_x86_32 = blkdev->sring;
 
-        BACK_RING_INIT(&blkdev->rings.x86_32_part, sring_x86_32, XC_PAGE_SIZE);
+        BACK_RING_INIT(&blkdev->rings.x86_32_part, sring_x86_32, ring_size);
         break;
     }
     case BLKIF_PROTOCOL_X86_64:
     {
         blkif_x86_64_sring_t *sring_x86_64 = blkdev->sring;
 
-        BACK_RING_INIT(&blkdev->rings.x86_64_part, sring_x86_64, XC_PAGE_SIZE);
+        BACK_RING_INIT(&blkdev->rings.x86_64_part, sring_x86_64, ring_size);
         break;
     }
     }
 
+    if (blkdev->feature_persistent) {
+        /* Init persistent grants */
+        blkdev->max_grants = blkdev->max_requests *
+                             BLKIF_MAX_SEGMENTS_PER_REQUEST;
+        blkdev->persistent_gnts = g_tree_new_full((GCompareDataFunc)int_cmp,
+                                                  NULL, NULL,
+                                                  (GDestroyNotify)destroy_grant);
+        blkdev->persistent_gnt_count = 0;
+    }
+
     xen_be_bind_evtchn(&blkdev->xendev);
 
-    xen_be_printf(&blkdev->xendev, 1, "ok: proto %s, ring-ref %d, "
-                  "remote port %d, local port %d\n",
-                  blkdev->xendev.protocol, blkdev->ring_ref,
-                  blkdev->xendev.remote_port, blkdev->xendev.local_port);
+    xen_be_printf(&blkdev->xendev, 1, "ok: proto %s, nr-ring-ref %u, "
+                  "remote port %d, local port %d, persistent grants %d\n",
+                  blkdev->xendev.protocol, blkdev->nr_ring_ref,
+                  blkdev->xendev.remote_port, blkdev->xendev.local_port,
+                  blkdev->feature_persistent);
     return 0;
 }
 
@@ -755,10 +934,18 @@ static void blk_disconnect(struct XenDevice *xendev)
     xen_be_unbind_evtchn(&blkdev->xendev);
 
     if (blkdev->sring) {
-        xc_gnttab_munmap(blkdev->xendev.gnttabdev, blkdev->sring, 1);
-        blkdev->cnt_map--;
+        xc_gnttab_munmap(blkdev->xendev.gnttabdev, blkdev->sring,
+                         blkdev->nr_ring_ref);
+        blkdev->cnt_map -= blkdev->nr_ring_ref;
         blkdev->sring = NULL;
     }
+
+    /* Free persistent grants */
+    if (blkdev->feature_persistent && blkdev->persistent_gnts) {
+        g_tree_destroy(blkdev->persistent_gnts);
+        blkdev->persistent_gnts = NULL;
+        blkdev->persistent_gnt_count = 0;
+    }
 }
 
 static int blk_free(struct XenDevice *xendev)
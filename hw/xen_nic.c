@@ -46,173 +46,247 @@
 
 /* ------------------------------------------------------------- */
 
-struct XenNetDev {
-    struct XenDevice      xendev;  /* must be first */
-    char                  *mac;
-    int                   tx_work;
+/* Queues the frontend may use, see multi-queue-max-queues */
+#define NET_MAX_QUEUES  8
+/* Requests whose grants are mapped with a single call */
+#define NET_TX_BATCH    64
+#define NET_RX_BATCH    64
+
+struct XenNetDev;
+
+struct XenNetQueue {
+    struct XenNetDev      *netdev;
+    int                   id;
     int                   tx_ring_ref;
     int                   rx_ring_ref;
     struct netif_tx_sring *txs;
     struct netif_rx_sring *rxs;
     netif_tx_back_ring_t  tx_ring;
     netif_rx_back_ring_t  rx_ring;
+
+    /* queue 0 uses the event channel of the xendev */
+    XenEvtchn             evtchndev;
+    int                   local_port;
+    int                   remote_port;
+
+    /*
+     * Receive buffers of the current burst of packets, mapped in one go.
+     * rx_reqs[rx_used..rx_mapped) are still owned by the frontend.
+     */
+    netif_rx_request_t    rx_reqs[NET_RX_BATCH];
+    uint8_t               *rx_pages;
+    int                   rx_mapped;
+    int                   rx_used;
+    QEMUBH                *rx_bh;   /* ends the burst */
+};
+
+struct XenNetDev {
+    struct XenDevice      xendev;  /* must be first */
+    char                  *mac;
+    int                   num_queues;
+    struct XenNetQueue    queues[NET_MAX_QUEUES];
     NICConf               conf;
     NICState              *nic;
 };
 
 /* ------------------------------------------------------------- */
 
-static void net_tx_response(struct XenNetDev *netdev, netif_tx_request_t *txp, int8_t st)
+static void net_notify(struct XenNetQueue *q)
+{
+    if (q->id == 0) {
+        xen_be_send_notify(&q->netdev->xendev);
+    } else {
+        xc_evtchn_notify(q->evtchndev, q->local_port);
+    }
+}
+
+static void net_tx_response(struct XenNetQueue *q, netif_tx_request_t *txp,
+                            int8_t st)
 {
-    RING_IDX i = netdev->tx_ring.rsp_prod_pvt;
+    RING_IDX i = q->tx_ring.rsp_prod_pvt;
     netif_tx_response_t *resp;
-    int notify;
 
-    resp = RING_GET_RESPONSE(&netdev->tx_ring, i);
+    resp = RING_GET_RESPONSE(&q->tx_ring, i);
     resp->id     = txp->id;
     resp->status = st;
 
-#if 0
+    q->tx_ring.rsp_prod_pvt = ++i;
+}
+
+/* Publish the responses of a batch with at most one notification */
+static void net_tx_push_responses(struct XenNetQueue *q)
+{
+    int notify;
+
+    RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(&q->tx_ring, notify);
+    if (notify) {
+        net_notify(q);
+    }
+}
+
+static bool net_tx_check(struct XenNetQueue *q, netif_tx_request_t *txp)
+{
+    struct XenNetDev *netdev = q->netdev;
+
+    /* should not happen in theory, we don't announce the *
+     * feature-{sg,gso,whatelse} flags in xenstore (yet?) */
     if (txp->flags & NETTXF_extra_info) {
-        RING_GET_RESPONSE(&netdev->tx_ring, ++i)->status = NETIF_RSP_NULL;
+        xen_be_printf(&netdev->xendev, 0, "FIXME: extra info flag\n");
+        return false;
+    }
+    if (txp->flags & NETTXF_more_data) {
+        xen_be_printf(&netdev->xendev, 0, "FIXME: more data flag\n");
+        return false;
     }
-#endif
 
-    netdev->tx_ring.rsp_prod_pvt = ++i;
-    RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(&netdev->tx_ring, notify);
-    if (notify) {
-        xen_be_send_notify(&netdev->xendev);
+    if (txp->size < 14) {
+        xen_be_printf(&netdev->xendev, 0, "bad packet size: %d\n", txp->size);
+        return false;
     }
 
-    if (i == netdev->tx_ring.req_cons) {
-        int more_to_do;
-        RING_FINAL_CHECK_FOR_REQUESTS(&netdev->tx_ring, more_to_do);
-        if (more_to_do) {
-            netdev->tx_work++;
-        }
+    if ((txp->offset + txp->size) > XC_PAGE_SIZE) {
+        xen_be_printf(&netdev->xendev, 0, "error: page crossing\n");
+        return false;
     }
+
+    xen_be_printf(&netdev->xendev, 3, "tx packet ref %d, off %d, len %d, flags 0x%x%s%s%s%s\n",
+                  txp->gref, txp->offset, txp->size, txp->flags,
+                  (txp->flags & NETTXF_csum_blank)     ? " csum_blank"     : "",
+                  (txp->flags & NETTXF_data_validated) ? " data_validated" : "",
+                  (txp->flags & NETTXF_more_data)      ? " more_data"      : "",
+                  (txp->flags & NETTXF_extra_info)     ? " extra_info"     : "");
+    return true;
 }
 
-static void net_tx_error(struct XenNetDev *netdev, netif_tx_request_t *txp, RING_IDX end)
+static void net_tx_send(struct XenNetQueue *q, netif_tx_request_t *txp,
+                        uint8_t *page, uint8_t *tmpbuf)
 {
-#if 0
-    /*
-     * Hmm, why netback fails everything in the ring?
-     * Should we do that even when not supporting SG and TSO?
-     */
-    RING_IDX cons = netdev->tx_ring.req_cons;
+    NetClientState *nc = qemu_get_queue(q->netdev->nic);
+
+    if (txp->flags & NETTXF_csum_blank) {
+        /* have read-only mapping -> can't fill checksum in-place */
+        memcpy(tmpbuf, page + txp->offset, txp->size);
+        net_checksum_calculate(tmpbuf, txp->size);
+        qemu_send_packet(nc, tmpbuf, txp->size);
+    } else {
+        qemu_send_packet(nc, page + txp->offset, txp->size);
+    }
+}
 
-    do {
-        make_tx_response(netif, txp, NETIF_RSP_ERROR);
-        if (cons >= end) {
-            break;
+/*
+ * Send a batch of requests whose grants could not be mapped together, so
+ * that a bad grant only fails its own packet.
+ */
+static void net_tx_send_one_by_one(struct XenNetQueue *q,
+                                   netif_tx_request_t *txreqs, int n,
+                                   uint8_t *tmpbuf)
+{
+    struct XenNetDev *netdev = q->netdev;
+    uint8_t *page;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        page = xc_gnttab_map_grant_ref(netdev->xendev.gnttabdev,
+                                       netdev->xendev.dom,
+                                       txreqs[i].gref, PROT_READ);
+        if (page == NULL) {
+            xen_be_printf(&netdev->xendev, 0, "error: tx gref dereference failed (%d)\n",
+                          txreqs[i].gref);
+            net_tx_response(q, &txreqs[i], NETIF_RSP_ERROR);
+            continue;
         }
-        txp = RING_GET_REQUEST(&netdev->tx_ring, cons++);
-    } while (1);
-    netdev->tx_ring.req_cons = cons;
-    netif_schedule_work(netif);
-    netif_put(netif);
-#else
-    net_tx_response(netdev, txp, NETIF_RSP_ERROR);
-#endif
+        net_tx_send(q, &txreqs[i], page, tmpbuf);
+        xc_gnttab_munmap(netdev->xendev.gnttabdev, page, 1);
+        net_tx_response(q, &txreqs[i], NETIF_RSP_OKAY);
+    }
 }
 
-static void net_tx_packets(struct XenNetDev *netdev)
+static void net_tx_packets(struct XenNetQueue *q)
 {
-    netif_tx_request_t txreq;
+    struct XenNetDev *netdev = q->netdev;
+    netif_tx_request_t txreqs[NET_TX_BATCH];
+    uint32_t domids[NET_TX_BATCH];
+    uint32_t refs[NET_TX_BATCH];
+    uint8_t *tmpbuf = NULL;
+    uint8_t *pages;
     RING_IDX rc, rp;
-    void *page;
-    void *tmpbuf = NULL;
+    int i, n, more_to_do;
 
     for (;;) {
-        rc = netdev->tx_ring.req_cons;
-        rp = netdev->tx_ring.sring->req_prod;
+        rc = q->tx_ring.req_cons;
+        rp = q->tx_ring.sring->req_prod;
         xen_rmb(); /* Ensure we see queued requests up to 'rp'. */
 
-        while ((rc != rp)) {
-            if (RING_REQUEST_CONS_OVERFLOW(&netdev->tx_ring, rc)) {
+        /* Collect a batch of requests, failing the malformed ones */
+        n = 0;
+        while (rc != rp && n < NET_TX_BATCH) {
+            if (RING_REQUEST_CONS_OVERFLOW(&q->tx_ring, rc)) {
                 break;
             }
-            memcpy(&txreq, RING_GET_REQUEST(&netdev->tx_ring, rc), sizeof(txreq));
-            netdev->tx_ring.req_cons = ++rc;
-
-#if 1
-            /* should not happen in theory, we don't announce the *
-             * feature-{sg,gso,whatelse} flags in xenstore (yet?) */
-            if (txreq.flags & NETTXF_extra_info) {
-                xen_be_printf(&netdev->xendev, 0, "FIXME: extra info flag\n");
-                net_tx_error(netdev, &txreq, rc);
-                continue;
-            }
-            if (txreq.flags & NETTXF_more_data) {
-                xen_be_printf(&netdev->xendev, 0, "FIXME: more data flag\n");
-                net_tx_error(netdev, &txreq, rc);
-                continue;
-            }
-#endif
+            memcpy(&txreqs[n], RING_GET_REQUEST(&q->tx_ring, rc),
+                   sizeof(txreqs[n]));
+            q->tx_ring.req_cons = ++rc;
 
-            if (txreq.size < 14) {
-                xen_be_printf(&netdev->xendev, 0, "bad packet size: %d\n", txreq.size);
-                net_tx_error(netdev, &txreq, rc);
+            if (!net_tx_check(q, &txreqs[n])) {
+                net_tx_response(q, &txreqs[n], NETIF_RSP_ERROR);
                 continue;
             }
+            domids[n] = netdev->xendev.dom;
+            refs[n] = txreqs[n].gref;
+            n++;
+        }
 
-            if ((txreq.offset + txreq.size) > XC_PAGE_SIZE) {
-                xen_be_printf(&netdev->xendev, 0, "error: page crossing\n");
-                net_tx_error(netdev, &txreq, rc);
-                continue;
+        if (n) {
+            if (!tmpbuf) {
+                tmpbuf = g_malloc(XC_PAGE_SIZE);
             }
 
-            xen_be_printf(&netdev->xendev, 3, "tx packet ref %d, off %d, len %d, flags 0x%x%s%s%s%s\n",
-                          txreq.gref, txreq.offset, txreq.size, txreq.flags,
-                          (txreq.flags & NETTXF_csum_blank)     ? " csum_blank"     : "",
-                          (txreq.flags & NETTXF_data_validated) ? " data_validated" : "",
-                          (txreq.flags & NETTXF_more_data)      ? " more_data"      : "",
-                          (txreq.flags & NETTXF_extra_info)     ? " extra_info"     : "");
-
-            page = xc_gnttab_map_grant_ref(netdev->xendev.gnttabdev,
-                                           netdev->xendev.dom,
-                                           txreq.gref, PROT_READ);
-            if (page == NULL) {
-                xen_be_printf(&netdev->xendev, 0, "error: tx gref dereference failed (%d)\n",
-                              txreq.gref);
-                net_tx_error(netdev, &txreq, rc);
-                continue;
-            }
-            if (txreq.flags & NETTXF_csum_blank) {
-                /* have read-only mapping -> can't fill checksum in-place */
-                if (!tmpbuf) {
-                    tmpbuf = g_malloc(XC_PAGE_SIZE);
+            /* One mapping and one TLB flush for the whole batch */
+            pages = xc_gnttab_map_grant_refs(netdev->xendev.gnttabdev, n,
+                                             domids, refs, PROT_READ);
+            if (pages) {
+                for (i = 0; i < n; i++) {
+                    net_tx_send(q, &txreqs[i], pages + i * XC_PAGE_SIZE,
+                                tmpbuf);
+                }
+                xc_gnttab_munmap(netdev->xendev.gnttabdev, pages, n);
+                for (i = 0; i < n; i++) {
+                    net_tx_response(q, &txreqs[i], NETIF_RSP_OKAY);
                 }
-                memcpy(tmpbuf, page + txreq.offset, txreq.size);
-                net_checksum_calculate(tmpbuf, txreq.size);
-                qemu_send_packet(&netdev->nic->nc, tmpbuf, txreq.size);
             } else {
-                qemu_send_packet(&netdev->nic->nc, page + txreq.offset, txreq.size);
+                net_tx_send_one_by_one(q, txreqs, n, tmpbuf);
             }
-            xc_gnttab_munmap(netdev->xendev.gnttabdev, page, 1);
-            net_tx_response(netdev, &txreq, NETIF_RSP_OKAY);
         }
-        if (!netdev->tx_work) {
+
+        net_tx_push_responses(q);
+
+        if (n == NET_TX_BATCH) {
+            continue;
+        }
+        if (rc != rp) {
+            /* overflow, the frontend queued more than the ring holds */
+            break;
+        }
+        /* Ask for an event only once the ring has run dry */
+        RING_FINAL_CHECK_FOR_REQUESTS(&q->tx_ring, more_to_do);
+        if (!more_to_do) {
             break;
         }
-        netdev->tx_work = 0;
     }
     g_free(tmpbuf);
 }
 
 /* ------------------------------------------------------------- */
 
-static void net_rx_response(struct XenNetDev *netdev,
+static void net_rx_response(struct XenNetQueue *q,
                             netif_rx_request_t *req, int8_t st,
                             uint16_t offset, uint16_t size,
                             uint16_t flags)
 {
-    RING_IDX i = netdev->rx_ring.rsp_prod_pvt;
+    RING_IDX i = q->rx_ring.rsp_prod_pvt;
     netif_rx_response_t *resp;
-    int notify;
 
-    resp = RING_GET_RESPONSE(&netdev->rx_ring, i);
+    resp = RING_GET_RESPONSE(&q->rx_ring, i);
     resp->offset     = offset;
     resp->flags      = flags;
     resp->id         = req->id;
@@ -221,79 +295,194 @@ static void net_rx_response(struct XenNetDev *netdev,
         resp->status = (int16_t)st;
     }
 
-    xen_be_printf(&netdev->xendev, 3, "rx response: idx %d, status %d, flags 0x%x\n",
-                  i, resp->status, resp->flags);
+    xen_be_printf(&q->netdev->xendev, 3, "rx response: queue %d, idx %d, status %d, flags 0x%x\n",
+                  q->id, i, resp->status, resp->flags);
 
-    netdev->rx_ring.rsp_prod_pvt = ++i;
-    RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(&netdev->rx_ring, notify);
+    q->rx_ring.rsp_prod_pvt = ++i;
+}
+
+static void net_rx_push_responses(struct XenNetQueue *q)
+{
+    int notify;
+
+    RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(&q->rx_ring, notify);
     if (notify) {
-        xen_be_send_notify(&netdev->xendev);
+        net_notify(q);
     }
 }
 
-#define NET_IP_ALIGN 2
+static void net_rx_unmap(struct XenNetQueue *q)
+{
+    if (q->rx_pages) {
+        xc_gnttab_munmap(q->netdev->xendev.gnttabdev, q->rx_pages,
+                         q->rx_mapped);
+        q->rx_pages = NULL;
+    }
+    q->rx_mapped = 0;
+    q->rx_used = 0;
+}
 
-static int net_rx_ok(NetClientState *nc)
+/* End of a burst of received packets: give the buffers back */
+static void net_rx_bh(void *opaque)
+{
+    struct XenNetQueue *q = opaque;
+
+    net_rx_unmap(q);
+    net_rx_push_responses(q);
+}
+
+static bool net_rx_has_buffers(struct XenNetQueue *q)
 {
-    struct XenNetDev *netdev = DO_UPCAST(NICState, nc, nc)->opaque;
     RING_IDX rc, rp;
 
-    if (netdev->xendev.be_state != XenbusStateConnected) {
-        return 0;
+    if (q->rx_used < q->rx_mapped) {
+        return true;
     }
 
-    rc = netdev->rx_ring.req_cons;
-    rp = netdev->rx_ring.sring->req_prod;
+    rc = q->rx_ring.req_cons;
+    rp = q->rx_ring.sring->req_prod;
     xen_rmb();
 
-    if (rc == rp || RING_REQUEST_CONS_OVERFLOW(&netdev->rx_ring, rc)) {
-        xen_be_printf(&netdev->xendev, 2, "%s: no rx buffers (%d/%d)\n",
-                      __FUNCTION__, rc, rp);
+    return rc != rp && !RING_REQUEST_CONS_OVERFLOW(&q->rx_ring, rc);
+}
+
+/*
+ * Map the buffers posted by the frontend, up to NET_RX_BATCH of them.
+ * Returns false if there are none.
+ */
+static bool net_rx_map(struct XenNetQueue *q)
+{
+    struct XenNetDev *netdev = q->netdev;
+    uint32_t domids[NET_RX_BATCH];
+    uint32_t refs[NET_RX_BATCH];
+    RING_IDX rc, rp;
+    int n = 0;
+
+    rc = q->rx_ring.req_cons;
+    rp = q->rx_ring.sring->req_prod;
+    xen_rmb(); /* Ensure we see queued requests up to 'rp'. */
+
+    while (rc != rp && n < NET_RX_BATCH &&
+           !RING_REQUEST_CONS_OVERFLOW(&q->rx_ring, rc)) {
+        memcpy(&q->rx_reqs[n], RING_GET_REQUEST(&q->rx_ring, rc),
+               sizeof(q->rx_reqs[n]));
+        domids[n] = netdev->xendev.dom;
+        refs[n] = q->rx_reqs[n].gref;
+        rc++;
+        n++;
+    }
+    if (n == 0) {
+        return false;
+    }
+
+    q->rx_pages = xc_gnttab_map_grant_refs(netdev->xendev.gnttabdev, n,
+                                           domids, refs, PROT_WRITE);
+    if (q->rx_pages == NULL && n > 1) {
+        /* Some grant is bad; find out which one, a buffer at a time */
+        n = 1;
+        q->rx_pages = xc_gnttab_map_grant_ref(netdev->xendev.gnttabdev,
+                                              netdev->xendev.dom,
+                                              refs[0], PROT_WRITE);
+    }
+    if (q->rx_pages == NULL) {
+        xen_be_printf(&netdev->xendev, 0, "error: rx gref dereference failed (%d)\n",
+                      refs[0]);
+        q->rx_ring.req_cons++;
+        net_rx_response(q, &q->rx_reqs[0], NETIF_RSP_ERROR, 0, 0, 0);
+        net_rx_push_responses(q);
+        return false;
+    }
+
+    q->rx_mapped = n;
+    q->rx_used = 0;
+    return true;
+}
+
+/* Spread flows over the queues by their IPv4 addresses and ports */
+static int net_rx_select_queue(struct XenNetDev *netdev, const uint8_t *buf,
+                               size_t size)
+{
+    const uint8_t *ip = buf + 14;
+    uint32_t hash;
+    int ihl;
+
+    if (netdev->num_queues == 1 || size < 14 + 20 ||
+        lduw_be_p(buf + 12) != 0x0800) {
         return 0;
     }
-    return 1;
+
+    ihl = (ip[0] & 0xf) * 4;
+    hash = ldl_be_p(ip + 12) ^ ldl_be_p(ip + 16);
+    if ((ip[9] == 6 || ip[9] == 17) && size >= 14 + ihl + 4) {
+        hash ^= ldl_be_p(ip + ihl);
+    }
+    hash ^= hash >> 16;
+    hash ^= hash >> 8;
+
+    return hash % netdev->num_queues;
 }
 
-static ssize_t net_rx_packet(NetClientState *nc, const uint8_t *buf, size_t size)
+#define NET_IP_ALIGN 2
+
+static int net_rx_ok(NetClientState *nc)
 {
-    struct XenNetDev *netdev = DO_UPCAST(NICState, nc, nc)->opaque;
-    netif_rx_request_t rxreq;
-    RING_IDX rc, rp;
-    void *page;
+    struct XenNetDev *netdev = qemu_get_nic_opaque(nc);
+    int i;
 
     if (netdev->xendev.be_state != XenbusStateConnected) {
-        return -1;
+        return 0;
     }
 
-    rc = netdev->rx_ring.req_cons;
-    rp = netdev->rx_ring.sring->req_prod;
-    xen_rmb(); /* Ensure we see queued requests up to 'rp'. */
+    /* The packet may be steered to any of the queues */
+    for (i = 0; i < netdev->num_queues; i++) {
+        if (!net_rx_has_buffers(&netdev->queues[i])) {
+            xen_be_printf(&netdev->xendev, 2, "%s: no rx buffers on queue %d\n",
+                          __FUNCTION__, i);
+            return 0;
+        }
+    }
+    return 1;
+}
 
-    if (rc == rp || RING_REQUEST_CONS_OVERFLOW(&netdev->rx_ring, rc)) {
-        xen_be_printf(&netdev->xendev, 2, "no buffer, drop packet\n");
+static ssize_t net_rx_packet(NetClientState *nc, const uint8_t *buf, size_t size)
+{
+    struct XenNetDev *netdev = qemu_get_nic_opaque(nc);
+    struct XenNetQueue *q;
+    netif_rx_request_t *rxreq;
+    uint8_t *page;
+
+    if (netdev->xendev.be_state != XenbusStateConnected) {
         return -1;
     }
+
     if (size > XC_PAGE_SIZE - NET_IP_ALIGN) {
         xen_be_printf(&netdev->xendev, 0, "packet too big (%lu > %ld)",
                       (unsigned long)size, XC_PAGE_SIZE - NET_IP_ALIGN);
         return -1;
     }
 
-    memcpy(&rxreq, RING_GET_REQUEST(&netdev->rx_ring, rc), sizeof(rxreq));
-    netdev->rx_ring.req_cons = ++rc;
-
-    page = xc_gnttab_map_grant_ref(netdev->xendev.gnttabdev,
-                                   netdev->xendev.dom,
-                                   rxreq.gref, PROT_WRITE);
-    if (page == NULL) {
-        xen_be_printf(&netdev->xendev, 0, "error: rx gref dereference failed (%d)\n",
-                      rxreq.gref);
-        net_rx_response(netdev, &rxreq, NETIF_RSP_ERROR, 0, 0, 0);
-        return -1;
+    q = &netdev->queues[net_rx_select_queue(netdev, buf, size)];
+    if (q->rx_used == q->rx_mapped) {
+        /* Return the filled buffers before taking new ones */
+        if (q->rx_mapped) {
+            net_rx_bh(q);
+        }
+        if (!net_rx_map(q)) {
+            xen_be_printf(&netdev->xendev, 2, "no buffer, drop packet\n");
+            return -1;
+        }
     }
+
+    rxreq = &q->rx_reqs[q->rx_used];
+    page = q->rx_pages + q->rx_used * XC_PAGE_SIZE;
+    q->rx_used++;
+    q->rx_ring.req_cons++;
+
     memcpy(page + NET_IP_ALIGN, buf, size);
-    xc_gnttab_munmap(netdev->xendev.gnttabdev, page, 1);
-    net_rx_response(netdev, &rxreq, NETIF_RSP_OKAY, NET_IP_ALIGN, size, 0);
+    net_rx_response(q, rxreq, NETIF_RSP_OKAY, NET_IP_ALIGN, size, 0);
+
+    /* Responses are pushed, and the frontend notified, once per burst */
+    qemu_bh_schedule(q->rx_bh);
 
     return size;
 }
@@ -325,38 +514,174 @@ static int net_init(struct XenDevice *xendev)
         return -1;
     }
 
-    netdev->conf.peer = NULL;
+    netdev->conf.peers.ncs[0] = NULL;
 
     netdev->nic = qemu_new_nic(&net_xen_info, &netdev->conf,
                                "xen", NULL, netdev);
 
-    snprintf(netdev->nic->nc.info_str, sizeof(netdev->nic->nc.info_str),
+    snprintf(qemu_get_queue(netdev->nic)->info_str,
+             sizeof(qemu_get_queue(netdev->nic)->info_str),
              "nic: xenbus vif macaddr=%s", netdev->mac);
 
     /* fill info */
     xenstore_write_be_int(&netdev->xendev, "feature-rx-copy", 1);
     xenstore_write_be_int(&netdev->xendev, "feature-rx-flip", 0);
+    xenstore_write_be_int(&netdev->xendev, "multi-queue-max-queues",
+                          NET_MAX_QUEUES);
 
     return 0;
 }
 
-static int net_connect(struct XenDevice *xendev)
+static void net_queue_event(void *opaque)
 {
-    struct XenNetDev *netdev = container_of(xendev, struct XenNetDev, xendev);
-    int rx_copy;
+    struct XenNetQueue *q = opaque;
+    evtchn_port_t port;
+
+    port = xc_evtchn_pending(q->evtchndev);
+    if (port != q->local_port) {
+        xen_be_printf(&q->netdev->xendev, 0, "queue %d: xc_evtchn_pending returned %d (expected %d)\n",
+                      q->id, port, q->local_port);
+        return;
+    }
+    xc_evtchn_unmask(q->evtchndev, port);
+
+    net_tx_packets(q);
+    qemu_flush_queued_packets(qemu_get_queue(q->netdev->nic));
+}
+
+static int net_queue_bind_evtchn(struct XenNetQueue *q)
+{
+    struct XenNetDev *netdev = q->netdev;
+
+    if (q->id == 0) {
+        netdev->xendev.remote_port = q->remote_port;
+        return xen_be_bind_evtchn(&netdev->xendev);
+    }
+
+    q->evtchndev = xen_xc_evtchn_open(NULL, 0);
+    if (q->evtchndev == XC_HANDLER_INITIAL_VALUE) {
+        xen_be_printf(&netdev->xendev, 0, "can't open evtchn device\n");
+        return -1;
+    }
+    fcntl(xc_evtchn_fd(q->evtchndev), F_SETFD, FD_CLOEXEC);
+
+    q->local_port = xc_evtchn_bind_interdomain(q->evtchndev,
+                                               netdev->xendev.dom,
+                                               q->remote_port);
+    if (q->local_port == -1) {
+        xen_be_printf(&netdev->xendev, 0, "xc_evtchn_bind_interdomain failed\n");
+        return -1;
+    }
+    qemu_set_fd_handler(xc_evtchn_fd(q->evtchndev), net_queue_event, NULL, q);
+    return 0;
+}
+
+static void net_queue_unbind_evtchn(struct XenNetQueue *q)
+{
+    if (q->id == 0) {
+        xen_be_unbind_evtchn(&q->netdev->xendev);
+        return;
+    }
+
+    if (q->evtchndev == XC_HANDLER_INITIAL_VALUE) {
+        return;
+    }
+    if (q->local_port != -1) {
+        qemu_set_fd_handler(xc_evtchn_fd(q->evtchndev), NULL, NULL, NULL);
+        xc_evtchn_unbind(q->evtchndev, q->local_port);
+        q->local_port = -1;
+    }
+    xc_evtchn_close(q->evtchndev);
+    q->evtchndev = XC_HANDLER_INITIAL_VALUE;
+}
+
+static int net_queue_connect(struct XenNetDev *netdev, int id)
+{
+    struct XenNetQueue *q = &netdev->queues[id];
+    char node[64];
+    const char *prefix = "";
+    char prefix_buf[16];
+
+    q->netdev = netdev;
+    q->id = id;
+    q->evtchndev = XC_HANDLER_INITIAL_VALUE;
+    q->local_port = -1;
+    q->rx_bh = qemu_bh_new(net_rx_bh, q);
+
+    /* With several queues, each one has its own directory */
+    if (netdev->num_queues > 1) {
+        snprintf(prefix_buf, sizeof(prefix_buf), "queue-%d/", id);
+        prefix = prefix_buf;
+    }
 
-    if (xenstore_read_fe_int(&netdev->xendev, "tx-ring-ref",
-                             &netdev->tx_ring_ref) == -1) {
+    snprintf(node, sizeof(node), "%stx-ring-ref", prefix);
+    if (xenstore_read_fe_int(&netdev->xendev, node, &q->tx_ring_ref) == -1) {
         return -1;
     }
-    if (xenstore_read_fe_int(&netdev->xendev, "rx-ring-ref",
-                             &netdev->rx_ring_ref) == -1) {
-        return 1;
+    snprintf(node, sizeof(node), "%srx-ring-ref", prefix);
+    if (xenstore_read_fe_int(&netdev->xendev, node, &q->rx_ring_ref) == -1) {
+        return -1;
+    }
+    snprintf(node, sizeof(node), "%sevent-channel", prefix);
+    if (xenstore_read_fe_int(&netdev->xendev, node, &q->remote_port) == -1) {
+        return -1;
     }
-    if (xenstore_read_fe_int(&netdev->xendev, "event-channel",
-                             &netdev->xendev.remote_port) == -1) {
+
+    q->txs = xc_gnttab_map_grant_ref(netdev->xendev.gnttabdev,
+                                     netdev->xendev.dom,
+                                     q->tx_ring_ref,
+                                     PROT_READ | PROT_WRITE);
+    q->rxs = xc_gnttab_map_grant_ref(netdev->xendev.gnttabdev,
+                                     netdev->xendev.dom,
+                                     q->rx_ring_ref,
+                                     PROT_READ | PROT_WRITE);
+    if (!q->txs || !q->rxs) {
         return -1;
     }
+    BACK_RING_INIT(&q->tx_ring, q->txs, XC_PAGE_SIZE);
+    BACK_RING_INIT(&q->rx_ring, q->rxs, XC_PAGE_SIZE);
+
+    if (net_queue_bind_evtchn(q) < 0) {
+        return -1;
+    }
+
+    xen_be_printf(&netdev->xendev, 1, "ok: queue %d, tx-ring-ref %d, rx-ring-ref %d, "
+                  "remote port %d\n",
+                  id, q->tx_ring_ref, q->rx_ring_ref, q->remote_port);
+    return 0;
+}
+
+static void net_queue_disconnect(struct XenNetQueue *q)
+{
+    struct XenNetDev *netdev = q->netdev;
+
+    if (!netdev) {
+        return;
+    }
+
+    net_queue_unbind_evtchn(q);
+
+    if (q->rx_bh) {
+        qemu_bh_delete(q->rx_bh);
+        q->rx_bh = NULL;
+    }
+    net_rx_unmap(q);
+
+    if (q->txs) {
+        xc_gnttab_munmap(netdev->xendev.gnttabdev, q->txs, 1);
+        q->txs = NULL;
+    }
+    if (q->rxs) {
+        xc_gnttab_munmap(netdev->xendev.gnttabdev, q->rxs, 1);
+        q->rxs = NULL;
+    }
+    q->netdev = NULL;
+}
+
+static int net_connect(struct XenDevice *xendev)
+{
+    struct XenNetDev *netdev = container_of(xendev, struct XenNetDev, xendev);
+    int rx_copy, num_queues, i;
 
     if (xenstore_read_fe_int(&netdev->xendev, "request-rx-copy", &rx_copy) == -1) {
         rx_copy = 0;
@@ -366,47 +691,44 @@ static int net_connect(struct XenDevice *xendev)
         return -1;
     }
 
-    netdev->txs = xc_gnttab_map_grant_ref(netdev->xendev.gnttabdev,
-                                          netdev->xendev.dom,
-                                          netdev->tx_ring_ref,
-                                          PROT_READ | PROT_WRITE);
-    netdev->rxs = xc_gnttab_map_grant_ref(netdev->xendev.gnttabdev,
-                                          netdev->xendev.dom,
-                                          netdev->rx_ring_ref,
-                                          PROT_READ | PROT_WRITE);
-    if (!netdev->txs || !netdev->rxs) {
+    if (xenstore_read_fe_int(&netdev->xendev, "multi-queue-num-queues",
+                             &num_queues) == -1) {
+        num_queues = 1;
+    }
+    if (num_queues < 1 || num_queues > NET_MAX_QUEUES) {
+        xen_be_printf(&netdev->xendev, 0, "invalid number of queues %d.\n",
+                      num_queues);
         return -1;
     }
-    BACK_RING_INIT(&netdev->tx_ring, netdev->txs, XC_PAGE_SIZE);
-    BACK_RING_INIT(&netdev->rx_ring, netdev->rxs, XC_PAGE_SIZE);
+    netdev->num_queues = num_queues;
 
-    xen_be_bind_evtchn(&netdev->xendev);
-
-    xen_be_printf(&netdev->xendev, 1, "ok: tx-ring-ref %d, rx-ring-ref %d, "
-                  "remote port %d, local port %d\n",
-                  netdev->tx_ring_ref, netdev->rx_ring_ref,
-                  netdev->xendev.remote_port, netdev->xendev.local_port);
+    for (i = 0; i < num_queues; i++) {
+        if (net_queue_connect(netdev, i) < 0) {
+            while (i >= 0) {
+                net_queue_disconnect(&netdev->queues[i--]);
+            }
+            return -1;
+        }
+    }
 
-    net_tx_packets(netdev);
+    for (i = 0; i < num_queues; i++) {
+        net_tx_packets(&netdev->queues[i]);
+    }
     return 0;
 }
 
 static void net_disconnect(struct XenDevice *xendev)
 {
     struct XenNetDev *netdev = container_of(xendev, struct XenNetDev, xendev);
+    int i;
 
-    xen_be_unbind_evtchn(&netdev->xendev);
-
-    if (netdev->txs) {
-        xc_gnttab_munmap(netdev->xendev.gnttabdev, netdev->txs, 1);
-        netdev->txs = NULL;
-    }
-    if (netdev->rxs) {
-        xc_gnttab_munmap(netdev->xendev.gnttabdev, netdev->rxs, 1);
-        netdev->rxs = NULL;
+    for (i = 0; i < netdev->num_queues; i++) {
+        net_queue_disconnect(&netdev->queues[i]);
     }
+    netdev->num_queues = 0;
+
     if (netdev->nic) {
-        qemu_del_net_client(&netdev->nic->nc);
+        qemu_del_nic(netdev->nic);
         netdev->nic = NULL;
     }
 }
@@ -414,8 +736,8 @@ static void net_disconnect(struct XenDevice *xendev)
 static void net_event(struct XenDevice *xendev)
 {
     struct XenNetDev *netdev = container_of(xendev, struct XenNetDev, xendev);
-    net_tx_packets(netdev);
-    qemu_flush_queued_packets(&netdev->nic->nc);
+    net_tx_packets(&netdev->queues[0]);
+    qemu_flush_queued_packets(qemu_get_queue(netdev->nic));
 }
 
 static int net_free(struct XenDevice *xendev)
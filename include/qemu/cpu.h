@@ -57,6 +57,7 @@ typedef struct CPUClass {
  * @created: Indicates whether the CPU thread has been successfully created.
  * @stop: Indicates a pending stop request.
  * @stopped: Indicates the CPU has been artificially stopped.
+ * @throttle_pending: Set when the vCPU should sleep for one throttling period.
  *
  * State of one CPU core or thread.
  */
@@ -76,6 +77,12 @@ struct CPUState {
     bool created;
     bool stop;
     bool stopped;
+    bool throttle_pending;
+
+    /* halt polling window and statistics, see qemu_halt_poll() */
+    int64_t halt_poll_ns;
+    uint64_t halt_polls;
+    uint64_t halt_poll_hits;
 
     /* TODO Move common fields from CPUArchState here. */
 };
@@ -115,6 +122,15 @@ bool qemu_cpu_is_self(CPUState *cpu);
  */
 void qemu_cpu_kick(CPUState *cpu);
 
+/**
+ * cpu_resume:
+ * @cpu: The vCPU to resume.
+ *
+ * Lets a stopped @cpu run again, for example after it has been hotplugged
+ * into a running machine.
+ */
+void cpu_resume(CPUState *cpu);
+
 /**
  * cpu_is_stopped:
  * @cpu: The CPU to check.
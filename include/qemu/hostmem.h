@@ -0,0 +1,79 @@
+/*
+ * QEMU Host Memory Backend
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef QEMU_HOSTMEM_H
+#define QEMU_HOSTMEM_H
+
+#include "qemu/object.h"
+#include "qemu-common.h"
+#include "error.h"
+#include "memory.h"
+#include "bitmap.h"
+
+#define TYPE_MEMORY_BACKEND "memory-backend"
+#define MEMORY_BACKEND(obj) \
+    OBJECT_CHECK(HostMemoryBackend, (obj), TYPE_MEMORY_BACKEND)
+#define MEMORY_BACKEND_GET_CLASS(obj) \
+    OBJECT_GET_CLASS(HostMemoryBackendClass, (obj), TYPE_MEMORY_BACKEND)
+#define MEMORY_BACKEND_CLASS(klass) \
+    OBJECT_CLASS_CHECK(HostMemoryBackendClass, (klass), TYPE_MEMORY_BACKEND)
+
+#define TYPE_MEMORY_BACKEND_RAM "memory-backend-ram"
+#define TYPE_MEMORY_BACKEND_FILE "memory-backend-file"
+
+#define MAX_HOST_NODES 128
+
+typedef enum HostMemPolicy {
+    HOST_MEM_POLICY_DEFAULT,
+    HOST_MEM_POLICY_PREFERRED,
+    HOST_MEM_POLICY_BIND,
+    HOST_MEM_POLICY_INTERLEAVE,
+    HOST_MEM_POLICY_MAX,
+} HostMemPolicy;
+
+typedef struct HostMemoryBackendClass HostMemoryBackendClass;
+typedef struct HostMemoryBackend HostMemoryBackend;
+
+struct HostMemoryBackendClass
+{
+    ObjectClass parent_class;
+
+    void (*alloc)(HostMemoryBackend *backend, const char *name, Error **errp);
+};
+
+struct HostMemoryBackend
+{
+    Object parent;
+
+    /*< protected >*/
+    uint64_t size;
+    bool share;
+    bool prealloc;
+    bool merge;
+    bool hugepage;
+    HostMemPolicy policy;
+    DECLARE_BITMAP(host_nodes, MAX_HOST_NODES);
+    bool allocated;
+    MemoryRegion mr;
+};
+
+/**
+ * host_memory_backend_get_memory:
+ * @backend: the backend to get the memory of
+ * @errp: a pointer to return the #Error object if an error occurs.
+ *
+ * This function allocates the guest memory described by the backend's
+ * properties the first time it is called, applies the KSM and transparent
+ * hugepage advice and the host NUMA policy, and pre-faults the memory if
+ * requested; after that the properties can no
+ * longer be changed.  The region is named after the id of the backend.
+ *
+ * Returns: the #MemoryRegion holding the memory, or %NULL on error.
+ */
+MemoryRegion *host_memory_backend_get_memory(HostMemoryBackend *backend,
+                                             Error **errp);
+
+#endif
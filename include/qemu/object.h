@@ -252,12 +252,20 @@ typedef void (ObjectFree)(void *obj);
  * The base for all classes.  The only thing that #ObjectClass contains is an
  * integer type handle.
  */
+#define OBJECT_CLASS_CAST_CACHE 4
+
 struct ObjectClass
 {
     /*< private >*/
     Type type;
     GSList *interfaces;
 
+    /* Type names this class was recently cast to successfully, compared by
+     * pointer: the TYPE_* macros expand to string literals, which the
+     * compiler and linker merge, so a hit needs no hash table lookup.
+     */
+    const char *cast_cache[OBJECT_CLASS_CAST_CACHE];
+
     ObjectUnparent *unparent;
 };
 
@@ -282,8 +290,10 @@ struct Object
     ObjectClass *class;
     ObjectFree *free;
     QTAILQ_HEAD(, ObjectProperty) properties;
+    GHashTable *property_table;     /* properties by name */
     uint32_t ref;
     Object *parent;
+    ObjectProperty *parent_prop;    /* child<> property of @parent */
 };
 
 /**
@@ -650,7 +660,8 @@ void object_unref(Object *obj);
  *   meant to allow a property to free its opaque upon object
  *   destruction.  This may be NULL.
  * @opaque: an opaque pointer to pass to the callbacks for the property
- * @errp: returns an error if this function fails
+ * @errp: returns an error if this function fails, e.g. because @obj already
+ *   has a property called @name
  */
 void object_property_add(Object *obj, const char *name, const char *type,
                          ObjectPropertyAccessor *get,
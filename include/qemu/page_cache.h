@@ -1,6 +1,7 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is a set-associative hash of the page address, with LRU
+ * replacement within each set
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -47,17 +48,19 @@ void cache_fini(PageCache *cache);
 bool cache_is_cached(const PageCache *cache, uint64_t addr);
 
 /**
- * get_cached_data: Get the data cached for an addr
+ * get_cached_data: Get the data cached for an addr and mark it as the
+ * most recently used page of its set
  *
  * Returns pointer to the data cached or NULL if not cached
  *
  * @cache pointer to the PageCache struct
  * @addr: page addr
  */
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
+uint8_t *get_cached_data(PageCache *cache, uint64_t addr);
 
 /**
- * cache_insert: insert the page into the cache. the previous value will be overwritten
+ * cache_insert: insert the page into the cache. the previous value for the
+ * address, or the least recently used page of its set, is freed
  *
  * @cache pointer to the PageCache struct
  * @addr: page address
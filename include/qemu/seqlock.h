@@ -0,0 +1,54 @@
+/*
+ * Seqlock: data read without a lock, updated by serialized writers
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_SEQLOCK_H
+#define QEMU_SEQLOCK_H 1
+
+#include "qemu-barrier.h"
+
+/* The sequence is odd while a write is in progress.  Writers must be
+ * serialized by the caller, for example by the global mutex; readers
+ * retry until they saw the same even sequence before and after reading.
+ */
+typedef struct QemuSeqLock {
+    unsigned sequence;
+} QemuSeqLock;
+
+static inline void seqlock_init(QemuSeqLock *sl)
+{
+    sl->sequence = 0;
+}
+
+static inline void seqlock_write_begin(QemuSeqLock *sl)
+{
+    sl->sequence++;
+    smp_wmb();
+}
+
+static inline void seqlock_write_end(QemuSeqLock *sl)
+{
+    smp_wmb();
+    sl->sequence++;
+}
+
+static inline unsigned seqlock_read_begin(QemuSeqLock *sl)
+{
+    unsigned ret = *(volatile unsigned *)&sl->sequence;
+
+    smp_rmb();
+    /* an odd value never matches, so a read during a write is retried */
+    return ret & ~1;
+}
+
+static inline bool seqlock_read_retry(QemuSeqLock *sl, unsigned start)
+{
+    smp_rmb();
+    return unlikely(*(volatile unsigned *)&sl->sequence != start);
+}
+
+#endif
@@ -63,6 +63,9 @@ int qemu_set_fd_handler2(int fd,
         QLIST_FOREACH(ioh, &io_handlers, next) {
             if (ioh->fd == fd) {
                 ioh->deleted = 1;
+#ifndef _WIN32
+                main_loop_poll_set_events(fd, MAIN_LOOP_POLL_IOHANDLER, 0);
+#endif
                 break;
             }
         }
@@ -93,6 +96,61 @@ int qemu_set_fd_handler(int fd,
     return qemu_set_fd_handler2(fd, NULL, fd_read, fd_write, opaque);
 }
 
+#ifndef _WIN32
+/* Only handlers with an fd_read_poll callback can change their events
+   without going through qemu_set_fd_handler2, but re-declaring an
+   unchanged set is cheap and does not reach the kernel.  */
+void qemu_iohandler_fill(void)
+{
+    IOHandlerRecord *ioh;
+
+    QLIST_FOREACH(ioh, &io_handlers, next) {
+        int events = 0;
+
+        if (ioh->deleted) {
+            continue;
+        }
+        if (ioh->fd_read &&
+            (!ioh->fd_read_poll ||
+             ioh->fd_read_poll(ioh->opaque) != 0)) {
+            events |= G_IO_IN;
+        }
+        if (ioh->fd_write) {
+            events |= G_IO_OUT;
+        }
+        main_loop_poll_set_events(ioh->fd, MAIN_LOOP_POLL_IOHANDLER, events);
+    }
+}
+
+void qemu_iohandler_poll(int ret)
+{
+    if (ret > 0) {
+        IOHandlerRecord *pioh, *ioh;
+
+        QLIST_FOREACH_SAFE(ioh, &io_handlers, next, pioh) {
+            int events = main_loop_poll_get_events(ioh->fd,
+                                                   MAIN_LOOP_POLL_IOHANDLER);
+            int revents = main_loop_poll_revents(ioh->fd);
+
+            /* like select(), report errors and hangups as readiness */
+            if (!ioh->deleted && ioh->fd_read && (events & G_IO_IN) &&
+                (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR))) {
+                ioh->fd_read(ioh->opaque);
+            }
+            if (!ioh->deleted && ioh->fd_write && (events & G_IO_OUT) &&
+                (revents & (G_IO_OUT | G_IO_ERR))) {
+                ioh->fd_write(ioh->opaque);
+            }
+
+            /* Do this last in case read/write handlers marked it for deletion */
+            if (ioh->deleted) {
+                QLIST_REMOVE(ioh, next);
+                g_free(ioh);
+            }
+        }
+    }
+}
+#else
 void qemu_iohandler_fill(int *pnfds, fd_set *readfds, fd_set *writefds, fd_set *xfds)
 {
     IOHandlerRecord *ioh;
@@ -136,6 +194,7 @@ void qemu_iohandler_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds, int re
         }
     }
 }
+#endif
 
 /* reaping of zombies.  right now we're not passing the status to
    anyone, but it would be possible to add a callback.  */
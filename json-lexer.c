@@ -11,10 +11,6 @@
  *
  */
 
-#include "qstring.h"
-#include "qlist.h"
-#include "qdict.h"
-#include "qint.h"
 #include "qemu-common.h"
 #include "json-lexer.h"
 
@@ -272,10 +268,22 @@ void json_lexer_init(JSONLexer *lexer, JSONLexerEmitter func)
 {
     lexer->emit = func;
     lexer->state = IN_START;
-    lexer->token = qstring_new();
+    lexer->token = g_string_sized_new(3);
     lexer->x = lexer->y = 0;
 }
 
+/* Do not let a single token grow to an arbitrarily large size,
+ * this is a security consideration.
+ */
+static void json_lexer_check_size(JSONLexer *lexer)
+{
+    if (lexer->token->len > MAX_TOKEN_SIZE) {
+        lexer->emit(lexer, lexer->token, lexer->state, lexer->x, lexer->y);
+        g_string_truncate(lexer->token, 0);
+        lexer->state = IN_START;
+    }
+}
+
 static int json_lexer_feed_char(JSONLexer *lexer, char ch, bool flush)
 {
     int char_consumed, new_state;
@@ -290,7 +298,7 @@ static int json_lexer_feed_char(JSONLexer *lexer, char ch, bool flush)
         new_state = json_lexer[lexer->state][(uint8_t)ch];
         char_consumed = !TERMINAL_NEEDED_LOOKAHEAD(lexer->state, new_state);
         if (char_consumed) {
-            qstring_append_chr(lexer->token, ch);
+            g_string_append_c(lexer->token, ch);
         }
 
         switch (new_state) {
@@ -303,8 +311,7 @@ static int json_lexer_feed_char(JSONLexer *lexer, char ch, bool flush)
             lexer->emit(lexer, lexer->token, new_state, lexer->x, lexer->y);
             /* fall through */
         case JSON_SKIP:
-            QDECREF(lexer->token);
-            lexer->token = qstring_new();
+            g_string_truncate(lexer->token, 0);
             new_state = IN_START;
             break;
         case IN_ERROR:
@@ -322,8 +329,7 @@ static int json_lexer_feed_char(JSONLexer *lexer, char ch, bool flush)
              * induce an error/flush state.
              */
             lexer->emit(lexer, lexer->token, JSON_ERROR, lexer->x, lexer->y);
-            QDECREF(lexer->token);
-            lexer->token = qstring_new();
+            g_string_truncate(lexer->token, 0);
             new_state = IN_START;
             lexer->state = new_state;
             return 0;
@@ -333,30 +339,56 @@ static int json_lexer_feed_char(JSONLexer *lexer, char ch, bool flush)
         lexer->state = new_state;
     } while (!char_consumed && !flush);
 
-    /* Do not let a single token grow to an arbitrarily large size,
-     * this is a security consideration.
-     */
-    if (lexer->token->length > MAX_TOKEN_SIZE) {
-        lexer->emit(lexer, lexer->token, lexer->state, lexer->x, lexer->y);
-        QDECREF(lexer->token);
-        lexer->token = qstring_new();
-        lexer->state = IN_START;
-    }
-
+    json_lexer_check_size(lexer);
     return 0;
 }
 
-int json_lexer_feed(JSONLexer *lexer, const char *buffer, size_t size)
+/*
+ * Most of the input is made of runs of characters that leave the lexer in
+ * the same state: the body of a string, the digits of a number, the letters
+ * of a keyword, whitespace.  Consume such a run at once and append it to
+ * the token in a single call.  Returns the length of the run.
+ */
+static size_t json_lexer_feed_run(JSONLexer *lexer, const char *buffer,
+                                  size_t size)
 {
+    int state = lexer->state;
     size_t i;
 
+    if (state == IN_START) {
+        return 0;
+    }
+
     for (i = 0; i < size; i++) {
+        if (json_lexer[state][(uint8_t)buffer[i]] != state) {
+            break;
+        }
+        lexer->x++;
+        if (buffer[i] == '\n') {
+            lexer->x = 0;
+            lexer->y++;
+        }
+    }
+
+    if (i) {
+        g_string_append_len(lexer->token, buffer, i);
+        json_lexer_check_size(lexer);
+    }
+    return i;
+}
+
+int json_lexer_feed(JSONLexer *lexer, const char *buffer, size_t size)
+{
+    size_t i = 0;
+
+    while (i < size) {
         int err;
 
-        err = json_lexer_feed_char(lexer, buffer[i], false);
+        err = json_lexer_feed_char(lexer, buffer[i++], false);
         if (err < 0) {
             return err;
         }
+        i += json_lexer_feed_run(lexer, buffer + i, size - i);
     }
 
     return 0;
@@ -369,5 +401,5 @@ int json_lexer_flush(JSONLexer *lexer)
 
 void json_lexer_destroy(JSONLexer *lexer)
 {
-    QDECREF(lexer->token);
+    g_string_free(lexer->token, true);
 }
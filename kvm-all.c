@@ -63,6 +63,9 @@ typedef struct KVMSlot
     hwaddr start_addr;
     ram_addr_t memory_size;
     void *ram;
+    /* the RAM region and the offset in it that back the slot */
+    MemoryRegion *mr;
+    hwaddr mr_offset;
     int slot;
     int flags;
 } KVMSlot;
@@ -71,10 +74,12 @@ typedef struct kvm_dirty_log KVMDirtyLog;
 
 struct KVMState
 {
-    KVMSlot slots[32];
+    KVMSlot *slots;
+    int nr_slots;
     int fd;
     int vmfd;
     int coalesced_mmio;
+    bool coalesced_pio;
     struct kvm_coalesced_mmio_ring *coalesced_mmio_ring;
     bool coalesced_flush_in_progress;
     int broken_set_mem_region;
@@ -98,9 +103,16 @@ struct KVMState
     int nr_allocated_irq_routes;
     uint32_t *used_gsi_bitmap;
     unsigned int gsi_count;
+    /* Nesting depth of kvm_irqchip_begin_route_changes */
+    int irq_routes_batch;
+    bool irq_routes_dirty;
     QTAILQ_HEAD(msi_hashtab, KVMMSIRoute) msi_hashtab[KVM_MSI_HASHTAB_SIZE];
+    /* Dynamic MSI routes, least recently used first */
+    QTAILQ_HEAD(msi_lru, KVMMSIRoute) msi_lru;
     bool direct_msi;
 #endif
+    /* Entries in each vCPU's dirty ring, or 0 to use KVM_GET_DIRTY_LOG */
+    uint32_t dirty_ring_size;
 };
 
 KVMState *kvm_state;
@@ -120,7 +132,7 @@ static KVMSlot *kvm_alloc_slot(KVMState *s)
 {
     int i;
 
-    for (i = 0; i < ARRAY_SIZE(s->slots); i++) {
+    for (i = 0; i < s->nr_slots; i++) {
         if (s->slots[i].memory_size == 0) {
             return &s->slots[i];
         }
@@ -136,7 +148,7 @@ static KVMSlot *kvm_lookup_matching_slot(KVMState *s,
 {
     int i;
 
-    for (i = 0; i < ARRAY_SIZE(s->slots); i++) {
+    for (i = 0; i < s->nr_slots; i++) {
         KVMSlot *mem = &s->slots[i];
 
         if (start_addr == mem->start_addr &&
@@ -158,7 +170,7 @@ static KVMSlot *kvm_lookup_overlapping_slot(KVMState *s,
     KVMSlot *found = NULL;
     int i;
 
-    for (i = 0; i < ARRAY_SIZE(s->slots); i++) {
+    for (i = 0; i < s->nr_slots; i++) {
         KVMSlot *mem = &s->slots[i];
 
         if (mem->memory_size == 0 ||
@@ -180,7 +192,7 @@ int kvm_physical_memory_addr_from_host(KVMState *s, void *ram,
 {
     int i;
 
-    for (i = 0; i < ARRAY_SIZE(s->slots); i++) {
+    for (i = 0; i < s->nr_slots; i++) {
         KVMSlot *mem = &s->slots[i];
 
         if (ram >= mem->ram && ram < mem->ram + mem->memory_size) {
@@ -252,6 +264,24 @@ int kvm_init_vcpu(CPUArchState *env)
             (void *)env->kvm_run + s->coalesced_mmio * PAGE_SIZE;
     }
 
+#ifdef KVM_CAP_DIRTY_LOG_RING
+    if (s->dirty_ring_size) {
+        env->kvm_dirty_gfns = mmap(NULL,
+                                   s->dirty_ring_size *
+                                   sizeof(struct kvm_dirty_gfn),
+                                   PROT_READ | PROT_WRITE, MAP_SHARED,
+                                   env->kvm_fd,
+                                   PAGE_SIZE * KVM_DIRTY_LOG_PAGE_OFFSET);
+        if (env->kvm_dirty_gfns == MAP_FAILED) {
+            ret = -errno;
+            env->kvm_dirty_gfns = NULL;
+            DPRINTF("mmap'ing vcpu dirty ring failed\n");
+            goto err;
+        }
+        env->kvm_fetch_index = 0;
+    }
+#endif
+
     ret = kvm_arch_init_vcpu(env);
     if (ret == 0) {
         qemu_register_reset(kvm_reset_vcpu, env);
@@ -340,7 +370,7 @@ static int kvm_set_migration_log(int enable)
 
     s->migration_log = enable;
 
-    for (i = 0; i < ARRAY_SIZE(s->slots); i++) {
+    for (i = 0; i < s->nr_slots; i++) {
         mem = &s->slots[i];
 
         if (!mem->memory_size) {
@@ -361,32 +391,128 @@ static int kvm_set_migration_log(int enable)
 static int kvm_get_dirty_pages_log_range(MemoryRegionSection *section,
                                          unsigned long *bitmap)
 {
-    unsigned int i, j;
-    unsigned long page_number, c;
-    hwaddr addr, addr1;
-    unsigned int len = ((section->size / getpagesize()) + HOST_LONG_BITS - 1) / HOST_LONG_BITS;
-    unsigned long hpratio = getpagesize() / TARGET_PAGE_SIZE;
-
     /*
      * bitmap-traveling is faster than memory-traveling (for addr...)
      * especially when most of the memory is not dirty.
      */
-    for (i = 0; i < len; i++) {
-        if (bitmap[i] != 0) {
-            c = leul_to_cpu(bitmap[i]);
-            do {
-                j = ffsl(c) - 1;
-                c &= ~(1ul << j);
-                page_number = (i * HOST_LONG_BITS + j) * hpratio;
-                addr1 = page_number * TARGET_PAGE_SIZE;
-                addr = section->offset_within_region + addr1;
-                memory_region_set_dirty(section->mr, addr,
-                                        TARGET_PAGE_SIZE * hpratio);
-            } while (c != 0);
+    memory_region_set_dirty_lebitmap(section->mr,
+                                     section->offset_within_region, bitmap,
+                                     section->size / getpagesize());
+    return 0;
+}
+
+#ifdef KVM_CAP_DIRTY_LOG_RING
+/*
+ * With a dirty ring, KVM pushes the guest frame number of each page it
+ * starts logging into a ring shared with the vCPU, so the cost of a sync
+ * depends on the number of pages written rather than on the size of the
+ * guest.  Harvested entries are flagged for reset; KVM_RESET_DIRTY_RINGS
+ * then write-protects the pages again and recycles the entries.
+ *
+ * Rings are harvested with the iothread lock held, either while syncing
+ * the dirty log or when a vCPU exits because its ring is full.  Pages
+ * that a vCPU dirtied after its last exit may still sit in a hardware
+ * buffer (e.g. Intel PML) and are picked up by a later sync; the final
+ * sync of a migration runs with every vCPU stopped.
+ */
+static uint64_t kvm_dirty_ring_reap_one(KVMState *s, CPUArchState *env)
+{
+    struct kvm_dirty_gfn *gfn;
+    uint64_t count = 0;
+    uint32_t slot_id;
+    KVMSlot *mem;
+
+    for (;;) {
+        gfn = &env->kvm_dirty_gfns[env->kvm_fetch_index %
+                                   s->dirty_ring_size];
+        /* the flags must be read before the rest of the entry */
+        if (!(*(volatile uint32_t *)&gfn->flags & KVM_DIRTY_GFN_F_DIRTY)) {
+            break;
         }
+        smp_rmb();
+
+        slot_id = gfn->slot & 0xffff;
+        if ((gfn->slot >> 16) == 0 && slot_id < s->nr_slots) {
+            mem = &s->slots[slot_id];
+            /* entries for a slot that was removed meanwhile are stale */
+            if (mem->memory_size &&
+                gfn->offset < mem->memory_size / getpagesize()) {
+                memory_region_set_dirty(mem->mr, mem->mr_offset +
+                                        gfn->offset * getpagesize(),
+                                        getpagesize());
+            }
+        }
+
+        /* hand the entry back to KVM */
+        smp_wmb();
+        gfn->flags = KVM_DIRTY_GFN_F_RESET;
+        env->kvm_fetch_index++;
+        count++;
+    }
+    return count;
+}
+
+static uint64_t kvm_dirty_ring_reap(KVMState *s)
+{
+    CPUArchState *env;
+    uint64_t total = 0;
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        if (env->kvm_dirty_gfns) {
+            total += kvm_dirty_ring_reap_one(s, env);
+        }
+    }
+    if (total && kvm_vm_ioctl(s, KVM_RESET_DIRTY_RINGS) < 0) {
+        fprintf(stderr, "KVM_RESET_DIRTY_RINGS failed: %m\n");
+        abort();
+    }
+    return total;
+}
+
+static int kvm_dirty_ring_init(KVMState *s)
+{
+    QemuOptsList *list = qemu_find_opts("machine");
+    struct kvm_enable_cap cap = {};
+    uint64_t size = 0, bytes;
+    int max_bytes, ret;
+
+    if (!QTAILQ_EMPTY(&list->head)) {
+        size = qemu_opt_get_number(QTAILQ_FIRST(&list->head),
+                                   "kvm_dirty_ring", 0);
+    }
+    if (!size) {
+        return 0;
     }
+    if (size & (size - 1)) {
+        fprintf(stderr, "kvm_dirty_ring must be a power of two\n");
+        return -EINVAL;
+    }
+
+    bytes = size * sizeof(struct kvm_dirty_gfn);
+    max_bytes = kvm_check_extension(s, KVM_CAP_DIRTY_LOG_RING);
+    if (max_bytes <= 0) {
+        fprintf(stderr, "KVM does not support a dirty ring, "
+                "using the dirty bitmap\n");
+        return 0;
+    }
+    if (bytes > max_bytes) {
+        fprintf(stderr, "kvm_dirty_ring is limited to %zu entries\n",
+                max_bytes / sizeof(struct kvm_dirty_gfn));
+        return -EINVAL;
+    }
+
+    cap.cap = KVM_CAP_DIRTY_LOG_RING;
+    cap.args[0] = bytes;
+    ret = kvm_vm_ioctl(s, KVM_ENABLE_CAP, &cap);
+    if (ret < 0) {
+        fprintf(stderr, "Could not enable a KVM dirty ring: %s\n",
+                strerror(-ret));
+        return ret;
+    }
+    s->dirty_ring_size = size;
     return 0;
 }
+#endif
 
 #define ALIGN(x, y)  (((x)+(y)-1) & ~((y)-1))
 
@@ -409,6 +535,14 @@ static int kvm_physical_sync_dirty_bitmap(MemoryRegionSection *section)
     hwaddr start_addr = section->offset_within_address_space;
     hwaddr end_addr = start_addr + section->size;
 
+#ifdef KVM_CAP_DIRTY_LOG_RING
+    /* the rings cover every slot at once */
+    if (s->dirty_ring_size) {
+        kvm_dirty_ring_reap(s);
+        return 0;
+    }
+#endif
+
     d.dirty_bitmap = NULL;
     while (start_addr < end_addr) {
         mem = kvm_lookup_overlapping_slot(s, start_addr, end_addr);
@@ -488,6 +622,40 @@ static void kvm_uncoalesce_mmio_region(MemoryListener *listener,
     }
 }
 
+static void kvm_coalesce_pio_add(MemoryListener *listener,
+                                 MemoryRegionSection *section,
+                                 hwaddr start, hwaddr size)
+{
+    KVMState *s = kvm_state;
+
+    if (s->coalesced_pio) {
+        struct kvm_coalesced_mmio_zone zone;
+
+        zone.addr = start;
+        zone.size = size;
+        zone.pio = 1;
+
+        (void)kvm_vm_ioctl(s, KVM_REGISTER_COALESCED_MMIO, &zone);
+    }
+}
+
+static void kvm_coalesce_pio_del(MemoryListener *listener,
+                                 MemoryRegionSection *section,
+                                 hwaddr start, hwaddr size)
+{
+    KVMState *s = kvm_state;
+
+    if (s->coalesced_pio) {
+        struct kvm_coalesced_mmio_zone zone;
+
+        zone.addr = start;
+        zone.size = size;
+        zone.pio = 1;
+
+        (void)kvm_vm_ioctl(s, KVM_UNREGISTER_COALESCED_MMIO, &zone);
+    }
+}
+
 int kvm_check_extension(KVMState *s, unsigned int extension)
 {
     int ret;
@@ -624,6 +792,8 @@ static void kvm_set_phys_mem(MemoryRegionSection *section, bool add)
             mem->memory_size = old.memory_size;
             mem->start_addr = old.start_addr;
             mem->ram = old.ram;
+            mem->mr = old.mr;
+            mem->mr_offset = old.mr_offset;
             mem->flags = kvm_mem_flags(s, log_dirty);
 
             err = kvm_set_user_memory_region(s, mem);
@@ -645,6 +815,8 @@ static void kvm_set_phys_mem(MemoryRegionSection *section, bool add)
             mem->memory_size = start_addr - old.start_addr;
             mem->start_addr = old.start_addr;
             mem->ram = old.ram;
+            mem->mr = old.mr;
+            mem->mr_offset = old.mr_offset;
             mem->flags =  kvm_mem_flags(s, log_dirty);
 
             err = kvm_set_user_memory_region(s, mem);
@@ -669,6 +841,8 @@ static void kvm_set_phys_mem(MemoryRegionSection *section, bool add)
             size_delta = mem->start_addr - old.start_addr;
             mem->memory_size = old.memory_size - size_delta;
             mem->ram = old.ram + size_delta;
+            mem->mr = old.mr;
+            mem->mr_offset = old.mr_offset + size_delta;
             mem->flags = kvm_mem_flags(s, log_dirty);
 
             err = kvm_set_user_memory_region(s, mem);
@@ -691,6 +865,8 @@ static void kvm_set_phys_mem(MemoryRegionSection *section, bool add)
     mem->memory_size = size;
     mem->start_addr = start_addr;
     mem->ram = ram;
+    mem->mr = mr;
+    mem->mr_offset = section->offset_within_region + delta;
     mem->flags = kvm_mem_flags(s, log_dirty);
 
     err = kvm_set_user_memory_region(s, mem);
@@ -823,6 +999,8 @@ static MemoryListener kvm_memory_listener = {
 static MemoryListener kvm_io_listener = {
     .eventfd_add = kvm_io_ioeventfd_add,
     .eventfd_del = kvm_io_ioeventfd_del,
+    .coalesced_mmio_add = kvm_coalesce_pio_add,
+    .coalesced_mmio_del = kvm_coalesce_pio_del,
     .priority = 10,
 };
 
@@ -859,6 +1037,7 @@ int kvm_set_irq(KVMState *s, int irq, int level)
 typedef struct KVMMSIRoute {
     struct kvm_irq_routing_entry kroute;
     QTAILQ_ENTRY(KVMMSIRoute) entry;
+    QTAILQ_ENTRY(KVMMSIRoute) lru;
 } KVMMSIRoute;
 
 static void set_gsi(KVMState *s, unsigned int gsi)
@@ -897,6 +1076,7 @@ static void kvm_init_irq_routing(KVMState *s)
         for (i = 0; i < KVM_MSI_HASHTAB_SIZE; i++) {
             QTAILQ_INIT(&s->msi_hashtab[i]);
         }
+        QTAILQ_INIT(&s->msi_lru);
     }
 
     kvm_arch_init_irq_routing(s);
@@ -909,6 +1089,30 @@ static void kvm_irqchip_commit_routes(KVMState *s)
     s->irq_routes->flags = 0;
     ret = kvm_vm_ioctl(s, KVM_SET_GSI_ROUTING, s->irq_routes);
     assert(ret == 0);
+    s->irq_routes_dirty = false;
+}
+
+/* KVM only accepts the routing table as a whole, so changes are pushed to
+   the kernel at the end of the outermost batch.  */
+static void kvm_irqchip_routes_changed(KVMState *s)
+{
+    s->irq_routes_dirty = true;
+    if (s->irq_routes_batch == 0) {
+        kvm_irqchip_commit_routes(s);
+    }
+}
+
+void kvm_irqchip_begin_route_changes(KVMState *s)
+{
+    s->irq_routes_batch++;
+}
+
+void kvm_irqchip_commit_route_changes(KVMState *s)
+{
+    assert(s->irq_routes_batch > 0);
+    if (--s->irq_routes_batch == 0 && s->irq_routes_dirty) {
+        kvm_irqchip_commit_routes(s);
+    }
 }
 
 static void kvm_add_routing_entry(KVMState *s,
@@ -937,7 +1141,7 @@ static void kvm_add_routing_entry(KVMState *s,
 
     set_gsi(s, entry->gsi);
 
-    kvm_irqchip_commit_routes(s);
+    kvm_irqchip_routes_changed(s);
 }
 
 static int kvm_update_routing_entry(KVMState *s,
@@ -952,11 +1156,17 @@ static int kvm_update_routing_entry(KVMState *s,
             continue;
         }
 
+        if (entry->type == new_entry->type &&
+            entry->flags == new_entry->flags &&
+            !memcmp(&entry->u, &new_entry->u, sizeof(entry->u))) {
+            return 0;
+        }
+
         entry->type = new_entry->type;
         entry->flags = new_entry->flags;
         entry->u = new_entry->u;
 
-        kvm_irqchip_commit_routes(s);
+        kvm_irqchip_routes_changed(s);
 
         return 0;
     }
@@ -992,7 +1202,7 @@ void kvm_irqchip_release_virq(KVMState *s, int virq)
     }
     clear_gsi(s, virq);
 
-    kvm_irqchip_commit_routes(s);
+    kvm_irqchip_routes_changed(s);
 }
 
 static unsigned int kvm_hash_msi(uint32_t data)
@@ -1002,18 +1212,20 @@ static unsigned int kvm_hash_msi(uint32_t data)
     return data & 0xff;
 }
 
-static void kvm_flush_dynamic_msi_routes(KVMState *s)
+/* Free the GSI of the least recently used dynamic MSI route.  */
+static bool kvm_evict_dynamic_msi_route(KVMState *s)
 {
-    KVMMSIRoute *route, *next;
-    unsigned int hash;
+    KVMMSIRoute *route = QTAILQ_FIRST(&s->msi_lru);
 
-    for (hash = 0; hash < KVM_MSI_HASHTAB_SIZE; hash++) {
-        QTAILQ_FOREACH_SAFE(route, &s->msi_hashtab[hash], entry, next) {
-            kvm_irqchip_release_virq(s, route->kroute.gsi);
-            QTAILQ_REMOVE(&s->msi_hashtab[hash], route, entry);
-            g_free(route);
-        }
+    if (!route) {
+        return false;
     }
+    kvm_irqchip_release_virq(s, route->kroute.gsi);
+    QTAILQ_REMOVE(&s->msi_hashtab[kvm_hash_msi(route->kroute.u.msi.data)],
+                  route, entry);
+    QTAILQ_REMOVE(&s->msi_lru, route, lru);
+    g_free(route);
+    return true;
 }
 
 static int kvm_irqchip_get_virq(KVMState *s)
@@ -1021,7 +1233,6 @@ static int kvm_irqchip_get_virq(KVMState *s)
     uint32_t *word = s->used_gsi_bitmap;
     int max_words = ALIGN(s->gsi_count, 32) / 32;
     int i, bit;
-    bool retry = true;
 
 again:
     /* Return the lowest unused GSI in the bitmap */
@@ -1033,9 +1244,8 @@ again:
 
         return bit - 1 + i * 32;
     }
-    if (!s->direct_msi && retry) {
-        retry = false;
-        kvm_flush_dynamic_msi_routes(s);
+    /* Dynamic MSI routes may use up every free GSI; recycle the oldest */
+    if (!s->direct_msi && kvm_evict_dynamic_msi_route(s)) {
         goto again;
     }
     return -ENOSPC;
@@ -1073,11 +1283,16 @@ int kvm_irqchip_send_msi(KVMState *s, MSIMessage msg)
     }
 
     route = kvm_lookup_msi_route(s, msg);
-    if (!route) {
+    if (route) {
+        QTAILQ_REMOVE(&s->msi_lru, route, lru);
+    } else {
         int virq;
 
+        /* The eviction and the new entry go to KVM in a single update */
+        kvm_irqchip_begin_route_changes(s);
         virq = kvm_irqchip_get_virq(s);
         if (virq < 0) {
+            kvm_irqchip_commit_route_changes(s);
             return virq;
         }
 
@@ -1093,7 +1308,15 @@ int kvm_irqchip_send_msi(KVMState *s, MSIMessage msg)
 
         QTAILQ_INSERT_TAIL(&s->msi_hashtab[kvm_hash_msi(msg.data)], route,
                            entry);
+
+        kvm_irqchip_commit_route_changes(s);
+        /* The route must reach KVM before the interrupt is injected, even
+           if the caller has a batch open.  */
+        if (s->irq_routes_dirty) {
+            kvm_irqchip_commit_routes(s);
+        }
     }
+    QTAILQ_INSERT_TAIL(&s->msi_lru, route, lru);
 
     assert(route->kroute.type == KVM_IRQ_ROUTING_MSI);
 
@@ -1165,6 +1388,14 @@ static void kvm_init_irq_routing(KVMState *s)
 {
 }
 
+void kvm_irqchip_begin_route_changes(KVMState *s)
+{
+}
+
+void kvm_irqchip_commit_route_changes(KVMState *s)
+{
+}
+
 void kvm_irqchip_release_virq(KVMState *s, int virq)
 {
 }
@@ -1179,6 +1410,11 @@ int kvm_irqchip_add_msi_route(KVMState *s, MSIMessage msg)
     return -ENOSYS;
 }
 
+int kvm_irqchip_update_msi_route(KVMState *s, int virq, MSIMessage msg)
+{
+    return -ENOSYS;
+}
+
 static int kvm_irqchip_assign_irqfd(KVMState *s, int fd, int virq, bool assign)
 {
     abort();
@@ -1268,9 +1504,6 @@ int kvm_init(void)
 #ifdef KVM_CAP_SET_GUEST_DEBUG
     QTAILQ_INIT(&s->kvm_sw_breakpoints);
 #endif
-    for (i = 0; i < ARRAY_SIZE(s->slots); i++) {
-        s->slots[i].slot = i;
-    }
     s->vmfd = -1;
     s->fd = qemu_open("/dev/kvm", O_RDWR);
     if (s->fd == -1) {
@@ -1301,6 +1534,22 @@ int kvm_init(void)
                 "supported by KVM (%d)\n", smp_cpus, max_vcpus);
         goto err;
     }
+    if (max_cpus > max_vcpus) {
+        ret = -EINVAL;
+        fprintf(stderr, "Number of hotpluggable cpus requested (%d) exceeds "
+                "max cpus supported by KVM (%d)\n", max_cpus, max_vcpus);
+        goto err;
+    }
+
+    /* Hotplugged DIMMs each take a slot, so use as many as the kernel has */
+    s->nr_slots = kvm_check_extension(s, KVM_CAP_NR_MEMSLOTS);
+    if (s->nr_slots <= 0) {
+        s->nr_slots = 32;
+    }
+    s->slots = g_new0(KVMSlot, s->nr_slots);
+    for (i = 0; i < s->nr_slots; i++) {
+        s->slots[i].slot = i;
+    }
 
     s->vmfd = kvm_ioctl(s, KVM_CREATE_VM, 0);
     if (s->vmfd < 0) {
@@ -1325,6 +1574,8 @@ int kvm_init(void)
     }
 
     s->coalesced_mmio = kvm_check_extension(s, KVM_CAP_COALESCED_MMIO);
+    s->coalesced_pio = s->coalesced_mmio &&
+                       kvm_check_extension(s, KVM_CAP_COALESCED_PIO);
 
     s->broken_set_mem_region = 1;
     ret = kvm_check_extension(s, KVM_CAP_JOIN_MEMORY_REGIONS_WORKS);
@@ -1361,6 +1612,14 @@ int kvm_init(void)
 
     s->intx_set_mask = kvm_check_extension(s, KVM_CAP_PCI_2_3);
 
+#ifdef KVM_CAP_DIRTY_LOG_RING
+    /* must be enabled before the first vCPU is created */
+    ret = kvm_dirty_ring_init(s);
+    if (ret < 0) {
+        goto err;
+    }
+#endif
+
     s->irq_set_ioctl = KVM_IRQ_LINE;
     if (kvm_check_extension(s, KVM_CAP_IRQ_INJECT_STATUS)) {
         s->irq_set_ioctl = KVM_IRQ_LINE_STATUS;
@@ -1393,6 +1652,7 @@ err:
     if (s->fd != -1) {
         close(s->fd);
     }
+    g_free(s->slots);
     g_free(s);
 
     return ret;
@@ -1435,6 +1695,30 @@ static void kvm_handle_io(uint16_t port, void *data, int direction, int size,
     }
 }
 
+/* Complete I/O exits that target lockless regions before retaking the
+   global mutex.  Returns whether the exit has been handled.  */
+static bool kvm_handle_io_lockless(struct kvm_run *run)
+{
+    switch (run->exit_reason) {
+    case KVM_EXIT_IO:
+        if (run->io.count != 1) {
+            return false;
+        }
+        return address_space_rw_lockless(&address_space_io, run->io.port,
+                                         (uint8_t *)run + run->io.data_offset,
+                                         run->io.size,
+                                         run->io.direction == KVM_EXIT_IO_OUT);
+    case KVM_EXIT_MMIO:
+        return address_space_rw_lockless(&address_space_memory,
+                                         run->mmio.phys_addr,
+                                         run->mmio.data,
+                                         run->mmio.len,
+                                         run->mmio.is_write);
+    default:
+        return false;
+    }
+}
+
 static int kvm_handle_internal_error(CPUArchState *env, struct kvm_run *run)
 {
     fprintf(stderr, "KVM internal error.");
@@ -1462,28 +1746,48 @@ static int kvm_handle_internal_error(CPUArchState *env, struct kvm_run *run)
     return -1;
 }
 
+/* This runs after every exit, so the empty ring must cost no more than
+   two loads.  Entries are replayed in batches up to a snapshot of the
+   producer index, and the slots are handed back to the kernel once per
+   batch rather than once per entry.  */
 void kvm_flush_coalesced_mmio_buffer(void)
 {
     KVMState *s = kvm_state;
+    struct kvm_coalesced_mmio_ring *ring = s->coalesced_mmio_ring;
+    uint32_t first, last;
 
-    if (s->coalesced_flush_in_progress) {
+    if (!ring || s->coalesced_flush_in_progress) {
+        return;
+    }
+
+    first = ring->first;
+    last = ring->last;
+    if (first == last) {
         return;
     }
 
     s->coalesced_flush_in_progress = true;
 
-    if (s->coalesced_mmio_ring) {
-        struct kvm_coalesced_mmio_ring *ring = s->coalesced_mmio_ring;
-        while (ring->first != ring->last) {
+    do {
+        /* Read the entries only after the index that published them.  */
+        smp_rmb();
+        while (first != last) {
             struct kvm_coalesced_mmio *ent;
 
-            ent = &ring->coalesced_mmio[ring->first];
+            ent = &ring->coalesced_mmio[first];
 
-            cpu_physical_memory_write(ent->phys_addr, ent->data, ent->len);
-            smp_wmb();
-            ring->first = (ring->first + 1) % KVM_COALESCED_MMIO_MAX;
+            if (ent->pio) {
+                kvm_handle_io(ent->phys_addr, ent->data, KVM_EXIT_IO_OUT,
+                              ent->len, 1);
+            } else {
+                cpu_physical_memory_write(ent->phys_addr, ent->data, ent->len);
+            }
+            first = (first + 1) % KVM_COALESCED_MMIO_MAX;
         }
-    }
+        smp_mb();
+        ring->first = first;
+        last = ring->last;
+    } while (first != last);
 
     s->coalesced_flush_in_progress = false;
 }
@@ -1523,6 +1827,7 @@ int kvm_cpu_exec(CPUArchState *env)
 {
     struct kvm_run *run = env->kvm_run;
     int ret, run_ret;
+    bool io_done;
 
     DPRINTF("kvm_cpu_exec()\n");
 
@@ -1547,12 +1852,14 @@ int kvm_cpu_exec(CPUArchState *env)
              */
             qemu_cpu_kick_self();
         }
-        qemu_mutex_unlock_iothread();
+        qemu_mutex_release_iothread_vcpu();
 
         run_ret = kvm_vcpu_ioctl(env, KVM_RUN, 0);
+        io_done = run_ret >= 0 && kvm_handle_io_lockless(run);
 
-        qemu_mutex_lock_iothread();
+        qemu_mutex_acquire_iothread_vcpu();
         kvm_arch_post_run(env, run);
+        kvm_flush_coalesced_mmio_buffer();
 
         if (run_ret < 0) {
             if (run_ret == -EINTR || run_ret == -EAGAIN) {
@@ -1568,6 +1875,10 @@ int kvm_cpu_exec(CPUArchState *env)
         switch (run->exit_reason) {
         case KVM_EXIT_IO:
             DPRINTF("handle_io\n");
+            if (io_done) {
+                ret = 0;
+                break;
+            }
             kvm_handle_io(run->io.port,
                           (uint8_t *)run + run->io.data_offset,
                           run->io.direction,
@@ -1577,6 +1888,10 @@ int kvm_cpu_exec(CPUArchState *env)
             break;
         case KVM_EXIT_MMIO:
             DPRINTF("handle_mmio\n");
+            if (io_done) {
+                ret = 0;
+                break;
+            }
             cpu_physical_memory_rw(run->mmio.phys_addr,
                                    run->mmio.data,
                                    run->mmio.len,
@@ -1600,6 +1915,13 @@ int kvm_cpu_exec(CPUArchState *env)
         case KVM_EXIT_INTERNAL_ERROR:
             ret = kvm_handle_internal_error(env, run);
             break;
+#ifdef KVM_CAP_DIRTY_LOG_RING
+        case KVM_EXIT_DIRTY_RING_FULL:
+            DPRINTF("dirty ring full\n");
+            kvm_dirty_ring_reap(env->kvm_state);
+            ret = 0;
+            break;
+#endif
         default:
             DPRINTF("kvm_arch_handle_exit\n");
             ret = kvm_arch_handle_exit(env, run);
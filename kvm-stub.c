@@ -127,10 +127,23 @@ int kvm_irqchip_add_msi_route(KVMState *s, MSIMessage msg)
     return -ENOSYS;
 }
 
+int kvm_irqchip_update_msi_route(KVMState *s, int virq, MSIMessage msg)
+{
+    return -ENOSYS;
+}
+
 void kvm_irqchip_release_virq(KVMState *s, int virq)
 {
 }
 
+void kvm_irqchip_begin_route_changes(KVMState *s)
+{
+}
+
+void kvm_irqchip_commit_route_changes(KVMState *s)
+{
+}
+
 int kvm_irqchip_add_irqfd_notifier(KVMState *s, EventNotifier *n, int virq)
 {
     return -ENOSYS;
@@ -5134,6 +5134,79 @@ static int do_open(void *cpu_env, const char *pathname, int flags, mode_t mode)
     return get_errno(open(path(pathname), flags, mode));
 }
 
+/* When guest and host agree on word size and byte order, struct timespec
+   and struct timeval have the same layout and the host can fill them in
+   guest memory directly.  The same goes for struct stat when the guest
+   is the host architecture.  */
+#if !defined(DEBUG_REMAP)
+#if TARGET_ABI_BITS == HOST_LONG_BITS && !defined(BSWAP_NEEDED)
+#define TARGET_TIME_IS_HOST
+#endif
+#if defined(TARGET_X86_64) && defined(__x86_64__)
+#define TARGET_STAT_IS_HOST
+QEMU_BUILD_BUG_ON(sizeof(struct target_stat) != sizeof(struct stat));
+#endif
+#endif
+
+/* Fast path for the hottest system calls, tried before the big switch in
+   do_syscall().  Arguments are passed to the host without conversion or
+   copies.  Returns false if the call must take the slow path, which also
+   reports errors such as -TARGET_EFAULT.  */
+static bool do_syscall_fast(int num, abi_long arg1, abi_long arg2,
+                            abi_long arg3, abi_long arg4, abi_long arg5,
+                            abi_long arg6, abi_long *ret)
+{
+    void *p;
+
+    switch (num) {
+    case TARGET_NR_read:
+        if (arg3 == 0 || !(p = lock_user(VERIFY_WRITE, arg2, arg3, 0))) {
+            return false;
+        }
+        *ret = get_errno(read(arg1, p, arg3));
+        unlock_user(p, arg2, *ret);
+        return true;
+    case TARGET_NR_write:
+        if (!(p = lock_user(VERIFY_READ, arg2, arg3, 1))) {
+            return false;
+        }
+        *ret = get_errno(write(arg1, p, arg3));
+        unlock_user(p, arg2, 0);
+        return true;
+#if defined(TARGET_NR_futex) && defined(CONFIG_USE_NPTL)
+    case TARGET_NR_futex:
+        *ret = do_futex(arg1, arg2, arg3, arg4, arg5, arg6);
+        return true;
+#endif
+#ifdef TARGET_TIME_IS_HOST
+#ifdef TARGET_NR_clock_gettime
+    case TARGET_NR_clock_gettime:
+        if (!access_ok(VERIFY_WRITE, arg2, sizeof(struct timespec))) {
+            return false;
+        }
+        *ret = get_errno(clock_gettime(arg1, g2h(arg2)));
+        return true;
+#endif
+    case TARGET_NR_gettimeofday:
+        if (!access_ok(VERIFY_WRITE, arg1, sizeof(struct timeval))) {
+            return false;
+        }
+        *ret = get_errno(gettimeofday(g2h(arg1), NULL));
+        return true;
+#endif
+#ifdef TARGET_STAT_IS_HOST
+    case TARGET_NR_fstat:
+        if (!access_ok(VERIFY_WRITE, arg2, sizeof(struct stat))) {
+            return false;
+        }
+        *ret = get_errno(fstat(arg1, g2h(arg2)));
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
 /* do_syscall() should always have a single exit point at the end so
    that actions, such as logging of syscall results, can be performed.
    All errnos that do_syscall() returns must be -TARGET_<errcode>. */
@@ -5152,6 +5225,8 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
 #endif
     if(do_strace)
         print_syscall(num, arg1, arg2, arg3, arg4, arg5, arg6);
+    else if (do_syscall_fast(num, arg1, arg2, arg3, arg4, arg5, arg6, &ret))
+        return ret;
 
     switch(num) {
     case TARGET_NR_exit:
@@ -30,6 +30,13 @@
 
 #ifndef _WIN32
 
+#include <poll.h>
+#ifdef CONFIG_EPOLL
+#include <sys/epoll.h>
+#endif
+#ifdef CONFIG_TIMERFD
+#include <sys/timerfd.h>
+#endif
 #include "compatfd.h"
 
 /* If we have signalfd, we mask out the signals we want to handle and then
@@ -109,6 +116,11 @@ static int qemu_signal_init(void)
 
 static AioContext *qemu_aio_context;
 
+AioContext *qemu_get_aio_context(void)
+{
+    return qemu_aio_context;
+}
+
 void qemu_notify_event(void)
 {
     if (!qemu_aio_context) {
@@ -123,10 +135,6 @@ int qemu_init_main_loop(void)
     GSource *src;
 
     init_clocks();
-    if (init_timer_alarm() < 0) {
-        fprintf(stderr, "could not initialize alarm timer\n");
-        exit(1);
-    }
 
     ret = qemu_signal_init();
     if (ret) {
@@ -140,15 +148,381 @@ int qemu_init_main_loop(void)
     return 0;
 }
 
+#ifdef _WIN32
 static fd_set rfds, wfds, xfds;
 static int nfds;
+#endif
 static GPollFD poll_fds[1024 * 2]; /* this is probably overkill */
 static int n_poll_fds;
 static int max_priority;
 
 #ifndef _WIN32
-static void glib_select_fill(int *max_fd, fd_set *rfds, fd_set *wfds,
-                             fd_set *xfds, uint32_t *cur_timeout)
+/* Every file descriptor the main loop waits on has an entry in a table
+ * indexed by fd.  The iohandlers, the glib main context and slirp each
+ * declare the G_IO_* events they are interested in; the union is kept
+ * registered in a persistent epoll set, so that steady-state iterations
+ * do not issue any system call besides the wait itself.  Hosts without
+ * epoll poll() an array that is only rebuilt when the registrations
+ * change.
+ *
+ * Timer deadlines are folded into the wait with nanosecond precision:
+ * epoll_wait() only takes milliseconds, so a timerfd in the epoll set
+ * wakes us at the exact deadline, while ppoll() takes it directly.
+ */
+typedef struct MainLoopPollFd {
+    uint16_t events[MAIN_LOOP_POLL_NR];
+    uint16_t registered;
+    uint16_t revents;
+    bool dirty;
+    /* regular files cannot be added to an epoll set; like select() and
+       poll(), treat them as always ready */
+    bool always_ready;
+} MainLoopPollFd;
+
+typedef struct MainLoopFdList {
+    int *fds;
+    int nr;
+    int alloc;
+} MainLoopFdList;
+
+static MainLoopPollFd *poll_table;
+static int poll_table_nr;
+static MainLoopFdList poll_dirty;
+static MainLoopFdList poll_ready;
+static MainLoopFdList poll_always_ready;
+static int poll_registered_nr;
+static bool poll_initialized;
+
+#ifdef CONFIG_EPOLL
+static int poll_epoll_fd = -1;
+static struct epoll_event *poll_epoll_events;
+static int poll_epoll_events_nr;
+#endif
+
+#ifdef CONFIG_TIMERFD
+/* Deadlines closer than this to the armed one reuse it, so that a wakeup
+   for I/O does not cost a timerfd_settime() when the earliest timer did
+   not change.  */
+#define POLL_TIMER_SLACK_NS 10000
+
+static int poll_timer_fd = -1;
+static int64_t poll_timer_deadline = -1;
+#endif
+
+static GPollFD *poll_array;
+static int poll_array_nr;
+static bool poll_array_stale;
+
+static void fd_list_add(MainLoopFdList *list, int fd)
+{
+    if (list->nr == list->alloc) {
+        list->alloc = MAX(list->alloc * 2, 16);
+        list->fds = g_renew(int, list->fds, list->alloc);
+    }
+    list->fds[list->nr++] = fd;
+}
+
+static void fd_list_remove(MainLoopFdList *list, int fd)
+{
+    int i;
+
+    for (i = 0; i < list->nr; i++) {
+        if (list->fds[i] == fd) {
+            list->fds[i] = list->fds[--list->nr];
+            return;
+        }
+    }
+}
+
+static MainLoopPollFd *main_loop_poll_fd(int fd)
+{
+    if (fd >= poll_table_nr) {
+        int nr = MAX(MAX(poll_table_nr * 2, 64), fd + 1);
+
+        poll_table = g_renew(MainLoopPollFd, poll_table, nr);
+        memset(poll_table + poll_table_nr, 0,
+               (nr - poll_table_nr) * sizeof(*poll_table));
+        poll_table_nr = nr;
+    }
+    return &poll_table[fd];
+}
+
+void main_loop_poll_set_events(int fd, MainLoopPollSource source, int events)
+{
+    MainLoopPollFd *p = main_loop_poll_fd(fd);
+
+    if (p->events[source] == events) {
+        return;
+    }
+    p->events[source] = events;
+    if (!p->dirty) {
+        p->dirty = true;
+        fd_list_add(&poll_dirty, fd);
+    }
+}
+
+int main_loop_poll_get_events(int fd, MainLoopPollSource source)
+{
+    return fd < poll_table_nr ? poll_table[fd].events[source] : 0;
+}
+
+int main_loop_poll_revents(int fd)
+{
+    return fd < poll_table_nr ? poll_table[fd].revents : 0;
+}
+
+int main_loop_poll_ready_fds(const int **fds)
+{
+    *fds = poll_ready.fds;
+    return poll_ready.nr;
+}
+
+static void main_loop_poll_init(void)
+{
+    poll_initialized = true;
+#ifdef CONFIG_EPOLL
+#ifdef CONFIG_EPOLL_CREATE1
+    poll_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+#else
+    poll_epoll_fd = epoll_create(64);
+    if (poll_epoll_fd >= 0) {
+        qemu_set_cloexec(poll_epoll_fd);
+    }
+#endif
+#ifdef CONFIG_TIMERFD
+    if (poll_epoll_fd >= 0 && use_rt_clock) {
+        struct epoll_event ev = { .events = EPOLLIN };
+
+        poll_timer_fd = timerfd_create(CLOCK_MONOTONIC,
+                                       TFD_NONBLOCK | TFD_CLOEXEC);
+        ev.data.fd = poll_timer_fd;
+        if (poll_timer_fd >= 0 &&
+            epoll_ctl(poll_epoll_fd, EPOLL_CTL_ADD, poll_timer_fd, &ev) < 0) {
+            close(poll_timer_fd);
+            poll_timer_fd = -1;
+        }
+    }
+#endif
+#endif
+}
+
+#ifdef CONFIG_EPOLL
+static uint32_t epoll_events_from_gio(int events)
+{
+    return (events & G_IO_IN ? EPOLLIN : 0) |
+           (events & G_IO_OUT ? EPOLLOUT : 0) |
+           (events & G_IO_PRI ? EPOLLPRI : 0);
+}
+
+static int gio_from_epoll_events(uint32_t events)
+{
+    return (events & EPOLLIN ? G_IO_IN : 0) |
+           (events & EPOLLOUT ? G_IO_OUT : 0) |
+           (events & EPOLLPRI ? G_IO_PRI : 0) |
+           (events & EPOLLERR ? G_IO_ERR : 0) |
+           (events & EPOLLHUP ? G_IO_HUP : 0);
+}
+
+static void main_loop_epoll_update(int fd, MainLoopPollFd *p, int events)
+{
+    struct epoll_event ev = {
+        .events = epoll_events_from_gio(events),
+        .data.fd = fd,
+    };
+    int op, ret;
+
+    if (p->always_ready) {
+        if (!events) {
+            p->always_ready = false;
+            fd_list_remove(&poll_always_ready, fd);
+        }
+        return;
+    }
+
+    op = !p->registered ? EPOLL_CTL_ADD :
+         !events ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+    ret = epoll_ctl(poll_epoll_fd, op, fd, &ev);
+    if (ret < 0 && errno == ENOENT && events) {
+        /* closed behind our back, possibly reused */
+        ret = epoll_ctl(poll_epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    } else if (ret < 0 && errno == EEXIST) {
+        ret = epoll_ctl(poll_epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+    }
+    if (ret < 0 && errno == EPERM && events) {
+        p->always_ready = true;
+        fd_list_add(&poll_always_ready, fd);
+    }
+    /* other failures are for descriptors that were already closed */
+}
+#endif
+
+/* Push the events that changed since the last wait to the kernel. */
+static void main_loop_poll_sync(void)
+{
+    int i, j;
+
+    if (!poll_initialized) {
+        main_loop_poll_init();
+    }
+
+    for (i = 0; i < poll_dirty.nr; i++) {
+        int fd = poll_dirty.fds[i];
+        MainLoopPollFd *p = &poll_table[fd];
+        int events = 0;
+
+        p->dirty = false;
+        for (j = 0; j < MAIN_LOOP_POLL_NR; j++) {
+            events |= p->events[j];
+        }
+        if (events == p->registered) {
+            continue;
+        }
+#ifdef CONFIG_EPOLL
+        if (poll_epoll_fd >= 0) {
+            main_loop_epoll_update(fd, p, events);
+        }
+#endif
+        poll_registered_nr += !p->registered - !events;
+        p->registered = events;
+        poll_array_stale = true;
+    }
+    poll_dirty.nr = 0;
+
+    /* the previous results have been consumed */
+    for (i = 0; i < poll_ready.nr; i++) {
+        poll_table[poll_ready.fds[i]].revents = 0;
+    }
+    poll_ready.nr = 0;
+}
+
+static void main_loop_poll_set_ready(int fd, int revents)
+{
+    MainLoopPollFd *p = &poll_table[fd];
+
+    if (!p->revents) {
+        fd_list_add(&poll_ready, fd);
+    }
+    p->revents |= revents;
+}
+
+#ifdef CONFIG_TIMERFD
+/* Arm the timerfd for a timeout in nanoseconds that epoll_wait() cannot
+   express; returns the timeout in milliseconds to use as a fallback.  */
+static int main_loop_timer_arm(int64_t timeout)
+{
+    struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+    int64_t deadline = -1;
+
+    if (timeout > 0 && timeout % SCALE_MS) {
+        deadline = get_clock() + timeout;
+        if (poll_timer_deadline >= 0 &&
+            deadline >= poll_timer_deadline - POLL_TIMER_SLACK_NS &&
+            deadline <= poll_timer_deadline + POLL_TIMER_SLACK_NS) {
+            return qemu_timeout_ns_to_ms(timeout);
+        }
+        its.it_value.tv_sec = deadline / 1000000000LL;
+        its.it_value.tv_nsec = deadline % 1000000000LL;
+    } else if (poll_timer_deadline < 0) {
+        return qemu_timeout_ns_to_ms(timeout);
+    }
+
+    /* arm, or disarm a deadline that is no longer wanted */
+    if (timerfd_settime(poll_timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+        deadline = -1;
+    }
+    poll_timer_deadline = deadline;
+    return qemu_timeout_ns_to_ms(timeout);
+}
+
+static void main_loop_timer_expired(void)
+{
+    uint64_t expirations;
+
+    if (read(poll_timer_fd, &expirations, sizeof(expirations)) > 0) {
+        poll_timer_deadline = -1;
+    }
+}
+#endif
+
+static int main_loop_poll_wait(int64_t timeout)
+{
+    int ret, i;
+
+    if (poll_always_ready.nr) {
+        timeout = 0;
+    }
+
+#ifdef CONFIG_EPOLL
+    if (poll_epoll_fd >= 0) {
+        int ms = qemu_timeout_ns_to_ms(timeout);
+
+#ifdef CONFIG_TIMERFD
+        if (poll_timer_fd >= 0) {
+            ms = main_loop_timer_arm(timeout);
+        }
+#endif
+        /* one more for the timerfd */
+        if (poll_epoll_events_nr < poll_registered_nr + 1) {
+            poll_epoll_events_nr = MAX(poll_registered_nr + 1, 16);
+            poll_epoll_events = g_renew(struct epoll_event, poll_epoll_events,
+                                        poll_epoll_events_nr);
+        }
+        ret = epoll_wait(poll_epoll_fd, poll_epoll_events,
+                         poll_epoll_events_nr, ms);
+        for (i = 0; i < ret; i++) {
+#ifdef CONFIG_TIMERFD
+            if (poll_epoll_events[i].data.fd == poll_timer_fd) {
+                main_loop_timer_expired();
+                continue;
+            }
+#endif
+            main_loop_poll_set_ready(poll_epoll_events[i].data.fd,
+                    gio_from_epoll_events(poll_epoll_events[i].events));
+        }
+    } else
+#endif
+    {
+        if (poll_array_stale) {
+            int fd, n = 0;
+
+            poll_array = g_renew(GPollFD, poll_array,
+                                 MAX(poll_registered_nr, 1));
+            for (fd = 0; fd < poll_table_nr; fd++) {
+                if (poll_table[fd].registered) {
+                    poll_array[n].fd = fd;
+                    /* G_IO_* have the values of the POLL* constants */
+                    poll_array[n].events = poll_table[fd].registered;
+                    n++;
+                }
+            }
+            poll_array_nr = n;
+            poll_array_stale = false;
+        }
+        ret = qemu_poll_ns(poll_array, poll_array_nr, timeout);
+        for (i = 0; i < poll_array_nr && ret > 0; i++) {
+            if (poll_array[i].revents) {
+                main_loop_poll_set_ready(poll_array[i].fd,
+                                         poll_array[i].revents);
+            }
+        }
+    }
+
+    if (ret >= 0) {
+        for (i = 0; i < poll_always_ready.nr; i++) {
+            int fd = poll_always_ready.fds[i];
+
+            main_loop_poll_set_ready(fd, poll_table[fd].registered &
+                                         (G_IO_IN | G_IO_OUT));
+            ret++;
+        }
+    }
+    return ret;
+}
+
+static GPollFD glib_last_fds[ARRAY_SIZE(poll_fds)];
+static int n_glib_last_fds;
+
+static void glib_poll_fill(int64_t *cur_timeout)
 {
     GMainContext *context = g_main_context_default();
     int i;
@@ -160,30 +534,34 @@ static void glib_select_fill(int *max_fd, fd_set *rfds, fd_set *wfds,
                                       poll_fds, ARRAY_SIZE(poll_fds));
     g_assert(n_poll_fds <= ARRAY_SIZE(poll_fds));
 
-    for (i = 0; i < n_poll_fds; i++) {
-        GPollFD *p = &poll_fds[i];
-
-        if ((p->events & G_IO_IN)) {
-            FD_SET(p->fd, rfds);
-            *max_fd = MAX(*max_fd, p->fd);
+    /* the set of glib descriptors rarely changes between iterations */
+    for (i = 0; i < n_poll_fds && i < n_glib_last_fds; i++) {
+        if (poll_fds[i].fd != glib_last_fds[i].fd ||
+            poll_fds[i].events != glib_last_fds[i].events) {
+            break;
         }
-        if ((p->events & G_IO_OUT)) {
-            FD_SET(p->fd, wfds);
-            *max_fd = MAX(*max_fd, p->fd);
+    }
+    if (i < n_poll_fds || i < n_glib_last_fds) {
+        for (i = 0; i < n_glib_last_fds; i++) {
+            main_loop_poll_set_events(glib_last_fds[i].fd,
+                                      MAIN_LOOP_POLL_GLIB, 0);
         }
-        if ((p->events & G_IO_ERR)) {
-            FD_SET(p->fd, xfds);
-            *max_fd = MAX(*max_fd, p->fd);
+        for (i = 0; i < n_poll_fds; i++) {
+            GPollFD *p = &poll_fds[i];
+
+            main_loop_poll_set_events(p->fd, MAIN_LOOP_POLL_GLIB,
+                main_loop_poll_get_events(p->fd, MAIN_LOOP_POLL_GLIB) |
+                (p->events & (G_IO_IN | G_IO_OUT | G_IO_PRI)));
         }
+        memcpy(glib_last_fds, poll_fds, n_poll_fds * sizeof(GPollFD));
+        n_glib_last_fds = n_poll_fds;
     }
 
-    if (timeout >= 0 && timeout < *cur_timeout) {
-        *cur_timeout = timeout;
-    }
+    *cur_timeout = qemu_soonest_timeout(*cur_timeout,
+                                        timeout < 0 ? -1 : timeout * SCALE_MS);
 }
 
-static void glib_select_poll(fd_set *rfds, fd_set *wfds, fd_set *xfds,
-                             bool err)
+static void glib_poll_dispatch(bool err)
 {
     GMainContext *context = g_main_context_default();
 
@@ -193,15 +571,8 @@ static void glib_select_poll(fd_set *rfds, fd_set *wfds, fd_set *xfds,
         for (i = 0; i < n_poll_fds; i++) {
             GPollFD *p = &poll_fds[i];
 
-            if ((p->events & G_IO_IN) && FD_ISSET(p->fd, rfds)) {
-                p->revents |= G_IO_IN;
-            }
-            if ((p->events & G_IO_OUT) && FD_ISSET(p->fd, wfds)) {
-                p->revents |= G_IO_OUT;
-            }
-            if ((p->events & G_IO_ERR) && FD_ISSET(p->fd, xfds)) {
-                p->revents |= G_IO_ERR;
-            }
+            p->revents = main_loop_poll_revents(p->fd) &
+                         (p->events | G_IO_ERR | G_IO_HUP);
         }
     }
 
@@ -210,30 +581,33 @@ static void glib_select_poll(fd_set *rfds, fd_set *wfds, fd_set *xfds,
     }
 }
 
-static int os_host_main_loop_wait(uint32_t timeout)
+static int os_host_main_loop_wait(int64_t timeout)
 {
-    struct timeval tv, *tvarg = NULL;
     int ret;
 
-    glib_select_fill(&nfds, &rfds, &wfds, &xfds, &timeout);
-
-    if (timeout < UINT32_MAX) {
-        tvarg = &tv;
-        tv.tv_sec = timeout / 1000;
-        tv.tv_usec = (timeout % 1000) * 1000;
-    }
+    /* XXX: separate device handlers from system ones */
+#ifdef CONFIG_SLIRP
+    slirp_pollfds_fill();
+#endif
+    qemu_iohandler_fill();
+    glib_poll_fill(&timeout);
+    main_loop_poll_sync();
 
-    if (timeout > 0) {
+    if (timeout != 0) {
         qemu_mutex_unlock_iothread();
     }
 
-    ret = select(nfds + 1, &rfds, &wfds, &xfds, tvarg);
+    ret = main_loop_poll_wait(timeout);
 
-    if (timeout > 0) {
+    if (timeout != 0) {
         qemu_mutex_lock_iothread();
     }
 
-    glib_select_poll(&rfds, &wfds, &xfds, (ret < 0));
+    glib_poll_dispatch(ret < 0);
+    qemu_iohandler_poll(ret);
+#ifdef CONFIG_SLIRP
+    slirp_pollfds_poll(ret < 0);
+#endif
     return ret;
 }
 #else
@@ -327,7 +701,7 @@ void qemu_fd_register(int fd)
                    FD_CONNECT | FD_WRITE | FD_OOB);
 }
 
-static int os_host_main_loop_wait(uint32_t timeout)
+static int win32_main_loop_wait(int64_t timeout)
 {
     GMainContext *context = g_main_context_default();
     int ret, i;
@@ -362,9 +736,9 @@ static int os_host_main_loop_wait(uint32_t timeout)
         poll_fds[n_poll_fds + i].events = G_IO_IN;
     }
 
-    if (poll_timeout < 0 || timeout < poll_timeout) {
-        poll_timeout = timeout;
-    }
+    poll_timeout = qemu_timeout_ns_to_ms(
+        qemu_soonest_timeout(timeout, poll_timeout < 0 ? -1 :
+                                      (int64_t)poll_timeout * SCALE_MS));
 
     qemu_mutex_unlock_iothread();
     ret = g_poll(poll_fds, n_poll_fds + w->num, poll_timeout);
@@ -391,18 +765,11 @@ static int os_host_main_loop_wait(uint32_t timeout)
 
     return ret;
 }
-#endif
 
-int main_loop_wait(int nonblocking)
+static int os_host_main_loop_wait(int64_t timeout)
 {
     int ret;
-    uint32_t timeout = UINT32_MAX;
-
-    if (nonblocking) {
-        timeout = 0;
-    }
 
-    /* poll any events */
     /* XXX: separate device handlers from system ones */
     nfds = -1;
     FD_ZERO(&rfds);
@@ -410,15 +777,40 @@ int main_loop_wait(int nonblocking)
     FD_ZERO(&xfds);
 
 #ifdef CONFIG_SLIRP
-    slirp_update_timeout(&timeout);
     slirp_select_fill(&nfds, &rfds, &wfds, &xfds);
 #endif
     qemu_iohandler_fill(&nfds, &rfds, &wfds, &xfds);
-    ret = os_host_main_loop_wait(timeout);
+    ret = win32_main_loop_wait(timeout);
     qemu_iohandler_poll(&rfds, &wfds, &xfds, ret);
 #ifdef CONFIG_SLIRP
     slirp_select_poll(&rfds, &wfds, &xfds, (ret < 0));
 #endif
+    return ret;
+}
+#endif
+
+int main_loop_wait(int nonblocking)
+{
+    int ret;
+    uint32_t timeout = UINT32_MAX;
+    int64_t timeout_ns;
+
+    if (nonblocking) {
+        timeout = 0;
+    }
+
+    /* poll any events */
+#if defined(CONFIG_SLIRP) && defined(_WIN32)
+    /* elsewhere slirp's timers are regular QEMU timers */
+    slirp_update_timeout(&timeout);
+#endif
+    timeout_ns = timeout == UINT32_MAX ? -1 : (int64_t)timeout * SCALE_MS;
+
+    /* the timers are run right after the wait, so wake up for the first */
+    timeout_ns = qemu_soonest_timeout(timeout_ns,
+                                      timerlistgroup_deadline_ns(main_loop_tlg));
+
+    ret = os_host_main_loop_wait(timeout_ns);
 
     qemu_run_all_timers();
 
@@ -44,6 +44,15 @@
  */
 int qemu_init_main_loop(void);
 
+/**
+ * qemu_get_aio_context: Return the main loop's AioContext.
+ *
+ * This is the context that qemu_bh_new(), qemu_aio_wait() and friends
+ * operate on.  Block devices are bound to it unless they are moved to
+ * another AioContext with bdrv_set_aio_context().
+ */
+AioContext *qemu_get_aio_context(void);
+
 /**
  * main_loop_wait: Run one iteration of the main loop.
  *
@@ -294,11 +303,72 @@ void qemu_mutex_lock_iothread(void);
  */
 void qemu_mutex_unlock_iothread(void);
 
+/**
+ * qemu_mutex_lock_iothread_vcpu: Lock the main loop mutex from guest code.
+ *
+ * With multi-threaded TCG, vCPU threads execute guest code without the
+ * main loop mutex.  Code reached from there that emulates devices or
+ * changes state shared with the main loop calls this function first.  It
+ * takes the mutex only if the calling thread is such a vCPU, and returns
+ * whether it did; pass the result to qemu_mutex_unlock_iothread_vcpu.
+ */
+bool qemu_mutex_lock_iothread_vcpu(void);
+
+/**
+ * qemu_mutex_unlock_iothread_vcpu: Undo qemu_mutex_lock_iothread_vcpu.
+ *
+ * @locked: The value returned by qemu_mutex_lock_iothread_vcpu.
+ */
+void qemu_mutex_unlock_iothread_vcpu(bool locked);
+
+/**
+ * qemu_mutex_release_iothread_vcpu: Unlock the main loop mutex before
+ * running guest code.
+ *
+ * Called by vCPU threads instead of qemu_mutex_unlock_iothread, so that
+ * code reached without the mutex (for example through lockless memory
+ * regions) can take it with qemu_mutex_lock_iothread_vcpu.
+ */
+void qemu_mutex_release_iothread_vcpu(void);
+
+/**
+ * qemu_mutex_acquire_iothread_vcpu: Undo qemu_mutex_release_iothread_vcpu.
+ */
+void qemu_mutex_acquire_iothread_vcpu(void);
+
+/**
+ * qemu_mutex_reset_iothread_vcpu: Drop the mutex after a guest exception.
+ *
+ * Called by cpu_exec when a guest exception longjmps out of code that
+ * took the mutex with qemu_mutex_lock_iothread_vcpu.
+ */
+void qemu_mutex_reset_iothread_vcpu(void);
+
 /* internal interfaces */
 
 void qemu_fd_register(int fd);
+#ifndef _WIN32
+typedef enum MainLoopPollSource {
+    MAIN_LOOP_POLL_IOHANDLER,
+    MAIN_LOOP_POLL_GLIB,
+    MAIN_LOOP_POLL_SLIRP,
+    MAIN_LOOP_POLL_NR
+} MainLoopPollSource;
+
+/* Declare the G_IO_* events @source waits for on @fd; 0 stops waiting. */
+void main_loop_poll_set_events(int fd, MainLoopPollSource source, int events);
+int main_loop_poll_get_events(int fd, MainLoopPollSource source);
+/* G_IO_* events reported for @fd by the last wait */
+int main_loop_poll_revents(int fd);
+/* The descriptors the last wait reported events for */
+int main_loop_poll_ready_fds(const int **fds);
+
+void qemu_iohandler_fill(void);
+void qemu_iohandler_poll(int rc);
+#else
 void qemu_iohandler_fill(int *pnfds, fd_set *readfds, fd_set *writefds, fd_set *xfds);
 void qemu_iohandler_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds, int rc);
+#endif
 
 QEMUBH *qemu_bh_new(QEMUBHFunc *cb, void *opaque);
 void qemu_bh_schedule_idle(QEMUBH *bh);
@@ -18,6 +18,8 @@
 #include "ioport.h"
 #include "bitops.h"
 #include "kvm.h"
+#include "main-loop.h"
+#include "qemu-rcu.h"
 #include <assert.h>
 
 #include "memory-internal.h"
@@ -218,9 +220,13 @@ struct FlatRange {
 };
 
 /* Flattened global view of current active memory hierarchy.  Kept in sorted
- * order.
+ * order.  A view is immutable once published in AddressSpace::current_map;
+ * readers outside the global mutex take a reference inside an RCU critical
+ * section with address_space_get_flatview().
  */
 struct FlatView {
+    struct rcu_head rcu;
+    unsigned ref;
     FlatRange *ranges;
     unsigned nr;
     unsigned nr_allocated;
@@ -242,6 +248,7 @@ static bool flatrange_equal(FlatRange *a, FlatRange *b)
 
 static void flatview_init(FlatView *view)
 {
+    view->ref = 1;
     view->ranges = NULL;
     view->nr = 0;
     view->nr_allocated = 0;
@@ -266,6 +273,42 @@ static void flatview_insert(FlatView *view, unsigned pos, FlatRange *range)
 static void flatview_destroy(FlatView *view)
 {
     g_free(view->ranges);
+    g_free(view);
+}
+
+static void flatview_ref(FlatView *view)
+{
+    __sync_fetch_and_add(&view->ref, 1);
+}
+
+static void flatview_unref(FlatView *view)
+{
+    if (__sync_fetch_and_sub(&view->ref, 1) == 1) {
+        flatview_destroy(view);
+    }
+}
+
+static void flatview_reclaim(struct rcu_head *rcu)
+{
+    flatview_unref(container_of(rcu, FlatView, rcu));
+}
+
+static FlatView *address_space_get_flatview(AddressSpace *as)
+{
+    FlatView *view;
+
+    rcu_read_lock();
+    view = atomic_rcu_read(&as->current_map);
+    flatview_ref(view);
+    rcu_read_unlock();
+    return view;
+}
+
+/* Drop the reference held by AddressSpace::current_map once no reader
+   can still be fetching it.  */
+static void address_space_retire_flatview(FlatView *view)
+{
+    call_rcu(&view->rcu, flatview_reclaim);
 }
 
 static bool can_merge(FlatRange *r1, FlatRange *r2)
@@ -559,17 +602,107 @@ static void render_memory_region(FlatView *view,
 }
 
 /* Render a memory topology into a list of disjoint absolute ranges. */
-static FlatView generate_memory_topology(MemoryRegion *mr)
+static FlatView *generate_memory_topology(MemoryRegion *mr)
 {
-    FlatView view;
+    FlatView *view = g_new(FlatView, 1);
 
-    flatview_init(&view);
+    flatview_init(view);
 
     if (mr) {
-        render_memory_region(&view, mr, int128_zero(),
+        render_memory_region(view, mr, int128_zero(),
                              addrrange_make(int128_zero(), int128_2_64()), false);
     }
-    flatview_simplify(&view);
+    flatview_simplify(view);
+
+    return view;
+}
+
+static int cmp_addrrange_start(const void *a_, const void *b_)
+{
+    const AddrRange *a = a_, *b = b_;
+
+    if (int128_lt(a->start, b->start)) {
+        return -1;
+    } else if (int128_eq(a->start, b->start)) {
+        return 0;
+    }
+    return 1;
+}
+
+/* Append the part of @fr that lies within @clip to @view. */
+static void flatview_append_clipped(FlatView *view, FlatRange *fr,
+                                    AddrRange clip)
+{
+    FlatRange piece = *fr;
+
+    if (!addrrange_intersects(fr->addr, clip)) {
+        return;
+    }
+    piece.addr = addrrange_intersection(fr->addr, clip);
+    piece.offset_in_region +=
+        int128_get64(int128_sub(piece.addr.start, fr->addr.start));
+    flatview_insert(view, view->nr, &piece);
+}
+
+/* Like generate_memory_topology(), but only render again the parts of the
+ * address space listed in @damage; everything else is copied from @old.
+ * @damage is sorted and merged in place.
+ */
+static FlatView *generate_memory_topology_damage(MemoryRegion *mr,
+                                                 FlatView *old,
+                                                 AddrRange *damage,
+                                                 unsigned damage_nb)
+{
+    FlatView *view = g_new(FlatView, 1);
+    FlatView part;
+    AddrRange gap;
+    Int128 start, end;
+    unsigned i, j, k;
+
+    flatview_init(view);
+
+    qsort(damage, damage_nb, sizeof(*damage), cmp_addrrange_start);
+    for (i = j = 0; i < damage_nb; i++) {
+        if (j && int128_ge(addrrange_end(damage[j - 1]), damage[i].start)) {
+            end = int128_max(addrrange_end(damage[j - 1]),
+                             addrrange_end(damage[i]));
+            damage[j - 1].size = int128_sub(end, damage[j - 1].start);
+        } else {
+            damage[j++] = damage[i];
+        }
+    }
+    damage_nb = j;
+
+    start = int128_zero();
+    k = 0;
+    for (j = 0; j <= damage_nb; j++) {
+        /* Copy what lies between the previous damaged range and this one */
+        end = j < damage_nb ? damage[j].start : int128_2_64();
+        gap = addrrange_make(start, int128_sub(end, start));
+        while (k < old->nr && int128_le(addrrange_end(old->ranges[k].addr),
+                                        start)) {
+            ++k;
+        }
+        for (i = k; i < old->nr && int128_lt(old->ranges[i].addr.start, end);
+             ++i) {
+            flatview_append_clipped(view, &old->ranges[i], gap);
+        }
+        if (j == damage_nb) {
+            break;
+        }
+
+        /* Render the damaged range on its own, then append it */
+        flatview_init(&part);
+        if (mr) {
+            render_memory_region(&part, mr, int128_zero(), damage[j], false);
+        }
+        for (i = 0; i < part.nr; ++i) {
+            flatview_insert(view, view->nr, &part.ranges[i]);
+        }
+        g_free(part.ranges);
+        start = addrrange_end(damage[j]);
+    }
+    flatview_simplify(view);
 
     return view;
 }
@@ -655,8 +788,8 @@ static void address_space_update_ioeventfds(AddressSpace *as)
 }
 
 static void address_space_update_topology_pass(AddressSpace *as,
-                                               FlatView old_view,
-                                               FlatView new_view,
+                                               const FlatView *old_view,
+                                               const FlatView *new_view,
                                                bool adding)
 {
     unsigned iold, inew;
@@ -666,14 +799,14 @@ static void address_space_update_topology_pass(AddressSpace *as,
      * Kill ranges in the old map, and instantiate ranges in the new map.
      */
     iold = inew = 0;
-    while (iold < old_view.nr || inew < new_view.nr) {
-        if (iold < old_view.nr) {
-            frold = &old_view.ranges[iold];
+    while (iold < old_view->nr || inew < new_view->nr) {
+        if (iold < old_view->nr) {
+            frold = &old_view->ranges[iold];
         } else {
             frold = NULL;
         }
-        if (inew < new_view.nr) {
-            frnew = &new_view.ranges[inew];
+        if (inew < new_view->nr) {
+            frnew = &new_view->ranges[inew];
         } else {
             frnew = NULL;
         }
@@ -719,17 +852,96 @@ static void address_space_update_topology_pass(AddressSpace *as,
 
 static void address_space_update_topology(AddressSpace *as)
 {
-    FlatView old_view = *as->current_map;
-    FlatView new_view = generate_memory_topology(as->root);
+    FlatView *old_view = as->current_map;
+    FlatView *new_view;
+
+    if (!as->damage_all && !as->damage_nb) {
+        /* Nothing changed here, but listeners still expect to see every
+         * range of every address space between begin and commit.
+         */
+        address_space_update_topology_pass(as, old_view, old_view, true);
+        return;
+    }
+
+    if (as->damage_all) {
+        new_view = generate_memory_topology(as->root);
+    } else {
+        new_view = generate_memory_topology_damage(as->root, old_view,
+                                                   as->damage, as->damage_nb);
+    }
+    as->damage_all = false;
+    as->damage_nb = 0;
 
     address_space_update_topology_pass(as, old_view, new_view, false);
     address_space_update_topology_pass(as, old_view, new_view, true);
 
-    *as->current_map = new_view;
-    flatview_destroy(&old_view);
+    atomic_rcu_set(&as->current_map, new_view);
+    address_space_retire_flatview(old_view);
     address_space_update_ioeventfds(as);
 }
 
+/* Beyond this many damaged ranges, render the whole address space again */
+#define ADDRESS_SPACE_DAMAGE_MAX 32
+
+static void address_space_damage(AddressSpace *as, AddrRange range)
+{
+    if (as->damage_all) {
+        return;
+    }
+    if (as->damage_nb == ADDRESS_SPACE_DAMAGE_MAX) {
+        as->damage_all = true;
+        return;
+    }
+    if (!as->damage) {
+        as->damage = g_new(AddrRange, ADDRESS_SPACE_DAMAGE_MAX);
+    }
+    as->damage[as->damage_nb++] = range;
+}
+
+/* Note that @range, in @mr's own coordinates, may render differently at
+ * the end of the transaction, in every address space where it is visible
+ * either directly or through an alias.
+ */
+static void memory_region_damage_range(MemoryRegion *mr, AddrRange range)
+{
+    AddrRange own = addrrange_make(int128_zero(), mr->size);
+    MemoryRegion *alias;
+    AddressSpace *as;
+
+    if (!addrrange_intersects(range, own)) {
+        return;
+    }
+    range = addrrange_intersection(range, own);
+
+    QTAILQ_FOREACH(alias, &mr->alias_users, alias_link) {
+        memory_region_damage_range(alias,
+            addrrange_shift(range,
+                            int128_neg(int128_make64(alias->alias_offset))));
+    }
+
+    if (mr->parent) {
+        memory_region_damage_range(mr->parent,
+            addrrange_shift(range, int128_make64(mr->addr)));
+        return;
+    }
+    QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+        if (as->root == mr) {
+            address_space_damage(as, range);
+        }
+    }
+}
+
+/* Schedule the area covered by @mr for rendering at the end of the
+ * current transaction.  Must be called while @mr is still mapped where
+ * it was before the change, and again once it is mapped where it is
+ * after the change.
+ */
+static void memory_region_damage(MemoryRegion *mr)
+{
+    memory_region_damage_range(mr, addrrange_make(int128_zero(), mr->size));
+    memory_region_update_pending = true;
+}
+
 void memory_region_transaction_begin(void)
 {
     qemu_flush_coalesced_mmio_buffer();
@@ -810,12 +1022,14 @@ void memory_region_init(MemoryRegion *mr,
     mr->alias = NULL;
     QTAILQ_INIT(&mr->subregions);
     memset(&mr->subregions_link, 0, sizeof mr->subregions_link);
+    QTAILQ_INIT(&mr->alias_users);
     QTAILQ_INIT(&mr->coalesced);
     mr->name = g_strdup(name);
     mr->dirty_log_mask = 0;
     mr->ioeventfd_nb = 0;
     mr->ioeventfds = NULL;
     mr->flush_coalesced_mmio = false;
+    mr->lockless = false;
 }
 
 static bool memory_region_access_valid(MemoryRegion *mr,
@@ -956,6 +1170,24 @@ void memory_region_init_ram_ptr(MemoryRegion *mr,
     mr->ram_addr = qemu_ram_alloc_from_ptr(size, ptr, mr);
 }
 
+int memory_region_init_ram_from_file(MemoryRegion *mr,
+                                     const char *name,
+                                     uint64_t size,
+                                     const char *path,
+                                     bool share)
+{
+    memory_region_init(mr, name, size);
+    mr->ram = true;
+    mr->terminates = true;
+    mr->destructor = memory_region_destructor_ram;
+    mr->ram_addr = qemu_ram_alloc_from_file(size, mr, path, share);
+    if (mr->ram_addr == RAM_ADDR_MAX) {
+        mr->destructor = memory_region_destructor_none;
+        return -1;
+    }
+    return 0;
+}
+
 void memory_region_init_alias(MemoryRegion *mr,
                               const char *name,
                               MemoryRegion *orig,
@@ -965,6 +1197,7 @@ void memory_region_init_alias(MemoryRegion *mr,
     memory_region_init(mr, name, size);
     mr->alias = orig;
     mr->alias_offset = offset;
+    QTAILQ_INSERT_TAIL(&orig->alias_users, mr, alias_link);
 }
 
 void memory_region_init_rom_device(MemoryRegion *mr,
@@ -1022,6 +1255,17 @@ void memory_region_destroy(MemoryRegion *mr)
 {
     assert(QTAILQ_EMPTY(&mr->subregions));
     assert(memory_region_transaction_depth == 0);
+    if (mr->lockless) {
+        /* vCPUs that looked the region up before it was unmapped may still
+           be running its callbacks; some of them may be waiting for the
+           global mutex.  */
+        qemu_mutex_unlock_iothread();
+        synchronize_rcu_others();
+        qemu_mutex_lock_iothread();
+    }
+    if (mr->alias) {
+        QTAILQ_REMOVE(&mr->alias->alias_users, mr, alias_link);
+    }
     mr->destructor(mr);
     memory_region_clear_coalescing(mr);
     g_free((char *)mr->name);
@@ -1062,7 +1306,9 @@ void memory_region_set_log(MemoryRegion *mr, bool log, unsigned client)
 
     memory_region_transaction_begin();
     mr->dirty_log_mask = (mr->dirty_log_mask & ~mask) | (log * mask);
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_damage(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -1070,15 +1316,22 @@ bool memory_region_get_dirty(MemoryRegion *mr, hwaddr addr,
                              hwaddr size, unsigned client)
 {
     assert(mr->terminates);
-    return cpu_physical_memory_get_dirty(mr->ram_addr + addr, size,
-                                         1 << client);
+    return cpu_physical_memory_get_dirty(mr->ram_addr + addr, size, client);
 }
 
 void memory_region_set_dirty(MemoryRegion *mr, hwaddr addr,
                              hwaddr size)
 {
     assert(mr->terminates);
-    return cpu_physical_memory_set_dirty_range(mr->ram_addr + addr, size, -1);
+    return cpu_physical_memory_set_dirty_range(mr->ram_addr + addr, size);
+}
+
+void memory_region_set_dirty_lebitmap(MemoryRegion *mr, hwaddr addr,
+                                      const unsigned long *bitmap,
+                                      uint64_t pages)
+{
+    assert(mr->terminates);
+    cpu_physical_memory_set_dirty_lebitmap(mr->ram_addr + addr, bitmap, pages);
 }
 
 void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
@@ -1100,7 +1353,9 @@ void memory_region_set_readonly(MemoryRegion *mr, bool readonly)
     if (mr->readonly != readonly) {
         memory_region_transaction_begin();
         mr->readonly = readonly;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_damage(mr);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -1110,7 +1365,9 @@ void memory_region_rom_device_set_readable(MemoryRegion *mr, bool readable)
     if (mr->readable != readable) {
         memory_region_transaction_begin();
         mr->readable = readable;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_damage(mr);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -1120,8 +1377,32 @@ void memory_region_reset_dirty(MemoryRegion *mr, hwaddr addr,
 {
     assert(mr->terminates);
     cpu_physical_memory_reset_dirty(mr->ram_addr + addr,
-                                    mr->ram_addr + addr + size,
-                                    1 << client);
+                                    mr->ram_addr + addr + size, client);
+}
+
+uint64_t memory_region_move_dirty(MemoryRegion *mr, hwaddr addr,
+                                  hwaddr size, unsigned client,
+                                  unsigned long *dest)
+{
+    assert(mr->terminates);
+    return cpu_physical_memory_move_dirty(mr->ram_addr + addr, size,
+                                          client, dest);
+}
+
+int memory_region_get_fd(MemoryRegion *mr, ram_addr_t *offset)
+{
+    int fd;
+
+    if (mr->alias) {
+        fd = memory_region_get_fd(mr->alias, offset);
+        *offset += mr->alias_offset;
+        return fd;
+    }
+
+    assert(mr->terminates);
+
+    *offset = 0;
+    return qemu_ram_get_fd(mr->ram_addr & TARGET_PAGE_MASK);
 }
 
 void *memory_region_get_ram_ptr(MemoryRegion *mr)
@@ -1224,6 +1505,12 @@ void memory_region_clear_flush_coalesced(MemoryRegion *mr)
     }
 }
 
+void memory_region_set_lockless(MemoryRegion *mr, bool lockless)
+{
+    assert(!mr->ram);
+    mr->lockless = lockless;
+}
+
 void memory_region_add_eventfd(MemoryRegion *mr,
                                hwaddr addr,
                                unsigned size,
@@ -1253,7 +1540,9 @@ void memory_region_add_eventfd(MemoryRegion *mr,
     memmove(&mr->ioeventfds[i+1], &mr->ioeventfds[i],
             sizeof(*mr->ioeventfds) * (mr->ioeventfd_nb-1 - i));
     mr->ioeventfds[i] = mrfd;
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_damage(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -1286,7 +1575,9 @@ void memory_region_del_eventfd(MemoryRegion *mr,
     --mr->ioeventfd_nb;
     mr->ioeventfds = g_realloc(mr->ioeventfds,
                                   sizeof(*mr->ioeventfds)*mr->ioeventfd_nb + 1);
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_damage(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -1330,7 +1621,9 @@ static void memory_region_add_subregion_common(MemoryRegion *mr,
     }
     QTAILQ_INSERT_TAIL(&mr->subregions, subregion, subregions_link);
 done:
-    memory_region_update_pending |= mr->enabled && subregion->enabled;
+    if (mr->enabled && subregion->enabled) {
+        memory_region_damage(subregion);
+    }
     memory_region_transaction_commit();
 }
 
@@ -1359,9 +1652,11 @@ void memory_region_del_subregion(MemoryRegion *mr,
 {
     memory_region_transaction_begin();
     assert(subregion->parent == mr);
+    if (mr->enabled && subregion->enabled) {
+        memory_region_damage(subregion);
+    }
     subregion->parent = NULL;
     QTAILQ_REMOVE(&mr->subregions, subregion, subregions_link);
-    memory_region_update_pending |= mr->enabled && subregion->enabled;
     memory_region_transaction_commit();
 }
 
@@ -1372,7 +1667,7 @@ void memory_region_set_enabled(MemoryRegion *mr, bool enabled)
     }
     memory_region_transaction_begin();
     mr->enabled = enabled;
-    memory_region_update_pending = true;
+    memory_region_damage(mr);
     memory_region_transaction_commit();
 }
 
@@ -1407,7 +1702,9 @@ void memory_region_set_alias_offset(MemoryRegion *mr, hwaddr offset)
 
     memory_region_transaction_begin();
     mr->alias_offset = offset;
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_damage(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -1429,9 +1726,9 @@ static int cmp_flatrange_addr(const void *addr_, const void *fr_)
     return 0;
 }
 
-static FlatRange *address_space_lookup(AddressSpace *as, AddrRange addr)
+static FlatRange *flatview_lookup(FlatView *view, AddrRange addr)
 {
-    return bsearch(&addr, as->current_map->ranges, as->current_map->nr,
+    return bsearch(&addr, view->ranges, view->nr,
                    sizeof(FlatRange), cmp_flatrange_addr);
 }
 
@@ -1441,14 +1738,16 @@ MemoryRegionSection memory_region_find(MemoryRegion *address_space,
     AddressSpace *as = memory_region_to_address_space(address_space);
     AddrRange range = addrrange_make(int128_make64(addr),
                                      int128_make64(size));
-    FlatRange *fr = address_space_lookup(as, range);
+    FlatView *view = address_space_get_flatview(as);
+    FlatRange *fr = flatview_lookup(view, range);
     MemoryRegionSection ret = { .mr = NULL, .size = 0 };
 
     if (!fr) {
+        flatview_unref(view);
         return ret;
     }
 
-    while (fr > as->current_map->ranges
+    while (fr > view->ranges
            && addrrange_intersects(fr[-1].addr, range)) {
         --fr;
     }
@@ -1461,6 +1760,7 @@ MemoryRegionSection memory_region_find(MemoryRegion *address_space,
     ret.size = int128_get64(range.size);
     ret.offset_within_address_space = int128_get64(range.start);
     ret.readonly = fr->readonly;
+    flatview_unref(view);
     return ret;
 }
 
@@ -1550,8 +1850,10 @@ void address_space_init(AddressSpace *as, MemoryRegion *root)
 {
     memory_region_transaction_begin();
     as->root = root;
-    as->current_map = g_new(FlatView, 1);
-    flatview_init(as->current_map);
+    as->current_map = generate_memory_topology(NULL);
+    as->damage = NULL;
+    as->damage_nb = 0;
+    as->damage_all = true;
     QTAILQ_INSERT_TAIL(&address_spaces, as, address_spaces_link);
     as->name = NULL;
     memory_region_transaction_commit();
@@ -1563,22 +1865,42 @@ void address_space_destroy(AddressSpace *as)
     /* Flush out anything from MemoryListeners listening in on this */
     memory_region_transaction_begin();
     as->root = NULL;
+    as->damage_all = true;
     memory_region_transaction_commit();
     QTAILQ_REMOVE(&address_spaces, as, address_spaces_link);
+    g_free(as->damage);
     address_space_destroy_dispatch(as);
-    flatview_destroy(as->current_map);
-    g_free(as->current_map);
+    address_space_retire_flatview(as->current_map);
+}
+
+/* Device emulation runs under the global mutex, which vCPUs do not hold
+   while executing guest code.  Lockless regions do their own locking, and
+   subpages only forward the access to the region that handles it.  */
+static bool io_mem_lock(MemoryRegion *mr)
+{
+    if (mr->lockless || mr->subpage) {
+        return false;
+    }
+    return qemu_mutex_lock_iothread_vcpu();
 }
 
 uint64_t io_mem_read(MemoryRegion *mr, hwaddr addr, unsigned size)
 {
-    return memory_region_dispatch_read(mr, addr, size);
+    bool locked = io_mem_lock(mr);
+    uint64_t val;
+
+    val = memory_region_dispatch_read(mr, addr, size);
+    qemu_mutex_unlock_iothread_vcpu(locked);
+    return val;
 }
 
 void io_mem_write(MemoryRegion *mr, hwaddr addr,
                   uint64_t val, unsigned size)
 {
+    bool locked = io_mem_lock(mr);
+
     memory_region_dispatch_write(mr, addr, val, size);
+    qemu_mutex_unlock_iothread_vcpu(locked);
 }
 
 typedef struct MemoryRegionList MemoryRegionList;
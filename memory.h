@@ -31,13 +31,6 @@ typedef struct MemoryRegion MemoryRegion;
 typedef struct MemoryRegionPortio MemoryRegionPortio;
 typedef struct MemoryRegionMmio MemoryRegionMmio;
 
-/* Must match *_DIRTY_FLAGS in cpu-all.h.  To be replaced with dynamic
- * registration.
- */
-#define DIRTY_MEMORY_VGA       0
-#define DIRTY_MEMORY_CODE      1
-#define DIRTY_MEMORY_MIGRATION 3
-
 struct MemoryRegionMmio {
     CPUReadMemoryFunc *read[3];
     CPUWriteMemoryFunc *write[3];
@@ -134,12 +127,15 @@ struct MemoryRegion {
     bool rom_device;
     bool warning_printed; /* For reservations */
     bool flush_coalesced_mmio;
+    bool lockless;
     MemoryRegion *alias;
     hwaddr alias_offset;
     unsigned priority;
     bool may_overlap;
     QTAILQ_HEAD(subregions, MemoryRegion) subregions;
     QTAILQ_ENTRY(MemoryRegion) subregions_link;
+    QTAILQ_HEAD(alias_users, MemoryRegion) alias_users;
+    QTAILQ_ENTRY(MemoryRegion) alias_link;
     QTAILQ_HEAD(coalesced_ranges, CoalescedMemoryRange) coalesced;
     const char *name;
     uint8_t dirty_log_mask;
@@ -159,20 +155,6 @@ struct MemoryRegionPortio {
 
 typedef struct AddressSpace AddressSpace;
 
-/**
- * AddressSpace: describes a mapping of addresses to #MemoryRegion objects
- */
-struct AddressSpace {
-    /* All fields are private. */
-    const char *name;
-    MemoryRegion *root;
-    struct FlatView *current_map;
-    int ioeventfd_nb;
-    struct MemoryRegionIoeventfd *ioeventfds;
-    struct AddressSpaceDispatch *dispatch;
-    QTAILQ_ENTRY(AddressSpace) address_spaces_link;
-};
-
 typedef struct MemoryRegionSection MemoryRegionSection;
 
 /**
@@ -228,6 +210,29 @@ struct MemoryListener {
     QTAILQ_ENTRY(MemoryListener) link;
 };
 
+/**
+ * AddressSpace: describes a mapping of addresses to #MemoryRegion objects
+ */
+struct AddressSpace {
+    /* All fields are private. */
+    const char *name;
+    MemoryRegion *root;
+    /* RCU-published; replaced as a whole on every topology change */
+    struct FlatView *current_map;
+    /* Parts of the address space to render again at the next commit */
+    struct AddrRange *damage;
+    unsigned damage_nb;
+    bool damage_all;
+    int ioeventfd_nb;
+    struct MemoryRegionIoeventfd *ioeventfds;
+    /* RCU-published; the snapshot being built during a transaction */
+    struct AddressSpaceDispatch *dispatch;
+    struct AddressSpaceDispatch *next_dispatch;
+    bool dispatch_rebuild;      /* next_dispatch starts from scratch */
+    MemoryListener dispatch_listener;
+    QTAILQ_ENTRY(AddressSpace) address_spaces_link;
+};
+
 /**
  * memory_region_init: Initialize a memory region
  *
@@ -287,6 +292,29 @@ void memory_region_init_ram_ptr(MemoryRegion *mr,
                                 uint64_t size,
                                 void *ptr);
 
+/**
+ * memory_region_init_ram_from_file:  Initialize RAM memory region backed by
+ *                                    a file descriptor.
+ *
+ * As memory_region_init_ram(), but the memory is a mapping of a file created
+ * in @path, or of an anonymous memory file if @path is %NULL.  With @share
+ * the mapping is shared and its file descriptor can be handed to other
+ * processes (see memory_region_get_fd()).  Returns 0 on success or -1 if the
+ * memory could not be allocated, in which case the region must be destroyed.
+ *
+ * @mr: the #MemoryRegion to be initialized.
+ * @name: the name of the region.
+ * @size: size of the region.
+ * @path: directory to create the backing file in, or %NULL; if %NULL,
+ *        @share must be %true.
+ * @share: map the memory shared rather than private.
+ */
+int memory_region_init_ram_from_file(MemoryRegion *mr,
+                                     const char *name,
+                                     uint64_t size,
+                                     const char *path,
+                                     bool share);
+
 /**
  * memory_region_init_alias: Initialize a memory region that aliases all or a
  *                           part of another memory region.
@@ -399,6 +427,18 @@ bool memory_region_is_logging(MemoryRegion *mr);
  */
 bool memory_region_is_rom(MemoryRegion *mr);
 
+/**
+ * memory_region_get_fd: Get the file descriptor backing a RAM memory region.
+ *
+ * Returns the file descriptor of a shared, fd-backed RAM memory region and
+ * stores the offset of the start of the region into the file in @offset,
+ * or returns -1 if the region is not backed by a shared file mapping.
+ *
+ * @mr: the memory region being queried.
+ * @offset: where to store the offset of @mr in the file.
+ */
+int memory_region_get_fd(MemoryRegion *mr, ram_addr_t *offset);
+
 /**
  * memory_region_get_ram_ptr: Get a pointer into a RAM memory region.
  *
@@ -453,6 +493,24 @@ bool memory_region_get_dirty(MemoryRegion *mr, hwaddr addr,
 void memory_region_set_dirty(MemoryRegion *mr, hwaddr addr,
                              hwaddr size);
 
+/**
+ * memory_region_set_dirty_lebitmap: Mark the pages set in a bitmap as dirty.
+ *
+ * Like memory_region_set_dirty(), for the scattered pages reported by an
+ * accelerator.  The bitmap is processed a word at a time, so clean and
+ * fully dirty stretches of memory cost one test each.
+ *
+ * @mr: the memory region being dirtied.
+ * @addr: the address (relative to the start of the region) of the page
+ *        described by bit 0.
+ * @bitmap: a little-endian bitmap with one bit per host page, as returned
+ *          by KVM_GET_DIRTY_LOG.
+ * @pages: the number of host pages described by @bitmap.
+ */
+void memory_region_set_dirty_lebitmap(MemoryRegion *mr, hwaddr addr,
+                                      const unsigned long *bitmap,
+                                      uint64_t pages);
+
 /**
  * memory_region_sync_dirty_bitmap: Synchronize a region's dirty bitmap with
  *                                  any external TLBs (e.g. kvm)
@@ -479,6 +537,28 @@ void memory_region_sync_dirty_bitmap(MemoryRegion *mr);
 void memory_region_reset_dirty(MemoryRegion *mr, hwaddr addr,
                                hwaddr size, unsigned client);
 
+/**
+ * memory_region_move_dirty: Move the dirty pages of a client to a bitmap.
+ *
+ * Sets in @dest the pages of a range that are dirty for @client, and marks
+ * them clean; the result is the same as calling memory_region_get_dirty()
+ * and memory_region_reset_dirty() on each page, but clean stretches are
+ * skipped several pages at a time.
+ *
+ * @mr: the region being scanned.
+ * @addr: the start of the subrange being scanned.
+ * @size: the size of the subrange being scanned.
+ * @client: the user of the logging information; %DIRTY_MEMORY_MIGRATION or
+ *          %DIRTY_MEMORY_VGA.
+ * @dest: a bitmap indexed by target page number within the guest RAM
+ *        address space, i.e. (mr->ram_addr + addr) >> TARGET_PAGE_BITS.
+ *
+ * Returns the number of pages that were newly set in @dest.
+ */
+uint64_t memory_region_move_dirty(MemoryRegion *mr, hwaddr addr,
+                                  hwaddr size, unsigned client,
+                                  unsigned long *dest);
+
 /**
  * memory_region_set_readonly: Turn a memory region read-only (or read-write)
  *
@@ -566,6 +646,24 @@ void memory_region_set_flush_coalesced(MemoryRegion *mr);
  */
 void memory_region_clear_flush_coalesced(MemoryRegion *mr);
 
+/**
+ * memory_region_set_lockless: Dispatch accesses without the global mutex.
+ *
+ * By default, the read and write callbacks of an I/O region run with the
+ * global mutex held.  Devices that protect their own state may mark their
+ * regions lockless; accesses can then be dispatched straight from the vCPU
+ * thread that performed them, concurrently with other vCPUs and with the
+ * main loop.  A callback that needs to touch state shared with the rest of
+ * QEMU can still take the mutex with qemu_mutex_lock_iothread_vcpu().
+ *
+ * memory_region_destroy() waits for lockless accesses that are still in
+ * flight, and releases the global mutex while doing so.
+ *
+ * @mr: the memory region to be updated.
+ * @lockless: whether the callbacks can run without the global mutex.
+ */
+void memory_region_set_lockless(MemoryRegion *mr, bool lockless);
+
 /**
  * memory_region_add_eventfd: Request an eventfd to be triggered when a word
  *                            is written to a location.
@@ -827,6 +925,25 @@ void address_space_destroy(AddressSpace *as);
 void address_space_rw(AddressSpace *as, hwaddr addr, uint8_t *buf,
                       int len, bool is_write);
 
+/**
+ * address_space_rw_lockless: access a lockless region of an address space.
+ *
+ * Performs the access like address_space_rw(), but only if it falls within
+ * a single region marked with memory_region_set_lockless().  Can be called
+ * from a vCPU thread that does not hold the global mutex.
+ *
+ * Returns true if the access was performed, false if the caller has to
+ * fall back to address_space_rw() with the global mutex held.
+ *
+ * @as: #AddressSpace to be accessed
+ * @addr: address within that address space
+ * @buf: buffer with the data transferred
+ * @len: length of the access; must not cross a page boundary
+ * @is_write: indicates the transfer direction
+ */
+bool address_space_rw_lockless(AddressSpace *as, hwaddr addr, uint8_t *buf,
+                               int len, bool is_write);
+
 /**
  * address_space_write: write to address space.
  *
@@ -19,7 +19,6 @@
 #include "qemu_socket.h"
 #include "migration.h"
 #include "qemu-char.h"
-#include "buffered_file.h"
 #include "block.h"
 #include <sys/types.h>
 #include <sys/wait.h>
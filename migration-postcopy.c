@@ -0,0 +1,336 @@
+/*
+ * Postcopy live migration, incoming side
+ *
+ * Guest RAM that has not been received yet is registered with the
+ * kernel's userfaultfd.  Accesses to it are reported to a fault thread,
+ * which asks the source for the page over the migration socket; pages
+ * are then placed atomically with UFFDIO_COPY/UFFDIO_ZEROPAGE.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qemu-thread.h"
+#include "qemu-error.h"
+#include "migration.h"
+#include "trace.h"
+
+#ifdef CONFIG_POSTCOPY
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+
+typedef struct PostcopyRAMBlock {
+    char idstr[256];
+    uint8_t *host;
+    uint64_t length;
+} PostcopyRAMBlock;
+
+static struct {
+    int uffd;
+    int quit_fd;
+    int return_fd;
+    PostcopyRAMBlock *blocks;
+    int nb_blocks;
+    bool thread_running;
+    QemuThread thread;
+} postcopy_in = {
+    .uffd = -1,
+    .quit_fd = -1,
+    .return_fd = -1,
+};
+
+bool postcopy_incoming_supported(void)
+{
+    struct uffdio_api api = { .api = UFFD_API };
+    uint64_t needed = (uint64_t)1 << _UFFDIO_REGISTER |
+                      (uint64_t)1 << _UFFDIO_UNREGISTER;
+    bool ret = false;
+    int fd;
+
+    fd = syscall(__NR_userfaultfd, O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    if (ioctl(fd, UFFDIO_API, &api) == 0 &&
+        (api.ioctls & needed) == needed) {
+        ret = true;
+    }
+    close(fd);
+    return ret;
+}
+
+int postcopy_incoming_init(int return_fd)
+{
+    struct uffdio_api api = { .api = UFFD_API };
+
+    assert(postcopy_in.uffd == -1);
+
+    postcopy_in.uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (postcopy_in.uffd < 0) {
+        error_report("postcopy: userfaultfd not available: %s",
+                     strerror(errno));
+        return -errno;
+    }
+    if (ioctl(postcopy_in.uffd, UFFDIO_API, &api) < 0) {
+        error_report("postcopy: UFFDIO_API failed: %s", strerror(errno));
+        postcopy_incoming_cleanup();
+        return -EINVAL;
+    }
+    postcopy_in.quit_fd = eventfd(0, EFD_CLOEXEC);
+    if (postcopy_in.quit_fd < 0) {
+        postcopy_incoming_cleanup();
+        return -errno;
+    }
+    postcopy_in.return_fd = return_fd;
+    return 0;
+}
+
+int postcopy_incoming_register(const char *idstr, void *host, uint64_t length)
+{
+    struct uffdio_register reg;
+    PostcopyRAMBlock *block;
+
+    reg.range.start = (uintptr_t)host;
+    reg.range.len = length;
+    reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+    if (ioctl(postcopy_in.uffd, UFFDIO_REGISTER, &reg) < 0) {
+        error_report("postcopy: failed to register RAM block %s: %s",
+                     idstr, strerror(errno));
+        return -errno;
+    }
+
+    postcopy_in.blocks = g_renew(PostcopyRAMBlock, postcopy_in.blocks,
+                                 postcopy_in.nb_blocks + 1);
+    block = &postcopy_in.blocks[postcopy_in.nb_blocks++];
+    pstrcpy(block->idstr, sizeof(block->idstr), idstr);
+    block->host = host;
+    block->length = length;
+    return 0;
+}
+
+/* The block table is only written before the fault thread starts, so
+ * lookups are safe from any thread afterwards.
+ */
+void *postcopy_host_from_idstr(const char *idstr, uint64_t offset)
+{
+    int i;
+
+    for (i = 0; i < postcopy_in.nb_blocks; i++) {
+        PostcopyRAMBlock *block = &postcopy_in.blocks[i];
+
+        if (!strcmp(block->idstr, idstr)) {
+            return offset < block->length ? block->host + offset : NULL;
+        }
+    }
+    return NULL;
+}
+
+static int postcopy_write_full(int fd, const uint8_t *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t ret = write(fd, buf, len);
+
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            return -errno;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+/* Request format: be64 offset, u8 idstr length, idstr */
+static int postcopy_request_page(uint64_t addr)
+{
+    uint8_t msg[8 + 1 + 256];
+    int i, len;
+
+    for (i = 0; i < postcopy_in.nb_blocks; i++) {
+        PostcopyRAMBlock *block = &postcopy_in.blocks[i];
+        uint8_t *host = (uint8_t *)(uintptr_t)addr;
+
+        if (host >= block->host && host < block->host + block->length) {
+            uint64_t offset = host - block->host;
+
+            trace_postcopy_request_page(block->idstr, offset);
+            stq_be_p(msg, offset);
+            len = strlen(block->idstr);
+            msg[8] = len;
+            memcpy(msg + 9, block->idstr, len);
+            return postcopy_write_full(postcopy_in.return_fd, msg, 9 + len);
+        }
+    }
+    error_report("postcopy: fault at unknown address 0x%" PRIx64, addr);
+    return -EINVAL;
+}
+
+static void *postcopy_fault_thread(void *opaque)
+{
+    struct pollfd pfd[2];
+    struct uffd_msg msg;
+    ssize_t ret;
+
+    pfd[0].fd = postcopy_in.uffd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = postcopy_in.quit_fd;
+    pfd[1].events = POLLIN;
+
+    for (;;) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_report("postcopy: fault thread poll failed: %s",
+                         strerror(errno));
+            break;
+        }
+        if (pfd[1].revents) {
+            break;
+        }
+
+        ret = read(postcopy_in.uffd, &msg, sizeof(msg));
+        if (ret != sizeof(msg)) {
+            if (ret < 0 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+            error_report("postcopy: failed to read fault event");
+            break;
+        }
+        if (msg.event != UFFD_EVENT_PAGEFAULT) {
+            continue;
+        }
+        if (postcopy_request_page(msg.arg.pagefault.address &
+                                  ~(uint64_t)(getpagesize() - 1)) < 0) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+int postcopy_incoming_start(void)
+{
+    qemu_thread_create(&postcopy_in.thread, postcopy_fault_thread, NULL,
+                       QEMU_THREAD_JOINABLE);
+    postcopy_in.thread_running = true;
+    return 0;
+}
+
+int postcopy_place_page(void *host, const void *from, size_t size)
+{
+    struct uffdio_copy copy = {
+        .dst = (uintptr_t)host,
+        .src = (uintptr_t)from,
+        .len = size,
+    };
+
+    /* EEXIST: the page was already placed, e.g. requested twice */
+    if (ioctl(postcopy_in.uffd, UFFDIO_COPY, &copy) < 0 && errno != EEXIST) {
+        return -errno;
+    }
+    return 0;
+}
+
+int postcopy_place_zero_page(void *host, size_t size)
+{
+    struct uffdio_zeropage zero = {
+        .range = { .start = (uintptr_t)host, .len = size },
+    };
+
+    if (ioctl(postcopy_in.uffd, UFFDIO_ZEROPAGE, &zero) < 0 &&
+        errno != EEXIST) {
+        return -errno;
+    }
+    return 0;
+}
+
+bool postcopy_incoming_active(void)
+{
+    return postcopy_in.uffd != -1;
+}
+
+void postcopy_incoming_cleanup(void)
+{
+    if (postcopy_in.thread_running) {
+        uint64_t val = 1;
+
+        if (write(postcopy_in.quit_fd, &val, sizeof(val)) != sizeof(val)) {
+            error_report("postcopy: failed to stop fault thread");
+        }
+        qemu_thread_join(&postcopy_in.thread);
+        postcopy_in.thread_running = false;
+    }
+    if (postcopy_in.quit_fd != -1) {
+        close(postcopy_in.quit_fd);
+        postcopy_in.quit_fd = -1;
+    }
+    if (postcopy_in.uffd != -1) {
+        /* Closing the userfaultfd unregisters all ranges */
+        close(postcopy_in.uffd);
+        postcopy_in.uffd = -1;
+    }
+    g_free(postcopy_in.blocks);
+    postcopy_in.blocks = NULL;
+    postcopy_in.nb_blocks = 0;
+    postcopy_in.return_fd = -1;
+}
+
+#else
+
+bool postcopy_incoming_supported(void)
+{
+    return false;
+}
+
+int postcopy_incoming_init(int return_fd)
+{
+    return -ENOSYS;
+}
+
+int postcopy_incoming_register(const char *idstr, void *host, uint64_t length)
+{
+    return -ENOSYS;
+}
+
+void *postcopy_host_from_idstr(const char *idstr, uint64_t offset)
+{
+    return NULL;
+}
+
+int postcopy_incoming_start(void)
+{
+    return -ENOSYS;
+}
+
+int postcopy_place_page(void *host, const void *from, size_t size)
+{
+    return -ENOSYS;
+}
+
+int postcopy_place_zero_page(void *host, size_t size)
+{
+    return -ENOSYS;
+}
+
+bool postcopy_incoming_active(void)
+{
+    return false;
+}
+
+void postcopy_incoming_cleanup(void)
+{
+}
+
+#endif
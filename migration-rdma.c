@@ -0,0 +1,903 @@
+/*
+ * RDMA transport for live migration
+ *
+ * The migration stream is carried in SEND messages over a reliable
+ * connected queue pair, with at most one message in flight: the receiver
+ * sends READY whenever it has consumed everything it was sent so far.
+ *
+ * RAM pages bypass the stream.  When the connection is set up, the
+ * destination registers all of its RAM blocks with the HCA and sends
+ * their addresses and keys; the source then writes pages straight into
+ * the destination's guest memory with RDMA WRITE.  Before each RAM round
+ * the source waits for READY, so that pages still sent in the stream
+ * (zero pages, XBZRLE deltas) have been applied on the destination before
+ * newer contents of the same page can arrive by RDMA.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qemu_socket.h"
+#include "qemu-coroutine.h"
+#include "qemu-error.h"
+#include "cpu-common.h"
+#include "migration.h"
+#include "block.h"
+
+#include <rdma/rdma_cma.h>
+
+//#define DEBUG_MIGRATION_RDMA
+
+#ifdef DEBUG_MIGRATION_RDMA
+#define DPRINTF(fmt, ...) \
+    do { printf("migration-rdma: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+#define RDMA_RESOLVE_TIMEOUT_MS     10000
+
+/* control messages: be32 type, be32 payload length, payload */
+#define RDMA_CONTROL_HDR_SIZE       8
+#define RDMA_CONTROL_MAX_BUFFER     (512 * 1024)
+#define RDMA_CONTROL_MAX_PAYLOAD    (RDMA_CONTROL_MAX_BUFFER - \
+                                     RDMA_CONTROL_HDR_SIZE)
+
+/* RAM_BLOCKS entry: be64 host address, be64 offset, be64 length, be32 rkey */
+#define RDMA_BLOCK_ENTRY_SIZE       32
+
+/* contiguous pages are merged into one RDMA WRITE up to this size */
+#define RDMA_MERGE_MAX              (1024 * 1024)
+#define RDMA_MAX_OUTSTANDING        128
+
+enum {
+    RDMA_WRID_RDMA_WRITE = 1,
+    RDMA_WRID_SEND_CONTROL,
+    RDMA_WRID_RECV_CONTROL,
+};
+
+enum {
+    RDMA_CONTROL_READY = 1,
+    RDMA_CONTROL_QEMU_FILE,
+    RDMA_CONTROL_RAM_BLOCKS,
+};
+
+typedef struct RDMALocalBlock {
+    uint8_t *local_host_addr;
+    uint64_t offset;
+    uint64_t length;
+    struct ibv_mr *mr;
+    uint64_t remote_host_addr;
+    uint32_t remote_rkey;
+} RDMALocalBlock;
+
+typedef struct RDMAContext {
+    struct rdma_event_channel *channel;
+    struct rdma_cm_id *listen_id;
+    struct rdma_cm_id *cm_id;
+    struct ibv_pd *pd;
+    struct ibv_comp_channel *comp_channel;
+    struct ibv_cq *cq;
+    struct ibv_qp *qp;
+    bool connected;
+    int error;
+
+    uint8_t *send_buf;
+    struct ibv_mr *send_mr;
+    bool send_pending;
+
+    uint8_t *recv_buf;
+    struct ibv_mr *recv_mr;
+    /* a control message was received and not consumed yet */
+    bool recv_done;
+    uint32_t recv_type;
+    uint32_t recv_len;
+    uint32_t recv_off;
+    /* source only: the destination has asked for more of the stream */
+    bool peer_ready;
+
+    RDMALocalBlock *blocks;
+    int nb_blocks;
+    int last_block;
+
+    /* source only: RDMA WRITE being merged, and WRITEs on the wire */
+    int cur_block;
+    uint64_t cur_offset;
+    uint64_t cur_len;
+    int nb_outstanding;
+} RDMAContext;
+
+static void qemu_rdma_cleanup(RDMAContext *rdma)
+{
+    int i;
+
+    if (rdma->connected) {
+        rdma_disconnect(rdma->cm_id);
+    }
+    for (i = 0; i < rdma->nb_blocks; i++) {
+        if (rdma->blocks[i].mr) {
+            ibv_dereg_mr(rdma->blocks[i].mr);
+        }
+    }
+    g_free(rdma->blocks);
+    if (rdma->qp) {
+        rdma_destroy_qp(rdma->cm_id);
+    }
+    if (rdma->send_mr) {
+        ibv_dereg_mr(rdma->send_mr);
+    }
+    if (rdma->recv_mr) {
+        ibv_dereg_mr(rdma->recv_mr);
+    }
+    if (rdma->cq) {
+        ibv_destroy_cq(rdma->cq);
+    }
+    if (rdma->comp_channel) {
+        ibv_destroy_comp_channel(rdma->comp_channel);
+    }
+    if (rdma->pd) {
+        ibv_dealloc_pd(rdma->pd);
+    }
+    if (rdma->cm_id) {
+        rdma_destroy_id(rdma->cm_id);
+    }
+    if (rdma->listen_id) {
+        rdma_destroy_id(rdma->listen_id);
+    }
+    if (rdma->channel) {
+        rdma_destroy_event_channel(rdma->channel);
+    }
+    g_free(rdma->send_buf);
+    g_free(rdma->recv_buf);
+    g_free(rdma);
+}
+
+static int qemu_rdma_resolve_host(const char *host_port, bool passive,
+                                  struct addrinfo **res, Error **errp)
+{
+    struct addrinfo hints = { .ai_flags = passive ? AI_PASSIVE : 0 };
+    char *host = g_strdup(host_port);
+    char *port = strrchr(host, ':');
+    int ret;
+
+    if (!port) {
+        error_setg(errp, "RDMA: expected host:port, got '%s'", host_port);
+        g_free(host);
+        return -EINVAL;
+    }
+    *port++ = '\0';
+
+    ret = getaddrinfo(*host ? host : NULL, port, &hints, res);
+    if (ret) {
+        error_setg(errp, "RDMA: could not resolve '%s': %s", host_port,
+                   gai_strerror(ret));
+        g_free(host);
+        return -EINVAL;
+    }
+    g_free(host);
+    return 0;
+}
+
+static int qemu_rdma_wait_event(RDMAContext *rdma,
+                                enum rdma_cm_event_type type,
+                                struct rdma_cm_id **id)
+{
+    struct rdma_cm_event *cm_event;
+    int ret = 0;
+
+    if (rdma_get_cm_event(rdma->channel, &cm_event) < 0) {
+        return -errno;
+    }
+    if (cm_event->event != type) {
+        error_report("RDMA: expected %s, got %s", rdma_event_str(type),
+                     rdma_event_str(cm_event->event));
+        ret = -ECONNREFUSED;
+    } else if (id) {
+        *id = cm_event->id;
+    }
+    rdma_ack_cm_event(cm_event);
+    return ret;
+}
+
+static int qemu_rdma_alloc_qp(RDMAContext *rdma, struct rdma_cm_id *id)
+{
+    struct ibv_qp_init_attr attr = {
+        .cap = {
+            .max_send_wr = RDMA_MAX_OUTSTANDING + 2,
+            .max_recv_wr = 2,
+            .max_send_sge = 1,
+            .max_recv_sge = 1,
+        },
+        .qp_type = IBV_QPT_RC,
+    };
+
+    rdma->pd = ibv_alloc_pd(id->verbs);
+    if (!rdma->pd) {
+        return -ENOMEM;
+    }
+    rdma->comp_channel = ibv_create_comp_channel(id->verbs);
+    if (!rdma->comp_channel) {
+        return -ENOMEM;
+    }
+    rdma->cq = ibv_create_cq(id->verbs, RDMA_MAX_OUTSTANDING + 4, NULL,
+                             rdma->comp_channel, 0);
+    if (!rdma->cq) {
+        return -ENOMEM;
+    }
+
+    attr.send_cq = rdma->cq;
+    attr.recv_cq = rdma->cq;
+    if (rdma_create_qp(id, rdma->pd, &attr) < 0) {
+        return -errno;
+    }
+    rdma->qp = id->qp;
+
+    rdma->send_buf = g_malloc0(RDMA_CONTROL_MAX_BUFFER);
+    rdma->recv_buf = g_malloc0(RDMA_CONTROL_MAX_BUFFER);
+    rdma->send_mr = ibv_reg_mr(rdma->pd, rdma->send_buf,
+                               RDMA_CONTROL_MAX_BUFFER, IBV_ACCESS_LOCAL_WRITE);
+    rdma->recv_mr = ibv_reg_mr(rdma->pd, rdma->recv_buf,
+                               RDMA_CONTROL_MAX_BUFFER, IBV_ACCESS_LOCAL_WRITE);
+    if (!rdma->send_mr || !rdma->recv_mr) {
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+static void qemu_rdma_add_block(void *host_addr, ram_addr_t offset,
+                                ram_addr_t length, void *opaque)
+{
+    RDMAContext *rdma = opaque;
+    RDMALocalBlock *block;
+
+    rdma->blocks = g_renew(RDMALocalBlock, rdma->blocks, rdma->nb_blocks + 1);
+    block = &rdma->blocks[rdma->nb_blocks++];
+    memset(block, 0, sizeof(*block));
+    block->local_host_addr = host_addr;
+    block->offset = offset;
+    block->length = length;
+}
+
+/* Pins all of guest RAM */
+static int qemu_rdma_reg_ram_blocks(RDMAContext *rdma, int access)
+{
+    int i;
+
+    qemu_ram_foreach_block(qemu_rdma_add_block, rdma);
+
+    for (i = 0; i < rdma->nb_blocks; i++) {
+        RDMALocalBlock *block = &rdma->blocks[i];
+
+        block->mr = ibv_reg_mr(rdma->pd, block->local_host_addr,
+                               block->length, access);
+        if (!block->mr) {
+            error_report("RDMA: failed to register RAM block at 0x%" PRIx64
+                         ": %s", block->offset, strerror(errno));
+            return -errno;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Reap one completion.  Returns 1 and its work request id, 0 if there
+ * was none, or a negative errno.
+ */
+static int qemu_rdma_poll(RDMAContext *rdma, uint64_t *wr_id)
+{
+    struct ibv_wc wc;
+    int ret;
+
+    ret = ibv_poll_cq(rdma->cq, 1, &wc);
+    if (ret <= 0) {
+        return ret < 0 ? -EIO : 0;
+    }
+    if (wc.status != IBV_WC_SUCCESS) {
+        error_report("RDMA: work request %" PRIu64 " failed: %s",
+                     (uint64_t)wc.wr_id, ibv_wc_status_str(wc.status));
+        return -EIO;
+    }
+
+    switch (wc.wr_id) {
+    case RDMA_WRID_RDMA_WRITE:
+        rdma->nb_outstanding--;
+        break;
+    case RDMA_WRID_SEND_CONTROL:
+        rdma->send_pending = false;
+        break;
+    case RDMA_WRID_RECV_CONTROL: {
+        uint32_t type = ldl_be_p(rdma->recv_buf);
+        uint32_t len = ldl_be_p(rdma->recv_buf + 4);
+
+        if (wc.byte_len < RDMA_CONTROL_HDR_SIZE ||
+            len > wc.byte_len - RDMA_CONTROL_HDR_SIZE) {
+            error_report("RDMA: truncated control message");
+            return -EIO;
+        }
+        if (type == RDMA_CONTROL_READY) {
+            rdma->peer_ready = true;
+        } else {
+            rdma->recv_type = type;
+            rdma->recv_len = len;
+            rdma->recv_off = 0;
+            rdma->recv_done = true;
+        }
+        break;
+    }
+    }
+
+    *wr_id = wc.wr_id;
+    return 1;
+}
+
+static int qemu_rdma_wait_comp_channel(RDMAContext *rdma)
+{
+    struct ibv_cq *cq;
+    void *cq_ctx;
+
+    for (;;) {
+        if (ibv_get_cq_event(rdma->comp_channel, &cq, &cq_ctx) == 0) {
+            ibv_ack_cq_events(cq, 1);
+            return 0;
+        }
+        if (errno == EAGAIN && qemu_in_coroutine()) {
+            /* incoming side: the completion channel fd wakes us up */
+            qemu_coroutine_yield();
+        } else if (errno != EINTR) {
+            return -errno;
+        }
+    }
+}
+
+/* Block until a work request of the given kind completes */
+static int qemu_rdma_block_for_wrid(RDMAContext *rdma, uint64_t wrid)
+{
+    uint64_t wr_id;
+    int ret;
+
+    for (;;) {
+        ret = qemu_rdma_poll(rdma, &wr_id);
+        if (ret == 0) {
+            /* arm the notification, then look again so as not to miss a
+             * completion that came in meanwhile
+             */
+            if (ibv_req_notify_cq(rdma->cq, 0)) {
+                return -EIO;
+            }
+            ret = qemu_rdma_poll(rdma, &wr_id);
+            if (ret == 0) {
+                ret = qemu_rdma_wait_comp_channel(rdma);
+                if (ret < 0) {
+                    return ret;
+                }
+                continue;
+            }
+        }
+        if (ret < 0) {
+            return ret;
+        }
+        if (wr_id == wrid) {
+            return 0;
+        }
+    }
+}
+
+static int qemu_rdma_post_recv(RDMAContext *rdma)
+{
+    struct ibv_sge sge = {
+        .addr = (uintptr_t)rdma->recv_buf,
+        .length = RDMA_CONTROL_MAX_BUFFER,
+        .lkey = rdma->recv_mr->lkey,
+    };
+    struct ibv_recv_wr wr = {
+        .wr_id = RDMA_WRID_RECV_CONTROL,
+        .sg_list = &sge,
+        .num_sge = 1,
+    };
+    struct ibv_recv_wr *bad_wr;
+
+    if (ibv_post_recv(rdma->qp, &wr, &bad_wr)) {
+        return -EIO;
+    }
+    return 0;
+}
+
+static int qemu_rdma_send_control(RDMAContext *rdma, uint32_t type,
+                                  const uint8_t *data, uint32_t len)
+{
+    struct ibv_sge sge = {
+        .addr = (uintptr_t)rdma->send_buf,
+        .length = RDMA_CONTROL_HDR_SIZE + len,
+        .lkey = rdma->send_mr->lkey,
+    };
+    struct ibv_send_wr wr = {
+        .wr_id = RDMA_WRID_SEND_CONTROL,
+        .opcode = IBV_WR_SEND,
+        .send_flags = IBV_SEND_SIGNALED,
+        .sg_list = &sge,
+        .num_sge = 1,
+    };
+    struct ibv_send_wr *bad_wr;
+    int ret;
+
+    assert(len <= RDMA_CONTROL_MAX_PAYLOAD);
+    stl_be_p(rdma->send_buf, type);
+    stl_be_p(rdma->send_buf + 4, len);
+    if (len) {
+        memcpy(rdma->send_buf + RDMA_CONTROL_HDR_SIZE, data, len);
+    }
+
+    if (ibv_post_send(rdma->qp, &wr, &bad_wr)) {
+        return -EIO;
+    }
+    rdma->send_pending = true;
+    while (rdma->send_pending) {
+        ret = qemu_rdma_block_for_wrid(rdma, RDMA_WRID_SEND_CONTROL);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+static int qemu_rdma_wait_control(RDMAContext *rdma, uint32_t type)
+{
+    int ret;
+
+    while (!rdma->recv_done) {
+        ret = qemu_rdma_block_for_wrid(rdma, RDMA_WRID_RECV_CONTROL);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    if (rdma->recv_type != type) {
+        error_report("RDMA: unexpected control message %d", rdma->recv_type);
+        return -EIO;
+    }
+    return 0;
+}
+
+/* Source: wait until the destination has consumed all of the stream */
+static int qemu_rdma_wait_ready(RDMAContext *rdma)
+{
+    int ret;
+
+    while (!rdma->peer_ready) {
+        ret = qemu_rdma_block_for_wrid(rdma, RDMA_WRID_RECV_CONTROL);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/* Destination: tell the source where our RAM blocks are */
+static int qemu_rdma_send_ram_blocks(RDMAContext *rdma)
+{
+    uint32_t len = rdma->nb_blocks * RDMA_BLOCK_ENTRY_SIZE;
+    uint8_t *buf, *p;
+    int i, ret;
+
+    if (len > RDMA_CONTROL_MAX_PAYLOAD) {
+        error_report("RDMA: too many RAM blocks");
+        return -E2BIG;
+    }
+
+    buf = p = g_malloc0(len);
+    for (i = 0; i < rdma->nb_blocks; i++) {
+        RDMALocalBlock *block = &rdma->blocks[i];
+
+        stq_be_p(p, (uintptr_t)block->local_host_addr);
+        stq_be_p(p + 8, block->offset);
+        stq_be_p(p + 16, block->length);
+        stl_be_p(p + 24, block->mr->rkey);
+        p += RDMA_BLOCK_ENTRY_SIZE;
+    }
+    ret = qemu_rdma_send_control(rdma, RDMA_CONTROL_RAM_BLOCKS, buf, len);
+    g_free(buf);
+    return ret;
+}
+
+/* Source: match the destination's RAM blocks with ours */
+static int qemu_rdma_recv_ram_blocks(RDMAContext *rdma)
+{
+    uint8_t *p = rdma->recv_buf + RDMA_CONTROL_HDR_SIZE;
+    int nb_remote = rdma->recv_len / RDMA_BLOCK_ENTRY_SIZE;
+    int i, j;
+
+    rdma->recv_done = false;
+    if (nb_remote != rdma->nb_blocks) {
+        goto mismatch;
+    }
+
+    for (i = 0; i < nb_remote; i++, p += RDMA_BLOCK_ENTRY_SIZE) {
+        uint64_t offset = ldq_be_p(p + 8);
+        uint64_t length = ldq_be_p(p + 16);
+
+        for (j = 0; j < rdma->nb_blocks; j++) {
+            RDMALocalBlock *block = &rdma->blocks[j];
+
+            if (block->offset == offset && block->length == length) {
+                block->remote_host_addr = ldq_be_p(p);
+                block->remote_rkey = ldl_be_p(p + 24);
+                break;
+            }
+        }
+        if (j == rdma->nb_blocks) {
+            goto mismatch;
+        }
+    }
+    return 0;
+
+mismatch:
+    error_report("RDMA: RAM layout differs on the destination");
+    return -EINVAL;
+}
+
+/* Source: put the merged pages on the wire */
+static int qemu_rdma_write_flush(RDMAContext *rdma)
+{
+    RDMALocalBlock *block = &rdma->blocks[rdma->cur_block];
+    struct ibv_sge sge;
+    struct ibv_send_wr wr = {
+        .wr_id = RDMA_WRID_RDMA_WRITE,
+        .opcode = IBV_WR_RDMA_WRITE,
+        .send_flags = IBV_SEND_SIGNALED,
+        .sg_list = &sge,
+        .num_sge = 1,
+    };
+    struct ibv_send_wr *bad_wr;
+    int ret;
+
+    if (!rdma->cur_len) {
+        return 0;
+    }
+
+    while (rdma->nb_outstanding >= RDMA_MAX_OUTSTANDING) {
+        ret = qemu_rdma_block_for_wrid(rdma, RDMA_WRID_RDMA_WRITE);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    sge.addr = (uintptr_t)(block->local_host_addr + rdma->cur_offset);
+    sge.length = rdma->cur_len;
+    sge.lkey = block->mr->lkey;
+    wr.wr.rdma.remote_addr = block->remote_host_addr + rdma->cur_offset;
+    wr.wr.rdma.rkey = block->remote_rkey;
+
+    if (ibv_post_send(rdma->qp, &wr, &bad_wr)) {
+        return -EIO;
+    }
+    rdma->nb_outstanding++;
+    rdma->cur_len = 0;
+    return 0;
+}
+
+static int rdma_errno(MigrationState *s)
+{
+    RDMAContext *rdma = s->opaque;
+
+    return -rdma->error;
+}
+
+/* Send one chunk of the migration stream */
+static int rdma_write(MigrationState *s, const void *buf, size_t size)
+{
+    RDMAContext *rdma = s->opaque;
+    size_t len = MIN(size, RDMA_CONTROL_MAX_PAYLOAD);
+    int ret;
+
+    ret = qemu_rdma_wait_ready(rdma);
+    if (ret == 0) {
+        rdma->peer_ready = false;
+        ret = qemu_rdma_post_recv(rdma);
+    }
+    if (ret == 0) {
+        ret = qemu_rdma_send_control(rdma, RDMA_CONTROL_QEMU_FILE, buf, len);
+    }
+    if (ret < 0) {
+        rdma->error = ret;
+        return -1;
+    }
+    return len;
+}
+
+static int rdma_close(MigrationState *s)
+{
+    DPRINTF("rdma_close\n");
+    qemu_rdma_cleanup(s->opaque);
+    s->opaque = NULL;
+    return 0;
+}
+
+static int rdma_before_ram_iterate(MigrationState *s, uint64_t flags)
+{
+    RDMAContext *rdma = s->opaque;
+    int ret;
+
+    ret = qemu_fflush(s->file);
+    if (ret < 0) {
+        return ret;
+    }
+    return qemu_rdma_wait_ready(rdma);
+}
+
+static int rdma_after_ram_iterate(MigrationState *s, uint64_t flags)
+{
+    RDMAContext *rdma = s->opaque;
+    int ret;
+
+    ret = qemu_rdma_write_flush(rdma);
+    while (ret == 0 && rdma->nb_outstanding > 0) {
+        ret = qemu_rdma_block_for_wrid(rdma, RDMA_WRID_RDMA_WRITE);
+    }
+    return ret;
+}
+
+static int rdma_save_page(MigrationState *s, uint64_t block_offset,
+                          uint64_t offset, size_t size)
+{
+    RDMAContext *rdma = s->opaque;
+    int i = rdma->last_block;
+    int ret;
+
+    if (i >= rdma->nb_blocks || rdma->blocks[i].offset != block_offset) {
+        for (i = 0; i < rdma->nb_blocks; i++) {
+            if (rdma->blocks[i].offset == block_offset) {
+                break;
+            }
+        }
+        if (i == rdma->nb_blocks) {
+            return -ENOTSUP;
+        }
+        rdma->last_block = i;
+    }
+
+    if (rdma->cur_len && rdma->cur_block == i &&
+        rdma->cur_offset + rdma->cur_len == offset &&
+        rdma->cur_len + size <= RDMA_MERGE_MAX) {
+        rdma->cur_len += size;
+        return size;
+    }
+
+    ret = qemu_rdma_write_flush(rdma);
+    if (ret < 0) {
+        return ret;
+    }
+    rdma->cur_block = i;
+    rdma->cur_offset = offset;
+    rdma->cur_len = size;
+    return size;
+}
+
+void rdma_start_outgoing_migration(MigrationState *s, const char *host_port,
+                                   Error **errp)
+{
+    RDMAContext *rdma = g_malloc0(sizeof(*rdma));
+    struct rdma_conn_param conn_param = {
+        .retry_count = 5,
+        .rnr_retry_count = 7,   /* infinite */
+    };
+    struct addrinfo *res;
+    int ret;
+
+    if (qemu_rdma_resolve_host(host_port, false, &res, errp) < 0) {
+        g_free(rdma);
+        return;
+    }
+
+    rdma->channel = rdma_create_event_channel();
+    if (!rdma->channel ||
+        rdma_create_id(rdma->channel, &rdma->cm_id, NULL, RDMA_PS_TCP) < 0) {
+        ret = -errno;
+        goto err;
+    }
+    if (rdma_resolve_addr(rdma->cm_id, NULL, res->ai_addr,
+                          RDMA_RESOLVE_TIMEOUT_MS) < 0) {
+        ret = -errno;
+        goto err;
+    }
+    ret = qemu_rdma_wait_event(rdma, RDMA_CM_EVENT_ADDR_RESOLVED, NULL);
+    if (ret < 0) {
+        goto err;
+    }
+    if (rdma_resolve_route(rdma->cm_id, RDMA_RESOLVE_TIMEOUT_MS) < 0) {
+        ret = -errno;
+        goto err;
+    }
+    ret = qemu_rdma_wait_event(rdma, RDMA_CM_EVENT_ROUTE_RESOLVED, NULL);
+    if (ret < 0) {
+        goto err;
+    }
+
+    ret = qemu_rdma_alloc_qp(rdma, rdma->cm_id);
+    if (ret == 0) {
+        ret = qemu_rdma_reg_ram_blocks(rdma, IBV_ACCESS_LOCAL_WRITE);
+    }
+    if (ret == 0) {
+        ret = qemu_rdma_post_recv(rdma);
+    }
+    if (ret < 0) {
+        goto err;
+    }
+
+    if (rdma_connect(rdma->cm_id, &conn_param) < 0) {
+        ret = -errno;
+        goto err;
+    }
+    ret = qemu_rdma_wait_event(rdma, RDMA_CM_EVENT_ESTABLISHED, NULL);
+    if (ret < 0) {
+        goto err;
+    }
+    rdma->connected = true;
+
+    ret = qemu_rdma_wait_control(rdma, RDMA_CONTROL_RAM_BLOCKS);
+    if (ret == 0) {
+        ret = qemu_rdma_recv_ram_blocks(rdma);
+    }
+    if (ret == 0) {
+        /* for the destination's first READY */
+        ret = qemu_rdma_post_recv(rdma);
+    }
+    if (ret < 0) {
+        goto err;
+    }
+    freeaddrinfo(res);
+
+    DPRINTF("connected to %s\n", host_port);
+
+    s->opaque = rdma;
+    s->fd = rdma->comp_channel->fd;
+    s->get_error = rdma_errno;
+    s->write = rdma_write;
+    s->close = rdma_close;
+    s->before_ram_iterate = rdma_before_ram_iterate;
+    s->after_ram_iterate = rdma_after_ram_iterate;
+    s->save_page = rdma_save_page;
+
+    migrate_fd_connect(s);
+    return;
+
+err:
+    error_setg(errp, "RDMA: could not connect to %s: %s", host_port,
+               strerror(-ret));
+    freeaddrinfo(res);
+    qemu_rdma_cleanup(rdma);
+}
+
+/* The stream from the source, for qemu_loadvm_state() */
+static int rdma_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
+{
+    RDMAContext *rdma = opaque;
+    uint32_t len;
+    int ret;
+
+    if (rdma->error) {
+        return rdma->error;
+    }
+
+    if (!rdma->recv_done) {
+        ret = qemu_rdma_post_recv(rdma);
+        if (ret == 0) {
+            ret = qemu_rdma_send_control(rdma, RDMA_CONTROL_READY, NULL, 0);
+        }
+        if (ret == 0) {
+            ret = qemu_rdma_wait_control(rdma, RDMA_CONTROL_QEMU_FILE);
+        }
+        if (ret < 0) {
+            rdma->error = ret;
+            return ret;
+        }
+    }
+
+    len = MIN(size, rdma->recv_len - rdma->recv_off);
+    memcpy(buf, rdma->recv_buf + RDMA_CONTROL_HDR_SIZE + rdma->recv_off, len);
+    rdma->recv_off += len;
+    if (rdma->recv_off == rdma->recv_len) {
+        rdma->recv_done = false;
+    }
+    return len;
+}
+
+static int rdma_get_fd(void *opaque)
+{
+    RDMAContext *rdma = opaque;
+
+    return rdma->comp_channel->fd;
+}
+
+static int rdma_file_close(void *opaque)
+{
+    qemu_rdma_cleanup(opaque);
+    return 0;
+}
+
+static const QEMUFileOps rdma_read_ops = {
+    .get_fd =     rdma_get_fd,
+    .get_buffer = rdma_get_buffer,
+    .close =      rdma_file_close,
+};
+
+static void rdma_accept_incoming_migration(void *opaque)
+{
+    RDMAContext *rdma = opaque;
+    struct rdma_conn_param conn_param = {
+        .rnr_retry_count = 7,   /* infinite */
+    };
+    QEMUFile *f;
+    int ret;
+
+    qemu_set_fd_handler2(rdma->channel->fd, NULL, NULL, NULL, NULL);
+
+    ret = qemu_rdma_wait_event(rdma, RDMA_CM_EVENT_CONNECT_REQUEST,
+                               &rdma->cm_id);
+    if (ret < 0) {
+        goto err;
+    }
+
+    ret = qemu_rdma_alloc_qp(rdma, rdma->cm_id);
+    if (ret == 0) {
+        ret = qemu_rdma_reg_ram_blocks(rdma, IBV_ACCESS_LOCAL_WRITE |
+                                             IBV_ACCESS_REMOTE_WRITE);
+    }
+    if (ret < 0) {
+        goto err;
+    }
+
+    if (rdma_accept(rdma->cm_id, &conn_param) < 0) {
+        ret = -errno;
+        goto err;
+    }
+    ret = qemu_rdma_wait_event(rdma, RDMA_CM_EVENT_ESTABLISHED, NULL);
+    if (ret < 0) {
+        goto err;
+    }
+    rdma->connected = true;
+
+    ret = qemu_rdma_send_ram_blocks(rdma);
+    if (ret < 0) {
+        goto err;
+    }
+
+    DPRINTF("accepted migration\n");
+
+    f = qemu_fopen_ops(rdma, &rdma_read_ops);
+    process_incoming_migration(f);
+    return;
+
+err:
+    fprintf(stderr, "could not accept RDMA migration connection: %s\n",
+            strerror(-ret));
+    qemu_rdma_cleanup(rdma);
+}
+
+void rdma_start_incoming_migration(const char *host_port, Error **errp)
+{
+    RDMAContext *rdma = g_malloc0(sizeof(*rdma));
+    struct addrinfo *res;
+
+    if (qemu_rdma_resolve_host(host_port, true, &res, errp) < 0) {
+        g_free(rdma);
+        return;
+    }
+
+    rdma->channel = rdma_create_event_channel();
+    if (!rdma->channel ||
+        rdma_create_id(rdma->channel, &rdma->listen_id, NULL,
+                       RDMA_PS_TCP) < 0 ||
+        rdma_bind_addr(rdma->listen_id, res->ai_addr) < 0 ||
+        rdma_listen(rdma->listen_id, 1) < 0) {
+        error_setg(errp, "RDMA: could not listen on %s: %s", host_port,
+                   strerror(errno));
+        freeaddrinfo(res);
+        qemu_rdma_cleanup(rdma);
+        return;
+    }
+    freeaddrinfo(res);
+
+    qemu_set_fd_handler2(rdma->channel->fd, NULL,
+                         rdma_accept_incoming_migration, NULL, rdma);
+}
@@ -17,7 +17,6 @@
 #include "qemu_socket.h"
 #include "migration.h"
 #include "qemu-char.h"
-#include "buffered_file.h"
 #include "block.h"
 
 //#define DEBUG_MIGRATION_UNIX
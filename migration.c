@@ -16,12 +16,18 @@
 #include "qemu-common.h"
 #include "migration.h"
 #include "monitor.h"
-#include "buffered_file.h"
 #include "sysemu.h"
 #include "block.h"
 #include "qemu_socket.h"
 #include "block-migration.h"
 #include "qmp-commands.h"
+#include "qemu-error.h"
+#include "trace.h"
+#include "qemu-thread.h"
+#include "iov.h"
+#include "cpus.h"
+#include "qjson.h"
+#include "qint.h"
 
 //#define DEBUG_MIGRATION
 
@@ -39,6 +45,7 @@ enum {
     MIG_STATE_CANCELLED,
     MIG_STATE_ACTIVE,
     MIG_STATE_COMPLETED,
+    MIG_STATE_POSTCOPY_ACTIVE,
 };
 
 #define MAX_THROTTLE  (32 << 20)      /* Migration speed throttling */
@@ -46,6 +53,15 @@ enum {
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
 
+/* Migration compression defaults */
+#define DEFAULT_MIGRATE_COMPRESS_LEVEL 1
+#define DEFAULT_MIGRATE_COMPRESS_THREADS 8
+#define DEFAULT_MIGRATE_DECOMPRESS_THREADS 2
+#define MAX_MIGRATE_COMPRESS_THREADS 255
+
+/* Number of dirty bitmap passes before switching to postcopy */
+#define POSTCOPY_PRECOPY_ROUNDS 5
+
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
 
@@ -59,6 +75,9 @@ MigrationState *migrate_get_current(void)
         .state = MIG_STATE_SETUP,
         .bandwidth_limit = MAX_THROTTLE,
         .xbzrle_cache_size = DEFAULT_MIGRATE_CACHE_SIZE,
+        .compress_level = DEFAULT_MIGRATE_COMPRESS_LEVEL,
+        .compress_thread_count = DEFAULT_MIGRATE_COMPRESS_THREADS,
+        .decompress_thread_count = DEFAULT_MIGRATE_DECOMPRESS_THREADS,
     };
 
     return &current_migration;
@@ -77,6 +96,10 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
         unix_start_incoming_migration(p, errp);
     else if (strstart(uri, "fd:", &p))
         fd_start_incoming_migration(p, errp);
+#endif
+#ifdef CONFIG_RDMA
+    else if (strstart(uri, "rdma:", &p))
+        rdma_start_incoming_migration(p, errp);
 #endif
     else {
         error_setg(errp, "unknown migration protocol: %s\n", uri);
@@ -89,12 +112,16 @@ static void process_incoming_migration_co(void *opaque)
     int ret;
 
     ret = qemu_loadvm_state(f);
-    qemu_set_fd_handler(qemu_get_fd(f), NULL, NULL, NULL);
-    qemu_fclose(f);
+    migrate_decompress_threads_join();
     if (ret < 0) {
         fprintf(stderr, "load of migration failed\n");
         exit(0);
     }
+    /* In postcopy mode the stream now belongs to the listen thread */
+    if (ret == 0) {
+        qemu_set_fd_handler(qemu_get_fd(f), NULL, NULL, NULL);
+        qemu_fclose(f);
+    }
     qemu_announce_self();
     DPRINTF("successfully loaded vm state\n");
 
@@ -163,6 +190,8 @@ MigrationCapabilityStatusList *qmp_query_migrate_capabilities(Error **errp)
 
 static void get_xbzrle_cache_stats(MigrationInfo *info)
 {
+    uint64_t total;
+
     if (migrate_use_xbzrle()) {
         info->has_xbzrle_cache = true;
         info->xbzrle_cache = g_malloc0(sizeof(*info->xbzrle_cache));
@@ -170,10 +199,26 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
         info->xbzrle_cache->bytes = xbzrle_mig_bytes_transferred();
         info->xbzrle_cache->pages = xbzrle_mig_pages_transferred();
         info->xbzrle_cache->cache_miss = xbzrle_mig_pages_cache_miss();
+        info->xbzrle_cache->cache_hits = xbzrle_mig_pages_cache_hit();
+        total = info->xbzrle_cache->cache_hits + info->xbzrle_cache->cache_miss;
+        info->xbzrle_cache->cache_hit_rate =
+            total ? (double)info->xbzrle_cache->cache_hits / total : 0;
         info->xbzrle_cache->overflow = xbzrle_mig_pages_overflow();
     }
 }
 
+static void get_compression_stats(MigrationInfo *info)
+{
+    if (migrate_use_compression()) {
+        info->has_compression = true;
+        info->compression = g_malloc0(sizeof(*info->compression));
+        info->compression->pages = compress_mig_pages_transferred();
+        info->compression->busy = compress_mig_busy();
+        info->compression->compressed_size = compress_mig_bytes_transferred();
+        info->compression->compression_rate = compress_mig_rate();
+    }
+}
+
 MigrationInfo *qmp_query_migrate(Error **errp)
 {
     MigrationInfo *info = g_malloc0(sizeof(*info));
@@ -184,8 +229,10 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         /* no migration has happened ever */
         break;
     case MIG_STATE_ACTIVE:
+    case MIG_STATE_POSTCOPY_ACTIVE:
         info->has_status = true;
-        info->status = g_strdup("active");
+        info->status = g_strdup(s->state == MIG_STATE_ACTIVE ?
+                                "active" : "postcopy-active");
         info->has_total_time = true;
         info->total_time = qemu_get_clock_ms(rt_clock)
             - s->total_time;
@@ -202,6 +249,19 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->normal_bytes = norm_mig_bytes_transferred();
         info->ram->dirty_pages_rate = s->dirty_pages_rate;
 
+        if (s->has_estimates) {
+            info->has_estimates = true;
+            info->estimates = g_malloc0(sizeof(*info->estimates));
+            info->estimates->pass = s->dirty_sync_count;
+            info->estimates->bandwidth = s->bandwidth * 1000;
+            info->estimates->dirty_rate = s->dirty_rate;
+            info->estimates->dirty_bytes = s->dirty_sync_bytes;
+            info->estimates->converging = s->remaining_time >= 0;
+            if (s->remaining_time >= 0) {
+                info->estimates->has_remaining_time = true;
+                info->estimates->remaining_time = s->remaining_time;
+            }
+        }
 
         if (blk_mig_active()) {
             info->has_disk = true;
@@ -212,12 +272,20 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         }
 
         get_xbzrle_cache_stats(info);
+        get_compression_stats(info);
+
+        if (cpu_throttle_active()) {
+            info->has_cpu_throttle_percentage = true;
+            info->cpu_throttle_percentage = cpu_throttle_get_percentage();
+        }
         break;
     case MIG_STATE_COMPLETED:
         get_xbzrle_cache_stats(info);
+        get_compression_stats(info);
 
         info->has_status = true;
         info->status = g_strdup("completed");
+        info->has_total_time = true;
         info->total_time = s->total_time;
         info->has_downtime = true;
         info->downtime = s->downtime;
@@ -250,7 +318,7 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
     MigrationState *s = migrate_get_current();
     MigrationCapabilityStatusList *cap;
 
-    if (s->state == MIG_STATE_ACTIVE) {
+    if (migration_is_active(s)) {
         error_set(errp, QERR_MIGRATION_ACTIVE);
         return;
     }
@@ -262,6 +330,87 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
 
 /* shared migration helpers */
 
+/* Length of a rate limiting and bandwidth measurement window, in ms */
+#define BUFFER_DELAY 100
+
+/* Account @bytes sent over the last @time ms and average the bandwidth
+ * over the last MIG_BW_WINDOW periods, so that a single stall or burst
+ * does not skew the estimates.
+ */
+static void migration_update_bandwidth(MigrationState *s, uint64_t bytes,
+                                       int64_t time)
+{
+    uint64_t total_bytes = 0;
+    int64_t total_time = 0;
+    int i;
+
+    s->bw_bytes[s->bw_index] = bytes;
+    s->bw_time[s->bw_index] = time;
+    s->bw_index = (s->bw_index + 1) % MIG_BW_WINDOW;
+
+    for (i = 0; i < MIG_BW_WINDOW; i++) {
+        total_bytes += s->bw_bytes[i];
+        total_time += s->bw_time[i];
+    }
+    s->bandwidth = (double)total_bytes / total_time;
+}
+
+/* Called after each sync of the dirty bitmap with the amount of memory
+ * the guest dirtied since the previous one.  Updates the estimates
+ * reported by query-migrate and emits a MIGRATION_PASS event.
+ */
+void migration_update_estimates(MigrationState *s, uint64_t dirty_bytes)
+{
+    int64_t now = qemu_get_clock_ms(rt_clock);
+    int64_t period = now - s->last_sync_time;
+    bool first = !s->last_sync_time;
+    uint64_t remaining, bandwidth, sendable;
+    QObject *data;
+
+    s->last_sync_time = now;
+    s->dirty_sync_bytes = dirty_bytes;
+    /* the first sync finds all of RAM dirty, which says nothing */
+    if (first || s->state != MIG_STATE_ACTIVE) {
+        return;
+    }
+
+    s->dirty_rate = period > 0 ? dirty_bytes * 1000 / period : 0;
+    bandwidth = s->bandwidth * 1000;
+    remaining = ram_bytes_remaining();
+
+    /* what can be sent with the guest stopped for the allowed downtime */
+    sendable = bandwidth * migrate_max_downtime() / 1000000000;
+    if (remaining <= sendable) {
+        s->remaining_time = 0;
+    } else if (bandwidth > s->dirty_rate) {
+        s->remaining_time = (remaining - sendable) * 1000 /
+                            (bandwidth - s->dirty_rate);
+    } else {
+        s->remaining_time = -1;
+    }
+    /* far from the truth if bandwidth is 0, but without crashing */
+    s->expected_downtime = remaining * 1000 / MAX(bandwidth, 1);
+    s->has_estimates = true;
+
+    data = qobject_from_jsonf("{ 'pass': %" PRId64 ", "
+                              "'bandwidth': %" PRId64 ", "
+                              "'dirty-rate': %" PRId64 ", "
+                              "'dirty-bytes': %" PRId64 ", "
+                              "'remaining': %" PRId64 ", "
+                              "'expected-downtime': %" PRId64 ", "
+                              "'converging': %i }",
+                              s->dirty_sync_count, (int64_t)bandwidth,
+                              s->dirty_rate, (int64_t)dirty_bytes,
+                              (int64_t)remaining, s->expected_downtime,
+                              s->remaining_time >= 0);
+    if (s->remaining_time >= 0) {
+        qdict_put(qobject_to_qdict(data), "remaining-time",
+                  qint_from_int(s->remaining_time));
+    }
+    monitor_protocol_event(QEVENT_MIGRATION_PASS, data);
+    qobject_decref(data);
+}
+
 static int migrate_fd_cleanup(MigrationState *s)
 {
     int ret = 0;
@@ -276,6 +425,7 @@ static int migrate_fd_cleanup(MigrationState *s)
     return ret;
 }
 
+/* Only for failures before the migration thread was started */
 void migrate_fd_error(MigrationState *s)
 {
     DPRINTF("setting error state\n");
@@ -284,38 +434,82 @@ void migrate_fd_error(MigrationState *s)
     migrate_fd_cleanup(s);
 }
 
-static void migrate_fd_completed(MigrationState *s)
+/* Called from the main loop once the migration thread has exited */
+static void migrate_fd_thread_done(void *opaque)
 {
-    DPRINTF("setting completed state\n");
-    if (migrate_fd_cleanup(s) < 0) {
+    MigrationState *s = opaque;
+
+    qemu_bh_delete(s->cleanup_bh);
+    s->cleanup_bh = NULL;
+    qemu_thread_join(&s->thread);
+    cpu_throttle_stop();
+
+    if (s->state == MIG_STATE_CANCELLED) {
+        qemu_savevm_state_cancel(s->file);
+    }
+    if (migrate_fd_cleanup(s) < 0 && s->state == MIG_STATE_COMPLETED) {
         s->state = MIG_STATE_ERROR;
-    } else {
-        s->state = MIG_STATE_COMPLETED;
+    }
+
+    if (s->state == MIG_STATE_COMPLETED) {
+        DPRINTF("setting completed state\n");
         runstate_set(RUN_STATE_POSTMIGRATE);
+    } else if (s->old_vm_running) {
+        vm_start();
     }
     notifier_list_notify(&migration_state_notifiers, s);
 }
 
-static void migrate_fd_put_notify(void *opaque)
+/* Must be called with the iothread lock held */
+static void migrate_set_error(MigrationState *s)
 {
-    MigrationState *s = opaque;
-    int ret;
-
-    qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
-    ret = qemu_file_put_notify(s->file);
-    if (ret) {
-        migrate_fd_error(s);
+    if (migration_is_active(s)) {
+        DPRINTF("setting error state\n");
+        s->state = MIG_STATE_ERROR;
     }
 }
 
-ssize_t migrate_fd_put_buffer(MigrationState *s, const void *data,
-                              size_t size)
+/*
+ * Page requests from the destination: be64 offset, u8 len, idstr.
+ * Called with the iothread lock held; never blocks.
+ */
+static int migrate_postcopy_read_requests(MigrationState *s)
 {
-    ssize_t ret;
+    GPollFD pfd = { .fd = s->fd, .events = G_IO_IN };
+    ssize_t len;
+
+    /* the socket is blocking, only read what is already there */
+    while (g_poll(&pfd, 1, 0) == 1) {
+        len = qemu_recv(s->fd, s->return_buf + s->return_len,
+                        sizeof(s->return_buf) - s->return_len, 0);
+        if (len == 0 || (len < 0 && socket_error() != EINTR)) {
+            error_report("postcopy: return channel closed");
+            return -EIO;
+        }
+        if (len < 0) {
+            continue;
+        }
+        s->return_len += len;
 
-    if (s->state != MIG_STATE_ACTIVE) {
-        return -EIO;
+        while (s->return_len >= 9 && s->return_len >= 9 + s->return_buf[8]) {
+            int msg_len = 9 + s->return_buf[8];
+            char idstr[256];
+
+            memcpy(idstr, s->return_buf + 9, s->return_buf[8]);
+            idstr[s->return_buf[8]] = 0;
+            ram_postcopy_request_page(idstr, ldq_be_p(s->return_buf));
+
+            s->return_len -= msg_len;
+            memmove(s->return_buf, s->return_buf + msg_len, s->return_len);
+        }
     }
+    return 0;
+}
+
+static ssize_t migrate_fd_put_buffer(MigrationState *s, const void *data,
+                                     size_t size)
+{
+    ssize_t ret;
 
     do {
         ret = s->write(s, data, size);
@@ -324,86 +518,342 @@ ssize_t migrate_fd_put_buffer(MigrationState *s, const void *data,
     if (ret == -1)
         ret = -(s->get_error(s));
 
-    if (ret == -EAGAIN) {
-        qemu_set_fd_handler2(s->fd, NULL, NULL, migrate_fd_put_notify, s);
+    return ret;
+}
+
+/*
+ * Send the whole iovec, blocking until done.  Called with or without the
+ * iothread lock, whenever the QEMUFile is flushed.  Sockets get the data
+ * with as few sendmsg() calls as possible; exec: and fd: may give us a
+ * pipe or a plain file, which are written one element at a time.
+ */
+static ssize_t buffered_writev_buffer(void *opaque, struct iovec *iov,
+                                      int iovcnt, int64_t pos)
+{
+    MigrationState *s = opaque;
+    size_t size = iov_size(iov, iovcnt);
+    size_t offset = 0;
+    ssize_t ret = 0;
+    int i;
+
+    DPRINTF("sending %zu byte(s) in %d iovec(s)\n", size, iovcnt);
+
+    if (s->fd_is_socket) {
+        while (offset < size) {
+            ret = iov_send(s->fd, iov, iovcnt, offset, size - offset);
+            if (ret == -1 && s->get_error(s) == EINTR) {
+                continue;
+            }
+            if (ret <= 0) {
+                ret = ret < 0 ? -(s->get_error(s)) : -EIO;
+                break;
+            }
+            offset += ret;
+        }
+    } else {
+        for (i = 0; i < iovcnt && ret >= 0; i++) {
+            size_t done = 0;
+
+            while (done < iov[i].iov_len) {
+                ret = migrate_fd_put_buffer(s, iov[i].iov_base + done,
+                                            iov[i].iov_len - done);
+                if (ret <= 0) {
+                    ret = ret < 0 ? ret : -EIO;
+                    break;
+                }
+                done += ret;
+                offset += ret;
+            }
+        }
     }
 
-    return ret;
+    s->bytes_xfer += offset;
+    if (ret < 0) {
+        DPRINTF("error sending data, %zd\n", ret);
+        return ret;
+    }
+    return offset;
+}
+
+static int buffered_get_fd(void *opaque)
+{
+    MigrationState *s = opaque;
+
+    return s->fd;
+}
+
+/*
+ * The meaning of the return values is:
+ *   0: We can continue sending
+ *   1: Time to stop
+ *   negative: There has been an error
+ */
+static int buffered_rate_limit(void *opaque)
+{
+    MigrationState *s = opaque;
+    int ret;
+
+    ret = qemu_file_get_error(s->file);
+    if (ret) {
+        return ret;
+    }
+
+    if (s->bytes_xfer > s->xfer_limit) {
+        return 1;
+    }
+
+    return 0;
+}
+
+static int64_t buffered_set_rate_limit(void *opaque, int64_t new_rate)
+{
+    MigrationState *s = opaque;
+
+    if (qemu_file_get_error(s->file)) {
+        goto out;
+    }
+    if (new_rate > SIZE_MAX) {
+        new_rate = SIZE_MAX;
+    }
+
+    s->xfer_limit = new_rate / (1000 / BUFFER_DELAY);
+
+out:
+    return s->xfer_limit;
+}
+
+static int64_t buffered_get_rate_limit(void *opaque)
+{
+    MigrationState *s = opaque;
+
+    return s->xfer_limit;
+}
+
+static int buffered_before_ram_iterate(void *opaque, uint64_t flags)
+{
+    MigrationState *s = opaque;
+
+    if (!s->before_ram_iterate) {
+        return 0;
+    }
+    return s->before_ram_iterate(s, flags);
 }
 
-void migrate_fd_put_ready(MigrationState *s)
+static int buffered_after_ram_iterate(void *opaque, uint64_t flags)
 {
+    MigrationState *s = opaque;
+
+    if (!s->after_ram_iterate) {
+        return 0;
+    }
+    return s->after_ram_iterate(s, flags);
+}
+
+static int buffered_save_page(void *opaque, uint64_t block_offset,
+                              uint64_t offset, size_t size)
+{
+    MigrationState *s = opaque;
     int ret;
 
-    if (s->state != MIG_STATE_ACTIVE) {
-        DPRINTF("put_ready returning because of non-active state\n");
+    if (!s->save_page) {
+        return -ENOTSUP;
+    }
+    ret = s->save_page(s, block_offset, offset, size);
+    if (ret > 0) {
+        s->bytes_xfer += ret;
+    }
+    return ret;
+}
+
+static const QEMUFileOps buffered_file_ops = {
+    .get_fd =             buffered_get_fd,
+    .writev_buffer =      buffered_writev_buffer,
+    .rate_limit =         buffered_rate_limit,
+    .get_rate_limit =     buffered_get_rate_limit,
+    .set_rate_limit =     buffered_set_rate_limit,
+    .before_ram_iterate = buffered_before_ram_iterate,
+    .after_ram_iterate =  buffered_after_ram_iterate,
+    .save_page =          buffered_save_page,
+};
+
+static bool migrate_postcopy_possible(MigrationState *s)
+{
+    if (!migrate_use_postcopy() ||
+        s->dirty_sync_count < POSTCOPY_PRECOPY_ROUNDS) {
+        return false;
+    }
+    /* page requests come back over the same socket */
+    if (!s->fd_is_socket) {
+        return false;
+    }
+    return qemu_savevm_state_postcopy_supported();
+}
+
+/*
+ * Stop the guest, send the device state and the list of still dirty
+ * pages, and let the destination run; the remaining RAM is then sent by
+ * migrate_fd_iterate().  From here on the source can no longer
+ * resume the guest.
+ */
+static void migrate_postcopy_start(MigrationState *s)
+{
+    int64_t start_time;
+
+    trace_migrate_postcopy_start(s->dirty_sync_count, ram_bytes_remaining());
+    start_time = qemu_get_clock_ms(rt_clock);
+    qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
+    vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+
+    s->state = MIG_STATE_POSTCOPY_ACTIVE;
+
+    if (qemu_savevm_state_postcopy(s->file) < 0) {
+        migrate_set_error(s);
         return;
     }
+    s->downtime = qemu_get_clock_ms(rt_clock) - start_time;
+}
+
+/*
+ * One step of the save loop, called with the iothread lock held.
+ * Returns true when the whole state has been queued for sending.
+ */
+static bool migrate_fd_iterate(MigrationState *s)
+{
+    int ret;
+
+    if (migration_in_postcopy(s)) {
+        ret = qemu_savevm_state_postcopy_iterate(s->file);
+        if (ret == 1) {
+            DPRINTF("postcopy done\n");
+            ret = qemu_savevm_state_postcopy_complete(s->file);
+            if (ret == 0) {
+                return true;
+            }
+        }
+        if (ret < 0) {
+            migrate_set_error(s);
+        }
+        return false;
+    }
 
     DPRINTF("iterate\n");
     ret = qemu_savevm_state_iterate(s->file);
     if (ret < 0) {
-        migrate_fd_error(s);
+        migrate_set_error(s);
+    } else if (ret == 0 && migrate_postcopy_possible(s)) {
+        migrate_postcopy_start(s);
     } else if (ret == 1) {
-        int old_vm_running = runstate_is_running();
-        int64_t start_time, end_time;
-
         DPRINTF("done iterating\n");
-        start_time = qemu_get_clock_ms(rt_clock);
+        s->downtime = qemu_get_clock_ms(rt_clock);
+        s->old_vm_running = runstate_is_running();
         qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
         vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
 
         if (qemu_savevm_state_complete(s->file) < 0) {
-            migrate_fd_error(s);
+            migrate_set_error(s);
         } else {
-            migrate_fd_completed(s);
-        }
-        end_time = qemu_get_clock_ms(rt_clock);
-        s->total_time = end_time - s->total_time;
-        s->downtime = end_time - start_time;
-        if (s->state != MIG_STATE_COMPLETED) {
-            if (old_vm_running) {
-                vm_start();
-            }
+            return true;
         }
     }
+    return false;
 }
 
-static void migrate_fd_cancel(MigrationState *s)
+/*
+ * Sleep until the end of the rate limiting window.  In postcopy, wake
+ * up as soon as the destination asks for a page.
+ */
+static void migrate_fd_wait(MigrationState *s, int64_t timeout)
 {
-    if (s->state != MIG_STATE_ACTIVE)
+    if (timeout <= 0) {
         return;
+    }
+    if (migration_in_postcopy(s)) {
+        GPollFD pfd = { .fd = s->fd, .events = G_IO_IN };
 
-    DPRINTF("cancelling migration\n");
-
-    s->state = MIG_STATE_CANCELLED;
-    notifier_list_notify(&migration_state_notifiers, s);
-    qemu_savevm_state_cancel(s->file);
-
-    migrate_fd_cleanup(s);
+        g_poll(&pfd, 1, timeout);
+    } else {
+        g_usleep(timeout * 1000);
+    }
 }
 
-int migrate_fd_wait_for_unfreeze(MigrationState *s)
+/*
+ * The outgoing save loop.  Sending data, rate limiting and bandwidth
+ * measurement happen here without the iothread lock; it is only taken
+ * to run the savevm handlers.
+ */
+static void *migration_thread(void *opaque)
 {
+    MigrationState *s = opaque;
+    int64_t initial_time = qemu_get_clock_ms(rt_clock);
+    bool done = false;
     int ret;
 
-    DPRINTF("wait for unfreeze\n");
-    if (s->state != MIG_STATE_ACTIVE)
-        return -EINVAL;
+    qemu_mutex_lock_iothread();
+    DPRINTF("beginning savevm\n");
+    ret = qemu_savevm_state_begin(s->file, &s->params);
+    if (ret < 0) {
+        DPRINTF("failed, %d\n", ret);
+        migrate_set_error(s);
+    }
+    qemu_mutex_unlock_iothread();
 
-    do {
-        fd_set wfds;
+    while (migration_is_active(s) && !done) {
+        int64_t current_time;
+
+        qemu_mutex_lock_iothread();
+        if (migration_in_postcopy(s) &&
+            migrate_postcopy_read_requests(s) < 0) {
+            migrate_set_error(s);
+        }
+        if (migration_is_active(s) && !qemu_file_rate_limit(s->file)) {
+            done = migrate_fd_iterate(s);
+        }
+        qemu_mutex_unlock_iothread();
 
-        FD_ZERO(&wfds);
-        FD_SET(s->fd, &wfds);
+        if (qemu_fflush(s->file) < 0 || qemu_file_get_error(s->file)) {
+            qemu_mutex_lock_iothread();
+            migrate_set_error(s);
+            qemu_mutex_unlock_iothread();
+            break;
+        }
+
+        current_time = qemu_get_clock_ms(rt_clock);
+        if (current_time >= initial_time + BUFFER_DELAY) {
+            migration_update_bandwidth(s, s->bytes_xfer,
+                                       current_time - initial_time);
+            s->bytes_xfer = 0;
+            initial_time = current_time;
+        }
+        if (!done && qemu_file_rate_limit(s->file) == 1) {
+            migrate_fd_wait(s, initial_time + BUFFER_DELAY - current_time);
+        }
+    }
 
-        ret = select(s->fd + 1, NULL, &wfds, NULL, NULL);
-    } while (ret == -1 && (s->get_error(s)) == EINTR);
+    qemu_mutex_lock_iothread();
+    if (done && migration_is_active(s)) {
+        int64_t end_time = qemu_get_clock_ms(rt_clock);
 
-    if (ret == -1) {
-        return -s->get_error(s);
+        if (!migration_in_postcopy(s)) {
+            s->downtime = end_time - s->downtime;
+        }
+        s->total_time = end_time - s->total_time;
+        s->state = MIG_STATE_COMPLETED;
     }
-    return 0;
+    qemu_mutex_unlock_iothread();
+
+    qemu_bh_schedule(s->cleanup_bh);
+    return NULL;
+}
+
+static void migrate_fd_cancel(MigrationState *s)
+{
+    if (s->state != MIG_STATE_ACTIVE)
+        return;
+
+    DPRINTF("cancelling migration\n");
+
+    /* the migration thread notices and cleans up from the main loop */
+    s->state = MIG_STATE_CANCELLED;
 }
 
 int migrate_fd_close(MigrationState *s)
@@ -429,7 +879,13 @@ void remove_migration_state_change_notifier(Notifier *notify)
 
 bool migration_is_active(MigrationState *s)
 {
-    return s->state == MIG_STATE_ACTIVE;
+    return s->state == MIG_STATE_ACTIVE ||
+           s->state == MIG_STATE_POSTCOPY_ACTIVE;
+}
+
+bool migration_in_postcopy(MigrationState *s)
+{
+    return s->state == MIG_STATE_POSTCOPY_ACTIVE;
 }
 
 bool migration_has_finished(MigrationState *s)
@@ -445,19 +901,20 @@ bool migration_has_failed(MigrationState *s)
 
 void migrate_fd_connect(MigrationState *s)
 {
-    int ret;
+    struct stat st;
 
     s->state = MIG_STATE_ACTIVE;
-    s->file = qemu_fopen_ops_buffered(s);
+    s->bytes_xfer = 0;
+    s->xfer_limit = s->bandwidth_limit / (1000 / BUFFER_DELAY);
 
-    DPRINTF("beginning savevm\n");
-    ret = qemu_savevm_state_begin(s->file, &s->params);
-    if (ret < 0) {
-        DPRINTF("failed, %d\n", ret);
-        migrate_fd_error(s);
-        return;
-    }
-    migrate_fd_put_ready(s);
+    /* the migration thread does blocking writes */
+    socket_set_block(s->fd);
+    s->fd_is_socket = fstat(s->fd, &st) == 0 && S_ISSOCK(st.st_mode);
+
+    s->file = qemu_fopen_ops(s, &buffered_file_ops);
+    s->cleanup_bh = qemu_bh_new(migrate_fd_thread_done, s);
+    qemu_thread_create(&s->thread, migration_thread, s,
+                       QEMU_THREAD_JOINABLE);
 }
 
 static MigrationState *migrate_init(const MigrationParams *params)
@@ -466,6 +923,9 @@ static MigrationState *migrate_init(const MigrationParams *params)
     int64_t bandwidth_limit = s->bandwidth_limit;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size = s->xbzrle_cache_size;
+    int compress_level = s->compress_level;
+    int compress_thread_count = s->compress_thread_count;
+    int decompress_thread_count = s->decompress_thread_count;
 
     memcpy(enabled_capabilities, s->enabled_capabilities,
            sizeof(enabled_capabilities));
@@ -476,6 +936,9 @@ static MigrationState *migrate_init(const MigrationParams *params)
     memcpy(s->enabled_capabilities, enabled_capabilities,
            sizeof(enabled_capabilities));
     s->xbzrle_cache_size = xbzrle_cache_size;
+    s->compress_level = compress_level;
+    s->compress_thread_count = compress_thread_count;
+    s->decompress_thread_count = decompress_thread_count;
 
     s->bandwidth_limit = bandwidth_limit;
     s->state = MIG_STATE_SETUP;
@@ -508,11 +971,16 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
     params.blk = blk;
     params.shared = inc;
 
-    if (s->state == MIG_STATE_ACTIVE) {
+    if (migration_is_active(s) || savevm_live_active()) {
         error_set(errp, QERR_MIGRATION_ACTIVE);
         return;
     }
 
+    if (dump_in_progress()) {
+        error_setg(errp, "A live guest memory dump is in progress");
+        return;
+    }
+
     if (qemu_savevm_state_blocked(errp)) {
         return;
     }
@@ -533,6 +1001,10 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         unix_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+#endif
+#ifdef CONFIG_RDMA
+    } else if (strstart(uri, "rdma:", &p)) {
+        rdma_start_outgoing_migration(s, p, &local_err);
 #endif
     } else {
         error_set(errp, QERR_INVALID_PARAMETER_VALUE, "uri", "a valid migration protocol");
@@ -572,6 +1044,62 @@ int64_t qmp_query_migrate_cache_size(Error **errp)
     return migrate_xbzrle_cache_size();
 }
 
+void qmp_migrate_set_parameters(bool has_compress_level,
+                                int64_t compress_level,
+                                bool has_compress_threads,
+                                int64_t compress_threads,
+                                bool has_decompress_threads,
+                                int64_t decompress_threads, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (migration_is_active(s)) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+    if (has_compress_level && (compress_level < 0 || compress_level > 9)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "compress-level",
+                  "a value between 0 and 9");
+        return;
+    }
+    if (has_compress_threads &&
+        (compress_threads < 1 ||
+         compress_threads > MAX_MIGRATE_COMPRESS_THREADS)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "compress-threads",
+                  "a value between 1 and 255");
+        return;
+    }
+    if (has_decompress_threads &&
+        (decompress_threads < 1 ||
+         decompress_threads > MAX_MIGRATE_COMPRESS_THREADS)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "decompress-threads",
+                  "a value between 1 and 255");
+        return;
+    }
+
+    if (has_compress_level) {
+        s->compress_level = compress_level;
+    }
+    if (has_compress_threads) {
+        s->compress_thread_count = compress_threads;
+    }
+    if (has_decompress_threads) {
+        s->decompress_thread_count = decompress_threads;
+    }
+}
+
+MigrationParameters *qmp_query_migrate_parameters(Error **errp)
+{
+    MigrationParameters *params = g_malloc0(sizeof(*params));
+    MigrationState *s = migrate_get_current();
+
+    params->compress_level = s->compress_level;
+    params->compress_threads = s->compress_thread_count;
+    params->decompress_threads = s->decompress_thread_count;
+
+    return params;
+}
+
 void qmp_migrate_set_speed(int64_t value, Error **errp)
 {
     MigrationState *s;
@@ -601,6 +1129,75 @@ int migrate_use_xbzrle(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_XBZRLE];
 }
 
+bool migrate_use_postcopy(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_POSTCOPY_RAM];
+}
+
+bool migrate_auto_converge(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_AUTO_CONVERGE];
+}
+
+bool migrate_transport_saves_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->save_page != NULL;
+}
+
+bool migrate_use_compression(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS];
+}
+
+bool migrate_use_zero_ranges(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_RANGES];
+}
+
+bool migrate_zero_blocks(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_BLOCKS];
+}
+
+int migrate_compress_level(void)
+{
+    return migrate_get_current()->compress_level;
+}
+
+int migrate_compress_threads(void)
+{
+    return migrate_get_current()->compress_thread_count;
+}
+
+int migrate_decompress_threads(void)
+{
+    return migrate_get_current()->decompress_thread_count;
+}
+
 int64_t migrate_xbzrle_cache_size(void)
 {
     MigrationState *s;
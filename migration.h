@@ -20,6 +20,8 @@
 #include "error.h"
 #include "vmstate.h"
 #include "qapi-types.h"
+#include "qemu-thread.h"
+#include "qemu-file.h"
 
 struct MigrationParams {
     bool blk;
@@ -28,6 +30,9 @@ struct MigrationParams {
 
 typedef struct MigrationState MigrationState;
 
+/* Number of rate limiting periods the bandwidth is averaged over */
+#define MIG_BW_WINDOW 10
+
 struct MigrationState
 {
     int64_t bandwidth_limit;
@@ -37,6 +42,11 @@ struct MigrationState
     int (*get_error)(MigrationState *s);
     int (*close)(MigrationState *s);
     int (*write)(MigrationState *s, const void *buff, size_t size);
+    /* optional, for transports that move RAM pages outside the stream */
+    int (*before_ram_iterate)(MigrationState *s, uint64_t flags);
+    int (*after_ram_iterate)(MigrationState *s, uint64_t flags);
+    int (*save_page)(MigrationState *s, uint64_t block_offset,
+                     uint64_t offset, size_t size);
     void *opaque;
     MigrationParams params;
     int64_t total_time;
@@ -45,6 +55,31 @@ struct MigrationState
     int64_t dirty_pages_rate;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size;
+    int compress_level;
+    int compress_thread_count;
+    int decompress_thread_count;
+    int64_t dirty_sync_count;
+    uint8_t return_buf[8 + 1 + 256];
+    int return_len;
+
+    /* outgoing migration thread, see migration_thread() */
+    QemuThread thread;
+    QEMUBH *cleanup_bh;
+    bool old_vm_running;
+    bool fd_is_socket;
+    size_t bytes_xfer;
+    size_t xfer_limit;
+    double bandwidth;   /* bytes per ms, over the last MIG_BW_WINDOW periods */
+    uint64_t bw_bytes[MIG_BW_WINDOW];
+    int64_t bw_time[MIG_BW_WINDOW];
+    unsigned bw_index;
+
+    /* convergence estimates, see migration_update_estimates() */
+    bool has_estimates;
+    int64_t last_sync_time;
+    uint64_t dirty_sync_bytes;
+    int64_t dirty_rate;         /* bytes per second */
+    int64_t remaining_time;     /* ms, -1 while not converging */
 };
 
 void process_incoming_migration(QEMUFile *f);
@@ -53,6 +88,8 @@ void qemu_start_incoming_migration(const char *uri, Error **errp);
 
 uint64_t migrate_max_downtime(void);
 
+void migration_update_estimates(MigrationState *s, uint64_t dirty_bytes);
+
 void do_info_migrate_print(Monitor *mon, const QObject *data);
 
 void do_info_migrate(Monitor *mon, QObject **ret_data);
@@ -73,14 +110,14 @@ void fd_start_incoming_migration(const char *path, Error **errp);
 
 void fd_start_outgoing_migration(MigrationState *s, const char *fdname, Error **errp);
 
+void rdma_start_incoming_migration(const char *host_port, Error **errp);
+
+void rdma_start_outgoing_migration(MigrationState *s, const char *host_port, Error **errp);
+
 void migrate_fd_error(MigrationState *s);
 
 void migrate_fd_connect(MigrationState *s);
 
-ssize_t migrate_fd_put_buffer(MigrationState *s, const void *data,
-                              size_t size);
-void migrate_fd_put_ready(MigrationState *s);
-int migrate_fd_wait_for_unfreeze(MigrationState *s);
 int migrate_fd_close(MigrationState *s);
 
 void add_migration_state_change_notifier(Notifier *notify);
@@ -93,6 +130,8 @@ MigrationState *migrate_get_current(void);
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
+void ram_discard_free_range(struct MemoryRegion *mr, uint64_t offset,
+                            uint64_t length);
 
 extern SaveVMHandlers savevm_ram_handlers;
 
@@ -104,6 +143,12 @@ uint64_t xbzrle_mig_bytes_transferred(void);
 uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
+uint64_t xbzrle_mig_pages_cache_hit(void);
+uint64_t compress_mig_pages_transferred(void);
+uint64_t compress_mig_bytes_transferred(void);
+uint64_t compress_mig_busy(void);
+double compress_mig_rate(void);
+void migrate_decompress_threads_join(void);
 
 /**
  * @migrate_add_blocker - prevent migration from proceeding
@@ -125,7 +170,30 @@ int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
+bool migrate_use_postcopy(void);
+bool migrate_auto_converge(void);
+bool migrate_transport_saves_ram(void);
+bool migrate_use_compression(void);
+bool migrate_use_zero_ranges(void);
+bool migrate_zero_blocks(void);
+int migrate_compress_level(void);
+int migrate_compress_threads(void);
+int migrate_decompress_threads(void);
+bool migration_in_postcopy(MigrationState *s);
 
 int64_t xbzrle_cache_resize(int64_t new_size);
 
+void ram_postcopy_request_page(const char *idstr, uint64_t offset);
+
+/* Incoming postcopy, see migration-postcopy.c */
+bool postcopy_incoming_supported(void);
+int postcopy_incoming_init(int return_fd);
+int postcopy_incoming_register(const char *idstr, void *host, uint64_t length);
+void *postcopy_host_from_idstr(const char *idstr, uint64_t offset);
+int postcopy_incoming_start(void);
+int postcopy_place_page(void *host, const void *from, size_t size);
+int postcopy_place_zero_page(void *host, size_t size);
+bool postcopy_incoming_active(void);
+void postcopy_incoming_cleanup(void);
+
 #endif
@@ -67,6 +67,9 @@
 #include "qmp-commands.h"
 #include "hmp.h"
 #include "qemu-thread.h"
+#include "qapi-visit.h"
+#include "qapi/qmp-output-visitor.h"
+#include "qapi/qapi-dealloc-visitor.h"
 
 /* for pic/irq_info */
 #if defined(TARGET_SPARC)
@@ -130,6 +133,7 @@ typedef struct mon_cmd_t {
                           MonitorCompletion *cb, void *opaque);
     } mhandler;
     int flags;
+    const struct QMPOffload *offload;
 } mon_cmd_t;
 
 /* file descriptors passed via SCM_RIGHTS */
@@ -162,6 +166,12 @@ typedef struct MonitorControl {
     QObject *id;
     JSONMessageParser parser;
     int command_mode;
+    /* An offloaded command is running, later commands wait in @pending
+     * so that replies are sent in order.
+     */
+    bool offloaded;
+    GQueue *pending;
+    unsigned int generation;
 } MonitorControl;
 
 /*
@@ -458,6 +468,7 @@ static const char *monitor_event_names[] = {
     [QEVENT_WAKEUP] = "WAKEUP",
     [QEVENT_BALLOON_CHANGE] = "BALLOON_CHANGE",
     [QEVENT_SPICE_MIGRATE_COMPLETED] = "SPICE_MIGRATE_COMPLETED",
+    [QEVENT_MIGRATION_PASS] = "MIGRATION_PASS",
 };
 QEMU_BUILD_BUG_ON(ARRAY_SIZE(monitor_event_names) != QEVENT_MAX)
 
@@ -778,15 +789,218 @@ static void user_monitor_complete(void *opaque, QObject *ret_data)
     g_free(data);
 }
 
+/* Asynchronous QMP commands keep their own id, so that other commands can
+ * run and reply while they are in progress.
+ */
+typedef struct QMPCompletionData {
+    Monitor *mon;
+    QObject *id;
+} QMPCompletionData;
+
 static void qmp_monitor_complete(void *opaque, QObject *ret_data)
 {
-    monitor_protocol_emitter(opaque, ret_data);
+    QMPCompletionData *data = opaque;
+
+    qobject_decref(data->mon->mc->id);
+    data->mon->mc->id = data->id;
+    monitor_protocol_emitter(data->mon, ret_data);
+    g_free(data);
 }
 
 static int qmp_async_cmd_handler(Monitor *mon, const mon_cmd_t *cmd,
                                  const QDict *params)
 {
-    return cmd->mhandler.cmd_async(mon, params, qmp_monitor_complete, mon);
+    QMPCompletionData *data = g_malloc(sizeof(*data));
+    int ret;
+
+    data->mon = mon;
+    data->id = mon->mc->id;
+    mon->mc->id = NULL;
+
+    ret = cmd->mhandler.cmd_async(mon, params, qmp_monitor_complete, data);
+    if (ret) {
+        mon->mc->id = data->id;
+        g_free(data);
+    }
+    return ret;
+}
+
+/*
+ * Offloaded QMP commands
+ *
+ * Query commands that return a lot of data spend most of their time
+ * converting it to QObjects and then to JSON.  For these commands only a
+ * snapshot of the data is taken in the main loop, by calling the QAPI
+ * function that fills in the return type; the conversion, serialization
+ * and freeing happen in the monitor thread without the global mutex.  The
+ * reply is written back from a bottom half.  The monitor stops reading
+ * while a command is offloaded, and commands that were already received
+ * are queued, so replies still come in order.
+ */
+typedef struct QMPOffload {
+    void *(*snapshot)(Error **errp);
+    void (*visit)(Visitor *v, void **obj, Error **errp);
+} QMPOffload;
+
+typedef struct QMPOffloadJob {
+    Monitor *mon;
+    const QMPOffload *offload;
+    void *data;
+    QObject *id;
+    bool pretty;
+    unsigned int generation;
+    QString *reply;
+    QTAILQ_ENTRY(QMPOffloadJob) next;
+} QMPOffloadJob;
+
+static struct {
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;
+    QEMUBH *bh;
+    QTAILQ_HEAD(, QMPOffloadJob) todo;
+    QTAILQ_HEAD(, QMPOffloadJob) done;
+} qmp_offload;
+
+#define QMP_OFFLOAD(cmd, type)                                          \
+static void *qmp_snapshot_##cmd(Error **errp)                           \
+{                                                                       \
+    return qmp_##cmd(errp);                                             \
+}                                                                       \
+                                                                        \
+static void qmp_visit_##cmd(Visitor *v, void **obj, Error **errp)      \
+{                                                                       \
+    visit_type_##type(v, (type **)obj, "unused", errp);                 \
+}                                                                       \
+                                                                        \
+static const QMPOffload qmp_offload_##cmd = {                           \
+    .snapshot = qmp_snapshot_##cmd,                                     \
+    .visit = qmp_visit_##cmd,                                           \
+}
+
+QMP_OFFLOAD(query_block, BlockInfoList);
+QMP_OFFLOAD(query_blockstats, BlockStatsList);
+QMP_OFFLOAD(query_migrate, MigrationInfo);
+
+static void qmp_offload_run(QMPOffloadJob *job)
+{
+    QmpOutputVisitor *mo = qmp_output_visitor_new();
+    QapiDeallocVisitor *md = qapi_dealloc_visitor_new();
+    QObject *data;
+    QDict *qmp;
+
+    job->offload->visit(qmp_output_get_visitor(mo), &job->data, NULL);
+    data = qmp_output_get_qobject(mo);
+    qmp_output_visitor_cleanup(mo);
+
+    job->offload->visit(qapi_dealloc_get_visitor(md), &job->data, NULL);
+    qapi_dealloc_visitor_cleanup(md);
+
+    qmp = qdict_new();
+    qdict_put_obj(qmp, "return", data ? data : QOBJECT(qdict_new()));
+    if (job->id) {
+        qdict_put_obj(qmp, "id", job->id);
+        job->id = NULL;
+    }
+    job->reply = job->pretty ? qobject_to_json_pretty(QOBJECT(qmp)) :
+                               qobject_to_json(QOBJECT(qmp));
+    qstring_append_chr(job->reply, '\n');
+    QDECREF(qmp);
+}
+
+static void *qmp_offload_thread(void *opaque)
+{
+    QMPOffloadJob *job;
+
+    qemu_mutex_lock(&qmp_offload.lock);
+    for (;;) {
+        while (QTAILQ_EMPTY(&qmp_offload.todo)) {
+            qemu_cond_wait(&qmp_offload.cond, &qmp_offload.lock);
+        }
+        job = QTAILQ_FIRST(&qmp_offload.todo);
+        QTAILQ_REMOVE(&qmp_offload.todo, job, next);
+        qemu_mutex_unlock(&qmp_offload.lock);
+
+        qmp_offload_run(job);
+
+        qemu_mutex_lock(&qmp_offload.lock);
+        QTAILQ_INSERT_TAIL(&qmp_offload.done, job, next);
+        qemu_bh_schedule(qmp_offload.bh);
+    }
+    return NULL;
+}
+
+static void qmp_dispatch_pending(Monitor *mon);
+
+static void qmp_offload_bh(void *opaque)
+{
+    QTAILQ_HEAD(, QMPOffloadJob) done = QTAILQ_HEAD_INITIALIZER(done);
+    QMPOffloadJob *job;
+
+    qemu_mutex_lock(&qmp_offload.lock);
+    while ((job = QTAILQ_FIRST(&qmp_offload.done)) != NULL) {
+        QTAILQ_REMOVE(&qmp_offload.done, job, next);
+        QTAILQ_INSERT_TAIL(&done, job, next);
+    }
+    qemu_mutex_unlock(&qmp_offload.lock);
+
+    while ((job = QTAILQ_FIRST(&done)) != NULL) {
+        Monitor *mon = job->mon;
+
+        QTAILQ_REMOVE(&done, job, next);
+        /* Do not send the reply to a client that connected afterwards */
+        if (job->generation == mon->mc->generation) {
+            monitor_puts(mon, qstring_get_str(job->reply));
+        }
+        QDECREF(job->reply);
+        g_free(job);
+
+        mon->mc->offloaded = false;
+        mon->suspend_cnt--;
+        qmp_dispatch_pending(mon);
+    }
+}
+
+static int qmp_offload_cmd(Monitor *mon, const mon_cmd_t *cmd)
+{
+    QMPOffloadJob *job;
+    Error *local_err = NULL;
+    void *data;
+
+    data = cmd->offload->snapshot(&local_err);
+    if (error_is_set(&local_err)) {
+        qerror_report_err(local_err);
+        error_free(local_err);
+        return -1;
+    }
+
+    if (!qmp_offload.bh) {
+        qemu_mutex_init(&qmp_offload.lock);
+        qemu_cond_init(&qmp_offload.cond);
+        QTAILQ_INIT(&qmp_offload.todo);
+        QTAILQ_INIT(&qmp_offload.done);
+        qmp_offload.bh = qemu_bh_new(qmp_offload_bh, NULL);
+        qemu_thread_create(&qmp_offload.thread, qmp_offload_thread, NULL,
+                           QEMU_THREAD_DETACHED);
+    }
+
+    job = g_malloc0(sizeof(*job));
+    job->mon = mon;
+    job->offload = cmd->offload;
+    job->data = data;
+    job->id = mon->mc->id;
+    job->pretty = mon->flags & MONITOR_USE_PRETTY;
+    job->generation = mon->mc->generation;
+    mon->mc->id = NULL;
+
+    mon->mc->offloaded = true;
+    mon->suspend_cnt++;
+
+    qemu_mutex_lock(&qmp_offload.lock);
+    QTAILQ_INSERT_TAIL(&qmp_offload.todo, job, next);
+    qemu_cond_signal(&qmp_offload.cond);
+    qemu_mutex_unlock(&qmp_offload.lock);
+    return 0;
 }
 
 static void user_async_cmd_handler(Monitor *mon, const mon_cmd_t *cmd,
@@ -2485,6 +2699,21 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show infos for each CPU",
         .mhandler.info = hmp_info_cpus,
     },
+    {
+        .name       = "memory",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the host memory layout and huge page coverage "
+                      "of guest RAM blocks",
+        .mhandler.info = hmp_info_memory,
+    },
+    {
+        .name       = "startup",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show how long each startup phase took",
+        .mhandler.info = hmp_info_startup,
+    },
     {
         .name       = "history",
         .args_type  = "",
@@ -2610,6 +2839,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show the currently saved VM snapshots",
         .mhandler.info = do_info_snapshots,
     },
+    {
+        .name       = "savevm",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the progress of the live snapshot",
+        .mhandler.info = hmp_info_savevm,
+    },
     {
         .name       = "status",
         .args_type  = "",
@@ -2700,6 +2936,20 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show current migration xbzrle cache size",
         .mhandler.info = hmp_info_migrate_cache_size,
     },
+    {
+        .name       = "migrate_parameters",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show current migration compression parameters",
+        .mhandler.info = hmp_info_migrate_parameters,
+    },
+    {
+        .name       = "dump",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the progress of a live guest memory dump",
+        .mhandler.info = hmp_info_dump,
+    },
     {
         .name       = "balloon",
         .args_type  = "",
@@ -4449,18 +4699,15 @@ static void qmp_call_cmd(Monitor *mon, const mon_cmd_t *cmd,
     qobject_decref(data);
 }
 
-static void handle_qmp_command(JSONMessageParser *parser, QList *tokens)
+static void handle_qmp_input(Monitor *mon, QObject *obj)
 {
     int err;
-    QObject *obj;
     QDict *input, *args;
     const mon_cmd_t *cmd;
     const char *cmd_name;
-    Monitor *mon = cur_mon;
 
     args = input = NULL;
 
-    obj = json_parser_parse(tokens, NULL);
     if (!obj) {
         // FIXME: should be triggered in json_parser_parse()
         qerror_report(QERR_JSON_PARSING);
@@ -4502,7 +4749,12 @@ static void handle_qmp_command(JSONMessageParser *parser, QList *tokens)
         goto err_out;
     }
 
-    if (handler_is_async(cmd)) {
+    if (cmd->offload) {
+        err = qmp_offload_cmd(mon, cmd);
+        if (err) {
+            goto err_out;
+        }
+    } else if (handler_is_async(cmd)) {
         err = qmp_async_cmd_handler(mon, cmd, args);
         if (err) {
             /* emit the error response */
@@ -4521,6 +4773,31 @@ out:
     QDECREF(args);
 }
 
+static void handle_qmp_command(JSONMessageParser *parser, GQueue *tokens)
+{
+    Monitor *mon = cur_mon;
+    QObject *obj;
+
+    /* A NULL object is queued too, the parse error is reported in order */
+    obj = json_parser_parse(tokens, NULL);
+    if (mon->mc->offloaded) {
+        g_queue_push_tail(mon->mc->pending, obj);
+        return;
+    }
+    handle_qmp_input(mon, obj);
+}
+
+static void qmp_dispatch_pending(Monitor *mon)
+{
+    Monitor *old_mon = cur_mon;
+
+    cur_mon = mon;
+    while (!mon->mc->offloaded && !g_queue_is_empty(mon->mc->pending)) {
+        handle_qmp_input(mon, g_queue_pop_head(mon->mc->pending));
+    }
+    cur_mon = old_mon;
+}
+
 /**
  * monitor_control_read(): Read and handle QMP input
  */
@@ -4605,6 +4882,10 @@ static void monitor_control_event(void *opaque, int event)
     case CHR_EVENT_CLOSED:
         json_message_parser_destroy(&mon->mc->parser);
         json_message_parser_init(&mon->mc->parser, handle_qmp_command);
+        while (!g_queue_is_empty(mon->mc->pending)) {
+            qobject_decref(g_queue_pop_head(mon->mc->pending));
+        }
+        mon->mc->generation++;
         mon_refcount--;
         monitor_fdsets_cleanup();
         break;
@@ -4706,6 +4987,7 @@ void monitor_init(CharDriverState *chr, int flags)
 
     if (monitor_ctrl_mode(mon)) {
         mon->mc = g_malloc0(sizeof(MonitorControl));
+        mon->mc->pending = g_queue_new();
         /* Control mode requires special handlers */
         qemu_chr_add_handlers(chr, monitor_can_read, monitor_control_read,
                               monitor_control_event, mon);
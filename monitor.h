@@ -46,6 +46,7 @@ typedef enum MonitorEvent {
     QEVENT_WAKEUP,
     QEVENT_BALLOON_CHANGE,
     QEVENT_SPICE_MIGRATE_COMPLETED,
+    QEVENT_MIGRATION_PASS,
 
     /* Add to 'monitor_event_names' array in monitor.c when
      * defining new events here */
@@ -59,6 +59,7 @@
 
 #define NBD_REQUEST_SIZE        (4 + 4 + 8 + 8 + 4)
 #define NBD_REPLY_SIZE          (4 + 4 + 8)
+#define NBD_CHUNK_HEADER_SIZE   (4 + 2 + 2 + 8 + 4)
 #define NBD_REQUEST_MAGIC       0x25609513
 #define NBD_REPLY_MAGIC         0x67446698
 #define NBD_OPTS_MAGIC          0x49484156454F5054LL
@@ -77,6 +78,23 @@
 #define NBD_SET_FLAGS           _IO(0xab, 10)
 
 #define NBD_OPT_EXPORT_NAME     (1 << 0)
+#define NBD_OPT_STRUCTURED_REPLY 8
+#define NBD_OPT_SET_META_CONTEXT 10
+
+#define NBD_REP_MAGIC           0x0003e889045565a9LL
+#define NBD_REP_ACK             1
+#define NBD_REP_META_CONTEXT    4
+#define NBD_REP_ERR_UNSUP       ((1u << 31) | 1)
+#define NBD_REP_ERR_INVALID     ((1u << 31) | 3)
+
+/* Context id handed out for "base:allocation" */
+#define NBD_META_ALLOCATION_ID  0
+
+/* Upper bound on the option payloads that are parsed by the server */
+#define NBD_MAX_OPTION_SIZE     4096
+
+/* Extents returned for one NBD_CMD_BLOCK_STATUS request */
+#define NBD_MAX_EXTENTS         64
 
 /* Definitions for opaque data types */
 
@@ -113,6 +131,10 @@ struct NBDClient {
 
     Coroutine *recv_coroutine;
 
+    bool fixed_newstyle;
+    bool structured_reply;
+    bool alloc_context;
+
     CoMutex send_lock;
     Coroutine *send_coroutine;
 
@@ -288,20 +310,109 @@ int unix_socket_outgoing(const char *path)
 
 */
 
+static int nbd_send_option_reply(int csock, uint32_t opt, uint32_t type,
+                                 void *data, uint32_t len)
+{
+    uint8_t buf[8 + 4 + 4 + 4];
+
+    /* Option reply
+        [ 0 ..   7]   NBD_REP_MAGIC
+        [ 8 ..  11]   option
+        [12 ..  15]   reply type
+        [16 ..  19]   length
+        [20 ..  xx]   data (length bytes)
+     */
+    cpu_to_be64w((uint64_t*)buf, NBD_REP_MAGIC);
+    cpu_to_be32w((uint32_t*)(buf + 8), opt);
+    cpu_to_be32w((uint32_t*)(buf + 12), type);
+    cpu_to_be32w((uint32_t*)(buf + 16), len);
+    if (write_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
+        LOG("write failed (option reply)");
+        return -EINVAL;
+    }
+    if (len && write_sync(csock, data, len) != len) {
+        LOG("write failed (option reply data)");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int nbd_meta_context_reply(NBDClient *client, uint8_t *data,
+                                  uint32_t length)
+{
+    int csock = client->sock;
+    uint32_t len, nb_queries, i;
+    uint8_t reply[4 + sizeof(NBD_META_BASE_ALLOCATION) - 1];
+
+    /* Option data
+        [ 0 ..   3]   export name length
+        [ 4 ..  xx]   export name
+        [xx .. +3]   number of queries
+        followed by each query as length + string
+     */
+    if (length < 8 || (len = be32_to_cpup((uint32_t*)data)) > length - 8) {
+        goto invalid;
+    }
+    data += 4 + len;
+    length -= 4 + len;
+    nb_queries = be32_to_cpup((uint32_t*)data);
+    data += 4;
+    length -= 4;
+
+    client->alloc_context = false;
+    for (i = 0; i < nb_queries; i++) {
+        if (length < 4 || (len = be32_to_cpup((uint32_t*)data)) > length - 4) {
+            goto invalid;
+        }
+        data += 4;
+        length -= 4;
+        if (len == strlen(NBD_META_BASE_ALLOCATION) &&
+            !memcmp(data, NBD_META_BASE_ALLOCATION, len)) {
+            client->alloc_context = true;
+        }
+        data += len;
+        length -= len;
+    }
+
+    if (client->alloc_context) {
+        cpu_to_be32w((uint32_t*)reply, NBD_META_ALLOCATION_ID);
+        memcpy(reply + 4, NBD_META_BASE_ALLOCATION, sizeof(reply) - 4);
+        if (nbd_send_option_reply(csock, NBD_OPT_SET_META_CONTEXT,
+                                  NBD_REP_META_CONTEXT,
+                                  reply, sizeof(reply)) < 0) {
+            return -EINVAL;
+        }
+    }
+    return nbd_send_option_reply(csock, NBD_OPT_SET_META_CONTEXT,
+                                 NBD_REP_ACK, NULL, 0);
+
+invalid:
+    client->alloc_context = false;
+    return nbd_send_option_reply(csock, NBD_OPT_SET_META_CONTEXT,
+                                 NBD_REP_ERR_INVALID, NULL, 0);
+}
+
 static int nbd_receive_options(NBDClient *client)
 {
     int csock = client->sock;
     char name[256];
-    uint32_t tmp, length;
+    uint8_t *data = NULL;
+    uint32_t tmp, opt, length;
     uint64_t magic;
     int rc;
 
     /* Client sends:
-        [ 0 ..   3]   reserved (0)
-        [ 4 ..  11]   NBD_OPTS_MAGIC
-        [12 ..  15]   NBD_OPT_EXPORT_NAME
-        [16 ..  19]   length
-        [20 ..  xx]   export name (length bytes)
+        [ 0 ..   3]   client flags
+
+       followed by any number of options, the last one being
+       NBD_OPT_EXPORT_NAME:
+        [ 0 ..   7]   NBD_OPTS_MAGIC
+        [ 8 ..  11]   option
+        [12 ..  15]   length
+        [16 ..  xx]   option data (length bytes)
+
+       Every option except NBD_OPT_EXPORT_NAME is answered with one or
+       more option replies; only fixed-newstyle clients may send them.
      */
 
     rc = -EINVAL;
@@ -309,38 +420,82 @@ static int nbd_receive_options(NBDClient *client)
         LOG("read failed");
         goto fail;
     }
-    TRACE("Checking reserved");
-    if (tmp != 0) {
-        LOG("Bad reserved received");
+    TRACE("Checking client flags");
+    tmp = be32_to_cpu(tmp);
+    if (tmp & ~NBD_FLAG_C_FIXED_NEWSTYLE) {
+        LOG("Bad client flags received");
         goto fail;
     }
+    client->fixed_newstyle = tmp & NBD_FLAG_C_FIXED_NEWSTYLE;
 
-    if (read_sync(csock, &magic, sizeof(magic)) != sizeof(magic)) {
-        LOG("read failed");
-        goto fail;
-    }
-    TRACE("Checking reserved");
-    if (magic != be64_to_cpu(NBD_OPTS_MAGIC)) {
-        LOG("Bad magic received");
-        goto fail;
-    }
+    for (;;) {
+        if (read_sync(csock, &magic, sizeof(magic)) != sizeof(magic)) {
+            LOG("read failed");
+            goto fail;
+        }
+        TRACE("Checking opts magic");
+        if (magic != be64_to_cpu(NBD_OPTS_MAGIC)) {
+            LOG("Bad magic received");
+            goto fail;
+        }
 
-    if (read_sync(csock, &tmp, sizeof(tmp)) != sizeof(tmp)) {
-        LOG("read failed");
-        goto fail;
-    }
-    TRACE("Checking option");
-    if (tmp != be32_to_cpu(NBD_OPT_EXPORT_NAME)) {
-        LOG("Bad option received");
-        goto fail;
-    }
+        if (read_sync(csock, &opt, sizeof(opt)) != sizeof(opt) ||
+            read_sync(csock, &length, sizeof(length)) != sizeof(length)) {
+            LOG("read failed");
+            goto fail;
+        }
+        opt = be32_to_cpu(opt);
+        length = be32_to_cpu(length);
+        TRACE("Checking option %u", opt);
 
-    if (read_sync(csock, &length, sizeof(length)) != sizeof(length)) {
-        LOG("read failed");
-        goto fail;
+        if (opt == NBD_OPT_EXPORT_NAME) {
+            break;
+        }
+        if (!client->fixed_newstyle) {
+            LOG("Bad option received");
+            goto fail;
+        }
+        if (length > NBD_MAX_OPTION_SIZE) {
+            LOG("Bad option length received");
+            goto fail;
+        }
+
+        data = g_realloc(data, length);
+        if (read_sync(csock, data, length) != length) {
+            LOG("read failed");
+            goto fail;
+        }
+
+        switch (opt) {
+        case NBD_OPT_STRUCTURED_REPLY:
+            if (length) {
+                rc = nbd_send_option_reply(csock, opt, NBD_REP_ERR_INVALID,
+                                           NULL, 0);
+                break;
+            }
+            client->structured_reply = true;
+            rc = nbd_send_option_reply(csock, opt, NBD_REP_ACK, NULL, 0);
+            break;
+        case NBD_OPT_SET_META_CONTEXT:
+            if (!client->structured_reply) {
+                rc = nbd_send_option_reply(csock, opt, NBD_REP_ERR_INVALID,
+                                           NULL, 0);
+                break;
+            }
+            rc = nbd_meta_context_reply(client, data, length);
+            break;
+        default:
+            rc = nbd_send_option_reply(csock, opt, NBD_REP_ERR_UNSUP,
+                                       NULL, 0);
+            break;
+        }
+        if (rc < 0) {
+            goto fail;
+        }
+        rc = -EINVAL;
     }
+
     TRACE("Checking length");
-    length = be32_to_cpu(length);
     if (length > 255) {
         LOG("Bad length received");
         goto fail;
@@ -363,6 +518,7 @@ static int nbd_receive_options(NBDClient *client)
     TRACE("Option negotiation succeeded.");
     rc = 0;
 fail:
+    g_free(data);
     return rc;
 }
 
@@ -372,7 +528,8 @@ static int nbd_send_negotiate(NBDClient *client)
     char buf[8 + 8 + 8 + 128];
     int rc;
     const int myflags = (NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_TRIM |
-                         NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA);
+                         NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA |
+                         NBD_FLAG_CAN_MULTI_CONN);
 
     /* Negotiation header without options:
         [ 0 ..   7]   passwd       ("NBDMAGIC")
@@ -385,7 +542,7 @@ static int nbd_send_negotiate(NBDClient *client)
        Negotiation header with options, part 1:
         [ 0 ..   7]   passwd       ("NBDMAGIC")
         [ 8 ..  15]   magic        (NBD_OPTS_MAGIC)
-        [16 ..  17]   server flags (0)
+        [16 ..  17]   server flags (NBD_FLAG_FIXED_NEWSTYLE)
 
        part 2 (after options are sent):
         [18 ..  25]   size
@@ -406,6 +563,7 @@ static int nbd_send_negotiate(NBDClient *client)
         cpu_to_be16w((uint16_t*)(buf + 26), client->exp->nbdflags | myflags);
     } else {
         cpu_to_be64w((uint64_t*)(buf + 8), NBD_OPTS_MAGIC);
+        cpu_to_be16w((uint16_t*)(buf + 16), NBD_FLAG_FIXED_NEWSTYLE);
     }
 
     if (client->exp) {
@@ -440,8 +598,132 @@ fail:
     return rc;
 }
 
+static int nbd_drain_sync(int csock, uint32_t len)
+{
+    char buf[256];
+
+    while (len > 0) {
+        uint32_t n = MIN(len, sizeof(buf));
+        if (read_sync(csock, buf, n) != n) {
+            LOG("read failed (drain)");
+            return -EINVAL;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+static int nbd_send_option(int csock, uint32_t opt, void *data, uint32_t len)
+{
+    uint8_t buf[8 + 4 + 4];
+
+    cpu_to_be64w((uint64_t*)buf, NBD_OPTS_MAGIC);
+    cpu_to_be32w((uint32_t*)(buf + 8), opt);
+    cpu_to_be32w((uint32_t*)(buf + 12), len);
+    if (write_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
+        LOG("write failed (option)");
+        return -EINVAL;
+    }
+    if (len && write_sync(csock, data, len) != len) {
+        LOG("write failed (option data)");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int nbd_receive_option_reply(int csock, uint32_t opt, uint32_t *type,
+                                    uint32_t *len)
+{
+    uint8_t buf[8 + 4 + 4 + 4];
+
+    if (read_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
+        LOG("read failed (option reply)");
+        return -EINVAL;
+    }
+    if (be64_to_cpup((uint64_t*)buf) != NBD_REP_MAGIC ||
+        be32_to_cpup((uint32_t*)(buf + 8)) != opt) {
+        LOG("Bad option reply received");
+        return -EINVAL;
+    }
+    *type = be32_to_cpup((uint32_t*)(buf + 12));
+    *len = be32_to_cpup((uint32_t*)(buf + 16));
+    return 0;
+}
+
+/* Ask a fixed-newstyle server for structured replies and for the
+ * allocation metadata context.  Refusals are not errors, they only
+ * leave the corresponding extension disabled.
+ */
+static int nbd_negotiate_extensions(int csock, const char *name,
+                                    NBDExtensions *ext)
+{
+    size_t namelen = strlen(name);
+    size_t querylen = strlen(NBD_META_BASE_ALLOCATION);
+    uint32_t type, len, id;
+    uint8_t *buf;
+    char reply[256];
+    int rc;
+
+    if (nbd_send_option(csock, NBD_OPT_STRUCTURED_REPLY, NULL, 0) < 0 ||
+        nbd_receive_option_reply(csock, NBD_OPT_STRUCTURED_REPLY,
+                                 &type, &len) < 0 ||
+        nbd_drain_sync(csock, len) < 0) {
+        return -EINVAL;
+    }
+    if (type != NBD_REP_ACK) {
+        TRACE("Server refused structured replies");
+        return 0;
+    }
+    ext->structured_reply = true;
+
+    /* Option data
+        [ 0 ..   3]   export name length
+        [ 4 ..  xx]   export name
+        [xx .. +3]   number of queries (1)
+        [xx .. +3]   query length
+        [xx .. yy]   NBD_META_BASE_ALLOCATION
+     */
+    len = 4 + namelen + 4 + 4 + querylen;
+    buf = g_malloc(len);
+    cpu_to_be32w((uint32_t*)buf, namelen);
+    memcpy(buf + 4, name, namelen);
+    cpu_to_be32w((uint32_t*)(buf + 4 + namelen), 1);
+    cpu_to_be32w((uint32_t*)(buf + 8 + namelen), querylen);
+    memcpy(buf + 12 + namelen, NBD_META_BASE_ALLOCATION, querylen);
+    rc = nbd_send_option(csock, NBD_OPT_SET_META_CONTEXT, buf, len);
+    g_free(buf);
+    if (rc < 0) {
+        return rc;
+    }
+
+    for (;;) {
+        if (nbd_receive_option_reply(csock, NBD_OPT_SET_META_CONTEXT,
+                                     &type, &len) < 0) {
+            return -EINVAL;
+        }
+        if (type != NBD_REP_META_CONTEXT) {
+            if (type != NBD_REP_ACK) {
+                ext->block_status = false;
+            }
+            return nbd_drain_sync(csock, len);
+        }
+
+        if (len < 4 || len - 4 >= sizeof(reply) ||
+            read_sync(csock, &id, sizeof(id)) != sizeof(id) ||
+            read_sync(csock, reply, len - 4) != len - 4) {
+            LOG("Bad meta context reply received");
+            return -EINVAL;
+        }
+        reply[len - 4] = '\0';
+        if (!strcmp(reply, NBD_META_BASE_ALLOCATION)) {
+            ext->block_status = true;
+            ext->alloc_context_id = be32_to_cpu(id);
+        }
+    }
+}
+
 int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
-                          off_t *size, size_t *blocksize)
+                          off_t *size, size_t *blocksize, NBDExtensions *ext)
 {
     char buf[256];
     uint64_t magic, s;
@@ -450,6 +732,10 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
 
     TRACE("Receiving negotiation.");
 
+    if (ext) {
+        memset(ext, 0, sizeof(*ext));
+    }
+
     socket_set_block(csock);
     rc = -EINVAL;
 
@@ -487,7 +773,7 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
     TRACE("Magic is 0x%" PRIx64, magic);
 
     if (name) {
-        uint32_t reserved = 0;
+        uint32_t client_flags = 0;
         uint32_t opt;
         uint32_t namesize;
 
@@ -501,10 +787,17 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
             goto fail;
         }
         *flags = be16_to_cpu(tmp) << 16;
-        /* reserved for future use */
-        if (write_sync(csock, &reserved, sizeof(reserved)) !=
-            sizeof(reserved)) {
-            LOG("write failed (reserved)");
+        if (*flags & (NBD_FLAG_FIXED_NEWSTYLE << 16)) {
+            client_flags = cpu_to_be32(NBD_FLAG_C_FIXED_NEWSTYLE);
+        }
+        if (write_sync(csock, &client_flags, sizeof(client_flags)) !=
+            sizeof(client_flags)) {
+            LOG("write failed (client flags)");
+            goto fail;
+        }
+        if (client_flags && ext &&
+            nbd_negotiate_extensions(csock, name, ext) < 0) {
+            LOG("option negotiation failed");
             goto fail;
         }
         /* write the export name */
@@ -556,7 +849,7 @@ int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
             LOG("read failed (tmp)");
             goto fail;
         }
-        *flags |= be32_to_cpu(tmp);
+        *flags |= be16_to_cpu(tmp);
     }
     if (read_sync(csock, &buf, 124) != 124) {
         LOG("read failed (buf)");
@@ -759,12 +1052,48 @@ ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply)
        [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
        [ 7 .. 15]    handle
+
+       Structured reply chunk
+       [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+       [ 4 ..  5]    flags
+       [ 6 ..  7]    type
+       [ 8 .. 15]    handle
+       [16 .. 19]    length of the payload that follows
      */
 
     magic = be32_to_cpup((uint32_t*)buf);
-    reply->error  = be32_to_cpup((uint32_t*)(buf + 4));
+    reply->magic = magic;
     reply->handle = be64_to_cpup((uint64_t*)(buf + 8));
 
+    if (magic == NBD_STRUCTURED_REPLY_MAGIC) {
+        uint32_t length;
+
+        /* The header was sent with a single write, so the remaining
+         * bytes are on their way.
+         */
+        do {
+            ret = read_sync(csock, &length, sizeof(length));
+        } while (ret == -EAGAIN);
+        if (ret != sizeof(length)) {
+            LOG("read failed");
+            return -EINVAL;
+        }
+        reply->error = 0;
+        reply->flags = be16_to_cpup((uint16_t*)(buf + 4));
+        reply->type = be16_to_cpup((uint16_t*)(buf + 6));
+        reply->length = be32_to_cpu(length);
+
+        TRACE("Got chunk: "
+              "{ .flags = %#x, .type = %d, handle = %" PRIu64", .length = %u }",
+              reply->flags, reply->type, reply->handle, reply->length);
+        return 0;
+    }
+
+    reply->error  = be32_to_cpup((uint32_t*)(buf + 4));
+    reply->flags = NBD_REPLY_FLAG_DONE;
+    reply->type = NBD_REPLY_TYPE_NONE;
+    reply->length = 0;
+
     TRACE("Got reply: "
           "{ magic = 0x%x, .error = %d, handle = %" PRIu64" }",
           magic, reply->error, reply->handle);
@@ -1021,6 +1350,207 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
     return rc;
 }
 
+static ssize_t nbd_co_send_chunk(NBDRequest *req, uint64_t handle,
+                                 uint16_t flags, uint16_t type,
+                                 struct iovec *payload, int niov)
+{
+    NBDClient *client = req->client;
+    int csock = client->sock;
+    uint8_t buf[NBD_CHUNK_HEADER_SIZE];
+    struct iovec iov[4];
+    size_t len = 0;
+    ssize_t rc;
+    int i;
+
+    assert(client->structured_reply);
+    assert(niov < ARRAY_SIZE(iov));
+    for (i = 0; i < niov; i++) {
+        iov[i + 1] = payload[i];
+        len += payload[i].iov_len;
+    }
+
+    /* Structured reply chunk
+       [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+       [ 4 ..  5]    flags
+       [ 6 ..  7]    type
+       [ 8 .. 15]    handle
+       [16 .. 19]    length of the payload
+     */
+    cpu_to_be32w((uint32_t*)buf, NBD_STRUCTURED_REPLY_MAGIC);
+    cpu_to_be16w((uint16_t*)(buf + 4), flags);
+    cpu_to_be16w((uint16_t*)(buf + 6), type);
+    cpu_to_be64w((uint64_t*)(buf + 8), handle);
+    cpu_to_be32w((uint32_t*)(buf + 16), len);
+    iov[0].iov_base = buf;
+    iov[0].iov_len = sizeof(buf);
+    len += sizeof(buf);
+
+    TRACE("Sending chunk to client: { .flags = %#x, .type = %d }",
+          flags, type);
+
+    qemu_co_mutex_lock(&client->send_lock);
+    qemu_set_fd_handler2(csock, nbd_can_read, nbd_read,
+                         nbd_restart_write, client);
+    client->send_coroutine = qemu_coroutine_self();
+
+    rc = qemu_co_sendv(csock, iov, niov + 1, 0, len);
+    rc = (rc == len) ? 0 : -EIO;
+
+    client->send_coroutine = NULL;
+    qemu_set_fd_handler2(csock, nbd_can_read, nbd_read, NULL, client);
+    qemu_co_mutex_unlock(&client->send_lock);
+    return rc;
+}
+
+static ssize_t nbd_co_send_structured_error(NBDRequest *req, uint64_t handle,
+                                            uint32_t error)
+{
+    uint8_t buf[4 + 2];
+    struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+
+    /* Error chunk payload
+       [ 0 ..  3]    error
+       [ 4 ..  5]    message length (0)
+     */
+    cpu_to_be32w((uint32_t*)buf, error);
+    cpu_to_be16w((uint16_t*)(buf + 4), 0);
+    return nbd_co_send_chunk(req, handle, NBD_REPLY_FLAG_DONE,
+                             NBD_REPLY_TYPE_ERROR, &iov, 1);
+}
+
+/* Send a read reply as a sequence of data and hole chunks, so that
+ * unallocated parts of the image are not transferred.  Returns a
+ * negative value only if the connection is broken; I/O errors are
+ * reported to the client with an error chunk.
+ */
+static ssize_t nbd_co_read_structured(NBDRequest *req,
+                                      struct nbd_request *request)
+{
+    NBDExport *exp = req->client->exp;
+    int64_t sector_num = (request->from + exp->dev_offset) / 512;
+    int nb_sectors = request->len / 512;
+    uint32_t offset = 0;
+    uint8_t buf[8 + 4];
+    struct iovec iov[2];
+    QEMUIOVector qiov;
+    uint16_t flags;
+    int ret, n;
+
+    if (nb_sectors == 0) {
+        return nbd_co_send_chunk(req, request->handle, NBD_REPLY_FLAG_DONE,
+                                 NBD_REPLY_TYPE_NONE, NULL, 0);
+    }
+
+    while (nb_sectors > 0) {
+        ret = bdrv_co_is_allocated_above(exp->bs, NULL, sector_num,
+                                         nb_sectors, &n);
+        if (ret < 0) {
+            return nbd_co_send_structured_error(req, request->handle, -ret);
+        }
+        if (n == 0) {
+            /* Past the end of the backing chain, read it normally */
+            n = nb_sectors;
+            ret = 1;
+        }
+        flags = (n == nb_sectors) ? NBD_REPLY_FLAG_DONE : 0;
+
+        /* Data and hole chunk payloads
+           [ 0 ..  7]    offset
+           [ 8 .. xx]    data (NBD_REPLY_TYPE_OFFSET_DATA)
+           [ 8 .. 11]    hole size (NBD_REPLY_TYPE_OFFSET_HOLE)
+         */
+        cpu_to_be64w((uint64_t*)buf, request->from + offset);
+        iov[0].iov_base = buf;
+        if (ret) {
+            iov[0].iov_len = 8;
+            iov[1].iov_base = req->data + offset;
+            iov[1].iov_len = n * 512;
+            qemu_iovec_init_external(&qiov, &iov[1], 1);
+            ret = bdrv_co_readv(exp->bs, sector_num, n, &qiov);
+            if (ret < 0) {
+                LOG("reading from file failed");
+                return nbd_co_send_structured_error(req, request->handle,
+                                                    -ret);
+            }
+            ret = nbd_co_send_chunk(req, request->handle, flags,
+                                    NBD_REPLY_TYPE_OFFSET_DATA, iov, 2);
+        } else {
+            iov[0].iov_len = 12;
+            cpu_to_be32w((uint32_t*)(buf + 8), n * 512);
+            ret = nbd_co_send_chunk(req, request->handle, flags,
+                                    NBD_REPLY_TYPE_OFFSET_HOLE, iov, 1);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        offset += n * 512;
+    }
+    return 0;
+}
+
+/* Describe the allocation status of the requested range in the
+ * "base:allocation" context.  Unallocated sectors read as zeroes
+ * because the whole backing chain is consulted.
+ */
+static ssize_t nbd_co_block_status(NBDRequest *req,
+                                   struct nbd_request *request)
+{
+    NBDExport *exp = req->client->exp;
+    int64_t sector_num = (request->from + exp->dev_offset) / 512;
+    int nb_sectors = request->len / 512;
+    int max = (request->type & NBD_CMD_FLAG_REQ_ONE) ? 1 : NBD_MAX_EXTENTS;
+    struct nbd_extent *extents = (struct nbd_extent *)(req->data + 4);
+    struct iovec iov;
+    uint32_t state;
+    int ret, n, count = 0;
+
+    /* Block status chunk payload
+       [ 0 ..  3]    context id
+       [ 4 .. xx]    extents, each one being
+                     [ 0 ..  3] length
+                     [ 4 ..  7] NBD_STATE_* flags
+     */
+    while (nb_sectors > 0) {
+        ret = bdrv_co_is_allocated_above(exp->bs, NULL, sector_num,
+                                         nb_sectors, &n);
+        if (ret < 0) {
+            return nbd_co_send_structured_error(req, request->handle, -ret);
+        }
+        if (n == 0) {
+            break;
+        }
+        state = ret ? 0 : NBD_STATE_HOLE | NBD_STATE_ZERO;
+        if (count && extents[count - 1].flags == state) {
+            extents[count - 1].length += n * 512;
+        } else if (count == max) {
+            break;
+        } else {
+            extents[count].length = n * 512;
+            extents[count].flags = state;
+            count++;
+        }
+        sector_num += n;
+        nb_sectors -= n;
+    }
+
+    if (count == 0) {
+        return nbd_co_send_structured_error(req, request->handle, EINVAL);
+    }
+
+    cpu_to_be32w((uint32_t*)req->data, NBD_META_ALLOCATION_ID);
+    for (n = 0; n < count; n++) {
+        extents[n].length = cpu_to_be32(extents[n].length);
+        extents[n].flags = cpu_to_be32(extents[n].flags);
+    }
+    iov.iov_base = req->data;
+    iov.iov_len = 4 + count * sizeof(struct nbd_extent);
+    return nbd_co_send_chunk(req, request->handle, NBD_REPLY_FLAG_DONE,
+                             NBD_REPLY_TYPE_BLOCK_STATUS, &iov, 1);
+}
+
 static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *request)
 {
     NBDClient *client = req->client;
@@ -1036,7 +1566,9 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
         goto out;
     }
 
-    if (request->len > NBD_BUFFER_SIZE) {
+    /* Block status replies do not depend on the request length */
+    if (request->len > NBD_BUFFER_SIZE &&
+        (request->type & NBD_CMD_MASK_COMMAND) != NBD_CMD_BLOCK_STATUS) {
         LOG("len (%u) is larger than max len (%u)",
             request->len, NBD_BUFFER_SIZE);
         rc = -EINVAL;
@@ -1121,6 +1653,13 @@ static void nbd_trip(void *opaque)
             }
         }
 
+        if (client->structured_reply) {
+            if (nbd_co_read_structured(req, &request) < 0) {
+                goto out;
+            }
+            break;
+        }
+
         ret = bdrv_read(exp->bs, (request.from + exp->dev_offset) / 512,
                         req->data, request.len / 512);
         if (ret < 0) {
@@ -1193,12 +1732,27 @@ static void nbd_trip(void *opaque)
             goto out;
         }
         break;
+    case NBD_CMD_BLOCK_STATUS:
+        TRACE("Request type is BLOCK_STATUS");
+        if (!client->alloc_context) {
+            goto invalid_request;
+        }
+        if (nbd_co_block_status(req, &request) < 0) {
+            goto out;
+        }
+        break;
     default:
         LOG("invalid request type (%u) received", request.type);
     invalid_request:
-        reply.error = -EINVAL;
+        reply.error = EINVAL;
     error_reply:
-        if (nbd_co_send_reply(req, &reply, 0) < 0) {
+        if (client->structured_reply) {
+            ret = nbd_co_send_structured_error(req, reply.handle,
+                                               reply.error);
+        } else {
+            ret = nbd_co_send_reply(req, &reply, 0);
+        }
+        if (ret < 0) {
             goto out;
         }
         break;
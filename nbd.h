@@ -35,26 +35,68 @@ struct nbd_reply {
     uint32_t magic;
     uint32_t error;
     uint64_t handle;
+    /* Only meaningful for structured reply chunks */
+    uint16_t flags;
+    uint16_t type;
+    uint32_t length;
 } QEMU_PACKED;
 
+struct nbd_extent {
+    uint32_t length;
+    uint32_t flags;
+} QEMU_PACKED;
+
+/* Protocol extensions negotiated with NBD_OPT_* in the newstyle handshake */
+typedef struct NBDExtensions {
+    bool structured_reply;
+    bool block_status;
+    uint32_t alloc_context_id;      /* context id of "base:allocation" */
+} NBDExtensions;
+
+#define NBD_STRUCTURED_REPLY_MAGIC  0x668e33ef
+
 #define NBD_FLAG_HAS_FLAGS      (1 << 0)        /* Flags are there */
 #define NBD_FLAG_READ_ONLY      (1 << 1)        /* Device is read-only */
 #define NBD_FLAG_SEND_FLUSH     (1 << 2)        /* Send FLUSH */
 #define NBD_FLAG_SEND_FUA       (1 << 3)        /* Send FUA (Force Unit Access) */
 #define NBD_FLAG_ROTATIONAL     (1 << 4)        /* Use elevator algorithm - rotational media */
 #define NBD_FLAG_SEND_TRIM      (1 << 5)        /* Send TRIM (discard) */
+#define NBD_FLAG_CAN_MULTI_CONN (1 << 8)        /* Multiple connections are coherent */
+
+/* Handshake flags sent by the server and by the client in newstyle */
+#define NBD_FLAG_FIXED_NEWSTYLE   (1 << 0)
+#define NBD_FLAG_C_FIXED_NEWSTYLE (1 << 0)
 
 #define NBD_CMD_MASK_COMMAND	0x0000ffff
 #define NBD_CMD_FLAG_FUA	(1 << 16)
+#define NBD_CMD_FLAG_REQ_ONE	(1 << 19)
 
 enum {
     NBD_CMD_READ = 0,
     NBD_CMD_WRITE = 1,
     NBD_CMD_DISC = 2,
     NBD_CMD_FLUSH = 3,
-    NBD_CMD_TRIM = 4
+    NBD_CMD_TRIM = 4,
+    NBD_CMD_BLOCK_STATUS = 7,
 };
 
+/* Structured reply chunks */
+#define NBD_REPLY_FLAG_DONE         (1 << 0)
+
+#define NBD_REPLY_TYPE_NONE         0
+#define NBD_REPLY_TYPE_OFFSET_DATA  1
+#define NBD_REPLY_TYPE_OFFSET_HOLE  2
+#define NBD_REPLY_TYPE_BLOCK_STATUS 5
+#define NBD_REPLY_TYPE_ERROR        ((1 << 15) + 1)
+#define NBD_REPLY_TYPE_ERROR_OFFSET ((1 << 15) + 2)
+#define NBD_REPLY_TYPE_IS_ERR(type) ((type) & (1 << 15))
+
+/* Extent flags for the "base:allocation" metadata context */
+#define NBD_STATE_HOLE              (1 << 0)
+#define NBD_STATE_ZERO              (1 << 1)
+
+#define NBD_META_BASE_ALLOCATION    "base:allocation"
+
 #define NBD_DEFAULT_PORT	10809
 
 #define NBD_BUFFER_SIZE (1024*1024)
@@ -68,7 +110,7 @@ int unix_socket_outgoing(const char *path);
 int unix_socket_incoming(const char *path);
 
 int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
-                          off_t *size, size_t *blocksize);
+                          off_t *size, size_t *blocksize, NBDExtensions *ext);
 int nbd_init(int fd, int csock, uint32_t flags, off_t size, size_t blocksize);
 ssize_t nbd_send_request(int csock, struct nbd_request *request);
 ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply);
@@ -181,17 +181,18 @@ static char *assign_name(NetClientState *nc1, const char *model)
     return g_strdup(buf);
 }
 
-NetClientState *qemu_new_net_client(NetClientInfo *info,
-                                    NetClientState *peer,
-                                    const char *model,
-                                    const char *name)
+static void qemu_net_client_destructor(NetClientState *nc)
 {
-    NetClientState *nc;
-
-    assert(info->size >= sizeof(NetClientState));
-
-    nc = g_malloc0(info->size);
+    g_free(nc);
+}
 
+static void qemu_net_client_setup(NetClientState *nc,
+                                  NetClientInfo *info,
+                                  NetClientState *peer,
+                                  const char *model,
+                                  const char *name,
+                                  NetClientDestructor *destructor)
+{
     nc->info = info;
     nc->model = g_strdup(model);
     if (name) {
@@ -208,6 +209,21 @@ NetClientState *qemu_new_net_client(NetClientInfo *info,
     QTAILQ_INSERT_TAIL(&net_clients, nc, next);
 
     nc->send_queue = qemu_new_net_queue(nc);
+    nc->destructor = destructor;
+}
+
+NetClientState *qemu_new_net_client(NetClientInfo *info,
+                                    NetClientState *peer,
+                                    const char *model,
+                                    const char *name)
+{
+    NetClientState *nc;
+
+    assert(info->size >= sizeof(NetClientState));
+
+    nc = g_malloc0(info->size);
+    qemu_net_client_setup(nc, info, peer, model, name,
+                          qemu_net_client_destructor);
 
     return nc;
 }
@@ -218,21 +234,54 @@ NICState *qemu_new_nic(NetClientInfo *info,
                        const char *name,
                        void *opaque)
 {
-    NetClientState *nc;
+    NetClientState **peers = conf->peers.ncs;
     NICState *nic;
+    int i, queues = MAX(1, conf->peers.queues);
 
     assert(info->type == NET_CLIENT_OPTIONS_KIND_NIC);
     assert(info->size >= sizeof(NICState));
 
-    nc = qemu_new_net_client(info, conf->peer, model, name);
-
-    nic = DO_UPCAST(NICState, nc, nc);
+    /* The queues are allocated right after the NICState so that
+     * qemu_get_nic() can find its way back from any of them.
+     */
+    nic = g_malloc0(info->size + sizeof(NetClientState) * queues);
+    nic->ncs = (void *)nic + info->size;
     nic->conf = conf;
     nic->opaque = opaque;
 
+    for (i = 0; i < queues; i++) {
+        qemu_net_client_setup(&nic->ncs[i], info, peers[i], model, name,
+                              NULL);
+        nic->ncs[i].queue_index = i;
+    }
+
     return nic;
 }
 
+NetClientState *qemu_get_subqueue(NICState *nic, int queue_index)
+{
+    return nic->ncs + queue_index;
+}
+
+NetClientState *qemu_get_queue(NICState *nic)
+{
+    return qemu_get_subqueue(nic, 0);
+}
+
+NICState *qemu_get_nic(NetClientState *nc)
+{
+    NetClientState *nc0 = nc - nc->queue_index;
+
+    return (NICState *)((void *)nc0 - nc->info->size);
+}
+
+void *qemu_get_nic_opaque(NetClientState *nc)
+{
+    NICState *nic = qemu_get_nic(nc);
+
+    return nic->opaque;
+}
+
 static void qemu_cleanup_net_client(NetClientState *nc)
 {
     QTAILQ_REMOVE(&net_clients, nc, next);
@@ -252,37 +301,75 @@ static void qemu_free_net_client(NetClientState *nc)
     }
     g_free(nc->name);
     g_free(nc->model);
-    g_free(nc);
+    if (nc->destructor) {
+        nc->destructor(nc);
+    }
 }
 
 void qemu_del_net_client(NetClientState *nc)
 {
+    NetClientState *ncs[MAX_QUEUE_NUM];
+    int queues, i;
+
+    /* If the NetClientState belongs to a multiqueue backend, we will change all
+     * other NetClientStates also.
+     */
+    queues = qemu_find_net_clients_except(nc->name, ncs,
+                                          NET_CLIENT_OPTIONS_KIND_NIC,
+                                          MAX_QUEUE_NUM);
+    assert(queues != 0);
+
     /* If there is a peer NIC, delete and cleanup client, but do not free. */
     if (nc->peer && nc->peer->info->type == NET_CLIENT_OPTIONS_KIND_NIC) {
-        NICState *nic = DO_UPCAST(NICState, nc, nc->peer);
+        NICState *nic = qemu_get_nic(nc->peer);
         if (nic->peer_deleted) {
             return;
         }
         nic->peer_deleted = true;
+
+        for (i = 0; i < queues; i++) {
+            ncs[i]->peer->link_down = true;
+        }
+
         /* Let NIC know peer is gone. */
-        nc->peer->link_down = true;
         if (nc->peer->info->link_status_changed) {
             nc->peer->info->link_status_changed(nc->peer);
         }
-        qemu_cleanup_net_client(nc);
+
+        for (i = 0; i < queues; i++) {
+            qemu_cleanup_net_client(ncs[i]);
+        }
+
         return;
     }
 
+    assert(nc->info->type != NET_CLIENT_OPTIONS_KIND_NIC);
+
+    for (i = 0; i < queues; i++) {
+        qemu_cleanup_net_client(ncs[i]);
+        qemu_free_net_client(ncs[i]);
+    }
+}
+
+void qemu_del_nic(NICState *nic)
+{
+    int i, queues = MAX(nic->conf->peers.queues, 1);
+
     /* If this is a peer NIC and peer has already been deleted, free it now. */
-    if (nc->peer && nc->info->type == NET_CLIENT_OPTIONS_KIND_NIC) {
-        NICState *nic = DO_UPCAST(NICState, nc, nc);
-        if (nic->peer_deleted) {
-            qemu_free_net_client(nc->peer);
+    if (nic->peer_deleted) {
+        for (i = 0; i < queues; i++) {
+            qemu_free_net_client(qemu_get_subqueue(nic, i)->peer);
         }
     }
 
-    qemu_cleanup_net_client(nc);
-    qemu_free_net_client(nc);
+    for (i = queues - 1; i >= 0; i--) {
+        NetClientState *nc = qemu_get_subqueue(nic, i);
+
+        qemu_cleanup_net_client(nc);
+        qemu_free_net_client(nc);
+    }
+
+    g_free(nic);
 }
 
 void qemu_foreach_nic(qemu_nic_foreach func, void *opaque)
@@ -291,11 +378,68 @@ void qemu_foreach_nic(qemu_nic_foreach func, void *opaque)
 
     QTAILQ_FOREACH(nc, &net_clients, next) {
         if (nc->info->type == NET_CLIENT_OPTIONS_KIND_NIC) {
-            func(DO_UPCAST(NICState, nc, nc), opaque);
+            if (nc->queue_index == 0) {
+                func(qemu_get_nic(nc), opaque);
+            }
         }
     }
 }
 
+int qemu_has_ufo(NetClientState *nc)
+{
+    if (!nc || !nc->info->has_ufo) {
+        return 0;
+    }
+
+    return nc->info->has_ufo(nc);
+}
+
+int qemu_has_vnet_hdr(NetClientState *nc)
+{
+    if (!nc || !nc->info->has_vnet_hdr) {
+        return 0;
+    }
+
+    return nc->info->has_vnet_hdr(nc);
+}
+
+int qemu_has_vnet_hdr_len(NetClientState *nc, int len)
+{
+    if (!nc || !nc->info->has_vnet_hdr_len) {
+        return 0;
+    }
+
+    return nc->info->has_vnet_hdr_len(nc, len);
+}
+
+void qemu_using_vnet_hdr(NetClientState *nc, int enable)
+{
+    if (!nc || !nc->info->using_vnet_hdr) {
+        return;
+    }
+
+    nc->info->using_vnet_hdr(nc, enable);
+}
+
+void qemu_set_offload(NetClientState *nc, int csum, int tso4, int tso6,
+                      int ecn, int ufo)
+{
+    if (!nc || !nc->info->set_offload) {
+        return;
+    }
+
+    nc->info->set_offload(nc, csum, tso4, tso6, ecn, ufo);
+}
+
+void qemu_set_vnet_hdr_len(NetClientState *nc, int len)
+{
+    if (!nc || !nc->info->set_vnet_hdr_len) {
+        return;
+    }
+
+    nc->info->set_vnet_hdr_len(nc, len);
+}
+
 int qemu_can_send_packet(NetClientState *sender)
 {
     if (!sender->peer) {
@@ -321,6 +465,7 @@ ssize_t qemu_deliver_packet(NetClientState *sender,
     ssize_t ret;
 
     if (nc->link_down) {
+        nc->stats.rx_dropped++;
         return size;
     }
 
@@ -336,7 +481,11 @@ ssize_t qemu_deliver_packet(NetClientState *sender,
 
     if (ret == 0) {
         nc->receive_disabled = 1;
-    };
+        nc->stats.rx_blocked++;
+    } else if (ret > 0) {
+        nc->stats.rx_packets++;
+        nc->stats.rx_bytes += ret;
+    }
 
     return ret;
 }
@@ -375,9 +524,12 @@ static ssize_t qemu_send_packet_async_with_flags(NetClientState *sender,
 #endif
 
     if (sender->link_down || !sender->peer) {
+        sender->stats.tx_dropped++;
         return size;
     }
 
+    sender->stats.tx_packets++;
+    sender->stats.tx_bytes += size;
     queue = sender->peer->send_queue;
 
     return qemu_net_queue_send(queue, sender, flags, buf, size, sent_cb);
@@ -423,6 +575,7 @@ ssize_t qemu_deliver_packet_iov(NetClientState *sender,
     int ret;
 
     if (nc->link_down) {
+        nc->stats.rx_dropped++;
         return iov_size(iov, iovcnt);
     }
 
@@ -438,6 +591,10 @@ ssize_t qemu_deliver_packet_iov(NetClientState *sender,
 
     if (ret == 0) {
         nc->receive_disabled = 1;
+        nc->stats.rx_blocked++;
+    } else if (ret > 0) {
+        nc->stats.rx_packets++;
+        nc->stats.rx_bytes += ret;
     }
 
     return ret;
@@ -450,9 +607,12 @@ ssize_t qemu_sendv_packet_async(NetClientState *sender,
     NetQueue *queue;
 
     if (sender->link_down || !sender->peer) {
+        sender->stats.tx_dropped++;
         return iov_size(iov, iovcnt);
     }
 
+    sender->stats.tx_packets++;
+    sender->stats.tx_bytes += iov_size(iov, iovcnt);
     queue = sender->peer->send_queue;
 
     return qemu_net_queue_send_iov(queue, sender,
@@ -466,6 +626,115 @@ qemu_sendv_packet(NetClientState *nc, const struct iovec *iov, int iovcnt)
     return qemu_sendv_packet_async(nc, iov, iovcnt, NULL);
 }
 
+int qemu_deliver_packet_batch(NetClientState *sender,
+                              unsigned flags,
+                              const NetPacketIOV *pkts,
+                              int count,
+                              void *opaque)
+{
+    NetClientState *nc = opaque;
+    ssize_t ret;
+    int i, j;
+
+    if (nc->link_down) {
+        nc->stats.rx_dropped += count;
+        return count;
+    }
+
+    if (nc->receive_disabled) {
+        return 0;
+    }
+
+    if (nc->info->receive_batch &&
+        !(flags & QEMU_NET_PACKET_FLAG_RAW && nc->info->receive_raw)) {
+        i = nc->info->receive_batch(nc, pkts, count);
+        if (i < count) {
+            nc->receive_disabled = 1;
+            nc->stats.rx_blocked++;
+        }
+        for (j = 0; j < i; j++) {
+            nc->stats.rx_bytes += iov_size(pkts[j].iov, pkts[j].iovcnt);
+        }
+        nc->stats.rx_packets += i;
+        return i;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (pkts[i].iovcnt == 1) {
+            ret = qemu_deliver_packet(sender, flags, pkts[i].iov[0].iov_base,
+                                      pkts[i].iov[0].iov_len, opaque);
+        } else {
+            ret = qemu_deliver_packet_iov(sender, flags, pkts[i].iov,
+                                          pkts[i].iovcnt, opaque);
+        }
+        if (ret == 0) {
+            break;
+        }
+    }
+    return i;
+}
+
+/* Send @count packets at once.  Returns how many were delivered; if that is
+ * less than @count, the others were queued and, like for a zero return of
+ * qemu_sendv_packet_async(), the caller must wait for @sent_cb before
+ * sending more.
+ */
+int qemu_sendv_packets_async(NetClientState *sender,
+                             const NetPacketIOV *pkts, int count,
+                             NetPacketSent *sent_cb)
+{
+    NetQueue *queue;
+    int i;
+
+    if (sender->link_down || !sender->peer) {
+        sender->stats.tx_dropped += count;
+        return count;
+    }
+
+    for (i = 0; i < count; i++) {
+        sender->stats.tx_bytes += iov_size(pkts[i].iov, pkts[i].iovcnt);
+    }
+    sender->stats.tx_packets += count;
+    queue = sender->peer->send_queue;
+
+    return qemu_net_queue_send_batch(queue, sender,
+                                     QEMU_NET_PACKET_FLAG_NONE,
+                                     pkts, count, sent_cb);
+}
+
+/* Let @sender write its next packet straight into the receive buffers of
+ * its peer.  Only possible while nothing is queued for the peer, so that
+ * packets stay in order; a zero return means the packet must be sent the
+ * usual way.
+ */
+int qemu_peer_rx_map(NetClientState *sender, size_t hdr_len,
+                     struct iovec *iov, int iovmax)
+{
+    NetClientState *peer = sender->peer;
+
+    if (sender->link_down || !peer || peer->link_down ||
+        peer->receive_disabled || !peer->info->rx_map ||
+        !qemu_net_queue_empty(peer->send_queue)) {
+        return 0;
+    }
+
+    return peer->info->rx_map(peer, hdr_len, iov, iovmax);
+}
+
+void qemu_peer_rx_unmap(NetClientState *sender, size_t size)
+{
+    NetClientState *peer = sender->peer;
+
+    peer->info->rx_unmap(peer, size);
+
+    if (size) {
+        sender->stats.tx_packets++;
+        sender->stats.tx_bytes += size;
+        peer->stats.rx_packets++;
+        peer->stats.rx_bytes += size;
+    }
+}
+
 NetClientState *qemu_find_netdev(const char *id)
 {
     NetClientState *nc;
@@ -481,6 +750,27 @@ NetClientState *qemu_find_netdev(const char *id)
     return NULL;
 }
 
+int qemu_find_net_clients_except(const char *id, NetClientState **ncs,
+                                 NetClientOptionsKind type, int max)
+{
+    NetClientState *nc;
+    int ret = 0;
+
+    QTAILQ_FOREACH(nc, &net_clients, next) {
+        if (nc->info->type == type) {
+            continue;
+        }
+        if (!strcmp(nc->name, id)) {
+            if (ret < max) {
+                ncs[ret] = nc;
+            }
+            ret++;
+        }
+    }
+
+    return ret;
+}
+
 static int nic_get_free_idx(void)
 {
     int index;
@@ -617,6 +907,10 @@ static int (* const net_client_init_fun[NET_CLIENT_OPTIONS_KIND_MAX])(
         [NET_CLIENT_OPTIONS_KIND_BRIDGE]    = net_init_bridge,
 #endif
         [NET_CLIENT_OPTIONS_KIND_HUBPORT]   = net_init_hubport,
+#ifdef CONFIG_LINUX
+        [NET_CLIENT_OPTIONS_KIND_VHOST_USER] = net_init_vhost_user,
+        [NET_CLIENT_OPTIONS_KIND_AF_PACKET] = net_init_af_packet,
+#endif
 };
 
 
@@ -647,6 +941,10 @@ static int net_client_init1(const void *object, int is_netdev, Error **errp)
         case NET_CLIENT_OPTIONS_KIND_BRIDGE:
 #endif
         case NET_CLIENT_OPTIONS_KIND_HUBPORT:
+#ifdef CONFIG_LINUX
+        case NET_CLIENT_OPTIONS_KIND_VHOST_USER:
+        case NET_CLIENT_OPTIONS_KIND_AF_PACKET:
+#endif
             break;
 
         default:
@@ -847,8 +1145,18 @@ void qmp_netdev_del(const char *id, Error **errp)
 
 void print_net_client(Monitor *mon, NetClientState *nc)
 {
+    unsigned count;
+    uint64_t queued, dropped;
+
     monitor_printf(mon, "%s: type=%s,%s\n", nc->name,
                    NetClientOptionsKind_lookup[nc->info->type], nc->info_str);
+
+    /* packets waiting for nc to receive them */
+    qemu_net_queue_stats(nc->send_queue, &count, &queued, &dropped);
+    if (queued || dropped) {
+        monitor_printf(mon, "    queue: %u packets, %" PRIu64 " queued, %"
+                       PRIu64 " dropped\n", count, queued, dropped);
+    }
 }
 
 void do_info_network(Monitor *mon)
@@ -879,20 +1187,23 @@ void do_info_network(Monitor *mon)
 
 void qmp_set_link(const char *name, bool up, Error **errp)
 {
-    NetClientState *nc = NULL;
+    NetClientState *ncs[MAX_QUEUE_NUM];
+    NetClientState *nc;
+    int queues, i;
 
-    QTAILQ_FOREACH(nc, &net_clients, next) {
-        if (!strcmp(nc->name, name)) {
-            goto done;
-        }
-    }
-done:
-    if (!nc) {
+    queues = qemu_find_net_clients_except(name, ncs,
+                                          NET_CLIENT_OPTIONS_KIND_MAX,
+                                          MAX_QUEUE_NUM);
+
+    if (queues == 0) {
         error_set(errp, QERR_DEVICE_NOT_FOUND, name);
         return;
     }
+    nc = ncs[0];
 
-    nc->link_down = !up;
+    for (i = 0; i < queues; i++) {
+        ncs[i]->link_down = !up;
+    }
 
     if (nc->info->link_status_changed) {
         nc->info->link_status_changed(nc);
@@ -910,12 +1221,47 @@ done:
     }
 }
 
+NetClientCountersList *qmp_query_net_counters(Error **errp)
+{
+    NetClientCountersList *head = NULL, **tail = &head;
+    NetClientState *nc;
+
+    QTAILQ_FOREACH(nc, &net_clients, next) {
+        NetClientCountersList *entry = g_malloc0(sizeof(*entry));
+        NetClientCounters *info = g_malloc0(sizeof(*info));
+
+        info->name = g_strdup(nc->name);
+        info->model = g_strdup(nc->model);
+        info->queue_index = nc->queue_index;
+        info->rx_packets = nc->stats.rx_packets;
+        info->rx_bytes = nc->stats.rx_bytes;
+        info->rx_blocked = nc->stats.rx_blocked;
+        info->rx_dropped = nc->stats.rx_dropped;
+        info->tx_packets = nc->stats.tx_packets;
+        info->tx_bytes = nc->stats.tx_bytes;
+        info->tx_dropped = nc->stats.tx_dropped;
+        entry->value = info;
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    return head;
+}
+
 void net_cleanup(void)
 {
-    NetClientState *nc, *next_vc;
+    NetClientState *nc;
 
-    QTAILQ_FOREACH_SAFE(nc, &net_clients, next, next_vc) {
-        qemu_del_net_client(nc);
+    /* We may del multiple entries during qemu_del_net_client(),
+     * so QTAILQ_FOREACH_SAFE() is also not safe here.
+     */
+    while (!QTAILQ_EMPTY(&net_clients)) {
+        nc = QTAILQ_FIRST(&net_clients);
+        if (nc->info->type == NET_CLIENT_OPTIONS_KIND_NIC) {
+            qemu_del_nic(qemu_get_nic(nc));
+        } else {
+            qemu_del_net_client(nc);
+        }
     }
 }
 
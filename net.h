@@ -13,18 +13,25 @@ struct MACAddr {
     uint8_t a[6];
 };
 
+#define MAX_QUEUE_NUM 1024
+
 /* qdev nic properties */
 
+typedef struct NICPeers {
+    NetClientState *ncs[MAX_QUEUE_NUM];
+    int32_t queues;
+} NICPeers;
+
 typedef struct NICConf {
     MACAddr macaddr;
-    NetClientState *peer;
+    NICPeers peers;
     int32_t bootindex;
 } NICConf;
 
 #define DEFINE_NIC_PROPERTIES(_state, _conf)                            \
     DEFINE_PROP_MACADDR("mac",   _state, _conf.macaddr),                \
-    DEFINE_PROP_VLAN("vlan",     _state, _conf.peer),                   \
-    DEFINE_PROP_NETDEV("netdev", _state, _conf.peer),                   \
+    DEFINE_PROP_VLAN("vlan",     _state, _conf.peers),                  \
+    DEFINE_PROP_NETDEV("netdev", _state, _conf.peers),                  \
     DEFINE_PROP_INT32("bootindex", _state, _conf.bootindex, -1)
 
 /* Net clients */
@@ -33,8 +40,18 @@ typedef void (NetPoll)(NetClientState *, bool enable);
 typedef int (NetCanReceive)(NetClientState *);
 typedef ssize_t (NetReceive)(NetClientState *, const uint8_t *, size_t);
 typedef ssize_t (NetReceiveIOV)(NetClientState *, const struct iovec *, int);
+typedef int (NetReceiveBatch)(NetClientState *, const NetPacketIOV *, int);
 typedef void (NetCleanup) (NetClientState *);
 typedef void (LinkStatusChanged)(NetClientState *);
+typedef void (NetClientDestructor)(NetClientState *);
+typedef int (NetHasUfo)(NetClientState *);
+typedef int (NetHasVnetHdr)(NetClientState *);
+typedef int (NetHasVnetHdrLen)(NetClientState *, int);
+typedef void (NetUsingVnetHdr)(NetClientState *, int);
+typedef void (NetSetOffload)(NetClientState *, int, int, int, int, int);
+typedef void (NetSetVnetHdrLen)(NetClientState *, int);
+typedef int (NetRxMap)(NetClientState *, size_t, struct iovec *, int);
+typedef void (NetRxUnmap)(NetClientState *, size_t);
 
 typedef struct NetClientInfo {
     NetClientOptionsKind type;
@@ -42,12 +59,46 @@ typedef struct NetClientInfo {
     NetReceive *receive;
     NetReceive *receive_raw;
     NetReceiveIOV *receive_iov;
+    /* Returns how many packets were taken, stopping at the first one that
+     * has to wait for qemu_flush_queued_packets().  Dropped packets count
+     * as taken.
+     */
+    NetReceiveBatch *receive_batch;
     NetCanReceive *can_receive;
     NetCleanup *cleanup;
     LinkStatusChanged *link_status_changed;
     NetPoll *poll;
+    /* Backends that exchange virtio-net headers with the NIC */
+    NetHasUfo *has_ufo;
+    NetHasVnetHdr *has_vnet_hdr;
+    NetHasVnetHdrLen *has_vnet_hdr_len;
+    NetUsingVnetHdr *using_vnet_hdr;
+    NetSetOffload *set_offload;
+    NetSetVnetHdrLen *set_vnet_hdr_len;
+    /* Zero-copy receive.  rx_map fills at most iovmax iovecs with the
+     * buffers the next packet goes to, laid out as a header of hdr_len
+     * bytes followed by the frame, and returns the count or 0 if the
+     * packet must take the normal path.  The iovecs must stay valid until
+     * rx_unmap, which is passed the number of bytes written or 0 to give
+     * the buffers back.
+     */
+    NetRxMap *rx_map;
+    NetRxUnmap *rx_unmap;
 } NetClientInfo;
 
+/* Counted on the receiving side for rx_* and on the sender for tx_*; a
+ * blocked receive is one that returned 0 and caused the packet to be queued.
+ */
+typedef struct NetClientStats {
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t rx_blocked;
+    uint64_t rx_dropped;
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
+    uint64_t tx_dropped;
+} NetClientStats;
+
 struct NetClientState {
     NetClientInfo *info;
     int link_down;
@@ -58,16 +109,21 @@ struct NetClientState {
     char *name;
     char info_str[256];
     unsigned receive_disabled : 1;
+    NetClientDestructor *destructor;
+    unsigned int queue_index;
+    NetClientStats stats;
 };
 
 typedef struct NICState {
-    NetClientState nc;
+    NetClientState *ncs;
     NICConf *conf;
     void *opaque;
     bool peer_deleted;
 } NICState;
 
 NetClientState *qemu_find_netdev(const char *id);
+int qemu_find_net_clients_except(const char *id, NetClientState **ncs,
+                                 NetClientOptionsKind type, int max);
 NetClientState *qemu_new_net_client(NetClientInfo *info,
                                     NetClientState *peer,
                                     const char *model,
@@ -78,6 +134,11 @@ NICState *qemu_new_nic(NetClientInfo *info,
                        const char *name,
                        void *opaque);
 void qemu_del_net_client(NetClientState *nc);
+void qemu_del_nic(NICState *nic);
+NetClientState *qemu_get_subqueue(NICState *nic, int queue_index);
+NetClientState *qemu_get_queue(NICState *nic);
+NICState *qemu_get_nic(NetClientState *nc);
+void *qemu_get_nic_opaque(NetClientState *nc);
 NetClientState *qemu_find_vlan_client_by_name(Monitor *mon, int vlan_id,
                                               const char *client_str);
 typedef void (*qemu_nic_foreach)(NICState *nic, void *opaque);
@@ -87,11 +148,23 @@ ssize_t qemu_sendv_packet(NetClientState *nc, const struct iovec *iov,
                           int iovcnt);
 ssize_t qemu_sendv_packet_async(NetClientState *nc, const struct iovec *iov,
                                 int iovcnt, NetPacketSent *sent_cb);
+int qemu_sendv_packets_async(NetClientState *nc, const NetPacketIOV *pkts,
+                             int count, NetPacketSent *sent_cb);
+int qemu_peer_rx_map(NetClientState *nc, size_t hdr_len,
+                     struct iovec *iov, int iovmax);
+void qemu_peer_rx_unmap(NetClientState *nc, size_t size);
 void qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_raw(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_async(NetClientState *nc, const uint8_t *buf,
                                int size, NetPacketSent *sent_cb);
 void qemu_purge_queued_packets(NetClientState *nc);
+int qemu_has_ufo(NetClientState *nc);
+int qemu_has_vnet_hdr(NetClientState *nc);
+int qemu_has_vnet_hdr_len(NetClientState *nc, int len);
+void qemu_using_vnet_hdr(NetClientState *nc, int enable);
+void qemu_set_offload(NetClientState *nc, int csum, int tso4, int tso6,
+                      int ecn, int ufo);
+void qemu_set_vnet_hdr_len(NetClientState *nc, int len);
 void qemu_flush_queued_packets(NetClientState *nc);
 void qemu_format_nic_info_str(NetClientState *nc, uint8_t macaddr[6]);
 void qemu_macaddr_default_if_unset(MACAddr *macaddr);
@@ -110,6 +183,11 @@ ssize_t qemu_deliver_packet_iov(NetClientState *sender,
                             const struct iovec *iov,
                             int iovcnt,
                             void *opaque);
+int qemu_deliver_packet_batch(NetClientState *sender,
+                              unsigned flags,
+                              const NetPacketIOV *pkts,
+                              int count,
+                              void *opaque);
 
 void print_net_client(Monitor *mon, NetClientState *nc);
 void do_info_network(Monitor *mon);
@@ -0,0 +1,458 @@
+/*
+ * AF_PACKET ring network backend
+ *
+ * Frames are exchanged with a host interface through memory mapped
+ * packet rings instead of one read() or write() per frame.  The receive
+ * ring uses TPACKET_V3, where the kernel fills whole blocks of frames and
+ * a single poll wakeup hands over all of them.  The transmit ring uses
+ * TPACKET_V2 frames, which are queued in the ring and passed to the
+ * kernel with one send() per batch.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+#include "net.h"
+#include "clients.h"
+#include "qemu-common.h"
+#include "qemu-error.h"
+#include "main-loop.h"
+#include "qemu-barrier.h"
+#include "qemu_socket.h"
+#include "iov.h"
+
+#define AF_PACKET_DEFAULT_RING_SIZE (8 * 1024 * 1024)
+
+/* Receive blocks are retired by the kernel when full or, at the latest,
+ * after AF_PACKET_RX_BLOCK_TIMEOUT milliseconds.
+ */
+#define AF_PACKET_RX_BLOCK_SIZE     (256 * 1024)
+#define AF_PACKET_RX_FRAME_SIZE     2048
+#define AF_PACKET_RX_BLOCK_TIMEOUT  1
+
+/* Transmit frames hold an MTU sized frame behind the tpacket header */
+#define AF_PACKET_TX_BLOCK_SIZE     (64 * 1024)
+#define AF_PACKET_TX_FRAME_SIZE     2048
+#define AF_PACKET_TX_DATA_OFFSET    TPACKET_ALIGN(sizeof(struct tpacket2_hdr))
+
+/* Frames handed to the peer at once */
+#define AF_PACKET_BATCH 64
+
+typedef struct AfPacketState {
+    NetClientState nc;
+    int rx_fd;
+    int tx_fd;
+    unsigned int read_poll : 1;
+    unsigned int write_poll : 1;
+
+    uint8_t *rx_ring;
+    unsigned rx_block_nr;
+    unsigned rx_block;
+    /* Position in the current block, for blocks that could not be
+     * delivered in one go */
+    unsigned rx_pkt;
+    struct tpacket3_hdr *rx_ppd;
+
+    uint8_t *tx_ring;
+    unsigned tx_frame_nr;
+    unsigned tx_frame;
+    unsigned tx_pending;
+} AfPacketState;
+
+static int af_packet_can_send(void *opaque);
+static void af_packet_send(void *opaque);
+static void af_packet_writable(void *opaque);
+
+static void af_packet_read_poll(AfPacketState *s, bool enable)
+{
+    s->read_poll = enable;
+    qemu_set_fd_handler2(s->rx_fd, enable ? af_packet_can_send : NULL,
+                         enable ? af_packet_send : NULL, NULL, s);
+}
+
+static void af_packet_write_poll(AfPacketState *s, bool enable)
+{
+    s->write_poll = enable;
+    qemu_set_fd_handler2(s->tx_fd, NULL, NULL,
+                         enable ? af_packet_writable : NULL, s);
+}
+
+/* Transmit */
+
+static struct tpacket2_hdr *af_packet_tx_frame(AfPacketState *s)
+{
+    return (struct tpacket2_hdr *)(s->tx_ring +
+                                   s->tx_frame * AF_PACKET_TX_FRAME_SIZE);
+}
+
+static bool af_packet_tx_available(struct tpacket2_hdr *hdr)
+{
+    /* Rejected frames are not retried, reuse them */
+    return hdr->tp_status == TP_STATUS_AVAILABLE ||
+           hdr->tp_status == TP_STATUS_WRONG_FORMAT;
+}
+
+/* Let the kernel transmit all frames queued since the last kick */
+static void af_packet_tx_kick(AfPacketState *s)
+{
+    if (!s->tx_pending) {
+        return;
+    }
+    s->tx_pending = 0;
+    if (send(s->tx_fd, NULL, 0, MSG_DONTWAIT) < 0 &&
+        errno != EAGAIN && errno != ENOBUFS) {
+        error_report("af-packet: send failed: %s", strerror(errno));
+    }
+}
+
+static ssize_t af_packet_queue_tx(AfPacketState *s, const struct iovec *iov,
+                                  int iovcnt)
+{
+    struct tpacket2_hdr *hdr = af_packet_tx_frame(s);
+    size_t size = iov_size(iov, iovcnt);
+
+    if (size > AF_PACKET_TX_FRAME_SIZE - AF_PACKET_TX_DATA_OFFSET) {
+        s->nc.stats.tx_dropped++;
+        return size;
+    }
+
+    if (!af_packet_tx_available(hdr)) {
+        /* Ring full: push out what we have, the kernel may complete some
+         * frames right away */
+        af_packet_tx_kick(s);
+        if (!af_packet_tx_available(hdr)) {
+            af_packet_write_poll(s, true);
+            return 0;
+        }
+    }
+
+    iov_to_buf(iov, iovcnt, 0, (uint8_t *)hdr + AF_PACKET_TX_DATA_OFFSET,
+               size);
+    hdr->tp_len = size;
+    smp_wmb();
+    hdr->tp_status = TP_STATUS_SEND_REQUEST;
+
+    s->tx_frame = (s->tx_frame + 1) % s->tx_frame_nr;
+    s->tx_pending++;
+    return size;
+}
+
+static ssize_t af_packet_receive_iov(NetClientState *nc,
+                                     const struct iovec *iov, int iovcnt)
+{
+    AfPacketState *s = DO_UPCAST(AfPacketState, nc, nc);
+    ssize_t ret;
+
+    ret = af_packet_queue_tx(s, iov, iovcnt);
+    af_packet_tx_kick(s);
+    return ret;
+}
+
+static ssize_t af_packet_receive(NetClientState *nc, const uint8_t *buf,
+                                 size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size,
+    };
+
+    return af_packet_receive_iov(nc, &iov, 1);
+}
+
+static int af_packet_receive_batch(NetClientState *nc,
+                                   const NetPacketIOV *pkts, int count)
+{
+    AfPacketState *s = DO_UPCAST(AfPacketState, nc, nc);
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (af_packet_queue_tx(s, pkts[i].iov, pkts[i].iovcnt) == 0) {
+            break;
+        }
+    }
+    af_packet_tx_kick(s);
+    return i;
+}
+
+static void af_packet_writable(void *opaque)
+{
+    AfPacketState *s = opaque;
+
+    af_packet_write_poll(s, false);
+
+    qemu_flush_queued_packets(&s->nc);
+}
+
+/* Receive */
+
+static struct tpacket_block_desc *af_packet_rx_block(AfPacketState *s)
+{
+    return (struct tpacket_block_desc *)(s->rx_ring +
+                                         s->rx_block * AF_PACKET_RX_BLOCK_SIZE);
+}
+
+static int af_packet_can_send(void *opaque)
+{
+    AfPacketState *s = opaque;
+
+    return qemu_can_send_packet(&s->nc);
+}
+
+static void af_packet_send_completed(NetClientState *nc, ssize_t len)
+{
+    AfPacketState *s = DO_UPCAST(AfPacketState, nc, nc);
+
+    af_packet_read_poll(s, true);
+}
+
+static void af_packet_send(void *opaque)
+{
+    AfPacketState *s = opaque;
+    struct iovec iov[AF_PACKET_BATCH];
+    NetPacketIOV pkts[AF_PACKET_BATCH];
+    int n, sent;
+
+    for (;;) {
+        struct tpacket_block_desc *bd = af_packet_rx_block(s);
+        unsigned num_pkts;
+
+        if (!(bd->hdr.bh1.block_status & TP_STATUS_USER)) {
+            break;
+        }
+        smp_rmb();
+
+        num_pkts = bd->hdr.bh1.num_pkts;
+        if (s->rx_pkt == 0) {
+            s->rx_ppd = (struct tpacket3_hdr *)
+                ((uint8_t *)bd + bd->hdr.bh1.offset_to_first_pkt);
+        }
+
+        for (n = 0; n < AF_PACKET_BATCH && s->rx_pkt < num_pkts;
+             s->rx_pkt++) {
+            struct tpacket3_hdr *ppd = s->rx_ppd;
+            struct sockaddr_ll *sll = (struct sockaddr_ll *)
+                ((uint8_t *)ppd + TPACKET_ALIGN(sizeof(*ppd)));
+
+            s->rx_ppd = (struct tpacket3_hdr *)
+                ((uint8_t *)ppd + ppd->tp_next_offset);
+
+            /* Our own transmissions are looped back to packet sockets */
+            if (sll->sll_pkttype == PACKET_OUTGOING) {
+                continue;
+            }
+
+            iov[n].iov_base = (uint8_t *)ppd + ppd->tp_mac;
+            iov[n].iov_len = ppd->tp_snaplen;
+            pkts[n].iov = &iov[n];
+            pkts[n].iovcnt = 1;
+            n++;
+        }
+
+        /* Frames that cannot be delivered now are copied to the queue, so
+         * the block can go back to the kernel once it has been walked.
+         */
+        sent = n ? qemu_sendv_packets_async(&s->nc, pkts, n,
+                                            af_packet_send_completed) : 0;
+
+        if (s->rx_pkt == num_pkts) {
+            smp_mb();
+            bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+            s->rx_block = (s->rx_block + 1) % s->rx_block_nr;
+            s->rx_pkt = 0;
+        }
+
+        if (sent < n) {
+            af_packet_read_poll(s, false);
+            break;
+        }
+        if (!qemu_can_send_packet(&s->nc)) {
+            break;
+        }
+    }
+}
+
+static void af_packet_poll(NetClientState *nc, bool enable)
+{
+    AfPacketState *s = DO_UPCAST(AfPacketState, nc, nc);
+
+    af_packet_read_poll(s, enable);
+    af_packet_write_poll(s, enable);
+}
+
+static void af_packet_cleanup(NetClientState *nc)
+{
+    AfPacketState *s = DO_UPCAST(AfPacketState, nc, nc);
+
+    qemu_purge_queued_packets(nc);
+
+    af_packet_read_poll(s, false);
+    af_packet_write_poll(s, false);
+
+    munmap(s->rx_ring, s->rx_block_nr * AF_PACKET_RX_BLOCK_SIZE);
+    munmap(s->tx_ring, s->tx_frame_nr * AF_PACKET_TX_FRAME_SIZE);
+    close(s->rx_fd);
+    close(s->tx_fd);
+}
+
+static NetClientInfo net_af_packet_info = {
+    .type = NET_CLIENT_OPTIONS_KIND_AF_PACKET,
+    .size = sizeof(AfPacketState),
+    .receive = af_packet_receive,
+    .receive_iov = af_packet_receive_iov,
+    .receive_batch = af_packet_receive_batch,
+    .poll = af_packet_poll,
+    .cleanup = af_packet_cleanup,
+};
+
+/* Open a packet socket on @ifindex with a ring described by @req mapped at
+ * *ring.  @protocol 0 binds a socket that does not receive anything.
+ */
+static int af_packet_open(int ifindex, int protocol, int version, int ring,
+                          const void *req, size_t req_len, size_t ring_size,
+                          uint8_t **ring_mem)
+{
+    struct sockaddr_ll sll = {
+        .sll_family = AF_PACKET,
+        .sll_protocol = htons(protocol),
+        .sll_ifindex = ifindex,
+    };
+    void *mem;
+    int fd;
+
+    fd = qemu_socket(AF_PACKET, SOCK_RAW, htons(protocol));
+    if (fd < 0) {
+        error_report("af-packet: cannot create packet socket: %s",
+                     strerror(errno));
+        return -1;
+    }
+
+    if (setsockopt(fd, SOL_PACKET, PACKET_VERSION,
+                   &version, sizeof(version)) < 0 ||
+        setsockopt(fd, SOL_PACKET, ring, req, req_len) < 0) {
+        error_report("af-packet: cannot set up packet ring: %s",
+                     strerror(errno));
+        goto fail;
+    }
+
+    mem = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+        error_report("af-packet: cannot map packet ring: %s",
+                     strerror(errno));
+        goto fail;
+    }
+
+    if (bind(fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+        error_report("af-packet: cannot bind packet socket: %s",
+                     strerror(errno));
+        munmap(mem, ring_size);
+        goto fail;
+    }
+
+    socket_set_nonblock(fd);
+    *ring_mem = mem;
+    return fd;
+
+fail:
+    close(fd);
+    return -1;
+}
+
+int net_init_af_packet(const NetClientOptions *opts, const char *name,
+                       NetClientState *peer)
+{
+    const NetdevAfPacketOptions *af_packet;
+    struct tpacket_req3 rx_req = { };
+    struct tpacket_req tx_req = { };
+    struct packet_mreq mreq = { };
+    NetClientState *nc;
+    AfPacketState *s;
+    uint64_t ring_size;
+    uint8_t *rx_ring, *tx_ring;
+    int ifindex, rx_fd, tx_fd;
+
+    assert(opts->kind == NET_CLIENT_OPTIONS_KIND_AF_PACKET);
+    af_packet = opts->af_packet;
+
+    ifindex = if_nametoindex(af_packet->ifname);
+    if (!ifindex) {
+        error_report("af-packet: no interface '%s'", af_packet->ifname);
+        return -1;
+    }
+
+    ring_size = af_packet->has_ring_size ? af_packet->ring_size
+                                         : AF_PACKET_DEFAULT_RING_SIZE;
+    if (ring_size < AF_PACKET_RX_BLOCK_SIZE || ring_size > UINT32_MAX) {
+        error_report("af-packet: ring-size must be between %d and %u",
+                     AF_PACKET_RX_BLOCK_SIZE, UINT32_MAX);
+        return -1;
+    }
+
+    rx_req.tp_block_size = AF_PACKET_RX_BLOCK_SIZE;
+    rx_req.tp_block_nr = ring_size / AF_PACKET_RX_BLOCK_SIZE;
+    rx_req.tp_frame_size = AF_PACKET_RX_FRAME_SIZE;
+    rx_req.tp_frame_nr = rx_req.tp_block_nr *
+                         (AF_PACKET_RX_BLOCK_SIZE / AF_PACKET_RX_FRAME_SIZE);
+    rx_req.tp_retire_blk_tov = AF_PACKET_RX_BLOCK_TIMEOUT;
+
+    tx_req.tp_block_size = AF_PACKET_TX_BLOCK_SIZE;
+    tx_req.tp_block_nr = ring_size / AF_PACKET_TX_BLOCK_SIZE;
+    tx_req.tp_frame_size = AF_PACKET_TX_FRAME_SIZE;
+    tx_req.tp_frame_nr = tx_req.tp_block_nr *
+                         (AF_PACKET_TX_BLOCK_SIZE / AF_PACKET_TX_FRAME_SIZE);
+
+    rx_fd = af_packet_open(ifindex, ETH_P_ALL, TPACKET_V3, PACKET_RX_RING,
+                           &rx_req, sizeof(rx_req),
+                           (size_t)rx_req.tp_block_nr * rx_req.tp_block_size,
+                           &rx_ring);
+    if (rx_fd < 0) {
+        return -1;
+    }
+
+    tx_fd = af_packet_open(ifindex, 0, TPACKET_V2, PACKET_TX_RING,
+                           &tx_req, sizeof(tx_req),
+                           (size_t)tx_req.tp_block_nr * tx_req.tp_block_size,
+                           &tx_ring);
+    if (tx_fd < 0) {
+        munmap(rx_ring, (size_t)rx_req.tp_block_nr * rx_req.tp_block_size);
+        close(rx_fd);
+        return -1;
+    }
+
+#ifdef PACKET_QDISC_BYPASS
+    {
+        int one = 1;
+        setsockopt(tx_fd, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one));
+    }
+#endif
+
+    /* The guest has its own MAC address */
+    mreq.mr_ifindex = ifindex;
+    mreq.mr_type = PACKET_MR_PROMISC;
+    if (setsockopt(rx_fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+                   &mreq, sizeof(mreq)) < 0) {
+        error_report("af-packet: cannot make '%s' promiscuous: %s",
+                     af_packet->ifname, strerror(errno));
+    }
+
+    nc = qemu_new_net_client(&net_af_packet_info, peer, "af-packet", name);
+    snprintf(nc->info_str, sizeof(nc->info_str), "ifname=%s",
+             af_packet->ifname);
+    s = DO_UPCAST(AfPacketState, nc, nc);
+
+    s->rx_fd = rx_fd;
+    s->rx_ring = rx_ring;
+    s->rx_block_nr = rx_req.tp_block_nr;
+    s->tx_fd = tx_fd;
+    s->tx_ring = tx_ring;
+    s->tx_frame_nr = tx_req.tp_frame_nr;
+
+    af_packet_read_poll(s, true);
+    return 0;
+}
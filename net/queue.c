@@ -37,10 +37,31 @@
  *
  * If a sent callback isn't provided, we just drop the packet to avoid
  * unbounded queueing.
+ *
+ * A batch is delivered up to the first packet the handler cannot take;
+ * that packet and the rest of the batch are queued.
+ *
+ * The queue holds at most NET_QUEUE_MAX_LEN packets.  Past that, packets
+ * without a sent callback are dropped; the others are still queued since
+ * their sender stops until the callback runs.
+ */
+
+#define NET_QUEUE_MAX_LEN 10000
+
+/* Packets that fit in a slot, headers included, are queued in a pool
+ * allocated on first use; larger ones and overflow go to the heap.
  */
+#define NET_QUEUE_SLOT_SIZE 2048
+#define NET_QUEUE_POOL_SLOTS 256
+
+/* Most packets flushed at once; one batch is a single guest notification
+ * for NICs that support batches.
+ */
+#define NET_QUEUE_FLUSH_BATCH 64
 
 struct NetPacket {
     QTAILQ_ENTRY(NetPacket) entry;
+    QSLIST_ENTRY(NetPacket) free_entry;
     NetClientState *sender;
     unsigned flags;
     int size;
@@ -52,6 +73,12 @@ struct NetQueue {
     void *opaque;
 
     QTAILQ_HEAD(packets, NetPacket) packets;
+    unsigned nq_count;
+    uint64_t nq_queued;
+    uint64_t nq_dropped;
+
+    uint8_t *pool;
+    QSLIST_HEAD(, NetPacket) free_slots;
 
     unsigned delivering : 1;
 };
@@ -65,24 +92,94 @@ NetQueue *qemu_new_net_queue(void *opaque)
     queue->opaque = opaque;
 
     QTAILQ_INIT(&queue->packets);
+    QSLIST_INIT(&queue->free_slots);
 
     queue->delivering = 0;
 
     return queue;
 }
 
+static NetPacket *qemu_net_queue_alloc_packet(NetQueue *queue, size_t size)
+{
+    NetPacket *packet;
+    int i;
+
+    if (sizeof(NetPacket) + size > NET_QUEUE_SLOT_SIZE) {
+        return g_malloc(sizeof(NetPacket) + size);
+    }
+
+    if (!queue->pool) {
+        queue->pool = g_malloc(NET_QUEUE_POOL_SLOTS * NET_QUEUE_SLOT_SIZE);
+        for (i = NET_QUEUE_POOL_SLOTS - 1; i >= 0; i--) {
+            packet = (NetPacket *)(queue->pool + i * NET_QUEUE_SLOT_SIZE);
+            QSLIST_INSERT_HEAD(&queue->free_slots, packet, free_entry);
+        }
+    }
+
+    packet = QSLIST_FIRST(&queue->free_slots);
+    if (!packet) {
+        return g_malloc(sizeof(NetPacket) + size);
+    }
+    QSLIST_REMOVE_HEAD(&queue->free_slots, free_entry);
+    return packet;
+}
+
+static void qemu_net_queue_free_packet(NetQueue *queue, NetPacket *packet)
+{
+    uint8_t *p = (uint8_t *)packet;
+
+    if (queue->pool && p >= queue->pool &&
+        p < queue->pool + NET_QUEUE_POOL_SLOTS * NET_QUEUE_SLOT_SIZE) {
+        QSLIST_INSERT_HEAD(&queue->free_slots, packet, free_entry);
+    } else {
+        g_free(packet);
+    }
+}
+
+/* Unlink a packet; the caller frees it or puts it back */
+static void qemu_net_queue_remove(NetQueue *queue, NetPacket *packet)
+{
+    QTAILQ_REMOVE(&queue->packets, packet, entry);
+    queue->nq_count--;
+}
+
+static void qemu_net_queue_insert_head(NetQueue *queue, NetPacket *packet)
+{
+    QTAILQ_INSERT_HEAD(&queue->packets, packet, entry);
+    queue->nq_count++;
+}
+
+/* Whether a new packet must be dropped rather than queued */
+static bool qemu_net_queue_full(NetQueue *queue, NetPacketSent *sent_cb)
+{
+    if (queue->nq_count < NET_QUEUE_MAX_LEN || sent_cb) {
+        return false;
+    }
+    queue->nq_dropped++;
+    return true;
+}
+
 void qemu_del_net_queue(NetQueue *queue)
 {
     NetPacket *packet, *next;
 
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
-        QTAILQ_REMOVE(&queue->packets, packet, entry);
-        g_free(packet);
+        qemu_net_queue_remove(queue, packet);
+        qemu_net_queue_free_packet(queue, packet);
     }
 
+    g_free(queue->pool);
     g_free(queue);
 }
 
+void qemu_net_queue_stats(NetQueue *queue, unsigned *count,
+                          uint64_t *queued, uint64_t *dropped)
+{
+    *count = queue->nq_count;
+    *queued = queue->nq_queued;
+    *dropped = queue->nq_dropped;
+}
+
 static void qemu_net_queue_append(NetQueue *queue,
                                   NetClientState *sender,
                                   unsigned flags,
@@ -92,7 +189,11 @@ static void qemu_net_queue_append(NetQueue *queue,
 {
     NetPacket *packet;
 
-    packet = g_malloc(sizeof(NetPacket) + size);
+    if (qemu_net_queue_full(queue, sent_cb)) {
+        return;
+    }
+
+    packet = qemu_net_queue_alloc_packet(queue, size);
     packet->sender = sender;
     packet->flags = flags;
     packet->size = size;
@@ -100,6 +201,8 @@ static void qemu_net_queue_append(NetQueue *queue,
     memcpy(packet->data, buf, size);
 
     QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    queue->nq_count++;
+    queue->nq_queued++;
 }
 
 static void qemu_net_queue_append_iov(NetQueue *queue,
@@ -113,11 +216,15 @@ static void qemu_net_queue_append_iov(NetQueue *queue,
     size_t max_len = 0;
     int i;
 
+    if (qemu_net_queue_full(queue, sent_cb)) {
+        return;
+    }
+
     for (i = 0; i < iovcnt; i++) {
         max_len += iov[i].iov_len;
     }
 
-    packet = g_malloc(sizeof(NetPacket) + max_len);
+    packet = qemu_net_queue_alloc_packet(queue, max_len);
     packet->sender = sender;
     packet->sent_cb = sent_cb;
     packet->flags = flags;
@@ -131,6 +238,8 @@ static void qemu_net_queue_append_iov(NetQueue *queue,
     }
 
     QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    queue->nq_count++;
+    queue->nq_queued++;
 }
 
 static ssize_t qemu_net_queue_deliver(NetQueue *queue,
@@ -163,6 +272,21 @@ static ssize_t qemu_net_queue_deliver_iov(NetQueue *queue,
     return ret;
 }
 
+static int qemu_net_queue_deliver_batch(NetQueue *queue,
+                                        NetClientState *sender,
+                                        unsigned flags,
+                                        const NetPacketIOV *pkts,
+                                        int count)
+{
+    int ret;
+
+    queue->delivering = 1;
+    ret = qemu_deliver_packet_batch(sender, flags, pkts, count, queue->opaque);
+    queue->delivering = 0;
+
+    return ret;
+}
+
 ssize_t qemu_net_queue_send(NetQueue *queue,
                             NetClientState *sender,
                             unsigned flags,
@@ -213,14 +337,44 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
     return ret;
 }
 
+/* Returns the number of packets delivered; the others were queued */
+int qemu_net_queue_send_batch(NetQueue *queue,
+                              NetClientState *sender,
+                              unsigned flags,
+                              const NetPacketIOV *pkts,
+                              int count,
+                              NetPacketSent *sent_cb)
+{
+    int i, ret = 0;
+
+    if (!queue->delivering && qemu_can_send_packet(sender)) {
+        ret = qemu_net_queue_deliver_batch(queue, sender, flags, pkts, count);
+    }
+
+    for (i = ret; i < count; i++) {
+        qemu_net_queue_append_iov(queue, sender, flags,
+                                  pkts[i].iov, pkts[i].iovcnt, sent_cb);
+    }
+    if (ret == count) {
+        qemu_net_queue_flush(queue);
+    }
+
+    return ret;
+}
+
+bool qemu_net_queue_empty(NetQueue *queue)
+{
+    return QTAILQ_EMPTY(&queue->packets);
+}
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
 {
     NetPacket *packet, *next;
 
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         if (packet->sender == from) {
-            QTAILQ_REMOVE(&queue->packets, packet, entry);
-            g_free(packet);
+            qemu_net_queue_remove(queue, packet);
+            qemu_net_queue_free_packet(queue, packet);
         }
     }
 }
@@ -228,27 +382,45 @@ void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
 bool qemu_net_queue_flush(NetQueue *queue)
 {
     while (!QTAILQ_EMPTY(&queue->packets)) {
-        NetPacket *packet;
-        int ret;
+        NetPacket *batch[NET_QUEUE_FLUSH_BATCH], *packet;
+        NetPacketIOV pkts[NET_QUEUE_FLUSH_BATCH];
+        struct iovec iov[NET_QUEUE_FLUSH_BATCH];
+        int i, n = 0, ret;
 
+        /* a run of packets from the same sender, with the same flags */
         packet = QTAILQ_FIRST(&queue->packets);
-        QTAILQ_REMOVE(&queue->packets, packet, entry);
-
-        ret = qemu_net_queue_deliver(queue,
-                                     packet->sender,
-                                     packet->flags,
-                                     packet->data,
-                                     packet->size);
-        if (ret == 0) {
-            QTAILQ_INSERT_HEAD(&queue->packets, packet, entry);
-            return false;
+        do {
+            qemu_net_queue_remove(queue, packet);
+            iov[n].iov_base = packet->data;
+            iov[n].iov_len = packet->size;
+            pkts[n].iov = &iov[n];
+            pkts[n].iovcnt = 1;
+            batch[n++] = packet;
+            packet = QTAILQ_FIRST(&queue->packets);
+        } while (packet && n < NET_QUEUE_FLUSH_BATCH &&
+                 packet->sender == batch[0]->sender &&
+                 packet->flags == batch[0]->flags);
+
+        ret = qemu_net_queue_deliver_batch(queue,
+                                           batch[0]->sender,
+                                           batch[0]->flags,
+                                           pkts, n);
+
+        for (i = n - 1; i >= ret; i--) {
+            qemu_net_queue_insert_head(queue, batch[i]);
         }
 
-        if (packet->sent_cb) {
-            packet->sent_cb(packet->sender, ret);
+        for (i = 0; i < ret; i++) {
+            packet = batch[i];
+            if (packet->sent_cb) {
+                packet->sent_cb(packet->sender, packet->size);
+            }
+            qemu_net_queue_free_packet(queue, packet);
         }
 
-        g_free(packet);
+        if (ret < n) {
+            return false;
+        }
     }
     return true;
 }
@@ -31,6 +31,12 @@ typedef struct NetQueue NetQueue;
 
 typedef void (NetPacketSent) (NetClientState *sender, ssize_t ret);
 
+/* One packet of a batch */
+typedef struct NetPacketIOV {
+    const struct iovec *iov;
+    int iovcnt;
+} NetPacketIOV;
+
 #define QEMU_NET_PACKET_FLAG_NONE  0
 #define QEMU_NET_PACKET_FLAG_RAW  (1<<0)
 
@@ -52,7 +58,17 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
                                 int iovcnt,
                                 NetPacketSent *sent_cb);
 
+int qemu_net_queue_send_batch(NetQueue *queue,
+                              NetClientState *sender,
+                              unsigned flags,
+                              const NetPacketIOV *pkts,
+                              int count,
+                              NetPacketSent *sent_cb);
+
+bool qemu_net_queue_empty(NetQueue *queue);
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from);
+void qemu_net_queue_stats(NetQueue *queue, unsigned *count,
+                          uint64_t *queued, uint64_t *dropped);
 bool qemu_net_queue_flush(NetQueue *queue);
 
 #endif /* QEMU_NET_QUEUE_H */
@@ -35,6 +35,7 @@
 #include "monitor.h"
 #include "qemu_socket.h"
 #include "slirp/libslirp.h"
+#include "hw/virtio-net.h"
 
 static int get_str_sep(char *buf, int buf_size, const char **pp, int sep)
 {
@@ -75,6 +76,11 @@ typedef struct SlirpState {
 #ifndef _WIN32
     char smb_dir[128];
 #endif
+    /* virtio-net header exchanged with a directly attached NIC */
+    int using_vnet_hdr;
+    int vnet_hdr_len;
+    int guest_csum;
+    int guest_tso4;
 } SlirpState;
 
 static struct slirp_config_str *slirp_configs;
@@ -98,22 +104,149 @@ static void slirp_smb_cleanup(SlirpState *s);
 static inline void slirp_smb_cleanup(SlirpState *s) { }
 #endif
 
+#define SLIRP_ETH_HLEN 14
+#define SLIRP_IF_MTU   1500
+
+/* Sum of the TCP pseudo header, which the guest expects in the checksum
+ * field of a frame flagged VIRTIO_NET_HDR_F_NEEDS_CSUM.  */
+static uint16_t net_slirp_pseudo_csum(const uint8_t *ip, int iphl)
+{
+    uint32_t sum;
+
+    sum = lduw_be_p(ip + 12) + lduw_be_p(ip + 14) +
+          lduw_be_p(ip + 16) + lduw_be_p(ip + 18) +
+          ip[9] + lduw_be_p(ip + 2) - iphl;
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return sum;
+}
+
 void slirp_output(void *opaque, const uint8_t *pkt, int pkt_len)
 {
     SlirpState *s = opaque;
+    struct virtio_net_hdr_mrg_rxbuf hdr;
+    const uint8_t *ip = pkt + SLIRP_ETH_HLEN;
+    uint8_t pseudo[2];
+    struct iovec iov[4];
+    int iphl, thl, csum;
+
+    if (!s->using_vnet_hdr) {
+        qemu_send_packet(&s->nc, pkt, pkt_len);
+        return;
+    }
 
-    qemu_send_packet(&s->nc, pkt, pkt_len);
+    memset(&hdr, 0, sizeof(hdr));
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = s->vnet_hdr_len;
+    iov[1].iov_base = (void *)pkt;
+    iov[1].iov_len = pkt_len;
+
+    /* slirp computes its own checksums, large TCP segments are the only
+       frames that exceed the MTU */
+    if (pkt_len > SLIRP_ETH_HLEN + 20 && lduw_be_p(pkt + 12) == 0x0800) {
+        iphl = (ip[0] & 0xf) * 4;
+        if (ip[9] == IPPROTO_TCP && pkt_len > SLIRP_ETH_HLEN + SLIRP_IF_MTU &&
+            s->guest_tso4 && pkt_len >= SLIRP_ETH_HLEN + iphl + 20) {
+            thl = (ip[iphl + 12] >> 4) * 4;
+            csum = SLIRP_ETH_HLEN + iphl + 16;
+
+            hdr.hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+            hdr.hdr.gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+            hdr.hdr.hdr_len = SLIRP_ETH_HLEN + iphl + thl;
+            hdr.hdr.gso_size = SLIRP_IF_MTU - iphl - thl;
+            hdr.hdr.csum_start = SLIRP_ETH_HLEN + iphl;
+            hdr.hdr.csum_offset = 16;
+
+            /* replace the full checksum without copying the frame */
+            stw_be_p(pseudo, net_slirp_pseudo_csum(ip, iphl));
+            iov[1].iov_len = csum;
+            iov[2].iov_base = pseudo;
+            iov[2].iov_len = 2;
+            iov[3].iov_base = (void *)(pkt + csum + 2);
+            iov[3].iov_len = pkt_len - csum - 2;
+            qemu_sendv_packet(&s->nc, iov, 4);
+            return;
+        }
+        if ((ip[9] == IPPROTO_TCP || ip[9] == IPPROTO_UDP) && s->guest_csum) {
+            hdr.hdr.flags = VIRTIO_NET_HDR_F_DATA_VALID;
+        }
+    }
+    qemu_sendv_packet(&s->nc, iov, 2);
 }
 
 static ssize_t net_slirp_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
+    const struct virtio_net_hdr *hdr = (const struct virtio_net_hdr *)buf;
 
-    slirp_input(s->slirp, buf, size);
+    if (!s->using_vnet_hdr) {
+        slirp_input(s->slirp, buf, size);
+        return size;
+    }
+
+    if (size < s->vnet_hdr_len) {
+        return size;
+    }
+    /* partial or absent checksums are fine, slirp terminates the flow */
+    if ((hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) ||
+        hdr->gso_type != VIRTIO_NET_HDR_GSO_NONE) {
+        slirp_input_csum_valid(s->slirp, buf + s->vnet_hdr_len,
+                               size - s->vnet_hdr_len);
+    } else {
+        slirp_input(s->slirp, buf + s->vnet_hdr_len, size - s->vnet_hdr_len);
+    }
 
     return size;
 }
 
+static int net_slirp_has_ufo(NetClientState *nc)
+{
+    return 0;
+}
+
+static int net_slirp_has_vnet_hdr(NetClientState *nc)
+{
+    return 1;
+}
+
+static int net_slirp_has_vnet_hdr_len(NetClientState *nc, int len)
+{
+    return len == sizeof(struct virtio_net_hdr) ||
+           len == sizeof(struct virtio_net_hdr_mrg_rxbuf);
+}
+
+static void net_slirp_using_vnet_hdr(NetClientState *nc, int enable)
+{
+    SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
+
+    s->using_vnet_hdr = enable;
+    if (!enable) {
+        s->guest_csum = s->guest_tso4 = 0;
+        slirp_set_tso(s->slirp, false);
+    }
+}
+
+static void net_slirp_set_vnet_hdr_len(NetClientState *nc, int len)
+{
+    SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
+
+    assert(net_slirp_has_vnet_hdr_len(nc, len));
+    s->vnet_hdr_len = len;
+}
+
+static void net_slirp_set_offload(NetClientState *nc, int csum, int tso4,
+                                  int tso6, int ecn, int ufo)
+{
+    SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
+
+    /* segmentation offload frames rely on the guest completing the
+       checksum, and slirp only speaks IPv4 */
+    s->guest_csum = csum;
+    s->guest_tso4 = csum && tso4;
+    slirp_set_tso(s->slirp, s->using_vnet_hdr && s->guest_tso4);
+}
+
 static void net_slirp_cleanup(NetClientState *nc)
 {
     SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
@@ -128,6 +261,12 @@ static NetClientInfo net_slirp_info = {
     .size = sizeof(SlirpState),
     .receive = net_slirp_receive,
     .cleanup = net_slirp_cleanup,
+    .has_ufo = net_slirp_has_ufo,
+    .has_vnet_hdr = net_slirp_has_vnet_hdr,
+    .has_vnet_hdr_len = net_slirp_has_vnet_hdr_len,
+    .using_vnet_hdr = net_slirp_using_vnet_hdr,
+    .set_offload = net_slirp_set_offload,
+    .set_vnet_hdr_len = net_slirp_set_vnet_hdr_len,
 };
 
 static int net_slirp_init(NetClientState *peer, const char *model,
@@ -240,6 +379,7 @@ static int net_slirp_init(NetClientState *peer, const char *model,
              restricted ? "on" : "off");
 
     s = DO_UPCAST(SlirpState, nc, nc);
+    s->vnet_hdr_len = sizeof(struct virtio_net_hdr);
 
     s->slirp = slirp_init(restricted, net, mask, host, vhostname,
                           tftp_export, bootfile, dhcp, dns, dnssearch, s);
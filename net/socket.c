@@ -33,15 +33,26 @@
 #include "qemu_socket.h"
 #include "iov.h"
 
+/* Largest frame accepted from a stream peer */
+#define NET_SOCKET_MAX_PACKET (4096 + 65536)
+
+/* Receive buffer; a stream read can return many frames at once */
+#define NET_SOCKET_BUF_SIZE (256 * 1024)
+
+/* Frames parsed from the stream and handed to the peer at once */
+#define NET_SOCKET_BATCH 64
+
+/* Most iovecs gathered into one writev() */
+#define NET_SOCKET_IOV_MAX 256
+
 typedef struct NetSocketState {
     NetClientState nc;
     int listen_fd;
     int fd;
-    int state; /* 0 = getting length, 1 = getting data */
-    unsigned int index;
-    unsigned int packet_len;
+    unsigned int buf_start;       /* unparsed stream data, only SOCK_STREAM */
+    unsigned int buf_end;
     unsigned int send_index;      /* number of bytes sent (only SOCK_STREAM) */
-    uint8_t buf[4096];
+    uint8_t buf[NET_SOCKET_BUF_SIZE];
     struct sockaddr_in dgram_dst; /* contains inet host and port destination iff connectionless (SOCK_DGRAM) */
     IOHandler *send_fn;           /* differs between SOCK_STREAM/SOCK_DGRAM */
     bool read_poll;               /* waiting to receive data? */
@@ -89,24 +100,22 @@ static void net_socket_writable(void *opaque)
     qemu_flush_queued_packets(&s->nc);
 }
 
-static ssize_t net_socket_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+static ssize_t net_socket_receive_iov(NetClientState *nc,
+                                      const struct iovec *iov, int iovcnt)
 {
     NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+    size_t size = iov_size(iov, iovcnt);
     uint32_t len = htonl(size);
-    struct iovec iov[] = {
-        {
-            .iov_base = &len,
-            .iov_len  = sizeof(len),
-        }, {
-            .iov_base = (void *)buf,
-            .iov_len  = size,
-        },
-    };
+    struct iovec iov_copy[iovcnt + 1];
     size_t remaining;
     ssize_t ret;
 
-    remaining = iov_size(iov, 2) - s->send_index;
-    ret = iov_send(s->fd, iov, 2, s->send_index, remaining);
+    iov_copy[0].iov_base = &len;
+    iov_copy[0].iov_len = sizeof(len);
+    memcpy(&iov_copy[1], iov, iovcnt * sizeof(*iov));
+
+    remaining = sizeof(len) + size - s->send_index;
+    ret = iov_send(s->fd, iov_copy, iovcnt + 1, s->send_index, remaining);
 
     if (ret == -1 && errno == EAGAIN) {
         ret = 0; /* handled further down */
@@ -124,6 +133,83 @@ static ssize_t net_socket_receive(NetClientState *nc, const uint8_t *buf, size_t
     return size;
 }
 
+static ssize_t net_socket_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len  = size,
+    };
+
+    return net_socket_receive_iov(nc, &iov, 1);
+}
+
+/* Coalesce frames, each behind its length, into as few writev() calls as
+ * possible.  send_index always refers to the first frame of @pkts.
+ */
+static int net_socket_receive_batch(NetClientState *nc,
+                                    const NetPacketIOV *pkts, int count)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+    struct iovec iov[NET_SOCKET_IOV_MAX];
+    uint32_t lens[NET_SOCKET_IOV_MAX];
+    size_t sizes[NET_SOCKET_IOV_MAX];
+    int done = 0;
+
+    while (done < count) {
+        size_t total = 0;
+        int n = 0, cnt = 0, i;
+        ssize_t ret;
+
+        while (done + n < count &&
+               cnt + 1 + pkts[done + n].iovcnt <= NET_SOCKET_IOV_MAX) {
+            const NetPacketIOV *p = &pkts[done + n];
+
+            sizes[n] = sizeof(lens[n]) + iov_size(p->iov, p->iovcnt);
+            lens[n] = htonl(sizes[n] - sizeof(lens[n]));
+            iov[cnt].iov_base = &lens[n];
+            iov[cnt].iov_len = sizeof(lens[n]);
+            memcpy(&iov[cnt + 1], p->iov, p->iovcnt * sizeof(*iov));
+            cnt += 1 + p->iovcnt;
+            total += sizes[n];
+            n++;
+        }
+
+        if (n == 0) {
+            /* Too fragmented to be gathered */
+            if (net_socket_receive_iov(nc, pkts[done].iov,
+                                       pkts[done].iovcnt) == 0) {
+                return done;
+            }
+            done++;
+            continue;
+        }
+
+        ret = iov_send(s->fd, iov, cnt, s->send_index,
+                       total - s->send_index);
+        if (ret == -1 && errno == EAGAIN) {
+            ret = 0;
+        }
+        if (ret == -1) {
+            /* Like a failed single send, the frames are dropped */
+            s->send_index = 0;
+            return count;
+        }
+
+        ret += s->send_index;
+        for (i = 0; i < n && ret >= (ssize_t)sizes[i]; i++) {
+            ret -= sizes[i];
+        }
+        done += i;
+        if (i < n) {
+            s->send_index = ret;
+            net_socket_write_poll(s, true);
+            return done;
+        }
+        s->send_index = 0;
+    }
+    return done;
+}
+
 static ssize_t net_socket_receive_dgram(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
@@ -142,19 +228,35 @@ static ssize_t net_socket_receive_dgram(NetClientState *nc, const uint8_t *buf,
     return ret;
 }
 
+static void net_socket_send_completed(NetClientState *nc, ssize_t len)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+
+    net_socket_read_poll(s, true);
+}
+
 static void net_socket_send(void *opaque)
 {
     NetSocketState *s = opaque;
-    int size, err;
-    unsigned l;
-    uint8_t buf1[4096];
-    const uint8_t *buf;
+    struct iovec iov[NET_SOCKET_BATCH];
+    NetPacketIOV pkts[NET_SOCKET_BATCH];
+    bool stalled = false;
+    int size, err, n;
+
+    if (s->buf_start) {
+        /* Move the partial frame left by the last read to the front */
+        memmove(s->buf, s->buf + s->buf_start, s->buf_end - s->buf_start);
+        s->buf_end -= s->buf_start;
+        s->buf_start = 0;
+    }
 
-    size = qemu_recv(s->fd, buf1, sizeof(buf1), 0);
+    size = qemu_recv(s->fd, s->buf + s->buf_end,
+                     sizeof(s->buf) - s->buf_end, 0);
     if (size < 0) {
         err = socket_error();
         if (err != EWOULDBLOCK)
             goto eoc;
+        return;
     } else if (size == 0) {
         /* end of connection */
     eoc:
@@ -166,57 +268,56 @@ static void net_socket_send(void *opaque)
         closesocket(s->fd);
 
         s->fd = -1;
-        s->state = 0;
-        s->index = 0;
-        s->packet_len = 0;
+        s->buf_start = 0;
+        s->buf_end = 0;
         s->nc.link_down = true;
-        memset(s->buf, 0, sizeof(s->buf));
         memset(s->nc.info_str, 0, sizeof(s->nc.info_str));
 
         return;
     }
-    buf = buf1;
-    while (size > 0) {
-        /* reassemble a packet from the network */
-        switch(s->state) {
-        case 0:
-            l = 4 - s->index;
-            if (l > size)
-                l = size;
-            memcpy(s->buf + s->index, buf, l);
-            buf += l;
-            size -= l;
-            s->index += l;
-            if (s->index == 4) {
-                /* got length */
-                s->packet_len = ntohl(*(uint32_t *)s->buf);
-                s->index = 0;
-                s->state = 1;
+    s->buf_end += size;
+
+    /* Hand over every complete frame in the buffer, in batches.  Frames
+     * the peer cannot take now are copied to its queue, so the buffer can
+     * be reused in any case; reading stops until the queue drains.
+     */
+    do {
+        for (n = 0; n < NET_SOCKET_BATCH; n++) {
+            unsigned int avail = s->buf_end - s->buf_start;
+            uint32_t len;
+
+            if (avail < sizeof(len)) {
+                break;
             }
-            break;
-        case 1:
-            l = s->packet_len - s->index;
-            if (l > size)
-                l = size;
-            if (s->index + l <= sizeof(s->buf)) {
-                memcpy(s->buf + s->index, buf, l);
-            } else {
+            memcpy(&len, s->buf + s->buf_start, sizeof(len));
+            len = ntohl(len);
+            if (len > NET_SOCKET_MAX_PACKET) {
                 fprintf(stderr, "serious error: oversized packet received,"
                     "connection terminated.\n");
-                s->state = 0;
                 goto eoc;
             }
-
-            s->index += l;
-            buf += l;
-            size -= l;
-            if (s->index >= s->packet_len) {
-                qemu_send_packet(&s->nc, s->buf, s->packet_len);
-                s->index = 0;
-                s->state = 0;
+            if (avail < sizeof(len) + len) {
+                break;
             }
+
+            iov[n].iov_base = s->buf + s->buf_start + sizeof(len);
+            iov[n].iov_len = len;
+            pkts[n].iov = &iov[n];
+            pkts[n].iovcnt = 1;
+            s->buf_start += sizeof(len) + len;
+        }
+        if (n == 0) {
             break;
         }
+
+        if (qemu_sendv_packets_async(&s->nc, pkts, n,
+                                     net_socket_send_completed) < n) {
+            stalled = true;
+        }
+    } while (n == NET_SOCKET_BATCH);
+
+    if (stalled) {
+        net_socket_read_poll(s, false);
     }
 }
 
@@ -420,6 +521,8 @@ static NetClientInfo net_socket_info = {
     .type = NET_CLIENT_OPTIONS_KIND_SOCKET,
     .size = sizeof(NetSocketState),
     .receive = net_socket_receive,
+    .receive_iov = net_socket_receive_iov,
+    .receive_batch = net_socket_receive_batch,
     .cleanup = net_socket_cleanup,
 };
 
@@ -40,6 +40,7 @@
 #include "qemu-char.h"
 #include "qemu-common.h"
 #include "qemu-error.h"
+#include "iov.h"
 
 #include "net/tap-linux.h"
 
@@ -50,16 +51,25 @@
  */
 #define TAP_BUFSIZE (4096 + 65536)
 
+/* Packets read per batch.  Only the start of each buffer is touched by
+ * small packets, so most of the space stays untouched.
+ */
+#define TAP_BATCH 16
+
+/* Guest buffers one frame may be read into by tap_send_direct() */
+#define TAP_RX_MAP_IOV 64
+
 typedef struct TAPState {
     NetClientState nc;
     int fd;
     char down_script[1024];
     char down_script_arg[128];
-    uint8_t buf[TAP_BUFSIZE];
+    uint8_t buf[TAP_BATCH][TAP_BUFSIZE];
     unsigned int read_poll : 1;
     unsigned int write_poll : 1;
     unsigned int using_vnet_hdr : 1;
     unsigned int has_ufo: 1;
+    unsigned int enabled : 1;
     VHostNetState *vhost_net;
     unsigned host_vnet_hdr_len;
 } TAPState;
@@ -73,9 +83,9 @@ static void tap_writable(void *opaque);
 static void tap_update_fd_handler(TAPState *s)
 {
     qemu_set_fd_handler2(s->fd,
-                         s->read_poll  ? tap_can_send : NULL,
-                         s->read_poll  ? tap_send     : NULL,
-                         s->write_poll ? tap_writable : NULL,
+                         s->read_poll && s->enabled ? tap_can_send : NULL,
+                         s->read_poll && s->enabled ? tap_send     : NULL,
+                         s->write_poll && s->enabled ? tap_writable : NULL,
                          s);
 }
 
@@ -135,6 +145,19 @@ static ssize_t tap_receive_iov(NetClientState *nc, const struct iovec *iov,
     return tap_write_packet(s, iovp, iovcnt);
 }
 
+static int tap_receive_batch(NetClientState *nc, const NetPacketIOV *pkts,
+                             int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (tap_receive_iov(nc, pkts[i].iov, pkts[i].iovcnt) == 0) {
+            break;
+        }
+    }
+    return i;
+}
+
 static ssize_t tap_receive_raw(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -190,29 +213,107 @@ static void tap_send_completed(NetClientState *nc, ssize_t len)
     tap_read_poll(s, 1);
 }
 
+/* Read one frame straight into the receive buffers of the peer.  Returns
+ * a positive value if a frame was consumed, 0 if there was nothing to
+ * read, or -1 if the peer cannot take the frame that way and it has to be
+ * read into s->buf.
+ */
+static ssize_t tap_send_direct(TAPState *s)
+{
+#ifndef __sun__
+    struct iovec iov[1 + TAP_RX_MAP_IOV];
+    struct virtio_net_hdr_mrg_rxbuf hdr;
+    size_t hdr_len = 0;
+    int iovcnt = 0;
+    ssize_t size;
+    int n;
+
+    if (s->host_vnet_hdr_len) {
+        if (s->using_vnet_hdr) {
+            hdr_len = s->host_vnet_hdr_len;
+        } else {
+            /* Nobody wants the header, read it out of the way */
+            iov[0].iov_base = &hdr;
+            iov[0].iov_len = s->host_vnet_hdr_len;
+            iovcnt = 1;
+        }
+    }
+
+    n = qemu_peer_rx_map(&s->nc, hdr_len, iov + iovcnt, TAP_RX_MAP_IOV);
+    if (n == 0) {
+        return -1;
+    }
+
+    do {
+        size = readv(s->fd, iov, iovcnt + n);
+    } while (size == -1 && errno == EINTR);
+
+    if (size <= 0) {
+        qemu_peer_rx_unmap(&s->nc, 0);
+        return 0;
+    }
+
+    size -= iovcnt ? s->host_vnet_hdr_len : 0;
+    if (size <= 0 || (size_t)size >= iov_size(iov + iovcnt, n)) {
+        /* Runt, or possibly truncated; drop it */
+        qemu_peer_rx_unmap(&s->nc, 0);
+        return 1;
+    }
+
+    qemu_peer_rx_unmap(&s->nc, size);
+    return size;
+#else
+    return -1;
+#endif
+}
+
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
-    int size;
+    struct iovec iov[TAP_BATCH];
+    NetPacketIOV pkts[TAP_BATCH];
+    ssize_t ret;
+    int n, sent;
+
+    while ((ret = tap_send_direct(s)) > 0) {
+        if (!qemu_can_send_packet(&s->nc)) {
+            return;
+        }
+    }
+    if (ret == 0) {
+        return;
+    }
 
     do {
-        uint8_t *buf = s->buf;
+        for (n = 0; n < TAP_BATCH; n++) {
+            uint8_t *buf = s->buf[n];
+            int size;
 
-        size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
-        if (size <= 0) {
-            break;
-        }
+            size = tap_read_packet(s->fd, buf, TAP_BUFSIZE);
+            if (size <= 0) {
+                break;
+            }
+
+            if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+                buf  += s->host_vnet_hdr_len;
+                size -= s->host_vnet_hdr_len;
+            }
 
-        if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
-            buf  += s->host_vnet_hdr_len;
-            size -= s->host_vnet_hdr_len;
+            iov[n].iov_base = buf;
+            iov[n].iov_len = size;
+            pkts[n].iov = &iov[n];
+            pkts[n].iovcnt = 1;
+        }
+        if (n == 0) {
+            break;
         }
 
-        size = qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
-        if (size == 0) {
+        sent = qemu_sendv_packets_async(&s->nc, pkts, n, tap_send_completed);
+        if (sent < n) {
             tap_read_poll(s, 0);
+            break;
         }
-    } while (size > 0 && qemu_can_send_packet(&s->nc));
+    } while (n == TAP_BATCH && qemu_can_send_packet(&s->nc));
 }
 
 int tap_has_ufo(NetClientState *nc)
@@ -319,8 +420,15 @@ static NetClientInfo net_tap_info = {
     .receive = tap_receive,
     .receive_raw = tap_receive_raw,
     .receive_iov = tap_receive_iov,
+    .receive_batch = tap_receive_batch,
     .poll = tap_poll,
     .cleanup = tap_cleanup,
+    .has_ufo = tap_has_ufo,
+    .has_vnet_hdr = tap_has_vnet_hdr,
+    .has_vnet_hdr_len = tap_has_vnet_hdr_len,
+    .using_vnet_hdr = tap_using_vnet_hdr,
+    .set_offload = tap_set_offload,
+    .set_vnet_hdr_len = tap_set_vnet_hdr_len,
 };
 
 static TAPState *net_tap_fd_init(NetClientState *peer,
@@ -337,6 +445,7 @@ static TAPState *net_tap_fd_init(NetClientState *peer,
     s = DO_UPCAST(TAPState, nc, nc);
 
     s->fd = fd;
+    s->enabled = true;
     s->host_vnet_hdr_len = vnet_hdr ? sizeof(struct virtio_net_hdr) : 0;
     s->using_vnet_hdr = 0;
     s->has_ufo = tap_probe_has_ufo(s->fd);
@@ -559,17 +668,10 @@ int net_init_bridge(const NetClientOptions *opts, const char *name,
 
 static int net_tap_init(const NetdevTapOptions *tap, int *vnet_hdr,
                         const char *setup_script, char *ifname,
-                        size_t ifname_sz)
+                        size_t ifname_sz, int mq_required)
 {
     int fd, vnet_hdr_required;
 
-    if (tap->has_ifname) {
-        pstrcpy(ifname, ifname_sz, tap->ifname);
-    } else {
-        assert(ifname_sz > 0);
-        ifname[0] = '\0';
-    }
-
     if (tap->has_vnet_hdr) {
         *vnet_hdr = tap->vnet_hdr;
         vnet_hdr_required = *vnet_hdr;
@@ -578,7 +680,8 @@ static int net_tap_init(const NetdevTapOptions *tap, int *vnet_hdr,
         vnet_hdr_required = 0;
     }
 
-    TFR(fd = tap_open(ifname, ifname_sz, vnet_hdr, vnet_hdr_required));
+    TFR(fd = tap_open(ifname, ifname_sz, vnet_hdr, vnet_hdr_required,
+                      mq_required));
     if (fd < 0) {
         return -1;
     }
@@ -594,27 +697,130 @@ static int net_tap_init(const NetdevTapOptions *tap, int *vnet_hdr,
     return fd;
 }
 
+#define MAX_TAP_QUEUES 1024
+
+static int net_init_tap_one(const NetdevTapOptions *tap, NetClientState *peer,
+                            const char *model, const char *name,
+                            const char *ifname, const char *script,
+                            const char *downscript, const char *vhostfdname,
+                            int vnet_hdr, int fd)
+{
+    TAPState *s;
+
+    s = net_tap_fd_init(peer, model, name, fd, vnet_hdr);
+    if (!s) {
+        close(fd);
+        return -1;
+    }
+
+    if (tap_set_sndbuf(s->fd, tap) < 0) {
+        return -1;
+    }
+
+    if (tap->has_fd || tap->has_fds) {
+        snprintf(s->nc.info_str, sizeof(s->nc.info_str), "fd=%d", fd);
+    } else if (tap->has_helper) {
+        snprintf(s->nc.info_str, sizeof(s->nc.info_str), "helper=%s",
+                 tap->helper);
+    } else {
+        snprintf(s->nc.info_str, sizeof(s->nc.info_str),
+                 "ifname=%s,script=%s,downscript=%s", ifname, script,
+                 downscript);
+
+        if (strcmp(downscript, "no") != 0) {
+            snprintf(s->down_script, sizeof(s->down_script), "%s", downscript);
+            snprintf(s->down_script_arg, sizeof(s->down_script_arg), "%s",
+                     ifname);
+        }
+    }
+
+    if (tap->has_vhost ? tap->vhost :
+        vhostfdname || (tap->has_vhostforce && tap->vhostforce)) {
+        int vhostfd;
+
+        if (vhostfdname) {
+            vhostfd = monitor_handle_fd_param(cur_mon, vhostfdname);
+            if (vhostfd == -1) {
+                return -1;
+            }
+        } else {
+            vhostfd = -1;
+        }
+
+        s->vhost_net = vhost_net_init(&s->nc, vhostfd,
+                                      VHOST_BACKEND_TYPE_KERNEL,
+                                      tap->has_vhostforce && tap->vhostforce);
+        if (!s->vhost_net) {
+            error_report("vhost-net requested but could not be initialized");
+            return -1;
+        }
+    } else if (vhostfdname) {
+        error_report("vhostfd= is not valid without vhost");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Split a colon separated list of fd names */
+static int get_fds(char *str, char *fds[], int max)
+{
+    char *ptr = str, *this;
+    size_t len = strlen(str);
+    int i = 0;
+
+    while (i < max && ptr < str + len) {
+        this = strchr(ptr, ':');
+
+        if (this == NULL) {
+            fds[i] = g_strdup(ptr);
+        } else {
+            fds[i] = g_strndup(ptr, this - ptr);
+        }
+
+        i++;
+        if (this == NULL) {
+            break;
+        } else {
+            ptr = this + 1;
+        }
+    }
+
+    return i;
+}
+
+static void free_fds(char *fds[], int nfds)
+{
+    int i;
+
+    for (i = 0; i < nfds; i++) {
+        g_free(fds[i]);
+    }
+}
+
 int net_init_tap(const NetClientOptions *opts, const char *name,
                  NetClientState *peer)
 {
     const NetdevTapOptions *tap;
-
-    int fd, vnet_hdr = 0;
-    const char *model;
-    TAPState *s;
-
+    int fd, vnet_hdr = 0, i = 0, queues, ret = -1;
     /* for the no-fd, no-helper case */
     const char *script = NULL; /* suppress wrong "uninit'd use" gcc warning */
+    const char *downscript = NULL;
+    const char *vhostfdname;
     char ifname[128];
 
     assert(opts->kind == NET_CLIENT_OPTIONS_KIND_TAP);
     tap = opts->tap;
+    queues = tap->has_queues ? tap->queues : 1;
+    vhostfdname = tap->has_vhostfd ? tap->vhostfd : NULL;
 
     if (tap->has_fd) {
         if (tap->has_ifname || tap->has_script || tap->has_downscript ||
-            tap->has_vnet_hdr || tap->has_helper) {
+            tap->has_vnet_hdr || tap->has_helper || tap->has_queues ||
+            tap->has_fds || tap->has_vhostfds) {
             error_report("ifname=, script=, downscript=, vnet_hdr=, "
-                         "and helper= are invalid with fd=");
+                         "helper=, queues=, fds=, and vhostfds= "
+                         "are invalid with fd=");
             return -1;
         }
 
@@ -627,13 +833,67 @@ int net_init_tap(const NetClientOptions *opts, const char *name,
 
         vnet_hdr = tap_probe_vnet_hdr(fd);
 
-        model = "tap";
+        return net_init_tap_one(tap, peer, "tap", name, NULL,
+                                script, downscript, vhostfdname,
+                                vnet_hdr, fd);
+    } else if (tap->has_fds) {
+        char *fds[MAX_TAP_QUEUES];
+        char *vhost_fds[MAX_TAP_QUEUES];
+        int nfds, nvhosts = 0;
+
+        if (tap->has_ifname || tap->has_script || tap->has_downscript ||
+            tap->has_vnet_hdr || tap->has_helper || tap->has_queues ||
+            tap->has_vhostfd) {
+            error_report("ifname=, script=, downscript=, vnet_hdr=, "
+                         "helper=, queues=, and vhostfd= "
+                         "are invalid with fds=");
+            return -1;
+        }
+
+        nfds = get_fds(tap->fds, fds, MAX_TAP_QUEUES);
+        if (tap->has_vhostfds) {
+            nvhosts = get_fds(tap->vhostfds, vhost_fds, MAX_TAP_QUEUES);
+            if (nfds != nvhosts) {
+                error_report("The number of fds passed does not match the "
+                             "number of vhostfds passed");
+                goto out_free_fds;
+            }
+        }
+
+        for (i = 0; i < nfds; i++) {
+            fd = monitor_handle_fd_param(cur_mon, fds[i]);
+            if (fd == -1) {
+                goto out_free_fds;
+            }
+
+            fcntl(fd, F_SETFL, O_NONBLOCK);
+
+            if (i == 0) {
+                vnet_hdr = tap_probe_vnet_hdr(fd);
+            } else if (vnet_hdr != tap_probe_vnet_hdr(fd)) {
+                error_report("vnet_hdr not consistent across given tap fds");
+                close(fd);
+                goto out_free_fds;
+            }
+
+            if (net_init_tap_one(tap, peer, "tap", name, ifname,
+                                 script, downscript,
+                                 tap->has_vhostfds ? vhost_fds[i] : NULL,
+                                 vnet_hdr, fd)) {
+                goto out_free_fds;
+            }
+        }
+        ret = 0;
 
+out_free_fds:
+        free_fds(fds, nfds);
+        free_fds(vhost_fds, nvhosts);
+        return ret;
     } else if (tap->has_helper) {
         if (tap->has_ifname || tap->has_script || tap->has_downscript ||
-            tap->has_vnet_hdr) {
-            error_report("ifname=, script=, downscript=, and vnet_hdr= "
-                         "are invalid with helper=");
+            tap->has_vnet_hdr || tap->has_queues || tap->has_vhostfds) {
+            error_report("ifname=, script=, downscript=, vnet_hdr=, "
+                         "queues=, and vhostfds= are invalid with helper=");
             return -1;
         }
 
@@ -646,71 +906,51 @@ int net_init_tap(const NetClientOptions *opts, const char *name,
 
         vnet_hdr = tap_probe_vnet_hdr(fd);
 
-        model = "bridge";
-
+        return net_init_tap_one(tap, peer, "bridge", name, ifname,
+                                script, downscript, vhostfdname,
+                                vnet_hdr, fd);
     } else {
-        script = tap->has_script ? tap->script : DEFAULT_NETWORK_SCRIPT;
-        fd = net_tap_init(tap, &vnet_hdr, script, ifname, sizeof ifname);
-        if (fd == -1) {
+        if (tap->has_vhostfds) {
+            error_report("vhostfds= is invalid if fds= wasn't specified");
+            return -1;
+        }
+        if (queues < 1 || queues > MAX_TAP_QUEUES) {
+            error_report("queues= must be between 1 and %d", MAX_TAP_QUEUES);
+            return -1;
+        }
+        if (queues > 1 && vhostfdname) {
+            error_report("vhostfd= is invalid with queues= greater than 1");
             return -1;
         }
 
-        model = "tap";
-    }
-
-    s = net_tap_fd_init(peer, model, name, fd, vnet_hdr);
-    if (!s) {
-        close(fd);
-        return -1;
-    }
-
-    if (tap_set_sndbuf(s->fd, tap) < 0) {
-        return -1;
-    }
-
-    if (tap->has_fd) {
-        snprintf(s->nc.info_str, sizeof(s->nc.info_str), "fd=%d", fd);
-    } else if (tap->has_helper) {
-        snprintf(s->nc.info_str, sizeof(s->nc.info_str), "helper=%s",
-                 tap->helper);
-    } else {
-        const char *downscript;
-
+        script = tap->has_script ? tap->script : DEFAULT_NETWORK_SCRIPT;
         downscript = tap->has_downscript ? tap->downscript :
                                            DEFAULT_NETWORK_DOWN_SCRIPT;
 
-        snprintf(s->nc.info_str, sizeof(s->nc.info_str),
-                 "ifname=%s,script=%s,downscript=%s", ifname, script,
-                 downscript);
-
-        if (strcmp(downscript, "no") != 0) {
-            snprintf(s->down_script, sizeof(s->down_script), "%s", downscript);
-            snprintf(s->down_script_arg, sizeof(s->down_script_arg), "%s", ifname);
+        if (tap->has_ifname) {
+            pstrcpy(ifname, sizeof ifname, tap->ifname);
+        } else {
+            ifname[0] = '\0';
         }
-    }
-
-    if (tap->has_vhost ? tap->vhost :
-        tap->has_vhostfd || (tap->has_vhostforce && tap->vhostforce)) {
-        int vhostfd;
 
-        if (tap->has_vhostfd) {
-            vhostfd = monitor_handle_fd_param(cur_mon, tap->vhostfd);
-            if (vhostfd == -1) {
+        /* All queues attach to the interface created by the first open,
+         * whose name tap_open() stored back into ifname.  Only the first
+         * queue runs the setup and teardown scripts.
+         */
+        for (i = 0; i < queues; i++) {
+            fd = net_tap_init(tap, &vnet_hdr, i >= 1 ? "no" : script,
+                              ifname, sizeof ifname, queues > 1);
+            if (fd == -1) {
                 return -1;
             }
-        } else {
-            vhostfd = -1;
-        }
 
-        s->vhost_net = vhost_net_init(&s->nc, vhostfd,
-                                      tap->has_vhostforce && tap->vhostforce);
-        if (!s->vhost_net) {
-            error_report("vhost-net requested but could not be initialized");
-            return -1;
+            if (net_init_tap_one(tap, peer, "tap", name, ifname,
+                                 i >= 1 ? "no" : script,
+                                 i >= 1 ? "no" : downscript,
+                                 vhostfdname, vnet_hdr, fd)) {
+                return -1;
+            }
         }
-    } else if (tap->has_vhostfd) {
-        error_report("vhostfd= is not valid without vhost");
-        return -1;
     }
 
     return 0;
@@ -722,3 +962,38 @@ VHostNetState *tap_get_vhost_net(NetClientState *nc)
     assert(nc->info->type == NET_CLIENT_OPTIONS_KIND_TAP);
     return s->vhost_net;
 }
+
+int tap_enable(NetClientState *nc)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    int ret;
+
+    if (s->enabled) {
+        return 0;
+    } else {
+        ret = tap_fd_enable(s->fd);
+        if (ret == 0) {
+            s->enabled = true;
+            tap_update_fd_handler(s);
+        }
+        return ret;
+    }
+}
+
+int tap_disable(NetClientState *nc)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    int ret;
+
+    if (s->enabled == 0) {
+        return 0;
+    } else {
+        ret = tap_fd_disable(s->fd);
+        if (ret == 0) {
+            qemu_purge_queued_packets(nc);
+            s->enabled = false;
+            tap_update_fd_handler(s);
+        }
+        return ret;
+    }
+}
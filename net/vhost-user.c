@@ -0,0 +1,107 @@
+/*
+ * vhost-user network backend
+ *
+ * The packets of the peer virtio-net device are not seen by QEMU.  Its
+ * virtqueues are handed to a backend process connected through a UNIX
+ * domain socket, which accesses the rings and buffers in shared guest
+ * memory directly.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "clients.h"
+#include "net.h"
+#include "net/vhost-user.h"
+#include "hw/vhost_net.h"
+#include "qemu_socket.h"
+#include "qemu-error.h"
+#include "migration.h"
+
+typedef struct VhostUserState {
+    NetClientState nc;
+    VHostNetState *vhost_net;
+    Error *migration_blocker;
+} VhostUserState;
+
+VHostNetState *vhost_user_get_vhost_net(NetClientState *nc)
+{
+    VhostUserState *s = DO_UPCAST(VhostUserState, nc, nc);
+    assert(nc->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER);
+    return s->vhost_net;
+}
+
+static ssize_t vhost_user_receive(NetClientState *nc, const uint8_t *buf,
+                                  size_t size)
+{
+    /* Packets only travel through the virtqueues, drop anything else */
+    return size;
+}
+
+static void vhost_user_cleanup(NetClientState *nc)
+{
+    VhostUserState *s = DO_UPCAST(VhostUserState, nc, nc);
+
+    if (s->vhost_net) {
+        vhost_net_cleanup(s->vhost_net);
+        s->vhost_net = NULL;
+    }
+    if (s->migration_blocker) {
+        migrate_del_blocker(s->migration_blocker);
+        error_free(s->migration_blocker);
+        s->migration_blocker = NULL;
+    }
+}
+
+static NetClientInfo net_vhost_user_info = {
+    .type = NET_CLIENT_OPTIONS_KIND_VHOST_USER,
+    .size = sizeof(VhostUserState),
+    .receive = vhost_user_receive,
+    .cleanup = vhost_user_cleanup,
+};
+
+int net_init_vhost_user(const NetClientOptions *opts, const char *name,
+                        NetClientState *peer)
+{
+    const NetdevVhostUserOptions *vhost_user;
+    NetClientState *nc;
+    VhostUserState *s;
+    Error *err = NULL;
+    int fd;
+
+    assert(opts->kind == NET_CLIENT_OPTIONS_KIND_VHOST_USER);
+    vhost_user = opts->vhost_user;
+
+    if (peer) {
+        error_report("vhost-user can only be used with -netdev");
+        return -1;
+    }
+
+    fd = unix_connect(vhost_user->path, &err);
+    if (fd < 0) {
+        error_report("%s", error_get_pretty(err));
+        error_free(err);
+        return -1;
+    }
+
+    nc = qemu_new_net_client(&net_vhost_user_info, peer, "vhost-user", name);
+    snprintf(nc->info_str, sizeof(nc->info_str), "vhost-user to %s",
+             vhost_user->path);
+    s = DO_UPCAST(VhostUserState, nc, nc);
+
+    /* There is no fallback to virtio-net in QEMU, so always use vhost */
+    s->vhost_net = vhost_net_init(nc, fd, VHOST_BACKEND_TYPE_USER, true);
+    if (!s->vhost_net) {
+        error_report("vhost-user backend could not be initialized");
+        qemu_del_net_client(nc);
+        return -1;
+    }
+
+    /* Dirty logging of guest memory written by the backend is not supported */
+    error_setg(&s->migration_blocker,
+               "vhost-user netdev '%s' does not support migration", name);
+    migrate_add_blocker(s->migration_blocker);
+
+    return 0;
+}
@@ -363,3 +363,12 @@ bool is_daemonized(void)
 {
     return daemonize;
 }
+
+/* Lock all current and future mappings of the process into RAM, or unlock
+   them again.  Returns 0 or a negative errno.  */
+int os_mlock(bool on)
+{
+    int ret = on ? mlockall(MCL_CURRENT | MCL_FUTURE) : munlockall();
+
+    return ret < 0 ? -errno : 0;
+}
@@ -52,6 +52,9 @@ extern int daemon(int, int);
 #include "sysemu.h"
 #include "trace.h"
 #include "qemu_socket.h"
+#include "qemu-thread.h"
+#include <setjmp.h>
+#include <sys/mman.h>
 
 #if defined(CONFIG_VALGRIND)
 static int running_on_valgrind = -1;
@@ -226,3 +229,138 @@ int qemu_utimens(const char *path, const struct timespec *times)
 
     return utimes(path, &tv[0]);
 }
+
+typedef struct MemsetThread {
+    char *addr;
+    size_t numpages;
+    size_t pagesize;
+    QemuThread thread;
+    bool started;
+    bool failed;
+    sigjmp_buf env;
+} MemsetThread;
+
+static MemsetThread *memset_thread;
+static int memset_num_threads;
+
+static void sigbus_handler(int signal)
+{
+    int i;
+
+    for (i = 0; i < memset_num_threads; i++) {
+        if (memset_thread[i].started &&
+            qemu_thread_is_self(&memset_thread[i].thread)) {
+            siglongjmp(memset_thread[i].env, 1);
+        }
+    }
+}
+
+static void *do_touch_pages(void *arg)
+{
+    MemsetThread *t = arg;
+    sigset_t set;
+    size_t i;
+
+    /* qemu_thread_create() blocks all signals, but a blocked SIGBUS that
+     * is raised by a page fault kills the process.
+     */
+    sigemptyset(&set);
+    sigaddset(&set, SIGBUS);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+    qemu_thread_get_self(&t->thread);
+    t->started = true;
+    if (sigsetjmp(t->env, 1)) {
+        t->failed = true;
+        return NULL;
+    }
+
+    /* Writing a zero to the first byte of each page faults it in; the
+     * memory is fresh, so this does not change its contents.
+     */
+    for (i = 0; i < t->numpages; i++) {
+        memset(t->addr + i * t->pagesize, 0, 1);
+    }
+    return NULL;
+}
+
+/* Fault in the pages of area from nthreads threads, each taking one
+ * contiguous slice.  Returns -ENOMEM if the host ran out of pages (for
+ * hugetlbfs this is reported by a SIGBUS while touching).
+ */
+int os_mem_prealloc(void *area, size_t size, size_t pagesize, int nthreads)
+{
+    struct sigaction act, oldact;
+    size_t numpages = size / pagesize;
+    size_t per_thread, done = 0;
+    int i, ret = 0;
+
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+    if (nthreads > numpages) {
+        nthreads = numpages ? numpages : 1;
+    }
+
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = sigbus_handler;
+    act.sa_flags = 0;
+    sigaction(SIGBUS, &act, &oldact);
+
+    memset_thread = g_new0(MemsetThread, nthreads);
+    memset_num_threads = nthreads;
+    per_thread = numpages / nthreads;
+    for (i = 0; i < nthreads; i++) {
+        MemsetThread *t = &memset_thread[i];
+
+        t->addr = (char *)area + done * pagesize;
+        t->numpages = i == nthreads - 1 ? numpages - done : per_thread;
+        t->pagesize = pagesize;
+        done += t->numpages;
+        qemu_thread_create(&t->thread, do_touch_pages, t,
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < nthreads; i++) {
+        qemu_thread_join(&memset_thread[i].thread);
+        if (memset_thread[i].failed) {
+            ret = -ENOMEM;
+        }
+    }
+
+    g_free(memset_thread);
+    memset_thread = NULL;
+    memset_num_threads = 0;
+    sigaction(SIGBUS, &oldact, NULL);
+    return ret;
+}
+
+/* Stacks are mapped separately so that the first page can be a guard page:
+ * overflowing a coroutine stack then faults instead of silently corrupting
+ * the heap.  Pages that are never touched do not use any memory.
+ */
+void *qemu_alloc_stack(size_t sz)
+{
+    void *ptr;
+
+    ptr = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        fprintf(stderr, "Failed to allocate %zu bytes for stack: %s\n",
+                sz, strerror(errno));
+        abort();
+    }
+
+    /* stacks grow down on all hosts we care about */
+    if (mprotect(ptr, getpagesize(), PROT_NONE) != 0) {
+        fprintf(stderr, "Failed to set up stack guard page: %s\n",
+                strerror(errno));
+        abort();
+    }
+
+    return ptr;
+}
+
+void qemu_free_stack(void *stack, size_t sz)
+{
+    munmap(stack, sz);
+}
@@ -74,6 +74,19 @@ void qemu_vfree(void *ptr)
     VirtualFree(ptr, 0, MEM_RELEASE);
 }
 
+/* VirtualAlloc(MEM_COMMIT) already commits the memory; touching the pages
+ * from a single thread is enough to bring them in.
+ */
+int os_mem_prealloc(void *area, size_t size, size_t pagesize, int nthreads)
+{
+    size_t i;
+
+    for (i = 0; i < size; i += pagesize) {
+        memset((char *)area + i, 0, 1);
+    }
+    return 0;
+}
+
 /* FIXME: add proper locking */
 struct tm *gmtime_r(const time_t *timep, struct tm *result)
 {
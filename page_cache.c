@@ -1,6 +1,7 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is a set-associative hash of the page address, with LRU
+ * replacement within each set
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -34,6 +35,11 @@
     do { } while (0)
 #endif
 
+/* Number of entries a page can be cached in; a page that collides with
+   hotter ones then evicts the least recently used entry of its set
+   instead of always replacing the one it maps to.  */
+#define CACHE_WAYS 4
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
@@ -46,6 +52,7 @@ struct PageCache {
     CacheItem *page_cache;
     unsigned int page_size;
     int64_t max_num_items;
+    unsigned int num_ways;
     uint64_t max_item_age;
     int64_t num_items;
 };
@@ -72,6 +79,7 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     cache->num_items = 0;
     cache->max_item_age = 0;
     cache->max_num_items = num_pages;
+    cache->num_ways = MIN(num_pages, CACHE_WAYS);
 
     DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
 
@@ -102,71 +110,101 @@ void cache_fini(PageCache *cache)
     cache->page_cache = NULL;
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+/* First entry of the set addr maps to */
+static CacheItem *cache_get_set(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    size_t num_sets, set;
 
     g_assert(cache->max_num_items);
-    pos = (address / cache->page_size) & (cache->max_num_items - 1);
-    return pos;
-}
-
-bool cache_is_cached(const PageCache *cache, uint64_t addr)
-{
-    size_t pos;
-
-    g_assert(cache);
-    g_assert(cache->page_cache);
-
-    pos = cache_get_cache_pos(cache, addr);
-
-    return (cache->page_cache[pos].it_addr == addr);
+    num_sets = cache->max_num_items / cache->num_ways;
+    set = (addr / cache->page_size) & (num_sets - 1);
+    return &cache->page_cache[set * cache->num_ways];
 }
 
 static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *it;
+    unsigned int i;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    pos = cache_get_cache_pos(cache, addr);
-
-    return &cache->page_cache[pos];
+    it = cache_get_set(cache, addr);
+    for (i = 0; i < cache->num_ways; i++) {
+        if (it[i].it_data && it[i].it_addr == addr) {
+            return &it[i];
+        }
+    }
+    return NULL;
 }
 
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
+bool cache_is_cached(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    return cache_get_by_addr(cache, addr) != NULL;
 }
 
-void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata)
+uint8_t *get_cached_data(PageCache *cache, uint64_t addr)
 {
+    CacheItem *it = cache_get_by_addr(cache, addr);
 
-    CacheItem *it = NULL;
+    if (!it) {
+        return NULL;
+    }
+    it->it_age = ++cache->max_item_age;
+    return it->it_data;
+}
 
-    g_assert(cache);
-    g_assert(cache->page_cache);
+/* Store pdata for addr with the given age, in the entry already caching
+ * addr, a free entry of its set, or the least recently used one.  Data
+ * that ends up unused is freed.
+ */
+static void cache_insert_item(PageCache *cache, uint64_t addr, uint8_t *pdata,
+                              uint64_t age)
+{
+    CacheItem *set, *it;
+    unsigned int i;
 
-    /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
+    if (!it) {
+        set = cache_get_set(cache, addr);
+        it = &set[0];
+        for (i = 0; i < cache->num_ways && it->it_data; i++) {
+            if (!set[i].it_data || set[i].it_age < it->it_age) {
+                it = &set[i];
+            }
+        }
+        if (it->it_data && it->it_age > age) {
+            /* only happens while resizing: everything here is hotter */
+            g_free(pdata);
+            return;
+        }
+    }
 
     if (!it->it_data) {
         cache->num_items++;
+    } else if (it->it_data != pdata) {
+        g_free(it->it_data);
     }
 
     it->it_data = pdata;
-    it->it_age = ++cache->max_item_age;
+    it->it_age = age;
     it->it_addr = addr;
 }
 
+void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata)
+{
+    g_assert(cache);
+    g_assert(cache->page_cache);
+
+    cache_insert_item(cache, addr, pdata, ++cache->max_item_age);
+}
+
 int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
 {
     PageCache *new_cache;
     int64_t i;
 
-    CacheItem *old_it, *new_it;
+    CacheItem *old_it;
 
     g_assert(cache);
 
@@ -186,30 +224,19 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
         return -1;
     }
 
-    /* move all data from old cache */
+    /* move all data from old cache, keeping the MRU pages of each set */
     for (i = 0; i < cache->max_num_items; i++) {
         old_it = &cache->page_cache[i];
-        if (old_it->it_addr != -1) {
-            /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
-            if (new_it->it_data) {
-                /* keep the MRU page */
-                if (new_it->it_age >= old_it->it_age) {
-                    g_free(old_it->it_data);
-                } else {
-                    g_free(new_it->it_data);
-                    new_it->it_data = old_it->it_data;
-                    new_it->it_age = old_it->it_age;
-                    new_it->it_addr = old_it->it_addr;
-                }
-            } else {
-                cache_insert(new_cache, old_it->it_addr, old_it->it_data);
-            }
+        if (old_it->it_data) {
+            cache_insert_item(new_cache, old_it->it_addr, old_it->it_data,
+                              old_it->it_age);
         }
     }
 
+    g_free(cache->page_cache);
     cache->page_cache = new_cache->page_cache;
     cache->max_num_items = new_cache->max_num_items;
+    cache->num_ways = new_cache->num_ways;
     cache->num_items = new_cache->num_items;
 
     g_free(new_cache);
@@ -41,7 +41,11 @@ typedef struct AioHandler AioHandler;
 typedef void QEMUBHFunc(void *opaque);
 typedef void IOHandler(void *opaque);
 
-typedef struct AioContext {
+typedef struct AioContext AioContext;
+
+#include "qemu-timer.h"
+
+struct AioContext {
     GSource source;
 
     /* The list of registered AIO handlers */
@@ -53,17 +57,34 @@ typedef struct AioContext {
      */
     int walking_handlers;
 
-    /* Anchor of the list of Bottom Halves belonging to the context */
-    struct QEMUBH *first_bh;
+    /* Bottom Halves waiting to be run (or freed), most recently scheduled
+     * first.  Pushed to from any thread, emptied only by aio_bh_poll.
+     */
+    struct QEMUBH *scheduled_bh;
+
+    /* Bottom Halves taken off scheduled_bh that have not run yet, oldest
+     * first.  Only touched by aio_bh_poll, so that an aio_poll nested in a
+     * callback runs the rest of the outer call's batch too.
+     */
+    struct QEMUBH *pending_bh;
+
+    /* Deleted Bottom Halves that are freed once walking_bh drops to 0 */
+    struct QEMUBH *deleted_bh;
 
-    /* A simple lock used to protect the first_bh list, and ensure that
-     * no callbacks are removed while we're walking and dispatching callbacks.
+    /* A simple lock used to ensure that no bottom half is freed while
+     * we're dispatching callbacks.
      */
     int walking_bh;
 
     /* Used for aio_notify.  */
     EventNotifier notifier;
-} AioContext;
+
+    /* Thread pool for performing work and receiving completion callbacks */
+    struct ThreadPool *thread_pool;
+
+    /* Timers run by aio_poll and by the GSource */
+    QEMUTimerListGroup tlg;
+};
 
 /* Returns 1 if there are still outstanding AIO requests; 0 otherwise */
 typedef int (AioFlushEventNotifierHandler)(EventNotifier *e);
@@ -130,9 +151,11 @@ int aio_bh_poll(AioContext *ctx);
  * Scheduling a bottom half interrupts the main loop and causes the
  * execution of the callback that was passed to qemu_bh_new.
  *
- * Bottom halves that are scheduled from a bottom half handler are instantly
- * invoked.  This can create an infinite loop if a bottom half handler
- * schedules itself.
+ * Bottom halves that are scheduled from a bottom half handler are invoked
+ * by the next aio_bh_poll, without waiting.  This can create an infinite
+ * loop if a bottom half handler schedules itself.
+ *
+ * This function is safe to call from any thread.
  *
  * @bh: The bottom half to be scheduled.
  */
@@ -226,6 +249,22 @@ void aio_set_event_notifier(AioContext *ctx,
  */
 GSource *aio_get_g_source(AioContext *ctx);
 
+/* Return the ThreadPool bound to this AioContext */
+struct ThreadPool *aio_get_thread_pool(AioContext *ctx);
+
+/**
+ * aio_timer_new: Create a timer run by an AioContext.
+ * @ctx: the AioContext that runs the timer callback
+ * @type: the clock the expiry time refers to, e.g. QEMU_CLOCK_VIRTUAL
+ * @scale: the scale of the expiry time, e.g. SCALE_NS or SCALE_MS
+ *
+ * The callback is invoked from aio_poll(), or from the GSource when the
+ * AioContext is attached to a GMainContext; modifying the timer from
+ * another thread wakes up the context.
+ */
+QEMUTimer *aio_timer_new(AioContext *ctx, enum QEMUClockType type, int scale,
+                         QEMUTimerCB *cb, void *opaque);
+
 /* Functions to operate on the main QEMU AioContext.  */
 
 void qemu_aio_flush(void);
@@ -32,6 +32,7 @@
 #include "hw/baum.h"
 #include "hw/msmouse.h"
 #include "qmp-commands.h"
+#include "iov.h"
 
 #include <unistd.h>
 #include <fcntl.h>
@@ -145,6 +146,221 @@ int qemu_chr_fe_write(CharDriverState *s, const uint8_t *buf, int len)
     return s->chr_write(s, buf, len);
 }
 
+int qemu_chr_fe_writev(CharDriverState *s, const struct iovec *iov, int iovcnt)
+{
+    int i, ret, done = 0;
+
+    if (s->chr_writev) {
+        return s->chr_writev(s, iov, iovcnt);
+    }
+    for (i = 0; i < iovcnt; i++) {
+        ret = s->chr_write(s, iov[i].iov_base, iov[i].iov_len);
+        if (ret < 0) {
+            return done ? done : ret;
+        }
+        done += ret;
+        if (ret < iov[i].iov_len) {
+            break;
+        }
+    }
+    return done;
+}
+
+void qemu_chr_fe_set_write_ready(CharDriverState *s, IOHandler *fd_write_ready)
+{
+    s->chr_write_ready = fd_write_ready;
+}
+
+bool qemu_chr_fe_write_blocked(CharDriverState *s)
+{
+    return s->out_blocked;
+}
+
+/* Output that a non-blocking fd does not take right away is queued in a
+   ring and flushed when the fd becomes writable.  Front ends that wait
+   for the write-ready callback see the ring fill up at CHR_OUT_BUF_SIZE;
+   the others used to rely on send_all() blocking and may let it grow to
+   CHR_OUT_BUF_MAX before output is dropped.  */
+#define CHR_OUT_BUF_SIZE 65536
+#define CHR_OUT_BUF_MAX  (1024 * 1024)
+
+/* Returns 0 if the fd would block */
+static int qemu_chr_out_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    int ret;
+
+#ifdef _WIN32
+    /* a short write of the first element is as good as any */
+    ret = send(fd, iov[0].iov_base, iov[0].iov_len, 0);
+    if (ret < 0 && WSAGetLastError() == WSAEWOULDBLOCK) {
+        return 0;
+    }
+#else
+    do {
+        ret = writev(fd, iov, MIN(iovcnt, IOV_MAX));
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+#endif
+    return ret;
+}
+
+static void qemu_chr_out_update(CharDriverState *s)
+{
+    if (s->chr_update_write_handler) {
+        s->chr_update_write_handler(s);
+    } else {
+        qemu_set_fd_handler(s->out_fd, NULL, qemu_chr_out_handler(s), s);
+    }
+}
+
+static void qemu_chr_out_grow(CharDriverState *s, size_t size)
+{
+    uint8_t *buf = g_malloc(size);
+    size_t chunk = MIN(s->out_len, s->out_size - s->out_start);
+
+    memcpy(buf, s->out_buf + s->out_start, chunk);
+    memcpy(buf + chunk, s->out_buf, s->out_len - chunk);
+    g_free(s->out_buf);
+    s->out_buf = buf;
+    s->out_size = size;
+    s->out_start = 0;
+}
+
+static int qemu_chr_out_append(CharDriverState *s, const uint8_t *buf, int len)
+{
+    size_t limit = s->chr_write_ready ? CHR_OUT_BUF_SIZE : CHR_OUT_BUF_MAX;
+    size_t size = s->out_size ? s->out_size : CHR_OUT_BUF_SIZE;
+    size_t pos, chunk;
+    int n;
+
+    while (size - s->out_len < len && size < limit) {
+        size *= 2;
+    }
+    if (size > s->out_size) {
+        qemu_chr_out_grow(s, size);
+    }
+
+    n = MIN(len, s->out_size - s->out_len);
+    pos = (s->out_start + s->out_len) % s->out_size;
+    chunk = MIN(n, s->out_size - pos);
+    memcpy(s->out_buf + pos, buf, chunk);
+    memcpy(s->out_buf, buf + chunk, n - chunk);
+    s->out_len += n;
+    return n;
+}
+
+static void qemu_chr_out_flush(void *opaque)
+{
+    CharDriverState *s = opaque;
+    int chunk, ret = 0;
+
+    while (s->out_len) {
+        /* both halves of a wrapped ring in one go */
+        struct iovec iov[2];
+
+        chunk = MIN(s->out_len, s->out_size - s->out_start);
+        iov[0].iov_base = s->out_buf + s->out_start;
+        iov[0].iov_len = chunk;
+        iov[1].iov_base = s->out_buf;
+        iov[1].iov_len = s->out_len - chunk;
+        ret = qemu_chr_out_writev(s->out_fd, iov, iov[1].iov_len ? 2 : 1);
+        if (ret <= 0) {
+            break;
+        }
+        s->out_start = (s->out_start + ret) % s->out_size;
+        s->out_len -= ret;
+    }
+    if (ret < 0) {
+        /* the back end notices the hangup on its read side */
+        s->out_len = 0;
+    }
+    if (!s->out_len) {
+        s->out_start = 0;
+        qemu_chr_out_update(s);
+    }
+
+    if (s->out_blocked && s->out_size - s->out_len >= s->out_size / 2) {
+        s->out_blocked = false;
+        if (s->chr_write_ready) {
+            s->chr_write_ready(s->handler_opaque);
+        }
+    }
+}
+
+IOHandler *qemu_chr_out_handler(CharDriverState *s)
+{
+    return s->out_len ? qemu_chr_out_flush : NULL;
+}
+
+void qemu_chr_set_out_fd(CharDriverState *s, int fd)
+{
+    bool queued = s->out_len > 0;
+
+    s->out_start = 0;
+    s->out_len = 0;
+    s->out_blocked = false;
+    if (queued) {
+        qemu_chr_out_update(s);
+    }
+    s->out_fd = fd;
+    if (fd >= 0) {
+        socket_set_nonblock(fd);
+    }
+}
+
+int qemu_chr_writev_buffered(CharDriverState *s, const struct iovec *iov,
+                             int iovcnt)
+{
+    bool was_empty = !s->out_len;
+    size_t len = iov_size(iov, iovcnt);
+    size_t done = 0, skip;
+    int i, n;
+
+    s->out_blocked = false;
+    if (was_empty) {
+        n = qemu_chr_out_writev(s->out_fd, iov, iovcnt);
+        if (n < 0 || n == len) {
+            return n;
+        }
+        done = n;
+    }
+
+    skip = done;
+    for (i = 0; i < iovcnt; i++) {
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        n = qemu_chr_out_append(s, (uint8_t *)iov[i].iov_base + skip,
+                                iov[i].iov_len - skip);
+        done += n;
+        if (n < iov[i].iov_len - skip) {
+            break;
+        }
+        skip = 0;
+    }
+
+    if (done < len && s->chr_write_ready) {
+        s->out_blocked = true;
+    }
+    if (was_empty && s->out_len) {
+        qemu_chr_out_update(s);
+    }
+    return done;
+}
+
+int qemu_chr_write_buffered(CharDriverState *s, const uint8_t *buf, int len)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = len,
+    };
+
+    return qemu_chr_writev_buffered(s, &iov, 1);
+}
+
 int qemu_chr_fe_ioctl(CharDriverState *s, int cmd, void *arg)
 {
     if (!s->chr_ioctl)
@@ -557,6 +773,7 @@ static int fd_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
     return send_all(s->fd_out, buf, len);
 }
 
+
 static int fd_chr_read_poll(void *opaque)
 {
     CharDriverState *chr = opaque;
@@ -597,8 +814,9 @@ static void fd_chr_update_read_handler(CharDriverState *chr)
     if (s->fd_in >= 0) {
         if (display_type == DT_NOGRAPHIC && s->fd_in == 0) {
         } else {
-            qemu_set_fd_handler2(s->fd_in, fd_chr_read_poll,
-                                 fd_chr_read, NULL, chr);
+            qemu_set_fd_handler2(s->fd_in, fd_chr_read_poll, fd_chr_read,
+                                 s->fd_in == s->fd_out ?
+                                 qemu_chr_out_handler(chr) : NULL, chr);
         }
     }
 }
@@ -638,6 +856,21 @@ static CharDriverState *qemu_chr_open_fd(int fd_in, int fd_out)
     return chr;
 }
 
+/* Like qemu_chr_open_fd, but writes go through the output ring so that a
+   slow reader does not stall the main loop.  */
+static CharDriverState *qemu_chr_open_fd_buffered(int fd_in, int fd_out)
+{
+    CharDriverState *chr = qemu_chr_open_fd(fd_in, fd_out);
+
+    chr->chr_write = qemu_chr_write_buffered;
+    chr->chr_writev = qemu_chr_writev_buffered;
+    if (fd_in == fd_out) {
+        chr->chr_update_write_handler = fd_chr_update_read_handler;
+    }
+    qemu_chr_set_out_fd(chr, fd_out);
+    return chr;
+}
+
 static CharDriverState *qemu_chr_open_file_out(QemuOpts *opts)
 {
     int fd_out;
@@ -647,7 +880,7 @@ static CharDriverState *qemu_chr_open_file_out(QemuOpts *opts)
     if (fd_out < 0) {
         return NULL;
     }
-    return qemu_chr_open_fd(-1, fd_out);
+    return qemu_chr_open_fd_buffered(-1, fd_out);
 }
 
 static CharDriverState *qemu_chr_open_pipe(QemuOpts *opts)
@@ -675,7 +908,7 @@ static CharDriverState *qemu_chr_open_pipe(QemuOpts *opts)
             return NULL;
         }
     }
-    return qemu_chr_open_fd(fd_in, fd_out);
+    return qemu_chr_open_fd_buffered(fd_in, fd_out);
 }
 
 
@@ -873,7 +1106,19 @@ static int pty_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
         pty_chr_update_read_handler(chr);
         return 0;
     }
-    return send_all(s->fd, buf, len);
+    return qemu_chr_write_buffered(chr, buf, len);
+}
+
+static int pty_chr_writev(CharDriverState *chr, const struct iovec *iov,
+                          int iovcnt)
+{
+    PtyCharDriver *s = chr->opaque;
+
+    if (!s->connected) {
+        pty_chr_update_read_handler(chr);
+        return 0;
+    }
+    return qemu_chr_writev_buffered(chr, iov, iovcnt);
 }
 
 static int pty_chr_read_poll(void *opaque)
@@ -914,7 +1159,7 @@ static void pty_chr_update_read_handler(CharDriverState *chr)
     PtyCharDriver *s = chr->opaque;
 
     qemu_set_fd_handler2(s->fd, pty_chr_read_poll,
-                         pty_chr_read, NULL, chr);
+                         pty_chr_read, qemu_chr_out_handler(chr), chr);
     s->polling = 1;
     /*
      * Short timeout here: just need wait long enougth that qemu makes
@@ -927,6 +1172,16 @@ static void pty_chr_update_read_handler(CharDriverState *chr)
     qemu_mod_timer(s->timer, qemu_get_clock_ms(rt_clock) + 10);
 }
 
+static void pty_chr_update_write_handler(CharDriverState *chr)
+{
+    PtyCharDriver *s = chr->opaque;
+
+    if (s->connected || s->polling) {
+        qemu_set_fd_handler2(s->fd, pty_chr_read_poll,
+                             pty_chr_read, qemu_chr_out_handler(chr), chr);
+    }
+}
+
 static void pty_chr_state(CharDriverState *chr, int connected)
 {
     PtyCharDriver *s = chr->opaque;
@@ -935,6 +1190,8 @@ static void pty_chr_state(CharDriverState *chr, int connected)
         qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
         s->connected = 0;
         s->polling = 0;
+        /* nobody is going to read what is still queued */
+        qemu_chr_set_out_fd(chr, s->fd);
         /* (re-)connect poll interval for idle guests: once per second.
          * We check more frequently in case the guests sends data to
          * the virtual device linked to our pty. */
@@ -1011,10 +1268,13 @@ static CharDriverState *qemu_chr_open_pty(QemuOpts *opts)
     s = g_malloc0(sizeof(PtyCharDriver));
     chr->opaque = s;
     chr->chr_write = pty_chr_write;
+    chr->chr_writev = pty_chr_writev;
     chr->chr_update_read_handler = pty_chr_update_read_handler;
+    chr->chr_update_write_handler = pty_chr_update_write_handler;
     chr->chr_close = pty_chr_close;
 
     s->fd = master_fd;
+    qemu_chr_set_out_fd(chr, master_fd);
     s->timer = qemu_new_timer_ms(rt_clock, pty_chr_timer, chr);
 
     return chr;
@@ -1229,7 +1489,7 @@ static CharDriverState *qemu_chr_open_tty(QemuOpts *opts)
         return NULL;
     }
     tty_serial_init(fd, 115200, 'N', 8, 1);
-    chr = qemu_chr_open_fd(fd, fd);
+    chr = qemu_chr_open_fd_buffered(fd, fd);
     chr->chr_ioctl = tty_serial_ioctl;
     chr->chr_close = qemu_chr_close_tty;
     return chr;
@@ -2150,13 +2410,24 @@ static int tcp_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
 {
     TCPCharDriver *s = chr->opaque;
     if (s->connected) {
-        return send_all(s->fd, buf, len);
+        return qemu_chr_write_buffered(chr, buf, len);
     } else {
         /* XXX: indicate an error ? */
         return len;
     }
 }
 
+static int tcp_chr_writev(CharDriverState *chr, const struct iovec *iov,
+                          int iovcnt)
+{
+    TCPCharDriver *s = chr->opaque;
+    if (s->connected) {
+        return qemu_chr_writev_buffered(chr, iov, iovcnt);
+    } else {
+        return iov_size(iov, iovcnt);
+    }
+}
+
 static int tcp_chr_read_poll(void *opaque)
 {
     CharDriverState *chr = opaque;
@@ -2290,13 +2561,18 @@ static ssize_t tcp_chr_recv(CharDriverState *chr, char *buf, size_t len)
 }
 #endif
 
+/* Bound on the reads done per wakeup while the socket keeps filling the
+   buffer and the front end keeps taking it.  */
+#define TCP_READ_BATCH 16
+
 static void tcp_chr_read(void *opaque)
 {
     CharDriverState *chr = opaque;
     TCPCharDriver *s = chr->opaque;
     uint8_t buf[READ_BUF_LEN];
-    int len, size;
+    int len, size, n = 0;
 
+again:
     if (!s->connected || s->max_size <= 0)
         return;
     len = sizeof(buf);
@@ -2309,25 +2585,42 @@ static void tcp_chr_read(void *opaque)
         if (s->listen_fd >= 0) {
             qemu_set_fd_handler2(s->listen_fd, NULL, tcp_chr_accept, NULL, chr);
         }
+        qemu_chr_set_out_fd(chr, -1);
         qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
         closesocket(s->fd);
         s->fd = -1;
         qemu_chr_be_event(chr, CHR_EVENT_CLOSED);
     } else if (size > 0) {
+        int got = size;
+
         if (s->do_telnetopt)
             tcp_chr_process_IAC_bytes(chr, s, buf, &size);
         if (size > 0)
             qemu_chr_be_write(chr, buf, size);
+        if (got == len && ++n < TCP_READ_BATCH) {
+            tcp_chr_read_poll(chr);
+            goto again;
+        }
     }
 }
 
 #ifndef _WIN32
 CharDriverState *qemu_chr_open_eventfd(int eventfd)
 {
-    return qemu_chr_open_fd(eventfd, eventfd);
+    return qemu_chr_open_fd_buffered(eventfd, eventfd);
 }
 #endif
 
+static void tcp_chr_update_write_handler(CharDriverState *chr)
+{
+    TCPCharDriver *s = chr->opaque;
+
+    if (s->connected && s->fd >= 0) {
+        qemu_set_fd_handler2(s->fd, tcp_chr_read_poll,
+                             tcp_chr_read, qemu_chr_out_handler(chr), chr);
+    }
+}
+
 static void tcp_chr_connect(void *opaque)
 {
     CharDriverState *chr = opaque;
@@ -2335,6 +2628,7 @@ static void tcp_chr_connect(void *opaque)
 
     s->connected = 1;
     if (s->fd >= 0) {
+        qemu_chr_set_out_fd(chr, s->fd);
         qemu_set_fd_handler2(s->fd, tcp_chr_read_poll,
                              tcp_chr_read, NULL, chr);
     }
@@ -2481,7 +2775,9 @@ static CharDriverState *qemu_chr_open_socket(QemuOpts *opts)
 
     chr->opaque = s;
     chr->chr_write = tcp_chr_write;
+    chr->chr_writev = tcp_chr_writev;
     chr->chr_close = tcp_chr_close;
+    chr->chr_update_write_handler = tcp_chr_update_write_handler;
     chr->get_msgfd = tcp_get_msgfd;
     chr->chr_add_client = tcp_chr_add_client;
 
@@ -2865,8 +3161,12 @@ void qemu_chr_fe_close(struct CharDriverState *chr)
 void qemu_chr_delete(CharDriverState *chr)
 {
     QTAILQ_REMOVE(&chardevs, chr, next);
+    if (chr->out_len) {
+        qemu_chr_set_out_fd(chr, -1);
+    }
     if (chr->chr_close)
         chr->chr_close(chr);
+    g_free(chr->out_buf);
     g_free(chr->filename);
     g_free(chr->label);
     g_free(chr);
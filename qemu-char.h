@@ -56,6 +56,8 @@ typedef void IOEventHandler(void *opaque, int event);
 struct CharDriverState {
     void (*init)(struct CharDriverState *s);
     int (*chr_write)(struct CharDriverState *s, const uint8_t *buf, int len);
+    int (*chr_writev)(struct CharDriverState *s, const struct iovec *iov,
+                      int iovcnt);
     void (*chr_update_read_handler)(struct CharDriverState *s);
     int (*chr_ioctl)(struct CharDriverState *s, int cmd, void *arg);
     int (*get_msgfd)(struct CharDriverState *s);
@@ -69,12 +71,20 @@ struct CharDriverState {
     void (*chr_set_echo)(struct CharDriverState *chr, bool echo);
     void (*chr_guest_open)(struct CharDriverState *chr);
     void (*chr_guest_close)(struct CharDriverState *chr);
+    /* for backends that poll out_fd together with their input */
+    void (*chr_update_write_handler)(struct CharDriverState *chr);
+    IOHandler *chr_write_ready;
     void *opaque;
     QEMUTimer *open_timer;
     char *label;
     char *filename;
     int opened;
     int avail_connections;
+    /* output ring, see qemu_chr_write_buffered */
+    int out_fd;
+    bool out_blocked;
+    uint8_t *out_buf;
+    size_t out_start, out_len, out_size;
     QTAILQ_ENTRY(CharDriverState) next;
 };
 
@@ -163,6 +173,43 @@ void qemu_chr_fe_printf(CharDriverState *s, const char *fmt, ...)
  */
 int qemu_chr_fe_write(CharDriverState *s, const uint8_t *buf, int len);
 
+/**
+ * @qemu_chr_fe_writev:
+ *
+ * Like @qemu_chr_fe_write, but gathers the data from an I/O vector.  Back
+ * ends that support it pass the vector down to a single writev() instead
+ * of writing one element at a time.
+ *
+ * @iov the data
+ * @iovcnt the number of elements in @iov
+ *
+ * Returns: the number of bytes consumed
+ */
+int qemu_chr_fe_writev(CharDriverState *s, const struct iovec *iov, int iovcnt);
+
+/**
+ * @qemu_chr_fe_set_write_ready:
+ *
+ * Register a callback for front ends that can wait for the back end.  Back
+ * ends with an output buffer then return a short count from
+ * @qemu_chr_fe_write once the buffer is full, and invoke @fd_write_ready
+ * with the opaque passed to @qemu_chr_add_handlers when it has drained.
+ * Without a callback, output is buffered more generously and dropped only
+ * if the buffer overflows.
+ *
+ * @fd_write_ready the callback, or NULL
+ */
+void qemu_chr_fe_set_write_ready(CharDriverState *s, IOHandler *fd_write_ready);
+
+/**
+ * @qemu_chr_fe_write_blocked:
+ *
+ * Returns: true if the last call to @qemu_chr_fe_write was cut short by a
+ *          full output buffer, in which case the callback registered with
+ *          @qemu_chr_fe_set_write_ready will be invoked later
+ */
+bool qemu_chr_fe_write_blocked(CharDriverState *s);
+
 /**
  * @qemu_chr_fe_ioctl:
  *
@@ -223,6 +270,36 @@ void qemu_chr_be_write(CharDriverState *s, uint8_t *buf, int len);
  */
 void qemu_chr_be_event(CharDriverState *s, int event);
 
+/**
+ * @qemu_chr_set_out_fd:
+ *
+ * Make @qemu_chr_write_buffered write to @fd, which is switched to
+ * non-blocking mode.  Any data still queued for the previous fd is
+ * discarded; pass -1 before closing it.
+ */
+void qemu_chr_set_out_fd(CharDriverState *s, int fd);
+
+/**
+ * @qemu_chr_write_buffered:
+ *
+ * Default implementation of chr_write for back ends that set an output fd.
+ * Writes what the fd takes right away and queues the rest.
+ *
+ * Returns: the number of bytes written or queued, or -1 on error
+ */
+int qemu_chr_write_buffered(CharDriverState *s, const uint8_t *buf, int len);
+int qemu_chr_writev_buffered(CharDriverState *s, const struct iovec *iov,
+                             int iovcnt);
+
+/**
+ * @qemu_chr_out_handler:
+ *
+ * For back ends that set chr_update_write_handler because they register
+ * the output fd themselves: the fd_write handler to pass along with their
+ * read handlers, NULL while nothing is queued.
+ */
+IOHandler *qemu_chr_out_handler(CharDriverState *s);
+
 void qemu_chr_add_handlers(CharDriverState *s,
                            IOCanReadHandler *fd_can_read,
                            IOReadHandler *fd_read,
@@ -177,6 +177,8 @@ int qemu_fls(int i);
 int qemu_fdatasync(int fd);
 int fcntl_setfl(int fd, int flag);
 int qemu_parse_fd(const char *param);
+int qemu_parse_cpulist(const char *str, unsigned long *cpus,
+                       unsigned long nbits);
 
 /*
  * strtosz() suffixes used to specify the default treatment of an
@@ -318,6 +320,7 @@ typedef struct PCIHostDeviceAddress {
 } PCIHostDeviceAddress;
 
 void tcg_exec_init(unsigned long tb_size);
+int tb_persist_init(const char *path);
 bool tcg_enabled(void);
 
 void cpu_exec_init_all(void);
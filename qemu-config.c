@@ -61,7 +61,15 @@ static QemuOptsList qemu_drive_opts = {
         },{
             .name = "aio",
             .type = QEMU_OPT_STRING,
-            .help = "host AIO implementation (threads, native)",
+            .help = "host AIO implementation (threads, native, io_uring)",
+        },{
+            .name = "aio-sqpoll",
+            .type = QEMU_OPT_BOOL,
+            .help = "let a kernel thread poll for io_uring submissions",
+        },{
+            .name = "aio-fixed-bufs",
+            .type = QEMU_OPT_BOOL,
+            .help = "register guest RAM with io_uring",
         },{
             .name = "format",
             .type = QEMU_OPT_STRING,
@@ -110,10 +118,66 @@ static QemuOptsList qemu_drive_opts = {
             .name = "bps_wr",
             .type = QEMU_OPT_NUMBER,
             .help = "limit write bytes per second",
+        },{
+            .name = "iops_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "total I/O operations per second burst rate",
+        },{
+            .name = "iops_rd_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "read operations per second burst rate",
+        },{
+            .name = "iops_wr_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "write operations per second burst rate",
+        },{
+            .name = "bps_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "total bytes per second burst rate",
+        },{
+            .name = "bps_rd_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "read bytes per second burst rate",
+        },{
+            .name = "bps_wr_max",
+            .type = QEMU_OPT_NUMBER,
+            .help = "write bytes per second burst rate",
+        },{
+            .name = "burst_length",
+            .type = QEMU_OPT_NUMBER,
+            .help = "seconds the burst rates can be sustained",
+        },{
+            .name = "iops_size",
+            .type = QEMU_OPT_SIZE,
+            .help = "requests larger than this count as several operations",
+        },{
+            .name = "group",
+            .type = QEMU_OPT_STRING,
+            .help = "throttle group sharing the limits between drives",
         },{
             .name = "copy-on-read",
             .type = QEMU_OPT_BOOL,
             .help = "copy read data from backing file into image file",
+        },{
+            .name = "merge",
+            .type = QEMU_OPT_BOOL,
+            .help = "merge adjacent requests before submitting them",
+        },{
+            .name = "merge-window",
+            .type = QEMU_OPT_NUMBER,
+            .help = "microseconds requests may wait for merging",
+        },{
+            .name = "stats-intervals",
+            .type = QEMU_OPT_STRING,
+            .help = "colon-separated intervals in seconds for latency stats",
+        },{
+            .name = "l2-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the image format's L2 table cache",
+        },{
+            .name = "refcount-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the image format's refcount block cache",
         },{
             .name = "boot",
             .type = QEMU_OPT_BOOL,
@@ -144,6 +208,15 @@ static QemuOptsList qemu_iscsi_opts = {
             .name = "initiator-name",
             .type = QEMU_OPT_STRING,
             .help = "Initiator iqn name to use when connecting",
+        },{
+            .name = "sessions",
+            .type = QEMU_OPT_NUMBER,
+            .help = "number of sessions to log in per LUN (1-8)",
+        },{
+            .name = "queue-depth",
+            .type = QEMU_OPT_NUMBER,
+            .help = "maximum READ/WRITE commands in flight per session, "
+                    "0 for no limit",
         },
         { /* end of list */ }
     },
@@ -249,6 +322,12 @@ QemuOptsList qemu_fsdev_opts = {
         }, {
             .name = "sock_fd",
             .type = QEMU_OPT_NUMBER,
+        }, {
+            .name = "workers",
+            .type = QEMU_OPT_NUMBER,
+        }, {
+            .name = "stat_cache_ttl",
+            .type = QEMU_OPT_NUMBER,
         },
 
         { /*End of list */ }
@@ -284,6 +363,12 @@ QemuOptsList qemu_virtfs_opts = {
         }, {
             .name = "sock_fd",
             .type = QEMU_OPT_NUMBER,
+        }, {
+            .name = "workers",
+            .type = QEMU_OPT_NUMBER,
+        }, {
+            .name = "stat_cache_ttl",
+            .type = QEMU_OPT_NUMBER,
         },
 
         { /*End of list */ }
@@ -379,6 +464,22 @@ QemuOptsList qemu_sandbox_opts = {
     },
 };
 
+QemuOptsList qemu_backing_cache_opts = {
+    .name = "backing-cache",
+    .implied_opt_name = "path",
+    .head = QTAILQ_HEAD_INITIALIZER(qemu_backing_cache_opts.head),
+    .desc = {
+        {
+            .name = "path",
+            .type = QEMU_OPT_STRING,
+        },{
+            .name = "size",
+            .type = QEMU_OPT_SIZE,
+        },
+        { /* end of list */ }
+    },
+};
+
 static QemuOptsList qemu_mon_opts = {
     .name = "mon",
     .implied_opt_name = "chardev",
@@ -587,6 +688,10 @@ static QemuOptsList qemu_machine_opts = {
             .name = "kvm_shadow_mem",
             .type = QEMU_OPT_SIZE,
             .help = "KVM shadow MMU size",
+        }, {
+            .name = "kvm_dirty_ring",
+            .type = QEMU_OPT_NUMBER,
+            .help = "KVM dirty ring entries per vCPU (0 uses the dirty bitmap)",
         }, {
             .name = "kernel",
             .type = QEMU_OPT_STRING,
@@ -623,6 +728,50 @@ static QemuOptsList qemu_machine_opts = {
             .name = "mem-merge",
             .type = QEMU_OPT_BOOL,
             .help = "enable/disable memory merge support",
+        }, {
+            .name = "mem-share",
+            .type = QEMU_OPT_BOOL,
+            .help = "back guest memory by shareable file descriptors",
+        }, {
+            .name = "prealloc-threads",
+            .type = QEMU_OPT_NUMBER,
+            .help = "number of threads used to preallocate guest memory",
+        }, {
+            .name = "tcg-thread",
+            .type = QEMU_OPT_STRING,
+            .help = "run TCG vCPUs on a single host thread or one each",
+        }, {
+            .name = "halt-poll-ns",
+            .type = QEMU_OPT_NUMBER,
+            .help = "maximum time a halted vCPU polls before sleeping",
+        }, {
+            .name = "mlock",
+            .type = QEMU_OPT_BOOL,
+            .help = "lock all guest and QEMU memory into host RAM",
+        }, {
+            .name = "thp",
+            .type = QEMU_OPT_BOOL,
+            .help = "back guest memory by transparent hugepages",
+        }, {
+            .name = "ram-align",
+            .type = QEMU_OPT_SIZE,
+            .help = "alignment of guest RAM blocks in host memory",
+        }, {
+            .name = "fast-boot",
+            .type = QEMU_OPT_BOOL,
+            .help = "leave out legacy devices, option ROMs and SMBIOS tables",
+        }, {
+            .name = "startup-trace",
+            .type = QEMU_OPT_BOOL,
+            .help = "print the duration of each startup phase",
+        }, {
+            .name = "maxmem",
+            .type = QEMU_OPT_SIZE,
+            .help = "maximum guest memory including hotplugged memory",
+        }, {
+            .name = "mem-slots",
+            .type = QEMU_OPT_NUMBER,
+            .help = "number of slots for hotplugged memory",
         },{
             .name = "usb",
             .type = QEMU_OPT_BOOL,
@@ -707,6 +856,7 @@ static QemuOptsList *vm_config_groups[32] = {
     &qemu_boot_opts,
     &qemu_iscsi_opts,
     &qemu_sandbox_opts,
+    &qemu_backing_cache_opts,
     &qemu_add_fd_opts,
     &qemu_object_opts,
     NULL,
@@ -14,16 +14,147 @@
 
 #include "trace.h"
 #include "qemu-common.h"
+#include "qemu-thread.h"
+#include "qemu-tls.h"
 #include "qemu-coroutine.h"
 #include "qemu-coroutine-int.h"
 
+enum {
+    /* Terminated coroutines each thread keeps for itself */
+    POOL_BATCH_SIZE = 64,
+
+    /* Maximum size of the pool shared by all threads */
+    POOL_MAX_SIZE = 256,
+};
+
+QSLIST_HEAD(CoroutinePool, Coroutine);
+
+/** Free list shared by all threads, protected by pool_lock */
+static struct CoroutinePool release_pool =
+    QSLIST_HEAD_INITIALIZER(release_pool);
+static unsigned int release_pool_size;
+static QemuMutex pool_lock;
+
+/** Per-thread free list to speed up creation without taking pool_lock.
+ * This is really thread-local only on Linux, see qemu-tls.h; elsewhere
+ * coroutines are only used by one thread at a time.
+ */
+static DEFINE_TLS(struct CoroutinePool, alloc_pool);
+static DEFINE_TLS(unsigned int, alloc_pool_size);
+
+static void coroutine_pool_free_local(void)
+{
+    Coroutine *co;
+
+    while ((co = QSLIST_FIRST(&tls_var(alloc_pool))) != NULL) {
+        QSLIST_REMOVE_HEAD(&tls_var(alloc_pool), pool_next);
+        qemu_coroutine_delete(co);
+    }
+    tls_var(alloc_pool_size) = 0;
+}
+
+#ifdef __linux__
+static pthread_key_t pool_key;
+
+/* Called on thread exit when the thread's free list is not empty */
+static void coroutine_pool_thread_cleanup(void *opaque)
+{
+    coroutine_pool_free_local();
+}
+
+static void coroutine_pool_register_thread(void)
+{
+    if (!pthread_getspecific(pool_key)) {
+        pthread_setspecific(pool_key, &tls_var(alloc_pool));
+    }
+}
+#else
+static void coroutine_pool_register_thread(void)
+{
+}
+#endif
+
+static void __attribute__((constructor)) coroutine_pool_init(void)
+{
+    qemu_mutex_init(&pool_lock);
+#ifdef __linux__
+    if (pthread_key_create(&pool_key, coroutine_pool_thread_cleanup) != 0) {
+        fprintf(stderr, "unable to create coroutine pool key: %s\n",
+                strerror(errno));
+        abort();
+    }
+#endif
+}
+
+static void __attribute__((destructor)) coroutine_pool_cleanup(void)
+{
+    Coroutine *co;
+    Coroutine *tmp;
+
+    coroutine_pool_free_local();
+    QSLIST_FOREACH_SAFE(co, &release_pool, pool_next, tmp) {
+        qemu_coroutine_delete(co);
+    }
+}
+
 Coroutine *qemu_coroutine_create(CoroutineEntry *entry)
 {
-    Coroutine *co = qemu_coroutine_new();
+    Coroutine *co = NULL;
+
+    if (CONFIG_COROUTINE_POOL) {
+        co = QSLIST_FIRST(&tls_var(alloc_pool));
+        if (!co) {
+            /* take over the whole shared list, one lock for many creations */
+            qemu_mutex_lock(&pool_lock);
+            co = QSLIST_FIRST(&release_pool);
+            QSLIST_INIT(&release_pool);
+            tls_var(alloc_pool).slh_first = co;
+            tls_var(alloc_pool_size) = release_pool_size;
+            release_pool_size = 0;
+            qemu_mutex_unlock(&pool_lock);
+            if (co) {
+                coroutine_pool_register_thread();
+            }
+        }
+        if (co) {
+            QSLIST_REMOVE_HEAD(&tls_var(alloc_pool), pool_next);
+            tls_var(alloc_pool_size)--;
+        }
+    }
+
+    if (!co) {
+        co = qemu_coroutine_new();
+    }
+
     co->entry = entry;
     return co;
 }
 
+static void coroutine_delete(Coroutine *co)
+{
+    if (CONFIG_COROUTINE_POOL) {
+        co->caller = NULL;
+
+        if (tls_var(alloc_pool_size) < POOL_BATCH_SIZE) {
+            coroutine_pool_register_thread();
+            QSLIST_INSERT_HEAD(&tls_var(alloc_pool), co, pool_next);
+            tls_var(alloc_pool_size)++;
+            return;
+        }
+
+        qemu_mutex_lock(&pool_lock);
+        if (release_pool_size < POOL_MAX_SIZE) {
+            QSLIST_INSERT_HEAD(&release_pool, co, pool_next);
+            release_pool_size++;
+            qemu_mutex_unlock(&pool_lock);
+            return;
+        }
+        qemu_mutex_unlock(&pool_lock);
+    }
+
+    qemu_coroutine_delete(co);
+}
+
 static void coroutine_swap(Coroutine *from, Coroutine *to)
 {
     CoroutineAction ret;
@@ -35,7 +166,7 @@ static void coroutine_swap(Coroutine *from, Coroutine *to)
         return;
     case COROUTINE_TERMINATE:
         trace_qemu_coroutine_terminate(to);
-        qemu_coroutine_delete(to);
+        coroutine_delete(to);
         return;
     default:
         abort();
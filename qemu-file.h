@@ -63,6 +63,26 @@ typedef int (QEMUFileRateLimit)(void *opaque);
 typedef int64_t (QEMUFileSetRateLimit)(void *opaque, int64_t new_rate);
 typedef int64_t (QEMUFileGetRateLimit)(void *opaque);
 
+/* Write all the iovecs in one go; an alternative to put_buffer that lets
+ * qemu_put_buffer_async() data go out without being copied.  Returns the
+ * number of bytes written or a negative errno.
+ */
+typedef ssize_t (QEMUFileWritevBufferFunc)(void *opaque, struct iovec *iov,
+                                           int iovcnt, int64_t pos);
+
+/* Hooks around the RAM save loop, for transports that move RAM pages
+ * themselves instead of sending them in the stream (see migration-rdma.c).
+ * flags is one of the RAM_CONTROL_* values.
+ */
+typedef int (QEMURamHookFunc)(void *opaque, uint64_t flags);
+
+/* Send the page at offset in the RAM block starting at block_offset.
+ * Returns the number of bytes sent, -ENOTSUP to have the page sent in
+ * the stream as usual, or another negative errno.
+ */
+typedef int (QEMURamSaveFunc)(void *opaque, uint64_t block_offset,
+                              uint64_t offset, size_t size);
+
 typedef struct QEMUFileOps {
     QEMUFilePutBufferFunc *put_buffer;
     QEMUFileGetBufferFunc *get_buffer;
@@ -71,6 +91,10 @@ typedef struct QEMUFileOps {
     QEMUFileRateLimit *rate_limit;
     QEMUFileSetRateLimit *set_rate_limit;
     QEMUFileGetRateLimit *get_rate_limit;
+    QEMUFileWritevBufferFunc *writev_buffer;
+    QEMURamHookFunc *before_ram_iterate;
+    QEMURamHookFunc *after_ram_iterate;
+    QEMURamSaveFunc *save_page;
 } QEMUFileOps;
 
 QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops);
@@ -81,7 +105,18 @@ QEMUFile *qemu_popen(FILE *popen_file, const char *mode);
 QEMUFile *qemu_popen_cmd(const char *command, const char *mode);
 int qemu_get_fd(QEMUFile *f);
 int qemu_fclose(QEMUFile *f);
+int qemu_fflush(QEMUFile *f);
 void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size);
+void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, int size);
+
+#define RAM_CONTROL_SETUP     0
+#define RAM_CONTROL_ROUND     1
+#define RAM_CONTROL_FINISH    2
+
+void ram_control_before_iterate(QEMUFile *f, uint64_t flags);
+void ram_control_after_iterate(QEMUFile *f, uint64_t flags);
+int ram_control_save_page(QEMUFile *f, uint64_t block_offset,
+                          uint64_t offset, size_t size);
 void qemu_put_byte(QEMUFile *f, int v);
 
 static inline void qemu_put_ubyte(QEMUFile *f, unsigned int v)
@@ -116,7 +151,6 @@ int qemu_file_get_error(QEMUFile *f);
 /* Try to send any outstanding data.  This function is useful when output is
  * halted due to rate limiting or EAGAIN errors occur as it can be used to
  * resume output. */
-int qemu_file_put_notify(QEMUFile *f);
 
 static inline void qemu_put_be64s(QEMUFile *f, const uint64_t *pv)
 {
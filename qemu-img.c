@@ -88,6 +88,8 @@ static void help(void)
            "  '-p' show progress of command (only certain commands)\n"
            "  '-S' indicates the consecutive number of bytes that must contain only zeros\n"
            "       for qemu-img to create a sparse image during conversion\n"
+           "  '-m' number of parallel coroutines for the conversion (default 8)\n"
+           "  '-W' allow the conversion to write out of order\n"
            "  '--output' takes the format in which the output must be done (human or json)\n"
            "\n"
            "Parameters to check subcommand:\n"
@@ -573,6 +575,11 @@ static int is_allocated_sectors(const uint8_t *buf, int n, int *pnum)
         return 0;
     }
     is_zero = buffer_is_zero(buf, 512);
+    /* Runs of zeroes are common, check them in one go */
+    if (is_zero && n > 1 && buffer_is_zero(buf + 512, (n - 1) * 512)) {
+        *pnum = n;
+        return 0;
+    }
     for(i = 1; i < n; i++) {
         buf += 512;
         if (is_zero != buffer_is_zero(buf, 512)) {
@@ -643,6 +650,11 @@ static int compare_sectors(const uint8_t *buf1, const uint8_t *buf2, int n,
     }
 
     res = !!memcmp(buf1, buf2, 512);
+    /* Matching buffers are the common case, compare them in one go */
+    if (!res && n > 1 && !memcmp(buf1 + 512, buf2 + 512, (n - 1) * 512)) {
+        *pnum = n;
+        return 0;
+    }
     for(i = 1; i < n; i++) {
         buf1 += 512;
         buf2 += 512;
@@ -658,9 +670,342 @@ static int compare_sectors(const uint8_t *buf1, const uint8_t *buf2, int n,
 
 #define IO_BUF_SIZE (2 * 1024 * 1024)
 
+#define MAX_COROUTINES 16
+
+enum ImgConvertBlockStatus {
+    BLK_DATA,
+    BLK_ZERO,
+    BLK_BACKING_FILE,
+};
+
+typedef struct ImgConvertState {
+    BlockDriverState **src;
+    int64_t *src_sectors;
+    int src_num;
+    int64_t total_sectors;
+    int64_t allocated_sectors;
+    int64_t allocated_done;
+    int64_t sector_num;
+    int64_t wr_offs;
+    enum ImgConvertBlockStatus status;
+    int64_t sector_next_status;
+    BlockDriverState *target;
+    bool has_zero_init;
+    bool target_has_backing;
+    bool wr_in_order;
+    int min_sparse;
+    int buf_sectors;
+    int num_coroutines;
+    int running_coroutines;
+    Coroutine *co[MAX_COROUTINES];
+    int64_t wait_sector_num[MAX_COROUTINES];
+    CoMutex lock;
+    int ret;
+} ImgConvertState;
+
+/* Find the source image that contains sector_num and its start sector */
+static void convert_select_part(ImgConvertState *s, int64_t sector_num,
+                                int *src_cur, int64_t *src_cur_offset)
+{
+    *src_cur = 0;
+    *src_cur_offset = 0;
+    while (sector_num - *src_cur_offset >= s->src_sectors[*src_cur]) {
+        *src_cur_offset += s->src_sectors[*src_cur];
+        (*src_cur)++;
+        assert(*src_cur < s->src_num);
+    }
+}
+
+/*
+ * Returns the number of sectors starting at sector_num that can be handled
+ * with a single request, and updates s->status to tell how. Unallocated
+ * sectors are left alone if the output has a backing file, and are known to
+ * read as zeros if the source image has no backing file.
+ */
+static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
+{
+    int64_t src_cur_offset;
+    int src_cur, n;
+
+    convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+    n = MIN(s->total_sectors - sector_num, INT_MAX >> BDRV_SECTOR_BITS);
+    n = MIN(n, s->src_sectors[src_cur] - (sector_num - src_cur_offset));
+
+    if (s->sector_next_status <= sector_num) {
+        BlockDriverState *bs = s->src[src_cur];
+        int ret;
+
+        ret = bdrv_is_allocated(bs, sector_num - src_cur_offset, n, &n);
+        if (ret < 0) {
+            return ret;
+        }
+
+        if (ret) {
+            s->status = BLK_DATA;
+        } else if (s->target_has_backing) {
+            s->status = BLK_BACKING_FILE;
+        } else if (!bs->backing_hd) {
+            s->status = BLK_ZERO;
+        } else {
+            s->status = BLK_DATA;
+        }
+
+        s->sector_next_status = sector_num + n;
+    }
+
+    n = MIN(n, s->sector_next_status - sector_num);
+    if (s->status == BLK_DATA) {
+        n = MIN(n, s->buf_sectors);
+    }
+
+    return n;
+}
+
+static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
+                                        int nb_sectors, uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int n, ret;
+
+    assert(nb_sectors <= s->buf_sectors);
+    while (nb_sectors > 0) {
+        int64_t src_cur_offset;
+        int src_cur;
+
+        convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+        n = MIN(nb_sectors,
+                s->src_sectors[src_cur] - (sector_num - src_cur_offset));
+
+        iov.iov_base = buf;
+        iov.iov_len = n << BDRV_SECTOR_BITS;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        ret = bdrv_co_readv(s->src[src_cur], sector_num - src_cur_offset,
+                            n, &qiov);
+        if (ret < 0) {
+            return ret;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
+                                         int nb_sectors, uint8_t *buf,
+                                         enum ImgConvertBlockStatus status)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int ret;
+
+    while (nb_sectors > 0) {
+        int n = nb_sectors;
+
+        switch (status) {
+        case BLK_BACKING_FILE:
+            /* The backing file of the output already has this data */
+            assert(s->target_has_backing);
+            break;
+
+        case BLK_DATA:
+            /* If the output image is being created as a copy on write image,
+               copy all sectors even the ones containing only NUL bytes,
+               because they may differ from the sectors in the base image.
+
+               If the output is to a host device, we also write out
+               sectors that are entirely 0, since whatever data was
+               already there is garbage, not 0s. */
+            if (!s->has_zero_init || s->target_has_backing ||
+                is_allocated_sectors_min(buf, n, &n, s->min_sparse)) {
+                iov.iov_base = buf;
+                iov.iov_len = n << BDRV_SECTOR_BITS;
+                qemu_iovec_init_external(&qiov, &iov, 1);
+
+                ret = bdrv_co_writev(s->target, sector_num, n, &qiov);
+                if (ret < 0) {
+                    return ret;
+                }
+            }
+            break;
+
+        case BLK_ZERO:
+            if (s->has_zero_init) {
+                break;
+            }
+            ret = bdrv_co_write_zeroes(s->target, sector_num, n);
+            if (ret < 0) {
+                return ret;
+            }
+            break;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+    }
+
+    return 0;
+}
+
+static void coroutine_fn convert_co_do_copy(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    uint8_t *buf;
+    int ret, i;
+    int index = -1;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] == qemu_coroutine_self()) {
+            index = i;
+            break;
+        }
+    }
+    assert(index >= 0);
+
+    s->running_coroutines++;
+    buf = qemu_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+
+    for (;;) {
+        int n;
+        int64_t sector_num;
+        enum ImgConvertBlockStatus status;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        n = convert_iteration_sectors(s, s->sector_num);
+        if (n < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            error_report("error while reading block status of sector %"
+                         PRId64 ": %s", s->sector_num, strerror(-n));
+            s->ret = n;
+            break;
+        }
+
+        /* Other coroutines can go on with the following sectors while this
+         * request is being processed */
+        sector_num = s->sector_num;
+        status = s->status;
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (status == BLK_DATA) {
+            s->allocated_done += n;
+            qemu_progress_print(100.0 * s->allocated_done /
+                                s->allocated_sectors, 0);
+
+            ret = convert_co_read(s, sector_num, n, buf);
+            if (ret < 0) {
+                error_report("error while reading sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                s->ret = ret;
+                goto out;
+            }
+        }
+
+        if (s->wr_in_order) {
+            /* Wait until all previous sectors have been written */
+            while (s->wr_offs != sector_num) {
+                if (s->ret != -EINPROGRESS) {
+                    goto out;
+                }
+                s->wait_sector_num[index] = sector_num;
+                qemu_coroutine_yield();
+            }
+            s->wait_sector_num[index] = -1;
+        }
+
+        ret = convert_co_write(s, sector_num, n, buf, status);
+        if (ret < 0) {
+            error_report("error while writing sector %" PRId64
+                         ": %s", sector_num, strerror(-ret));
+            s->ret = ret;
+            goto out;
+        }
+
+        if (s->wr_in_order) {
+            /* Wake up the coroutine that waits for this write, if any. It
+             * can't be ourselves, wait_sector_num is -1 for us now. */
+            s->wr_offs = sector_num + n;
+            for (i = 0; i < s->num_coroutines; i++) {
+                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
+                    qemu_coroutine_enter(s->co[i], NULL);
+                    break;
+                }
+            }
+        }
+    }
+
+out:
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->running_coroutines--;
+    if (!s->running_coroutines && s->ret == -EINPROGRESS) {
+        /* The conversion has finished successfully */
+        s->ret = 0;
+    }
+}
+
+static int convert_do_copy(ImgConvertState *s)
+{
+    int64_t sector_num = 0;
+    int i, n;
+
+    /* Count the sectors that need to be read for the progress output */
+    s->allocated_sectors = 0;
+    while (sector_num < s->total_sectors) {
+        n = convert_iteration_sectors(s, sector_num);
+        if (n < 0) {
+            error_report("error while reading block status of sector %"
+                         PRId64 ": %s", sector_num, strerror(-n));
+            return n;
+        }
+        if (s->status == BLK_DATA) {
+            s->allocated_sectors += n;
+        }
+        sector_num += n;
+    }
+
+    s->sector_next_status = 0;
+    s->ret = -EINPROGRESS;
+
+    /* Submit the first requests of all coroutines together */
+    for (i = 0; i < s->src_num; i++) {
+        bdrv_io_plug(s->src[i]);
+    }
+
+    qemu_co_mutex_init(&s->lock);
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy);
+        s->wait_sector_num[i] = -1;
+        qemu_coroutine_enter(s->co[i], s);
+    }
+
+    for (i = 0; i < s->src_num; i++) {
+        bdrv_io_unplug(s->src[i]);
+    }
+
+    while (s->ret == -EINPROGRESS) {
+        aio_poll(bdrv_get_aio_context(s->target), true);
+    }
+
+    if (s->ret == 0 && !s->allocated_sectors) {
+        qemu_progress_print(100, 0);
+    }
+
+    return s->ret;
+}
+
 static int img_convert(int argc, char **argv)
 {
-    int c, ret = 0, n, n1, bs_n, bs_i, compress, cluster_size, cluster_sectors;
+    int c, ret = 0, n, bs_n, bs_i, compress, cluster_size, cluster_sectors;
     int progress = 0, flags;
     const char *fmt, *out_fmt, *cache, *out_baseimg, *out_filename;
     BlockDriver *drv, *proto_drv;
@@ -668,7 +1013,6 @@ static int img_convert(int argc, char **argv)
     int64_t total_sectors, nb_sectors, sector_num, bs_offset;
     uint64_t bs_sectors;
     uint8_t * buf = NULL;
-    const uint8_t *buf1;
     BlockDriverInfo bdi;
     QEMUOptionParameter *param = NULL, *create_options = NULL;
     QEMUOptionParameter *out_baseimg_param;
@@ -676,6 +1020,9 @@ static int img_convert(int argc, char **argv)
     const char *snapshot_name = NULL;
     float local_progress = 0;
     int min_sparse = 8; /* Need at least 4k of zeros for sparse detection */
+    int num_coroutines = 8;
+    bool wr_in_order = true;
+    ImgConvertState state;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -683,7 +1030,7 @@ static int img_convert(int argc, char **argv)
     out_baseimg = NULL;
     compress = 0;
     for(;;) {
-        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:");
+        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:m:W");
         if (c == -1) {
             break;
         }
@@ -737,7 +1084,29 @@ static int img_convert(int argc, char **argv)
         case 't':
             cache = optarg;
             break;
+        case 'm':
+        {
+            char *end;
+            num_coroutines = strtol(optarg, &end, 10);
+            if (*end || num_coroutines < 1 ||
+                num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d",
+                             MAX_COROUTINES);
+                return 1;
+            }
+            break;
         }
+        case 'W':
+            wr_in_order = false;
+            break;
+        }
+    }
+
+    if (!wr_in_order && compress) {
+        error_report("Out of order write and compress are mutually "
+                     "exclusive");
+        return 1;
     }
 
     bs_n = argc - optind - 1;
@@ -896,9 +1265,9 @@ static int img_convert(int argc, char **argv)
     bs_i = 0;
     bs_offset = 0;
     bdrv_get_geometry(bs[0], &bs_sectors);
-    buf = qemu_blockalign(out_bs, IO_BUF_SIZE);
 
     if (compress) {
+        buf = qemu_blockalign(out_bs, IO_BUF_SIZE);
         ret = bdrv_get_info(out_bs, &bdi);
         if (ret < 0) {
             error_report("could not get block driver info");
@@ -919,18 +1288,18 @@ static int img_convert(int argc, char **argv)
                 (nb_sectors / MIN(nb_sectors, cluster_sectors));
         }
 
+        /* Read as many whole clusters as fit in the buffer, so that the
+         * driver can compress them in parallel */
         for(;;) {
             int64_t bs_num;
-            int remainder;
+            int remainder, nb_clusters, i, run;
             uint8_t *buf2;
 
             nb_sectors = total_sectors - sector_num;
             if (nb_sectors <= 0)
                 break;
-            if (nb_sectors >= cluster_sectors)
-                n = cluster_sectors;
-            else
-                n = nb_sectors;
+            n = MIN(nb_sectors,
+                    (int64_t)(IO_BUF_SIZE / cluster_size) * cluster_sectors);
 
             bs_num = sector_num - bs_offset;
             assert (bs_num >= 0);
@@ -966,110 +1335,64 @@ static int img_convert(int argc, char **argv)
             }
             assert (remainder == 0);
 
-            if (n < cluster_sectors) {
-                memset(buf + n * 512, 0, cluster_size - n * 512);
+            nb_clusters = DIV_ROUND_UP(n, cluster_sectors);
+            if (n < nb_clusters * cluster_sectors) {
+                memset(buf + n * 512, 0,
+                       nb_clusters * cluster_size - n * 512);
             }
-            if (!buffer_is_zero(buf, cluster_size)) {
-                ret = bdrv_write_compressed(out_bs, sector_num, buf,
-                                            cluster_sectors);
+
+            /* Write each run of non-zero clusters with one call */
+            for (i = 0; i < nb_clusters; i += MAX(run, 1)) {
+                run = 0;
+                while (i + run < nb_clusters &&
+                       !buffer_is_zero(buf + (i + run) * cluster_size,
+                                       cluster_size)) {
+                    run++;
+                }
+                if (run == 0) {
+                    continue;
+                }
+                ret = bdrv_write_compressed(out_bs,
+                                            sector_num + i * cluster_sectors,
+                                            buf + i * cluster_size,
+                                            run * cluster_sectors);
                 if (ret != 0) {
                     error_report("error while compressing sector %" PRId64
-                                 ": %s", sector_num, strerror(-ret));
+                                 ": %s", sector_num + i * cluster_sectors,
+                                 strerror(-ret));
                     goto out;
                 }
             }
             sector_num += n;
-            qemu_progress_print(local_progress, 100);
+            qemu_progress_print(local_progress * nb_clusters, 100);
         }
         /* signal EOF to align */
         bdrv_write_compressed(out_bs, 0, NULL, 0);
     } else {
-        int has_zero_init = bdrv_has_zero_init(out_bs);
-
-        sector_num = 0; // total number of sectors converted so far
-        nb_sectors = total_sectors - sector_num;
-        if (nb_sectors != 0) {
-            local_progress = (float)100 /
-                (nb_sectors / MIN(nb_sectors, IO_BUF_SIZE / 512));
-        }
+        int64_t *src_sectors = g_malloc(bs_n * sizeof(int64_t));
 
-        for(;;) {
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0) {
-                break;
-            }
-            if (nb_sectors >= (IO_BUF_SIZE / 512)) {
-                n = (IO_BUF_SIZE / 512);
-            } else {
-                n = nb_sectors;
-            }
-
-            while (sector_num - bs_offset >= bs_sectors) {
-                bs_i ++;
-                assert (bs_i < bs_n);
-                bs_offset += bs_sectors;
-                bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                /* printf("changing part: sector_num=%" PRId64 ", bs_i=%d, "
-                  "bs_offset=%" PRId64 ", bs_sectors=%" PRId64 "\n",
-                   sector_num, bs_i, bs_offset, bs_sectors); */
-            }
-
-            if (n > bs_offset + bs_sectors - sector_num) {
-                n = bs_offset + bs_sectors - sector_num;
-            }
-
-            if (has_zero_init) {
-                /* If the output image is being created as a copy on write image,
-                   assume that sectors which are unallocated in the input image
-                   are present in both the output's and input's base images (no
-                   need to copy them). */
-                if (out_baseimg) {
-                    if (!bdrv_is_allocated(bs[bs_i], sector_num - bs_offset,
-                                           n, &n1)) {
-                        sector_num += n1;
-                        continue;
-                    }
-                    /* The next 'n1' sectors are allocated in the input image. Copy
-                       only those as they may be followed by unallocated sectors. */
-                    n = n1;
-                }
-            } else {
-                n1 = n;
-            }
+        for (bs_i = 0; bs_i < bs_n; bs_i++) {
+            bdrv_get_geometry(bs[bs_i], &bs_sectors);
+            src_sectors[bs_i] = bs_sectors;
+        }
+
+        state = (ImgConvertState) {
+            .src                = bs,
+            .src_sectors        = src_sectors,
+            .src_num            = bs_n,
+            .total_sectors      = total_sectors,
+            .target             = out_bs,
+            .has_zero_init      = bdrv_has_zero_init(out_bs),
+            .target_has_backing = (bool) out_baseimg,
+            .wr_in_order        = wr_in_order,
+            .min_sparse         = min_sparse,
+            .buf_sectors        = IO_BUF_SIZE / BDRV_SECTOR_SIZE,
+            .num_coroutines     = num_coroutines,
+        };
+        state.target_has_backing &= state.has_zero_init;
 
-            ret = bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n);
-            if (ret < 0) {
-                error_report("error while reading sector %" PRId64 ": %s",
-                             sector_num - bs_offset, strerror(-ret));
-                goto out;
-            }
-            /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
-            buf1 = buf;
-            while (n > 0) {
-                /* If the output image is being created as a copy on write image,
-                   copy all sectors even the ones containing only NUL bytes,
-                   because they may differ from the sectors in the base image.
-
-                   If the output is to a host device, we also write out
-                   sectors that are entirely 0, since whatever data was
-                   already there is garbage, not 0s. */
-                if (!has_zero_init || out_baseimg ||
-                    is_allocated_sectors_min(buf1, n, &n1, min_sparse)) {
-                    ret = bdrv_write(out_bs, sector_num, buf1, n1);
-                    if (ret < 0) {
-                        error_report("error while writing sector %" PRId64
-                                     ": %s", sector_num, strerror(-ret));
-                        goto out;
-                    }
-                }
-                sector_num += n1;
-                n -= n1;
-                buf1 += n1 * 512;
-            }
-            qemu_progress_print(local_progress, 100);
-        }
+        ret = convert_do_copy(&state);
+        g_free(src_sectors);
     }
 out:
     qemu_progress_end();
@@ -1390,6 +1713,7 @@ err:
 enum {
     OPTION_OUTPUT = 256,
     OPTION_BACKING_CHAIN = 257,
+    OPTION_SIZE = 258,
 };
 
 typedef enum OutputFormat {
@@ -1473,6 +1797,268 @@ static int img_info(int argc, char **argv)
     return 0;
 }
 
+static void dump_map_entry(OutputFormat output_format, BdrvExtent *e,
+                           bool first)
+{
+    int64_t start = e->sector_num << BDRV_SECTOR_BITS;
+    int64_t length = e->nb_sectors << BDRV_SECTOR_BITS;
+    bool data = e->type == BDRV_EXTENT_DATA;
+
+    switch (output_format) {
+    case OFORMAT_HUMAN:
+        printf("%#-16" PRIx64 "%#-16" PRIx64 "%-8d%s\n", start, length,
+               e->depth, data ? "data" : "zero");
+        break;
+    case OFORMAT_JSON:
+        printf("%s{ \"start\": %" PRId64 ", \"length\": %" PRId64 ", "
+               "\"depth\": %d, \"zero\": %s, \"data\": %s }",
+               first ? "" : ",\n", start, length, e->depth,
+               data ? "false" : "true", data ? "true" : "false");
+        break;
+    }
+}
+
+/* Number of extents that are queried at once */
+#define MAP_EXTENTS 1024
+
+static int img_map(int argc, char **argv)
+{
+    int c, i, n, ret = 0;
+    OutputFormat output_format = OFORMAT_HUMAN;
+    BlockDriverState *bs;
+    const char *filename, *fmt, *output;
+    BdrvExtent *extents, cur;
+    int64_t total_sectors, sector_num;
+    bool first = true;
+
+    fmt = NULL;
+    output = NULL;
+    for (;;) {
+        int option_index = 0;
+        static const struct option long_options[] = {
+            {"help", no_argument, 0, 'h'},
+            {"format", required_argument, 0, 'f'},
+            {"output", required_argument, 0, OPTION_OUTPUT},
+            {0, 0, 0, 0}
+        };
+        c = getopt_long(argc, argv, "f:h",
+                        long_options, &option_index);
+        if (c == -1) {
+            break;
+        }
+        switch (c) {
+        case '?':
+        case 'h':
+            help();
+            break;
+        case 'f':
+            fmt = optarg;
+            break;
+        case OPTION_OUTPUT:
+            output = optarg;
+            break;
+        }
+    }
+    if (optind >= argc) {
+        help();
+    }
+    filename = argv[optind++];
+
+    if (output && !strcmp(output, "json")) {
+        output_format = OFORMAT_JSON;
+    } else if (output && !strcmp(output, "human")) {
+        output_format = OFORMAT_HUMAN;
+    } else if (output) {
+        error_report("--output must be used with human or json as argument.");
+        return 1;
+    }
+
+    bs = bdrv_new_open(filename, fmt, BDRV_O_FLAGS, false);
+    if (!bs) {
+        return 1;
+    }
+
+    if (output_format == OFORMAT_HUMAN) {
+        printf("%-16s%-16s%-8s%s\n", "Offset", "Length", "Depth", "Type");
+    } else {
+        printf("[");
+    }
+
+    extents = g_new(BdrvExtent, MAP_EXTENTS);
+    total_sectors = bdrv_getlength(bs) >> BDRV_SECTOR_BITS;
+    cur.nb_sectors = 0;
+    for (sector_num = 0; sector_num < total_sectors; ) {
+        n = bdrv_get_extents(bs, sector_num, total_sectors - sector_num,
+                             extents, MAP_EXTENTS);
+        if (n <= 0) {
+            error_report("Could not get allocation status of '%s': %s",
+                         filename, strerror(n < 0 ? -n : EIO));
+            ret = 1;
+            break;
+        }
+
+        /* Extents are only merged within one query, finish that here */
+        for (i = 0; i < n; i++) {
+            if (cur.nb_sectors && cur.type == extents[i].type &&
+                cur.depth == extents[i].depth) {
+                cur.nb_sectors += extents[i].nb_sectors;
+                continue;
+            }
+            if (cur.nb_sectors) {
+                dump_map_entry(output_format, &cur, first);
+                first = false;
+            }
+            cur = extents[i];
+        }
+        sector_num = extents[n - 1].sector_num + extents[n - 1].nb_sectors;
+    }
+    if (cur.nb_sectors) {
+        dump_map_entry(output_format, &cur, first);
+    }
+
+    if (output_format == OFORMAT_JSON) {
+        printf("]\n");
+    }
+
+    g_free(extents);
+    bdrv_delete(bs);
+    return ret;
+}
+
+static int img_measure(int argc, char **argv)
+{
+    int c, ret = 1;
+    OutputFormat output_format = OFORMAT_HUMAN;
+    const char *filename, *fmt, *out_fmt, *options, *output;
+    BlockDriverState *in_bs = NULL;
+    BlockDriver *drv;
+    QEMUOptionParameter *create_options = NULL, *param = NULL;
+    BlockMeasureInfo info;
+    int64_t img_size = -1;
+
+    fmt = NULL;
+    out_fmt = "raw";
+    options = NULL;
+    output = NULL;
+    for (;;) {
+        int option_index = 0;
+        static const struct option long_options[] = {
+            {"help", no_argument, 0, 'h'},
+            {"format", required_argument, 0, 'f'},
+            {"output", required_argument, 0, OPTION_OUTPUT},
+            {"size", required_argument, 0, OPTION_SIZE},
+            {0, 0, 0, 0}
+        };
+        c = getopt_long(argc, argv, "f:O:o:h",
+                        long_options, &option_index);
+        if (c == -1) {
+            break;
+        }
+        switch (c) {
+        case '?':
+        case 'h':
+            help();
+            break;
+        case 'f':
+            fmt = optarg;
+            break;
+        case 'O':
+            out_fmt = optarg;
+            break;
+        case 'o':
+            options = optarg;
+            break;
+        case OPTION_OUTPUT:
+            output = optarg;
+            break;
+        case OPTION_SIZE:
+        {
+            char *end;
+            img_size = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (img_size < 0 || *end) {
+                error_report("Invalid image size specified! You may use k, M, "
+                      "G or T suffixes for ");
+                error_report("kilobytes, megabytes, gigabytes and terabytes.");
+                return 1;
+            }
+            break;
+        }
+        }
+    }
+    filename = optind < argc ? argv[optind++] : NULL;
+
+    if (!filename == (img_size < 0)) {
+        error_report("Either --size or a filename must be specified.");
+        return 1;
+    }
+
+    if (output && !strcmp(output, "json")) {
+        output_format = OFORMAT_JSON;
+    } else if (output && !strcmp(output, "human")) {
+        output_format = OFORMAT_HUMAN;
+    } else if (output) {
+        error_report("--output must be used with human or json as argument.");
+        return 1;
+    }
+
+    drv = bdrv_find_format(out_fmt);
+    if (!drv) {
+        error_report("Unknown file format '%s'", out_fmt);
+        return 1;
+    }
+
+    if (filename) {
+        in_bs = bdrv_new_open(filename, fmt, BDRV_O_FLAGS, false);
+        if (!in_bs) {
+            return 1;
+        }
+        img_size = bdrv_getlength(in_bs);
+    }
+
+    create_options = append_option_parameters(create_options,
+                                              drv->create_options);
+    param = parse_option_parameters(options ? options : "", create_options,
+                                    param);
+    if (param == NULL) {
+        error_report("Invalid options for file format '%s'.", out_fmt);
+        goto out;
+    }
+    set_option_parameter_int(param, BLOCK_OPT_SIZE, img_size);
+
+    ret = bdrv_measure(drv, param, in_bs, &info);
+    if (ret == -ENOTSUP) {
+        error_report("Size measurement not supported for file format '%s'",
+                     out_fmt);
+        ret = 1;
+        goto out;
+    } else if (ret < 0) {
+        error_report("Error while measuring: %s", strerror(-ret));
+        ret = 1;
+        goto out;
+    }
+
+    switch (output_format) {
+    case OFORMAT_HUMAN:
+        printf("required size: %" PRIu64 "\n", info.required);
+        printf("fully allocated size: %" PRIu64 "\n", info.fully_allocated);
+        break;
+    case OFORMAT_JSON:
+        printf("{\n    \"required\": %" PRIu64 ",\n"
+               "    \"fully-allocated\": %" PRIu64 "\n}\n",
+               info.required, info.fully_allocated);
+        break;
+    }
+    ret = 0;
+
+out:
+    free_option_parameters(create_options);
+    free_option_parameters(param);
+    if (in_bs) {
+        bdrv_delete(in_bs);
+    }
+    return ret;
+}
+
 #define SNAPSHOT_LIST   1
 #define SNAPSHOT_CREATE 2
 #define SNAPSHOT_APPLY  3
@@ -1591,6 +2177,235 @@ static int img_snapshot(int argc, char **argv)
     return 0;
 }
 
+#define CMP_COROUTINES 8
+
+/*
+ * Compares the content of two images, which may have different sizes; the
+ * sectors past the end of the shorter one, and all sectors of a NULL image,
+ * read as zeroes.  Ranges that read as zeroes from both images are not read.
+ *
+ * With 'top' set, this is the safe mode of rebase: 'src' are the old and the
+ * new backing file of 'top', the ranges that 'top' has are skipped and the
+ * mismatching sectors are copied from the old backing file into 'top'.
+ * Without it, the first mismatching sector is stored in 'first_diff'.
+ */
+typedef struct ImgCmpState {
+    BlockDriverState *src[2];
+    int64_t src_sectors[2];
+    BlockDriverState *top;
+    int64_t total_sectors;
+    int64_t sector_num;
+    int64_t done_sectors;
+    int64_t first_diff;
+    int buf_sectors;
+    int num_coroutines;
+    int running_coroutines;
+    CoMutex lock;
+    int ret;
+} ImgCmpState;
+
+/*
+ * Returns the number of sectors starting at sector_num that can be handled
+ * with a single request. zero[i] is set if they read as zeroes from src[i],
+ * and *skip if there is nothing to compare.
+ */
+static int coroutine_fn cmp_iteration_sectors(ImgCmpState *s,
+                                              int64_t sector_num,
+                                              bool *zero, bool *skip)
+{
+    int i, n, ret;
+
+    n = MIN(s->total_sectors - sector_num, s->buf_sectors);
+    *skip = false;
+
+    if (s->top) {
+        ret = bdrv_co_is_allocated(s->top, sector_num, n, &n);
+        if (ret < 0) {
+            return ret;
+        } else if (ret) {
+            /* The image has these sectors, its backing file doesn't matter */
+            *skip = true;
+            return n;
+        }
+    }
+
+    for (i = 0; i < 2; i++) {
+        zero[i] = true;
+        if (!s->src[i] || sector_num >= s->src_sectors[i]) {
+            continue;
+        }
+
+        n = MIN(n, s->src_sectors[i] - sector_num);
+        ret = bdrv_co_get_extent_above(s->src[i], NULL, sector_num, n, &n);
+        if (ret < 0) {
+            return ret;
+        }
+        zero[i] = ret != BDRV_EXTENT_DATA;
+    }
+
+    *skip = zero[0] && zero[1];
+    return n;
+}
+
+static int coroutine_fn cmp_co_read(BlockDriverState *bs, int64_t sector_num,
+                                    int nb_sectors, uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+
+    iov.iov_base = buf;
+    iov.iov_len = nb_sectors << BDRV_SECTOR_BITS;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    return bdrv_co_readv(bs, sector_num, nb_sectors, &qiov);
+}
+
+/* Handles the mismatching sectors of [sector_num, sector_num + n) */
+static int coroutine_fn cmp_co_diff(ImgCmpState *s, int64_t sector_num,
+                                    int n, uint8_t **buf, bool *zero)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int i, pnum, ret;
+
+    for (i = 0; i < n; i += pnum) {
+        uint8_t *buf0 = buf[0] + i * BDRV_SECTOR_SIZE;
+        uint8_t *buf1 = buf[1] + i * BDRV_SECTOR_SIZE;
+
+        if (zero[0]) {
+            ret = is_allocated_sectors(buf1, n - i, &pnum);
+        } else if (zero[1]) {
+            ret = is_allocated_sectors(buf0, n - i, &pnum);
+        } else {
+            ret = compare_sectors(buf0, buf1, n - i, &pnum);
+        }
+        if (!ret) {
+            continue;
+        }
+
+        if (!s->top) {
+            if (s->first_diff < 0 || sector_num + i < s->first_diff) {
+                s->first_diff = sector_num + i;
+            }
+            return 0;
+        }
+
+        if (zero[0]) {
+            ret = bdrv_co_write_zeroes(s->top, sector_num + i, pnum);
+        } else {
+            iov.iov_base = buf0;
+            iov.iov_len = pnum << BDRV_SECTOR_BITS;
+            qemu_iovec_init_external(&qiov, &iov, 1);
+            ret = bdrv_co_writev(s->top, sector_num + i, pnum, &qiov);
+        }
+        if (ret < 0) {
+            error_report("Error while writing to COW image: %s",
+                         strerror(-ret));
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+static void coroutine_fn cmp_co_do_compare(void *opaque)
+{
+    ImgCmpState *s = opaque;
+    uint8_t *buf[2];
+    bool zero[2], skip;
+    int64_t sector_num;
+    int i, n, ret;
+
+    s->running_coroutines++;
+    for (i = 0; i < 2; i++) {
+        buf[i] = qemu_blockalign(s->src[0], s->buf_sectors * BDRV_SECTOR_SIZE);
+    }
+
+    for (;;) {
+        qemu_co_mutex_lock(&s->lock);
+        /* Once there is a mismatch, only the requests before it go on */
+        if (s->ret != -EINPROGRESS || s->first_diff >= 0 ||
+            s->sector_num >= s->total_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        n = cmp_iteration_sectors(s, s->sector_num, zero, &skip);
+        if (n < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            error_report("error while reading block status of sector %"
+                         PRId64 ": %s", s->sector_num, strerror(-n));
+            s->ret = n;
+            break;
+        }
+
+        /* Other coroutines can go on with the following sectors while this
+         * request is being processed */
+        sector_num = s->sector_num;
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (!skip) {
+            for (i = 0; i < 2; i++) {
+                if (zero[i]) {
+                    continue;
+                }
+                ret = cmp_co_read(s->src[i], sector_num, n, buf[i]);
+                if (ret < 0) {
+                    error_report("error while reading sector %" PRId64
+                                 " of '%s': %s", sector_num,
+                                 s->src[i]->filename, strerror(-ret));
+                    s->ret = ret;
+                    goto out;
+                }
+            }
+
+            ret = cmp_co_diff(s, sector_num, n, buf, zero);
+            if (ret < 0) {
+                s->ret = ret;
+                goto out;
+            }
+        }
+
+        s->done_sectors += n;
+        qemu_progress_print(100.0 * s->done_sectors / s->total_sectors, 0);
+    }
+
+out:
+    qemu_vfree(buf[0]);
+    qemu_vfree(buf[1]);
+    s->running_coroutines--;
+    if (!s->running_coroutines && s->ret == -EINPROGRESS) {
+        /* The comparison has finished successfully */
+        s->ret = 0;
+    }
+}
+
+static int cmp_do_compare(ImgCmpState *s)
+{
+    Coroutine *co;
+    int i;
+
+    s->sector_num = 0;
+    s->done_sectors = 0;
+    s->first_diff = -1;
+    s->ret = -EINPROGRESS;
+    if (!s->total_sectors) {
+        return 0;
+    }
+
+    qemu_co_mutex_init(&s->lock);
+    for (i = 0; i < s->num_coroutines; i++) {
+        co = qemu_coroutine_create(cmp_co_do_compare);
+        qemu_coroutine_enter(co, s);
+    }
+
+    while (s->ret == -EINPROGRESS) {
+        aio_poll(bdrv_get_aio_context(s->src[0]), true);
+    }
+
+    return s->ret;
+}
+
 static int img_rebase(int argc, char **argv)
 {
     BlockDriverState *bs, *bs_old_backing = NULL, *bs_new_backing = NULL;
@@ -1724,100 +2539,26 @@ static int img_rebase(int argc, char **argv)
      */
     if (!unsafe) {
         uint64_t num_sectors;
-        uint64_t old_backing_num_sectors;
-        uint64_t new_backing_num_sectors = 0;
-        uint64_t sector;
-        int n;
-        uint8_t * buf_old;
-        uint8_t * buf_new;
-        float local_progress = 0;
-
-        buf_old = qemu_blockalign(bs, IO_BUF_SIZE);
-        buf_new = qemu_blockalign(bs, IO_BUF_SIZE);
+        ImgCmpState state = {
+            .src                = { bs_old_backing, bs_new_backing },
+            .top                = bs,
+            .buf_sectors        = IO_BUF_SIZE / BDRV_SECTOR_SIZE,
+            .num_coroutines     = CMP_COROUTINES,
+        };
 
         bdrv_get_geometry(bs, &num_sectors);
-        bdrv_get_geometry(bs_old_backing, &old_backing_num_sectors);
+        state.total_sectors = num_sectors;
+        bdrv_get_geometry(bs_old_backing, &num_sectors);
+        state.src_sectors[0] = num_sectors;
         if (bs_new_backing) {
-            bdrv_get_geometry(bs_new_backing, &new_backing_num_sectors);
+            bdrv_get_geometry(bs_new_backing, &num_sectors);
+            state.src_sectors[1] = num_sectors;
         }
 
-        if (num_sectors != 0) {
-            local_progress = (float)100 /
-                (num_sectors / MIN(num_sectors, IO_BUF_SIZE / 512));
-        }
-
-        for (sector = 0; sector < num_sectors; sector += n) {
-
-            /* How many sectors can we handle with the next read? */
-            if (sector + (IO_BUF_SIZE / 512) <= num_sectors) {
-                n = (IO_BUF_SIZE / 512);
-            } else {
-                n = num_sectors - sector;
-            }
-
-            /* If the cluster is allocated, we don't need to take action */
-            ret = bdrv_is_allocated(bs, sector, n, &n);
-            if (ret) {
-                continue;
-            }
-
-            /*
-             * Read old and new backing file and take into consideration that
-             * backing files may be smaller than the COW image.
-             */
-            if (sector >= old_backing_num_sectors) {
-                memset(buf_old, 0, n * BDRV_SECTOR_SIZE);
-            } else {
-                if (sector + n > old_backing_num_sectors) {
-                    n = old_backing_num_sectors - sector;
-                }
-
-                ret = bdrv_read(bs_old_backing, sector, buf_old, n);
-                if (ret < 0) {
-                    error_report("error while reading from old backing file");
-                    goto out;
-                }
-            }
-
-            if (sector >= new_backing_num_sectors || !bs_new_backing) {
-                memset(buf_new, 0, n * BDRV_SECTOR_SIZE);
-            } else {
-                if (sector + n > new_backing_num_sectors) {
-                    n = new_backing_num_sectors - sector;
-                }
-
-                ret = bdrv_read(bs_new_backing, sector, buf_new, n);
-                if (ret < 0) {
-                    error_report("error while reading from new backing file");
-                    goto out;
-                }
-            }
-
-            /* If they differ, we need to write to the COW file */
-            uint64_t written = 0;
-
-            while (written < n) {
-                int pnum;
-
-                if (compare_sectors(buf_old + written * 512,
-                    buf_new + written * 512, n - written, &pnum))
-                {
-                    ret = bdrv_write(bs, sector + written,
-                        buf_old + written * 512, pnum);
-                    if (ret < 0) {
-                        error_report("Error while writing to COW image: %s",
-                            strerror(-ret));
-                        goto out;
-                    }
-                }
-
-                written += pnum;
-            }
-            qemu_progress_print(local_progress, 100);
+        ret = cmp_do_compare(&state);
+        if (ret < 0) {
+            goto out;
         }
-
-        qemu_vfree(buf_old);
-        qemu_vfree(buf_new);
     }
 
     /*
@@ -1865,6 +2606,121 @@ out:
     return 0;
 }
 
+static int img_compare(int argc, char **argv)
+{
+    const char *fmt1, *fmt2, *cache, *filename1, *filename2;
+    BlockDriverState *bs1, *bs2;
+    int64_t total_sectors1, total_sectors2;
+    int c, flags, ret;
+    int progress = 0, strict = 0;
+
+    fmt1 = NULL;
+    fmt2 = NULL;
+    cache = BDRV_DEFAULT_CACHE;
+    for (;;) {
+        c = getopt(argc, argv, "hpsf:F:t:");
+        if (c == -1) {
+            break;
+        }
+        switch (c) {
+        case '?':
+        case 'h':
+            help();
+            break;
+        case 'f':
+            fmt1 = optarg;
+            break;
+        case 'F':
+            fmt2 = optarg;
+            break;
+        case 'p':
+            progress = 1;
+            break;
+        case 's':
+            strict = 1;
+            break;
+        case 't':
+            cache = optarg;
+            break;
+        }
+    }
+    if (optind != argc - 2) {
+        help();
+    }
+    filename1 = argv[optind++];
+    filename2 = argv[optind++];
+
+    /* Errors exit with 2, so that they can't be taken for a mismatch */
+    flags = BDRV_O_FLAGS;
+    ret = bdrv_parse_cache_flags(cache, &flags);
+    if (ret < 0) {
+        error_report("Invalid cache option: %s", cache);
+        return 2;
+    }
+
+    qemu_progress_init(progress, 2.0);
+    qemu_progress_print(0, 100);
+
+    ret = 2;
+    bs1 = bdrv_new_open(filename1, fmt1, flags, true);
+    if (!bs1) {
+        goto out3;
+    }
+    bs2 = bdrv_new_open(filename2, fmt2, flags, true);
+    if (!bs2) {
+        goto out2;
+    }
+
+    total_sectors1 = bdrv_getlength(bs1);
+    total_sectors2 = bdrv_getlength(bs2);
+    if (total_sectors1 < 0 || total_sectors2 < 0) {
+        error_report("Could not get the size of the images: %s",
+                     strerror(-MIN(total_sectors1, total_sectors2)));
+        goto out;
+    }
+    total_sectors1 >>= BDRV_SECTOR_BITS;
+    total_sectors2 >>= BDRV_SECTOR_BITS;
+
+    if (total_sectors1 != total_sectors2) {
+        if (strict) {
+            printf("Strict mode: Image size mismatch!\n");
+            ret = 1;
+            goto out;
+        }
+        printf("Warning: Image size mismatch!\n");
+    }
+
+    {
+        ImgCmpState state = {
+            .src                = { bs1, bs2 },
+            .src_sectors        = { total_sectors1, total_sectors2 },
+            .total_sectors      = MAX(total_sectors1, total_sectors2),
+            .buf_sectors        = IO_BUF_SIZE / BDRV_SECTOR_SIZE,
+            .num_coroutines     = CMP_COROUTINES,
+        };
+
+        if (cmp_do_compare(&state) < 0) {
+            ret = 2;
+        } else if (state.first_diff >= 0) {
+            printf("Content mismatch at offset %" PRId64 "!\n",
+                   (int64_t)(state.first_diff * BDRV_SECTOR_SIZE));
+            ret = 1;
+        } else {
+            qemu_progress_print(100, 0);
+            printf("Images are identical.\n");
+            ret = 0;
+        }
+    }
+
+out:
+    bdrv_delete(bs2);
+out2:
+    bdrv_delete(bs1);
+out3:
+    qemu_progress_end();
+    return ret;
+}
+
 static int img_resize(int argc, char **argv)
 {
     int c, ret, relative;
@@ -19,6 +19,7 @@
 #include "block_int.h"
 #include "cmd.h"
 #include "trace/control.h"
+#include "qemu-timer.h"
 
 #define VERSION	"0.0.1"
 
@@ -1360,6 +1361,346 @@ static int aio_write_f(int argc, char **argv)
     return 0;
 }
 
+/*
+ * Benchmark: keeps a number of requests in flight until a count or a
+ * duration is reached, and reports throughput and latency percentiles.
+ */
+
+typedef struct BenchReq {
+    struct BenchState *s;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    void *buf;
+    int64_t start;
+    bool is_write;
+} BenchReq;
+
+typedef struct BenchLat {
+    int64_t *ns;
+    int64_t nr, alloc;
+    int64_t bytes;
+} BenchLat;
+
+typedef struct BenchState {
+    GRand *rand;
+    int64_t base, nr_blocks, next_block;
+    int bsize;
+    int read_pct;
+    int random;
+    int64_t count, issued, in_flight;
+    int64_t deadline;
+    int error;
+    BenchLat lat[2];                /* reads, writes */
+} BenchState;
+
+static void bench_submit(BenchReq *req);
+
+static void bench_cb(void *opaque, int ret)
+{
+    BenchReq *req = opaque;
+    BenchState *s = req->s;
+    BenchLat *lat = &s->lat[req->is_write];
+
+    s->in_flight--;
+    if (ret < 0) {
+        if (!s->error) {
+            printf("bench: %s failed: %s\n", req->is_write ? "write" : "read",
+                   strerror(-ret));
+        }
+        s->error = ret;
+        return;
+    }
+
+    if (lat->nr == lat->alloc) {
+        lat->alloc = MAX(lat->alloc * 2, 4096);
+        lat->ns = g_renew(int64_t, lat->ns, lat->alloc);
+    }
+    lat->ns[lat->nr++] = get_clock() - req->start;
+    lat->bytes += s->bsize;
+
+    bench_submit(req);
+}
+
+static void bench_submit(BenchReq *req)
+{
+    BenchState *s = req->s;
+    int64_t block, now = get_clock();
+
+    if (s->error || (s->count && s->issued >= s->count) ||
+        (s->deadline && now >= s->deadline)) {
+        return;
+    }
+
+    if (s->random) {
+        block = (((uint64_t)g_rand_int(s->rand) << 32) |
+                 g_rand_int(s->rand)) % s->nr_blocks;
+    } else {
+        block = s->next_block;
+        s->next_block = (block + 1) % s->nr_blocks;
+    }
+    req->is_write = g_rand_int_range(s->rand, 0, 100) >= s->read_pct;
+    req->start = now;
+    s->issued++;
+    s->in_flight++;
+
+    qemu_iovec_init_external(&req->qiov, &req->iov, 1);
+    if (req->is_write) {
+        bdrv_aio_writev(bs, (s->base + block * s->bsize) >> 9, &req->qiov,
+                        s->bsize >> 9, bench_cb, req);
+    } else {
+        bdrv_aio_readv(bs, (s->base + block * s->bsize) >> 9, &req->qiov,
+                       s->bsize >> 9, bench_cb, req);
+    }
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double bench_percentile(BenchLat *lat, double pct)
+{
+    int64_t i = (int64_t)(lat->nr * pct / 100);
+
+    return lat->ns[MIN(i, lat->nr - 1)] / 1000.0;
+}
+
+static void bench_report(const char *op, BenchLat *lat, double secs,
+                         int Cflag)
+{
+    double avg = 0;
+    int64_t i;
+
+    if (!lat->nr) {
+        return;
+    }
+
+    qsort(lat->ns, lat->nr, sizeof(lat->ns[0]), bench_cmp);
+    for (i = 0; i < lat->nr; i++) {
+        avg += lat->ns[i];
+    }
+    avg /= lat->nr * 1000.0;
+
+    if (Cflag) {
+        /* op,ops,bytes,secs,ops/sec,bytes/sec,min,avg,p50,p90,p99,p99.9,max */
+        printf("%s,%" PRId64 ",%" PRId64 ",%.3f,%.3f,%.3f,"
+               "%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+               op, lat->nr, lat->bytes, secs, lat->nr / secs,
+               lat->bytes / secs, lat->ns[0] / 1000.0, avg,
+               bench_percentile(lat, 50), bench_percentile(lat, 90),
+               bench_percentile(lat, 99), bench_percentile(lat, 99.9),
+               lat->ns[lat->nr - 1] / 1000.0);
+    } else {
+        char s1[64], s2[64];
+
+        cvtstr((double)lat->bytes, s1, sizeof(s1));
+        cvtstr(lat->bytes / secs, s2, sizeof(s2));
+        printf("%-5s %" PRId64 " ops, %s (%.1f ops/sec and %s/sec)\n",
+               op, lat->nr, s1, lat->nr / secs, s2);
+        printf("      latency usec: min %.1f, avg %.1f, max %.1f\n",
+               lat->ns[0] / 1000.0, avg, lat->ns[lat->nr - 1] / 1000.0);
+        printf("      percentiles usec: 50th %.1f, 90th %.1f, "
+               "99th %.1f, 99.9th %.1f\n",
+               bench_percentile(lat, 50), bench_percentile(lat, 90),
+               bench_percentile(lat, 99), bench_percentile(lat, 99.9));
+    }
+}
+
+static void bench_help(void)
+{
+    printf(
+"\n"
+" runs a benchmark with a given queue depth, block size and read/write mix\n"
+"\n"
+" Example:\n"
+" 'bench -r -d 32 -s 4k -M 70 -t 30' - 30 seconds of random 4k requests,\n"
+"                                       70%% reads, with 32 in flight\n"
+"\n"
+" Requests are issued with bdrv_aio_readv/bdrv_aio_writev, so the whole\n"
+" block driver stack of the open image is measured.  Without -c and -t,\n"
+" 10000 requests are issued.  Writes destroy the data in the image.\n"
+" -c, -- number of requests to issue\n"
+" -C, -- report statistics in a machine parsable format\n"
+" -d, -- queue depth, the number of requests in flight (default 1)\n"
+" -l, -- length of the range to use (default: up to the end of the image)\n"
+" -M, -- percentage of reads (default 100)\n"
+" -o, -- start offset of the range to use (default 0)\n"
+" -r, -- random offsets rather than sequential\n"
+" -s, -- block size (default 4k)\n"
+" -S, -- seed for the random offsets and the read/write mix\n"
+" -t, -- duration in seconds\n"
+" -w, -- only write, same as -M 0\n"
+"\n");
+}
+
+static int bench_f(int argc, char **argv);
+
+static const cmdinfo_t bench_cmd = {
+    .name       = "bench",
+    .cfunc      = bench_f,
+    .argmin     = 0,
+    .argmax     = -1,
+    .args       = "[-Crw] [-c count] [-d depth] [-M read%] [-o off] [-l len] "
+                  "[-s size] [-S seed] [-t secs]",
+    .oneline    = "runs a read/write benchmark",
+    .help       = bench_help,
+};
+
+static int bench_f(int argc, char **argv)
+{
+    BenchState s = { .read_pct = 100, .bsize = 4096 };
+    BenchReq *reqs;
+    int64_t start, offset = 0, len = -1, size, secs = 0;
+    int depth = 1, Cflag = 0, c, i;
+    guint32 seed = 1;
+    char *end;
+    double elapsed;
+
+    while ((c = getopt(argc, argv, "c:Cd:l:M:o:rs:S:t:w")) != EOF) {
+        switch (c) {
+        case 'c':
+            s.count = cvtnum(optarg);
+            if (s.count <= 0) {
+                printf("invalid request count -- %s\n", optarg);
+                return 0;
+            }
+            break;
+        case 'C':
+            Cflag = 1;
+            break;
+        case 'd':
+            depth = strtol(optarg, &end, 0);
+            if (*end || depth <= 0 || depth > 1024) {
+                printf("invalid queue depth -- %s\n", optarg);
+                return 0;
+            }
+            break;
+        case 'l':
+            len = cvtnum(optarg);
+            if (len < 0) {
+                printf("non-numeric length argument -- %s\n", optarg);
+                return 0;
+            }
+            break;
+        case 'M':
+            s.read_pct = strtol(optarg, &end, 0);
+            if (*end || s.read_pct < 0 || s.read_pct > 100) {
+                printf("invalid read percentage -- %s\n", optarg);
+                return 0;
+            }
+            break;
+        case 'o':
+            offset = cvtnum(optarg);
+            if (offset < 0) {
+                printf("non-numeric offset argument -- %s\n", optarg);
+                return 0;
+            }
+            break;
+        case 'r':
+            s.random = 1;
+            break;
+        case 's':
+            size = cvtnum(optarg);
+            if (size <= 0 || size > INT_MAX || (size & 0x1ff)) {
+                printf("block size %s is not a positive multiple of 512\n",
+                       optarg);
+                return 0;
+            }
+            s.bsize = size;
+            break;
+        case 'S':
+            seed = strtoul(optarg, &end, 0);
+            if (*end) {
+                printf("invalid seed -- %s\n", optarg);
+                return 0;
+            }
+            break;
+        case 't':
+            secs = strtol(optarg, &end, 0);
+            if (*end || secs <= 0) {
+                printf("invalid duration -- %s\n", optarg);
+                return 0;
+            }
+            break;
+        case 'w':
+            s.read_pct = 0;
+            break;
+        default:
+            return command_usage(&bench_cmd);
+        }
+    }
+
+    if (optind != argc) {
+        return command_usage(&bench_cmd);
+    }
+
+    if (offset & 0x1ff) {
+        printf("offset %" PRId64 " is not sector aligned\n", offset);
+        return 0;
+    }
+    size = bdrv_getlength(bs);
+    if (size < 0) {
+        printf("getlength: %s\n", strerror(-size));
+        return 0;
+    }
+    if (len < 0) {
+        len = size > offset ? size - offset : 0;
+    }
+    s.base = offset;
+    s.nr_blocks = len / s.bsize;
+    if (s.nr_blocks == 0 || offset + len > size) {
+        printf("range %" PRId64 "+%" PRId64 " does not hold a %d byte block "
+               "inside the image\n", offset, len, s.bsize);
+        return 0;
+    }
+    if (!s.count && !secs) {
+        s.count = 10000;
+    }
+
+    s.rand = g_rand_new_with_seed(seed);
+    reqs = g_new0(BenchReq, depth);
+    for (i = 0; i < depth; i++) {
+        reqs[i].s = &s;
+        reqs[i].buf = qemu_io_alloc(s.bsize, 0xcd);
+        reqs[i].iov.iov_base = reqs[i].buf;
+        reqs[i].iov.iov_len = s.bsize;
+    }
+
+    start = get_clock();
+    if (secs) {
+        s.deadline = start + secs * get_ticks_per_sec();
+    }
+    for (i = 0; i < depth; i++) {
+        bench_submit(&reqs[i]);
+    }
+    while (s.in_flight) {
+        main_loop_wait(false);
+    }
+    elapsed = (get_clock() - start) / 1e9;
+
+    if (!s.error) {
+        if (!Cflag) {
+            printf("bench: %d%% reads, %s, %d byte blocks, queue depth %d, "
+                   "%.3f sec\n", s.read_pct,
+                   s.random ? "random" : "sequential", s.bsize, depth,
+                   elapsed);
+        }
+        bench_report("read", &s.lat[0], elapsed, Cflag);
+        bench_report("write", &s.lat[1], elapsed, Cflag);
+    }
+
+    for (i = 0; i < depth; i++) {
+        qemu_io_free(reqs[i].buf);
+    }
+    g_free(reqs);
+    g_free(s.lat[0].ns);
+    g_free(s.lat[1].ns);
+    g_rand_free(s.rand);
+    return 0;
+}
+
 static int aio_flush_f(int argc, char **argv)
 {
     bdrv_drain_all();
@@ -1908,6 +2249,7 @@ int main(int argc, char **argv)
     add_command(&aio_read_cmd);
     add_command(&aio_write_cmd);
     add_command(&aio_flush_cmd);
+    add_command(&bench_cmd);
     add_command(&flush_cmd);
     add_command(&truncate_cmd);
     add_command(&length_cmd);
@@ -41,6 +41,7 @@ static NBDExport *exp;
 static int verbose;
 static char *srcpath;
 static char *sockpath;
+static char *export_name;
 static int persistent = 0;
 static enum { RUNNING, TERMINATE, TERMINATING, TERMINATED } state;
 static int shared = 1;
@@ -61,6 +62,8 @@ static void usage(const char *name)
 "  -k, --socket=PATH    path to the unix socket\n"
 "                       (default '"SOCKET_PATH"')\n"
 "  -e, --shared=NUM     device can be shared by NUM clients (default '1')\n"
+"  -x, --export-name=NAME  expose the image under NAME, using the newstyle\n"
+"                       handshake and its protocol extensions\n"
 "  -t, --persistent     don't exit on the last connection\n"
 "  -v, --verbose        display extra debugging information\n"
 "\n"
@@ -222,8 +225,8 @@ static void *nbd_client_thread(void *arg)
         goto out;
     }
 
-    ret = nbd_receive_negotiate(sock, NULL, &nbdflags,
-                                &size, &blocksize);
+    ret = nbd_receive_negotiate(sock, export_name, &nbdflags,
+                                &size, &blocksize, NULL);
     if (ret < 0) {
         goto out;
     }
@@ -297,7 +300,11 @@ static void nbd_accept(void *opaque)
         return;
     }
 
-    if (fd >= 0 && nbd_client_new(exp, fd, nbd_client_closed)) {
+    /* With an export name, the client picks the export during the
+     * newstyle handshake.
+     */
+    if (fd >= 0 &&
+        nbd_client_new(export_name ? NULL : exp, fd, nbd_client_closed)) {
         nb_fds++;
     }
 }
@@ -312,7 +319,7 @@ int main(int argc, char **argv)
     char *device = NULL;
     int port = NBD_DEFAULT_PORT;
     off_t fd_size;
-    const char *sopt = "hVb:o:p:rsnP:c:dvk:e:t";
+    const char *sopt = "hVb:o:p:rsnP:c:dvk:e:x:t";
     struct option lopt[] = {
         { "help", 0, NULL, 'h' },
         { "version", 0, NULL, 'V' },
@@ -331,6 +338,7 @@ int main(int argc, char **argv)
         { "aio", 1, NULL, QEMU_NBD_OPT_AIO },
 #endif
         { "shared", 1, NULL, 'e' },
+        { "export-name", 1, NULL, 'x' },
         { "persistent", 0, NULL, 't' },
         { "verbose", 0, NULL, 'v' },
         { NULL, 0, NULL, 0 }
@@ -442,6 +450,9 @@ int main(int argc, char **argv)
                 errx(EXIT_FAILURE, "Shared device number must be greater than 0\n");
             }
             break;
+        case 'x':
+            export_name = optarg;
+            break;
 	case 't':
 	    persistent = 1;
 	    break;
@@ -561,6 +572,9 @@ int main(int argc, char **argv)
     }
 
     exp = nbd_export_new(bs, dev_offset, fd_size, nbdflags, nbd_export_closed);
+    if (export_name) {
+        nbd_export_set_name(exp, export_name);
+    }
 
     if (sockpath) {
         fd = unix_socket_incoming(sockpath);
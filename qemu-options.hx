@@ -34,8 +34,19 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "                supported accelerators are kvm, xen, tcg (default: tcg)\n"
     "                kernel_irqchip=on|off controls accelerated irqchip support\n"
     "                kvm_shadow_mem=size of KVM shadow MMU\n"
+    "                kvm_dirty_ring=n per-vCPU KVM dirty ring entries (default: 0, use the dirty bitmap)\n"
     "                dump-guest-core=on|off include guest memory in a core dump (default=on)\n"
-    "                mem-merge=on|off controls memory merge support (default: on)\n",
+    "                mem-merge=on|off controls memory merge support (default: on)\n"
+    "                thp=on|off back guest memory by transparent hugepages (default: on)\n"
+    "                ram-align=size align guest RAM blocks in host memory (default: 2M)\n"
+    "                mem-share=on|off back guest memory by shareable file descriptors (default: off)\n"
+    "                prealloc-threads=n number of threads used to preallocate guest memory (default: 1)\n"
+    "                tcg-thread=single|multi run TCG vCPUs on one host thread or one thread each (default: single)\n"
+    "                halt-poll-ns=n poll up to n ns for work before a halted vCPU sleeps (default: 0)\n"
+    "                mlock=on|off lock all guest and QEMU memory into host RAM (default: off)\n"
+    "                maxmem=size,mem-slots=n allow hotplugging up to maxmem of memory in n slots\n"
+    "                fast-boot=on|off leave out legacy devices, NIC option ROMs and SMBIOS tables (default: off)\n"
+    "                startup-trace=on|off print how long each startup phase takes (default: off)\n",
     QEMU_ARCH_ALL)
 STEXI
 @item -machine [type=]@var{name}[,prop=@var{value}[,...]]
@@ -52,12 +63,72 @@ to initialize.
 Enables in-kernel irqchip support for the chosen accelerator when available.
 @item kvm_shadow_mem=size
 Defines the size of the KVM shadow MMU.
+@item kvm_dirty_ring=@var{n}
+Track dirty guest memory with per-vCPU rings of @var{n} entries, a power of
+two, instead of the per-slot dirty bitmap.  Requires host kernel support;
+0, the default, keeps using the bitmap.
 @item dump-guest-core=on|off
 Include guest memory in a core dump. The default is on.
 @item mem-merge=on|off
 Enables or disables memory merge support. This feature, when supported by
 the host, de-duplicates identical memory pages among VMs instances
 (enabled by default).
+@item thp=on|off
+Advise guest memory to be backed by transparent hugepages (on, the default)
+or not (off).  KSM splits the huge pages whose contents it merges, so guests
+that depend on huge page TLB coverage should turn mem-merge off; memory
+backends can make the choice per RAM block.  @code{info memory} shows how
+much of each RAM block is backed by huge pages.
+@item ram-align=@var{size}
+Align every guest RAM block to @var{size}, a power of two, in the host
+address space, so that transparent hugepages can map all of it.  The default
+is 2M, the size of a transparent hugepage on x86 hosts.
+@item mem-share=on|off
+Allocates every guest RAM block as a shared mapping of a file descriptor
+(an anonymous memory file, or a file in the @option{-mem-path} directory) so
+that the memory can be mapped by other processes such as a vhost-user
+backend. The default is off.
+@item prealloc-threads=@var{n}
+Fault in preallocated guest memory (@option{-mem-prealloc}, or memory
+backends with prealloc=on) from @var{n} threads in parallel, each touching
+one slice of the memory. The default is 1.
+@item tcg-thread=single|multi
+With the TCG accelerator, execute all vCPUs round-robin on a single host
+thread (@option{single}, the default), or give each vCPU its own host thread
+so that they run in parallel (@option{multi}).  @option{multi} is only
+available for targets whose atomic instructions support it, currently ARM,
+and is incompatible with @option{-icount} and with live migration.
+@item halt-poll-ns=@var{n}
+Let a vCPU thread that has nothing to do spin for up to @var{n} nanoseconds
+before it sleeps, which shortens the wakeup latency of guests that idle
+briefly and often.  The poll window adapts to the guest's idle periods and is
+reported together with the poll statistics by @code{info cpus}.  With KVM this
+applies only when halts are handled in userspace, i.e. kernel_irqchip=off.
+The default, 0, disables polling.
+@item mlock=on|off
+Lock all memory of QEMU, including guest RAM, into host RAM so that it is
+never swapped out, as real-time guests need.  The QMP command
+@code{set-mlock} changes this at run time, and @code{set-thread-sched} pins
+vCPU, data plane and emulator threads to host CPUs and gives them real-time
+scheduling policies.  The default is off.
+@item maxmem=@var{size},mem-slots=@var{n}
+Reserve guest physical address space above RAM for growing the guest to
+@var{size} bytes of memory in total, in up to @var{n} (at most 32) steps.  The
+QMP command @code{memory-add} maps a memory backend created with
+@option{-object} and not used otherwise into the next free slot; its size
+must be a multiple of 128 MiB.  vCPUs up to the @option{-smp} @var{maxcpus} limit are added with
+@code{cpu-add}.
+@item fast-boot=on|off
+Start short-lived, microVM-style guests quickly: create no default devices
+other than the serial port and the monitor (as if @option{-nodefaults}
+had been given for the others), and on PCs no PC speaker, VMware port or
+floppy controller without floppy drives.  NICs get no option ROM, and the
+firmware gets no SMBIOS tables.  The default is off.
+@item startup-trace=on|off
+When the first vCPU enters guest code, print to stderr how long each phase
+of QEMU's initialization took, and the total time to the first guest
+instruction.  The figures are also available at any time with the QMP
+command @code{query-startup} and @code{info startup}.  The default is off.
 @end table
 ETEXI
 
@@ -95,12 +166,19 @@ specifies the maximum number of hotpluggable CPUs.
 ETEXI
 
 DEF("numa", HAS_ARG, QEMU_OPTION_numa,
-    "-numa node[,mem=size][,cpus=cpu[-cpu]][,nodeid=node]\n", QEMU_ARCH_ALL)
+    "-numa node[,mem=size][,cpus=cpu[-cpu]][,nodeid=node]\n"
+    "-numa node[,memdev=id][,cpus=cpu[-cpu]][,nodeid=node][,pin-vcpus=on|off]\n", QEMU_ARCH_ALL)
 STEXI
-@item -numa @var{opts}
+@item -numa node[,mem=@var{size}][,cpus=@var{cpu[-cpu]}][,nodeid=@var{node}]
+@item -numa node[,memdev=@var{id}][,cpus=@var{cpu[-cpu]}][,nodeid=@var{node}][,pin-vcpus=on|off]
 @findex -numa
 Simulate a multi node NUMA system. If mem and cpus are omitted, resources
-are split equally.
+are split equally. With memdev, the memory of the node is taken from the
+memory backend object @var{id} created with @option{-object}; either all
+nodes or none must use memdev, and the sizes of the backends must add up to
+the @option{-m} size. With pin-vcpus=on, the vCPU threads of the node are
+pinned to the CPUs of the host nodes given by the host-nodes property of its
+memdev (KVM only, where each vCPU has its own thread).
 ETEXI
 
 DEF("fda", HAS_ARG, QEMU_OPTION_fda,
@@ -148,9 +226,15 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "-drive [file=file][,if=type][,bus=n][,unit=m][,media=d][,index=i]\n"
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
-    "       [,serial=s][,addr=A][,id=name][,aio=threads|native]\n"
+    "       [,serial=s][,addr=A][,id=name][,aio=threads|native|io_uring]\n"
+    "       [,aio-sqpoll=on|off][,aio-fixed-bufs=on|off]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
+    "       [,merge=on|off][,merge-window=usecs][,stats-intervals=s[:s...]]\n"
+    "       [,l2-cache-size=size][,refcount-cache-size=size]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]][[,iops=i]|[[,iops_rd=r][,iops_wr=w]]\n"
+    "       [[,bps_max=bm]|[[,bps_rd_max=rm][,bps_wr_max=wm]]]\n"
+    "       [[,iops_max=im]|[[,iops_rd_max=irm][,iops_wr_max=iwm]]]\n"
+    "       [,burst_length=s][,iops_size=is][,group=g]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
 @item -drive @var{option}[,@var{option}[,@var{option}[,...]]]
@@ -184,7 +268,17 @@ These options have the same definition as they have in @option{-hdachs}.
 @item cache=@var{cache}
 @var{cache} is "none", "writeback", "unsafe", "directsync" or "writethrough" and controls how the host cache is used to access block data.
 @item aio=@var{aio}
-@var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+@var{aio} is "threads", "native" or "io_uring" and selects between pthread based disk I/O, native Linux AIO and Linux io_uring.
+Unlike native Linux AIO, io_uring is used with all cache modes and also
+handles flushes, and discards on regular files.
+@item aio-sqpoll=@var{aio-sqpoll}
+@itemx aio-fixed-bufs=@var{aio-fixed-bufs}
+With @option{aio=io_uring}, @var{aio-sqpoll} is "on" or "off" and lets a
+kernel thread pick up requests, so that submitting them needs no system
+call (default off).  The thread polls for up to a second after the last
+request.  @var{aio-fixed-bufs} is "on" or "off" and registers guest RAM with
+the kernel once instead of mapping it for every request (default off).  This
+pins guest RAM in host memory and is subject to the locked memory limit.
 @item format=@var{format}
 Specify which disk @var{format} will be used rather than detecting
 the format.  Can be used to specifiy format=raw to avoid interpreting
@@ -204,6 +298,21 @@ Open drive @option{file} as read-only. Guest write attempts will fail.
 @item copy-on-read=@var{copy-on-read}
 @var{copy-on-read} is "on" or "off" and enables whether to copy read backing
 file sectors into the image file.
+@item merge=@var{merge}
+@itemx merge-window=@var{usecs}
+@var{merge} is "on" or "off" and enables merging of adjacent guest requests
+before they are submitted (default off).  Requests are collected while the
+device emulation processes a batch, and for at most @var{usecs} microseconds
+otherwise (default 0, i.e. only within a batch).
+@item stats-intervals=@var{seconds}[:@var{seconds}...]
+Intervals over which @code{query-blockstats} reports the minimum, maximum
+and average latency and the average queue depth of the drive (default
+1:60:3600, at most 8 intervals; an empty list turns them off).
+@item l2-cache-size=@var{size}
+@itemx refcount-cache-size=@var{size}
+Size of the image format's L2 table and refcount block caches (qcow2 only).
+Larger L2 caches avoid metadata reads for random I/O on big images; the
+defaults cover 16 and 4 clusters of tables.
 @end table
 
 By default, the @option{cache=writeback} mode is used. It will report data
@@ -239,6 +348,14 @@ Copy-on-read avoids accessing the same backing file sectors repeatedly and is
 useful when the backing file is over a slow network.  By default copy-on-read
 is off.
 
+The @option{bps}, @option{iops} and related options limit the throughput of
+the drive.  Short bursts above the limits are allowed up to the rates given
+by the @option{bps_max} and @option{iops_max} family of options, for at most
+@option{burst_length} seconds (default 1).  With @option{iops_size}, requests
+larger than that many bytes count as several I/O operations.  Drives with the
+same @option{group} share a single set of limits and are served in turn; the
+limits given last for any drive of a group apply to all of them.
+
 Instead of @option{-cdrom} you can use:
 @example
 qemu-system-i386 -drive file=file,index=2,media=cdrom
@@ -616,12 +733,13 @@ DEFHEADING(File system options:)
 
 DEF("fsdev", HAS_ARG, QEMU_OPTION_fsdev,
     "-fsdev fsdriver,id=id[,path=path,][security_model={mapped-xattr|mapped-file|passthrough|none}]\n"
-    " [,writeout=immediate][,readonly][,socket=socket|sock_fd=sock_fd]\n",
+    " [,writeout=immediate][,readonly][,socket=socket|sock_fd=sock_fd][,workers=n]\n"
+    "        [,stat_cache_ttl=ms]\n",
     QEMU_ARCH_ALL)
 
 STEXI
 
-@item -fsdev @var{fsdriver},id=@var{id},path=@var{path},[security_model=@var{security_model}][,writeout=@var{writeout}][,readonly][,socket=@var{socket}|sock_fd=@var{sock_fd}]
+@item -fsdev @var{fsdriver},id=@var{id},path=@var{path},[security_model=@var{security_model}][,writeout=@var{writeout}][,readonly][,socket=@var{socket}|sock_fd=@var{sock_fd}][,workers=@var{n}][,stat_cache_ttl=@var{ms}]
 @findex -fsdev
 Define a new file system device. Valid options are:
 @table @option
@@ -662,6 +780,19 @@ with virtfs-proxy-helper
 Enables proxy filesystem driver to use passed socket descriptor for
 communicating with virtfs-proxy-helper. Usually a helper like libvirt
 will create socketpair and pass one of the fds as sock_fd
+@item workers=@var{n}
+Runs the 9p file system operations on a pool of @var{n} worker threads
+that are created up front. Requests on different fids run in parallel,
+I/O on the same fid is processed in order. By default a thread is started
+for each outstanding request.
+@item stat_cache_ttl=@var{ms}
+Local driver only. Reuses the attributes of a file for @var{ms}
+milliseconds without asking the host again. Changes made through the
+guest are seen immediately, changes made directly on the host may take
+up to @var{ms} to show up. With the default of 0 the host is always
+asked; the mapped-xattr security model still caches the credentials it
+reads from the extended attributes as long as the file's inode and
+change time stay the same.
 @end table
 
 -fsdev option is used along with -device driver "virtio-9p-pci".
@@ -682,12 +813,13 @@ DEFHEADING(Virtual File system pass-through options:)
 
 DEF("virtfs", HAS_ARG, QEMU_OPTION_virtfs,
     "-virtfs local,path=path,mount_tag=tag,security_model=[mapped-xattr|mapped-file|passthrough|none]\n"
-    "        [,writeout=immediate][,readonly][,socket=socket|sock_fd=sock_fd]\n",
+    "        [,writeout=immediate][,readonly][,socket=socket|sock_fd=sock_fd][,workers=n]\n"
+    "        [,stat_cache_ttl=ms]\n",
     QEMU_ARCH_ALL)
 
 STEXI
 
-@item -virtfs @var{fsdriver}[,path=@var{path}],mount_tag=@var{mount_tag}[,security_model=@var{security_model}][,writeout=@var{writeout}][,readonly][,socket=@var{socket}|sock_fd=@var{sock_fd}]
+@item -virtfs @var{fsdriver}[,path=@var{path}],mount_tag=@var{mount_tag}[,security_model=@var{security_model}][,writeout=@var{writeout}][,readonly][,socket=@var{socket}|sock_fd=@var{sock_fd}][,workers=@var{n}][,stat_cache_ttl=@var{ms}]
 @findex -virtfs
 
 The general form of a Virtual File system pass-through options are:
@@ -729,6 +861,11 @@ will create socketpair and pass one of the fds as sock_fd
 @item sock_fd
 Enables proxy filesystem driver to use passed 'sock_fd' as the socket
 descriptor for interfacing with virtfs-proxy-helper
+@item workers=@var{n}
+Runs the 9p file system operations on a pool of @var{n} worker threads,
+as for @option{-fsdev}.
+@item stat_cache_ttl=@var{ms}
+Caches file attributes for @var{ms} milliseconds, as for @option{-fsdev}.
 @end table
 ETEXI
 
@@ -780,7 +917,7 @@ ETEXI
 
 DEF("display", HAS_ARG, QEMU_OPTION_display,
     "-display sdl[,frame=on|off][,alt_grab=on|off][,ctrl_grab=on|off]\n"
-    "            [,window_close=on|off]|curses|none|\n"
+    "            [,window_close=on|off][,gl=on|off]|curses|none|\n"
     "            vnc=<display>[,<optargs>]\n"
     "                select display type\n", QEMU_ARCH_ALL)
 STEXI
@@ -792,6 +929,9 @@ old style -sdl/-curses/... options. Valid values for @var{type} are
 @item sdl
 Display video output via SDL (usually in a separate graphics
 window; see the SDL documentation for other possibilities).
+With @option{gl=on}, the guest framebuffer is uploaded into an OpenGL
+texture and scaled by the graphics card instead of being copied and
+zoomed by the CPU.
 @item curses
 Display video output via curses. For graphics device models which
 support a text mode, QEMU can display this output using a
@@ -1330,7 +1470,7 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "-net tap[,vlan=n][,name=str],ifname=name\n"
     "                connect the host TAP network interface to VLAN 'n'\n"
 #else
-    "-net tap[,vlan=n][,name=str][,fd=h][,ifname=name][,script=file][,downscript=dfile][,helper=helper][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off][,vhostfd=h][,vhostforce=on|off]\n"
+    "-net tap[,vlan=n][,name=str][,fd=h][,fds=x:y:...:z][,ifname=name][,script=file][,downscript=dfile][,helper=helper][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off][,vhostfd=h][,vhostfds=x:y:...:z][,vhostforce=on|off][,queues=n]\n"
     "                connect the host TAP network interface to VLAN 'n' \n"
     "                use network scripts 'file' (default=" DEFAULT_NETWORK_SCRIPT ")\n"
     "                to configure it and 'dfile' (default=" DEFAULT_NETWORK_DOWN_SCRIPT ")\n"
@@ -1347,6 +1487,8 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "                    (only has effect for virtio guests which use MSIX)\n"
     "                use vhostforce=on to force vhost on for non-MSIX virtio guests\n"
     "                use 'vhostfd=h' to connect to an already opened vhost net device\n"
+    "                use 'vhostfds=x:y:...:z' to connect to multiple already opened vhost net devices\n"
+    "                use 'queues=n' to specify the number of queues to be created for multiqueue TAP\n"
     "-net bridge[,vlan=n][,name=str][,br=bridge][,helper=helper]\n"
     "                connects a host TAP network interface to a host bridge device 'br'\n"
     "                (default=" DEFAULT_BRIDGE_INTERFACE ") using the program 'helper'\n"
@@ -1365,6 +1507,14 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "                on host and listening for incoming connections on 'socketpath'.\n"
     "                Use group 'groupname' and mode 'octalmode' to change default\n"
     "                ownership and permissions for communication port.\n"
+#endif
+#ifdef CONFIG_LINUX
+    "-netdev vhost-user,id=str,path=socketpath\n"
+    "                hand the virtqueues of the NIC using this netdev to a vhost-user\n"
+    "                backend process listening on the UNIX socket 'socketpath'\n"
+    "-netdev af-packet,id=str,ifname=name[,ring-size=n]\n"
+    "                connect to host interface 'name' through AF_PACKET rings\n"
+    "                of 'n' bytes each for receive and transmit (default 8M)\n"
 #endif
     "-net dump[,vlan=n][,file=f][,len=n]\n"
     "                dump traffic on vlan 'n' to file 'f' (max n bytes per packet)\n"
@@ -1377,6 +1527,10 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
 #endif
     "tap|"
     "bridge|"
+#ifdef CONFIG_LINUX
+    "vhost-user|"
+    "af-packet|"
+#endif
 #ifdef CONFIG_VDE
     "vde|"
 #endif
@@ -1548,7 +1702,7 @@ syntax gives undefined results. Their use for new applications is discouraged
 as they will be removed from future versions.
 
 @item -netdev tap,id=@var{id}[,fd=@var{h}][,ifname=@var{name}][,script=@var{file}][,downscript=@var{dfile}][,helper=@var{helper}]
-@item -net tap[,vlan=@var{n}][,name=@var{name}][,fd=@var{h}][,ifname=@var{name}][,script=@var{file}][,downscript=@var{dfile}][,helper=@var{helper}]
+@item -net tap[,vlan=@var{n}][,name=@var{name}][,fd=@var{h}][,fds=@var{x}:@var{y}:...:@var{z}][,ifname=@var{name}][,script=@var{file}][,downscript=@var{dfile}][,helper=@var{helper}][,queues=@var{n}]
 Connect the host TAP network interface @var{name} to VLAN @var{n}.
 
 Use the network script @var{file} to configure it and the network script
@@ -1565,6 +1719,13 @@ helper executable is @file{/usr/local/libexec/qemu-bridge-helper}.
 @option{fd}=@var{h} can be used to specify the handle of an already
 opened host TAP interface.
 
+@option{queues}=@var{n} creates a multiqueue TAP device with @var{n} queues,
+each one backed by its own file descriptor, so that a multiqueue capable NIC
+such as virtio-net can spread its traffic across the queues.  Already opened
+queues of a multiqueue TAP interface can be passed with
+@option{fds}=@var{x}:@var{y}:...:@var{z}, together with one vhost net device per
+queue in @option{vhostfds}.
+
 Examples:
 
 @example
@@ -1610,6 +1771,44 @@ qemu-system-i386 linux.img -net bridge -net nic,model=virtio
 qemu-system-i386 linux.img -net bridge,br=qemubr0 -net nic,model=virtio
 @end example
 
+@item -netdev vhost-user,id=@var{id},path=@var{socketpath}
+Hand the virtqueues of the virtio-net device connected to this netdev to a
+vhost-user backend, for example a userspace virtual switch, that listens on
+the UNIX domain socket @var{socketpath}.  The backend processes the guest
+rings directly; QEMU only sets them up using the vhost protocol described in
+@file{docs/specs/vhost-user.txt}.
+
+Guest memory is shared with the backend, so it must be allocated as shared
+memory, with @option{-machine mem-share=on}, with shared memory backends
+(@option{-object memory-backend-file,share=on,...} and
+@option{-numa node,memdev=...}) or with @option{-mem-path} and
+@option{-mem-prealloc}.  Migration is not supported.
+
+Example:
+
+@example
+qemu-system-x86_64 -m 1024 -mem-path /dev/hugepages -mem-prealloc \
+                   -netdev vhost-user,id=net0,path=/var/run/vswitch.sock \
+                   -device virtio-net-pci,netdev=net0
+@end example
+
+@item -netdev af-packet,id=@var{id},ifname=@var{name}[,ring-size=@var{n}]
+Connect to the host interface @var{name}, for example one end of a veth
+pair or a physical NIC, through memory mapped AF_PACKET rings.  Frames are
+received a block at a time and transmitted in batches, with one system call
+per batch instead of one per frame.  Each of the receive and transmit rings
+uses @var{n} bytes (8M by default).  Frames larger than 2K are not
+transmitted, and no offloads are available to the guest.
+
+Opening packet sockets requires the CAP_NET_RAW capability.
+
+Example:
+
+@example
+qemu-system-x86_64 linux.img -netdev af-packet,id=net0,ifname=eth1 \
+                   -device virtio-net-pci,netdev=net0
+@end example
+
 @item -netdev socket,id=@var{id}[,fd=@var{h}][,listen=[@var{host}]:@var{port}][,connect=@var{host}:@var{port}]
 @item -net socket[,vlan=@var{n}][,name=@var{name}][,fd=@var{h}] [,listen=[@var{host}]:@var{port}][,connect=@var{host}:@var{port}]
 
@@ -2011,13 +2210,18 @@ ETEXI
 DEF("iscsi", HAS_ARG, QEMU_OPTION_iscsi,
     "-iscsi [user=user][,password=password]\n"
     "       [,header-digest=CRC32C|CR32C-NONE|NONE-CRC32C|NONE\n"
-    "       [,initiator-name=iqn]\n"
+    "       [,initiator-name=iqn][,sessions=n][,queue-depth=n]\n"
     "                iSCSI session parameters\n", QEMU_ARCH_ALL)
 STEXI
 
 iSCSI parameters such as username and password can also be specified via
 a configuration file. See qemu-doc for more information and examples.
 
+@option{sessions} logs in to each LUN up to 8 times and spreads reads and
+writes over the connections, which helps when one TCP connection cannot
+fill the link.  @option{queue-depth} limits the reads and writes in flight
+on each session; further requests wait inside QEMU.  The default is no limit.
+
 @item NBD
 QEMU supports NBD (Network Block Devices) both using TCP protocol as well
 as Unix Domain Sockets.
@@ -2083,6 +2287,19 @@ qemu-system-x86_84 --drive file=gluster://192.0.2.1/testvol/a.img
 @end example
 
 See also @url{http://www.gluster.org}.
+
+@item HTTP, HTTPS, FTP, FTPS and TFTP
+QEMU can read images straight from a web or FTP server with range requests.
+A trailing @code{:readahead=@var{bytes}:} sets the initial readahead
+(256 KiB by default).  The window grows to 4 MiB while the guest reads
+sequentially, and the next window is fetched in parallel.
+
+To keep fetched data on local disk, put a qcow2 overlay on top of the URL
+and enable copy-on-read:
+@example
+qemu-img create -f qcow2 -b http://192.0.2.1/images/cloud.img cache.qcow2
+qemu-system-i386 -drive file=cache.qcow2,copy-on-read=on
+@end example
 @end table
 ETEXI
 
@@ -2592,16 +2809,9 @@ Load the contents of @var{file} as an option ROM.
 This option is useful to load things like EtherBoot.
 ETEXI
 
-DEF("clock", HAS_ARG, QEMU_OPTION_clock, \
-    "-clock          force the use of the given methods for timer alarm.\n" \
-    "                To see what timers are available use '-clock help'\n",
-    QEMU_ARCH_ALL)
-STEXI
-@item -clock @var{method}
-@findex -clock
-Force the use of the given methods for timer alarm. To see what timers
-are available use @code{-clock help}.
-ETEXI
+HXCOMM Obsolete: timers are folded into the main loop wait, there are no
+HXCOMM alarm timers to choose from anymore
+DEF("clock", HAS_ARG, QEMU_OPTION_clock, "", QEMU_ARCH_ALL)
 
 HXCOMM Options deprecated by -rtc
 DEF("localtime", 0, QEMU_OPTION_localtime, "", QEMU_ARCH_ALL)
@@ -2635,17 +2845,23 @@ re-inject them.
 ETEXI
 
 DEF("icount", HAS_ARG, QEMU_OPTION_icount, \
-    "-icount [N|auto]\n" \
+    "-icount [N|auto][,sleep=on|off]\n" \
     "                enable virtual instruction counter with 2^N clock ticks per\n" \
-    "                instruction\n", QEMU_ARCH_ALL)
+    "                instruction; sleep=off skips idle time instead of waiting\n", QEMU_ARCH_ALL)
 STEXI
-@item -icount [@var{N}|auto]
+@item -icount [@var{N}|auto][,sleep=on|off]
 @findex -icount
 Enable virtual instruction counter.  The virtual cpu will execute one
 instruction every 2^@var{N} ns of virtual time.  If @code{auto} is specified
 then the virtual cpu speed will be automatically adjusted to keep virtual
 time within a few seconds of real time.
 
+When the virtual cpu is idle, virtual time normally advances to the next
+timer deadline only after the same amount of real time has passed.  With
+@option{sleep=off} it jumps there immediately, so idle periods cost no host
+time; virtual time then runs ahead of real time.  This is only supported
+with a fixed @var{N}.
+
 Note that while this option can give deterministic behavior, it does not
 provide cycle accurate emulation.  Modern CPUs contain superscalar out of
 order cores with complex cache hierarchies.  The number of instructions
@@ -2753,6 +2969,19 @@ STEXI
 Set TB size.
 ETEXI
 
+DEF("tb-persist", HAS_ARG, QEMU_OPTION_tb_persist, \
+    "-tb-persist file\n"
+    "                keep translated code in file across runs\n", QEMU_ARCH_ALL)
+STEXI
+@item -tb-persist @var{file}
+@findex -tb-persist
+Store the code generated by TCG in @var{file} and reuse it on the next
+run instead of translating the same guest code again.  A block is only
+reused when the guest code it was generated from is unchanged; the file
+is discarded when it was written by a different QEMU binary, CPU model
+or @option{-icount} setting.  Only supported on x86 hosts.
+ETEXI
+
 DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "-incoming p     prepare for incoming migration, listen on port p\n",
     QEMU_ARCH_ALL)
@@ -2831,6 +3060,27 @@ Enable Seccomp mode 2 system call filter. 'on' will enable syscall filtering and
 disable it.  The default is 'off'.
 ETEXI
 
+DEF("backing-cache", HAS_ARG, QEMU_OPTION_backing_cache,
+    "-backing-cache [path=]file[,size=size]\n"
+    "                share a read cache for read-only images with other\n"
+    "                QEMU processes using the same file\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -backing-cache [path=]@var{file}[,size=@var{size}]
+@findex -backing-cache
+Cache data read from read-only images, such as the backing files of
+guest disks, in @var{file}, which is mapped into memory and shared with
+all other QEMU processes given the same @var{file}.  When many guests boot
+from the same base image, only the first one to read a cluster of it has
+to fetch it from storage.  Use a file on a memory-backed file system, e.g.
+@file{/dev/shm/qemu-backing-cache}.
+
+@var{size} is used when @var{file} is created and defaults to 1G; an
+existing cache keeps its size.  Only images in regular files that are not
+encrypted are cached, and an image is no longer cached once it is
+modified or reopened read-write.
+ETEXI
+
 DEF("readconfig", HAS_ARG, QEMU_OPTION_readconfig,
     "-readconfig <file>\n", QEMU_ARCH_ALL)
 STEXI
@@ -2940,6 +3190,40 @@ DEF("object", HAS_ARG, QEMU_OPTION_object,
     "                property must be set.  These objects are placed in the\n"
     "                '/objects' path.\n",
     QEMU_ARCH_ALL)
+STEXI
+@item -object @var{typename}[,@var{prop1}=@var{value1},...]
+@findex -object
+Create a new object of type @var{typename}, setting properties in the order
+they are specified. The @option{id} property must be set. Memory backends
+that can be attached to NUMA nodes with @option{-numa node,memdev=@var{id}}
+are:
+
+@table @option
+@item -object memory-backend-ram,id=@var{id},size=@var{size}[,share=on|off]
+Anonymous memory. With share=on it is a shared mapping of an anonymous
+memory file whose descriptor can be passed to other processes.
+@item -object memory-backend-file,id=@var{id},size=@var{size},mem-path=@var{dir}[,share=on|off]
+Memory mapped from a file created in @var{dir}, typically a hugetlbfs mount.
+@end table
+
+Both take the host NUMA options
+@option{policy=default|preferred|bind|interleave} and
+@option{host-nodes=@var{node}[-@var{node}]}, which set the host memory
+policy of the backend with mbind(2), and @option{prealloc=on|off}, which
+faults in all of the memory at startup.  @option{merge=on|off} and
+@option{hugepage=on|off} choose for the backend alone whether its memory is
+offered to KSM and to transparent hugepages; they default to the
+@option{-machine} mem-merge and thp settings.  For example, to back each node
+of a two node guest by the matching host node:
+
+@example
+qemu -m 8G -smp 8 \
+     -object memory-backend-ram,id=m0,size=4G,policy=bind,host-nodes=0 \
+     -object memory-backend-ram,id=m1,size=4G,policy=bind,host-nodes=1 \
+     -numa node,memdev=m0,cpus=0-3,pin-vcpus=on \
+     -numa node,memdev=m1,cpus=4-7,pin-vcpus=on
+@end example
+ETEXI
 
 HXCOMM This is the last statement. Insert new options before this line!
 STEXI
@@ -46,6 +46,10 @@ typedef struct timeval qemu_timeval;
 typedef struct timespec qemu_timespec;
 int qemu_utimens(const char *path, const qemu_timespec *times);
 
+void *qemu_alloc_stack(size_t sz);
+void qemu_free_stack(void *stack, size_t sz);
+
 bool is_daemonized(void);
+int os_mlock(bool on);
 
 #endif
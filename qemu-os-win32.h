@@ -96,4 +96,9 @@ static inline bool is_daemonized(void)
     return false;
 }
 
+static inline int os_mlock(bool on)
+{
+    return -ENOSYS;
+}
+
 #endif
@@ -0,0 +1,150 @@
+/*
+ * Read-copy-update for QEMU
+ *
+ * The grace-period detector follows the memory-barrier flavour of
+ * userspace RCU: a reader copies the global counter into its per-thread
+ * slot when it enters its outermost critical section and clears it when
+ * it leaves.  synchronize_rcu() advances the counter and waits for every
+ * slot to be either clear or equal to the new value.  The counter is
+ * wide enough that it never wraps in practice, so a single phase
+ * suffices.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu-rcu.h"
+#include "qemu-thread.h"
+
+DEFINE_TLS(struct rcu_reader_data *, rcu_reader);
+
+/* Odd, so that it never matches a quiescent slot */
+unsigned long rcu_gp_ctr = 1;
+
+/* Serializes grace periods */
+static QemuMutex rcu_gp_lock;
+
+/* Protects insertions into the registry.  Readers are only ever added at
+   the head and never removed, so the grace-period detector can walk the
+   list from a snapshot of its head without holding the lock.  */
+static QemuMutex rcu_registry_lock;
+static QLIST_HEAD(, rcu_reader_data) rcu_registry =
+    QLIST_HEAD_INITIALIZER(rcu_registry);
+
+struct rcu_reader_data *rcu_register_thread(void)
+{
+    struct rcu_reader_data *r;
+
+    /* Heap allocated so that the slot outlives its thread; a thread that
+       has exited is simply quiescent forever.  */
+    r = g_new0(struct rcu_reader_data, 1);
+    qemu_mutex_lock(&rcu_registry_lock);
+    QLIST_INSERT_HEAD(&rcu_registry, r, node);
+    qemu_mutex_unlock(&rcu_registry_lock);
+    tls_var(rcu_reader) = r;
+    return r;
+}
+
+static void wait_for_readers(struct rcu_reader_data *skip)
+{
+    struct rcu_reader_data *r;
+    unsigned long ctr, cur;
+
+    qemu_mutex_lock(&rcu_gp_lock);
+
+    /* order the removal of the old version before the counter update */
+    smp_mb();
+    ctr = rcu_gp_ctr + 2;
+    *(volatile unsigned long *)&rcu_gp_ctr = ctr;
+    smp_mb();
+
+    qemu_mutex_lock(&rcu_registry_lock);
+    r = QLIST_FIRST(&rcu_registry);
+    qemu_mutex_unlock(&rcu_registry_lock);
+
+    for (; r; r = QLIST_NEXT(r, node)) {
+        if (r == skip) {
+            continue;
+        }
+        for (;;) {
+            cur = *(volatile unsigned long *)&r->ctr;
+            if (cur == 0 || cur == ctr) {
+                break;
+            }
+            g_usleep(100);
+        }
+    }
+
+    /* order the reader checks before the reclamation */
+    smp_mb();
+    qemu_mutex_unlock(&rcu_gp_lock);
+}
+
+void synchronize_rcu(void)
+{
+    wait_for_readers(NULL);
+}
+
+void synchronize_rcu_others(void)
+{
+    wait_for_readers(tls_var(rcu_reader));
+}
+
+static QemuMutex rcu_call_lock;
+static QemuCond rcu_call_cond;
+static struct rcu_head *rcu_call_head;
+static struct rcu_head **rcu_call_tail = &rcu_call_head;
+static bool rcu_call_started;
+static QemuThread rcu_call_thread;
+
+static void *call_rcu_thread(void *opaque)
+{
+    struct rcu_head *head, *next;
+
+    for (;;) {
+        qemu_mutex_lock(&rcu_call_lock);
+        while (!rcu_call_head) {
+            qemu_cond_wait(&rcu_call_cond, &rcu_call_lock);
+        }
+        head = rcu_call_head;
+        rcu_call_head = NULL;
+        rcu_call_tail = &rcu_call_head;
+        qemu_mutex_unlock(&rcu_call_lock);
+
+        /* one grace period covers the whole batch */
+        synchronize_rcu();
+
+        for (; head; head = next) {
+            next = head->next;
+            head->func(head);
+        }
+    }
+    return NULL;
+}
+
+void call_rcu(struct rcu_head *head, RCUCBFunc *func)
+{
+    head->func = func;
+    head->next = NULL;
+
+    qemu_mutex_lock(&rcu_call_lock);
+    if (!rcu_call_started) {
+        rcu_call_started = true;
+        qemu_thread_create(&rcu_call_thread, call_rcu_thread, NULL,
+                           QEMU_THREAD_DETACHED);
+    }
+    *rcu_call_tail = head;
+    rcu_call_tail = &head->next;
+    qemu_cond_signal(&rcu_call_cond);
+    qemu_mutex_unlock(&rcu_call_lock);
+}
+
+static void __attribute__((constructor)) rcu_init(void)
+{
+    qemu_mutex_init(&rcu_gp_lock);
+    qemu_mutex_init(&rcu_registry_lock);
+    qemu_mutex_init(&rcu_call_lock);
+    qemu_cond_init(&rcu_call_cond);
+}
@@ -0,0 +1,108 @@
+/*
+ * Read-copy-update for QEMU
+ *
+ * Readers bracket their accesses to RCU-protected data with
+ * rcu_read_lock() and rcu_read_unlock(); they never block and never
+ * write shared memory other than their own per-thread counter.  Writers
+ * publish a new version with atomic_rcu_set() and hand the old one to
+ * call_rcu(), which frees it once every reader that could still see it
+ * has left its critical section.
+ *
+ * Threads are registered with the grace-period detector the first time
+ * they enter a read-side critical section.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_RCU_H
+#define QEMU_RCU_H
+
+#include <stdbool.h>
+#include "qemu-barrier.h"
+#include "qemu-tls.h"
+#include "qemu-queue.h"
+
+struct rcu_reader_data {
+    /* Snapshot of rcu_gp_ctr when the outermost critical section was
+       entered, or 0 while the thread is quiescent.  */
+    unsigned long ctr;
+    unsigned depth;
+    QLIST_ENTRY(rcu_reader_data) node;
+};
+
+DECLARE_TLS(struct rcu_reader_data *, rcu_reader);
+extern unsigned long rcu_gp_ctr;
+
+struct rcu_reader_data *rcu_register_thread(void);
+
+static inline void rcu_read_lock(void)
+{
+    struct rcu_reader_data *r = tls_var(rcu_reader);
+
+    if (!r) {
+        r = rcu_register_thread();
+    }
+    if (r->depth++ > 0) {
+        return;
+    }
+    r->ctr = *(volatile unsigned long *)&rcu_gp_ctr;
+    /* order the counter store before the loads of protected data */
+    smp_mb();
+}
+
+static inline void rcu_read_unlock(void)
+{
+    struct rcu_reader_data *r = tls_var(rcu_reader);
+
+    if (--r->depth > 0) {
+        return;
+    }
+    /* order the loads of protected data before the counter store */
+    smp_mb();
+    *(volatile unsigned long *)&r->ctr = 0;
+}
+
+/* Leave the critical sections nested inside the outermost one, for code
+   that longjmps out of them.  */
+static inline void rcu_read_lock_reset(void)
+{
+    tls_var(rcu_reader)->depth = 1;
+}
+
+/* Wait until every critical section that was running when the function
+   was called has ended.  Must not be called inside a critical section. */
+void synchronize_rcu(void);
+
+/* Like synchronize_rcu, but ignores the caller's own critical section so
+   that it can be used from inside one.  The caller must not itself hold
+   references to the data that is going to be reclaimed.  */
+void synchronize_rcu_others(void);
+
+struct rcu_head;
+typedef void RCUCBFunc(struct rcu_head *head);
+
+struct rcu_head {
+    struct rcu_head *next;
+    RCUCBFunc *func;
+};
+
+/* Run @func from a helper thread after a grace period has elapsed.
+   @head is usually embedded in the object to be reclaimed.  */
+void call_rcu(struct rcu_head *head, RCUCBFunc *func);
+
+/* Publish @v through the pointer at @p; readers that observe the new
+   pointer also observe the initialized contents of *@v.  */
+#define atomic_rcu_set(p, v) do {               \
+    smp_wmb();                                  \
+    *(p) = (v);                                 \
+} while (0)
+
+/* Fetch an RCU-protected pointer; only valid inside a critical section. */
+#define atomic_rcu_read(p) ({                               \
+    typeof(*(p)) _val = *(volatile typeof(*(p)) *)(p);      \
+    smp_rmb();                                              \
+    _val;                                                   \
+})
+
+#endif
@@ -24,6 +24,7 @@ struct QemuSeccompSyscall {
 static const struct QemuSeccompSyscall seccomp_whitelist[] = {
     { SCMP_SYS(timer_settime), 255 },
     { SCMP_SYS(timer_gettime), 254 },
+    { SCMP_SYS(timerfd_settime), 254 },
     { SCMP_SYS(futex), 253 },
     { SCMP_SYS(select), 252 },
 #if defined(__x86_64__)
@@ -229,7 +230,8 @@ static const struct QemuSeccompSyscall seccomp_whitelist[] = {
     { SCMP_SYS(sendmmsg), 241 },
     { SCMP_SYS(recvmmsg), 241 },
     { SCMP_SYS(prlimit64), 241 },
-    { SCMP_SYS(waitid), 241 }
+    { SCMP_SYS(waitid), 241 },
+    { SCMP_SYS(timerfd_create), 241 }
 };
 
 int seccomp_start(void)
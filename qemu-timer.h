@@ -2,7 +2,6 @@
 #define QEMU_TIMER_H
 
 #include "qemu-common.h"
-#include "main-loop.h"
 #include "notify.h"
 
 #ifdef __FreeBSD__
@@ -18,6 +17,27 @@
 typedef struct QEMUClock QEMUClock;
 typedef void QEMUTimerCB(void *opaque);
 
+enum QEMUClockType {
+    QEMU_CLOCK_REALTIME = 0,
+    QEMU_CLOCK_VIRTUAL = 1,
+    QEMU_CLOCK_HOST = 2,
+    QEMU_CLOCK_MAX
+};
+
+/* A timer list holds the active timers of one clock that are run by one
+   thread or event loop.  Every clock has a list run by the main loop; an
+   AioContext or another thread can create its own lists and run them.
+   Timers can be modified from any thread; when the earliest deadline of
+   a list changes, its notify callback wakes up the owner.  */
+typedef struct QEMUTimerList QEMUTimerList;
+typedef QEMUTimerList *QEMUTimerListGroup[QEMU_CLOCK_MAX];
+typedef void QEMUTimerListNotifyCB(void *opaque);
+
+extern QEMUTimerListGroup main_loop_tlg;
+
+/* main-loop.h needs the types above through qemu-aio.h */
+#include "main-loop.h"
+
 /* The real time clock should be used only for stuff which does not
    change the virtual machine state, as it is run even if the virtual
    machine is stopped. The real time clock has a frequency of 1000
@@ -40,6 +60,7 @@ int64_t qemu_get_clock_ns(QEMUClock *clock);
 int64_t qemu_clock_has_timers(QEMUClock *clock);
 int64_t qemu_clock_expired(QEMUClock *clock);
 int64_t qemu_clock_deadline(QEMUClock *clock);
+int64_t qemu_clock_deadline_ns_all(QEMUClock *clock);
 void qemu_clock_enable(QEMUClock *clock, bool enabled);
 void qemu_clock_warp(QEMUClock *clock);
 
@@ -59,9 +80,36 @@ uint64_t qemu_timer_expire_time_ns(QEMUTimer *ts);
 
 void qemu_run_timers(QEMUClock *clock);
 void qemu_run_all_timers(void);
-void configure_alarms(char const *opt);
 void init_clocks(void);
-int init_timer_alarm(void);
+
+/* Deadlines are in nanoseconds; -1 means that no timer is pending.  */
+QEMUTimerList *timerlist_new(QEMUClock *clock, QEMUTimerListNotifyCB *cb,
+                             void *opaque);
+void timerlist_free(QEMUTimerList *timer_list);
+bool timerlist_has_timers(QEMUTimerList *timer_list);
+int64_t timerlist_deadline_ns(QEMUTimerList *timer_list);
+bool timerlist_run_timers(QEMUTimerList *timer_list);
+void timerlist_notify(QEMUTimerList *timer_list);
+QEMUTimer *qemu_new_timer_tl(QEMUTimerList *timer_list, int scale,
+                             QEMUTimerCB *cb, void *opaque);
+
+void timerlistgroup_init(QEMUTimerListGroup tlg,
+                         QEMUTimerListNotifyCB *cb, void *opaque);
+void timerlistgroup_deinit(QEMUTimerListGroup tlg);
+bool timerlistgroup_run_timers(QEMUTimerListGroup tlg);
+int64_t timerlistgroup_deadline_ns(QEMUTimerListGroup tlg);
+
+static inline int64_t qemu_soonest_timeout(int64_t timeout1, int64_t timeout2)
+{
+    /* -1 converted to unsigned is the largest value */
+    return (uint64_t)timeout1 < (uint64_t)timeout2 ? timeout1 : timeout2;
+}
+
+/* Round a nanosecond timeout up to milliseconds, for poll() and friends. */
+int qemu_timeout_ns_to_ms(int64_t ns);
+
+/* Like g_poll(), but with a nanosecond timeout.  */
+int qemu_poll_ns(GPollFD *fds, unsigned int nfds, int64_t timeout);
 
 int64_t cpu_get_ticks(void);
 void cpu_enable_ticks(void);
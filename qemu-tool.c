@@ -106,6 +106,16 @@ void slirp_select_poll(fd_set *readfds, fd_set *writefds,
 {
 }
 
+#ifndef _WIN32
+void slirp_pollfds_fill(void)
+{
+}
+
+void slirp_pollfds_poll(int select_error)
+{
+}
+#endif
+
 void migrate_add_blocker(Error *reason)
 {
 }
@@ -319,6 +319,7 @@ static void guest_file_init(void)
 typedef struct FsMount {
     char *dirname;
     char *devtype;
+    int fd;         /* -1 unless opened for fsfreeze */
     QTAILQ_ENTRY(FsMount) next;
 } FsMount;
 
@@ -334,6 +335,9 @@ static void free_fs_mount_list(FsMountList *mounts)
 
      QTAILQ_FOREACH_SAFE(mount, mounts, next, temp) {
          QTAILQ_REMOVE(mounts, mount, next);
+         if (mount->fd != -1) {
+             close(mount->fd);
+         }
          g_free(mount->dirname);
          g_free(mount->devtype);
          g_free(mount);
@@ -372,6 +376,7 @@ static int build_fs_mount_list(FsMountList *mounts)
         mount = g_malloc0(sizeof(FsMount));
         mount->dirname = g_strdup(ment->mnt_dir);
         mount->devtype = g_strdup(ment->mnt_type);
+        mount->fd = -1;
 
         QTAILQ_INSERT_TAIL(mounts, mount, next);
     }
@@ -384,6 +389,55 @@ static int build_fs_mount_list(FsMountList *mounts)
 
 #if defined(CONFIG_FSFREEZE)
 
+/*
+ * Mount points opened by guest-fsfreeze-prepare or guest-fsfreeze-freeze,
+ * kept open until the thaw so that neither freezing nor thawing has to
+ * read the mount table or resolve paths.
+ */
+static struct {
+    FsMountList mounts;
+    bool valid;
+} guest_fsfreeze_state;
+
+static void guest_fsfreeze_release(void)
+{
+    if (guest_fsfreeze_state.valid) {
+        free_fs_mount_list(&guest_fsfreeze_state.mounts);
+        guest_fsfreeze_state.valid = false;
+    }
+}
+
+/*
+ * Build the list of local file systems and open each of them.
+ */
+static int guest_fsfreeze_open(Error **err)
+{
+    FsMount *mount;
+    char err_msg[512];
+
+    guest_fsfreeze_release();
+    QTAILQ_INIT(&guest_fsfreeze_state.mounts);
+    if (build_fs_mount_list(&guest_fsfreeze_state.mounts) < 0) {
+        error_set(err, QERR_QGA_COMMAND_FAILED,
+                  "failed to enumerate filesystems");
+        return -1;
+    }
+    guest_fsfreeze_state.valid = true;
+
+    QTAILQ_FOREACH(mount, &guest_fsfreeze_state.mounts, next) {
+        mount->fd = qemu_open(mount->dirname, O_RDONLY);
+        if (mount->fd == -1) {
+            snprintf(err_msg, sizeof(err_msg), "failed to open %s, %s",
+                     mount->dirname, strerror(errno));
+            error_set(err, QERR_QGA_COMMAND_FAILED, err_msg);
+            guest_fsfreeze_release();
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 /*
  * Return status of freeze/thaw
  */
@@ -396,6 +450,29 @@ GuestFsfreezeStatus qmp_guest_fsfreeze_status(Error **err)
     return GUEST_FSFREEZE_STATUS_THAWED;
 }
 
+/*
+ * Open the local file systems and write back their dirty data ahead of
+ * guest-fsfreeze-freeze, so that FIFREEZE has next to nothing left to
+ * flush and the file systems stay frozen for as short as possible.
+ */
+int64_t qmp_guest_fsfreeze_prepare(Error **err)
+{
+    FsMount *mount;
+    int64_t i = 0;
+
+    slog("guest-fsfreeze-prepare called");
+
+    if (guest_fsfreeze_open(err) < 0) {
+        return 0;
+    }
+    sync();
+
+    QTAILQ_FOREACH(mount, &guest_fsfreeze_state.mounts, next) {
+        i++;
+    }
+    return i;
+}
+
 /*
  * Walk list of mounted file systems in the guest, and freeze the ones which
  * are real local file systems.
@@ -403,31 +480,19 @@ GuestFsfreezeStatus qmp_guest_fsfreeze_status(Error **err)
 int64_t qmp_guest_fsfreeze_freeze(Error **err)
 {
     int ret = 0, i = 0;
-    FsMountList mounts;
     struct FsMount *mount;
-    int fd;
     char err_msg[512];
 
     slog("guest-fsfreeze called");
 
-    QTAILQ_INIT(&mounts);
-    ret = build_fs_mount_list(&mounts);
-    if (ret < 0) {
-        return ret;
+    if (!guest_fsfreeze_state.valid && guest_fsfreeze_open(err) < 0) {
+        return 0;
     }
 
     /* cannot risk guest agent blocking itself on a write in this state */
     ga_set_frozen(ga_state);
 
-    QTAILQ_FOREACH(mount, &mounts, next) {
-        fd = qemu_open(mount->dirname, O_RDONLY);
-        if (fd == -1) {
-            sprintf(err_msg, "failed to open %s, %s", mount->dirname,
-                    strerror(errno));
-            error_set(err, QERR_QGA_COMMAND_FAILED, err_msg);
-            goto error;
-        }
-
+    QTAILQ_FOREACH(mount, &guest_fsfreeze_state.mounts, next) {
         /* we try to cull filesytems we know won't work in advance, but other
          * filesytems may not implement fsfreeze for less obvious reasons.
          * these will report EOPNOTSUPP. we simply ignore these when tallying
@@ -437,26 +502,22 @@ int64_t qmp_guest_fsfreeze_freeze(Error **err)
          * expect to be freezable, so return an error in those cases
          * and return system to thawed state.
          */
-        ret = ioctl(fd, FIFREEZE);
+        ret = ioctl(mount->fd, FIFREEZE);
         if (ret == -1) {
             if (errno != EOPNOTSUPP) {
                 sprintf(err_msg, "failed to freeze %s, %s",
                         mount->dirname, strerror(errno));
                 error_set(err, QERR_QGA_COMMAND_FAILED, err_msg);
-                close(fd);
                 goto error;
             }
         } else {
             i++;
         }
-        close(fd);
     }
 
-    free_fs_mount_list(&mounts);
     return i;
 
 error:
-    free_fs_mount_list(&mounts);
     qmp_guest_fsfreeze_thaw(NULL);
     return 0;
 }
@@ -467,21 +528,27 @@ error:
 int64_t qmp_guest_fsfreeze_thaw(Error **err)
 {
     int ret;
-    FsMountList mounts;
     FsMount *mount;
     int fd, i = 0, logged;
 
-    QTAILQ_INIT(&mounts);
-    ret = build_fs_mount_list(&mounts);
-    if (ret) {
-        error_set(err, QERR_QGA_COMMAND_FAILED,
-                  "failed to enumerate filesystems");
-        return 0;
+    /* After a restart of the agent while frozen, nothing is open yet */
+    if (!guest_fsfreeze_state.valid) {
+        QTAILQ_INIT(&guest_fsfreeze_state.mounts);
+        ret = build_fs_mount_list(&guest_fsfreeze_state.mounts);
+        if (ret) {
+            error_set(err, QERR_QGA_COMMAND_FAILED,
+                      "failed to enumerate filesystems");
+            return 0;
+        }
+        guest_fsfreeze_state.valid = true;
     }
 
-    QTAILQ_FOREACH(mount, &mounts, next) {
+    QTAILQ_FOREACH(mount, &guest_fsfreeze_state.mounts, next) {
         logged = false;
-        fd = qemu_open(mount->dirname, O_RDONLY);
+        fd = mount->fd;
+        if (fd == -1) {
+            fd = qemu_open(mount->dirname, O_RDONLY);
+        }
         if (fd == -1) {
             continue;
         }
@@ -508,11 +575,13 @@ int64_t qmp_guest_fsfreeze_thaw(Error **err)
                 logged = true;
             }
         } while (ret == 0);
-        close(fd);
+        if (fd != mount->fd) {
+            close(fd);
+        }
     }
 
     ga_unset_frozen(ga_state);
-    free_fs_mount_list(&mounts);
+    guest_fsfreeze_release();
     return i;
 }
 
@@ -527,6 +596,7 @@ static void guest_fsfreeze_cleanup(void)
             slog("failed to clean up frozen filesystems");
         }
     }
+    guest_fsfreeze_release();
 }
 #endif /* CONFIG_FSFREEZE */
 
@@ -969,6 +1039,13 @@ GuestFsfreezeStatus qmp_guest_fsfreeze_status(Error **err)
     return 0;
 }
 
+int64_t qmp_guest_fsfreeze_prepare(Error **err)
+{
+    error_set(err, QERR_UNSUPPORTED);
+
+    return 0;
+}
+
 int64_t qmp_guest_fsfreeze_freeze(Error **err)
 {
     error_set(err, QERR_UNSUPPORTED);
@@ -154,6 +154,12 @@ GuestFsfreezeStatus qmp_guest_fsfreeze_status(Error **err)
     return 0;
 }
 
+int64_t qmp_guest_fsfreeze_prepare(Error **err)
+{
+    error_set(err, QERR_UNSUPPORTED);
+    return 0;
+}
+
 /*
  * Walk list of mounted file systems in the guest, and freeze the ones which
  * are real local file systems.
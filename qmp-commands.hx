@@ -612,6 +612,56 @@ Example:
 -> { "execute": "query-migrate-cache-size" }
 <- { "return": 67108864 }
 
+EQMP
+
+    {
+        .name       = "migrate-set-parameters",
+        .args_type  = "compress-level:i?,compress-threads:i?,decompress-threads:i?",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_parameters,
+    },
+
+SQMP
+migrate-set-parameters
+----------------------
+
+Set migration compression parameters
+
+Arguments:
+
+- "compress-level": zlib compression level, 0-9 (json-int, optional)
+- "compress-threads": number of compression threads (json-int, optional)
+- "decompress-threads": number of decompression threads (json-int, optional)
+
+Example:
+
+-> { "execute": "migrate-set-parameters",
+     "arguments": { "compress-level": 1, "compress-threads": 4 } }
+<- { "return": {} }
+
+EQMP
+    {
+        .name       = "query-migrate-parameters",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_migrate_parameters,
+    },
+
+SQMP
+query-migrate-parameters
+------------------------
+
+Show migration compression parameters
+
+returns a json-object with the following information:
+- "compress-level" : zlib compression level (json-int)
+- "compress-threads" : number of compression threads (json-int)
+- "decompress-threads" : number of decompression threads (json-int)
+
+Example:
+
+-> { "execute": "query-migrate-parameters" }
+<- { "return": { "compress-level": 1, "compress-threads": 8,
+                 "decompress-threads": 2 } }
+
 EQMP
 
     {
@@ -698,8 +748,8 @@ EQMP
 
     {
         .name       = "dump-guest-memory",
-        .args_type  = "paging:b,protocol:s,begin:i?,end:i?",
-        .params     = "-p protocol [begin] [length]",
+        .args_type  = "paging:b,protocol:s,begin:i?,end:i?,format:s?,live:b?",
+        .params     = "-p protocol [begin] [length] [format] [live]",
         .help       = "dump guest memory to file",
         .user_print = monitor_user_noop,
         .mhandler.cmd_new = qmp_marshal_input_dump_guest_memory,
@@ -720,6 +770,10 @@ Arguments:
            with length together (json-int)
 - "length": the memory size, in bytes. It's optional, and should be specified
             with begin together (json-int)
+- "format": the format of the vmcore, "elf", "kdump-zlib", "kdump-lzo" or
+            "kdump-snappy". It's optional, the default is "elf" (json-string)
+- "live": copy memory while the guest runs and return immediately; only for
+          the elf format without paging (json-bool, optional)
 
 Example:
 
@@ -730,6 +784,31 @@ Notes:
 
 (1) All boolean arguments default to false
 
+EQMP
+
+    {
+        .name       = "query-dump",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_dump,
+    },
+
+SQMP
+query-dump
+----------
+
+Query the progress of a live guest memory dump.
+
+Return a json-object with the following information:
+
+- "status": "none", "active", "completed" or "failed" (json-string)
+- "completed": bytes of guest memory written so far (json-int)
+- "total": bytes of guest memory to dump (json-int)
+
+Example:
+
+-> { "execute": "query-dump" }
+<- { "return": { "status": "active", "completed": 1024000, "total": 2048000 } }
+
 EQMP
 
     {
@@ -811,10 +890,62 @@ EQMP
 
     {
         .name       = "block-stream",
-        .args_type  = "device:B,base:s?,speed:o?,on-error:s?",
+        .args_type  = "device:B,base:s?,hint-file:s?,speed:o?,on-error:s?",
         .mhandler.cmd_new = qmp_marshal_input_block_stream,
     },
 
+    {
+        .name       = "block-record-reads",
+        .args_type  = "device:B,hint-file:s,duration:i?",
+        .mhandler.cmd_new = qmp_marshal_input_block_record_reads,
+    },
+
+SQMP
+block-record-reads
+------------------
+
+Record the order in which the guest first reads each area of a block device
+into a hint file for block-stream.
+
+Arguments:
+
+- "device": device name (json-string)
+- "hint-file": file the hint file is written to (json-string)
+- "duration": length of the recording in seconds; by default until
+  block-record-reads-stop or until the device is closed (json-int, optional)
+
+Example:
+
+-> { "execute": "block-record-reads", "arguments": { "device": "virtio0",
+                                             "hint-file": "/var/lib/base.hints",
+                                             "duration": 120 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-record-reads-stop",
+        .args_type  = "device:B",
+        .mhandler.cmd_new = qmp_marshal_input_block_record_reads_stop,
+    },
+
+SQMP
+block-record-reads-stop
+-----------------------
+
+End a recording started by block-record-reads and write its hint file.
+
+Arguments:
+
+- "device": device name (json-string)
+
+Example:
+
+-> { "execute": "block-record-reads-stop", "arguments": { "device": "virtio0" } }
+<- { "return": {} }
+
+EQMP
+
     {
         .name       = "block-commit",
         .args_type  = "device:B,base:s?,top:s,speed:o?",
@@ -938,7 +1069,8 @@ EQMP
     {
         .name       = "drive-mirror",
         .args_type  = "sync:s,device:B,target:s,speed:i?,mode:s?,format:s?,"
-                      "on-source-error:s?,on-target-error:s?",
+                      "on-source-error:s?,on-target-error:s?,"
+                      "granularity:i?,buf-size:i?",
         .mhandler.cmd_new = qmp_marshal_input_drive_mirror,
     },
 
@@ -970,6 +1102,13 @@ Arguments:
   (BlockdevOnError, default 'report')
 - "on-target-error": the action to take on an error on the target
   (BlockdevOnError, default 'report')
+- "granularity": granularity of the dirty bitmap, in bytes; a power of 2
+  between 512 and 64M (json-int, optional, default: the cluster size of
+  the target clamped to 4k-64k)
+- "buf-size": memory used for in-flight copies, in bytes (json-int,
+  optional, default 10M)
+
+The job copies several dirty chunks at once, as many as fit in buf-size.
 
 
 
@@ -981,6 +1120,121 @@ Example:
                                                "format": "qcow2" } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "drive-backup",
+        .args_type  = "sync:s,device:B,target:s,speed:i?,mode:s?,format:s?,"
+                      "bitmap:s?,on-source-error:s?,on-target-error:s?",
+        .mhandler.cmd_new = qmp_marshal_input_drive_backup,
+    },
+
+SQMP
+drive-backup
+------------
+
+Start a point-in-time copy of a block device to a new destination.  The
+status of ongoing drive-backup operations can be checked with
+query-block-jobs.  The operation can be stopped before it has completed
+using the block-job-cancel command.  Guest writes to clusters that have
+not been copied yet first save the old data to the target.
+
+Arguments:
+
+- "device": the name of the device which should be copied.
+            (json-string)
+- "target": the target of the new image.  If the file exists, or if it is a
+            device, the existing file/device will be used as the new
+            destination.  If it does not exist, a new file will be created.
+            (json-string)
+- "format": the format of the new destination, default is to probe if 'mode'
+            is 'existing', else the format of the source
+            (json-string, optional)
+- "sync": what parts of the disk image should be copied to the destination;
+  possibilities include "full" for all the disk, "top" for only the sectors
+  allocated in the topmost image, "none" to only copy the data overwritten
+  by the guest, or "incremental" for the clusters marked in "bitmap"
+  (MirrorSyncMode).
+- "mode": whether and how QEMU should create a new image
+          (NewImageMode, optional, default 'absolute-paths')
+- "speed": the maximum speed, in bytes per second (json-int, optional)
+- "bitmap": the dirty bitmap that selects the clusters to copy, required
+            for sync mode "incremental".  It is cleared when the job starts
+            and marked again if the job fails or is cancelled.
+            (json-string, optional)
+- "on-source-error": the action to take on an error on the source, default
+                     'report'.  'stop' and 'enospc' can only be used
+                     if the block device supports io-status.
+                     (BlockdevOnError, optional)
+- "on-target-error": the action to take on an error on the target, default
+                     'report' (no limitations, since this applies to
+                     a different block device than device).
+                     (BlockdevOnError, optional)
+
+Example:
+-> { "execute": "drive-backup", "arguments": { "device": "drive0",
+                                               "sync": "incremental",
+                                               "bitmap": "nightly",
+                                               "target": "backup.img" } }
+<- { "return": {} }
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-add",
+        .args_type  = "device:B,name:s,granularity:i?,persistent:b?",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_add,
+    },
+
+SQMP
+block-dirty-bitmap-add
+----------------------
+
+Create a named dirty bitmap that tracks the writes to a block device from now
+on.  Persistent bitmaps are stored in the image on close and loaded again on
+open; this requires a writable qcow2 image of version 3.
+
+Arguments:
+
+- "device": device name (json-string)
+- "name": name of the new bitmap (json-string)
+- "granularity": granularity in bytes, a power of 2 between 512 and 64M
+  (json-int, optional, default: the cluster size, at least 64k)
+- "persistent": store the bitmap in the image (json-bool, optional,
+  default false)
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-add", "arguments": { "device": "drive0",
+                                                         "name": "nightly",
+                                                         "persistent": true } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-remove",
+        .args_type  = "device:B,name:s",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_remove,
+    },
+
+SQMP
+block-dirty-bitmap-remove
+-------------------------
+
+Delete a named dirty bitmap, and remove it from the image if it is
+persistent.  Bitmaps used by a running backup job cannot be removed.
+
+Arguments:
+
+- "device": device name (json-string)
+- "name": name of the bitmap (json-string)
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-remove", "arguments": { "device": "drive0",
+                                                            "name": "nightly" } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1237,7 +1491,10 @@ EQMP
 
     {
         .name       = "block_set_io_throttle",
-        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,"
+                      "bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,"
+                      "iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,"
+                      "burst_length:l?,iops_size:l?,group:s?",
         .mhandler.cmd_new = qmp_marshal_input_block_set_io_throttle,
     },
 
@@ -1256,6 +1513,16 @@ Arguments:
 - "iops":  total I/O operations per second(json-int)
 - "iops_rd":  read I/O operations per second(json-int)
 - "iops_wr":  write I/O operations per second(json-int)
+- "bps_max":  total throughput burst rate in bytes per second(json-int, optional)
+- "bps_rd_max":  read throughput burst rate in bytes per second(json-int, optional)
+- "bps_wr_max":  write throughput burst rate in bytes per second(json-int, optional)
+- "iops_max":  total I/O operations burst rate per second(json-int, optional)
+- "iops_rd_max":  read I/O operations burst rate per second(json-int, optional)
+- "iops_wr_max":  write I/O operations burst rate per second(json-int, optional)
+- "burst_length":  seconds the burst rates can be sustained, default 1(json-int, optional)
+- "iops_size":  requests larger than this many bytes count as several
+                I/O operations(json-int, optional)
+- "group":  throttle group whose members share the limits(json-string, optional)
 
 Example:
 
@@ -1268,6 +1535,34 @@ Example:
                                                "iops_wr": "0" } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block-set-cache-size",
+        .args_type  = "device:B,l2-cache-size:o?,refcount-cache-size:o?",
+        .mhandler.cmd_new = qmp_marshal_input_block_set_cache_size,
+    },
+
+SQMP
+block-set-cache-size
+--------------------
+
+Change the size of the metadata caches of a block device's image format.
+
+Arguments:
+
+- "device": device name (json-string)
+- "l2-cache-size": size of the L2 table cache in bytes, 0 for the default
+  (json-int, optional)
+- "refcount-cache-size": size of the refcount block cache in bytes, 0 for
+  the default (json-int, optional)
+
+Example:
+
+-> { "execute": "block-set-cache-size", "arguments": { "device": "virtio0",
+                                             "l2-cache-size": 33554432 } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1606,6 +1901,15 @@ Each json-object contain the following:
          - "iops": limit total I/O operations per second (json-int)
          - "iops_rd": limit read operations per second (json-int)
          - "iops_wr": limit write operations per second (json-int)
+         - "bps_max": total bytes per second burst rate (json-int, optional)
+         - "bps_rd_max": read bytes per second burst rate (json-int, optional)
+         - "bps_wr_max": write bytes per second burst rate (json-int, optional)
+         - "iops_max": total operations per second burst rate (json-int, optional)
+         - "iops_rd_max": read operations per second burst rate (json-int, optional)
+         - "iops_wr_max": write operations per second burst rate (json-int, optional)
+         - "burst_length": seconds the burst rates can be sustained (json-int, optional)
+         - "iops_size": bytes counted as one operation (json-int, optional)
+         - "group": throttle group name (json-string, optional)
 
 - "io-status": I/O operation status, only present if the device supports it
                and the VM is configured to stop on errors. It's always reset
@@ -1665,6 +1969,7 @@ EQMP
         .name       = "query-block",
         .args_type  = "",
         .mhandler.cmd_new = qmp_marshal_input_query_block,
+        .offload    = &qmp_offload_query_block,
     },
 
 SQMP
@@ -1690,6 +1995,24 @@ Each json-object contain the following:
     - "flush_total_time_ns": total time spend on cache flushes in nano-seconds (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+    - "rd_merged": read requests merged into an adjacent one (json-int)
+    - "wr_merged": write requests merged into an adjacent one (json-int)
+    - "timed_stats": json-array with one json-object per interval set with
+                     the stats-intervals drive option (optional):
+        - "interval_length": length of the interval in seconds (json-int)
+        - "min_rd_latency_ns", "max_rd_latency_ns", "avg_rd_latency_ns",
+          "min_wr_latency_ns", "max_wr_latency_ns", "avg_wr_latency_ns",
+          "min_flush_latency_ns", "max_flush_latency_ns",
+          "avg_flush_latency_ns": latencies of the requests that completed
+                                  within the interval (json-int)
+        - "avg_rd_queue_depth", "avg_wr_queue_depth": average number of
+                                  pending requests (json-number)
+    - "rd_latency_histogram", "wr_latency_histogram",
+      "flush_latency_histogram": latency histograms, see
+                                 block-latency-histogram-set (optional):
+        - "bins": json-array of json-objects with "start", the lowest
+                  latency of the bin in nanoseconds (json-int), and
+                  "count", its number of requests (json-int)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -1724,7 +2047,9 @@ Example:
                "flush_operations":51,
                "wr_total_times_ns":313253456
                "rd_total_times_ns":3465673657
-               "flush_total_times_ns":49653
+               "flush_total_times_ns":49653,
+               "rd_merged":0,
+               "wr_merged":0
             }
          },
          {
@@ -1778,6 +2103,7 @@ EQMP
         .name       = "query-blockstats",
         .args_type  = "",
         .mhandler.cmd_new = qmp_marshal_input_query_blockstats,
+        .offload    = &qmp_offload_query_blockstats,
     },
 
 SQMP
@@ -2381,7 +2707,27 @@ The main json-object contains the following:
          - "bytes": total XBZRLE bytes transferred
          - "pages": number of XBZRLE compressed pages
          - "cache-miss": number of cache misses
+         - "cache-hits": number of cache hits
+         - "cache-hit-rate": fraction of lookups that hit (json-number)
          - "overflow": number of XBZRLE overflows
+- "compression": only present if the compress capability is on.
+  It is a json-object with the following compression information:
+         - "pages": number of compressed pages
+         - "busy": times no compression thread was free
+         - "compressed-size": total bytes after compression
+         - "compression-rate": ratio of original to compressed size
+- "cpu-throttle-percentage": only present while auto-converge is throttling
+  the guest, percentage of time the vCPUs are kept from running (json-int)
+- "estimates": only present if "status" is "active" and the dirty bitmap
+  was synchronized at least twice.  It is a json-object with the same
+  members as the MIGRATION_PASS event:
+         - "pass": number of dirty bitmap synchronizations (json-int)
+         - "bandwidth": bytes per second over the last second (json-int)
+         - "dirty-rate": bytes per second dirtied by the guest (json-int)
+         - "dirty-bytes": bytes found dirty by the last pass (json-int)
+         - "converging": true if sending outpaces dirtying (json-bool)
+         - "remaining-time": ms until the rest fits in the maximum
+           downtime, only present if converging (json-int)
 Examples:
 
 1. Before the first migration
@@ -2477,6 +2823,8 @@ Examples:
             "bytes":20971520,
             "pages":2444343,
             "cache-miss":2244,
+            "cache-hits":8651,
+            "cache-hit-rate":0.79,
             "overflow":34434
          }
       }
@@ -2488,6 +2836,7 @@ EQMP
         .name       = "query-migrate",
         .args_type  = "",
         .mhandler.cmd_new = qmp_marshal_input_query_migrate,
+        .offload    = &qmp_offload_query_migrate,
     },
 
 SQMP
@@ -2611,7 +2960,7 @@ EQMP
     },
     {
         .name       = "nbd-server-add",
-        .args_type  = "device:B,writable:b?",
+        .args_type  = "device:B,writable:b?,snapshot:b?",
         .mhandler.cmd_new = qmp_marshal_input_nbd_server_add,
     },
     {
@@ -2654,3 +3003,525 @@ EQMP
         .args_type  = "",
         .mhandler.cmd_new = qmp_marshal_input_query_target,
     },
+
+    {
+        .name       = "tb-profile",
+        .args_type  = "enable:b",
+        .mhandler.cmd_new = qmp_marshal_input_tb_profile,
+    },
+
+SQMP
+tb-profile
+----------
+
+Enable or disable per-TB profiling of the TCG accelerator.  Enabling it
+clears the statistics and flushes the translated code.
+
+Arguments:
+
+- "enable": whether to profile (json-bool)
+
+Example:
+
+-> { "execute": "tb-profile", "arguments": { "enable": true } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-tb-profile",
+        .args_type  = "sort:s?,limit:i?",
+        .mhandler.cmd_new = qmp_marshal_input_query_tb_profile,
+    },
+
+SQMP
+query-tb-profile
+----------------
+
+Return the statistics of each translation block since profiling was
+enabled.  Blocks translated again from the same guest code share one
+entry.
+
+Arguments:
+
+- "sort": "exec-count" (default), "pc", "translate-time", "host-size",
+          "tlb-misses" or "exits" (json-string, optional)
+- "limit": maximum number of blocks to return (json-int, optional)
+
+Each block is described by:
+
+- "pc": guest virtual address (json-int)
+- "cs-base": target-specific code segment base (json-int)
+- "flags": target-specific translation flags (json-int)
+- "symbol": guest symbol containing "pc" (json-string, optional)
+- "guest-size": size of the guest code in bytes (json-int)
+- "host-size": size of the host code in bytes (json-int)
+- "translations": number of translations (json-int)
+- "translate-time": time spent translating, in ns (json-int)
+- "exec-count": number of times the block was entered (json-int)
+- "helper-calls": helper calls in the generated code (json-int)
+- "tlb-misses": softmmu TLB misses of the block's accesses (json-int)
+- "unchained-exits": returns to the main loop through an unchained
+                     direct jump (json-int)
+- "icount-exits": returns to the main loop because the instruction
+                  counter expired (json-int)
+
+Example:
+
+-> { "execute": "query-tb-profile",
+     "arguments": { "sort": "exec-count", "limit": 1 } }
+<- { "return": [ { "pc": 3221532736, "cs-base": 0, "flags": 11547,
+                   "symbol": "copy_user_generic", "guest-size": 23,
+                   "host-size": 187, "translations": 1,
+                   "translate-time": 14212, "exec-count": 9825744,
+                   "helper-calls": 0, "tlb-misses": 3811,
+                   "unchained-exits": 0, "icount-exits": 0 } ] }
+
+EQMP
+
+    {
+        .name       = "savevm-start",
+        .args_type  = "name:s?",
+        .mhandler.cmd_new = qmp_marshal_input_savevm_start,
+    },
+
+SQMP
+savevm-start
+------------
+
+Start a live internal snapshot.  RAM is saved while the guest runs; the
+guest is only stopped for the last dirty pages and the device state.
+
+Arguments:
+
+- "name": snapshot tag (json-string, optional)
+
+Example:
+
+-> { "execute": "savevm-start", "arguments": { "name": "before-upgrade" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "savevm-cancel",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_savevm_cancel,
+    },
+
+SQMP
+savevm-cancel
+-------------
+
+Cancel the live snapshot in progress.
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "savevm-cancel" }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-savevm",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_savevm,
+    },
+
+SQMP
+query-savevm
+------------
+
+Show the progress of the last live snapshot.
+
+Return a json-object with the following information; all members are
+absent if no live snapshot has been started:
+
+- "status": "active", "completed", "failed" or "cancelled" (json-string)
+- "name": snapshot tag (json-string)
+- "total-time": time since the start, or total duration, in ms (json-int)
+- "bytes": VM state written so far, in bytes (json-int)
+- "remaining": RAM still to be written, in bytes; only while active
+               (json-int, optional)
+- "error": reason of a failure (json-string, optional)
+
+Example:
+
+-> { "execute": "query-savevm" }
+<- { "return": { "status": "active", "name": "before-upgrade",
+                 "total-time": 12030, "bytes": 1730150400,
+                 "remaining": 38797312 } }
+
+EQMP
+
+    {
+        .name       = "set-thread-sched",
+        .args_type  = "threads:s,cpu-index:i?,host-cpus:s?,policy:s?,priority:i?",
+        .mhandler.cmd_new = qmp_marshal_input_set_thread_sched,
+    },
+
+SQMP
+set-thread-sched
+----------------
+
+Restrict a class of QEMU threads to a set of host CPUs and/or change their
+host scheduling policy.
+
+Arguments:
+
+- "threads": "vcpu", "iothread" or "emulator" (json-string)
+- "cpu-index": with "vcpu", configure only this virtual CPU
+               (json-int, optional)
+- "host-cpus": host CPUs the threads may run on, e.g. "2-5,8"
+               (json-string, optional)
+- "policy": "other", "fifo" or "rr" (json-string, optional)
+- "priority": real-time priority for "fifo" and "rr", 1 to 99
+              (json-int, optional)
+
+Data plane threads that start later get the last settings given for
+"iothread".
+
+Example:
+
+-> { "execute": "set-thread-sched",
+     "arguments": { "threads": "vcpu", "cpu-index": 0, "host-cpus": "4",
+                    "policy": "fifo", "priority": 10 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-thread-sched",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_thread_sched,
+    },
+
+SQMP
+query-thread-sched
+------------------
+
+Show the host scheduling of every QEMU thread.
+
+Each thread is described by:
+
+- "threads": "vcpu", "iothread" or "emulator" (json-string)
+- "cpu-index": virtual CPU of a "vcpu" thread (json-int, optional)
+- "thread-id": host thread ID (json-int)
+- "host-cpus": host CPUs the thread may run on (json-string)
+- "policy": "other", "fifo" or "rr" (json-string)
+- "priority": real-time priority, 0 for "other" (json-int)
+
+Example:
+
+-> { "execute": "query-thread-sched" }
+<- { "return": [ { "threads": "vcpu", "cpu-index": 0, "thread-id": 3135,
+                   "host-cpus": "4", "policy": "fifo", "priority": 10 },
+                 { "threads": "emulator", "thread-id": 3134,
+                   "host-cpus": "0-3", "policy": "other",
+                   "priority": 0 } ] }
+
+EQMP
+
+    {
+        .name       = "set-mlock",
+        .args_type  = "enable:b",
+        .mhandler.cmd_new = qmp_marshal_input_set_mlock,
+    },
+
+SQMP
+set-mlock
+---------
+
+Lock all memory of QEMU, including guest RAM, into host RAM, or unlock it.
+
+Arguments:
+
+- "enable": whether to lock the memory (json-bool)
+
+Example:
+
+-> { "execute": "set-mlock", "arguments": { "enable": true } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "cpu-add",
+        .args_type  = "id:i",
+        .mhandler.cmd_new = qmp_marshal_input_cpu_add,
+    },
+
+SQMP
+cpu-add
+-------
+
+Add a virtual CPU to the running machine.  The guest is notified through
+the ACPI CPU hotplug event of the PIIX4 power management device.
+
+Arguments:
+
+- "id": id of the new CPU, the APIC id on PCs (json-int)
+
+CPUs are added in order, so "id" must be the number of CPUs present, and
+below the maxcpus limit of -smp.  The destination of a later migration must
+be started with the new number of CPUs.
+
+Example:
+
+-> { "execute": "cpu-add", "arguments": { "id": 2 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "memory-add",
+        .args_type  = "memdev:s",
+        .mhandler.cmd_new = qmp_marshal_input_memory_add,
+    },
+
+SQMP
+memory-add
+----------
+
+Map a memory backend, created with -object but not yet used, into the next
+free slot reserved with "-machine maxmem=...,mem-slots=...".  The backend's
+memory is only allocated at this point.  The memory becomes a separate KVM
+memory slot; the guest is notified through the memory hotplug registers of
+the PIIX4 power management device, or can online the memory itself, e.g.
+through /sys/devices/system/memory/probe on Linux.
+
+Arguments:
+
+- "memdev": id of the memory backend, whose size must be a multiple of
+            128 MiB (json-string)
+
+Before an incoming migration, the destination must create the same backends
+and add them in the same order.
+
+Example:
+
+-> { "execute": "memory-add", "arguments": { "memdev": "mem1" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-memory-slots",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_memory_slots,
+    },
+
+SQMP
+query-memory-slots
+------------------
+
+Show the memory hotplug slots.
+
+Each slot is described by:
+
+- "slot": index of the slot (json-int)
+- "addr": guest physical address, 0 if the slot is empty (json-int)
+- "size": size in bytes, 0 if the slot is empty (json-int)
+- "memdev": id of the memory backend (json-string, optional)
+
+Example:
+
+-> { "execute": "query-memory-slots" }
+<- { "return": [ { "slot": 0, "addr": 4294967296, "size": 1073741824,
+                   "memdev": "mem1" },
+                 { "slot": 1, "addr": 0, "size": 0 } ] }
+
+EQMP
+
+    {
+        .name       = "query-ram-blocks",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_ram_blocks,
+    },
+
+SQMP
+query-ram-blocks
+----------------
+
+Show how the guest RAM blocks are laid out and advised in host memory.
+
+Each RAM block is described by:
+
+- "name": name of the block (json-string)
+- "size": size in bytes (json-int)
+- "align": alignment in host memory, at most 1 GiB (json-int)
+- "merge": whether the block is offered to KSM (json-bool)
+- "hugepage": whether the block is advised to use transparent hugepages
+              (json-bool)
+- "thp-size": bytes currently backed by transparent hugepages (json-int)
+
+Example:
+
+-> { "execute": "query-ram-blocks" }
+<- { "return": [ { "name": "pc.ram", "size": 4294967296,
+                   "align": 1073741824, "merge": false, "hugepage": true,
+                   "thp-size": 4114612224 },
+                 { "name": "pc.bios", "size": 131072, "align": 4096,
+                   "merge": true, "hugepage": true, "thp-size": 0 } ] }
+
+EQMP
+
+    {
+        .name       = "query-startup",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_startup,
+    },
+
+SQMP
+query-startup
+-------------
+
+Show how long each initialization phase of QEMU took, and when the guest
+started running.
+
+Return a json-object with:
+
+- "phases": json-array of the phases in the order they ran, each with
+    - "name": name of the phase (json-string)
+    - "duration-ns": duration in nanoseconds (json-int)
+- "first-insn-ns": nanoseconds from the start of QEMU until a vCPU first
+                   entered guest code (json-int, optional)
+
+Example:
+
+-> { "execute": "query-startup" }
+<- { "return": { "phases": [ { "name": "qom-types", "duration-ns": 412000 },
+                             { "name": "options", "duration-ns": 1893000 },
+                             { "name": "accelerator", "duration-ns": 6120000 },
+                             { "name": "machine", "duration-ns": 9034000 },
+                             { "name": "devices", "duration-ns": 1002000 },
+                             { "name": "displays", "duration-ns": 51000 },
+                             { "name": "roms", "duration-ns": 398000 },
+                             { "name": "reset", "duration-ns": 120000 },
+                             { "name": "vm-start", "duration-ns": 85000 } ],
+                 "first-insn-ns": 19410000 } }
+
+EQMP
+
+    {
+        .name       = "block-latency-histogram-set",
+        .args_type  = "device:B,boundaries:s?,boundaries-read:s?,"
+                      "boundaries-write:s?,boundaries-flush:s?",
+        .mhandler.cmd_new = qmp_marshal_input_block_latency_histogram_set,
+    },
+
+SQMP
+block-latency-histogram-set
+---------------------------
+
+Set the bin boundaries of the latency histograms that query-blockstats
+reports for a device, and reset their counts.
+
+Arguments:
+
+- "device": the device name (json-string)
+- "boundaries": colon-separated boundaries in nanoseconds for all request
+                types, increasing (json-string, optional)
+- "boundaries-read": boundaries for reads (json-string, optional)
+- "boundaries-write": boundaries for writes (json-string, optional)
+- "boundaries-flush": boundaries for flushes (json-string, optional)
+
+An empty string disables a histogram.  Without any boundaries, all
+histograms go back to the defaults of 10us, 100us, 1ms, 10ms, 100ms, 1s
+and 10s.
+
+Example:
+
+-> { "execute": "block-latency-histogram-set",
+     "arguments": { "device": "virtio0",
+                    "boundaries": "100000:1000000:10000000",
+                    "boundaries-flush": "" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-virtio-counters",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_virtio_counters,
+    },
+
+SQMP
+query-virtio-counters
+---------------------
+
+Return the performance counters of each virtqueue of each virtio device.
+The counters start at zero when the device is created and are never reset.
+
+The return value is a json-array with one json-object per device:
+
+- "name": the virtio device type (json-string)
+- "id": the device id (json-string, optional)
+- "path": the QOM path of the device (json-string, optional)
+- "queues": a json-array of json-objects, one per configured queue:
+  - "index": queue index (json-int)
+  - "notifications": guest kicks (json-int)
+  - "interrupts": interrupts injected (json-int)
+  - "suppressed-interrupts": interrupts the guest asked not to get (json-int)
+  - "popped": requests taken from the ring (json-int)
+  - "ring-full": times no guest buffer was available (json-int)
+  - "batches": times the queue was processed (json-int)
+  - "batched": requests processed in batches (json-int)
+  - "batch-max": largest batch (json-int)
+  - "batch-limited": batches that hit the device limit (json-int)
+  - "batch-empty": batches with no request (json-int)
+
+Example:
+
+-> { "execute": "query-virtio-counters" }
+<- { "return": [
+       { "name": "virtio-blk", "id": "disk0",
+         "path": "/machine/peripheral/disk0",
+         "queues": [
+           { "index": 0, "notifications": 5120, "interrupts": 4800,
+             "suppressed-interrupts": 310, "popped": 9731,
+             "ring-full": 0, "batches": 5120, "batched": 9731,
+             "batch-max": 32, "batch-limited": 0, "batch-empty": 12 } ] } ] }
+
+EQMP
+
+    {
+        .name       = "query-net-counters",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_net_counters,
+    },
+
+SQMP
+query-net-counters
+------------------
+
+Return the packet counters of each network client, front ends and back
+ends alike.  The counters start at zero when the client is created.
+
+The return value is a json-array with one json-object per client:
+
+- "name": client name (json-string)
+- "model": client type (json-string)
+- "queue-index": queue of a multiqueue client (json-int)
+- "rx-packets", "rx-bytes": packets and bytes received (json-int)
+- "rx-blocked": times a packet had to be queued for the client (json-int)
+- "rx-dropped": packets dropped because the link was down (json-int)
+- "tx-packets", "tx-bytes": packets and bytes sent (json-int)
+- "tx-dropped": packets dropped for lack of a peer or link (json-int)
+
+Example:
+
+-> { "execute": "query-net-counters" }
+<- { "return": [
+       { "name": "net0", "model": "virtio-net-pci", "queue-index": 0,
+         "rx-packets": 1043, "rx-bytes": 1409223, "rx-blocked": 2,
+         "rx-dropped": 0, "tx-packets": 883, "tx-bytes": 90511,
+         "tx-dropped": 0 },
+       { "name": "hostnet0", "model": "tap", "queue-index": 0,
+         "rx-packets": 883, "rx-bytes": 90511, "rx-blocked": 0,
+         "rx-dropped": 0, "tx-packets": 1043, "tx-bytes": 1409223,
+         "tx-dropped": 0 } ] }
+
+EQMP
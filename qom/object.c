@@ -26,6 +26,9 @@
 
 #define MAX_INTERFACES 32
 
+/* Most recent results of object_resolve_path_type() for partial paths */
+#define PATH_CACHE_MAX 1024
+
 typedef struct InterfaceImpl InterfaceImpl;
 typedef struct TypeImpl TypeImpl;
 
@@ -85,7 +88,7 @@ static TypeImpl *type_table_lookup(const char *name)
     return g_hash_table_lookup(type_table_get(), name);
 }
 
-static TypeImpl *type_register_internal(const TypeInfo *info)
+static TypeImpl *type_register_internal(const TypeInfo *info, bool is_static)
 {
     TypeImpl *ti = g_malloc0(sizeof(*ti));
     int i;
@@ -97,7 +100,10 @@ static TypeImpl *type_register_internal(const TypeInfo *info)
         abort();
     }
 
-    ti->name = g_strdup(info->name);
+    /* Keep the caller's string for static types, so that a cast with the
+     * same TYPE_* literal matches by pointer in object_class_dynamic_cast.
+     */
+    ti->name = is_static ? info->name : g_strdup(info->name);
     ti->parent = g_strdup(info->parent);
 
     ti->class_size = info->class_size;
@@ -126,12 +132,13 @@ static TypeImpl *type_register_internal(const TypeInfo *info)
 TypeImpl *type_register(const TypeInfo *info)
 {
     assert(info->parent);
-    return type_register_internal(info);
+    return type_register_internal(info, false);
 }
 
 TypeImpl *type_register_static(const TypeInfo *info)
 {
-    return type_register(info);
+    assert(info->parent);
+    return type_register_internal(info, true);
 }
 
 static TypeImpl *type_get_by_name(const char *name)
@@ -244,6 +251,7 @@ static void type_initialize(TypeImpl *ti)
 
         g_assert(parent->class_size <= ti->class_size);
         memcpy(ti->class, parent->class, parent->class_size);
+        memset(ti->class->cast_cache, 0, sizeof(ti->class->cast_cache));
 
         for (e = parent->class->interfaces; e; e = e->next) {
             ObjectClass *iface = e->data;
@@ -329,39 +337,63 @@ static inline bool object_property_is_link(ObjectProperty *prop)
     return strstart(prop->type, "link<", NULL);
 }
 
-static void object_property_del_all(Object *obj)
+/*
+ * Partial path resolution searches the whole composition tree, so its
+ * results are cached until a child<> or link<> property changes anywhere.
+ * Only objects found through child<> properties alone are cached, because
+ * link<> targets may also be changed without going through the property.
+ */
+static GHashTable *path_cache;
+
+static void path_cache_invalidate(void)
 {
-    while (!QTAILQ_EMPTY(&obj->properties)) {
-        ObjectProperty *prop = QTAILQ_FIRST(&obj->properties);
+    if (path_cache) {
+        g_hash_table_remove_all(path_cache);
+    }
+}
 
-        QTAILQ_REMOVE(&obj->properties, prop, node);
+static void path_cache_invalidate_for(ObjectProperty *prop)
+{
+    if (object_property_is_child(prop) || object_property_is_link(prop)) {
+        path_cache_invalidate();
+    }
+}
 
-        if (prop->release) {
-            prop->release(obj, prop->name, prop->opaque);
-        }
+static void object_property_remove(Object *obj, ObjectProperty *prop)
+{
+    QTAILQ_REMOVE(&obj->properties, prop, node);
+    g_hash_table_remove(obj->property_table, prop->name);
+    path_cache_invalidate_for(prop);
+
+    if (object_property_is_child(prop)) {
+        Object *child = prop->opaque;
+        child->parent_prop = NULL;
+    }
 
-        g_free(prop->name);
-        g_free(prop->type);
-        g_free(prop);
+    if (prop->release) {
+        prop->release(obj, prop->name, prop->opaque);
     }
+
+    g_free(prop->name);
+    g_free(prop->type);
+    g_free(prop);
 }
 
-static void object_property_del_child(Object *obj, Object *child, Error **errp)
+static void object_property_del_all(Object *obj)
 {
-    ObjectProperty *prop;
-
-    QTAILQ_FOREACH(prop, &obj->properties, node) {
-        if (object_property_is_child(prop) && prop->opaque == child) {
-            object_property_del(obj, prop->name, errp);
-            break;
-        }
+    while (!QTAILQ_EMPTY(&obj->properties)) {
+        object_property_remove(obj, QTAILQ_FIRST(&obj->properties));
+    }
+    if (obj->property_table) {
+        g_hash_table_destroy(obj->property_table);
+        obj->property_table = NULL;
     }
 }
 
 void object_unparent(Object *obj)
 {
-    if (obj->parent) {
-        object_property_del_child(obj->parent, obj, NULL);
+    if (obj->parent && obj->parent_prop) {
+        object_property_remove(obj->parent, obj->parent_prop);
     }
     if (obj->class->unparent) {
         (obj->class->unparent)(obj);
@@ -432,6 +464,7 @@ Object *object_dynamic_cast(Object *obj, const char *typename)
 
 Object *object_dynamic_cast_assert(Object *obj, const char *typename)
 {
+#ifdef CONFIG_QOM_CAST_DEBUG
     Object *inst;
 
     inst = object_dynamic_cast(obj, typename);
@@ -443,15 +476,53 @@ Object *object_dynamic_cast_assert(Object *obj, const char *typename)
     }
 
     return inst;
+#else
+    /* Casting an object never changes the pointer, so without the check
+     * there is nothing left to do.
+     */
+    return obj;
+#endif
+}
+
+static bool object_class_cast_cached(ObjectClass *class, const char *typename)
+{
+    int i;
+
+    for (i = 0; i < OBJECT_CLASS_CAST_CACHE; i++) {
+        if (class->cast_cache[i] == typename) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Racing updates from several threads may lose or duplicate an entry, but
+ * every entry they can leave behind is a type the class really casts to.
+ */
+static void object_class_cast_cache_add(ObjectClass *class,
+                                        const char *typename)
+{
+    int i;
+
+    for (i = OBJECT_CLASS_CAST_CACHE - 1; i > 0; i--) {
+        class->cast_cache[i] = class->cast_cache[i - 1];
+    }
+    class->cast_cache[0] = typename;
 }
 
 ObjectClass *object_class_dynamic_cast(ObjectClass *class,
                                        const char *typename)
 {
-    TypeImpl *target_type = type_get_by_name(typename);
+    TypeImpl *target_type;
     TypeImpl *type = class->type;
     ObjectClass *ret = NULL;
 
+    if (type->name == typename || object_class_cast_cached(class, typename)) {
+        return class;
+    }
+
+    target_type = type_get_by_name(typename);
+
     if (type->num_interfaces && type_is_ancestor(target_type, type_interface)) {
         int found = 0;
         GSList *i;
@@ -471,6 +542,10 @@ ObjectClass *object_class_dynamic_cast(ObjectClass *class,
         }
     } else if (type_is_ancestor(type, target_type)) {
         ret = class;
+        /* Only casts that return the class itself can be cached; casts to
+         * an interface return the interface class.
+         */
+        object_class_cast_cache_add(class, typename);
     }
 
     return ret;
@@ -479,7 +554,15 @@ ObjectClass *object_class_dynamic_cast(ObjectClass *class,
 ObjectClass *object_class_dynamic_cast_assert(ObjectClass *class,
                                               const char *typename)
 {
-    ObjectClass *ret = object_class_dynamic_cast(class, typename);
+    ObjectClass *ret;
+
+#ifndef CONFIG_QOM_CAST_DEBUG
+    if (!class->interfaces) {
+        return class;
+    }
+#endif
+
+    ret = object_class_dynamic_cast(class, typename);
 
     if (!ret) {
         fprintf(stderr, "Object %p is not an instance of type %s\n",
@@ -626,8 +709,16 @@ void object_property_add(Object *obj, const char *name, const char *type,
                          ObjectPropertyRelease *release,
                          void *opaque, Error **errp)
 {
-    ObjectProperty *prop = g_malloc0(sizeof(*prop));
+    ObjectProperty *prop;
 
+    if (!obj->property_table) {
+        obj->property_table = g_hash_table_new(g_str_hash, g_str_equal);
+    } else if (g_hash_table_lookup(obj->property_table, name)) {
+        error_set(errp, QERR_DUPLICATE_ID, name, "property");
+        return;
+    }
+
+    prop = g_malloc0(sizeof(*prop));
     prop->name = g_strdup(name);
     prop->type = g_strdup(type);
 
@@ -636,22 +727,24 @@ void object_property_add(Object *obj, const char *name, const char *type,
     prop->release = release;
     prop->opaque = opaque;
 
+    /* The list keeps the order in which properties were added */
     QTAILQ_INSERT_TAIL(&obj->properties, prop, node);
+    g_hash_table_insert(obj->property_table, prop->name, prop);
+    path_cache_invalidate_for(prop);
 }
 
 ObjectProperty *object_property_find(Object *obj, const char *name,
                                      Error **errp)
 {
-    ObjectProperty *prop;
+    ObjectProperty *prop = NULL;
 
-    QTAILQ_FOREACH(prop, &obj->properties, node) {
-        if (strcmp(prop->name, name) == 0) {
-            return prop;
-        }
+    if (obj->property_table) {
+        prop = g_hash_table_lookup(obj->property_table, name);
     }
-
-    error_set(errp, QERR_PROPERTY_NOT_FOUND, "", name);
-    return NULL;
+    if (!prop) {
+        error_set(errp, QERR_PROPERTY_NOT_FOUND, "", name);
+    }
+    return prop;
 }
 
 void object_property_del(Object *obj, const char *name, Error **errp)
@@ -661,15 +754,7 @@ void object_property_del(Object *obj, const char *name, Error **errp)
         return;
     }
 
-    if (prop->release) {
-        prop->release(obj, name, prop->opaque);
-    }
-
-    QTAILQ_REMOVE(&obj->properties, prop, node);
-
-    g_free(prop->name);
-    g_free(prop->type);
-    g_free(prop);
+    object_property_remove(obj, prop);
 }
 
 void object_property_get(Object *obj, Visitor *v, const char *name,
@@ -885,18 +970,24 @@ static void object_finalize_child_property(Object *obj, const char *name,
 void object_property_add_child(Object *obj, const char *name,
                                Object *child, Error **errp)
 {
+    Error *local_err = NULL;
     gchar *type;
 
     type = g_strdup_printf("child<%s>", object_get_typename(OBJECT(child)));
 
     object_property_add(obj, name, type, object_get_child_property,
-                        NULL, object_finalize_child_property, child, errp);
+                        NULL, object_finalize_child_property, child,
+                        &local_err);
+    g_free(type);
+    if (error_is_set(&local_err)) {
+        error_propagate(errp, local_err);
+        return;
+    }
 
     object_ref(child);
     g_assert(child->parent == NULL);
     child->parent = obj;
-
-    g_free(type);
+    child->parent_prop = object_property_find(obj, name, NULL);
 }
 
 static void object_get_link_property(Object *obj, Visitor *v, void *opaque,
@@ -957,6 +1048,9 @@ static void object_set_link_property(Object *obj, Visitor *v, void *opaque,
 
     g_free(path);
 
+    if (*child != old_target) {
+        path_cache_invalidate();
+    }
     if (old_target != NULL) {
         object_unref(old_target);
     }
@@ -984,29 +1078,19 @@ gchar *object_get_canonical_path(Object *obj)
     char *newpath = NULL, *path = NULL;
 
     while (obj != root) {
-        ObjectProperty *prop = NULL;
+        ObjectProperty *prop = obj->parent_prop;
 
         g_assert(obj->parent != NULL);
+        g_assert(prop != NULL);
 
-        QTAILQ_FOREACH(prop, &obj->parent->properties, node) {
-            if (!object_property_is_child(prop)) {
-                continue;
-            }
-
-            if (prop->opaque == obj) {
-                if (path) {
-                    newpath = g_strdup_printf("%s/%s", prop->name, path);
-                    g_free(path);
-                    path = newpath;
-                } else {
-                    path = g_strdup(prop->name);
-                }
-                break;
-            }
+        if (path) {
+            newpath = g_strdup_printf("%s/%s", prop->name, path);
+            g_free(path);
+            path = newpath;
+        } else {
+            path = g_strdup(prop->name);
         }
 
-        g_assert(prop != NULL);
-
         obj = obj->parent;
     }
 
@@ -1092,6 +1176,23 @@ static Object *object_resolve_partial_path(Object *parent,
     return obj;
 }
 
+/* Whether obj is reached from its ancestors through child<> parts alone */
+static bool object_path_is_children(Object *obj, gchar **parts)
+{
+    int i = g_strv_length(parts);
+
+    while (i-- > 0) {
+        if (strcmp(parts[i], "") == 0) {
+            continue;
+        }
+        if (!obj->parent_prop || strcmp(obj->parent_prop->name, parts[i])) {
+            return false;
+        }
+        obj = obj->parent;
+    }
+    return true;
+}
+
 Object *object_resolve_path_type(const char *path, const char *typename,
                                  bool *ambiguous)
 {
@@ -1110,11 +1211,32 @@ Object *object_resolve_path_type(const char *path, const char *typename,
     }
 
     if (partial_path) {
+        gchar *key;
+
         if (ambiguous) {
             *ambiguous = false;
         }
-        obj = object_resolve_partial_path(object_get_root(), parts,
-                                          typename, ambiguous);
+        if (!path_cache) {
+            path_cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                               g_free, NULL);
+        }
+
+        key = g_strdup_printf("%s:%s", typename, path);
+        obj = g_hash_table_lookup(path_cache, key);
+        if (obj) {
+            g_free(key);
+        } else {
+            obj = object_resolve_partial_path(object_get_root(), parts,
+                                              typename, ambiguous);
+            if (obj && object_path_is_children(obj, parts)) {
+                if (g_hash_table_size(path_cache) >= PATH_CACHE_MAX) {
+                    path_cache_invalidate();
+                }
+                g_hash_table_insert(path_cache, key, obj);
+            } else {
+                g_free(key);
+            }
+        }
     } else {
         obj = object_resolve_abs_path(object_get_root(), parts, typename, 1);
     }
@@ -1270,8 +1392,8 @@ static void register_types(void)
         .abstract = true,
     };
 
-    type_interface = type_register_internal(&interface_info);
-    type_register_internal(&object_info);
+    type_interface = type_register_internal(&interface_info, true);
+    type_register_internal(&object_info, true);
 }
 
 type_init(register_types)
@@ -87,6 +87,13 @@
 #include "qmp-commands.h"
 #include "trace.h"
 #include "bitops.h"
+#include "qemu-thread.h"
+#include "qemu-error.h"
+#include "host-utils.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define SELF_ANNOUNCE_ROUNDS 5
 
@@ -129,7 +136,7 @@ static void qemu_announce_self_iter(NICState *nic, void *opaque)
 
     len = announce_self_create(buf, nic->conf->macaddr.a);
 
-    qemu_send_packet_raw(&nic->nc, buf, len);
+    qemu_send_packet_raw(qemu_get_queue(nic), buf, len);
 }
 
 
@@ -161,6 +168,7 @@ void qemu_announce_self(void)
 /* savevm/loadvm support */
 
 #define IO_BUF_SIZE 32768
+#define MAX_IOV_SIZE MIN(IOV_MAX, 64)
 
 struct QEMUFile {
     const QEMUFileOps *ops;
@@ -173,6 +181,9 @@ struct QEMUFile {
     int buf_size; /* 0 when writing */
     uint8_t buf[IO_BUF_SIZE];
 
+    struct iovec iov[MAX_IOV_SIZE];
+    unsigned int iovcnt;
+
     int last_error;
 };
 
@@ -447,6 +458,55 @@ static QEMUFile *qemu_fopen_bdrv(BlockDriverState *bs, int is_writable)
     return qemu_fopen_ops(bs, &bdrv_read_ops);
 }
 
+/* In-memory QEMUFile, used to pass the device state at postcopy switch */
+typedef struct QEMUFileBuffer
+{
+    uint8_t *data;
+    size_t size;
+} QEMUFileBuffer;
+
+static int buf_put_buffer(void *opaque, const uint8_t *buf,
+                          int64_t pos, int size)
+{
+    QEMUFileBuffer *s = opaque;
+
+    s->data = g_realloc(s->data, s->size + size);
+    memcpy(s->data + s->size, buf, size);
+    s->size += size;
+    return size;
+}
+
+static int buf_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
+{
+    QEMUFileBuffer *s = opaque;
+
+    if (pos >= s->size) {
+        return 0;
+    }
+    size = MIN(size, s->size - pos);
+    memcpy(buf, s->data + pos, size);
+    return size;
+}
+
+static int buf_close(void *opaque)
+{
+    QEMUFileBuffer *s = opaque;
+
+    g_free(s->data);
+    g_free(s);
+    return 0;
+}
+
+static const QEMUFileOps buf_read_ops = {
+    .get_buffer = buf_get_buffer,
+    .close =      buf_close
+};
+
+static const QEMUFileOps buf_write_ops = {
+    .put_buffer = buf_put_buffer,
+    .close =      buf_close
+};
+
 QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops)
 {
     QEMUFile *f;
@@ -473,14 +533,27 @@ static void qemu_file_set_error(QEMUFile *f, int ret)
 /** Flushes QEMUFile buffer
  *
  */
-static int qemu_fflush(QEMUFile *f)
+int qemu_fflush(QEMUFile *f)
 {
     int ret = 0;
 
-    if (!f->ops->put_buffer)
+    if (!f->ops->put_buffer && !f->ops->writev_buffer) {
         return 0;
+    }
 
-    if (f->is_write && f->buf_index > 0) {
+    if (f->is_write && f->ops->writev_buffer) {
+        if (f->iovcnt > 0) {
+            ssize_t len = f->ops->writev_buffer(f->opaque, f->iov, f->iovcnt,
+                                                f->buf_offset);
+            if (len >= 0) {
+                f->buf_offset += len;
+            } else {
+                ret = len;
+            }
+        }
+        f->buf_index = 0;
+        f->iovcnt = 0;
+    } else if (f->is_write && f->buf_index > 0) {
         ret = f->ops->put_buffer(f->opaque, f->buf, f->buf_offset, f->buf_index);
         if (ret >= 0) {
             f->buf_offset += f->buf_index;
@@ -490,6 +563,27 @@ static int qemu_fflush(QEMUFile *f)
     return ret;
 }
 
+/* Queue data for a writev_buffer backend, merging with the previous entry
+ * when contiguous.  Flushes when the iovec is full.
+ */
+static void add_to_iovec(QEMUFile *f, const uint8_t *buf, int size)
+{
+    if (f->iovcnt > 0 && buf == f->iov[f->iovcnt - 1].iov_base +
+        f->iov[f->iovcnt - 1].iov_len) {
+        f->iov[f->iovcnt - 1].iov_len += size;
+    } else {
+        f->iov[f->iovcnt].iov_base = (uint8_t *)buf;
+        f->iov[f->iovcnt++].iov_len = size;
+    }
+
+    if (f->iovcnt >= MAX_IOV_SIZE) {
+        int ret = qemu_fflush(f);
+        if (ret < 0) {
+            qemu_file_set_error(f, ret);
+        }
+    }
+}
+
 static void qemu_fill_buffer(QEMUFile *f)
 {
     int len;
@@ -556,11 +650,6 @@ int qemu_fclose(QEMUFile *f)
     return ret;
 }
 
-int qemu_file_put_notify(QEMUFile *f)
-{
-    return f->ops->put_buffer(f->opaque, NULL, 0, 0);
-}
-
 void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
 {
     int l;
@@ -576,12 +665,20 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
     }
 
     while (size > 0) {
+        uint8_t *p = f->buf + f->buf_index;
+
         l = IO_BUF_SIZE - f->buf_index;
         if (l > size)
             l = size;
-        memcpy(f->buf + f->buf_index, buf, l);
+        memcpy(p, buf, l);
         f->is_write = 1;
         f->buf_index += l;
+        if (f->ops->writev_buffer) {
+            add_to_iovec(f, p, l);
+            if (f->last_error) {
+                break;
+            }
+        }
         buf += l;
         size -= l;
         if (f->buf_index >= IO_BUF_SIZE) {
@@ -594,6 +691,73 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
     }
 }
 
+/*
+ * Like qemu_put_buffer(), but with a writev_buffer backend the data is
+ * referenced instead of copied.  It must stay valid and unchanged until
+ * the next qemu_fflush(); data that may still change is simply resent
+ * by the caller (e.g. dirty RAM pages).
+ */
+void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, int size)
+{
+    if (!f->ops->writev_buffer) {
+        qemu_put_buffer(f, buf, size);
+        return;
+    }
+
+    if (f->last_error) {
+        return;
+    }
+
+    if (f->is_write == 0 && f->buf_index > 0) {
+        fprintf(stderr,
+                "Attempted to write to buffer while read buffer is not empty\n");
+        abort();
+    }
+
+    f->is_write = 1;
+    add_to_iovec(f, buf, size);
+}
+
+void ram_control_before_iterate(QEMUFile *f, uint64_t flags)
+{
+    int ret;
+
+    if (f->ops->before_ram_iterate) {
+        ret = f->ops->before_ram_iterate(f->opaque, flags);
+        if (ret < 0) {
+            qemu_file_set_error(f, ret);
+        }
+    }
+}
+
+void ram_control_after_iterate(QEMUFile *f, uint64_t flags)
+{
+    int ret;
+
+    if (f->ops->after_ram_iterate) {
+        ret = f->ops->after_ram_iterate(f->opaque, flags);
+        if (ret < 0) {
+            qemu_file_set_error(f, ret);
+        }
+    }
+}
+
+int ram_control_save_page(QEMUFile *f, uint64_t block_offset,
+                          uint64_t offset, size_t size)
+{
+    int ret;
+
+    if (!f->ops->save_page || f->last_error) {
+        return -ENOTSUP;
+    }
+
+    ret = f->ops->save_page(f->opaque, block_offset, offset, size);
+    if (ret < 0 && ret != -ENOTSUP) {
+        qemu_file_set_error(f, ret);
+    }
+    return ret;
+}
+
 void qemu_put_byte(QEMUFile *f, int v)
 {
     if (f->last_error) {
@@ -608,6 +772,9 @@ void qemu_put_byte(QEMUFile *f, int v)
 
     f->buf[f->buf_index++] = v;
     f->is_write = 1;
+    if (f->ops->writev_buffer) {
+        add_to_iovec(f, f->buf + f->buf_index - 1, 1);
+    }
     if (f->buf_index >= IO_BUF_SIZE) {
         int ret = qemu_fflush(f);
         if (ret < 0) {
@@ -1428,10 +1595,248 @@ static void vmstate_subsection_save(QEMUFile *f, const VMStateDescription *vmsd,
 static int vmstate_subsection_load(QEMUFile *f, const VMStateDescription *vmsd,
                                    void *opaque);
 
+/* Flat descriptions
+ *
+ * Most descriptions are a list of fixed-size integers and buffers, maybe
+ * inside nested structs without hooks of their own.  Their fields are
+ * compiled once into a table of copies, and moved through one buffer
+ * instead of one interpreted get/put call per element.  The hooks and
+ * subsections of the outer description still run as usual.
+ */
+
+enum {
+    VMSTATE_FAST_U8,
+    VMSTATE_FAST_BOOL,
+    VMSTATE_FAST_BE16,
+    VMSTATE_FAST_BE32,
+    VMSTATE_FAST_BE64,
+    VMSTATE_FAST_BUFFER,
+    VMSTATE_FAST_UNUSED,
+};
+
+#define VMSTATE_FAST_MAX_OPS  64
+#define VMSTATE_FAST_MAX_SIZE 4096
+
+typedef struct VMStateFastOp {
+    uint32_t kind;
+    uint32_t offset;
+    uint32_t size;      /* of an element, both in memory and in the stream */
+    uint32_t count;
+} VMStateFastOp;
+
+typedef struct VMStateFastPlan {
+    int nops;
+    size_t stream_size;
+    VMStateFastOp ops[];
+} VMStateFastPlan;
+
+/* Maps descriptions to their plan, or to vmstate_not_flat.  The postcopy
+   listen thread loads without the iothread lock, hence the mutex.  */
+static GHashTable *vmstate_fast_plans;
+static QemuMutex vmstate_fast_lock;
+static VMStateFastPlan vmstate_not_flat;
+
+static int vmstate_fast_kind(const VMStateInfo *info, size_t size)
+{
+    if (info == &vmstate_info_buffer) {
+        return VMSTATE_FAST_BUFFER;
+    } else if (info == &vmstate_info_unused_buffer) {
+        return VMSTATE_FAST_UNUSED;
+    } else if (info == &vmstate_info_bool) {
+        return size == sizeof(bool) ? VMSTATE_FAST_BOOL : -1;
+    } else if (info == &vmstate_info_uint8 || info == &vmstate_info_int8) {
+        return size == 1 ? VMSTATE_FAST_U8 : -1;
+    } else if (info == &vmstate_info_uint16 || info == &vmstate_info_int16) {
+        return size == 2 ? VMSTATE_FAST_BE16 : -1;
+    } else if (info == &vmstate_info_uint32 || info == &vmstate_info_int32) {
+        return size == 4 ? VMSTATE_FAST_BE32 : -1;
+    } else if (info == &vmstate_info_uint64 || info == &vmstate_info_int64) {
+        return size == 8 ? VMSTATE_FAST_BE64 : -1;
+    }
+    return -1;
+}
+
+static bool vmstate_fast_compile(const VMStateDescription *vmsd, size_t base,
+                                 VMStateFastOp *ops, int *nops,
+                                 size_t *stream_size)
+{
+    VMStateField *field;
+
+    for (field = vmsd->fields; field->name; field++) {
+        int i, kind, n_elems = 1;
+        VMStateFastOp *op;
+
+        if (field->field_exists || field->version_id > vmsd->version_id ||
+            (field->flags & ~(VMS_SINGLE | VMS_ARRAY | VMS_BUFFER |
+                              VMS_STRUCT))) {
+            return false;
+        }
+        if (field->flags & VMS_ARRAY) {
+            n_elems = field->num;
+        }
+        if (field->flags & VMS_STRUCT) {
+            const VMStateDescription *sub = field->vmsd;
+
+            if (sub->pre_load || sub->post_load || sub->pre_save ||
+                sub->subsections || sub->version_id < sub->minimum_version_id) {
+                return false;
+            }
+            for (i = 0; i < n_elems; i++) {
+                if (!vmstate_fast_compile(sub,
+                                          base + field->offset + field->size * i,
+                                          ops, nops, stream_size)) {
+                    return false;
+                }
+            }
+            continue;
+        }
+
+        kind = vmstate_fast_kind(field->info, field->size);
+        if (kind < 0 || *nops == VMSTATE_FAST_MAX_OPS) {
+            return false;
+        }
+        op = &ops[(*nops)++];
+        op->kind = kind;
+        op->offset = base + field->offset;
+        op->size = field->size;
+        op->count = n_elems;
+        *stream_size += field->size * n_elems;
+        if (*stream_size > VMSTATE_FAST_MAX_SIZE) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Return the plan of @vmsd, or NULL if it is not flat */
+static const VMStateFastPlan *vmstate_fast_plan(const VMStateDescription *vmsd)
+{
+    VMStateFastOp ops[VMSTATE_FAST_MAX_OPS];
+    VMStateFastPlan *plan;
+    size_t stream_size = 0;
+    int nops = 0;
+
+    qemu_mutex_lock(&vmstate_fast_lock);
+    if (!vmstate_fast_plans) {
+        vmstate_fast_plans = g_hash_table_new(NULL, NULL);
+    }
+    plan = g_hash_table_lookup(vmstate_fast_plans, vmsd);
+    if (!plan) {
+        if (vmstate_fast_compile(vmsd, 0, ops, &nops, &stream_size)) {
+            plan = g_malloc(sizeof(*plan) + nops * sizeof(ops[0]));
+            plan->nops = nops;
+            plan->stream_size = stream_size;
+            memcpy(plan->ops, ops, nops * sizeof(ops[0]));
+        } else {
+            plan = &vmstate_not_flat;
+        }
+        g_hash_table_insert(vmstate_fast_plans, (gpointer)vmsd, plan);
+    }
+    qemu_mutex_unlock(&vmstate_fast_lock);
+
+    return plan == &vmstate_not_flat ? NULL : plan;
+}
+
+static int vmstate_fast_load(QEMUFile *f, const VMStateFastPlan *plan,
+                             void *opaque)
+{
+    uint8_t buf[VMSTATE_FAST_MAX_SIZE];
+    const uint8_t *p = buf;
+    int i, j;
+
+    if (qemu_get_buffer(f, buf, plan->stream_size) != plan->stream_size) {
+        return -EIO;
+    }
+    for (i = 0; i < plan->nops; i++) {
+        const VMStateFastOp *op = &plan->ops[i];
+        void *addr = opaque + op->offset;
+
+        switch (op->kind) {
+        case VMSTATE_FAST_U8:
+        case VMSTATE_FAST_BUFFER:
+            memcpy(addr, p, op->size * op->count);
+            break;
+        case VMSTATE_FAST_BOOL:
+            for (j = 0; j < op->count; j++) {
+                ((bool *)addr)[j] = p[j];
+            }
+            break;
+        case VMSTATE_FAST_BE16:
+            for (j = 0; j < op->count; j++) {
+                ((uint16_t *)addr)[j] = lduw_be_p(p + j * 2);
+            }
+            break;
+        case VMSTATE_FAST_BE32:
+            for (j = 0; j < op->count; j++) {
+                ((uint32_t *)addr)[j] = ldl_be_p(p + j * 4);
+            }
+            break;
+        case VMSTATE_FAST_BE64:
+            for (j = 0; j < op->count; j++) {
+                ((uint64_t *)addr)[j] = ldq_be_p(p + j * 8);
+            }
+            break;
+        }
+        p += op->size * op->count;
+    }
+    return 0;
+}
+
+static void vmstate_fast_save(QEMUFile *f, const VMStateFastPlan *plan,
+                              void *opaque)
+{
+    uint8_t buf[VMSTATE_FAST_MAX_SIZE];
+    uint8_t *p = buf;
+    int i, j;
+
+    for (i = 0; i < plan->nops; i++) {
+        const VMStateFastOp *op = &plan->ops[i];
+        void *addr = opaque + op->offset;
+
+        switch (op->kind) {
+        case VMSTATE_FAST_U8:
+        case VMSTATE_FAST_BUFFER:
+            memcpy(p, addr, op->size * op->count);
+            break;
+        case VMSTATE_FAST_UNUSED:
+            memset(p, 0, op->size * op->count);
+            break;
+        case VMSTATE_FAST_BOOL:
+            for (j = 0; j < op->count; j++) {
+                p[j] = ((bool *)addr)[j];
+            }
+            break;
+        case VMSTATE_FAST_BE16:
+            for (j = 0; j < op->count; j++) {
+                stw_be_p(p + j * 2, ((uint16_t *)addr)[j]);
+            }
+            break;
+        case VMSTATE_FAST_BE32:
+            for (j = 0; j < op->count; j++) {
+                stl_be_p(p + j * 4, ((uint32_t *)addr)[j]);
+            }
+            break;
+        case VMSTATE_FAST_BE64:
+            for (j = 0; j < op->count; j++) {
+                stq_be_p(p + j * 8, ((uint64_t *)addr)[j]);
+            }
+            break;
+        }
+        p += op->size * op->count;
+    }
+    qemu_put_buffer(f, buf, plan->stream_size);
+}
+
+static void __attribute__((constructor)) vmstate_fast_init(void)
+{
+    qemu_mutex_init(&vmstate_fast_lock);
+}
+
 int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
                        void *opaque, int version_id)
 {
     VMStateField *field = vmsd->fields;
+    const VMStateFastPlan *plan;
     int ret;
 
     if (version_id > vmsd->version_id) {
@@ -1448,7 +1853,16 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
         if (ret)
             return ret;
     }
-    while(field->name) {
+    /* older streams may lack fields, take the slow path for them */
+    plan = version_id == vmsd->version_id ? vmstate_fast_plan(vmsd) : NULL;
+    if (plan) {
+        ret = vmstate_fast_load(f, plan, opaque);
+        if (ret < 0) {
+            return ret;
+        }
+        field = NULL;
+    }
+    while (field && field->name) {
         if ((field->field_exists &&
              field->field_exists(opaque, version_id)) ||
             (!field->field_exists &&
@@ -1510,11 +1924,17 @@ void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
                         void *opaque)
 {
     VMStateField *field = vmsd->fields;
+    const VMStateFastPlan *plan;
 
     if (vmsd->pre_save) {
         vmsd->pre_save(opaque);
     }
-    while(field->name) {
+    plan = vmstate_fast_plan(vmsd);
+    if (plan) {
+        vmstate_fast_save(f, plan, opaque);
+        field = NULL;
+    }
+    while (field && field->name) {
         if (!field->field_exists ||
             field->field_exists(opaque, vmsd->version_id)) {
             void *base_addr = opaque + field->offset;
@@ -1586,6 +2006,7 @@ static void vmstate_save(QEMUFile *f, SaveStateEntry *se)
 #define QEMU_VM_SECTION_END          0x03
 #define QEMU_VM_SECTION_FULL         0x04
 #define QEMU_VM_SUBSECTION           0x05
+#define QEMU_VM_POSTCOPY_RUN         0x06
 
 bool qemu_savevm_state_blocked(Error **errp)
 {
@@ -1660,7 +2081,7 @@ int qemu_savevm_state_begin(QEMUFile *f,
  *   0 : We haven't finished, caller have to go again
  *   1 : We have finished, we can go to complete phase
  */
-int qemu_savevm_state_iterate(QEMUFile *f)
+static int qemu_savevm_iterate_sections(QEMUFile *f, bool postcopy)
 {
     SaveStateEntry *se;
     int ret = 1;
@@ -1674,7 +2095,8 @@ int qemu_savevm_state_iterate(QEMUFile *f)
                 continue;
             }
         }
-        if (qemu_file_rate_limit(f)) {
+        /* in postcopy, page requests must be served regardless */
+        if (!postcopy && qemu_file_rate_limit(f)) {
             return 0;
         }
         trace_savevm_section_start();
@@ -1703,13 +2125,21 @@ int qemu_savevm_state_iterate(QEMUFile *f)
     return ret;
 }
 
-int qemu_savevm_state_complete(QEMUFile *f)
+int qemu_savevm_state_iterate(QEMUFile *f)
+{
+    return qemu_savevm_iterate_sections(f, false);
+}
+
+int qemu_savevm_state_postcopy_iterate(QEMUFile *f)
+{
+    return qemu_savevm_iterate_sections(f, true);
+}
+
+static int qemu_savevm_state_live_complete(QEMUFile *f)
 {
     SaveStateEntry *se;
     int ret;
 
-    cpu_synchronize_all_states();
-
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         if (!se->ops || !se->ops->save_live_complete) {
             continue;
@@ -1730,6 +2160,12 @@ int qemu_savevm_state_complete(QEMUFile *f)
             return ret;
         }
     }
+    return 0;
+}
+
+static void qemu_savevm_state_devices(QEMUFile *f)
+{
+    SaveStateEntry *se;
 
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         int len;
@@ -1753,59 +2189,156 @@ int qemu_savevm_state_complete(QEMUFile *f)
         vmstate_save(f, se);
         trace_savevm_section_end(se->section_id);
     }
+}
+
+int qemu_savevm_state_complete(QEMUFile *f)
+{
+    int ret;
+
+    cpu_synchronize_all_states();
+
+    ret = qemu_savevm_state_live_complete(f);
+    if (ret < 0) {
+        return ret;
+    }
+    qemu_savevm_state_devices(f);
 
     qemu_put_byte(f, QEMU_VM_EOF);
 
     return qemu_file_get_error(f);
 }
 
-void qemu_savevm_state_cancel(QEMUFile *f)
+bool qemu_savevm_state_postcopy_supported(void)
 {
     SaveStateEntry *se;
 
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
-        if (se->ops && se->ops->cancel) {
-            se->ops->cancel(se->opaque);
+        if (!se->ops || !se->ops->save_live_setup) {
+            continue;
+        }
+        if (se->ops->is_active && !se->ops->is_active(se->opaque)) {
+            continue;
+        }
+        if (!se->ops->save_live_postcopy) {
+            return false;
         }
     }
+    return true;
 }
 
-static int qemu_savevm_state(QEMUFile *f)
+/*
+ * Switch to postcopy: every live section gets a chance to tell the
+ * destination what is still missing, then the device state follows as
+ * a single QEMU_VM_POSTCOPY_RUN blob.  The blob lets the destination
+ * start consuming the rest of the stream in a separate thread before
+ * loading devices, since loading them may fault on guest RAM.
+ */
+int qemu_savevm_state_postcopy(QEMUFile *f)
 {
+    QEMUFileBuffer *buf;
+    QEMUFile *bf;
+    SaveStateEntry *se;
     int ret;
-    MigrationParams params = {
-        .blk = 0,
-        .shared = 0
-    };
 
-    if (qemu_savevm_state_blocked(NULL)) {
-        ret = -EINVAL;
-        goto out;
-    }
+    cpu_synchronize_all_states();
 
-    ret = qemu_savevm_state_begin(f, &params);
-    if (ret < 0)
-        goto out;
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        if (!se->ops || !se->ops->save_live_postcopy) {
+            continue;
+        }
+        if (se->ops->is_active && !se->ops->is_active(se->opaque)) {
+            continue;
+        }
+        trace_savevm_section_start();
+        qemu_put_byte(f, QEMU_VM_SECTION_PART);
+        qemu_put_be32(f, se->section_id);
 
-    do {
-        ret = qemu_savevm_state_iterate(f);
-        if (ret < 0)
-            goto out;
-    } while (ret == 0);
+        ret = se->ops->save_live_postcopy(f, se->opaque);
+        trace_savevm_section_end(se->section_id);
+        if (ret < 0) {
+            return ret;
+        }
+    }
 
-    ret = qemu_savevm_state_complete(f);
+    buf = g_malloc0(sizeof(*buf));
+    bf = qemu_fopen_ops(buf, &buf_write_ops);
+    qemu_savevm_state_devices(bf);
+    qemu_put_byte(bf, QEMU_VM_EOF);
+    qemu_fflush(bf);
 
-out:
+    qemu_put_byte(f, QEMU_VM_POSTCOPY_RUN);
+    qemu_put_be32(f, buf->size);
+    qemu_put_buffer(f, buf->data, buf->size);
+    qemu_fclose(bf);
+
+    ret = qemu_file_get_error(f);
     if (ret == 0) {
-        ret = qemu_file_get_error(f);
+        ret = qemu_fflush(f);
     }
-
-    return ret;
+    return ret < 0 ? ret : 0;
 }
 
-static int qemu_save_device_state(QEMUFile *f)
+int qemu_savevm_state_postcopy_complete(QEMUFile *f)
 {
-    SaveStateEntry *se;
+    int ret;
+
+    ret = qemu_savevm_state_live_complete(f);
+    if (ret < 0) {
+        return ret;
+    }
+
+    qemu_put_byte(f, QEMU_VM_EOF);
+
+    return qemu_file_get_error(f);
+}
+
+void qemu_savevm_state_cancel(QEMUFile *f)
+{
+    SaveStateEntry *se;
+
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        if (se->ops && se->ops->cancel) {
+            se->ops->cancel(se->opaque);
+        }
+    }
+}
+
+static int qemu_savevm_state(QEMUFile *f)
+{
+    int ret;
+    MigrationParams params = {
+        .blk = 0,
+        .shared = 0
+    };
+
+    if (qemu_savevm_state_blocked(NULL)) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    ret = qemu_savevm_state_begin(f, &params);
+    if (ret < 0)
+        goto out;
+
+    do {
+        ret = qemu_savevm_state_iterate(f);
+        if (ret < 0)
+            goto out;
+    } while (ret == 0);
+
+    ret = qemu_savevm_state_complete(f);
+
+out:
+    if (ret == 0) {
+        ret = qemu_file_get_error(f);
+    }
+
+    return ret;
+}
+
+static int qemu_save_device_state(QEMUFile *f)
+{
+    SaveStateEntry *se;
 
     qemu_put_be32(f, QEMU_VM_FILE_MAGIC);
     qemu_put_be32(f, QEMU_VM_FILE_VERSION);
@@ -1942,31 +2475,19 @@ typedef struct LoadStateEntry {
     int version_id;
 } LoadStateEntry;
 
-int qemu_loadvm_state(QEMUFile *f)
+typedef QLIST_HEAD(, LoadStateEntry) LoadStateEntryList;
+
+/*
+ * Returns 0 at QEMU_VM_EOF, 1 at QEMU_VM_POSTCOPY_RUN and -errno on
+ * errors.
+ */
+static int qemu_loadvm_state_main(QEMUFile *f,
+                                  LoadStateEntryList *loadvm_handlers)
 {
-    QLIST_HEAD(, LoadStateEntry) loadvm_handlers =
-        QLIST_HEAD_INITIALIZER(loadvm_handlers);
-    LoadStateEntry *le, *new_le;
+    LoadStateEntry *le;
     uint8_t section_type;
-    unsigned int v;
     int ret;
 
-    if (qemu_savevm_state_blocked(NULL)) {
-        return -EINVAL;
-    }
-
-    v = qemu_get_be32(f);
-    if (v != QEMU_VM_FILE_MAGIC)
-        return -EINVAL;
-
-    v = qemu_get_be32(f);
-    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
-        fprintf(stderr, "SaveVM v2 format is obsolete and don't work anymore\n");
-        return -ENOTSUP;
-    }
-    if (v != QEMU_VM_FILE_VERSION)
-        return -ENOTSUP;
-
     while ((section_type = qemu_get_byte(f)) != QEMU_VM_EOF) {
         uint32_t instance_id, version_id, section_id;
         SaveStateEntry *se;
@@ -1989,7 +2510,7 @@ int qemu_loadvm_state(QEMUFile *f)
             if (se == NULL) {
                 fprintf(stderr, "Unknown savevm section or instance '%s' %d\n", idstr, instance_id);
                 ret = -EINVAL;
-                goto out;
+                return ret;
             }
 
             /* Validate version */
@@ -1997,7 +2518,7 @@ int qemu_loadvm_state(QEMUFile *f)
                 fprintf(stderr, "savevm: unsupported version %d for '%s' v%d\n",
                         version_id, idstr, se->version_id);
                 ret = -EINVAL;
-                goto out;
+                return ret;
             }
 
             /* Add entry */
@@ -2006,20 +2527,20 @@ int qemu_loadvm_state(QEMUFile *f)
             le->se = se;
             le->section_id = section_id;
             le->version_id = version_id;
-            QLIST_INSERT_HEAD(&loadvm_handlers, le, entry);
+            QLIST_INSERT_HEAD(loadvm_handlers, le, entry);
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state for instance 0x%x of device '%s'\n",
                         instance_id, idstr);
-                goto out;
+                return ret;
             }
             break;
         case QEMU_VM_SECTION_PART:
         case QEMU_VM_SECTION_END:
             section_id = qemu_get_be32(f);
 
-            QLIST_FOREACH(le, &loadvm_handlers, entry) {
+            QLIST_FOREACH(le, loadvm_handlers, entry) {
                 if (le->section_id == section_id) {
                     break;
                 }
@@ -2027,36 +2548,167 @@ int qemu_loadvm_state(QEMUFile *f)
             if (le == NULL) {
                 fprintf(stderr, "Unknown savevm section %d\n", section_id);
                 ret = -EINVAL;
-                goto out;
+                return ret;
             }
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state section id %d\n",
                         section_id);
-                goto out;
+                return ret;
             }
             break;
+        case QEMU_VM_POSTCOPY_RUN:
+            return 1;
         default:
             fprintf(stderr, "Unknown savevm section type %d\n", section_type);
             ret = -EINVAL;
-            goto out;
+            return ret;
         }
     }
 
-    cpu_synchronize_all_post_init();
+    return qemu_file_get_error(f);
+}
 
-    ret = 0;
+static void qemu_loadvm_free_handlers(LoadStateEntryList *loadvm_handlers)
+{
+    LoadStateEntry *le, *new_le;
 
-out:
-    QLIST_FOREACH_SAFE(le, &loadvm_handlers, entry, new_le) {
+    QLIST_FOREACH_SAFE(le, loadvm_handlers, entry, new_le) {
         QLIST_REMOVE(le, entry);
         g_free(le);
     }
+}
 
-    if (ret == 0) {
-        ret = qemu_file_get_error(f);
+typedef struct PostcopyListenState {
+    QEMUFile *f;
+    LoadStateEntryList loadvm_handlers;
+    QemuThread thread;
+    QEMUBH *bh;
+    int ret;
+} PostcopyListenState;
+
+/* Receives the RAM pages that follow the switch-over. */
+static void *postcopy_listen_thread(void *opaque)
+{
+    PostcopyListenState *pls = opaque;
+
+    pls->ret = qemu_loadvm_state_main(pls->f, &pls->loadvm_handlers);
+    qemu_bh_schedule(pls->bh);
+    return NULL;
+}
+
+static void postcopy_listen_done(void *opaque)
+{
+    PostcopyListenState *pls = opaque;
+
+    qemu_thread_join(&pls->thread);
+    qemu_bh_delete(pls->bh);
+    postcopy_incoming_cleanup();
+    qemu_loadvm_free_handlers(&pls->loadvm_handlers);
+    qemu_fclose(pls->f);
+
+    /* The guest is already running here, there is no way back. */
+    if (pls->ret != 0) {
+        error_report("postcopy migration failed: %s", strerror(-pls->ret));
+        exit(1);
+    }
+    g_free(pls);
+}
+
+/*
+ * Hand the rest of the stream over to a listen thread, then load the
+ * device state blob.  Guest RAM faults are served from here on.
+ */
+static int qemu_loadvm_state_postcopy(QEMUFile *f,
+                                      LoadStateEntryList *loadvm_handlers)
+{
+    PostcopyListenState *pls;
+    LoadStateEntryList blob_handlers = QLIST_HEAD_INITIALIZER(blob_handlers);
+    QEMUFileBuffer *buf;
+    QEMUFile *bf;
+    LoadStateEntry *le, *new_le;
+    int fd = qemu_get_fd(f);
+    int ret;
+
+    if (!postcopy_incoming_active()) {
+        fprintf(stderr, "savevm: postcopy run without postcopy RAM\n");
+        return -EINVAL;
+    }
+
+    buf = g_malloc0(sizeof(*buf));
+    buf->size = qemu_get_be32(f);
+    buf->data = g_malloc(buf->size);
+    qemu_get_buffer(f, buf->data, buf->size);
+    ret = qemu_file_get_error(f);
+    if (ret < 0) {
+        buf_close(buf);
+        return ret;
+    }
+
+    /* The listen thread reads with blocking I/O, outside the coroutine */
+    qemu_set_fd_handler(fd, NULL, NULL, NULL);
+    socket_set_block(fd);
+
+    pls = g_malloc0(sizeof(*pls));
+    pls->f = f;
+    QLIST_INIT(&pls->loadvm_handlers);
+    QLIST_FOREACH_SAFE(le, loadvm_handlers, entry, new_le) {
+        QLIST_REMOVE(le, entry);
+        QLIST_INSERT_HEAD(&pls->loadvm_handlers, le, entry);
+    }
+    pls->bh = qemu_bh_new(postcopy_listen_done, pls);
+    qemu_thread_create(&pls->thread, postcopy_listen_thread, pls,
+                       QEMU_THREAD_JOINABLE);
+
+    bf = qemu_fopen_ops(buf, &buf_read_ops);
+    ret = qemu_loadvm_state_main(bf, &blob_handlers);
+    qemu_loadvm_free_handlers(&blob_handlers);
+    qemu_fclose(bf);
+    if (ret != 0) {
+        return ret < 0 ? ret : -EINVAL;
+    }
+
+    cpu_synchronize_all_post_init();
+    return 1;
+}
+
+/*
+ * Returns 0 when the whole state was loaded, 1 when the guest can be
+ * started while postcopy keeps loading RAM in the background, and
+ * -errno on errors.
+ */
+int qemu_loadvm_state(QEMUFile *f)
+{
+    LoadStateEntryList loadvm_handlers =
+        QLIST_HEAD_INITIALIZER(loadvm_handlers);
+    unsigned int v;
+    int ret;
+
+    if (qemu_savevm_state_blocked(NULL)) {
+        return -EINVAL;
+    }
+
+    v = qemu_get_be32(f);
+    if (v != QEMU_VM_FILE_MAGIC)
+        return -EINVAL;
+
+    v = qemu_get_be32(f);
+    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
+        fprintf(stderr, "SaveVM v2 format is obsolete and don't work anymore\n");
+        return -ENOTSUP;
     }
+    if (v != QEMU_VM_FILE_VERSION)
+        return -ENOTSUP;
+
+    ret = qemu_loadvm_state_main(f, &loadvm_handlers);
+    if (ret == 1) {
+        ret = qemu_loadvm_state_postcopy(f, &loadvm_handlers);
+    } else if (ret == 0) {
+        cpu_synchronize_all_post_init();
+    }
+
+    qemu_loadvm_free_handlers(&loadvm_handlers);
 
     return ret;
 }
@@ -2110,14 +2762,14 @@ static int del_existing_snapshots(Monitor *mon, const char *name)
     return 0;
 }
 
-void do_savevm(Monitor *mon, const QDict *qdict)
+/* Fill @sn for a new snapshot called @name, or one named after the current
+   date if @name is NULL, reusing the id of an existing snapshot on @bs
+   with the same name.  */
+static void savevm_init_snapshot(BlockDriverState *bs, QEMUSnapshotInfo *sn,
+                                 const char *name)
 {
-    BlockDriverState *bs, *bs1;
-    QEMUSnapshotInfo sn1, *sn = &sn1, old_sn1, *old_sn = &old_sn1;
+    QEMUSnapshotInfo old_sn1, *old_sn = &old_sn1;
     int ret;
-    QEMUFile *f;
-    int saved_vm_running;
-    uint64_t vm_state_size;
 #ifdef _WIN32
     struct _timeb tb;
     struct tm *ptm;
@@ -2125,31 +2777,6 @@ void do_savevm(Monitor *mon, const QDict *qdict)
     struct timeval tv;
     struct tm tm;
 #endif
-    const char *name = qdict_get_try_str(qdict, "name");
-
-    /* Verify if there is a device that doesn't support snapshots and is writable */
-    bs = NULL;
-    while ((bs = bdrv_next(bs))) {
-
-        if (!bdrv_is_inserted(bs) || bdrv_is_read_only(bs)) {
-            continue;
-        }
-
-        if (!bdrv_can_snapshot(bs)) {
-            monitor_printf(mon, "Device '%s' is writable but does not support snapshots.\n",
-                               bdrv_get_device_name(bs));
-            return;
-        }
-    }
-
-    bs = bdrv_snapshots();
-    if (!bs) {
-        monitor_printf(mon, "No block device can accept snapshots\n");
-        return;
-    }
-
-    saved_vm_running = runstate_is_running();
-    vm_stop(RUN_STATE_SAVE_VM);
 
     memset(sn, 0, sizeof(*sn));
 
@@ -2184,6 +2811,334 @@ void do_savevm(Monitor *mon, const QDict *qdict)
         strftime(sn->name, sizeof(sn->name), "vm-%Y%m%d%H%M%S", &tm);
 #endif
     }
+}
+
+/* Create @sn on every device that supports snapshots.  The VM state was
+   written into @bs.  Returns the first device that failed, or NULL.  */
+static BlockDriverState *savevm_create_snapshots(Monitor *mon,
+                                                 BlockDriverState *bs,
+                                                 QEMUSnapshotInfo *sn,
+                                                 uint64_t vm_state_size)
+{
+    BlockDriverState *bs1, *failed = NULL;
+    int ret;
+
+    bs1 = NULL;
+    while ((bs1 = bdrv_next(bs1))) {
+        if (bdrv_can_snapshot(bs1)) {
+            /* Write VM state size only to the image that contains the state */
+            sn->vm_state_size = (bs == bs1 ? vm_state_size : 0);
+            ret = bdrv_snapshot_create(bs1, sn);
+            if (ret < 0) {
+                monitor_printf(mon, "Error while creating snapshot on '%s'\n",
+                               bdrv_get_device_name(bs1));
+                if (!failed) {
+                    failed = bs1;
+                }
+            }
+        }
+    }
+    return failed;
+}
+
+/* Return the device that will hold the VM state, or NULL if a writable
+   device cannot take part in the snapshot.  */
+static BlockDriverState *savevm_check_devices(Error **errp)
+{
+    BlockDriverState *bs;
+
+    /* Verify if there is a device that doesn't support snapshots and is writable */
+    bs = NULL;
+    while ((bs = bdrv_next(bs))) {
+
+        if (!bdrv_is_inserted(bs) || bdrv_is_read_only(bs)) {
+            continue;
+        }
+
+        if (!bdrv_can_snapshot(bs)) {
+            error_setg(errp, "Device '%s' is writable but does not support "
+                       "snapshots", bdrv_get_device_name(bs));
+            return NULL;
+        }
+    }
+
+    bs = bdrv_snapshots();
+    if (!bs) {
+        error_setg(errp, "No block device can accept snapshots");
+    }
+    return bs;
+}
+
+/* Live snapshots */
+
+enum {
+    SAVEVM_LIVE_NONE,
+    SAVEVM_LIVE_ACTIVE,
+    SAVEVM_LIVE_COMPLETED,
+    SAVEVM_LIVE_FAILED,
+    SAVEVM_LIVE_CANCELLED,
+};
+
+/* Pause between two rounds of RAM, so that the vCPU threads can take the
+   big lock and the monitor keeps answering.  */
+#define SAVEVM_LIVE_PAUSE 10 /* ms */
+
+/* Stop the guest after this many passes over RAM even if the dirty pages
+   would not fit in the maximum downtime; disks are slower than networks. */
+#define SAVEVM_LIVE_MAX_PASSES 30
+
+typedef struct SaveVMLiveState {
+    int state;
+    char *name;
+    BlockDriverState *bs;
+    QEMUFile *file;
+    QEMUTimer *timer;
+    int64_t start_time;
+    int64_t total_time;
+    int64_t start_pass;
+    uint64_t bytes;
+    char *error;
+} SaveVMLiveState;
+
+static SaveVMLiveState savevm_live;
+
+bool savevm_live_active(void)
+{
+    return savevm_live.state == SAVEVM_LIVE_ACTIVE;
+}
+
+static void savevm_live_end(SaveVMLiveState *s, int state, const char *error)
+{
+    if (s->file) {
+        if (state != SAVEVM_LIVE_COMPLETED) {
+            qemu_savevm_state_cancel(s->file);
+        }
+        qemu_fclose(s->file);
+        s->file = NULL;
+    }
+    qemu_del_timer(s->timer);
+    qemu_free_timer(s->timer);
+    s->timer = NULL;
+    bdrv_set_in_use(s->bs, 0);
+    s->bs = NULL;
+
+    s->total_time = qemu_get_clock_ms(rt_clock) - s->start_time;
+    s->error = g_strdup(error);
+    s->state = state;
+}
+
+/* Write what is left with the guest stopped, then snapshot the disks */
+static void savevm_live_complete(SaveVMLiveState *s)
+{
+    QEMUSnapshotInfo sn;
+    BlockDriverState *failed;
+    int saved_vm_running;
+    int ret;
+
+    saved_vm_running = runstate_is_running();
+    vm_stop(RUN_STATE_SAVE_VM);
+
+    ret = qemu_savevm_state_complete(s->file);
+    if (ret == 0) {
+        ret = qemu_file_get_error(s->file);
+    }
+    s->bytes = qemu_ftell(s->file);
+    if (ret == 0) {
+        ret = qemu_fclose(s->file);
+    } else {
+        qemu_fclose(s->file);
+    }
+    s->file = NULL;
+    if (ret < 0) {
+        char *error = g_strdup_printf("Error %d while writing VM", ret);
+        savevm_live_end(s, SAVEVM_LIVE_FAILED, error);
+        g_free(error);
+        goto out;
+    }
+
+    savevm_init_snapshot(s->bs, &sn, s->name);
+    if (s->name && del_existing_snapshots(NULL, s->name) < 0) {
+        savevm_live_end(s, SAVEVM_LIVE_FAILED,
+                        "Error while deleting the old snapshot");
+        goto out;
+    }
+    g_free(s->name);
+    s->name = g_strdup(sn.name);
+
+    failed = savevm_create_snapshots(NULL, s->bs, &sn, s->bytes);
+    if (failed) {
+        char *error = g_strdup_printf("Error while creating snapshot on '%s'",
+                                      bdrv_get_device_name(failed));
+        savevm_live_end(s, SAVEVM_LIVE_FAILED, error);
+        g_free(error);
+        goto out;
+    }
+    savevm_live_end(s, SAVEVM_LIVE_COMPLETED, NULL);
+
+out:
+    if (saved_vm_running) {
+        vm_start();
+    }
+}
+
+static void savevm_live_tick(void *opaque)
+{
+    SaveVMLiveState *s = opaque;
+    int64_t passes = migrate_get_current()->dirty_sync_count - s->start_pass;
+    int ret;
+
+    /* the RAM handler stops each round after at most 50ms */
+    ret = qemu_savevm_state_iterate(s->file);
+    if (ret == 0) {
+        ret = qemu_file_get_error(s->file);
+        if (ret == 0 && passes >= SAVEVM_LIVE_MAX_PASSES) {
+            ret = 1;
+        }
+    }
+    if (ret < 0) {
+        char *error = g_strdup_printf("Error %d while writing VM", ret);
+        savevm_live_end(s, SAVEVM_LIVE_FAILED, error);
+        g_free(error);
+        return;
+    }
+
+    s->bytes = qemu_ftell(s->file);
+    if (ret > 0) {
+        savevm_live_complete(s);
+    } else {
+        qemu_mod_timer(s->timer,
+                       qemu_get_clock_ms(rt_clock) + SAVEVM_LIVE_PAUSE);
+    }
+}
+
+void qmp_savevm_start(bool has_name, const char *name, Error **errp)
+{
+    SaveVMLiveState *s = &savevm_live;
+    MigrationParams params = {
+        .blk = 0,
+        .shared = 0
+    };
+    BlockDriverState *bs;
+    int ret;
+
+    if (savevm_live_active() || migration_is_active(migrate_get_current())) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+    if (dump_in_progress()) {
+        error_setg(errp, "A live guest memory dump is in progress");
+        return;
+    }
+    if (qemu_savevm_state_blocked(errp)) {
+        return;
+    }
+    bs = savevm_check_devices(errp);
+    if (!bs) {
+        return;
+    }
+
+    g_free(s->name);
+    g_free(s->error);
+    memset(s, 0, sizeof(*s));
+    s->name = has_name ? g_strdup(name) : NULL;
+    s->start_time = qemu_get_clock_ms(rt_clock);
+    s->start_pass = migrate_get_current()->dirty_sync_count;
+
+    s->file = qemu_fopen_bdrv(bs, 1);
+    if (!s->file) {
+        error_setg(errp, "Could not open VM state file");
+        return;
+    }
+    /* keep the device from going away under the job */
+    s->bs = bs;
+    bdrv_set_in_use(bs, 1);
+    s->timer = qemu_new_timer_ms(rt_clock, savevm_live_tick, s);
+    s->state = SAVEVM_LIVE_ACTIVE;
+
+    ret = qemu_savevm_state_begin(s->file, &params);
+    if (ret == 0) {
+        ret = qemu_file_get_error(s->file);
+    }
+    if (ret < 0) {
+        error_setg(errp, "Error %d while writing VM", ret);
+        savevm_live_end(s, SAVEVM_LIVE_FAILED, "Could not start the snapshot");
+        return;
+    }
+    qemu_mod_timer(s->timer, qemu_get_clock_ms(rt_clock));
+}
+
+void qmp_savevm_cancel(Error **errp)
+{
+    if (savevm_live_active()) {
+        savevm_live_end(&savevm_live, SAVEVM_LIVE_CANCELLED, NULL);
+    }
+}
+
+SaveVMInfo *qmp_query_savevm(Error **errp)
+{
+    SaveVMLiveState *s = &savevm_live;
+    SaveVMInfo *info = g_new0(SaveVMInfo, 1);
+    static const char *const status[] = {
+        [SAVEVM_LIVE_ACTIVE] = "active",
+        [SAVEVM_LIVE_COMPLETED] = "completed",
+        [SAVEVM_LIVE_FAILED] = "failed",
+        [SAVEVM_LIVE_CANCELLED] = "cancelled",
+    };
+
+    if (s->state == SAVEVM_LIVE_NONE) {
+        return info;
+    }
+
+    info->has_status = true;
+    info->status = g_strdup(status[s->state]);
+    if (s->name) {
+        info->has_name = true;
+        info->name = g_strdup(s->name);
+    }
+    info->has_total_time = true;
+    info->has_bytes = true;
+    info->bytes = s->bytes;
+    if (s->state == SAVEVM_LIVE_ACTIVE) {
+        info->total_time = qemu_get_clock_ms(rt_clock) - s->start_time;
+        info->has_remaining = true;
+        info->remaining = ram_bytes_remaining();
+    } else {
+        info->total_time = s->total_time;
+    }
+    if (s->error) {
+        info->has_error = true;
+        info->error = g_strdup(s->error);
+    }
+    return info;
+}
+
+void do_savevm(Monitor *mon, const QDict *qdict)
+{
+    BlockDriverState *bs;
+    QEMUSnapshotInfo sn1, *sn = &sn1;
+    Error *local_err = NULL;
+    int ret;
+    QEMUFile *f;
+    int saved_vm_running;
+    uint64_t vm_state_size;
+    const char *name = qdict_get_try_str(qdict, "name");
+
+    if (savevm_live_active()) {
+        monitor_printf(mon, "A live snapshot is in progress\n");
+        return;
+    }
+
+    bs = savevm_check_devices(&local_err);
+    if (!bs) {
+        monitor_printf(mon, "%s\n", error_get_pretty(local_err));
+        error_free(local_err);
+        return;
+    }
+
+    saved_vm_running = runstate_is_running();
+    vm_stop(RUN_STATE_SAVE_VM);
+
+    savevm_init_snapshot(bs, sn, name);
 
     /* Delete old snapshots of the same name */
     if (name && del_existing_snapshots(mon, name) < 0) {
@@ -2205,19 +3160,7 @@ void do_savevm(Monitor *mon, const QDict *qdict)
     }
 
     /* create the snapshots */
-
-    bs1 = NULL;
-    while ((bs1 = bdrv_next(bs1))) {
-        if (bdrv_can_snapshot(bs1)) {
-            /* Write VM state size only to the image that contains the state */
-            sn->vm_state_size = (bs == bs1 ? vm_state_size : 0);
-            ret = bdrv_snapshot_create(bs1, sn);
-            if (ret < 0) {
-                monitor_printf(mon, "Error while creating snapshot on '%s'\n",
-                               bdrv_get_device_name(bs1));
-            }
-        }
-    }
+    savevm_create_snapshots(mon, bs, sn, vm_state_size);
 
  the_end:
     if (saved_vm_running)
@@ -2256,6 +3199,11 @@ int load_vmstate(const char *name)
     QEMUFile *f;
     int ret;
 
+    if (savevm_live_active()) {
+        error_report("A live snapshot is in progress");
+        return -EBUSY;
+    }
+
     bs_vm_state = bdrv_snapshots();
     if (!bs_vm_state) {
         error_report("No block device supports snapshots");
@@ -2448,13 +3396,84 @@ void vmstate_register_ram_global(MemoryRegion *mr)
 
   length = uleb128 encoded integer
  */
+/* Index of the first byte at or after i where the buffers differ, or slen */
+static int xbzrle_skip_equal(const uint8_t *old_buf, const uint8_t *new_buf,
+                             int i, int slen)
+{
+#ifdef __SSE2__
+    int mask;
+
+    for (; i + 16 <= slen; i += 16) {
+        mask = _mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(old_buf + i)),
+                           _mm_loadu_si128((const __m128i *)(new_buf + i))));
+        if (mask != 0xFFFF) {
+            return i + ctz32(~mask);
+        }
+    }
+#endif
+    while (i < slen && i % sizeof(long) && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    /* word at a time for speed */
+    if (!(i % sizeof(long))) {
+        while (i + sizeof(long) <= slen &&
+               *(long *)(old_buf + i) == *(long *)(new_buf + i)) {
+            i += sizeof(long);
+        }
+    }
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+/* Index of the first byte at or after i where the buffers are equal, or
+ * slen */
+static int xbzrle_skip_diff(const uint8_t *old_buf, const uint8_t *new_buf,
+                            int i, int slen)
+{
+#ifdef __SSE2__
+    int mask;
+
+    for (; i + 16 <= slen; i += 16) {
+        mask = _mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(old_buf + i)),
+                           _mm_loadu_si128((const __m128i *)(new_buf + i))));
+        if (mask) {
+            return i + ctz32(mask);
+        }
+    }
+#endif
+    while (i < slen && i % sizeof(long) && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    /* word at a time for speed, use of 32-bit long okay */
+    if (!(i % sizeof(long))) {
+        /* truncation to 32-bit long okay */
+        long mask = (long)0x0101010101010101ULL;
+        long xor;
+
+        while (i + sizeof(long) <= slen) {
+            xor = *(long *)(old_buf + i) ^ *(long *)(new_buf + i);
+            if ((xor - mask) & ~xor & (mask << 7)) {
+                /* the long contains an equal byte */
+                break;
+            }
+            i += sizeof(long);
+        }
+    }
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen)
 {
-    uint32_t zrun_len = 0, nzrun_len = 0;
-    int d = 0, i = 0;
-    long res, xor;
-    uint8_t *nzrun_start = NULL;
+    uint32_t zrun_len, nzrun_len;
+    int d = 0, i = 0, start;
 
     g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
                sizeof(long)));
@@ -2465,28 +3484,9 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             return -1;
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
-
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
-
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
-        }
+        start = i;
+        i = xbzrle_skip_equal(old_buf, new_buf, i, slen);
+        zrun_len = i - start;
 
         /* buffer unchanged */
         if (zrun_len == slen) {
@@ -2500,49 +3500,22 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 
         d += uleb128_encode_small(dst + d, zrun_len);
 
-        zrun_len = 0;
-        nzrun_start = new_buf + i;
-
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            long mask = (long)0x0101010101010101ULL;
-            while (i < slen) {
-                xor = *(long *)(old_buf + i) ^ *(long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
+
+        start = i;
+        i = xbzrle_skip_diff(old_buf, new_buf, i, slen);
+        nzrun_len = i - start;
 
         d += uleb128_encode_small(dst + d, nzrun_len);
         /* overflow */
         if (d + nzrun_len > dlen) {
             return -1;
         }
-        memcpy(dst + d, nzrun_start, nzrun_len);
+        memcpy(dst + d, new_buf + start, nzrun_len);
         d += nzrun_len;
-        nzrun_len = 0;
     }
 
     return d;
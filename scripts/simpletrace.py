@@ -12,12 +12,15 @@
 import struct
 import re
 import inspect
+import mmap
+import bisect
 from tracetool import _read_events, Event
 from tracetool.backend.simple import is_string
 
 header_event_id = 0xffffffffffffffff
 header_magic    = 0xf2b177cb0aa429b4
 dropped_event_id = 0xfffffffffffffffe
+clock_event_id = 0xfffffffffffffffd
 
 log_header_fmt = '=QQQ'
 rec_header_fmt = '=QQII'
@@ -58,6 +61,57 @@ def read_record(edict, fobj):
     rechdr = read_header(fobj, rec_header_fmt)
     return get_record(edict, rechdr, fobj) # return tuple of record elements
 
+def ticks_to_ns_fn(clock):
+    """Return a function that converts host ticks to nanoseconds by
+    interpolating between the (ticks, ns) pairs of the clock records."""
+    if not clock:
+        return lambda ticks: ticks
+    if len(clock) == 1:
+        (ticks0, ns0) = clock[0]
+        return lambda ticks: ns0 + ticks - ticks0
+
+    ticks_list = [ticks for ticks, ns in clock]
+    def ticks_to_ns(ticks):
+        i = bisect.bisect_right(ticks_list, ticks)
+        i = min(max(i, 1), len(clock) - 1)
+        (ticks0, ns0), (ticks1, ns1) = clock[i - 1], clock[i]
+        if ticks1 == ticks0:
+            return ns0
+        return ns0 + (ticks - ticks0) * (ns1 - ns0) // (ticks1 - ticks0)
+    return ticks_to_ns
+
+def read_trace_records_v3(edict, fobj):
+    """Deserialize version 3 trace records.  Records carry host ticks and are
+    8-byte aligned with their length in the header, so the file is mapped and
+    scanned twice: once for the clock records, then for the events."""
+    buf = mmap.mmap(fobj.fileno(), 0, access=mmap.ACCESS_READ)
+    hlen = struct.calcsize(rec_header_fmt)
+    start = struct.calcsize(log_header_fmt)
+
+    def headers():
+        off = start
+        while off + hlen <= len(buf):
+            rechdr = struct.unpack_from(rec_header_fmt, buf, off)
+            length = rechdr[2]
+            if length < hlen or off + length > len(buf):
+                break # truncated
+            yield off, rechdr
+            off += length
+
+    clock = []
+    for off, rechdr in headers():
+        if rechdr[0] == clock_event_id:
+            (ns,) = struct.unpack_from('=Q', buf, off + hlen)
+            clock.append((rechdr[1], ns))
+    clock.sort()
+    ticks_to_ns = ticks_to_ns_fn(clock)
+
+    for off, rechdr in headers():
+        if rechdr[0] == clock_event_id:
+            continue
+        buf.seek(off + hlen)
+        yield get_record(edict, (rechdr[0], ticks_to_ns(rechdr[1])), buf)
+
 def read_trace_file(edict, fobj):
     """Deserialize trace records from a file, yielding record tuples (event_num, timestamp, arg1, ..., arg6)."""
     header = read_header(fobj, log_header_fmt)
@@ -66,13 +120,19 @@ def read_trace_file(edict, fobj):
        header[1] != header_magic:
         raise ValueError('Not a valid trace file!')
     if header[2] != 0 and \
-       header[2] != 2:
+       header[2] != 2 and \
+       header[2] != 3:
         raise ValueError('Unknown version of tracelog format!')
 
     log_version = header[2]
     if log_version == 0:
         raise ValueError('Older log format, not supported with this QEMU release!')
 
+    if log_version == 3:
+        for rec in read_trace_records_v3(edict, fobj):
+            yield rec
+        return
+
     while True:
         rec = read_record(edict, fobj)
         if rec is None:
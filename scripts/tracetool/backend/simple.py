@@ -37,7 +37,7 @@ def c(events):
         '')
 
     for num, event in enumerate(events):
-        out('void trace_%(name)s(%(args)s)',
+        out('void _simple_trace_%(name)s(%(args)s)',
             '{',
             '    TraceBufferRecord rec;',
             name = event.name,
@@ -59,10 +59,6 @@ def c(events):
 
 
         out('',
-            '    if (!trace_list[%(event_id)s].state) {',
-            '        return;',
-            '    }',
-            '',
             '    if (trace_record_start(&rec, %(event_id)s, %(size_str)s)) {',
             '        return; /* Trace Buffer Full, Event Dropped ! */',
             '    }',
@@ -95,13 +91,25 @@ def c(events):
 
 def h(events):
     out('#include "trace/simple.h"',
-        '')
+        '',
+        '#define NR_TRACE_EVENTS %d' % len(events),
+        'extern TraceEvent trace_list[NR_TRACE_EVENTS];')
 
-    for event in events:
-        out('void trace_%(name)s(%(args)s);',
+    # The state check is inlined so that a disabled event costs one
+    # predicted branch and no call
+    for num, event in enumerate(events):
+        out('',
+            'void _simple_trace_%(name)s(%(args)s);',
+            '',
+            'static inline void trace_%(name)s(%(args)s)',
+            '{',
+            '    if (unlikely(trace_list[%(event_id)d].state)) {',
+            '        _simple_trace_%(name)s(%(argnames)s);',
+            '    }',
+            '}',
             name = event.name,
             args = event.args,
+            event_id = num,
+            argnames = ", ".join(event.args.names()),
             )
     out('')
-    out('#define NR_TRACE_EVENTS %d' % len(events))
-    out('extern TraceEvent trace_list[NR_TRACE_EVENTS];')
@@ -112,6 +112,7 @@ if_output(struct socket *so, struct mbuf *ifm)
 diddit:
 	if (so) {
 		/* Update *_queued */
+		sodirty(so);
 		so->so_queued++;
 		so->so_nqueued++;
 		/*
@@ -225,6 +226,9 @@ void if_start(Slirp *slirp)
         }
 
         /* Update so_queued */
+        if (ifm->ifq_so) {
+            sodirty(ifm->ifq_so);
+        }
         if (ifm->ifq_so && --ifm->ifq_so->so_queued == 0) {
             /* If there's no more queued, reset nqueued */
             ifm->ifq_so->so_nqueued = 0;
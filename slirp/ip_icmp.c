@@ -88,6 +88,7 @@ static int icmp_send(struct socket *so, struct mbuf *m, int hlen)
     so->so_laddr = ip->ip_src;
     so->so_iptos = ip->ip_tos;
     so->so_type = IPPROTO_ICMP;
+    so->so_icmpsock = true;
     so->so_state = SS_ISFCONNECTED;
     so->so_expire = curtime + SO_EXPIRE;
 
@@ -95,6 +96,7 @@ static int icmp_send(struct socket *so, struct mbuf *m, int hlen)
     addr.sin_addr = so->so_faddr;
 
     insque(so, &so->slirp->icmp);
+    sodirty(so);
 
     if (sendto(so->s, m->m_data + hlen, m->m_len - hlen, 0,
                (struct sockaddr *)&addr, sizeof(addr)) == -1) {
@@ -75,7 +75,8 @@ ip_output(struct socket *so, struct mbuf *m0)
 	/*
 	 * If small enough for interface, can just send directly.
 	 */
-	if ((uint16_t)ip->ip_len <= IF_MTU) {
+	if ((uint16_t)ip->ip_len <= IF_MTU ||
+	    (slirp->tso && ip->ip_p == IPPROTO_TCP)) {
 		ip->ip_len = htons((uint16_t)ip->ip_len);
 		ip->ip_off = htons((uint16_t)ip->ip_off);
 		ip->ip_sum = 0;
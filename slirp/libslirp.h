@@ -23,7 +23,19 @@ void slirp_select_fill(int *pnfds,
 void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds,
                        int select_error);
 
+#ifndef _WIN32
+/* Register the sockets whose events changed with the main loop */
+void slirp_pollfds_fill(void);
+/* Dispatch the descriptors the last wait reported as ready */
+void slirp_pollfds_poll(int select_error);
+#endif
+
 void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len);
+/* Like slirp_input(), for frames whose TCP/UDP checksum was offloaded by the
+ * sender and must not be verified.  */
+void slirp_input_csum_valid(Slirp *slirp, const uint8_t *pkt, int pkt_len);
+/* Emit TCP segments larger than the MTU; the receiver segments them.  */
+void slirp_set_tso(Slirp *slirp, bool enable);
 
 /* you must provide the following functions: */
 void slirp_output(void *opaque, const uint8_t *pkt, int pkt_len);
@@ -24,6 +24,7 @@
 #include "qemu-common.h"
 #include "qemu-timer.h"
 #include "qemu-char.h"
+#include "main-loop.h"
 #include "slirp.h"
 #include "hw/hw.h"
 
@@ -39,9 +40,6 @@ static const uint8_t special_ethaddr[ETH_ALEN] = {
 
 static const uint8_t zero_ethaddr[ETH_ALEN] = { 0, 0, 0, 0, 0, 0 };
 
-/* XXX: suppress those select globals */
-fd_set *global_readfds, *global_writefds, *global_xfds;
-
 u_int curtime;
 static u_int time_fasttimo, last_slowtimo;
 static int do_slowtimo;
@@ -198,6 +196,10 @@ static void slirp_init_once(void)
 
 static void slirp_state_save(QEMUFile *f, void *opaque);
 static int slirp_state_load(QEMUFile *f, void *opaque, int version_id);
+#ifndef _WIN32
+static void slirp_fasttimo(void *opaque);
+static void slirp_slowtimo(void *opaque);
+#endif
 
 Slirp *slirp_init(int restricted, struct in_addr vnetwork,
                   struct in_addr vnetmask, struct in_addr vhost,
@@ -240,6 +242,12 @@ Slirp *slirp_init(int restricted, struct in_addr vnetwork,
 
     slirp->opaque = opaque;
 
+#ifndef _WIN32
+    QLIST_INIT(&slirp->dirty_sockets);
+    slirp->fasttimo_timer = qemu_new_timer_ms(rt_clock, slirp_fasttimo, slirp);
+    slirp->slowtimo_timer = qemu_new_timer_ms(rt_clock, slirp_slowtimo, slirp);
+#endif
+
     register_savevm(NULL, "slirp", 0, 3,
                     slirp_state_save, slirp_state_load, slirp);
 
@@ -257,15 +265,164 @@ void slirp_cleanup(Slirp *slirp)
     ip_cleanup(slirp);
     m_cleanup(slirp);
 
+#ifndef _WIN32
+    qemu_free_timer(slirp->fasttimo_timer);
+    qemu_free_timer(slirp->slowtimo_timer);
+#endif
+
     g_free(slirp->vdnssearch);
     g_free(slirp->tftp_prefix);
     g_free(slirp->bootp_filename);
     g_free(slirp);
 }
 
-#define CONN_CANFSEND(so) (((so)->so_state & (SS_FCANTSENDMORE|SS_ISFCONNECTED)) == SS_ISFCONNECTED)
-#define CONN_CANFRCV(so) (((so)->so_state & (SS_FCANTRCVMORE|SS_ISFCONNECTED)) == SS_ISFCONNECTED)
-#define UPD_NFDS(x) if (nfds < (x)) nfds = (x)
+#ifndef _WIN32
+/*
+ * Sockets stay registered with the main loop's poll set between
+ * iterations.  Their events are only recomputed when something happened
+ * to them (a packet from the guest, data from the host, a timer), and
+ * only the descriptors the wait reported are dispatched, so the cost of
+ * an iteration follows the number of active connections.
+ */
+
+#define SLIRP_FASTTIMO_MS 2
+#define SLIRP_SLOWTIMO_MS 500
+
+/* Fold errors and hangups into the events select() would report */
+static int slirp_socket_revents(struct socket *so, int revents)
+{
+    int events = so->so_events;
+
+    return (revents & events) |
+           (revents & (G_IO_HUP | G_IO_ERR) ? events & G_IO_IN : 0) |
+           (revents & G_IO_ERR ? events & G_IO_OUT : 0);
+}
+
+static bool slirp_needs_slowtimo(Slirp *slirp)
+{
+    /*
+     * *_slowtimo needs calling if there are IP fragments
+     * in the fragment queue, or there are TCP connections active;
+     * UDP and ICMP sockets expire from it too
+     */
+    return slirp->tcb.so_next != &slirp->tcb ||
+           slirp->udb.so_next != &slirp->udb ||
+           slirp->icmp.so_next != &slirp->icmp ||
+           &slirp->ipq.ip_link != slirp->ipq.ip_link.next;
+}
+
+static void slirp_fasttimo(void *opaque)
+{
+    Slirp *slirp = opaque;
+    struct socket *so, *so_next;
+    struct tcpcb *tp;
+
+    curtime = qemu_get_clock_ms(rt_clock);
+
+    /* only sockets with a pending delayed ACK stay on the dirty list */
+    QLIST_FOREACH_SAFE(so, &slirp->dirty_sockets, so_dirty_entry, so_next) {
+        tp = so->so_tcpcb;
+        if (tp && (tp->t_flags & TF_DELACK)) {
+            tp->t_flags &= ~TF_DELACK;
+            tp->t_flags |= TF_ACKNOW;
+            tcp_output(tp);
+        }
+    }
+    if_start(slirp);
+}
+
+static void slirp_expire(struct socket *head, void (*detach)(struct socket *))
+{
+    struct socket *so, *so_next;
+
+    for (so = head->so_next; so != head; so = so_next) {
+        so_next = so->so_next;
+        if (so->so_expire && so->so_expire <= curtime) {
+            detach(so);
+        }
+    }
+}
+
+static void slirp_slowtimo(void *opaque)
+{
+    Slirp *slirp = opaque;
+
+    curtime = qemu_get_clock_ms(rt_clock);
+
+    ip_slowtimo(slirp);
+    tcp_slowtimo(slirp);
+    slirp_expire(&slirp->udb, udp_detach);
+    slirp_expire(&slirp->icmp, icmp_detach);
+    if_start(slirp);
+
+    if (slirp_needs_slowtimo(slirp)) {
+        qemu_mod_timer(slirp->slowtimo_timer, curtime + SLIRP_SLOWTIMO_MS);
+    }
+}
+
+void slirp_pollfds_fill(void)
+{
+    Slirp *slirp;
+    struct socket *so, *so_next;
+    bool delack;
+
+    QTAILQ_FOREACH(slirp, &slirp_instances, entry) {
+        delack = false;
+        QLIST_FOREACH_SAFE(so, &slirp->dirty_sockets, so_dirty_entry,
+                           so_next) {
+            sowatch(so);
+            if (so->so_tcpcb && (so->so_tcpcb->t_flags & TF_DELACK)) {
+                delack = true;
+                continue;
+            }
+            QLIST_REMOVE(so, so_dirty_entry);
+            so->so_dirty = false;
+        }
+
+        curtime = qemu_get_clock_ms(rt_clock);
+        if (delack && !qemu_timer_pending(slirp->fasttimo_timer)) {
+            qemu_mod_timer(slirp->fasttimo_timer, curtime + SLIRP_FASTTIMO_MS);
+        }
+        if (!qemu_timer_pending(slirp->slowtimo_timer) &&
+            slirp_needs_slowtimo(slirp)) {
+            qemu_mod_timer(slirp->slowtimo_timer, curtime + SLIRP_SLOWTIMO_MS);
+        }
+    }
+}
+
+void slirp_pollfds_poll(int select_error)
+{
+    Slirp *slirp;
+    struct socket *so;
+    const int *fds;
+    int i, nr, revents;
+
+    if (QTAILQ_EMPTY(&slirp_instances)) {
+        return;
+    }
+
+    curtime = qemu_get_clock_ms(rt_clock);
+
+    if (!select_error) {
+        nr = main_loop_poll_ready_fds(&fds);
+        for (i = 0; i < nr; i++) {
+            /* handlers may free other sockets, look each one up afresh */
+            so = solookup_fd(fds[i]);
+            if (!so) {
+                continue;
+            }
+            revents = slirp_socket_revents(so, main_loop_poll_revents(fds[i]));
+            if (revents) {
+                sopoll(so, revents);
+            }
+        }
+    }
+
+    QTAILQ_FOREACH(slirp, &slirp_instances, entry) {
+        if_start(slirp);
+    }
+}
+#endif
 
 void slirp_update_timeout(uint32_t *timeout)
 {
@@ -274,6 +431,8 @@ void slirp_update_timeout(uint32_t *timeout)
     }
 }
 
+#define UPD_NFDS(x) if (nfds < (x)) nfds = (x)
+
 void slirp_select_fill(int *pnfds,
                        fd_set *readfds, fd_set *writefds, fd_set *xfds)
 {
@@ -285,11 +444,6 @@ void slirp_select_fill(int *pnfds,
         return;
     }
 
-    /* fail safe */
-    global_readfds = NULL;
-    global_writefds = NULL;
-    global_xfds = NULL;
-
     nfds = *pnfds;
 	/*
 	 * First, TCP sockets
@@ -314,49 +468,15 @@ void slirp_select_fill(int *pnfds,
 			if (time_fasttimo == 0 && so->so_tcpcb->t_flags & TF_DELACK)
 			   time_fasttimo = curtime; /* Flag when we want a fasttimo */
 
-			/*
-			 * NOFDREF can include still connecting to local-host,
-			 * newly socreated() sockets etc. Don't want to select these.
-	 		 */
-			if (so->so_state & SS_NOFDREF || so->s == -1)
-			   continue;
-
-			/*
-			 * Set for reading sockets which are accepting
-			 */
-			if (so->so_state & SS_FACCEPTCONN) {
-                                FD_SET(so->s, readfds);
-				UPD_NFDS(so->s);
-				continue;
-			}
-
-			/*
-			 * Set for writing sockets which are connecting
-			 */
-			if (so->so_state & SS_ISFCONNECTING) {
-				FD_SET(so->s, writefds);
-				UPD_NFDS(so->s);
-				continue;
-			}
-
-			/*
-			 * Set for writing if we are connected, can send more, and
-			 * we have something to send
-			 */
-			if (CONN_CANFSEND(so) && so->so_rcv.sb_cc) {
-				FD_SET(so->s, writefds);
-				UPD_NFDS(so->s);
-			}
-
-			/*
-			 * Set for reading (and urgent data) if we are connected, can
-			 * receive more, and we have room for it XXX /2 ?
-			 */
-			if (CONN_CANFRCV(so) && (so->so_snd.sb_cc < (so->so_snd.sb_datalen/2))) {
+			so->so_events = sopollevents(so);
+			if (so->so_events & G_IO_IN)
 				FD_SET(so->s, readfds);
+			if (so->so_events & G_IO_OUT)
+				FD_SET(so->s, writefds);
+			if (so->so_events & G_IO_PRI)
 				FD_SET(so->s, xfds);
+			if (so->so_events)
 				UPD_NFDS(so->s);
-			}
 		}
 
 		/*
@@ -377,17 +497,8 @@ void slirp_select_fill(int *pnfds,
 					do_slowtimo = 1; /* Let socket expire */
 			}
 
-			/*
-			 * When UDP packets are received from over the
-			 * link, they're sendto()'d straight away, so
-			 * no need for setting for writing
-			 * Limit the number of packets queued by this session
-			 * to 4.  Note that even though we try and limit this
-			 * to 4 packets, the session could have more queued
-			 * if the packets needed to be fragmented
-			 * (XXX <= 4 ?)
-			 */
-			if ((so->so_state & SS_ISFCONNECTED) && so->so_queued <= 4) {
+			so->so_events = sopollevents(so);
+			if (so->so_events) {
 				FD_SET(so->s, readfds);
 				UPD_NFDS(so->s);
 			}
@@ -412,7 +523,8 @@ void slirp_select_fill(int *pnfds,
                         }
                     }
 
-                    if (so->so_state & SS_ISFCONNECTED) {
+                    so->so_events = sopollevents(so);
+                    if (so->so_events) {
                         FD_SET(so->s, readfds);
                         UPD_NFDS(so->s);
                     }
@@ -422,21 +534,41 @@ void slirp_select_fill(int *pnfds,
         *pnfds = nfds;
 }
 
+static void slirp_select_poll_list(struct socket *head, fd_set *readfds,
+                                   fd_set *writefds, fd_set *xfds)
+{
+    struct socket *so, *so_next;
+    int revents;
+
+    for (so = head->so_next; so != head; so = so_next) {
+        so_next = so->so_next;
+
+        /*
+         * FD_ISSET is meaningless on these sockets
+         * (and they can crash the program)
+         */
+        if (!so->so_events || so->s == -1) {
+            continue;
+        }
+        revents = (FD_ISSET(so->s, readfds) ? G_IO_IN : 0) |
+                  (FD_ISSET(so->s, writefds) ? G_IO_OUT : 0) |
+                  (FD_ISSET(so->s, xfds) ? G_IO_PRI : 0);
+        revents &= so->so_events;
+        if (revents) {
+            sopoll(so, revents);
+        }
+    }
+}
+
 void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds,
                        int select_error)
 {
     Slirp *slirp;
-    struct socket *so, *so_next;
-    int ret;
 
     if (QTAILQ_EMPTY(&slirp_instances)) {
         return;
     }
 
-    global_readfds = readfds;
-    global_writefds = writefds;
-    global_xfds = xfds;
-
     curtime = qemu_get_clock_ms(rt_clock);
 
     QTAILQ_FOREACH(slirp, &slirp_instances, entry) {
@@ -457,160 +589,18 @@ void slirp_select_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds,
 	 * Check sockets
 	 */
 	if (!select_error) {
-		/*
-		 * Check TCP sockets
-		 */
-		for (so = slirp->tcb.so_next; so != &slirp->tcb;
-		     so = so_next) {
-			so_next = so->so_next;
-
-			/*
-			 * FD_ISSET is meaningless on these sockets
-			 * (and they can crash the program)
-			 */
-			if (so->so_state & SS_NOFDREF || so->s == -1)
-			   continue;
-
-			/*
-			 * Check for URG data
-			 * This will soread as well, so no need to
-			 * test for readfds below if this succeeds
-			 */
-			if (FD_ISSET(so->s, xfds))
-			   sorecvoob(so);
-			/*
-			 * Check sockets for reading
-			 */
-			else if (FD_ISSET(so->s, readfds)) {
-				/*
-				 * Check for incoming connections
-				 */
-				if (so->so_state & SS_FACCEPTCONN) {
-					tcp_connect(so);
-					continue;
-				} /* else */
-				ret = soread(so);
-
-				/* Output it if we read something */
-				if (ret > 0)
-				   tcp_output(sototcpcb(so));
-			}
-
-			/*
-			 * Check sockets for writing
-			 */
-			if (FD_ISSET(so->s, writefds)) {
-			  /*
-			   * Check for non-blocking, still-connecting sockets
-			   */
-			  if (so->so_state & SS_ISFCONNECTING) {
-			    /* Connected */
-			    so->so_state &= ~SS_ISFCONNECTING;
-
-			    ret = send(so->s, (const void *) &ret, 0, 0);
-			    if (ret < 0) {
-			      /* XXXXX Must fix, zero bytes is a NOP */
-			      if (errno == EAGAIN || errno == EWOULDBLOCK ||
-				  errno == EINPROGRESS || errno == ENOTCONN)
-				continue;
-
-			      /* else failed */
-			      so->so_state &= SS_PERSISTENT_MASK;
-			      so->so_state |= SS_NOFDREF;
-			    }
-			    /* else so->so_state &= ~SS_ISFCONNECTING; */
-
-			    /*
-			     * Continue tcp_input
-			     */
-			    tcp_input((struct mbuf *)NULL, sizeof(struct ip), so);
-			    /* continue; */
-			  } else
-			    ret = sowrite(so);
-			  /*
-			   * XXXXX If we wrote something (a lot), there
-			   * could be a need for a window update.
-			   * In the worst case, the remote will send
-			   * a window probe to get things going again
-			   */
-			}
-
-			/*
-			 * Probe a still-connecting, non-blocking socket
-			 * to check if it's still alive
-	 	 	 */
-#ifdef PROBE_CONN
-			if (so->so_state & SS_ISFCONNECTING) {
-                          ret = qemu_recv(so->s, &ret, 0,0);
-
-			  if (ret < 0) {
-			    /* XXX */
-			    if (errno == EAGAIN || errno == EWOULDBLOCK ||
-				errno == EINPROGRESS || errno == ENOTCONN)
-			      continue; /* Still connecting, continue */
-
-			    /* else failed */
-			    so->so_state &= SS_PERSISTENT_MASK;
-			    so->so_state |= SS_NOFDREF;
-
-			    /* tcp_input will take care of it */
-			  } else {
-			    ret = send(so->s, &ret, 0,0);
-			    if (ret < 0) {
-			      /* XXX */
-			      if (errno == EAGAIN || errno == EWOULDBLOCK ||
-				  errno == EINPROGRESS || errno == ENOTCONN)
-				continue;
-			      /* else failed */
-			      so->so_state &= SS_PERSISTENT_MASK;
-			      so->so_state |= SS_NOFDREF;
-			    } else
-			      so->so_state &= ~SS_ISFCONNECTING;
-
-			  }
-			  tcp_input((struct mbuf *)NULL, sizeof(struct ip),so);
-			} /* SS_ISFCONNECTING */
-#endif
-		}
-
+		slirp_select_poll_list(&slirp->tcb, readfds, writefds, xfds);
 		/*
 		 * Now UDP sockets.
 		 * Incoming packets are sent straight away, they're not buffered.
 		 * Incoming UDP data isn't buffered either.
 		 */
-		for (so = slirp->udb.so_next; so != &slirp->udb;
-		     so = so_next) {
-			so_next = so->so_next;
-
-			if (so->s != -1 && FD_ISSET(so->s, readfds)) {
-                            sorecvfrom(so);
-                        }
-		}
-
-                /*
-                 * Check incoming ICMP relies.
-                 */
-                for (so = slirp->icmp.so_next; so != &slirp->icmp;
-                     so = so_next) {
-                     so_next = so->so_next;
-
-                    if (so->s != -1 && FD_ISSET(so->s, readfds)) {
-                        icmp_receive(so);
-                    }
-                }
+		slirp_select_poll_list(&slirp->udb, readfds, writefds, xfds);
+		slirp_select_poll_list(&slirp->icmp, readfds, writefds, xfds);
 	}
 
         if_start(slirp);
     }
-
-	/* clear global file descriptor sets.
-	 * these reside on the stack in vl.c
-	 * so they're unusable if we're not in
-	 * slirp_select_fill or slirp_select_poll.
-	 */
-	 global_readfds = NULL;
-	 global_writefds = NULL;
-	 global_xfds = NULL;
 }
 
 static void arp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
@@ -672,7 +662,13 @@ static void arp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
     }
 }
 
-void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
+void slirp_set_tso(Slirp *slirp, bool enable)
+{
+    slirp->tso = enable;
+}
+
+static void slirp_input_flags(Slirp *slirp, const uint8_t *pkt, int pkt_len,
+                              int flags)
 {
     struct mbuf *m;
     int proto;
@@ -698,6 +694,7 @@ void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
 
         m->m_data += 2 + ETH_HLEN;
         m->m_len -= 2 + ETH_HLEN;
+        m->m_flags |= flags;
 
         ip_input(m);
         break;
@@ -706,17 +703,28 @@ void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
     }
 }
 
+void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
+{
+    slirp_input_flags(slirp, pkt, pkt_len, 0);
+}
+
+void slirp_input_csum_valid(Slirp *slirp, const uint8_t *pkt, int pkt_len)
+{
+    slirp_input_flags(slirp, pkt, pkt_len, M_CSUM_VALID);
+}
+
 /* Output the IP packet to the ethernet device. Returns 0 if the packet must be
  * re-queued.
  */
 int if_encap(Slirp *slirp, struct mbuf *ifm)
 {
-    uint8_t buf[1600];
-    struct ethhdr *eh = (struct ethhdr *)buf;
+    uint8_t stack_buf[1600];
+    uint8_t *buf = stack_buf;
+    struct ethhdr *eh;
     uint8_t ethaddr[ETH_ALEN];
     const struct ip *iph = (const struct ip *)ifm->m_data;
 
-    if (ifm->m_len + ETH_HLEN > sizeof(buf)) {
+    if (ifm->m_len + ETH_HLEN > sizeof(stack_buf) && !slirp->tso) {
         return 1;
     }
 
@@ -758,13 +766,30 @@ int if_encap(Slirp *slirp, struct mbuf *ifm)
         }
         return 0;
     } else {
+        char *start = ifm->m_flags & M_EXT ? ifm->m_ext : ifm->m_dat;
+        bool in_place = ifm->m_data - start >= ETH_HLEN;
+
+        /* Most mbufs reserve IF_MAXLINKHDR in front of the IP header, so
+           the frame can be built without copying it.  Segmentation
+           offload frames that lack the room do not fit the stack buffer. */
+        if (in_place) {
+            buf = (uint8_t *)ifm->m_data - ETH_HLEN;
+        } else if (ifm->m_len + ETH_HLEN > sizeof(stack_buf)) {
+            buf = g_malloc(ifm->m_len + ETH_HLEN);
+        }
+        eh = (struct ethhdr *)buf;
         memcpy(eh->h_dest, ethaddr, ETH_ALEN);
         memcpy(eh->h_source, special_ethaddr, ETH_ALEN - 4);
         /* XXX: not correct */
         memcpy(&eh->h_source[2], &slirp->vhost_addr, 4);
         eh->h_proto = htons(ETH_P_IP);
-        memcpy(buf + sizeof(struct ethhdr), ifm->m_data, ifm->m_len);
+        if (!in_place) {
+            memcpy(buf + sizeof(struct ethhdr), ifm->m_data, ifm->m_len);
+        }
         slirp_output(slirp->opaque, buf, ifm->m_len + ETH_HLEN);
+        if (!in_place && buf != stack_buf) {
+            g_free(buf);
+        }
         return 1;
     }
 }
@@ -227,6 +227,12 @@ struct Slirp {
     struct mbuf if_batchq;  /* queue for non-interactive data */
     struct mbuf *next_m;    /* pointer to next mbuf to output */
     bool if_start_busy;     /* avoid if_start recursion */
+    bool tso;               /* guest segments large TCP frames itself */
+
+    /* main loop states */
+    QLIST_HEAD(, socket) dirty_sockets; /* events to recompute */
+    QEMUTimer *fasttimo_timer;
+    QEMUTimer *slowtimo_timer;
 
     /* ip states */
     struct ipq ipq;         /* ip reass. queue */
@@ -8,12 +8,16 @@
 #include "qemu-common.h"
 #include <slirp.h>
 #include "ip_icmp.h"
+#include "main-loop.h"
 #ifdef __sun__
 #include <sys/filio.h>
 #endif
 
 static void sofcantrcvmore(struct socket *so);
 static void sofcantsendmore(struct socket *so);
+#ifndef _WIN32
+static void sounwatch(struct socket *so);
+#endif
 
 struct socket *
 solookup(struct socket *head, struct in_addr laddr, u_int lport,
@@ -50,6 +54,7 @@ socreate(Slirp *slirp)
     memset(so, 0, sizeof(struct socket));
     so->so_state = SS_NOFDREF;
     so->s = -1;
+    so->so_pollfd = -1;
     so->slirp = slirp;
   }
   return(so);
@@ -76,6 +81,13 @@ sofree(struct socket *so)
   }
   m_free(so->so_m);
 
+#ifndef _WIN32
+  sounwatch(so);
+#endif
+  if (so->so_dirty) {
+    QLIST_REMOVE(so, so_dirty_entry);
+  }
+
   if(so->so_next && so->so_prev)
     remque(so);  /* crashes if so is not in a queue */
 
@@ -680,9 +692,7 @@ sofcantrcvmore(struct socket *so)
 {
 	if ((so->so_state & SS_NOFDREF) == 0) {
 		shutdown(so->s,0);
-		if(global_writefds) {
-		  FD_CLR(so->s,global_writefds);
-		}
+		so->so_revents &= ~G_IO_OUT;
 	}
 	so->so_state &= ~(SS_ISFCONNECTING);
 	if (so->so_state & SS_FCANTSENDMORE) {
@@ -698,12 +708,7 @@ sofcantsendmore(struct socket *so)
 {
 	if ((so->so_state & SS_NOFDREF) == 0) {
             shutdown(so->s,1);           /* send FIN to fhost */
-            if (global_readfds) {
-                FD_CLR(so->s,global_readfds);
-            }
-            if (global_xfds) {
-                FD_CLR(so->s,global_xfds);
-            }
+            so->so_revents &= ~(G_IO_IN | G_IO_PRI);
 	}
 	so->so_state &= ~(SS_ISFCONNECTING);
 	if (so->so_state & SS_FCANTRCVMORE) {
@@ -726,3 +731,224 @@ sofwdrain(struct socket *so)
 	else
 		sofcantsendmore(so);
 }
+
+/*
+ * The G_IO_* events a socket waits for in its current state
+ */
+int
+sopollevents(struct socket *so)
+{
+	int events = 0;
+
+	if (so->so_tcpcb == NULL) {
+		/*
+		 * When UDP packets are received from over the
+		 * link, they're sendto()'d straight away, so
+		 * no need for setting for writing
+		 * Limit the number of packets queued by this session
+		 * to 4.  Note that even though we try and limit this
+		 * to 4 packets, the session could have more queued
+		 * if the packets needed to be fragmented
+		 * (XXX <= 4 ?)
+		 */
+		if (so->s != -1 && (so->so_state & SS_ISFCONNECTED) &&
+		    (so->so_icmpsock || so->so_queued <= 4))
+			events = G_IO_IN;
+		return events;
+	}
+
+	/*
+	 * NOFDREF can include still connecting to local-host,
+	 * newly socreated() sockets etc. Don't want to select these.
+	 */
+	if (so->so_state & SS_NOFDREF || so->s == -1)
+		return 0;
+
+	/*
+	 * Set for reading sockets which are accepting
+	 */
+	if (so->so_state & SS_FACCEPTCONN)
+		return G_IO_IN;
+
+	/*
+	 * Set for writing sockets which are connecting
+	 */
+	if (so->so_state & SS_ISFCONNECTING)
+		return G_IO_OUT;
+
+	/*
+	 * Set for writing if we are connected, can send more, and
+	 * we have something to send
+	 */
+	if (CONN_CANFSEND(so) && so->so_rcv.sb_cc)
+		events |= G_IO_OUT;
+
+	/*
+	 * Set for reading (and urgent data) if we are connected, can
+	 * receive more, and we have room for it XXX /2 ?
+	 */
+	if (CONN_CANFRCV(so) && (so->so_snd.sb_cc < (so->so_snd.sb_datalen/2)))
+		events |= G_IO_IN | G_IO_PRI;
+
+	return events;
+}
+
+/*
+ * Handle the G_IO_* events reported for a socket.  Errors and hangups
+ * must already have been folded into G_IO_IN and G_IO_OUT, as select()
+ * does.
+ */
+void
+sopoll(struct socket *so, int revents)
+{
+	int ret;
+
+	so->so_revents = revents;
+	sodirty(so);
+
+	/*
+	 * Incoming UDP packets and ICMP replies are sent straight away,
+	 * they're not buffered.
+	 */
+	if (so->so_tcpcb == NULL) {
+		if (so->so_revents & G_IO_IN) {
+			if (so->so_icmpsock)
+				icmp_receive(so);
+			else
+				sorecvfrom(so);
+		}
+		return;
+	}
+
+	/*
+	 * Check for URG data
+	 * This will soread as well, so no need to
+	 * test for reading below if this succeeds
+	 */
+	if (so->so_revents & G_IO_PRI)
+		sorecvoob(so);
+	/*
+	 * Check sockets for reading
+	 */
+	else if (so->so_revents & G_IO_IN) {
+		/*
+		 * Check for incoming connections
+		 */
+		if (so->so_state & SS_FACCEPTCONN) {
+			tcp_connect(so);
+			return;
+		}
+		ret = soread(so);
+
+		/* Output it if we read something */
+		if (ret > 0)
+			tcp_output(sototcpcb(so));
+	}
+
+	/*
+	 * Check sockets for writing
+	 */
+	if (so->so_revents & G_IO_OUT) {
+		/*
+		 * Check for non-blocking, still-connecting sockets
+		 */
+		if (so->so_state & SS_ISFCONNECTING) {
+			/* Connected */
+			so->so_state &= ~SS_ISFCONNECTING;
+
+			ret = send(so->s, (const void *) &ret, 0, 0);
+			if (ret < 0) {
+				/* XXXXX Must fix, zero bytes is a NOP */
+				if (errno == EAGAIN || errno == EWOULDBLOCK ||
+				    errno == EINPROGRESS || errno == ENOTCONN)
+					return;
+
+				/* else failed */
+				so->so_state &= SS_PERSISTENT_MASK;
+				so->so_state |= SS_NOFDREF;
+			}
+			/* else so->so_state &= ~SS_ISFCONNECTING; */
+
+			/*
+			 * Continue tcp_input
+			 */
+			tcp_input((struct mbuf *)NULL, sizeof(struct ip), so);
+		} else
+			sowrite(so);
+		/*
+		 * XXXXX If we wrote something (a lot), there
+		 * could be a need for a window update.
+		 * In the worst case, the remote will send
+		 * a window probe to get things going again
+		 */
+	}
+}
+
+/*
+ * Queue a socket whose events may have changed, so that the main loop
+ * only looks at sockets that something happened to.
+ */
+void
+sodirty(struct socket *so)
+{
+#ifndef _WIN32
+	if (!so->so_dirty) {
+		so->so_dirty = true;
+		QLIST_INSERT_HEAD(&so->slirp->dirty_sockets, so, so_dirty_entry);
+	}
+#endif
+}
+
+#ifndef _WIN32
+/* Sockets by descriptor, to dispatch the descriptors the main loop
+ * reports as ready.  Entries are shared by all slirp instances. */
+static struct socket **so_fd_table;
+static int so_fd_table_nr;
+
+static void
+sounwatch(struct socket *so)
+{
+	int fd = so->so_pollfd;
+
+	/* the descriptor may have been closed and reused by another socket */
+	if (fd >= 0 && so_fd_table[fd] == so) {
+		so_fd_table[fd] = NULL;
+		main_loop_poll_set_events(fd, MAIN_LOOP_POLL_SLIRP, 0);
+	}
+	so->so_pollfd = -1;
+	so->so_events = 0;
+}
+
+/*
+ * Declare the events the socket now waits for to the main loop
+ */
+void
+sowatch(struct socket *so)
+{
+	int events = sopollevents(so);
+
+	if (so->so_pollfd != (events ? so->s : -1))
+		sounwatch(so);
+	if (!events)
+		return;
+
+	if (so->s >= so_fd_table_nr) {
+		int nr = MAX(MAX(so_fd_table_nr * 2, 64), so->s + 1);
+
+		so_fd_table = g_renew(struct socket *, so_fd_table, nr);
+		memset(so_fd_table + so_fd_table_nr, 0,
+		       (nr - so_fd_table_nr) * sizeof(*so_fd_table));
+		so_fd_table_nr = nr;
+	}
+	so_fd_table[so->s] = so;
+	so->so_pollfd = so->s;
+	so->so_events = events;
+	main_loop_poll_set_events(so->s, MAIN_LOOP_POLL_SLIRP, events);
+}
+
+struct socket *
+solookup_fd(int fd)
+{
+	return fd < so_fd_table_nr ? so_fd_table[fd] : NULL;
+}
+#endif
@@ -51,6 +51,13 @@ struct socket {
   struct sbuf so_rcv;		/* Receive buffer */
   struct sbuf so_snd;		/* Send buffer */
   void * extra;			/* Extra pointer */
+
+  bool so_icmpsock;		/* Datagram ICMP socket on the icmp list */
+  int so_pollfd;		/* Descriptor watched by the main loop, or -1 */
+  int so_events;		/* G_IO_* events it is watched for */
+  int so_revents;		/* Events being dispatched */
+  bool so_dirty;		/* On the dirty list */
+  QLIST_ENTRY(socket) so_dirty_entry; /* Sockets whose events may have changed */
 };
 
 
@@ -74,6 +81,9 @@ struct socket {
 #define SS_HOSTFWD		0x1000	/* Socket describes host->guest forwarding */
 #define SS_INCOMING		0x2000	/* Connection was initiated by a host on the internet */
 
+#define CONN_CANFSEND(so) (((so)->so_state & (SS_FCANTSENDMORE|SS_ISFCONNECTED)) == SS_ISFCONNECTED)
+#define CONN_CANFRCV(so) (((so)->so_state & (SS_FCANTRCVMORE|SS_ISFCONNECTED)) == SS_ISFCONNECTED)
+
 struct socket * solookup(struct socket *, struct in_addr, u_int, struct in_addr, u_int);
 struct socket * socreate(Slirp *);
 void sofree(struct socket *);
@@ -91,5 +101,12 @@ void sofwdrain(struct socket *);
 struct iovec; /* For win32 */
 size_t sopreprbuf(struct socket *so, struct iovec *iov, int *np);
 int soreadbuf(struct socket *so, const char *buf, int size);
+int sopollevents(struct socket *so);
+void sopoll(struct socket *so, int revents);
+void sodirty(struct socket *so);
+#ifndef _WIN32
+void sowatch(struct socket *so);
+struct socket *solookup_fd(int fd);
+#endif
 
 #endif /* _SOCKET_H_ */
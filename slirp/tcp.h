@@ -41,6 +41,10 @@ typedef	uint32_t tcp_seq;
 #define TCP_SNDSPACE 8192
 #define TCP_RCVSPACE 8192
 
+/* Socket buffers and largest segment when the guest does segmentation */
+#define TCP_TSO_SPACE  65535
+#define TCP_TSO_MAXSEG (IP_MAXPACKET - 40 - 32) /* less headers and options */
+
 /*
  * TCP header.
  * Per RFC 793, September, 1981.
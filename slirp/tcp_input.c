@@ -282,7 +282,7 @@ tcp_input(struct mbuf *m, int iphlen, struct socket *inso)
 	ti->ti_x1 = 0;
 	ti->ti_len = htons((uint16_t)tlen);
 	len = sizeof(struct ip ) + tlen;
-	if(cksum(m, len)) {
+	if (!(m->m_flags & M_CSUM_VALID) && cksum(m, len)) {
 	  goto drop;
 	}
 
@@ -379,6 +379,7 @@ findso:
 	  tp = sototcpcb(so);
 	  tp->t_state = TCPS_LISTEN;
 	}
+	sodirty(so);
 
         /*
          * If this is a still-connecting socket, this probably
@@ -1456,7 +1457,7 @@ int
 tcp_mss(struct tcpcb *tp, u_int offer)
 {
 	struct socket *so = tp->t_socket;
-	int mss;
+	int mss, sndspace, rcvspace;
 
 	DEBUG_CALL("tcp_mss");
 	DEBUG_ARG("tp = %lx", (long)tp);
@@ -1471,12 +1472,12 @@ tcp_mss(struct tcpcb *tp, u_int offer)
 
 	tp->snd_cwnd = mss;
 
-	sbreserve(&so->so_snd, TCP_SNDSPACE + ((TCP_SNDSPACE % mss) ?
-                                               (mss - (TCP_SNDSPACE % mss)) :
-                                               0));
-	sbreserve(&so->so_rcv, TCP_RCVSPACE + ((TCP_RCVSPACE % mss) ?
-                                               (mss - (TCP_RCVSPACE % mss)) :
-                                               0));
+	sndspace = so->slirp->tso ? TCP_TSO_SPACE : TCP_SNDSPACE;
+	rcvspace = so->slirp->tso ? TCP_TSO_SPACE : TCP_RCVSPACE;
+	sbreserve(&so->so_snd, sndspace + ((sndspace % mss) ?
+                                           (mss - (sndspace % mss)) : 0));
+	sbreserve(&so->so_rcv, rcvspace + ((rcvspace % mss) ?
+                                           (mss - (rcvspace % mss)) : 0));
 
 	DEBUG_MISC((dfd, " returning mss = %d\n", mss));
 
@@ -63,11 +63,13 @@ tcp_output(struct tcpcb *tp)
 	register struct tcpiphdr *ti;
 	u_char opt[MAX_TCPOPTLEN];
 	unsigned optlen, hdrlen;
-	int idle, sendalot;
+	int idle, sendalot, maxseg;
 
 	DEBUG_CALL("tcp_output");
 	DEBUG_ARG("tp = %lx", (long )tp);
 
+	sodirty(so);
+
 	/*
 	 * Determine length of data that should be transmitted,
 	 * and flags that will be used.
@@ -144,8 +146,10 @@ again:
 		}
 	}
 
-	if (len > tp->t_maxseg) {
-		len = tp->t_maxseg;
+	/* with segmentation offload the guest cuts the segment to t_maxseg */
+	maxseg = so->slirp->tso ? TCP_TSO_MAXSEG : tp->t_maxseg;
+	if (len > maxseg) {
+		len = maxseg;
 		sendalot = 1;
 	}
 	if (SEQ_LT(tp->snd_nxt + len, tp->snd_una + so->so_snd.sb_cc))
@@ -164,7 +168,7 @@ again:
 	 * to send into a small window), then must resend.
 	 */
 	if (len) {
-		if (len == tp->t_maxseg)
+		if (len >= tp->t_maxseg)
 			goto send;
 		if ((1 || idle || tp->t_flags & TF_NODELAY) &&
 		    len + off >= so->so_snd.sb_cc)
@@ -280,8 +284,8 @@ send:
 	 * Adjust data length if insertion of options will
 	 * bump the packet length beyond the t_maxseg length.
 	 */
-	 if (len > tp->t_maxseg - optlen) {
-		len = tp->t_maxseg - optlen;
+	 if (len > maxseg - optlen) {
+		len = maxseg - optlen;
 		sendalot = 1;
 	 }
 
@@ -298,6 +302,9 @@ send:
 		}
 		m->m_data += IF_MAXLINKHDR;
 		m->m_len = hdrlen;
+		if (M_FREEROOM(m) < len) {
+			m_inc(m, IF_MAXLINKHDR + hdrlen + len);
+		}
 
 		sbcopy(&so->so_snd, off, (int) len, mtod(m, caddr_t) + hdrlen);
 		m->m_len += len;
@@ -473,6 +473,7 @@ tcp_attach(struct socket *so)
 	   return -1;
 
 	insque(so, &so->slirp->tcb);
+	sodirty(so);
 
 	return 0;
 }
@@ -116,7 +116,7 @@ udp_input(register struct mbuf *m, int iphlen)
 	/*
 	 * Checksum extended UDP header and data.
 	 */
-	if (uh->uh_sum) {
+	if (uh->uh_sum && !(m->m_flags & M_CSUM_VALID)) {
       memset(&((struct ipovly *)ip)->ih_mbuf, 0, sizeof(struct mbuf_ptr));
 	  ((struct ipovly *)ip)->ih_x1 = 0;
 	  ((struct ipovly *)ip)->ih_len = uh->uh_ulen;
@@ -315,6 +315,7 @@ udp_attach(struct socket *so)
   if((so->s = qemu_socket(AF_INET,SOCK_DGRAM,0)) != -1) {
     so->so_expire = curtime + SO_EXPIRE;
     insque(so, &so->slirp->udb);
+    sodirty(so);
   }
   return(so->s);
 }
@@ -363,6 +364,7 @@ udp_listen(Slirp *slirp, uint32_t haddr, u_int hport, uint32_t laddr,
 	so->s = qemu_socket(AF_INET,SOCK_DGRAM,0);
 	so->so_expire = curtime + SO_EXPIRE;
 	insque(so, &slirp->udb);
+	sodirty(so);
 
 	addr.sin_family = AF_INET;
 	addr.sin_addr.s_addr = haddr;
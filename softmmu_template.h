@@ -64,7 +64,7 @@ static inline DATA_TYPE glue(io_read, SUFFIX)(CPUArchState *env,
                                               uintptr_t retaddr)
 {
     DATA_TYPE res;
-    MemoryRegion *mr = iotlb_to_region(physaddr);
+    MemoryRegion *mr = iotlb_to_region(env, physaddr);
 
     physaddr = (physaddr & TARGET_PAGE_MASK) + addr;
     env->mem_io_pc = retaddr;
@@ -143,7 +143,10 @@ glue(glue(helper_ld, SUFFIX), MMUSUFFIX)(CPUArchState *env, target_ulong addr,
         if ((addr & (DATA_SIZE - 1)) != 0)
             do_unaligned_access(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
 #endif
-        tlb_fill(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
+        tb_profile_tlb_miss(retaddr);
+        if (!tlb_victim_lookup(env, addr, READ_ACCESS_TYPE, mmu_idx)) {
+            tlb_fill(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
+        }
         goto redo;
     }
     return res;
@@ -195,7 +198,10 @@ glue(glue(slow_ld, SUFFIX), MMUSUFFIX)(CPUArchState *env,
         }
     } else {
         /* the page is not in the TLB : fill it */
-        tlb_fill(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
+        tb_profile_tlb_miss(retaddr);
+        if (!tlb_victim_lookup(env, addr, READ_ACCESS_TYPE, mmu_idx)) {
+            tlb_fill(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
+        }
         goto redo;
     }
     return res;
@@ -215,7 +221,7 @@ static inline void glue(io_write, SUFFIX)(CPUArchState *env,
                                           target_ulong addr,
                                           uintptr_t retaddr)
 {
-    MemoryRegion *mr = iotlb_to_region(physaddr);
+    MemoryRegion *mr = iotlb_to_region(env, physaddr);
 
     physaddr = (physaddr & TARGET_PAGE_MASK) + addr;
     if (mr != &io_mem_ram && mr != &io_mem_rom
@@ -288,7 +294,10 @@ void glue(glue(helper_st, SUFFIX), MMUSUFFIX)(CPUArchState *env,
         if ((addr & (DATA_SIZE - 1)) != 0)
             do_unaligned_access(env, addr, 1, mmu_idx, retaddr);
 #endif
-        tlb_fill(env, addr, 1, mmu_idx, retaddr);
+        tb_profile_tlb_miss(retaddr);
+        if (!tlb_victim_lookup(env, addr, 1, mmu_idx)) {
+            tlb_fill(env, addr, 1, mmu_idx, retaddr);
+        }
         goto redo;
     }
 }
@@ -338,7 +347,10 @@ static void glue(glue(slow_st, SUFFIX), MMUSUFFIX)(CPUArchState *env,
         }
     } else {
         /* the page is not in the TLB : fill it */
-        tlb_fill(env, addr, 1, mmu_idx, retaddr);
+        tb_profile_tlb_miss(retaddr);
+        if (!tlb_victim_lookup(env, addr, 1, mmu_idx)) {
+            tlb_fill(env, addr, 1, mmu_idx, retaddr);
+        }
         goto redo;
     }
 }
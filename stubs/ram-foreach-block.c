@@ -0,0 +1,6 @@
+#include "qemu-common.h"
+#include "cpu-common.h"
+
+void qemu_ram_foreach_block(RAMBlockIterFunc func, void *opaque)
+{
+}
@@ -0,0 +1,9 @@
+#include "qemu-common.h"
+#include "qmp-commands.h"
+#include "qerror.h"
+
+VirtioCountersList *qmp_query_virtio_counters(Error **errp)
+{
+    error_set(errp, QERR_NOT_SUPPORTED);
+    return NULL;
+}
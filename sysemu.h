@@ -65,10 +65,24 @@ void qemu_remove_exit_notifier(Notifier *notify);
 
 void qemu_add_machine_init_done_notifier(Notifier *notify);
 
+/* The notifier data of a hotplugged CPU is a pointer to its int64_t id,
+ * which on PCs is the APIC id.
+ */
+void qemu_register_cpu_added_notifier(Notifier *notifier);
+
+/* Record the end of a startup phase of main(), and the first entry of any
+ * vCPU into guest code, for -machine startup-trace=on and query-startup.
+ */
+void qemu_startup_phase(const char *name);
+void qemu_startup_first_insn(void);
+void qemu_cpu_added(int64_t id);
+
 void do_savevm(Monitor *mon, const QDict *qdict);
 int load_vmstate(const char *name);
 void do_delvm(Monitor *mon, const QDict *qdict);
 void do_info_snapshots(Monitor *mon);
+bool savevm_live_active(void);
+bool dump_in_progress(void);
 
 void qemu_announce_self(void);
 
@@ -78,6 +92,10 @@ int qemu_savevm_state_begin(QEMUFile *f,
 int qemu_savevm_state_iterate(QEMUFile *f);
 int qemu_savevm_state_complete(QEMUFile *f);
 void qemu_savevm_state_cancel(QEMUFile *f);
+bool qemu_savevm_state_postcopy_supported(void);
+int qemu_savevm_state_postcopy(QEMUFile *f);
+int qemu_savevm_state_postcopy_iterate(QEMUFile *f);
+int qemu_savevm_state_postcopy_complete(QEMUFile *f);
 int qemu_loadvm_state(QEMUFile *f);
 
 /* SLIRP */
@@ -111,6 +129,7 @@ extern const char *keyboard_layout;
 extern int win2k_install_hack;
 extern int alt_grab;
 extern int ctrl_grab;
+extern int sdl_opengl;
 extern int smp_cpus;
 extern int max_cpus;
 extern int cursor_hide;
@@ -130,6 +149,13 @@ extern QEMUClock *rtc_clock;
 extern int nb_numa_nodes;
 extern uint64_t node_mem[MAX_NODES];
 extern unsigned long *node_cpumask[MAX_NODES];
+/* threads used to fault in preallocated guest memory */
+extern int mem_prealloc_threads;
+extern bool fast_boot;
+
+#define MAX_HOST_CPUS 1024
+/* host CPUs the vCPUs of a node are pinned to, or NULL */
+extern unsigned long *node_host_cpumask[MAX_NODES];
 
 #define MAX_OPTION_ROMS 16
 typedef struct QEMUOptionRom {
@@ -18,6 +18,7 @@
  */
 #include "cpu.h"
 #include "helper.h"
+#include "main-loop.h"
 
 #define SIGNBIT (uint32_t)0x80000000
 #define SIGNBIT64 ((uint64_t)1 << 63)
@@ -91,6 +92,100 @@ void tlb_fill(CPUARMState *env, target_ulong addr, int is_write, int mmu_idx,
         raise_exception(env, env->exception_index);
     }
 }
+
+/* Store exclusive for multi-threaded TCG.  Other vCPUs run at the same
+   time, so compare memory with the value seen by the load exclusive and
+   store the new one with a single host atomic operation.  Returns 0 if
+   the store was done and 1 otherwise, like the instruction.  */
+uint32_t HELPER(strex)(CPUARMState *env, uint32_t addr, uint32_t size,
+                       uint64_t val)
+{
+    int mmu_idx = cpu_mmu_index(env);
+    int index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    uint64_t oldval;
+    target_ulong tlb_addr;
+    void *host;
+    uint32_t ret;
+    bool locked;
+
+    if (env->exclusive_addr != addr) {
+        return 1;
+    }
+    oldval = ((uint64_t)env->exclusive_high << 32) | env->exclusive_val;
+
+    tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
+    if ((addr & TARGET_PAGE_MASK) !=
+        (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+        tlb_fill(env, addr, 1, mmu_idx, GETPC());
+        tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
+    }
+
+    if (!(tlb_addr & ~TARGET_PAGE_MASK) && !(addr & ((1 << size) - 1))) {
+        host = (void *)((uintptr_t)addr +
+                        env->tlb_table[mmu_idx][index].addend);
+        switch (size) {
+        case 0:
+            return !__sync_bool_compare_and_swap((uint8_t *)host,
+                                                 (uint8_t)oldval,
+                                                 (uint8_t)val);
+        case 1:
+            return !__sync_bool_compare_and_swap((uint16_t *)host,
+                                                 tswap16(oldval),
+                                                 tswap16(val));
+        case 2:
+            return !__sync_bool_compare_and_swap((uint32_t *)host,
+                                                 tswap32(oldval),
+                                                 tswap32(val));
+        case 3:
+            return !__sync_bool_compare_and_swap((uint64_t *)host,
+                                                 tswap64(oldval),
+                                                 tswap64(val));
+        default:
+            abort();
+        }
+    }
+
+    /* I/O, watched and not yet dirty pages take the slow path, which the
+       global mutex serialises against device emulation and other slow
+       path store exclusives.  */
+    locked = qemu_mutex_lock_iothread_vcpu();
+    switch (size) {
+    case 0:
+        ret = cpu_ldub_data(env, addr) != (uint8_t)oldval;
+        break;
+    case 1:
+        ret = cpu_lduw_data(env, addr) != (uint16_t)oldval;
+        break;
+    case 2:
+        ret = cpu_ldl_data(env, addr) != (uint32_t)oldval;
+        break;
+    case 3:
+        ret = cpu_ldl_data(env, addr) != (uint32_t)oldval ||
+              cpu_ldl_data(env, addr + 4) != (uint32_t)(oldval >> 32);
+        break;
+    default:
+        abort();
+    }
+    if (!ret) {
+        switch (size) {
+        case 0:
+            cpu_stb_data(env, addr, val);
+            break;
+        case 1:
+            cpu_stw_data(env, addr, val);
+            break;
+        case 2:
+            cpu_stl_data(env, addr, val);
+            break;
+        case 3:
+            cpu_stl_data(env, addr, val);
+            cpu_stl_data(env, addr + 4, val >> 32);
+            break;
+        }
+    }
+    qemu_mutex_unlock_iothread_vcpu(locked);
+    return ret;
+}
 #endif
 
 uint32_t HELPER(add_setq)(CPUARMState *env, uint32_t a, uint32_t b)
@@ -765,7 +765,7 @@ static inline void gen_bx_im(DisasContext *s, uint32_t addr)
 /* Set PC and Thumb state from var.  var is marked as dead.  */
 static inline void gen_bx(DisasContext *s, TCGv var)
 {
-    s->is_jmp = DISAS_UPDATE;
+    s->is_jmp = DISAS_JUMP;
     tcg_gen_andi_i32(cpu_R[15], var, ~1);
     tcg_gen_andi_i32(var, var, 1);
     store_cpu_field(var, thumb);
@@ -855,6 +855,14 @@ static inline void gen_st64(TCGv_i64 val, TCGv addr, int index)
     tcg_temp_free_i64(val);
 }
 
+/* The reginfo lives on the heap, so the TB cannot be reused by
+   another process.  */
+static TCGv_ptr gen_const_reginfo(const ARMCPRegInfo *ri)
+{
+    tcg_mark_host_ptr(&tcg_ctx);
+    return tcg_const_ptr(ri);
+}
+
 static inline void gen_set_pc_im(uint32_t val)
 {
     tcg_gen_movi_i32(cpu_R[15], val);
@@ -3519,8 +3527,8 @@ static void gen_nop_hint(DisasContext *s, int val)
 static inline void gen_neon_add(int size, TCGv t0, TCGv t1)
 {
     switch (size) {
-    case 0: gen_helper_neon_add_u8(t0, t0, t1); break;
-    case 1: gen_helper_neon_add_u16(t0, t0, t1); break;
+    case 0: tcg_gen_vec_add8_i32(t0, t0, t1); break;
+    case 1: tcg_gen_vec_add16_i32(t0, t0, t1); break;
     case 2: tcg_gen_add_i32(t0, t0, t1); break;
     default: abort();
     }
@@ -3529,8 +3537,8 @@ static inline void gen_neon_add(int size, TCGv t0, TCGv t1)
 static inline void gen_neon_rsb(int size, TCGv t0, TCGv t1)
 {
     switch (size) {
-    case 0: gen_helper_neon_sub_u8(t0, t1, t0); break;
-    case 1: gen_helper_neon_sub_u16(t0, t1, t0); break;
+    case 0: tcg_gen_vec_sub8_i32(t0, t1, t0); break;
+    case 1: tcg_gen_vec_sub16_i32(t0, t1, t0); break;
     case 2: tcg_gen_sub_i32(t0, t1, t0); break;
     default: return;
     }
@@ -4711,8 +4719,8 @@ static int disas_neon_data_insn(CPUARMState * env, DisasContext *s, uint32_t ins
                 gen_neon_add(size, tmp, tmp2);
             } else { /* VSUB */
                 switch (size) {
-                case 0: gen_helper_neon_sub_u8(tmp, tmp, tmp2); break;
-                case 1: gen_helper_neon_sub_u16(tmp, tmp, tmp2); break;
+                case 0: tcg_gen_vec_sub8_i32(tmp, tmp, tmp2); break;
+                case 1: tcg_gen_vec_sub16_i32(tmp, tmp, tmp2); break;
                 case 2: tcg_gen_sub_i32(tmp, tmp, tmp2); break;
                 default: abort();
                 }
@@ -5945,7 +5953,7 @@ static int disas_neon_data_insn(CPUARMState * env, DisasContext *s, uint32_t ins
                             switch (size) {
                             case 0: gen_helper_neon_clz_u8(tmp, tmp); break;
                             case 1: gen_helper_neon_clz_u16(tmp, tmp); break;
-                            case 2: gen_helper_clz(tmp, tmp); break;
+                            case 2: tcg_gen_clz_i32(tmp, tmp); break;
                             default: abort();
                             }
                             break;
@@ -6285,7 +6293,7 @@ static int disas_coproc_insn(CPUARMState * env, DisasContext *s, uint32_t insn)
                     TCGv_ptr tmpptr;
                     gen_set_pc_im(s->pc);
                     tmp64 = tcg_temp_new_i64();
-                    tmpptr = tcg_const_ptr(ri);
+                    tmpptr = gen_const_reginfo(ri);
                     gen_helper_get_cp_reg64(tmp64, cpu_env, tmpptr);
                     tcg_temp_free_ptr(tmpptr);
                 } else {
@@ -6308,7 +6316,7 @@ static int disas_coproc_insn(CPUARMState * env, DisasContext *s, uint32_t insn)
                     TCGv_ptr tmpptr;
                     gen_set_pc_im(s->pc);
                     tmp = tcg_temp_new_i32();
-                    tmpptr = tcg_const_ptr(ri);
+                    tmpptr = gen_const_reginfo(ri);
                     gen_helper_get_cp_reg(tmp, cpu_env, tmpptr);
                     tcg_temp_free_ptr(tmpptr);
                 } else {
@@ -6340,7 +6348,7 @@ static int disas_coproc_insn(CPUARMState * env, DisasContext *s, uint32_t insn)
                 tcg_temp_free_i32(tmplo);
                 tcg_temp_free_i32(tmphi);
                 if (ri->writefn) {
-                    TCGv_ptr tmpptr = tcg_const_ptr(ri);
+                    TCGv_ptr tmpptr = gen_const_reginfo(ri);
                     gen_set_pc_im(s->pc);
                     gen_helper_set_cp_reg64(cpu_env, tmpptr, tmp64);
                     tcg_temp_free_ptr(tmpptr);
@@ -6354,7 +6362,7 @@ static int disas_coproc_insn(CPUARMState * env, DisasContext *s, uint32_t insn)
                     TCGv_ptr tmpptr;
                     gen_set_pc_im(s->pc);
                     tmp = load_reg(s, rt);
-                    tmpptr = tcg_const_ptr(ri);
+                    tmpptr = gen_const_reginfo(ri);
                     gen_helper_set_cp_reg(cpu_env, tmpptr, tmp);
                     tcg_temp_free_ptr(tmpptr);
                     tcg_temp_free_i32(tmp);
@@ -6440,8 +6448,9 @@ static void gen_logicq_cc(TCGv_i64 val)
    regular stores.
 
    In system emulation mode only one CPU will be running at once, so
-   this sequence is effectively atomic.  In user emulation mode we
-   throw an exception and handle the atomic operation elsewhere.  */
+   this sequence is effectively atomic, except with multi-threaded TCG
+   where the store is done by an atomic helper.  In user emulation mode
+   we throw an exception and handle the atomic operation elsewhere.  */
 static void gen_load_exclusive(DisasContext *s, int rt, int rt2,
                                TCGv addr, int size)
 {
@@ -6496,6 +6505,22 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
     int done_label;
     int fail_label;
 
+    if (tcg_multithread) {
+        TCGv_i64 val = tcg_temp_new_i64();
+        TCGv tmp2;
+
+        tmp = load_reg(s, rt);
+        tmp2 = size == 3 ? load_reg(s, rt2) : tcg_const_i32(0);
+        tcg_gen_concat_i32_i64(val, tmp, tmp2);
+        tcg_temp_free_i32(tmp2);
+        tcg_gen_movi_i32(tmp, size);
+        gen_helper_strex(cpu_R[rd], cpu_env, addr, tmp, val);
+        tcg_temp_free_i32(tmp);
+        tcg_temp_free_i64(val);
+        tcg_gen_movi_i32(cpu_exclusive_addr, -1);
+        return;
+    }
+
     /* if (env->exclusive_addr == addr && env->exclusive_val == [addr]) {
          [addr] = {Rt};
          {Rd} = 0;
@@ -6867,7 +6892,7 @@ static void disas_arm_insn(CPUARMState * env, DisasContext *s)
                 ARCH(5);
                 rd = (insn >> 12) & 0xf;
                 tmp = load_reg(s, rm);
-                gen_helper_clz(tmp, tmp);
+                tcg_gen_clz_i32(tmp, tmp);
                 store_reg(s, rd, tmp);
             } else {
                 goto illegal_op;
@@ -8356,7 +8381,7 @@ static int disas_thumb2_insn(CPUARMState *env, DisasContext *s, uint16_t insn_hw
                     tcg_temp_free_i32(tmp2);
                     break;
                 case 0x18: /* clz */
-                    gen_helper_clz(tmp, tmp);
+                    tcg_gen_clz_i32(tmp, tmp);
                     break;
                 default:
                     goto illegal_op;
@@ -9936,8 +9961,19 @@ static inline void gen_intermediate_code_internal(CPUARMState *env,
         case DISAS_NEXT:
             gen_goto_tb(dc, 1, dc->pc);
             break;
-        default:
         case DISAS_JUMP:
+            /* indirect branch: look up the next TB without going back
+               to the main loop if possible */
+            if (TCG_TARGET_HAS_goto_ptr) {
+                TCGv_ptr ptr = tcg_temp_new_ptr();
+
+                gen_helper_lookup_tb_ptr(ptr, cpu_env);
+                tcg_gen_goto_ptr(ptr);
+                tcg_temp_free_ptr(ptr);
+                break;
+            }
+            /* fallthrough */
+        default:
         case DISAS_UPDATE:
             /* indicate that the hash table must be used to find the next TB */
             tcg_gen_exit_tb(0);
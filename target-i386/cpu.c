@@ -1349,6 +1349,12 @@ static int cpu_x86_find_by_name(x86_def_t *x86_cpu_def, const char *cpu_model)
             hyperv_enable_relaxed_timing(true);
         } else if (!strcmp(featurestr, "hv_vapic")) {
             hyperv_enable_vapic_recommended(true);
+        } else if (!strcmp(featurestr, "hv_time")) {
+            hyperv_enable_time(true);
+        } else if (!strcmp(featurestr, "hv_synic")) {
+            hyperv_enable_synic(true);
+        } else if (!strcmp(featurestr, "hv_stimer")) {
+            hyperv_enable_stimer(true);
         } else {
             fprintf(stderr, "feature string `%s' not in format (+feature|-feature|feature=xyz)\n", featurestr);
             goto error;
@@ -1954,6 +1960,10 @@ static void x86_cpu_reset(CPUState *s)
     env->pat = 0x0007040600070406ULL;
     env->msr_ia32_misc_enable = MSR_IA32_MISC_ENABLE_DEFAULT;
 
+    for (i = 0; i < HV_SINT_COUNT; i++) {
+        env->msr_hv_synic_sint[i] = HV_SINT_MASKED;
+    }
+
     memset(env->dr, 0, sizeof(env->dr));
     env->dr[6] = DR6_FIXED_1;
     env->dr[7] = DR7_FIXED_1;
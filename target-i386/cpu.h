@@ -316,6 +316,11 @@
 /* Indicates good rep/movs microcode on some processors: */
 #define MSR_IA32_MISC_ENABLE_DEFAULT    1
 
+/* Hyper-V synthetic interrupt sources and timers per vCPU */
+#define HV_SINT_COUNT                   16
+#define HV_SINT_MASKED                  (1ULL << 16)
+#define HV_STIMER_COUNT                 4
+
 #define MSR_MTRRphysBase(reg)		(0x200 + 2 * (reg))
 #define MSR_MTRRphysMask(reg)		(0x200 + 2 * (reg) + 1)
 
@@ -777,6 +782,17 @@ typedef struct CPUX86State {
     uint64_t mcg_status;
     uint64_t msr_ia32_misc_enable;
 
+    /* Hyper-V enlightenments */
+    uint64_t msr_hv_guest_os_id;
+    uint64_t msr_hv_hypercall;
+    uint64_t msr_hv_tsc;
+    uint64_t msr_hv_synic_control;
+    uint64_t msr_hv_synic_evt_page;
+    uint64_t msr_hv_synic_msg_page;
+    uint64_t msr_hv_synic_sint[HV_SINT_COUNT];
+    uint64_t msr_hv_stimer_config[HV_STIMER_COUNT];
+    uint64_t msr_hv_stimer_count[HV_STIMER_COUNT];
+
     /* exception/interrupt handling */
     int error_code;
     int exception_is_int;
@@ -220,4 +220,6 @@ DEF_HELPER_3(rclq, tl, env, tl, tl)
 DEF_HELPER_3(rcrq, tl, env, tl, tl)
 #endif
 
+DEF_HELPER_FLAGS_1(lookup_tb_ptr, TCG_CALL_NO_WG, ptr, env)
+
 #include "def-helper.h"
@@ -14,6 +14,9 @@
 
 static bool hyperv_vapic;
 static bool hyperv_relaxed_timing;
+static bool hyperv_time;
+static bool hyperv_synic;
+static bool hyperv_stimer;
 static int hyperv_spinlock_attempts = HYPERV_SPINLOCK_NEVER_RETRY;
 
 void hyperv_enable_vapic_recommended(bool val)
@@ -26,6 +29,21 @@ void hyperv_enable_relaxed_timing(bool val)
     hyperv_relaxed_timing = val;
 }
 
+void hyperv_enable_time(bool val)
+{
+    hyperv_time = val;
+}
+
+void hyperv_enable_synic(bool val)
+{
+    hyperv_synic = val;
+}
+
+void hyperv_enable_stimer(bool val)
+{
+    hyperv_stimer = val;
+}
+
 void hyperv_set_spinlock_retries(int val)
 {
     hyperv_spinlock_attempts = val;
@@ -36,12 +54,13 @@ void hyperv_set_spinlock_retries(int val)
 
 bool hyperv_enabled(void)
 {
-    return hyperv_hypercall_available() || hyperv_relaxed_timing_enabled();
+    return hyperv_hypercall_available() || hyperv_relaxed_timing_enabled() ||
+           hyperv_time_enabled();
 }
 
 bool hyperv_hypercall_available(void)
 {
-    if (hyperv_vapic ||
+    if (hyperv_vapic || hyperv_synic ||
         (hyperv_spinlock_attempts != HYPERV_SPINLOCK_NEVER_RETRY)) {
       return true;
     }
@@ -58,6 +77,23 @@ bool hyperv_relaxed_timing_enabled(void)
     return hyperv_relaxed_timing;
 }
 
+bool hyperv_time_enabled(void)
+{
+    return hyperv_time;
+}
+
+bool hyperv_synic_enabled(void)
+{
+    return hyperv_synic;
+}
+
+/* Synthetic timers deliver their expiration messages through the SynIC and
+   count in units of the partition reference time.  */
+bool hyperv_stimer_enabled(void)
+{
+    return hyperv_stimer && hyperv_synic && hyperv_time;
+}
+
 int hyperv_get_spinlock_retries(void)
 {
     return hyperv_spinlock_attempts;
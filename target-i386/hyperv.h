@@ -29,10 +29,16 @@
 #if !defined(CONFIG_USER_ONLY) && defined(CONFIG_KVM)
 void hyperv_enable_vapic_recommended(bool val);
 void hyperv_enable_relaxed_timing(bool val);
+void hyperv_enable_time(bool val);
+void hyperv_enable_synic(bool val);
+void hyperv_enable_stimer(bool val);
 void hyperv_set_spinlock_retries(int val);
 #else
 static inline void hyperv_enable_vapic_recommended(bool val) { }
 static inline void hyperv_enable_relaxed_timing(bool val) { }
+static inline void hyperv_enable_time(bool val) { }
+static inline void hyperv_enable_synic(bool val) { }
+static inline void hyperv_enable_stimer(bool val) { }
 static inline void hyperv_set_spinlock_retries(int val) { }
 #endif
 
@@ -40,6 +46,9 @@ bool hyperv_enabled(void);
 bool hyperv_hypercall_available(void);
 bool hyperv_vapic_recommended(void);
 bool hyperv_relaxed_timing_enabled(void);
+bool hyperv_time_enabled(void);
+bool hyperv_synic_enabled(void);
+bool hyperv_stimer_enabled(void);
 int hyperv_get_spinlock_retries(void);
 
 #endif /* QEMU_HW_HYPERV_H */
@@ -418,6 +418,25 @@ int kvm_arch_init_vcpu(CPUX86State *env)
     uint32_t signature[3];
     int r;
 
+    if (hyperv_time_enabled() &&
+        !kvm_check_extension(env->kvm_state, KVM_CAP_HYPERV_TIME)) {
+        fprintf(stderr, "Warning: Hyper-V reference time (hv_time) is not "
+                "supported by the host kernel\n");
+        hyperv_enable_time(false);
+    }
+    if (hyperv_synic_enabled()) {
+        struct kvm_enable_cap cap = {
+            .cap = KVM_CAP_HYPERV_SYNIC,
+        };
+
+        if (!kvm_check_extension(env->kvm_state, KVM_CAP_HYPERV_SYNIC) ||
+            kvm_vcpu_ioctl(env, KVM_ENABLE_CAP, &cap) < 0) {
+            fprintf(stderr, "Hyper-V SynIC (hv_synic) is not supported by "
+                    "the host kernel\n");
+            return -ENOSYS;
+        }
+    }
+
     cpuid_i = 0;
 
     /* Paravirtualization CPUIDs */
@@ -460,6 +479,17 @@ int kvm_arch_init_vcpu(CPUX86State *env)
             c->eax |= HV_X64_MSR_HYPERCALL_AVAILABLE;
             c->eax |= HV_X64_MSR_APIC_ACCESS_AVAILABLE;
         }
+        if (hyperv_time_enabled()) {
+            c->eax |= HV_X64_MSR_TIME_REF_COUNT_AVAILABLE;
+            c->eax |= HV_X64_MSR_REFERENCE_TSC_AVAILABLE;
+        }
+        if (hyperv_synic_enabled()) {
+            c->eax |= HV_X64_MSR_HYPERCALL_AVAILABLE;
+            c->eax |= HV_X64_MSR_SYNIC_AVAILABLE;
+        }
+        if (hyperv_stimer_enabled()) {
+            c->eax |= HV_X64_MSR_SYNTIMER_AVAILABLE;
+        }
 
         c = &cpuid_data.entries[cpuid_i++];
         memset(c, 0, sizeof(*c));
@@ -998,7 +1028,7 @@ static int kvm_put_msrs(CPUX86State *env, int level)
 {
     struct {
         struct kvm_msrs info;
-        struct kvm_msr_entry entries[100];
+        struct kvm_msr_entry entries[150];
     } msr_data;
     struct kvm_msr_entry *msrs = msr_data.entries;
     int n = 0;
@@ -1057,12 +1087,43 @@ static int kvm_put_msrs(CPUX86State *env, int level)
                               env->pv_eoi_en_msr);
         }
         if (hyperv_hypercall_available()) {
-            kvm_msr_entry_set(&msrs[n++], HV_X64_MSR_GUEST_OS_ID, 0);
-            kvm_msr_entry_set(&msrs[n++], HV_X64_MSR_HYPERCALL, 0);
+            kvm_msr_entry_set(&msrs[n++], HV_X64_MSR_GUEST_OS_ID,
+                              env->msr_hv_guest_os_id);
+            kvm_msr_entry_set(&msrs[n++], HV_X64_MSR_HYPERCALL,
+                              env->msr_hv_hypercall);
         }
         if (hyperv_vapic_recommended()) {
             kvm_msr_entry_set(&msrs[n++], HV_X64_MSR_APIC_ASSIST_PAGE, 0);
         }
+        if (hyperv_time_enabled()) {
+            kvm_msr_entry_set(&msrs[n++], HV_X64_MSR_REFERENCE_TSC,
+                              env->msr_hv_tsc);
+        }
+        if (hyperv_synic_enabled()) {
+            int j;
+
+            kvm_msr_entry_set(&msrs[n++], HV_X64_MSR_SCONTROL,
+                              env->msr_hv_synic_control);
+            kvm_msr_entry_set(&msrs[n++], HV_X64_MSR_SIEFP,
+                              env->msr_hv_synic_evt_page);
+            kvm_msr_entry_set(&msrs[n++], HV_X64_MSR_SIMP,
+                              env->msr_hv_synic_msg_page);
+            for (j = 0; j < HV_SINT_COUNT; j++) {
+                kvm_msr_entry_set(&msrs[n++], HV_X64_MSR_SINT0 + j,
+                                  env->msr_hv_synic_sint[j]);
+            }
+        }
+        if (hyperv_stimer_enabled()) {
+            int j;
+
+            /* The count arms an enabled timer, so set it last */
+            for (j = 0; j < HV_STIMER_COUNT; j++) {
+                kvm_msr_entry_set(&msrs[n++], HV_X64_MSR_STIMER0_CONFIG + j * 2,
+                                  env->msr_hv_stimer_config[j]);
+                kvm_msr_entry_set(&msrs[n++], HV_X64_MSR_STIMER0_COUNT + j * 2,
+                                  env->msr_hv_stimer_count[j]);
+            }
+        }
     }
     if (env->mcg_cap) {
         int i;
@@ -1257,7 +1318,7 @@ static int kvm_get_msrs(CPUX86State *env)
 {
     struct {
         struct kvm_msrs info;
-        struct kvm_msr_entry entries[100];
+        struct kvm_msr_entry entries[150];
     } msr_data;
     struct kvm_msr_entry *msrs = msr_data.entries;
     int ret, i, n;
@@ -1301,6 +1362,27 @@ static int kvm_get_msrs(CPUX86State *env)
     if (has_msr_pv_eoi_en) {
         msrs[n++].index = MSR_KVM_PV_EOI_EN;
     }
+    if (hyperv_hypercall_available()) {
+        msrs[n++].index = HV_X64_MSR_GUEST_OS_ID;
+        msrs[n++].index = HV_X64_MSR_HYPERCALL;
+    }
+    if (hyperv_time_enabled()) {
+        msrs[n++].index = HV_X64_MSR_REFERENCE_TSC;
+    }
+    if (hyperv_synic_enabled()) {
+        msrs[n++].index = HV_X64_MSR_SCONTROL;
+        msrs[n++].index = HV_X64_MSR_SIEFP;
+        msrs[n++].index = HV_X64_MSR_SIMP;
+        for (i = 0; i < HV_SINT_COUNT; i++) {
+            msrs[n++].index = HV_X64_MSR_SINT0 + i;
+        }
+    }
+    if (hyperv_stimer_enabled()) {
+        for (i = 0; i < HV_STIMER_COUNT; i++) {
+            msrs[n++].index = HV_X64_MSR_STIMER0_CONFIG + i * 2;
+            msrs[n++].index = HV_X64_MSR_STIMER0_COUNT + i * 2;
+        }
+    }
 
     if (env->mcg_cap) {
         msrs[n++].index = MSR_MCG_STATUS;
@@ -1371,6 +1453,44 @@ static int kvm_get_msrs(CPUX86State *env)
         case MSR_IA32_MISC_ENABLE:
             env->msr_ia32_misc_enable = msrs[i].data;
             break;
+        case HV_X64_MSR_GUEST_OS_ID:
+            env->msr_hv_guest_os_id = msrs[i].data;
+            break;
+        case HV_X64_MSR_HYPERCALL:
+            env->msr_hv_hypercall = msrs[i].data;
+            break;
+        case HV_X64_MSR_REFERENCE_TSC:
+            env->msr_hv_tsc = msrs[i].data;
+            break;
+        case HV_X64_MSR_SCONTROL:
+            env->msr_hv_synic_control = msrs[i].data;
+            break;
+        case HV_X64_MSR_SIEFP:
+            env->msr_hv_synic_evt_page = msrs[i].data;
+            break;
+        case HV_X64_MSR_SIMP:
+            env->msr_hv_synic_msg_page = msrs[i].data;
+            break;
+        case HV_X64_MSR_SINT0 ... HV_X64_MSR_SINT15:
+            env->msr_hv_synic_sint[msrs[i].index - HV_X64_MSR_SINT0] =
+                msrs[i].data;
+            break;
+        case HV_X64_MSR_STIMER0_CONFIG:
+        case HV_X64_MSR_STIMER1_CONFIG:
+        case HV_X64_MSR_STIMER2_CONFIG:
+        case HV_X64_MSR_STIMER3_CONFIG:
+            env->msr_hv_stimer_config[(msrs[i].index -
+                                       HV_X64_MSR_STIMER0_CONFIG) / 2] =
+                msrs[i].data;
+            break;
+        case HV_X64_MSR_STIMER0_COUNT:
+        case HV_X64_MSR_STIMER1_COUNT:
+        case HV_X64_MSR_STIMER2_COUNT:
+        case HV_X64_MSR_STIMER3_COUNT:
+            env->msr_hv_stimer_count[(msrs[i].index -
+                                      HV_X64_MSR_STIMER0_COUNT) / 2] =
+                msrs[i].data;
+            break;
         default:
             if (msrs[i].index >= MSR_MC0_CTL &&
                 msrs[i].index < MSR_MC0_CTL + (env->mcg_cap & 0xff) * 4) {
@@ -2031,6 +2151,34 @@ static bool host_supports_vmx(void)
 
 #define VMX_INVALID_GUEST_STATE 0x80000021
 
+/* KVM emulates the SynIC itself and only reports guest writes to its
+   control MSRs, so that the values can be migrated.  */
+static int kvm_handle_hyperv_exit(CPUX86State *env, struct kvm_run *run)
+{
+    struct kvm_hyperv_exit *exit = &run->hyperv;
+
+    switch (exit->type) {
+    case KVM_EXIT_HYPERV_SYNIC:
+        switch (exit->u.synic.msr) {
+        case HV_X64_MSR_SCONTROL:
+            env->msr_hv_synic_control = exit->u.synic.control;
+            break;
+        case HV_X64_MSR_SIEFP:
+            env->msr_hv_synic_evt_page = exit->u.synic.evt_page;
+            break;
+        case HV_X64_MSR_SIMP:
+            env->msr_hv_synic_msg_page = exit->u.synic.msg_page;
+            break;
+        default:
+            return -1;
+        }
+        return 0;
+    default:
+        fprintf(stderr, "KVM: unknown Hyper-V exit type %d\n", exit->type);
+        return -1;
+    }
+}
+
 int kvm_arch_handle_exit(CPUX86State *env, struct kvm_run *run)
 {
     X86CPU *cpu = x86_env_get_cpu(env);
@@ -2048,6 +2196,9 @@ int kvm_arch_handle_exit(CPUX86State *env, struct kvm_run *run)
     case KVM_EXIT_TPR_ACCESS:
         ret = kvm_handle_tpr_access(env);
         break;
+    case KVM_EXIT_HYPERV:
+        ret = kvm_handle_hyperv_exit(env, run);
+        break;
     case KVM_EXIT_FAIL_ENTRY:
         code = run->fail_entry.hardware_entry_failure_reason;
         fprintf(stderr, "KVM: entry failed, hardware error 0x%" PRIx64 "\n",
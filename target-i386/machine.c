@@ -364,6 +364,102 @@ static const VMStateDescription vmstate_msr_ia32_misc_enable = {
     }
 };
 
+static bool hyperv_hypercall_needed(void *opaque)
+{
+    CPUX86State *env = opaque;
+
+    return env->msr_hv_guest_os_id != 0 || env->msr_hv_hypercall != 0;
+}
+
+static const VMStateDescription vmstate_msr_hyperv_hypercall = {
+    .name = "cpu/msr_hyperv_hypercall",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields      = (VMStateField []) {
+        VMSTATE_UINT64(msr_hv_guest_os_id, CPUX86State),
+        VMSTATE_UINT64(msr_hv_hypercall, CPUX86State),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static bool hyperv_time_needed(void *opaque)
+{
+    CPUX86State *env = opaque;
+
+    return env->msr_hv_tsc != 0;
+}
+
+static const VMStateDescription vmstate_msr_hyperv_time = {
+    .name = "cpu/msr_hyperv_time",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields      = (VMStateField []) {
+        VMSTATE_UINT64(msr_hv_tsc, CPUX86State),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static bool hyperv_synic_needed(void *opaque)
+{
+    CPUX86State *env = opaque;
+    int i;
+
+    if (env->msr_hv_synic_control != 0 ||
+        env->msr_hv_synic_evt_page != 0 ||
+        env->msr_hv_synic_msg_page != 0) {
+        return true;
+    }
+    for (i = 0; i < HV_SINT_COUNT; i++) {
+        if (env->msr_hv_synic_sint[i] != HV_SINT_MASKED) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static const VMStateDescription vmstate_msr_hyperv_synic = {
+    .name = "cpu/msr_hyperv_synic",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields      = (VMStateField []) {
+        VMSTATE_UINT64(msr_hv_synic_control, CPUX86State),
+        VMSTATE_UINT64(msr_hv_synic_evt_page, CPUX86State),
+        VMSTATE_UINT64(msr_hv_synic_msg_page, CPUX86State),
+        VMSTATE_UINT64_ARRAY(msr_hv_synic_sint, CPUX86State, HV_SINT_COUNT),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static bool hyperv_stimer_needed(void *opaque)
+{
+    CPUX86State *env = opaque;
+    int i;
+
+    for (i = 0; i < HV_STIMER_COUNT; i++) {
+        if (env->msr_hv_stimer_config[i] || env->msr_hv_stimer_count[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static const VMStateDescription vmstate_msr_hyperv_stimer = {
+    .name = "cpu/msr_hyperv_stimer",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields      = (VMStateField []) {
+        VMSTATE_UINT64_ARRAY(msr_hv_stimer_config, CPUX86State,
+                             HV_STIMER_COUNT),
+        VMSTATE_UINT64_ARRAY(msr_hv_stimer_count, CPUX86State,
+                             HV_STIMER_COUNT),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_cpu = {
     .name = "cpu",
     .version_id = CPU_SAVE_VERSION,
@@ -483,6 +579,18 @@ static const VMStateDescription vmstate_cpu = {
         }, {
             .vmsd = &vmstate_msr_ia32_misc_enable,
             .needed = misc_enable_needed,
+        } , {
+            .vmsd = &vmstate_msr_hyperv_hypercall,
+            .needed = hyperv_hypercall_needed,
+        } , {
+            .vmsd = &vmstate_msr_hyperv_time,
+            .needed = hyperv_time_needed,
+        } , {
+            .vmsd = &vmstate_msr_hyperv_synic,
+            .needed = hyperv_synic_needed,
+        } , {
+            .vmsd = &vmstate_msr_hyperv_stimer,
+            .needed = hyperv_stimer_needed,
         } , {
             /* empty */
         }
@@ -830,6 +830,188 @@ static void gen_compute_eflags(TCGv reg)
     tcg_gen_extu_i32_tl(reg, cpu_tmp2_i32);
 }
 
+/* move the sign bit of a 'size' operand in 'src' to bit 0 of 'reg' */
+static void gen_msb(int size, TCGv reg, TCGv src)
+{
+    tcg_gen_shri_tl(reg, src, (8 << size) - 1);
+    tcg_gen_andi_tl(reg, reg, 1);
+}
+
+/* compute one of the C, Z, S or O flags of 'cc_op' as 0 or 1 into 'reg'.
+   Return false if it cannot be done inline. */
+static bool gen_compute_flag(int cc_op, int flag, TCGv reg)
+{
+    int size, op;
+    TCGv t0;
+
+    if (cc_op == CC_OP_EFLAGS) {
+        tcg_gen_andi_tl(reg, cpu_cc_src, flag);
+        tcg_gen_setcondi_tl(TCG_COND_NE, reg, reg, 0);
+        return true;
+    }
+    if (cc_op < CC_OP_MULB || cc_op >= CC_OP_NB) {
+        return false;
+    }
+    /* the first op of the group, e.g. CC_OP_ADDB for CC_OP_ADDL */
+    op = cc_op - ((cc_op - CC_OP_MULB) & 3);
+    size = cc_op - op;
+    if (op == CC_OP_ADCB || op == CC_OP_SBBB) {
+        return false;
+    }
+
+    switch (flag) {
+    case CC_Z:
+        tcg_gen_mov_tl(reg, cpu_cc_dst);
+        gen_extu(size, reg);
+        tcg_gen_setcondi_tl(TCG_COND_EQ, reg, reg, 0);
+        return true;
+    case CC_S:
+        gen_msb(size, reg, cpu_cc_dst);
+        return true;
+    case CC_C:
+    case CC_O:
+        break;
+    default:
+        return false;
+    }
+
+    t0 = tcg_temp_new();
+    switch (op) {
+    case CC_OP_MULB:
+        tcg_gen_setcondi_tl(TCG_COND_NE, reg, cpu_cc_src, 0);
+        break;
+    case CC_OP_ADDB:
+        if (flag == CC_C) {
+            /* res < src1 */
+            tcg_gen_mov_tl(reg, cpu_cc_dst);
+            gen_extu(size, reg);
+            tcg_gen_mov_tl(t0, cpu_cc_src);
+            gen_extu(size, t0);
+            tcg_gen_setcond_tl(TCG_COND_LTU, reg, reg, t0);
+        } else {
+            /* (src1 ^ res) & ~(src1 ^ src2), with src2 = res - src1 */
+            tcg_gen_sub_tl(t0, cpu_cc_dst, cpu_cc_src);
+            tcg_gen_xor_tl(t0, t0, cpu_cc_src);
+            tcg_gen_xor_tl(reg, cpu_cc_src, cpu_cc_dst);
+            tcg_gen_andc_tl(reg, reg, t0);
+            gen_msb(size, reg, reg);
+        }
+        break;
+    case CC_OP_SUBB:
+        /* src1 = res + src2, with src2 = cc_src */
+        tcg_gen_add_tl(t0, cpu_cc_dst, cpu_cc_src);
+        if (flag == CC_C) {
+            gen_extu(size, t0);
+            tcg_gen_mov_tl(reg, cpu_cc_src);
+            gen_extu(size, reg);
+            tcg_gen_setcond_tl(TCG_COND_LTU, reg, t0, reg);
+        } else {
+            /* (src1 ^ src2) & (src1 ^ res) */
+            tcg_gen_xor_tl(reg, t0, cpu_cc_src);
+            tcg_gen_xor_tl(t0, t0, cpu_cc_dst);
+            tcg_gen_and_tl(reg, reg, t0);
+            gen_msb(size, reg, reg);
+        }
+        break;
+    case CC_OP_LOGICB:
+        tcg_gen_movi_tl(reg, 0);
+        break;
+    case CC_OP_INCB:
+    case CC_OP_DECB:
+        if (flag == CC_C) {
+            /* the carry is left unchanged in cc_src */
+            tcg_gen_mov_tl(reg, cpu_cc_src);
+        } else {
+            /* the result is the smallest negative value for inc, the
+               largest positive one for dec */
+            tcg_gen_mov_tl(reg, cpu_cc_dst);
+            gen_extu(size, reg);
+            tcg_gen_setcondi_tl(TCG_COND_EQ, reg, reg,
+                                ((target_ulong)1 << ((8 << size) - 1)) -
+                                (op == CC_OP_DECB));
+        }
+        break;
+    case CC_OP_SHLB:
+    case CC_OP_SARB:
+        if (flag == CC_O) {
+            tcg_gen_xor_tl(reg, cpu_cc_src, cpu_cc_dst);
+            gen_msb(size, reg, reg);
+        } else if (op == CC_OP_SHLB) {
+            gen_msb(size, reg, cpu_cc_src);
+        } else {
+            tcg_gen_andi_tl(reg, cpu_cc_src, 1);
+        }
+        break;
+    default:
+        tcg_abort();
+    }
+    tcg_temp_free(t0);
+    return true;
+}
+
+/* compute the condition 'jcc_op' (not inverted) as 0 or 1 into 'reg'
+   straight from cc_src/cc_dst, without calling the flag helpers.
+   Return false if 'cc_op' is not known at translation time or the
+   condition needs the parity flag. */
+static bool gen_setcc_fast(int cc_op, int jcc_op, TCGv reg)
+{
+    TCGv t0;
+    TCGCond cond;
+    int size;
+
+    if (cc_op >= CC_OP_SUBB && cc_op <= CC_OP_SUBQ &&
+        (jcc_op == JCC_B || jcc_op == JCC_BE ||
+         jcc_op == JCC_L || jcc_op == JCC_LE)) {
+        /* compare src1 = res + src2 with src2 directly */
+        size = cc_op - CC_OP_SUBB;
+        t0 = tcg_temp_new();
+        tcg_gen_add_tl(t0, cpu_cc_dst, cpu_cc_src);
+        tcg_gen_mov_tl(reg, cpu_cc_src);
+        if (jcc_op == JCC_B || jcc_op == JCC_BE) {
+            gen_extu(size, t0);
+            gen_extu(size, reg);
+            cond = jcc_op == JCC_B ? TCG_COND_LTU : TCG_COND_LEU;
+        } else {
+            gen_exts(size, t0);
+            gen_exts(size, reg);
+            cond = jcc_op == JCC_L ? TCG_COND_LT : TCG_COND_LE;
+        }
+        tcg_gen_setcond_tl(cond, reg, t0, reg);
+        tcg_temp_free(t0);
+        return true;
+    }
+
+    switch (jcc_op) {
+    case JCC_O:
+        return gen_compute_flag(cc_op, CC_O, reg);
+    case JCC_B:
+        return gen_compute_flag(cc_op, CC_C, reg);
+    case JCC_Z:
+        return gen_compute_flag(cc_op, CC_Z, reg);
+    case JCC_S:
+        return gen_compute_flag(cc_op, CC_S, reg);
+    case JCC_P:
+        return cc_op == CC_OP_EFLAGS && gen_compute_flag(cc_op, CC_P, reg);
+    default:
+        /* BE = C | Z, L = S ^ O, LE = (S ^ O) | Z.  The C, Z, S and O
+           flags are either all available inline or none is.  */
+        if (!gen_compute_flag(cc_op, jcc_op == JCC_BE ? CC_C : CC_S, reg)) {
+            return false;
+        }
+        t0 = tcg_temp_new();
+        if (jcc_op != JCC_BE) {
+            gen_compute_flag(cc_op, CC_O, t0);
+            tcg_gen_xor_tl(reg, reg, t0);
+        }
+        if (jcc_op != JCC_L) {
+            gen_compute_flag(cc_op, CC_Z, t0);
+            tcg_gen_or_tl(reg, reg, t0);
+        }
+        tcg_temp_free(t0);
+        return true;
+    }
+}
+
 static inline void gen_setcc_slow_T0(DisasContext *s, int jcc_op)
 {
     if (s->cc_op != CC_OP_DYNAMIC)
@@ -884,57 +1066,6 @@ static inline void gen_setcc_slow_T0(DisasContext *s, int jcc_op)
     }
 }
 
-/* return true if setcc_slow is not needed (WARNING: must be kept in
-   sync with gen_jcc1) */
-static int is_fast_jcc_case(DisasContext *s, int b)
-{
-    int jcc_op;
-    jcc_op = (b >> 1) & 7;
-    switch(s->cc_op) {
-        /* we optimize the cmp/jcc case */
-    case CC_OP_SUBB:
-    case CC_OP_SUBW:
-    case CC_OP_SUBL:
-    case CC_OP_SUBQ:
-        if (jcc_op == JCC_O || jcc_op == JCC_P)
-            goto slow_jcc;
-        break;
-
-        /* some jumps are easy to compute */
-    case CC_OP_ADDB:
-    case CC_OP_ADDW:
-    case CC_OP_ADDL:
-    case CC_OP_ADDQ:
-
-    case CC_OP_LOGICB:
-    case CC_OP_LOGICW:
-    case CC_OP_LOGICL:
-    case CC_OP_LOGICQ:
-
-    case CC_OP_INCB:
-    case CC_OP_INCW:
-    case CC_OP_INCL:
-    case CC_OP_INCQ:
-
-    case CC_OP_DECB:
-    case CC_OP_DECW:
-    case CC_OP_DECL:
-    case CC_OP_DECQ:
-
-    case CC_OP_SHLB:
-    case CC_OP_SHLW:
-    case CC_OP_SHLL:
-    case CC_OP_SHLQ:
-        if (jcc_op != JCC_Z && jcc_op != JCC_S)
-            goto slow_jcc;
-        break;
-    default:
-    slow_jcc:
-        return 0;
-    }
-    return 1;
-}
-
 /* generate a conditional jump to label 'l1' according to jump opcode
    value 'b'. In the fast case, T0 is guaranted not to be used. */
 static inline void gen_jcc1(DisasContext *s, int cc_op, int b, int l1)
@@ -1126,7 +1257,9 @@ static inline void gen_jcc1(DisasContext *s, int cc_op, int b, int l1)
         break;
     default:
     slow_jcc:
-        gen_setcc_slow_T0(s, jcc_op);
+        if (!gen_setcc_fast(cc_op, jcc_op, cpu_T[0])) {
+            gen_setcc_slow_T0(s, jcc_op);
+        }
         tcg_gen_brcondi_tl(inv ? TCG_COND_EQ : TCG_COND_NE, 
                            cpu_T[0], 0, l1);
         break;
@@ -2391,32 +2524,18 @@ static inline void gen_jcc(DisasContext *s, int b,
     }
 }
 
+/* compute the condition 'b' as 0 or 1 into T0 */
 static void gen_setcc(DisasContext *s, int b)
 {
-    int inv, jcc_op, l1;
-    TCGv t0;
+    int inv, jcc_op;
 
-    if (is_fast_jcc_case(s, b)) {
-        /* nominal case: we use a jump */
-        /* XXX: make it faster by adding new instructions in TCG */
-        t0 = tcg_temp_local_new();
-        tcg_gen_movi_tl(t0, 0);
-        l1 = gen_new_label();
-        gen_jcc1(s, s->cc_op, b ^ 1, l1);
-        tcg_gen_movi_tl(t0, 1);
-        gen_set_label(l1);
-        tcg_gen_mov_tl(cpu_T[0], t0);
-        tcg_temp_free(t0);
-    } else {
-        /* slow case: it is more efficient not to generate a jump,
-           although it is questionnable whether this optimization is
-           worth to */
-        inv = b & 1;
-        jcc_op = (b >> 1) & 7;
+    inv = b & 1;
+    jcc_op = (b >> 1) & 7;
+    if (!gen_setcc_fast(s->cc_op, jcc_op, cpu_T[0])) {
         gen_setcc_slow_T0(s, jcc_op);
-        if (inv) {
-            tcg_gen_xori_tl(cpu_T[0], cpu_T[0], 1);
-        }
+    }
+    if (inv) {
+        tcg_gen_xori_tl(cpu_T[0], cpu_T[0], 1);
     }
 }
 
@@ -2751,7 +2870,9 @@ static void gen_debug(DisasContext *s, target_ulong cur_eip)
 
 /* generate a generic end of block. Trace exception is also generated
    if needed */
-static void gen_eob(DisasContext *s)
+/* End of block.  If JR is set, the block ends with an indirect jump
+   whose target TB is looked up without leaving the generated code.  */
+static void gen_eob_worker(DisasContext *s, bool jr)
 {
     if (s->cc_op != CC_OP_DYNAMIC)
         gen_op_set_cc_op(s->cc_op);
@@ -2765,12 +2886,29 @@ static void gen_eob(DisasContext *s)
         gen_helper_debug(cpu_env);
     } else if (s->tf) {
         gen_helper_single_step(cpu_env);
+    } else if (jr && s->jmp_opt && TCG_TARGET_HAS_goto_ptr) {
+        TCGv_ptr ptr = tcg_temp_new_ptr();
+
+        gen_helper_lookup_tb_ptr(ptr, cpu_env);
+        tcg_gen_goto_ptr(ptr);
+        tcg_temp_free_ptr(ptr);
     } else {
         tcg_gen_exit_tb(0);
     }
     s->is_jmp = DISAS_TB_JUMP;
 }
 
+static void gen_eob(DisasContext *s)
+{
+    gen_eob_worker(s, false);
+}
+
+/* indirect jump: the new eip has already been stored */
+static void gen_jr(DisasContext *s)
+{
+    gen_eob_worker(s, true);
+}
+
 /* generate a jump to eip. No segment change must happen before as a
    direct call to the next block may occur */
 static void gen_jmp_tb(DisasContext *s, target_ulong eip, int tb_num)
@@ -3169,6 +3307,77 @@ static const struct SSEOpHelper_eppi sse_op_table7[256] = {
     [0x63] = SSE42_OP(pcmpistri),
 };
 
+/* Expand the bitwise and wrapping add/sub MMX/SSE operations as 64-bit
+   lane TCG ops instead of calling an out of line helper.  Returns false
+   if B is not one of them.  */
+static bool gen_sse_inline(int b, int op1_offset, int op2_offset, int is_xmm)
+{
+    void (*gen_op)(TCGv_i64, TCGv_i64, TCGv_i64);
+    bool swap = false;
+    TCGv_i64 t0;
+    int i;
+
+    switch (b) {
+    case 0x54: /* andps, andpd */
+    case 0xdb: /* pand */
+        gen_op = tcg_gen_and_i64;
+        break;
+    case 0x55: /* andnps, andnpd */
+    case 0xdf: /* pandn */
+        gen_op = tcg_gen_andc_i64;
+        swap = true;
+        break;
+    case 0x56: /* orps, orpd */
+    case 0xeb: /* por */
+        gen_op = tcg_gen_or_i64;
+        break;
+    case 0x57: /* xorps, xorpd */
+    case 0xef: /* pxor */
+        gen_op = tcg_gen_xor_i64;
+        break;
+    case 0xfc: /* paddb */
+        gen_op = tcg_gen_vec_add8_i64;
+        break;
+    case 0xfd: /* paddw */
+        gen_op = tcg_gen_vec_add16_i64;
+        break;
+    case 0xfe: /* paddl */
+        gen_op = tcg_gen_vec_add32_i64;
+        break;
+    case 0xd4: /* paddq */
+        gen_op = tcg_gen_add_i64;
+        break;
+    case 0xf8: /* psubb */
+        gen_op = tcg_gen_vec_sub8_i64;
+        break;
+    case 0xf9: /* psubw */
+        gen_op = tcg_gen_vec_sub16_i64;
+        break;
+    case 0xfa: /* psubl */
+        gen_op = tcg_gen_vec_sub32_i64;
+        break;
+    case 0xfb: /* psubq */
+        gen_op = tcg_gen_sub_i64;
+        break;
+    default:
+        return false;
+    }
+
+    t0 = tcg_temp_new_i64();
+    for (i = 0; i < (is_xmm ? 16 : 8); i += 8) {
+        tcg_gen_ld_i64(cpu_tmp1_i64, cpu_env, op1_offset + i);
+        tcg_gen_ld_i64(t0, cpu_env, op2_offset + i);
+        if (swap) {
+            gen_op(cpu_tmp1_i64, t0, cpu_tmp1_i64);
+        } else {
+            gen_op(cpu_tmp1_i64, cpu_tmp1_i64, t0);
+        }
+        tcg_gen_st_i64(cpu_tmp1_i64, cpu_env, op1_offset + i);
+    }
+    tcg_temp_free_i64(t0);
+    return true;
+}
+
 static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                     target_ulong pc_start, int rex_r)
 {
@@ -4185,6 +4394,9 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
             sse_fn_eppt(cpu_env, cpu_ptr0, cpu_ptr1, cpu_A0);
             break;
         default:
+            if (gen_sse_inline(b, op1_offset, op2_offset, is_xmm)) {
+                break;
+            }
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
             sse_fn_epp(cpu_env, cpu_ptr0, cpu_ptr1);
@@ -4753,7 +4965,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             gen_movtl_T1_im(next_eip);
             gen_push_T1(s);
             gen_op_jmp_T0();
-            gen_eob(s);
+            gen_jr(s);
             break;
         case 3: /* lcall Ev */
             gen_op_ld_T1_A0(ot + s->mem_index);
@@ -4780,7 +4992,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             if (s->dflag == 0)
                 gen_op_andl_T0_ffff();
             gen_op_jmp_T0();
-            gen_eob(s);
+            gen_jr(s);
             break;
         case 5: /* ljmp Ev */
             gen_op_ld_T1_A0(ot + s->mem_index);
@@ -6308,7 +6520,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         if (s->dflag == 0)
             gen_op_andl_T0_ffff();
         gen_op_jmp_T0();
-        gen_eob(s);
+        gen_jr(s);
         break;
     case 0xc3: /* ret */
         gen_pop_T0(s);
@@ -6316,7 +6528,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         if (s->dflag == 0)
             gen_op_andl_T0_ffff();
         gen_op_jmp_T0();
-        gen_eob(s);
+        gen_jr(s);
         break;
     case 0xca: /* lret im */
         val = cpu_ldsw_code(env, s->pc);
@@ -6460,14 +6672,13 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         break;
     case 0x140 ... 0x14f: /* cmov Gv, Ev */
         {
-            int l1;
-            TCGv t0;
+            TCGv t0, zero;
 
             ot = dflag + OT_WORD;
             modrm = cpu_ldub_code(env, s->pc++);
             reg = ((modrm >> 3) & 7) | rex_r;
             mod = (modrm >> 6) & 3;
-            t0 = tcg_temp_local_new();
+            t0 = tcg_temp_new();
             if (mod != 3) {
                 gen_lea_modrm(env, s, modrm, &reg_addr, &offset_addr);
                 gen_op_ld_v(ot + s->mem_index, t0, cpu_A0);
@@ -6475,21 +6686,20 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
                 rm = (modrm & 7) | REX_B(s);
                 gen_op_mov_v_reg(ot, t0, rm);
             }
+            /* select without a branch */
+            gen_setcc(s, b);
+            zero = tcg_const_tl(0);
+            tcg_gen_movcond_tl(TCG_COND_NE, t0, cpu_T[0], zero,
+                               t0, cpu_regs[reg]);
+            tcg_temp_free(zero);
 #ifdef TARGET_X86_64
             if (ot == OT_LONG) {
                 /* XXX: specific Intel behaviour ? */
-                l1 = gen_new_label();
-                gen_jcc1(s, s->cc_op, b ^ 1, l1);
-                tcg_gen_mov_tl(cpu_regs[reg], t0);
-                gen_set_label(l1);
-                tcg_gen_ext32u_tl(cpu_regs[reg], cpu_regs[reg]);
+                tcg_gen_ext32u_tl(cpu_regs[reg], t0);
             } else
 #endif
             {
-                l1 = gen_new_label();
-                gen_jcc1(s, s->cc_op, b ^ 1, l1);
                 gen_op_mov_reg_v(ot, reg, t0);
-                gen_set_label(l1);
             }
             tcg_temp_free(t0);
         }
@@ -0,0 +1,509 @@
+/*
+ * Persistent translated code cache
+ *
+ * Translated blocks are appended to a file together with the host code
+ * relocations recorded by the TCG backend, so that a later run of the
+ * same binary on the same machine can copy them into the code buffer
+ * instead of translating the guest code again.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "config.h"
+#include "cpu.h"
+#include "exec-all.h"
+#include "tcg.h"
+#include "qemu-log.h"
+#include "sysemu.h"
+
+#include <sys/stat.h>
+
+#if defined(TCG_TARGET_HAS_EXT_RELOCS) && defined(USE_DIRECT_JUMP)
+
+#define TB_PERSIST_MAGIC    "QEMUTBC"
+#define TB_PERSIST_VERSION  1
+
+typedef struct QEMU_PACKED TBPersistHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t fingerprint;
+} TBPersistHeader;
+
+/* All records are padded to 8 bytes and stored in host byte order; the
+   fingerprint guarantees that they are only read by the same binary.  */
+typedef struct QEMU_PACKED TBPersistRecord {
+    uint64_t pc;
+    uint64_t cs_base;
+    uint64_t flags;
+    uint32_t cflags;
+    uint16_t size;              /* guest code bytes */
+    uint16_t code_size;         /* host code bytes */
+    uint64_t content_hash;      /* of the guest code bytes */
+    uint64_t checksum;          /* of the record, with this field zero */
+    uint16_t tb_next_offset[2];
+    uint16_t tb_jmp_offset[2];
+    uint16_t nb_relocs;
+    uint8_t reserved[6];
+    /* followed by nb_relocs TBPersistReloc and code_size bytes of code */
+} TBPersistRecord;
+
+typedef struct QEMU_PACKED TBPersistReloc {
+    uint16_t offset;
+    uint8_t type;               /* TCGExtRelocType */
+    uint8_t reserved[5];
+    int64_t value;              /* target, or addend to the TB for exit_tb */
+} TBPersistReloc;
+
+typedef struct TBPersistEntry {
+    const TBPersistRecord *rec;
+    struct TBPersistEntry *next;
+} TBPersistEntry;
+
+typedef struct TBPersist {
+    FILE *file;
+    uint8_t *data;              /* contents of the file when opened */
+    GHashTable *index;          /* first record -> TBPersistEntry chain */
+    Notifier exit_notifier;
+    unsigned int loaded;
+    unsigned int saved;
+    unsigned int rejected;
+} TBPersist;
+
+static TBPersist *tb_persist;
+
+static uint64_t tb_persist_hash(uint64_t h, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+
+    /* FNV-1a */
+    while (len--) {
+        h ^= *p++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+#define TB_PERSIST_HASH_INIT 0xcbf29ce484222325ULL
+
+static size_t tb_persist_record_len(const TBPersistRecord *rec)
+{
+    size_t len = sizeof(*rec) + rec->nb_relocs * sizeof(TBPersistReloc) +
+                 rec->code_size;
+
+    return (len + 7) & ~(size_t)7;
+}
+
+static uint64_t tb_persist_checksum(const TBPersistRecord *rec)
+{
+    TBPersistRecord tmp = *rec;
+    uint64_t h;
+
+    tmp.checksum = 0;
+    h = tb_persist_hash(TB_PERSIST_HASH_INIT, &tmp, sizeof(tmp));
+    return tb_persist_hash(h, rec + 1, tb_persist_record_len(rec) -
+                           sizeof(*rec));
+}
+
+static guint tb_persist_key_hash(gconstpointer key)
+{
+    const TBPersistRecord *rec = key;
+
+    return rec->pc ^ (rec->pc >> 32) ^ rec->cs_base ^ rec->flags ^
+           (rec->flags >> 32) ^ (rec->cflags << 16);
+}
+
+static gboolean tb_persist_key_equal(gconstpointer a, gconstpointer b)
+{
+    const TBPersistRecord *ra = a, *rb = b;
+
+    return ra->pc == rb->pc && ra->cs_base == rb->cs_base &&
+           ra->flags == rb->flags && ra->cflags == rb->cflags;
+}
+
+static void tb_persist_index(TBPersist *p, const TBPersistRecord *rec)
+{
+    TBPersistEntry *e = g_new(TBPersistEntry, 1);
+    TBPersistEntry *head = g_hash_table_lookup(p->index, rec);
+
+    e->rec = rec;
+    if (head) {
+        e->next = head->next;
+        head->next = e;
+    } else {
+        e->next = NULL;
+        g_hash_table_insert(p->index, (gpointer)rec, e);
+    }
+}
+
+/* Everything that, besides the TB key and the guest code, changes the
+   generated code or the meaning of the addresses embedded in it.  */
+static uint64_t tb_persist_fingerprint(void)
+{
+    uint64_t h = TB_PERSIST_HASH_INIT;
+    uintptr_t addrs[] = {
+        (uintptr_t)&tb_persist_fingerprint,
+        (uintptr_t)&cpu_gen_code,
+        (uintptr_t)&tcg_ctx,
+    };
+    uint32_t config[] = {
+        sizeof(CPUArchState), use_icount, tcg_multithread,
+    };
+    const char *model = first_cpu->cpu_model_str ?
+                        first_cpu->cpu_model_str : "";
+#ifdef __linux__
+    struct stat st;
+
+    if (stat("/proc/self/exe", &st) == 0) {
+        h = tb_persist_hash(h, &st.st_ino, sizeof(st.st_ino));
+        h = tb_persist_hash(h, &st.st_size, sizeof(st.st_size));
+        h = tb_persist_hash(h, &st.st_mtime, sizeof(st.st_mtime));
+    }
+#endif
+    h = tb_persist_hash(h, QEMU_VERSION, strlen(QEMU_VERSION));
+    h = tb_persist_hash(h, TARGET_ARCH, strlen(TARGET_ARCH));
+    h = tb_persist_hash(h, model, strlen(model) + 1);
+    h = tb_persist_hash(h, addrs, sizeof(addrs));
+    return tb_persist_hash(h, config, sizeof(config));
+}
+
+static void tb_persist_exit(Notifier *n, void *data)
+{
+    fflush(tb_persist->file);
+}
+
+/* Read the records of an existing file and return the length of its
+   valid prefix, or 0 if it was written by something else.  */
+static size_t tb_persist_parse(TBPersist *p, size_t len, uint64_t fingerprint)
+{
+    const TBPersistHeader *hdr = (const TBPersistHeader *)p->data;
+    size_t pos;
+
+    if (len < sizeof(*hdr) || memcmp(hdr->magic, TB_PERSIST_MAGIC,
+                                     sizeof(TB_PERSIST_MAGIC)) ||
+        hdr->version != TB_PERSIST_VERSION ||
+        hdr->header_size != sizeof(*hdr) ||
+        hdr->fingerprint != fingerprint) {
+        return 0;
+    }
+
+    pos = sizeof(*hdr);
+    while (len - pos >= sizeof(TBPersistRecord)) {
+        const TBPersistRecord *rec =
+            (const TBPersistRecord *)(p->data + pos);
+        size_t rec_len = tb_persist_record_len(rec);
+
+        /* a crash while appending leaves a truncated last record */
+        if (rec_len > len - pos || tb_persist_checksum(rec) != rec->checksum) {
+            break;
+        }
+        tb_persist_index(p, rec);
+        pos += rec_len;
+    }
+    return pos;
+}
+
+int tb_persist_init(const char *path)
+{
+    TBPersist *p;
+    TBPersistHeader hdr;
+    uint64_t fingerprint;
+    gchar *contents = NULL;
+    gsize len = 0;
+    size_t valid;
+    int fd;
+
+    fd = qemu_open(path, O_RDWR | O_CREAT | O_APPEND | O_BINARY, 0644);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    p = g_new0(TBPersist, 1);
+    p->index = g_hash_table_new(tb_persist_key_hash, tb_persist_key_equal);
+    g_file_get_contents(path, &contents, &len, NULL);
+    p->data = (uint8_t *)contents;
+    fingerprint = tb_persist_fingerprint();
+
+    valid = p->data ? tb_persist_parse(p, len, fingerprint) : 0;
+    if (!valid) {
+        g_free(p->data);
+        p->data = NULL;
+    }
+    if ((valid != len && ftruncate(fd, valid) < 0) ||
+        !(p->file = fdopen(fd, "ab"))) {
+        int ret = -errno;
+        qemu_close(fd);
+        g_hash_table_destroy(p->index);
+        g_free(p->data);
+        g_free(p);
+        return ret;
+    }
+    if (!valid) {
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, TB_PERSIST_MAGIC, sizeof(TB_PERSIST_MAGIC));
+        hdr.version = TB_PERSIST_VERSION;
+        hdr.header_size = sizeof(hdr);
+        hdr.fingerprint = fingerprint;
+        fwrite(&hdr, sizeof(hdr), 1, p->file);
+    }
+
+    p->exit_notifier.notify = tb_persist_exit;
+    qemu_add_exit_notifier(&p->exit_notifier);
+    tb_persist = p;
+    return 0;
+}
+
+static bool tb_persist_usable(CPUArchState *env)
+{
+    /* the generated code would differ from the stored code */
+    return tb_persist && !singlestep && !env->singlestep_enabled &&
+           QTAILQ_EMPTY(&env->breakpoints) &&
+           !qemu_loglevel_mask(CPU_LOG_TB_IN_ASM | CPU_LOG_TB_OUT_ASM |
+                               CPU_LOG_TB_OP | CPU_LOG_TB_OP_OPT);
+}
+
+/* Return a host pointer to the guest code at 'addr' if its page is in
+   the TLB and backed by RAM or ROM.  Unlike a code load, this never
+   faults: a stored TB whose second page is not mapped yet is simply
+   not used.  */
+static uint8_t *tb_persist_code_ptr(CPUArchState *env, target_ulong addr)
+{
+    int mmu_idx = cpu_mmu_index(env);
+    int index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    CPUTLBEntry *e = &env->tlb_table[mmu_idx][index];
+
+    if (e->addr_code != (addr & TARGET_PAGE_MASK)) {
+        return NULL;
+    }
+    return (uint8_t *)((uintptr_t)addr + e->addend);
+}
+
+static bool tb_persist_content_hash(CPUArchState *env, target_ulong pc,
+                                    unsigned int size, uint64_t *hash)
+{
+    uint64_t h = TB_PERSIST_HASH_INIT;
+
+    while (size) {
+        unsigned int len = MIN(size, TARGET_PAGE_SIZE -
+                                     (pc & ~TARGET_PAGE_MASK));
+        uint8_t *ptr = tb_persist_code_ptr(env, pc);
+
+        if (!ptr) {
+            return false;
+        }
+        h = tb_persist_hash(h, ptr, len);
+        pc += len;
+        size -= len;
+    }
+    *hash = h;
+    return true;
+}
+
+/* Copy the code of 'rec' to tb->tc_ptr and fix up its references to
+   helpers, the epilogue and the TB itself.  The result must match what
+   the backend would emit at this address, because cpu_restore_state
+   retranslates the block to map host to guest PCs.  */
+static bool tb_persist_relocate(TranslationBlock *tb,
+                                const TBPersistRecord *rec)
+{
+    const TBPersistReloc *r = (const TBPersistReloc *)(rec + 1);
+    uint8_t *code = tb->tc_ptr;
+    int i;
+
+    memcpy(code, r + rec->nb_relocs, rec->code_size);
+    for (i = 0; i < rec->nb_relocs; i++, r++) {
+        uint8_t *field = code + r->offset;
+        tcg_target_long disp, v;
+
+        switch (r->type) {
+        case TCG_EXT_RELOC_PCREL32:
+            disp = r->value - (tcg_target_long)(field + 4);
+            if (disp != (int32_t)disp) {
+                return false;
+            }
+            *(int32_t *)field = disp;
+            break;
+        case TCG_EXT_RELOC_FAR_BRANCH:
+            disp = r->value - (tcg_target_long)field - 5;
+            if (disp == (int32_t)disp) {
+                return false;
+            }
+            break;
+        case TCG_EXT_RELOC_TB_IMM32U:
+            v = (tcg_target_long)tb + r->value;
+            if (v != (uint32_t)v) {
+                return false;
+            }
+            *(uint32_t *)field = v;
+            break;
+        case TCG_EXT_RELOC_TB_IMM32S:
+            v = (tcg_target_long)tb + r->value;
+            if (v == (uint32_t)v || v != (int32_t)v) {
+                return false;
+            }
+            *(int32_t *)field = v;
+            break;
+        case TCG_EXT_RELOC_TB_IMM64:
+            v = (tcg_target_long)tb + r->value;
+            if (v == (uint32_t)v || v == (int32_t)v) {
+                return false;
+            }
+            memcpy(field, &v, sizeof(v));
+            break;
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+bool tb_persist_load(CPUArchState *env, TranslationBlock *tb,
+                     int *code_size)
+{
+    TBPersistRecord key;
+    TBPersistEntry *e;
+    unsigned int size = 0;
+    uint64_t hash = 0;
+    int i;
+
+    if (!tb_persist_usable(env)) {
+        return false;
+    }
+    key.pc = tb->pc;
+    key.cs_base = tb->cs_base;
+    key.flags = tb->flags;
+    key.cflags = tb->cflags;
+    for (e = g_hash_table_lookup(tb_persist->index, &key); e; e = e->next) {
+        const TBPersistRecord *rec = e->rec;
+
+        if (rec->size != size) {
+            size = rec->size;
+            if (!tb_persist_content_hash(env, tb->pc, size, &hash)) {
+                size = 0;
+                continue;
+            }
+        }
+        if (hash != rec->content_hash) {
+            continue;
+        }
+        if (!tb_persist_relocate(tb, rec)) {
+            tb_persist->rejected++;
+            return false;
+        }
+
+        tb->size = rec->size;
+        for (i = 0; i < 2; i++) {
+            tb->tb_next_offset[i] = rec->tb_next_offset[i];
+            tb->tb_jmp_offset[i] = rec->tb_jmp_offset[i];
+        }
+        flush_icache_range((tcg_target_ulong)tb->tc_ptr,
+                           (tcg_target_ulong)tb->tc_ptr + rec->code_size);
+        *code_size = rec->code_size;
+        tb_persist->loaded++;
+        return true;
+    }
+    return false;
+}
+
+void tb_persist_save(CPUArchState *env, TranslationBlock *tb, int code_size)
+{
+    TCGContext *s = &tcg_ctx;
+    TBPersistRecord *rec;
+    TBPersistReloc *r;
+    TBPersistEntry *e;
+    uint64_t hash;
+    size_t len;
+    int i, nb_relocs;
+
+    if (!tb_persist_usable(env) || s->host_ptr_used ||
+        s->nb_ext_relocs < 0 ||
+        !tb_persist_content_hash(env, tb->pc, tb->size, &hash)) {
+        return;
+    }
+
+    rec = g_malloc0(sizeof(*rec) + s->nb_ext_relocs * sizeof(*r) +
+                    code_size + 7);
+    rec->pc = tb->pc;
+    rec->cs_base = tb->cs_base;
+    rec->flags = tb->flags;
+    rec->cflags = tb->cflags;
+
+    /* already stored, but not usable at this address */
+    for (e = g_hash_table_lookup(tb_persist->index, rec); e; e = e->next) {
+        if (e->rec->size == tb->size && e->rec->content_hash == hash) {
+            g_free(rec);
+            return;
+        }
+    }
+
+    r = (TBPersistReloc *)(rec + 1);
+    nb_relocs = 0;
+    for (i = 0; i < s->nb_ext_relocs; i++) {
+        const TCGExtReloc *x = &s->ext_relocs[i];
+        tcg_target_long value = x->value;
+
+        if (x->type >= TCG_EXT_RELOC_TB_IMM32U) {
+            value -= (tcg_target_long)tb;
+            if (value < 0 || value > 3) {
+                g_free(rec);
+                return;
+            }
+        }
+        r[nb_relocs].offset = x->offset;
+        r[nb_relocs].type = x->type;
+        r[nb_relocs].value = value;
+        nb_relocs++;
+    }
+
+    rec->content_hash = hash;
+    rec->size = tb->size;
+    rec->code_size = code_size;
+    for (i = 0; i < 2; i++) {
+        rec->tb_next_offset[i] = tb->tb_next_offset[i];
+        rec->tb_jmp_offset[i] = tb->tb_jmp_offset[i];
+    }
+    rec->nb_relocs = nb_relocs;
+    memcpy(r + nb_relocs, tb->tc_ptr, code_size);
+    rec->checksum = tb_persist_checksum(rec);
+
+    len = tb_persist_record_len(rec);
+    if (fwrite(rec, len, 1, tb_persist->file) != 1) {
+        g_free(rec);
+        return;
+    }
+    tb_persist_index(tb_persist, rec);
+    tb_persist->saved++;
+}
+
+void tb_persist_dump_info(FILE *f, fprintf_function cpu_fprintf)
+{
+    if (tb_persist) {
+        cpu_fprintf(f, "TB persist          %u loaded, %u saved, "
+                    "%u not relocatable\n", tb_persist->loaded,
+                    tb_persist->saved, tb_persist->rejected);
+    }
+}
+
+#else
+
+int tb_persist_init(const char *path)
+{
+    return -ENOTSUP;
+}
+
+bool tb_persist_load(CPUArchState *env, TranslationBlock *tb,
+                     int *code_size)
+{
+    return false;
+}
+
+void tb_persist_save(CPUArchState *env, TranslationBlock *tb, int code_size)
+{
+}
+
+void tb_persist_dump_info(FILE *f, fprintf_function cpu_fprintf)
+{
+}
+
+#endif
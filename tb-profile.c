@@ -0,0 +1,233 @@
+/*
+ * Per-TB profiling of the TCG accelerator
+ *
+ * While profiling is enabled, every translated block increments an
+ * execution counter on entry; translation time, code sizes, softmmu TLB
+ * misses and returns to the main loop are accounted from C.  Statistics
+ * are keyed by pc, cs_base and flags, so they survive retranslation of
+ * the same guest code after a flush or an invalidation.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "config.h"
+#include "cpu.h"
+#include "exec-all.h"
+#include "tcg.h"
+#include "disas.h"
+#include "qemu-timer.h"
+#include "qmp-commands.h"
+#include "qerror.h"
+
+bool tb_profile_enabled;
+
+/* TBProfile entries are never freed, only cleared, because generated code
+   may still hold pointers to their counters.  */
+static GHashTable *tb_profiles;
+
+static guint tb_profile_hash(gconstpointer key)
+{
+    const TBProfile *p = key;
+
+    return p->pc ^ p->cs_base ^ p->flags ^ (p->flags >> 32);
+}
+
+static gboolean tb_profile_equal(gconstpointer a, gconstpointer b)
+{
+    const TBProfile *pa = a, *pb = b;
+
+    return pa->pc == pb->pc && pa->cs_base == pb->cs_base &&
+           pa->flags == pb->flags;
+}
+
+static TBProfile *tb_profile_get(TranslationBlock *tb)
+{
+    TBProfile key, *p;
+
+    key.pc = tb->pc;
+    key.cs_base = tb->cs_base;
+    key.flags = tb->flags;
+    p = g_hash_table_lookup(tb_profiles, &key);
+    if (!p) {
+        p = g_new0(TBProfile, 1);
+        p->pc = tb->pc;
+        p->cs_base = tb->cs_base;
+        p->flags = tb->flags;
+        g_hash_table_insert(tb_profiles, p, p);
+    }
+    return p;
+}
+
+void tb_profile_gen_code(CPUArchState *env, TranslationBlock *tb,
+                         int *code_size)
+{
+    TBProfile *p = tb_profile_get(tb);
+    uint16_t *opc;
+    int64_t ti;
+
+    tb->prof = p;
+    tb_profile_counter = &p->exec_count;
+    ti = get_clock();
+    cpu_gen_code(env, tb, code_size);
+    p->translate_time += get_clock() - ti;
+    tb_profile_counter = NULL;
+
+    p->translations++;
+    p->guest_size = tb->size;
+    p->host_size = *code_size;
+    p->helper_calls = 0;
+    for (opc = tcg_ctx.gen_opc_buf; opc < tcg_ctx.gen_opc_ptr; opc++) {
+        if (*opc == INDEX_op_call) {
+            p->helper_calls++;
+        }
+    }
+}
+
+void tb_profile_tlb_miss_slow(uintptr_t retaddr)
+{
+    TranslationBlock *tb = tb_find_pc(retaddr);
+
+    if (tb && tb->prof) {
+        tb->prof->tlb_misses++;
+    }
+}
+
+static void tb_profile_clear(gpointer key, gpointer value, gpointer opaque)
+{
+    TBProfile *p = value;
+    target_ulong pc = p->pc, cs_base = p->cs_base;
+    uint64_t flags = p->flags;
+
+    memset(p, 0, sizeof(*p));
+    p->pc = pc;
+    p->cs_base = cs_base;
+    p->flags = flags;
+}
+
+void qmp_tb_profile(bool enable, Error **errp)
+{
+    if (!tcg_enabled()) {
+        error_set(errp, QERR_UNSUPPORTED);
+        return;
+    }
+
+    tb_cache_lock();
+    if (enable) {
+        if (!tb_profiles) {
+            tb_profiles = g_hash_table_new(tb_profile_hash, tb_profile_equal);
+        }
+        g_hash_table_foreach(tb_profiles, tb_profile_clear, NULL);
+    }
+    if (enable || tb_profile_enabled) {
+        tb_profile_enabled = enable;
+        /* retranslate with or without the execution counters */
+        tb_flush(first_cpu);
+    }
+    tb_cache_unlock();
+}
+
+static void tb_profile_collect(gpointer key, gpointer value, gpointer opaque)
+{
+    TBProfile ***next = opaque;
+
+    *(*next)++ = value;
+}
+
+static TbProfileSortKey tb_profile_sort_key;
+
+static uint64_t tb_profile_sort_value(const TBProfile *p)
+{
+    switch (tb_profile_sort_key) {
+    case TB_PROFILE_SORT_KEY_TRANSLATE_TIME:
+        return p->translate_time;
+    case TB_PROFILE_SORT_KEY_HOST_SIZE:
+        return p->host_size;
+    case TB_PROFILE_SORT_KEY_TLB_MISSES:
+        return p->tlb_misses;
+    case TB_PROFILE_SORT_KEY_EXITS:
+        return p->unchained_exits + p->icount_exits;
+    default:
+        return p->exec_count;
+    }
+}
+
+static int tb_profile_compare(const void *a, const void *b)
+{
+    const TBProfile *pa = *(TBProfile * const *)a;
+    const TBProfile *pb = *(TBProfile * const *)b;
+    uint64_t va, vb;
+
+    if (tb_profile_sort_key == TB_PROFILE_SORT_KEY_PC) {
+        return pa->pc < pb->pc ? -1 : pa->pc > pb->pc;
+    }
+    /* descending */
+    va = tb_profile_sort_value(pa);
+    vb = tb_profile_sort_value(pb);
+    return va > vb ? -1 : va < vb;
+}
+
+TbProfileInfoList *qmp_query_tb_profile(bool has_sort, TbProfileSortKey sort,
+                                        bool has_limit, int64_t limit,
+                                        Error **errp)
+{
+    TbProfileInfoList *head = NULL, **prev = &head;
+    TBProfile **array, **next;
+    int64_t n = 0;
+    guint i, len;
+
+    if (has_limit && limit < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "limit",
+                  "a non-negative value");
+        return NULL;
+    }
+    if (!tb_profiles) {
+        return NULL;
+    }
+
+    tb_cache_lock();
+    len = g_hash_table_size(tb_profiles);
+    array = next = g_new(TBProfile *, len);
+    g_hash_table_foreach(tb_profiles, tb_profile_collect, &next);
+    tb_profile_sort_key = has_sort ? sort : TB_PROFILE_SORT_KEY_EXEC_COUNT;
+    qsort(array, len, sizeof(*array), tb_profile_compare);
+
+    for (i = 0; i < len && (!has_limit || n < limit); i++) {
+        const TBProfile *p = array[i];
+        TbProfileInfoList *entry;
+        TbProfileInfo *info;
+        const char *symbol;
+
+        /* not translated again since the last clear */
+        if (!p->translations) {
+            continue;
+        }
+        info = g_new0(TbProfileInfo, 1);
+        info->pc = p->pc;
+        info->cs_base = p->cs_base;
+        info->flags = p->flags;
+        symbol = lookup_symbol(p->pc);
+        if (symbol[0]) {
+            info->has_symbol = true;
+            info->symbol = g_strdup(symbol);
+        }
+        info->guest_size = p->guest_size;
+        info->host_size = p->host_size;
+        info->translations = p->translations;
+        info->translate_time = p->translate_time;
+        info->exec_count = p->exec_count;
+        info->helper_calls = p->helper_calls;
+        info->tlb_misses = p->tlb_misses;
+        info->unchained_exits = p->unchained_exits;
+        info->icount_exits = p->icount_exits;
+
+        entry = g_new0(TbProfileInfoList, 1);
+        entry->value = info;
+        *prev = entry;
+        prev = &entry->next;
+        n++;
+    }
+    tb_cache_unlock();
+    g_free(array);
+    return head;
+}
@@ -23,6 +23,7 @@
  */
 #include <stdint.h>
 
+#include "host-utils.h"
 #include "tcg/tcg-runtime.h"
 
 /* 32-bit helpers */
@@ -47,6 +48,11 @@ uint32_t tcg_helper_remu_i32(uint32_t arg1, uint32_t arg2)
     return arg1 % arg2;
 }
 
+uint32_t tcg_helper_clz_i32(uint32_t arg)
+{
+    return clz32(arg);
+}
+
 /* 64-bit helpers */
 
 int64_t tcg_helper_shl_i64(int64_t arg1, int64_t arg2)
@@ -83,3 +89,8 @@ uint64_t tcg_helper_remu_i64(uint64_t arg1, uint64_t arg2)
 {
     return arg1 % arg2;
 }
+
+uint64_t tcg_helper_clz_i64(uint64_t arg)
+{
+    return clz64(arg);
+}
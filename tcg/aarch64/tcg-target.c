@@ -0,0 +1,1566 @@
+/*
+ * Tiny Code Generator for QEMU
+ *
+ * Copyright (c) 2008 Fabrice Bellard
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef NDEBUG
+static const char * const tcg_target_reg_names[TCG_TARGET_NB_REGS] = {
+    "x0", "x1", "x2", "x3", "x4", "x5", "x6", "x7",
+    "x8", "x9", "x10", "x11", "x12", "x13", "x14", "x15",
+    "x16", "x17", "x18", "x19", "x20", "x21", "x22", "x23",
+    "x24", "x25", "x26", "x27", "x28", "fp", "lr", "sp",
+};
+#endif
+
+static const int tcg_target_reg_alloc_order[] = {
+    /* Call saved registers first, they survive helper calls.  */
+    TCG_REG_X20, TCG_REG_X21, TCG_REG_X22, TCG_REG_X23,
+    TCG_REG_X24, TCG_REG_X25, TCG_REG_X26, TCG_REG_X27,
+    TCG_REG_X28,
+
+    TCG_REG_X8, TCG_REG_X9, TCG_REG_X10, TCG_REG_X11,
+    TCG_REG_X12, TCG_REG_X13, TCG_REG_X14, TCG_REG_X15,
+    TCG_REG_X16, TCG_REG_X17,
+
+    /* Argument registers last, they are needed for helper calls.  */
+    TCG_REG_X7, TCG_REG_X6, TCG_REG_X5, TCG_REG_X4,
+    TCG_REG_X3, TCG_REG_X2, TCG_REG_X1, TCG_REG_X0,
+};
+
+static const int tcg_target_call_iarg_regs[8] = {
+    TCG_REG_X0, TCG_REG_X1, TCG_REG_X2, TCG_REG_X3,
+    TCG_REG_X4, TCG_REG_X5, TCG_REG_X6, TCG_REG_X7,
+};
+
+static const int tcg_target_call_oarg_regs[1] = {
+    TCG_REG_X0,
+};
+
+/* The link register is saved by the prologue, so it is free to be used
+   as a scratch register within the translated code.  */
+#define TCG_REG_TMP TCG_REG_LR
+
+#ifndef CONFIG_SOFTMMU
+/* Holds GUEST_BASE for the whole life of the translated code.  */
+# define TCG_REG_GUEST_BASE TCG_REG_X28
+#endif
+
+static uint8_t *tb_ret_addr;
+
+typedef enum {
+    COND_EQ = 0x0,
+    COND_NE = 0x1,
+    COND_HS = 0x2,
+    COND_LO = 0x3,
+    COND_MI = 0x4,
+    COND_PL = 0x5,
+    COND_VS = 0x6,
+    COND_VC = 0x7,
+    COND_HI = 0x8,
+    COND_LS = 0x9,
+    COND_GE = 0xa,
+    COND_LT = 0xb,
+    COND_GT = 0xc,
+    COND_LE = 0xd,
+    COND_AL = 0xe,
+    COND_NV = 0xf, /* behaves like COND_AL here */
+} AArch64Cond;
+
+static const int tcg_cond_to_aarch64[] = {
+    [TCG_COND_EQ] = COND_EQ,
+    [TCG_COND_NE] = COND_NE,
+    [TCG_COND_LT] = COND_LT,
+    [TCG_COND_GE] = COND_GE,
+    [TCG_COND_LE] = COND_LE,
+    [TCG_COND_GT] = COND_GT,
+    [TCG_COND_LTU] = COND_LO,
+    [TCG_COND_GEU] = COND_HS,
+    [TCG_COND_LEU] = COND_LS,
+    [TCG_COND_GTU] = COND_HI,
+};
+
+/* Load/store sizes and operations, for bits 31:30 and 23:22 of the
+   load/store register instructions.  */
+enum aarch64_ldst_size {
+    LDST_8 = 0,
+    LDST_16 = 1,
+    LDST_32 = 2,
+    LDST_64 = 3,
+};
+
+enum aarch64_ldst_op {
+    LDST_ST = 0,        /* store */
+    LDST_LD = 1,        /* load, zero extend */
+    LDST_LD_S_X = 2,    /* load, sign extend to 64 bits */
+    LDST_LD_S_W = 3,    /* load, sign extend to 32 bits */
+};
+
+/* Extend/shift options of the register offset of a load/store.  */
+enum aarch64_ldst_ext {
+    LDST_EXT_UXTW = 2,
+    LDST_EXT_LSL = 3,
+};
+
+/* Instruction encodings, without the register and immediate fields.
+   The "ext" argument of the emitters below selects the 64-bit form
+   (bit 31, and the N bit of bitfield and logical immediate insns).  */
+enum aarch64_insn {
+    /* Load/store register.  */
+    INSN_LDST_IMM9 = 0x38000000,    /* unscaled signed 9-bit offset */
+    INSN_LDST_REG = 0x38200800,     /* register offset */
+    INSN_LDST_UIMM = 0x39000000,    /* scaled unsigned 12-bit offset */
+
+    /* Load/store pair of 64-bit registers.  */
+    INSN_STP = 0xa9000000,
+    INSN_STP_PRE = 0xa9800000,
+    INSN_LDP = 0xa9400000,
+    INSN_LDP_POST = 0xa8c00000,
+
+    /* Add/subtract and logical, shifted register.  */
+    ARITH_AND = 0x0a000000,
+    ARITH_BIC = 0x0a200000,
+    ARITH_OR = 0x2a000000,
+    ARITH_ORN = 0x2a200000,
+    ARITH_XOR = 0x4a000000,
+    ARITH_EON = 0x4a200000,
+    ARITH_ADD = 0x0b000000,
+    ARITH_ADDS = 0x2b000000,
+    ARITH_SUB = 0x4b000000,
+    ARITH_SUBS = 0x6b000000,
+
+    /* Add/subtract, 12-bit immediate optionally shifted by 12.  */
+    AIMM_ADD = 0x11000000,
+    AIMM_ADDS = 0x31000000,
+    AIMM_SUB = 0x51000000,
+    AIMM_SUBS = 0x71000000,
+
+    /* Logical, bitmask immediate.  */
+    LIMM_AND = 0x12000000,
+    LIMM_OR = 0x32000000,
+    LIMM_XOR = 0x52000000,
+
+    /* Move wide immediate.  */
+    INSN_MOVN = 0x12800000,
+    INSN_MOVZ = 0x52800000,
+    INSN_MOVK = 0x72800000,
+
+    /* Bitfield and extract.  */
+    INSN_SBFM = 0x13000000,
+    INSN_BFM = 0x33000000,
+    INSN_UBFM = 0x53000000,
+    INSN_EXTR = 0x13800000,
+
+    /* Data processing, one and two sources.  */
+    INSN_REV16 = 0x5ac00400,
+    INSN_REV32 = 0x5ac00800,
+    INSN_REV64 = 0xdac00c00,
+    INSN_CLZ = 0x5ac01000,
+    INSN_UDIV = 0x1ac00800,
+    INSN_SDIV = 0x1ac00c00,
+    INSN_LSLV = 0x1ac02000,
+    INSN_LSRV = 0x1ac02400,
+    INSN_ASRV = 0x1ac02800,
+    INSN_RORV = 0x1ac02c00,
+
+    /* Data processing, three sources.  */
+    INSN_MADD = 0x1b000000,
+    INSN_MSUB = 0x1b008000,
+
+    /* Conditional select.  */
+    INSN_CSEL = 0x1a800000,
+    INSN_CSINC = 0x1a800400,
+
+    /* Branches.  */
+    INSN_B = 0x14000000,
+    INSN_BL = 0x94000000,
+    INSN_B_C = 0x54000000,
+    INSN_CBZ = 0x34000000,
+    INSN_CBNZ = 0x35000000,
+    INSN_BR = 0xd61f0000,
+    INSN_BLR = 0xd63f0000,
+    INSN_RET = 0xd65f0000,
+};
+
+static inline void reloc_pc26(void *code_ptr, tcg_target_long target)
+{
+    tcg_target_long disp = (target - (tcg_target_long)code_ptr) >> 2;
+
+    if ((disp << 38) >> 38 != disp) {
+        tcg_abort();
+    }
+    *(uint32_t *)code_ptr = (*(uint32_t *)code_ptr & ~0x3ffffff)
+        | (disp & 0x3ffffff);
+}
+
+static inline void reloc_pc19(void *code_ptr, tcg_target_long target)
+{
+    tcg_target_long disp = (target - (tcg_target_long)code_ptr) >> 2;
+
+    if ((disp << 45) >> 45 != disp) {
+        tcg_abort();
+    }
+    *(uint32_t *)code_ptr = (*(uint32_t *)code_ptr & ~(0x7ffff << 5))
+        | (disp & 0x7ffff) << 5;
+}
+
+static void patch_reloc(uint8_t *code_ptr, int type,
+                        tcg_target_long value, tcg_target_long addend)
+{
+    value += addend;
+    switch (type) {
+    case R_AARCH64_JUMP26:
+    case R_AARCH64_CALL26:
+        reloc_pc26(code_ptr, value);
+        break;
+    case R_AARCH64_CONDBR19:
+        reloc_pc19(code_ptr, value);
+        break;
+    default:
+        tcg_abort();
+    }
+}
+
+/* Add/subtract immediate: 12 bits, optionally shifted left by 12.  */
+static inline bool is_aimm(uint64_t val)
+{
+    return (val & ~0xfff) == 0 || (val & ~0xfff000) == 0;
+}
+
+/* Logical immediate.  Take a simplified view and only match a single run
+   of ones, possibly rotated, ignoring the replicated element sizes:
+       0....01....1
+       0..01..10..0
+   and their inverses.  */
+static inline bool is_limm(uint64_t val)
+{
+    /* Test the form with the msb clear.  */
+    if ((int64_t)val < 0) {
+        val = ~val;
+    }
+    if (val == 0) {
+        return false;
+    }
+    val += val & -val;
+    return (val & (val - 1)) == 0;
+}
+
+/* parse target specific constraints */
+static int target_parse_constraint(TCGArgConstraint *ct, const char **pct_str)
+{
+    const char *ct_str = *pct_str;
+
+    switch (ct_str[0]) {
+    case 'r':
+        ct->ct |= TCG_CT_REG;
+        tcg_regset_set32(ct->u.regs, 0, 0xffffffff);
+        break;
+    case 'l': /* qemu_ld/qemu_st address and data */
+        ct->ct |= TCG_CT_REG;
+        tcg_regset_set32(ct->u.regs, 0, 0xffffffff);
+#ifdef CONFIG_SOFTMMU
+        /* x0-x3 are used by the TLB lookup and as helper arguments.  */
+        tcg_regset_reset_reg(ct->u.regs, TCG_REG_X0);
+        tcg_regset_reset_reg(ct->u.regs, TCG_REG_X1);
+        tcg_regset_reset_reg(ct->u.regs, TCG_REG_X2);
+        tcg_regset_reset_reg(ct->u.regs, TCG_REG_X3);
+#endif
+        break;
+    case 'A': /* add/subtract immediate */
+        ct->ct |= TCG_CT_CONST_AIMM;
+        break;
+    case 'L': /* logical immediate */
+        ct->ct |= TCG_CT_CONST_LIMM;
+        break;
+    default:
+        return -1;
+    }
+    ct_str++;
+    *pct_str = ct_str;
+    return 0;
+}
+
+/* test if a constant matches the constraint */
+static int tcg_target_const_match(tcg_target_long val,
+                                  const TCGArgConstraint *arg_ct)
+{
+    int ct = arg_ct->ct;
+
+    if (ct & TCG_CT_CONST) {
+        return 1;
+    }
+    if ((ct & TCG_CT_CONST_AIMM) && (is_aimm(val) || is_aimm(-val))) {
+        return 1;
+    }
+    if ((ct & TCG_CT_CONST_LIMM) && is_limm(val)) {
+        return 1;
+    }
+    return 0;
+}
+
+static inline void tcg_out_ldst_9(TCGContext *s, enum aarch64_ldst_size size,
+                                  enum aarch64_ldst_op op, TCGReg rd,
+                                  TCGReg rn, tcg_target_long offset)
+{
+    tcg_out32(s, INSN_LDST_IMM9 | size << 30 | op << 22
+              | (offset & 0x1ff) << 12 | rn << 5 | rd);
+}
+
+static inline void tcg_out_ldst_12(TCGContext *s, enum aarch64_ldst_size size,
+                                   enum aarch64_ldst_op op, TCGReg rd,
+                                   TCGReg rn, tcg_target_ulong scaled_uimm)
+{
+    tcg_out32(s, INSN_LDST_UIMM | size << 30 | op << 22
+              | scaled_uimm << 10 | rn << 5 | rd);
+}
+
+static inline void tcg_out_ldst_r(TCGContext *s, enum aarch64_ldst_size size,
+                                  enum aarch64_ldst_op op, TCGReg rd,
+                                  TCGReg base, TCGReg regoff,
+                                  enum aarch64_ldst_ext ext)
+{
+    tcg_out32(s, INSN_LDST_REG | size << 30 | op << 22 | regoff << 16
+              | ext << 13 | base << 5 | rd);
+}
+
+static inline void tcg_out_ldst_pair(TCGContext *s, enum aarch64_insn insn,
+                                     TCGReg r1, TCGReg r2, TCGReg rn,
+                                     tcg_target_long offset)
+{
+    tcg_out32(s, insn | ((offset >> 3) & 0x7f) << 15 | r2 << 10
+              | rn << 5 | r1);
+}
+
+static inline void tcg_out_arith(TCGContext *s, enum aarch64_insn insn,
+                                 int ext, TCGReg rd, TCGReg rn, TCGReg rm,
+                                 int shift_imm)
+{
+    /* Register 31 is the zero register here, not the stack pointer.  */
+    tcg_out32(s, insn | ext << 31 | rm << 16 | shift_imm << 10
+              | rn << 5 | rd);
+}
+
+static void tcg_out_aimm(TCGContext *s, enum aarch64_insn insn, int ext,
+                         TCGReg rd, TCGReg rn, tcg_target_ulong aimm)
+{
+    if (aimm > 0xfff) {
+        aimm >>= 12;
+        insn |= 1 << 22;
+    }
+    /* Register 31 is the stack pointer here, except for the destination
+       of the flag-setting forms.  */
+    tcg_out32(s, insn | ext << 31 | aimm << 10 | rn << 5 | rd);
+}
+
+static void tcg_out_addsubi(TCGContext *s, int ext, TCGReg rd, TCGReg rn,
+                            tcg_target_long aimm)
+{
+    if (aimm >= 0) {
+        tcg_out_aimm(s, AIMM_ADD, ext, rd, rn, aimm);
+    } else {
+        tcg_out_aimm(s, AIMM_SUB, ext, rd, rn, -aimm);
+    }
+}
+
+/* Emit a logical immediate insn; LIMM must satisfy is_limm().  For the
+   32-bit forms it must be sign-extended from 32 bits.  */
+static void tcg_out_logicali(TCGContext *s, enum aarch64_insn insn, int ext,
+                             TCGReg rd, TCGReg rn, uint64_t limm)
+{
+    unsigned h, l, r, c;
+
+    h = clz64(limm);
+    l = ctz64(limm);
+    if (l == 0) {
+        r = 0;                  /* form 0....01....1 */
+        c = ctz64(~limm) - 1;
+        if (h == 0) {
+            r = clz64(~limm);   /* form 1..10..01..1 */
+            c += r;
+        }
+    } else {
+        r = 64 - l;             /* form 1....10....0 or 0..01..10..0 */
+        c = r - h - 1;
+    }
+    if (!ext) {
+        r &= 31;
+        c &= 31;
+    }
+    tcg_out32(s, insn | ext << 31 | ext << 22 | r << 16 | c << 10
+              | rn << 5 | rd);
+}
+
+static inline void tcg_out_bfm(TCGContext *s, enum aarch64_insn insn, int ext,
+                               TCGReg rd, TCGReg rn,
+                               unsigned int immr, unsigned int imms)
+{
+    tcg_out32(s, insn | ext << 31 | ext << 22 | immr << 16 | imms << 10
+              | rn << 5 | rd);
+}
+
+static inline void tcg_out_extr(TCGContext *s, int ext, TCGReg rd,
+                                TCGReg rn, TCGReg rm, unsigned int lsb)
+{
+    tcg_out32(s, INSN_EXTR | ext << 31 | ext << 22 | rm << 16 | lsb << 10
+              | rn << 5 | rd);
+}
+
+static inline void tcg_out_dp1(TCGContext *s, enum aarch64_insn insn, int ext,
+                               TCGReg rd, TCGReg rn)
+{
+    tcg_out32(s, insn | ext << 31 | rn << 5 | rd);
+}
+
+static inline void tcg_out_dp2(TCGContext *s, enum aarch64_insn insn, int ext,
+                               TCGReg rd, TCGReg rn, TCGReg rm)
+{
+    tcg_out32(s, insn | ext << 31 | rm << 16 | rn << 5 | rd);
+}
+
+static inline void tcg_out_dp3(TCGContext *s, enum aarch64_insn insn, int ext,
+                               TCGReg rd, TCGReg rn, TCGReg rm, TCGReg ra)
+{
+    tcg_out32(s, insn | ext << 31 | rm << 16 | ra << 10 | rn << 5 | rd);
+}
+
+static inline void tcg_out_csel(TCGContext *s, enum aarch64_insn insn,
+                                int ext, TCGReg rd, TCGReg rn, TCGReg rm,
+                                AArch64Cond cond)
+{
+    tcg_out32(s, insn | ext << 31 | rm << 16 | cond << 12 | rn << 5 | rd);
+}
+
+static inline void tcg_out_movw(TCGContext *s, enum aarch64_insn insn,
+                                int ext, TCGReg rd, uint16_t half, int shift)
+{
+    tcg_out32(s, insn | ext << 31 | (shift / 16) << 21 | half << 5 | rd);
+}
+
+static inline void tcg_out_mov(TCGContext *s,
+                               TCGType type, TCGReg ret, TCGReg arg)
+{
+    if (ret != arg) {
+        tcg_out_arith(s, ARITH_OR, type == TCG_TYPE_I64,
+                      ret, TCG_REG_XZR, arg, 0);
+    }
+}
+
+static void tcg_out_movi(TCGContext *s, TCGType type,
+                         TCGReg rd, tcg_target_long value)
+{
+    int ext = type == TCG_TYPE_I64;
+    int bits = ext ? 64 : 32;
+    uint64_t ival = value, inv;
+    int shift, nzero, nones;
+    enum aarch64_insn insn;
+
+    if (!ext) {
+        ival = (uint32_t)ival;
+    }
+    inv = ~ival & (ext ? -1ull : 0xffffffffull);
+
+    /* A single MOVZ or MOVN.  */
+    for (shift = 0; shift < bits; shift += 16) {
+        if ((ival & ~(0xffffull << shift)) == 0) {
+            tcg_out_movw(s, INSN_MOVZ, ext, rd, ival >> shift, shift);
+            return;
+        }
+        if ((inv & ~(0xffffull << shift)) == 0) {
+            tcg_out_movw(s, INSN_MOVN, ext, rd, inv >> shift, shift);
+            return;
+        }
+    }
+
+    /* A single ORR with a logical immediate.  */
+    if (is_limm(ext ? ival : (uint64_t)(int32_t)ival)) {
+        tcg_out_logicali(s, LIMM_OR, ext, rd, TCG_REG_XZR,
+                         ext ? ival : (uint64_t)(int32_t)ival);
+        return;
+    }
+
+    /* Otherwise start with MOVZ or MOVN, whichever leaves fewer halfwords
+       to be patched in with MOVK.  */
+    nzero = nones = 0;
+    for (shift = 0; shift < bits; shift += 16) {
+        nzero += ((ival >> shift) & 0xffff) == 0;
+        nones += ((ival >> shift) & 0xffff) == 0xffff;
+    }
+
+    insn = nones > nzero ? INSN_MOVN : INSN_MOVZ;
+    for (shift = 0; shift < bits; shift += 16) {
+        uint16_t half = ival >> shift;
+
+        if (half == (insn == INSN_MOVN ? 0xffff : 0)) {
+            continue;
+        }
+        if (insn == INSN_MOVN) {
+            tcg_out_movw(s, INSN_MOVN, ext, rd, ~half, shift);
+        } else {
+            tcg_out_movw(s, insn, ext, rd, half, shift);
+        }
+        insn = INSN_MOVK;
+    }
+}
+
+static void tcg_out_ldst(TCGContext *s, enum aarch64_ldst_size size,
+                         enum aarch64_ldst_op op, TCGReg rd, TCGReg rn,
+                         tcg_target_long offset)
+{
+    if (offset >= 0 && !(offset & ((1 << size) - 1))
+        && (offset >> size) < 0x1000) {
+        tcg_out_ldst_12(s, size, op, rd, rn, offset >> size);
+        return;
+    }
+    if (offset >= -256 && offset < 256) {
+        tcg_out_ldst_9(s, size, op, rd, rn, offset);
+        return;
+    }
+    tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_TMP, offset);
+    tcg_out_ldst_r(s, size, op, rd, rn, TCG_REG_TMP, LDST_EXT_LSL);
+}
+
+static inline void tcg_out_ld(TCGContext *s, TCGType type, TCGReg arg,
+                              TCGReg arg1, tcg_target_long arg2)
+{
+    tcg_out_ldst(s, type == TCG_TYPE_I64 ? LDST_64 : LDST_32, LDST_LD,
+                 arg, arg1, arg2);
+}
+
+static inline void tcg_out_st(TCGContext *s, TCGType type, TCGReg arg,
+                              TCGReg arg1, tcg_target_long arg2)
+{
+    tcg_out_ldst(s, type == TCG_TYPE_I64 ? LDST_64 : LDST_32, LDST_ST,
+                 arg, arg1, arg2);
+}
+
+/* Logical operation with a constant operand.  The constant matched
+   is_limm() as a 64-bit value, but a 32-bit operation can still see
+   0 or -1 once it is sign-extended; use a register for those.  */
+static void tcg_out_logical_const(TCGContext *s, enum aarch64_insn limm_insn,
+                                  enum aarch64_insn reg_insn, int ext,
+                                  TCGReg rd, TCGReg rn, tcg_target_long val)
+{
+    if (!ext) {
+        val = (int32_t)val;
+    }
+    if (is_limm(val)) {
+        tcg_out_logicali(s, limm_insn, ext, rd, rn, val);
+    } else {
+        tcg_out_movi(s, ext ? TCG_TYPE_I64 : TCG_TYPE_I32, TCG_REG_TMP, val);
+        tcg_out_arith(s, reg_insn, ext, rd, rn, TCG_REG_TMP, 0);
+    }
+}
+
+static void tcg_out_cmp(TCGContext *s, int ext, TCGReg a,
+                        tcg_target_long b, int const_b)
+{
+    if (!const_b) {
+        tcg_out_arith(s, ARITH_SUBS, ext, TCG_REG_XZR, a, b, 0);
+    } else if (b >= 0) {
+        tcg_out_aimm(s, AIMM_SUBS, ext, TCG_REG_XZR, a, b);
+    } else {
+        tcg_out_aimm(s, AIMM_ADDS, ext, TCG_REG_XZR, a, -b);
+    }
+}
+
+static inline void tcg_out_goto(TCGContext *s, tcg_target_long target)
+{
+    tcg_target_long disp = (target - (tcg_target_long)s->code_ptr) >> 2;
+
+    if ((disp << 38) >> 38 == disp) {
+        tcg_out32(s, INSN_B | (disp & 0x3ffffff));
+    } else {
+        tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_TMP, target);
+        tcg_out32(s, INSN_BR | TCG_REG_TMP << 5);
+    }
+}
+
+static inline void tcg_out_call(TCGContext *s, tcg_target_long target)
+{
+    tcg_target_long disp = (target - (tcg_target_long)s->code_ptr) >> 2;
+
+    if ((disp << 38) >> 38 == disp) {
+        tcg_out32(s, INSN_BL | (disp & 0x3ffffff));
+    } else {
+        tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_TMP, target);
+        tcg_out32(s, INSN_BLR | TCG_REG_TMP << 5);
+    }
+}
+
+static void tcg_out_goto_label(TCGContext *s, int label_index)
+{
+    TCGLabel *l = &s->labels[label_index];
+
+    if (l->has_value) {
+        tcg_out_goto(s, l->u.value);
+    } else {
+        tcg_out_reloc(s, s->code_ptr, R_AARCH64_JUMP26, label_index, 0);
+        tcg_out32(s, INSN_B);
+    }
+}
+
+/* Emit a B.cond, CBZ or CBNZ to a label.  */
+static void tcg_out_goto_label_cond(TCGContext *s, uint32_t insn,
+                                    int label_index)
+{
+    TCGLabel *l = &s->labels[label_index];
+    tcg_target_long disp = 0;
+
+    if (l->has_value) {
+        disp = (l->u.value - (tcg_target_long)s->code_ptr) >> 2;
+        if ((disp << 45) >> 45 != disp) {
+            tcg_abort();
+        }
+    } else {
+        tcg_out_reloc(s, s->code_ptr, R_AARCH64_CONDBR19, label_index, 0);
+    }
+    tcg_out32(s, insn | (disp & 0x7ffff) << 5);
+}
+
+static void tcg_out_brcond(TCGContext *s, int ext, TCGCond cond, TCGArg a,
+                           TCGArg b, int const_b, int label_index)
+{
+    if (const_b && b == 0 && (cond == TCG_COND_EQ || cond == TCG_COND_NE)) {
+        tcg_out_goto_label_cond(s, (cond == TCG_COND_EQ ? INSN_CBZ : INSN_CBNZ)
+                                | ext << 31 | a, label_index);
+        return;
+    }
+    tcg_out_cmp(s, ext, a, b, const_b);
+    tcg_out_goto_label_cond(s, INSN_B_C | tcg_cond_to_aarch64[cond],
+                            label_index);
+}
+
+void aarch64_tb_set_jmp_target(uintptr_t jmp_addr, uintptr_t addr)
+{
+    tcg_target_long disp = ((tcg_target_long)addr
+                            - (tcg_target_long)jmp_addr) >> 2;
+
+    if ((disp << 38) >> 38 != disp) {
+        tcg_abort();
+    }
+    /* A single aligned word store, so other threads see either the old
+       or the new branch.  */
+    *(uint32_t *)jmp_addr = INSN_B | (disp & 0x3ffffff);
+    flush_icache_range(jmp_addr, jmp_addr + 4);
+}
+
+#ifdef CONFIG_SOFTMMU
+
+#include "../../softmmu_defs.h"
+
+/* helper signature: helper_ld_mmu(CPUState *env, target_ulong addr,
+   int mmu_idx) */
+static const void * const qemu_ld_helpers[4] = {
+    helper_ldb_mmu,
+    helper_ldw_mmu,
+    helper_ldl_mmu,
+    helper_ldq_mmu,
+};
+
+/* helper signature: helper_st_mmu(CPUState *env, target_ulong addr,
+   uintxx_t val, int mmu_idx) */
+static const void * const qemu_st_helpers[4] = {
+    helper_stb_mmu,
+    helper_stw_mmu,
+    helper_stl_mmu,
+    helper_stq_mmu,
+};
+
+/* Look up the TLB entry of ADDR_REG and compare it with the address,
+   leaving the flags set for a B.NE to the slow path.  On exit x1 holds
+   the addend of the entry; x0-x3 are clobbered.  */
+static void tcg_out_tlb_read(TCGContext *s, TCGReg addr_reg, int s_bits,
+                             int mem_index, int is_read)
+{
+    int ext = TARGET_LONG_BITS == 64;
+    int cmp_off = (is_read
+                   ? offsetof(CPUArchState, tlb_table[mem_index][0].addr_read)
+                   : offsetof(CPUArchState, tlb_table[mem_index][0].addr_write));
+    int add_off = offsetof(CPUArchState, tlb_table[mem_index][0].addend);
+    int high = add_off & ~0xfff;
+
+    /* x0 = index of the TLB entry.  */
+    tcg_out_bfm(s, INSN_UBFM, ext, TCG_REG_X0, addr_reg, TARGET_PAGE_BITS,
+                TARGET_PAGE_BITS + CPU_TLB_BITS - 1);
+    /* x0 = &env->tlb_table[0][index], then bring the offsets of the
+       fields into range of the loads below.  */
+    tcg_out_arith(s, ARITH_ADD, 1, TCG_REG_X0, TCG_AREG0, TCG_REG_X0,
+                  CPU_TLB_ENTRY_BITS);
+    if (high) {
+        assert(high <= 0xfff000);
+        tcg_out_aimm(s, AIMM_ADD, 1, TCG_REG_X0, TCG_REG_X0, high);
+    }
+    /* x1 = the comparator, x3 = the page of the address, keeping the low
+       bits that would make an unaligned access miss.  */
+    tcg_out_ldst(s, ext ? LDST_64 : LDST_32, LDST_LD,
+                 TCG_REG_X1, TCG_REG_X0, cmp_off - high);
+    tcg_out_logicali(s, LIMM_AND, ext, TCG_REG_X3, addr_reg,
+                     ext ? (uint64_t)(TARGET_PAGE_MASK | ((1 << s_bits) - 1))
+                     : (uint64_t)(int32_t)(TARGET_PAGE_MASK
+                                           | ((1 << s_bits) - 1)));
+    tcg_out_cmp(s, ext, TCG_REG_X1, TCG_REG_X3, 0);
+    /* x1 = the addend; loads do not change the flags.  */
+    tcg_out_ldst(s, LDST_64, LDST_LD, TCG_REG_X1, TCG_REG_X0, add_off - high);
+}
+
+#endif /* CONFIG_SOFTMMU */
+
+/* Access guest memory at BASE + ADDR_REG, where BASE is the TLB addend or
+   GUEST_BASE.  A 32-bit guest address is zero-extended by the insn.  */
+static void tcg_out_qemu_ld_direct(TCGContext *s, int opc, TCGReg data_reg,
+                                   TCGReg base, TCGReg addr_reg)
+{
+    enum aarch64_ldst_ext ext = (TARGET_LONG_BITS == 64
+                                 ? LDST_EXT_LSL : LDST_EXT_UXTW);
+#ifdef TARGET_WORDS_BIGENDIAN
+    const int bswap = 1;
+#else
+    const int bswap = 0;
+#endif
+
+    switch (opc) {
+    case 0:
+        tcg_out_ldst_r(s, LDST_8, LDST_LD, data_reg, base, addr_reg, ext);
+        break;
+    case 0 | 4:
+        tcg_out_ldst_r(s, LDST_8, LDST_LD_S_X, data_reg, base, addr_reg, ext);
+        break;
+    case 1:
+        tcg_out_ldst_r(s, LDST_16, LDST_LD, data_reg, base, addr_reg, ext);
+        if (bswap) {
+            tcg_out_dp1(s, INSN_REV16, 0, data_reg, data_reg);
+        }
+        break;
+    case 1 | 4:
+        if (bswap) {
+            tcg_out_ldst_r(s, LDST_16, LDST_LD, data_reg, base, addr_reg, ext);
+            tcg_out_dp1(s, INSN_REV16, 0, data_reg, data_reg);
+            tcg_out_bfm(s, INSN_SBFM, 1, data_reg, data_reg, 0, 15);
+        } else {
+            tcg_out_ldst_r(s, LDST_16, LDST_LD_S_X,
+                           data_reg, base, addr_reg, ext);
+        }
+        break;
+    case 2:
+        tcg_out_ldst_r(s, LDST_32, LDST_LD, data_reg, base, addr_reg, ext);
+        if (bswap) {
+            tcg_out_dp1(s, INSN_REV32, 0, data_reg, data_reg);
+        }
+        break;
+    case 2 | 4:
+        if (bswap) {
+            tcg_out_ldst_r(s, LDST_32, LDST_LD, data_reg, base, addr_reg, ext);
+            tcg_out_dp1(s, INSN_REV32, 0, data_reg, data_reg);
+            tcg_out_bfm(s, INSN_SBFM, 1, data_reg, data_reg, 0, 31);
+        } else {
+            tcg_out_ldst_r(s, LDST_32, LDST_LD_S_X,
+                           data_reg, base, addr_reg, ext);
+        }
+        break;
+    case 3:
+        tcg_out_ldst_r(s, LDST_64, LDST_LD, data_reg, base, addr_reg, ext);
+        if (bswap) {
+            tcg_out_dp1(s, INSN_REV64, 1, data_reg, data_reg);
+        }
+        break;
+    default:
+        tcg_abort();
+    }
+}
+
+static void tcg_out_qemu_st_direct(TCGContext *s, int opc, TCGReg data_reg,
+                                   TCGReg base, TCGReg addr_reg)
+{
+    enum aarch64_ldst_ext ext = (TARGET_LONG_BITS == 64
+                                 ? LDST_EXT_LSL : LDST_EXT_UXTW);
+#ifdef TARGET_WORDS_BIGENDIAN
+    const int bswap = 1;
+#else
+    const int bswap = 0;
+#endif
+
+    switch (opc) {
+    case 0:
+        break;
+    case 1:
+        if (bswap) {
+            tcg_out_dp1(s, INSN_REV16, 0, TCG_REG_TMP, data_reg);
+            data_reg = TCG_REG_TMP;
+        }
+        break;
+    case 2:
+        if (bswap) {
+            tcg_out_dp1(s, INSN_REV32, 0, TCG_REG_TMP, data_reg);
+            data_reg = TCG_REG_TMP;
+        }
+        break;
+    case 3:
+        if (bswap) {
+            tcg_out_dp1(s, INSN_REV64, 1, TCG_REG_TMP, data_reg);
+            data_reg = TCG_REG_TMP;
+        }
+        break;
+    default:
+        tcg_abort();
+    }
+    tcg_out_ldst_r(s, opc, LDST_ST, data_reg, base, addr_reg, ext);
+}
+
+static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args, int opc)
+{
+    TCGReg data_reg, addr_reg;
+#ifdef CONFIG_SOFTMMU
+    int mem_index, s_bits;
+    uint8_t *label1_ptr, *label2_ptr;
+#endif
+
+    data_reg = args[0];
+    addr_reg = args[1];
+
+#ifdef CONFIG_SOFTMMU
+    mem_index = args[2];
+    s_bits = opc & 3;
+
+    tcg_out_tlb_read(s, addr_reg, s_bits, mem_index, 1);
+
+    label1_ptr = s->code_ptr;
+    tcg_out32(s, INSN_B_C | COND_NE);
+
+    /* TLB hit */
+    tcg_out_qemu_ld_direct(s, opc, data_reg, TCG_REG_X1, addr_reg);
+
+    label2_ptr = s->code_ptr;
+    tcg_out32(s, INSN_B);
+
+    /* label1: TLB miss, call the helper */
+    reloc_pc19(label1_ptr, (tcg_target_long)s->code_ptr);
+
+    tcg_out_mov(s, TCG_TYPE_I64, TCG_REG_X0, TCG_AREG0);
+    tcg_out_mov(s, TARGET_LONG_BITS == 64 ? TCG_TYPE_I64 : TCG_TYPE_I32,
+                TCG_REG_X1, addr_reg);
+    tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_X2, mem_index);
+    tcg_out_call(s, (tcg_target_long)qemu_ld_helpers[s_bits]);
+
+    /* The upper bits of a narrow return value are undefined.  */
+    switch (opc) {
+    case 0:
+        tcg_out_bfm(s, INSN_UBFM, 0, data_reg, TCG_REG_X0, 0, 7);
+        break;
+    case 0 | 4:
+        tcg_out_bfm(s, INSN_SBFM, 1, data_reg, TCG_REG_X0, 0, 7);
+        break;
+    case 1:
+        tcg_out_bfm(s, INSN_UBFM, 0, data_reg, TCG_REG_X0, 0, 15);
+        break;
+    case 1 | 4:
+        tcg_out_bfm(s, INSN_SBFM, 1, data_reg, TCG_REG_X0, 0, 15);
+        break;
+    case 2:
+        tcg_out_arith(s, ARITH_OR, 0, data_reg, TCG_REG_XZR, TCG_REG_X0, 0);
+        break;
+    case 2 | 4:
+        tcg_out_bfm(s, INSN_SBFM, 1, data_reg, TCG_REG_X0, 0, 31);
+        break;
+    case 3:
+        tcg_out_mov(s, TCG_TYPE_I64, data_reg, TCG_REG_X0);
+        break;
+    }
+
+    /* label2: done */
+    reloc_pc26(label2_ptr, (tcg_target_long)s->code_ptr);
+#else
+    tcg_out_qemu_ld_direct(s, opc, data_reg, TCG_REG_GUEST_BASE, addr_reg);
+#endif
+}
+
+static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, int opc)
+{
+    TCGReg data_reg, addr_reg;
+#ifdef CONFIG_SOFTMMU
+    int mem_index;
+    uint8_t *label1_ptr, *label2_ptr;
+#endif
+
+    data_reg = args[0];
+    addr_reg = args[1];
+
+#ifdef CONFIG_SOFTMMU
+    mem_index = args[2];
+
+    tcg_out_tlb_read(s, addr_reg, opc, mem_index, 0);
+
+    label1_ptr = s->code_ptr;
+    tcg_out32(s, INSN_B_C | COND_NE);
+
+    /* TLB hit */
+    tcg_out_qemu_st_direct(s, opc, data_reg, TCG_REG_X1, addr_reg);
+
+    label2_ptr = s->code_ptr;
+    tcg_out32(s, INSN_B);
+
+    /* label1: TLB miss, call the helper */
+    reloc_pc19(label1_ptr, (tcg_target_long)s->code_ptr);
+
+    tcg_out_mov(s, TCG_TYPE_I64, TCG_REG_X0, TCG_AREG0);
+    tcg_out_mov(s, TARGET_LONG_BITS == 64 ? TCG_TYPE_I64 : TCG_TYPE_I32,
+                TCG_REG_X1, addr_reg);
+    tcg_out_mov(s, opc == 3 ? TCG_TYPE_I64 : TCG_TYPE_I32,
+                TCG_REG_X2, data_reg);
+    tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_X3, mem_index);
+    tcg_out_call(s, (tcg_target_long)qemu_st_helpers[opc]);
+
+    /* label2: done */
+    reloc_pc26(label2_ptr, (tcg_target_long)s->code_ptr);
+#else
+    tcg_out_qemu_st_direct(s, opc, data_reg, TCG_REG_GUEST_BASE, addr_reg);
+#endif
+}
+
+static void tcg_out_op(TCGContext *s, TCGOpcode opc, const TCGArg *args,
+                       const int *const_args)
+{
+    /* 99% of the time, we can signal the use of extension registers
+       by looking to see if the opcode handles 64-bit data.  */
+    int ext = (tcg_op_defs[opc].flags & TCG_OPF_64BIT) != 0;
+    int max = ext ? 63 : 31;
+    TCGArg a0 = args[0], a1 = args[1], a2 = args[2];
+    int c2 = const_args[2];
+
+    switch (opc) {
+    case INDEX_op_exit_tb:
+        tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_X0, a0);
+        tcg_out_goto(s, (tcg_target_long)tb_ret_addr);
+        break;
+    case INDEX_op_goto_tb:
+        if (s->tb_jmp_offset) {
+            /* direct jump method, patched by aarch64_tb_set_jmp_target */
+            s->tb_jmp_offset[a0] = s->code_ptr - s->code_buf;
+            tcg_out32(s, INSN_B | 1);
+        } else {
+            /* indirect jump method */
+            tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_TMP,
+                         (tcg_target_long)(s->tb_next + a0));
+            tcg_out_ldst(s, LDST_64, LDST_LD, TCG_REG_TMP, TCG_REG_TMP, 0);
+            tcg_out32(s, INSN_BR | TCG_REG_TMP << 5);
+        }
+        s->tb_next_offset[a0] = s->code_ptr - s->code_buf;
+        break;
+    case INDEX_op_goto_ptr:
+        tcg_out32(s, INSN_BR | a0 << 5);
+        break;
+    case INDEX_op_call:
+        if (const_args[0]) {
+            tcg_out_call(s, a0);
+        } else {
+            tcg_out32(s, INSN_BLR | a0 << 5);
+        }
+        break;
+    case INDEX_op_br:
+        tcg_out_goto_label(s, a0);
+        break;
+
+    case INDEX_op_mov_i32:
+    case INDEX_op_mov_i64:
+        tcg_out_mov(s, ext ? TCG_TYPE_I64 : TCG_TYPE_I32, a0, a1);
+        break;
+    case INDEX_op_movi_i32:
+        tcg_out_movi(s, TCG_TYPE_I32, a0, a1);
+        break;
+    case INDEX_op_movi_i64:
+        tcg_out_movi(s, TCG_TYPE_I64, a0, a1);
+        break;
+
+    case INDEX_op_ld8u_i32:
+    case INDEX_op_ld8u_i64:
+        tcg_out_ldst(s, LDST_8, LDST_LD, a0, a1, a2);
+        break;
+    case INDEX_op_ld8s_i32:
+        tcg_out_ldst(s, LDST_8, LDST_LD_S_W, a0, a1, a2);
+        break;
+    case INDEX_op_ld8s_i64:
+        tcg_out_ldst(s, LDST_8, LDST_LD_S_X, a0, a1, a2);
+        break;
+    case INDEX_op_ld16u_i32:
+    case INDEX_op_ld16u_i64:
+        tcg_out_ldst(s, LDST_16, LDST_LD, a0, a1, a2);
+        break;
+    case INDEX_op_ld16s_i32:
+        tcg_out_ldst(s, LDST_16, LDST_LD_S_W, a0, a1, a2);
+        break;
+    case INDEX_op_ld16s_i64:
+        tcg_out_ldst(s, LDST_16, LDST_LD_S_X, a0, a1, a2);
+        break;
+    case INDEX_op_ld_i32:
+    case INDEX_op_ld32u_i64:
+        tcg_out_ldst(s, LDST_32, LDST_LD, a0, a1, a2);
+        break;
+    case INDEX_op_ld32s_i64:
+        tcg_out_ldst(s, LDST_32, LDST_LD_S_X, a0, a1, a2);
+        break;
+    case INDEX_op_ld_i64:
+        tcg_out_ldst(s, LDST_64, LDST_LD, a0, a1, a2);
+        break;
+    case INDEX_op_st8_i32:
+    case INDEX_op_st8_i64:
+        tcg_out_ldst(s, LDST_8, LDST_ST, a0, a1, a2);
+        break;
+    case INDEX_op_st16_i32:
+    case INDEX_op_st16_i64:
+        tcg_out_ldst(s, LDST_16, LDST_ST, a0, a1, a2);
+        break;
+    case INDEX_op_st_i32:
+    case INDEX_op_st32_i64:
+        tcg_out_ldst(s, LDST_32, LDST_ST, a0, a1, a2);
+        break;
+    case INDEX_op_st_i64:
+        tcg_out_ldst(s, LDST_64, LDST_ST, a0, a1, a2);
+        break;
+
+    case INDEX_op_add_i32:
+    case INDEX_op_add_i64:
+        if (c2) {
+            tcg_out_addsubi(s, ext, a0, a1, ext ? a2 : (int32_t)a2);
+        } else {
+            tcg_out_arith(s, ARITH_ADD, ext, a0, a1, a2, 0);
+        }
+        break;
+    case INDEX_op_sub_i32:
+    case INDEX_op_sub_i64:
+        if (c2) {
+            tcg_out_addsubi(s, ext, a0, a1, -(ext ? a2 : (int32_t)a2));
+        } else {
+            tcg_out_arith(s, ARITH_SUB, ext, a0, a1, a2, 0);
+        }
+        break;
+    case INDEX_op_neg_i32:
+    case INDEX_op_neg_i64:
+        tcg_out_arith(s, ARITH_SUB, ext, a0, TCG_REG_XZR, a1, 0);
+        break;
+
+    case INDEX_op_and_i32:
+    case INDEX_op_and_i64:
+        if (c2) {
+            tcg_out_logical_const(s, LIMM_AND, ARITH_AND, ext, a0, a1, a2);
+        } else {
+            tcg_out_arith(s, ARITH_AND, ext, a0, a1, a2, 0);
+        }
+        break;
+    case INDEX_op_andc_i32:
+    case INDEX_op_andc_i64:
+        if (c2) {
+            tcg_out_logical_const(s, LIMM_AND, ARITH_AND, ext, a0, a1, ~a2);
+        } else {
+            tcg_out_arith(s, ARITH_BIC, ext, a0, a1, a2, 0);
+        }
+        break;
+    case INDEX_op_or_i32:
+    case INDEX_op_or_i64:
+        if (c2) {
+            tcg_out_logical_const(s, LIMM_OR, ARITH_OR, ext, a0, a1, a2);
+        } else {
+            tcg_out_arith(s, ARITH_OR, ext, a0, a1, a2, 0);
+        }
+        break;
+    case INDEX_op_orc_i32:
+    case INDEX_op_orc_i64:
+        if (c2) {
+            tcg_out_logical_const(s, LIMM_OR, ARITH_OR, ext, a0, a1, ~a2);
+        } else {
+            tcg_out_arith(s, ARITH_ORN, ext, a0, a1, a2, 0);
+        }
+        break;
+    case INDEX_op_xor_i32:
+    case INDEX_op_xor_i64:
+        if (c2) {
+            tcg_out_logical_const(s, LIMM_XOR, ARITH_XOR, ext, a0, a1, a2);
+        } else {
+            tcg_out_arith(s, ARITH_XOR, ext, a0, a1, a2, 0);
+        }
+        break;
+    case INDEX_op_eqv_i32:
+    case INDEX_op_eqv_i64:
+        if (c2) {
+            tcg_out_logical_const(s, LIMM_XOR, ARITH_XOR, ext, a0, a1, ~a2);
+        } else {
+            tcg_out_arith(s, ARITH_EON, ext, a0, a1, a2, 0);
+        }
+        break;
+    case INDEX_op_not_i32:
+    case INDEX_op_not_i64:
+        tcg_out_arith(s, ARITH_ORN, ext, a0, TCG_REG_XZR, a1, 0);
+        break;
+
+    case INDEX_op_mul_i32:
+    case INDEX_op_mul_i64:
+        tcg_out_dp3(s, INSN_MADD, ext, a0, a1, a2, TCG_REG_XZR);
+        break;
+    case INDEX_op_div_i32:
+    case INDEX_op_div_i64:
+        tcg_out_dp2(s, INSN_SDIV, ext, a0, a1, a2);
+        break;
+    case INDEX_op_divu_i32:
+    case INDEX_op_divu_i64:
+        tcg_out_dp2(s, INSN_UDIV, ext, a0, a1, a2);
+        break;
+    case INDEX_op_rem_i32:
+    case INDEX_op_rem_i64:
+        tcg_out_dp2(s, INSN_SDIV, ext, TCG_REG_TMP, a1, a2);
+        tcg_out_dp3(s, INSN_MSUB, ext, a0, TCG_REG_TMP, a2, a1);
+        break;
+    case INDEX_op_remu_i32:
+    case INDEX_op_remu_i64:
+        tcg_out_dp2(s, INSN_UDIV, ext, TCG_REG_TMP, a1, a2);
+        tcg_out_dp3(s, INSN_MSUB, ext, a0, TCG_REG_TMP, a2, a1);
+        break;
+
+    case INDEX_op_shl_i32:
+    case INDEX_op_shl_i64:
+        if (c2) {
+            /* LSL is an alias of UBFM */
+            tcg_out_bfm(s, INSN_UBFM, ext, a0, a1,
+                        -a2 & max, max - (a2 & max));
+        } else {
+            tcg_out_dp2(s, INSN_LSLV, ext, a0, a1, a2);
+        }
+        break;
+    case INDEX_op_shr_i32:
+    case INDEX_op_shr_i64:
+        if (c2) {
+            tcg_out_bfm(s, INSN_UBFM, ext, a0, a1, a2 & max, max);
+        } else {
+            tcg_out_dp2(s, INSN_LSRV, ext, a0, a1, a2);
+        }
+        break;
+    case INDEX_op_sar_i32:
+    case INDEX_op_sar_i64:
+        if (c2) {
+            tcg_out_bfm(s, INSN_SBFM, ext, a0, a1, a2 & max, max);
+        } else {
+            tcg_out_dp2(s, INSN_ASRV, ext, a0, a1, a2);
+        }
+        break;
+    case INDEX_op_rotr_i32:
+    case INDEX_op_rotr_i64:
+        if (c2) {
+            /* ROR is an alias of EXTR */
+            tcg_out_extr(s, ext, a0, a1, a1, a2 & max);
+        } else {
+            tcg_out_dp2(s, INSN_RORV, ext, a0, a1, a2);
+        }
+        break;
+    case INDEX_op_rotl_i32:
+    case INDEX_op_rotl_i64:
+        if (c2) {
+            tcg_out_extr(s, ext, a0, a1, a1, -a2 & max);
+        } else {
+            tcg_out_arith(s, ARITH_SUB, 0, TCG_REG_TMP, TCG_REG_XZR, a2, 0);
+            tcg_out_dp2(s, INSN_RORV, ext, a0, a1, TCG_REG_TMP);
+        }
+        break;
+
+    case INDEX_op_brcond_i32:
+    case INDEX_op_brcond_i64:
+        tcg_out_brcond(s, ext, a2, a0, a1, const_args[1], args[3]);
+        break;
+    case INDEX_op_setcond_i32:
+    case INDEX_op_setcond_i64:
+        tcg_out_cmp(s, ext, a1, a2, c2);
+        /* CSET is an alias of CSINC with the inverted condition */
+        tcg_out_csel(s, INSN_CSINC, 0, a0, TCG_REG_XZR, TCG_REG_XZR,
+                     tcg_cond_to_aarch64[tcg_invert_cond(args[3])]);
+        break;
+    case INDEX_op_movcond_i32:
+    case INDEX_op_movcond_i64:
+        tcg_out_cmp(s, ext, a1, a2, c2);
+        tcg_out_csel(s, INSN_CSEL, ext, a0, args[3], args[4],
+                     tcg_cond_to_aarch64[args[5]]);
+        break;
+
+    case INDEX_op_ext8s_i32:
+    case INDEX_op_ext8s_i64:
+        tcg_out_bfm(s, INSN_SBFM, ext, a0, a1, 0, 7);
+        break;
+    case INDEX_op_ext16s_i32:
+    case INDEX_op_ext16s_i64:
+        tcg_out_bfm(s, INSN_SBFM, ext, a0, a1, 0, 15);
+        break;
+    case INDEX_op_ext32s_i64:
+        tcg_out_bfm(s, INSN_SBFM, 1, a0, a1, 0, 31);
+        break;
+    case INDEX_op_ext8u_i32:
+    case INDEX_op_ext8u_i64:
+        tcg_out_bfm(s, INSN_UBFM, 0, a0, a1, 0, 7);
+        break;
+    case INDEX_op_ext16u_i32:
+    case INDEX_op_ext16u_i64:
+        tcg_out_bfm(s, INSN_UBFM, 0, a0, a1, 0, 15);
+        break;
+    case INDEX_op_ext32u_i64:
+        tcg_out_arith(s, ARITH_OR, 0, a0, TCG_REG_XZR, a1, 0);
+        break;
+
+    case INDEX_op_bswap16_i32:
+    case INDEX_op_bswap16_i64:
+        tcg_out_dp1(s, INSN_REV16, 0, a0, a1);
+        break;
+    case INDEX_op_bswap32_i32:
+    case INDEX_op_bswap32_i64:
+        tcg_out_dp1(s, INSN_REV32, 0, a0, a1);
+        break;
+    case INDEX_op_bswap64_i64:
+        tcg_out_dp1(s, INSN_REV64, 1, a0, a1);
+        break;
+
+    case INDEX_op_clz_i32:
+    case INDEX_op_clz_i64:
+        tcg_out_dp1(s, INSN_CLZ, ext, a0, a1);
+        break;
+
+    case INDEX_op_deposit_i32:
+    case INDEX_op_deposit_i64:
+        /* BFI is an alias of BFM */
+        tcg_out_bfm(s, INSN_BFM, ext, a0, a2, -args[3] & max, args[4] - 1);
+        break;
+
+    case INDEX_op_qemu_ld8u:
+        tcg_out_qemu_ld(s, args, 0);
+        break;
+    case INDEX_op_qemu_ld8s:
+        tcg_out_qemu_ld(s, args, 0 | 4);
+        break;
+    case INDEX_op_qemu_ld16u:
+        tcg_out_qemu_ld(s, args, 1);
+        break;
+    case INDEX_op_qemu_ld16s:
+        tcg_out_qemu_ld(s, args, 1 | 4);
+        break;
+    case INDEX_op_qemu_ld32:
+    case INDEX_op_qemu_ld32u:
+        tcg_out_qemu_ld(s, args, 2);
+        break;
+    case INDEX_op_qemu_ld32s:
+        tcg_out_qemu_ld(s, args, 2 | 4);
+        break;
+    case INDEX_op_qemu_ld64:
+        tcg_out_qemu_ld(s, args, 3);
+        break;
+    case INDEX_op_qemu_st8:
+        tcg_out_qemu_st(s, args, 0);
+        break;
+    case INDEX_op_qemu_st16:
+        tcg_out_qemu_st(s, args, 1);
+        break;
+    case INDEX_op_qemu_st32:
+        tcg_out_qemu_st(s, args, 2);
+        break;
+    case INDEX_op_qemu_st64:
+        tcg_out_qemu_st(s, args, 3);
+        break;
+
+    default:
+        tcg_dump_ops(s);
+        tcg_abort();
+    }
+}
+
+static const TCGTargetOpDef aarch64_op_defs[] = {
+    { INDEX_op_exit_tb, { } },
+    { INDEX_op_goto_tb, { } },
+    { INDEX_op_goto_ptr, { "r" } },
+    { INDEX_op_call, { "ri" } },
+    { INDEX_op_br, { } },
+
+    { INDEX_op_mov_i32, { "r", "r" } },
+    { INDEX_op_mov_i64, { "r", "r" } },
+    { INDEX_op_movi_i32, { "r" } },
+    { INDEX_op_movi_i64, { "r" } },
+
+    { INDEX_op_ld8u_i32, { "r", "r" } },
+    { INDEX_op_ld8s_i32, { "r", "r" } },
+    { INDEX_op_ld16u_i32, { "r", "r" } },
+    { INDEX_op_ld16s_i32, { "r", "r" } },
+    { INDEX_op_ld_i32, { "r", "r" } },
+    { INDEX_op_ld8u_i64, { "r", "r" } },
+    { INDEX_op_ld8s_i64, { "r", "r" } },
+    { INDEX_op_ld16u_i64, { "r", "r" } },
+    { INDEX_op_ld16s_i64, { "r", "r" } },
+    { INDEX_op_ld32u_i64, { "r", "r" } },
+    { INDEX_op_ld32s_i64, { "r", "r" } },
+    { INDEX_op_ld_i64, { "r", "r" } },
+
+    { INDEX_op_st8_i32, { "r", "r" } },
+    { INDEX_op_st16_i32, { "r", "r" } },
+    { INDEX_op_st_i32, { "r", "r" } },
+    { INDEX_op_st8_i64, { "r", "r" } },
+    { INDEX_op_st16_i64, { "r", "r" } },
+    { INDEX_op_st32_i64, { "r", "r" } },
+    { INDEX_op_st_i64, { "r", "r" } },
+
+    { INDEX_op_add_i32, { "r", "r", "rA" } },
+    { INDEX_op_add_i64, { "r", "r", "rA" } },
+    { INDEX_op_sub_i32, { "r", "r", "rA" } },
+    { INDEX_op_sub_i64, { "r", "r", "rA" } },
+    { INDEX_op_mul_i32, { "r", "r", "r" } },
+    { INDEX_op_mul_i64, { "r", "r", "r" } },
+    { INDEX_op_div_i32, { "r", "r", "r" } },
+    { INDEX_op_div_i64, { "r", "r", "r" } },
+    { INDEX_op_divu_i32, { "r", "r", "r" } },
+    { INDEX_op_divu_i64, { "r", "r", "r" } },
+    { INDEX_op_rem_i32, { "r", "r", "r" } },
+    { INDEX_op_rem_i64, { "r", "r", "r" } },
+    { INDEX_op_remu_i32, { "r", "r", "r" } },
+    { INDEX_op_remu_i64, { "r", "r", "r" } },
+    { INDEX_op_and_i32, { "r", "r", "rL" } },
+    { INDEX_op_and_i64, { "r", "r", "rL" } },
+    { INDEX_op_or_i32, { "r", "r", "rL" } },
+    { INDEX_op_or_i64, { "r", "r", "rL" } },
+    { INDEX_op_xor_i32, { "r", "r", "rL" } },
+    { INDEX_op_xor_i64, { "r", "r", "rL" } },
+    { INDEX_op_andc_i32, { "r", "r", "rL" } },
+    { INDEX_op_andc_i64, { "r", "r", "rL" } },
+    { INDEX_op_orc_i32, { "r", "r", "rL" } },
+    { INDEX_op_orc_i64, { "r", "r", "rL" } },
+    { INDEX_op_eqv_i32, { "r", "r", "rL" } },
+    { INDEX_op_eqv_i64, { "r", "r", "rL" } },
+
+    { INDEX_op_neg_i32, { "r", "r" } },
+    { INDEX_op_neg_i64, { "r", "r" } },
+    { INDEX_op_not_i32, { "r", "r" } },
+    { INDEX_op_not_i64, { "r", "r" } },
+
+    { INDEX_op_shl_i32, { "r", "r", "ri" } },
+    { INDEX_op_shr_i32, { "r", "r", "ri" } },
+    { INDEX_op_sar_i32, { "r", "r", "ri" } },
+    { INDEX_op_rotl_i32, { "r", "r", "ri" } },
+    { INDEX_op_rotr_i32, { "r", "r", "ri" } },
+    { INDEX_op_shl_i64, { "r", "r", "ri" } },
+    { INDEX_op_shr_i64, { "r", "r", "ri" } },
+    { INDEX_op_sar_i64, { "r", "r", "ri" } },
+    { INDEX_op_rotl_i64, { "r", "r", "ri" } },
+    { INDEX_op_rotr_i64, { "r", "r", "ri" } },
+
+    { INDEX_op_brcond_i32, { "r", "rA" } },
+    { INDEX_op_brcond_i64, { "r", "rA" } },
+    { INDEX_op_setcond_i32, { "r", "r", "rA" } },
+    { INDEX_op_setcond_i64, { "r", "r", "rA" } },
+    { INDEX_op_movcond_i32, { "r", "r", "rA", "r", "r" } },
+    { INDEX_op_movcond_i64, { "r", "r", "rA", "r", "r" } },
+
+    { INDEX_op_ext8s_i32, { "r", "r" } },
+    { INDEX_op_ext16s_i32, { "r", "r" } },
+    { INDEX_op_ext8u_i32, { "r", "r" } },
+    { INDEX_op_ext16u_i32, { "r", "r" } },
+    { INDEX_op_ext8s_i64, { "r", "r" } },
+    { INDEX_op_ext16s_i64, { "r", "r" } },
+    { INDEX_op_ext32s_i64, { "r", "r" } },
+    { INDEX_op_ext8u_i64, { "r", "r" } },
+    { INDEX_op_ext16u_i64, { "r", "r" } },
+    { INDEX_op_ext32u_i64, { "r", "r" } },
+
+    { INDEX_op_bswap16_i32, { "r", "r" } },
+    { INDEX_op_bswap32_i32, { "r", "r" } },
+    { INDEX_op_bswap16_i64, { "r", "r" } },
+    { INDEX_op_bswap32_i64, { "r", "r" } },
+    { INDEX_op_bswap64_i64, { "r", "r" } },
+
+    { INDEX_op_clz_i32, { "r", "r" } },
+    { INDEX_op_clz_i64, { "r", "r" } },
+
+    { INDEX_op_deposit_i32, { "r", "0", "r" } },
+    { INDEX_op_deposit_i64, { "r", "0", "r" } },
+
+    { INDEX_op_qemu_ld8u, { "r", "l" } },
+    { INDEX_op_qemu_ld8s, { "r", "l" } },
+    { INDEX_op_qemu_ld16u, { "r", "l" } },
+    { INDEX_op_qemu_ld16s, { "r", "l" } },
+    { INDEX_op_qemu_ld32, { "r", "l" } },
+    { INDEX_op_qemu_ld32u, { "r", "l" } },
+    { INDEX_op_qemu_ld32s, { "r", "l" } },
+    { INDEX_op_qemu_ld64, { "r", "l" } },
+
+    { INDEX_op_qemu_st8, { "l", "l" } },
+    { INDEX_op_qemu_st16, { "l", "l" } },
+    { INDEX_op_qemu_st32, { "l", "l" } },
+    { INDEX_op_qemu_st64, { "l", "l" } },
+
+    { -1 },
+};
+
+/* Frame layout: the callee-saved registers x19-x28, the frame pointer
+   and the link register are pushed at the top, then come the TCG temps
+   and the outgoing stack arguments of helper calls.  */
+#define PUSH_SIZE  ((TCG_REG_LR - TCG_REG_X19 + 1) * 8)
+
+#define FRAME_SIZE \
+    ((PUSH_SIZE \
+      + TCG_STATIC_CALL_ARGS_SIZE \
+      + CPU_TEMP_BUF_NLONGS * sizeof(long) \
+      + TCG_TARGET_STACK_ALIGN - 1) \
+     & ~(TCG_TARGET_STACK_ALIGN - 1))
+
+/* Generate global QEMU prologue and epilogue code */
+static void tcg_target_qemu_prologue(TCGContext *s)
+{
+    TCGReg r;
+
+    /* Push (fp, lr) and allocate space for all the saved registers.  */
+    tcg_out_ldst_pair(s, INSN_STP_PRE, TCG_REG_FP, TCG_REG_LR,
+                      TCG_REG_SP, -PUSH_SIZE);
+
+    /* Set up the frame pointer, for the benefit of debuggers.  */
+    tcg_out_aimm(s, AIMM_ADD, 1, TCG_REG_FP, TCG_REG_SP, 0);
+
+    /* Store the callee-saved registers x19-x28.  */
+    for (r = TCG_REG_X19; r <= TCG_REG_X27; r += 2) {
+        tcg_out_ldst_pair(s, INSN_STP, r, r + 1, TCG_REG_SP,
+                          (r - TCG_REG_X19 + 2) * 8);
+    }
+
+    /* Reserve the stack space for the TCG temps and call arguments.  */
+    tcg_out_aimm(s, AIMM_SUB, 1, TCG_REG_SP, TCG_REG_SP,
+                 FRAME_SIZE - PUSH_SIZE);
+    tcg_set_frame(s, TCG_REG_CALL_STACK, TCG_STATIC_CALL_ARGS_SIZE,
+                  CPU_TEMP_BUF_NLONGS * sizeof(long));
+
+#ifndef CONFIG_SOFTMMU
+    tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_GUEST_BASE, GUEST_BASE);
+#endif
+
+    tcg_out_mov(s, TCG_TYPE_PTR, TCG_AREG0, tcg_target_call_iarg_regs[0]);
+    tcg_out32(s, INSN_BR | tcg_target_call_iarg_regs[1] << 5);
+
+    /* Return path for goto_ptr: same as exit_tb(0) */
+    code_gen_epilogue = s->code_ptr;
+    tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_X0, 0);
+
+    /* TB epilogue */
+    tb_ret_addr = s->code_ptr;
+
+    tcg_out_aimm(s, AIMM_ADD, 1, TCG_REG_SP, TCG_REG_SP,
+                 FRAME_SIZE - PUSH_SIZE);
+
+    for (r = TCG_REG_X19; r <= TCG_REG_X27; r += 2) {
+        tcg_out_ldst_pair(s, INSN_LDP, r, r + 1, TCG_REG_SP,
+                          (r - TCG_REG_X19 + 2) * 8);
+    }
+
+    /* Pop (fp, lr) and restore sp to its value on entry.  */
+    tcg_out_ldst_pair(s, INSN_LDP_POST, TCG_REG_FP, TCG_REG_LR,
+                      TCG_REG_SP, PUSH_SIZE);
+    tcg_out32(s, INSN_RET | TCG_REG_LR << 5);
+}
+
+static void tcg_target_init(TCGContext *s)
+{
+    tcg_regset_set32(tcg_target_available_regs[TCG_TYPE_I32], 0, 0xffffffff);
+    tcg_regset_set32(tcg_target_available_regs[TCG_TYPE_I64], 0, 0xffffffff);
+
+    tcg_regset_set32(tcg_target_call_clobber_regs, 0,
+                     (1 << TCG_REG_X0) | (1 << TCG_REG_X1) |
+                     (1 << TCG_REG_X2) | (1 << TCG_REG_X3) |
+                     (1 << TCG_REG_X4) | (1 << TCG_REG_X5) |
+                     (1 << TCG_REG_X6) | (1 << TCG_REG_X7) |
+                     (1 << TCG_REG_X8) | (1 << TCG_REG_X9) |
+                     (1 << TCG_REG_X10) | (1 << TCG_REG_X11) |
+                     (1 << TCG_REG_X12) | (1 << TCG_REG_X13) |
+                     (1 << TCG_REG_X14) | (1 << TCG_REG_X15) |
+                     (1 << TCG_REG_X16) | (1 << TCG_REG_X17) |
+                     (1 << TCG_REG_X18) | (1 << TCG_REG_LR));
+
+    tcg_regset_clear(s->reserved_regs);
+    tcg_regset_set_reg(s->reserved_regs, TCG_REG_SP);
+    tcg_regset_set_reg(s->reserved_regs, TCG_REG_FP);
+    tcg_regset_set_reg(s->reserved_regs, TCG_REG_TMP);
+    tcg_regset_set_reg(s->reserved_regs, TCG_REG_X18); /* platform register */
+#ifndef CONFIG_SOFTMMU
+    tcg_regset_set_reg(s->reserved_regs, TCG_REG_GUEST_BASE);
+#endif
+
+    tcg_add_target_add_op_defs(aarch64_op_defs);
+}
+
+typedef struct {
+    uint32_t len __attribute__((aligned((sizeof(void *)))));
+    uint32_t id;
+    uint8_t version;
+    char augmentation[1];
+    uint8_t code_align;
+    uint8_t data_align;
+    uint8_t return_column;
+} DebugFrameCIE;
+
+typedef struct {
+    uint32_t len __attribute__((aligned((sizeof(void *)))));
+    uint32_t cie_offset;
+    tcg_target_long func_start __attribute__((packed));
+    tcg_target_long func_len __attribute__((packed));
+    uint8_t def_cfa[4];
+    uint8_t reg_ofs[24];
+} DebugFrameFDE;
+
+typedef struct {
+    DebugFrameCIE cie;
+    DebugFrameFDE fde;
+} DebugFrame;
+
+#define ELF_HOST_MACHINE EM_AARCH64
+
+static DebugFrame debug_frame = {
+    .cie.len = sizeof(DebugFrameCIE)-4, /* length after .len member */
+    .cie.id = -1,
+    .cie.version = 1,
+    .cie.code_align = 1,
+    .cie.data_align = 0x78,             /* sleb128 -8 */
+    .cie.return_column = TCG_REG_LR,
+
+    .fde.len = sizeof(DebugFrameFDE)-4, /* length after .len member */
+    .fde.def_cfa = {
+        12, TCG_REG_SP,                 /* DW_CFA_def_cfa sp, ... */
+        (FRAME_SIZE & 0x7f) | 0x80,     /* ... uleb128 FRAME_SIZE */
+        (FRAME_SIZE >> 7)
+    },
+    .fde.reg_ofs = {
+        /* The following must match the layout used by the prologue.  */
+        0x80 + 28, 1,                   /* DW_CFA_offset, x28, -8 */
+        0x80 + 27, 2,                   /* DW_CFA_offset, x27, -16 */
+        0x80 + 26, 3,                   /* DW_CFA_offset, x26, -24 */
+        0x80 + 25, 4,                   /* DW_CFA_offset, x25, -32 */
+        0x80 + 24, 5,                   /* DW_CFA_offset, x24, -40 */
+        0x80 + 23, 6,                   /* DW_CFA_offset, x23, -48 */
+        0x80 + 22, 7,                   /* DW_CFA_offset, x22, -56 */
+        0x80 + 21, 8,                   /* DW_CFA_offset, x21, -64 */
+        0x80 + 20, 9,                   /* DW_CFA_offset, x20, -72 */
+        0x80 + 19, 10,                  /* DW_CFA_offset, x19, -80 */
+        0x80 + 30, 11,                  /* DW_CFA_offset, lr,  -88 */
+        0x80 + 29, 12,                  /* DW_CFA_offset, fp,  -96 */
+    }
+};
+
+void tcg_register_jit(void *buf, size_t buf_size)
+{
+    /* We're expecting a 2 byte uleb128 encoded value.  */
+    assert(FRAME_SIZE >> 14 == 0);
+
+    debug_frame.fde.func_start = (tcg_target_long) buf;
+    debug_frame.fde.func_len = buf_size;
+
+    tcg_register_jit_int(buf, buf_size, &debug_frame, sizeof(debug_frame));
+}
@@ -99,6 +99,22 @@ static const int tcg_target_call_oarg_regs[] = {
 
 static uint8_t *tb_ret_addr;
 
+#ifdef CONFIG_CPUID_H
+#include <cpuid.h>
+#ifndef bit_LZCNT
+/* older versions of cpuid.h call this bit_ABM */
+#define bit_LZCNT (1 << 5)
+#endif
+#endif
+
+/* The andc and clz opcodes depend on these, so tcg-target.h needs them even
+   when we cannot probe for the features.  */
+bool have_bmi1;
+bool have_lzcnt;
+
+static bool have_bmi2;
+static bool have_movbe;
+
 static void patch_reloc(uint8_t *code_ptr, int type,
                         tcg_target_long value, tcg_target_long addend)
 {
@@ -139,9 +155,17 @@ static int target_parse_constraint(TCGArgConstraint *ct, const char **pct_str)
         tcg_regset_set_reg(ct->u.regs, TCG_REG_EBX);
         break;
     case 'c':
+    case_c:
         ct->ct |= TCG_CT_REG;
         tcg_regset_set_reg(ct->u.regs, TCG_REG_ECX);
         break;
+    case 'C':
+        /* With SHLX et al, the shift count can be in any register.  */
+        if (have_bmi2) {
+            goto case_r;
+        } else {
+            goto case_c;
+        }
     case 'd':
         ct->ct |= TCG_CT_REG;
         tcg_regset_set_reg(ct->u.regs, TCG_REG_EDX);
@@ -167,6 +191,7 @@ static int target_parse_constraint(TCGArgConstraint *ct, const char **pct_str)
         tcg_regset_set32(ct->u.regs, 0, 0xf);
         break;
     case 'r':
+    case_r:
         ct->ct |= TCG_CT_REG;
         if (TCG_TARGET_REG_BITS == 64) {
             tcg_regset_set32(ct->u.regs, 0, 0xffff);
@@ -227,6 +252,9 @@ static inline int tcg_target_const_match(tcg_target_long val,
 
 #define P_EXT		0x100		/* 0x0f opcode prefix */
 #define P_DATA16	0x200		/* 0x66 opcode prefix */
+#define P_EXT38         0x8000          /* 0x0f 0x38 opcode prefix */
+#define P_SIMDF3        0x10000         /* 0xf3 opcode prefix */
+#define P_SIMDF2        0x20000         /* 0xf2 opcode prefix */
 #if TCG_TARGET_REG_BITS == 64
 # define P_ADDR32	0x400		/* 0x67 opcode prefix */
 # define P_REXW		0x800		/* Set REX.W = 1 */
@@ -245,6 +273,7 @@ static inline int tcg_target_const_match(tcg_target_long val,
 #define OPC_ARITH_EvIb	(0x83)
 #define OPC_ARITH_GvEv	(0x03)		/* ... plus (ARITH_FOO << 3) */
 #define OPC_ADD_GvEv	(OPC_ARITH_GvEv | (ARITH_ADD << 3))
+#define OPC_ANDN        (0xf2 | P_EXT38)
 #define OPC_BSWAP	(0xc8 | P_EXT)
 #define OPC_CALL_Jz	(0xe8)
 #define OPC_CMOVCC      (0x40 | P_EXT)  /* ... plus condition code */
@@ -259,6 +288,9 @@ static inline int tcg_target_const_match(tcg_target_long val,
 #define OPC_JMP_long	(0xe9)
 #define OPC_JMP_short	(0xeb)
 #define OPC_LEA         (0x8d)
+#define OPC_LZCNT       (0xbd | P_EXT | P_SIMDF3)
+#define OPC_MOVBE_GyMy  (0xf0 | P_EXT38)
+#define OPC_MOVBE_MyGy  (0xf1 | P_EXT38)
 #define OPC_MOVB_EvGv	(0x88)		/* stores, more or less */
 #define OPC_MOVL_EvGv	(0x89)		/* stores, more or less */
 #define OPC_MOVL_GvEv	(0x8b)		/* loads, more or less */
@@ -275,10 +307,13 @@ static inline int tcg_target_const_match(tcg_target_long val,
 #define OPC_PUSH_Iv	(0x68)
 #define OPC_PUSH_Ib	(0x6a)
 #define OPC_RET		(0xc3)
+#define OPC_SARX        (0xf7 | P_EXT38 | P_SIMDF3)
 #define OPC_SETCC	(0x90 | P_EXT | P_REXB_RM) /* ... plus cc */
 #define OPC_SHIFT_1	(0xd1)
 #define OPC_SHIFT_Ib	(0xc1)
 #define OPC_SHIFT_cl	(0xd3)
+#define OPC_SHLX        (0xf7 | P_EXT38 | P_DATA16)
+#define OPC_SHRX        (0xf7 | P_EXT38 | P_SIMDF2)
 #define OPC_TESTL	(0x85)
 #define OPC_XCHG_ax_r32	(0x90)
 
@@ -365,6 +400,11 @@ static void tcg_out_opc(TCGContext *s, int opc, int r, int rm, int x)
     if (opc & P_ADDR32) {
         tcg_out8(s, 0x67);
     }
+    if (opc & P_SIMDF3) {
+        tcg_out8(s, 0xf3);
+    } else if (opc & P_SIMDF2) {
+        tcg_out8(s, 0xf2);
+    }
 
     rex = 0;
     rex |= (opc & P_REXW) >> 8;		/* REX.W */
@@ -384,8 +424,11 @@ static void tcg_out_opc(TCGContext *s, int opc, int r, int rm, int x)
         tcg_out8(s, (uint8_t)(rex | 0x40));
     }
 
-    if (opc & P_EXT) {
+    if (opc & (P_EXT | P_EXT38)) {
         tcg_out8(s, 0x0f);
+        if (opc & P_EXT38) {
+            tcg_out8(s, 0x38);
+        }
     }
     tcg_out8(s, opc);
 }
@@ -395,8 +438,16 @@ static void tcg_out_opc(TCGContext *s, int opc)
     if (opc & P_DATA16) {
         tcg_out8(s, 0x66);
     }
-    if (opc & P_EXT) {
+    if (opc & P_SIMDF3) {
+        tcg_out8(s, 0xf3);
+    } else if (opc & P_SIMDF2) {
+        tcg_out8(s, 0xf2);
+    }
+    if (opc & (P_EXT | P_EXT38)) {
         tcg_out8(s, 0x0f);
+        if (opc & P_EXT38) {
+            tcg_out8(s, 0x38);
+        }
     }
     tcg_out8(s, opc);
 }
@@ -412,6 +463,38 @@ static void tcg_out_modrm(TCGContext *s, int opc, int r, int rm)
     tcg_out8(s, 0xc0 | (LOWREGMASK(r) << 3) | LOWREGMASK(rm));
 }
 
+/* Output a VEX-encoded instruction with three register operands: R in the
+   ModRM reg field, V in VEX.vvvv and RM in the ModRM r/m field.  Only the
+   0x0f 0x38 opcode map is used, so the three byte form is always needed.  */
+
+static void tcg_out_vex_modrm(TCGContext *s, int opc, int r, int v, int rm)
+{
+    int tmp;
+
+    assert(opc & P_EXT38);
+    tcg_out8(s, 0xc4);
+
+    tmp = 2;                            /* VEX.m-mmmm: 0x0f 0x38 */
+    tmp |= 0x40;                        /* VEX.X */
+    tmp |= (r & 8 ? 0 : 0x80);          /* VEX.R */
+    tmp |= (rm & 8 ? 0 : 0x20);         /* VEX.B */
+    tcg_out8(s, tmp);
+
+    tmp = (opc & P_REXW ? 0x80 : 0);    /* VEX.W */
+    if (opc & P_DATA16) {               /* VEX.pp */
+        tmp |= 1;
+    } else if (opc & P_SIMDF3) {
+        tmp |= 2;
+    } else if (opc & P_SIMDF2) {
+        tmp |= 3;
+    }
+    tmp |= (~v & 15) << 3;              /* VEX.vvvv */
+    tcg_out8(s, tmp);
+
+    tcg_out8(s, opc);
+    tcg_out8(s, 0xc0 | (LOWREGMASK(r) << 3) | LOWREGMASK(rm));
+}
+
 /* Output an opcode with a full "rm + (index<<shift) + offset" address mode.
    We handle either RM and INDEX missing with a negative value.  In 64-bit
    mode for absolute addresses, ~RM is the size of the immediate operand
@@ -956,14 +1039,39 @@ static void tcg_out_movcond64(TCGContext *s, TCGCond cond, TCGArg dest,
 }
 #endif
 
+static void tcg_out_ext_reloc(TCGContext *s, int type, uint8_t *ptr,
+                              tcg_target_long value)
+{
+    TCGExtReloc *r;
+
+    if (s->nb_ext_relocs < 0) {
+        return;
+    }
+    if (s->nb_ext_relocs == TCG_MAX_EXT_RELOCS) {
+        s->nb_ext_relocs = -1;
+        return;
+    }
+    r = &s->ext_relocs[s->nb_ext_relocs++];
+    r->offset = ptr - s->code_buf;
+    r->type = type;
+    r->value = value;
+}
+
 static void tcg_out_branch(TCGContext *s, int call, tcg_target_long dest)
 {
     tcg_target_long disp = dest - (tcg_target_long)s->code_ptr - 5;
+    /* branches back into the TB itself need no relocation */
+    bool ext = dest < (tcg_target_long)s->code_buf ||
+               dest >= (tcg_target_long)s->code_ptr;
 
     if (disp == (int32_t)disp) {
         tcg_out_opc(s, call ? OPC_CALL_Jz : OPC_JMP_long, 0, 0, 0);
+        if (ext) {
+            tcg_out_ext_reloc(s, TCG_EXT_RELOC_PCREL32, s->code_ptr, dest);
+        }
         tcg_out32(s, disp);
     } else {
+        tcg_out_ext_reloc(s, TCG_EXT_RELOC_FAR_BRANCH, s->code_ptr, dest);
         tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_R10, dest);
         tcg_out_modrm(s, OPC_GRP5,
                       call ? EXT5_CALLN_Ev : EXT5_JMPN_Ev, TCG_REG_R10);
@@ -1115,10 +1223,19 @@ static void tcg_out_qemu_ld_direct(TCGContext *s, int datalo, int datahi,
                                    int sizeop)
 {
 #ifdef TARGET_WORDS_BIGENDIAN
-    const int bswap = 1;
+    const int real_bswap = 1;
 #else
-    const int bswap = 0;
+    const int real_bswap = 0;
 #endif
+    int bswap = real_bswap;
+    int movop = OPC_MOVL_GvEv;
+
+    /* MOVBE folds the byte swap into the load.  */
+    if (have_movbe && real_bswap) {
+        bswap = 0;
+        movop = OPC_MOVBE_GyMy;
+    }
+
     switch (sizeop) {
     case 0:
         tcg_out_modrm_offset(s, OPC_MOVZBL + seg, datalo, base, ofs);
@@ -1127,15 +1244,22 @@ static void tcg_out_qemu_ld_direct(TCGContext *s, int datalo, int datahi,
         tcg_out_modrm_offset(s, OPC_MOVSBL + P_REXW + seg, datalo, base, ofs);
         break;
     case 1:
+        /* A 16-bit MOVBE leaves the high bits alone, so zero extension
+           and ROLW is no worse.  */
         tcg_out_modrm_offset(s, OPC_MOVZWL + seg, datalo, base, ofs);
-        if (bswap) {
+        if (real_bswap) {
             tcg_out_rolw_8(s, datalo);
         }
         break;
     case 1 | 4:
-        if (bswap) {
-            tcg_out_modrm_offset(s, OPC_MOVZWL + seg, datalo, base, ofs);
-            tcg_out_rolw_8(s, datalo);
+        if (real_bswap) {
+            if (have_movbe) {
+                tcg_out_modrm_offset(s, OPC_MOVBE_GyMy + P_DATA16 + seg,
+                                     datalo, base, ofs);
+            } else {
+                tcg_out_modrm_offset(s, OPC_MOVZWL + seg, datalo, base, ofs);
+                tcg_out_rolw_8(s, datalo);
+            }
             tcg_out_modrm(s, OPC_MOVSWL + P_REXW, datalo, datalo);
         } else {
             tcg_out_modrm_offset(s, OPC_MOVSWL + P_REXW + seg,
@@ -1143,16 +1267,18 @@ static void tcg_out_qemu_ld_direct(TCGContext *s, int datalo, int datahi,
         }
         break;
     case 2:
-        tcg_out_modrm_offset(s, OPC_MOVL_GvEv + seg, datalo, base, ofs);
+        tcg_out_modrm_offset(s, movop + seg, datalo, base, ofs);
         if (bswap) {
             tcg_out_bswap32(s, datalo);
         }
         break;
 #if TCG_TARGET_REG_BITS == 64
     case 2 | 4:
-        if (bswap) {
-            tcg_out_modrm_offset(s, OPC_MOVL_GvEv + seg, datalo, base, ofs);
-            tcg_out_bswap32(s, datalo);
+        if (real_bswap) {
+            tcg_out_modrm_offset(s, movop + seg, datalo, base, ofs);
+            if (bswap) {
+                tcg_out_bswap32(s, datalo);
+            }
             tcg_out_ext32s(s, datalo, datalo);
         } else {
             tcg_out_modrm_offset(s, OPC_MOVSLQ + seg, datalo, base, ofs);
@@ -1161,26 +1287,26 @@ static void tcg_out_qemu_ld_direct(TCGContext *s, int datalo, int datahi,
 #endif
     case 3:
         if (TCG_TARGET_REG_BITS == 64) {
-            tcg_out_modrm_offset(s, OPC_MOVL_GvEv + P_REXW + seg,
+            tcg_out_modrm_offset(s, movop + P_REXW + seg,
                                  datalo, base, ofs);
             if (bswap) {
                 tcg_out_bswap64(s, datalo);
             }
         } else {
-            if (bswap) {
+            if (real_bswap) {
                 int t = datalo;
                 datalo = datahi;
                 datahi = t;
             }
             if (base != datalo) {
-                tcg_out_modrm_offset(s, OPC_MOVL_GvEv + seg,
+                tcg_out_modrm_offset(s, movop + seg,
                                      datalo, base, ofs);
-                tcg_out_modrm_offset(s, OPC_MOVL_GvEv + seg,
+                tcg_out_modrm_offset(s, movop + seg,
                                      datahi, base, ofs + 4);
             } else {
-                tcg_out_modrm_offset(s, OPC_MOVL_GvEv + seg,
+                tcg_out_modrm_offset(s, movop + seg,
                                      datahi, base, ofs + 4);
-                tcg_out_modrm_offset(s, OPC_MOVL_GvEv + seg,
+                tcg_out_modrm_offset(s, movop + seg,
                                      datalo, base, ofs);
             }
             if (bswap) {
@@ -1266,15 +1392,23 @@ static void tcg_out_qemu_st_direct(TCGContext *s, int datalo, int datahi,
                                    int sizeop)
 {
 #ifdef TARGET_WORDS_BIGENDIAN
-    const int bswap = 1;
+    const int real_bswap = 1;
 #else
-    const int bswap = 0;
+    const int real_bswap = 0;
 #endif
     /* ??? Ideally we wouldn't need a scratch register.  For user-only,
        we could perform the bswap twice to restore the original value
        instead of moving to the scratch.  But as it is, the L constraint
        means that TCG_REG_L0 is definitely free here.  */
     const int scratch = TCG_REG_L0;
+    int bswap = real_bswap;
+    int movop = OPC_MOVL_EvGv;
+
+    /* MOVBE folds the byte swap into the store, and needs no scratch.  */
+    if (have_movbe && real_bswap) {
+        bswap = 0;
+        movop = OPC_MOVBE_MyGy;
+    }
 
     switch (sizeop) {
     case 0:
@@ -1287,8 +1421,7 @@ static void tcg_out_qemu_st_direct(TCGContext *s, int datalo, int datahi,
             tcg_out_rolw_8(s, scratch);
             datalo = scratch;
         }
-        tcg_out_modrm_offset(s, OPC_MOVL_EvGv + P_DATA16 + seg,
-                             datalo, base, ofs);
+        tcg_out_modrm_offset(s, movop + P_DATA16 + seg, datalo, base, ofs);
         break;
     case 2:
         if (bswap) {
@@ -1296,7 +1429,7 @@ static void tcg_out_qemu_st_direct(TCGContext *s, int datalo, int datahi,
             tcg_out_bswap32(s, scratch);
             datalo = scratch;
         }
-        tcg_out_modrm_offset(s, OPC_MOVL_EvGv + seg, datalo, base, ofs);
+        tcg_out_modrm_offset(s, movop + seg, datalo, base, ofs);
         break;
     case 3:
         if (TCG_TARGET_REG_BITS == 64) {
@@ -1305,7 +1438,7 @@ static void tcg_out_qemu_st_direct(TCGContext *s, int datalo, int datahi,
                 tcg_out_bswap64(s, scratch);
                 datalo = scratch;
             }
-            tcg_out_modrm_offset(s, OPC_MOVL_EvGv + P_REXW + seg,
+            tcg_out_modrm_offset(s, movop + P_REXW + seg,
                                  datalo, base, ofs);
         } else if (bswap) {
             tcg_out_mov(s, TCG_TYPE_I32, scratch, datahi);
@@ -1315,8 +1448,13 @@ static void tcg_out_qemu_st_direct(TCGContext *s, int datalo, int datahi,
             tcg_out_bswap32(s, scratch);
             tcg_out_modrm_offset(s, OPC_MOVL_EvGv + seg, scratch, base, ofs+4);
         } else {
-            tcg_out_modrm_offset(s, OPC_MOVL_EvGv + seg, datalo, base, ofs);
-            tcg_out_modrm_offset(s, OPC_MOVL_EvGv + seg, datahi, base, ofs+4);
+            if (real_bswap) {
+                int t = datalo;
+                datalo = datahi;
+                datahi = t;
+            }
+            tcg_out_modrm_offset(s, movop + seg, datalo, base, ofs);
+            tcg_out_modrm_offset(s, movop + seg, datahi, base, ofs+4);
         }
         break;
     default:
@@ -1646,7 +1784,7 @@ void tcg_out_tb_finalize(TCGContext *s)
 static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
                               const TCGArg *args, const int *const_args)
 {
-    int c, rexw = 0;
+    int c, vexop, rexw = 0;
 
 #if TCG_TARGET_REG_BITS == 64
 # define OP_32_64(x) \
@@ -1661,6 +1799,19 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
     switch(opc) {
     case INDEX_op_exit_tb:
         tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_EAX, args[0]);
+        /* mirror the encodings chosen by tcg_out_movi */
+        if (args[0] == 0) {
+            /* nothing to relocate */
+        } else if (args[0] == (uint32_t)args[0]) {
+            tcg_out_ext_reloc(s, TCG_EXT_RELOC_TB_IMM32U, s->code_ptr - 4,
+                              args[0]);
+        } else if (args[0] == (int32_t)args[0]) {
+            tcg_out_ext_reloc(s, TCG_EXT_RELOC_TB_IMM32S, s->code_ptr - 4,
+                              args[0]);
+        } else {
+            tcg_out_ext_reloc(s, TCG_EXT_RELOC_TB_IMM64, s->code_ptr - 8,
+                              args[0]);
+        }
         tcg_out_jmp(s, (tcg_target_long) tb_ret_addr);
         break;
     case INDEX_op_goto_tb:
@@ -1676,6 +1827,10 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
         }
         s->tb_next_offset[args[0]] = s->code_ptr - s->code_buf;
         break;
+    case INDEX_op_goto_ptr:
+        /* jmp *reg */
+        tcg_out_modrm(s, OPC_GRP5, EXT5_JMPN_Ev, args[0]);
+        break;
     case INDEX_op_call:
         if (const_args[0]) {
             tcg_out_calli(s, args[0]);
@@ -1782,6 +1937,16 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
         }
         break;
 
+    OP_32_64(andc):
+        if (const_args[2]) {
+            tcg_out_mov(s, rexw ? TCG_TYPE_I64 : TCG_TYPE_I32,
+                        args[0], args[1]);
+            tgen_arithi(s, ARITH_AND + rexw, args[0], ~args[2], 0);
+        } else {
+            tcg_out_vex_modrm(s, OPC_ANDN + rexw, args[0], args[2], args[1]);
+        }
+        break;
+
     OP_32_64(mul):
         if (const_args[2]) {
             int32_t val;
@@ -1807,19 +1972,28 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
 
     OP_32_64(shl):
         c = SHIFT_SHL;
-        goto gen_shift;
+        vexop = OPC_SHLX;
+        goto gen_shift_maybe_vex;
     OP_32_64(shr):
         c = SHIFT_SHR;
-        goto gen_shift;
+        vexop = OPC_SHRX;
+        goto gen_shift_maybe_vex;
     OP_32_64(sar):
         c = SHIFT_SAR;
-        goto gen_shift;
+        vexop = OPC_SARX;
+        goto gen_shift_maybe_vex;
     OP_32_64(rotl):
         c = SHIFT_ROL;
         goto gen_shift;
     OP_32_64(rotr):
         c = SHIFT_ROR;
         goto gen_shift;
+    gen_shift_maybe_vex:
+        if (have_bmi2 && !const_args[2]) {
+            tcg_out_vex_modrm(s, vexop + rexw, args[0], args[2], args[1]);
+            break;
+        }
+        /* FALLTHRU */
     gen_shift:
         if (const_args[2]) {
             tcg_out_shifti(s, c + rexw, args[0], args[2]);
@@ -1854,6 +2028,9 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
     OP_32_64(not):
         tcg_out_modrm(s, OPC_GRP3_Ev + rexw, EXT3_NOT, args[0]);
         break;
+    OP_32_64(clz):
+        tcg_out_modrm(s, OPC_LZCNT + rexw, args[0], args[1]);
+        break;
 
     OP_32_64(ext8s):
         tcg_out_ext8s(s, args[0], args[1], rexw);
@@ -2010,6 +2187,7 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
 static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_exit_tb, { } },
     { INDEX_op_goto_tb, { } },
+    { INDEX_op_goto_ptr, { "r" } },
     { INDEX_op_call, { "ri" } },
     { INDEX_op_br, { } },
     { INDEX_op_mov_i32, { "r", "r" } },
@@ -2031,10 +2209,11 @@ static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_and_i32, { "r", "0", "ri" } },
     { INDEX_op_or_i32, { "r", "0", "ri" } },
     { INDEX_op_xor_i32, { "r", "0", "ri" } },
+    { INDEX_op_andc_i32, { "r", "r", "ri" } },
 
-    { INDEX_op_shl_i32, { "r", "0", "ci" } },
-    { INDEX_op_shr_i32, { "r", "0", "ci" } },
-    { INDEX_op_sar_i32, { "r", "0", "ci" } },
+    { INDEX_op_shl_i32, { "r", "0", "Ci" } },
+    { INDEX_op_shr_i32, { "r", "0", "Ci" } },
+    { INDEX_op_sar_i32, { "r", "0", "Ci" } },
     { INDEX_op_rotl_i32, { "r", "0", "ci" } },
     { INDEX_op_rotr_i32, { "r", "0", "ci" } },
 
@@ -2046,6 +2225,7 @@ static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_neg_i32, { "r", "0" } },
 
     { INDEX_op_not_i32, { "r", "0" } },
+    { INDEX_op_clz_i32, { "r", "r" } },
 
     { INDEX_op_ext8s_i32, { "r", "q" } },
     { INDEX_op_ext16s_i32, { "r", "r" } },
@@ -2088,10 +2268,11 @@ static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_and_i64, { "r", "0", "reZ" } },
     { INDEX_op_or_i64, { "r", "0", "re" } },
     { INDEX_op_xor_i64, { "r", "0", "re" } },
+    { INDEX_op_andc_i64, { "r", "r", "re" } },
 
-    { INDEX_op_shl_i64, { "r", "0", "ci" } },
-    { INDEX_op_shr_i64, { "r", "0", "ci" } },
-    { INDEX_op_sar_i64, { "r", "0", "ci" } },
+    { INDEX_op_shl_i64, { "r", "0", "Ci" } },
+    { INDEX_op_shr_i64, { "r", "0", "Ci" } },
+    { INDEX_op_sar_i64, { "r", "0", "Ci" } },
     { INDEX_op_rotl_i64, { "r", "0", "ci" } },
     { INDEX_op_rotr_i64, { "r", "0", "ci" } },
 
@@ -2103,6 +2284,7 @@ static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_bswap64_i64, { "r", "0" } },
     { INDEX_op_neg_i64, { "r", "0" } },
     { INDEX_op_not_i64, { "r", "0" } },
+    { INDEX_op_clz_i64, { "r", "r" } },
 
     { INDEX_op_ext8s_i64, { "r", "r" } },
     { INDEX_op_ext16s_i64, { "r", "r" } },
@@ -2223,6 +2405,10 @@ static void tcg_target_qemu_prologue(TCGContext *s)
     tcg_out_modrm(s, OPC_GRP5, EXT5_JMPN_Ev, tcg_target_call_iarg_regs[1]);
 #endif
 
+    /* Return path for goto_ptr: same as exit_tb(0) */
+    code_gen_epilogue = s->code_ptr;
+    tcg_out_movi(s, TCG_TYPE_REG, TCG_REG_EAX, 0);
+
     /* TB epilogue */
     tb_ret_addr = s->code_ptr;
 
@@ -2243,6 +2429,37 @@ static void tcg_target_qemu_prologue(TCGContext *s)
 
 static void tcg_target_init(TCGContext *s)
 {
+#ifdef CONFIG_CPUID_H
+    unsigned a, b, c, d;
+    int max = __get_cpuid_max(0, 0);
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+#ifdef bit_MOVBE
+        have_movbe = (c & bit_MOVBE) != 0;
+#endif
+    }
+
+    if (max >= 7) {
+        /* BMI1 is available on AMD Piledriver and Intel Haswell CPUs.  */
+        __cpuid_count(7, 0, a, b, c, d);
+#ifdef bit_BMI
+        have_bmi1 = (b & bit_BMI) != 0;
+#endif
+#ifdef bit_BMI2
+        have_bmi2 = (b & bit_BMI2) != 0;
+#endif
+    }
+
+    if (__get_cpuid_max(0x80000000, 0) >= 0x80000001) {
+        /* LZCNT was introduced with AMD Barcelona and Intel Haswell.
+           On older CPUs its encoding is BSR with a REP prefix, which
+           gives a different result, so the feature bit must be checked.  */
+        __cpuid(0x80000001, a, b, c, d);
+        have_lzcnt = (c & bit_LZCNT) != 0;
+    }
+#endif
+
 #if !defined(CONFIG_USER_ONLY)
     /* fail safe */
     if ((1 << CPU_TLB_ENTRY_BITS) != sizeof(CPUTLBEntry))
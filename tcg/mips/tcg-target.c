@@ -939,6 +939,33 @@ static const void * const qemu_st_helpers[4] = {
     helper_stl_mmu,
     helper_stq_mmu,
 };
+
+static void add_qemu_ldst_label(TCGContext *s, int is_ld, int opc,
+                                int data_reg, int data_reg2,
+                                int addrlo_reg, int addrhi_reg,
+                                int mem_index, uint8_t *raddr,
+                                uint8_t **label_ptr)
+{
+    int idx;
+    TCGLabelQemuLdst *label;
+
+    if (s->nb_qemu_ldst_labels >= TCG_MAX_QEMU_LDST) {
+        tcg_abort();
+    }
+
+    idx = s->nb_qemu_ldst_labels++;
+    label = (TCGLabelQemuLdst *)&s->qemu_ldst_labels[idx];
+    label->is_ld = is_ld;
+    label->opc = opc;
+    label->datalo_reg = data_reg;
+    label->datahi_reg = data_reg2;
+    label->addrlo_reg = addrlo_reg;
+    label->addrhi_reg = addrhi_reg;
+    label->mem_index = mem_index;
+    label->raddr = raddr;
+    label->label_ptr[0] = label_ptr[0];
+    label->label_ptr[1] = label_ptr[1];
+}
 #endif
 
 static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
@@ -946,13 +973,11 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
 {
     TCGReg addr_regl, data_regl, data_regh, data_reg1, data_reg2;
 #if defined(CONFIG_SOFTMMU)
-    void *label1_ptr, *label2_ptr;
-    int arg_num;
+    uint8_t *label_ptr[2];
     int mem_index, s_bits;
     int addr_meml;
-# if TARGET_LONG_BITS == 64
-    uint8_t *label3_ptr;
     TCGReg addr_regh;
+# if TARGET_LONG_BITS == 64
     int addr_memh;
 # endif
 #endif
@@ -973,6 +998,7 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
     addr_meml = 0;
 #  endif
 # else
+    addr_regh = 0;
     addr_meml = 0;
 # endif
     mem_index = *args;
@@ -1000,71 +1026,28 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
     tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_T0, TARGET_PAGE_MASK | ((1 << s_bits) - 1));
     tcg_out_opc_reg(s, OPC_AND, TCG_REG_T0, TCG_REG_T0, addr_regl);
 
+    /* TLB Miss: branch to the slow path emitted at the end of the block.
+       The TLB addend is loaded in the delay slot, whose result is simply
+       ignored by the slow path.  */
 # if TARGET_LONG_BITS == 64
-    label3_ptr = s->code_ptr;
+    label_ptr[0] = s->code_ptr;
     tcg_out_opc_br(s, OPC_BNE, TCG_REG_T0, TCG_REG_AT);
-    tcg_out_nop(s);
-
+    /* delay slot */
     tcg_out_opc_imm(s, OPC_LW, TCG_REG_AT, TCG_REG_A0,
                     offsetof(CPUArchState, tlb_table[mem_index][0].addr_read) + addr_memh);
 
-    label1_ptr = s->code_ptr;
-    tcg_out_opc_br(s, OPC_BEQ, addr_regh, TCG_REG_AT);
-    tcg_out_nop(s);
-
-    reloc_pc16(label3_ptr, (tcg_target_long) s->code_ptr);
+    label_ptr[1] = s->code_ptr;
+    tcg_out_opc_br(s, OPC_BNE, addr_regh, TCG_REG_AT);
 # else
-    label1_ptr = s->code_ptr;
-    tcg_out_opc_br(s, OPC_BEQ, TCG_REG_T0, TCG_REG_AT);
-    tcg_out_nop(s);
-# endif
-
-    /* slow path */
-    arg_num = 0;
-    tcg_out_call_iarg_reg32(s, &arg_num, TCG_AREG0);
-# if TARGET_LONG_BITS == 64
-    tcg_out_call_iarg_reg64(s, &arg_num, addr_regl, addr_regh);
-# else
-    tcg_out_call_iarg_reg32(s, &arg_num, addr_regl);
+    label_ptr[0] = s->code_ptr;
+    label_ptr[1] = NULL;
+    tcg_out_opc_br(s, OPC_BNE, TCG_REG_T0, TCG_REG_AT);
 # endif
-    tcg_out_call_iarg_imm32(s, &arg_num, mem_index);
-    tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_T9, (tcg_target_long)qemu_ld_helpers[s_bits]);
-    tcg_out_opc_reg(s, OPC_JALR, TCG_REG_RA, TCG_REG_T9, 0);
-    tcg_out_nop(s);
-
-    switch(opc) {
-    case 0:
-        tcg_out_opc_imm(s, OPC_ANDI, data_reg1, TCG_REG_V0, 0xff);
-        break;
-    case 0 | 4:
-        tcg_out_ext8s(s, data_reg1, TCG_REG_V0);
-        break;
-    case 1:
-        tcg_out_opc_imm(s, OPC_ANDI, data_reg1, TCG_REG_V0, 0xffff);
-        break;
-    case 1 | 4:
-        tcg_out_ext16s(s, data_reg1, TCG_REG_V0);
-        break;
-    case 2:
-        tcg_out_mov(s, TCG_TYPE_I32, data_reg1, TCG_REG_V0);
-        break;
-    case 3:
-        tcg_out_mov(s, TCG_TYPE_I32, data_reg2, TCG_REG_V1);
-        tcg_out_mov(s, TCG_TYPE_I32, data_reg1, TCG_REG_V0);
-        break;
-    default:
-        tcg_abort();
-    }
-
-    label2_ptr = s->code_ptr;
-    tcg_out_opc_br(s, OPC_BEQ, TCG_REG_ZERO, TCG_REG_ZERO);
-    tcg_out_nop(s);
-
-    /* label1: fast path */
-    reloc_pc16(label1_ptr, (tcg_target_long) s->code_ptr);
-
+    /* delay slot */
     tcg_out_opc_imm(s, OPC_LW, TCG_REG_A0, TCG_REG_A0,
                     offsetof(CPUArchState, tlb_table[mem_index][0].addend));
+
+    /* TLB Hit */
     tcg_out_opc_reg(s, OPC_ADDU, TCG_REG_V0, TCG_REG_A0, addr_regl);
 #else
     if (GUEST_BASE == (int16_t)GUEST_BASE) {
@@ -1122,7 +1105,8 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
     }
 
 #if defined(CONFIG_SOFTMMU)
-    reloc_pc16(label2_ptr, (tcg_target_long) s->code_ptr);
+    add_qemu_ldst_label(s, 1, opc, data_regl, data_regh, addr_regl, addr_regh,
+                        mem_index, s->code_ptr, label_ptr);
 #endif
 }
 
@@ -1131,15 +1115,11 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
 {
     TCGReg addr_regl, data_regl, data_regh, data_reg1, data_reg2;
 #if defined(CONFIG_SOFTMMU)
-    uint8_t *label1_ptr, *label2_ptr;
-    int arg_num;
+    uint8_t *label_ptr[2];
     int mem_index, s_bits;
     int addr_meml;
-#endif
-#if TARGET_LONG_BITS == 64
-# if defined(CONFIG_SOFTMMU)
-    uint8_t *label3_ptr;
     TCGReg addr_regh;
+# if TARGET_LONG_BITS == 64
     int addr_memh;
 # endif
 #endif
@@ -1161,6 +1141,7 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
     addr_meml = 0;
 #  endif
 # else
+    addr_regh = 0;
     addr_meml = 0;
 # endif
     mem_index = *args;
@@ -1189,63 +1170,26 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
     tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_T0, TARGET_PAGE_MASK | ((1 << s_bits) - 1));
     tcg_out_opc_reg(s, OPC_AND, TCG_REG_T0, TCG_REG_T0, addr_regl);
 
+    /* TLB Miss: branch to the slow path emitted at the end of the block.  */
 # if TARGET_LONG_BITS == 64
-    label3_ptr = s->code_ptr;
+    label_ptr[0] = s->code_ptr;
     tcg_out_opc_br(s, OPC_BNE, TCG_REG_T0, TCG_REG_AT);
-    tcg_out_nop(s);
-
+    /* delay slot */
     tcg_out_opc_imm(s, OPC_LW, TCG_REG_AT, TCG_REG_A0,
                     offsetof(CPUArchState, tlb_table[mem_index][0].addr_write) + addr_memh);
 
-    label1_ptr = s->code_ptr;
-    tcg_out_opc_br(s, OPC_BEQ, addr_regh, TCG_REG_AT);
-    tcg_out_nop(s);
-
-    reloc_pc16(label3_ptr, (tcg_target_long) s->code_ptr);
-# else
-    label1_ptr = s->code_ptr;
-    tcg_out_opc_br(s, OPC_BEQ, TCG_REG_T0, TCG_REG_AT);
-    tcg_out_nop(s);
-# endif
-
-    /* slow path */
-    arg_num = 0;
-    tcg_out_call_iarg_reg32(s, &arg_num, TCG_AREG0);
-# if TARGET_LONG_BITS == 64
-    tcg_out_call_iarg_reg64(s, &arg_num, addr_regl, addr_regh);
+    label_ptr[1] = s->code_ptr;
+    tcg_out_opc_br(s, OPC_BNE, addr_regh, TCG_REG_AT);
 # else
-    tcg_out_call_iarg_reg32(s, &arg_num, addr_regl);
+    label_ptr[0] = s->code_ptr;
+    label_ptr[1] = NULL;
+    tcg_out_opc_br(s, OPC_BNE, TCG_REG_T0, TCG_REG_AT);
 # endif
-    switch(opc) {
-    case 0:
-        tcg_out_call_iarg_reg8(s, &arg_num, data_regl);
-        break;
-    case 1:
-        tcg_out_call_iarg_reg16(s, &arg_num, data_regl);
-        break;
-    case 2:
-        tcg_out_call_iarg_reg32(s, &arg_num, data_regl);
-        break;
-    case 3:
-        tcg_out_call_iarg_reg64(s, &arg_num, data_regl, data_regh);
-        break;
-    default:
-        tcg_abort();
-    }
-    tcg_out_call_iarg_imm32(s, &arg_num, mem_index);
-    tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_T9, (tcg_target_long)qemu_st_helpers[s_bits]);
-    tcg_out_opc_reg(s, OPC_JALR, TCG_REG_RA, TCG_REG_T9, 0);
-    tcg_out_nop(s);
-
-    label2_ptr = s->code_ptr;
-    tcg_out_opc_br(s, OPC_BEQ, TCG_REG_ZERO, TCG_REG_ZERO);
-    tcg_out_nop(s);
-
-    /* label1: fast path */
-    reloc_pc16(label1_ptr, (tcg_target_long) s->code_ptr);
-
+    /* delay slot */
     tcg_out_opc_imm(s, OPC_LW, TCG_REG_A0, TCG_REG_A0,
                     offsetof(CPUArchState, tlb_table[mem_index][0].addend));
+
+    /* TLB Hit */
     tcg_out_opc_reg(s, OPC_ADDU, TCG_REG_A0, TCG_REG_A0, addr_regl);
 #else
     if (GUEST_BASE == (int16_t)GUEST_BASE) {
@@ -1294,10 +1238,158 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
     }
 
 #if defined(CONFIG_SOFTMMU)
-    reloc_pc16(label2_ptr, (tcg_target_long) s->code_ptr);
+    add_qemu_ldst_label(s, 0, opc, data_regl, data_regh, addr_regl, addr_regh,
+                        mem_index, s->code_ptr, label_ptr);
 #endif
 }
 
+#if defined(CONFIG_SOFTMMU)
+/* Emit the return address of the fast path after the helper call and its
+   delay slot, in the format expected by GETPC_LDST(): a branch over a word
+   holding the distance from that word to RADDR.  The helper returns to
+   the branch.  */
+static void tcg_out_ldst_raddr(TCGContext *s, uint8_t *raddr)
+{
+    tcg_out_opc_imm(s, OPC_BEQ, TCG_REG_ZERO, TCG_REG_ZERO, 2);
+    tcg_out_nop(s);
+    tcg_out32(s, raddr - s->code_ptr);
+}
+
+static void tcg_out_ldst_return(TCGContext *s, uint8_t *raddr)
+{
+    tcg_out_opc_br(s, OPC_BEQ, TCG_REG_ZERO, TCG_REG_ZERO);
+    reloc_pc16(s->code_ptr - 4, (tcg_target_long)raddr);
+    tcg_out_nop(s);
+}
+
+static void tcg_out_qemu_ld_slow_path(TCGContext *s, TCGLabelQemuLdst *label)
+{
+    TCGReg data_reg1, data_reg2;
+    int opc = label->opc;
+    int arg_num;
+
+    if (opc == 3) {
+#if defined(TCG_TARGET_WORDS_BIGENDIAN)
+        data_reg1 = label->datahi_reg;
+        data_reg2 = label->datalo_reg;
+#else
+        data_reg1 = label->datalo_reg;
+        data_reg2 = label->datahi_reg;
+#endif
+    } else {
+        data_reg1 = label->datalo_reg;
+        data_reg2 = 0;
+    }
+
+    reloc_pc16(label->label_ptr[0], (tcg_target_long) s->code_ptr);
+    if (TARGET_LONG_BITS == 64) {
+        reloc_pc16(label->label_ptr[1], (tcg_target_long) s->code_ptr);
+    }
+
+    arg_num = 0;
+    tcg_out_call_iarg_reg32(s, &arg_num, TCG_AREG0);
+# if TARGET_LONG_BITS == 64
+    tcg_out_call_iarg_reg64(s, &arg_num, label->addrlo_reg,
+                            label->addrhi_reg);
+# else
+    tcg_out_call_iarg_reg32(s, &arg_num, label->addrlo_reg);
+# endif
+    tcg_out_call_iarg_imm32(s, &arg_num, label->mem_index);
+    tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_T9,
+                 (tcg_target_long)qemu_ld_helpers[opc & 3]);
+    tcg_out_opc_reg(s, OPC_JALR, TCG_REG_RA, TCG_REG_T9, 0);
+    tcg_out_nop(s);
+    tcg_out_ldst_raddr(s, label->raddr);
+
+    switch(opc) {
+    case 0:
+        tcg_out_opc_imm(s, OPC_ANDI, data_reg1, TCG_REG_V0, 0xff);
+        break;
+    case 0 | 4:
+        tcg_out_ext8s(s, data_reg1, TCG_REG_V0);
+        break;
+    case 1:
+        tcg_out_opc_imm(s, OPC_ANDI, data_reg1, TCG_REG_V0, 0xffff);
+        break;
+    case 1 | 4:
+        tcg_out_ext16s(s, data_reg1, TCG_REG_V0);
+        break;
+    case 2:
+        tcg_out_mov(s, TCG_TYPE_I32, data_reg1, TCG_REG_V0);
+        break;
+    case 3:
+        tcg_out_mov(s, TCG_TYPE_I32, data_reg2, TCG_REG_V1);
+        tcg_out_mov(s, TCG_TYPE_I32, data_reg1, TCG_REG_V0);
+        break;
+    default:
+        tcg_abort();
+    }
+
+    tcg_out_ldst_return(s, label->raddr);
+}
+
+static void tcg_out_qemu_st_slow_path(TCGContext *s, TCGLabelQemuLdst *label)
+{
+    int opc = label->opc;
+    int arg_num;
+
+    reloc_pc16(label->label_ptr[0], (tcg_target_long) s->code_ptr);
+    if (TARGET_LONG_BITS == 64) {
+        reloc_pc16(label->label_ptr[1], (tcg_target_long) s->code_ptr);
+    }
+
+    arg_num = 0;
+    tcg_out_call_iarg_reg32(s, &arg_num, TCG_AREG0);
+# if TARGET_LONG_BITS == 64
+    tcg_out_call_iarg_reg64(s, &arg_num, label->addrlo_reg,
+                            label->addrhi_reg);
+# else
+    tcg_out_call_iarg_reg32(s, &arg_num, label->addrlo_reg);
+# endif
+    switch(opc) {
+    case 0:
+        tcg_out_call_iarg_reg8(s, &arg_num, label->datalo_reg);
+        break;
+    case 1:
+        tcg_out_call_iarg_reg16(s, &arg_num, label->datalo_reg);
+        break;
+    case 2:
+        tcg_out_call_iarg_reg32(s, &arg_num, label->datalo_reg);
+        break;
+    case 3:
+        tcg_out_call_iarg_reg64(s, &arg_num, label->datalo_reg,
+                                label->datahi_reg);
+        break;
+    default:
+        tcg_abort();
+    }
+    tcg_out_call_iarg_imm32(s, &arg_num, label->mem_index);
+    tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_T9,
+                 (tcg_target_long)qemu_st_helpers[opc]);
+    tcg_out_opc_reg(s, OPC_JALR, TCG_REG_RA, TCG_REG_T9, 0);
+    tcg_out_nop(s);
+    tcg_out_ldst_raddr(s, label->raddr);
+
+    tcg_out_ldst_return(s, label->raddr);
+}
+
+void tcg_out_tb_finalize(TCGContext *s)
+{
+    int i;
+    TCGLabelQemuLdst *label;
+
+    /* qemu_ld/st slow paths */
+    for (i = 0; i < s->nb_qemu_ldst_labels; i++) {
+        label = (TCGLabelQemuLdst *)&s->qemu_ldst_labels[i];
+        if (label->is_ld) {
+            tcg_out_qemu_ld_slow_path(s, label);
+        } else {
+            tcg_out_qemu_st_slow_path(s, label);
+        }
+    }
+}
+#endif /* CONFIG_SOFTMMU */
+
 static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
                               const TCGArg *args, const int *const_args)
 {
@@ -80,6 +80,7 @@ typedef enum {
 #define TCG_TARGET_HAS_div_i32          1
 #define TCG_TARGET_HAS_not_i32          1
 #define TCG_TARGET_HAS_nor_i32          1
+#define TCG_TARGET_HAS_clz_i32          0
 #define TCG_TARGET_HAS_ext8s_i32        1
 #define TCG_TARGET_HAS_ext16s_i32       1
 #define TCG_TARGET_HAS_andc_i32         0
@@ -95,6 +96,7 @@ typedef enum {
 #else
 #define TCG_TARGET_HAS_movcond_i32      0
 #endif
+#define TCG_TARGET_HAS_goto_ptr         0
 
 /* optional instructions only implemented on MIPS32R2 */
 #if defined(__mips_isa_rev) && (__mips_isa_rev >= 2)
@@ -1415,14 +1415,41 @@ static void tgen64_andi_tmp(TCGContext *s, TCGReg dest, tcg_target_ulong val)
     }
 }
 
-static void tcg_prepare_qemu_ldst(TCGContext* s, TCGReg data_reg,
-                                  TCGReg addr_reg, int mem_index, int opc,
-                                  uint16_t **label2_ptr_p, int is_store)
+static void add_qemu_ldst_label(TCGContext *s, int is_ld, int opc,
+                                int data_reg, int addr_reg, int mem_index,
+                                uint8_t *raddr, uint8_t *label_ptr)
+{
+    int idx;
+    TCGLabelQemuLdst *label;
+
+    if (s->nb_qemu_ldst_labels >= TCG_MAX_QEMU_LDST) {
+        tcg_abort();
+    }
+
+    idx = s->nb_qemu_ldst_labels++;
+    label = (TCGLabelQemuLdst *)&s->qemu_ldst_labels[idx];
+    label->is_ld = is_ld;
+    label->opc = opc;
+    label->datalo_reg = data_reg;
+    label->datahi_reg = TCG_REG_NONE;
+    label->addrlo_reg = addr_reg;
+    label->addrhi_reg = TCG_REG_NONE;
+    label->mem_index = mem_index;
+    label->raddr = raddr;
+    label->label_ptr[0] = label_ptr;
+}
+
+/* Emit the TLB check.  On a TLB miss, branch to the slow path emitted at
+   the end of the block by tcg_out_tb_finalize, with the zero-extended guest
+   address in R2.  On a TLB hit, fall through with the host address in R2.
+   Return the position of the branch.  */
+static uint8_t *tcg_prepare_qemu_ldst(TCGContext* s, TCGReg addr_reg,
+                                      int mem_index, int opc, int is_store)
 {
     const TCGReg arg0 = TCG_REG_R2;
     const TCGReg arg1 = TCG_REG_R3;
     int s_bits = opc & 3;
-    uint16_t *label1_ptr;
+    uint8_t *label_ptr;
     tcg_target_long ofs;
 
     if (TARGET_LONG_BITS == 32) {
@@ -1456,91 +1483,125 @@ static void tcg_prepare_qemu_ldst(TCGContext* s, TCGReg data_reg,
         tcg_out_mov(s, TCG_TYPE_I64, arg0, addr_reg);
     }
 
-    label1_ptr = (uint16_t*)s->code_ptr;
-
-    /* je label1 (offset will be patched in later) */
-    tcg_out_insn(s, RI, BRC, S390_CC_EQ, 0);
-
-    /* call load/store helper */
-    if (is_store) {
-        /* Make sure to zero-extend the value to the full register
-           for the calling convention.  */
-        switch (opc) {
-        case LD_UINT8:
-            tgen_ext8u(s, TCG_TYPE_I64, arg1, data_reg);
-            break;
-        case LD_UINT16:
-            tgen_ext16u(s, TCG_TYPE_I64, arg1, data_reg);
-            break;
-        case LD_UINT32:
-            tgen_ext32u(s, arg1, data_reg);
-            break;
-        case LD_UINT64:
-            tcg_out_mov(s, TCG_TYPE_I64, arg1, data_reg);
-            break;
-        default:
-            tcg_abort();
-        }
-        tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_R4, mem_index);
-        /* XXX/FIXME: suboptimal */
-        tcg_out_mov(s, TCG_TYPE_I64, tcg_target_call_iarg_regs[3],
-                    tcg_target_call_iarg_regs[2]);
-        tcg_out_mov(s, TCG_TYPE_I64, tcg_target_call_iarg_regs[2],
-                    tcg_target_call_iarg_regs[1]);
-        tcg_out_mov(s, TCG_TYPE_I64, tcg_target_call_iarg_regs[1],
-                    tcg_target_call_iarg_regs[0]);
-        tcg_out_mov(s, TCG_TYPE_I64, tcg_target_call_iarg_regs[0],
-                    TCG_AREG0);
-        tgen_calli(s, (tcg_target_ulong)qemu_st_helpers[s_bits]);
-    } else {
-        tcg_out_movi(s, TCG_TYPE_I32, arg1, mem_index);
-        /* XXX/FIXME: suboptimal */
-        tcg_out_mov(s, TCG_TYPE_I64, tcg_target_call_iarg_regs[2],
-                    tcg_target_call_iarg_regs[1]);
-        tcg_out_mov(s, TCG_TYPE_I64, tcg_target_call_iarg_regs[1],
-                    tcg_target_call_iarg_regs[0]);
-        tcg_out_mov(s, TCG_TYPE_I64, tcg_target_call_iarg_regs[0],
-                    TCG_AREG0);
-        tgen_calli(s, (tcg_target_ulong)qemu_ld_helpers[s_bits]);
-
-        /* sign extension */
-        switch (opc) {
-        case LD_INT8:
-            tgen_ext8s(s, TCG_TYPE_I64, data_reg, arg0);
-            break;
-        case LD_INT16:
-            tgen_ext16s(s, TCG_TYPE_I64, data_reg, arg0);
-            break;
-        case LD_INT32:
-            tgen_ext32s(s, data_reg, arg0);
-            break;
-        default:
-            /* unsigned -> just copy */
-            tcg_out_mov(s, TCG_TYPE_I64, data_reg, arg0);
-            break;
-        }
-    }
-
-    /* jump to label2 (end) */
-    *label2_ptr_p = (uint16_t*)s->code_ptr;
-
-    tcg_out_insn(s, RI, BRC, S390_CC_ALWAYS, 0);
-
-    /* this is label1, patch branch */
-    *(label1_ptr + 1) = ((unsigned long)s->code_ptr -
-                         (unsigned long)label1_ptr) >> 1;
+    /* jne slow_path (offset will be patched in later) */
+    label_ptr = s->code_ptr;
+    tcg_out_insn(s, RIL, BRCL, S390_CC_NE, 0);
 
     ofs = offsetof(CPUArchState, tlb_table[mem_index][0].addend);
     assert(ofs < 0x80000);
 
     tcg_out_mem(s, 0, RXY_AG, arg0, arg1, TCG_AREG0, ofs);
+
+    return label_ptr;
+}
+
+/* Emit the return address of the fast path after the helper call, in the
+   format expected by GETPC_LDST(): a branch over a word holding the
+   distance from that word to RADDR.  The helper returns to the branch.  */
+static void tcg_out_ldst_raddr(TCGContext *s, uint8_t *raddr)
+{
+    tcg_out_insn(s, RI, BRC, S390_CC_ALWAYS, (4 + 4) >> 1);
+    tcg_out32(s, raddr - s->code_ptr);
+}
+
+static void tcg_out_qemu_ld_slow_path(TCGContext *s, TCGLabelQemuLdst *label)
+{
+    const TCGReg arg0 = TCG_REG_R2;
+    const TCGReg arg1 = TCG_REG_R3;
+    TCGReg data_reg = label->datalo_reg;
+    uint8_t *label_ptr = label->label_ptr[0];
+
+    /* patch branch */
+    *(int32_t *)(label_ptr + 2) = (s->code_ptr - label_ptr) >> 1;
+
+    tcg_out_movi(s, TCG_TYPE_I32, arg1, label->mem_index);
+    /* XXX/FIXME: suboptimal */
+    tcg_out_mov(s, TCG_TYPE_I64, tcg_target_call_iarg_regs[2],
+                tcg_target_call_iarg_regs[1]);
+    tcg_out_mov(s, TCG_TYPE_I64, tcg_target_call_iarg_regs[1],
+                tcg_target_call_iarg_regs[0]);
+    tcg_out_mov(s, TCG_TYPE_I64, tcg_target_call_iarg_regs[0],
+                TCG_AREG0);
+    tgen_calli(s, (tcg_target_ulong)qemu_ld_helpers[label->opc & 3]);
+    tcg_out_ldst_raddr(s, label->raddr);
+
+    /* sign extension */
+    switch (label->opc) {
+    case LD_INT8:
+        tgen_ext8s(s, TCG_TYPE_I64, data_reg, arg0);
+        break;
+    case LD_INT16:
+        tgen_ext16s(s, TCG_TYPE_I64, data_reg, arg0);
+        break;
+    case LD_INT32:
+        tgen_ext32s(s, data_reg, arg0);
+        break;
+    default:
+        /* unsigned -> just copy */
+        tcg_out_mov(s, TCG_TYPE_I64, data_reg, arg0);
+        break;
+    }
+
+    tgen_gotoi(s, S390_CC_ALWAYS, (tcg_target_long)label->raddr);
 }
 
-static void tcg_finish_qemu_ldst(TCGContext* s, uint16_t *label2_ptr)
+static void tcg_out_qemu_st_slow_path(TCGContext *s, TCGLabelQemuLdst *label)
 {
+    const TCGReg arg1 = TCG_REG_R3;
+    TCGReg data_reg = label->datalo_reg;
+    uint8_t *label_ptr = label->label_ptr[0];
+
     /* patch branch */
-    *(label2_ptr + 1) = ((unsigned long)s->code_ptr -
-                         (unsigned long)label2_ptr) >> 1;
+    *(int32_t *)(label_ptr + 2) = (s->code_ptr - label_ptr) >> 1;
+
+    /* Make sure to zero-extend the value to the full register
+       for the calling convention.  */
+    switch (label->opc) {
+    case LD_UINT8:
+        tgen_ext8u(s, TCG_TYPE_I64, arg1, data_reg);
+        break;
+    case LD_UINT16:
+        tgen_ext16u(s, TCG_TYPE_I64, arg1, data_reg);
+        break;
+    case LD_UINT32:
+        tgen_ext32u(s, arg1, data_reg);
+        break;
+    case LD_UINT64:
+        tcg_out_mov(s, TCG_TYPE_I64, arg1, data_reg);
+        break;
+    default:
+        tcg_abort();
+    }
+    tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_R4, label->mem_index);
+    /* XXX/FIXME: suboptimal */
+    tcg_out_mov(s, TCG_TYPE_I64, tcg_target_call_iarg_regs[3],
+                tcg_target_call_iarg_regs[2]);
+    tcg_out_mov(s, TCG_TYPE_I64, tcg_target_call_iarg_regs[2],
+                tcg_target_call_iarg_regs[1]);
+    tcg_out_mov(s, TCG_TYPE_I64, tcg_target_call_iarg_regs[1],
+                tcg_target_call_iarg_regs[0]);
+    tcg_out_mov(s, TCG_TYPE_I64, tcg_target_call_iarg_regs[0],
+                TCG_AREG0);
+    tgen_calli(s, (tcg_target_ulong)qemu_st_helpers[label->opc & 3]);
+    tcg_out_ldst_raddr(s, label->raddr);
+
+    tgen_gotoi(s, S390_CC_ALWAYS, (tcg_target_long)label->raddr);
+}
+
+void tcg_out_tb_finalize(TCGContext *s)
+{
+    int i;
+    TCGLabelQemuLdst *label;
+
+    /* qemu_ld/st slow paths */
+    for (i = 0; i < s->nb_qemu_ldst_labels; i++) {
+        label = (TCGLabelQemuLdst *)&s->qemu_ldst_labels[i];
+        if (label->is_ld) {
+            tcg_out_qemu_ld_slow_path(s, label);
+        } else {
+            tcg_out_qemu_st_slow_path(s, label);
+        }
+    }
 }
 #else
 static void tcg_prepare_user_ldst(TCGContext *s, TCGReg *addr_reg,
@@ -1567,7 +1628,7 @@ static void tcg_out_qemu_ld(TCGContext* s, const TCGArg* args, int opc)
     TCGReg addr_reg, data_reg;
 #if defined(CONFIG_SOFTMMU)
     int mem_index;
-    uint16_t *label2_ptr;
+    uint8_t *label_ptr;
 #else
     TCGReg index_reg;
     tcg_target_long disp;
@@ -1579,12 +1640,12 @@ static void tcg_out_qemu_ld(TCGContext* s, const TCGArg* args, int opc)
 #if defined(CONFIG_SOFTMMU)
     mem_index = *args;
 
-    tcg_prepare_qemu_ldst(s, data_reg, addr_reg, mem_index,
-                          opc, &label2_ptr, 0);
+    label_ptr = tcg_prepare_qemu_ldst(s, addr_reg, mem_index, opc, 0);
 
     tcg_out_qemu_ld_direct(s, opc, data_reg, TCG_REG_R2, TCG_REG_NONE, 0);
 
-    tcg_finish_qemu_ldst(s, label2_ptr);
+    add_qemu_ldst_label(s, 1, opc, data_reg, addr_reg, mem_index,
+                        s->code_ptr, label_ptr);
 #else
     tcg_prepare_user_ldst(s, &addr_reg, &index_reg, &disp);
     tcg_out_qemu_ld_direct(s, opc, data_reg, addr_reg, index_reg, disp);
@@ -1596,7 +1657,7 @@ static void tcg_out_qemu_st(TCGContext* s, const TCGArg* args, int opc)
     TCGReg addr_reg, data_reg;
 #if defined(CONFIG_SOFTMMU)
     int mem_index;
-    uint16_t *label2_ptr;
+    uint8_t *label_ptr;
 #else
     TCGReg index_reg;
     tcg_target_long disp;
@@ -1608,12 +1669,12 @@ static void tcg_out_qemu_st(TCGContext* s, const TCGArg* args, int opc)
 #if defined(CONFIG_SOFTMMU)
     mem_index = *args;
 
-    tcg_prepare_qemu_ldst(s, data_reg, addr_reg, mem_index,
-                          opc, &label2_ptr, 1);
+    label_ptr = tcg_prepare_qemu_ldst(s, addr_reg, mem_index, opc, 1);
 
     tcg_out_qemu_st_direct(s, opc, data_reg, TCG_REG_R2, TCG_REG_NONE, 0);
 
-    tcg_finish_qemu_ldst(s, label2_ptr);
+    add_qemu_ldst_label(s, 0, opc, data_reg, addr_reg, mem_index,
+                        s->code_ptr, label_ptr);
 #else
     tcg_prepare_user_ldst(s, &addr_reg, &index_reg, &disp);
     tcg_out_qemu_st_direct(s, opc, data_reg, addr_reg, index_reg, disp);
@@ -916,6 +916,164 @@ static int tcg_out_tlb_load(TCGContext *s, int addrlo_idx, int mem_index,
     }
     return addrlo;
 }
+
+static void add_qemu_ldst_label(TCGContext *s, int is_ld, int opc,
+                                int data_reg, int data_reg2,
+                                int addrlo_reg, int addrhi_reg,
+                                int mem_index, uint8_t *raddr,
+                                uint8_t *label_ptr)
+{
+    int idx;
+    TCGLabelQemuLdst *label;
+
+    if (s->nb_qemu_ldst_labels >= TCG_MAX_QEMU_LDST) {
+        tcg_abort();
+    }
+
+    idx = s->nb_qemu_ldst_labels++;
+    label = (TCGLabelQemuLdst *)&s->qemu_ldst_labels[idx];
+    label->is_ld = is_ld;
+    label->opc = opc;
+    label->datalo_reg = data_reg;
+    label->datahi_reg = data_reg2;
+    label->addrlo_reg = addrlo_reg;
+    label->addrhi_reg = addrhi_reg;
+    label->mem_index = mem_index;
+    label->raddr = raddr;
+    label->label_ptr[0] = label_ptr;
+}
+
+/* Marshal the address arguments of a slow path helper call.  The env
+   argument has already been set up in the delay slot of the branch from
+   the fast path.  Return the index of the next argument.  */
+static int tcg_out_ldst_addr_args(TCGContext *s, TCGLabelQemuLdst *label)
+{
+    int n = 1;
+
+    *(uint32_t *)label->label_ptr[0] |=
+        INSN_OFF19((unsigned long)s->code_ptr
+                   - (unsigned long)label->label_ptr[0]);
+
+    if (TARGET_LONG_BITS > TCG_TARGET_REG_BITS) {
+        tcg_out_mov(s, TCG_TYPE_REG, tcg_target_call_iarg_regs[n++],
+                    label->addrhi_reg);
+    }
+    tcg_out_mov(s, TCG_TYPE_REG, tcg_target_call_iarg_regs[n++],
+                label->addrlo_reg);
+    return n;
+}
+
+/* Emit the return address of the fast path after the helper call and its
+   delay slot, in the format expected by GETPC_LDST(): a branch over a word
+   holding the distance from that word to RADDR.  The word sits in the
+   annulled delay slot of the branch.  */
+static void tcg_out_ldst_raddr(TCGContext *s, uint8_t *raddr)
+{
+    /* ba,a,pt 1f */
+    tcg_out_bpcc0(s, COND_A, BPCC_A | BPCC_PT, INSN_OFF19(8));
+    tcg_out32(s, raddr - s->code_ptr);
+}
+
+static void tcg_out_ldst_return(TCGContext *s, uint8_t *raddr)
+{
+    /* ba,a,pt raddr */
+    tcg_out_bpcc0(s, COND_A, BPCC_A | BPCC_PT,
+                  INSN_OFF19((unsigned long)raddr
+                             - (unsigned long)s->code_ptr));
+}
+
+static void tcg_out_qemu_ld_slow_path(TCGContext *s, TCGLabelQemuLdst *label)
+{
+    int sizeop = label->opc;
+    int datalo = label->datalo_reg;
+    int datahi = label->datahi_reg;
+    int n;
+
+    n = tcg_out_ldst_addr_args(s, label);
+
+    /* qemu_ld_helper[s_bits](arg0, arg1) */
+    tcg_out32(s, CALL | ((((tcg_target_ulong)qemu_ld_helpers[sizeop & 3]
+                           - (tcg_target_ulong)s->code_ptr) >> 2)
+                         & 0x3fffffff));
+    /* delay slot */
+    tcg_out_movi(s, TCG_TYPE_I32, tcg_target_call_iarg_regs[n],
+                 label->mem_index);
+    tcg_out_ldst_raddr(s, label->raddr);
+
+    n = tcg_target_call_oarg_regs[0];
+    /* datalo = sign_extend(arg0) */
+    switch (sizeop) {
+    case 0 | 4:
+        /* Recall that SRA sign extends from bit 31 through bit 63.  */
+        tcg_out_arithi(s, datalo, n, 24, SHIFT_SLL);
+        tcg_out_arithi(s, datalo, datalo, 24, SHIFT_SRA);
+        break;
+    case 1 | 4:
+        tcg_out_arithi(s, datalo, n, 16, SHIFT_SLL);
+        tcg_out_arithi(s, datalo, datalo, 16, SHIFT_SRA);
+        break;
+    case 2 | 4:
+        tcg_out_arithi(s, datalo, n, 0, SHIFT_SRA);
+        break;
+    case 3:
+        if (TCG_TARGET_REG_BITS == 32) {
+            tcg_out_mov(s, TCG_TYPE_REG, datahi, n);
+            tcg_out_mov(s, TCG_TYPE_REG, datalo, n + 1);
+            break;
+        }
+        /* FALLTHRU */
+    case 0:
+    case 1:
+    case 2:
+    default:
+        /* mov */
+        tcg_out_mov(s, TCG_TYPE_REG, datalo, n);
+        break;
+    }
+
+    tcg_out_ldst_return(s, label->raddr);
+}
+
+static void tcg_out_qemu_st_slow_path(TCGContext *s, TCGLabelQemuLdst *label)
+{
+    int sizeop = label->opc;
+    int n;
+
+    n = tcg_out_ldst_addr_args(s, label);
+    if (TCG_TARGET_REG_BITS == 32 && sizeop == 3) {
+        tcg_out_mov(s, TCG_TYPE_REG, tcg_target_call_iarg_regs[n++],
+                    label->datahi_reg);
+    }
+    tcg_out_mov(s, TCG_TYPE_REG, tcg_target_call_iarg_regs[n++],
+                label->datalo_reg);
+
+    /* qemu_st_helper[s_bits](arg0, arg1, arg2) */
+    tcg_out32(s, CALL | ((((tcg_target_ulong)qemu_st_helpers[sizeop]
+                           - (tcg_target_ulong)s->code_ptr) >> 2)
+                         & 0x3fffffff));
+    /* delay slot */
+    tcg_out_movi(s, TCG_TYPE_REG, tcg_target_call_iarg_regs[n],
+                 label->mem_index);
+    tcg_out_ldst_raddr(s, label->raddr);
+
+    tcg_out_ldst_return(s, label->raddr);
+}
+
+void tcg_out_tb_finalize(TCGContext *s)
+{
+    int i;
+    TCGLabelQemuLdst *label;
+
+    /* qemu_ld/st slow paths */
+    for (i = 0; i < s->nb_qemu_ldst_labels; i++) {
+        label = (TCGLabelQemuLdst *)&s->qemu_ldst_labels[i];
+        if (label->is_ld) {
+            tcg_out_qemu_ld_slow_path(s, label);
+        } else {
+            tcg_out_qemu_st_slow_path(s, label);
+        }
+    }
+}
 #endif /* CONFIG_SOFTMMU */
 
 static const int qemu_ld_opc[8] = {
@@ -938,8 +1096,8 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args, int sizeop)
 {
     int addrlo_idx = 1, datalo, datahi, addr_reg;
 #if defined(CONFIG_SOFTMMU)
-    int memi_idx, memi, s_bits, n;
-    uint32_t *label_ptr[2];
+    int memi_idx, memi, s_bits;
+    uint8_t *label_ptr;
 #endif
 
     datahi = datalo = args[0];
@@ -956,15 +1114,20 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args, int sizeop)
     addr_reg = tcg_out_tlb_load(s, addrlo_idx, memi, s_bits, args,
                                 offsetof(CPUTLBEntry, addr_read));
 
+    /* TLB Miss: branch to the slow path emitted at the end of the block.
+       The first helper argument is set up in the delay slot, which is
+       annulled when the branch is not taken.  */
+    /* bne,a,pn %[xi]cc, slow_path */
+    label_ptr = s->code_ptr;
+    tcg_out_bpcc0(s, COND_NE, BPCC_A | BPCC_PN
+                  | (TARGET_LONG_BITS == 64 ? BPCC_XCC : BPCC_ICC), 0);
+    /* delay slot */
+    tcg_out_mov(s, TCG_TYPE_PTR, tcg_target_call_iarg_regs[0], TCG_AREG0);
+
+    /* TLB Hit.  */
     if (TCG_TARGET_REG_BITS == 32 && sizeop == 3) {
         int reg64;
 
-        /* bne,pn %[xi]cc, label0 */
-        label_ptr[0] = (uint32_t *)s->code_ptr;
-        tcg_out_bpcc0(s, COND_NE, BPCC_PN
-                      | (TARGET_LONG_BITS == 64 ? BPCC_XCC : BPCC_ICC), 0);
-
-        /* TLB Hit.  */
         /* Load all 64-bits into an O/G register.  */
         reg64 = (datalo < 16 ? datalo : TCG_REG_O0);
         tcg_out_ldst_rr(s, reg64, addr_reg, TCG_REG_O1, qemu_ld_opc[sizeop]);
@@ -974,79 +1137,14 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args, int sizeop)
         if (reg64 != datalo) {
             tcg_out_mov(s, TCG_TYPE_I32, datalo, reg64);
         }
-
-        /* b,a,pt label1 */
-        label_ptr[1] = (uint32_t *)s->code_ptr;
-        tcg_out_bpcc0(s, COND_A, BPCC_A | BPCC_PT, 0);
     } else {
-        /* The fast path is exactly one insn.  Thus we can perform the
-           entire TLB Hit in the (annulled) delay slot of the branch
-           over the TLB Miss case.  */
-
-        /* beq,a,pt %[xi]cc, label0 */
-        label_ptr[0] = NULL;
-        label_ptr[1] = (uint32_t *)s->code_ptr;
-        tcg_out_bpcc0(s, COND_E, BPCC_A | BPCC_PT
-                      | (TARGET_LONG_BITS == 64 ? BPCC_XCC : BPCC_ICC), 0);
-        /* delay slot */
         tcg_out_ldst_rr(s, datalo, addr_reg, TCG_REG_O1, qemu_ld_opc[sizeop]);
     }
 
-    /* TLB Miss.  */
-
-    if (label_ptr[0]) {
-        *label_ptr[0] |= INSN_OFF19((unsigned long)s->code_ptr -
-                                    (unsigned long)label_ptr[0]);
-    }
-    n = 0;
-    tcg_out_mov(s, TCG_TYPE_PTR, tcg_target_call_iarg_regs[n++], TCG_AREG0);
-    if (TARGET_LONG_BITS > TCG_TARGET_REG_BITS) {
-        tcg_out_mov(s, TCG_TYPE_REG, tcg_target_call_iarg_regs[n++],
-                    args[addrlo_idx + 1]);
-    }
-    tcg_out_mov(s, TCG_TYPE_REG, tcg_target_call_iarg_regs[n++],
-                args[addrlo_idx]);
-
-    /* qemu_ld_helper[s_bits](arg0, arg1) */
-    tcg_out32(s, CALL | ((((tcg_target_ulong)qemu_ld_helpers[s_bits]
-                           - (tcg_target_ulong)s->code_ptr) >> 2)
-                         & 0x3fffffff));
-    /* delay slot */
-    tcg_out_movi(s, TCG_TYPE_I32, tcg_target_call_iarg_regs[n], memi);
-
-    n = tcg_target_call_oarg_regs[0];
-    /* datalo = sign_extend(arg0) */
-    switch (sizeop) {
-    case 0 | 4:
-        /* Recall that SRA sign extends from bit 31 through bit 63.  */
-        tcg_out_arithi(s, datalo, n, 24, SHIFT_SLL);
-        tcg_out_arithi(s, datalo, datalo, 24, SHIFT_SRA);
-        break;
-    case 1 | 4:
-        tcg_out_arithi(s, datalo, n, 16, SHIFT_SLL);
-        tcg_out_arithi(s, datalo, datalo, 16, SHIFT_SRA);
-        break;
-    case 2 | 4:
-        tcg_out_arithi(s, datalo, n, 0, SHIFT_SRA);
-        break;
-    case 3:
-        if (TCG_TARGET_REG_BITS == 32) {
-            tcg_out_mov(s, TCG_TYPE_REG, datahi, n);
-            tcg_out_mov(s, TCG_TYPE_REG, datalo, n + 1);
-            break;
-        }
-        /* FALLTHRU */
-    case 0:
-    case 1:
-    case 2:
-    default:
-        /* mov */
-        tcg_out_mov(s, TCG_TYPE_REG, datalo, n);
-        break;
-    }
-
-    *label_ptr[1] |= INSN_OFF19((unsigned long)s->code_ptr -
-                                (unsigned long)label_ptr[1]);
+    add_qemu_ldst_label(s, 1, sizeop, datalo, datahi, args[addrlo_idx],
+                        (TARGET_LONG_BITS > TCG_TARGET_REG_BITS
+                         ? args[addrlo_idx + 1] : 0),
+                        memi, s->code_ptr, label_ptr);
 #else
     addr_reg = args[addrlo_idx];
     if (TCG_TARGET_REG_BITS == 64 && TARGET_LONG_BITS == 32) {
@@ -1076,8 +1174,8 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, int sizeop)
 {
     int addrlo_idx = 1, datalo, datahi, addr_reg;
 #if defined(CONFIG_SOFTMMU)
-    int memi_idx, memi, n, datafull;
-    uint32_t *label_ptr;
+    int memi_idx, memi, datafull;
+    uint8_t *label_ptr;
 #endif
 
     datahi = datalo = args[0];
@@ -1102,39 +1200,23 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, int sizeop)
         datafull = TCG_REG_O2;
     }
 
-    /* The fast path is exactly one insn.  Thus we can perform the entire
-       TLB Hit in the (annulled) delay slot of the branch over TLB Miss.  */
-    /* beq,a,pt %[xi]cc, label0 */
-    label_ptr = (uint32_t *)s->code_ptr;
-    tcg_out_bpcc0(s, COND_E, BPCC_A | BPCC_PT
+    /* TLB Miss: branch to the slow path emitted at the end of the block.
+       The first helper argument is set up in the delay slot, which is
+       annulled when the branch is not taken.  */
+    /* bne,a,pn %[xi]cc, slow_path */
+    label_ptr = s->code_ptr;
+    tcg_out_bpcc0(s, COND_NE, BPCC_A | BPCC_PN
                   | (TARGET_LONG_BITS == 64 ? BPCC_XCC : BPCC_ICC), 0);
     /* delay slot */
-    tcg_out_ldst_rr(s, datafull, addr_reg, TCG_REG_O1, qemu_st_opc[sizeop]);
-
-    /* TLB Miss.  */
-
-    n = 0;
-    tcg_out_mov(s, TCG_TYPE_PTR, tcg_target_call_iarg_regs[n++], TCG_AREG0);
-    if (TARGET_LONG_BITS > TCG_TARGET_REG_BITS) {
-        tcg_out_mov(s, TCG_TYPE_REG, tcg_target_call_iarg_regs[n++],
-                    args[addrlo_idx + 1]);
-    }
-    tcg_out_mov(s, TCG_TYPE_REG, tcg_target_call_iarg_regs[n++],
-                args[addrlo_idx]);
-    if (TCG_TARGET_REG_BITS == 32 && sizeop == 3) {
-        tcg_out_mov(s, TCG_TYPE_REG, tcg_target_call_iarg_regs[n++], datahi);
-    }
-    tcg_out_mov(s, TCG_TYPE_REG, tcg_target_call_iarg_regs[n++], datalo);
+    tcg_out_mov(s, TCG_TYPE_PTR, tcg_target_call_iarg_regs[0], TCG_AREG0);
 
-    /* qemu_st_helper[s_bits](arg0, arg1, arg2) */
-    tcg_out32(s, CALL | ((((tcg_target_ulong)qemu_st_helpers[sizeop]
-                           - (tcg_target_ulong)s->code_ptr) >> 2)
-                         & 0x3fffffff));
-    /* delay slot */
-    tcg_out_movi(s, TCG_TYPE_REG, tcg_target_call_iarg_regs[n], memi);
+    /* TLB Hit.  */
+    tcg_out_ldst_rr(s, datafull, addr_reg, TCG_REG_O1, qemu_st_opc[sizeop]);
 
-    *label_ptr |= INSN_OFF19((unsigned long)s->code_ptr -
-                             (unsigned long)label_ptr);
+    add_qemu_ldst_label(s, 0, sizeop, datalo, datahi, args[addrlo_idx],
+                        (TARGET_LONG_BITS > TCG_TARGET_REG_BITS
+                         ? args[addrlo_idx + 1] : 0),
+                        memi, s->code_ptr, label_ptr);
 #else
     addr_reg = args[addrlo_idx];
     if (TCG_TARGET_REG_BITS == 64 && TARGET_LONG_BITS == 32) {
@@ -433,6 +433,32 @@ static inline void tcg_gen_helper64(void *func, int sizemask, TCGv_i64 ret,
     tcg_temp_free_ptr(fn);
 }
 
+static inline void tcg_gen_helper32_1(void *func, int sizemask, TCGv_i32 ret,
+                                      TCGv_i32 a)
+{
+    TCGv_ptr fn;
+    TCGArg args[1];
+    fn = tcg_const_ptr(func);
+    args[0] = GET_TCGV_I32(a);
+    tcg_gen_callN(&tcg_ctx, fn,
+                  TCG_CALL_NO_READ_GLOBALS | TCG_CALL_NO_SIDE_EFFECTS,
+                  sizemask, GET_TCGV_I32(ret), 1, args);
+    tcg_temp_free_ptr(fn);
+}
+
+static inline void tcg_gen_helper64_1(void *func, int sizemask, TCGv_i64 ret,
+                                      TCGv_i64 a)
+{
+    TCGv_ptr fn;
+    TCGArg args[1];
+    fn = tcg_const_ptr(func);
+    args[0] = GET_TCGV_I64(a);
+    tcg_gen_callN(&tcg_ctx, fn,
+                  TCG_CALL_NO_READ_GLOBALS | TCG_CALL_NO_SIDE_EFFECTS,
+                  sizemask, GET_TCGV_I64(ret), 1, args);
+    tcg_temp_free_ptr(fn);
+}
+
 /* 32 bit ops */
 
 static inline void tcg_gen_ld8u_i32(TCGv_i32 ret, TCGv_ptr arg2, tcg_target_long offset)
@@ -1999,6 +2025,32 @@ static inline void tcg_gen_orc_i64(TCGv_i64 ret, TCGv_i64 arg1, TCGv_i64 arg2)
 #endif
 }
 
+static inline void tcg_gen_clz_i32(TCGv_i32 ret, TCGv_i32 arg)
+{
+    if (TCG_TARGET_HAS_clz_i32) {
+        tcg_gen_op2_i32(INDEX_op_clz_i32, ret, arg);
+    } else {
+        int sizemask = 0;
+        /* Return value and argument are 32-bit and unsigned.  */
+        sizemask |= tcg_gen_sizemask(0, 0, 0);
+        sizemask |= tcg_gen_sizemask(1, 0, 0);
+        tcg_gen_helper32_1(tcg_helper_clz_i32, sizemask, ret, arg);
+    }
+}
+
+static inline void tcg_gen_clz_i64(TCGv_i64 ret, TCGv_i64 arg)
+{
+    if (TCG_TARGET_HAS_clz_i64) {
+        tcg_gen_op2_i64(INDEX_op_clz_i64, ret, arg);
+    } else {
+        int sizemask = 0;
+        /* Return value and argument are 64-bit and unsigned.  */
+        sizemask |= tcg_gen_sizemask(0, 1, 0);
+        sizemask |= tcg_gen_sizemask(1, 1, 0);
+        tcg_gen_helper64_1(tcg_helper_clz_i64, sizemask, ret, arg);
+    }
+}
+
 static inline void tcg_gen_rotl_i32(TCGv_i32 ret, TCGv_i32 arg1, TCGv_i32 arg2)
 {
     if (TCG_TARGET_HAS_rot_i32) {
@@ -2312,6 +2364,139 @@ static inline void tcg_gen_movcond_i64(TCGCond cond, TCGv_i64 ret,
 #endif
 }
 
+/***************************************/
+/* Packed lane arithmetic.  The register is treated as a vector of 8, 16
+   or 32-bit lanes; carries and borrows do not cross lane boundaries.
+   M has the most significant bit of each lane set.  */
+
+static inline void tcg_gen_vec_add_mask_i32(TCGv_i32 d, TCGv_i32 a,
+                                            TCGv_i32 b, uint32_t m)
+{
+    TCGv_i32 t1 = tcg_temp_new_i32();
+    TCGv_i32 t2 = tcg_temp_new_i32();
+    TCGv_i32 t3 = tcg_temp_new_i32();
+
+    /* d = ((a & ~m) + (b & ~m)) ^ ((a ^ b) & m) */
+    tcg_gen_andi_i32(t1, a, ~m);
+    tcg_gen_andi_i32(t2, b, ~m);
+    tcg_gen_xor_i32(t3, a, b);
+    tcg_gen_add_i32(d, t1, t2);
+    tcg_gen_andi_i32(t3, t3, m);
+    tcg_gen_xor_i32(d, d, t3);
+
+    tcg_temp_free_i32(t1);
+    tcg_temp_free_i32(t2);
+    tcg_temp_free_i32(t3);
+}
+
+static inline void tcg_gen_vec_sub_mask_i32(TCGv_i32 d, TCGv_i32 a,
+                                            TCGv_i32 b, uint32_t m)
+{
+    TCGv_i32 t1 = tcg_temp_new_i32();
+    TCGv_i32 t2 = tcg_temp_new_i32();
+    TCGv_i32 t3 = tcg_temp_new_i32();
+
+    /* d = ((a | m) - (b & ~m)) ^ ((a ^ ~b) & m) */
+    tcg_gen_ori_i32(t1, a, m);
+    tcg_gen_andi_i32(t2, b, ~m);
+    tcg_gen_eqv_i32(t3, a, b);
+    tcg_gen_sub_i32(d, t1, t2);
+    tcg_gen_andi_i32(t3, t3, m);
+    tcg_gen_xor_i32(d, d, t3);
+
+    tcg_temp_free_i32(t1);
+    tcg_temp_free_i32(t2);
+    tcg_temp_free_i32(t3);
+}
+
+static inline void tcg_gen_vec_add8_i32(TCGv_i32 d, TCGv_i32 a, TCGv_i32 b)
+{
+    tcg_gen_vec_add_mask_i32(d, a, b, 0x80808080u);
+}
+
+static inline void tcg_gen_vec_add16_i32(TCGv_i32 d, TCGv_i32 a, TCGv_i32 b)
+{
+    tcg_gen_vec_add_mask_i32(d, a, b, 0x80008000u);
+}
+
+static inline void tcg_gen_vec_sub8_i32(TCGv_i32 d, TCGv_i32 a, TCGv_i32 b)
+{
+    tcg_gen_vec_sub_mask_i32(d, a, b, 0x80808080u);
+}
+
+static inline void tcg_gen_vec_sub16_i32(TCGv_i32 d, TCGv_i32 a, TCGv_i32 b)
+{
+    tcg_gen_vec_sub_mask_i32(d, a, b, 0x80008000u);
+}
+
+static inline void tcg_gen_vec_add_mask_i64(TCGv_i64 d, TCGv_i64 a,
+                                            TCGv_i64 b, uint64_t m)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+    TCGv_i64 t3 = tcg_temp_new_i64();
+
+    tcg_gen_andi_i64(t1, a, ~m);
+    tcg_gen_andi_i64(t2, b, ~m);
+    tcg_gen_xor_i64(t3, a, b);
+    tcg_gen_add_i64(d, t1, t2);
+    tcg_gen_andi_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+static inline void tcg_gen_vec_sub_mask_i64(TCGv_i64 d, TCGv_i64 a,
+                                            TCGv_i64 b, uint64_t m)
+{
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    TCGv_i64 t2 = tcg_temp_new_i64();
+    TCGv_i64 t3 = tcg_temp_new_i64();
+
+    tcg_gen_ori_i64(t1, a, m);
+    tcg_gen_andi_i64(t2, b, ~m);
+    tcg_gen_eqv_i64(t3, a, b);
+    tcg_gen_sub_i64(d, t1, t2);
+    tcg_gen_andi_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+static inline void tcg_gen_vec_add8_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_vec_add_mask_i64(d, a, b, 0x8080808080808080ull);
+}
+
+static inline void tcg_gen_vec_add16_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_vec_add_mask_i64(d, a, b, 0x8000800080008000ull);
+}
+
+static inline void tcg_gen_vec_add32_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_vec_add_mask_i64(d, a, b, 0x8000000080000000ull);
+}
+
+static inline void tcg_gen_vec_sub8_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_vec_sub_mask_i64(d, a, b, 0x8080808080808080ull);
+}
+
+static inline void tcg_gen_vec_sub16_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_vec_sub_mask_i64(d, a, b, 0x8000800080008000ull);
+}
+
+static inline void tcg_gen_vec_sub32_i64(TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_vec_sub_mask_i64(d, a, b, 0x8000000080000000ull);
+}
+
 /***************************************/
 /* QEMU specific operations. Their type depend on the QEMU CPU
    type. */
@@ -2360,6 +2545,13 @@ static inline void tcg_gen_exit_tb(tcg_target_long val)
     tcg_gen_op1i(INDEX_op_exit_tb, val);
 }
 
+/* Jump to the host code at PTR, which is either the start of a TB or
+   code_gen_epilogue.  Only valid if TCG_TARGET_HAS_goto_ptr.  */
+static inline void tcg_gen_goto_ptr(TCGv_ptr ptr)
+{
+    tcg_gen_op1_i32(INDEX_op_goto_ptr, MAKE_TCGV_I32(GET_TCGV_PTR(ptr)));
+}
+
 static inline void tcg_gen_goto_tb(unsigned idx)
 {
     /* We only support two chained exits.  */
@@ -2628,6 +2820,7 @@ static inline void tcg_gen_qemu_st64(TCGv_i64 arg, TCGv addr, int mem_index)
 #define tcg_gen_nand_tl tcg_gen_nand_i64
 #define tcg_gen_nor_tl tcg_gen_nor_i64
 #define tcg_gen_orc_tl tcg_gen_orc_i64
+#define tcg_gen_clz_tl tcg_gen_clz_i64
 #define tcg_gen_rotl_tl tcg_gen_rotl_i64
 #define tcg_gen_rotli_tl tcg_gen_rotli_i64
 #define tcg_gen_rotr_tl tcg_gen_rotr_i64
@@ -2700,6 +2893,7 @@ static inline void tcg_gen_qemu_st64(TCGv_i64 arg, TCGv addr, int mem_index)
 #define tcg_gen_nand_tl tcg_gen_nand_i32
 #define tcg_gen_nor_tl tcg_gen_nor_i32
 #define tcg_gen_orc_tl tcg_gen_orc_i32
+#define tcg_gen_clz_tl tcg_gen_clz_i32
 #define tcg_gen_rotl_tl tcg_gen_rotl_i32
 #define tcg_gen_rotli_tl tcg_gen_rotli_i32
 #define tcg_gen_rotr_tl tcg_gen_rotr_i32
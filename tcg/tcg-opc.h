@@ -40,7 +40,9 @@ DEF(set_label, 0, 0, 1, TCG_OPF_BB_END)
 DEF(call, 0, 1, 2, TCG_OPF_CALL_CLOBBER) /* variable number of parameters */
 DEF(br, 0, 0, 1, TCG_OPF_BB_END)
 
-#define IMPL(X) (X ? 0 : TCG_OPF_NOT_PRESENT)
+/* Backends may decide at run time whether an optional opcode is present,
+   in which case it must always have an entry in the op definitions.  */
+#define IMPL(X) (__builtin_constant_p(X) && !(X) ? TCG_OPF_NOT_PRESENT : 0)
 #if TCG_TARGET_REG_BITS == 32
 # define IMPL64  TCG_OPF_64BIT | TCG_OPF_NOT_PRESENT
 #else
@@ -102,6 +104,7 @@ DEF(orc_i32, 1, 2, 0, IMPL(TCG_TARGET_HAS_orc_i32))
 DEF(eqv_i32, 1, 2, 0, IMPL(TCG_TARGET_HAS_eqv_i32))
 DEF(nand_i32, 1, 2, 0, IMPL(TCG_TARGET_HAS_nand_i32))
 DEF(nor_i32, 1, 2, 0, IMPL(TCG_TARGET_HAS_nor_i32))
+DEF(clz_i32, 1, 1, 0, IMPL(TCG_TARGET_HAS_clz_i32))
 
 DEF(mov_i64, 1, 1, 0, IMPL64)
 DEF(movi_i64, 1, 0, 1, IMPL64)
@@ -157,6 +160,7 @@ DEF(orc_i64, 1, 2, 0, IMPL64 | IMPL(TCG_TARGET_HAS_orc_i64))
 DEF(eqv_i64, 1, 2, 0, IMPL64 | IMPL(TCG_TARGET_HAS_eqv_i64))
 DEF(nand_i64, 1, 2, 0, IMPL64 | IMPL(TCG_TARGET_HAS_nand_i64))
 DEF(nor_i64, 1, 2, 0, IMPL64 | IMPL(TCG_TARGET_HAS_nor_i64))
+DEF(clz_i64, 1, 1, 0, IMPL64 | IMPL(TCG_TARGET_HAS_clz_i64))
 
 /* QEMU specific */
 #if TARGET_LONG_BITS > TCG_TARGET_REG_BITS
@@ -166,6 +170,7 @@ DEF(debug_insn_start, 0, 0, 1, 0)
 #endif
 DEF(exit_tb, 0, 0, 1, TCG_OPF_BB_END)
 DEF(goto_tb, 0, 0, 1, TCG_OPF_BB_END)
+DEF(goto_ptr, 0, 1, 0, TCG_OPF_BB_END | IMPL(TCG_TARGET_HAS_goto_ptr))
 /* Note: even if TARGET_LONG_BITS is not defined, the INDEX_op
    constants must be defined */
 #if TCG_TARGET_REG_BITS == 32
@@ -239,6 +244,25 @@ DEF(qemu_st64, 0, 2, 1, TCG_OPF_CALL_CLOBBER | TCG_OPF_SIDE_EFFECTS)
 
 #endif /* TCG_TARGET_REG_BITS != 32 */
 
+#ifdef TCG_TARGET_INTERPRETER
+/* Superinstructions formed by the TCI bytecode emitter out of adjacent
+   ops.  They are never generated by the front ends. */
+DEF(tci_ld_add_st_i32, 1, 2, 1, TCG_OPF_NOT_PRESENT)
+DEF(tci_ld_sub_st_i32, 1, 2, 1, TCG_OPF_NOT_PRESENT)
+DEF(tci_ld_and_st_i32, 1, 2, 1, TCG_OPF_NOT_PRESENT)
+DEF(tci_ld_or_st_i32, 1, 2, 1, TCG_OPF_NOT_PRESENT)
+DEF(tci_ld_xor_st_i32, 1, 2, 1, TCG_OPF_NOT_PRESENT)
+DEF(tci_setcond_brcond_i32, 1, 2, 3, TCG_OPF_BB_END | TCG_OPF_NOT_PRESENT)
+
+DEF(tci_ld_add_st_i64, 1, 2, 1, TCG_OPF_64BIT | TCG_OPF_NOT_PRESENT)
+DEF(tci_ld_sub_st_i64, 1, 2, 1, TCG_OPF_64BIT | TCG_OPF_NOT_PRESENT)
+DEF(tci_ld_and_st_i64, 1, 2, 1, TCG_OPF_64BIT | TCG_OPF_NOT_PRESENT)
+DEF(tci_ld_or_st_i64, 1, 2, 1, TCG_OPF_64BIT | TCG_OPF_NOT_PRESENT)
+DEF(tci_ld_xor_st_i64, 1, 2, 1, TCG_OPF_64BIT | TCG_OPF_NOT_PRESENT)
+DEF(tci_setcond_brcond_i64, 1, 2, 3,
+    TCG_OPF_BB_END | TCG_OPF_64BIT | TCG_OPF_NOT_PRESENT)
+#endif
+
 #undef IMPL
 #undef IMPL64
 #undef DEF
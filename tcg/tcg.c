@@ -295,6 +295,7 @@ void tcg_func_start(TCGContext *s)
 
     s->gen_opc_ptr = s->gen_opc_buf;
     s->gen_opparam_ptr = s->gen_opparam_buf;
+    s->host_ptr_used = false;
 
 #if defined(CONFIG_QEMU_LDST_OPTIMIZATION) && defined(CONFIG_SOFTMMU)
     /* Initialize qemu_ld/st labels to assist code generation at the end of TB
@@ -1224,6 +1225,7 @@ static void tcg_liveness_analysis(TCGContext *s)
     uint8_t *dead_temps, *mem_temps;
     uint16_t dead_args;
     uint8_t sync_args;
+    TCGRegSet *temp_hint, regs;
     
     s->gen_opc_ptr++; /* skip end */
 
@@ -1231,11 +1233,19 @@ static void tcg_liveness_analysis(TCGContext *s)
 
     s->op_dead_args = tcg_malloc(nb_ops * sizeof(uint16_t));
     s->op_sync_args = tcg_malloc(nb_ops * sizeof(uint8_t));
+    s->op_out_hint = tcg_malloc(nb_ops * sizeof(TCGRegSet));
+    memset(s->op_out_hint, 0, nb_ops * sizeof(TCGRegSet));
     
     dead_temps = tcg_malloc(s->nb_temps);
     mem_temps = tcg_malloc(s->nb_temps);
     tcg_la_func_end(s, dead_temps, mem_temps);
 
+    /* registers in which the next op reading each temp wants it: the
+       argument registers of a helper call, or an input constraint
+       naming a single register */
+    temp_hint = tcg_malloc(s->nb_temps * sizeof(TCGRegSet));
+    memset(temp_hint, 0, s->nb_temps * sizeof(TCGRegSet));
+
     args = s->gen_opparam_ptr;
     op_index = nb_ops - 1;
     while (op_index >= 0) {
@@ -1280,6 +1290,7 @@ static void tcg_liveness_analysis(TCGContext *s)
                         }
                         dead_temps[arg] = 1;
                         mem_temps[arg] = 0;
+                        tcg_regset_clear(temp_hint[arg]);
                     }
 
                     if (!(call_flags & TCG_CALL_NO_READ_GLOBALS)) {
@@ -1300,6 +1311,13 @@ static void tcg_liveness_analysis(TCGContext *s)
                                 dead_args |= (1 << i);
                             }
                             dead_temps[arg] = 0;
+                            if (i - nb_oargs <
+                                ARRAY_SIZE(tcg_target_call_iarg_regs) &&
+                                i - nb_oargs < nb_iargs - 1) {
+                                tcg_regset_clear(temp_hint[arg]);
+                                tcg_regset_set_reg(temp_hint[arg],
+                                    tcg_target_call_iarg_regs[i - nb_oargs]);
+                            }
                         }
                     }
                     s->op_dead_args[op_index] = dead_args;
@@ -1400,6 +1418,9 @@ static void tcg_liveness_analysis(TCGContext *s)
                 /* output args are dead */
                 dead_args = 0;
                 sync_args = 0;
+                if (nb_oargs > 0) {
+                    s->op_out_hint[op_index] = temp_hint[args[0]];
+                }
                 for(i = 0; i < nb_oargs; i++) {
                     arg = args[i];
                     if (dead_temps[arg]) {
@@ -1410,11 +1431,13 @@ static void tcg_liveness_analysis(TCGContext *s)
                     }
                     dead_temps[arg] = 1;
                     mem_temps[arg] = 0;
+                    tcg_regset_clear(temp_hint[arg]);
                 }
 
                 /* if end of basic block, update */
                 if (def->flags & TCG_OPF_BB_END) {
                     tcg_la_bb_end(s, dead_temps, mem_temps);
+                    memset(temp_hint, 0, s->nb_temps * sizeof(TCGRegSet));
                 } else if (def->flags & TCG_OPF_SIDE_EFFECTS) {
                     /* globals should be synced to memory */
                     memset(mem_temps, 1, s->nb_globals);
@@ -1427,6 +1450,11 @@ static void tcg_liveness_analysis(TCGContext *s)
                         dead_args |= (1 << i);
                     }
                     dead_temps[arg] = 0;
+                    regs = def->args_ct[i].u.regs;
+                    if ((def->args_ct[i].ct & TCG_CT_REG) &&
+                        regs != 0 && (regs & (regs - 1)) == 0) {
+                        temp_hint[arg] = regs;
+                    }
                 }
                 s->op_dead_args[op_index] = dead_args;
                 s->op_sync_args[op_index] = sync_args;
@@ -1451,6 +1479,8 @@ static void tcg_liveness_analysis(TCGContext *s)
     memset(s->op_dead_args, 0, nb_ops * sizeof(uint16_t));
     s->op_sync_args = tcg_malloc(nb_ops * sizeof(uint8_t));
     memset(s->op_sync_args, 0, nb_ops * sizeof(uint8_t));
+    s->op_out_hint = tcg_malloc(nb_ops * sizeof(TCGRegSet));
+    memset(s->op_out_hint, 0, nb_ops * sizeof(TCGRegSet));
 }
 #endif
 
@@ -1578,6 +1608,90 @@ static void tcg_reg_free(TCGContext *s, int reg)
     }
 }
 
+/* number of ops examined when choosing a register to spill */
+#define TCG_SPILL_LOOKAHEAD 16
+
+/* Choose the register of 'regs' to spill.  Starting from the op being
+   allocated, look for the next read of each candidate's temporary and
+   take the one needed last; a value that is overwritten or not read
+   again in the window counts as needed last.  On a tie, prefer a value
+   that is already coherent with memory, which costs no store.  */
+static int tcg_reg_spill_choice(TCGContext *s, TCGRegSet regs)
+{
+    int dist[TCG_TARGET_NB_REGS];
+    int i, k, reg, left, nb_oargs, nb_iargs, score, best_reg, best_score;
+    int op_index;
+    TCGOpcode opc;
+    const TCGOpDef *def;
+    const TCGArg *args, *op_args;
+    TCGArg arg;
+    TCGTemp *ts;
+
+    left = 0;
+    for (reg = 0; reg < TCG_TARGET_NB_REGS; reg++) {
+        dist[reg] = -1;
+        if (tcg_regset_test_reg(regs, reg)) {
+            left++;
+        }
+    }
+
+    op_index = s->cur_op_index;
+    args = s->cur_args;
+    for (k = 0; k < TCG_SPILL_LOOKAHEAD && left > 0; k++, op_index++) {
+        opc = s->gen_opc_buf[op_index];
+        def = &tcg_op_defs[opc];
+        if (opc == INDEX_op_end) {
+            break;
+        } else if (opc == INDEX_op_nopn) {
+            args += args[0];
+            continue;
+        } else if (opc == INDEX_op_call) {
+            nb_oargs = args[0] >> 16;
+            nb_iargs = args[0] & 0xffff;
+            op_args = args + 1;
+            args += nb_oargs + nb_iargs + def->nb_cargs + 1;
+        } else {
+            nb_oargs = def->nb_oargs;
+            nb_iargs = def->nb_iargs;
+            op_args = args;
+            args += def->nb_args;
+        }
+        /* inputs first: an op may read and overwrite the same temp */
+        for (i = 0; i < nb_iargs + nb_oargs; i++) {
+            arg = op_args[i < nb_iargs ? nb_oargs + i : i - nb_iargs];
+            if (arg == TCG_CALL_DUMMY_ARG) {
+                continue;
+            }
+            ts = &s->temps[arg];
+            if (ts->val_type != TEMP_VAL_REG || ts->fixed_reg ||
+                !tcg_regset_test_reg(regs, ts->reg) || dist[ts->reg] >= 0) {
+                continue;
+            }
+            dist[ts->reg] = i < nb_iargs ? k : TCG_SPILL_LOOKAHEAD;
+            left--;
+        }
+        if (def->flags & TCG_OPF_BB_END) {
+            break;
+        }
+    }
+
+    best_reg = -1;
+    best_score = -1;
+    for (i = 0; i < ARRAY_SIZE(tcg_target_reg_alloc_order); i++) {
+        reg = tcg_target_reg_alloc_order[i];
+        if (!tcg_regset_test_reg(regs, reg)) {
+            continue;
+        }
+        score = dist[reg] < 0 ? TCG_SPILL_LOOKAHEAD : dist[reg];
+        score = score * 2 + s->temps[s->reg_to_temp[reg]].mem_coherent;
+        if (score > best_score) {
+            best_reg = reg;
+            best_score = score;
+        }
+    }
+    return best_reg;
+}
+
 /* Allocate a register belonging to reg1 & ~reg2 */
 static int tcg_reg_alloc(TCGContext *s, TCGRegSet reg1, TCGRegSet reg2)
 {
@@ -1593,16 +1707,31 @@ static int tcg_reg_alloc(TCGContext *s, TCGRegSet reg1, TCGRegSet reg2)
             return reg;
     }
 
-    /* XXX: do better spill choice */
-    for(i = 0; i < ARRAY_SIZE(tcg_target_reg_alloc_order); i++) {
+    reg = tcg_reg_spill_choice(s, reg_ct);
+    if (reg < 0) {
+        tcg_abort();
+    }
+    tcg_reg_free(s, reg);
+    return reg;
+}
+
+/* Allocate a register belonging to reg1 & ~reg2, preferring a free one
+   among 'hint' so that a later op finds the value where it wants it. */
+static int tcg_reg_alloc_hint(TCGContext *s, TCGRegSet reg1, TCGRegSet reg2,
+                              TCGRegSet hint)
+{
+    int i, reg;
+    TCGRegSet reg_ct;
+
+    tcg_regset_andnot(reg_ct, reg1, reg2);
+    tcg_regset_and(reg_ct, reg_ct, hint);
+    for (i = 0; i < ARRAY_SIZE(tcg_target_reg_alloc_order); i++) {
         reg = tcg_target_reg_alloc_order[i];
-        if (tcg_regset_test_reg(reg_ct, reg)) {
-            tcg_reg_free(s, reg);
+        if (tcg_regset_test_reg(reg_ct, reg) && s->reg_to_temp[reg] == -1) {
             return reg;
         }
     }
-
-    tcg_abort();
+    return tcg_reg_alloc(s, reg1, reg2);
 }
 
 /* mark a temporary as dead. */
@@ -1819,7 +1948,9 @@ static void tcg_reg_alloc_mov(TCGContext *s, const TCGOpDef *def,
                 /* When allocating a new register, make sure to not spill the
                    input one. */
                 tcg_regset_set_reg(allocated_regs, ts->reg);
-                ots->reg = tcg_reg_alloc(s, oarg_ct->u.regs, allocated_regs);
+                ots->reg = tcg_reg_alloc_hint(s, oarg_ct->u.regs,
+                                              allocated_regs,
+                                              s->op_out_hint[s->cur_op_index]);
             }
             tcg_out_mov(s, ots->type, ots->reg, ts->reg);
         }
@@ -1955,7 +2086,12 @@ static void tcg_reg_alloc_op(TCGContext *s,
                     tcg_regset_test_reg(arg_ct->u.regs, reg)) {
                     goto oarg_end;
                 }
-                reg = tcg_reg_alloc(s, arg_ct->u.regs, allocated_regs);
+                if (i == 0) {
+                    reg = tcg_reg_alloc_hint(s, arg_ct->u.regs, allocated_regs,
+                                             s->op_out_hint[s->cur_op_index]);
+                } else {
+                    reg = tcg_reg_alloc(s, arg_ct->u.regs, allocated_regs);
+                }
             }
             tcg_regset_set_reg(allocated_regs, reg);
             /* if a fixed register is used, then a move will be done afterwards */
@@ -2073,7 +2209,10 @@ static int tcg_reg_alloc_call(TCGContext *s, const TCGOpDef *def,
         if (arg != TCG_CALL_DUMMY_ARG) {
             ts = &s->temps[arg];
             reg = tcg_target_call_iarg_regs[i];
-            tcg_reg_free(s, reg);
+            /* the value may already be where the helper wants it */
+            if (ts->val_type != TEMP_VAL_REG || ts->reg != reg) {
+                tcg_reg_free(s, reg);
+            }
             if (ts->val_type == TEMP_VAL_REG) {
                 if (ts->reg != reg) {
                     tcg_out_mov(s, ts->type, reg, ts->reg);
@@ -2245,6 +2384,9 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
 
     s->code_buf = gen_code_buf;
     s->code_ptr = gen_code_buf;
+#ifdef TCG_TARGET_HAS_EXT_RELOCS
+    s->nb_ext_relocs = 0;
+#endif
 
     args = s->gen_opparam_buf;
     op_index = 0;
@@ -2255,6 +2397,8 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
         tcg_table_op_count[opc]++;
 #endif
         def = &tcg_op_defs[opc];
+        s->cur_op_index = op_index;
+        s->cur_args = args;
 #if 0
         printf("%s: %d %d %d\n", def->name,
                def->nb_oargs, def->nb_iargs, def->nb_cargs);
@@ -78,6 +78,7 @@ typedef uint64_t TCGRegSet;
 #define TCG_TARGET_HAS_eqv_i64          0
 #define TCG_TARGET_HAS_nand_i64         0
 #define TCG_TARGET_HAS_nor_i64          0
+#define TCG_TARGET_HAS_clz_i64          0
 #define TCG_TARGET_HAS_deposit_i64      0
 #define TCG_TARGET_HAS_movcond_i64      0
 #endif
@@ -206,6 +207,29 @@ typedef struct TCGLabelQemuLdst {
 } TCGLabelQemuLdst;
 #endif
 
+#ifdef TCG_TARGET_HAS_EXT_RELOCS
+/* References from generated code to host addresses outside the TB.
+   Backends that define TCG_TARGET_HAS_EXT_RELOCS record them so that
+   a TB can be copied to a different place in the code buffer.  */
+#define TCG_MAX_EXT_RELOCS      1024
+
+typedef enum TCGExtRelocType {
+    TCG_EXT_RELOC_PCREL32,      /* 32-bit displacement to 'value' */
+    TCG_EXT_RELOC_FAR_BRANCH,   /* absolute branch to 'value', emitted
+                                   because it was out of PCREL32 range */
+    TCG_EXT_RELOC_TB_IMM32U,    /* exit_tb immediate, zero-extended */
+    TCG_EXT_RELOC_TB_IMM32S,    /* exit_tb immediate, sign-extended */
+    TCG_EXT_RELOC_TB_IMM64,     /* exit_tb immediate, 64-bit */
+} TCGExtRelocType;
+
+typedef struct TCGExtReloc {
+    uint16_t offset;            /* offset of the field (or of the far
+                                   branch) from the start of the TB */
+    uint8_t type;               /* TCGExtRelocType */
+    tcg_target_long value;
+} TCGExtReloc;
+#endif
+
 #ifdef CONFIG_DEBUG_TCG
 #define DEBUG_TCGV 1
 #endif
@@ -402,16 +426,30 @@ struct TCGContext {
     uint16_t *tb_next_offset;
     uint16_t *tb_jmp_offset; /* != NULL if USE_DIRECT_JUMP */
 
+    /* set by frontends when the ops embed a host pointer that is only
+       valid in this process, see tcg_mark_host_ptr() */
+    bool host_ptr_used;
+#ifdef TCG_TARGET_HAS_EXT_RELOCS
+    /* -1 if the TB had more than TCG_MAX_EXT_RELOCS */
+    int nb_ext_relocs;
+    TCGExtReloc ext_relocs[TCG_MAX_EXT_RELOCS];
+#endif
+
     /* liveness analysis */
     uint16_t *op_dead_args; /* for each operation, each bit tells if the
                                corresponding argument is dead */
     uint8_t *op_sync_args;  /* for each operation, each bit tells if the
                                corresponding output argument needs to be
                                sync to memory. */
+    TCGRegSet *op_out_hint; /* for each operation, registers in which its
+                               first output is wanted by a later op */
     
     /* tells in which temporary a given register is. It does not take
        into account fixed registers */
     int reg_to_temp[TCG_TARGET_NB_REGS];
+    /* operation being allocated, for the spill choice lookahead */
+    int cur_op_index;
+    const TCGArg *cur_args;
     TCGRegSet reserved_regs;
     tcg_target_long current_frame_offset;
     tcg_target_long frame_start;
@@ -466,6 +504,12 @@ struct TCGContext {
 
 extern TCGContext tcg_ctx;
 
+/* The TB being generated cannot be reused by another process.  */
+static inline void tcg_mark_host_ptr(TCGContext *s)
+{
+    s->host_ptr_used = true;
+}
+
 /* pool based memory allocation */
 
 void *tcg_malloc_internal(TCGContext *s, int size);
@@ -653,6 +697,8 @@ TCGv_i32 tcg_const_local_i32(int32_t val);
 TCGv_i64 tcg_const_local_i64(int64_t val);
 
 extern uint8_t *code_gen_prologue;
+/* set by backends with TCG_TARGET_HAS_goto_ptr; same as exit_tb(0) */
+extern uint8_t *code_gen_epilogue;
 
 /* TCG targets may use a different definition of tcg_qemu_tb_exec. */
 #if !defined(tcg_qemu_tb_exec)
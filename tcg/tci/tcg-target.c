@@ -498,6 +498,191 @@ static void tci_out_label(TCGContext *s, TCGArg arg)
     }
 }
 
+/* Start of the last two ops which were written, used to form
+   superinstructions.  The most recent op is in tci_prev_op[0]. */
+static uint8_t *tci_prev_op[2];
+
+/* Test whether op PREV immediately precedes NEXT in the current TB. */
+static bool tci_op_precedes(TCGContext *s, uint8_t *prev, uint8_t *next)
+{
+    return prev != NULL && prev >= s->code_buf && prev + prev[1] == next;
+}
+
+/* Test whether some label points between START and END (exclusive). */
+static bool tci_has_label(TCGContext *s, uint8_t *start, uint8_t *end)
+{
+    int i;
+
+    for (i = 0; i < s->nb_labels; i++) {
+        TCGLabel *l = &s->labels[i];
+        if (l->has_value && l->u.value > (tcg_target_long)start
+            && l->u.value < (tcg_target_long)end) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Fuse "ld r, base, ofs; op r, r, ri; st r, base, ofs" into a single
+   tci_ld_<op>_st op.  Returns the start of the fused op or NULL. */
+static uint8_t *tci_fuse_ld_op_st(TCGContext *s, uint8_t *st)
+{
+    uint8_t *ld = tci_prev_op[1];
+    uint8_t *op = tci_prev_op[0];
+    TCGOpcode fused;
+    bool is64 = false;
+
+    if (!tci_op_precedes(s, ld, op) || !tci_op_precedes(s, op, st)) {
+        return NULL;
+    }
+
+    switch (op[0]) {
+    case INDEX_op_add_i32:
+        fused = INDEX_op_tci_ld_add_st_i32;
+        break;
+    case INDEX_op_sub_i32:
+        fused = INDEX_op_tci_ld_sub_st_i32;
+        break;
+    case INDEX_op_and_i32:
+        fused = INDEX_op_tci_ld_and_st_i32;
+        break;
+    case INDEX_op_or_i32:
+        fused = INDEX_op_tci_ld_or_st_i32;
+        break;
+    case INDEX_op_xor_i32:
+        fused = INDEX_op_tci_ld_xor_st_i32;
+        break;
+#if TCG_TARGET_REG_BITS == 64
+    case INDEX_op_add_i64:
+        fused = INDEX_op_tci_ld_add_st_i64;
+        is64 = true;
+        break;
+    case INDEX_op_sub_i64:
+        fused = INDEX_op_tci_ld_sub_st_i64;
+        is64 = true;
+        break;
+    case INDEX_op_and_i64:
+        fused = INDEX_op_tci_ld_and_st_i64;
+        is64 = true;
+        break;
+    case INDEX_op_or_i64:
+        fused = INDEX_op_tci_ld_or_st_i64;
+        is64 = true;
+        break;
+    case INDEX_op_xor_i64:
+        fused = INDEX_op_tci_ld_xor_st_i64;
+        is64 = true;
+        break;
+#endif
+    default:
+        return NULL;
+    }
+    if (ld[0] != (is64 ? INDEX_op_ld_i64 : INDEX_op_ld_i32)
+        || st[0] != (is64 ? INDEX_op_st_i64 : INDEX_op_st_i32)) {
+        return NULL;
+    }
+
+    /* The ld and st must access the same memory through the same register,
+       and the op must modify the loaded value in place.  ld and st are
+       opcode, size, register, base and a 32 bit offset (8 bytes); op is
+       opcode, size, output, two inputs.  */
+    if (ld[2] == ld[3] || st[2] != ld[2] || st[3] != ld[3]
+        || memcmp(st + 4, ld + 4, 4) != 0
+        || op[2] != ld[2] || op[3] != ld[2] || op[4] == ld[2]) {
+        return NULL;
+    }
+    if (tci_has_label(s, ld, s->code_ptr)) {
+        return NULL;
+    }
+
+    /* Keep the register, base and offset of the ld and append the second
+       input of the op.  The fused op keeps the size of the three ops that
+       it replaces, so that code offsets within the TB do not change. */
+    assert(op == ld + 8);
+    memmove(op, op + 4, op[1] - 4);
+    ld[0] = fused;
+    ld[1] = s->code_ptr - ld;
+    return ld;
+}
+
+/* Fuse "setcond t, a, b, cond; brcond t, $0, eq/ne, label" into
+   tci_setcond_brcond.  Returns the start of the fused op or NULL. */
+static uint8_t *tci_fuse_setcond_brcond(TCGContext *s, uint8_t *br)
+{
+    uint8_t *set = tci_prev_op[0];
+    uint64_t zero;
+    size_t len;
+
+    if (!tci_op_precedes(s, set, br)) {
+        return NULL;
+    }
+    if (set[0] == INDEX_op_setcond_i32 && br[0] == INDEX_op_brcond_i32) {
+        len = 4;
+        zero = *(uint32_t *)(br + 4);
+#if TCG_TARGET_REG_BITS == 64
+    } else if (set[0] == INDEX_op_setcond_i64
+               && br[0] == INDEX_op_brcond_i64) {
+        len = 8;
+        zero = *(uint64_t *)(br + 4);
+#endif
+    } else {
+        return NULL;
+    }
+
+    /* brcond is opcode, size, register, constant tag, constant,
+       condition and label. */
+    if (br[2] != set[2] || br[3] != TCG_CONST || zero != 0
+        || (br[4 + len] != TCG_COND_EQ && br[4 + len] != TCG_COND_NE)) {
+        return NULL;
+    }
+    if (tci_has_label(s, set, s->code_ptr)) {
+        return NULL;
+    }
+
+    /* Keep the setcond and append the value of the setcond result for
+       which the branch is taken.  The label stays at the end of the op. */
+    br[0] = br[4 + len] == TCG_COND_NE;
+    set[0] = (len == 4 ? INDEX_op_tci_setcond_brcond_i32
+              : INDEX_op_tci_setcond_brcond_i64);
+    set[1] = s->code_ptr - set;
+    return set;
+}
+
+/* Finish the op which starts at OLD_CODE_PTR: write its size and try to
+   fuse it with the ops in front of it. */
+static void tci_out_end(TCGContext *s, uint8_t *old_code_ptr)
+{
+    uint8_t *fused = NULL;
+
+    old_code_ptr[1] = s->code_ptr - old_code_ptr;
+
+    switch (old_code_ptr[0]) {
+    case INDEX_op_st_i32:
+#if TCG_TARGET_REG_BITS == 64
+    case INDEX_op_st_i64:
+#endif
+        fused = tci_fuse_ld_op_st(s, old_code_ptr);
+        break;
+    case INDEX_op_brcond_i32:
+#if TCG_TARGET_REG_BITS == 64
+    case INDEX_op_brcond_i64:
+#endif
+        fused = tci_fuse_setcond_brcond(s, old_code_ptr);
+        break;
+    default:
+        break;
+    }
+
+    if (fused) {
+        /* The ops which were merged into FUSED are gone. */
+        tci_prev_op[1] = NULL;
+        tci_prev_op[0] = fused;
+    } else {
+        tci_prev_op[1] = tci_prev_op[0];
+        tci_prev_op[0] = old_code_ptr;
+    }
+}
+
 static void tcg_out_ld(TCGContext *s, TCGType type, TCGReg ret, TCGReg arg1,
                        tcg_target_long arg2)
 {
@@ -519,7 +704,7 @@ static void tcg_out_ld(TCGContext *s, TCGType type, TCGReg ret, TCGReg arg1,
         TODO();
 #endif
     }
-    old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    tci_out_end(s, old_code_ptr);
 }
 
 static void tcg_out_mov(TCGContext *s, TCGType type, TCGReg ret, TCGReg arg)
@@ -533,7 +718,7 @@ static void tcg_out_mov(TCGContext *s, TCGType type, TCGReg ret, TCGReg arg)
 #endif
     tcg_out_r(s, ret);
     tcg_out_r(s, arg);
-    old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    tci_out_end(s, old_code_ptr);
 }
 
 static void tcg_out_movi(TCGContext *s, TCGType type,
@@ -555,7 +740,7 @@ static void tcg_out_movi(TCGContext *s, TCGType type,
         TODO();
 #endif
     }
-    old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    tci_out_end(s, old_code_ptr);
 }
 
 static void tcg_out_op(TCGContext *s, TCGOpcode opc, const TCGArg *args,
@@ -849,7 +1034,7 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc, const TCGArg *args,
         fprintf(stderr, "Missing: %s\n", tcg_op_defs[opc].name);
         tcg_abort();
     }
-    old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    tci_out_end(s, old_code_ptr);
 }
 
 static void tcg_out_st(TCGContext *s, TCGType type, TCGReg arg, TCGReg arg1,
@@ -872,7 +1057,7 @@ static void tcg_out_st(TCGContext *s, TCGType type, TCGReg arg, TCGReg arg1,
         TODO();
 #endif
     }
-    old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    tci_out_end(s, old_code_ptr);
 }
 
 /* Test if a constant matches the constraint. */
@@ -429,44 +429,167 @@ static bool tci_compare64(uint64_t u0, uint64_t u1, TCGCond condition)
     return result;
 }
 
+/* With GCC, the frequent opcodes are dispatched through a table of label
+   addresses, and each of them jumps directly to the code of the next op
+   (direct threading).  This avoids the range check of the switch and gives
+   the host branch predictor one indirect branch per opcode instead of a
+   single one for all of them.  The other opcodes go through the switch. */
+#if defined(__GNUC__)
+# define TCI_THREADED
+#endif
+
+/* Start the op at tb_ptr: fetch its opcode and skip the opcode and size
+   entry. */
+#if defined(GETPC)
+# define TCI_FETCH_TB_PTR() (tci_tb_ptr = (uintptr_t)tb_ptr)
+#else
+# define TCI_FETCH_TB_PTR() ((void)0)
+#endif
+#if !defined(NDEBUG)
+# define TCI_FETCH_SIZE() (op_size = tb_ptr[1], old_code_ptr = tb_ptr)
+#else
+# define TCI_FETCH_SIZE() ((void)0)
+#endif
+#define TCI_FETCH() \
+    do { \
+        TCI_FETCH_TB_PTR(); \
+        opc = tb_ptr[0]; \
+        TCI_FETCH_SIZE(); \
+        tb_ptr += 2; \
+    } while (0)
+
+/* TCI_CASE starts the code of an opcode which is listed in the dispatch
+   table; such code ends with TCI_NEXT (continue with the following op) or
+   TCI_JUMP (continue at tb_ptr after a branch). */
+#if defined(TCI_THREADED)
+# define TCI_CASE(name) case INDEX_op_##name: do_##name
+# define TCI_NEXT() \
+    do { \
+        assert(tb_ptr == old_code_ptr + op_size); \
+        TCI_FETCH(); \
+        goto *dispatch[opc]; \
+    } while (0)
+# define TCI_JUMP() \
+    do { \
+        TCI_FETCH(); \
+        goto *dispatch[opc]; \
+    } while (0)
+#else
+# define TCI_CASE(name) case INDEX_op_##name
+# define TCI_NEXT() break
+# define TCI_JUMP() continue
+#endif
+
 /* Interpret pseudo code in tb. */
 tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
 {
-    tcg_target_ulong next_tb = 0;
-
-    env = cpustate;
-    tci_reg[TCG_AREG0] = (tcg_target_ulong)env;
-    assert(tb_ptr);
-
-    for (;;) {
-#if defined(GETPC)
-        tci_tb_ptr = (uintptr_t)tb_ptr;
+#if defined(TCI_THREADED)
+    static const void *const dispatch[NB_OPS] = {
+        [0 ... NB_OPS - 1] = &&do_switch,
+        [INDEX_op_call] = &&do_call,
+        [INDEX_op_br] = &&do_br,
+        [INDEX_op_setcond_i32] = &&do_setcond_i32,
+        [INDEX_op_mov_i32] = &&do_mov_i32,
+        [INDEX_op_movi_i32] = &&do_movi_i32,
+        [INDEX_op_ld8u_i32] = &&do_ld8u_i32,
+        [INDEX_op_ld_i32] = &&do_ld_i32,
+        [INDEX_op_st8_i32] = &&do_st8_i32,
+        [INDEX_op_st16_i32] = &&do_st16_i32,
+        [INDEX_op_st_i32] = &&do_st_i32,
+        [INDEX_op_add_i32] = &&do_add_i32,
+        [INDEX_op_sub_i32] = &&do_sub_i32,
+        [INDEX_op_mul_i32] = &&do_mul_i32,
+        [INDEX_op_and_i32] = &&do_and_i32,
+        [INDEX_op_or_i32] = &&do_or_i32,
+        [INDEX_op_xor_i32] = &&do_xor_i32,
+        [INDEX_op_shl_i32] = &&do_shl_i32,
+        [INDEX_op_shr_i32] = &&do_shr_i32,
+        [INDEX_op_sar_i32] = &&do_sar_i32,
+        [INDEX_op_brcond_i32] = &&do_brcond_i32,
+        [INDEX_op_tci_ld_add_st_i32] = &&do_tci_ld_add_st_i32,
+        [INDEX_op_tci_ld_sub_st_i32] = &&do_tci_ld_sub_st_i32,
+        [INDEX_op_tci_ld_and_st_i32] = &&do_tci_ld_and_st_i32,
+        [INDEX_op_tci_ld_or_st_i32] = &&do_tci_ld_or_st_i32,
+        [INDEX_op_tci_ld_xor_st_i32] = &&do_tci_ld_xor_st_i32,
+        [INDEX_op_tci_setcond_brcond_i32] = &&do_tci_setcond_brcond_i32,
+#if TCG_TARGET_REG_BITS == 64
+        [INDEX_op_setcond_i64] = &&do_setcond_i64,
+        [INDEX_op_mov_i64] = &&do_mov_i64,
+        [INDEX_op_movi_i64] = &&do_movi_i64,
+        [INDEX_op_ld8u_i64] = &&do_ld8u_i64,
+        [INDEX_op_ld32u_i64] = &&do_ld32u_i64,
+        [INDEX_op_ld32s_i64] = &&do_ld32s_i64,
+        [INDEX_op_ld_i64] = &&do_ld_i64,
+        [INDEX_op_st8_i64] = &&do_st8_i64,
+        [INDEX_op_st16_i64] = &&do_st16_i64,
+        [INDEX_op_st32_i64] = &&do_st32_i64,
+        [INDEX_op_st_i64] = &&do_st_i64,
+        [INDEX_op_add_i64] = &&do_add_i64,
+        [INDEX_op_sub_i64] = &&do_sub_i64,
+        [INDEX_op_mul_i64] = &&do_mul_i64,
+        [INDEX_op_and_i64] = &&do_and_i64,
+        [INDEX_op_or_i64] = &&do_or_i64,
+        [INDEX_op_xor_i64] = &&do_xor_i64,
+        [INDEX_op_shl_i64] = &&do_shl_i64,
+        [INDEX_op_shr_i64] = &&do_shr_i64,
+        [INDEX_op_sar_i64] = &&do_sar_i64,
+        [INDEX_op_brcond_i64] = &&do_brcond_i64,
+        [INDEX_op_tci_ld_add_st_i64] = &&do_tci_ld_add_st_i64,
+        [INDEX_op_tci_ld_sub_st_i64] = &&do_tci_ld_sub_st_i64,
+        [INDEX_op_tci_ld_and_st_i64] = &&do_tci_ld_and_st_i64,
+        [INDEX_op_tci_ld_or_st_i64] = &&do_tci_ld_or_st_i64,
+        [INDEX_op_tci_ld_xor_st_i64] = &&do_tci_ld_xor_st_i64,
+        [INDEX_op_tci_setcond_brcond_i64] = &&do_tci_setcond_brcond_i64,
+        [INDEX_op_qemu_ld32u] = &&do_qemu_ld32u,
+        [INDEX_op_qemu_ld32s] = &&do_qemu_ld32s,
+#endif
+        [INDEX_op_exit_tb] = &&do_exit_tb,
+        [INDEX_op_goto_tb] = &&do_goto_tb,
+        [INDEX_op_qemu_ld8u] = &&do_qemu_ld8u,
+        [INDEX_op_qemu_ld8s] = &&do_qemu_ld8s,
+        [INDEX_op_qemu_ld16u] = &&do_qemu_ld16u,
+        [INDEX_op_qemu_ld16s] = &&do_qemu_ld16s,
+        [INDEX_op_qemu_ld32] = &&do_qemu_ld32,
+        [INDEX_op_qemu_ld64] = &&do_qemu_ld64,
+        [INDEX_op_qemu_st8] = &&do_qemu_st8,
+        [INDEX_op_qemu_st16] = &&do_qemu_st16,
+        [INDEX_op_qemu_st32] = &&do_qemu_st32,
+        [INDEX_op_qemu_st64] = &&do_qemu_st64,
+    };
 #endif
-        TCGOpcode opc = tb_ptr[0];
+    tcg_target_ulong next_tb = 0;
+    TCGOpcode opc;
 #if !defined(NDEBUG)
-        uint8_t op_size = tb_ptr[1];
-        uint8_t *old_code_ptr = tb_ptr;
-#endif
-        tcg_target_ulong t0;
-        tcg_target_ulong t1;
-        tcg_target_ulong t2;
-        tcg_target_ulong label;
-        TCGCond condition;
-        target_ulong taddr;
+    uint8_t op_size;
+    uint8_t *old_code_ptr;
+#endif
+    uint8_t *next_op;
+    tcg_target_ulong t0;
+    tcg_target_ulong t1;
+    tcg_target_ulong t2;
+    tcg_target_ulong label;
+    TCGCond condition;
+    target_ulong taddr;
 #ifndef CONFIG_SOFTMMU
-        tcg_target_ulong host_addr;
+    tcg_target_ulong host_addr;
 #endif
-        uint8_t tmp8;
-        uint16_t tmp16;
-        uint32_t tmp32;
-        uint64_t tmp64;
+    uint8_t tmp8;
+    uint16_t tmp16;
+    uint32_t tmp32;
+    uint64_t tmp64;
 #if TCG_TARGET_REG_BITS == 32
-        uint64_t v64;
+    uint64_t v64;
 #endif
 
-        /* Skip opcode and size entry. */
-        tb_ptr += 2;
+    env = cpustate;
+    tci_reg[TCG_AREG0] = (tcg_target_ulong)env;
+    assert(tb_ptr);
 
+    for (;;) {
+        TCI_FETCH();
+#if defined(TCI_THREADED)
+    do_switch:
+#endif
         switch (opc) {
         case INDEX_op_end:
         case INDEX_op_nop:
@@ -481,7 +604,7 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
         case INDEX_op_set_label:
             TODO();
             break;
-        case INDEX_op_call:
+        TCI_CASE(call):
             t0 = tci_read_ri(&tb_ptr);
 #if TCG_TARGET_REG_BITS == 32
             tmp64 = ((helper_function)t0)(tci_read_reg(TCG_REG_R0),
@@ -504,19 +627,19 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
                                           tci_read_reg(TCG_REG_R5));
             tci_write_reg(TCG_REG_R0, tmp64);
 #endif
-            break;
-        case INDEX_op_br:
+            TCI_NEXT();
+        TCI_CASE(br):
             label = tci_read_label(&tb_ptr);
             assert(tb_ptr == old_code_ptr + op_size);
             tb_ptr = (uint8_t *)label;
-            continue;
-        case INDEX_op_setcond_i32:
+            TCI_JUMP();
+        TCI_CASE(setcond_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             condition = *tb_ptr++;
             tci_write_reg32(t0, tci_compare32(t1, t2, condition));
-            break;
+            TCI_NEXT();
 #if TCG_TARGET_REG_BITS == 32
         case INDEX_op_setcond2_i32:
             t0 = *tb_ptr++;
@@ -526,33 +649,33 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             tci_write_reg32(t0, tci_compare64(tmp64, v64, condition));
             break;
 #elif TCG_TARGET_REG_BITS == 64
-        case INDEX_op_setcond_i64:
+        TCI_CASE(setcond_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             condition = *tb_ptr++;
             tci_write_reg64(t0, tci_compare64(t1, t2, condition));
-            break;
+            TCI_NEXT();
 #endif
-        case INDEX_op_mov_i32:
+        TCI_CASE(mov_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             tci_write_reg32(t0, t1);
-            break;
-        case INDEX_op_movi_i32:
+            TCI_NEXT();
+        TCI_CASE(movi_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_i32(&tb_ptr);
             tci_write_reg32(t0, t1);
-            break;
+            TCI_NEXT();
 
             /* Load/store operations (32 bit). */
 
-        case INDEX_op_ld8u_i32:
+        TCI_CASE(ld8u_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_i32(&tb_ptr);
             tci_write_reg8(t0, *(uint8_t *)(t1 + t2));
-            break;
+            TCI_NEXT();
         case INDEX_op_ld8s_i32:
         case INDEX_op_ld16u_i32:
             TODO();
@@ -560,51 +683,51 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
         case INDEX_op_ld16s_i32:
             TODO();
             break;
-        case INDEX_op_ld_i32:
+        TCI_CASE(ld_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_i32(&tb_ptr);
             tci_write_reg32(t0, *(uint32_t *)(t1 + t2));
-            break;
-        case INDEX_op_st8_i32:
+            TCI_NEXT();
+        TCI_CASE(st8_i32):
             t0 = tci_read_r8(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_i32(&tb_ptr);
             *(uint8_t *)(t1 + t2) = t0;
-            break;
-        case INDEX_op_st16_i32:
+            TCI_NEXT();
+        TCI_CASE(st16_i32):
             t0 = tci_read_r16(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_i32(&tb_ptr);
             *(uint16_t *)(t1 + t2) = t0;
-            break;
-        case INDEX_op_st_i32:
+            TCI_NEXT();
+        TCI_CASE(st_i32):
             t0 = tci_read_r32(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_i32(&tb_ptr);
             *(uint32_t *)(t1 + t2) = t0;
-            break;
+            TCI_NEXT();
 
             /* Arithmetic operations (32 bit). */
 
-        case INDEX_op_add_i32:
+        TCI_CASE(add_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 + t2);
-            break;
-        case INDEX_op_sub_i32:
+            TCI_NEXT();
+        TCI_CASE(sub_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 - t2);
-            break;
-        case INDEX_op_mul_i32:
+            TCI_NEXT();
+        TCI_CASE(mul_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 * t2);
-            break;
+            TCI_NEXT();
 #if TCG_TARGET_HAS_div_i32
         case INDEX_op_div_i32:
             t0 = *tb_ptr++;
@@ -636,45 +759,45 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             TODO();
             break;
 #endif
-        case INDEX_op_and_i32:
+        TCI_CASE(and_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 & t2);
-            break;
-        case INDEX_op_or_i32:
+            TCI_NEXT();
+        TCI_CASE(or_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 | t2);
-            break;
-        case INDEX_op_xor_i32:
+            TCI_NEXT();
+        TCI_CASE(xor_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 ^ t2);
-            break;
+            TCI_NEXT();
 
             /* Shift/rotate operations (32 bit). */
 
-        case INDEX_op_shl_i32:
+        TCI_CASE(shl_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 << t2);
-            break;
-        case INDEX_op_shr_i32:
+            TCI_NEXT();
+        TCI_CASE(shr_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, t1 >> t2);
-            break;
-        case INDEX_op_sar_i32:
+            TCI_NEXT();
+        TCI_CASE(sar_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_ri32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             tci_write_reg32(t0, ((int32_t)t1 >> t2));
-            break;
+            TCI_NEXT();
 #if TCG_TARGET_HAS_rot_i32
         case INDEX_op_rotl_i32:
             t0 = *tb_ptr++;
@@ -700,7 +823,7 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             tci_write_reg32(t0, (t1 & ~tmp32) | ((t2 << tmp16) & tmp32));
             break;
 #endif
-        case INDEX_op_brcond_i32:
+        TCI_CASE(brcond_i32):
             t0 = tci_read_r32(&tb_ptr);
             t1 = tci_read_ri32(&tb_ptr);
             condition = *tb_ptr++;
@@ -708,9 +831,79 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             if (tci_compare32(t0, t1, condition)) {
                 assert(tb_ptr == old_code_ptr + op_size);
                 tb_ptr = (uint8_t *)label;
-                continue;
+                TCI_JUMP();
             }
-            break;
+            TCI_NEXT();
+
+            /* Superinstructions (32 bit), see tcg/tci/tcg-target.c.  The
+               size entry also covers the ops which were merged into them. */
+
+        TCI_CASE(tci_ld_add_st_i32):
+            next_op = tb_ptr - 2 + tb_ptr[-1];
+            t0 = *tb_ptr++;
+            t1 = tci_read_r(&tb_ptr);
+            t2 = tci_read_i32(&tb_ptr);
+            tmp32 = *(uint32_t *)(t1 + t2) + tci_read_ri32(&tb_ptr);
+            *(uint32_t *)(t1 + t2) = tmp32;
+            tci_write_reg32(t0, tmp32);
+            tb_ptr = next_op;
+            TCI_NEXT();
+        TCI_CASE(tci_ld_sub_st_i32):
+            next_op = tb_ptr - 2 + tb_ptr[-1];
+            t0 = *tb_ptr++;
+            t1 = tci_read_r(&tb_ptr);
+            t2 = tci_read_i32(&tb_ptr);
+            tmp32 = *(uint32_t *)(t1 + t2) - tci_read_ri32(&tb_ptr);
+            *(uint32_t *)(t1 + t2) = tmp32;
+            tci_write_reg32(t0, tmp32);
+            tb_ptr = next_op;
+            TCI_NEXT();
+        TCI_CASE(tci_ld_and_st_i32):
+            next_op = tb_ptr - 2 + tb_ptr[-1];
+            t0 = *tb_ptr++;
+            t1 = tci_read_r(&tb_ptr);
+            t2 = tci_read_i32(&tb_ptr);
+            tmp32 = *(uint32_t *)(t1 + t2) & tci_read_ri32(&tb_ptr);
+            *(uint32_t *)(t1 + t2) = tmp32;
+            tci_write_reg32(t0, tmp32);
+            tb_ptr = next_op;
+            TCI_NEXT();
+        TCI_CASE(tci_ld_or_st_i32):
+            next_op = tb_ptr - 2 + tb_ptr[-1];
+            t0 = *tb_ptr++;
+            t1 = tci_read_r(&tb_ptr);
+            t2 = tci_read_i32(&tb_ptr);
+            tmp32 = *(uint32_t *)(t1 + t2) | tci_read_ri32(&tb_ptr);
+            *(uint32_t *)(t1 + t2) = tmp32;
+            tci_write_reg32(t0, tmp32);
+            tb_ptr = next_op;
+            TCI_NEXT();
+        TCI_CASE(tci_ld_xor_st_i32):
+            next_op = tb_ptr - 2 + tb_ptr[-1];
+            t0 = *tb_ptr++;
+            t1 = tci_read_r(&tb_ptr);
+            t2 = tci_read_i32(&tb_ptr);
+            tmp32 = *(uint32_t *)(t1 + t2) ^ tci_read_ri32(&tb_ptr);
+            *(uint32_t *)(t1 + t2) = tmp32;
+            tci_write_reg32(t0, tmp32);
+            tb_ptr = next_op;
+            TCI_NEXT();
+        TCI_CASE(tci_setcond_brcond_i32):
+            next_op = tb_ptr - 2 + tb_ptr[-1];
+            t0 = *tb_ptr++;
+            t1 = tci_read_r32(&tb_ptr);
+            t2 = tci_read_ri32(&tb_ptr);
+            condition = *tb_ptr++;
+            tmp8 = tci_compare32(t1, t2, condition);
+            tci_write_reg32(t0, tmp8);
+            if (tmp8 == *tb_ptr) {
+                tb_ptr = next_op - sizeof(tcg_target_ulong);
+                label = tci_read_label(&tb_ptr);
+                tb_ptr = (uint8_t *)label;
+                TCI_JUMP();
+            }
+            tb_ptr = next_op;
+            TCI_NEXT();
 #if TCG_TARGET_REG_BITS == 32
         case INDEX_op_add2_i32:
             t0 = *tb_ptr++;
@@ -802,93 +995,93 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             break;
 #endif
 #if TCG_TARGET_REG_BITS == 64
-        case INDEX_op_mov_i64:
+        TCI_CASE(mov_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
-        case INDEX_op_movi_i64:
+            TCI_NEXT();
+        TCI_CASE(movi_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_i64(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
+            TCI_NEXT();
 
             /* Load/store operations (64 bit). */
 
-        case INDEX_op_ld8u_i64:
+        TCI_CASE(ld8u_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_i32(&tb_ptr);
             tci_write_reg8(t0, *(uint8_t *)(t1 + t2));
-            break;
+            TCI_NEXT();
         case INDEX_op_ld8s_i64:
         case INDEX_op_ld16u_i64:
         case INDEX_op_ld16s_i64:
             TODO();
             break;
-        case INDEX_op_ld32u_i64:
+        TCI_CASE(ld32u_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_i32(&tb_ptr);
             tci_write_reg32(t0, *(uint32_t *)(t1 + t2));
-            break;
-        case INDEX_op_ld32s_i64:
+            TCI_NEXT();
+        TCI_CASE(ld32s_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_i32(&tb_ptr);
             tci_write_reg32s(t0, *(int32_t *)(t1 + t2));
-            break;
-        case INDEX_op_ld_i64:
+            TCI_NEXT();
+        TCI_CASE(ld_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_i32(&tb_ptr);
             tci_write_reg64(t0, *(uint64_t *)(t1 + t2));
-            break;
-        case INDEX_op_st8_i64:
+            TCI_NEXT();
+        TCI_CASE(st8_i64):
             t0 = tci_read_r8(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_i32(&tb_ptr);
             *(uint8_t *)(t1 + t2) = t0;
-            break;
-        case INDEX_op_st16_i64:
+            TCI_NEXT();
+        TCI_CASE(st16_i64):
             t0 = tci_read_r16(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_i32(&tb_ptr);
             *(uint16_t *)(t1 + t2) = t0;
-            break;
-        case INDEX_op_st32_i64:
+            TCI_NEXT();
+        TCI_CASE(st32_i64):
             t0 = tci_read_r32(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_i32(&tb_ptr);
             *(uint32_t *)(t1 + t2) = t0;
-            break;
-        case INDEX_op_st_i64:
+            TCI_NEXT();
+        TCI_CASE(st_i64):
             t0 = tci_read_r64(&tb_ptr);
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_i32(&tb_ptr);
             *(uint64_t *)(t1 + t2) = t0;
-            break;
+            TCI_NEXT();
 
             /* Arithmetic operations (64 bit). */
 
-        case INDEX_op_add_i64:
+        TCI_CASE(add_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 + t2);
-            break;
-        case INDEX_op_sub_i64:
+            TCI_NEXT();
+        TCI_CASE(sub_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 - t2);
-            break;
-        case INDEX_op_mul_i64:
+            TCI_NEXT();
+        TCI_CASE(mul_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 * t2);
-            break;
+            TCI_NEXT();
 #if TCG_TARGET_HAS_div_i64
         case INDEX_op_div_i64:
         case INDEX_op_divu_i64:
@@ -902,45 +1095,45 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             TODO();
             break;
 #endif
-        case INDEX_op_and_i64:
+        TCI_CASE(and_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 & t2);
-            break;
-        case INDEX_op_or_i64:
+            TCI_NEXT();
+        TCI_CASE(or_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 | t2);
-            break;
-        case INDEX_op_xor_i64:
+            TCI_NEXT();
+        TCI_CASE(xor_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 ^ t2);
-            break;
+            TCI_NEXT();
 
             /* Shift/rotate operations (64 bit). */
 
-        case INDEX_op_shl_i64:
+        TCI_CASE(shl_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 << t2);
-            break;
-        case INDEX_op_shr_i64:
+            TCI_NEXT();
+        TCI_CASE(shr_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, t1 >> t2);
-            break;
-        case INDEX_op_sar_i64:
+            TCI_NEXT();
+        TCI_CASE(sar_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_ri64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             tci_write_reg64(t0, ((int64_t)t1 >> t2));
-            break;
+            TCI_NEXT();
 #if TCG_TARGET_HAS_rot_i64
         case INDEX_op_rotl_i64:
         case INDEX_op_rotr_i64:
@@ -958,7 +1151,7 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             tci_write_reg64(t0, (t1 & ~tmp64) | ((t2 << tmp16) & tmp64));
             break;
 #endif
-        case INDEX_op_brcond_i64:
+        TCI_CASE(brcond_i64):
             t0 = tci_read_r64(&tb_ptr);
             t1 = tci_read_ri64(&tb_ptr);
             condition = *tb_ptr++;
@@ -966,9 +1159,79 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             if (tci_compare64(t0, t1, condition)) {
                 assert(tb_ptr == old_code_ptr + op_size);
                 tb_ptr = (uint8_t *)label;
-                continue;
+                TCI_JUMP();
             }
-            break;
+            TCI_NEXT();
+
+            /* Superinstructions (64 bit), see tcg/tci/tcg-target.c.  The
+               size entry also covers the ops which were merged into them. */
+
+        TCI_CASE(tci_ld_add_st_i64):
+            next_op = tb_ptr - 2 + tb_ptr[-1];
+            t0 = *tb_ptr++;
+            t1 = tci_read_r(&tb_ptr);
+            t2 = tci_read_i32(&tb_ptr);
+            tmp64 = *(uint64_t *)(t1 + t2) + tci_read_ri64(&tb_ptr);
+            *(uint64_t *)(t1 + t2) = tmp64;
+            tci_write_reg64(t0, tmp64);
+            tb_ptr = next_op;
+            TCI_NEXT();
+        TCI_CASE(tci_ld_sub_st_i64):
+            next_op = tb_ptr - 2 + tb_ptr[-1];
+            t0 = *tb_ptr++;
+            t1 = tci_read_r(&tb_ptr);
+            t2 = tci_read_i32(&tb_ptr);
+            tmp64 = *(uint64_t *)(t1 + t2) - tci_read_ri64(&tb_ptr);
+            *(uint64_t *)(t1 + t2) = tmp64;
+            tci_write_reg64(t0, tmp64);
+            tb_ptr = next_op;
+            TCI_NEXT();
+        TCI_CASE(tci_ld_and_st_i64):
+            next_op = tb_ptr - 2 + tb_ptr[-1];
+            t0 = *tb_ptr++;
+            t1 = tci_read_r(&tb_ptr);
+            t2 = tci_read_i32(&tb_ptr);
+            tmp64 = *(uint64_t *)(t1 + t2) & tci_read_ri64(&tb_ptr);
+            *(uint64_t *)(t1 + t2) = tmp64;
+            tci_write_reg64(t0, tmp64);
+            tb_ptr = next_op;
+            TCI_NEXT();
+        TCI_CASE(tci_ld_or_st_i64):
+            next_op = tb_ptr - 2 + tb_ptr[-1];
+            t0 = *tb_ptr++;
+            t1 = tci_read_r(&tb_ptr);
+            t2 = tci_read_i32(&tb_ptr);
+            tmp64 = *(uint64_t *)(t1 + t2) | tci_read_ri64(&tb_ptr);
+            *(uint64_t *)(t1 + t2) = tmp64;
+            tci_write_reg64(t0, tmp64);
+            tb_ptr = next_op;
+            TCI_NEXT();
+        TCI_CASE(tci_ld_xor_st_i64):
+            next_op = tb_ptr - 2 + tb_ptr[-1];
+            t0 = *tb_ptr++;
+            t1 = tci_read_r(&tb_ptr);
+            t2 = tci_read_i32(&tb_ptr);
+            tmp64 = *(uint64_t *)(t1 + t2) ^ tci_read_ri64(&tb_ptr);
+            *(uint64_t *)(t1 + t2) = tmp64;
+            tci_write_reg64(t0, tmp64);
+            tb_ptr = next_op;
+            TCI_NEXT();
+        TCI_CASE(tci_setcond_brcond_i64):
+            next_op = tb_ptr - 2 + tb_ptr[-1];
+            t0 = *tb_ptr++;
+            t1 = tci_read_r64(&tb_ptr);
+            t2 = tci_read_ri64(&tb_ptr);
+            condition = *tb_ptr++;
+            tmp8 = tci_compare64(t1, t2, condition);
+            tci_write_reg64(t0, tmp8);
+            if (tmp8 == *tb_ptr) {
+                tb_ptr = next_op - sizeof(tcg_target_ulong);
+                label = tci_read_label(&tb_ptr);
+                tb_ptr = (uint8_t *)label;
+                TCI_JUMP();
+            }
+            tb_ptr = next_op;
+            TCI_NEXT();
 #if TCG_TARGET_HAS_ext8u_i64
         case INDEX_op_ext8u_i64:
             t0 = *tb_ptr++;
@@ -1060,16 +1323,16 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             TODO();
             break;
 #endif
-        case INDEX_op_exit_tb:
+        TCI_CASE(exit_tb):
             next_tb = *(uint64_t *)tb_ptr;
             goto exit;
             break;
-        case INDEX_op_goto_tb:
+        TCI_CASE(goto_tb):
             t0 = tci_read_i32(&tb_ptr);
             assert(tb_ptr == old_code_ptr + op_size);
             tb_ptr += (int32_t)t0;
-            continue;
-        case INDEX_op_qemu_ld8u:
+            TCI_JUMP();
+        TCI_CASE(qemu_ld8u):
             t0 = *tb_ptr++;
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1080,8 +1343,8 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             tmp8 = *(uint8_t *)(host_addr + GUEST_BASE);
 #endif
             tci_write_reg8(t0, tmp8);
-            break;
-        case INDEX_op_qemu_ld8s:
+            TCI_NEXT();
+        TCI_CASE(qemu_ld8s):
             t0 = *tb_ptr++;
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1092,8 +1355,8 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             tmp8 = *(uint8_t *)(host_addr + GUEST_BASE);
 #endif
             tci_write_reg8s(t0, tmp8);
-            break;
-        case INDEX_op_qemu_ld16u:
+            TCI_NEXT();
+        TCI_CASE(qemu_ld16u):
             t0 = *tb_ptr++;
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1104,8 +1367,8 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             tmp16 = tswap16(*(uint16_t *)(host_addr + GUEST_BASE));
 #endif
             tci_write_reg16(t0, tmp16);
-            break;
-        case INDEX_op_qemu_ld16s:
+            TCI_NEXT();
+        TCI_CASE(qemu_ld16s):
             t0 = *tb_ptr++;
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1116,9 +1379,9 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             tmp16 = tswap16(*(uint16_t *)(host_addr + GUEST_BASE));
 #endif
             tci_write_reg16s(t0, tmp16);
-            break;
+            TCI_NEXT();
 #if TCG_TARGET_REG_BITS == 64
-        case INDEX_op_qemu_ld32u:
+        TCI_CASE(qemu_ld32u):
             t0 = *tb_ptr++;
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1129,8 +1392,8 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             tmp32 = tswap32(*(uint32_t *)(host_addr + GUEST_BASE));
 #endif
             tci_write_reg32(t0, tmp32);
-            break;
-        case INDEX_op_qemu_ld32s:
+            TCI_NEXT();
+        TCI_CASE(qemu_ld32s):
             t0 = *tb_ptr++;
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1141,9 +1404,9 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             tmp32 = tswap32(*(uint32_t *)(host_addr + GUEST_BASE));
 #endif
             tci_write_reg32s(t0, tmp32);
-            break;
+            TCI_NEXT();
 #endif /* TCG_TARGET_REG_BITS == 64 */
-        case INDEX_op_qemu_ld32:
+        TCI_CASE(qemu_ld32):
             t0 = *tb_ptr++;
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1154,8 +1417,8 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             tmp32 = tswap32(*(uint32_t *)(host_addr + GUEST_BASE));
 #endif
             tci_write_reg32(t0, tmp32);
-            break;
-        case INDEX_op_qemu_ld64:
+            TCI_NEXT();
+        TCI_CASE(qemu_ld64):
             t0 = *tb_ptr++;
 #if TCG_TARGET_REG_BITS == 32
             t1 = *tb_ptr++;
@@ -1172,8 +1435,8 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
 #if TCG_TARGET_REG_BITS == 32
             tci_write_reg(t1, tmp64 >> 32);
 #endif
-            break;
-        case INDEX_op_qemu_st8:
+            TCI_NEXT();
+        TCI_CASE(qemu_st8):
             t0 = tci_read_r8(&tb_ptr);
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1184,8 +1447,8 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             assert(taddr == host_addr);
             *(uint8_t *)(host_addr + GUEST_BASE) = t0;
 #endif
-            break;
-        case INDEX_op_qemu_st16:
+            TCI_NEXT();
+        TCI_CASE(qemu_st16):
             t0 = tci_read_r16(&tb_ptr);
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1196,8 +1459,8 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             assert(taddr == host_addr);
             *(uint16_t *)(host_addr + GUEST_BASE) = tswap16(t0);
 #endif
-            break;
-        case INDEX_op_qemu_st32:
+            TCI_NEXT();
+        TCI_CASE(qemu_st32):
             t0 = tci_read_r32(&tb_ptr);
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1208,8 +1471,8 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             assert(taddr == host_addr);
             *(uint32_t *)(host_addr + GUEST_BASE) = tswap32(t0);
 #endif
-            break;
-        case INDEX_op_qemu_st64:
+            TCI_NEXT();
+        TCI_CASE(qemu_st64):
             tmp64 = tci_read_r64(&tb_ptr);
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1220,7 +1483,7 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             assert(taddr == host_addr);
             *(uint64_t *)(host_addr + GUEST_BASE) = tswap64(tmp64);
 #endif
-            break;
+            TCI_NEXT();
         default:
             TODO();
             break;
@@ -0,0 +1,273 @@
+/*
+ * Micro-benchmarks for core data paths
+ *
+ * Each benchmark runs its loop BENCH_ROUNDS times and reports the fastest
+ * round in nanoseconds per operation through g_test_minimized_result(), so
+ * "gtester -m=perf -o report.xml" records one machine-readable number per
+ * test path.  Taking the minimum filters out most scheduling noise.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu-aio.h"
+#include "qemu-coroutine.h"
+#include "thread-pool.h"
+#include "block.h"
+#include "iov.h"
+#include "bitops.h"
+#include "qemu/hbitmap.h"
+
+#define BENCH_ROUNDS 5
+
+static AioContext *ctx;
+static ThreadPool *pool;
+
+static void bench_report(const char *name, double best, unsigned int ops)
+{
+    double ns = best * 1e9 / ops;
+
+    g_test_minimized_result(ns, "%s: %.1f ns/op", name, ns);
+}
+
+#define BENCH_RUN(name, ops, body) do {                     \
+    double best_ = 0;                                       \
+    int round_;                                             \
+    for (round_ = 0; round_ < BENCH_ROUNDS; round_++) {     \
+        double elapsed_;                                    \
+        g_test_timer_start();                               \
+        body;                                               \
+        elapsed_ = g_test_timer_elapsed();                  \
+        if (!round_ || elapsed_ < best_) {                  \
+            best_ = elapsed_;                               \
+        }                                                   \
+    }                                                       \
+    bench_report(name, best_, ops);                         \
+} while (0)
+
+/*
+ * Coroutines
+ */
+
+static void coroutine_fn empty_coroutine(void *opaque)
+{
+}
+
+static void coroutine_fn yield_loop(void *opaque)
+{
+    for (;;) {
+        qemu_coroutine_yield();
+    }
+}
+
+static void bench_coroutine_create(void)
+{
+    unsigned int i, max = 1000000;
+
+    BENCH_RUN("coroutine-create", max, {
+        for (i = 0; i < max; i++) {
+            qemu_coroutine_enter(qemu_coroutine_create(empty_coroutine),
+                                 NULL);
+        }
+    });
+}
+
+static void bench_coroutine_switch(void)
+{
+    unsigned int i, max = 10000000;
+    Coroutine *co = qemu_coroutine_create(yield_loop);
+
+    /* Every enter is a switch in and a yield back out */
+    BENCH_RUN("coroutine-switch", max, {
+        for (i = 0; i < max; i++) {
+            qemu_coroutine_enter(co, NULL);
+        }
+    });
+}
+
+/*
+ * Bottom halves
+ */
+
+static void bh_count_cb(void *opaque)
+{
+    (*(unsigned int *)opaque)++;
+}
+
+static void bench_bh_schedule(void)
+{
+    unsigned int i, n = 0, max = 1000000;
+    QEMUBH *bh = aio_bh_new(ctx, bh_count_cb, &n);
+
+    BENCH_RUN("bh-schedule", max, {
+        for (i = 0; i < max; i++) {
+            qemu_bh_schedule(bh);
+            aio_poll(ctx, false);
+        }
+    });
+    g_assert_cmpint(n, ==, max * BENCH_ROUNDS);
+    qemu_bh_delete(bh);
+}
+
+/*
+ * Thread pool
+ */
+
+static int null_worker(void *opaque)
+{
+    return 0;
+}
+
+static void count_done(void *opaque, int ret)
+{
+    (*(unsigned int *)opaque)++;
+}
+
+static void bench_thread_pool(void)
+{
+    unsigned int i, n = 0, max = 100000;
+
+    /* Keep the pool busy with up to 64 requests in flight, like a guest
+     * with a deep queue would.
+     */
+    BENCH_RUN("thread-pool-submit", max, {
+        n = 0;
+        for (i = 0; i < max; i++) {
+            thread_pool_submit_aio(pool, null_worker, NULL, count_done, &n);
+            while (i + 1 - n >= 64) {
+                aio_poll(ctx, true);
+            }
+        }
+        while (n < max) {
+            aio_poll(ctx, true);
+        }
+    });
+}
+
+/*
+ * I/O vectors
+ */
+
+static void bench_iov_from_buf(void)
+{
+    unsigned int i, max = 1000000;
+    struct iovec iov[16];
+    char *data = g_malloc0(16 * 256);
+    char buf[16 * 256];
+
+    for (i = 0; i < ARRAY_SIZE(iov); i++) {
+        iov[i].iov_base = data + i * 256;
+        iov[i].iov_len = 256;
+    }
+    memset(buf, 0x5a, sizeof(buf));
+
+    /* A 4K copy scattered over 16 elements, starting in the middle */
+    BENCH_RUN("iov-from-buf", max, {
+        for (i = 0; i < max; i++) {
+            iov_from_buf(iov, ARRAY_SIZE(iov), 100, buf, sizeof(buf) - 100);
+        }
+    });
+    g_free(data);
+}
+
+static void bench_iovec_concat(void)
+{
+    unsigned int i, max = 1000000;
+    QEMUIOVector src, dst;
+    char *data = g_malloc0(64 * 512);
+
+    qemu_iovec_init(&src, 64);
+    for (i = 0; i < 64; i++) {
+        qemu_iovec_add(&src, data + i * 512, 512);
+    }
+    qemu_iovec_init(&dst, 64);
+
+    BENCH_RUN("iovec-concat", max, {
+        for (i = 0; i < max; i++) {
+            qemu_iovec_reset(&dst);
+            qemu_iovec_concat(&dst, &src, 1000, 16384);
+        }
+    });
+    qemu_iovec_destroy(&dst);
+    qemu_iovec_destroy(&src);
+    g_free(data);
+}
+
+/*
+ * Bitmaps
+ */
+
+#define BITMAP_BITS (1 << 20)
+
+static void bench_find_next_bit(void)
+{
+    unsigned long *map = g_malloc0(BITS_TO_LONGS(BITMAP_BITS) *
+                                   sizeof(unsigned long));
+    unsigned long bit;
+    unsigned int i, n = 0, max = 100;
+
+    /* One bit set in every 1000, like a sparse dirty bitmap */
+    for (i = 0; i < BITMAP_BITS; i += 1000) {
+        set_bit(i, map);
+    }
+
+    BENCH_RUN("find-next-bit", max, {
+        for (i = 0; i < max; i++) {
+            for (bit = find_first_bit(map, BITMAP_BITS); bit < BITMAP_BITS;
+                 bit = find_next_bit(map, BITMAP_BITS, bit + 1)) {
+                n++;
+            }
+        }
+    });
+    g_assert_cmpint(n, ==, max * BENCH_ROUNDS * DIV_ROUND_UP(BITMAP_BITS,
+                                                             1000));
+    g_free(map);
+}
+
+static void bench_hbitmap_iter(void)
+{
+    HBitmap *hb = hbitmap_alloc(BITMAP_BITS, 0);
+    HBitmapIter hbi;
+    unsigned int i, max = 100;
+
+    for (i = 0; i < BITMAP_BITS; i += 1000) {
+        hbitmap_set(hb, i, 1);
+    }
+
+    BENCH_RUN("hbitmap-iter", max, {
+        for (i = 0; i < max; i++) {
+            hbitmap_iter_init(&hbi, hb, 0);
+            while (hbitmap_iter_next(&hbi) >= 0) {
+                /* nothing */
+            }
+        }
+    });
+    hbitmap_free(hb);
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+
+    ctx = aio_context_new();
+    pool = aio_get_thread_pool(ctx);
+
+    g_test_init(&argc, &argv, NULL);
+    if (g_test_perf()) {
+        g_test_add_func("/bench/coroutine/create", bench_coroutine_create);
+        g_test_add_func("/bench/coroutine/switch", bench_coroutine_switch);
+        g_test_add_func("/bench/aio/bh-schedule", bench_bh_schedule);
+        g_test_add_func("/bench/thread-pool/submit", bench_thread_pool);
+        g_test_add_func("/bench/iov/from-buf", bench_iov_from_buf);
+        g_test_add_func("/bench/iov/concat", bench_iovec_concat);
+        g_test_add_func("/bench/bitmap/find-next-bit", bench_find_next_bit);
+        g_test_add_func("/bench/bitmap/hbitmap-iter", bench_hbitmap_iter);
+    }
+
+    ret = g_test_run();
+
+    aio_context_unref(ctx);
+    return ret;
+}
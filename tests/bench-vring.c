@@ -0,0 +1,186 @@
+/*
+ * Micro-benchmark for virtqueue pop/push
+ *
+ * Runs the data plane vring code against a fake guest: guest memory is a
+ * plain host buffer mapped at guest physical address 0, and the benchmark
+ * plays the driver, filling the avail ring and reaping the used ring.
+ * Results are reported like in bench-core.c.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "hw/dataplane/vring.h"
+
+#define BENCH_ROUNDS    5
+#define RING_SIZE       256
+#define GUEST_MEM_SIZE  (4 << 20)
+#define RING_ALIGN      4096
+#define BUF_SIZE        4096
+
+static uint8_t *guest_mem;
+
+/* Fake guest memory for the vring code */
+
+void hostmem_init(HostMem *hostmem)
+{
+}
+
+void hostmem_finalize(HostMem *hostmem)
+{
+}
+
+void *hostmem_lookup(HostMem *hostmem, hwaddr phys, hwaddr len, bool is_write)
+{
+    if (phys >= GUEST_MEM_SIZE || len > GUEST_MEM_SIZE - phys) {
+        return NULL;
+    }
+    return guest_mem + phys;
+}
+
+/* vring_setup() and vring_teardown() are not used, the ring is laid out
+ * directly in the fake guest memory.
+ */
+
+hwaddr virtio_queue_get_ring_addr(VirtIODevice *vdev, int n)
+{
+    return 0;
+}
+
+hwaddr virtio_queue_get_ring_size(VirtIODevice *vdev, int n)
+{
+    return 0;
+}
+
+int virtio_queue_get_num(VirtIODevice *vdev, int n)
+{
+    return RING_SIZE;
+}
+
+uint16_t virtio_queue_get_last_avail_idx(VirtIODevice *vdev, int n)
+{
+    return 0;
+}
+
+void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n, uint16_t idx)
+{
+}
+
+static void bench_setup(Vring *vring, VirtIODevice *vdev, uint32_t features)
+{
+    hwaddr bufs = QEMU_ALIGN_UP(vring_size(RING_SIZE, RING_ALIGN), RING_ALIGN);
+    unsigned int i;
+
+    memset(guest_mem, 0, GUEST_MEM_SIZE);
+    memset(vring, 0, sizeof(*vring));
+    memset(vdev, 0, sizeof(*vdev));
+    vdev->guest_features = features;
+    vring_init(&vring->vr, RING_SIZE, guest_mem, RING_ALIGN);
+
+    /* Each request is a 16-byte header the device reads followed by a
+     * buffer the device writes, like a virtio-blk read.
+     */
+    for (i = 0; i < RING_SIZE; i += 2) {
+        struct vring_desc *d = &vring->vr.desc[i];
+
+        d[0].addr = bufs + i * BUF_SIZE;
+        d[0].len = 16;
+        d[0].flags = VRING_DESC_F_NEXT;
+        d[0].next = i + 1;
+        d[1].addr = bufs + (i + 1) * BUF_SIZE;
+        d[1].len = BUF_SIZE;
+        d[1].flags = VRING_DESC_F_WRITE;
+    }
+    assert(bufs + RING_SIZE * BUF_SIZE <= GUEST_MEM_SIZE);
+}
+
+/* Make @n requests available, as the driver would */
+static void guest_add(Vring *vring, uint16_t *head, unsigned int n)
+{
+    struct vring_avail *avail = vring->vr.avail;
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        avail->ring[avail->idx % RING_SIZE] = *head;
+        *head = (*head + 2) % RING_SIZE;
+        smp_wmb();
+        avail->idx++;
+    }
+}
+
+static void bench_pop_push(const char *name, uint32_t features,
+                           unsigned int batch)
+{
+    VirtIODevice vdev;
+    Vring vring;
+    struct iovec iov[8];
+    unsigned int out_num, in_num, i, j, max = 1000000;
+    uint16_t head = 0;
+    double best = 0;
+    int round, ret;
+
+    bench_setup(&vring, &vdev, features);
+
+    for (round = 0; round < BENCH_ROUNDS; round++) {
+        double elapsed;
+
+        g_test_timer_start();
+        for (i = 0; i < max; i += batch) {
+            guest_add(&vring, &head, batch);
+            for (j = 0; j < batch; j++) {
+                out_num = in_num = 0;
+                ret = vring_pop(&vdev, &vring, iov, iov + ARRAY_SIZE(iov),
+                                &out_num, &in_num);
+                g_assert_cmpint(ret, >=, 0);
+                vring_push(&vring, ret, BUF_SIZE);
+            }
+            vring_should_notify(&vdev, &vring);
+        }
+        elapsed = g_test_timer_elapsed();
+        if (!round || elapsed < best) {
+            best = elapsed;
+        }
+    }
+
+    g_assert(!vring.broken);
+    g_test_minimized_result(best * 1e9 / max, "%s: %.1f ns/op", name,
+                            best * 1e9 / max);
+}
+
+static void bench_pop_push_single(void)
+{
+    bench_pop_push("vring-pop-push", 0, 1);
+}
+
+static void bench_pop_push_batch(void)
+{
+    bench_pop_push("vring-pop-push-batch32", 0, 32);
+}
+
+static void bench_pop_push_event_idx(void)
+{
+    bench_pop_push("vring-pop-push-event-idx",
+                   1 << VIRTIO_RING_F_EVENT_IDX, 32);
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+
+    guest_mem = qemu_memalign(RING_ALIGN, GUEST_MEM_SIZE);
+
+    g_test_init(&argc, &argv, NULL);
+    if (g_test_perf()) {
+        g_test_add_func("/bench/vring/pop-push", bench_pop_push_single);
+        g_test_add_func("/bench/vring/pop-push-batch", bench_pop_push_batch);
+        g_test_add_func("/bench/vring/pop-push-event-idx",
+                        bench_pop_push_event_idx);
+    }
+
+    ret = g_test_run();
+
+    qemu_vfree(guest_mem);
+    return ret;
+}
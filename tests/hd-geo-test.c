@@ -390,6 +390,27 @@ static void test_ide_drive_cd_0(void)
     qtest_quit(global_qtest);
 }
 
+/*
+ * Test case: two IDE disks (if=ide) whose formats are both probed while
+ * the command line drives are opened at the same time
+ */
+static void test_ide_drive_probe_pair(void)
+{
+    char *argv[256];
+    int argc;
+    Backend i;
+
+    argc = setup_common(argv, ARRAY_SIZE(argv));
+    for (i = backend_small; i <= backend_large; i++) {
+        cur_ide[i] = &hd_chst[i][mbr_blank];
+        argc = setup_ide(argc, argv, ARRAY_SIZE(argv),
+                         i, NULL, i, mbr_blank, "");
+    }
+    qtest_start(g_strjoinv(" ", argv));
+    test_cmos();
+    qtest_quit(global_qtest);
+}
+
 int main(int argc, char **argv)
 {
     Backend i;
@@ -412,6 +433,7 @@ int main(int argc, char **argv)
     qtest_add_func("hd-geo/ide/drive/user/chs", test_ide_drive_user_chs);
     qtest_add_func("hd-geo/ide/drive/user/chst", test_ide_drive_user_chst);
     qtest_add_func("hd-geo/ide/drive/cd_0", test_ide_drive_cd_0);
+    qtest_add_func("hd-geo/ide/drive/probe_pair", test_ide_drive_probe_pair);
     qtest_add_func("hd-geo/ide/device/mbr/blank", test_ide_device_mbr_blank);
     qtest_add_func("hd-geo/ide/device/mbr/lba", test_ide_device_mbr_lba);
     qtest_add_func("hd-geo/ide/device/mbr/chs", test_ide_device_mbr_chs);
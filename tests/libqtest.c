@@ -103,6 +103,7 @@ static pid_t qtest_qemu_pid(QTestState *s)
 
 QTestState *qtest_init(const char *extra_args)
 {
+    static int instance;
     QTestState *s;
     int sock, qmpsock, ret, i;
     gchar *pid_file;
@@ -115,9 +116,13 @@ QTestState *qtest_init(const char *extra_args)
 
     s = g_malloc(sizeof(*s));
 
-    s->socket_path = g_strdup_printf("/tmp/qtest-%d.sock", getpid());
-    s->qmp_socket_path = g_strdup_printf("/tmp/qtest-%d.qmp", getpid());
-    pid_file = g_strdup_printf("/tmp/qtest-%d.pid", getpid());
+    /* Several instances may run at once, e.g. to test migration */
+    s->socket_path = g_strdup_printf("/tmp/qtest-%d-%d.sock", getpid(),
+                                     instance);
+    s->qmp_socket_path = g_strdup_printf("/tmp/qtest-%d-%d.qmp", getpid(),
+                                         instance);
+    pid_file = g_strdup_printf("/tmp/qtest-%d-%d.pid", getpid(), instance);
+    instance++;
 
     sock = init_socket(s->socket_path);
     qmpsock = init_socket(s->qmp_socket_path);
@@ -285,18 +290,14 @@ redo:
     return words;
 }
 
-void qtest_qmp(QTestState *s, const char *fmt, ...)
+/* Read one JSON object from the QMP socket, appending it to @str if
+ * it is not NULL.
+ */
+static void qmp_recv(QTestState *s, GString *str)
 {
-    va_list ap;
     bool has_reply = false;
     int nesting = 0;
 
-    /* Send QMP request */
-    va_start(ap, fmt);
-    socket_sendf(s->qmp_fd, fmt, ap);
-    va_end(ap);
-
-    /* Receive reply */
     while (!has_reply || nesting > 0) {
         ssize_t len;
         char c;
@@ -320,6 +321,42 @@ void qtest_qmp(QTestState *s, const char *fmt, ...)
             nesting--;
             break;
         }
+        if (str && has_reply) {
+            g_string_append_c(str, c);
+        }
+    }
+}
+
+void qtest_qmp(QTestState *s, const char *fmt, ...)
+{
+    va_list ap;
+
+    /* Send QMP request */
+    va_start(ap, fmt);
+    socket_sendf(s->qmp_fd, fmt, ap);
+    va_end(ap);
+
+    /* Receive reply */
+    qmp_recv(s, NULL);
+}
+
+char *qtest_qmp_str(QTestState *s, const char *fmt, ...)
+{
+    va_list ap;
+    GString *str;
+
+    va_start(ap, fmt);
+    socket_sendf(s->qmp_fd, fmt, ap);
+    va_end(ap);
+
+    /* Skip asynchronous events until the reply arrives */
+    for (;;) {
+        str = g_string_new("");
+        qmp_recv(s, str);
+        if (!strstr(str->str, "\"event\"")) {
+            return g_string_free(str, FALSE);
+        }
+        g_string_free(str, TRUE);
     }
 }
 
@@ -464,6 +501,12 @@ void qtest_add_func(const char *str, void (*fn))
     g_test_add_func(path, fn);
 }
 
+void qtest_memset(QTestState *s, uint64_t addr, uint8_t value, size_t size)
+{
+    qtest_sendf(s, "memset 0x%" PRIx64 " 0x%zx 0x%02x\n", addr, size, value);
+    qtest_rsp(s, 0);
+}
+
 void qtest_memwrite(QTestState *s, uint64_t addr, const void *data, size_t size)
 {
     const uint8_t *ptr = data;
@@ -46,6 +46,16 @@ void qtest_quit(QTestState *s);
  */
 void qtest_qmp(QTestState *s, const char *fmt, ...);
 
+/**
+ * qtest_qmp_str:
+ * @s: QTestState instance to operate on.
+ * @fmt...: QMP message to send to qemu
+ *
+ * Sends a QMP message to QEMU and returns the text of the reply, skipping
+ * any asynchronous event that arrives first.  The caller must g_free() it.
+ */
+char *qtest_qmp_str(QTestState *s, const char *fmt, ...);
+
 /**
  * qtest_get_irq:
  * @s: QTestState instance to operate on.
@@ -157,6 +167,17 @@ void qtest_memread(QTestState *s, uint64_t addr, void *data, size_t size);
  */
 void qtest_memwrite(QTestState *s, uint64_t addr, const void *data, size_t size);
 
+/**
+ * qtest_memset:
+ * @s: QTestState instance to operate on.
+ * @addr: Guest address to write to.
+ * @value: Byte to fill the memory with.
+ * @size: Number of bytes to write.
+ *
+ * Fill guest memory with a byte, without sending the data over the wire.
+ */
+void qtest_memset(QTestState *s, uint64_t addr, uint8_t value, size_t size);
+
 /**
  * qtest_clock_step_next:
  * @s: QTestState instance to operate on.
@@ -0,0 +1,123 @@
+/*
+ * QTest testcase for memory topology updates on the PC machine
+ *
+ * Boots the default PC machine, then remaps the PAM areas and a PCI BAR
+ * over and over, and checks that RAM, the BIOS area and the HPET are still
+ * where they belong after each round.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "libqtest.h"
+
+#include <glib.h>
+#include <string.h>
+
+#define I440FX_PAM      0x59
+#define I440FX_PAM_SIZE 7
+
+#define HPET_BASE       0xfed00000
+#define PAM_EXPAN_BASE  0xc0000
+#define PAM_BIOS_BASE   0xf0000
+#define HIGH_RAM        0x100000
+#define TOP_RAM         (0x8000000 - 0x1000)
+
+static void pci_config_writeb(int devfn, uint8_t reg, uint8_t val)
+{
+    outl(0xcf8, 0x80000000 | (devfn << 8) | (reg & ~3));
+    outb(0xcfc + (reg & 3), val);
+}
+
+static void pci_config_writew(int devfn, uint8_t reg, uint16_t val)
+{
+    outl(0xcf8, 0x80000000 | (devfn << 8) | (reg & ~3));
+    outw(0xcfc + (reg & 2), val);
+}
+
+static void set_pam(uint8_t val)
+{
+    int i;
+
+    /* the BIOS area only has the high nibble */
+    pci_config_writeb(0, I440FX_PAM, val & 0xf0);
+    for (i = 1; i < I440FX_PAM_SIZE; i++) {
+        pci_config_writeb(0, I440FX_PAM + i, val);
+    }
+}
+
+static void write_pattern(uint64_t addr, uint8_t seed)
+{
+    uint8_t buf[64];
+    int i;
+
+    for (i = 0; i < sizeof(buf); i++) {
+        buf[i] = seed + i;
+    }
+    memwrite(addr, buf, sizeof(buf));
+}
+
+static void check_pattern(uint64_t addr, uint8_t seed)
+{
+    uint8_t buf[64];
+    int i;
+
+    memread(addr, buf, sizeof(buf));
+    for (i = 0; i < sizeof(buf); i++) {
+        g_assert_cmphex(buf[i], ==, (uint8_t)(seed + i));
+    }
+}
+
+static void check_hpet(void)
+{
+    uint32_t cap;
+
+    memread(HPET_BASE, &cap, sizeof(cap));
+    g_assert_cmphex(GUINT32_FROM_LE(cap) >> 16, ==, 0x8086);
+}
+
+static void test_remap(void)
+{
+    int round;
+
+    write_pattern(HIGH_RAM, 0x10);
+    write_pattern(TOP_RAM, 0x20);
+    check_hpet();
+
+    for (round = 0; round < 16; round++) {
+        /* shadow RAM read/write: the PAM areas are ordinary RAM */
+        set_pam(0x33);
+        write_pattern(PAM_EXPAN_BASE + round * 0x100, round);
+        write_pattern(PAM_BIOS_BASE + round * 0x100, round + 0x40);
+
+        /* back to PCI/ROM, then to RAM again */
+        set_pam(0x00);
+        set_pam(0x33);
+        check_pattern(PAM_EXPAN_BASE + round * 0x100, round);
+        check_pattern(PAM_BIOS_BASE + round * 0x100, round + 0x40);
+
+        /* unmap and remap the BARs of the VGA device at 00:02.0 */
+        pci_config_writew(2 << 3, 0x04, 0x0000);
+        check_hpet();
+        pci_config_writew(2 << 3, 0x04, 0x0003);
+
+        check_pattern(HIGH_RAM, 0x10);
+        check_pattern(TOP_RAM, 0x20);
+        check_hpet();
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_start("-display none -m 128");
+    qtest_add_func("/memory-map/remap", test_remap);
+
+    ret = g_test_run();
+
+    qtest_quit(global_qtest);
+
+    return ret;
+}
@@ -0,0 +1,202 @@
+/*
+ * Migration benchmark
+ *
+ * Migrates a guest between two QEMU processes over a unix socket while
+ * dirtying its memory at a fixed rate, and reports the total time, the
+ * downtime, the bytes sent and the number of passes over RAM.  The guest
+ * is synthetic: no code runs in it, and the memory is dirtied through the
+ * qtest "memset" command in chunks every DIRTY_INTERVAL_MS.
+ *
+ * The benchmarks are only registered in perf mode, so they are skipped by
+ * "make check"; run them with "make check-qtest-x86_64 SPEED=perf".  They
+ * are configured through the environment:
+ *
+ *   MIGBENCH_MEM_MB       guest memory size (default 512)
+ *   MIGBENCH_DIRTY_MBPS   dirty rate of the "dirty" cases (default 64)
+ *   MIGBENCH_SPEED_MBPS   migration bandwidth limit (default 1024)
+ *   MIGBENCH_DOWNTIME_MS  maximum downtime (default 300)
+ *   MIGBENCH_TIMEOUT_S    time after which the guest stops dirtying memory,
+ *                         so that a migration that does not converge still
+ *                         finishes (default 60)
+ *
+ * Total time and downtime are reported in milliseconds with
+ * g_test_minimized_result(), the other values with g_test_message(); both
+ * end up in the gtester XML report.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "libqtest.h"
+
+#define DIRTY_BASE          (1 << 20)       /* above the ISA hole */
+#define DIRTY_INTERVAL_MS   10
+#define POLL_INTERVAL_MS    50
+
+typedef struct MigBenchConfig {
+    bool dirty;
+    bool xbzrle;
+} MigBenchConfig;
+
+static int64_t env_int(const char *name, int64_t def)
+{
+    const char *val = getenv(name);
+
+    return val ? g_ascii_strtoll(val, NULL, 0) : def;
+}
+
+static int64_t now_ms(void)
+{
+    GTimeVal tv;
+
+    g_get_current_time(&tv);
+    return tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+}
+
+/* Return the value of the first integer member called @key in @reply */
+static int64_t reply_int(const char *reply, const char *key, int64_t def)
+{
+    gchar *pattern = g_strdup_printf("\"%s\": ", key);
+    const char *p = strstr(reply, pattern);
+    int64_t val = def;
+
+    if (p) {
+        val = g_ascii_strtoll(p + strlen(pattern), NULL, 10);
+    }
+    g_free(pattern);
+    return val;
+}
+
+static void migbench(gconstpointer opaque)
+{
+    const MigBenchConfig *cfg = opaque;
+    int64_t mem_mb = env_int("MIGBENCH_MEM_MB", 512);
+    int64_t dirty_mbps = cfg->dirty ? env_int("MIGBENCH_DIRTY_MBPS", 64) : 0;
+    int64_t speed_mbps = env_int("MIGBENCH_SPEED_MBPS", 1024);
+    int64_t downtime_ms = env_int("MIGBENCH_DOWNTIME_MS", 300);
+    int64_t timeout_s = env_int("MIGBENCH_TIMEOUT_S", 60);
+    uint64_t dirty_end = MIN(mem_mb, 3072) << 20;
+    uint64_t chunk = dirty_mbps * (1 << 20) / 1000 * DIRTY_INTERVAL_MS;
+    uint64_t addr, cursor = DIRTY_BASE, last_addr = DIRTY_BASE;
+    gchar *uri, *args, *reply = NULL;
+    QTestState *src, *dst;
+    int64_t start, now, last_poll = 0, passes = 0, total, downtime;
+    int64_t transferred, duplicate, normal;
+    bool converged = true;
+    uint8_t value = 1, expect = 0, got;
+
+    uri = g_strdup_printf("unix:/tmp/migbench-%d.sock", getpid());
+    args = g_strdup_printf("-display none -m %" PRId64, mem_mb);
+    src = qtest_init(args);
+    g_free(args);
+    args = g_strdup_printf("-display none -m %" PRId64 " -incoming %s",
+                           mem_mb, uri);
+    dst = qtest_init(args);
+    g_free(args);
+
+    /* Touch all of the memory once, so that it is not sent as zero pages */
+    for (addr = DIRTY_BASE; addr < dirty_end; addr += 64 << 20) {
+        qtest_memset(src, addr, 0xaa, MIN(64 << 20, dirty_end - addr));
+    }
+
+    qtest_qmp(src, "{ 'execute': 'migrate_set_speed',"
+                   "  'arguments': { 'value': %" PRId64 " } }",
+              speed_mbps << 20);
+    qtest_qmp(src, "{ 'execute': 'migrate_set_downtime',"
+                   "  'arguments': { 'value': %f } }",
+              downtime_ms / 1000.0);
+    if (cfg->xbzrle) {
+        qtest_qmp(src, "{ 'execute': 'migrate-set-capabilities',"
+                       "  'arguments': { 'capabilities': ["
+                       "    { 'capability': 'xbzrle', 'state': true } ] } }");
+    }
+
+    start = now_ms();
+    qtest_qmp(src, "{ 'execute': 'migrate', 'arguments': { 'uri': '%s' } }",
+              uri);
+
+    for (;;) {
+        now = now_ms();
+        if (chunk && converged && now - start >= timeout_s * 1000) {
+            converged = false;
+            chunk = 0;
+        }
+        if (chunk) {
+            uint64_t len = MIN(chunk, dirty_end - cursor);
+
+            qtest_memset(src, cursor, value, len);
+            last_addr = cursor;
+            expect = value;
+            cursor += len;
+            if (cursor >= dirty_end) {
+                cursor = DIRTY_BASE;
+                value = value % 255 + 1;
+            }
+        }
+
+        if (now - last_poll >= POLL_INTERVAL_MS) {
+            g_free(reply);
+            reply = qtest_qmp_str(src, "{ 'execute': 'query-migrate' }");
+            g_assert(!strstr(reply, "\"failed\""));
+            if (strstr(reply, "\"completed\"")) {
+                break;
+            }
+            passes = MAX(passes, reply_int(reply, "pass", 0));
+            last_poll = now;
+        }
+        g_usleep(DIRTY_INTERVAL_MS * 1000);
+    }
+
+    total = reply_int(reply, "total-time", -1);
+    downtime = reply_int(reply, "downtime", -1);
+    transferred = reply_int(reply, "transferred", -1);
+    duplicate = reply_int(reply, "duplicate", -1);
+    normal = reply_int(reply, "normal", -1);
+
+    /* Memory written last must have made it to the destination */
+    if (expect) {
+        qtest_memread(dst, last_addr, &got, 1);
+        g_assert_cmpint(got, ==, expect);
+    }
+
+    g_test_message("mem %" PRId64 " MB, dirty %" PRId64 " MB/s, "
+                   "speed %" PRId64 " MB/s, max downtime %" PRId64 " ms%s",
+                   mem_mb, dirty_mbps, speed_mbps, downtime_ms,
+                   cfg->xbzrle ? ", xbzrle" : "");
+    g_test_message("total-time %" PRId64 " ms, downtime %" PRId64 " ms, "
+                   "transferred %" PRId64 " bytes, normal %" PRId64
+                   " pages, duplicate %" PRId64 " pages, passes %" PRId64
+                   ", converged %s", total, downtime, transferred, normal,
+                   duplicate, passes, converged ? "yes" : "no");
+    g_test_minimized_result(total, "total-time %" PRId64 " ms", total);
+    g_test_minimized_result(downtime, "downtime %" PRId64 " ms", downtime);
+
+    g_free(reply);
+    g_free(uri);
+    qtest_quit(dst);
+    qtest_quit(src);
+}
+
+static const MigBenchConfig idle = { .dirty = false };
+static const MigBenchConfig dirty = { .dirty = true };
+static const MigBenchConfig dirty_xbzrle = { .dirty = true, .xbzrle = true };
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    if (g_test_perf()) {
+        g_test_add_data_func("/migration-bench/idle", &idle, migbench);
+        g_test_add_data_func("/migration-bench/dirty", &dirty, migbench);
+        g_test_add_data_func("/migration-bench/dirty-xbzrle", &dirty_xbzrle,
+                             migbench);
+    }
+
+    return g_test_run();
+}
@@ -311,6 +311,20 @@ static void alarm_time(void)
     g_assert(cmos_read(RTC_REG_C) == 0);
 }
 
+static void update_flag_polled(void)
+{
+    cmos_write(RTC_REG_B, cmos_read(RTC_REG_B) &
+               ~(REG_B_UIE | REG_B_AIE | REG_B_PIE));
+    cmos_read(RTC_REG_C);
+    g_assert(!get_irq(RTC_ISA_IRQ));
+
+    /* UF is set even though no update interrupt is armed */
+    clock_step(1000000000);
+    g_assert(!get_irq(RTC_ISA_IRQ));
+    g_assert((cmos_read(RTC_REG_C) & REG_C_UF) != 0);
+    g_assert(cmos_read(RTC_REG_C) == 0);
+}
+
 /* success if no crash or abort */
 static void fuzz_registers(void)
 {
@@ -379,6 +393,7 @@ int main(int argc, char **argv)
     qtest_add_func("/rtc/bcd/check-time", bcd_check_time);
     qtest_add_func("/rtc/dec/check-time", dec_check_time);
     qtest_add_func("/rtc/alarm-time", alarm_time);
+    qtest_add_func("/rtc/update-flag-polled", update_flag_polled);
     qtest_add_func("/rtc/set-year/20xx", set_year_20xx);
     qtest_add_func("/rtc/set-year/1980", set_year_1980);
     qtest_add_func("/rtc/register_b_set_flag", register_b_set_flag);
@@ -68,6 +68,22 @@ static void event_ready_cb(EventNotifier *e)
     }
 }
 
+typedef struct {
+    QEMUTimer *timer;
+    int n;
+    int max;
+    int64_t ns;
+} TimerTestData;
+
+static void timer_test_cb(void *opaque)
+{
+    TimerTestData *data = opaque;
+    if (++data->n < data->max) {
+        qemu_mod_timer_ns(data->timer,
+                          qemu_get_clock_ns(rt_clock) + data->ns);
+    }
+}
+
 /* Tests using aio_*.  */
 
 static void test_notify(void)
@@ -353,6 +369,36 @@ static void test_wait_event_notifier_noflush(void)
  *   works well, and that's what I am using.
  */
 
+static void test_timer_schedule(void)
+{
+    TimerTestData data = { .n = 0, .max = 2, .ns = 10 * SCALE_MS };
+    EventNotifierTestData dummy = { .n = 0, .active = 1 };
+    int64_t start;
+
+    /* an active notifier lets aio_poll block */
+    event_notifier_init(&dummy.e, false);
+    aio_set_event_notifier(ctx, &dummy.e, event_ready_cb, event_active_cb);
+    data.timer = aio_timer_new(ctx, QEMU_CLOCK_REALTIME, SCALE_NS,
+                               timer_test_cb, &data);
+
+    start = qemu_get_clock_ns(rt_clock);
+    qemu_mod_timer_ns(data.timer, start + data.ns);
+    while (aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 0);
+
+    /* the first expiry rearms the timer from its callback */
+    while (data.n < data.max) {
+        aio_poll(ctx, true);
+    }
+    g_assert_cmpint(qemu_get_clock_ns(rt_clock) - start, >=, 2 * data.ns);
+    g_assert(!qemu_timer_pending(data.timer));
+    g_assert_cmpint(dummy.n, ==, 0);
+
+    aio_set_event_notifier(ctx, &dummy.e, NULL, NULL);
+    event_notifier_cleanup(&dummy.e);
+    qemu_free_timer(data.timer);
+}
+
 static void test_source_notify(void)
 {
     while (g_main_context_iteration(NULL, false));
@@ -622,6 +668,29 @@ static void test_source_wait_event_notifier_noflush(void)
     event_notifier_cleanup(&data.e);
 }
 
+static void test_source_timer_schedule(void)
+{
+    TimerTestData data = { .n = 0, .max = 2, .ns = 10 * SCALE_MS };
+    int64_t start;
+
+    data.timer = aio_timer_new(ctx, QEMU_CLOCK_REALTIME, SCALE_NS,
+                               timer_test_cb, &data);
+
+    start = qemu_get_clock_ns(rt_clock);
+    qemu_mod_timer_ns(data.timer, start + data.ns);
+    while (g_main_context_iteration(NULL, false));
+    g_assert_cmpint(data.n, ==, 0);
+
+    /* the GSource wakes up the main context for the deadline */
+    while (data.n < data.max) {
+        g_main_context_iteration(NULL, true);
+    }
+    g_assert_cmpint(qemu_get_clock_ns(rt_clock) - start, >=, 2 * data.ns);
+    g_assert(!qemu_timer_pending(data.timer));
+
+    qemu_free_timer(data.timer);
+}
+
 /* End of tests.  */
 
 int main(int argc, char **argv)
@@ -649,6 +718,7 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/wait",              test_wait_event_notifier);
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
+    g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
 
     g_test_add_func("/aio-gsource/notify",                  test_source_notify);
     g_test_add_func("/aio-gsource/flush",                   test_source_flush);
@@ -663,5 +733,6 @@ int main(int argc, char **argv)
     g_test_add_func("/aio-gsource/event/wait",              test_source_wait_event_notifier);
     g_test_add_func("/aio-gsource/event/wait/no-flush-cb",  test_source_wait_event_notifier_noflush);
     g_test_add_func("/aio-gsource/event/flush",             test_source_flush_event_notifier);
+    g_test_add_func("/aio-gsource/timer/schedule",          test_source_timer_schedule);
     return g_test_run();
 }
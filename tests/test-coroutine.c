@@ -13,6 +13,7 @@
 
 #include <glib.h>
 #include "qemu-coroutine.h"
+#include "qemu-thread.h"
 
 /*
  * Check that qemu_in_coroutine() works
@@ -150,6 +151,39 @@ static void test_lifecycle(void)
     g_assert(done); /* expect done to be true (second time) */
 }
 
+/*
+ * Check that coroutines can be recycled by several threads at once
+ */
+
+static void *lifecycle_thread(void *opaque)
+{
+    Coroutine *coroutine;
+    unsigned int i;
+    bool done;
+
+    for (i = 0; i < 1000; i++) {
+        done = false;
+        coroutine = qemu_coroutine_create(set_and_exit);
+        qemu_coroutine_enter(coroutine, &done);
+        g_assert(done);
+    }
+    return NULL;
+}
+
+static void test_lifecycle_threads(void)
+{
+    QemuThread threads[4];
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(threads); i++) {
+        qemu_thread_create(&threads[i], lifecycle_thread, NULL,
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < ARRAY_SIZE(threads); i++) {
+        qemu_thread_join(&threads[i]);
+    }
+}
+
 /*
  * Lifecycle benchmark
  */
@@ -207,6 +241,7 @@ int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/basic/lifecycle", test_lifecycle);
+    g_test_add_func("/basic/lifecycle-threads", test_lifecycle_threads);
     g_test_add_func("/basic/yield", test_yield);
     g_test_add_func("/basic/nesting", test_nesting);
     g_test_add_func("/basic/self", test_self);
@@ -0,0 +1,120 @@
+/*
+ * RCU unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu-rcu.h"
+#include "qemu-thread.h"
+
+#define NR_READERS 4
+#define NR_UPDATES 2000
+#define OBJ_MAGIC  0x52435521
+
+typedef struct TestObj {
+    struct rcu_head rcu;
+    unsigned magic;
+    unsigned gen;
+} TestObj;
+
+static TestObj *current_obj;
+static unsigned reclaimed;
+static bool stop_readers;
+
+static void test_obj_reclaim(struct rcu_head *rcu)
+{
+    TestObj *obj = container_of(rcu, TestObj, rcu);
+
+    /* a reader still using the object would see the poison */
+    obj->magic = 0;
+    g_free(obj);
+    __sync_fetch_and_add(&reclaimed, 1);
+}
+
+static void *reader_thread(void *opaque)
+{
+    unsigned long *reads = opaque;
+    unsigned last_gen = 0;
+    TestObj *obj;
+
+    while (!*(volatile bool *)&stop_readers) {
+        rcu_read_lock();
+        obj = atomic_rcu_read(&current_obj);
+        g_assert_cmpuint(obj->magic, ==, OBJ_MAGIC);
+        g_assert_cmpuint(obj->gen, >=, last_gen);
+        last_gen = obj->gen;
+        /* nested sections do not end the outer one */
+        rcu_read_lock();
+        g_assert_cmpuint(atomic_rcu_read(&current_obj)->magic, ==, OBJ_MAGIC);
+        rcu_read_unlock();
+        g_assert_cmpuint(obj->magic, ==, OBJ_MAGIC);
+        rcu_read_unlock();
+        (*reads)++;
+    }
+    return NULL;
+}
+
+static TestObj *test_obj_new(unsigned gen)
+{
+    TestObj *obj = g_new0(TestObj, 1);
+
+    obj->magic = OBJ_MAGIC;
+    obj->gen = gen;
+    return obj;
+}
+
+static void test_synchronize_idle(void)
+{
+    /* no reader is inside a critical section */
+    synchronize_rcu();
+    rcu_read_lock();
+    rcu_read_unlock();
+    synchronize_rcu();
+}
+
+static void test_call_rcu(void)
+{
+    QemuThread threads[NR_READERS];
+    unsigned long reads[NR_READERS] = { 0 };
+    TestObj *old;
+    unsigned i;
+
+    current_obj = test_obj_new(0);
+    stop_readers = false;
+    reclaimed = 0;
+    for (i = 0; i < NR_READERS; i++) {
+        qemu_thread_create(&threads[i], reader_thread, &reads[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+
+    for (i = 1; i <= NR_UPDATES; i++) {
+        old = current_obj;
+        atomic_rcu_set(&current_obj, test_obj_new(i));
+        call_rcu(&old->rcu, test_obj_reclaim);
+        if (i % 100 == 0) {
+            g_usleep(1000);
+        }
+    }
+
+    while (*(volatile unsigned *)&reclaimed < NR_UPDATES) {
+        g_usleep(1000);
+    }
+
+    stop_readers = true;
+    for (i = 0; i < NR_READERS; i++) {
+        qemu_thread_join(&threads[i]);
+        g_assert(reads[i] > 0);
+    }
+    g_free(current_obj);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/rcu/synchronize-idle", test_synchronize_idle);
+    g_test_add_func("/rcu/call-rcu", test_call_rcu);
+    return g_test_run();
+}
@@ -63,6 +63,20 @@ static void test_visitor_in_int(TestInputVisitorData *data,
     g_assert_cmpint(res, ==, value);
 }
 
+static void test_visitor_in_size(TestInputVisitorData *data,
+                                 const void *unused)
+{
+    uint64_t res = 0;
+    Error *errp = NULL;
+    Visitor *v;
+
+    v = visitor_input_test_init(data, "2M");
+
+    visit_type_size(v, &res, NULL, &errp);
+    g_assert(!error_is_set(&errp));
+    g_assert_cmpint(res, ==, 2 * 1024 * 1024);
+}
+
 static void test_visitor_in_bool(TestInputVisitorData *data,
                                  const void *unused)
 {
@@ -180,6 +194,8 @@ int main(int argc, char **argv)
 
     input_visitor_test_add("/string-visitor/input/int",
                            &in_visitor_data, test_visitor_in_int);
+    input_visitor_test_add("/string-visitor/input/size",
+                           &in_visitor_data, test_visitor_in_size);
     input_visitor_test_add("/string-visitor/input/bool",
                            &in_visitor_data, test_visitor_in_bool);
     input_visitor_test_add("/string-visitor/input/number",
@@ -27,42 +27,71 @@
 #define HEADER_MAGIC 0xf2b177cb0aa429b4ULL
 
 /** Trace file version number, bump if format changes */
-#define HEADER_VERSION 2
+#define HEADER_VERSION 3
 
 /** Records were dropped event ID */
 #define DROPPED_EVENT_ID (~(uint64_t)0 - 1)
 
-/** Trace record is valid */
-#define TRACE_RECORD_VALID ((uint64_t)1 << 63)
+/** Clock event ID, maps record timestamps (host ticks) to nanoseconds */
+#define CLOCK_EVENT_ID (~(uint64_t)0 - 2)
+
+/** Unused space at the end of a thread buffer, never written out */
+#define PADDING_EVENT_ID (~(uint64_t)0 - 3)
 
 /*
- * Trace records are written out by a dedicated thread.  The thread waits for
- * records to become available, writes them out, and then waits again.
+ * Every thread that traces fills a ring buffer of its own.  Only the thread
+ * advances the head and only the writeout thread advances the tail, so
+ * recording an event takes no lock and no atomic operation.
+ *
+ * The writeout thread wakes up periodically, or earlier when a buffer is
+ * getting full, merges the records of all buffers by timestamp and writes
+ * them out.  The mutex and conditions below only serialize it against
+ * flushing and enabling/disabling the trace file.
  */
 static GStaticMutex trace_lock = G_STATIC_MUTEX_INIT;
 static GCond *trace_available_cond;
 static GCond *trace_empty_cond;
 static bool trace_available;
 static bool trace_writeout_enabled;
+static bool writeout_kicked;
 
 enum {
-    TRACE_BUF_LEN = 4096 * 64,
+    TRACE_BUF_LEN = 4096 * 32, /* per thread, must be a power of two */
     TRACE_BUF_FLUSH_THRESHOLD = TRACE_BUF_LEN / 4,
+    TRACE_RECORD_ALIGN = 8,
+    TRACE_WRITEOUT_INTERVAL_US = 10000,
 };
 
-uint8_t trace_buf[TRACE_BUF_LEN];
-static unsigned int trace_idx;
-static unsigned int writeout_idx;
-static uint64_t dropped_events;
+struct TraceThreadBuffer {
+    uint8_t data[TRACE_BUF_LEN];
+    unsigned int head;          /* free-running byte counts */
+    unsigned int tail;
+    unsigned int writeout_head; /* head as seen by the writeout thread */
+    unsigned int dropped;
+    unsigned int id;
+    bool busy;                  /* a record is being written */
+    TraceThreadBuffer *next;
+};
+
+static TraceThreadBuffer *thread_buffers;
+static unsigned int nb_thread_buffers;
 static FILE *trace_fp;
 static char *trace_file_name;
 
+#if defined(__linux__)
+static __thread TraceThreadBuffer *thread_buffer;
+#elif !defined(_WIN32)
+static pthread_key_t thread_buffer_key;
+#else
+static DWORD thread_buffer_key;
+#endif
+
 /* * Trace buffer entry */
 typedef struct {
     uint64_t event; /*   TraceEventID */
-    uint64_t timestamp_ns;
-    uint32_t length;   /*    in bytes */
-    uint32_t reserved; /*    unused */
+    uint64_t timestamp; /* host ticks, see CLOCK_EVENT_ID */
+    uint32_t length;   /*    in bytes, a multiple of TRACE_RECORD_ALIGN */
+    uint32_t thread;   /*    id of the thread buffer */
     uint8_t arguments[];
 } TraceRecord;
 
@@ -72,54 +101,79 @@ typedef struct {
     uint64_t header_version;  /* HEADER_VERSION  */
 } TraceLogHeader;
 
+static TraceThreadBuffer *thread_buffer_lookup(void)
+{
+#if defined(__linux__)
+    return thread_buffer;
+#elif !defined(_WIN32)
+    return pthread_getspecific(thread_buffer_key);
+#else
+    return TlsGetValue(thread_buffer_key);
+#endif
+}
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size);
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size);
-
-static void clear_buffer_range(unsigned int idx, size_t len)
+/**
+ * Return the trace buffer of the calling thread, creating it on first use
+ *
+ * Buffers are never freed, so that records of threads that have exited are
+ * still written out.
+ */
+static TraceThreadBuffer *thread_buffer_get(void)
 {
-    uint32_t num = 0;
-    while (num < len) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        trace_buf[idx++] = 0;
-        num++;
+    TraceThreadBuffer *buf = thread_buffer_lookup();
+
+    if (likely(buf)) {
+        return buf;
+    }
+
+    buf = calloc(1, sizeof(*buf)); /* dont use g_malloc, can deadlock when traced */
+    if (!buf) {
+        return NULL;
     }
+#if defined(__linux__)
+    thread_buffer = buf;
+#elif !defined(_WIN32)
+    pthread_setspecific(thread_buffer_key, buf);
+#else
+    TlsSetValue(thread_buffer_key, buf);
+#endif
+
+    buf->id = __sync_fetch_and_add(&nb_thread_buffers, 1);
+    do {
+        buf->next = thread_buffers;
+    } while (!__sync_bool_compare_and_swap(&thread_buffers, buf->next, buf));
+    return buf;
 }
+
 /**
- * Read a trace record from the trace buffer
+ * Return the oldest record of @buf that is not written out yet
  *
- * @idx         Trace buffer index
- * @record      Trace record to fill
+ * @buf         Thread buffer
+ * @head        Head of the buffer when the writeout started
  *
- * Returns false if the record is not valid.
+ * Padding at the end of the buffer is skipped.
  */
-static bool get_trace_record(unsigned int idx, TraceRecord **recordptr)
+static TraceRecord *thread_buffer_peek(TraceThreadBuffer *buf,
+                                       unsigned int head)
 {
-    uint64_t event_flag = 0;
-    TraceRecord record;
-    /* read the event flag to see if its a valid record */
-    read_from_buffer(idx, &record, sizeof(event_flag));
-
-    if (!(record.event & TRACE_RECORD_VALID)) {
-        return false;
+    TraceRecord *record;
+    unsigned int idx, len;
+
+    while (buf->tail != head) {
+        idx = buf->tail % TRACE_BUF_LEN;
+        if (TRACE_BUF_LEN - idx < sizeof(TraceRecord)) {
+            len = TRACE_BUF_LEN - idx;
+        } else {
+            record = (TraceRecord *)&buf->data[idx];
+            if (record->event != PADDING_EVENT_ID) {
+                return record;
+            }
+            len = record->length;
+        }
+        smp_mb(); /* finish reading before the space is reused */
+        buf->tail += len;
     }
-
-    smp_rmb(); /* read memory barrier before accessing record */
-    /* read the record header to know record length */
-    read_from_buffer(idx, &record, sizeof(TraceRecord));
-    *recordptr = malloc(record.length); /* dont use g_malloc, can deadlock when traced */
-    /* make a copy of record to avoid being overwritten */
-    read_from_buffer(idx, *recordptr, record.length);
-    smp_rmb(); /* memory barrier before clearing valid flag */
-    (*recordptr)->event &= ~TRACE_RECORD_VALID;
-    /* clear the trace buffer range for consumed record otherwise any byte
-     * with its MSB set may be considered as a valid event id when the writer
-     * thread crosses this range of buffer again.
-     */
-    clear_buffer_range(idx, record.length);
-    return true;
+    return NULL;
 }
 
 /**
@@ -142,53 +196,95 @@ static void flush_trace_file(bool wait)
 
 static void wait_for_trace_records_available(void)
 {
+    GTimeVal deadline;
+
     g_static_mutex_lock(&trace_lock);
-    while (!(trace_available && trace_writeout_enabled)) {
+    while (!(trace_writeout_enabled && (trace_available || writeout_kicked))) {
         g_cond_signal(trace_empty_cond);
-        g_cond_wait(trace_available_cond,
-                    g_static_mutex_get_mutex(&trace_lock));
+        g_get_current_time(&deadline);
+        g_time_val_add(&deadline, TRACE_WRITEOUT_INTERVAL_US);
+        if (!g_cond_timed_wait(trace_available_cond,
+                               g_static_mutex_get_mutex(&trace_lock),
+                               &deadline) &&
+            trace_writeout_enabled) {
+            break;
+        }
     }
     trace_available = false;
+    writeout_kicked = false;
     g_static_mutex_unlock(&trace_lock);
 }
 
-static gpointer writeout_thread(gpointer opaque)
+/**
+ * Write a record that is generated by the tracer itself
+ *
+ * @event       DROPPED_EVENT_ID or CLOCK_EVENT_ID
+ * @thread      Thread buffer the record refers to
+ * @arg         Number of dropped records or current time in nanoseconds
+ */
+static void write_internal_record(uint64_t event, uint32_t thread,
+                                  uint64_t arg)
 {
-    TraceRecord *recordptr;
     union {
         TraceRecord rec;
         uint8_t bytes[sizeof(TraceRecord) + sizeof(uint64_t)];
-    } dropped;
-    unsigned int idx = 0;
-    uint64_t dropped_count;
+    } internal;
     size_t unused __attribute__ ((unused));
 
-    for (;;) {
-        wait_for_trace_records_available();
+    internal.rec.event = event;
+    internal.rec.timestamp = cpu_get_real_ticks();
+    internal.rec.length = sizeof(internal);
+    internal.rec.thread = thread;
+    memcpy(internal.rec.arguments, &arg, sizeof(arg));
+    unused = fwrite(&internal, sizeof(internal), 1, trace_fp);
+}
+
+static void writeout_records(void)
+{
+    TraceThreadBuffer *buf, *oldest_buf;
+    TraceRecord *record, *oldest;
+    unsigned int len, dropped;
+    size_t unused __attribute__ ((unused));
 
-        if (dropped_events) {
-            dropped.rec.event = DROPPED_EVENT_ID,
-            dropped.rec.timestamp_ns = get_clock();
-            dropped.rec.length = sizeof(TraceRecord) + sizeof(dropped_events),
-            dropped.rec.reserved = 0;
-            while (1) {
-                dropped_count = dropped_events;
-                if (g_atomic_int_compare_and_exchange((gint *)&dropped_events,
-                                                      dropped_count, 0)) {
-                    break;
-                }
+    for (buf = thread_buffers; buf; buf = buf->next) {
+        buf->writeout_head = buf->head;
+    }
+    smp_rmb(); /* read memory barrier before accessing records */
+
+    for (;;) {
+        oldest = NULL;
+        oldest_buf = NULL;
+        for (buf = thread_buffers; buf; buf = buf->next) {
+            record = thread_buffer_peek(buf, buf->writeout_head);
+            if (record && (!oldest || record->timestamp < oldest->timestamp)) {
+                oldest = record;
+                oldest_buf = buf;
             }
-            memcpy(dropped.rec.arguments, &dropped_count, sizeof(uint64_t));
-            unused = fwrite(&dropped.rec, dropped.rec.length, 1, trace_fp);
+        }
+        if (!oldest) {
+            break;
         }
 
-        while (get_trace_record(idx, &recordptr)) {
-            unused = fwrite(recordptr, recordptr->length, 1, trace_fp);
-            writeout_idx += recordptr->length;
-            free(recordptr); /* dont use g_free, can deadlock when traced */
-            idx = writeout_idx % TRACE_BUF_LEN;
+        len = oldest->length;
+        unused = fwrite(oldest, len, 1, trace_fp);
+        smp_mb(); /* finish reading before the space is reused */
+        oldest_buf->tail += len;
+    }
+
+    for (buf = thread_buffers; buf; buf = buf->next) {
+        dropped = __sync_fetch_and_and(&buf->dropped, 0);
+        if (dropped) {
+            write_internal_record(DROPPED_EVENT_ID, buf->id, dropped);
         }
+    }
+    write_internal_record(CLOCK_EVENT_ID, 0, get_clock());
+}
 
+static gpointer writeout_thread(gpointer opaque)
+{
+    for (;;) {
+        wait_for_trace_records_available();
+        writeout_records();
         fflush(trace_fp);
     }
     return NULL;
@@ -196,87 +292,87 @@ static gpointer writeout_thread(gpointer opaque)
 
 void trace_record_write_u64(TraceBufferRecord *rec, uint64_t val)
 {
-    rec->rec_off = write_to_buffer(rec->rec_off, &val, sizeof(uint64_t));
+    memcpy(&rec->buf->data[rec->rec_off], &val, sizeof(uint64_t));
+    rec->rec_off += sizeof(uint64_t);
 }
 
 void trace_record_write_str(TraceBufferRecord *rec, const char *s, uint32_t slen)
 {
     /* Write string length first */
-    rec->rec_off = write_to_buffer(rec->rec_off, &slen, sizeof(slen));
+    memcpy(&rec->buf->data[rec->rec_off], &slen, sizeof(slen));
+    rec->rec_off += sizeof(slen);
     /* Write actual string now */
-    rec->rec_off = write_to_buffer(rec->rec_off, (void*)s, slen);
+    memcpy(&rec->buf->data[rec->rec_off], s, slen);
+    rec->rec_off += slen;
 }
 
 int trace_record_start(TraceBufferRecord *rec, TraceEventID event, size_t datasize)
 {
-    unsigned int idx, rec_off, old_idx, new_idx;
-    uint32_t rec_len = sizeof(TraceRecord) + datasize;
-    uint64_t timestamp_ns = get_clock();
-
-    while (1) {
-        old_idx = trace_idx;
-        smp_rmb();
-        new_idx = old_idx + rec_len;
-
-        if (new_idx - writeout_idx > TRACE_BUF_LEN) {
-            /* Trace Buffer Full, Event dropped ! */
-            g_atomic_int_inc((gint *)&dropped_events);
-            return -ENOSPC;
-        }
+    TraceThreadBuffer *buf = thread_buffer_get();
+    uint32_t rec_len = QEMU_ALIGN_UP(sizeof(TraceRecord) + datasize,
+                                     TRACE_RECORD_ALIGN);
+    unsigned int head, idx, skip;
+    TraceRecord *record;
+
+    if (!buf) {
+        return -ENOMEM;
+    }
+    /* Drop events from signal handlers that interrupt a record */
+    if (buf->busy) {
+        __sync_fetch_and_add(&buf->dropped, 1);
+        return -EBUSY;
+    }
+    buf->busy = true;
+    barrier();
+
+    /* Records do not wrap around the end of the buffer */
+    head = buf->head;
+    idx = head % TRACE_BUF_LEN;
+    skip = TRACE_BUF_LEN - idx < rec_len ? TRACE_BUF_LEN - idx : 0;
+
+    if (head + skip + rec_len - buf->tail > TRACE_BUF_LEN) {
+        /* Trace Buffer Full, Event dropped ! */
+        __sync_fetch_and_add(&buf->dropped, 1);
+        buf->busy = false;
+        return -ENOSPC;
+    }
+    smp_rmb(); /* read the tail before overwriting the space it freed */
 
-        if (g_atomic_int_compare_and_exchange((gint *)&trace_idx,
-                                              old_idx, new_idx)) {
-            break;
+    if (skip) {
+        if (skip >= sizeof(TraceRecord)) {
+            record = (TraceRecord *)&buf->data[idx];
+            record->event = PADDING_EVENT_ID;
+            record->length = skip;
         }
+        head += skip;
+        idx = 0;
     }
 
-    idx = old_idx % TRACE_BUF_LEN;
-
-    rec_off = idx;
-    rec_off = write_to_buffer(rec_off, &event, sizeof(event));
-    rec_off = write_to_buffer(rec_off, &timestamp_ns, sizeof(timestamp_ns));
-    rec_off = write_to_buffer(rec_off, &rec_len, sizeof(rec_len));
+    record = (TraceRecord *)&buf->data[idx];
+    record->event = event;
+    record->timestamp = cpu_get_real_ticks();
+    record->length = rec_len;
+    record->thread = buf->id;
 
-    rec->tbuf_idx = idx;
-    rec->rec_off  = (idx + sizeof(TraceRecord)) % TRACE_BUF_LEN;
+    rec->buf = buf;
+    rec->tbuf_idx = head + rec_len;
+    rec->rec_off = idx + sizeof(TraceRecord);
     return 0;
 }
 
-static void read_from_buffer(unsigned int idx, void *dataptr, size_t size)
-{
-    uint8_t *data_ptr = dataptr;
-    uint32_t x = 0;
-    while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        data_ptr[x++] = trace_buf[idx++];
-    }
-}
-
-static unsigned int write_to_buffer(unsigned int idx, void *dataptr, size_t size)
-{
-    uint8_t *data_ptr = dataptr;
-    uint32_t x = 0;
-    while (x < size) {
-        if (idx >= TRACE_BUF_LEN) {
-            idx = idx % TRACE_BUF_LEN;
-        }
-        trace_buf[idx++] = data_ptr[x++];
-    }
-    return idx; /* most callers wants to know where to write next */
-}
-
 void trace_record_finish(TraceBufferRecord *rec)
 {
-    TraceRecord record;
-    read_from_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
-    smp_wmb(); /* write barrier before marking as valid */
-    record.event |= TRACE_RECORD_VALID;
-    write_to_buffer(rec->tbuf_idx, &record, sizeof(TraceRecord));
+    TraceThreadBuffer *buf = rec->buf;
 
-    if ((trace_idx - writeout_idx) > TRACE_BUF_FLUSH_THRESHOLD) {
-        flush_trace_file(false);
+    smp_wmb(); /* write barrier before publishing the record */
+    buf->head = rec->tbuf_idx;
+    barrier();
+    buf->busy = false;
+
+    /* Only a hint, the writeout thread also wakes up periodically */
+    if (buf->head - buf->tail > TRACE_BUF_FLUSH_THRESHOLD && !writeout_kicked) {
+        writeout_kicked = true;
+        g_cond_signal(trace_available_cond);
     }
 }
 
@@ -309,6 +405,7 @@ void st_set_trace_file_enabled(bool enable)
             trace_fp = NULL;
             return;
         }
+        write_internal_record(CLOCK_EVENT_ID, 0, get_clock());
 
         /* Resume trace writeout */
         trace_writeout_enabled = true;
@@ -425,6 +522,11 @@ bool trace_backend_init(const char *events, const char *file)
 #endif
     }
 
+#if defined(_WIN32)
+    thread_buffer_key = TlsAlloc();
+#elif !defined(__linux__)
+    pthread_key_create(&thread_buffer_key, NULL);
+#endif
     trace_available_cond = g_cond_new();
     trace_empty_cond = g_cond_new();
 
@@ -27,15 +27,19 @@ void st_set_trace_file_enabled(bool enable);
 bool st_set_trace_file(const char *file);
 void st_flush_trace_buffer(void);
 
+typedef struct TraceThreadBuffer TraceThreadBuffer;
+
 typedef struct {
-    unsigned int tbuf_idx;
-    unsigned int rec_off;
+    TraceThreadBuffer *buf;
+    unsigned int tbuf_idx; /* buffer head once the record is finished */
+    unsigned int rec_off;  /* where the next argument goes */
 } TraceBufferRecord;
 
 /* Note for hackers: Make sure MAX_TRACE_LEN < sizeof(uint32_t) */
 #define MAX_TRACE_STRLEN 512
 /**
- * Initialize a trace record and claim space for it in the buffer
+ * Initialize a trace record and claim space for it in the buffer of the
+ * calling thread
  *
  * @arglen  number of bytes required for arguments
  */
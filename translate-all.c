@@ -103,10 +103,8 @@ int cpu_gen_code(CPUArchState *env, TranslationBlock *tb, int *gen_code_size_ptr
     return 0;
 }
 
-/* The cpu state corresponding to 'searched_pc' is restored.
- */
-int cpu_restore_state(TranslationBlock *tb,
-                      CPUArchState *env, uintptr_t searched_pc)
+static int cpu_restore_state_locked(TranslationBlock *tb,
+                                    CPUArchState *env, uintptr_t searched_pc)
 {
     TCGContext *s = &tcg_ctx;
     int j;
@@ -120,7 +118,10 @@ int cpu_restore_state(TranslationBlock *tb,
 #endif
     tcg_func_start(s);
 
+    /* regenerate the same ops as the original translation */
+    tb_profile_counter = tb->prof ? &tb->prof->exec_count : NULL;
     gen_intermediate_code_pc(env, tb);
+    tb_profile_counter = NULL;
 
     if (use_icount) {
         /* Reset the cycle counter to the start of the block.  */
@@ -158,3 +159,17 @@ int cpu_restore_state(TranslationBlock *tb,
 #endif
     return 0;
 }
+
+/* The cpu state corresponding to 'searched_pc' is restored.
+ */
+int cpu_restore_state(TranslationBlock *tb,
+                      CPUArchState *env, uintptr_t searched_pc)
+{
+    int ret;
+
+    /* retranslating the block uses the shared code generator */
+    tb_cache_lock();
+    ret = cpu_restore_state_locked(tb, env, searched_pc);
+    tb_cache_unlock();
+    return ret;
+}
@@ -33,6 +33,9 @@
 #include "sysemu.h"
 #include "x_keymap.h"
 #include "sdl_zoom.h"
+#ifdef CONFIG_OPENGL
+#include <SDL_opengl.h>
+#endif
 
 static DisplayChangeListener *dcl;
 static SDL_Surface *real_screen;
@@ -59,6 +62,129 @@ static SDL_PixelFormat host_format;
 static int scaling_active = 0;
 static Notifier mouse_mode_notifier;
 
+#ifdef CONFIG_OPENGL
+/*
+ * With -display sdl,gl=on the window is an OpenGL context.  Dirty
+ * rectangles go from the display surface, usually the guest's video
+ * memory, straight into a texture, and the card does any scaling.
+ * Surface formats without a GL equivalent use the 2D path.
+ */
+static bool gl_active;
+static GLenum gl_format, gl_type;
+static GLuint gl_texture;
+static int gl_tex_w, gl_tex_h; /* 0 when the texture must be recreated */
+static bool gl_dirty;
+
+static void sdl_gl_select_format(DisplayState *ds)
+{
+    PixelFormat *pf = &ds->surface->pf;
+
+    gl_format = 0;
+    if (pf->bits_per_pixel == 32 && pf->rmask == 0xff0000 &&
+        pf->gmask == 0xff00 && pf->bmask == 0xff) {
+        gl_format = GL_BGRA;
+        gl_type = GL_UNSIGNED_INT_8_8_8_8_REV;
+    } else if (pf->bits_per_pixel == 16 && pf->rmask == 0xf800 &&
+               pf->gmask == 0x7e0 && pf->bmask == 0x1f) {
+        gl_format = GL_RGB;
+        gl_type = GL_UNSIGNED_SHORT_5_6_5;
+    }
+    gl_active = sdl_opengl && gl_format;
+}
+
+static int sdl_gl_pow2(int n)
+{
+    int p = 1;
+
+    while (p < n) {
+        p <<= 1;
+    }
+    return p;
+}
+
+/* Called after every SDL_SetVideoMode, which may recreate the context */
+static void sdl_gl_setup(int width, int height)
+{
+    glViewport(0, 0, width, height);
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    glOrtho(0, 1, 1, 0, -1, 1);
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+    glDisable(GL_DEPTH_TEST);
+    glEnable(GL_TEXTURE_2D);
+    gl_tex_w = gl_tex_h = 0;
+    gl_dirty = true;
+}
+
+static void sdl_gl_create_texture(DisplayState *ds)
+{
+    if (gl_texture) {
+        glDeleteTextures(1, &gl_texture);
+    }
+    glGenTextures(1, &gl_texture);
+    glBindTexture(GL_TEXTURE_2D, gl_texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    /* power-of-two sizes work on every implementation */
+    gl_tex_w = sdl_gl_pow2(ds_get_width(ds));
+    gl_tex_h = sdl_gl_pow2(ds_get_height(ds));
+    glTexImage2D(GL_TEXTURE_2D, 0, gl_format == GL_BGRA ? GL_RGBA : GL_RGB,
+                 gl_tex_w, gl_tex_h, 0, gl_format, gl_type, NULL);
+}
+
+static void sdl_gl_update(DisplayState *ds, int x, int y, int w, int h)
+{
+    int bpp = ds_get_bytes_per_pixel(ds);
+    int linesize = ds_get_linesize(ds);
+
+    if (!gl_tex_w) {
+        sdl_gl_create_texture(ds);
+        x = y = 0;
+        w = ds_get_width(ds);
+        h = ds_get_height(ds);
+    }
+    /* expose events cover the window, which may be larger when scaled */
+    w = MIN(w, ds_get_width(ds) - x);
+    h = MIN(h, ds_get_height(ds) - y);
+    if (w > 0 && h > 0) {
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, linesize / bpp);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, gl_format, gl_type,
+                        ds_get_data(ds) + y * linesize + x * bpp);
+    }
+    gl_dirty = true;
+}
+
+/* Present everything uploaded since the last refresh in one frame */
+static void sdl_gl_draw(DisplayState *ds)
+{
+    GLfloat s, t;
+
+    if (!gl_dirty || !gl_tex_w) {
+        return;
+    }
+    s = (GLfloat)ds_get_width(ds) / gl_tex_w;
+    t = (GLfloat)ds_get_height(ds) / gl_tex_h;
+
+    glBegin(GL_QUADS);
+    glTexCoord2f(0, 0);
+    glVertex2f(0, 0);
+    glTexCoord2f(s, 0);
+    glVertex2f(1, 0);
+    glTexCoord2f(s, t);
+    glVertex2f(1, 1);
+    glTexCoord2f(0, t);
+    glVertex2f(0, 1);
+    glEnd();
+    SDL_GL_SwapBuffers();
+    gl_dirty = false;
+}
+#endif
+
 static void sdl_update(DisplayState *ds, int x, int y, int w, int h)
 {
     //    printf("updating x=%d y=%d w=%d h=%d\n", x, y, w, h);
@@ -68,6 +194,13 @@ static void sdl_update(DisplayState *ds, int x, int y, int w, int h)
     rec.w = w;
     rec.h = h;
 
+#ifdef CONFIG_OPENGL
+    if (gl_active) {
+        sdl_gl_update(ds, x, y, w, h);
+        return;
+    }
+#endif
+
     if (guest_screen) {
         if (!scaling_active) {
             SDL_BlitSurface(guest_screen, &rec, real_screen, &rec);
@@ -89,6 +222,10 @@ static void sdl_setdata(DisplayState *ds)
                                             ds_get_bits_per_pixel(ds), ds_get_linesize(ds),
                                             ds->surface->pf.rmask, ds->surface->pf.gmask,
                                             ds->surface->pf.bmask, ds->surface->pf.amask);
+#ifdef CONFIG_OPENGL
+    /* the new surface may have a different size */
+    gl_tex_w = gl_tex_h = 0;
+#endif
 }
 
 static void do_sdl_resize(int width, int height, int bpp)
@@ -98,6 +235,12 @@ static void do_sdl_resize(int width, int height, int bpp)
     //    printf("resizing to %d %d\n", w, h);
 
     flags = SDL_HWSURFACE | SDL_ASYNCBLIT | SDL_HWACCEL;
+#ifdef CONFIG_OPENGL
+    if (gl_active) {
+        flags = SDL_OPENGL;
+        SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
+    }
+#endif
     if (gui_fullscreen) {
         flags |= SDL_FULLSCREEN;
     } else {
@@ -112,10 +255,18 @@ static void do_sdl_resize(int width, int height, int bpp)
 		height, bpp, SDL_GetError());
         exit(1);
     }
+#ifdef CONFIG_OPENGL
+    if (gl_active) {
+        sdl_gl_setup(width, height);
+    }
+#endif
 }
 
 static void sdl_resize(DisplayState *ds)
 {
+#ifdef CONFIG_OPENGL
+    sdl_gl_select_format(ds);
+#endif
     if (!scaling_active) {
         do_sdl_resize(ds_get_width(ds), ds_get_height(ds), 0);
     } else if (real_screen->format->BitsPerPixel != ds_get_bits_per_pixel(ds)) {
@@ -801,6 +952,11 @@ static void sdl_refresh(DisplayState *ds)
             break;
         }
     }
+#ifdef CONFIG_OPENGL
+    if (gl_active) {
+        sdl_gl_draw(ds);
+    }
+#endif
 }
 
 static void sdl_mouse_warp(DisplayState *ds, int x, int y, int on)
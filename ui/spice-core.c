@@ -371,6 +371,18 @@ static const char *wan_compression_names[] = {
 
 /* functions for the rest of qemu */
 
+bool qemu_spice_display_is_watched(void)
+{
+    ChannelList *item;
+
+    QTAILQ_FOREACH(item, &channel_list, link) {
+        if (item->info->type == SPICE_CHANNEL_DISPLAY) {
+            return true;
+        }
+    }
+    return false;
+}
+
 static SpiceChannelList *qmp_query_spice_channels(void)
 {
     SpiceChannelList *cur_item = NULL, *head = NULL;
@@ -143,8 +143,32 @@ int qemu_spice_display_is_running(SimpleSpiceDisplay *ssd)
     return spice_display_is_running;
 }
 
+static SimpleSpiceBuffer *qemu_spice_buffer_new(int width, int height)
+{
+    SimpleSpiceBuffer *buffer;
+
+    buffer = g_malloc(sizeof(*buffer) + width * height * 4);
+    buffer->refcount = 1;
+    buffer->stride = width * 4;
+    return buffer;
+}
+
+/* May be called from spice server thread context, see below */
+static void qemu_spice_buffer_unref(SimpleSpiceBuffer *buffer)
+{
+    if (__sync_sub_and_fetch(&buffer->refcount, 1) == 0) {
+        g_free(buffer);
+    }
+}
+
+/*
+ * Queue rect for sending.  Its pixels are at (rect->left - origin->left,
+ * rect->top - origin->top) in buffer, which the update keeps a reference to.
+ */
 static void qemu_spice_create_one_update(SimpleSpiceDisplay *ssd,
-                                         QXLRect *rect)
+                                         QXLRect *rect,
+                                         SimpleSpiceBuffer *buffer,
+                                         const QXLRect *origin)
 {
     SimpleSpiceUpdate *update;
     QXLDrawable *drawable;
@@ -152,7 +176,6 @@ static void qemu_spice_create_one_update(SimpleSpiceDisplay *ssd,
     QXLCommand *cmd;
     int bw, bh;
     struct timespec time_space;
-    pixman_image_t *dest;
 
     trace_qemu_spice_create_update(
            rect->left, rect->right,
@@ -165,7 +188,8 @@ static void qemu_spice_create_one_update(SimpleSpiceDisplay *ssd,
 
     bw       = rect->right - rect->left;
     bh       = rect->bottom - rect->top;
-    update->bitmap = g_malloc(bw * bh * 4);
+    __sync_fetch_and_add(&buffer->refcount, 1);
+    update->buffer = buffer;
 
     drawable->bbox            = *rect;
     drawable->clip.type       = SPICE_CLIP_TYPE_NONE;
@@ -188,29 +212,27 @@ static void qemu_spice_create_one_update(SimpleSpiceDisplay *ssd,
     QXL_SET_IMAGE_ID(image, QXL_IMAGE_GROUP_DEVICE, ssd->unique++);
     image->descriptor.type   = SPICE_IMAGE_TYPE_BITMAP;
     image->bitmap.flags      = QXL_BITMAP_DIRECT | QXL_BITMAP_TOP_DOWN;
-    image->bitmap.stride     = bw * 4;
+    image->bitmap.stride     = buffer->stride;
     image->descriptor.width  = image->bitmap.x = bw;
     image->descriptor.height = image->bitmap.y = bh;
-    image->bitmap.data = (uintptr_t)(update->bitmap);
+    image->bitmap.data = (uintptr_t)(buffer->data +
+                                     (rect->top - origin->top) * buffer->stride +
+                                     (rect->left - origin->left) * 4);
     image->bitmap.palette = 0;
     image->bitmap.format = SPICE_BITMAP_FMT_32BIT;
 
-    dest = pixman_image_create_bits(PIXMAN_x8r8g8b8, bw, bh,
-                                    (void *)update->bitmap, bw * 4);
-    pixman_image_composite(PIXMAN_OP_SRC, ssd->surface, NULL, ssd->mirror,
-                           rect->left, rect->top, 0, 0,
-                           rect->left, rect->top, bw, bh);
-    pixman_image_composite(PIXMAN_OP_SRC, ssd->mirror, NULL, dest,
-                           rect->left, rect->top, 0, 0,
-                           0, 0, bw, bh);
-    pixman_image_unref(dest);
-
     cmd->type = QXL_CMD_DRAW;
     cmd->data = (uintptr_t)drawable;
 
     QTAILQ_INSERT_TAIL(&ssd->updates, update, next);
 }
 
+/*
+ * Changed blocks are copied to the mirror and, when the guest surface is
+ * already in the format spice wants, to a buffer covering the dirty area
+ * while they are still in the cache from the comparison.  All updates of
+ * one refresh point into that buffer instead of getting their own copy.
+ */
 static void qemu_spice_create_update(SimpleSpiceDisplay *ssd)
 {
     static const int blksize = 32;
@@ -218,7 +240,10 @@ static void qemu_spice_create_update(SimpleSpiceDisplay *ssd)
     int dirty_top[blocks];
     int y, yoff, x, xoff, blk, bw;
     int bpp = ds_get_bytes_per_pixel(ssd->ds);
-    uint8_t *guest, *mirror;
+    uint8_t *guest, *mirror, *dst;
+    SimpleSpiceBuffer *buffer;
+    QXLRect area;
+    bool direct;
 
     if (qemu_spice_rect_is_empty(&ssd->dirty)) {
         return;
@@ -234,14 +259,20 @@ static void qemu_spice_create_update(SimpleSpiceDisplay *ssd)
         dirty_top[blk] = -1;
     }
 
+    area = ssd->dirty;
+    buffer = qemu_spice_buffer_new(area.right - area.left,
+                                   area.bottom - area.top);
+    direct = ds_get_format(ssd->ds) == PIXMAN_x8r8g8b8;
+
     guest = ds_get_data(ssd->ds);
     mirror = (void *)pixman_image_get_data(ssd->mirror);
-    for (y = ssd->dirty.top; y < ssd->dirty.bottom; y++) {
+    for (y = area.top; y < area.bottom; y++) {
         yoff = y * ds_get_linesize(ssd->ds);
-        for (x = ssd->dirty.left; x < ssd->dirty.right; x += blksize) {
+        dst = buffer->data + (y - area.top) * buffer->stride;
+        for (x = area.left; x < area.right; x += blksize) {
             xoff = x * bpp;
             blk = x / blksize;
-            bw = MIN(blksize, ssd->dirty.right - x);
+            bw = MIN(blksize, area.right - x);
             if (memcmp(guest + yoff + xoff,
                        mirror + yoff + xoff,
                        bw * bpp) == 0) {
@@ -252,10 +283,15 @@ static void qemu_spice_create_update(SimpleSpiceDisplay *ssd)
                         .left   = x,
                         .right  = x + bw,
                     };
-                    qemu_spice_create_one_update(ssd, &update);
+                    qemu_spice_create_one_update(ssd, &update, buffer, &area);
                     dirty_top[blk] = -1;
                 }
             } else {
+                memcpy(mirror + yoff + xoff, guest + yoff + xoff, bw * bpp);
+                if (direct) {
+                    memcpy(dst + (x - area.left) * 4, guest + yoff + xoff,
+                           bw * 4);
+                }
                 if (dirty_top[blk] == -1) {
                     dirty_top[blk] = y;
                 }
@@ -263,21 +299,38 @@ static void qemu_spice_create_update(SimpleSpiceDisplay *ssd)
         }
     }
 
-    for (x = ssd->dirty.left; x < ssd->dirty.right; x += blksize) {
+    if (!direct) {
+        /* The updates are not handed out before ssd->lock is dropped, so
+         * converting the whole area in one go afterwards is fine */
+        pixman_image_t *dest;
+
+        dest = pixman_image_create_bits(PIXMAN_x8r8g8b8,
+                                        area.right - area.left,
+                                        area.bottom - area.top,
+                                        (void *)buffer->data, buffer->stride);
+        pixman_image_composite(PIXMAN_OP_SRC, ssd->mirror, NULL, dest,
+                               area.left, area.top, 0, 0,
+                               0, 0, area.right - area.left,
+                               area.bottom - area.top);
+        pixman_image_unref(dest);
+    }
+
+    for (x = area.left; x < area.right; x += blksize) {
         blk = x / blksize;
-        bw = MIN(blksize, ssd->dirty.right - x);
+        bw = MIN(blksize, area.right - x);
         if (dirty_top[blk] != -1) {
             QXLRect update = {
                 .top    = dirty_top[blk],
-                .bottom = ssd->dirty.bottom,
+                .bottom = area.bottom,
                 .left   = x,
                 .right  = x + bw,
             };
-            qemu_spice_create_one_update(ssd, &update);
+            qemu_spice_create_one_update(ssd, &update, buffer, &area);
             dirty_top[blk] = -1;
         }
     }
 
+    qemu_spice_buffer_unref(buffer);
     memset(&ssd->dirty, 0, sizeof(ssd->dirty));
 }
 
@@ -286,10 +339,13 @@ static void qemu_spice_create_update(SimpleSpiceDisplay *ssd)
  * We do *not* hold the global qemu mutex here, so extra care is needed
  * when calling qemu functions.  QEMU interfaces used:
  *    - g_free (underlying glibc free is re-entrant).
+ * The buffer is shared with the other updates of the same refresh, which
+ * may be released concurrently from the main loop on resize, hence the
+ * atomic reference count.
  */
 void qemu_spice_destroy_update(SimpleSpiceDisplay *sdpy, SimpleSpiceUpdate *update)
 {
-    g_free(update->bitmap);
+    qemu_spice_buffer_unref(update->buffer);
     g_free(update);
 }
 
@@ -411,6 +467,17 @@ void qemu_spice_cursor_refresh_unlocked(SimpleSpiceDisplay *ssd)
 void qemu_spice_display_refresh(SimpleSpiceDisplay *ssd)
 {
     dprint(3, "%s:\n", __func__);
+
+    /* Nobody looks at the display channel: don't render frames for it.
+     * The first refresh after a client attaches redraws everything. */
+    if (!qemu_spice_display_is_watched()) {
+        ssd->unwatched = true;
+        return;
+    }
+    if (ssd->unwatched) {
+        ssd->unwatched = false;
+        vga_hw_invalidate();
+    }
     vga_hw_update();
 
     qemu_mutex_lock(&ssd->lock);
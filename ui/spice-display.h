@@ -68,6 +68,7 @@ QXLCookie *qxl_cookie_new(int type, uint64_t io);
 
 typedef struct SimpleSpiceDisplay SimpleSpiceDisplay;
 typedef struct SimpleSpiceUpdate SimpleSpiceUpdate;
+typedef struct SimpleSpiceBuffer SimpleSpiceBuffer;
 
 struct SimpleSpiceDisplay {
     DisplayState *ds;
@@ -82,6 +83,7 @@ struct SimpleSpiceDisplay {
 
     QXLRect dirty;
     int notify;
+    bool unwatched;
 
     /*
      * All struct members below this comment can be accessed from
@@ -94,11 +96,22 @@ struct SimpleSpiceDisplay {
     int mouse_x, mouse_y;
 };
 
+/*
+ * Pixels of the dirty area of one display refresh, shared by all of its
+ * updates and freed by the spice server thread when the last one is
+ * released.
+ */
+struct SimpleSpiceBuffer {
+    int refcount;
+    int stride;
+    uint8_t data[];
+};
+
 struct SimpleSpiceUpdate {
     QXLDrawable drawable;
     QXLImage image;
     QXLCommandExt ext;
-    uint8_t *bitmap;
+    SimpleSpiceBuffer *buffer;
     QTAILQ_ENTRY(SimpleSpiceUpdate) next;
 };
 
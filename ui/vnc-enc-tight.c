@@ -84,17 +84,18 @@ static const struct {
     double jpeg_freq_threshold; /* Always send JPEG if the freq is above */
     int jpeg_idx;               /* Allow indexed JPEG */
     int jpeg_full;              /* Allow full color JPEG */
+    int jpeg_video_quality;     /* JPEG quality above jpeg_freq_threshold */
 } tight_jpeg_conf[] = {
-    { 0,   8,  1, 1 },
-    { 0,   8,  1, 1 },
-    { 0,   8,  1, 1 },
-    { 0,   8,  1, 1 },
-    { 0,   10, 1, 1 },
-    { 0.1, 10, 1, 1 },
-    { 0.2, 10, 1, 1 },
-    { 0.3, 12, 0, 0 },
-    { 0.4, 14, 0, 0 },
-    { 0.5, 16, 0, 0 },
+    { 0,   8,  1, 1,  5 },
+    { 0,   8,  1, 1,  5 },
+    { 0,   8,  1, 1, 10 },
+    { 0,   8,  1, 1, 15 },
+    { 0,   10, 1, 1, 25 },
+    { 0.1, 10, 1, 1, 35 },
+    { 0.2, 10, 1, 1, 45 },
+    { 0.3, 12, 0, 0, 55 },
+    { 0.4, 14, 0, 0, 60 },
+    { 0.5, 16, 0, 0, 65 },
 };
 #endif
 
@@ -1174,7 +1175,13 @@ static void jpeg_term_destination(j_compress_ptr cinfo)
     buffer->offset = buffer->capacity - cinfo->dest->free_in_buffer;
 }
 
-static int send_jpeg_rect(VncState *vs, int x, int y, int w, int h, int quality)
+/*
+ * @video is set for regions updated faster than jpeg_freq_threshold.  They
+ * are replaced before the viewer can look closely, so they use the faster,
+ * less accurate DCT.
+ */
+static int send_jpeg_rect(VncState *vs, int x, int y, int w, int h, int quality,
+                          bool video)
 {
     struct jpeg_compress_struct cinfo;
     struct jpeg_error_mgr jerr;
@@ -1200,6 +1207,9 @@ static int send_jpeg_rect(VncState *vs, int x, int y, int w, int h, int quality)
 
     jpeg_set_defaults(&cinfo);
     jpeg_set_quality(&cinfo, quality, true);
+    if (video) {
+        cinfo.dct_method = JDCT_IFAST;
+    }
 
     manager.init_destination = jpeg_init_destination;
     manager.empty_output_buffer = jpeg_empty_output_buffer;
@@ -1430,7 +1440,7 @@ static int send_sub_rect_jpeg(VncState *vs, int x, int y, int w, int h,
                       tight_detect_smooth_image(vs, w, h))) {
             int quality = tight_conf[vs->tight.quality].jpeg_quality;
 
-            ret = send_jpeg_rect(vs, x, y, w, h, quality);
+            ret = send_jpeg_rect(vs, x, y, w, h, quality, false);
         } else {
             ret = send_full_color_rect(vs, x, y, w, h);
         }
@@ -1444,7 +1454,7 @@ static int send_sub_rect_jpeg(VncState *vs, int x, int y, int w, int h,
                       tight_detect_smooth_image(vs, w, h))) {
             int quality = tight_conf[vs->tight.quality].jpeg_quality;
 
-            ret = send_jpeg_rect(vs, x, y, w, h, quality);
+            ret = send_jpeg_rect(vs, x, y, w, h, quality, false);
         } else {
             ret = send_palette_rect(vs, x, y, w, h, palette);
         }
@@ -1486,6 +1496,18 @@ static int send_sub_rect(VncState *vs, int x, int y, int w, int h)
     }
 #endif
 
+#ifdef CONFIG_VNC_JPEG
+    if (force_jpeg) {
+        /*
+         * Video-like content: the palette scan would only tell us to
+         * use JPEG anyway, so go there directly and at a lower quality.
+         */
+        int quality = tight_jpeg_conf[vs->tight.quality].jpeg_video_quality;
+
+        return send_jpeg_rect(vs, x, y, w, h, quality, true);
+    }
+#endif
+
     colors = tight_fill_palette(vs, x, y, w * h, &fg, &bg, &palette);
 
 #ifdef CONFIG_VNC_JPEG
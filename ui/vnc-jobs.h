@@ -43,9 +43,35 @@ void vnc_start_worker_thread(void);
 void vnc_stop_worker_thread(void);
 
 /* Locks */
+
+/*
+ * The display lock is held exclusively by vnc_refresh() while it updates
+ * the server surface, and shared by the worker threads that encode from
+ * it.  The exclusive side only ever tries, so readers need no wakeup.
+ */
 static inline int vnc_trylock_display(VncDisplay *vd)
 {
-    return qemu_mutex_trylock(&vd->mutex);
+    int ret = qemu_mutex_trylock(&vd->mutex);
+
+    if (!ret && vd->mutex_readers) {
+        qemu_mutex_unlock(&vd->mutex);
+        ret = EBUSY;
+    }
+    return ret;
+}
+
+static inline void vnc_lock_display_shared(VncDisplay *vd)
+{
+    qemu_mutex_lock(&vd->mutex);
+    vd->mutex_readers++;
+    qemu_mutex_unlock(&vd->mutex);
+}
+
+static inline void vnc_unlock_display_shared(VncDisplay *vd)
+{
+    qemu_mutex_lock(&vd->mutex);
+    vd->mutex_readers--;
+    qemu_mutex_unlock(&vd->mutex);
 }
 
 static inline void vnc_lock_display(VncDisplay *vd)
@@ -34,6 +34,10 @@
 #include "qmp-commands.h"
 #include "osdep.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #define VNC_REFRESH_INTERVAL_BASE 30
 #define VNC_REFRESH_INTERVAL_INC  50
 #define VNC_REFRESH_INTERVAL_MAX  2000
@@ -2528,6 +2532,44 @@ static void vnc_rect_updated(VncDisplay *vd, int x, int y, struct timeval * tv)
     rect->updated = true;
 }
 
+/*
+ * Copy one block of the guest surface to the server surface if it changed.
+ * With 32bpp a block is one cache line, and the SSE2 version keeps it in
+ * registers between the compare and the store instead of reading it twice.
+ */
+static inline bool vnc_update_block(uint8_t *server, const uint8_t *guest,
+                                    int len)
+{
+#ifdef __SSE2__
+    if (len == 64) {
+        const __m128i *g = (const __m128i *)guest;
+        __m128i *s = (__m128i *)server;
+        __m128i g0 = _mm_loadu_si128(g), g1 = _mm_loadu_si128(g + 1);
+        __m128i g2 = _mm_loadu_si128(g + 2), g3 = _mm_loadu_si128(g + 3);
+        __m128i eq;
+
+        eq = _mm_and_si128(
+            _mm_and_si128(_mm_cmpeq_epi8(g0, _mm_loadu_si128(s)),
+                          _mm_cmpeq_epi8(g1, _mm_loadu_si128(s + 1))),
+            _mm_and_si128(_mm_cmpeq_epi8(g2, _mm_loadu_si128(s + 2)),
+                          _mm_cmpeq_epi8(g3, _mm_loadu_si128(s + 3))));
+        if (_mm_movemask_epi8(eq) == 0xFFFF) {
+            return false;
+        }
+        _mm_storeu_si128(s, g0);
+        _mm_storeu_si128(s + 1, g1);
+        _mm_storeu_si128(s + 2, g2);
+        _mm_storeu_si128(s + 3, g3);
+        return true;
+    }
+#endif
+    if (memcmp(server, guest, len) == 0) {
+        return false;
+    }
+    memcpy(server, guest, len);
+    return true;
+}
+
 static int vnc_refresh_server_surface(VncDisplay *vd)
 {
     int width = pixman_image_get_width(vd->guest.fb);
@@ -2539,6 +2581,7 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
     VncState *vs;
     int has_dirty = 0;
     pixman_image_t *tmpbuf = NULL;
+    DECLARE_BITMAP(changed, VNC_DIRTY_BITS);
 
     struct timeval tv = { 0, 0 };
 
@@ -2563,8 +2606,10 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
     guest_row = (uint8_t *)pixman_image_get_data(vd->guest.fb);
     server_row = (uint8_t *)pixman_image_get_data(vd->server);
     for (y = 0; y < height; y++) {
+        /* rows that the display's dirty log did not report have no bits */
         if (!bitmap_empty(vd->guest.dirty[y], VNC_DIRTY_BITS)) {
-            int x;
+            unsigned long i;
+            bool row_changed = false;
             uint8_t *guest_ptr;
             uint8_t *server_ptr;
 
@@ -2576,19 +2621,26 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
             }
             server_ptr = server_row;
 
-            for (x = 0; x + 15 < width;
-                    x += 16, guest_ptr += cmp_bytes, server_ptr += cmp_bytes) {
-                if (!test_and_clear_bit((x / 16), vd->guest.dirty[y]))
-                    continue;
-                if (memcmp(server_ptr, guest_ptr, cmp_bytes) == 0)
+            bitmap_zero(changed, VNC_DIRTY_BITS);
+            for (i = find_first_bit(vd->guest.dirty[y], VNC_DIRTY_BITS);
+                 i < width / 16;
+                 i = find_next_bit(vd->guest.dirty[y], VNC_DIRTY_BITS, i + 1)) {
+                if (!vnc_update_block(server_ptr + i * cmp_bytes,
+                                      guest_ptr + i * cmp_bytes, cmp_bytes)) {
                     continue;
-                memcpy(server_ptr, guest_ptr, cmp_bytes);
+                }
                 if (!vd->non_adaptive)
-                    vnc_rect_updated(vd, x, y, &tv);
+                    vnc_rect_updated(vd, i * 16, y, &tv);
+                set_bit(i, changed);
+                row_changed = true;
+                has_dirty++;
+            }
+            bitmap_zero(vd->guest.dirty[y], VNC_DIRTY_BITS);
+            if (row_changed) {
                 QTAILQ_FOREACH(vs, &vd->clients, next) {
-                    set_bit((x / 16), vs->dirty[y]);
+                    bitmap_or(vs->dirty[y], vs->dirty[y], changed,
+                              VNC_DIRTY_BITS);
                 }
-                has_dirty++;
             }
         }
         guest_row  += pixman_image_get_stride(vd->guest.fb);
@@ -146,6 +146,7 @@ struct VncDisplay
     kbd_layout_t *kbd_layout;
     int lock_key_sync;
     QemuMutex mutex;
+    int mutex_readers;
 
     QEMUCursor *cursor;
     int cursor_msize;
@@ -230,6 +231,7 @@ struct VncRectEntry
 struct VncJob
 {
     VncState *vs;
+    bool busy;
 
     QLIST_HEAD(, VncRectEntry) rectangles;
     QTAILQ_ENTRY(VncJob) next;
@@ -126,6 +126,7 @@ int main(int argc, char **argv)
 #include "hw/xen.h"
 #include "hw/qdev.h"
 #include "hw/loader.h"
+#include "hw/mem_hotplug.h"
 #include "bt-host.h"
 #include "net.h"
 #include "net/slirp.h"
@@ -147,6 +148,8 @@ int main(int argc, char **argv)
 #include "qemu-option.h"
 #include "qemu-config.h"
 #include "qemu-options.h"
+#include "qemu/hostmem.h"
+#include "block/shared-cache.h"
 #include "qmp-commands.h"
 #include "main-loop.h"
 #ifdef CONFIG_VIRTFS
@@ -187,6 +190,7 @@ ram_addr_t ram_size;
 const char *mem_path = NULL;
 #ifdef MAP_POPULATE
 int mem_prealloc = 0; /* force preallocation of physical target memory */
+int mem_prealloc_threads = 1;
 #endif
 int nb_nics;
 NICInfo nd_table[MAX_NICS];
@@ -214,6 +218,7 @@ const char *vnc_display;
 #endif
 int acpi_enabled = 1;
 int no_hpet = 0;
+bool fast_boot;
 int fd_bootchk = 1;
 static int no_reboot;
 int no_shutdown = 0;
@@ -227,6 +232,7 @@ int old_param = 0;
 const char *qemu_name;
 int alt_grab = 0;
 int ctrl_grab = 0;
+int sdl_opengl = 0;
 unsigned int nb_prom_envs = 0;
 const char *prom_envs[MAX_PROM_ENVS];
 int boot_menu;
@@ -247,6 +253,10 @@ static QTAILQ_HEAD(, FWBootEntry) fw_boot_order =
     QTAILQ_HEAD_INITIALIZER(fw_boot_order);
 
 int nb_numa_nodes;
+static char *node_memdev[MAX_NODES];
+static HostMemoryBackend *node_backend[MAX_NODES];
+static bool node_pin_vcpus[MAX_NODES];
+unsigned long *node_host_cpumask[MAX_NODES];
 uint64_t node_mem[MAX_NODES];
 unsigned long *node_cpumask[MAX_NODES];
 
@@ -260,6 +270,8 @@ static NotifierList exit_notifiers =
 
 static NotifierList machine_init_done_notifiers =
     NOTIFIER_LIST_INITIALIZER(machine_init_done_notifiers);
+static NotifierList cpu_added_notifiers =
+    NOTIFIER_LIST_INITIALIZER(cpu_added_notifiers);
 
 static int tcg_allowed = 1;
 int kvm_allowed = 0;
@@ -267,6 +279,7 @@ int xen_allowed = 0;
 uint32_t xen_domid;
 enum xen_mode xen_mode = XEN_EMULATE;
 static int tcg_tb_size;
+static const char *tb_persist_path;
 
 static int default_serial = 1;
 static int default_parallel = 1;
@@ -277,6 +290,33 @@ static int default_cdrom = 1;
 static int default_sdcard = 1;
 static int default_vga = 1;
 
+/* Startup trace: the end of each initialization phase of main(), then the
+ * first time any vCPU enters guest code.
+ */
+#define MAX_STARTUP_PHASES 32
+
+static struct {
+    const char *name;
+    int64_t ns;
+} startup_phases[MAX_STARTUP_PHASES];
+static int nb_startup_phases;
+static int64_t startup_begin_ns;
+static int64_t startup_first_insn_ns;
+static int startup_first_insn_seen;
+static bool startup_trace;
+
+/* Also do without the PC speaker, VMware port, floppy controller and
+ * option ROMs of NICs (fast-boot=on), which microVM-style guests never use.
+ */
+static GlobalProperty fast_boot_props[] = {
+    { .driver = "e1000", .property = "romfile", .value = "" },
+    { .driver = "rtl8139", .property = "romfile", .value = "" },
+    { .driver = "ne2k_pci", .property = "romfile", .value = "" },
+    { .driver = "pcnet", .property = "romfile", .value = "" },
+    { .driver = "virtio-net-pci", .property = "romfile", .value = "" },
+    { /* end of list */ }
+};
+
 static struct {
     const char *driver;
     int *flag;
@@ -791,6 +831,27 @@ static int parse_sandbox(QemuOpts *opts, void *opaque)
     return 0;
 }
 
+static int parse_backing_cache(QemuOpts *opts, void *opaque)
+{
+    const char *path = qemu_opt_get(opts, "path");
+    uint64_t size = qemu_opt_get_size(opts, "size",
+                                      SHARED_CACHE_DEFAULT_SIZE);
+    int ret;
+
+    if (!path) {
+        error_report("backing-cache: path is required");
+        return -1;
+    }
+    ret = bdrv_shared_cache_init(path, size);
+    if (ret < 0) {
+        error_report("backing-cache: could not use '%s': %s", path,
+                     strerror(-ret));
+        return -1;
+    }
+
+    return 0;
+}
+
 /*********QEMU USB setting******/
 bool usb_enabled(bool default_usb)
 {
@@ -1077,6 +1138,19 @@ static void numa_add(const char *optarg)
             nodenr = strtoull(option, NULL, 10);
         }
 
+        if (get_param_value(option, 128, "memdev", optarg) != 0) {
+            g_free(node_memdev[nodenr]);
+            node_memdev[nodenr] = g_strdup(option);
+            if (get_param_value(option, 128, "mem", optarg) != 0) {
+                fprintf(stderr, "qemu: numa mem and memdev are exclusive\n");
+                exit(1);
+            }
+        }
+
+        if (get_param_value(option, 128, "pin-vcpus", optarg) != 0) {
+            node_pin_vcpus[nodenr] = !strcmp(option, "on");
+        }
+
         if (get_param_value(option, 128, "mem", optarg) == 0) {
             node_mem[nodenr] = 0;
         } else {
@@ -1109,6 +1183,132 @@ static void numa_add(const char *optarg)
     }
 }
 
+/* Add the CPUs of host NUMA node to cpus, as listed by sysfs ("0-3,8-11") */
+static int numa_add_host_node_cpus(int node, unsigned long *cpus)
+{
+    char path[64], buf[1024];
+    char *p;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             node);
+    f = fopen(path, "r");
+    if (!f) {
+        return -1;
+    }
+    p = fgets(buf, sizeof(buf), f);
+    fclose(f);
+    if (!p) {
+        return -1;
+    }
+    return qemu_parse_cpulist(p, cpus, MAX_HOST_CPUS);
+}
+
+/* For -numa node,pin-vcpus=on collect the host CPUs of the host nodes that
+ * back the guest node, so that cpus.c can pin its vCPU threads there.
+ */
+static void numa_set_host_cpumask(int nodenr)
+{
+    HostMemoryBackend *backend = node_backend[nodenr];
+    int i;
+
+    if (!backend || bitmap_empty(backend->host_nodes, MAX_HOST_NODES)) {
+        fprintf(stderr, "qemu: pin-vcpus of NUMA node %d requires a memdev "
+                "with host-nodes\n", nodenr);
+        exit(1);
+    }
+
+    node_host_cpumask[nodenr] = bitmap_new(MAX_HOST_CPUS);
+    for (i = 0; i < MAX_HOST_NODES; i++) {
+        if (test_bit(i, backend->host_nodes) &&
+            numa_add_host_node_cpus(i, node_host_cpumask[nodenr]) < 0) {
+            fprintf(stderr, "qemu: cannot read the CPUs of host node %d\n",
+                    i);
+            exit(1);
+        }
+    }
+}
+
+/* Look up the -numa node,memdev= backends once the -object options have
+ * been processed; the node sizes are then given by the backends.
+ */
+static void numa_resolve_memdevs(void)
+{
+    uint64_t total = 0;
+    int i, nb_memdevs = 0;
+
+    for (i = 0; i < nb_numa_nodes; i++) {
+        Object *obj;
+
+        if (!node_memdev[i]) {
+            continue;
+        }
+        obj = object_resolve_path_component(
+            container_get(object_get_root(), "/objects"), node_memdev[i]);
+        if (!obj || !object_dynamic_cast(obj, TYPE_MEMORY_BACKEND)) {
+            fprintf(stderr, "qemu: memdev '%s' of NUMA node %d is not a "
+                    "memory backend\n", node_memdev[i], i);
+            exit(1);
+        }
+        node_backend[i] = MEMORY_BACKEND(obj);
+        node_mem[i] = node_backend[i]->size;
+        if (!node_mem[i]) {
+            fprintf(stderr, "qemu: memdev '%s' has no size\n",
+                    node_memdev[i]);
+            exit(1);
+        }
+        total += node_mem[i];
+        nb_memdevs++;
+    }
+
+    if (nb_memdevs && nb_memdevs != nb_numa_nodes) {
+        fprintf(stderr, "qemu: either all or none of the NUMA nodes must "
+                "use memdev\n");
+        exit(1);
+    }
+    if (nb_memdevs && total != ram_size) {
+        fprintf(stderr, "qemu: memory size 0x" RAM_ADDR_FMT " does not match "
+                "the total size 0x%" PRIx64 " of the NUMA memdevs\n",
+                ram_size, total);
+        exit(1);
+    }
+
+    for (i = 0; i < nb_numa_nodes; i++) {
+        if (node_pin_vcpus[i]) {
+            numa_set_host_cpumask(i);
+        }
+    }
+}
+
+void memory_region_allocate_system_memory(MemoryRegion *mr, const char *name,
+                                          uint64_t size)
+{
+    uint64_t addr = 0;
+    int i;
+
+    if (!nb_numa_nodes || !node_backend[0]) {
+        memory_region_init_ram(mr, name, size);
+        vmstate_register_ram_global(mr);
+        return;
+    }
+
+    memory_region_init(mr, name, size);
+    for (i = 0; i < nb_numa_nodes; i++) {
+        Error *local_err = NULL;
+        MemoryRegion *seg;
+
+        seg = host_memory_backend_get_memory(node_backend[i], &local_err);
+        if (local_err) {
+            qerror_report_err(local_err);
+            error_free(local_err);
+            exit(1);
+        }
+        memory_region_add_subregion(mr, addr, seg);
+        vmstate_register_ram_global(seg);
+        addr += node_mem[i];
+    }
+}
+
 static void smp_parse(const char *optarg)
 {
     int smp, sockets = 0, threads = 0, cores = 0;
@@ -1929,6 +2129,20 @@ static DisplayType select_display(const char *p)
                 } else {
                     goto invalid_sdl_args;
                 }
+            } else if (strstart(opts, ",gl=", &nextopt)) {
+                opts = nextopt;
+                if (strstart(opts, "on", &nextopt)) {
+#ifdef CONFIG_OPENGL
+                    sdl_opengl = 1;
+#else
+                    fprintf(stderr, "OpenGL support is disabled\n");
+                    exit(1);
+#endif
+                } else if (strstart(opts, "off", &nextopt)) {
+                    sdl_opengl = 0;
+                } else {
+                    goto invalid_sdl_args;
+                }
             } else if (strstart(opts, ",window_close=", &nextopt)) {
                 opts = nextopt;
                 if (strstart(opts, "on", &nextopt)) {
@@ -2412,11 +2626,92 @@ void qemu_add_machine_init_done_notifier(Notifier *notify)
     notifier_list_add(&machine_init_done_notifiers, notify);
 }
 
+void qemu_startup_phase(const char *name)
+{
+    if (nb_startup_phases < MAX_STARTUP_PHASES) {
+        startup_phases[nb_startup_phases].name = name;
+        startup_phases[nb_startup_phases].ns = get_clock_realtime();
+        nb_startup_phases++;
+    }
+}
+
+void qemu_startup_first_insn(void)
+{
+    int64_t now, prev;
+    int i;
+
+    /* called by every vCPU on every entry, so check before the atomic */
+    if (likely(startup_first_insn_seen) ||
+        !__sync_bool_compare_and_swap(&startup_first_insn_seen, 0, 1)) {
+        return;
+    }
+    now = get_clock_realtime();
+    startup_first_insn_ns = now;
+    if (!startup_trace) {
+        return;
+    }
+
+    prev = startup_begin_ns;
+    for (i = 0; i < nb_startup_phases; i++) {
+        fprintf(stderr, "qemu: startup: %-24s %8.3f ms\n",
+                startup_phases[i].name,
+                (startup_phases[i].ns - prev) / 1000000.0);
+        prev = startup_phases[i].ns;
+    }
+    fprintf(stderr, "qemu: startup: first guest instruction after "
+            "%.3f ms\n", (now - startup_begin_ns) / 1000000.0);
+}
+
+StartupInfo *qmp_query_startup(Error **errp)
+{
+    StartupInfo *info = g_malloc0(sizeof(*info));
+    StartupPhaseList **tail = &info->phases;
+    int64_t prev = startup_begin_ns;
+    int i;
+
+    for (i = 0; i < nb_startup_phases; i++) {
+        StartupPhaseList *entry = g_malloc0(sizeof(*entry));
+
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->name = g_strdup(startup_phases[i].name);
+        entry->value->duration_ns = startup_phases[i].ns - prev;
+        prev = startup_phases[i].ns;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    if (startup_first_insn_ns) {
+        info->has_first_insn_ns = true;
+        info->first_insn_ns = startup_first_insn_ns - startup_begin_ns;
+    }
+
+    return info;
+}
+
 static void qemu_run_machine_init_done_notifiers(void)
 {
     notifier_list_notify(&machine_init_done_notifiers, NULL);
 }
 
+void qemu_register_cpu_added_notifier(Notifier *notifier)
+{
+    notifier_list_add(&cpu_added_notifiers, notifier);
+}
+
+void qemu_cpu_added(int64_t id)
+{
+    notifier_list_notify(&cpu_added_notifiers, &id);
+}
+
+void qmp_cpu_add(int64_t id, Error **errp)
+{
+    if (!current_machine->hot_add_cpu) {
+        error_setg(errp, "Machine %s does not support CPU hotplug",
+                   current_machine->name);
+        return;
+    }
+    current_machine->hot_add_cpu(id, errp);
+}
+
 static const QEMUOption *lookup_opt(int argc, char **argv,
                                     const char **poptarg, int *poptind)
 {
@@ -2559,6 +2854,7 @@ int main(int argc, char **argv, char **envp)
     const char *trace_events = NULL;
     const char *trace_file = NULL;
 
+    startup_begin_ns = get_clock_realtime();
     atexit(qemu_run_exit_notifiers);
     error_set_progname(argv[0]);
 
@@ -2573,6 +2869,7 @@ int main(int argc, char **argv, char **envp)
     }
 
     module_call_init(MODULE_INIT_QOM);
+    qemu_startup_phase("qom-types");
 
     runstate_init();
 
@@ -3110,6 +3407,14 @@ int main(int argc, char **argv, char **envp)
 
                 qemu_opt_set_bool(fsdev, "readonly",
                                 qemu_opt_get_bool(opts, "readonly", 0));
+                if (qemu_opt_get(opts, "workers")) {
+                    qemu_opt_set(fsdev, "workers",
+                                 qemu_opt_get(opts, "workers"));
+                }
+                if (qemu_opt_get(opts, "stat_cache_ttl")) {
+                    qemu_opt_set(fsdev, "stat_cache_ttl",
+                                 qemu_opt_get(opts, "stat_cache_ttl"));
+                }
                 device = qemu_opts_create(qemu_find_opts("device"), NULL, 0,
                                           NULL);
                 qemu_opt_set(device, "driver", "virtio-9p-pci");
@@ -3388,7 +3693,7 @@ int main(int argc, char **argv, char **envp)
                 old_param = 1;
                 break;
             case QEMU_OPTION_clock:
-                configure_alarms(optarg);
+                /* accepted and ignored for compatibility */
                 break;
             case QEMU_OPTION_startdate:
                 configure_rtc_date_offset(optarg, 1);
@@ -3406,6 +3711,9 @@ int main(int argc, char **argv, char **envp)
                     tcg_tb_size = 0;
                 }
                 break;
+            case QEMU_OPTION_tb_persist:
+                tb_persist_path = optarg;
+                break;
             case QEMU_OPTION_icount:
                 icount_option = optarg;
                 break;
@@ -3505,6 +3813,13 @@ int main(int argc, char **argv, char **envp)
                     exit(0);
                 }
                 break;
+            case QEMU_OPTION_backing_cache:
+                opts = qemu_opts_parse(qemu_find_opts("backing-cache"),
+                                       optarg, 1);
+                if (!opts) {
+                    exit(1);
+                }
+                break;
             case QEMU_OPTION_add_fd:
 #ifndef _WIN32
                 opts = qemu_opts_parse(qemu_find_opts("add-fd"), optarg, 0);
@@ -3536,6 +3851,11 @@ int main(int argc, char **argv, char **envp)
         exit(1);
     }
 
+    if (qemu_opts_foreach(qemu_find_opts("backing-cache"),
+                          parse_backing_cache, NULL, 1)) {
+        exit(1);
+    }
+
 #ifndef _WIN32
     if (qemu_opts_foreach(qemu_find_opts("add-fd"), parse_add_fd, NULL, 1)) {
         exit(1);
@@ -3644,6 +3964,24 @@ int main(int argc, char **argv, char **envp)
         default_sdcard = 0;
     }
 
+    machine_opts = qemu_opts_find(qemu_find_opts("machine"), 0);
+    if (machine_opts && qemu_opt_get_bool(machine_opts, "startup-trace",
+                                          false)) {
+        startup_trace = true;
+    }
+    if (machine_opts && qemu_opt_get_bool(machine_opts, "fast-boot", false)) {
+        fast_boot = true;
+        default_parallel = 0;
+        default_virtcon = 0;
+        default_net = 0;
+        default_floppy = 0;
+        default_cdrom = 0;
+        default_sdcard = 0;
+        default_vga = 0;
+        qdev_prop_register_global_list(fast_boot_props);
+    }
+    qemu_startup_phase("options");
+
     if (display_type == DT_NOGRAPHIC) {
         if (default_parallel)
             add_device_config(DEV_PARALLEL, "null");
@@ -3698,12 +4036,19 @@ int main(int argc, char **argv, char **envp)
     }
 
     configure_accelerator();
+    qemu_startup_phase("accelerator");
 
     machine_opts = qemu_opts_find(qemu_find_opts("machine"), 0);
     if (machine_opts) {
         kernel_filename = qemu_opt_get(machine_opts, "kernel");
         initrd_filename = qemu_opt_get(machine_opts, "initrd");
         kernel_cmdline = qemu_opt_get(machine_opts, "append");
+        mem_prealloc_threads = qemu_opt_get_number(machine_opts,
+                                                   "prealloc-threads", 1);
+        if (mem_prealloc_threads < 1) {
+            fprintf(stderr, "qemu: prealloc-threads must be at least 1\n");
+            exit(1);
+        }
     } else {
         kernel_filename = initrd_filename = kernel_cmdline = NULL;
     }
@@ -3745,6 +4090,49 @@ int main(int argc, char **argv, char **envp)
     }
     configure_icount(icount_option);
 
+    if (machine_opts && qemu_opt_get(machine_opts, "tcg-thread") &&
+        qemu_tcg_configure_thread(qemu_opt_get(machine_opts, "tcg-thread"))) {
+        exit(1);
+    }
+
+    if (machine_opts &&
+        qemu_halt_poll_configure(qemu_opt_get_number(machine_opts,
+                                                     "halt-poll-ns", 0))) {
+        exit(1);
+    }
+
+    if (machine_opts && qemu_opt_get(machine_opts, "ram-align")) {
+        uint64_t align = qemu_opt_get_size(machine_opts, "ram-align", 0);
+
+        if (align < getpagesize() || (align & (align - 1))) {
+            fprintf(stderr, "qemu: ram-align must be a power of two and at "
+                    "least the page size\n");
+            exit(1);
+        }
+    }
+
+    /* before guest RAM is allocated, so that it is locked as it is mapped */
+    if (machine_opts && qemu_opt_get_bool(machine_opts, "mlock", false)) {
+        int ret = os_mlock(true);
+
+        if (ret < 0) {
+            fprintf(stderr, "qemu: locking memory failed: %s\n",
+                    strerror(-ret));
+            exit(1);
+        }
+    }
+
+    if (machine_opts &&
+        mem_hotplug_configure(ram_size,
+                              qemu_opt_get_size(machine_opts, "maxmem", 0),
+                              qemu_opt_get_number(machine_opts,
+                                                  "mem-slots", 0)) < 0) {
+        fprintf(stderr, "qemu: mem-slots must be between 0 and %d, and "
+                "maxmem larger than the memory size\n",
+                MEM_HOTPLUG_MAX_SLOTS);
+        exit(1);
+    }
+
     if (net_init_clients() < 0) {
         exit(1);
     }
@@ -3767,9 +4155,10 @@ int main(int argc, char **argv, char **envp)
 
     blk_mig_init();
 
-    /* open the virtual block devices */
+    /* open the virtual block devices, all images at the same time */
     if (snapshot)
         qemu_opts_foreach(qemu_find_opts("drive"), drive_enable_snapshot, NULL, 0);
+    drive_open_batch_begin();
     if (qemu_opts_foreach(qemu_find_opts("drive"), drive_init_func, &machine->use_scsi, 1) != 0)
         exit(1);
 
@@ -3779,6 +4168,9 @@ int main(int argc, char **argv, char **envp)
                   IF_FLOPPY, 0, FD_OPTS);
     default_drive(default_sdcard, snapshot, machine->use_scsi,
                   IF_SD, 0, SD_OPTS);
+    if (drive_open_batch_end() < 0) {
+        exit(1);
+    }
 
     register_savevm_live(NULL, "ram", 0, 4, &savevm_ram_handlers, NULL);
 
@@ -3789,6 +4181,8 @@ int main(int argc, char **argv, char **envp)
             nb_numa_nodes = MAX_NODES;
         }
 
+        numa_resolve_memdevs();
+
         /* If no memory size if given for any node, assume the default case
          * and distribute the available memory equally across all nodes
          */
@@ -3868,6 +4262,16 @@ int main(int argc, char **argv, char **envp)
                                  .initrd_filename = initrd_filename,
                                  .cpu_model = cpu_model };
     machine->init(&args);
+    qemu_startup_phase("machine");
+
+    if (tb_persist_path && tcg_enabled()) {
+        int ret = tb_persist_init(tb_persist_path);
+        if (ret < 0) {
+            error_report("could not open translation cache '%s': %s",
+                         tb_persist_path, strerror(-ret));
+            exit(1);
+        }
+    }
 
     cpu_synchronize_all_post_init();
 
@@ -3884,6 +4288,7 @@ int main(int argc, char **argv, char **envp)
     /* init generic devices */
     if (qemu_opts_foreach(qemu_find_opts("device"), device_init_func, NULL, 1) != 0)
         exit(1);
+    qemu_startup_phase("devices");
 
     net_check_clients();
 
@@ -3963,11 +4368,13 @@ int main(int argc, char **argv, char **envp)
     }
 
     qdev_machine_creation_done();
+    qemu_startup_phase("displays");
 
     if (rom_load_all() != 0) {
         fprintf(stderr, "rom loading failed\n");
         exit(1);
     }
+    qemu_startup_phase("roms");
 
     /* TODO: once all bus devices are qdevified, this should be done
      * when bus is created by qdev.c */
@@ -3975,6 +4382,7 @@ int main(int argc, char **argv, char **envp)
     qemu_run_machine_init_done_notifiers();
 
     qemu_system_reset(VMRESET_SILENT);
+    qemu_startup_phase("reset");
     if (loadvm) {
         if (load_vmstate(loadvm) < 0) {
             autostart = 0;
@@ -3996,6 +4404,7 @@ int main(int argc, char **argv, char **envp)
     os_setup_post();
 
     resume_all_vcpus();
+    qemu_startup_phase("vm-start");
     main_loop();
     bdrv_close_all();
     pause_all_vcpus();
@@ -35,6 +35,11 @@ typedef struct SaveVMHandlers {
     int (*save_live_setup)(QEMUFile *f, void *opaque);
     int (*save_live_iterate)(QEMUFile *f, void *opaque);
     int (*save_live_complete)(QEMUFile *f, void *opaque);
+    /* Called at the postcopy switch-over; handlers without it prevent
+     * postcopy.  save_live_iterate then keeps being called with the guest
+     * running on the destination until it returns 1.
+     */
+    int (*save_live_postcopy)(QEMUFile *f, void *opaque);
     void (*cancel)(void *opaque);
     LoadStateHandler *load_state;
     bool (*is_active)(void *opaque);
@@ -20,6 +20,7 @@
 #include <sys/mman.h>
 
 #include "xen-mapcache.h"
+#include "qemu-thread.h"
 #include "trace.h"
 
 
@@ -49,8 +50,14 @@
  */
 #define NON_MCACHE_MEMORY_SIZE (80 * 1024 * 1024)
 
-#define mapcache_lock()   ((void)0)
-#define mapcache_unlock() ((void)0)
+/* Unlocked mappings kept in bucket chains beyond the first entry, across
+ * all buckets.  Once there are more, least recently used ones are dropped
+ * when they are unlocked.
+ */
+#define MCACHE_MAX_EXTRA_ENTRIES 256
+
+#define mapcache_lock()   qemu_mutex_lock(&mapcache->lock)
+#define mapcache_unlock() qemu_mutex_unlock(&mapcache->lock)
 
 typedef struct MapCacheEntry {
     hwaddr paddr_index;
@@ -58,6 +65,7 @@ typedef struct MapCacheEntry {
     unsigned long *valid_mapping;
     uint8_t lock;
     hwaddr size;
+    uint64_t last_used;
     struct MapCacheEntry *next;
 } MapCacheEntry;
 
@@ -78,6 +86,13 @@ typedef struct MapCache {
     uint8_t *last_address_vaddr;
     unsigned long max_mcache_size;
     unsigned int mcache_bucket_shift;
+    unsigned long nr_extra_entries;
+    uint64_t lru_clock;
+
+    /* Protects everything above, so that I/O threads can map guest
+     * memory without holding the global mutex.
+     */
+    QemuMutex lock;
 
     phys_offset_to_gaddr_t phys_offset_to_gaddr;
     void *opaque;
@@ -106,6 +121,7 @@ void xen_map_cache_init(phys_offset_to_gaddr_t f, void *opaque)
 
     QTAILQ_INIT(&mapcache->locked_entries);
     mapcache->last_address_index = -1;
+    qemu_mutex_init(&mapcache->lock);
 
     if (geteuid() == 0) {
         rlimit_as.rlim_cur = RLIM_INFINITY;
@@ -195,10 +211,46 @@ static void xen_remap_bucket(MapCacheEntry *entry,
     g_free(err);
 }
 
-uint8_t *xen_map_cache(hwaddr phys_addr, hwaddr size,
-                       uint8_t lock)
+static inline bool xen_map_cache_entry_covers(MapCacheEntry *entry,
+                                              hwaddr address_index,
+                                              hwaddr address_offset,
+                                              hwaddr size, hwaddr __size)
+{
+    /* a mapping that is larger than needed serves the request as well */
+    return entry->vaddr_base && entry->paddr_index == address_index &&
+           entry->size >= __size &&
+           test_bits(address_offset >> XC_PAGE_SHIFT, size >> XC_PAGE_SHIFT,
+                     entry->valid_mapping);
+}
+
+static MapCacheEntry *xen_map_cache_find_entry(hwaddr address_index,
+                                               hwaddr size)
+{
+    MapCacheEntry *entry = &mapcache->entry[address_index %
+                                            mapcache->nr_buckets];
+
+    while (entry && (entry->paddr_index != address_index ||
+                     entry->size != size)) {
+        entry = entry->next;
+    }
+    return entry;
+}
+
+static void xen_map_cache_free_entry(MapCacheEntry *entry)
+{
+    if (munmap(entry->vaddr_base, entry->size) != 0) {
+        perror("unmap fails");
+        exit(-1);
+    }
+    g_free(entry->valid_mapping);
+    g_free(entry);
+    mapcache->nr_extra_entries--;
+}
+
+static uint8_t *xen_map_cache_unlocked(hwaddr phys_addr, hwaddr size,
+                                       uint8_t lock)
 {
-    MapCacheEntry *entry, *pentry = NULL;
+    MapCacheEntry *entry, *victim, *pentry = NULL;
     hwaddr address_index;
     hwaddr address_offset;
     hwaddr __size = size;
@@ -225,27 +277,34 @@ tryagain:
         __size = MCACHE_BUCKET_SIZE;
     }
 
+    /* Any mapping in the chain that covers the request will do.  Failing
+     * that, remap the least recently used unlocked entry, and only grow the
+     * chain if every entry is locked.
+     */
     entry = &mapcache->entry[address_index % mapcache->nr_buckets];
-
-    while (entry && entry->lock && entry->vaddr_base &&
-            (entry->paddr_index != address_index || entry->size != __size ||
-             !test_bits(address_offset >> XC_PAGE_SHIFT, size >> XC_PAGE_SHIFT,
-                 entry->valid_mapping))) {
+    victim = NULL;
+    while (entry && !xen_map_cache_entry_covers(entry, address_index,
+                                                address_offset, size,
+                                                __size)) {
+        if (!entry->lock &&
+            (!victim || !entry->vaddr_base ||
+             (victim->vaddr_base && entry->last_used < victim->last_used))) {
+            victim = entry;
+        }
         pentry = entry;
         entry = entry->next;
     }
     if (!entry) {
-        entry = g_malloc0(sizeof (MapCacheEntry));
-        pentry->next = entry;
-        xen_remap_bucket(entry, __size, address_index);
-    } else if (!entry->lock) {
-        if (!entry->vaddr_base || entry->paddr_index != address_index ||
-                entry->size != __size ||
-                !test_bits(address_offset >> XC_PAGE_SHIFT, size >> XC_PAGE_SHIFT,
-                    entry->valid_mapping)) {
-            xen_remap_bucket(entry, __size, address_index);
+        if (victim) {
+            entry = victim;
+        } else {
+            entry = g_malloc0(sizeof (MapCacheEntry));
+            pentry->next = entry;
+            mapcache->nr_extra_entries++;
         }
+        xen_remap_bucket(entry, __size, address_index);
     }
+    entry->last_used = ++mapcache->lru_clock;
 
     if(!test_bits(address_offset >> XC_PAGE_SHIFT, size >> XC_PAGE_SHIFT,
                 entry->valid_mapping)) {
@@ -274,14 +333,27 @@ tryagain:
     return mapcache->last_address_vaddr + address_offset;
 }
 
+uint8_t *xen_map_cache(hwaddr phys_addr, hwaddr size,
+                       uint8_t lock)
+{
+    uint8_t *p;
+
+    mapcache_lock();
+    p = xen_map_cache_unlocked(phys_addr, size, lock);
+    mapcache_unlock();
+    return p;
+}
+
 ram_addr_t xen_ram_addr_from_mapcache(void *ptr)
 {
     MapCacheEntry *entry = NULL;
     MapCacheRev *reventry;
     hwaddr paddr_index;
     hwaddr size;
+    ram_addr_t raddr;
     int found = 0;
 
+    mapcache_lock();
     QTAILQ_FOREACH(reventry, &mapcache->locked_entries, next) {
         if (reventry->vaddr_req == ptr) {
             paddr_index = reventry->paddr_index;
@@ -300,19 +372,19 @@ ram_addr_t xen_ram_addr_from_mapcache(void *ptr)
         return 0;
     }
 
-    entry = &mapcache->entry[paddr_index % mapcache->nr_buckets];
-    while (entry && (entry->paddr_index != paddr_index || entry->size != size)) {
-        entry = entry->next;
-    }
+    entry = xen_map_cache_find_entry(paddr_index, size);
     if (!entry) {
         DPRINTF("Trying to find address %p that is not in the mapcache!\n", ptr);
-        return 0;
+        raddr = 0;
+    } else {
+        raddr = (reventry->paddr_index << MCACHE_BUCKET_SHIFT) +
+            ((unsigned long) ptr - (unsigned long) entry->vaddr_base);
     }
-    return (reventry->paddr_index << MCACHE_BUCKET_SHIFT) +
-        ((unsigned long) ptr - (unsigned long) entry->vaddr_base);
+    mapcache_unlock();
+    return raddr;
 }
 
-void xen_invalidate_map_cache_entry(uint8_t *buffer)
+static void xen_invalidate_map_cache_entry_unlocked(uint8_t *buffer)
 {
     MapCacheEntry *entry = NULL, *pentry = NULL;
     MapCacheRev *reventry;
@@ -357,13 +429,19 @@ void xen_invalidate_map_cache_entry(uint8_t *buffer)
         return;
     }
 
-    pentry->next = entry->next;
-    if (munmap(entry->vaddr_base, entry->size) != 0) {
-        perror("unmap fails");
-        exit(-1);
+    /* unlocked chain entries stay cached while there is room for them */
+    if (mapcache->nr_extra_entries <= MCACHE_MAX_EXTRA_ENTRIES) {
+        return;
     }
-    g_free(entry->valid_mapping);
-    g_free(entry);
+    pentry->next = entry->next;
+    xen_map_cache_free_entry(entry);
+}
+
+void xen_invalidate_map_cache_entry(uint8_t *buffer)
+{
+    mapcache_lock();
+    xen_invalidate_map_cache_entry_unlocked(buffer);
+    mapcache_unlock();
 }
 
 void xen_invalidate_map_cache(void)
@@ -374,16 +452,29 @@ void xen_invalidate_map_cache(void)
     /* Flush pending AIO before destroying the mapcache */
     bdrv_drain_all();
 
+    mapcache_lock();
+
     QTAILQ_FOREACH(reventry, &mapcache->locked_entries, next) {
         DPRINTF("There should be no locked mappings at this time, "
                 "but "TARGET_FMT_plx" -> %p is present\n",
                 reventry->paddr_index, reventry->vaddr_req);
     }
 
-    mapcache_lock();
-
     for (i = 0; i < mapcache->nr_buckets; i++) {
         MapCacheEntry *entry = &mapcache->entry[i];
+        MapCacheEntry *pentry = entry;
+
+        /* drop the cached, unlocked mappings further down the chain */
+        while (pentry->next) {
+            MapCacheEntry *next = pentry->next;
+
+            if (next->lock > 0) {
+                pentry = next;
+                continue;
+            }
+            pentry->next = next->next;
+            xen_map_cache_free_entry(next);
+        }
 
         if (entry->vaddr_base == NULL) {
             continue;